@@ -0,0 +1,405 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "BatchStat.h"
+#include "Logging.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_IO_URING_STATX) && \
+    defined(HAVE_STATX)
+#define WATCHMAN_IO_URING_STAT 1
+#endif
+
+#ifdef WATCHMAN_IO_URING_STAT
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include "FileDescriptor.h"
+#endif
+
+#ifdef HAVE_GETATTRLISTBULK
+#include <sys/stat.h>
+#include <string>
+#include <unordered_map>
+#include "watchman_opendir.h"
+#include "watchman_string.h"
+#endif
+
+namespace watchman {
+
+#ifdef HAVE_GETATTRLISTBULK
+namespace {
+
+// A dir is listed, rather than its paths stat'd one at a time, when the
+// batch holds at least this many paths in it
+constexpr size_t kMinPathsPerListing = 8;
+
+class BulkListingBatchStat : public BatchStat {
+ public:
+  explicit BulkListingBatchStat(CaseSensitivity caseSensitive)
+      : caseSensitive_(caseSensitive) {}
+
+  bool statPaths(
+      const std::vector<const char*>& paths,
+      std::vector<Result>& results) override {
+    results.clear();
+    results.resize(paths.size());
+
+    std::unordered_map<std::string, std::vector<size_t>> byDir;
+    for (size_t i = 0; i < paths.size(); ++i) {
+      auto dir = w_string_piece(paths[i]).dirName();
+      byDir[std::string(dir.data(), dir.size())].push_back(i);
+    }
+
+    for (auto& it : byDir) {
+      if (it.second.size() < kMinPathsPerListing) {
+        for (auto i : it.second) {
+          statOne(paths[i], results[i]);
+        }
+      } else {
+        statFromListing(it.first, paths, it.second, results);
+      }
+    }
+    return true;
+  }
+
+ private:
+  void statOne(const char* path, Result& result) const {
+    try {
+      result.info = getFileInformation(path, caseSensitive_);
+    } catch (const std::system_error& exc) {
+      result.error = exc.code();
+    }
+  }
+
+  void statFromListing(
+      const std::string& dir,
+      const std::vector<const char*>& paths,
+      const std::vector<size_t>& indices,
+      std::vector<Result>& results) const {
+    std::unordered_map<w_string_piece, size_t> byName;
+    for (auto i : indices) {
+      byName.emplace(w_string_piece(paths[i]).baseName(), i);
+    }
+
+    std::unique_ptr<watchman_dir_handle> handle;
+    try {
+      handle = w_dir_open(dir.c_str());
+    } catch (const std::system_error&) {
+      // Let each of them report the error in its own terms
+      for (auto i : indices) {
+        statOne(paths[i], results[i]);
+      }
+      return;
+    }
+
+    std::vector<bool> found(paths.size(), false);
+    try {
+      const watchman_dir_ent* ent;
+      while ((ent = handle->readDir()) != nullptr) {
+        auto it = byName.find(w_string_piece(ent->d_name));
+        if (it == byName.end()) {
+          continue;
+        }
+        auto i = it->second;
+        found[i] = true;
+        if (ent->has_stat) {
+          results[i].info = ent->stat;
+        } else {
+          statOne(paths[i], results[i]);
+        }
+      }
+    } catch (const std::system_error&) {
+      // The listing was cut short, so we can't tell which of the rest
+      // are missing
+      for (auto i : indices) {
+        if (!found[i]) {
+          statOne(paths[i], results[i]);
+          found[i] = true;
+        }
+      }
+    }
+
+    for (auto i : indices) {
+      if (!found[i]) {
+        // Not in the listing, at least not with the case that we were
+        // given
+        results[i].error =
+            std::make_error_code(std::errc::no_such_file_or_directory);
+      }
+    }
+  }
+
+  CaseSensitivity caseSensitive_;
+};
+
+} // namespace
+#endif
+
+#ifdef WATCHMAN_IO_URING_STAT
+namespace {
+
+FileInformation infoFromStatx(const struct statx& stx) {
+  FileInformation info;
+  info.mode = stx.stx_mode;
+  info.size = off_t(stx.stx_size);
+  info.uid = stx.stx_uid;
+  info.gid = stx.stx_gid;
+  info.ino = stx.stx_ino;
+  info.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  info.nlink = stx.stx_nlink;
+  info.atime.tv_sec = stx.stx_atime.tv_sec;
+  info.atime.tv_nsec = stx.stx_atime.tv_nsec;
+  info.mtime.tv_sec = stx.stx_mtime.tv_sec;
+  info.mtime.tv_nsec = stx.stx_mtime.tv_nsec;
+  info.ctime.tv_sec = stx.stx_ctime.tv_sec;
+  info.ctime.tv_nsec = stx.stx_ctime.tv_nsec;
+  return info;
+}
+
+// The ring head and tail indices are shared with the kernel
+template <typename T>
+T loadAcquire(const T* ptr) {
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+void storeRelease(T* ptr, T value) {
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+// Owns one of the regions of the ring that are shared with the kernel
+struct RingMapping {
+  void* ptr{nullptr};
+  size_t size{0};
+
+  RingMapping() = default;
+  RingMapping(const RingMapping&) = delete;
+  RingMapping& operator=(const RingMapping&) = delete;
+
+  ~RingMapping() {
+    if (ptr) {
+      munmap(ptr, size);
+    }
+  }
+
+  void map(int fd, size_t len, off_t offset) {
+    auto addr = mmap(
+        nullptr,
+        len,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd,
+        offset);
+    if (addr == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(), "mmap io_uring");
+    }
+    ptr = addr;
+    size = len;
+  }
+};
+
+class IoUringBatchStat : public BatchStat {
+ public:
+  // Throws std::system_error if the ring cannot be set up
+  explicit IoUringBatchStat(unsigned queueDepth);
+
+  bool statPaths(
+      const std::vector<const char*>& paths,
+      std::vector<Result>& results) override;
+
+ private:
+  bool submitChunk(
+      const std::vector<const char*>& paths,
+      size_t first,
+      size_t count,
+      std::vector<Result>& results);
+
+  FileDescriptor ringFd_;
+  unsigned numEntries_{0};
+  bool broken_{false};
+
+  RingMapping sqRing_;
+  // Unused if the kernel maps both rings with sqRing_
+  RingMapping cqRing_;
+  RingMapping sqesRing_;
+  struct io_uring_sqe* sqes_{nullptr};
+
+  unsigned* sqTail_{nullptr};
+  unsigned sqMask_{0};
+  unsigned* sqArray_{nullptr};
+  unsigned* cqHead_{nullptr};
+  const unsigned* cqTail_{nullptr};
+  unsigned cqMask_{0};
+  const struct io_uring_cqe* cqes_{nullptr};
+
+  // The kernel writes the results of the chunk in flight here
+  std::vector<struct statx> statxBufs_;
+};
+
+IoUringBatchStat::IoUringBatchStat(unsigned queueDepth) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringFd_ = FileDescriptor(
+      int(syscall(__NR_io_uring_setup, queueDepth, &params)),
+      "io_uring_setup",
+      FileDescriptor::FDType::Generic);
+  numEntries_ = params.sq_entries;
+
+  auto sqRingSize =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  auto cqRingSize =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    singleMmap = true;
+  }
+#endif
+
+  sqRing_.map(ringFd_.fd(), sqRingSize, IORING_OFF_SQ_RING);
+  if (!singleMmap) {
+    cqRing_.map(ringFd_.fd(), cqRingSize, IORING_OFF_CQ_RING);
+  }
+  sqesRing_.map(
+      ringFd_.fd(),
+      params.sq_entries * sizeof(struct io_uring_sqe),
+      off_t(IORING_OFF_SQES));
+  sqes_ = static_cast<struct io_uring_sqe*>(sqesRing_.ptr);
+
+  auto sq = static_cast<char*>(sqRing_.ptr);
+  sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+  auto cq = static_cast<char*>(singleMmap ? sqRing_.ptr : cqRing_.ptr);
+  cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cqTail_ = reinterpret_cast<const unsigned*>(cq + params.cq_off.tail);
+  cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<const struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  statxBufs_.resize(numEntries_);
+}
+
+bool IoUringBatchStat::statPaths(
+    const std::vector<const char*>& paths,
+    std::vector<Result>& results) {
+  results.resize(paths.size());
+  for (size_t first = 0; first < paths.size() && !broken_;
+       first += numEntries_) {
+    auto count = std::min(size_t(numEntries_), paths.size() - first);
+    broken_ = !submitChunk(paths, first, count, results);
+  }
+  return !broken_;
+}
+
+bool IoUringBatchStat::submitChunk(
+    const std::vector<const char*>& paths,
+    size_t first,
+    size_t count,
+    std::vector<Result>& results) {
+  // We are the only producer, so there is no need to synchronize
+  // with the kernel to read the tail
+  auto tail = *sqTail_;
+  for (size_t i = 0; i < count; ++i) {
+    auto idx = tail & sqMask_;
+    auto& sqe = sqes_[idx];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_STATX;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<uintptr_t>(paths[first + i]);
+    sqe.len = STATX_BASIC_STATS;
+    sqe.off = reinterpret_cast<uintptr_t>(&statxBufs_[i]);
+    sqe.statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe.user_data = i;
+    sqArray_[idx] = idx;
+    ++tail;
+  }
+  storeRelease(sqTail_, tail);
+
+  size_t submitted = 0;
+  size_t completed = 0;
+  bool unsupported = false;
+  while (completed < count) {
+    auto res = syscall(
+        __NR_io_uring_enter,
+        ringFd_.fd(),
+        unsigned(count - submitted),
+        unsigned(count - completed),
+        IORING_ENTER_GETEVENTS,
+        nullptr,
+        0);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log(ERR,
+          "io_uring_enter failed: ",
+          strerror(errno),
+          "; disabling batched stats\n");
+      return false;
+    }
+    submitted += size_t(res);
+
+    auto head = *cqHead_;
+    auto cqTail = loadAcquire(cqTail_);
+    for (; head != cqTail; ++head) {
+      const auto& cqe = cqes_[head & cqMask_];
+      auto& result = results[first + cqe.user_data];
+      if (cqe.res < 0) {
+        // A kernel that predates IORING_OP_STATX rejects the opcode
+        // with EINVAL, which a well formed statx never produces.
+        if (cqe.res == -EINVAL) {
+          unsupported = true;
+        }
+        result.error = std::error_code(-cqe.res, std::generic_category());
+      } else {
+        result.error = std::error_code();
+        result.info = infoFromStatx(statxBufs_[cqe.user_data]);
+      }
+      ++completed;
+    }
+    storeRelease(cqHead_, head);
+  }
+
+  if (unsupported) {
+    log(DBG, "io_uring doesn't support statx; disabling batched stats\n");
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+#endif
+
+std::unique_ptr<BatchStat> BatchStat::create(
+    unsigned queueDepth,
+    CaseSensitivity caseSensitive) {
+#if defined(HAVE_GETATTRLISTBULK)
+  unused_parameter(queueDepth);
+  return std::make_unique<BulkListingBatchStat>(caseSensitive);
+#elif defined(WATCHMAN_IO_URING_STAT)
+  // The ring stats the paths verbatim
+  if (caseSensitive == CaseSensitivity::CaseInSensitive) {
+    return nullptr;
+  }
+  try {
+    return std::make_unique<IoUringBatchStat>(queueDepth);
+  } catch (const std::system_error& exc) {
+    // Most likely an old kernel, or a sandbox that blocks io_uring
+    log(DBG, "batched stats are not available: ", exc.what(), "\n");
+    return nullptr;
+  }
+#else
+  unused_parameter(queueDepth);
+  unused_parameter(caseSensitive);
+  return nullptr;
+#endif
+}
+
+} // namespace watchman
@@ -0,0 +1,69 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <memory>
+#include <system_error>
+#include <vector>
+#include "FileInformation.h"
+#include "FileSystem.h"
+
+namespace watchman {
+
+/** BatchStat retrieves the lstat() information for a batch of paths
+ * with a single system call, rather than one call per path.
+ *
+ * On Linux this is implemented using an io_uring submission queue of
+ * statx operations; all of the requests in a batch are submitted and
+ * reaped with one io_uring_enter() call.  The implementation talks to
+ * the kernel directly and doesn't require liburing.
+ *
+ * On macOS, the paths that share a parent dir are stat'd by listing that
+ * dir with getattrlistbulk(), which returns the stat information of many
+ * entries per call.  As the names are matched exactly against the
+ * listing, this also confirms their case.
+ *
+ * An instance is owned by a single thread and must not be used
+ * concurrently.
+ *
+ * Availability depends on both the build and the running kernel (which
+ * may be too old or may prohibit io_uring by policy), so callers obtain
+ * an instance via create() and must be prepared to use the synchronous
+ * getFileInformation() path when it returns nullptr.
+ */
+class BatchStat {
+ public:
+  struct Result {
+    // The error reported for the path, if any.  info is only
+    // valid when this is not set.
+    std::error_code error;
+    FileInformation info;
+  };
+
+  virtual ~BatchStat() = default;
+
+  /** Returns a BatchStat that can have up to queueDepth requests in
+   * flight, or nullptr if batched stats are not supported by this
+   * build or this system.  If caseSensitive is CaseInSensitive, the
+   * results are only equivalent to those of getFileInformation() if the
+   * implementation confirms the case of the names, so nullptr is
+   * returned if it can't. */
+  static std::unique_ptr<BatchStat> create(
+      unsigned queueDepth,
+      CaseSensitivity caseSensitive = CaseSensitivity::CaseSensitive);
+
+  /** Stats each of the NUL terminated paths, without following a
+   * symlink at the leaf, and stores the outcomes in the corresponding
+   * positions of results.  The batch may be larger than the queue
+   * depth, in which case it is submitted in queue depth sized chunks.
+   *
+   * Returns false if the batch could not be processed, in which case
+   * the contents of results are unspecified and the caller should fall
+   * back to stat'ing the paths itself.  Once false has been returned,
+   * the instance is unusable and every subsequent call returns false. */
+  virtual bool statPaths(
+      const std::vector<const char*>& paths,
+      std::vector<Result>& results) = 0;
+};
+
+} // namespace watchman
@@ -0,0 +1,59 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "CacheMemoryBudget.h"
+#include <algorithm>
+
+namespace watchman {
+
+CacheMemoryBudget::CacheMemoryBudget(size_t maxBytes) : maxBytes_(maxBytes) {}
+
+void CacheMemoryBudget::add(Member* member) {
+  std::lock_guard<std::mutex> lock(membersMutex_);
+  members_.push_back(member);
+}
+
+void CacheMemoryBudget::remove(Member* member) {
+  std::lock_guard<std::mutex> lock(membersMutex_);
+  members_.erase(
+      std::remove(members_.begin(), members_.end(), member), members_.end());
+}
+
+void CacheMemoryBudget::reclaim() {
+  std::unique_lock<std::mutex> lock(membersMutex_, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return;
+  }
+
+  // Members that had nothing left to evict
+  std::vector<Member*> exhausted;
+  while (true) {
+    auto used = usedBytes_.load();
+    if (used <= maxBytes_) {
+      return;
+    }
+
+    Member* largest = nullptr;
+    size_t largestBytes = 0;
+    for (auto member : members_) {
+      auto bytes = member->budgetedBytes();
+      if (bytes > largestBytes &&
+          std::find(exhausted.begin(), exhausted.end(), member) ==
+              exhausted.end()) {
+        largest = member;
+        largestBytes = bytes;
+      }
+    }
+    if (!largest) {
+      return;
+    }
+
+    // The largest member is the one most likely to hold items that are
+    // no longer useful, so it pays for the excess
+    auto excess = used - maxBytes_;
+    if (largest->shrinkBy(excess) == 0) {
+      exhausted.push_back(largest);
+    }
+  }
+}
+
+} // namespace watchman
@@ -0,0 +1,68 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace watchman {
+
+// Limits the memory used by a set of caches, such as the content hash and
+// symlink target caches of all of the watched roots, to a shared number of
+// bytes.  The caches charge the weight of the items that they hold to the
+// budget.  Once the budget is exceeded, the cache holding the most bytes
+// evicts its least recently used items until the total is within the
+// budget again.
+class CacheMemoryBudget {
+ public:
+  // A cache that holds memory on behalf of the budget
+  class Member {
+   public:
+    virtual ~Member() = default;
+    // Returns the bytes held by the member
+    virtual size_t budgetedBytes() const = 0;
+    // Evicts items until at least bytes have been freed, or there is
+    // nothing left to evict.  Returns the bytes that were freed.
+    virtual size_t shrinkBy(size_t bytes) = 0;
+  };
+
+  explicit CacheMemoryBudget(size_t maxBytes);
+
+  // The member must be removed before it is destroyed
+  void add(Member* member);
+  void remove(Member* member);
+
+  void charge(size_t bytes) {
+    usedBytes_ += bytes;
+  }
+  void release(size_t bytes) {
+    usedBytes_ -= bytes;
+  }
+
+  bool overBudget() const {
+    return usedBytes_.load() > maxBytes_;
+  }
+
+  // Shrinks the largest members until the budget is no longer exceeded.
+  // Members must call this without holding their own locks.  If another
+  // thread is already reclaiming, this returns without waiting for it.
+  void reclaim();
+
+  size_t usedBytes() const {
+    return usedBytes_.load();
+  }
+  size_t maxBytes() const {
+    return maxBytes_;
+  }
+
+ private:
+  const size_t maxBytes_;
+  std::atomic<size_t> usedBytes_{0};
+  // Also held while members are being shrunk, so that they can't be
+  // destroyed in the meantime
+  std::mutex membersMutex_;
+  std::vector<Member*> members_;
+};
+
+} // namespace watchman
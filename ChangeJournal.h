@@ -0,0 +1,167 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+namespace watchman {
+
+/** ChangeJournal records the order in which the nodes of a view changed.
+ *
+ * It is an append-only log of (tick, node) entries held in tick order.
+ * Recording a change appends a new entry at the newest end and clears
+ * the entry that previously referred to the node, so that each node is
+ * referenced by at most one live entry.  The cleared entries are holes
+ * that retain their tick so that the log remains sorted; they are
+ * squeezed out by compact(), which is triggered automatically once the
+ * log has grown to twice its size after the previous compaction.
+ *
+ * Because the entries are sorted by tick, the changes since a given
+ * tick can be found with a binary search and visited with a sequential
+ * scan of only the entries that are newer than that tick.
+ *
+ * Node must have a `journal_entry` member of type `Entry*` that is
+ * initialized to nullptr; the journal maintains it so that the previous
+ * entry for a node can be found without a search.  A node must be
+ * passed to unlink() before it is destroyed.
+ *
+ * Entries live in a std::deque so that appending never moves existing
+ * entries and the journal_entry pointers remain valid.
+ */
+template <typename Node>
+class ChangeJournal {
+ public:
+  struct Entry {
+    // The node that changed, or nullptr if this entry has been superseded
+    Node* node;
+    uint32_t tick;
+  };
+
+  ChangeJournal() = default;
+  ChangeJournal(const ChangeJournal&) = delete;
+  ChangeJournal& operator=(const ChangeJournal&) = delete;
+
+  /** Record that node changed at tick.  tick must not be older than
+   * that of the most recently appended entry. */
+  void append(Node* node, uint32_t tick) {
+    assert(entries_.empty() || entries_.back().tick <= tick);
+
+    auto entry = node->journal_entry;
+    if (entry && entry == &entries_.back()) {
+      // Already the newest entry; just revise the tick in place
+      entry->tick = tick;
+      return;
+    }
+
+    unlink(node);
+    if (entries_.size() >= compactThreshold_) {
+      compact();
+    }
+    entries_.push_back(Entry{node, tick});
+    node->journal_entry = &entries_.back();
+  }
+
+  /** Remove node from whichever journal holds it, if any */
+  static void unlink(Node* node) {
+    if (node->journal_entry) {
+      node->journal_entry->node = nullptr;
+      node->journal_entry = nullptr;
+    }
+  }
+
+  /** Calls fn(node) for each node in the journal, most recently changed
+   * first, until fn returns false.
+   * fn may unlink nodes (including the node passed to it) but must not
+   * append to the journal. */
+  template <typename Fn>
+  void forEach(Fn&& fn) const {
+    visitFrom(0, fn);
+  }
+
+  /** Calls fn(node) for each node that changed after sinceTick, most
+   * recently changed first, until fn returns false.
+   * The same restrictions as for forEach() apply to fn. */
+  template <typename Fn>
+  void forEachSince(uint32_t sinceTick, Fn&& fn) const {
+    auto first = std::upper_bound(
+        entries_.begin(),
+        entries_.end(),
+        sinceTick,
+        [](uint32_t tick, const Entry& entry) { return tick < entry.tick; });
+    visitFrom(size_t(first - entries_.begin()), fn);
+  }
+
+  /** Returns the entry at position, counting from the oldest.  The node
+   * of an entry that has been superseded is nullptr.  compact() moves the
+   * entries, which is reflected in generation(), so a position must be
+   * found again if the generation has changed. */
+  const Entry& entryAt(size_t position) const {
+    return entries_[position];
+  }
+
+  /** Returns the position of the oldest entry whose tick is no older
+   * than tick, or size() if there is none */
+  size_t positionOf(uint32_t tick) const {
+    auto first = std::lower_bound(
+        entries_.begin(),
+        entries_.end(),
+        tick,
+        [](const Entry& entry, uint32_t tick) { return entry.tick < tick; });
+    return size_t(first - entries_.begin());
+  }
+
+  /** Counts the calls to compact(), which invalidate positions */
+  uint64_t generation() const {
+    return generation_;
+  }
+
+  /** Squeeze out the holes left behind by superseded entries.
+   * Returns the number of entries that were removed. */
+  size_t compact() {
+    std::deque<Entry> live;
+    for (auto& entry : entries_) {
+      if (entry.node) {
+        live.push_back(entry);
+        entry.node->journal_entry = &live.back();
+      }
+    }
+    auto removed = entries_.size() - live.size();
+    // Swapping a deque doesn't move its elements, so the journal_entry
+    // pointers that we just assigned remain valid.
+    entries_.swap(live);
+    compactThreshold_ = std::max(kMinCompactThreshold, entries_.size() * 2);
+    ++generation_;
+    return removed;
+  }
+
+  /** Returns the number of entries in the journal, including holes */
+  size_t size() const {
+    return entries_.size();
+  }
+
+  bool empty() const {
+    return entries_.empty();
+  }
+
+ private:
+  static constexpr size_t kMinCompactThreshold = 1024;
+
+  template <typename Fn>
+  void visitFrom(size_t first, Fn& fn) const {
+    for (size_t i = entries_.size(); i > first; --i) {
+      auto node = entries_[i - 1].node;
+      if (node && !fn(node)) {
+        return;
+      }
+    }
+  }
+
+  std::deque<Entry> entries_;
+  size_t compactThreshold_{kMinCompactThreshold};
+  uint64_t generation_{0};
+};
+
+} // namespace watchman
@@ -0,0 +1,401 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman.h"
+#include "ChangedFilesCache.h"
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include "Logging.h"
+#include "ThreadPool.h"
+
+// The persisted cache is a sequence of fixed width fields in native byte
+// order, in the same style as the content hash store:
+//
+//   header:  magic, version, byte order mark, root path, entry count
+//   entry:   key, clock lineage, file count, files...
+//   trailer: end marker
+//
+// Strings are a uint32_t length followed by the bytes of the string.
+// Entries are written from the least to the most recently used.
+
+namespace watchman {
+
+namespace {
+constexpr char kCacheMagic[8] = {'W', 'M', 'S', 'C', 'M', 'C', 'F', 0};
+constexpr uint32_t kCacheVersion = 1;
+constexpr uint32_t kByteOrderMark = 0x01020304;
+constexpr uint32_t kEndMarker = 0x21444e45;
+
+class CacheWriter {
+ public:
+  template <typename T>
+  void put(T value) {
+    static_assert(std::is_trivially_copyable<T>::value, "must be POD");
+    buf_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void putString(w_string_piece str) {
+    put(uint32_t(str.size()));
+    buf_.append(str.data(), str.size());
+  }
+
+  std::string& data() {
+    return buf_;
+  }
+
+ private:
+  std::string buf_;
+};
+
+class CacheReader {
+ public:
+  explicit CacheReader(const std::string& data)
+      : cur_(data.data()), end_(data.data() + data.size()) {}
+
+  template <typename T>
+  T get() {
+    static_assert(std::is_trivially_copyable<T>::value, "must be POD");
+    T value;
+    need(sizeof(value));
+    memcpy(&value, cur_, sizeof(value));
+    cur_ += sizeof(value);
+    return value;
+  }
+
+  w_string_piece getString() {
+    auto len = get<uint32_t>();
+    need(len);
+    w_string_piece str(cur_, len);
+    cur_ += len;
+    return str;
+  }
+
+ private:
+  void need(size_t size) {
+    if (size_t(end_ - cur_) < size) {
+      throw std::runtime_error("changed files cache is truncated");
+    }
+  }
+
+  const char* cur_;
+  const char* end_;
+};
+
+// Returns the tick in the current view that corresponds to the position
+// that cached was recorded at, if the view can account for the changes
+// since then
+folly::Optional<uint32_t> sinceTickInView(
+    const ClockLineage& cached,
+    const ClockLineage& current,
+    const folly::Optional<ClockLineage>& prior) {
+  if (cached.startTime == current.startTime && cached.pid == current.pid &&
+      cached.rootNumber == current.rootNumber) {
+    return cached.ticks;
+  }
+  // The view was restored from a snapshot of the view that the entry was
+  // recorded against, and so continues its ticks
+  if (prior && cached.startTime == prior->startTime &&
+      cached.pid == prior->pid && cached.rootNumber == prior->rootNumber &&
+      cached.ticks <= prior->ticks) {
+    return cached.ticks;
+  }
+  return folly::none;
+}
+
+void sortAndUnique(std::vector<w_string>& files) {
+  std::sort(files.begin(), files.end());
+  files.erase(std::unique(files.begin(), files.end()), files.end());
+}
+} // namespace
+
+ChangedFilesCache::ChangedFilesCache(
+    w_string path,
+    w_string rootPath,
+    size_t maxEntries)
+    : path_(std::move(path)),
+      rootPath_(std::move(rootPath)),
+      maxEntries_(maxEntries) {}
+
+void ChangedFilesCache::load(State& state) {
+  state.loaded = true;
+  if (!path_) {
+    return;
+  }
+
+  std::string data;
+  if (!folly::readFile(path_.c_str(), data)) {
+    if (errno != ENOENT) {
+      log(ERR,
+          "failed to read changed files cache ",
+          path_,
+          ": ",
+          folly::errnoStr(errno),
+          "\n");
+    }
+    return;
+  }
+
+  std::unordered_map<std::string, Entry> entries;
+  try {
+    CacheReader reader(data);
+    char magic[sizeof(kCacheMagic)];
+    for (auto& c : magic) {
+      c = reader.get<char>();
+    }
+    if (memcmp(magic, kCacheMagic, sizeof(magic)) != 0) {
+      throw std::runtime_error("not a changed files cache");
+    }
+    if (reader.get<uint32_t>() != kCacheVersion) {
+      throw std::runtime_error("unsupported changed files cache version");
+    }
+    if (reader.get<uint32_t>() != kByteOrderMark) {
+      throw std::runtime_error("changed files cache has a foreign byte order");
+    }
+    if (reader.getString() != w_string_piece(rootPath_)) {
+      throw std::runtime_error("changed files cache is for a different root");
+    }
+
+    auto count = reader.get<uint64_t>();
+    for (uint64_t i = 0; i < count; ++i) {
+      auto key = reader.getString();
+      Entry entry;
+      entry.lineage.startTime = reader.get<uint64_t>();
+      entry.lineage.pid = reader.get<int32_t>();
+      entry.lineage.rootNumber = reader.get<uint32_t>();
+      entry.lineage.ticks = reader.get<uint32_t>();
+      auto numFiles = reader.get<uint64_t>();
+      for (uint64_t f = 0; f < numFiles; ++f) {
+        entry.files.push_back(reader.getString().asWString());
+      }
+      entry.lastUse = ++state.useCounter;
+      entries[std::string(key.data(), key.size())] = std::move(entry);
+    }
+    if (reader.get<uint32_t>() != kEndMarker) {
+      throw std::runtime_error("changed files cache is missing its trailer");
+    }
+  } catch (const std::exception& exc) {
+    log(ERR, "ignoring changed files cache ", path_, ": ", exc.what(), "\n");
+    return;
+  }
+
+  // Anything stored before we finished loading is more recent
+  for (auto& it : state.entries) {
+    entries[it.first] = std::move(it.second);
+  }
+  state.entries = std::move(entries);
+  log(DBG,
+      "loaded ",
+      state.entries.size(),
+      " changed files lists from ",
+      path_,
+      "\n");
+}
+
+void ChangedFilesCache::insert(State& state, std::string key, Entry&& entry) {
+  entry.lastUse = ++state.useCounter;
+  state.entries[std::move(key)] = std::move(entry);
+  while (state.entries.size() > maxEntries_) {
+    auto oldest = std::min_element(
+        state.entries.begin(), state.entries.end(), [](auto& a, auto& b) {
+          return a.second.lastUse < b.second.lastUse;
+        });
+    state.entries.erase(oldest);
+    state.evictions++;
+  }
+  state.dirty = true;
+}
+
+std::vector<w_string> ChangedFilesCache::getFilesChangedSinceMergeBase(
+    const std::shared_ptr<w_root_t>& root,
+    const w_string& mergeBase,
+    const w_string& requestId) {
+  auto view = root->view();
+  auto scm = view->getSCM();
+  auto token = enabled() ? scm->getDirStateToken() : w_string();
+  if (!token) {
+    return scm->getFilesChangedSinceMergeBaseWith(mergeBase, requestId);
+  }
+
+  auto key = folly::to<std::string>(mergeBase, '\0', token);
+  // The entry that we store is current as of this position, so take it
+  // before asking the SCM; anything that changes after it will be seen
+  // in the journal when the entry is reused
+  auto lineage =
+      ClockLineage::forPosition(view->getMostRecentRootNumberAndTickValue());
+
+  folly::Optional<Entry> cached;
+  {
+    auto state = state_.lock();
+    if (!state->loaded) {
+      load(*state);
+    }
+    auto it = state->entries.find(key);
+    if (it != state->entries.end()) {
+      it->second.lastUse = ++state->useCounter;
+      cached = it->second;
+    }
+  }
+
+  if (cached) {
+    auto sinceTick = sinceTickInView(
+        cached->lineage, lineage, view->getPriorClockLineage());
+    std::vector<w_string> changed;
+    if (sinceTick &&
+        view->forEachFileChangedSince(
+            lineage.rootNumber, *sinceTick, [&](w_string_piece name) {
+              changed.push_back(name.asWString());
+            })) {
+      sortAndUnique(changed);
+      Entry entry;
+      entry.lineage = lineage;
+      entry.files.reserve(cached->files.size() + changed.size());
+      std::set_union(
+          cached->files.begin(),
+          cached->files.end(),
+          changed.begin(),
+          changed.end(),
+          std::back_inserter(entry.files));
+      log(DBG,
+          "changed files cache hit for ",
+          mergeBase,
+          ": ",
+          cached->files.size(),
+          " cached and ",
+          changed.size(),
+          " from the journal\n");
+
+      auto files = entry.files;
+      {
+        auto state = state_.lock();
+        state->hits++;
+        insert(*state, std::move(key), std::move(entry));
+      }
+      scheduleSave();
+      return files;
+    }
+    state_.lock()->stale++;
+  } else {
+    state_.lock()->misses++;
+  }
+
+  auto files = scm->getFilesChangedSinceMergeBaseWith(mergeBase, requestId);
+
+  // If the dirstate changed while the SCM was working, we can't tell
+  // which state the files describe
+  if (scm->getDirStateToken() == token) {
+    Entry entry;
+    entry.lineage = lineage;
+    entry.files = files;
+    sortAndUnique(entry.files);
+    insert(*state_.lock(), std::move(key), std::move(entry));
+    scheduleSave();
+  }
+  return files;
+}
+
+std::string ChangedFilesCache::serialize(const State& state) const {
+  std::vector<std::pair<const std::string*, const Entry*>> entries;
+  entries.reserve(state.entries.size());
+  for (auto& it : state.entries) {
+    entries.emplace_back(&it.first, &it.second);
+  }
+  std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) {
+    return a.second->lastUse < b.second->lastUse;
+  });
+
+  CacheWriter writer;
+  for (auto c : kCacheMagic) {
+    writer.put(c);
+  }
+  writer.put(kCacheVersion);
+  writer.put(kByteOrderMark);
+  writer.putString(rootPath_);
+  writer.put(uint64_t(entries.size()));
+  for (auto& it : entries) {
+    auto& entry = *it.second;
+    writer.putString(*it.first);
+    writer.put(uint64_t(entry.lineage.startTime));
+    writer.put(int32_t(entry.lineage.pid));
+    writer.put(entry.lineage.rootNumber);
+    writer.put(entry.lineage.ticks);
+    writer.put(uint64_t(entry.files.size()));
+    for (auto& file : entry.files) {
+      writer.putString(file);
+    }
+  }
+  writer.put(kEndMarker);
+  return std::move(writer.data());
+}
+
+void ChangedFilesCache::save() {
+  if (!path_) {
+    return;
+  }
+  std::lock_guard<std::mutex> saving(saveMutex_);
+  std::string data;
+  {
+    auto state = state_.lock();
+    state->saveScheduled = false;
+    if (!state->dirty) {
+      return;
+    }
+    data = serialize(*state);
+    state->dirty = false;
+  }
+
+  try {
+    folly::writeFileAtomic(path_.c_str(), data, 0600);
+  } catch (const std::exception& exc) {
+    log(ERR,
+        "failed to save changed files cache ",
+        path_,
+        ": ",
+        exc.what(),
+        "\n");
+    state_.lock()->dirty = true;
+  }
+}
+
+void ChangedFilesCache::scheduleSave() {
+  if (!path_) {
+    return;
+  }
+  {
+    auto state = state_.lock();
+    if (!state->dirty || state->saveScheduled) {
+      return;
+    }
+    state->saveScheduled = true;
+  }
+  try {
+    getThreadPool().add(
+        ThreadPool::Priority::Background,
+        this,
+        [self = shared_from_this()] { self->save(); });
+  } catch (const std::exception&) {
+    // The pool is stopping; we'll save synchronously at shutdown
+    state_.lock()->saveScheduled = false;
+  }
+}
+
+json_ref ChangedFilesCache::stats() const {
+  auto state = state_.lock();
+  size_t files = 0;
+  for (auto& it : state->entries) {
+    files += it.second.files.size();
+  }
+  return json_object(
+      {{"enabled", json_boolean(enabled())},
+       {"persisted", json_boolean(bool(path_))},
+       {"entries", json_integer(state->entries.size())},
+       {"files", json_integer(files)},
+       {"hits", json_integer(state->hits)},
+       {"misses", json_integer(state->misses)},
+       {"stale", json_integer(state->stale)},
+       {"evictions", json_integer(state->evictions)}});
+}
+
+} // namespace watchman
@@ -0,0 +1,99 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Synchronized.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Clock.h"
+#include "thirdparty/jansson/jansson.h"
+
+struct watchman_root;
+
+namespace watchman {
+
+// Remembers the files that the SCM reported as changed since a merge
+// base, keyed by the merge base and the dirstate token of the SCM, so that
+// SCM-aware queries from any client can reuse them rather than running
+// `hg status` again.
+//
+// For as long as the dirstate token is unchanged, the only way for the
+// list to change is for files in the working copy to change, and those
+// changes are in the journal of the view.  An entry records the clock
+// position that it is current as of; reusing it adds the files that
+// changed since then and brings it up to date.  The result is a superset
+// of what the SCM would report, because a file that is changed back to
+// its original contents, or an ignored file, remains in the list.
+//
+// The entries can optionally be persisted, in which case they are reused
+// after a restart if the view was restored from a snapshot that covers
+// their clock positions.
+class ChangedFilesCache
+    : public std::enable_shared_from_this<ChangedFilesCache> {
+ public:
+  // Construct a cache that holds up to maxEntries lists for the root at
+  // rootPath.  It is persisted at path, unless path is null.  A cache
+  // with a maxEntries of 0 is disabled.
+  ChangedFilesCache(w_string path, w_string rootPath, size_t maxEntries);
+
+  bool enabled() const {
+    return maxEntries_ > 0;
+  }
+
+  // Returns the files that changed in the working copy of root since
+  // mergeBase, as SCM::getFilesChangedSinceMergeBaseWith() does
+  std::vector<w_string> getFilesChangedSinceMergeBase(
+      const std::shared_ptr<watchman_root>& root,
+      const w_string& mergeBase,
+      const w_string& requestId);
+
+  // Writes the cache to disk if it is persisted and has changed since it
+  // was last saved.  The asynchronous variant does the work in the thread
+  // pool.
+  void save();
+  void scheduleSave();
+
+  // Returns the counters of the cache for debugging purposes
+  json_ref stats() const;
+
+ private:
+  struct Entry {
+    // Sorted, without duplicates
+    std::vector<w_string> files;
+    // The clock position that files is current as of
+    ClockLineage lineage;
+    // The least recently used entries are dropped first
+    uint64_t lastUse{0};
+  };
+
+  struct State {
+    bool loaded{false};
+    bool dirty{false};
+    bool saveScheduled{false};
+    uint64_t useCounter{0};
+    std::unordered_map<std::string, Entry> entries;
+
+    size_t hits{0};
+    size_t misses{0};
+    size_t stale{0};
+    size_t evictions{0};
+  };
+
+  // Populates state from the persisted cache, if any
+  void load(State& state);
+  std::string serialize(const State& state) const;
+  void insert(State& state, std::string key, Entry&& entry);
+
+  const w_string path_;
+  const w_string rootPath_;
+  const size_t maxEntries_;
+  folly::Synchronized<State, std::mutex> state_;
+  // Serializes writers so that an older version can't replace a newer one
+  std::mutex saveMutex_;
+};
+
+} // namespace watchman
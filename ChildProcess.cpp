@@ -2,6 +2,9 @@
  * Licensed under the Apache License, Version 2.0 */
 #include "ChildProcess.h"
 #include <folly/ScopeGuard.h>
+#ifndef _WIN32
+#include <poll.h>
+#endif
 #include <memory>
 #include <system_error>
 #include <thread>
@@ -167,6 +170,8 @@ void ChildProcess::Options::dup2(int fd, int targetFd) {
     throw std::system_error(
         err, std::generic_category(), "posix_spawn_file_actions_adddup2");
   }
+  helperActions_.push_back(
+      {SpawnHelper::FileAction::Dup2, fd, targetFd, std::string(), 0, 0});
 }
 
 void ChildProcess::Options::dup2(const FileDescriptor& fd, int targetFd) {
@@ -186,6 +191,8 @@ void ChildProcess::Options::dup2(const FileDescriptor& fd, int targetFd) {
     throw std::system_error(
         err, std::generic_category(), "posix_spawn_file_actions_adddup2");
   }
+  helperActions_.push_back(
+      {SpawnHelper::FileAction::Dup2, fd.fd(), targetFd, std::string(), 0, 0});
 #endif
 }
 
@@ -200,6 +207,8 @@ void ChildProcess::Options::open(
     throw std::system_error(
         err, std::generic_category(), "posix_spawn_file_actions_addopen");
   }
+  helperActions_.push_back(
+      {SpawnHelper::FileAction::Open, -1, targetFd, path, flags, mode});
 }
 
 void ChildProcess::Options::pipe(int targetFd, bool childRead) {
@@ -246,6 +255,10 @@ void ChildProcess::Options::chdir(w_string_piece path) {
 #endif
 }
 
+void ChildProcess::Options::useSpawnHelper() {
+  useSpawnHelper_ = true;
+}
+
 static std::vector<w_string_piece> json_args_to_string_vec(
     const json_ref& args) {
   std::vector<w_string_piece> vec;
@@ -274,41 +287,50 @@ ChildProcess::ChildProcess(std::vector<w_string_piece> args, Options&& options)
   }
   argv.emplace_back(nullptr);
 
+  auto envp = options.env_.asEnviron();
+  int ret = 0;
+  bool spawned = false;
 #ifndef _WIN32
-  auto lock = lockCwdMutex();
-  char savedCwd[WATCHMAN_NAME_MAX];
-  if (!getcwd(savedCwd, sizeof(savedCwd))) {
-    throw std::system_error(errno, std::generic_category(), "failed to getcwd");
-  }
-  SCOPE_EXIT {
-    if (!options.cwd_.empty()) {
-      if (chdir(savedCwd) != 0) {
-        // log(FATAL) rather than throw because SCOPE_EXIT is
-        // a noexcept destructor and will call std::terminate
-        // in this case anyway.
-        log(FATAL, "failed to restore cwd of ", savedCwd);
-      }
-    }
-  };
+  spawned = spawnWithHelper(argStrings, envp.get(), options, ret);
+#endif
 
-  if (!options.cwd_.empty()) {
-    if (chdir(options.cwd_.c_str()) != 0) {
+  if (!spawned) {
+#ifndef _WIN32
+    auto lock = lockCwdMutex();
+    char savedCwd[WATCHMAN_NAME_MAX];
+    if (!getcwd(savedCwd, sizeof(savedCwd))) {
       throw std::system_error(
-          errno,
-          std::generic_category(),
-          folly::to<std::string>("failed to chdir to ", options.cwd_));
+          errno, std::generic_category(), "failed to getcwd");
+    }
+    SCOPE_EXIT {
+      if (!options.cwd_.empty()) {
+        if (chdir(savedCwd) != 0) {
+          // log(FATAL) rather than throw because SCOPE_EXIT is
+          // a noexcept destructor and will call std::terminate
+          // in this case anyway.
+          log(FATAL, "failed to restore cwd of ", savedCwd);
+        }
+      }
+    };
+
+    if (!options.cwd_.empty()) {
+      if (chdir(options.cwd_.c_str()) != 0) {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            folly::to<std::string>("failed to chdir to ", options.cwd_));
+      }
     }
-  }
 #endif
 
-  auto envp = options.env_.asEnviron();
-  auto ret = posix_spawnp(
-      &pid_,
-      argv[0],
-      &options.inner_->actions,
-      &options.inner_->attr,
-      &argv[0],
-      envp.get());
+    ret = posix_spawnp(
+        &pid_,
+        argv[0],
+        &options.inner_->actions,
+        &options.inner_->attr,
+        &argv[0],
+        envp.get());
+  }
 
   if (ret) {
     // Failed, so the creator cannot call wait() on us.
@@ -340,6 +362,81 @@ ChildProcess::ChildProcess(std::vector<w_string_piece> args, Options&& options)
   }
 }
 
+#ifndef _WIN32
+bool ChildProcess::spawnWithHelper(
+    const std::vector<std::string>& args,
+    char** envp,
+    const Options& options,
+    int& ret) {
+  auto helper = options.useSpawnHelper_ ? SpawnHelper::get() : nullptr;
+  if (!helper) {
+    return false;
+  }
+
+  SpawnHelper::Request request;
+  request.argv = args;
+  for (size_t i = 0; envp[i]; ++i) {
+    request.envp.emplace_back(envp[i]);
+  }
+  request.cwd = options.cwd_;
+  posix_spawnattr_getflags(&options.inner_->attr, &request.flags);
+#ifdef POSIX_SPAWN_SETSIGMASK
+  if (request.flags & POSIX_SPAWN_SETSIGMASK) {
+    request.setSigMask = true;
+    posix_spawnattr_getsigmask(&options.inner_->attr, &request.sigMask);
+  }
+#endif
+  request.actions = options.helperActions_;
+
+  try {
+    ret = helper->spawn(request, pid_, statusPipe_);
+    return true;
+  } catch (const std::exception& exc) {
+    log(ERR,
+        "failed to spawn ",
+        args.empty() ? std::string() : args[0],
+        " via the spawn helper, spawning it directly: ",
+        exc.what(),
+        "\n");
+    return false;
+  }
+}
+
+bool ChildProcess::readHelperStatus(int timeoutMs) {
+  pollfd pfd;
+  pfd.fd = statusPipe_.fd();
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  int r;
+  do {
+    r = ::poll(&pfd, 1, timeoutMs);
+  } while (r == -1 && errno == EINTR);
+  if (r == -1) {
+    throw std::system_error(errno, std::generic_category(), "poll");
+  }
+  if (r == 0) {
+    return false;
+  }
+
+  int status;
+  auto len = ::read(statusPipe_.fd(), &status, sizeof(status));
+  if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return false;
+  }
+  if (len == sizeof(status)) {
+    status_ = status;
+  } else {
+    // The helper went away before the child exited, taking its status
+    // with it
+    log(ERR, "lost the exit status of pid ", pid_, "\n");
+    status_ = -1;
+  }
+  statusPipe_.close();
+  waited_ = true;
+  return true;
+}
+#endif
+
 static std::mutex& getCwdMutex() {
   // Meyers singleton
   static std::mutex m;
@@ -367,6 +464,12 @@ bool ChildProcess::terminated() {
     return true;
   }
 
+#ifndef _WIN32
+  if (statusPipe_) {
+    return readHelperStatus(0);
+  }
+#endif
+
   auto pid = waitpid(pid_, &status_, WNOHANG);
   if (pid == pid_) {
     waited_ = true;
@@ -380,6 +483,15 @@ int ChildProcess::wait() {
     return status_;
   }
 
+#ifndef _WIN32
+  if (statusPipe_) {
+    while (!readHelperStatus(-1)) {
+      ;
+    }
+    return status_;
+  }
+#endif
+
   while (true) {
     auto pid = waitpid(pid_, &status_, 0);
     if (pid == pid_) {
@@ -414,9 +526,20 @@ std::pair<w_string, w_string> ChildProcess::communicate(
 #endif
 }
 
+w_string ChildProcess::communicateStreaming(
+    pipeReadCallback outputCallback,
+    pipeWriteCallback writeCallback) {
+#ifdef _WIN32
+  return threadedCommunicate(writeCallback, std::move(outputCallback)).second;
+#else
+  return pollingCommunicate(writeCallback, std::move(outputCallback)).second;
+#endif
+}
+
 #ifndef _WIN32
 std::pair<w_string, w_string> ChildProcess::pollingCommunicate(
-    pipeWriteCallback writeCallback) {
+    pipeWriteCallback writeCallback,
+    pipeReadCallback readCallback) {
   std::unordered_map<int, std::string> outputs;
 
   for (auto& it : pipes_) {
@@ -521,7 +644,11 @@ std::pair<w_string, w_string> ChildProcess::pollingCommunicate(
           pipes_.erase(revmap[pfd.fd]);
           continue;
         }
-        outputs[revmap[pfd.fd]].append(buf, l);
+        if (readCallback && revmap[pfd.fd] == STDOUT_FILENO) {
+          readCallback(w_string_piece(buf, l));
+        } else {
+          outputs[revmap[pfd.fd]].append(buf, l);
+        }
       }
 
       if ((pfd.revents & POLLHUP) && revmap[pfd.fd] == STDIN_FILENO) {
@@ -567,6 +694,10 @@ std::pair<w_string, w_string> ChildProcess::pollingCommunicate(
   }
 
   auto optBuffer = [&](int fd) -> w_string {
+    if (readCallback && fd == STDOUT_FILENO) {
+      // It was passed on as it was read
+      return nullptr;
+    }
     auto it = outputs.find(fd);
     if (it == outputs.end()) {
       watchman::log(watchman::DBG, "communicate fd ", fd, " nullptr\n");
@@ -583,15 +714,17 @@ std::pair<w_string, w_string> ChildProcess::pollingCommunicate(
 
 /** Spawn a thread to read from the pipe connected to the specified fd.
  * Returns a Future that will hold a string with the entire output from
- * that stream. */
-folly::Future<w_string> ChildProcess::readPipe(int fd) {
+ * that stream, or a null string once readable has been given all of it. */
+folly::Future<w_string> ChildProcess::readPipe(
+    int fd,
+    pipeReadCallback readable) {
   auto it = pipes_.find(fd);
   if (it == pipes_.end()) {
     return folly::makeFuture(w_string(nullptr));
   }
 
   auto p = std::make_shared<folly::Promise<w_string>>();
-  std::thread thr([ this, fd, p ]() noexcept {
+  std::thread thr([this, fd, p, readable = std::move(readable)]() noexcept {
     std::string result;
     p->setWith([&] {
       auto& pipe = pipes_[fd];
@@ -604,7 +737,14 @@ folly::Future<w_string> ChildProcess::readPipe(int fd) {
           // all done
           break;
         }
-        result.append(buf, len);
+        if (readable) {
+          readable(w_string_piece(buf, len));
+        } else {
+          result.append(buf, len);
+        }
+      }
+      if (readable) {
+        return w_string(nullptr);
       }
       return w_string(result.data(), result.size());
     });
@@ -619,8 +759,9 @@ folly::Future<w_string> ChildProcess::readPipe(int fd) {
  * way to carry out a non-blocking read on a pipe.  We compile and
  * test it on all platforms to make it easier to avoid regressions. */
 std::pair<w_string, w_string> ChildProcess::threadedCommunicate(
-    pipeWriteCallback writeCallback) {
-  auto outFuture = readPipe(STDOUT_FILENO);
+    pipeWriteCallback writeCallback,
+    pipeReadCallback readCallback) {
+  auto outFuture = readPipe(STDOUT_FILENO, std::move(readCallback));
   auto errFuture = readPipe(STDERR_FILENO);
 
   auto it = pipes_.find(STDIN_FILENO);
@@ -10,6 +10,7 @@
 #include <unordered_map>
 #include <vector>
 #include "Pipe.h"
+#include "SpawnHelper.h"
 #include "thirdparty/jansson/jansson.h"
 
 namespace watchman {
@@ -95,6 +96,10 @@ class ChildProcess {
     // Arrange to set the cwd for the child process
     void chdir(w_string_piece path);
 
+    // Have the spawn helper spawn the child, if it is running, rather
+    // than spawning it from this process
+    void useSpawnHelper();
+
    private:
     struct Inner {
       // There is no defined way to copy or move either of
@@ -110,6 +115,9 @@ class ChildProcess {
     Environment env_;
     std::unordered_map<int, std::unique_ptr<Pipe>> pipes_;
     std::string cwd_;
+    bool useSpawnHelper_{false};
+    // The file actions again, in the form that the spawn helper takes
+    std::vector<SpawnHelper::FileAction> helperActions_;
 
     friend class ChildProcess;
   };
@@ -154,6 +162,11 @@ class ChildProcess {
   // if you return false (e.g. after a partial write).
   using pipeWriteCallback = std::function<bool(FileDescriptor&)>;
 
+  // The pipeReadCallback is called by communicate with each chunk of the
+  // output stream, in order, as it is read.  It may be called from another
+  // thread than the one that called communicate, but never concurrently.
+  using pipeReadCallback = std::function<void(w_string_piece)>;
+
   /** ChildProcess::communicate() performs a read/write operation.
    * The provided pipeWriteCallback allows sending data to the input stream.
    * communicate() will return with the pair of output and error streams once
@@ -165,17 +178,47 @@ class ChildProcess {
         return true;
       });
 
+  /** Like communicate(), but passes the output stream to outputCallback
+   * as it is read rather than holding all of it, so that a consumer can
+   * parse large outputs as they arrive.  Returns the error stream. */
+  w_string communicateStreaming(
+      pipeReadCallback outputCallback,
+      pipeWriteCallback writeCallback = [](FileDescriptor&) { return true; });
+
   // these are public for the sake of testing.  You should use the
   // communicate() method instead of calling these directly.
-  std::pair<w_string, w_string> pollingCommunicate(pipeWriteCallback writable);
-  std::pair<w_string, w_string> threadedCommunicate(pipeWriteCallback writable);
+  // When readable is set, the output stream is passed to it and the first
+  // of the pair is null.
+  std::pair<w_string, w_string> pollingCommunicate(
+      pipeWriteCallback writable,
+      pipeReadCallback readable = nullptr);
+  std::pair<w_string, w_string> threadedCommunicate(
+      pipeWriteCallback writable,
+      pipeReadCallback readable = nullptr);
 
  private:
   pid_t pid_;
   bool waited_{false};
   int status_;
   std::unordered_map<int, std::unique_ptr<Pipe>> pipes_;
+  // When the spawn helper spawned the child, the pipe that it writes the
+  // wait status of the child to
+  FileDescriptor statusPipe_;
 
-  folly::Future<w_string> readPipe(int fd);
+  // Reads the pipe connected to fd on a thread of its own.  The output is
+  // passed to readable if it is set, else it is held for the result.
+  folly::Future<w_string> readPipe(int fd, pipeReadCallback readable = nullptr);
+#ifndef _WIN32
+  // Attempts to spawn through the spawn helper; returns false if it is
+  // not running, in which case we spawn the child ourselves
+  bool spawnWithHelper(
+      const std::vector<std::string>& args,
+      char** envp,
+      const Options& options,
+      int& ret);
+  // Reads the wait status from statusPipe_, waiting for up to timeoutMs
+  // for it.  Returns true once the child has terminated.
+  bool readHelperStatus(int timeoutMs);
+#endif
 };
 } // namespace watchman
@@ -0,0 +1,290 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+namespace watchman {
+
+/** ChildTable is a compact open-addressing hash table used to hold the
+ * children of a watchman_dir.
+ *
+ * Each slot stores the owning pointer to the child along with the
+ * precomputed hash value of its name, inline in a single contiguous
+ * array.  The key itself is not stored; it is obtained from the child
+ * via KeyOf, and is only consulted when the stored hash value matches.
+ * Compared to std::unordered_map this avoids a heap allocation and a
+ * couple of pointer hops per entry and halves the per-entry footprint so
+ * that a lookup touches one cache line per few probes.
+ *
+ * Collisions are resolved with linear probing and deletion uses backward
+ * shifting, so there are no tombstones and probe sequences stay short.
+ *
+ * The interface is modelled on std::unordered_map: entries expose the
+ * owned value as `second` and can be iterated with a range-for.  Value
+ * must be a nullable owning pointer type such as std::unique_ptr; a null
+ * value marks an empty slot, so null values cannot be stored.
+ *
+ * Any insertion or erasure invalidates iterators and references to
+ * entries.
+ */
+template <
+    typename Key,
+    typename Value,
+    typename KeyOf,
+    typename Hash = std::hash<Key>>
+class ChildTable {
+ public:
+  struct Entry {
+    Value second;
+    uint32_t hval;
+
+    Key key() const {
+      return KeyOf()(second);
+    }
+  };
+
+  template <typename EntryType>
+  class Iterator {
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = EntryType;
+    using difference_type = std::ptrdiff_t;
+    using pointer = EntryType*;
+    using reference = EntryType&;
+
+    Iterator(EntryType* pos, EntryType* end) : pos_(pos), end_(end) {
+      skipEmpty();
+    }
+
+    reference operator*() const {
+      return *pos_;
+    }
+    pointer operator->() const {
+      return pos_;
+    }
+
+    Iterator& operator++() {
+      ++pos_;
+      skipEmpty();
+      return *this;
+    }
+
+    bool operator==(const Iterator& other) const {
+      return pos_ == other.pos_;
+    }
+    bool operator!=(const Iterator& other) const {
+      return pos_ != other.pos_;
+    }
+
+   private:
+    void skipEmpty() {
+      while (pos_ != end_ && !pos_->second) {
+        ++pos_;
+      }
+    }
+
+    EntryType* pos_;
+    EntryType* end_;
+  };
+
+  using iterator = Iterator<Entry>;
+  using const_iterator = Iterator<const Entry>;
+
+  ChildTable() = default;
+  ChildTable(const ChildTable&) = delete;
+  ChildTable& operator=(const ChildTable&) = delete;
+  ChildTable(ChildTable&& other) noexcept
+      : entries_(std::move(other.entries_)),
+        capacity_(other.capacity_),
+        size_(other.size_) {
+    other.capacity_ = 0;
+    other.size_ = 0;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // The bytes of the slots of the table, which only grows until it is
+  // cleared or destroyed
+  size_t allocatedBytes() const {
+    return capacity_ * sizeof(Entry);
+  }
+
+  iterator begin() {
+    return iterator(entries_.get(), entries_.get() + capacity_);
+  }
+  iterator end() {
+    return iterator(entries_.get() + capacity_, entries_.get() + capacity_);
+  }
+  const_iterator begin() const {
+    return const_iterator(entries_.get(), entries_.get() + capacity_);
+  }
+  const_iterator end() const {
+    return const_iterator(
+        entries_.get() + capacity_, entries_.get() + capacity_);
+  }
+
+  iterator find(const Key& key) {
+    auto idx = findIndex(key, hashOf(key));
+    if (idx == kNotFound) {
+      return end();
+    }
+    return iterator(entries_.get() + idx, entries_.get() + capacity_);
+  }
+
+  const_iterator find(const Key& key) const {
+    auto idx = findIndex(key, hashOf(key));
+    if (idx == kNotFound) {
+      return end();
+    }
+    return const_iterator(entries_.get() + idx, entries_.get() + capacity_);
+  }
+
+  /** Insert value, keyed by KeyOf(value).  If an entry with the same key
+   * is already present, the table is left unchanged and the existing
+   * entry is returned along with false. */
+  std::pair<iterator, bool> emplace(Value&& value) {
+    assert(value);
+    Key key = KeyOf()(value);
+    auto hval = hashOf(key);
+    auto idx = findIndex(key, hval);
+    if (idx != kNotFound) {
+      return std::make_pair(
+          iterator(entries_.get() + idx, entries_.get() + capacity_), false);
+    }
+
+    if ((size_ + 1) * kMaxLoadDenominator > capacity_ * kMaxLoadNumerator) {
+      rehash(capacity_ ? capacity_ * 2 : kMinCapacity);
+    }
+
+    idx = insertSlot(hval);
+    auto& entry = entries_[idx];
+    entry.hval = hval;
+    entry.second = std::move(value);
+    ++size_;
+    return std::make_pair(
+        iterator(entries_.get() + idx, entries_.get() + capacity_), true);
+  }
+
+  /** Remove the entry for key, destroying its value.
+   * Returns the number of entries removed */
+  size_t erase(const Key& key) {
+    auto idx = findIndex(key, hashOf(key));
+    if (idx == kNotFound) {
+      return 0;
+    }
+    eraseIndex(idx);
+    return 1;
+  }
+
+  /** Ensure that there is space for at least n entries without
+   * needing to grow the table */
+  void reserve(size_t n) {
+    size_t cap = kMinCapacity;
+    while (n * kMaxLoadDenominator > cap * kMaxLoadNumerator) {
+      cap *= 2;
+    }
+    if (cap > capacity_) {
+      rehash(cap);
+    }
+  }
+
+  void clear() {
+    entries_.reset();
+    capacity_ = 0;
+    size_ = 0;
+  }
+
+ private:
+  static constexpr size_t kNotFound = ~size_t(0);
+  static constexpr size_t kMinCapacity = 4;
+  // Maximum load factor: 3/4
+  static constexpr size_t kMaxLoadNumerator = 3;
+  static constexpr size_t kMaxLoadDenominator = 4;
+
+  static uint32_t hashOf(const Key& key) {
+    return uint32_t(Hash()(key));
+  }
+
+  size_t mask() const {
+    return capacity_ - 1;
+  }
+
+  size_t findIndex(const Key& key, uint32_t hval) const {
+    if (capacity_ == 0) {
+      return kNotFound;
+    }
+    for (size_t idx = hval & mask();; idx = (idx + 1) & mask()) {
+      const auto& entry = entries_[idx];
+      if (!entry.second) {
+        return kNotFound;
+      }
+      if (entry.hval == hval && entry.key() == key) {
+        return idx;
+      }
+    }
+  }
+
+  // Returns the index of the first empty slot in the probe sequence
+  // for hval.  The table must have at least one empty slot.
+  size_t insertSlot(uint32_t hval) const {
+    size_t idx = hval & mask();
+    while (entries_[idx].second) {
+      idx = (idx + 1) & mask();
+    }
+    return idx;
+  }
+
+  void eraseIndex(size_t idx) {
+    entries_[idx].second.reset();
+    --size_;
+
+    // Backward shift deletion: walk the run of entries that follow the
+    // hole and move back any entry whose home slot is not between the
+    // hole and its current position, so that lookups don't stop early.
+    size_t hole = idx;
+    for (size_t next = (hole + 1) & mask(); entries_[next].second;
+         next = (next + 1) & mask()) {
+      size_t home = entries_[next].hval & mask();
+      // The entry may fill the hole if the hole lies within its probe
+      // sequence, which is to say between its home slot and where it
+      // currently lives.
+      if (((next - home) & mask()) >= ((next - hole) & mask())) {
+        entries_[hole] = std::move(entries_[next]);
+        hole = next;
+      }
+    }
+  }
+
+  void rehash(size_t newCapacity) {
+    auto oldEntries = std::move(entries_);
+    auto oldCapacity = capacity_;
+
+    entries_ = std::make_unique<Entry[]>(newCapacity);
+    capacity_ = newCapacity;
+
+    for (size_t i = 0; i < oldCapacity; ++i) {
+      auto& entry = oldEntries[i];
+      if (entry.second) {
+        entries_[insertSlot(entry.hval)] = std::move(entry);
+      }
+    }
+  }
+
+  std::unique_ptr<Entry[]> entries_;
+  size_t capacity_{0};
+  size_t size_{0};
+};
+
+} // namespace watchman
@@ -0,0 +1,605 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "ClientReactor.h"
+#include <folly/io/async/AsyncTimeout.h>
+#include <folly/io/async/EventHandler.h>
+#include <folly/net/NetworkSocket.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include "Logging.h"
+#ifdef _WIN32
+#include "watchman_stream.h"
+#endif
+
+namespace watchman {
+
+namespace {
+// How long a worker waits for another client to serve before it exits
+constexpr std::chrono::seconds kWorkerIdleTimeout{10};
+
+#ifdef _WIN32
+// The number of threads that wait on the completion port.  They only pass
+// completions on to the event loop thread and accept connections, so a
+// couple of them suffice.
+constexpr size_t kCompletionPortThreads = 2;
+
+// The completion key that tells a thread waiting on the port to exit
+constexpr ULONG_PTR kStopKey = 0;
+#endif
+} // namespace
+
+// Runs tasks in detached threads, starting another thread whenever there
+// are more tasks than idle threads to run them
+class ClientReactor::Workers : public std::enable_shared_from_this<Workers> {
+ public:
+  void add(std::function<void()> task) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    if (idle_ >= tasks_.size()) {
+      cond_.notify_one();
+      return;
+    }
+    lock.unlock();
+    std::thread([self = shared_from_this()] { self->run(); }).detach();
+  }
+
+ private:
+  void run() {
+    w_set_thread_name("client-worker");
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      while (!tasks_.empty()) {
+        auto task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+        task = nullptr;
+        w_set_thread_name("client-worker");
+        lock.lock();
+      }
+
+      ++idle_;
+      auto woken = cond_.wait_for(
+          lock, kWorkerIdleTimeout, [this] { return !tasks_.empty(); });
+      --idle_;
+      if (!woken) {
+        return;
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> tasks_;
+  // The number of threads that are waiting for a task
+  size_t idle_{0};
+};
+
+class ClientReactor::Watch {
+ public:
+  // Tells the reactor when the descriptor that it watches is ready
+  class Handler : public folly::EventHandler {
+   public:
+    Handler(
+        Watch& watch,
+        FileDescriptor::system_handle_type fd,
+        bool socket)
+        : EventHandler(&watch.reactor.eventBase_, folly::NetworkSocket(fd)),
+          watch_(watch),
+          socket_(socket) {}
+
+    void handlerReady(uint16_t events) noexcept override {
+      watch_.reactor.ready(
+          &watch_, socket_ && (events & folly::EventHandler::READ));
+    }
+
+   private:
+    Watch& watch_;
+    // Whether this watches the socket rather than the ping
+    const bool socket_;
+  };
+
+  // Tells the reactor when the client has waited for as long as it asked
+  class Timer : public folly::AsyncTimeout {
+   public:
+    explicit Timer(Watch& watch)
+        : AsyncTimeout(&watch.reactor.eventBase_), watch_(watch) {}
+
+    void timeoutExpired() noexcept override {
+      watch_.reactor.ready(&watch_, false);
+    }
+
+   private:
+    Watch& watch_;
+  };
+
+  Watch(
+      ClientReactor& reactor,
+      FileDescriptor::system_handle_type socket,
+      FileDescriptor::system_handle_type ping,
+      Serve serve)
+      : reactor(reactor),
+        socket(*this, socket, true),
+        ping(*this, ping, false),
+        timer(*this),
+        serve(std::move(serve)) {}
+
+  ClientReactor& reactor;
+  Handler socket;
+  Handler ping;
+  Timer timer;
+  // Only used by the worker that is serving the client, which resets it
+  // once the client has disconnected
+  Serve serve;
+};
+
+#ifdef _WIN32
+// A connection to the pipe that is waiting to be accepted
+struct ClientReactor::PendingAccept {
+  OVERLAPPED olap{};
+  FileDescriptor pipe;
+};
+
+// A named pipe client.  The completion port tells us when its reads and
+// writes complete, and a wait in the system thread pool tells the port
+// when its ping is signalled.  The state of the watch is only accessed in
+// the event loop thread, apart from stm and serve.
+class ClientReactor::PipeWatch
+    : public std::enable_shared_from_this<ClientReactor::PipeWatch> {
+ public:
+  // Tells the reactor when the client has waited for as long as it asked
+  class Timer : public folly::AsyncTimeout {
+   public:
+    explicit Timer(PipeWatch& watch)
+        : AsyncTimeout(&watch.reactor.eventBase_), watch_(watch) {}
+
+    void timeoutExpired() noexcept override {
+      watch_.reactor.pipeReady(
+          watch_.shared_from_this(), PipeEvent::Timeout);
+    }
+
+   private:
+    PipeWatch& watch_;
+  };
+
+  PipeWatch(
+      ClientReactor& reactor,
+      ULONG_PTR key,
+      watchman_stream* stm,
+      watchman_event* ping,
+      Serve serve)
+      : reactor(reactor),
+        key(key),
+        ping(HANDLE(ping->system_handle())),
+        timer(*this),
+        stm(stm),
+        serve(std::move(serve)) {}
+
+  ~PipeWatch() {
+    unregisterPing();
+  }
+
+  // Runs in the system thread pool
+  static void CALLBACK pingSignalled(void* context, BOOLEAN) {
+    auto watch = static_cast<PipeWatch*>(context);
+    PostQueuedCompletionStatus(watch->reactor.port_, 0, watch->key, nullptr);
+  }
+
+  bool registerPing() {
+    return RegisterWaitForSingleObject(
+        &pingWait, ping, pingSignalled, this, INFINITE, WT_EXECUTEONLYONCE);
+  }
+
+  void unregisterPing() {
+    if (pingWait) {
+      // Waits for the callback if it is running, so that it doesn't
+      // outlive us
+      UnregisterWaitEx(pingWait, INVALID_HANDLE_VALUE);
+      pingWait = nullptr;
+    }
+  }
+
+  ClientReactor& reactor;
+  const ULONG_PTR key;
+  const HANDLE ping;
+  HANDLE pingWait{nullptr};
+  Timer timer;
+  // Whether the client is waiting to be served, rather than being served
+  bool armed{false};
+  Wait wait{Wait::Input};
+  // What has completed since the client was last served.  Nothing has
+  // been read from a new client, which has to be served for it to start
+  // reading.
+  bool readReady{true};
+  bool wrote{false};
+
+  // Guards stm, which the threads that wait on the port pass completions
+  // to, until the client has disconnected
+  std::mutex mutex;
+  watchman_stream* stm;
+  // Only used by the worker that is serving the client, which resets it
+  // once the client has disconnected
+  Serve serve;
+};
+#endif
+
+ClientReactor::ClientReactor() : workers_(std::make_shared<Workers>()) {
+  thread_ = std::thread([this] {
+    w_set_thread_name("client-reactor");
+    eventBase_.loopForever();
+  });
+#ifdef _WIN32
+  port_ = CreateIoCompletionPort(
+      INVALID_HANDLE_VALUE, nullptr, 0, DWORD(kCompletionPortThreads));
+  if (!port_) {
+    log(ERR,
+        "CreateIoCompletionPort failed: ",
+        win32_strerror(GetLastError()),
+        "; named pipe clients will have a thread of their own\n");
+    return;
+  }
+  for (size_t i = 0; i < kCompletionPortThreads; ++i) {
+    portThreads_.emplace_back([this, i] {
+      w_set_thread_name("client-port", i);
+      runCompletionPort();
+    });
+  }
+#endif
+}
+
+ClientReactor::~ClientReactor() {
+  stop();
+}
+
+void ClientReactor::add(
+    FileDescriptor::system_handle_type socket,
+    FileDescriptor::system_handle_type ping,
+    Serve serve) {
+  eventBase_.runInEventBaseThread(
+      [this, socket, ping, serve = std::move(serve)]() mutable {
+        auto watch = std::make_unique<Watch>(*this, socket, ping, serve);
+        auto raw = watch.get();
+        watches_.emplace(raw, std::move(watch));
+        arm(raw, {Wait::Input});
+      });
+}
+
+void ClientReactor::stop() {
+#ifdef _WIN32
+  if (!portThreads_.empty()) {
+    for (size_t i = 0; i < portThreads_.size(); ++i) {
+      PostQueuedCompletionStatus(port_, 0, kStopKey, nullptr);
+    }
+    for (auto& thread : portThreads_) {
+      thread.join();
+    }
+    portThreads_.clear();
+
+    // The kernel may still write to the OVERLAPPED of a cancelled accept
+    // until it has completed
+    auto accepts = std::move(keys_.wlock()->accepts);
+    for (auto& it : accepts) {
+      auto& accept = it.second;
+      DWORD bytes;
+      if (CancelIoEx(HANDLE(accept->pipe.handle()), &accept->olap)) {
+        GetOverlappedResult(
+            HANDLE(accept->pipe.handle()), &accept->olap, &bytes, TRUE);
+      }
+    }
+  }
+#endif
+  if (thread_.joinable()) {
+    eventBase_.terminateLoopSoon();
+    thread_.join();
+  }
+#ifdef _WIN32
+  // Releases the clients that are still waiting
+  keys_.wlock()->pipes.clear();
+  if (port_) {
+    CloseHandle(port_);
+    port_ = nullptr;
+  }
+#endif
+}
+
+void ClientReactor::arm(Watch* watch, Next next) {
+  uint16_t events = 0;
+  switch (next.wait) {
+    case Wait::Input:
+      events = folly::EventHandler::READ;
+      break;
+    case Wait::InputOrOutput:
+      events = folly::EventHandler::READ | folly::EventHandler::WRITE;
+      break;
+    case Wait::Output:
+    case Wait::Disconnected:
+      events = folly::EventHandler::WRITE;
+      break;
+    case Wait::Ping:
+      break;
+  }
+
+  // The handlers aren't persistent, so that they are only ever ready once
+  // per call to arm, and a client is never served by two workers at once
+  if ((events && !watch->socket.registerHandler(events)) ||
+      !watch->ping.registerHandler(folly::EventHandler::READ)) {
+    log(ERR, "failed to wait for input from a client; disconnecting it\n");
+    watch->socket.unregisterHandler();
+    workers_->add([this, watch] {
+      watch->serve = nullptr;
+      eventBase_.runInEventBaseThread([this, watch] { remove(watch); });
+    });
+    return;
+  }
+  if (next.timeout.count() > 0) {
+    watch->timer.scheduleTimeout(next.timeout);
+  }
+}
+
+void ClientReactor::ready(Watch* watch, bool readable) {
+  // Only one of the handlers, or the timer, has fired
+  watch->socket.unregisterHandler();
+  watch->ping.unregisterHandler();
+  watch->timer.cancelTimeout();
+
+  workers_->add([this, watch, readable] {
+    auto next = watch->serve(readable);
+    if (next.wait != Wait::Disconnected) {
+      eventBase_.runInEventBaseThread(
+          [this, watch, next] { arm(watch, next); });
+      return;
+    }
+    // Release the client here rather than in the event loop thread, since
+    // tearing it down may have to wait for locks
+    watch->serve = nullptr;
+    eventBase_.runInEventBaseThread([this, watch] { remove(watch); });
+  });
+}
+
+void ClientReactor::remove(Watch* watch) {
+  watches_.erase(watch);
+}
+
+#ifdef _WIN32
+bool ClientReactor::listenPipe(
+    size_t instances,
+    std::function<FileDescriptor()> createPipe,
+    std::function<void(FileDescriptor&&)> accept) {
+  if (portThreads_.empty()) {
+    return false;
+  }
+  createPipe_ = std::move(createPipe);
+  accept_ = std::move(accept);
+  for (size_t i = 0; i < instances; ++i) {
+    listenOnePipe();
+  }
+  return true;
+}
+
+void ClientReactor::listenOnePipe() {
+  auto accept = std::make_unique<PendingAccept>();
+  accept->pipe = createPipe_();
+  if (!accept->pipe) {
+    log(ERR, "CreateNamedPipe failed: ", win32_strerror(GetLastError()), "\n");
+    return;
+  }
+  auto handle = HANDLE(accept->pipe.handle());
+  auto key = nextKey_++;
+  if (!CreateIoCompletionPort(handle, port_, key, 0)) {
+    log(ERR,
+        "failed to associate a pipe with the completion port: ",
+        win32_strerror(GetLastError()),
+        "\n");
+    return;
+  }
+
+  auto olap = &accept->olap;
+  keys_.wlock()->accepts.emplace(key, std::move(accept));
+  if (ConnectNamedPipe(handle, olap)) {
+    return;
+  }
+  auto err = GetLastError();
+  if (err == ERROR_IO_PENDING) {
+    return;
+  }
+  if (err == ERROR_PIPE_CONNECTED) {
+    // A client connected before we asked, and no packet is queued for it
+    PostQueuedCompletionStatus(port_, 0, key, olap);
+    return;
+  }
+  log(ERR, "ConnectNamedPipe: ", win32_strerror(err), "\n");
+  keys_.wlock()->accepts.erase(key);
+}
+
+void ClientReactor::pipeConnected(ULONG_PTR key, DWORD err) {
+  std::unique_ptr<PendingAccept> accept;
+  HANDLE handle;
+  {
+    auto keys = keys_.wlock();
+    auto it = keys->accepts.find(key);
+    if (it == keys->accepts.end()) {
+      return;
+    }
+    accept = std::move(it->second);
+    keys->accepts.erase(it);
+    handle = HANDLE(accept->pipe.handle());
+    keys->accepted.emplace(handle, key);
+  }
+
+  // Replace it, so that the same number of instances are always waiting
+  listenOnePipe();
+
+  if (err != 0 && err != ERROR_PIPE_CONNECTED) {
+    log(ERR, "ConnectNamedPipe: ", win32_strerror(err), "\n");
+  } else {
+    try {
+      accept_(std::move(accept->pipe));
+    } catch (const std::exception& exc) {
+      log(ERR, "failed to accept a pipe client: ", exc.what(), "\n");
+    }
+  }
+  keys_.wlock()->accepted.erase(handle);
+}
+
+bool ClientReactor::addPipe(
+    watchman_stream* stm,
+    watchman_event* ping,
+    Serve serve) {
+  ULONG_PTR key;
+  {
+    auto keys = keys_.rlock();
+    auto it = keys->accepted.find(HANDLE(stm->getFileDescriptor().handle()));
+    if (it == keys->accepted.end()) {
+      return false;
+    }
+    key = it->second;
+  }
+  if (!w_stm_use_completion_port(stm)) {
+    return false;
+  }
+
+  auto watch =
+      std::make_shared<PipeWatch>(*this, key, stm, ping, std::move(serve));
+  keys_.wlock()->pipes.emplace(key, watch);
+  eventBase_.runInEventBaseThread(
+      [this, watch] { armPipe(watch, {Wait::Input}); });
+  return true;
+}
+
+void ClientReactor::runCompletionPort() {
+  while (true) {
+    DWORD bytes = 0;
+    ULONG_PTR key = 0;
+    OVERLAPPED* olap = nullptr;
+    DWORD err = 0;
+    if (!GetQueuedCompletionStatus(port_, &bytes, &key, &olap, INFINITE)) {
+      err = GetLastError();
+      if (!olap) {
+        log(ERR,
+            "GetQueuedCompletionStatus failed: ",
+            win32_strerror(err),
+            "\n");
+        return;
+      }
+    }
+    if (key == kStopKey) {
+      return;
+    }
+
+    std::shared_ptr<PipeWatch> watch;
+    {
+      auto keys = keys_.rlock();
+      auto it = keys->pipes.find(key);
+      if (it == keys->pipes.end()) {
+        if (keys->accepts.count(key)) {
+          keys.unlock();
+          pipeConnected(key, err);
+        }
+        // Otherwise the client has gone
+        continue;
+      }
+      watch = it->second;
+    }
+
+    // The packets that the ping wait posts carry no OVERLAPPED
+    auto event = PipeEvent::Ping;
+    if (olap) {
+      std::lock_guard<std::mutex> lock(watch->mutex);
+      if (!watch->stm) {
+        continue;
+      }
+      event = w_stm_completed(watch->stm, olap, err, bytes) ? PipeEvent::Wrote
+                                                            : PipeEvent::Read;
+    }
+    eventBase_.runInEventBaseThread(
+        [this, watch, event] { pipeReady(watch, event); });
+  }
+}
+
+void ClientReactor::armPipe(
+    const std::shared_ptr<PipeWatch>& watch,
+    Next next) {
+  watch->wait = next.wait;
+  watch->armed = true;
+  bool input = next.wait == Wait::Input || next.wait == Wait::InputOrOutput;
+  bool output = next.wait == Wait::Output || next.wait == Wait::InputOrOutput;
+  if ((input && watch->readReady) || (output && watch->wrote)) {
+    // It completed while the client was being served
+    servePipe(watch);
+    return;
+  }
+
+  if (!watch->registerPing()) {
+    log(ERR,
+        "failed to wait for a ping for a client: ",
+        win32_strerror(GetLastError()),
+        "; disconnecting it\n");
+    watch->armed = false;
+    workers_->add([this, watch] { removePipe(watch); });
+    return;
+  }
+  if (next.timeout.count() > 0) {
+    watch->timer.scheduleTimeout(next.timeout);
+  }
+}
+
+void ClientReactor::pipeReady(
+    const std::shared_ptr<PipeWatch>& watch,
+    PipeEvent event) {
+  bool wanted = true;
+  switch (event) {
+    case PipeEvent::Read:
+      watch->readReady = true;
+      wanted = watch->wait == Wait::Input ||
+          watch->wait == Wait::InputOrOutput;
+      break;
+    case PipeEvent::Wrote:
+      watch->wrote = true;
+      wanted = watch->wait == Wait::Output ||
+          watch->wait == Wait::InputOrOutput;
+      break;
+    case PipeEvent::Ping:
+    case PipeEvent::Timeout:
+      break;
+  }
+  // What completed while the client was being served is remembered until
+  // it is next armed
+  if (watch->armed && wanted) {
+    servePipe(watch);
+  }
+}
+
+void ClientReactor::servePipe(const std::shared_ptr<PipeWatch>& watch) {
+  watch->armed = false;
+  watch->unregisterPing();
+  watch->timer.cancelTimeout();
+  bool readable = watch->readReady;
+  watch->readReady = false;
+  watch->wrote = false;
+
+  workers_->add([this, watch, readable] {
+    auto next = watch->serve(readable);
+    if (next.wait != Wait::Disconnected) {
+      eventBase_.runInEventBaseThread(
+          [this, watch, next] { armPipe(watch, next); });
+      return;
+    }
+    removePipe(watch);
+  });
+}
+
+void ClientReactor::removePipe(const std::shared_ptr<PipeWatch>& watch) {
+  keys_.wlock()->pipes.erase(watch->key);
+  {
+    std::lock_guard<std::mutex> lock(watch->mutex);
+    watch->stm = nullptr;
+  }
+  // Release the client here rather than in the event loop thread, since
+  // tearing it down may have to wait for locks and for its writes
+  watch->serve = nullptr;
+}
+#endif
+
+} // namespace watchman
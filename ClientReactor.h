@@ -0,0 +1,155 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <folly/Synchronized.h>
+#include <folly/io/async/EventBase.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "FileDescriptor.h"
+
+class watchman_event;
+class watchman_stream;
+
+namespace watchman {
+
+// Waits for input from idle clients, and for the pings that tell them that
+// there is something to send them, in one event loop thread rather than in
+// a thread per client.  A client that is ready to make progress is served
+// in a worker thread.  Workers are started as they are needed, so that a
+// command that blocks doesn't hold up other clients, and exit once they
+// have been idle for a while.
+//
+// On Windows, named pipe clients are served in the same way, but the reads
+// and writes of their streams complete on an I/O completion port, and
+// the connections to the pipe are accepted there too.  A few threads wait
+// on the port and pass what completed on to the event loop thread.
+class ClientReactor {
+ public:
+  // What a client is to be waited for, besides a ping, before it is
+  // served again
+  enum class Wait {
+    // Nothing; the client has disconnected
+    Disconnected,
+    // Input from the client
+    Input,
+    // Input, or room to write the responses that are queued for it
+    InputOrOutput,
+    // Room to write the responses that are queued for it, only
+    Output,
+    // Only a ping, such as while its command waits to be dispatched
+    Ping,
+  };
+
+  // What a client is to be waited for next, and how long to wait for it
+  // at most before serving the client again anyway; zero waits for as
+  // long as it takes
+  struct Next {
+    Wait wait;
+    std::chrono::milliseconds timeout{0};
+  };
+
+  // Serves a client until it has to wait for input, room to write or a
+  // ping again; readable is set if it was woken by input.  Returns what
+  // it is to be waited for next.
+  using Serve = std::function<Next(bool readable)>;
+
+  ClientReactor();
+  ~ClientReactor();
+  ClientReactor(const ClientReactor&) = delete;
+  ClientReactor& operator=(const ClientReactor&) = delete;
+
+  // Calls serve in a worker thread each time that socket is ready for what
+  // serve last asked for, ping is signalled or the timeout that it asked
+  // for has passed, until it returns Disconnected.  The socket is waited
+  // for input to begin with.  serve is never called again before the
+  // previous call has returned.
+  void add(
+      FileDescriptor::system_handle_type socket,
+      FileDescriptor::system_handle_type ping,
+      Serve serve);
+
+#ifdef _WIN32
+  // Keeps `instances` instances of a named pipe, each made by createPipe,
+  // waiting for a client to connect to them, and passes each client that
+  // connects to accept in one of the threads that wait on the completion
+  // port.  Returns false if the completion port couldn't be created, in
+  // which case the pipe has to be listened on in some other way.
+  bool listenPipe(
+      size_t instances,
+      std::function<FileDescriptor()> createPipe,
+      std::function<void(FileDescriptor&&)> accept);
+
+  // As add() for a client that has connected to the pipe that is being
+  // listened on, which must be called from accept.  stm and ping must
+  // remain valid for as long as serve does.  Returns false if stm can't
+  // complete its reads and writes on the completion port, in which case
+  // the client has to be served in some other way.
+  bool addPipe(watchman_stream* stm, watchman_event* ping, Serve serve);
+#endif
+
+  // Stops waiting for clients, and waits for the event loop thread to
+  // finish.  Clients that are being served at the time finish their
+  // current call to serve but are not waited for again.
+  void stop();
+
+ private:
+  class Watch;
+  class Workers;
+
+  // These are called in the event loop thread
+  void arm(Watch* watch, Next next);
+  void ready(Watch* watch, bool readable);
+  void remove(Watch* watch);
+
+  folly::EventBase eventBase_;
+  std::thread thread_;
+  std::shared_ptr<Workers> workers_;
+  // Only accessed in the event loop thread
+  std::unordered_map<Watch*, std::unique_ptr<Watch>> watches_;
+
+#ifdef _WIN32
+  class PipeWatch;
+  struct PendingAccept;
+
+  // What woke a pipe client
+  enum class PipeEvent { Read, Wrote, Ping, Timeout };
+
+  struct PortKeys {
+    // The pipe instances that are waiting for a client to connect
+    std::unordered_map<ULONG_PTR, std::unique_ptr<PendingAccept>> accepts;
+    // The keys of the pipes that are being passed to accept
+    std::unordered_map<HANDLE, ULONG_PTR> accepted;
+    std::unordered_map<ULONG_PTR, std::shared_ptr<PipeWatch>> pipes;
+  };
+
+  // These are called in the threads that wait on the completion port
+  void runCompletionPort();
+  void listenOnePipe();
+  void pipeConnected(ULONG_PTR key, DWORD err);
+
+  // These are called in the event loop thread
+  void armPipe(const std::shared_ptr<PipeWatch>& watch, Next next);
+  void pipeReady(const std::shared_ptr<PipeWatch>& watch, PipeEvent event);
+  void servePipe(const std::shared_ptr<PipeWatch>& watch);
+
+  void removePipe(const std::shared_ptr<PipeWatch>& watch);
+
+  HANDLE port_{nullptr};
+  std::vector<std::thread> portThreads_;
+  std::function<FileDescriptor()> createPipe_;
+  std::function<void(FileDescriptor&&)> accept_;
+  // Each pipe instance has a completion key of its own, which it keeps
+  // once a client has connected to it, so that the packets of a client
+  // that has gone can't be mistaken for those of another
+  std::atomic<ULONG_PTR> nextKey_{1};
+  folly::Synchronized<PortKeys> keys_;
+#endif
+};
+
+} // namespace watchman
@@ -129,6 +129,15 @@ std::unique_ptr<ClockSpec> ClockSpec::parseOptionalClockSpec(
   return std::make_unique<ClockSpec>(value);
 }
 
+ClockLineage ClockLineage::forPosition(const ClockPosition& position) {
+  ClockLineage lineage;
+  lineage.startTime = proc_start_time;
+  lineage.pid = proc_pid;
+  lineage.rootNumber = position.rootNumber;
+  lineage.ticks = position.ticks;
+  return lineage;
+}
+
 ClockSpec::ClockSpec() : tag(w_cs_timestamp), timestamp(0) {}
 
 ClockSpec::ClockSpec(const ClockPosition& position)
@@ -137,8 +146,8 @@ ClockSpec::ClockSpec(const ClockPosition& position)
 w_query_since ClockSpec::evaluate(
     const ClockPosition& position,
     const uint32_t lastAgeOutTick,
-    folly::Synchronized<std::unordered_map<w_string, uint32_t>>* cursorMap)
-    const {
+    CursorMap* cursorMap,
+    const ClockLineage* priorLineage) const {
   w_query_since since;
 
   switch (tag) {
@@ -156,22 +165,37 @@ w_query_since ClockSpec::evaluate(
             "illegal to use a named cursor in this context");
       }
 
+      // Record the current tick value against the cursor so that we use
+      // that as the basis for a subsequent query.  The tick of a known
+      // cursor is swapped in place under the read lock, so that polling
+      // one cursor doesn't hold up the queries that use the others; only
+      // a new cursor needs the write lock.
+      folly::Optional<uint32_t> prior;
       {
+        auto rlock = cursorMap->rlock();
+        auto it = rlock->find(named_cursor.cursor);
+        if (it != rlock->end()) {
+          prior = it->second.exchange(position.ticks);
+        }
+      }
+      if (!prior) {
         auto wlock = cursorMap->wlock();
-        auto& cursors = *wlock;
-        auto it = cursors.find(named_cursor.cursor);
-
-        if (it == cursors.end()) {
-          since.clock.is_fresh_instance = true;
-          since.clock.ticks = 0;
-        } else {
-          since.clock.ticks = it->second;
-          since.clock.is_fresh_instance = since.clock.ticks < lastAgeOutTick;
+        auto inserted = wlock->emplace(
+            std::piecewise_construct,
+            std::forward_as_tuple(named_cursor.cursor),
+            std::forward_as_tuple(position.ticks));
+        if (!inserted.second) {
+          // Another query created it since we looked
+          prior = inserted.first->second.exchange(position.ticks);
         }
+      }
 
-        // record the current tick value against the cursor so that we use that
-        // as the basis for a subsequent query.
-        cursors[named_cursor.cursor] = position.ticks;
+      if (!prior) {
+        since.clock.is_fresh_instance = true;
+        since.clock.ticks = 0;
+      } else {
+        since.clock.ticks = *prior;
+        since.clock.is_fresh_instance = since.clock.ticks < lastAgeOutTick;
       }
 
       watchman::log(
@@ -186,8 +210,18 @@ w_query_since ClockSpec::evaluate(
     }
 
     case w_cs_clock: {
-      if (clock.start_time == proc_start_time && clock.pid == proc_pid &&
-          clock.position.rootNumber == position.rootNumber) {
+      bool sameIncarnation = clock.start_time == proc_start_time &&
+          clock.pid == proc_pid &&
+          clock.position.rootNumber == position.rootNumber;
+      // A clock from the incarnation that our view was restored from
+      // remains valid provided that the state that it describes was
+      // captured in the snapshot.
+      bool priorIncarnation = priorLineage &&
+          clock.start_time == priorLineage->startTime &&
+          clock.pid == priorLineage->pid &&
+          clock.position.rootNumber == priorLineage->rootNumber &&
+          clock.position.ticks <= priorLineage->ticks;
+      if (sameIncarnation || priorIncarnation) {
         since.clock.is_fresh_instance = clock.position.ticks < lastAgeOutTick;
         if (since.clock.is_fresh_instance) {
           since.clock.ticks = 0;
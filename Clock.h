@@ -2,6 +2,7 @@
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
 #include <folly/Synchronized.h>
+#include <atomic>
 #include <unordered_map>
 #include "Logging.h"
 
@@ -23,6 +24,27 @@ struct ClockPosition {
   w_string toClockString() const;
 };
 
+/** Identifies the incarnation of a watch that issued a set of clocks.
+ * A view that was restored from a persistent snapshot continues the
+ * tick sequence of the incarnation that wrote the snapshot, and
+ * continues to honor the clocks that it issued up to and including
+ * ticks. */
+struct ClockLineage {
+  uint64_t startTime{0};
+  int pid{0};
+  uint32_t rootNumber{0};
+  uint32_t ticks{0};
+
+  /** Returns the lineage of clocks issued by this process for position */
+  static ClockLineage forPosition(const ClockPosition& position);
+};
+
+/** Maps the name of each cursor of a root to the tick that it was last
+ * resolved at.  The ticks are atomic so that a cursor can be advanced
+ * while the map is only locked for reading. */
+using CursorMap =
+    folly::Synchronized<std::unordered_map<w_string, std::atomic<uint32_t>>>;
+
 enum w_clockspec_tag { w_cs_timestamp, w_cs_clock, w_cs_named_cursor };
 
 struct ClockSpec {
@@ -60,12 +82,14 @@ struct ClockSpec {
   /** Evaluate the clockspec against the inputs, returning
    * the effective since parameter.
    * If cursorMap is passed in, it MUST be unlocked, as this method
-   * will acquire a lock to evaluate a named cursor. */
+   * will acquire a lock to evaluate a named cursor.
+   * If priorLineage is passed in, clocks issued by that incarnation
+   * of the watch are treated as though they were issued by this one. */
   w_query_since evaluate(
       const ClockPosition& position,
       const uint32_t lastAgeOutTick,
-      folly::Synchronized<std::unordered_map<w_string, uint32_t>>* cursorMap =
-          nullptr) const;
+      CursorMap* cursorMap = nullptr,
+      const ClockLineage* priorLineage = nullptr) const;
 
   /** Initializes some global state needed for clockspec evaluation */
   static void init();
@@ -0,0 +1,208 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "CommandAdmission.h"
+#include <algorithm>
+#include <cstring>
+#include "watchman_config.h"
+
+namespace watchman {
+
+namespace {
+size_t index(CommandAdmission::Priority priority) {
+  return size_t(priority);
+}
+} // namespace
+
+CommandAdmission::Ticket::Ticket(
+    CommandAdmission& admission,
+    Priority priority,
+    const void* client)
+    : admission_(admission), priority_(priority), client_(client) {}
+
+CommandAdmission::Ticket::~Ticket() {
+  admission_.release(priority_, client_);
+}
+
+CommandAdmission::CommandAdmission(Config config) : config_(config) {}
+
+bool CommandAdmission::enabled() const {
+  return config_.maxRunning[index(Priority::Normal)] != 0 ||
+      config_.maxRunning[index(Priority::Background)] != 0 ||
+      config_.maxRunningPerClient != 0;
+}
+
+bool CommandAdmission::hasRoomLocked(Priority priority, const void* client)
+    const {
+  if (priority == Priority::Interactive) {
+    return true;
+  }
+  auto limit = config_.maxRunning[index(priority)];
+  if (limit != 0 && stats_.running[index(priority)] >= limit) {
+    return false;
+  }
+  if (config_.maxRunningPerClient != 0) {
+    auto it = runningPerClient_.find(client);
+    if (it != runningPerClient_.end() &&
+        it->second >= config_.maxRunningPerClient) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::unique_ptr<CommandAdmission::Ticket> CommandAdmission::admit(
+    Priority priority,
+    const void* client) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto i = index(priority);
+
+  // grantLocked admits it straight away if the limits allow
+  Waiter waiter{priority, client, nextSeq_++};
+  waiters_.push_back(&waiter);
+  grantLocked();
+
+  if (!waiter.admitted) {
+    ++stats_.queued[i];
+    if (config_.maxQueued != 0 && waiters_.size() > config_.maxQueued) {
+      waiters_.erase(std::find(waiters_.begin(), waiters_.end(), &waiter));
+      ++stats_.rejected[i];
+      return nullptr;
+    }
+
+    ++stats_.waiting[i];
+    auto admitted = [&waiter] { return waiter.admitted; };
+    if (config_.maxWait.count() == 0) {
+      cond_.wait(lock, admitted);
+    } else {
+      cond_.wait_for(lock, config_.maxWait, admitted);
+    }
+    --stats_.waiting[i];
+
+    if (!waiter.admitted) {
+      waiters_.erase(std::find(waiters_.begin(), waiters_.end(), &waiter));
+      ++stats_.rejected[i];
+      return nullptr;
+    }
+  }
+
+  // grantLocked counted it as running
+  ++stats_.admitted[i];
+  return std::unique_ptr<Ticket>(new Ticket(*this, priority, client));
+}
+
+void CommandAdmission::grantLocked() {
+  // Highest priority first, then in the order that they came
+  std::sort(
+      waiters_.begin(), waiters_.end(), [](const Waiter* a, const Waiter* b) {
+        if (a->priority != b->priority) {
+          return index(a->priority) < index(b->priority);
+        }
+        return a->seq < b->seq;
+      });
+
+  bool granted = false;
+  for (auto it = waiters_.begin(); it != waiters_.end();) {
+    auto waiter = *it;
+    if (!hasRoomLocked(waiter->priority, waiter->client)) {
+      ++it;
+      continue;
+    }
+    ++stats_.running[index(waiter->priority)];
+    if (waiter->priority != Priority::Interactive) {
+      ++runningPerClient_[waiter->client];
+    }
+    waiter->admitted = true;
+    it = waiters_.erase(it);
+    granted = true;
+  }
+  if (granted) {
+    cond_.notify_all();
+  }
+}
+
+void CommandAdmission::release(Priority priority, const void* client) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  --stats_.running[index(priority)];
+  if (priority != Priority::Interactive) {
+    auto it = runningPerClient_.find(client);
+    if (it != runningPerClient_.end() && --it->second == 0) {
+      runningPerClient_.erase(it);
+    }
+  }
+  grantLocked();
+}
+
+CommandAdmission::Stats CommandAdmission::getStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+CommandAdmission::Priority CommandAdmission::classify(
+    const char* name,
+    const json_ref& args) {
+  if (!strcmp(name, "find")) {
+    // Its patterns are matched against every file in the tree
+    return Priority::Background;
+  }
+  if (strcmp(name, "query") || json_array_size(args) < 3 ||
+      !args.at(2).isObject()) {
+    // Anything wrong with a query is reported once it runs
+    return Priority::Interactive;
+  }
+
+  const auto& query = args.at(2);
+  Priority estimate;
+  if (query.get_default("since")) {
+    estimate = Priority::Interactive;
+  } else if (
+      query.get_default("path") || query.get_default("glob") ||
+      query.get_default("suffix")) {
+    estimate = Priority::Normal;
+  } else {
+    estimate = Priority::Background;
+  }
+
+  auto declared = query.get_default("priority");
+  if (declared && declared.isString()) {
+    const char* value = json_string_value(declared);
+    for (auto priority :
+         {Priority::Interactive, Priority::Normal, Priority::Background}) {
+      if (!strcmp(value, priorityName(priority)) &&
+          index(priority) > index(estimate)) {
+        return priority;
+      }
+    }
+  }
+  return estimate;
+}
+
+const char* CommandAdmission::priorityName(Priority priority) {
+  switch (priority) {
+    case Priority::Interactive:
+      return "interactive";
+    case Priority::Normal:
+      return "normal";
+    case Priority::Background:
+      return "background";
+  }
+  return "unknown";
+}
+
+CommandAdmission& getCommandAdmission() {
+  static CommandAdmission admission([] {
+    auto limit = [](const char* name) {
+      return size_t(std::max<json_int_t>(0, cfg_get_int(name, 0)));
+    };
+    CommandAdmission::Config config;
+    config.maxRunning[size_t(CommandAdmission::Priority::Normal)] =
+        limit("max_concurrent_queries");
+    config.maxRunning[size_t(CommandAdmission::Priority::Background)] =
+        limit("max_concurrent_background_queries");
+    config.maxRunningPerClient = limit("max_concurrent_queries_per_client");
+    config.maxQueued = limit("max_queued_queries");
+    config.maxWait = std::chrono::milliseconds(limit("query_queue_timeout_ms"));
+    return config;
+  }());
+  return admission;
+}
+} // namespace watchman
@@ -0,0 +1,126 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// Decides when the commands that can be expensive may run, so that a tool
+// that issues a stream of full-tree queries can't hold up the clock and
+// since queries that editors are waiting on.
+//
+// Each command is given a priority.  Interactive commands always run
+// straight away.  The Normal and Background priorities may each have a
+// limit on how many of their commands run at once, and each client may
+// have a limit on how many of its Normal and Background commands run at
+// once.  A command that is over a limit waits for its turn, the Normal
+// ones first, and is rejected if it would wait for too long or if too many
+// are already waiting.
+class CommandAdmission {
+ public:
+  enum class Priority { Interactive = 0, Normal = 1, Background = 2 };
+  static constexpr size_t kNumPriorities = 3;
+
+  struct Config {
+    // The most commands of each priority that may run at once, or 0 for no
+    // limit.  The limit for Interactive is ignored.
+    std::array<size_t, kNumPriorities> maxRunning{{0, 0, 0}};
+    // The most Normal and Background commands of a single client that may
+    // run at once, or 0 for no limit
+    size_t maxRunningPerClient{0};
+    // The most commands that may wait at once, or 0 for no limit
+    size_t maxQueued{0};
+    // How long a command may wait, or 0 to wait for as long as it takes
+    std::chrono::milliseconds maxWait{0};
+  };
+
+  // Lets a command run until it is destroyed
+  class Ticket {
+   public:
+    ~Ticket();
+    Ticket(const Ticket&) = delete;
+    Ticket& operator=(const Ticket&) = delete;
+
+   private:
+    friend class CommandAdmission;
+    Ticket(CommandAdmission& admission, Priority priority, const void* client);
+
+    CommandAdmission& admission_;
+    const Priority priority_;
+    const void* const client_;
+  };
+
+  struct Stats {
+    std::array<uint64_t, kNumPriorities> admitted{{0, 0, 0}};
+    // Commands that had to wait before they were admitted or rejected
+    std::array<uint64_t, kNumPriorities> queued{{0, 0, 0}};
+    std::array<uint64_t, kNumPriorities> rejected{{0, 0, 0}};
+    std::array<size_t, kNumPriorities> running{{0, 0, 0}};
+    std::array<size_t, kNumPriorities> waiting{{0, 0, 0}};
+  };
+
+  explicit CommandAdmission(Config config);
+
+  // Blocks until a command of priority from client may run and returns
+  // the ticket that lets it run, or returns nullptr if it is rejected.
+  // client identifies the client for the per-client limit.
+  std::unique_ptr<Ticket> admit(Priority priority, const void* client);
+
+  Stats getStats();
+
+  const Config& config() const {
+    return config_;
+  }
+
+  // True if any of the limits is set, so that commands may have to wait
+  bool enabled() const;
+
+  // Chooses the priority of a command from its name and arguments.  Queries
+  // that are answered from a clock, and commands other than queries, are
+  // Interactive.  Other queries are Normal if a generator narrows down the
+  // files that they look at, and Background if they look at the whole
+  // tree.  A query may ask for a lower priority than that with "priority"
+  // but not for a higher one.
+  static Priority classify(const char* name, const json_ref& args);
+
+  static const char* priorityName(Priority priority);
+
+ private:
+  struct Waiter {
+    Priority priority;
+    const void* client;
+    uint64_t seq;
+    bool admitted{false};
+  };
+
+  // True if a command of priority from client may run now; called with
+  // mutex_ held
+  bool hasRoomLocked(Priority priority, const void* client) const;
+  // Admits as many waiters as the limits allow; called with mutex_ held
+  void grantLocked();
+  void release(Priority priority, const void* client);
+
+  const Config config_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  uint64_t nextSeq_{1};
+  std::vector<Waiter*> waiters_;
+  // The number of running Normal and Background commands of each client
+  // that has some
+  std::unordered_map<const void*, size_t> runningPerClient_;
+  Stats stats_;
+};
+
+// Returns the admission control configured by the max_concurrent_queries
+// family of options
+CommandAdmission& getCommandAdmission();
+} // namespace watchman
@@ -5,7 +5,9 @@
 
 #include <folly/Conv.h>
 #include <folly/Range.h>
+#include <folly/futures/Future.h>
 #include <stdexcept>
+#include "CommandStats.h"
 
 class json_ref;
 struct watchman_client;
@@ -17,17 +19,33 @@ using command_func = void (*)(watchman_client* client, const json_ref& args);
 // fails
 using cli_cmd_validate_func = void (*)(json_ref& args);
 
+// Starts what the command would otherwise block on first, such as the
+// crawl of its root or a sync of it, and returns a future that is fulfilled
+// once that is done, or with the error that it failed with.  The command
+// is only dispatched after that, so that nothing is held up while it
+// waits; see start_command_wait().
+using command_wait_func = folly::Future<folly::Unit> (*)(
+    watchman_client* client,
+    const json_ref& args);
+
 using command_flags = int;
 constexpr int CMD_DAEMON = 1;
 constexpr int CMD_CLIENT = 2;
 constexpr int CMD_POISON_IMMUNE = 4;
 constexpr int CMD_ALLOW_ANY_USER = 8;
+// The command only uses the client to send its responses, so a tagged
+// request for it may run on a worker thread, concurrently with the other
+// requests of the same client
+constexpr int CMD_CONCURRENT = 16;
 
 struct command_handler_def {
   const char* name;
   command_func func;
   command_flags flags;
   cli_cmd_validate_func cli_validate;
+  command_wait_func wait;
+  // Counted by dispatch_command
+  CommandStats stats;
 };
 
 class CommandValidationError : public std::runtime_error {
@@ -50,16 +68,22 @@ command_handler_def* lookup_command(folly::StringPiece cmd_name, int mode);
 
 std::vector<command_handler_def*> get_all_commands();
 
-#define W_CMD_REG_1(symbol, name, func, flags, clivalidate) \
-  static w_ctor_fn_type(symbol) {                           \
-    static ::watchman::command_handler_def d = {            \
-        name, func, flags, clivalidate};                    \
-    ::watchman::register_command(d);                        \
-  }                                                         \
+#define W_CMD_REG_1(symbol, name, func, flags, clivalidate, wait) \
+  static w_ctor_fn_type(symbol) {                                 \
+    static ::watchman::command_handler_def d = {                  \
+        name, func, flags, clivalidate, wait};                    \
+    ::watchman::register_command(d);                              \
+  }                                                               \
   w_ctor_fn_reg(symbol)
 
 #define W_CMD_REG(name, func, flags, clivalidate) \
-  W_CMD_REG_1(w_gen_symbol(w_cmd_register_), name, func, flags, clivalidate)
+  W_CMD_REG_1(                                    \
+      w_gen_symbol(w_cmd_register_), name, func, flags, clivalidate, nullptr)
+
+// As W_CMD_REG, for a command with a command_wait_func
+#define W_CMD_REG_WAIT(name, func, flags, clivalidate, wait) \
+  W_CMD_REG_1(                                               \
+      w_gen_symbol(w_cmd_register_), name, func, flags, clivalidate, wait)
 
 #define W_CAP_REG1(symbol, name)           \
   static w_ctor_fn_type(symbol) {          \
@@ -0,0 +1,189 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "CommandStats.h"
+#include <memory>
+
+namespace watchman {
+
+CommandStats::Pdu CommandStats::pduFor(w_pdu_type pduType) {
+  switch (pduType) {
+    case is_json_compact:
+    case is_json_pretty:
+      return Pdu::Json;
+    case is_bser:
+      return Pdu::Bser;
+    case is_bser_v2:
+      return Pdu::BserV2;
+    case is_bser_v3:
+      return Pdu::BserV3;
+    default:
+      return Pdu::Other;
+  }
+}
+
+CommandStats::ClientClass CommandStats::clientClassFor(
+    pid_t pid,
+    bool isOwner) {
+  if (pid == 0) {
+    return ClientClass::Unknown;
+  }
+  return isOwner ? ClientClass::Owner : ClientClass::OtherUser;
+}
+
+const char* CommandStats::pduName(Pdu pdu) {
+  switch (pdu) {
+    case Pdu::Json:
+      return "json";
+    case Pdu::Bser:
+      return "bser";
+    case Pdu::BserV2:
+      return "bser-v2";
+    case Pdu::BserV3:
+      return "bser-v3";
+    default:
+      return "other";
+  }
+}
+
+const char* CommandStats::clientClassName(ClientClass clientClass) {
+  switch (clientClass) {
+    case ClientClass::Owner:
+      return "owner";
+    case ClientClass::OtherUser:
+      return "other-user";
+    default:
+      return "unknown";
+  }
+}
+
+CommandStats::~CommandStats() {
+  for (auto& slot : latencyUs_) {
+    delete slot.load(std::memory_order_relaxed);
+  }
+}
+
+size_t CommandStats::slotFor(Pdu pdu, ClientClass clientClass) {
+  return size_t(pdu) * kNumClientClasses + size_t(clientClass);
+}
+
+const Histogram* CommandStats::latencyUs(Pdu pdu, ClientClass clientClass)
+    const {
+  return latencyUs_[slotFor(pdu, clientClass)].load(
+      std::memory_order_acquire);
+}
+
+Histogram& CommandStats::latencyFor(Pdu pdu, ClientClass clientClass) {
+  auto& slot = latencyUs_[slotFor(pdu, clientClass)];
+  auto histogram = slot.load(std::memory_order_acquire);
+  if (histogram) {
+    return *histogram;
+  }
+  auto created = std::make_unique<Histogram>();
+  if (slot.compare_exchange_strong(
+          histogram, created.get(), std::memory_order_acq_rel)) {
+    return *created.release();
+  }
+  // Another thread got there first
+  return *histogram;
+}
+
+CommandStats::Call::Call(
+    CommandStats& stats,
+    Pdu pdu,
+    ClientClass clientClass)
+    : stats_(stats),
+      pdu_(pdu),
+      clientClass_(clientClass),
+      start_(std::chrono::steady_clock::now()) {
+  stats_.calls_.fetch_add(1, std::memory_order_relaxed);
+  stats_.inflight_.fetch_add(1, std::memory_order_relaxed);
+}
+
+CommandStats::Call::~Call() {
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start_);
+  stats_.latencyFor(pdu_, clientClass_).record(uint64_t(elapsed.count()));
+  if (failed_) {
+    stats_.errors_.fetch_add(1, std::memory_order_relaxed);
+  }
+  stats_.inflight_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+json_ref CommandStats::toJson(bool reset) {
+  auto latencies = json_array();
+  for (size_t p = 0; p < kNumPdus; ++p) {
+    for (size_t c = 0; c < kNumClientClasses; ++c) {
+      auto pdu = Pdu(p);
+      auto clientClass = ClientClass(c);
+      auto histogram = latencyUs_[slotFor(pdu, clientClass)].load(
+          std::memory_order_acquire);
+      if (!histogram || histogram->count() == 0) {
+        continue;
+      }
+      json_array_append_new(
+          latencies,
+          json_object(
+              {{"pdu", typed_string_to_json(pduName(pdu), W_STRING_UNICODE)},
+               {"client",
+                typed_string_to_json(
+                    clientClassName(clientClass), W_STRING_UNICODE)},
+               {"latency_us", histogram->toJson()}}));
+      if (reset) {
+        histogram->reset();
+      }
+    }
+  }
+
+  auto result = json_object(
+      {{"calls", json_integer(calls())},
+       {"errors", json_integer(errors())},
+       {"inflight", json_integer(inflight())},
+       {"latencies", std::move(latencies)}});
+  if (reset) {
+    calls_.store(0, std::memory_order_relaxed);
+    errors_.store(0, std::memory_order_relaxed);
+  }
+  return result;
+}
+
+void CommandStats::addMetrics(MetricsWriter& metrics, const char* command)
+    const {
+  w_string name(command, W_STRING_UNICODE);
+  MetricsWriter::Labels labels{{"command", name}};
+  metrics.counter(
+      "watchman_command_calls_total",
+      "Times that the command was dispatched",
+      calls(),
+      labels);
+  metrics.counter(
+      "watchman_command_errors_total",
+      "Times that the command failed",
+      errors(),
+      labels);
+  metrics.gauge(
+      "watchman_command_inflight",
+      "Dispatches of the command that are under way",
+      inflight(),
+      labels);
+  for (size_t p = 0; p < kNumPdus; ++p) {
+    for (size_t c = 0; c < kNumClientClasses; ++c) {
+      auto pdu = Pdu(p);
+      auto clientClass = ClientClass(c);
+      auto histogram = latencyUs(pdu, clientClass);
+      if (!histogram) {
+        continue;
+      }
+      metrics.histogram(
+          "watchman_command_latency_us",
+          "Microseconds that dispatches of the command took, by the "
+          "encoding of the request and the kind of client",
+          *histogram,
+          {{"command", name},
+           {"pdu", w_string(pduName(pdu), W_STRING_UNICODE)},
+           {"client",
+            w_string(clientClassName(clientClass), W_STRING_UNICODE)}});
+    }
+  }
+}
+
+} // namespace watchman
@@ -0,0 +1,98 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include "Histogram.h"
+#include "Metrics.h"
+#include "watchman_pdu.h"
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// Counts the dispatches of a command, the ones that failed and those that
+// are under way, and keeps the distribution of their latencies by the
+// encoding of the request and the kind of client that sent it.  Each
+// command_handler_def has one of these, so that the commands that load
+// the server the most can be picked out.  Counting a dispatch takes a few
+// relaxed atomic increments, without locking; the histogram for an
+// encoding and kind of client is allocated the first time that it is
+// needed, and kept for as long as the process runs.
+class CommandStats {
+ public:
+  // The encodings of requests that latencies are broken down by
+  enum class Pdu { Json, Bser, BserV2, BserV3, Other };
+  static constexpr size_t kNumPdus = 5;
+  // The kinds of clients: those that run as the user that owns the
+  // server, those that run as another user, and those whose process
+  // can't be told, such as on Windows
+  enum class ClientClass { Owner, OtherUser, Unknown };
+  static constexpr size_t kNumClientClasses = 3;
+
+  static Pdu pduFor(w_pdu_type pduType);
+  static ClientClass clientClassFor(pid_t pid, bool isOwner);
+  static const char* pduName(Pdu pdu);
+  static const char* clientClassName(ClientClass clientClass);
+
+  CommandStats() = default;
+  CommandStats(const CommandStats&) = delete;
+  CommandStats& operator=(const CommandStats&) = delete;
+  ~CommandStats();
+
+  // Counts a dispatch from when it is constructed until it is destroyed
+  class Call {
+   public:
+    Call(CommandStats& stats, Pdu pdu, ClientClass clientClass);
+    ~Call();
+    Call(const Call&) = delete;
+    Call& operator=(const Call&) = delete;
+
+    // The command failed, such as by sending an error response
+    void fail() {
+      failed_ = true;
+    }
+
+   private:
+    CommandStats& stats_;
+    Pdu pdu_;
+    ClientClass clientClass_;
+    std::chrono::steady_clock::time_point start_;
+    bool failed_{false};
+  };
+
+  uint64_t calls() const {
+    return calls_.load(std::memory_order_relaxed);
+  }
+  uint64_t errors() const {
+    return errors_.load(std::memory_order_relaxed);
+  }
+  uint64_t inflight() const {
+    return inflight_.load(std::memory_order_relaxed);
+  }
+  // The latencies of the dispatches with pdu from clients of clientClass,
+  // or null if there haven't been any
+  const Histogram* latencyUs(Pdu pdu, ClientClass clientClass) const;
+
+  // Returns the calls, errors and inflight, and the latencies of each
+  // encoding and kind of client that there have been dispatches for.  If
+  // reset is true, all but inflight are then cleared.
+  json_ref toJson(bool reset);
+
+  // Adds the counters and latencies, labelled with the name of command
+  void addMetrics(MetricsWriter& metrics, const char* command) const;
+
+ private:
+  static size_t slotFor(Pdu pdu, ClientClass clientClass);
+  Histogram& latencyFor(Pdu pdu, ClientClass clientClass);
+
+  std::atomic<uint64_t> calls_{0};
+  std::atomic<uint64_t> errors_{0};
+  std::atomic<uint64_t> inflight_{0};
+  std::array<std::atomic<Histogram*>, kNumPdus * kNumClientClasses>
+      latencyUs_{};
+};
+
+} // namespace watchman
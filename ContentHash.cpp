@@ -1,6 +1,8 @@
 /* Copyright 2017-present Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 */
 #include "ContentHash.h"
+#include "ContentHashRemote.h"
+#include "ContentHashStore.h"
 #include "ThreadPool.h"
 #include "watchman_hash.h"
 #include "watchman_stream.h"
@@ -12,10 +14,24 @@
 #else
 #include <openssl/sha.h>
 #endif
+#ifdef HAVE_BLAKE3_H
+#include <blake3.h>
+#endif
+#ifdef HAVE_XXHASH_H
+#include <xxhash.h>
+#endif
 #include <folly/ScopeGuard.h>
+#include <folly/String.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include <algorithm>
+#include <cstring>
+#include <memory>
 #include <string>
 #include "FileSystem.h"
 #include "Logging.h"
+#include "MappedFileErrors.h"
 
 using folly::to;
 
@@ -26,21 +42,43 @@ using Node = typename ContentHashCache::Node;
 
 bool ContentHashCacheKey::operator==(const ContentHashCacheKey& other) const {
   return fileSize == other.fileSize && mtime.tv_sec == other.mtime.tv_sec &&
-      mtime.tv_nsec == other.mtime.tv_nsec &&
-      relativePath == other.relativePath;
+      mtime.tv_nsec == other.mtime.tv_nsec && ino == other.ino &&
+      algorithm == other.algorithm && relativePath == other.relativePath;
 }
 
 std::size_t ContentHashCacheKey::hashValue() const {
   return hash_128_to_64(
       w_string_hval(relativePath),
-      hash_128_to_64(fileSize, hash_128_to_64(mtime.tv_sec, mtime.tv_nsec)));
+      hash_128_to_64(
+          hash_128_to_64(fileSize, uint64_t(algorithm)),
+          hash_128_to_64(
+              hash_128_to_64(mtime.tv_sec, mtime.tv_nsec), ino)));
 }
 
+namespace {
+size_t weighHash(const ContentHashCacheKey& key, const HashValue&) {
+  using Cache = ShardedLRUCache<ContentHashCacheKey, HashValue>::ShardType;
+  return Cache::kItemOverhead + key.relativePath.size();
+}
+} // namespace
+
 ContentHashCache::ContentHashCache(
     const w_string& rootPath,
     size_t maxItems,
-    std::chrono::milliseconds errorTTL)
-    : cache_(maxItems, errorTTL), rootPath_(rootPath) {}
+    std::chrono::milliseconds errorTTL,
+    std::shared_ptr<ContentHashStore> store,
+    size_t maxBytes,
+    std::shared_ptr<CacheMemoryBudget> budget,
+    std::shared_ptr<ContentHashRemote> remote)
+    : cache_(
+          maxItems,
+          errorTTL,
+          (maxBytes > 0 || budget) ? weighHash : nullptr,
+          maxBytes,
+          std::move(budget)),
+      rootPath_(rootPath),
+      store_(std::move(store)),
+      remote_(std::move(remote)) {}
 
 folly::Future<std::shared_ptr<const Node>> ContentHashCache::get(
     const ContentHashCacheKey& key) {
@@ -48,24 +86,174 @@ folly::Future<std::shared_ptr<const Node>> ContentHashCache::get(
       key, [this](const ContentHashCacheKey& k) { return computeHash(k); });
 }
 
-HashValue ContentHashCache::computeHashImmediate(const char* fullPath) {
-  HashValue result;
-  uint8_t buf[8192];
+std::shared_ptr<const Node> ContentHashCache::peek(
+    const ContentHashCacheKey& key) {
+  try {
+    auto node = cache_.get(key);
+    if (node && node->result().hasValue()) {
+      return node;
+    }
+  } catch (const std::runtime_error&) {
+    // The hash is still being computed
+  }
+  return nullptr;
+}
 
-  auto stm = w_stm_open(fullPath, O_RDONLY);
-  if (!stm) {
-    throw std::system_error(
-        errno,
-        std::generic_category(),
-        to<std::string>("w_stm_open ", fullPath));
+std::vector<folly::Future<std::shared_ptr<const Node>>>
+ContentHashCache::getBatch(const std::vector<ContentHashCacheKey>& keys) {
+  struct Miss {
+    ContentHashCacheKey key;
+    folly::Promise<HashValue> promise;
+  };
+  using Batch = std::vector<Miss>;
+
+  std::vector<Miss> misses;
+  std::vector<folly::Future<std::shared_ptr<const Node>>> futures;
+  futures.reserve(keys.size());
+  for (auto& key : keys) {
+    futures.emplace_back(
+        cache_.get(key, [&misses](const ContentHashCacheKey& k) {
+          misses.push_back(Miss{k, folly::Promise<HashValue>()});
+          return misses.back().promise.getFuture();
+        }));
+  }
+  if (misses.empty()) {
+    return futures;
   }
 
+  // Aim for a couple of batches per worker, so that a worker that draws
+  // a batch of slow files doesn't hold up the rest for long
+  uint64_t totalBytes = 0;
+  for (auto& miss : misses) {
+    totalBytes += miss.key.fileSize;
+  }
+  auto workers = std::max(getThreadPool().numWorkers(), size_t(1));
+  auto batchBytes = std::min(
+      std::max(totalBytes / (workers * 2), kMinBatchBytes), kMaxBatchBytes);
+
+  // Start with the largest files; they take the longest
+  std::sort(misses.begin(), misses.end(), [](const Miss& a, const Miss& b) {
+    return a.key.fileSize > b.key.fileSize;
+  });
+
+  auto schedule = [this](std::shared_ptr<Batch> batch) {
+    try {
+      getThreadPool().add(
+          ThreadPool::Priority::Interactive, this, [this, batch] {
+            for (auto& miss : *batch) {
+              miss.promise.setWith(
+                  [&] { return lookupOrComputeHash(miss.key); });
+            }
+          });
+    } catch (const std::exception& exc) {
+      for (auto& miss : *batch) {
+        miss.promise.setException(
+            folly::exception_wrapper(std::current_exception(), exc));
+      }
+    }
+  };
+
+  auto batch = std::make_shared<Batch>();
+  uint64_t bytes = 0;
+  for (auto& miss : misses) {
+    if (!batch->empty() &&
+        (bytes + miss.key.fileSize > batchBytes ||
+         batch->size() >= kMaxBatchFiles)) {
+      schedule(std::move(batch));
+      batch = std::make_shared<Batch>();
+      bytes = 0;
+    }
+    bytes += miss.key.fileSize;
+    batch->push_back(std::move(miss));
+  }
+  schedule(std::move(batch));
+
+  return futures;
+}
+
+folly::Future<std::shared_ptr<const Node>> ContentHashCache::getOnThisThread(
+    const ContentHashCacheKey& key,
+    bool& computed) {
+  computed = false;
+  return cache_.get(key, [this, &computed](const ContentHashCacheKey& k) {
+    computed = true;
+    return folly::makeFutureWith([&] { return lookupOrComputeHash(k); });
+  });
+}
+
+namespace {
+// The fast hash functions consume data far quicker than a small buffer
+// can be refilled, so we read in large chunks to amortize the syscalls
+constexpr int kReadSize = 256 * 1024;
+
+// How far ahead of the hash of a large file we ask the kernel to read.
+// None of the hash functions can be split across threads without
+// changing the digest, so this is how we keep the disk busy while the
+// hash is computed.
+constexpr off_t kReadAheadSize = 8 * 1024 * 1024;
+
 #ifndef _WIN32
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
+// Files at least this large are hashed straight from a mapping of the
+// file rather than being copied into the buffer a chunk at a time, which
+// for the largest files spares many syscalls and copies
+constexpr uint64_t kMapMinSize = 4 * 1024 * 1024;
+
+// Passes the whole of the file open as fd to update at once, from a
+// mapping of it.  Returns false if the file is too small to be worth
+// mapping or couldn't be mapped, in which case it should be read instead.
+template <typename Update>
+bool readMapped(
+    const FileDescriptor& fd,
+    const char* fullPath,
+    Update& update) {
+  auto size = uint64_t(fd.getInfo().size);
+  // A file too large to be mapped in its entirety is read instead
+  if (size < kMapMinSize || uint64_t(size_t(size)) != size) {
+    return false;
+  }
+  auto addr = mmap(nullptr, size_t(size), PROT_READ, MAP_PRIVATE, fd.fd(), 0);
+  if (addr == MAP_FAILED) {
+    log(DBG,
+        "reading ",
+        fullPath,
+        " since it couldn't be mapped: ",
+        folly::errnoStr(errno),
+        "\n");
+    return false;
+  }
+  SCOPE_EXIT {
+    munmap(addr, size_t(size));
+  };
+  // The kernel reads ahead more aggressively, and drops the pages behind
+  madvise(addr, size_t(size), MADV_SEQUENTIAL);
+
+  auto data = static_cast<const uint8_t*>(addr);
+  if (!catchMappedFileErrors([&] { update(data, size_t(size)); })) {
+    throw std::runtime_error(to<std::string>(
+        fullPath,
+        " was truncated while it was being hashed; query again to get "
+        "latest status"));
+  }
+  return true;
+}
+#endif
 
+// Reads the whole of stm, passing each chunk to update
+template <typename Update>
+void readChunks(watchman_stream* stm, const char* fullPath, Update&& update) {
+#ifndef _WIN32
+  if (readMapped(stm->getFileDescriptor(), fullPath, update)) {
+    return;
+  }
+#endif
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[kReadSize]);
+#ifdef POSIX_FADV_WILLNEED
+  auto fd = stm->getFileDescriptor().fd();
+  off_t offset = 0;
+  off_t advised = 0;
+#endif
   while (true) {
-    auto n = stm->read(buf, sizeof(buf));
+    auto n = stm->read(buf.get(), kReadSize);
     if (n == 0) {
       break;
     }
@@ -75,9 +263,39 @@ HashValue ContentHashCache::computeHashImmediate(const char* fullPath) {
           std::generic_category(),
           to<std::string>("while reading from ", fullPath));
     }
-    SHA1_Update(&ctx, buf, n);
+#ifdef POSIX_FADV_WILLNEED
+    offset += n;
+    if (n == kReadSize && advised < offset + kReadAheadSize / 2) {
+      // This is a large file; start reading the next part of it so that
+      // it is in the page cache by the time that we get to it
+      if (advised == 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        advised = offset;
+      }
+      posix_fadvise(fd, advised, kReadAheadSize, POSIX_FADV_WILLNEED);
+      advised += kReadAheadSize;
+    }
+#endif
+    update(buf.get(), size_t(n));
   }
+}
+
+// Inputs are grouped into batches of roughly this many bytes, so that
+// small files don't each pay for a task of their own
+constexpr uint64_t kMinBatchBytes = 1024 * 1024;
+constexpr uint64_t kMaxBatchBytes = 64 * 1024 * 1024;
+constexpr size_t kMaxBatchFiles = 256;
 
+void computeSha1(
+    watchman_stream* stm,
+    const char* fullPath,
+    HashValue& result) {
+#ifndef _WIN32
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  readChunks(stm, fullPath, [&](const uint8_t* data, size_t size) {
+    SHA1_Update(&ctx, data, size);
+  });
   SHA1_Final(result.data(), &ctx);
 #else
   // Use the built-in crypt provider API on windows to avoid introducing a
@@ -106,37 +324,132 @@ HashValue ContentHashCache::computeHashImmediate(const char* fullPath) {
     CryptDestroyHash(ctx);
   };
 
-  while (true) {
-    auto n = stm->read(buf, sizeof(buf));
-    if (n == 0) {
-      break;
-    }
-    if (n < 0) {
-      throw std::system_error(
-          errno,
-          std::generic_category(),
-          to<std::string>("while reading from ", fullPath));
-    }
-
-    if (!CryptHashData(ctx, buf, n, 0)) {
+  readChunks(stm, fullPath, [&](const uint8_t* data, size_t size) {
+    if (!CryptHashData(ctx, data, DWORD(size), 0)) {
       throw std::system_error(
           GetLastError(), std::system_category(), "CryptHashData");
     }
-  }
+  });
 
-  DWORD size = result.size();
+  DWORD size = contentHashSize(ContentHashAlgorithm::Sha1);
   if (!CryptGetHashParam(ctx, HP_HASHVAL, result.data(), &size, 0)) {
     throw std::system_error(
         GetLastError(), std::system_category(), "CryptGetHashParam HP_HASHVAL");
   }
 #endif
-  return result;
+}
+
+#ifdef HAVE_BLAKE3_H
+void computeBlake3(
+    watchman_stream* stm,
+    const char* fullPath,
+    HashValue& result) {
+  blake3_hasher hasher;
+  blake3_hasher_init(&hasher);
+  readChunks(stm, fullPath, [&](const uint8_t* data, size_t size) {
+    blake3_hasher_update(&hasher, data, size);
+  });
+  blake3_hasher_finalize(&hasher, result.data(), BLAKE3_OUT_LEN);
+}
+#endif
+
+#ifdef HAVE_XXHASH_H
+void computeXxh128(
+    watchman_stream* stm,
+    const char* fullPath,
+    HashValue& result) {
+  auto state = XXH3_createState();
+  if (!state) {
+    throw std::bad_alloc();
+  }
+  SCOPE_EXIT {
+    XXH3_freeState(state);
+  };
+  XXH3_128bits_reset(state);
+  readChunks(stm, fullPath, [&](const uint8_t* data, size_t size) {
+    XXH3_128bits_update(state, data, size);
+  });
+
+  // The canonical form is big endian, matching the output of xxh128sum
+  XXH128_canonical_t canonical;
+  XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state));
+  memcpy(result.data(), canonical.digest, sizeof(canonical.digest));
+}
+#endif
+} // namespace
+
+size_t contentHashSize(ContentHashAlgorithm algorithm) {
+  switch (algorithm) {
+    case ContentHashAlgorithm::Sha1:
+      return 20;
+    case ContentHashAlgorithm::Blake3:
+      return 32;
+    case ContentHashAlgorithm::Xxh128:
+      return 16;
+  }
+  return 0;
+}
+
+bool isContentHashAlgorithmAvailable(ContentHashAlgorithm algorithm) {
+  switch (algorithm) {
+    case ContentHashAlgorithm::Sha1:
+      return true;
+    case ContentHashAlgorithm::Blake3:
+#ifdef HAVE_BLAKE3_H
+      return true;
+#else
+      return false;
+#endif
+    case ContentHashAlgorithm::Xxh128:
+#ifdef HAVE_XXHASH_H
+      return true;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+HashValue ContentHashCache::computeHashImmediate(
+    const char* fullPath,
+    ContentHashAlgorithm algorithm) {
+  HashValue result{};
+
+  auto stm = w_stm_open(fullPath, O_RDONLY);
+  if (!stm) {
+    throw std::system_error(
+        errno,
+        std::generic_category(),
+        to<std::string>("w_stm_open ", fullPath));
+  }
+
+  switch (algorithm) {
+    case ContentHashAlgorithm::Sha1:
+      computeSha1(stm.get(), fullPath, result);
+      return result;
+    case ContentHashAlgorithm::Blake3:
+#ifdef HAVE_BLAKE3_H
+      computeBlake3(stm.get(), fullPath, result);
+      return result;
+#else
+      break;
+#endif
+    case ContentHashAlgorithm::Xxh128:
+#ifdef HAVE_XXHASH_H
+      computeXxh128(stm.get(), fullPath, result);
+      return result;
+#else
+      break;
+#endif
+  }
+  throw std::runtime_error(
+      "this build of watchman does not support the requested content hash");
 }
 
 HashValue ContentHashCache::computeHashImmediate(
     const ContentHashCacheKey& key) const {
   auto fullPath = w_string::pathCat({rootPath_, key.relativePath});
-  auto result = computeHashImmediate(fullPath.c_str());
+  auto result = computeHashImmediate(fullPath.c_str(), key.algorithm);
 
   // Since TOCTOU is everywhere and everything, double check to make sure that
   // the file looks like we were expecting at the start.  If it isn't, then
@@ -145,7 +458,8 @@ HashValue ContentHashCache::computeHashImmediate(
   auto stat = getFileInformation(fullPath.c_str());
   if (size_t(stat.size) != key.fileSize ||
       stat.mtime.tv_sec != key.mtime.tv_sec ||
-      stat.mtime.tv_nsec != key.mtime.tv_nsec) {
+      stat.mtime.tv_nsec != key.mtime.tv_nsec ||
+      (key.ino != 0 && uint64_t(stat.ino) != key.ino)) {
     throw std::runtime_error(
         "metadata changed during hashing; query again to get latest status");
   }
@@ -156,7 +470,26 @@ HashValue ContentHashCache::computeHashImmediate(
 folly::Future<HashValue> ContentHashCache::computeHash(
     const ContentHashCacheKey& key) const {
   return folly::via(
-      &getThreadPool(), [key, this] { return computeHashImmediate(key); });
+      &getThreadPool(), [key, this] { return lookupOrComputeHash(key); });
+}
+
+HashValue ContentHashCache::lookupOrComputeHash(
+    const ContentHashCacheKey& key) const {
+  if (store_) {
+    auto stored = store_->lookup(key);
+    if (stored) {
+      return *stored;
+    }
+  }
+  folly::Optional<HashValue> shared;
+  if (remote_) {
+    shared = remote_->lookup(key);
+  }
+  auto result = shared ? *shared : computeHashImmediate(key);
+  if (store_) {
+    store_->store(key, result);
+  }
+  return result;
 }
 
 const w_string& ContentHashCache::rootPath() const {
@@ -166,4 +499,12 @@ const w_string& ContentHashCache::rootPath() const {
 CacheStats ContentHashCache::stats() const {
   return cache_.stats();
 }
+
+const std::shared_ptr<ContentHashStore>& ContentHashCache::store() const {
+  return store_;
+}
+
+const std::shared_ptr<ContentHashRemote>& ContentHashCache::remote() const {
+  return remote_;
+}
 } // namespace watchman
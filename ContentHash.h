@@ -4,9 +4,30 @@
 #include "watchman_system.h"
 #include "watchman_string.h"
 #include <array>
+#include <memory>
+#include <vector>
 #include "LRUCache.h"
 
 namespace watchman {
+// The content hash functions that we know how to compute.  SHA-1 is
+// always available; the others are optional dependencies that are much
+// cheaper to compute on large files.
+enum class ContentHashAlgorithm : uint8_t {
+  Sha1,
+  Blake3,
+  Xxh128,
+};
+constexpr size_t kNumContentHashAlgorithms = 3;
+
+// The size of the largest digest produced by any of the algorithms
+constexpr size_t kMaxContentHashSize = 32;
+
+// Returns the size in bytes of the digest produced by algorithm
+size_t contentHashSize(ContentHashAlgorithm algorithm);
+
+// Returns true if this build is able to compute algorithm
+bool isContentHashAlgorithmAvailable(ContentHashAlgorithm algorithm);
+
 struct ContentHashCacheKey {
   // Path relative to the watched root
   w_string relativePath;
@@ -14,6 +35,11 @@ struct ContentHashCacheKey {
   size_t fileSize;
   // The modification time
   struct timespec mtime;
+  // The inode number; files that are replaced, rather than modified in
+  // place, may otherwise be indistinguishable from their predecessor
+  uint64_t ino{0};
+  // The hash function to apply to the content
+  ContentHashAlgorithm algorithm{ContentHashAlgorithm::Sha1};
 
   // Computes a hash value for use in the cache map
   std::size_t hashValue() const;
@@ -31,18 +57,32 @@ struct hash<watchman::ContentHashCacheKey> {
 } // namespace std
 
 namespace watchman {
+class ContentHashRemote;
+class ContentHashStore;
+
 class ContentHashCache {
  public:
-  using HashValue = std::array<uint8_t, 20>;
-  using Node = LRUCache<ContentHashCacheKey, HashValue>::NodeType;
+  // Holds the digest in its first contentHashSize(algorithm) bytes;
+  // the remainder is zero filled
+  using HashValue = std::array<uint8_t, kMaxContentHashSize>;
+  using Node = ShardedLRUCache<ContentHashCacheKey, HashValue>::NodeType;
 
   // Construct a cache for a given root, holding the specified
   // maximum number of items, using the configured negative
-  // caching TTL.
+  // caching TTL.  If store is provided, hashes that are not in the
+  // cache are looked up in, and recorded in, that persistent store.
+  // If maxBytes is not 0, the estimated size of the items is limited
+  // to it too.  If budget is provided, that size is charged to it.
+  // If remote is provided, hashes that are in neither are looked up in
+  // that shared tier before the file is read.
   ContentHashCache(
       const w_string& rootPath,
       size_t maxItems,
-      std::chrono::milliseconds errorTTL);
+      std::chrono::milliseconds errorTTL,
+      std::shared_ptr<ContentHashStore> store = nullptr,
+      size_t maxBytes = 0,
+      std::shared_ptr<CacheMemoryBudget> budget = nullptr,
+      std::shared_ptr<ContentHashRemote> remote = nullptr);
 
   // Obtain the content hash for the given input.
   // If the result is in the cache it will return a ready future
@@ -52,6 +92,26 @@ class ContentHashCache {
   folly::Future<std::shared_ptr<const Node>> get(
       const ContentHashCacheKey& key);
 
+  // Returns the cached hash of the given input, or nullptr if it isn't
+  // cached, is still being computed, or couldn't be computed.  Never
+  // computes the hash.
+  std::shared_ptr<const Node> peek(const ContentHashCacheKey& key);
+
+  // Obtain the content hashes for a set of inputs, returning a future
+  // for each of them in the same order.  The inputs that are not cached
+  // are hashed in the thread pool in batches, sized so that the work is
+  // spread across all of the workers without queueing a task per file.
+  std::vector<folly::Future<std::shared_ptr<const Node>>> getBatch(
+      const std::vector<ContentHashCacheKey>& keys);
+
+  // Like get(), except that a hash that isn't cached is computed on the
+  // calling thread rather than in the thread pool, so that the I/O is
+  // subject to the scheduling and I/O priority of the caller.
+  // computed is set to true if the hash wasn't already cached.
+  folly::Future<std::shared_ptr<const Node>> getOnThisThread(
+      const ContentHashCacheKey& key,
+      bool& computed);
+
   // Compute the hash value for a given input.
   // This will block the calling thread while the I/O is performed.
   // Throws exceptions for any errors that may occur.
@@ -60,7 +120,9 @@ class ContentHashCache {
   // Compute the hash value for a given input.
   // This will block the calling thread while the I/O is performed.
   // Throws exceptions for any errors that may occur.
-  static HashValue computeHashImmediate(const char* fullPath);
+  static HashValue computeHashImmediate(
+      const char* fullPath,
+      ContentHashAlgorithm algorithm = ContentHashAlgorithm::Sha1);
 
   // Compute the hash value for a given input via the thread pool.
   // Returns a future to operate on the result of this async operation
@@ -72,8 +134,20 @@ class ContentHashCache {
   // Returns cache statistics
   CacheStats stats() const;
 
+  // Returns the persistent store, if any
+  const std::shared_ptr<ContentHashStore>& store() const;
+
+  // Returns the shared tier, if any
+  const std::shared_ptr<ContentHashRemote>& remote() const;
+
  private:
-  LRUCache<ContentHashCacheKey, HashValue> cache_;
+  // Consults the persistent store and the shared tier, if any, before
+  // computing the hash
+  HashValue lookupOrComputeHash(const ContentHashCacheKey& key) const;
+
+  ShardedLRUCache<ContentHashCacheKey, HashValue> cache_;
   w_string rootPath_;
+  std::shared_ptr<ContentHashStore> store_;
+  std::shared_ptr<ContentHashRemote> remote_;
 };
 } // namespace watchman
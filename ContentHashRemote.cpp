@@ -0,0 +1,231 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "ContentHashRemote.h"
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include "Logging.h"
+#include "scm/SCM.h"
+
+namespace watchman {
+
+ContentHashRemote::ContentHashRemote(
+    w_string sharedDir,
+    std::unique_ptr<SCM> scm,
+    w_string mergeBaseWith,
+    std::chrono::milliseconds statusTTL)
+    : sharedDir_(std::move(sharedDir)),
+      scm_(std::move(scm)),
+      mergeBaseWith_(std::move(mergeBaseWith)),
+      statusTTL_(statusTTL) {}
+
+ContentHashRemote::~ContentHashRemote() = default;
+
+const char* ContentHashRemote::algorithmName(ContentHashAlgorithm algorithm) {
+  switch (algorithm) {
+    case ContentHashAlgorithm::Sha1:
+      return "sha1";
+    case ContentHashAlgorithm::Blake3:
+      return "blake3";
+    case ContentHashAlgorithm::Xxh128:
+      return "xxh128";
+  }
+  return "unknown";
+}
+
+ContentHashRemote::Manifest ContentHashRemote::parseManifest(
+    folly::StringPiece data,
+    ContentHashAlgorithm algorithm) {
+  Manifest manifest;
+  auto hashSize = contentHashSize(algorithm);
+  size_t lineNumber = 0;
+  while (!data.empty()) {
+    ++lineNumber;
+    auto eol = data.find('\n');
+    auto line = data.subpiece(0, eol);
+    data.advance(eol == folly::StringPiece::npos ? data.size() : eol + 1);
+    if (line.empty()) {
+      continue;
+    }
+
+    auto malformed = [&] {
+      return std::runtime_error(folly::to<std::string>(
+          "malformed ",
+          algorithmName(algorithm),
+          " manifest at line ",
+          lineNumber));
+    };
+    auto digestEnd = line.find(' ');
+    if (digestEnd == folly::StringPiece::npos) {
+      throw malformed();
+    }
+    auto sizeEnd = line.find(' ', digestEnd + 1);
+    if (sizeEnd == folly::StringPiece::npos || sizeEnd + 1 == line.size()) {
+      throw malformed();
+    }
+
+    std::string digest;
+    if (!folly::unhexlify(line.subpiece(0, digestEnd), digest) ||
+        digest.size() != hashSize) {
+      throw malformed();
+    }
+    auto size = folly::tryTo<size_t>(
+        line.subpiece(digestEnd + 1, sizeEnd - digestEnd - 1));
+    if (!size.hasValue()) {
+      throw malformed();
+    }
+
+    ManifestEntry entry{*size, HashValue{}};
+    memcpy(entry.hash.data(), digest.data(), hashSize);
+    auto path = line.subpiece(sizeEnd + 1);
+    manifest[w_string(path.data(), path.size())] = entry;
+  }
+  return manifest;
+}
+
+std::string ContentHashRemote::formatManifest(
+    const Manifest& manifest,
+    ContentHashAlgorithm algorithm) {
+  std::vector<const Manifest::value_type*> entries;
+  entries.reserve(manifest.size());
+  for (auto& it : manifest) {
+    entries.push_back(&it);
+  }
+  std::sort(entries.begin(), entries.end(), [](auto a, auto b) {
+    return a->first < b->first;
+  });
+
+  auto hashSize = contentHashSize(algorithm);
+  std::string data;
+  for (auto entry : entries) {
+    data.append(folly::hexlify(folly::ByteRange(
+        entry->second.hash.data(), entry->second.hash.data() + hashSize)));
+    folly::toAppend(' ', entry->second.fileSize, ' ', entry->first, &data);
+    data.push_back('\n');
+  }
+  return data;
+}
+
+w_string ContentHashRemote::manifestPath(
+    w_string_piece sharedDir,
+    w_string_piece commitId,
+    ContentHashAlgorithm algorithm) {
+  return w_string::build(
+      sharedDir, "/", commitId, ".", algorithmName(algorithm));
+}
+
+ContentHashRemote::Manifest ContentHashRemote::loadManifest(
+    const w_string& mergeBase,
+    ContentHashAlgorithm algorithm) const {
+  auto path = manifestPath(sharedDir_, mergeBase, algorithm);
+  std::string data;
+  if (!folly::readFile(path.c_str(), data)) {
+    if (errno != ENOENT) {
+      log(ERR,
+          "failed to read content hash manifest ",
+          path,
+          ": ",
+          folly::errnoStr(errno),
+          "\n");
+    }
+    return Manifest();
+  }
+  try {
+    auto manifest = parseManifest(data, algorithm);
+    log(DBG,
+        "loaded ",
+        manifest.size(),
+        " hashes from content hash manifest ",
+        path,
+        "\n");
+    return manifest;
+  } catch (const std::exception& exc) {
+    log(ERR, "ignoring content hash manifest ", path, ": ", exc.what(), "\n");
+    return Manifest();
+  }
+}
+
+void ContentHashRemote::refresh(State& state) {
+  auto token = scm_->getDirStateToken();
+  auto now = std::chrono::steady_clock::now();
+  if (state.refreshed && token == state.dirStateToken &&
+      now - state.refreshedAt < statusTTL_) {
+    return;
+  }
+  state.refreshed = true;
+  state.refreshedAt = now;
+  state.dirStateToken = token;
+
+  // Nothing can be trusted until the SCM has answered
+  state.modified.clear();
+  auto priorMergeBase = std::move(state.mergeBase);
+  state.mergeBase = nullptr;
+  try {
+    // Any file modified after this was either reported by the SCM or has a
+    // later mtime
+    auto statusTime = time(nullptr);
+    auto mergeBase = scm_->mergeBaseWith(mergeBaseWith_);
+    auto modified = scm_->getFilesChangedSinceMergeBaseWith(mergeBase);
+    state.modified.insert(modified.begin(), modified.end());
+    state.statusTime = statusTime;
+    state.mergeBase = mergeBase;
+  } catch (const std::exception& exc) {
+    log(ERR,
+        "not using shared content hashes for ",
+        scm_->getRootPath(),
+        " since the SCM failed: ",
+        exc.what(),
+        "\n");
+  }
+  if (state.mergeBase != priorMergeBase) {
+    for (auto& manifest : state.manifests) {
+      manifest.clear();
+    }
+  }
+}
+
+folly::Optional<ContentHashRemote::HashValue> ContentHashRemote::lookup(
+    const ContentHashCacheKey& key) {
+  auto state = state_.lock();
+  refresh(*state);
+  if (!state->mergeBase) {
+    return folly::none;
+  }
+  // mtimes have a granularity of a second on some filesystems, so a file
+  // modified in the second that the SCM was asked may not have been seen
+  if (key.mtime.tv_sec + 1 >= state->statusTime ||
+      state->modified.count(key.relativePath)) {
+    ++state->unverified;
+    return folly::none;
+  }
+
+  auto& manifest = state->manifests[size_t(key.algorithm)];
+  if (!manifest) {
+    manifest = loadManifest(state->mergeBase, key.algorithm);
+  }
+  auto it = manifest->find(key.relativePath);
+  if (it == manifest->end() || it->second.fileSize != key.fileSize) {
+    ++state->misses;
+    return folly::none;
+  }
+  ++state->hits;
+  return it->second.hash;
+}
+
+json_ref ContentHashRemote::stats() const {
+  auto state = state_.lock();
+  return json_object(
+      {{"shared_dir", w_string_to_json(sharedDir_)},
+       {"merge_base",
+        state->mergeBase ? w_string_to_json(state->mergeBase) : json_null()},
+       {"modified", json_integer(state->modified.size())},
+       {"hits", json_integer(state->hits)},
+       {"misses", json_integer(state->misses)},
+       {"unverified", json_integer(state->unverified)}});
+}
+
+} // namespace watchman
@@ -0,0 +1,113 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Optional.h>
+#include <folly/Synchronized.h>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include "ContentHash.h"
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+class SCM;
+
+// A tier of content hashes that is shared between machines, such as the
+// CI workers that check out the same commits, so that a fresh checkout
+// needn't read each file to hash it.  ContentHashCache consults it before
+// reading a file.
+//
+// The hashes are published per commit, as manifests in a shared dir that
+// are named <commit>.<algorithm>, for example 0123...abcd.sha1, with a line
+// "<hex digest> <size> <path>" for each file, and the path relative to the
+// watched root.  The manifest of the merge base of the working copy is
+// used, and only for the files that the working copy hasn't modified
+// relative to that commit, as reported by the SCM.  Since the SCM only
+// reports the modifications that were made before it was asked, files that
+// were modified after that aren't looked up either.
+class ContentHashRemote {
+ public:
+  using HashValue = ContentHashCache::HashValue;
+
+  struct ManifestEntry {
+    size_t fileSize;
+    HashValue hash;
+  };
+  using Manifest = std::unordered_map<w_string, ManifestEntry>;
+
+  // Looks up the manifests in sharedDir for the merge base of the working
+  // copy of scm with mergeBaseWith.  The files that the working copy has
+  // modified are asked of scm again when its dirstate changes, and at
+  // least every statusTTL.
+  ContentHashRemote(
+      w_string sharedDir,
+      std::unique_ptr<SCM> scm,
+      w_string mergeBaseWith,
+      std::chrono::milliseconds statusTTL);
+  ~ContentHashRemote();
+
+  // Returns the published hash of the file that key describes, if there is
+  // one and the file is known to be unmodified
+  folly::Optional<HashValue> lookup(const ContentHashCacheKey& key);
+
+  // Returns a description of the tier for debugging purposes
+  json_ref stats() const;
+
+  // Parses the manifest of algorithm in data.  Throws std::runtime_error if
+  // it is malformed.
+  static Manifest parseManifest(
+      folly::StringPiece data,
+      ContentHashAlgorithm algorithm);
+
+  // Formats manifest in the form that parseManifest reads, ordered by path
+  static std::string formatManifest(
+      const Manifest& manifest,
+      ContentHashAlgorithm algorithm);
+
+  // Returns the path in sharedDir of the manifest of algorithm for commitId
+  static w_string manifestPath(
+      w_string_piece sharedDir,
+      w_string_piece commitId,
+      ContentHashAlgorithm algorithm);
+
+  static const char* algorithmName(ContentHashAlgorithm algorithm);
+
+ private:
+  struct State {
+    bool refreshed{false};
+    std::chrono::steady_clock::time_point refreshedAt;
+    w_string dirStateToken;
+    // Null if the SCM couldn't tell us
+    w_string mergeBase;
+    std::unordered_set<w_string> modified;
+    // When the SCM was asked for the modified files
+    time_t statusTime{0};
+    // Loaded on first use; empty if there is no manifest
+    std::array<folly::Optional<Manifest>, kNumContentHashAlgorithms>
+        manifests;
+
+    size_t hits{0};
+    size_t misses{0};
+    // Lookups of files that may have been modified
+    size_t unverified{0};
+  };
+
+  // Asks the SCM about the working copy again if it may have changed
+  void refresh(State& state);
+  Manifest loadManifest(
+      const w_string& mergeBase,
+      ContentHashAlgorithm algorithm) const;
+
+  const w_string sharedDir_;
+  const std::unique_ptr<SCM> scm_;
+  const w_string mergeBaseWith_;
+  const std::chrono::milliseconds statusTTL_;
+  folly::Synchronized<State, std::mutex> state_;
+};
+
+} // namespace watchman
@@ -0,0 +1,335 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "ContentHashStore.h"
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include "Logging.h"
+#include "ThreadPool.h"
+
+// The persisted store is a sequence of fixed width fields in native byte
+// order, in the same style as the view snapshots:
+//
+//   header:  magic, version, byte order mark, root path, record count
+//   record:  relative path, size, mtime, inode, present algorithms,
+//            { digest }... for each present algorithm
+//   trailer: end marker
+//
+// Strings are a uint32_t length followed by the bytes of the string.
+// Records are written from the least to the most recently used.
+
+namespace watchman {
+
+namespace {
+constexpr char kStoreMagic[8] = {'W', 'M', 'C', 'H', 'A', 'S', 'H', 0};
+constexpr uint32_t kStoreVersion = 1;
+constexpr uint32_t kByteOrderMark = 0x01020304;
+constexpr uint32_t kEndMarker = 0x21444e45;
+
+class StoreWriter {
+ public:
+  template <typename T>
+  void put(T value) {
+    static_assert(std::is_trivially_copyable<T>::value, "must be POD");
+    buf_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void putString(w_string_piece str) {
+    put(uint32_t(str.size()));
+    putBytes(str.data(), str.size());
+  }
+
+  void putBytes(const void* data, size_t size) {
+    buf_.append(reinterpret_cast<const char*>(data), size);
+  }
+
+  std::string& data() {
+    return buf_;
+  }
+
+ private:
+  std::string buf_;
+};
+
+class StoreReader {
+ public:
+  explicit StoreReader(const std::string& data)
+      : cur_(data.data()), end_(data.data() + data.size()) {}
+
+  template <typename T>
+  T get() {
+    static_assert(std::is_trivially_copyable<T>::value, "must be POD");
+    T value;
+    getBytes(&value, sizeof(value));
+    return value;
+  }
+
+  w_string_piece getString() {
+    auto len = get<uint32_t>();
+    need(len);
+    w_string_piece str(cur_, len);
+    cur_ += len;
+    return str;
+  }
+
+  void getBytes(void* dest, size_t size) {
+    need(size);
+    memcpy(dest, cur_, size);
+    cur_ += size;
+  }
+
+ private:
+  void need(size_t size) {
+    if (size_t(end_ - cur_) < size) {
+      throw std::runtime_error("content hash store is truncated");
+    }
+  }
+
+  const char* cur_;
+  const char* end_;
+};
+} // namespace
+
+ContentHashStore::ContentHashStore(
+    w_string path,
+    w_string rootPath,
+    size_t maxItems)
+    : path_(std::move(path)),
+      rootPath_(std::move(rootPath)),
+      maxItems_(maxItems) {}
+
+void ContentHashStore::load(State& state) {
+  state.loaded = true;
+
+  std::string data;
+  if (!folly::readFile(path_.c_str(), data)) {
+    if (errno != ENOENT) {
+      log(ERR,
+          "failed to read content hash store ",
+          path_,
+          ": ",
+          folly::errnoStr(errno),
+          "\n");
+    }
+    return;
+  }
+
+  std::unordered_map<w_string, Record> records;
+  try {
+    StoreReader reader(data);
+    char magic[sizeof(kStoreMagic)];
+    reader.getBytes(magic, sizeof(magic));
+    if (memcmp(magic, kStoreMagic, sizeof(magic)) != 0) {
+      throw std::runtime_error("not a content hash store");
+    }
+    if (reader.get<uint32_t>() != kStoreVersion) {
+      throw std::runtime_error("unsupported content hash store version");
+    }
+    if (reader.get<uint32_t>() != kByteOrderMark) {
+      throw std::runtime_error("content hash store has a foreign byte order");
+    }
+    if (reader.getString() != w_string_piece(rootPath_)) {
+      throw std::runtime_error("content hash store is for a different root");
+    }
+
+    auto count = reader.get<uint64_t>();
+    for (uint64_t i = 0; i < count; ++i) {
+      auto name = reader.getString().asWString();
+      Record record;
+      record.fileSize = size_t(reader.get<uint64_t>());
+      record.mtime.tv_sec = time_t(reader.get<int64_t>());
+      record.mtime.tv_nsec = long(reader.get<int64_t>());
+      record.ino = reader.get<uint64_t>();
+      record.present = reader.get<uint8_t>();
+      record.lastUse = ++state.useCounter;
+      for (size_t a = 0; a < kNumContentHashAlgorithms; ++a) {
+        if (record.present & (1 << a)) {
+          reader.getBytes(
+              record.hashes[a].data(),
+              contentHashSize(ContentHashAlgorithm(a)));
+        }
+      }
+      records[std::move(name)] = record;
+    }
+    if (reader.get<uint32_t>() != kEndMarker) {
+      throw std::runtime_error("content hash store is missing its trailer");
+    }
+  } catch (const std::exception& exc) {
+    log(ERR, "ignoring content hash store ", path_, ": ", exc.what(), "\n");
+    return;
+  }
+
+  // Anything stored before we finished loading is more recent
+  for (auto& it : state.records) {
+    records[it.first] = it.second;
+  }
+  state.records = std::move(records);
+  state.loadedRecords = state.records.size();
+  log(DBG,
+      "loaded ",
+      state.loadedRecords,
+      " content hashes from ",
+      path_,
+      "\n");
+}
+
+folly::Optional<ContentHashStore::HashValue> ContentHashStore::lookup(
+    const ContentHashCacheKey& key) {
+  auto state = state_.wlock();
+  if (!state->loaded) {
+    load(*state);
+  }
+
+  auto it = state->records.find(key.relativePath);
+  if (it != state->records.end()) {
+    auto& record = it->second;
+    ContentHashCacheKey recorded{key.relativePath,
+                                 record.fileSize,
+                                 record.mtime,
+                                 record.ino,
+                                 key.algorithm};
+    auto bit = 1 << size_t(key.algorithm);
+    if ((record.present & bit) && recorded == key) {
+      record.lastUse = ++state->useCounter;
+      state->hits++;
+      return record.hashes[size_t(key.algorithm)];
+    }
+  }
+  state->misses++;
+  return folly::none;
+}
+
+void ContentHashStore::store(
+    const ContentHashCacheKey& key,
+    const HashValue& value) {
+  auto state = state_.wlock();
+  auto& record = state->records[key.relativePath];
+  ContentHashCacheKey recorded{key.relativePath,
+                               record.fileSize,
+                               record.mtime,
+                               record.ino,
+                               key.algorithm};
+  if (!(recorded == key)) {
+    // A new version of the file; the hashes of the old one are stale
+    record.fileSize = key.fileSize;
+    record.mtime = key.mtime;
+    record.ino = key.ino;
+    record.present = 0;
+  }
+  record.present |= 1 << size_t(key.algorithm);
+  record.hashes[size_t(key.algorithm)] = value;
+  record.lastUse = ++state->useCounter;
+  state->dirty = true;
+}
+
+std::string ContentHashStore::serialize(State& state) {
+  std::vector<std::pair<const w_string*, const Record*>> records;
+  records.reserve(state.records.size());
+  for (auto& it : state.records) {
+    records.emplace_back(&it.first, &it.second);
+  }
+  std::sort(records.begin(), records.end(), [](auto& a, auto& b) {
+    return a.second->lastUse < b.second->lastUse;
+  });
+  if (records.size() > maxItems_) {
+    // Forget the least recently used records
+    size_t excess = records.size() - maxItems_;
+    for (size_t i = 0; i < excess; ++i) {
+      w_string name = *records[i].first;
+      state.records.erase(name);
+    }
+    records.erase(records.begin(), records.begin() + excess);
+  }
+
+  StoreWriter writer;
+  writer.putBytes(kStoreMagic, sizeof(kStoreMagic));
+  writer.put(kStoreVersion);
+  writer.put(kByteOrderMark);
+  writer.putString(rootPath_);
+  writer.put(uint64_t(records.size()));
+  for (auto& it : records) {
+    auto& record = *it.second;
+    writer.putString(*it.first);
+    writer.put(uint64_t(record.fileSize));
+    writer.put(int64_t(record.mtime.tv_sec));
+    writer.put(int64_t(record.mtime.tv_nsec));
+    writer.put(record.ino);
+    writer.put(record.present);
+    for (size_t a = 0; a < kNumContentHashAlgorithms; ++a) {
+      if (record.present & (1 << a)) {
+        writer.putBytes(
+            record.hashes[a].data(), contentHashSize(ContentHashAlgorithm(a)));
+      }
+    }
+  }
+  writer.put(kEndMarker);
+  return std::move(writer.data());
+}
+
+void ContentHashStore::save() {
+  std::lock_guard<std::mutex> saving(saveMutex_);
+  std::string data;
+  {
+    auto state = state_.wlock();
+    state->saveScheduled = false;
+    if (!state->dirty) {
+      return;
+    }
+    if (!state->loaded) {
+      // Make sure that we don't replace records that we never looked at
+      load(*state);
+    }
+    data = serialize(*state);
+    state->dirty = false;
+    state->saves++;
+  }
+
+  try {
+    folly::writeFileAtomic(path_.c_str(), data, 0600);
+  } catch (const std::exception& exc) {
+    log(ERR,
+        "failed to save content hash store ",
+        path_,
+        ": ",
+        exc.what(),
+        "\n");
+    state_.wlock()->dirty = true;
+  }
+}
+
+void ContentHashStore::scheduleSave() {
+  {
+    auto state = state_.wlock();
+    if (!state->dirty || state->saveScheduled) {
+      return;
+    }
+    state->saveScheduled = true;
+  }
+  try {
+    getThreadPool().add(
+        ThreadPool::Priority::Background,
+        this,
+        [self = shared_from_this()] { self->save(); });
+  } catch (const std::exception&) {
+    // The pool is stopping; we'll save synchronously at shutdown
+    state_.wlock()->saveScheduled = false;
+  }
+}
+
+json_ref ContentHashStore::stats() const {
+  auto state = state_.rlock();
+  return json_object(
+      {{"path", w_string_to_json(path_)},
+       {"loaded", json_boolean(state->loaded)},
+       {"loaded_records", json_integer(state->loadedRecords)},
+       {"records", json_integer(state->records.size())},
+       {"hits", json_integer(state->hits)},
+       {"misses", json_integer(state->misses)},
+       {"saves", json_integer(state->saves)},
+       {"dirty", json_boolean(state->dirty)}});
+}
+
+} // namespace watchman
@@ -0,0 +1,91 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Optional.h>
+#include <folly/Synchronized.h>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "ContentHash.h"
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// A persistent record of the content hashes that we have computed for a
+// root, so that a restarted server doesn't have to read every file again.
+//
+// The store holds one record per file, describing the metadata that the
+// hashes were computed for; a lookup only succeeds if the key that it is
+// given compares equal to that metadata, in the same way that keys are
+// compared by the in-memory ContentHashCache.  The store is loaded the
+// first time that it is consulted and is written back to disk in the
+// thread pool.
+class ContentHashStore
+    : public std::enable_shared_from_this<ContentHashStore> {
+ public:
+  using HashValue = ContentHashCache::HashValue;
+
+  // Construct a store that is persisted at path, for the root at
+  // rootPath, and which holds at most maxItems records.
+  ContentHashStore(w_string path, w_string rootPath, size_t maxItems);
+
+  // Returns the hash recorded for key, if any.  Loads the store from
+  // disk if this is the first lookup.
+  folly::Optional<HashValue> lookup(const ContentHashCacheKey& key);
+
+  // Records the hash for key, replacing any record of a prior version of
+  // the file.  The change is written back by a subsequent save().
+  void store(const ContentHashCacheKey& key, const HashValue& value);
+
+  // Writes the store to disk if it has changed since it was last saved.
+  // The asynchronous variant does the work in the thread pool.
+  void save();
+  void scheduleSave();
+
+  // Returns a description of the store for debugging purposes
+  json_ref stats() const;
+
+ private:
+  struct Record {
+    size_t fileSize{0};
+    struct timespec mtime {
+      0, 0
+    };
+    uint64_t ino{0};
+    // The most recent use; the least recently used records are dropped
+    // when the store is saved with more than maxItems_ records
+    uint64_t lastUse{0};
+    // A bitset of the ContentHashAlgorithm values in hashes
+    uint8_t present{0};
+    std::array<HashValue, kNumContentHashAlgorithms> hashes{};
+  };
+
+  struct State {
+    bool loaded{false};
+    bool dirty{false};
+    bool saveScheduled{false};
+    uint64_t useCounter{0};
+    std::unordered_map<w_string, Record> records;
+
+    size_t loadedRecords{0};
+    size_t hits{0};
+    size_t misses{0};
+    size_t saves{0};
+  };
+
+  // Populates state from the persisted store, if any
+  void load(State& state);
+  std::string serialize(State& state);
+
+  const w_string path_;
+  const w_string rootPath_;
+  const size_t maxItems_;
+  folly::Synchronized<State> state_;
+  // Serializes writers so that an older version can't replace a newer one
+  std::mutex saveMutex_;
+};
+
+} // namespace watchman
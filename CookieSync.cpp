@@ -36,12 +36,12 @@ void CookieSync::setCookieDir(const w_string& dir) {
       cookieDir_, "/" WATCHMAN_COOKIE_PREFIX, hostname, "-", ::getpid(), "-");
 }
 
-folly::Future<folly::Unit> CookieSync::sync() {
-  /* generate a cookie name: cookie prefix + id */
-  auto path_str = w_string::build(cookiePrefix_, serial_++);
+void CookieSync::setBatchWindow(std::chrono::milliseconds window) {
+  batchWindow_ = window;
+}
 
-  auto cookie = std::make_unique<Cookie>(path_str);
-  auto future = cookie->promise.getFuture();
+void CookieSync::writeCookie(std::unique_ptr<Cookie> cookie) {
+  auto path_str = cookie->fileName;
 
   /* insert our cookie in the map */
   {
@@ -55,28 +55,128 @@ folly::Future<folly::Unit> CookieSync::sync() {
       path_str.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0700);
   if (!file) {
     auto errcode = errno;
-    // The erase will unlink the file
-    cookies_.wlock()->erase(path_str);
+    std::unique_ptr<Cookie> failed;
+    {
+      auto map = cookies_.wlock();
+      auto it = map->find(path_str);
+      if (it != map->end()) {
+        failed = std::move(it->second);
+        map->erase(it);
+      }
+    }
 
-    throw std::system_error(
+    std::system_error error(
         errcode,
         std::generic_category(),
         folly::to<std::string>(
             "sync: creat(", path_str, ") failed: ", strerror(errcode)));
+    if (failed) {
+      // Destroying the cookie will unlink the file
+      failed->promise.setException(
+          folly::make_exception_wrapper<std::system_error>(error));
+    }
+    throw error;
   }
   log(DBG, "sync created cookie file ", path_str, "\n");
+}
+
+folly::Future<folly::Unit> CookieSync::sync() {
+  /* generate a cookie name: cookie prefix + id */
+  auto cookie =
+      std::make_unique<Cookie>(w_string::build(cookiePrefix_, serial_++));
+  auto future = cookie->promise.getFuture();
+  writeCookie(std::move(cookie));
+  return future;
+}
+
+folly::Future<folly::Unit> CookieSync::syncBatched() {
+  using namespace std::chrono;
+  std::unique_ptr<Cookie> cookie;
+  auto future = folly::Future<folly::Unit>::makeEmpty();
+  {
+    auto batch = batch_.lock();
+    if (batch->next) {
+      // Its file will be created after we got here, so it's as good as
+      // a cookie of our own
+      return batch->next->promise.getFuture();
+    }
+
+    cookie =
+        std::make_unique<Cookie>(w_string::build(cookiePrefix_, serial_++));
+    future = cookie->promise.getFuture();
+
+    auto now = steady_clock::now();
+    bool inFlight = batch->lastCookie &&
+        cookies_.rlock()->count(batch->lastCookie) > 0 &&
+        now - batch->lastWrite < batchWindow_;
+    if (inFlight) {
+      // Wait for the cookie in flight to be observed before writing
+      // another; the callers that follow us will share this one
+      batch->next = std::move(cookie);
+      return future;
+    }
+    batch->lastCookie = cookie->fileName;
+    batch->lastWrite = now;
+  }
+
+  writeCookie(std::move(cookie));
   return future;
 }
 
+void CookieSync::writeNextBatch(const w_string* observed) {
+  using namespace std::chrono;
+  std::unique_ptr<Cookie> next;
+  {
+    auto batch = batch_.lock();
+    if (!batch->next) {
+      return;
+    }
+    auto now = steady_clock::now();
+    if (observed ? *observed != batch->lastCookie
+                 : now - batch->lastWrite < batchWindow_) {
+      return;
+    }
+    next = std::move(batch->next);
+    batch->lastCookie = next->fileName;
+    batch->lastWrite = now;
+  }
+
+  try {
+    writeCookie(std::move(next));
+  } catch (const std::system_error& exc) {
+    // The callers that are waiting for it receive the error
+    log(ERR, "failed to write a batched cookie: ", exc.what(), "\n");
+  }
+}
+
 void CookieSync::syncToNow(std::chrono::milliseconds timeout) {
   /* compute deadline */
   using namespace std::chrono;
   auto deadline = system_clock::now() + timeout;
 
   while (true) {
-    auto cookie = sync();
+    auto cookie = batchWindow_.count() > 0 ? syncBatched() : sync();
 
-    if (!cookie.wait(timeout).isReady()) {
+    if (batchWindow_.count() > 0) {
+      // If we're waiting behind a cookie that is slow to be observed,
+      // don't wait for it for longer than the window before writing ours
+      auto waitUntil = system_clock::now() + timeout;
+      while (!cookie.isReady()) {
+        auto remaining =
+            duration_cast<milliseconds>(waitUntil - system_clock::now());
+        if (remaining.count() <= 0) {
+          break;
+        }
+        cookie.wait(std::min(remaining, batchWindow_));
+        if (!cookie.isReady()) {
+          writeNextBatch(nullptr);
+        }
+      }
+    } else {
+      cookie.wait(timeout);
+    }
+
+    if (!cookie.isReady()) {
       auto why = folly::to<std::string>(
           "syncToNow: timed out waiting for cookie file to be "
           "observed by watcher within ",
@@ -90,6 +190,10 @@ void CookieSync::syncToNow(std::chrono::milliseconds timeout) {
       // Success!
       return;
     }
+    if (!cookie.result().exception().is_compatible_with<CookieSyncAborted>()) {
+      // We couldn't create the cookie
+      cookie.result().throwIfFailed();
+    }
 
     // Sync was aborted by a recrawl; recompute the timeout
     // and wait again if we still have time
@@ -103,9 +207,18 @@ void CookieSync::syncToNow(std::chrono::milliseconds timeout) {
 void CookieSync::abortAllCookies() {
   std::unordered_map<w_string, std::unique_ptr<Cookie>> cookies;
 
+  {
+    auto batch = batch_.lock();
+    if (batch->next) {
+      cookies[batch->next->fileName] = std::move(batch->next);
+    }
+  }
   {
     auto map = cookies_.wlock();
-    std::swap(*map, cookies);
+    for (auto& it : *map) {
+      cookies[it.first] = std::move(it.second);
+    }
+    map->clear();
   }
 
   for (auto& it : cookies) {
@@ -136,6 +249,9 @@ void CookieSync::notifyCookie(const w_string& path) {
 
   if (cookie) {
     cookie->promise.setValue();
+    // Callers that arrived while this cookie was in flight can have theirs
+    // now
+    writeNextBatch(&path);
     // cookie file will be unlinked when we exit this scope
   }
 }
@@ -3,6 +3,10 @@
 #pragma once
 #include <folly/Synchronized.h>
 #include <folly/futures/Future.h>
+#include <folly/futures/SharedPromise.h>
+#include <chrono>
+#include <mutex>
+#include "watchman_string.h"
 #define WATCHMAN_COOKIE_PREFIX ".watchman-cookie-"
 
 namespace watchman {
@@ -16,6 +20,13 @@ class CookieSync {
 
   void setCookieDir(const w_string& dir);
 
+  /* Sets how long syncToNow() may wait for a cookie that is already in
+   * flight before writing another.  Callers of syncToNow() that arrive
+   * while a cookie is in flight share the cookie that is written once it
+   * has been observed, or once the window has passed, whichever is first.
+   * A window of 0 writes a cookie for every caller. */
+  void setBatchWindow(std::chrono::milliseconds window);
+
   /* Ensure that we're synchronized with the state of the
    * filesystem at the current time.
    * We do this by touching a cookie file and waiting to
@@ -25,7 +36,9 @@ class CookieSync {
    * Throws a std::system_error with an ETIMEDOUT error if
    * the timeout expires before we observe the change, or
    * a runtime_error if the root has been deleted or rendered
-   * inaccessible. */
+   * inaccessible.
+   * Concurrent callers are coalesced onto a shared cookie; see
+   * setBatchWindow(). */
   void syncToNow(std::chrono::milliseconds timeout);
 
   /** Touches a cookie file and returns a Future that will
@@ -71,13 +84,34 @@ class CookieSync {
 
  private:
   struct Cookie {
-    folly::Promise<folly::Unit> promise;
+    // Shared by all of the callers that wait for this cookie
+    folly::SharedPromise<folly::Unit> promise;
     w_string fileName;
 
     explicit Cookie(w_string name);
     ~Cookie();
   };
 
+  // The cookies of the callers of syncToNow()
+  struct Batch {
+    // The cookie that callers that arrived while lastCookie was in flight
+    // are waiting for; it hasn't been written yet
+    std::unique_ptr<Cookie> next;
+    w_string lastCookie;
+    std::chrono::steady_clock::time_point lastWrite;
+  };
+
+  // Returns a future for the cookie that a caller of syncToNow() should
+  // wait for, writing it now unless a cookie is already in flight
+  folly::Future<folly::Unit> syncBatched();
+  // Writes the next cookie of the batch if there is one and either the
+  // cookie observed, if not null, is the one in flight, or the batch
+  // window has passed since the last was written
+  void writeNextBatch(const w_string* observed);
+  // Adds cookie to the map and creates its file.  If that fails, the
+  // promise of the cookie is fulfilled with the error, which is thrown.
+  void writeCookie(std::unique_ptr<Cookie> cookie);
+
   // path to the query cookie dir
   w_string cookieDir_;
   // valid filename prefix for cookies we create
@@ -86,5 +120,7 @@ class CookieSync {
   std::atomic<uint32_t> serial_{0};
   folly::Synchronized<std::unordered_map<w_string, std::unique_ptr<Cookie>>>
       cookies_;
+  std::chrono::milliseconds batchWindow_{0};
+  folly::Synchronized<Batch, std::mutex> batch_;
 };
 } // namespace watchman
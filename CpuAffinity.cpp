@@ -0,0 +1,265 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "CpuAffinity.h"
+#include <folly/Conv.h>
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <algorithm>
+#include "Logging.h"
+#include "watchman_config.h"
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#endif
+
+namespace watchman {
+
+CpuSet::CpuSet(std::vector<int> cpus) : cpus_(std::move(cpus)) {
+  std::sort(cpus_.begin(), cpus_.end());
+  cpus_.erase(std::unique(cpus_.begin(), cpus_.end()), cpus_.end());
+}
+
+folly::Optional<CpuSet> CpuSet::parse(folly::StringPiece list) {
+  std::vector<int> cpus;
+  list = folly::trimWhitespace(list);
+  if (list.empty()) {
+    return CpuSet();
+  }
+  std::vector<folly::StringPiece> ranges;
+  folly::split(',', list, ranges);
+  for (auto range : ranges) {
+    range = folly::trimWhitespace(range);
+    if (range.empty()) {
+      return folly::none;
+    }
+    folly::StringPiece first = range;
+    folly::StringPiece last = range;
+    auto dash = range.find('-');
+    if (dash != folly::StringPiece::npos) {
+      first = range.subpiece(0, dash);
+      last = range.subpiece(dash + 1);
+    }
+    auto lo = folly::tryTo<int>(first);
+    auto hi = folly::tryTo<int>(last);
+    if (!lo || !hi || *lo < 0 || *hi < *lo) {
+      return folly::none;
+    }
+    for (auto cpu = *lo; cpu <= *hi; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return CpuSet(std::move(cpus));
+}
+
+std::string CpuSet::toString() const {
+  std::string result;
+  for (size_t i = 0; i < cpus_.size();) {
+    // Collapse each run of consecutive CPUs into a range
+    auto j = i;
+    while (j + 1 < cpus_.size() && cpus_[j + 1] == cpus_[j] + 1) {
+      ++j;
+    }
+    if (!result.empty()) {
+      result.push_back(',');
+    }
+    folly::toAppend(cpus_[i], &result);
+    if (j > i) {
+      folly::toAppend('-', cpus_[j], &result);
+    }
+    i = j + 1;
+  }
+  return result;
+}
+
+#ifdef __linux__
+CpuSet CpuSet::ofNumaNode(int node) {
+  std::string list;
+  if (node < 0 ||
+      !folly::readFile(
+          folly::to<std::string>(
+              "/sys/devices/system/node/node", node, "/cpulist")
+              .c_str(),
+          list)) {
+    return CpuSet();
+  }
+  auto set = parse(list);
+  return set ? std::move(*set) : CpuSet();
+}
+
+CpuSet CpuSet::ofThread(int tid) {
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  if (sched_getaffinity(tid, sizeof(mask), &mask) != 0) {
+    return CpuSet();
+  }
+  std::vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &mask)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return CpuSet(std::move(cpus));
+}
+
+std::error_code CpuSet::applyToCurrentThread() const {
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  for (auto cpu : cpus_) {
+    if (cpu >= CPU_SETSIZE) {
+      return std::make_error_code(std::errc::invalid_argument);
+    }
+    CPU_SET(cpu, &mask);
+  }
+  // On Linux, 0 names the calling thread rather than the whole process
+  if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+    return std::error_code(errno, std::generic_category());
+  }
+  return std::error_code();
+}
+
+int numaNodeOfCpu(int cpu) {
+  // The dir of each CPU holds a link named after its node
+  auto dirName = folly::to<std::string>("/sys/devices/system/cpu/cpu", cpu);
+  auto dir = opendir(dirName.c_str());
+  if (!dir) {
+    return -1;
+  }
+  int node = -1;
+  while (auto ent = readdir(dir)) {
+    folly::StringPiece name(ent->d_name);
+    if (name.removePrefix("node")) {
+      if (auto parsed = folly::tryTo<int>(name)) {
+        node = *parsed;
+        break;
+      }
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+std::vector<ThreadPlacement> getThreadPlacements() {
+  std::vector<ThreadPlacement> placements;
+  auto dir = opendir("/proc/self/task");
+  if (!dir) {
+    return placements;
+  }
+  while (auto ent = readdir(dir)) {
+    auto tid = folly::tryTo<int>(folly::StringPiece(ent->d_name));
+    if (!tid) {
+      continue;
+    }
+    ThreadPlacement placement{*tid, "", ofThread(*tid), -1, -1};
+
+    auto taskDir = folly::to<std::string>("/proc/self/task/", *tid);
+    if (folly::readFile((taskDir + "/comm").c_str(), placement.name)) {
+      placement.name = folly::rtrimWhitespace(placement.name).str();
+    }
+    // The CPU is the 39th field of stat.  The second is the name in
+    // parens, which may have spaces in it, so count from its end.
+    std::string stat;
+    if (folly::readFile((taskDir + "/stat").c_str(), stat)) {
+      auto close = stat.rfind(')');
+      if (close != std::string::npos) {
+        std::vector<folly::StringPiece> fields;
+        folly::split(
+            ' ',
+            folly::trimWhitespace(folly::StringPiece(stat).subpiece(close + 1)),
+            fields);
+        // fields[0] is the third field of stat
+        if (fields.size() > 36) {
+          if (auto cpu = folly::tryTo<int>(fields[36])) {
+            placement.lastCpu = *cpu;
+            placement.numaNode = numaNodeOfCpu(*cpu);
+          }
+        }
+      }
+    }
+    placements.push_back(std::move(placement));
+  }
+  closedir(dir);
+  std::sort(
+      placements.begin(),
+      placements.end(),
+      [](const ThreadPlacement& a, const ThreadPlacement& b) {
+        return a.tid < b.tid;
+      });
+  return placements;
+}
+#else
+CpuSet CpuSet::ofNumaNode(int) {
+  return CpuSet();
+}
+
+CpuSet CpuSet::ofThread(int) {
+  return CpuSet();
+}
+
+std::error_code CpuSet::applyToCurrentThread() const {
+  return std::make_error_code(std::errc::not_supported);
+}
+
+int numaNodeOfCpu(int) {
+  return -1;
+}
+
+std::vector<ThreadPlacement> getThreadPlacements() {
+  return {};
+}
+#endif
+
+CpuSet cpuSetFromConfig(
+    const json_ref& cpus,
+    json_int_t numaNode,
+    folly::StringPiece cpusOption,
+    folly::StringPiece numaNodeOption) {
+  if (cpus) {
+    folly::Optional<CpuSet> set;
+    if (cpus.isString()) {
+      auto& list = json_to_w_string(cpus);
+      set = CpuSet::parse(folly::StringPiece(list.data(), list.size()));
+    }
+    if (!set || set->empty()) {
+      log(ERR,
+          cpusOption.str(),
+          " must be a list of CPUs such as \"0-7,16-23\"; ignoring it\n");
+      return CpuSet();
+    }
+    return std::move(*set);
+  }
+  if (numaNode >= 0) {
+    auto set = CpuSet::ofNumaNode(int(numaNode));
+    if (set.empty()) {
+      log(ERR,
+          numaNodeOption.str(),
+          ": there is no NUMA node ",
+          numaNode,
+          " with CPUs; ignoring it\n");
+    }
+    return set;
+  }
+  return CpuSet();
+}
+
+void placePoolThread() {
+  static const CpuSet cpus = cpuSetFromConfig(
+      cfg_get_json("pool_thread_cpus"),
+      cfg_get_int("pool_thread_numa_node", -1),
+      "pool_thread_cpus",
+      "pool_thread_numa_node");
+  if (cpus.empty()) {
+    return;
+  }
+  if (auto error = cpus.applyToCurrentThread()) {
+    log(ERR,
+        "failed to place ",
+        Log::getThreadName(),
+        " on CPUs ",
+        cpus.toString(),
+        ": ",
+        error.message(),
+        "\n");
+  }
+}
+
+} // namespace watchman
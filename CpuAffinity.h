@@ -0,0 +1,90 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <folly/Optional.h>
+#include <folly/Range.h>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// A set of CPUs that a thread may run on.
+//
+// Threads are only placed on Linux.  Elsewhere the sets can be built, but
+// applying one fails with std::errc::not_supported.
+class CpuSet {
+ public:
+  CpuSet() = default;
+  explicit CpuSet(std::vector<int> cpus);
+
+  // Parses a list of CPUs in the form that Linux uses in sysfs and that
+  // taskset --cpu-list takes, such as "0-7,16-23".  Returns folly::none
+  // if the list is malformed.
+  static folly::Optional<CpuSet> parse(folly::StringPiece list);
+
+  // The CPUs of a NUMA node, as sysfs lists them; empty if there is no
+  // such node
+  static CpuSet ofNumaNode(int node);
+
+  // The CPUs that a thread of this process may run on; tid 0 is the
+  // calling thread.  Empty if that can't be found out.
+  static CpuSet ofThread(int tid = 0);
+
+  bool empty() const {
+    return cpus_.empty();
+  }
+
+  const std::vector<int>& cpus() const {
+    return cpus_;
+  }
+
+  // The list form that parse() takes
+  std::string toString() const;
+
+  // Confines the calling thread to the CPUs of the set
+  std::error_code applyToCurrentThread() const;
+
+  bool operator==(const CpuSet& other) const {
+    return cpus_ == other.cpus_;
+  }
+
+ private:
+  // Sorted, without duplicates
+  std::vector<int> cpus_;
+};
+
+// Resolves a placement option pair: a CPU list in cpus, or failing that
+// the CPUs of the NUMA node numaNode if it isn't negative.  Problems are
+// logged as coming from the named options, and leave the set empty,
+// which means that threads are left wherever the OS puts them.
+CpuSet cpuSetFromConfig(
+    const json_ref& cpus,
+    json_int_t numaNode,
+    folly::StringPiece cpusOption,
+    folly::StringPiece numaNodeOption);
+
+// Places the calling thread of a thread pool on the CPUs given by the
+// pool_thread_cpus or pool_thread_numa_node global options, if either
+// is set
+void placePoolThread();
+
+// Where a thread of this process is and may run
+struct ThreadPlacement {
+  int tid;
+  std::string name;
+  CpuSet allowed;
+  // The CPU that the thread last ran on and its NUMA node, or -1
+  int lastCpu;
+  int numaNode;
+};
+
+// The placement of each of the threads of this process.  Empty on
+// systems other than Linux.
+std::vector<ThreadPlacement> getThreadPlacements();
+
+// The NUMA node of cpu, or -1 if that isn't known
+int numaNodeOfCpu(int cpu);
+
+} // namespace watchman
@@ -0,0 +1,147 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "CrawlScheduler.h"
+#include <algorithm>
+#include "watchman_config.h"
+
+namespace watchman {
+
+CrawlScheduler::Request::Request(
+    CrawlScheduler& scheduler,
+    w_string name,
+    uint64_t seq)
+    : scheduler_(scheduler),
+      name_(std::move(name)),
+      seq_(seq),
+      queuedAt_(std::chrono::steady_clock::now()) {}
+
+CrawlScheduler::Request::~Request() {
+  std::lock_guard<std::mutex> lock(scheduler_.mutex_);
+  auto& running = scheduler_.running_;
+  auto& queued = scheduler_.queued_;
+  running.erase(
+      std::remove(running.begin(), running.end(), this), running.end());
+  queued.erase(std::remove(queued.begin(), queued.end(), this), queued.end());
+  scheduler_.grantLocked();
+}
+
+bool CrawlScheduler::Request::wait() {
+  std::unique_lock<std::mutex> lock(scheduler_.mutex_);
+  scheduler_.cond_.wait(lock, [this] { return state_ != State::Queued; });
+  return state_ == State::Running;
+}
+
+void CrawlScheduler::Request::cancel() {
+  {
+    std::lock_guard<std::mutex> lock(scheduler_.mutex_);
+    if (state_ != State::Queued) {
+      return;
+    }
+    state_ = State::Cancelled;
+    auto& queued = scheduler_.queued_;
+    queued.erase(std::find(queued.begin(), queued.end(), this));
+  }
+  scheduler_.cond_.notify_all();
+}
+
+void CrawlScheduler::Request::prioritize() {
+  std::lock_guard<std::mutex> lock(scheduler_.mutex_);
+  if (prioritySeq_ == 0) {
+    prioritySeq_ = scheduler_.nextPrioritySeq_++;
+  }
+}
+
+size_t CrawlScheduler::Request::position() {
+  std::lock_guard<std::mutex> lock(scheduler_.mutex_);
+  return scheduler_.positionLocked(this);
+}
+
+CrawlScheduler::CrawlScheduler(size_t maxConcurrent)
+    : maxConcurrent_(maxConcurrent) {}
+
+std::shared_ptr<CrawlScheduler::Request> CrawlScheduler::enqueue(
+    w_string name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::shared_ptr<Request> request(
+      new Request(*this, std::move(name), nextSeq_++));
+  queued_.push_back(request.get());
+  grantLocked();
+  return request;
+}
+
+bool CrawlScheduler::runsBefore(const Request* a, const Request* b) {
+  // Those that somebody is waiting for go first, in the order in which
+  // they were waited for, and then the rest in the order that they came
+  if ((a->prioritySeq_ != 0) != (b->prioritySeq_ != 0)) {
+    return a->prioritySeq_ != 0;
+  }
+  if (a->prioritySeq_ != b->prioritySeq_) {
+    return a->prioritySeq_ < b->prioritySeq_;
+  }
+  return a->seq_ < b->seq_;
+}
+
+std::vector<CrawlScheduler::Request*>::iterator CrawlScheduler::nextLocked() {
+  return std::min_element(queued_.begin(), queued_.end(), runsBefore);
+}
+
+void CrawlScheduler::grantLocked() {
+  bool granted = false;
+  while (!queued_.empty() &&
+         (maxConcurrent_ == 0 || running_.size() < maxConcurrent_)) {
+    auto it = nextLocked();
+    auto request = *it;
+    queued_.erase(it);
+    request->state_ = Request::State::Running;
+    running_.push_back(request);
+    granted = true;
+  }
+  if (granted) {
+    cond_.notify_all();
+  }
+}
+
+size_t CrawlScheduler::positionLocked(const Request* request) {
+  if (request->state_ != Request::State::Queued) {
+    return 0;
+  }
+  size_t ahead = 0;
+  for (auto other : queued_) {
+    if (runsBefore(other, request)) {
+      ++ahead;
+    }
+  }
+  return ahead + 1;
+}
+
+std::vector<CrawlScheduler::Entry> CrawlScheduler::getQueue() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto now = std::chrono::steady_clock::now();
+  auto entry = [&](const Request* request) {
+    return Entry{
+        request->name_,
+        request->state_ == Request::State::Running,
+        request->prioritySeq_ != 0,
+        positionLocked(request),
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            now - request->queuedAt_)};
+  };
+
+  std::vector<Entry> entries;
+  for (auto request : running_) {
+    entries.push_back(entry(request));
+  }
+  auto queued = queued_;
+  std::sort(queued.begin(), queued.end(), runsBefore);
+  for (auto request : queued) {
+    entries.push_back(entry(request));
+  }
+  return entries;
+}
+
+CrawlScheduler& getCrawlScheduler() {
+  static CrawlScheduler scheduler(size_t(
+      std::max<json_int_t>(0, cfg_get_int("max_concurrent_crawls", 0))));
+  return scheduler;
+}
+} // namespace watchman
@@ -0,0 +1,105 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "watchman_string.h"
+
+namespace watchman {
+
+// Limits the number of full crawls that run at once across all of the
+// watched roots.  When the server starts, or when many roots are watched
+// at the same time, crawling all of them at once makes the disk seek back
+// and forth between them so that each of them finishes late.  Instead,
+// the crawls queue up here, and the roots that clients are waiting on go
+// to the front of the queue.
+class CrawlScheduler {
+ public:
+  // A crawl that is queued or running.  Destroying it leaves the queue, or
+  // lets the next crawl run if it was running.
+  class Request {
+   public:
+    ~Request();
+    Request(const Request&) = delete;
+    Request& operator=(const Request&) = delete;
+
+    // Blocks until the crawl may run, and returns true, or until the
+    // request is cancelled, and returns false
+    bool wait();
+
+    // Makes wait() return false, unless the crawl is already running
+    void cancel();
+
+    // Moves the crawl ahead of those that nobody is waiting for
+    void prioritize();
+
+    // The number of crawls that will run before this one, counting from
+    // 1, or 0 if it is running
+    size_t position();
+
+   private:
+    friend class CrawlScheduler;
+    enum class State { Queued, Running, Cancelled };
+
+    Request(CrawlScheduler& scheduler, w_string name, uint64_t seq);
+
+    CrawlScheduler& scheduler_;
+    const w_string name_;
+    const uint64_t seq_;
+    const std::chrono::steady_clock::time_point queuedAt_;
+
+    // These are protected by scheduler_.mutex_
+    State state_{State::Queued};
+    // The order in which the waited-on crawls were prioritized, or 0 if
+    // nobody has waited on this one
+    uint64_t prioritySeq_{0};
+  };
+
+  struct Entry {
+    w_string name;
+    bool running;
+    bool prioritized;
+    // As returned by Request::position()
+    size_t position;
+    std::chrono::milliseconds age;
+  };
+
+  // maxConcurrent of 0 lets every crawl run right away
+  explicit CrawlScheduler(size_t maxConcurrent);
+
+  // Queues up a crawl of the named root, which may run straight away
+  std::shared_ptr<Request> enqueue(w_string name);
+
+  // The running crawls, followed by the queued ones in the order in which
+  // they will run
+  std::vector<Entry> getQueue();
+
+  size_t maxConcurrent() const {
+    return maxConcurrent_;
+  }
+
+ private:
+  // The queued request that runs next; called with mutex_ held
+  std::vector<Request*>::iterator nextLocked();
+  // Runs as many of the queued crawls as the limit allows; called with
+  // mutex_ held
+  void grantLocked();
+  size_t positionLocked(const Request* request);
+  static bool runsBefore(const Request* a, const Request* b);
+
+  const size_t maxConcurrent_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  uint64_t nextSeq_{1};
+  uint64_t nextPrioritySeq_{1};
+  std::vector<Request*> running_;
+  std::vector<Request*> queued_;
+};
+
+// Returns the scheduler configured by max_concurrent_crawls
+CrawlScheduler& getCrawlScheduler();
+} // namespace watchman
@@ -0,0 +1,85 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace watchman {
+
+/** DescriptorTable maps the descriptors that the kernel hands out for
+ * watches, such as inotify watch descriptors and the fds that kqueue
+ * watches, to a value.  The kernel allocates those from the lowest numbers
+ * up, so a vector indexed by the descriptor costs the size of one value per
+ * watch and a lookup is an array index, where a hash table would cost a
+ * node and a bucket per watch and a hash per lookup.
+ *
+ * A default constructed Value marks an empty slot, and Value must be
+ * explicitly convertible to bool, with false for an empty value; a w_string
+ * or a pointer will do.
+ */
+template <typename Value>
+class DescriptorTable {
+ public:
+  void reserve(size_t size) {
+    slots_.reserve(size);
+  }
+
+  /** Maps desc, which must not be negative, to value */
+  void set(int desc, Value value) {
+    auto index = size_t(desc);
+    if (index >= slots_.size()) {
+      slots_.resize(index + 1);
+    }
+    if (!slots_[index]) {
+      ++size_;
+    }
+    slots_[index] = std::move(value);
+    if (!slots_[index]) {
+      // Setting an empty value is the same as erasing it
+      --size_;
+    }
+  }
+
+  /** Returns the value of desc, or nullptr if it has none */
+  const Value* find(int desc) const {
+    if (desc < 0 || size_t(desc) >= slots_.size() || !slots_[desc]) {
+      return nullptr;
+    }
+    return &slots_[desc];
+  }
+
+  /** Removes the value of desc.  Returns true if it had one */
+  bool erase(int desc) {
+    if (desc < 0 || size_t(desc) >= slots_.size() || !slots_[desc]) {
+      return false;
+    }
+    slots_[desc] = Value();
+    --size_;
+    // Keep the vector no longer than the greatest descriptor in use
+    while (!slots_.empty() && !slots_.back()) {
+      slots_.pop_back();
+    }
+    return true;
+  }
+
+  /** The number of descriptors that have a value */
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  void clear() {
+    slots_.clear();
+    size_ = 0;
+  }
+
+ private:
+  std::vector<Value> slots_;
+  size_t size_{0};
+};
+
+} // namespace watchman
@@ -0,0 +1,228 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "EventTrace.h"
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include "watchman_pending.h"
+
+namespace watchman {
+
+namespace {
+constexpr char kTraceMagic[8] = {'W', 'M', 'E', 'V', 'T', 'R', 'C', 0};
+constexpr uint64_t kTraceVersion = 1;
+// Batches are buffered until there is at least this much to write
+constexpr size_t kFlushThreshold = 64 * 1024;
+
+void putVarint(std::string& buf, uint64_t value) {
+  while (value >= 0x80) {
+    buf.push_back(char((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  buf.push_back(char(value));
+}
+
+void putString(std::string& buf, w_string_piece str) {
+  putVarint(buf, str.size());
+  buf.append(str.data(), str.size());
+}
+
+class TraceReader {
+ public:
+  explicit TraceReader(const std::string& data)
+      : cur_(data.data()), end_(data.data() + data.size()) {}
+
+  bool atEnd() const {
+    return cur_ == end_;
+  }
+
+  uint64_t getVarint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      need(1);
+      auto byte = uint8_t(*cur_++);
+      value |= uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    throw std::runtime_error("event trace has an invalid number");
+  }
+
+  w_string_piece getBytes(size_t size) {
+    need(size);
+    w_string_piece bytes(cur_, size);
+    cur_ += size;
+    return bytes;
+  }
+
+  w_string_piece getString() {
+    return getBytes(getVarint());
+  }
+
+ private:
+  void need(size_t size) {
+    if (size_t(end_ - cur_) < size) {
+      throw std::runtime_error("event trace is truncated");
+    }
+  }
+
+  const char* cur_;
+  const char* end_;
+};
+} // namespace
+
+EventTrace EventTrace::load(const char* path) {
+  std::string data;
+  if (!folly::readFile(path, data)) {
+    throw std::system_error(
+        errno,
+        std::generic_category(),
+        folly::to<std::string>("failed to read event trace ", path));
+  }
+
+  EventTrace trace;
+  TraceReader reader(data);
+  if (reader.getBytes(sizeof(kTraceMagic)) !=
+      w_string_piece(kTraceMagic, sizeof(kTraceMagic))) {
+    throw std::runtime_error(
+        folly::to<std::string>(path, " is not an event trace"));
+  }
+  if (reader.getVarint() != kTraceVersion) {
+    throw std::runtime_error(folly::to<std::string>(
+        path, " is from an unsupported version of watchman"));
+  }
+  trace.rootPath = reader.getString().asWString();
+
+  std::chrono::microseconds offset{0};
+  while (!reader.atEnd()) {
+    Batch batch;
+    offset += std::chrono::microseconds(reader.getVarint());
+    batch.offset = offset;
+    auto count = reader.getVarint();
+    std::string name;
+    for (uint64_t i = 0; i < count; ++i) {
+      int flags = int(reader.getVarint());
+      auto shared = reader.getVarint();
+      if (shared > name.size()) {
+        throw std::runtime_error("event trace has an invalid name");
+      }
+      name.resize(shared);
+      auto suffix = reader.getString();
+      name.append(suffix.data(), suffix.size());
+      batch.events.push_back(Event{w_string(name.data(), name.size()), flags});
+    }
+    trace.batches.push_back(std::move(batch));
+  }
+  return trace;
+}
+
+size_t EventTrace::numEvents() const {
+  size_t events = 0;
+  for (auto& batch : batches) {
+    events += batch.events.size();
+  }
+  return events;
+}
+
+EventTraceWriter::EventTraceWriter(
+    const w_string& path,
+    const w_string& rootPath)
+    : path_(path),
+      rootPath_(rootPath),
+      stm_(w_stm_open(
+          path.c_str(),
+          O_WRONLY | O_CLOEXEC | O_CREAT | O_TRUNC,
+          0600)),
+      start_(std::chrono::steady_clock::now()),
+      lastBatch_(start_) {
+  if (!stm_) {
+    throw std::system_error(
+        errno,
+        std::generic_category(),
+        folly::to<std::string>("failed to open event trace ", path));
+  }
+  buf_.append(kTraceMagic, sizeof(kTraceMagic));
+  putVarint(buf_, kTraceVersion);
+  putString(buf_, rootPath_);
+  flush();
+}
+
+EventTraceWriter::~EventTraceWriter() {
+  try {
+    flush();
+  } catch (const std::exception&) {
+    // The recording is best effort
+  }
+}
+
+void EventTraceWriter::writeBatch(const watchman_pending_fs* items) {
+  auto now = std::chrono::steady_clock::now();
+  auto delta =
+      std::chrono::duration_cast<std::chrono::microseconds>(now - lastBatch_);
+  lastBatch_ = now;
+
+  // Paths outside of the root, such as those of cookies in a VCS dir that
+  // is elsewhere, aren't of interest
+  std::vector<std::pair<w_string_piece, int>> names;
+  for (auto item = items; item; item = item->next.get()) {
+    w_string_piece path(item->path);
+    if (path == rootPath_) {
+      names.emplace_back(w_string_piece(), item->flags);
+    } else if (
+        path.size() > rootPath_.size() &&
+        path.startsWith(rootPath_) &&
+        is_slash(path.data()[rootPath_.size()])) {
+      names.emplace_back(
+          w_string_piece(
+              path.data() + rootPath_.size() + 1,
+              path.size() - rootPath_.size() - 1),
+          item->flags);
+    }
+  }
+
+  putVarint(buf_, delta.count());
+  putVarint(buf_, names.size());
+  w_string_piece prev;
+  for (auto& it : names) {
+    auto& name = it.first;
+    size_t shared = 0;
+    auto limit = std::min(prev.size(), name.size());
+    while (shared < limit && prev.data()[shared] == name.data()[shared]) {
+      ++shared;
+    }
+    putVarint(buf_, it.second);
+    putVarint(buf_, shared);
+    putString(
+        buf_, w_string_piece(name.data() + shared, name.size() - shared));
+    prev = name;
+  }
+  ++batches_;
+  events_ += names.size();
+
+  if (buf_.size() >= kFlushThreshold) {
+    flush();
+  }
+}
+
+void EventTraceWriter::flush() {
+  size_t pos = 0;
+  while (pos < buf_.size()) {
+    auto wrote = stm_->write(
+        buf_.data() + pos, int(std::min(buf_.size() - pos, size_t(1 << 20))));
+    if (wrote <= 0) {
+      throw std::system_error(
+          errno,
+          std::generic_category(),
+          folly::to<std::string>("failed to write event trace ", path_));
+    }
+    pos += wrote;
+  }
+  bytesWritten_ += buf_.size();
+  buf_.clear();
+}
+
+} // namespace watchman
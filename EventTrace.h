@@ -0,0 +1,91 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include "watchman_stream.h"
+
+struct watchman_pending_fs;
+
+namespace watchman {
+
+// A recording of the paths that the watcher of a root reported, in the
+// batches that the notify thread handed them to the IO thread, so that a
+// storm of changes such as a checkout can be replayed against a view to
+// measure how the IO thread copes with it.
+//
+// The file starts with a header: a magic number, the version of the
+// format and the path of the root.  Each batch that follows is the time
+// since the previous batch in microseconds, the number of paths, and for
+// each path its W_PENDING flags and its name relative to the root.  Names
+// are front coded against the previous name in the batch.  All of the
+// numbers are unsigned LEB128 varints.
+struct EventTrace {
+  struct Event {
+    // Relative to the root; empty for the root itself
+    w_string name;
+    int flags;
+  };
+
+  struct Batch {
+    // Since the recording started
+    std::chrono::microseconds offset{0};
+    std::vector<Event> events;
+  };
+
+  w_string rootPath;
+  std::vector<Batch> batches;
+
+  // Reads the trace at path.  Throws std::system_error if it can't be
+  // read, or std::runtime_error if it isn't a valid trace.
+  static EventTrace load(const char* path);
+
+  size_t numEvents() const;
+};
+
+// Writes the batches of a root to a trace file as they are reported.
+// Not thread safe; the notify thread is the only writer.
+class EventTraceWriter {
+ public:
+  // Creates or replaces the trace at path.  Throws std::system_error if
+  // it can't be opened.
+  EventTraceWriter(const w_string& path, const w_string& rootPath);
+  ~EventTraceWriter();
+
+  // Records the chain of items as the next batch
+  void writeBatch(const watchman_pending_fs* items);
+  // Writes out any buffered batches.  Throws std::system_error if that
+  // fails.
+  void flush();
+
+  const w_string& path() const {
+    return path_;
+  }
+  size_t batches() const {
+    return batches_;
+  }
+  size_t events() const {
+    return events_;
+  }
+  // Including those that are still buffered
+  size_t bytes() const {
+    return bytesWritten_ + buf_.size();
+  }
+
+ private:
+  w_string path_;
+  w_string rootPath_;
+  std::unique_ptr<watchman_stream> stm_;
+  std::string buf_;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::time_point lastBatch_;
+  size_t batches_{0};
+  size_t events_{0};
+  size_t bytesWritten_{0};
+};
+
+} // namespace watchman
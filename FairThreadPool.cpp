@@ -0,0 +1,108 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "FairThreadPool.h"
+#include "CpuAffinity.h"
+#include "Logging.h"
+
+namespace watchman {
+
+FairThreadPool& getSubscriptionThreadPool() {
+  static FairThreadPool pool;
+  return pool;
+}
+
+FairThreadPool::~FairThreadPool() {
+  stop();
+}
+
+void FairThreadPool::start(size_t numWorkers, size_t maxItems) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!workers_.empty()) {
+    throw std::runtime_error("FairThreadPool already started");
+  }
+  if (stopping_) {
+    throw std::runtime_error("Cannot restart a stopped pool");
+  }
+  maxItems_ = maxItems;
+
+  for (auto i = 0U; i < numWorkers; ++i) {
+    workers_.emplace_back([this, i]() noexcept {
+      w_set_thread_name("FairThreadPool-", i);
+      placePoolThread();
+      runWorker();
+    });
+  }
+}
+
+void FairThreadPool::runWorker() {
+  while (true) {
+    folly::Func task;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this] { return stopping_ || !keys_.empty(); });
+      if (keys_.empty()) {
+        return;
+      }
+
+      // Take the next task of the key at the front, and send the key to
+      // the back if it has more
+      auto key = keys_.front();
+      keys_.pop_front();
+      auto it = tasks_.find(key);
+      task = std::move(it->second.front());
+      it->second.pop_front();
+      if (it->second.empty()) {
+        tasks_.erase(it);
+      } else {
+        keys_.push_back(key);
+      }
+      --numTasks_;
+    }
+
+    task();
+  }
+}
+
+void FairThreadPool::stop(bool join) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  condition_.notify_all();
+
+  if (join) {
+    for (auto& worker : workers_) {
+      if (worker.joinable()) {
+        worker.join();
+      }
+    }
+  }
+}
+
+size_t FairThreadPool::numWorkers() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return workers_.size();
+}
+
+void FairThreadPool::add(Key key, folly::Func func) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stopping_ || workers_.empty()) {
+      throw std::runtime_error("pool is not running");
+    }
+    if (numTasks_ + 1 >= maxItems_) {
+      throw std::runtime_error("thread pool queue is full");
+    }
+
+    auto& queue = tasks_[key];
+    if (queue.empty()) {
+      keys_.push_back(key);
+    }
+    queue.emplace_back(std::move(func));
+    ++numTasks_;
+  }
+
+  condition_.notify_one();
+}
+} // namespace watchman
@@ -0,0 +1,63 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h" // to avoid system header ordering issue on win32
+#include <folly/Function.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace watchman {
+
+// A thread pool whose tasks are grouped by a key, such as the root that
+// they work on.  The workers take a task from each key that has some in
+// turn, so that a key with many tasks queued up doesn't hold up the tasks
+// of the others; the tasks of a key are started in the order that they
+// were added.
+class FairThreadPool {
+ public:
+  using Key = const void*;
+
+  FairThreadPool() = default;
+  ~FairThreadPool();
+  FairThreadPool(const FairThreadPool&) = delete;
+  FairThreadPool& operator=(const FairThreadPool&) = delete;
+
+  // Start the pool with the specified number of worker threads and the
+  // specified upper bound on the number of queued tasks
+  void start(size_t numWorkers, size_t maxItems);
+
+  // Request that the worker threads terminate once the queued tasks are
+  // done.  If `join` is true, wait for them to terminate.
+  void stop(bool join = true);
+
+  // Queues func to be run in the pool, after the tasks that were queued
+  // for key before it.  Throws a runtime_error if the pool isn't running
+  // or its queue is full.
+  void add(Key key, folly::Func func);
+
+  // Returns the number of worker threads
+  size_t numWorkers();
+
+ private:
+  void runWorker();
+
+  std::vector<std::thread> workers_;
+  // The tasks of each key that has some, and the keys in the order that
+  // they are to be served
+  std::unordered_map<Key, std::deque<folly::Func>> tasks_;
+  std::deque<Key> keys_;
+  size_t numTasks_{0};
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stopping_{false};
+  size_t maxItems_{0};
+};
+
+// Return a reference to the pool that evaluates subscriptions
+FairThreadPool& getSubscriptionThreadPool();
+} // namespace watchman
@@ -0,0 +1,37 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "FetchBatchSizer.h"
+#include <algorithm>
+
+namespace watchman {
+
+FetchBatchSizer::FetchBatchSizer(const FetchBatching& batching, Stage stage)
+    : min_(std::max<size_t>(1, batching.min)),
+      max_(std::max(min_, batching.max)),
+      targetLatency_(batching.targetLatency) {
+  auto initial = stage == Stage::Eval ? batching.initialEval
+                                      : batching.initialRender;
+  size_ = std::min(std::max(initial, min_), max_);
+}
+
+void FetchBatchSizer::record(size_t n, std::chrono::nanoseconds elapsed) {
+  if (n < size_ / 2) {
+    // The last few files of a query say little about the cost of a batch
+    return;
+  }
+  size_t ideal;
+  if (elapsed.count() <= 0) {
+    ideal = max_;
+  } else {
+    // The number of files that could be fetched in targetLatency_ at the
+    // rate that these were
+    auto scaled = double(n) * targetLatency_.count() / elapsed.count();
+    ideal = scaled >= double(max_) ? max_ : size_t(scaled);
+  }
+  // Move halfway there, so that one slow fetch doesn't throw the size off,
+  // growing by at most double each time
+  auto next = std::min((size_ + ideal + 1) / 2, size_ * 2);
+  size_ = std::min(std::max(next, min_), max_);
+}
+
+} // namespace watchman
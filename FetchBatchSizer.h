@@ -0,0 +1,51 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <chrono>
+#include <cstddef>
+
+namespace watchman {
+
+// How a view would like the query engine to batch up the files whose
+// properties it has to fetch before it can evaluate or render them.  A view
+// that fetches them with a round trip to another process wants large
+// batches, and one that has them at hand wants small ones, so that the
+// files held in a batch don't pile up.
+struct FetchBatching {
+  // The size of the first batch of files awaiting evaluation, and of the
+  // first awaiting rendering
+  size_t initialEval;
+  size_t initialRender;
+  // The bounds that the batches adapt within
+  size_t min;
+  size_t max;
+  // How long a fetch should take.  Batches grow while fetches take less
+  // time than this and shrink while they take more.
+  std::chrono::microseconds targetLatency;
+};
+
+// Chooses the size of each batch from how long the fetches of the
+// previous batches took per file
+class FetchBatchSizer {
+ public:
+  // Whether the files are awaiting evaluation or rendering
+  enum class Stage { Eval, Render };
+
+  FetchBatchSizer(const FetchBatching& batching, Stage stage);
+
+  // The number of files to accumulate before fetching them
+  size_t size() const {
+    return size_;
+  }
+
+  // Records that fetching the properties of n files took elapsed
+  void record(size_t n, std::chrono::nanoseconds elapsed);
+
+ private:
+  size_t min_;
+  size_t max_;
+  std::chrono::nanoseconds targetLatency_;
+  size_t size_;
+};
+
+} // namespace watchman
@@ -14,6 +14,7 @@
 #include "WinIoCtl.h"
 #endif
 #include <folly/ScopeGuard.h>
+#include <folly/portability/SysUio.h>
 
 #if defined(_WIN32) || defined(O_PATH)
 #define CAN_OPEN_SYMLINKS 1
@@ -539,8 +540,8 @@ w_string FileDescriptor::getOpenedPath() const {
 #endif
 }
 
-w_string readSymbolicLink(const char* path) {
 #ifndef _WIN32
+w_string readSymbolicLinkAt(int dirFd, const char* name) {
   std::string result;
 
   // Speculatively assume that this is large enough to read the
@@ -548,7 +549,7 @@ w_string readSymbolicLink(const char* path) {
   result.resize(256);
 
   for (int retry = 0; retry < 2; ++retry) {
-    auto len = readlink(path, &result[0], result.size());
+    auto len = readlinkat(dirFd, name, &result[0], result.size());
     if (len < 0) {
       throw std::system_error(
           errno, std::generic_category(), "readlink for readSymbolicLink");
@@ -559,7 +560,7 @@ w_string readSymbolicLink(const char* path) {
 
     // Truncated read; we need to figure out the right size to use
     struct stat st;
-    if (lstat(path, &st)) {
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW)) {
       throw std::system_error(
           errno, std::generic_category(), "lstat for readSymbolicLink");
     }
@@ -571,6 +572,12 @@ w_string readSymbolicLink(const char* path) {
       E2BIG,
       std::generic_category(),
       "readlink for readSymbolicLink: symlink changed while reading it");
+}
+#endif
+
+w_string readSymbolicLink(const char* path) {
+#ifndef _WIN32
+  return readSymbolicLinkAt(AT_FDCWD, path);
 #else
   return openFileHandle(path, OpenFileHandleOptions::queryFileInfo())
       .readSymbolicLink();
@@ -842,6 +849,44 @@ Result<int, std::error_code> FileDescriptor::write(const void* buf, int size)
 #endif
 }
 
+Result<int, std::error_code> FileDescriptor::writev(
+    const struct iovec* iov,
+    int iovcnt) const {
+#ifndef _WIN32
+  auto result = ::writev(fd_, iov, iovcnt);
+  if (result == -1) {
+    int errcode = errno;
+    return Result<int, std::error_code>(
+        std::error_code(errcode, std::generic_category()));
+  }
+  return Result<int, std::error_code>(result);
+#else
+  if (fdType_ == FDType::Socket) {
+    std::vector<WSABUF> bufs(iovcnt);
+    for (int i = 0; i < iovcnt; ++i) {
+      bufs[i].buf = static_cast<CHAR*>(iov[i].iov_base);
+      bufs[i].len = ULONG(iov[i].iov_len);
+    }
+    DWORD sent = 0;
+    if (WSASend(fd_, bufs.data(), DWORD(iovcnt), &sent, 0, nullptr, nullptr) !=
+        0) {
+      int errcode = WSAGetLastError();
+      return Result<int, std::error_code>(
+          std::error_code(errcode, std::system_category()));
+    }
+    return Result<int, std::error_code>(int(sent));
+  }
+  // There is no gather write for pipes and files that aren't opened for
+  // overlapped IO, so write the first buffer that has any data
+  for (int i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len > 0) {
+      return write(iov[i].iov_base, int(iov[i].iov_len));
+    }
+  }
+  return Result<int, std::error_code>(0);
+#endif
+}
+
 const FileDescriptor& FileDescriptor::stdIn() {
   static FileDescriptor f(
 #ifdef _WIN32
@@ -6,6 +6,7 @@
 #include "Result.h"
 
 class w_string;
+struct iovec;
 
 namespace watchman {
 
@@ -132,6 +133,12 @@ class FileDescriptor {
   /** write(2), but yielding a Result for system independent error reporting */
   Result<int, std::error_code> write(const void* buf, int size) const;
 
+  /** writev(2), but yielding a Result for system independent error
+   * reporting.  On Windows, only sockets write more than the first
+   * non-empty buffer in a single call. */
+  Result<int, std::error_code> writev(const struct iovec* iov, int iovcnt)
+      const;
+
   // Return a global handle to one of the standard IO stream descriptors
   static const FileDescriptor& stdIn();
   static const FileDescriptor& stdOut();
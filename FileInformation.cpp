@@ -104,4 +104,101 @@ FileInformation FileInformation::makeDeletedFileInformation() {
 #endif
   return info;
 }
+
+FileOwnerTable::FileOwnerTable() {
+  owners_.emplace_back();
+  index_.emplace(owners_.back(), 0);
+}
+
+size_t FileOwnerTable::Hash::operator()(const FileOwner& owner) const {
+  auto h = std::hash<uint64_t>()(uint64_t(owner.dev));
+  h = h * 31 + std::hash<uint64_t>()(uint64_t(owner.uid));
+  return h * 31 + std::hash<uint64_t>()(uint64_t(owner.gid));
+}
+
+uint32_t FileOwnerTable::intern(const FileOwner& owner) {
+  if (owners_[last_] == owner) {
+    return last_;
+  }
+  auto it = index_.find(owner);
+  if (it != index_.end()) {
+    last_ = it->second;
+    return last_;
+  }
+  last_ = uint32_t(owners_.size());
+  owners_.push_back(owner);
+  index_.emplace(owner, last_);
+  return last_;
+}
+
+CompactFileInformation::CompactFileInformation(
+    const FileInformation& info,
+    FileOwnerTable& owners)
+    : size_(info.size),
+      ino_(info.ino),
+      atimeSec_(info.atime.tv_sec),
+      mtimeSec_(info.mtime.tv_sec),
+      ctimeSec_(info.ctime.tv_sec),
+      atimeNsec_(uint32_t(info.atime.tv_nsec)),
+      mtimeNsec_(uint32_t(info.mtime.tv_nsec)),
+      ctimeNsec_(uint32_t(info.ctime.tv_nsec)),
+      mode_(uint32_t(info.mode)),
+      nlink_(uint32_t(info.nlink)),
+      owner_(owners.intern(FileOwner{info.dev, info.uid, info.gid}))
+#ifdef _WIN32
+      ,
+      fileAttributes_(info.fileAttributes)
+#endif
+{
+}
+
+FileInformation CompactFileInformation::expand(
+    const FileOwnerTable& owners) const {
+  FileInformation info = typeInfo();
+  info.size = off_t(size_);
+  info.ino = ino_t(ino_);
+  info.nlink = nlink_t(nlink_);
+  auto& owner = owners[owner_];
+  info.dev = owner.dev;
+  info.uid = owner.uid;
+  info.gid = owner.gid;
+  info.atime.tv_sec = atimeSec_;
+  info.atime.tv_nsec = atimeNsec_;
+  info.mtime = mtime();
+  info.ctime.tv_sec = ctimeSec_;
+  info.ctime.tv_nsec = ctimeNsec_;
+  return info;
+}
+
+struct timespec CompactFileInformation::mtime() const {
+  struct timespec ts;
+  ts.tv_sec = mtimeSec_;
+  ts.tv_nsec = mtimeNsec_;
+  return ts;
+}
+
+FileInformation CompactFileInformation::typeInfo() const {
+  FileInformation info;
+  info.mode = mode_t(mode_);
+#ifdef _WIN32
+  info.fileAttributes = fileAttributes_;
+#endif
+  return info;
+}
+
+DType CompactFileInformation::dtype() const {
+  return typeInfo().dtype();
+}
+
+bool CompactFileInformation::isSymlink() const {
+  return typeInfo().isSymlink();
+}
+
+bool CompactFileInformation::isDir() const {
+  return typeInfo().isDir();
+}
+
+bool CompactFileInformation::isFile() const {
+  return typeInfo().isFile();
+}
 } // namespace watchman
@@ -3,6 +3,9 @@
 #pragma once
 #include "watchman_system.h"
 #include <sys/stat.h>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
 #ifndef _WIN32
 #include <dirent.h>
 #endif
@@ -141,4 +144,98 @@ struct FileInformation {
   // files that were deleted between two revisions.
   static FileInformation makeDeletedFileInformation();
 };
+
+// The device and owner of a file.  Few of the files in a tree differ in
+// these, so CompactFileInformation refers to them by their index in a
+// FileOwnerTable rather than holding a copy of them.
+struct FileOwner {
+  dev_t dev{0};
+  uid_t uid{0};
+  gid_t gid{0};
+
+  bool operator==(const FileOwner& other) const {
+    return dev == other.dev && uid == other.uid && gid == other.gid;
+  }
+};
+
+// Assigns each distinct FileOwner an index.  The indices are never
+// reused, and index 0 is the default constructed owner, which is what a
+// zero-filled CompactFileInformation refers to.
+class FileOwnerTable {
+ public:
+  FileOwnerTable();
+
+  // Returns the index of owner, adding it to the table if it isn't
+  // already there
+  uint32_t intern(const FileOwner& owner);
+
+  const FileOwner& operator[](uint32_t index) const {
+    return owners_[index];
+  }
+
+  size_t size() const {
+    return owners_.size();
+  }
+
+ private:
+  struct Hash {
+    size_t operator()(const FileOwner& owner) const;
+  };
+
+  std::vector<FileOwner> owners_;
+  std::unordered_map<FileOwner, uint32_t, Hash> index_;
+  // Most files have the same owner as the one interned before them
+  uint32_t last_{0};
+};
+
+// The FileInformation of a file in the view, in fewer bytes than
+// FileInformation itself: the device and owner are held by a
+// FileOwnerTable, the times are split into their seconds and
+// nanoseconds so that they pack without padding, and the fields that
+// queries test most often can be read without expanding the whole of it.
+class CompactFileInformation {
+ public:
+  CompactFileInformation() = default;
+  CompactFileInformation(const FileInformation& info, FileOwnerTable& owners);
+
+  // Returns the full information; owners must be the table that this was
+  // made with
+  FileInformation expand(const FileOwnerTable& owners) const;
+
+  mode_t mode() const {
+    return mode_t(mode_);
+  }
+  off_t size() const {
+    return off_t(size_);
+  }
+  ino_t ino() const {
+    return ino_t(ino_);
+  }
+  struct timespec mtime() const;
+
+  DType dtype() const;
+  bool isSymlink() const;
+  bool isDir() const;
+  bool isFile() const;
+
+ private:
+  // The mode and attributes, which the type tests need
+  FileInformation typeInfo() const;
+
+  int64_t size_{0};
+  uint64_t ino_{0};
+  int64_t atimeSec_{0};
+  int64_t mtimeSec_{0};
+  int64_t ctimeSec_{0};
+  uint32_t atimeNsec_{0};
+  uint32_t mtimeNsec_{0};
+  uint32_t ctimeNsec_{0};
+  uint32_t mode_{0};
+  uint32_t nlink_{0};
+  // The index of the device and owner in the FileOwnerTable
+  uint32_t owner_{0};
+#ifdef _WIN32
+  uint32_t fileAttributes_{0};
+#endif
+};
 } // namespace watchman
@@ -101,6 +101,11 @@ w_string realPath(const char* path);
 
 /** equivalent to readlink() */
 w_string readSymbolicLink(const char* path);
+
+#ifndef _WIN32
+/** equivalent to readlinkat(); name is relative to the dir dirFd */
+w_string readSymbolicLinkAt(int dirFd, const char* name);
+#endif
 } // namespace watchman
 
 #ifdef _WIN32
@@ -0,0 +1,190 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "FrozenStringSet.h"
+#include <string.h>
+#include <algorithm>
+#include <unordered_set>
+
+namespace watchman {
+
+namespace {
+// The number of keys per bucket, on average.  Larger buckets need less
+// space for the displacements but take longer to place.
+constexpr size_t kKeysPerBucket = 4;
+// How many displacements to try for a bucket before growing the table
+constexpr uint32_t kMaxDisplacement = 1 << 16;
+
+uint64_t mix(uint64_t h) {
+  // The finalizer from MurmurHash3
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// ASCII only, as w_string_piece::asLowerCase folds the keys
+char fold(char c) {
+  return c >= 'A' && c <= 'Z' ? char(c | 0x20) : c;
+}
+} // namespace
+
+FrozenStringSet::FrozenStringSet(std::vector<w_string> keys, bool caseFold)
+    : caseFold_(caseFold) {
+  std::unordered_set<w_string> seen;
+  keys_.reserve(keys.size());
+  for (auto& key : keys) {
+    if (caseFold_) {
+      key = key.piece().asLowerCase(key.type());
+    }
+    if (seen.insert(key).second) {
+      keys_.emplace_back(std::move(key));
+    }
+  }
+  if (keys_.empty()) {
+    return;
+  }
+
+  std::vector<uint64_t> hashes;
+  hashes.reserve(keys_.size());
+  for (auto& key : keys_) {
+    hashes.push_back(hashPath(w_string_piece(), key, true));
+  }
+
+  // Leave some slots free so that the last buckets to be placed find a
+  // home quickly
+  auto numSlots = keys_.size() + keys_.size() / 4 + 1;
+  while (!build(hashes, numSlots)) {
+    numSlots += numSlots / 2;
+  }
+}
+
+bool FrozenStringSet::build(
+    const std::vector<uint64_t>& hashes,
+    size_t numSlots) {
+  auto numBuckets = (keys_.size() + kKeysPerBucket - 1) / kKeysPerBucket;
+  std::vector<std::vector<uint32_t>> buckets(numBuckets);
+  for (uint32_t i = 0; i < hashes.size(); ++i) {
+    buckets[(hashes[i] >> 32) % numBuckets].push_back(i);
+  }
+
+  // Place the largest buckets first, while most of the slots are free
+  std::vector<uint32_t> order(numBuckets);
+  for (uint32_t i = 0; i < numBuckets; ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  displacements_.assign(numBuckets, 0);
+  slots_.assign(numSlots, kEmptySlot);
+  std::vector<size_t> placed;
+  for (auto b : order) {
+    const auto& bucket = buckets[b];
+    if (bucket.empty()) {
+      break;
+    }
+    bool found = false;
+    for (uint32_t d = 0; d < kMaxDisplacement && !found; ++d) {
+      placed.clear();
+      found = true;
+      for (auto key : bucket) {
+        auto slot = slotHash(hashes[key], d) % numSlots;
+        // The slot must be free, and not taken by another key from this
+        // bucket
+        if (slots_[slot] != kEmptySlot ||
+            std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+          found = false;
+          break;
+        }
+        placed.push_back(slot);
+      }
+      if (found) {
+        displacements_[b] = d;
+        for (size_t i = 0; i < bucket.size(); ++i) {
+          slots_[placed[i]] = bucket[i];
+        }
+      }
+    }
+    if (!found) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint64_t FrozenStringSet::slotHash(uint64_t hash, uint32_t displacement) {
+  return mix(hash + (displacement + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+uint64_t FrozenStringSet::hashPath(
+    w_string_piece dir,
+    w_string_piece name,
+    bool nameFolded) const {
+  // FNV-1a, which can be fed the pieces of the name one at a time
+  uint64_t h = 0xcbf29ce484222325ULL;
+  auto feed = [&](w_string_piece piece, bool folded) {
+    auto end = piece.data() + piece.size();
+    if (caseFold_ && !folded) {
+      for (auto p = piece.data(); p != end; ++p) {
+        h ^= uint8_t(fold(*p));
+        h *= 0x100000001b3ULL;
+      }
+      return;
+    }
+    for (auto p = piece.data(); p != end; ++p) {
+      h ^= uint8_t(*p);
+      h *= 0x100000001b3ULL;
+    }
+  };
+  if (dir.size() > 0) {
+    feed(dir, false);
+    feed("/", true);
+  }
+  feed(name, nameFolded);
+  return mix(h);
+}
+
+bool FrozenStringSet::equalPath(
+    const w_string& key,
+    w_string_piece dir,
+    w_string_piece name,
+    bool nameFolded) const {
+  auto equal = [&](const char* k, w_string_piece piece, bool folded) {
+    if (!caseFold_ || folded) {
+      return memcmp(k, piece.data(), piece.size()) == 0;
+    }
+    for (size_t i = 0; i < piece.size(); ++i) {
+      if (fold(piece.data()[i]) != k[i]) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  if (dir.size() == 0) {
+    return key.size() == name.size() && equal(key.data(), name, nameFolded);
+  }
+  return key.size() == dir.size() + 1 + name.size() &&
+      key.data()[dir.size()] == '/' && equal(key.data(), dir, false) &&
+      equal(key.data() + dir.size() + 1, name, nameFolded);
+}
+
+bool FrozenStringSet::containsPath(
+    w_string_piece dir,
+    w_string_piece name,
+    bool nameFolded) const {
+  if (keys_.empty()) {
+    return false;
+  }
+  auto hash = hashPath(dir, name, nameFolded);
+  auto bucket = (hash >> 32) % displacements_.size();
+  auto slot = slotHash(hash, displacements_[bucket]) % slots_.size();
+  auto index = slots_[slot];
+  return index != kEmptySlot &&
+      equalPath(keys_[index], dir, name, nameFolded);
+}
+
+} // namespace watchman
@@ -0,0 +1,82 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "watchman_string.h"
+
+namespace watchman {
+
+// FrozenStringSet is an immutable set of strings that is built once, when
+// a query is parsed, and then probed for every file that the query
+// examines.
+//
+// The set is laid out as a minimal-ish perfect hash table using the
+// "hash, displace and compress" scheme: the keys are split into small
+// buckets by their hash value and each bucket is assigned a displacement
+// that places all of its keys into free slots.  A lookup hashes the
+// candidate once, reads the displacement of its bucket and compares the
+// candidate with the single key in the slot that it lands in.  There are
+// no chains to follow and no probing.
+//
+// A candidate can be supplied in two pieces that are joined by a `/`, so
+// that the set can be probed with the name of a file relative to the root
+// without building that name as a string.
+class FrozenStringSet {
+ public:
+  FrozenStringSet() = default;
+
+  // If caseFold is set, the keys and the candidates are compared after
+  // folding ASCII upper case to lower case, as w_string_piece::asLowerCase
+  // does.  Duplicate keys are removed.
+  explicit FrozenStringSet(std::vector<w_string> keys, bool caseFold = false);
+
+  // nameFolded says that the candidate is known to have no upper case
+  // letters, which spares a set built with caseFold from folding it
+  bool contains(w_string_piece candidate, bool nameFolded = false) const {
+    return containsPath(w_string_piece(), candidate, nameFolded);
+  }
+
+  // Returns true if the set holds dir joined to name with a `/`, or just
+  // name if dir is empty.  nameFolded applies to name alone.
+  bool containsPath(
+      w_string_piece dir,
+      w_string_piece name,
+      bool nameFolded = false) const;
+
+  size_t size() const {
+    return keys_.size();
+  }
+
+  bool empty() const {
+    return keys_.empty();
+  }
+
+  // The keys, folded if the set was built with caseFold, in the order
+  // that they were first supplied
+  const std::vector<w_string>& keys() const {
+    return keys_;
+  }
+
+ private:
+  static constexpr uint32_t kEmptySlot = UINT32_MAX;
+
+  uint64_t hashPath(w_string_piece dir, w_string_piece name, bool nameFolded)
+      const;
+  bool equalPath(
+      const w_string& key,
+      w_string_piece dir,
+      w_string_piece name,
+      bool nameFolded) const;
+  static uint64_t slotHash(uint64_t hash, uint32_t displacement);
+  bool build(const std::vector<uint64_t>& hashes, size_t numSlots);
+
+  bool caseFold_{false};
+  std::vector<w_string> keys_;
+  // The displacement for each bucket
+  std::vector<uint32_t> displacements_;
+  // The index into keys_ of the key held in each slot, or kEmptySlot
+  std::vector<uint32_t> slots_;
+};
+
+} // namespace watchman
@@ -0,0 +1,148 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "watchman_string.h"
+
+namespace watchman {
+
+// GlobSuffixIndex classifies a name against a set of glob patterns in a
+// single pass over the name.
+//
+// Every character at the end of a pattern after its last special
+// character or directory separator is a literal that the end of any
+// matching name must equal; for `**/*.h` that is `.h`.  Those tails are
+// inserted in reverse into a trie, so walking a name backwards from its
+// last character visits every pattern whose tail it ends with.  Patterns
+// that have no literal tail are always candidates.
+//
+// This is a prefilter: a pattern that is not yielded as a candidate
+// cannot match, but the candidates still need to be confirmed with
+// wildmatch.  With a set of `**/*.ext` patterns almost every name is
+// either rejected outright or has exactly one candidate.
+class GlobSuffixIndex {
+ public:
+  explicit GlobSuffixIndex(bool caseFold = false) : caseFold_(caseFold) {
+    nodes_.emplace_back();
+  }
+
+  /** Adds pattern to the index, returning the index that is passed to
+   * the forEachCandidate callback for it.  Indices are assigned in
+   * order, starting from 0. */
+  uint32_t add(w_string_piece pattern) {
+    auto index = numPatterns_++;
+    auto tail = literalTail(pattern);
+    if (tail.size() == 0) {
+      residual_.push_back(index);
+      return index;
+    }
+
+    uint32_t node = 0;
+    for (auto p = tail.data() + tail.size(); p != tail.data();) {
+      node = findOrAddChild(node, fold(*--p));
+    }
+    nodes_[node].terminals.push_back(index);
+    return index;
+  }
+
+  size_t size() const {
+    return numPatterns_;
+  }
+
+  bool empty() const {
+    return numPatterns_ == 0;
+  }
+
+  /** Calls func(index) for each pattern that may match name.  If func
+   * returns true, no further candidates are yielded. */
+  template <typename Func>
+  void forEachCandidate(w_string_piece name, Func&& func) const {
+    for (auto index : residual_) {
+      if (func(index)) {
+        return;
+      }
+    }
+
+    uint32_t node = 0;
+    for (auto p = name.data() + name.size(); p != name.data();) {
+      node = findChild(node, fold(*--p));
+      if (node == kNoNode) {
+        return;
+      }
+      for (auto index : nodes_[node].terminals) {
+        if (func(index)) {
+          return;
+        }
+      }
+    }
+  }
+
+  /** Returns the literal characters at the end of pattern that a
+   * matching name must end with */
+  static w_string_piece literalTail(w_string_piece pattern) {
+    auto end = pattern.data() + pattern.size();
+    auto p = end;
+    while (p != pattern.data()) {
+      switch (p[-1]) {
+        case '*':
+        case '?':
+        case '[':
+        case ']':
+        case '\\':
+        case '/':
+          return w_string_piece(p, end - p);
+      }
+      --p;
+    }
+    return w_string_piece(p, end - p);
+  }
+
+ private:
+  static constexpr uint32_t kNoNode = 0;
+
+  struct Node {
+    // Most nodes only have a handful of children, so a linear scan wins
+    std::vector<std::pair<char, uint32_t>> children;
+    std::vector<uint32_t> terminals;
+  };
+
+  // Matches the case folding performed by wildmatch with WM_CASEFOLD
+  char fold(char c) const {
+    if (caseFold_ && c >= 'A' && c <= 'Z') {
+      return c - 'A' + 'a';
+    }
+    return c;
+  }
+
+  uint32_t findChild(uint32_t node, char c) const {
+    for (const auto& child : nodes_[node].children) {
+      if (child.first == c) {
+        return child.second;
+      }
+    }
+    return kNoNode;
+  }
+
+  uint32_t findOrAddChild(uint32_t node, char c) {
+    auto child = findChild(node, c);
+    if (child != kNoNode) {
+      return child;
+    }
+    child = uint32_t(nodes_.size());
+    nodes_.emplace_back();
+    nodes_[node].children.emplace_back(c, child);
+    return child;
+  }
+
+  bool caseFold_;
+  uint32_t numPatterns_{0};
+  // nodes_[0] is the root of the trie; no other node links to it, which
+  // lets 0 double as the missing child marker
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> residual_;
+};
+
+} // namespace watchman
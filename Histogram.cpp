@@ -0,0 +1,99 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "Histogram.h"
+#include <folly/lang/Bits.h>
+#include <algorithm>
+#include <cmath>
+
+namespace watchman {
+
+size_t Histogram::bucketFor(uint64_t value) {
+  return folly::findLastSet(value);
+}
+
+uint64_t Histogram::bucketUpperBound(size_t bucket) {
+  return bucket == kNumBuckets - 1 ? UINT64_MAX
+                                   : (uint64_t(1) << bucket) - 1;
+}
+
+void Histogram::record(uint64_t value) {
+  buckets_[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+
+  auto max = max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::merge(const Histogram& other) {
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    buckets_[i].fetch_add(
+        other.buckets_[i].load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+  }
+  count_.fetch_add(other.count(), std::memory_order_relaxed);
+  sum_.fetch_add(other.sum(), std::memory_order_relaxed);
+
+  auto value = other.max();
+  auto max = max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::reset() {
+  for (auto& bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::quantile(double q) const {
+  // The buckets are read one at a time, so the total may be behind the
+  // values that are being recorded concurrently
+  uint64_t total = 0;
+  for (auto& bucket : buckets_) {
+    total += bucket.load(std::memory_order_relaxed);
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  auto rank =
+      std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * total)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return std::min(bucketUpperBound(i), max());
+    }
+  }
+  return max();
+}
+
+json_ref Histogram::toJson() const {
+  auto buckets = json_array();
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    auto n = buckets_[i].load(std::memory_order_relaxed);
+    if (n == 0) {
+      continue;
+    }
+    uint64_t least = i == 0 ? 0 : uint64_t(1) << (i - 1);
+    json_array_append_new(
+        buckets, json_array({json_integer(least), json_integer(n)}));
+  }
+
+  return json_object({{"count", json_integer(count())},
+                      {"sum", json_integer(sum())},
+                      {"max", json_integer(max())},
+                      {"p50", json_integer(quantile(0.5))},
+                      {"p90", json_integer(quantile(0.9))},
+                      {"p99", json_integer(quantile(0.99))},
+                      {"buckets", buckets}});
+}
+
+} // namespace watchman
@@ -0,0 +1,69 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// The distribution of a series of values, such as latencies or sizes, in
+// buckets whose bounds are powers of two: bucket 0 counts the zeros, and
+// bucket n the values from 2^(n-1) to 2^n - 1.  Values can be recorded
+// from any thread without locking, and the quantiles that are estimated
+// from the buckets are within a factor of two of the real ones.
+class Histogram {
+ public:
+  static constexpr size_t kNumBuckets = 65;
+
+  Histogram() = default;
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void record(uint64_t value);
+
+  // Adds the values recorded by other to this one
+  void merge(const Histogram& other);
+
+  // Forgets the recorded values.  A value that is recorded concurrently
+  // may be partially forgotten.
+  void reset();
+
+  uint64_t count() const {
+    return count_.load(std::memory_order_relaxed);
+  }
+  uint64_t sum() const {
+    return sum_.load(std::memory_order_relaxed);
+  }
+  uint64_t max() const {
+    return max_.load(std::memory_order_relaxed);
+  }
+
+  // Estimates the value that the fraction q of the recorded values are no
+  // greater than, as the upper bound of the bucket that holds it, or max
+  // if that is lower.  Returns 0 if nothing has been recorded.
+  uint64_t quantile(double q) const;
+
+  // The number of values recorded in bucket, and the greatest value that
+  // it can hold
+  uint64_t bucketCount(size_t bucket) const {
+    return buckets_[bucket].load(std::memory_order_relaxed);
+  }
+  static uint64_t bucketUpperBound(size_t bucket);
+
+  // Returns the count, sum, max, the 50th, 90th and 99th percentiles and
+  // the non-empty buckets, as [least value, count] pairs
+  json_ref toJson() const;
+
+ private:
+  static size_t bucketFor(uint64_t value);
+
+  std::array<std::atomic<uint64_t>, kNumBuckets> buckets_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+} // namespace watchman
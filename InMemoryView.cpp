@@ -3,9 +3,13 @@
 #include "watchman.h"
 #include "InMemoryView.h"
 #include <folly/ScopeGuard.h>
+#include <folly/futures/Future.h>
 #include <algorithm>
+#include <limits>
 #include <memory>
 #include <thread>
+#include "ContentHashRemote.h"
+#include "ContentHashStore.h"
 #include "ThreadPool.h"
 
 using folly::Optional;
@@ -16,24 +20,74 @@ static std::atomic<long> next_root_number{1};
 
 namespace watchman {
 
+static_assert(
+    std::is_same<ContentHashCache::HashValue, FileResult::ContentDigest>::value,
+    "the cache must be able to hold any digest");
+
 InMemoryViewCaches::InMemoryViewCaches(
     const w_string& rootPath,
     size_t maxHashes,
     size_t maxSymlinks,
-    std::chrono::milliseconds errorTTL)
-    : contentHashCache(rootPath, maxHashes, errorTTL),
-      symlinkTargetCache(rootPath, maxSymlinks, errorTTL) {}
+    size_t maxHashBytes,
+    size_t maxSymlinkBytes,
+    std::chrono::milliseconds errorTTL,
+    std::shared_ptr<ContentHashStore> hashStore,
+    std::shared_ptr<CacheMemoryBudget> budget,
+    std::shared_ptr<ContentHashRemote> hashRemote)
+    : contentHashCache(
+          rootPath,
+          maxHashes,
+          errorTTL,
+          std::move(hashStore),
+          maxHashBytes,
+          budget,
+          std::move(hashRemote)),
+      symlinkTargetCache(
+          rootPath,
+          maxSymlinks,
+          errorTTL,
+          maxSymlinkBytes,
+          budget) {}
 
 InMemoryFileResult::InMemoryFileResult(
     const watchman_file* file,
-    InMemoryViewCaches& caches)
-    : file_(file), caches_(caches) {}
+    InMemoryViewCaches& caches,
+    bool snapshot,
+    w_string dirName)
+    : file_(file),
+      stat_(file->getStat()),
+      otime_(file->otime),
+      ctime_(file->ctime),
+      exists_(file->exists),
+      baseNameFolded_(file->name_folded),
+      dirName_(std::move(dirName)),
+      caches_(caches) {
+  if (snapshot) {
+    baseName_ = file->getName().asWString();
+    if (!dirName_) {
+      dirName_ = file->parent->getFullPath();
+    }
+    renamedFrom_ = renamedFromPath(file);
+    file_ = nullptr;
+  }
+}
 
 void InMemoryFileResult::batchFetchProperties(
     const std::vector<std::unique_ptr<FileResult>>& files) {
   std::vector<folly::Future<folly::Unit>> readlinkFutures;
   std::vector<folly::Future<folly::Unit>> sha1Futures;
 
+  // The content hashes that we need, and the files that need them.  An
+  // algorithm of -1 is the SHA-1 that is reported by getContentSha1().
+  struct HashTarget {
+    InMemoryFileResult* file;
+    int algorithm;
+  };
+  std::vector<ContentHashCacheKey> hashKeys;
+  std::vector<HashTarget> hashTargets;
+  std::vector<SymlinkTargetCacheKey> linkKeys;
+  std::vector<InMemoryFileResult*> linkTargets;
+
   // Since we may initiate some async work in the body of the function
   // below, we need to ensure that we wait for it to complete before
   // we return from this scope, even if we are throwing an exception.
@@ -52,7 +106,7 @@ void InMemoryFileResult::batchFetchProperties(
     auto* file = dynamic_cast<InMemoryFileResult*>(f.get());
 
     if (file->neededProperties() & FileResult::Property::SymlinkTarget) {
-      if (!file->file_->stat.isSymlink()) {
+      if (!file->stat_.isSymlink()) {
         // If this file is not a symlink then we yield
         // a nullptr w_string instance rather than propagating an error.
         // This behavior is relied upon by the field rendering code and
@@ -69,26 +123,16 @@ void InMemoryFileResult::batchFetchProperties(
           dir.advance(1);
         }
 
-        SymlinkTargetCacheKey key{w_string::pathCat({dir, file->baseName()}),
-                                  file->file_->otime};
-
-        readlinkFutures.emplace_back(
-            caches_.symlinkTargetCache.get(key).thenTry(
-                [file](folly::Try<std::shared_ptr<
-                           const SymlinkTargetCache::Node>>&& result) {
-                  if (result.hasValue()) {
-                    file->symlinkTarget_ = result.value()->value();
-                  } else {
-                    // we don't have a way to report the error for readlink
-                    // due to legacy requirements in the interface, so we
-                    // just set it to empty.
-                    file->symlinkTarget_ = w_string();
-                  }
-                }));
+        linkKeys.push_back(SymlinkTargetCacheKey{
+            file->caches_.paths.intern(dir, file->baseName()),
+            file->otime_});
+        linkTargets.push_back(file);
       }
     }
 
-    if (file->neededProperties() & FileResult::Property::ContentSha1) {
+    if (file->neededProperties() &
+        (FileResult::Property::ContentSha1 |
+         FileResult::Property::ContentFastHash)) {
       auto dir = file->dirName();
       dir.advance(file->caches_.contentHashCache.rootPath().size());
 
@@ -99,44 +143,88 @@ void InMemoryFileResult::batchFetchProperties(
         dir.advance(1);
       }
 
-      ContentHashCacheKey key{w_string::pathCat({dir, file->baseName()}),
-                              size_t(file->file_->stat.size),
-                              file->file_->stat.mtime};
+      ContentHashCacheKey key{file->caches_.paths.intern(dir, file->baseName()),
+                              size_t(file->stat_.size),
+                              file->stat_.mtime,
+                              uint64_t(file->stat_.ino)};
 
-      sha1Futures.emplace_back(caches_.contentHashCache.get(key).thenTry(
-          [file](folly::Try<std::shared_ptr<const ContentHashCache::Node>>&&
-                     result) {
-            file->contentSha1_ =
-                makeResultWith([&] { return result.value()->value(); });
-          }));
+      if (file->neededProperties() & FileResult::Property::ContentSha1) {
+        hashKeys.push_back(key);
+        hashTargets.push_back(HashTarget{file, -1});
+      }
+
+      if (file->neededProperties() & FileResult::Property::ContentFastHash) {
+        for (size_t i = 0; i < kNumContentHashAlgorithms; ++i) {
+          if (file->neededContentHashes_ & (1 << i)) {
+            key.algorithm = ContentHashAlgorithm(i);
+            hashKeys.push_back(key);
+            hashTargets.push_back(HashTarget{file, int(i)});
+          }
+        }
+        file->neededContentHashes_ = 0;
+      }
     }
 
     file->clearNeededProperties();
   }
-}
 
-Optional<FileInformation> InMemoryFileResult::stat() {
-  return file_->stat;
-}
+  // The links are read in batches rather than a file at a time too
+  auto linkFutures = caches_.symlinkTargetCache.getBatch(linkKeys);
+  for (size_t i = 0; i < linkFutures.size(); ++i) {
+    readlinkFutures.emplace_back(std::move(linkFutures[i]).thenTry(
+        [file = linkTargets[i]](
+            folly::Try<std::shared_ptr<const SymlinkTargetCache::Node>>&&
+                result) {
+          if (result.hasValue()) {
+            file->symlinkTarget_ = result.value()->value();
+          } else {
+            // we don't have a way to report the error for readlink
+            // due to legacy requirements in the interface, so we
+            // just set it to empty.
+            file->symlinkTarget_ = w_string();
+          }
+        }));
+  }
 
-Optional<size_t> InMemoryFileResult::size() {
-  return file_->stat.size;
+  // The hashes are computed in batches rather than a file at a time
+  auto hashFutures = caches_.contentHashCache.getBatch(hashKeys);
+  for (size_t i = 0; i < hashFutures.size(); ++i) {
+    sha1Futures.emplace_back(std::move(hashFutures[i]).thenTry(
+        [target = hashTargets[i]](
+            folly::Try<std::shared_ptr<const ContentHashCache::Node>>&&
+                result) {
+          auto file = target.file;
+          if (target.algorithm < 0) {
+            file->contentSha1_ = makeResultWith([&] {
+              auto& value = result.value()->value();
+              FileResult::ContentHash hash;
+              std::copy_n(value.begin(), hash.size(), hash.begin());
+              return hash;
+            });
+          } else {
+            file->contentHashes_[target.algorithm] =
+                makeResultWith([&] { return result.value()->value(); });
+          }
+        }));
+  }
 }
 
 Optional<struct timespec> InMemoryFileResult::accessedTime() {
-  return file_->stat.atime;
+  return stat_.atime;
 }
 
 Optional<struct timespec> InMemoryFileResult::modifiedTime() {
-  return file_->stat.mtime;
+  return stat_.mtime;
 }
 
 Optional<struct timespec> InMemoryFileResult::changedTime() {
-  return file_->stat.ctime;
+  return stat_.ctime;
 }
 
-w_string_piece InMemoryFileResult::baseName() {
-  return file_->getName();
+const void* InMemoryFileResult::identity() {
+  // This is nullptr for a snapshot, since it may outlive its node, whose
+  // address could then be reused by another file
+  return file_;
 }
 
 w_string_piece InMemoryFileResult::dirName() {
@@ -146,21 +234,17 @@ w_string_piece InMemoryFileResult::dirName() {
   return dirName_;
 }
 
-Optional<bool> InMemoryFileResult::exists() {
-  return file_->exists;
-}
-
 Optional<w_clock_t> InMemoryFileResult::ctime() {
-  return file_->ctime;
+  return ctime_;
 }
 
 Optional<w_clock_t> InMemoryFileResult::otime() {
-  return file_->otime;
+  return otime_;
 }
 
 Optional<w_string> InMemoryFileResult::readLink() {
   if (!symlinkTarget_.has_value()) {
-    if (!file_->stat.isSymlink()) {
+    if (!stat_.isSymlink()) {
       // If this file is not a symlink then we immediately yield
       // a nullptr w_string instance rather than propagating an error.
       // This behavior is relied upon by the field rendering code and
@@ -175,14 +259,39 @@ Optional<w_string> InMemoryFileResult::readLink() {
   return symlinkTarget_;
 }
 
+Optional<w_string> InMemoryFileResult::renamedFrom() {
+  if (file_) {
+    return renamedFromPath(file_);
+  }
+  return renamedFrom_;
+}
+
+Optional<TreeSummary> InMemoryFileResult::treeSummary() {
+  if (file_) {
+    return treeSummaryOf(file_);
+  }
+  return treeSummary_;
+}
+
+Optional<TreeSummary> treeSummaryOf(const watchman_file* file) {
+  if (!file->exists || !file->stat.isDir()) {
+    return folly::none;
+  }
+  auto dir = file->parent->getChildDir(file->getName());
+  if (!dir) {
+    return folly::none;
+  }
+  return dir->getTreeSummary();
+}
+
 Optional<FileResult::ContentHash> InMemoryFileResult::getContentSha1() {
-  if (!file_->exists) {
+  if (!exists_) {
     // Don't return hashes for files that we believe to be deleted.
     throw std::system_error(
         std::make_error_code(std::errc::no_such_file_or_directory));
   }
 
-  if (!file_->stat.isFile()) {
+  if (!stat_.isFile()) {
     // We only want to compute the hash for regular files
     throw std::system_error(std::make_error_code(std::errc::is_a_directory));
   }
@@ -194,39 +303,164 @@ Optional<FileResult::ContentHash> InMemoryFileResult::getContentSha1() {
   return contentSha1_.value();
 }
 
-InMemoryView::view::view(const w_string& root_path)
-    : root_dir(std::make_unique<watchman_dir>(root_path, nullptr)) {}
+Optional<FileResult::ContentDigest> InMemoryFileResult::getContentHash(
+    ContentHashAlgorithm algorithm) {
+  if (!exists_) {
+    // Don't return hashes for files that we believe to be deleted.
+    throw std::system_error(
+        std::make_error_code(std::errc::no_such_file_or_directory));
+  }
+
+  if (!stat_.isFile()) {
+    // We only want to compute the hash for regular files
+    throw std::system_error(std::make_error_code(std::errc::is_a_directory));
+  }
+
+  auto& hash = contentHashes_[size_t(algorithm)];
+  if (hash.empty()) {
+    neededContentHashes_ |= 1 << size_t(algorithm);
+    accessorNeedsProperties(FileResult::Property::ContentFastHash);
+    return folly::none;
+  }
+  return hash.value();
+}
+
+// Returns the persistent content hash store for the root, if enabled
+static std::shared_ptr<ContentHashStore> makeContentHashStore(
+    const Configuration& config,
+    const w_string& rootPath) {
+  if (!config.getBool("content_hash_persist", false)) {
+    return nullptr;
+  }
+  auto stateDir = w_string_piece(watchman_state_file).dirName();
+  // The root path is also recorded in the store, so a collision will
+  // simply cause the store to be ignored
+  return std::make_shared<ContentHashStore>(
+      w_string::format(
+          "{}/contenthash-{:08x}.store",
+          stateDir,
+          w_string_piece(rootPath).hashValue()),
+      rootPath,
+      size_t(std::max(
+          config.getInt("content_hash_persist_max_items", 256 * 1024),
+          json_int_t(0))));
+}
+
+// Returns the shared content hash tier for the root, if enabled
+static std::shared_ptr<ContentHashRemote> makeContentHashRemote(
+    const Configuration& config,
+    const w_string& rootPath) {
+  auto sharedDir = config.getString("content_hash_shared_dir", "");
+  if (!*sharedDir) {
+    return nullptr;
+  }
+  // The tier relies on the SCM to tell which files match the manifest
+  auto scm = SCM::scmForPath(rootPath);
+  if (!scm) {
+    log(ERR,
+        "content_hash_shared_dir is set but ",
+        rootPath,
+        " is not a source control checkout; not using shared hashes\n");
+    return nullptr;
+  }
+  return std::make_shared<ContentHashRemote>(
+      w_string(sharedDir, W_STRING_UNICODE),
+      std::move(scm),
+      w_string(
+          config.getString("content_hash_shared_merge_base_with", "master"),
+          W_STRING_UNICODE),
+      std::chrono::milliseconds(std::max(
+          config.getInt("content_hash_shared_status_ttl_ms", 60000),
+          json_int_t(0))));
+}
+
+// Returns the memory budget that is shared by the caches of all of the
+// roots, if one is configured
+static std::shared_ptr<CacheMemoryBudget> getCacheMemoryBudget() {
+  static const auto budget = []() -> std::shared_ptr<CacheMemoryBudget> {
+    auto maxBytes = cfg_get_int("cache_memory_budget_bytes", 0);
+    if (maxBytes <= 0) {
+      return nullptr;
+    }
+    return std::make_shared<CacheMemoryBudget>(size_t(maxBytes));
+  }();
+  return budget;
+}
+
+InMemoryView::view::view(const w_string& root_path, NodeArena& arena)
+    : root_dir(watchman_dir::make(arena, root_path, nullptr)) {}
 
 InMemoryView::InMemoryView(w_root_t* root, std::shared_ptr<Watcher> watcher)
     : cookies_(root->cookies),
       config_(root->config),
-      view_(view(root->root_path)),
+      arena_(config_.getBool("view_huge_pages", false)),
+      view_(view(root->root_path, arena_)),
       rootNumber_(next_root_number++),
       root_path(root->root_path),
       watcher_(watcher),
+      enableCookieFreeSync_(config_.getBool("sync_without_cookies", false)),
+      notifyBatchInterval_(std::max(
+          config_.getInt("notify_batch_interval_ms", 0),
+          json_int_t(0))),
+      threadCpus_(cpuSetFromConfig(
+          config_.get("root_thread_cpus"),
+          config_.getInt("root_thread_numa_node", -1),
+          "root_thread_cpus",
+          "root_thread_numa_node")),
       caches_(
           root->root_path,
           config_.getInt("content_hash_max_items", 128 * 1024),
           config_.getInt("symlink_target_max_items", 32 * 1024),
+          size_t(std::max(
+              config_.getInt("content_hash_max_bytes", 0), json_int_t(0))),
+          size_t(std::max(
+              config_.getInt("symlink_target_max_bytes", 0), json_int_t(0))),
           std::chrono::milliseconds(
-              config_.getInt("content_hash_negative_cache_ttl_ms", 2000))),
+              config_.getInt("content_hash_negative_cache_ttl_ms", 2000)),
+          makeContentHashStore(config_, root->root_path),
+          getCacheMemoryBudget(),
+          makeContentHashRemote(config_, root->root_path)),
       enableContentCacheWarming_(
           config_.getBool("content_hash_warming", false)),
       maxFilesToWarmInContentCache_(
           size_t(config_.getInt("content_hash_max_warm_per_settle", 1024))),
       syncContentCacheWarming_(
           config_.getBool("content_hash_warm_wait_before_settle", false)),
+      warmBytesPerSecond_(uint64_t(std::max(
+          config_.getInt("content_hash_warm_bytes_per_second", 0),
+          json_int_t(0)))),
+      enableSymlinkTargetWarming_(
+          config_.getBool("symlink_target_warming", false)),
+      enableSnapshotReads_(config_.getBool("query_snapshot_reads", false)),
+      queryParallelism_(size_t(
+          std::max(config_.getInt("query_parallelism", 1), json_int_t(1)))),
+      queryParallelMinFiles_(size_t(std::max(
+          config_.getInt("query_parallel_min_files", 50000), json_int_t(1)))),
+      enableSnapshot_(config_.getBool("view_snapshot", false)),
+      snapshotInterval_(
+          config_.getInt("view_snapshot_interval_seconds", 600)),
+      trustUnchangedDirsOnRecrawl_(
+          config_.getBool("recrawl_trust_unchanged_dirs", false)),
+      crawlParallelism_(size_t(
+          std::max(config_.getInt("crawl_parallelism", 1), json_int_t(1)))),
+      batchStatQueueDepth_(unsigned(std::max(
+          config_.getInt("batch_stat_queue_depth", 0), json_int_t(0)))),
+      settleMin_(int(std::max(config_.getInt("settle_min", 2), json_int_t(0)))),
+      settleMax_(int(std::max(config_.getInt("settle_max", 0), json_int_t(0)))),
+      overflowRecoveryBudget_(size_t(std::max(
+          config_.getInt("overflow_recovery_budget", 0), json_int_t(0)))),
+      ageOutSliceTime_(
+          std::max(config_.getInt("gc_slice_ms", 0), json_int_t(0))),
+      detectDirRenames_(config_.getBool("detect_dir_renames", false)),
+      suppressUnchangedContent_(
+          config_.getBool("suppress_unchanged_content", false)),
+      basenameIndex_(config_.getBool("basename_index", false)),
+      viewMemoryBudget_(size_t(
+          std::max(config_.getInt("view_memory_budget", 0), json_int_t(0)))),
+      coldSubtreeAge_(std::max(
+          config_.getInt("cold_subtree_seconds", 3600), json_int_t(0))),
       scm_(SCM::scmForPath(root->root_path)) {}
 
-void InMemoryView::view::insertAtHeadOfFileList(struct watchman_file* file) {
-  file->next = latest_file;
-  if (file->next) {
-    file->next->prev = &file->next;
-  }
-  latest_file = file;
-  file->prev = &latest_file;
-}
-
 void InMemoryView::markFileChanged(
     SyncView::LockedPtr& view,
     watchman_file* file,
@@ -237,14 +471,10 @@ void InMemoryView::markFileChanged(
 
   file->otime.timestamp = now.tv_sec;
   file->otime.ticks = mostRecentTick_;
+  file->parent->markSubtreeChanged(file->otime);
+  file->parent->invalidateTreeSummary();
 
-  if (view->latest_file != file) {
-    // unlink from list
-    file->removeFromFileList();
-
-    // and move to the head
-    view->insertAtHeadOfFileList(file);
-  }
+  view->journal.append(file, file->otime.ticks);
 }
 
 const watchman_dir* InMemoryView::resolveDir(
@@ -340,14 +570,7 @@ watchman_dir* InMemoryView::resolveDir(
       // parent dir now and our other machinery will populate its contents
       // later.
       w_string child_name(dir_component, (uint32_t)(sep - dir_component));
-
-      // Careful! dir->dirs is keyed by non-owning string pieces so the
-      // child_name MUST be stored or otherwise kept alive by the watchman_dir
-      // instance constructed below!
-      auto& new_child = dir->dirs[child_name];
-      new_child.reset(new watchman_dir(child_name, dir));
-
-      child = new_child.get();
+      child = dir->makeChildDir(child_name);
     }
 
     parent = dir;
@@ -368,15 +591,7 @@ watchman_dir* InMemoryView::resolveDir(
   }
 
   w_string child_name(dir_component, (uint32_t)(dir_end - dir_component));
-  // Careful! parent->dirs is keyed by non-owning string pieces so the
-  // child_name MUST be stored or otherwise kept alive by the watchman_dir
-  // instance constructed below!
-  auto& new_child = parent->dirs[child_name];
-  new_child.reset(new watchman_dir(child_name, parent));
-
-  dir = new_child.get();
-
-  return dir;
+  return parent->makeChildDir(child_name);
 }
 
 void InMemoryView::markDirDeleted(
@@ -422,34 +637,28 @@ watchman_file* InMemoryView::getOrCreateChildFile(
     return it->second.get();
   }
 
-  // ... but take the shorter string from inside the file that
-  // we create as the key.
-  auto file = watchman_file::make(file_name, dir);
-  auto& file_ptr = dir->files[file->getName()];
-  file_ptr = std::move(file);
+  // ... the table takes its key from the name stored inside the file
+  // that we create.
+  auto file_ptr = dir->addChildFile(watchman_file::make(file_name, dir));
 
   file_ptr->ctime.ticks = mostRecentTick_;
   file_ptr->ctime.timestamp = now.tv_sec;
 
   auto suffix = file_name.asLowerCaseSuffix();
   if (suffix) {
-    auto& sufhead = view->suffixes[suffix];
-    if (!sufhead) {
-      // Create the list head if we don't already have one for this suffix.
-      sufhead.reset(new watchman::InMemoryView::file_list_head);
-    }
-
-    file_ptr->suffix_next = sufhead->head;
-    if (file_ptr->suffix_next) {
-      sufhead->head->suffix_prev = &file_ptr->suffix_next;
-    }
-    sufhead->head = file_ptr.get();
-    file_ptr->suffix_prev = &sufhead->head;
+    view->suffixes[suffix].add(file_ptr);
+  }
+  if (basenameIndex_) {
+    auto name = file_ptr->getName();
+    auto key = file_ptr->name_folded
+        ? w_string(name.data(), name.size(), file_name.type())
+        : name.asLowerCase(file_name.type());
+    view->basenames[key].add(file_ptr);
   }
 
-  watcher_->startWatchFile(file_ptr.get());
+  watcher_->startWatchFile(file_ptr);
 
-  return file_ptr.get();
+  return file_ptr;
 }
 
 void InMemoryView::ageOutFile(
@@ -474,34 +683,58 @@ void InMemoryView::ageOutFile(
 }
 
 void InMemoryView::ageOut(w_perf_t& sample, std::chrono::seconds minAge) {
-  struct watchman_file *file, *prior;
-  time_t now;
-  uint32_t num_aged_files = 0;
-  uint32_t num_walked = 0;
   std::unordered_set<w_string> dirs_to_erase;
+  size_t num_walked = 0;
+  size_t num_aged_files = 0;
 
-  time(&now);
-  last_age_out_timestamp = now;
   auto view = view_.wlock();
+  auto sliceStart = std::chrono::steady_clock::now();
+
+  if (!ageOutPass_ || ageOutPass_->minAge != minAge) {
+    // Start a new pass; one with a different minimum age can't carry on
+    // from where the old one got to
+    time_t now;
+    time(&now);
+    last_age_out_timestamp = now;
+    ageOutPass_.emplace();
+    ageOutPass_->minAge = minAge;
+    ageOutPass_->now = now;
+    ageOutPass_->generation = view->journal.generation();
+    ageOutInProgress_ = true;
+  }
+  auto& pass = *ageOutPass_;
+  ++pass.slices;
+
+  if (pass.generation != view->journal.generation()) {
+    // The journal was compacted since the last slice.  Resuming from the
+    // start of the last tick that we looked at may revisit a few files,
+    // which is harmless.
+    pass.position = view->journal.positionOf(pass.positionTick);
+    pass.generation = view->journal.generation();
+  }
 
-  file = view->latest_file;
-  prior = nullptr;
-  while (file) {
-    ++num_walked;
-    if (file->exists || file->otime.timestamp + minAge.count() > now) {
-      prior = file;
-      file = file->next;
+  // The journal is walked from the oldest change, so the files that
+  // change while the pass is in progress move past the position and are
+  // still looked at.  ageOutFile frees the file node, which only clears
+  // its entry.
+  size_t visited = 0;
+  while (pass.position < view->journal.size()) {
+    // Checking the clock for every entry would cost more than the work
+    if (ageOutSliceTime_.count() > 0 && ++visited % 1024 == 0 &&
+        std::chrono::steady_clock::now() - sliceStart >= ageOutSliceTime_) {
+      break;
+    }
+    auto& entry = view->journal.entryAt(pass.position++);
+    pass.positionTick = entry.tick;
+    auto file = entry.node;
+    if (!file) {
       continue;
     }
-
-    ageOutFile(dirs_to_erase, file);
-    num_aged_files++;
-
-    // Go back to last good file node; we can't trust that the
-    // value of file->next saved before age_out_file is a valid
-    // file node as anything past that point may have also been
-    // aged out along with it.
-    file = prior;
+    ++num_walked;
+    if (!file->exists && file->otime.timestamp + minAge.count() <= pass.now) {
+      ageOutFile(dirs_to_erase, file);
+      num_aged_files++;
+    }
   }
 
   for (auto& name : dirs_to_erase) {
@@ -511,74 +744,389 @@ void InMemoryView::ageOut(w_perf_t& sample, std::chrono::seconds minAge) {
     }
   }
 
-  if (num_aged_files + dirs_to_erase.size()) {
-    logf(ERR, "aged {} files, {} dirs\n", num_aged_files, dirs_to_erase.size());
+  pass.walked += num_walked;
+  pass.files += num_aged_files;
+  pass.dirs += dirs_to_erase.size();
+
+  auto meta = json_object(
+      {{"walked", json_integer(num_walked)},
+       {"files", json_integer(num_aged_files)},
+       {"dirs", json_integer(dirs_to_erase.size())},
+       {"slice", json_integer(pass.slices)}});
+
+  bool complete = pass.position >= view->journal.size();
+  if (complete) {
+    // Now that the aged nodes have been returned to the arena, release
+    // any slabs that are no longer holding live nodes.
+    auto slabs_released = arena_.compact();
+    auto arena_stats = arena_.stats();
+    auto journal_compacted = view->journal.compact();
+    auto suffixes_compacted = compactSuffixLists(view);
+    if (detectDirRenames_) {
+      pruneDirInodes(view);
+    }
+
+    if (pass.files + pass.dirs) {
+      logf(ERR, "aged {} files, {} dirs\n", pass.files, pass.dirs);
+    }
+    meta.set(
+        {{"pass_walked", json_integer(pass.walked)},
+         {"pass_files", json_integer(pass.files)},
+         {"pass_dirs", json_integer(pass.dirs)},
+         {"slabs_released", json_integer(slabs_released)},
+         {"slabs", json_integer(arena_stats.numSlabs)},
+         {"bytes_in_use", json_integer(arena_stats.bytesInUse)},
+         {"journal_compacted", json_integer(journal_compacted)},
+         {"journal_size", json_integer(view->journal.size())},
+         {"suffixes_compacted", json_integer(suffixes_compacted)}});
+    ageOutPass_.reset();
+    ageOutInProgress_ = false;
+  }
+  meta.set(
+      {{"complete", json_boolean(complete)},
+       {"slice_us",
+        json_integer(std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - sliceStart)
+                         .count())}});
+  sample.add_meta("age_out", std::move(meta));
+}
+
+bool InMemoryView::ageOutInProgress() const {
+  return ageOutInProgress_;
+}
+
+namespace {
+template <typename Lists>
+size_t compactLists(Lists& lists) {
+  size_t removed = 0;
+  for (auto it = lists.begin(); it != lists.end();) {
+    removed += it->second.compact();
+    if (it->second.empty()) {
+      it = lists.erase(it);
+    } else {
+      ++it;
+    }
   }
-  sample.add_meta(
-      "age_out",
-      json_object({{"walked", json_integer(num_walked)},
-                   {"files", json_integer(num_aged_files)},
-                   {"dirs", json_integer(dirs_to_erase.size())}}));
+  return removed;
 }
+} // namespace
 
-void InMemoryView::timeGenerator(w_query* query, struct w_query_ctx* ctx)
-    const {
-  struct watchman_file* f;
+size_t InMemoryView::compactSuffixLists(SyncView::LockedPtr& view) {
+  return compactLists(view->suffixes) + compactLists(view->basenames);
+}
 
-  // Walk back in time until we hit the boundary
-  auto view = view_.rlock();
-  for (f = view->latest_file; f; f = f->next) {
-    ctx->bumpNumWalked();
-    // Note that we use <= for the time comparisons in here so that we
-    // report the things that changed inclusive of the boundary presented.
-    // This is especially important for clients using the coarse unix
-    // timestamp as the since basis, as they would be much more
-    // likely to miss out on changes if we didn't.
-    if (ctx->since.is_timestamp && f->otime.timestamp <= ctx->since.timestamp) {
-      break;
+namespace {
+// Evaluates a result that the caller owns, only copying it to the heap if
+// the query is going to keep it
+void processResult(w_query* query, w_query_ctx* ctx, InMemoryFileResult& file) {
+  w_query_process_file(query, ctx, file, [&file] {
+    return std::make_unique<InMemoryFileResult>(std::move(file));
+  });
+}
+} // namespace
+
+InMemoryView::FileEmitter::FileEmitter(
+    const InMemoryView& view,
+    w_query* query,
+    w_query_ctx* ctx,
+    bool parallel)
+    : view_(view),
+      query_(query),
+      ctx_(ctx),
+      // Each dedup set, limit and ordering would only see its own share
+      // of the results
+      parallel_(
+          parallel && view.queryParallelism_ > 1 && !query->dedup_results &&
+          !query->limit && !query->order_by_name && !query->order_by_ticks &&
+          !query->group_by_dir),
+      // A limited query is evaluated as the files are walked, so that the
+      // walk can stop as soon as enough of them have matched.  A streaming
+      // query is evaluated once the lock has been released, as passing its
+      // results to result_sink may block on writing to the client.
+      snapshot_(
+          (view.enableSnapshotReads_ || parallel_ ||
+           query->stream_chunk_size > 0) &&
+          !query->limit) {
+  if (!snapshot_ && ctx->streamResults) {
+    // Hold the results of a limited streaming query back until flush()
+    ctx->streamResults = false;
+    pausedStreaming_ = true;
+  }
+  if (snapshot_) {
+    for (auto field : query->fieldList) {
+      w_string_piece name(field->name);
+      if (name == "tree_hash" || name == "tree_stats") {
+        treeSummary_ = true;
+      }
     }
-    if (!ctx->since.is_timestamp && f->otime.ticks <= ctx->since.clock.ticks) {
+  }
+}
+
+void InMemoryView::FileEmitter::emit(const watchman_file* file) {
+  if (emitted_) {
+    emitted_->push_back(file);
+  }
+  if (!snapshot_) {
+    InMemoryFileResult result(file, view_.caches_);
+    processResult(query_, ctx_, result);
+    return;
+  }
+
+  if (file->parent != lastDir_) {
+    lastDir_ = file->parent;
+    lastDirName_ = lastDir_->getFullPath();
+  }
+  deferred_.emplace_back(file, view_.caches_, true, lastDirName_);
+  if (treeSummary_) {
+    deferred_.back().setTreeSummary(treeSummaryOf(file));
+  }
+}
+
+void InMemoryView::FileEmitter::flush() {
+  lastDir_ = nullptr;
+  lastDirName_.reset();
+
+  if (pausedStreaming_) {
+    pausedStreaming_ = false;
+    ctx_->streamResults = true;
+    ctx_->maybeStreamResults();
+  }
+
+  auto deferred = std::move(deferred_);
+  deferred_.clear();
+  if (parallel_ && deferred.size() >= view_.queryParallelMinFiles_) {
+    view_.evaluateInParallel(query_, ctx_, deferred);
+    return;
+  }
+  for (auto& file : deferred) {
+    processResult(query_, ctx_, file);
+  }
+}
+
+void InMemoryView::evaluateInParallel(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    std::vector<InMemoryFileResult>& files) const {
+  // This is a dedicated pool, rather than the shared one, because the
+  // evaluation may block on content hashes that are computed in the
+  // shared pool
+  std::call_once(queryPoolStarted_, [this] {
+    // The queue is shared by concurrent queries
+    queryPool_.start(queryParallelism_, 1024);
+  });
+
+  // More chunks than workers, so that a chunk of expensive files doesn't
+  // hold up the whole query.  The chunks are runs of consecutive files,
+  // which for the tree walking generators means whole subtrees.
+  auto numChunks = queryParallelism_ * 2;
+  auto chunkSize = (files.size() + numChunks - 1) / numChunks;
+
+  std::vector<std::unique_ptr<w_query_ctx>> workers;
+  std::vector<folly::Future<folly::Unit>> futures;
+  std::exception_ptr error;
+  for (size_t begin = 0; begin < files.size(); begin += chunkSize) {
+    auto end = std::min(files.size(), begin + chunkSize);
+    workers.emplace_back(ctx->makeWorkerContext());
+    auto worker = workers.back().get();
+    try {
+      futures.emplace_back(
+          folly::via(&queryPool_, [query, worker, &files, begin, end] {
+            for (auto i = begin; i < end; ++i) {
+              processResult(query, worker, files[i]);
+            }
+            worker->fetchEvalBatchNow();
+            while (!worker->fetchRenderBatchNow()) {
+            }
+          }));
+    } catch (const std::exception&) {
+      // The queue is full
+      error = std::current_exception();
       break;
     }
+  }
+  // Wait for all of them before looking at the results, or unwinding;
+  // the workers reference files.
+  auto results = folly::collectAll(futures.begin(), futures.end()).get();
+  if (error) {
+    std::rethrow_exception(error);
+  }
 
-    if (!ctx->fileMatchesRelativeRoot(f)) {
-      continue;
+  // Concatenate the results in the order of the chunks to produce the
+  // same order as serial evaluation
+  for (size_t i = 0; i < workers.size(); ++i) {
+    results[i].throwIfFailed();
+    ctx->mergeWorkerContext(*workers[i]);
+  }
+}
+
+InMemoryView::SyncView::ConstLockedPtr InMemoryView::lockViewForQuery(
+    struct w_query_ctx* ctx) const {
+  auto start = std::chrono::steady_clock::now();
+  auto view = view_.rlock();
+  ctx->viewLockWaitTime +=
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start);
+  return view;
+}
+
+namespace {
+// Tests whether files are within the relative root of a query by looking
+// for its dir, resolved once, among their ancestors.  This spares
+// assembling the path of the dir of each file, as
+// w_query_ctx::fileMatchesRelativeRoot has to.
+class RelativeRootMatcher {
+ public:
+  // dir is the dir of the relative root, or nullptr if it doesn't exist,
+  // in which case no file matches
+  RelativeRootMatcher(bool hasRelativeRoot, const watchman_dir* dir)
+      : hasRelativeRoot_(hasRelativeRoot), dir_(dir) {}
+
+  bool operator()(const watchman_file* file) const {
+    if (!hasRelativeRoot_) {
+      return true;
     }
+    for (auto dir = file->parent; dir; dir = dir->parent) {
+      if (dir == dir_) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  bool hasRelativeRoot_;
+  const watchman_dir* dir_;
+};
+} // namespace
+
+void InMemoryView::timeGenerator(w_query* query, struct w_query_ctx* ctx)
+    const {
+  FileEmitter emitter(*this, query, ctx);
+
+  {
+    auto view = lockViewForQuery(ctx);
+    RelativeRootMatcher inRelativeRoot(
+        bool(query->relative_root),
+        query->relative_root ? resolveDir(view, query->relative_root)
+                             : nullptr);
+    auto visit = [&](watchman_file* f) {
+      if (emitter.done()) {
+        return false;
+      }
+      ctx->bumpNumWalked();
+      // Note that we use <= for the time comparisons in here so that we
+      // report the things that changed inclusive of the boundary presented.
+      // This is especially important for clients using the coarse unix
+      // timestamp as the since basis, as they would be much more
+      // likely to miss out on changes if we didn't.
+      if (ctx->since.is_timestamp &&
+          f->otime.timestamp <= ctx->since.timestamp) {
+        return false;
+      }
 
-    w_query_process_file(
-        query, ctx, std::make_unique<InMemoryFileResult>(f, caches_));
+      if (inRelativeRoot(f)) {
+        emitter.emit(f);
+      }
+      return true;
+    };
+
+    if (ctx->since.is_timestamp) {
+      // The journal isn't indexed by timestamp; walk back in time
+      // until we hit the boundary
+      view->journal.forEach(visit);
+    } else if (query->relative_root) {
+      // The journal holds the changes to the whole root, which may be
+      // mostly outside of the relative root; walk the changed parts of
+      // its subtree instead
+      auto dir = resolveDir(view, query->relative_root);
+      if (dir) {
+        sinceDirGenerator(emitter, ctx, dir, ctx->since.clock.ticks);
+      }
+    } else {
+      // Seek directly to the changes that follow the boundary
+      view->journal.forEachSince(ctx->since.clock.ticks, visit);
+    }
   }
+
+  emitter.flush();
 }
 
 void InMemoryView::suffixGenerator(w_query* query, struct w_query_ctx* ctx)
     const {
-  struct watchman_file* f;
+  FileEmitter emitter(*this, query, ctx);
 
-  auto view = view_.rlock();
-  for (const auto& suff : *query->suffixes) {
-    // Head of suffix index for this suffix
-    auto it = view->suffixes.find(suff);
-    if (it == view->suffixes.end()) {
-      continue;
+  {
+    auto view = lockViewForQuery(ctx);
+    RelativeRootMatcher inRelativeRoot(
+        bool(query->relative_root),
+        query->relative_root ? resolveDir(view, query->relative_root)
+                             : nullptr);
+    // A file has a single suffix, so the lists of the suffixes are
+    // disjoint and can simply be walked in turn
+    for (const auto& suff : *query->suffixes) {
+      if (emitter.done()) {
+        break;
+      }
+      auto it = view->suffixes.find(suff);
+      if (it == view->suffixes.end()) {
+        continue;
+      }
+
+      it->second.forEach([&](watchman_file* f) {
+        ctx->bumpNumWalked();
+        if (inRelativeRoot(f)) {
+          emitter.emit(f);
+        }
+        return !emitter.done();
+      });
     }
+  }
 
-    // Walk and process
-    for (f = it->second->head; f; f = f->suffix_next) {
-      ctx->bumpNumWalked();
-      if (!ctx->fileMatchesRelativeRoot(f)) {
+  emitter.flush();
+}
+
+void InMemoryView::basenameGenerator(w_query* query, struct w_query_ctx* ctx)
+    const {
+  FileEmitter emitter(*this, query, ctx);
+
+  {
+    auto view = lockViewForQuery(ctx);
+    RelativeRootMatcher inRelativeRoot(
+        bool(query->relative_root),
+        query->relative_root ? resolveDir(view, query->relative_root)
+                             : nullptr);
+    // The planner removed duplicate names, so the lists are disjoint
+    for (const auto& name : *query->basenames) {
+      if (emitter.done()) {
+        break;
+      }
+      auto it = view->basenames.find(name);
+      if (it == view->basenames.end()) {
         continue;
       }
 
-      w_query_process_file(
-          query, ctx, std::make_unique<InMemoryFileResult>(f, caches_));
+      it->second.forEach([&](watchman_file* f) {
+        ctx->bumpNumWalked();
+        if (inRelativeRoot(f)) {
+          emitter.emit(f);
+        }
+        return !emitter.done();
+      });
     }
   }
+
+  emitter.flush();
+}
+
+bool InMemoryView::hasBasenameIndex() const {
+  return basenameIndex_;
 }
 
 void InMemoryView::pathGenerator(w_query* query, struct w_query_ctx* ctx)
     const {
   w_string_t* relative_root;
   struct watchman_file* f;
+  FileEmitter emitter(*this, query, ctx, true);
 
   if (query->relative_root) {
     relative_root = query->relative_root;
@@ -586,101 +1134,162 @@ void InMemoryView::pathGenerator(w_query* query, struct w_query_ctx* ctx)
     relative_root = root_path;
   }
 
-  auto view = view_.rlock();
+  {
+    auto view = lockViewForQuery(ctx);
 
-  for (const auto& path : *query->paths) {
-    const watchman_dir* dir;
-    w_string dir_name;
+    for (const auto& path : *query->paths) {
+      if (emitter.done()) {
+        break;
+      }
+      const watchman_dir* dir;
+      w_string dir_name;
 
-    // Compose path with root
-    auto full_name = w_string::pathCat({relative_root, path.name});
+      // Compose path with root
+      auto full_name = w_string::pathCat({relative_root, path.name});
 
-    // special case of root dir itself
-    if (w_string_equal(root_path, full_name)) {
-      // dirname on the root is outside the root, which is useless
-      dir = resolveDir(view, full_name);
-      goto is_dir;
-    }
+      // special case of root dir itself
+      if (w_string_equal(root_path, full_name)) {
+        if (path.exact) {
+          // The root isn't a file in the view
+          continue;
+        }
+        // dirname on the root is outside the root, which is useless
+        dir = resolveDir(view, full_name);
+        goto is_dir;
+      }
 
-    // Ideally, we'd just resolve it directly as a dir and be done.
-    // It's not quite so simple though, because we may resolve a dir
-    // that had been deleted and replaced by a file.
-    // We prefer to resolve the parent and walk down.
-    dir_name = full_name.dirName();
-    if (!dir_name) {
-      continue;
-    }
+      // Ideally, we'd just resolve it directly as a dir and be done.
+      // It's not quite so simple though, because we may resolve a dir
+      // that had been deleted and replaced by a file.
+      // We prefer to resolve the parent and walk down.
+      dir_name = full_name.dirName();
+      if (!dir_name) {
+        continue;
+      }
 
-    dir = resolveDir(view, dir_name);
+      dir = resolveDir(view, dir_name);
 
-    if (!dir) {
-      // Doesn't exist, and never has
-      continue;
-    }
+      if (!dir) {
+        // Doesn't exist, and never has
+        continue;
+      }
 
-    if (!dir->files.empty()) {
-      auto file_name = path.name.baseName();
-      f = dir->getChildFile(file_name);
+      if (!dir->files.empty()) {
+        auto file_name = path.name.baseName();
+        f = dir->getChildFile(file_name);
 
-      // If it's a file (but not an existent dir)
-      if (f && (!f->exists || !f->stat.isDir())) {
-        ctx->bumpNumWalked();
-        w_query_process_file(
-            query, ctx, std::make_unique<InMemoryFileResult>(f, caches_));
-        continue;
+        // If it's a file (but not an existent dir), or we want the entry
+        // itself whatever it is
+        if (f && (path.exact || !f->exists || !f->stat.isDir())) {
+          ctx->bumpNumWalked();
+          emitter.emit(f);
+          continue;
+        }
       }
-    }
 
-    // Is it a dir?
-    if (dir->dirs.empty()) {
-      continue;
-    }
+      // Is it a dir?
+      if (path.exact || dir->dirs.empty()) {
+        continue;
+      }
 
-    dir = dir->getChildDir(full_name.baseName());
-  is_dir:
-    // We got a dir; process recursively to specified depth
-    if (dir) {
-      dirGenerator(query, ctx, dir, path.depth);
+      dir = dir->getChildDir(full_name.baseName());
+    is_dir:
+      // We got a dir; process recursively to specified depth
+      if (dir) {
+        dirGenerator(emitter, ctx, dir, path.depth);
+      }
     }
   }
+
+  emitter.flush();
 }
 
 void InMemoryView::dirGenerator(
-    w_query* query,
+    FileEmitter& emitter,
     struct w_query_ctx* ctx,
     const watchman_dir* dir,
     uint32_t depth) const {
   for (auto& it : dir->files) {
+    if (emitter.done()) {
+      return;
+    }
     auto file = it.second.get();
     ctx->bumpNumWalked();
 
-    w_query_process_file(
-        query, ctx, std::make_unique<InMemoryFileResult>(file, caches_));
+    emitter.emit(file);
   }
 
   if (depth > 0) {
     for (auto& it : dir->dirs) {
+      if (emitter.done()) {
+        return;
+      }
       const auto child = it.second.get();
 
-      dirGenerator(query, ctx, child, depth - 1);
+      dirGenerator(emitter, ctx, child, depth - 1);
+    }
+  }
+}
+
+void InMemoryView::sinceDirGenerator(
+    FileEmitter& emitter,
+    struct w_query_ctx* ctx,
+    const watchman_dir* dir,
+    uint32_t sinceTick) const {
+  for (auto& it : dir->files) {
+    if (emitter.done()) {
+      return;
+    }
+    auto file = it.second.get();
+    ctx->bumpNumWalked();
+    if (file->otime.ticks > sinceTick) {
+      emitter.emit(file);
+    }
+  }
+
+  for (auto& it : dir->dirs) {
+    if (emitter.done()) {
+      return;
+    }
+    const auto child = it.second.get();
+    if (child->subtree_tick > sinceTick) {
+      sinceDirGenerator(emitter, ctx, child, sinceTick);
     }
   }
 }
 
 void InMemoryView::allFilesGenerator(w_query* query, struct w_query_ctx* ctx)
     const {
-  struct watchman_file* f;
-  auto view = view_.rlock();
+  FileEmitter emitter(*this, query, ctx, true);
 
-  for (f = view->latest_file; f; f = f->next) {
-    ctx->bumpNumWalked();
-    if (!ctx->fileMatchesRelativeRoot(f)) {
-      continue;
-    }
+  {
+    auto view = lockViewForQuery(ctx);
 
-    w_query_process_file(
-        query, ctx, std::make_unique<InMemoryFileResult>(f, caches_));
+    if (query->group_by_dir) {
+      // Walking the tree rather than the journal emits the files of each
+      // dir together, which saves grouping them afterwards
+      auto dir = resolveDir(
+          view, query->relative_root ? query->relative_root : root_path);
+      if (dir) {
+        dirGenerator(emitter, ctx, dir, std::numeric_limits<uint32_t>::max());
+      }
+      ctx->generatedInDirOrder = true;
+    } else {
+      RelativeRootMatcher inRelativeRoot(
+          bool(query->relative_root),
+          query->relative_root ? resolveDir(view, query->relative_root)
+                               : nullptr);
+      view->journal.forEach([&](watchman_file* f) {
+        ctx->bumpNumWalked();
+        if (inRelativeRoot(f)) {
+          emitter.emit(f);
+        }
+        return !emitter.done();
+      });
+    }
   }
+
+  emitter.flush();
 }
 
 ClockPosition InMemoryView::getMostRecentRootNumberAndTickValue() const {
@@ -704,12 +1313,111 @@ time_t InMemoryView::getLastAgeOutTimeStamp() const {
   return last_age_out_timestamp;
 }
 
+folly::Optional<ClockLineage> InMemoryView::getPriorClockLineage() const {
+  return view_.rlock()->priorClockLineage;
+}
+
+void InMemoryView::recordSettleChanges() {
+  auto rootNumber = rootNumber_.load();
+  SettleChanges::Batch batch;
+  batch.fromTick = settleChanges_.lastTick(rootNumber);
+  {
+    auto view = view_.rlock();
+    batch.toTick = mostRecentTick_;
+    if (batch.toTick == batch.fromTick) {
+      return;
+    }
+
+    std::unordered_set<const watchman_dir*> dirs;
+    size_t numFiles = 0;
+    view->journal.forEachSince(batch.fromTick, [&](watchman_file* f) {
+      if (++numFiles > SettleChanges::kMaxBatchFiles) {
+        batch.overflowed = true;
+        return false;
+      }
+      auto suffix = f->getName().asLowerCaseSuffix();
+      if (suffix) {
+        batch.suffixes.insert(std::move(suffix));
+      }
+      dirs.insert(f->parent);
+      return true;
+    });
+
+    batch.files = numFiles;
+    if (batch.overflowed) {
+      batch.suffixes.clear();
+    } else {
+      batch.dirs.reserve(dirs.size());
+      for (auto dir : dirs) {
+        batch.dirs.push_back(dir->getFullPath());
+      }
+    }
+  }
+  settleChanges_.add(rootNumber, std::move(batch));
+}
+
+folly::Optional<uint32_t> InMemoryView::unmatchedChangesThrough(
+    uint32_t rootNumber,
+    uint32_t sinceTick,
+    const SettleChanges::Filter& filter) const {
+  return settleChanges_.unmatchedThrough(rootNumber, sinceTick, filter);
+}
+
+size_t InMemoryView::changedFilesSince(uint32_t rootNumber, uint32_t sinceTick)
+    const {
+  return settleChanges_.changedFilesSince(rootNumber, sinceTick);
+}
+
+bool InMemoryView::forEachFileChangedSince(
+    uint32_t rootNumber,
+    uint32_t sinceTick,
+    const std::function<void(w_string_piece)>& fn) const {
+  auto view = view_.rlock();
+  // Files that were deleted and aged out after sinceTick have left the
+  // journal, so we'd miss them
+  if (rootNumber != rootNumber_ || sinceTick < last_age_out_tick) {
+    return false;
+  }
+  view->journal.forEachSince(sinceTick, [&](watchman_file* f) {
+    if (!f->stat.isDir()) {
+      auto fullPath = f->parent->getFullPathToChild(f->getName());
+      w_string_piece name(fullPath);
+      name.advance(root_path.size() + 1);
+      fn(name);
+    }
+    return true;
+  });
+  return true;
+}
+
 void InMemoryView::startThreads(const std::shared_ptr<w_root_t>& root) {
   // Start a thread to call into the watcher API for filesystem notifications
   auto self = std::static_pointer_cast<InMemoryView>(shared_from_this());
   logf(DBG, "starting threads for {} {}\n", fmt::ptr(this), root_path);
+
+  if (enableSnapshot_) {
+    // Let the watcher replay the changes that followed the snapshot that
+    // the IO thread is about to restore, rather than have it crawl
+    if (auto position = readSnapshotResumePosition(root)) {
+      watcher_->setResumePosition(position);
+    }
+  }
+
+#ifndef _WIN32
+  // A watcher that can't be polled still needs a notify thread, but its
+  // IO can be done by the pool
+  auto pool = getRootThreadPool();
+  if (pool && watcher_->getNotifyFd() != -1) {
+    if (startNotifyTask(root, *pool)) {
+      startIoTask(root, *pool);
+    }
+    return;
+  }
+#endif
+
   std::thread notifyThreadInstance([self, root]() {
     w_set_thread_name("notify ", uintptr_t(self.get()), " ", self->root_path);
+    self->placeThread();
     try {
       self->notifyThread(root);
     } catch (const std::exception& e) {
@@ -724,9 +1432,17 @@ void InMemoryView::startThreads(const std::shared_ptr<w_root_t>& root) {
   bool pinged = false;
   pending_.lockAndWait(std::chrono::milliseconds(-1) /* infinite */, pinged);
 
+#ifndef _WIN32
+  if (pool) {
+    startIoTask(root, *pool);
+    return;
+  }
+#endif
+
   // And now start the IO thread
   std::thread ioThreadInstance([self, root]() {
     w_set_thread_name("io ", uintptr_t(self.get()), " ", self->root_path);
+    self->placeThread();
     try {
       self->ioThread(root);
     } catch (const std::exception& e) {
@@ -738,11 +1454,38 @@ void InMemoryView::startThreads(const std::shared_ptr<w_root_t>& root) {
   ioThreadInstance.detach();
 }
 
+void InMemoryView::placeThread() const {
+  if (threadCpus_.empty()) {
+    return;
+  }
+  if (auto error = threadCpus_.applyToCurrentThread()) {
+    log(ERR,
+        "failed to place ",
+        Log::getThreadName(),
+        " on CPUs ",
+        threadCpus_.toString(),
+        ": ",
+        error.message(),
+        "\n");
+  }
+}
+
 void InMemoryView::signalThreads() {
   logf(DBG, "signalThreads! {} {}\n", fmt::ptr(this), root_path);
   stopThreads_ = true;
   watcher_->signalThreads();
+  if (notifyTask_) {
+    notifyTask_->wake();
+  }
+  if (auto request = *crawlRequest_.rlock()) {
+    request->cancel();
+  }
   pending_.ping();
+  {
+    // Take the lock so that the warming thread can't miss the wakeup
+    auto state = warmState_.lock();
+    warmCond_.notify_all();
+  }
 }
 
 void InMemoryView::wakeThreads() {
@@ -778,88 +1521,178 @@ const w_string& InMemoryView::getName() const {
   return watcher_->name;
 }
 
-SCM* InMemoryView::getSCM() const {
-  return scm_.get();
-}
-
-void InMemoryView::warmContentCache() {
-  if (!enableContentCacheWarming_) {
-    return;
+void InMemoryView::addMetrics(
+    MetricsWriter& metrics,
+    const MetricsWriter::Labels& labels) const {
+  auto watcherLabels = labels;
+  watcherLabels.emplace_back("watcher", watcher_->name);
+  metrics.counter(
+      "watchman_root_watcher_events_total",
+      "Paths reported by the watcher of the root",
+      watcherEvents_.load(),
+      watcherLabels);
+  auto& stats = watcher_->stats;
+  metrics.counter(
+      "watchman_root_watcher_batches_total",
+      "Batches of events that the watcher of the root retrieved from the "
+      "system",
+      stats.batches.load(),
+      watcherLabels);
+  metrics.counter(
+      "watchman_root_watcher_batch_events_total",
+      "Events in the batches that the watcher of the root retrieved from the "
+      "system",
+      stats.events.load(),
+      watcherLabels);
+  metrics.counter(
+      "watchman_root_watcher_coalesced_events_total",
+      "Events that the watcher of the root folded into another event for the "
+      "same path",
+      stats.coalescedEvents.load(),
+      watcherLabels);
+  metrics.counter(
+      "watchman_root_watcher_read_bytes_total",
+      "Bytes of events that the watcher of the root read from the system",
+      stats.bytesRead.load(),
+      watcherLabels);
+  metrics.counter(
+      "watchman_root_watcher_overflows_total",
+      "Times that the system dropped events for the watcher of the root",
+      stats.overflows.load(),
+      watcherLabels);
+  metrics.counter(
+      "watchman_root_watcher_consume_microseconds_total",
+      "Time that the watcher of the root spent consuming events",
+      stats.consumeMicros.load(),
+      watcherLabels);
+  metrics.gauge(
+      "watchman_root_watcher_watches",
+      "Files and dirs that the watcher of the root holds a watch on",
+      watcher_->getNumWatches(),
+      watcherLabels);
+  if (auto limit = watcher_->getWatchLimit()) {
+    metrics.gauge(
+        "watchman_root_watcher_watch_limit",
+        "The most watches that the system allows the watcher of the root",
+        limit,
+        watcherLabels);
   }
+  watcher_->addMetrics(metrics, watcherLabels);
+  metrics.gauge(
+      "watchman_root_pending_paths",
+      "Paths waiting to be examined by the IO thread of the root",
+      pending_.lock()->size(),
+      labels);
+
+  auto addCache = [&](const char* cache, const CacheStats& stats) {
+    auto cacheLabels = labels;
+    cacheLabels.emplace_back("cache", w_string(cache, W_STRING_UNICODE));
+    metrics.counter(
+        "watchman_root_cache_hits_total",
+        "Lookups that were answered by a cache of the root",
+        stats.cacheHit + stats.cacheShare,
+        cacheLabels);
+    metrics.counter(
+        "watchman_root_cache_misses_total",
+        "Lookups that a cache of the root had to compute",
+        stats.cacheMiss,
+        cacheLabels);
+    metrics.gauge(
+        "watchman_root_cache_bytes",
+        "The estimated bytes held by a cache of the root",
+        stats.bytes,
+        cacheLabels);
+  };
+  addCache("content_hash", caches_.contentHashCache.stats());
+  addCache("symlink_target", caches_.symlinkTargetCache.stats());
+}
 
-  watchman::log(
-      watchman::DBG, "considering files for content hash cache warming\n");
-
-  size_t n = 0;
-  std::deque<folly::Future<std::shared_ptr<const ContentHashCache::Node>>>
-      futures;
+json_ref InMemoryView::getWatcherInfo() const {
+  return json_object(
+      {{"name", w_string_to_json(watcher_->name)},
+       {"stats", watcher_->getStatsJson()}});
+}
 
+json_ref InMemoryView::getMemoryUsage() const {
+  NodeArena::Stats arena;
+  NodeArena::Usage usage;
+  size_t hugePageBytes;
+  size_t suffixes;
+  size_t suffixBytes = 0;
+  size_t basenames;
+  size_t basenameBytes = 0;
+  size_t journalEntries;
+  size_t collapsedDirs;
   {
-    // Walk back in time until we hit the boundary, or hit the limit
-    // on the number of files we should warm up.
     auto view = view_.rlock();
-    struct watchman_file* f;
-    for (f = view->latest_file; f && n < maxFilesToWarmInContentCache_;
-         f = f->next) {
-      if (f->otime.ticks <= lastWarmedTick_) {
-        watchman::log(
-            watchman::DBG,
-            "warmContentCache: stop because file ticks ",
-            f->otime.ticks,
-            " is <= lastWarmedTick_ ",
-            lastWarmedTick_,
-            "\n");
-        break;
-      }
-
-      if (f->exists && f->stat.isFile()) {
-        // Note: we could also add an expression to further constrain
-        // the things we warm up here.  Let's see if we need it before
-        // going ahead and adding.
-
-        auto dirStr = f->parent->getFullPath();
-        w_string_piece dir(dirStr);
-        dir.advance(caches_.contentHashCache.rootPath().size());
-
-        // If dirName is the root, dir.size() will now be zero
-        if (dir.size() > 0) {
-          // if not at the root, skip the slash character at the
-          // front of dir
-          dir.advance(1);
-        }
-        ContentHashCacheKey key{w_string::pathCat({dir, f->getName()}),
-                                size_t(f->stat.size),
-                                f->stat.mtime};
-
-        watchman::log(
-            watchman::DBG, "warmContentCache: lookup ", key.relativePath, "\n");
-        auto f = caches_.contentHashCache.get(key);
-        if (syncContentCacheWarming_) {
-          futures.emplace_back(std::move(f));
-        }
-        ++n;
-      }
+    // The arena and the usage of its nodes only change under the write
+    // lock of the view
+    arena = arena_.stats();
+    usage = arena_.usage();
+    hugePageBytes = arena_.hugePageBytes();
+    suffixes = view->suffixes.size();
+    for (const auto& it : view->suffixes) {
+      suffixBytes += sizeof(it) + it.first.size() +
+          it.second.size() * sizeof(watchman_file*);
     }
-
-    lastWarmedTick_ = mostRecentTick_;
+    basenames = view->basenames.size();
+    for (const auto& it : view->basenames) {
+      basenameBytes += sizeof(it) + it.first.size() +
+          it.second.size() * sizeof(watchman_file*);
+    }
+    journalEntries = view->journal.size();
+    collapsedDirs = view->collapsedDirs.size();
   }
+  auto arenaBytes = arena.numSlabs * NodeArena::kSlabSize;
+  auto journalBytes =
+      journalEntries * sizeof(ChangeJournal<watchman_file>::Entry);
+  auto contentHashes = caches_.contentHashCache.stats();
+  auto symlinkTargets = caches_.symlinkTargetCache.stats();
+
+  return json_object(
+      {{"files", json_integer(usage.files)},
+       {"dirs", json_integer(usage.dirs)},
+       {"node_arena_bytes", json_integer(arenaBytes)},
+       {"node_bytes", json_integer(arena.bytesInUse)},
+       {"node_arena_huge_regions", json_integer(arena.numHugeRegions)},
+       {"node_arena_huge_page_bytes", json_integer(hugePageBytes)},
+       {"file_name_bytes", json_integer(usage.fileNameBytes)},
+       {"dir_name_bytes", json_integer(usage.dirNameBytes)},
+       {"child_table_bytes", json_integer(usage.childTableBytes)},
+       {"suffixes", json_integer(suffixes)},
+       {"suffix_bytes", json_integer(suffixBytes)},
+       {"basenames", json_integer(basenames)},
+       {"basename_bytes", json_integer(basenameBytes)},
+       {"journal_entries", json_integer(journalEntries)},
+       {"journal_bytes", json_integer(journalBytes)},
+       {"collapsed_dirs", json_integer(collapsedDirs)},
+       {"pending_items", json_integer(pending_.lock()->size())},
+       {"content_hash_cache_entries", json_integer(contentHashes.size)},
+       {"content_hash_cache_bytes", json_integer(contentHashes.bytes)},
+       {"symlink_target_cache_entries", json_integer(symlinkTargets.size)},
+       {"symlink_target_cache_bytes", json_integer(symlinkTargets.bytes)},
+       // The names of files are stored in their nodes, so they are
+       // already counted in the arena
+       {"total_bytes",
+        json_integer(
+            arenaBytes + usage.dirNameBytes + usage.childTableBytes +
+            suffixBytes + basenameBytes + journalBytes + contentHashes.bytes +
+            symlinkTargets.bytes)}});
+}
 
-  watchman::log(
-      watchman::DBG,
-      "warmContentCache, lastWarmedTick_ now ",
-      lastWarmedTick_,
-      " scheduled ",
-      n,
-      " files for hashing, will wait for ",
-      futures.size(),
-      " lookups to finish\n");
+json_ref InMemoryView::getLastCrawlInfo() const {
+  return *lastCrawlInfo_.lock();
+}
 
-  if (syncContentCacheWarming_) {
-    // Wait for them to finish, but don't use get() because we don't
-    // care about any errors that may have occurred.
-    folly::collectAll(futures.begin(), futures.end()).wait();
-    watchman::log(watchman::DBG, "warmContentCache: hashing complete\n");
-  }
+FetchBatching InMemoryView::getFetchBatching() const {
+  // The properties are read from the local filesystem by the thread pool,
+  // so a batch only needs to be large enough to keep the pool busy, and
+  // smaller batches let the results start flowing sooner
+  return FetchBatching{1024, 1024, 64, 20480, std::chrono::milliseconds(20)};
+}
+
+SCM* InMemoryView::getSCM() const {
+  return scm_.get();
 }
 
 namespace {
@@ -872,7 +1705,8 @@ void addCacheStats(json_ref& resp, const CacheStats& stats) {
             {"cacheLoad", json_integer(stats.cacheLoad)},
             {"cacheErase", json_integer(stats.cacheErase)},
             {"clearCount", json_integer(stats.clearCount)},
-            {"size", json_integer(stats.size)}});
+            {"size", json_integer(stats.size)},
+            {"bytes", json_integer(stats.bytes)}});
 }
 
 } // namespace
@@ -898,6 +1732,21 @@ void InMemoryView::debugContentHashCache(
   auto stats = view->caches_.contentHashCache.stats();
   auto resp = make_response();
   addCacheStats(resp, stats);
+  if (auto& store = view->caches_.contentHashCache.store()) {
+    resp.set("store", store->stats());
+  }
+  if (auto& remote = view->caches_.contentHashCache.remote()) {
+    resp.set("shared", remote->stats());
+  }
+  if (view->suppressUnchangedContent_) {
+    resp.set(
+        "unchanged_content",
+        json_object(
+            {{"suppressed",
+              json_integer(view->contentChangesSuppressed_.load())},
+             {"confirmed",
+              json_integer(view->contentChangesConfirmed_.load())}}));
+  }
   send_and_dispose_response(client, std::move(resp));
 }
 W_CMD_REG(
@@ -3,15 +3,33 @@
 #pragma once
 #include "watchman_system.h"
 #include "watchman_string.h"
+#include <folly/SharedMutex.h>
 #include <folly/Synchronized.h>
+#include <folly/futures/SharedPromise.h>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
+#include "BatchStat.h"
+#include "ChangeJournal.h"
 #include "ContentHash.h"
 #include "CookieSync.h"
+#include "CpuAffinity.h"
+#include "CrawlScheduler.h"
+#include "EventTrace.h"
+#include "LockProfile.h"
+#include "NodeArena.h"
+#include "PathInterner.h"
 #include "QueryableView.h"
+#include "RootThreadPool.h"
+#include "SettleChanges.h"
+#include "SuffixList.h"
 #include "SymlinkTargets.h"
+#include "ThreadPool.h"
 #include "watchman_config.h"
 #include "watchman_opendir.h"
 #include "watchman_pending.h"
@@ -27,40 +45,129 @@ namespace watchman {
 struct InMemoryViewCaches {
   ContentHashCache contentHashCache;
   SymlinkTargetCache symlinkTargetCache;
+  // The relative paths that the keys of the two caches are made from
+  PathInterner paths;
 
   InMemoryViewCaches(
       const w_string& rootPath,
       size_t maxHashes,
       size_t maxSymlinks,
-      std::chrono::milliseconds errorTTL);
+      size_t maxHashBytes,
+      size_t maxSymlinkBytes,
+      std::chrono::milliseconds errorTTL,
+      std::shared_ptr<ContentHashStore> hashStore,
+      std::shared_ptr<CacheMemoryBudget> budget,
+      std::shared_ptr<ContentHashRemote> hashRemote);
 };
 
-class InMemoryFileResult : public FileResult {
+// The device and inode numbers of a dir
+struct DirInode {
+  dev_t dev;
+  ino_t ino;
+
+  bool operator==(const DirInode& other) const {
+    return dev == other.dev && ino == other.ino;
+  }
+
+  struct Hash {
+    size_t operator()(const DirInode& key) const {
+      return std::hash<uint64_t>()(
+          uint64_t(key.ino) ^ (uint64_t(key.dev) << 40));
+    }
+  };
+};
+
+/** If file was recreated by the view from a dir that was renamed, and
+ * hasn't changed since, returns the full path that it was renamed from.
+ * See root/rename.cpp. */
+w_string renamedFromPath(const watchman_file* file);
+
+/** If file is a dir, returns the summary of its subtree; otherwise, or if
+ * part of the subtree is collapsed, folly::none. */
+folly::Optional<TreeSummary> treeSummaryOf(const watchman_file* file);
+
+// Final, and with its cheapest accessors inline, so that the terms that
+// are specialized for it (see SpecializedQueryExpr) reduce to field loads
+class InMemoryFileResult final : public FileResult {
  public:
-  explicit InMemoryFileResult(
+  // Captures the metadata of file so that the result remains consistent
+  // with the view at the time that it was generated.  The name of the
+  // file is read from the node lazily, so the node must outlive this
+  // result unless a snapshot is requested.
+  // When snapshot is true, the names are captured too and the result
+  // no longer references the node at all; this allows the result to be
+  // evaluated after the view lock has been released.
+  // dirName may be passed in by the caller to share the computation of
+  // the containing directory name between sibling files.
+  InMemoryFileResult(
       const watchman_file* file,
-      InMemoryViewCaches& caches);
-  folly::Optional<FileInformation> stat() override;
+      InMemoryViewCaches& caches,
+      bool snapshot = false,
+      w_string dirName = nullptr);
+  folly::Optional<FileInformation> stat() override {
+    return stat_;
+  }
+  folly::Optional<watchman::DType> dtype() override {
+    return stat_.dtype();
+  }
   folly::Optional<struct timespec> accessedTime() override;
   folly::Optional<struct timespec> modifiedTime() override;
   folly::Optional<struct timespec> changedTime() override;
-  folly::Optional<size_t> size() override;
-  w_string_piece baseName() override;
+  folly::Optional<size_t> size() override {
+    return stat_.size;
+  }
+  w_string_piece baseName() override {
+    if (baseName_) {
+      return baseName_;
+    }
+    return file_->getName();
+  }
+  bool baseNameIsFolded() override {
+    return baseNameFolded_;
+  }
+  const void* identity() override;
   w_string_piece dirName() override;
-  folly::Optional<bool> exists() override;
+  folly::Optional<bool> exists() override {
+    return exists_;
+  }
   folly::Optional<w_string> readLink() override;
+  folly::Optional<w_string> renamedFrom() override;
+  folly::Optional<TreeSummary> treeSummary() override;
+  // Sets the tree summary of a snapshot, which is only computed when the
+  // query asks for it
+  void setTreeSummary(folly::Optional<TreeSummary> summary) {
+    treeSummary_ = summary;
+  }
   folly::Optional<w_clock_t> ctime() override;
   folly::Optional<w_clock_t> otime() override;
   folly::Optional<FileResult::ContentHash> getContentSha1() override;
+  folly::Optional<FileResult::ContentDigest> getContentHash(
+      ContentHashAlgorithm algorithm) override;
   void batchFetchProperties(
       const std::vector<std::unique_ptr<FileResult>>& files) override;
 
  private:
+  // The node that this result was generated from; nullptr if the
+  // result holds a snapshot of the names.
   const watchman_file* file_;
+  FileInformation stat_;
+  w_clock_t otime_;
+  w_clock_t ctime_;
+  bool exists_;
+  bool baseNameFolded_;
+  w_string baseName_;
   w_string dirName_;
+  // Captured along with the names when snapshotting
+  w_string renamedFrom_;
+  folly::Optional<TreeSummary> treeSummary_;
   InMemoryViewCaches& caches_;
   folly::Optional<w_string> symlinkTarget_;
   Result<FileResult::ContentHash> contentSha1_;
+  // Indexed by ContentHashAlgorithm
+  std::array<Result<FileResult::ContentDigest>, kNumContentHashAlgorithms>
+      contentHashes_;
+  // A bitset of the algorithms that getContentHash() has been asked for
+  uint8_t neededContentHashes_{0};
 };
 
 /** Keeps track of the state of the filesystem in-memory. */
@@ -68,14 +175,33 @@ struct InMemoryView : public QueryableView {
   ClockPosition getMostRecentRootNumberAndTickValue() const override;
   uint32_t getLastAgeOutTickValue() const override;
   time_t getLastAgeOutTimeStamp() const override;
+  folly::Optional<ClockLineage> getPriorClockLineage() const override;
   w_string getCurrentClockString() const override;
+  folly::Optional<uint32_t> unmatchedChangesThrough(
+      uint32_t rootNumber,
+      uint32_t sinceTick,
+      const SettleChanges::Filter& filter) const override;
+  size_t changedFilesSince(uint32_t rootNumber, uint32_t sinceTick)
+      const override;
+  bool forEachFileChangedSince(
+      uint32_t rootNumber,
+      uint32_t sinceTick,
+      const std::function<void(w_string_piece)>& fn) const override;
 
   explicit InMemoryView(w_root_t* root, std::shared_ptr<Watcher> watcher);
 
   void ageOut(w_perf_t& sample, std::chrono::seconds minAge) override;
+  bool ageOutInProgress() const override;
+  bool expandCollapsedDirs(const w_string& dir) override;
+  std::vector<w_string> collapseColdDirs(
+      const std::shared_ptr<w_root_t>& root,
+      std::chrono::seconds coldAge) override;
   void syncToNow(
       const std::shared_ptr<w_root_t>& root,
       std::chrono::milliseconds timeout) override;
+  folly::Future<folly::Unit> syncToNowAsync(
+      const std::shared_ptr<w_root_t>& root,
+      std::chrono::milliseconds timeout) override;
 
   bool doAnyOfTheseFilesExist(
       const std::vector<w_string>& fileNames) const override;
@@ -87,6 +213,11 @@ struct InMemoryView : public QueryableView {
   /** Walks all files with the suffix(es) configured in the query */
   void suffixGenerator(w_query* query, struct w_query_ctx* ctx) const override;
 
+  /** Walks all files with the basename(s) chosen by the planner */
+  void basenameGenerator(w_query* query, struct w_query_ctx* ctx)
+      const override;
+  bool hasBasenameIndex() const override;
+
   /** Walks files that match the supplied set of paths */
   void pathGenerator(w_query* query, struct w_query_ctx* ctx) const override;
 
@@ -97,6 +228,8 @@ struct InMemoryView : public QueryableView {
 
   std::shared_future<void> waitUntilReadyToQuery(
       const std::shared_ptr<w_root_t>& root) override;
+  folly::Future<folly::Unit> readyToQuery(
+      const std::shared_ptr<w_root_t>& root) override;
 
   void startThreads(const std::shared_ptr<w_root_t>& root) override;
   void signalThreads() override;
@@ -105,43 +238,140 @@ struct InMemoryView : public QueryableView {
 
   const w_string& getName() const override;
   const std::shared_ptr<Watcher>& getWatcher() const;
-
-  // If content cache warming is configured, do the warm up now
-  void warmContentCache();
+  void addMetrics(MetricsWriter& metrics, const MetricsWriter::Labels& labels)
+      const override;
+  json_ref getWatcherInfo() const override;
+  json_ref getMemoryUsage() const override;
+  json_ref getLastCrawlInfo() const override;
+  FetchBatching getFetchBatching() const override;
+
+  // If content cache warming is configured, schedule the files that have
+  // changed since it was last performed for warming
+  void warmContentCache(const std::shared_ptr<w_root_t>& root);
+  // Starts reading the targets of the symlinks that changed into the
+  // cache.  Called with the view lock held.
+  void warmSymlinkTargets();
+  // Summarizes the files that changed since the previous settle; called
+  // by the IO thread when the view settles
+  void recordSettleChanges();
   static void debugContentHashCache(
       struct watchman_client* client,
       const json_ref& args);
   static void debugSymlinkTargetCache(
       struct watchman_client* client,
       const json_ref& args);
+  static void debugContentWarming(
+      struct watchman_client* client,
+      const json_ref& args);
+  static void debugRecordEvents(
+      struct watchman_client* client,
+      const json_ref& args);
+  static void debugBenchReplay(
+      struct watchman_client* client,
+      const json_ref& args);
 
   SCM* getSCM() const override;
 
  private:
-  /* Holds the list head for files of a given suffix */
-  struct file_list_head {
-    watchman_file* head{nullptr};
+  /** Feeds files from a generator into the query engine.
+   * In snapshot mode the results capture a copy of the node state and
+   * are held back until flush() is called, which allows the generator to
+   * release the view lock before any expression evaluation or rendering
+   * takes place.
+   * If parallel is true, a large enough set of results may be evaluated by
+   * several threads at once; this also implies snapshot mode. */
+  class FileEmitter {
+   public:
+    FileEmitter(
+        const InMemoryView& view,
+        w_query* query,
+        w_query_ctx* ctx,
+        bool parallel = false);
+    FileEmitter(const FileEmitter&) = delete;
+
+    void emit(const watchman_file* file);
+
+    // While files is set, each file that is emitted is also appended to it
+    void recordEmitted(std::vector<const watchman_file*>* files) {
+      emitted_ = files;
+    }
+
+    // True once the query doesn't need any more files, or has been
+    // cancelled, so that the generator can stop walking
+    bool done() const {
+      return ctx_->limitReached() || ctx_->cancelled();
+    }
+
+    // Process any deferred results.  Must be called after the view lock
+    // has been released.
+    void flush();
+
+   private:
+    const InMemoryView& view_;
+    w_query* query_;
+    w_query_ctx* ctx_;
+    bool parallel_;
+    bool snapshot_;
+    // Whether the streaming of results was held back while the view is
+    // locked; see flush()
+    bool pausedStreaming_{false};
+    // Whether the snapshots need the tree summaries of their dirs, since
+    // they can't be computed once the view lock has been released
+    bool treeSummary_{false};
+    // Cache of the most recently computed dir name; generators tend to
+    // emit runs of files from the same dir
+    const watchman_dir* lastDir_{nullptr};
+    w_string lastDirName_;
+    // Held by value, so that only the results that the query keeps are
+    // copied to the heap
+    std::vector<InMemoryFileResult> deferred_;
+    std::vector<const watchman_file*>* emitted_{nullptr};
   };
 
+  // The files that share a lower-cased name
+  using BasenameList = SuffixList<watchman_file, &watchman_file::basename_slot>;
+
   struct view {
-    /* the most recently changed file */
-    struct watchman_file* latest_file{0};
+    /* the files, ordered by the time that they last changed.
+     * This is declared ahead of root_dir so that it outlives the
+     * file nodes, which unlink themselves from it when destroyed. */
+    ChangeJournal<watchman_file> journal;
 
-    /* Holds the list heads for all known suffixes */
-    std::unordered_map<w_string, std::unique_ptr<file_list_head>> suffixes;
+    /* The files with each known suffix.  This is declared ahead of
+     * root_dir for the same reason as the journal. */
+    std::unordered_map<w_string, SuffixList<watchman_file>> suffixes;
 
-    std::unique_ptr<watchman_dir> root_dir;
+    /* The files with each lower-cased name, if basename_index is
+     * enabled.  Also declared ahead of root_dir. */
+    std::unordered_map<w_string, BasenameList> basenames;
+
+    std::unique_ptr<watchman_dir, watchman_dir::Deleter> root_dir;
 
     // Inode number for the root dir.  This is used to detect what should
     // be impossible situations, but is needed in practice to workaround
     // eg: BTRFS not delivering all events for subvolumes
     ino_t rootInode{0};
 
-    explicit view(const w_string& root_path);
+    // Set if the view was restored from a snapshot written by a prior
+    // incarnation of this watch
+    folly::Optional<ClockLineage> priorClockLineage;
+
+    // The full paths of the dirs whose contents were dropped by
+    // maybeCollapseColdDirs, pending their next crawl
+    std::unordered_set<w_string> collapsedDirs;
 
-    void insertAtHeadOfFileList(struct watchman_file* file);
+    // The full path of each dir, keyed by its device and inode numbers, so
+    // that statPath can recognize a dir that was renamed.  Entries go stale
+    // as dirs are removed, so they are checked against the view before use.
+    std::unordered_map<DirInode, w_string, DirInode::Hash> dirsByInode;
+
+    view(const w_string& root_path, NodeArena& arena);
+  };
+  struct ViewLock {
+    static constexpr const char* kName = "view";
   };
-  using SyncView = folly::Synchronized<view>;
+  using SyncView =
+      folly::Synchronized<view, ProfiledMutex<folly::SharedMutex, ViewLock>>;
 
   void ageOutFile(
       std::unordered_set<w_string>& dirs_to_erase,
@@ -162,6 +392,22 @@ struct InMemoryView : public QueryableView {
       int flags,
       const watchman_dir_ent* pre_stat);
 
+  // A stat result for a pending item, obtained ahead of time
+  struct PrefetchedStat {
+    const watchman_pending_fs* item;
+    watchman_dir_ent ent;
+  };
+  /** Stats the items from the pending list, starting at item, that
+   * processPath would pass to statPath, as a single batch via
+   * batchStat_.  Looks ahead by at most batchStatQueueDepth_ items and
+   * returns the number of items that were looked at.  Items that
+   * couldn't be stat'ed are omitted from prefetched and are left for
+   * statPath to deal with. */
+  size_t prefetchPendingStats(
+      const std::shared_ptr<w_root_t>& root,
+      const watchman_pending_fs* item,
+      std::vector<PrefetchedStat>& prefetched);
+
   /** Updates the otime for the file and bubbles it to the front of recency
    * index */
   void markFileChanged(
@@ -192,22 +438,43 @@ struct InMemoryView : public QueryableView {
       const w_string& file_name,
       const struct timeval& now);
 
+  /** Acquires the view read lock on behalf of a query, accounting
+   * for the time spent waiting for it in the query context */
+  SyncView::ConstLockedPtr lockViewForQuery(struct w_query_ctx* ctx) const;
+
   /** Recursively walks files under a specified dir */
   void dirGenerator(
-      w_query* query,
+      FileEmitter& emitter,
       struct w_query_ctx* ctx,
       const watchman_dir* dir,
       uint32_t depth) const;
+  /** Recursively walks the files under dir that changed after sinceTick,
+   * skipping the subtrees in which nothing did */
+  void sinceDirGenerator(
+      FileEmitter& emitter,
+      struct w_query_ctx* ctx,
+      const watchman_dir* dir,
+      uint32_t sinceTick) const;
   void globGeneratorTree(
+      FileEmitter& emitter,
       struct w_query_ctx* ctx,
       const struct watchman_glob_tree* node,
       const struct watchman_dir* dir) const;
   void globGeneratorDoublestar(
+      FileEmitter& emitter,
       struct w_query_ctx* ctx,
       const struct watchman_dir* dir,
       const struct watchman_glob_tree* node,
       const char* dir_name,
       uint32_t dir_name_len) const;
+  /** Emits the files that the globs of query matched when it last ran,
+   * after matching the files that changed since then, or walks dir with
+   * globGeneratorTree and remembers what it matched if that isn't known */
+  void globGeneratorIncremental(
+      FileEmitter& emitter,
+      struct w_query_ctx* ctx,
+      const SyncView::ConstLockedPtr& view,
+      const struct watchman_dir* dir) const;
   void crawler(
       const std::shared_ptr<w_root_t>& root,
       SyncView::LockedPtr& view,
@@ -215,12 +482,181 @@ struct InMemoryView : public QueryableView {
       const w_string& dir_name,
       struct timeval now,
       bool recursive);
+  struct CrawlEntry;
+  /** Stats an entry that the crawler read from the dir open on dirFd.
+   * If the stat fails the entry is left for statPath to deal with. */
+  static void
+  statCrawlEntry(int dirFd, CaseSensitivity caseSensitive, CrawlEntry& entry);
+  /** Stats the entries that the crawler read from a dir using the
+   * crawl thread pool, so that the crawl isn't bound by the latency
+   * of one stat at a time */
+  void statCrawlEntriesInParallel(
+      const std::shared_ptr<w_root_t>& root,
+      int dirFd,
+      std::vector<CrawlEntry>& entries);
+  /** Confines the calling thread, one of those of this root, to the CPUs
+   * of root_thread_cpus or root_thread_numa_node */
+  void placeThread() const;
   void notifyThread(const std::shared_ptr<w_root_t>& root);
+  /** Reads a batch of notifications from the watcher and hands them to
+   * the IO thread, unless they are held back to be handed over along
+   * with those that follow; see notifyBatchInterval_ */
+  void consumeNotifyBatch(
+      const std::shared_ptr<w_root_t>& root,
+      PendingCollection::LockedPtr& localLock);
+  /** Hands the notifications in localLock to the IO thread */
+  void handOffNotifyBatch(PendingCollection::LockedPtr& localLock);
+  /** When a batch is being held, returns the time by which it must be
+   * handed over */
+  folly::Optional<std::chrono::steady_clock::time_point> notifyBatchDeadline()
+      const;
   void ioThread(const std::shared_ptr<w_root_t>& root);
+
+  // What the IO thread carries from one iteration to the next
+  struct IoThreadState {
+    int timeoutms{0};
+    int settleMs{0};
+    // Upper bound on the time that we wait without anything to do
+    int biggestTimeout{0};
+    // The items that the IO thread has taken from pending_
+    PendingCollection pending;
+    // The CPU time of the thread when it last published ioThreadCpuTime_
+    std::chrono::nanoseconds cpuMark{0};
+    // The number of items in pending that the last step held back while a
+    // state that defers processing was asserted
+    uint32_t deferredItems{0};
+  };
+  void startIoThread(
+      const std::shared_ptr<w_root_t>& root,
+      IoThreadState& state);
+  /** Handles what the IO thread found in pending_ when it woke up.
+   * Returns false if the IO thread should stop. */
+  bool ioThreadStep(
+      const std::shared_ptr<w_root_t>& root,
+      IoThreadState& state,
+      PendingCollection::LockedPtr& localPendingLock,
+      bool pinged);
+  /** Returns true if the IO thread should hold back the items in coll
+   * rather than process them now: a state that defers processing is
+   * asserted, more changes are still arriving, and nobody is waiting to
+   * sync with a cookie. */
+  bool shouldDeferPending(
+      const std::shared_ptr<w_root_t>& root,
+      const PendingCollection::LockedPtr& coll,
+      bool pinged) const;
+  void stopIoThread(const std::shared_ptr<w_root_t>& root);
+  // Starts measuring the CPU time of the calling thread, and adds what
+  // it used since then to ioThreadCpuTime_
+  void markIoThreadCpuTime(IoThreadState& state);
+  void publishIoThreadCpuTime(IoThreadState& state);
+
+  // When root_thread_pool_threads is set, the notify and IO threads are
+  // tasks in the RootThreadPool instead; see root/pooled.cpp
+  std::shared_ptr<RootThreadPool::Task> notifyTask_;
+  std::shared_ptr<RootThreadPool::Task> ioTask_;
+  bool startNotifyTask(
+      const std::shared_ptr<w_root_t>& root,
+      RootThreadPool& pool);
+  void startIoTask(const std::shared_ptr<w_root_t>& root, RootThreadPool& pool);
+  /** Returns true if a recrawl is due.  A recrawl that is backing off
+   * isn't due until its time comes; see watchman_root::scheduleRecrawl */
   bool handleShouldRecrawl(const std::shared_ptr<w_root_t>& root);
+  /** Queues the crawl of each dir that failed to be crawled and whose
+   * backoff has passed; see watchman_root::scheduleSubtreeRecrawl */
+  void queueSubtreeRecrawls(
+      const std::shared_ptr<w_root_t>& root,
+      PendingCollection::LockedPtr& pending);
+  /** Shortens the time that the IO thread sleeps for so that it wakes up
+   * when the next recrawl or subtree crawl is due */
+  void limitTimeoutToRecrawls(
+      const std::shared_ptr<w_root_t>& root,
+      IoThreadState& state);
+  /** Folds the number of events that arrived since the last call into
+   * the moving average of the event rate */
+  void updateEventRate(size_t numEvents);
+  /** Returns the settle period, in milliseconds, to use for the current
+   * event rate */
+  int getSettleTimeout(const std::shared_ptr<w_root_t>& root);
+  /** If the watcher has reported lost notifications, queues a rescan of
+   * the dirs that could have changed without our knowledge, or schedules
+   * a full recrawl if there are more of them than our budget allows.
+   * See root/recovery.cpp */
+  void handleOverflowRecovery(
+      const std::shared_ptr<w_root_t>& root,
+      PendingCollection::LockedPtr& pending);
   void fullCrawl(
       const std::shared_ptr<w_root_t>& root,
       PendingCollection::LockedPtr& pending);
+  // Waits until max_concurrent_crawls lets this root crawl.  Returns false
+  // if the threads were signalled to stop first.
+  bool waitForCrawlSlot();
+  void finishedWithCrawlSlot();
+
+  /** Squeezes the holes left by freed nodes out of the suffix and
+   * basename lists and drops the lists that are left empty.  Returns the
+   * number of slots that were removed. */
+  size_t compactSuffixLists(SyncView::LockedPtr& view);
+
+  /** Dir rename detection; see root/rename.cpp */
+  // Records that the dir at full_path has the device and inode of st
+  void noteDirInode(
+      SyncView::LockedPtr& view,
+      const w_string& full_path,
+      const FileInformation& st);
+  // If the new dir at full_path, with stat st, was renamed from elsewhere
+  // in the view, recreates the nodes beneath it from those at its old
+  // location rather than having it crawled recursively, and returns true
+  bool adoptRenamedDir(
+      const std::shared_ptr<w_root_t>& root,
+      SyncView::LockedPtr& view,
+      PendingCollection::LockedPtr& coll,
+      watchman_dir* parentDir,
+      const w_string& full_path,
+      const FileInformation& st,
+      struct timeval now);
+  void cloneRenamedDir(
+      SyncView::LockedPtr& view,
+      PendingCollection::LockedPtr& coll,
+      const watchman_dir* src,
+      watchman_dir* dst,
+      uint32_t deletedTick,
+      const struct timeval& now);
+  // Drops the entries of dirsByInode that no longer describe the view
+  void pruneDirInodes(SyncView::LockedPtr& view);
+
+  /** Memory bounded views; see root/collapse.cpp */
+  // The memory that the nodes of the view and their indices are using
+  size_t viewBytes(const SyncView::LockedPtr& view) const;
+  // If the view has outgrown view_memory_budget, drops the contents of
+  // the subtrees that have been cold for cold_subtree_seconds; called by
+  // the IO thread when it settles
+  void maybeCollapseColdDirs(const std::shared_ptr<w_root_t>& root);
+  // If full_path lies beneath a collapsed dir, returns the path of that
+  // dir
+  w_string findCollapsedParent(
+      const SyncView::LockedPtr& view,
+      const w_string& full_path) const;
+
+  /** Persistent snapshots of the view; see root/snapshot.cpp */
+  w_string getSnapshotPath() const;
+  void saveSnapshot(const std::shared_ptr<w_root_t>& root);
+  // Saves a snapshot if one is due
+  void maybeSaveSnapshot(const std::shared_ptr<w_root_t>& root);
+  void removeSnapshot();
+  // Populates the empty view from a snapshot, if a valid one exists.
+  // The caller is responsible for validating the restored state
+  // with a full crawl, unless the watcher replays what followed it.
+  bool loadSnapshot(const std::shared_ptr<w_root_t>& root);
+  // Returns the watcher position recorded in the snapshot, if there is
+  // a snapshot for root and it recorded one
+  w_string readSnapshotResumePosition(
+      const std::shared_ptr<w_root_t>& root) const;
+  // Marks the initial crawl as done without crawling, for a view restored
+  // from a snapshot while the watcher replays the changes that followed it
+  void resumeFromSnapshot(const std::shared_ptr<w_root_t>& root);
+  // True if a dir with the stat info can't have changed since the snapshot
+  // that the crawl is validating was written
+  bool isUnchangedSinceSnapshot(const FileInformation& info) const;
   void statPath(
       const std::shared_ptr<w_root_t>& root,
       SyncView::LockedPtr& view,
@@ -229,6 +665,16 @@ struct InMemoryView : public QueryableView {
       struct timeval now,
       int flags,
       const watchman_dir_ent* pre_stat);
+  // If the content hash of the file at full_path is cached for its prior
+  // stat, saved, and it is the same size now, arranges to have the file
+  // re-hashed in the background and returns true; statPath then leaves
+  // it unchanged in the view.  Should the content turn out to differ,
+  // the path is queued for statPath with W_PENDING_VIA_NOTIFY.
+  bool verifyContentChange(
+      const w_string& full_path,
+      const FileInformation& saved,
+      const FileInformation& st,
+      struct timeval now);
   bool propagateToParentDirIfAppropriate(
       const std::shared_ptr<w_root_t>& root,
       PendingCollection::LockedPtr& coll,
@@ -241,6 +687,10 @@ struct InMemoryView : public QueryableView {
   CookieSync& cookies_;
   Configuration& config_;
 
+  // Backing storage for the nodes in view_.  This must be declared ahead
+  // of view_ so that it outlives the nodes allocated from it.
+  // Access is serialized by the view_ lock.
+  NodeArena arena_;
   SyncView view_;
   // The most recently observed tick value of an item in the view
   std::atomic<uint32_t> mostRecentTick_{1};
@@ -258,18 +708,99 @@ struct InMemoryView : public QueryableView {
   struct crawl_state {
     std::unique_ptr<std::promise<void>> promise;
     std::shared_future<void> future;
+    // For the callers of readyToQuery; only set while promise is
+    std::unique_ptr<folly::SharedPromise<folly::Unit>> asyncPromise;
+
+    // Lets everybody who is waiting know that the crawl is done
+    void fulfil();
   };
   folly::Synchronized<crawl_state> crawlState_;
+  // The slot that fullCrawl is waiting for, or crawling in, under the
+  // max_concurrent_crawls limit
+  folly::Synchronized<std::shared_ptr<CrawlScheduler::Request>>
+      crawlRequest_;
 
   uint32_t last_age_out_tick{0};
   time_t last_age_out_timestamp{0};
 
+  // An age out pass that is done a slice at a time; see ageOut().  This
+  // is accessed under the view write lock.
+  struct AgeOutPass {
+    std::chrono::seconds minAge{0};
+    // When the pass started, which the ages of the files are measured at
+    time_t now{0};
+    // The journal position of the next file to look at, which is only
+    // valid while the journal has the same generation.  Otherwise the
+    // pass resumes from the tick of the last file that it looked at.
+    size_t position{0};
+    uint64_t generation{0};
+    uint32_t positionTick{0};
+    size_t slices{0};
+    size_t walked{0};
+    size_t files{0};
+    size_t dirs{0};
+  };
+  folly::Optional<AgeOutPass> ageOutPass_;
+  std::atomic<bool> ageOutInProgress_{false};
+
   /* queue of items that we need to stat/process */
   PendingCollection pending_;
 
   std::atomic<bool> stopThreads_{false};
   std::shared_ptr<Watcher> watcher_;
 
+  // The notify thread numbers the batches of notifications that it hands
+  // to the IO thread.  The number is odd while a batch is being read from
+  // the watcher or held back, and even once that batch has been added to
+  // pending_.
+  std::atomic<uint64_t> notifyBatch_{0};
+  // The paths that the watcher has reported, after those in the same
+  // batch are consolidated
+  std::atomic<uint64_t> watcherEvents_{0};
+  // The most recent batch that the IO thread has finished processing
+  folly::Synchronized<uint64_t, std::mutex> processedBatch_;
+  std::condition_variable processedBatchCond_;
+  // The paths that processPending has handled, for comparison with
+  // watcherEvents_
+  std::atomic<uint64_t> pathsProcessed_{0};
+  // The CPU time of the IO thread in nanoseconds, as of the last time
+  // that it finished processing or settled.  See publishIoThreadCpuTime.
+  std::atomic<int64_t> ioThreadCpuTime_{0};
+  // How many times the IO thread has settled, and when it last woke up
+  // to find nothing to do
+  struct SettleState {
+    uint64_t count{0};
+    std::chrono::steady_clock::time_point at;
+  };
+  folly::Synchronized<SettleState, std::mutex> lastSettle_;
+  std::condition_variable settleCond_;
+  // If true, syncToNow doesn't use a cookie when the watcher can show
+  // that it has nothing left to read
+  bool enableCookieFreeSync_{false};
+  // When notifications arrive within this long of the last batch that was
+  // handed to the IO thread, the notify thread holds on to them until
+  // this long after it, so that a burst of changes wakes the IO thread
+  // once per interval rather than once per read from the watcher.
+  // Batches that may hold a cookie are never held.
+  std::chrono::milliseconds notifyBatchInterval_{0};
+  // The CPUs that the notify, IO and warming threads of the root run on;
+  // empty to leave them to the OS.  As the IO thread is the one that
+  // first touches the memory of the view, placing it on the CPUs of a
+  // NUMA node also places the view in that node's memory.
+  CpuSet threadCpus_;
+  // Only touched by the notify thread
+  std::chrono::steady_clock::time_point lastNotifyHandoff_;
+  bool holdingNotifyBatch_{false};
+
+  // Returns the most recent batch that has been added to pending_
+  uint64_t enqueuedNotifyBatch() const;
+  void markNotifyBatchProcessed(uint64_t batch);
+  bool syncWithoutCookie(
+      const std::shared_ptr<w_root_t>& root,
+      std::chrono::milliseconds timeout);
+  // Whether syncWithoutCookie can sync the view now
+  bool canSyncWithoutCookie(const std::shared_ptr<w_root_t>& root) const;
+
   // mutable because we pass a reference to other things from inside
   // const methods
   mutable InMemoryViewCaches caches_;
@@ -281,10 +812,174 @@ struct InMemoryView : public QueryableView {
   // If true, we will wait for the items to be hashed before
   // dispatching the settle to watchman clients
   bool syncContentCacheWarming_{false};
+  // The most bytes per second that warming may read; 0 is unlimited
+  uint64_t warmBytesPerSecond_{0};
+  // Should we read the targets of symlinks as soon as we observe them?
+  bool enableSymlinkTargetWarming_{false};
+  // The symlinks that changed since warmSymlinkTargets was last called.
+  // Protected by the lock on view_.
+  std::vector<SymlinkTargetCacheKey> symlinksToWarm_;
+  // The files that changed between recent settles; see
+  // recordSettleChanges
+  SettleChanges settleChanges_;
+
   // Remember what we've already warmed up
-  uint32_t lastWarmedTick_{0};
+  std::atomic<uint32_t> lastWarmedTick_{0};
+
+  // The files that are waiting to be warmed by the warming thread.
+  // See root/warming.cpp.
+  struct ContentWarmState {
+    // Files matched by a subscription are warmed first
+    std::deque<ContentHashCacheKey> subscribed;
+    std::deque<ContentHashCacheKey> other;
+    // The tick that the queue was built from
+    uint32_t tick{0};
+    // True while the warming thread is hashing a file
+    bool busy{false};
+    bool threadStarted{false};
+
+    // Counters reported by debug-content-warming
+    size_t scheduled{0};
+    size_t hashed{0};
+    size_t cached{0};
+    size_t stale{0};
+    size_t cancelled{0};
+    size_t errors{0};
+    uint64_t bytesHashed{0};
+    std::chrono::microseconds hashingTime{0};
+    std::chrono::microseconds throttledTime{0};
+  };
+  folly::Synchronized<ContentWarmState, std::mutex> warmState_;
+  std::condition_variable warmCond_;
+
+  void warmThread();
+  // Hashes the file described by key and updates the warming counters
+  void warmOne(const ContentHashCacheKey& key);
+
+  // If true, generators snapshot the nodes that they visit and release
+  // the view lock before the query expression is evaluated, so that
+  // long running queries don't hold off the IO thread.
+  bool enableSnapshotReads_{false};
+
+  // Generators that walk the whole tree hand the files that they produce
+  // to up to this many threads of queryPool_ for evaluation, provided that
+  // there are at least queryParallelMinFiles_ of them.
+  size_t queryParallelism_{1};
+  size_t queryParallelMinFiles_{50000};
+  mutable ThreadPool queryPool_;
+  mutable std::once_flag queryPoolStarted_;
+
+  // Evaluates files against the query in the query pool and appends the
+  // results to ctx in the order that the files were given
+  void evaluateInParallel(
+      w_query* query,
+      w_query_ctx* ctx,
+      std::vector<InMemoryFileResult>& files) const;
+
+  // If true, the view is periodically persisted to disk and restored
+  // when the watch is re-established by a new server process.
+  // These are accessed only by the IO thread.
+  bool enableSnapshot_{false};
+  std::chrono::seconds snapshotInterval_{600};
+  std::chrono::steady_clock::time_point lastSnapshotTime_;
+  uint32_t lastSnapshotTick_{0};
+  // Set while a client mode crawl validates the view that it restored from
+  // a snapshot, which lets it trust the listings of unchanged dirs.
+  // snapshotSavedAt_ is when that snapshot was written.
+  bool validatingSnapshot_{false};
+  time_t snapshotSavedAt_{0};
+  // Set while a recrawl trusts the dirs whose stat still matches the view,
+  // and the files in them, so that it only has to stat the dirs; see
+  // recrawl_trust_unchanged_dirs.  Accessed only by the IO thread.
+  bool trustUnchangedDirsOnRecrawl_{false};
+  bool validatingRecrawl_{false};
+
+  // The number of stats that the crawler may have in flight.  When this
+  // is greater than 1 the stats are issued from crawlPool_, which is
+  // started on demand.  These are accessed only by the IO thread.
+  size_t crawlParallelism_{1};
+  ThreadPool crawlPool_;
+  bool crawlPoolStarted_{false};
+
+  // Counters for the current full crawl
+  struct CrawlStats {
+    size_t dirs{0};
+    size_t entries{0};
+    size_t parallelStats{0};
+    size_t deferredStats{0};
+    size_t unchangedDirs{0};
+    // Files in unchanged dirs that a validating recrawl didn't stat
+    size_t skippedStats{0};
+  };
+  CrawlStats crawlStats_;
+  // Describes the most recent full crawl; see getLastCrawlInfo
+  folly::Synchronized<json_ref, std::mutex> lastCrawlInfo_;
+
+  // If greater than zero, processPending stats the pending items in
+  // batches of up to this many, using batchStat_ when the system
+  // supports it.  These are accessed only by the IO thread.
+  unsigned batchStatQueueDepth_{0};
+  std::unique_ptr<BatchStat> batchStat_;
+
+  // When settleMax_ is greater than settleMin_, the settle period adapts
+  // to the rate at which events arrive, rather than being fixed at the
+  // configured settle period.  These are accessed only by the IO thread.
+  int settleMin_{0};
+  int settleMax_{0};
+  double eventRate_{0};
+  std::chrono::steady_clock::time_point lastEventRateUpdate_;
+
+  // The most dirs that we'll rescan to recover from a notification
+  // overflow before resorting to a full recrawl.  0 means that we
+  // always recrawl.
+  size_t overflowRecoveryBudget_{0};
+
+  // The most time that ageOut() spends in a slice, or 0 to do each pass
+  // in one go
+  std::chrono::milliseconds ageOutSliceTime_{0};
+
+  // If true, statPath looks up new dirs in dirsByInode to see whether
+  // they were renamed from elsewhere in the view
+  bool detectDirRenames_{false};
+
+  // If true, files whose stat changes while their size and content don't
+  // are not reported as changed; see verifyContentChange()
+  bool suppressUnchangedContent_{false};
+
+  // If true, view.basenames indexes the files by lower-cased name so that
+  // the planner can look up the files that a name term matches
+  bool basenameIndex_{false};
+  // The number of such changes that were suppressed, and of those that
+  // turned out to change the content after all
+  std::atomic<uint64_t> contentChangesSuppressed_{0};
+  std::atomic<uint64_t> contentChangesConfirmed_{0};
+
+  // Once the view uses more than viewMemoryBudget_ bytes, the subtrees in
+  // which nothing has changed, and that no query has needed all of, for
+  // coldSubtreeAge_ are collapsed.  0 is unbounded.
+  size_t viewMemoryBudget_{0};
+  std::chrono::seconds coldSubtreeAge_{3600};
+  // Accessed only by the IO thread
+  std::chrono::steady_clock::time_point lastCollapseCheck_;
+  // When a query last needed all of the files beneath each dir, keyed by
+  // full path
+  folly::Synchronized<std::unordered_map<w_string, time_t>, std::mutex>
+      fullyQueriedDirs_;
 
   // The source control system that we detected during initialization
   std::unique_ptr<SCM> scm_;
+
+  // If set by debug-record-events, the notify thread writes each batch
+  // that it hands to the IO thread here; see root/eventtrace.cpp
+  std::atomic<bool> recordingEvents_{false};
+  folly::Synchronized<std::unique_ptr<EventTraceWriter>, std::mutex>
+      eventTraceWriter_;
+  void recordEventBatch(const watchman_pending_fs* items);
+  // Feeds the batches of trace to the IO thread as though the watcher had
+  // reported them, and waits for the view to settle afterwards
+  json_ref replayEventTrace(
+      const EventTrace& trace,
+      double speed,
+      std::chrono::milliseconds timeout);
 };
 } // namespace watchman
@@ -3,10 +3,16 @@
 #pragma once
 #include <folly/Synchronized.h>
 #include <folly/futures/Future.h>
+#include <folly/hash/Hash.h>
+#include <algorithm>
 #include <chrono>
 #include <deque>
+#include <functional>
 #include <memory>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+#include "CacheMemoryBudget.h"
 
 namespace watchman {
 
@@ -42,6 +48,11 @@ namespace watchman {
  * and its nodes.  Because the cache is LRU it needs to touch
  * a node as part of a lookup to ensure that it will not
  * be evicted prematurely.
+ *
+ * The cache may optionally be given a weigher function that
+ * estimates the bytes used by an item, in which case it can be
+ * limited by bytes as well as by items, and it can charge those
+ * bytes to a CacheMemoryBudget that it shares with other caches.
  */
 
 template <typename KeyType, typename ValueType>
@@ -118,6 +129,9 @@ class Node {
 
   // Time after which this node is to be considered invalid
   std::chrono::steady_clock::time_point deadline_;
+
+  // The bytes that the node is charged for while it is in the map
+  size_t weight_{0};
 };
 
 // A doubly-linked intrusive list through the cache nodes.
@@ -216,6 +230,9 @@ struct InternalState {
   // Maintain some stats for cache introspection
   Stats stats;
 
+  // The sum of the weights of the nodes in the map
+  size_t bytes{0};
+
   // To manage eviction we categorize a node into one of
   // three sets and link it into the appropriate tailq
   // below.  A node belongs in only one set at a time.
@@ -246,16 +263,26 @@ struct InternalState {
 } // namespace lrucache
 
 struct CacheStats : public lrucache::Stats {
-  CacheStats(const lrucache::Stats s, size_t size) : Stats(s), size(size) {}
+  CacheStats(const lrucache::Stats s, size_t size, size_t bytes = 0)
+      : Stats(s), size(size), bytes(bytes) {}
   size_t size;
+  // The estimated bytes held, if the cache has a weigher
+  size_t bytes;
 };
 
 // The cache.  More information on this can be found at the
 // top of this header file!
 template <typename KeyType, typename ValueType>
-class LRUCache {
+class LRUCache : private CacheMemoryBudget::Member {
  public:
   using NodeType = lrucache::Node<KeyType, ValueType>;
+  // Returns the estimated bytes used by an item
+  using Weigher = std::function<size_t(const KeyType&, const ValueType&)>;
+
+  // The bytes used by an item other than those that its key and value
+  // own indirectly: the node, and the entry in the map that holds it
+  static constexpr size_t kItemOverhead = sizeof(NodeType) + sizeof(KeyType) +
+      sizeof(std::shared_ptr<NodeType>) + 2 * sizeof(void*);
 
  private:
   using State = lrucache::InternalState<KeyType, ValueType>;
@@ -268,6 +295,33 @@ class LRUCache {
   LRUCache(size_t maxItems, std::chrono::milliseconds errorTTL)
       : maxItems_(maxItems), errorTTL_(errorTTL) {}
 
+  // Construct a cache that weighs its successful items with weigher
+  // and additionally limits their total weight to maxBytes, unless it
+  // is 0.  If budget is provided, the weight is also charged to it,
+  // and the cache is shrunk when the budget is exceeded.
+  LRUCache(
+      size_t maxItems,
+      std::chrono::milliseconds errorTTL,
+      Weigher weigher,
+      size_t maxBytes,
+      std::shared_ptr<CacheMemoryBudget> budget = nullptr)
+      : maxItems_(maxItems),
+        errorTTL_(errorTTL),
+        weigher_(std::move(weigher)),
+        maxBytes_(maxBytes),
+        budget_(std::move(budget)) {
+    if (budget_) {
+      budget_->add(this);
+    }
+  }
+
+  ~LRUCache() override {
+    if (budget_) {
+      budget_->remove(this);
+      budget_->release(state_.rlock()->bytes);
+    }
+  }
+
   // No moving or copying
   LRUCache(const LRUCache&) = delete;
   LRUCache& operator=(const LRUCache&) = delete;
@@ -297,6 +351,7 @@ class LRUCache {
 
     // Remove expired item
     if (node->expired(now)) {
+      unweigh(state, node.get());
       state->map.erase(it);
       q->remove(node.get());
       ++state->stats.cacheMiss;
@@ -382,6 +437,7 @@ class LRUCache {
         // We can't re-use it without introducing locking in
         // the node itself.
         q->remove(node.get());
+        unweigh(state, node.get());
         state->map.erase(it);
         ++state->stats.cacheEvict;
       }
@@ -444,13 +500,14 @@ class LRUCache {
         // Now that the promises have been stolen, insert into
         // the appropriate queue.
         whichQ(node.get(), state)->insertTail(node.get());
+        weigh(state, node.get());
 
         // If we were saturated at the start of the query, we may
         // not have been able to make room and may have taken on
         // more requests than the cache limits allow.  Now that we're
         // done we should be able to free up some of those entries,
         // so take a stab at that now.
-        while (state->map.size() > maxItems_) {
+        while (overLimit(state)) {
           if (!evictOne(state, now, true)) {
             // We were not able to evict anything, so stop
             // trying.  We'll be over our cache size limit,
@@ -460,6 +517,8 @@ class LRUCache {
         }
       }
 
+      reclaimBudget();
+
       // Wake up all waiters
       for (auto& p : *promises) {
         p.setValue(node);
@@ -492,6 +551,7 @@ class LRUCache {
       // with some valid value.
       auto oldNode = it->second;
       whichQ(oldNode.get(), state)->remove(oldNode.get());
+      unweigh(state, oldNode.get());
       state->map.erase(it);
       ++state->stats.cacheEvict;
     }
@@ -499,8 +559,15 @@ class LRUCache {
     auto node = makeNode(state, now, key, std::move(value));
     state->map.emplace(std::make_pair(node->key_, node));
     whichQ(node.get(), state)->insertTail(node.get());
+    weigh(state, node.get());
     ++state->stats.cacheStore;
 
+    // An item that is heavier than the whole cache evicts itself
+    while (overLimit(state) && evictOne(state, now, true)) {
+    }
+    state.unlock();
+    reclaimBudget();
+
     return node;
   }
 
@@ -518,6 +585,7 @@ class LRUCache {
     // we do in the get() path.  The assumption is that the
     // caller is deliberately invalidating an errored node.
     whichQ(node.get(), state)->remove(node.get());
+    unweigh(state, node.get());
     state->map.erase(it);
     ++state->stats.cacheErase;
 
@@ -533,12 +601,16 @@ class LRUCache {
   // Returns cache statistics
   CacheStats stats() const {
     auto state = state_.rlock();
-    return CacheStats(state->stats, state->map.size());
+    return CacheStats(state->stats, state->map.size(), state->bytes);
   }
 
   // Purge all of the entries from the cache
   void clear() {
     auto state = state_.wlock();
+    if (budget_) {
+      budget_->release(state->bytes);
+    }
+    state->bytes = 0;
     state->evictionOrder.clear();
     state->erroredOrder.clear();
     state->lookupOrder.clear();
@@ -594,6 +666,7 @@ class LRUCache {
     auto errorNode = state->erroredOrder.head();
     if (errorNode && errorNode->expired(now)) {
       state->erroredOrder.remove(errorNode);
+      unweigh(state, errorNode);
       // Erase from the map last, as this will invalidate node
       state->map.erase(errorNode->key_);
       ++state->stats.cacheEvict;
@@ -604,6 +677,7 @@ class LRUCache {
     auto node = state->evictionOrder.head();
     if (node) {
       state->evictionOrder.remove(node);
+      unweigh(state, node);
       // Erase from the map last, as this will invalidate node
       state->map.erase(node->key_);
       ++state->stats.cacheEvict;
@@ -615,6 +689,7 @@ class LRUCache {
     // that we found earlier.
     if (forceRemoval && errorNode) {
       state->erroredOrder.remove(errorNode);
+      unweigh(state, errorNode);
       // Erase from the map last, as this will invalidate node
       state->map.erase(errorNode->key_);
       ++state->stats.cacheEvict;
@@ -625,10 +700,220 @@ class LRUCache {
     return false;
   }
 
+  // Charges the weight of a node that was just linked into the map
+  void weigh(LockedState& state, NodeType* node) {
+    if (!weigher_ || !node->value_.hasValue()) {
+      return;
+    }
+    node->weight_ = weigher_(node->key_, node->value_.value());
+    state->bytes += node->weight_;
+    if (budget_) {
+      budget_->charge(node->weight_);
+    }
+  }
+
+  // Releases the weight of a node that is being removed from the map
+  void unweigh(LockedState& state, NodeType* node) {
+    state->bytes -= node->weight_;
+    if (budget_) {
+      budget_->release(node->weight_);
+    }
+    node->weight_ = 0;
+  }
+
+  bool overLimit(LockedState& state) const {
+    return state->map.size() > maxItems_ ||
+        (maxBytes_ > 0 && state->bytes > maxBytes_);
+  }
+
+  // Must be called without holding the lock on the state, as the
+  // budget may shrink this cache
+  void reclaimBudget() {
+    if (budget_ && budget_->overBudget()) {
+      budget_->reclaim();
+    }
+  }
+
+  size_t budgetedBytes() const override {
+    return state_.rlock()->bytes;
+  }
+
+  size_t shrinkBy(size_t bytes) override {
+    auto state = state_.wlock();
+    auto now = std::chrono::steady_clock::now();
+    size_t freed = 0;
+    while (freed < bytes) {
+      auto before = state->bytes;
+      if (!evictOne(state, now, true)) {
+        break;
+      }
+      freed += before - state->bytes;
+    }
+    return freed;
+  }
+
   // The maximum allowed capacity
   const size_t maxItems_;
   // How long to cache items that have an error Result
   const std::chrono::milliseconds errorTTL_;
+  const Weigher weigher_;
+  // The maximum total weight, or 0 for no limit
+  const size_t maxBytes_{0};
+  const std::shared_ptr<CacheMemoryBudget> budget_;
   folly::Synchronized<State> state_;
 };
+
+/** ShardedLRUCache spreads its items across a number of LRUCache shards,
+ * chosen by the hash of the key, so that lookups of different keys from
+ * many threads don't all contend on a single lock.
+ *
+ * Each shard holds an equal portion of maxItems and evicts the least
+ * recently used of its own items, so the eviction order only approximates
+ * that of a single LRUCache.  The API and the thread safety guarantees are
+ * the same as those of LRUCache.
+ */
+template <typename KeyType, typename ValueType>
+class ShardedLRUCache {
+ public:
+  using ShardType = LRUCache<KeyType, ValueType>;
+  using NodeType = typename ShardType::NodeType;
+  using Weigher = typename ShardType::Weigher;
+
+  // Each shard holds at least this many items, so that a small cache
+  // retains a usable eviction order
+  static constexpr size_t kMinItemsPerShard = 64;
+
+  // Construct a cache with a defined limit and the specified negative
+  // caching TTL duration.  If numShards is 0, it is picked based on the
+  // number of cores.
+  ShardedLRUCache(
+      size_t maxItems,
+      std::chrono::milliseconds errorTTL,
+      size_t numShards = 0)
+      : ShardedLRUCache(maxItems, errorTTL, nullptr, 0, nullptr, numShards) {}
+
+  // Construct a cache that is also limited by weight; see LRUCache.
+  // Each shard holds an equal portion of maxBytes, and is a separate
+  // member of the budget.
+  ShardedLRUCache(
+      size_t maxItems,
+      std::chrono::milliseconds errorTTL,
+      Weigher weigher,
+      size_t maxBytes,
+      std::shared_ptr<CacheMemoryBudget> budget = nullptr,
+      size_t numShards = 0) {
+    if (numShards == 0) {
+      numShards = defaultNumShards(maxItems);
+    }
+    // Round down to a power of two so that we can mask the hash
+    size_t shards = 1;
+    while (shards * 2 <= numShards) {
+      shards <<= 1;
+    }
+    mask_ = shards - 1;
+    auto perShard = (maxItems + shards - 1) / shards;
+    auto bytesPerShard = (maxBytes + shards - 1) / shards;
+    shards_.reserve(shards);
+    for (size_t i = 0; i < shards; ++i) {
+      shards_.emplace_back(std::make_unique<ShardType>(
+          perShard, errorTTL, weigher, bytesPerShard, budget));
+    }
+  }
+
+  // No moving or copying
+  ShardedLRUCache(const ShardedLRUCache&) = delete;
+  ShardedLRUCache& operator=(const ShardedLRUCache&) = delete;
+  ShardedLRUCache(ShardedLRUCache&&) = delete;
+  ShardedLRUCache& operator=(ShardedLRUCache&&) = delete;
+
+  // See LRUCache::get()
+  std::shared_ptr<const NodeType> get(
+      const KeyType& key,
+      std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now()) {
+    return shardFor(key).get(key, now);
+  }
+
+  // See LRUCache::get()
+  template <typename Func>
+  folly::Future<std::shared_ptr<const NodeType>> get(
+      const KeyType& key,
+      Func&& getter,
+      std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now()) {
+    return shardFor(key).get(key, std::forward<Func>(getter), now);
+  }
+
+  // See LRUCache::set()
+  std::shared_ptr<const NodeType> set(
+      const KeyType& key,
+      ValueType&& value,
+      std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now()) {
+    return shardFor(key).set(key, std::move(value), now);
+  }
+
+  // See LRUCache::erase()
+  std::shared_ptr<const NodeType> erase(const KeyType& key) {
+    return shardFor(key).erase(key);
+  }
+
+  // Returns the number of cached items across all of the shards
+  size_t size() const {
+    size_t size = 0;
+    for (auto& shard : shards_) {
+      size += shard->size();
+    }
+    return size;
+  }
+
+  // Returns the sum of the statistics of the shards.  The shards are
+  // sampled one at a time, so this isn't an atomic snapshot.
+  CacheStats stats() const {
+    lrucache::Stats total;
+    size_t size = 0;
+    size_t bytes = 0;
+    for (auto& shard : shards_) {
+      auto stats = shard->stats();
+      total.cacheHit += stats.cacheHit;
+      total.cacheShare += stats.cacheShare;
+      total.cacheMiss += stats.cacheMiss;
+      total.cacheEvict += stats.cacheEvict;
+      total.cacheStore += stats.cacheStore;
+      total.cacheLoad += stats.cacheLoad;
+      total.cacheErase += stats.cacheErase;
+      // Every shard is cleared together
+      total.clearCount = std::max(total.clearCount, stats.clearCount);
+      size += stats.size;
+      bytes += stats.bytes;
+    }
+    return CacheStats(total, size, bytes);
+  }
+
+  // Purge all of the entries from the cache
+  void clear() {
+    for (auto& shard : shards_) {
+      shard->clear();
+    }
+  }
+
+  size_t numShards() const {
+    return shards_.size();
+  }
+
+ private:
+  static size_t defaultNumShards(size_t maxItems) {
+    size_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+    return std::min(cores, maxItems / kMinItemsPerShard);
+  }
+
+  ShardType& shardFor(const KeyType& key) {
+    // The hash of some keys is weak in the low bits, so mix it first
+    auto hash = folly::hash::twang_mix64(std::hash<KeyType>()(key));
+    return *shards_[hash & mask_];
+  }
+
+  std::vector<std::unique_ptr<ShardType>> shards_;
+  size_t mask_;
+};
 } // namespace watchman
@@ -1,16 +1,43 @@
 #include "LocalFileResult.h"
+#include <algorithm>
 #include "ContentHash.h"
 #include "watchman_error_category.h"
+#include "watchman_opendir.h"
 
 using folly::Optional;
 
 namespace watchman {
 
+namespace {
+// The properties that don't need the file to be stat'd, provided that the
+// listing of its dir tells us its type
+constexpr FileResult::Properties kListingProperties =
+    FileResult::Property::Name | FileResult::Property::Exists |
+    FileResult::Property::FileDType | FileResult::Property::CTime |
+    FileResult::Property::OTime;
+} // namespace
+
+bool LocalFileResult::DirCache::isMissing(w_string_piece dir) const {
+  if (missingDirs.empty()) {
+    return false;
+  }
+  for (; dir.size() > 0; dir = dir.dirName()) {
+    if (missingDirs.find(dir.asWString()) != missingDirs.end()) {
+      return true;
+    }
+  }
+  return false;
+}
+
 LocalFileResult::LocalFileResult(
     const std::shared_ptr<w_root_t>& root,
     w_string fullPath,
-    w_clock_t clock)
-    : root_(root), fullPath_(fullPath), clock_(clock) {}
+    w_clock_t clock,
+    std::shared_ptr<DirCache> dirCache)
+    : root_(root),
+      fullPath_(fullPath),
+      clock_(clock),
+      dirCache_(std::move(dirCache)) {}
 
 void LocalFileResult::getInfo() {
   if (info_.has_value()) {
@@ -21,11 +48,15 @@ void LocalFileResult::getInfo() {
     exists_ = true;
   } catch (const std::exception&) {
     // Treat any error as effectively deleted
-    exists_ = false;
-    info_ = FileInformation::makeDeletedFileInformation();
+    markDeleted();
   }
 }
 
+void LocalFileResult::markDeleted() {
+  exists_ = false;
+  info_ = FileInformation::makeDeletedFileInformation();
+}
+
 Optional<FileInformation> LocalFileResult::stat() {
   if (!info_.has_value()) {
     accessorNeedsProperties(FileResult::Property::FullFileInformation);
@@ -75,13 +106,24 @@ w_string_piece LocalFileResult::dirName() {
 }
 
 Optional<bool> LocalFileResult::exists() {
-  if (!info_.has_value()) {
+  if (!info_.has_value() && !dtype_.has_value()) {
     accessorNeedsProperties(FileResult::Property::Exists);
     return folly::none;
   }
   return exists_;
 }
 
+Optional<DType> LocalFileResult::dtype() {
+  if (info_.has_value()) {
+    return info_->dtype();
+  }
+  if (dtype_.has_value()) {
+    return dtype_;
+  }
+  accessorNeedsProperties(FileResult::Property::FileDType);
+  return folly::none;
+}
+
 Optional<w_string> LocalFileResult::readLink() {
   if (symlinkTarget_.has_value()) {
     return symlinkTarget_;
@@ -106,11 +148,132 @@ Optional<FileResult::ContentHash> LocalFileResult::getContentSha1() {
   return contentSha1_.value();
 }
 
+Optional<FileResult::ContentDigest> LocalFileResult::getContentHash(
+    ContentHashAlgorithm algorithm) {
+  auto& hash = contentHashes_[size_t(algorithm)];
+  if (hash.empty()) {
+    neededContentHashes_ |= 1 << size_t(algorithm);
+    accessorNeedsProperties(FileResult::Property::ContentFastHash);
+    return folly::none;
+  }
+  return hash.value();
+}
+
+void LocalFileResult::fetchDirEntries(
+    const w_string& dir,
+    LocalFileResult** begin,
+    LocalFileResult** end,
+    DirCache& dirCache) {
+  if (dirCache.isMissing(dir)) {
+    for (auto it = begin; it != end; ++it) {
+      (*it)->markDeleted();
+    }
+    return;
+  }
+
+  std::unique_ptr<watchman_dir_handle> handle;
+  try {
+    handle = w_dir_open(dir.c_str());
+  } catch (const std::system_error& exc) {
+    if (exc.code() == error_code::no_such_file_or_directory ||
+        exc.code() == error_code::not_a_directory) {
+      dirCache.missingDirs.insert(dir);
+      for (auto it = begin; it != end; ++it) {
+        (*it)->markDeleted();
+      }
+      return;
+    }
+    // Otherwise look at each file by its full path below
+  }
+
+  for (auto it = begin; it != end; ++it) {
+    auto file = *it;
+    // A file whose name is not in the listing doesn't exist, just as if
+    // getFileInformation() had failed to find it
+    if (handle && !(file->neededProperties() & ~kListingProperties)) {
+      auto listing = dirCache.listings.find(dir);
+      if (listing == dirCache.listings.end()) {
+        std::unordered_map<w_string, DType> entries;
+        while (auto ent = handle->readDir()) {
+          entries.emplace(w_string(ent->d_name, W_STRING_BYTE), ent->d_type);
+        }
+        listing = dirCache.listings.emplace(dir, std::move(entries)).first;
+      }
+      auto entry = listing->second.find(file->baseName().asWString());
+      if (entry == listing->second.end()) {
+        file->markDeleted();
+        continue;
+      }
+      if (entry->second != DType::Unknown) {
+        file->exists_ = true;
+        file->dtype_ = entry->second;
+        continue;
+      }
+      // The listing didn't tell us the type, so we need to stat it
+    }
+
+#ifndef _WIN32
+    // As in the crawler, stat'ing the name relative to the dir handle is
+    // equivalent to getFileInformation() when we don't need to confirm
+    // the case of the name
+    int dirFd = handle ? handle->getFd() : -1;
+    if (dirFd != -1 &&
+        file->root_->case_sensitive != CaseSensitivity::CaseInSensitive) {
+      struct stat st;
+      // The base name is the tail of fullPath_, so it is terminated
+      if (fstatat(dirFd, file->baseName().data(), &st, AT_SYMLINK_NOFOLLOW) ==
+          0) {
+        file->info_ = FileInformation(st);
+        file->exists_ = true;
+      } else {
+        file->markDeleted();
+      }
+      continue;
+    }
+#endif
+    file->getInfo();
+  }
+}
+
 void LocalFileResult::batchFetchProperties(
     const std::vector<std::unique_ptr<FileResult>>& files) {
+  auto dirCache = dirCache_ ? dirCache_ : std::make_shared<DirCache>();
+
+  // Look up the files that we don't know about yet a dir at a time
+  std::vector<LocalFileResult*> unknown;
+  for (auto& f : files) {
+    auto localFile = dynamic_cast<LocalFileResult*>(f.get());
+    if (localFile->info_.has_value()) {
+      continue;
+    }
+    if (localFile->dtype_.has_value() &&
+        !(localFile->neededProperties() & ~kListingProperties)) {
+      continue;
+    }
+    unknown.push_back(localFile);
+  }
+  std::stable_sort(
+      unknown.begin(),
+      unknown.end(),
+      [](LocalFileResult* a, LocalFileResult* b) {
+        return a->dirName() < b->dirName();
+      });
+  for (size_t begin = 0; begin < unknown.size();) {
+    auto dir = unknown[begin]->dirName();
+    auto end = begin + 1;
+    while (end < unknown.size() && unknown[end]->dirName() == dir) {
+      ++end;
+    }
+    fetchDirEntries(
+        dir.asWString(),
+        unknown.data() + begin,
+        unknown.data() + end,
+        *dirCache);
+    begin = end;
+  }
+
   for (auto& f : files) {
     auto localFile = dynamic_cast<LocalFileResult*>(f.get());
-    localFile->getInfo();
 
     if (localFile->neededProperties() & FileResult::Property::SymlinkTarget) {
       if (!localFile->info_->isSymlink()) {
@@ -129,11 +292,26 @@ void LocalFileResult::batchFetchProperties(
       // TODO: find a way to reference a ContentHashCache instance
       // that will work with !InMemoryView based views.
       localFile->contentSha1_ = makeResultWith([&] {
-        return ContentHashCache::computeHashImmediate(
+        auto value = ContentHashCache::computeHashImmediate(
             localFile->fullPath_.c_str());
+        FileResult::ContentHash hash;
+        std::copy_n(value.begin(), hash.size(), hash.begin());
+        return hash;
       });
     }
 
+    if (localFile->neededProperties() & FileResult::Property::ContentFastHash) {
+      for (size_t i = 0; i < kNumContentHashAlgorithms; ++i) {
+        if (localFile->neededContentHashes_ & (1 << i)) {
+          localFile->contentHashes_[i] = makeResultWith([&] {
+            return ContentHashCache::computeHashImmediate(
+                localFile->fullPath_.c_str(), ContentHashAlgorithm(i));
+          });
+        }
+      }
+      localFile->neededContentHashes_ = 0;
+    }
+
     localFile->clearNeededProperties();
   }
 }
@@ -1,6 +1,11 @@
 #pragma once
 #include "watchman.h"
 #include "watchman_string.h"
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include "ContentHash.h"
 #include "thirdparty/jansson/jansson.h"
 #include "watchman_query.h"
 
@@ -17,13 +22,33 @@ namespace watchman {
  * FileResult objects are typically extremely short lived, existing between
  * the point in time at which a file is matched by a query and the time
  * at which the file is rendered into the results of the query.
+ *
+ * The files are looked up a dir at a time: the files in the same dir are
+ * stat'd relative to a single handle on it, and files whose type is all
+ * that is needed are found in the listing of the dir without a stat.
  */
 class LocalFileResult : public FileResult {
  public:
+  // What is learned about the dirs while fetching the properties of one
+  // batch of files, kept for the next batch.  One is shared by the
+  // results of a query, and is only used by the thread that executes it.
+  struct DirCache {
+    // The type of each entry of the dirs that have been listed, by the
+    // full path of the dir
+    std::unordered_map<w_string, std::unordered_map<w_string, DType>>
+        listings;
+    // The full paths of the dirs that don't exist
+    std::unordered_set<w_string> missingDirs;
+
+    // Returns true if dir, or a dir that contains it, doesn't exist
+    bool isMissing(w_string_piece dir) const;
+  };
+
   LocalFileResult(
       const std::shared_ptr<w_root_t>& root_,
       w_string fullPath,
-      w_clock_t clock);
+      w_clock_t clock,
+      std::shared_ptr<DirCache> dirCache = nullptr);
 
   // Returns stat-like information about this file.  If the file doesn't
   // exist the stat information will be largely useless (it will be zeroed
@@ -44,6 +69,7 @@ class LocalFileResult : public FileResult {
   w_string_piece dirName() override;
   // Returns true if the file currently exists
   folly::Optional<bool> exists() override;
+  folly::Optional<DType> dtype() override;
   // Returns the symlink target
   folly::Optional<w_string> readLink() override;
 
@@ -53,20 +79,40 @@ class LocalFileResult : public FileResult {
   // Returns the SHA-1 hash of the file contents
   folly::Optional<FileResult::ContentHash> getContentSha1() override;
 
+  // Returns the hash of the file contents computed by algorithm
+  folly::Optional<FileResult::ContentDigest> getContentHash(
+      ContentHashAlgorithm algorithm) override;
+
   void batchFetchProperties(
       const std::vector<std::unique_ptr<FileResult>>& files) override;
 
  private:
   void getInfo();
+  void markDeleted();
+  // Looks up the files in [begin, end), which are all in dir
+  static void fetchDirEntries(
+      const w_string& dir,
+      LocalFileResult** begin,
+      LocalFileResult** end,
+      DirCache& dirCache);
   w_string getFullPath();
 
   bool exists_{true};
   folly::Optional<FileInformation> info_;
+  // The type reported by the listing of the dir, which also tells us that
+  // the file exists, when we didn't need to stat it
+  folly::Optional<DType> dtype_;
+  std::shared_ptr<DirCache> dirCache_;
   std::shared_ptr<w_root_t> root_;
   w_string fullPath_;
   w_clock_t clock_;
   folly::Optional<w_string> symlinkTarget_;
   Result<FileResult::ContentHash> contentSha1_;
+  // Indexed by ContentHashAlgorithm
+  std::array<Result<FileResult::ContentDigest>, kNumContentHashAlgorithms>
+      contentHashes_;
+  // A bitset of the algorithms that getContentHash() has been asked for
+  uint8_t neededContentHashes_{0};
 };
 
 } // namespace watchman
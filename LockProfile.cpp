@@ -0,0 +1,102 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "LockProfile.h"
+#include <algorithm>
+#include "Logging.h"
+
+namespace watchman {
+
+std::atomic<bool> LockProfile::enabled_{false};
+thread_local const char* LockSite::current_{nullptr};
+
+namespace {
+folly::Synchronized<std::vector<LockProfile*>, std::mutex>& registry() {
+  static auto* profiles =
+      new folly::Synchronized<std::vector<LockProfile*>, std::mutex>();
+  return *profiles;
+}
+} // namespace
+
+LockProfile::LockProfile(const char* name) : name_(name) {
+  registry().lock()->push_back(this);
+}
+
+void LockProfile::setEnabled(bool enabled) {
+  enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void LockProfile::recordAcquire(bool shared, bool contended, uint64_t waitUs) {
+  acquisitions_.fetch_add(1, std::memory_order_relaxed);
+  if (contended) {
+    contended_.fetch_add(1, std::memory_order_relaxed);
+  }
+  (shared ? sharedWaitUs_ : exclusiveWaitUs_).record(waitUs);
+}
+
+void LockProfile::recordHold(uint64_t holdUs, const char* site) {
+  holdUs_.record(holdUs);
+  if (holdUs <= longestThreshold_.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  auto longest = longest_.lock();
+  auto it = std::find_if(longest->begin(), longest->end(), [&](auto& hold) {
+    return hold.holdUs < holdUs;
+  });
+  if (it == longest->end() && longest->size() >= kMaxLongestHolds) {
+    return;
+  }
+  longest->insert(it, Hold{holdUs, site, Log::getThreadName()});
+  if (longest->size() > kMaxLongestHolds) {
+    longest->pop_back();
+  }
+  if (longest->size() == kMaxLongestHolds) {
+    longestThreshold_.store(
+        longest->back().holdUs, std::memory_order_relaxed);
+  }
+}
+
+json_ref LockProfile::toJson() const {
+  auto holds = json_array();
+  for (auto& hold : *longest_.lock()) {
+    json_array_append_new(
+        holds,
+        json_object(
+            {{"hold_us", json_integer(hold.holdUs)},
+             {"site", typed_string_to_json(hold.site, W_STRING_UNICODE)},
+             {"thread",
+              typed_string_to_json(hold.thread.c_str(), W_STRING_UNICODE)}}));
+  }
+  return json_object(
+      {{"acquisitions",
+        json_integer(acquisitions_.load(std::memory_order_relaxed))},
+       {"contended", json_integer(contended_.load(std::memory_order_relaxed))},
+       {"exclusive_wait_us", exclusiveWaitUs_.toJson()},
+       {"shared_wait_us", sharedWaitUs_.toJson()},
+       {"hold_us", holdUs_.toJson()},
+       {"longest_holds", holds}});
+}
+
+void LockProfile::reset() {
+  acquisitions_.store(0, std::memory_order_relaxed);
+  contended_.store(0, std::memory_order_relaxed);
+  exclusiveWaitUs_.reset();
+  sharedWaitUs_.reset();
+  holdUs_.reset();
+  longest_.lock()->clear();
+  longestThreshold_.store(0, std::memory_order_relaxed);
+}
+
+json_ref LockProfile::allToJson(bool reset) {
+  auto result = json_object();
+  auto profiles = registry().lock();
+  for (auto profile : *profiles) {
+    result.set(profile->name_, profile->toJson());
+    if (reset) {
+      profile->reset();
+    }
+  }
+  return result;
+}
+
+} // namespace watchman
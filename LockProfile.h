@@ -0,0 +1,184 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <folly/Synchronized.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Histogram.h"
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// The contention on a class of locks, such as the view locks of all of
+// the roots: how long acquiring them waited, how long they were held
+// exclusively, and which code held them the longest.  Profiling is off
+// by default, in which case a ProfiledMutex costs a relaxed load and a
+// store per lock.
+class LockProfile {
+ public:
+  // Profiles are never destroyed
+  explicit LockProfile(const char* name);
+  LockProfile(const LockProfile&) = delete;
+  LockProfile& operator=(const LockProfile&) = delete;
+
+  static bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+  static void setEnabled(bool enabled);
+
+  void recordAcquire(bool shared, bool contended, uint64_t waitUs);
+  void recordHold(uint64_t holdUs, const char* site);
+
+  // Returns the stats of every profile, keyed by their names.  If reset
+  // is true, the stats are then cleared.
+  static json_ref allToJson(bool reset);
+
+ private:
+  struct Hold {
+    uint64_t holdUs;
+    const char* site;
+    std::string thread;
+  };
+  static constexpr size_t kMaxLongestHolds = 10;
+
+  json_ref toJson() const;
+  void reset();
+
+  const char* const name_;
+  std::atomic<uint64_t> acquisitions_{0};
+  std::atomic<uint64_t> contended_{0};
+  Histogram exclusiveWaitUs_;
+  Histogram sharedWaitUs_;
+  Histogram holdUs_;
+  // The longest holds, longest first.  Holds no longer than
+  // longestThreshold_ can't make the list, which lets them skip the lock.
+  folly::Synchronized<std::vector<Hold>, std::mutex> longest_;
+  std::atomic<uint64_t> longestThreshold_{0};
+
+  static std::atomic<bool> enabled_;
+};
+
+// Labels the locks that are acquired by the current thread while it is
+// in scope, so that the longest holds can be attributed to the code that
+// took them.  Scopes nest; the innermost label applies.
+class LockSite {
+ public:
+  explicit LockSite(const char* name) : prior_(current_) {
+    current_ = name;
+  }
+  ~LockSite() {
+    current_ = prior_;
+  }
+  LockSite(const LockSite&) = delete;
+  LockSite& operator=(const LockSite&) = delete;
+
+  static const char* current() {
+    return current_ ? current_ : "unlabelled";
+  }
+
+ private:
+  const char* prior_;
+  static thread_local const char* current_;
+};
+
+// A mutex that records its contention in the LockProfile named by
+// Tag::kName, for use as the mutex of a folly::Synchronized.  Mutex may
+// be a shared mutex, in which case only the waits for the shared lock are
+// recorded, since its holders can't be told apart.
+template <typename Mutex, typename Tag>
+class ProfiledMutex {
+ public:
+  static LockProfile& profile() {
+    static auto* profile = new LockProfile(Tag::kName);
+    return *profile;
+  }
+
+  void lock() {
+    if (!LockProfile::enabled()) {
+      mutex_.lock();
+      profiledHold_ = false;
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool contended = !mutex_.try_lock();
+    if (contended) {
+      mutex_.lock();
+    }
+    auto acquired = std::chrono::steady_clock::now();
+    profile().recordAcquire(false, contended, micros(acquired - start));
+    startHold(acquired);
+  }
+
+  bool try_lock() {
+    if (!mutex_.try_lock()) {
+      return false;
+    }
+    if (LockProfile::enabled()) {
+      profile().recordAcquire(false, false, 0);
+      startHold(std::chrono::steady_clock::now());
+    } else {
+      profiledHold_ = false;
+    }
+    return true;
+  }
+
+  void unlock() {
+    if (profiledHold_) {
+      profiledHold_ = false;
+      profile().recordHold(
+          micros(std::chrono::steady_clock::now() - acquiredAt_), site_);
+    }
+    mutex_.unlock();
+  }
+
+  void lock_shared() {
+    if (!LockProfile::enabled()) {
+      mutex_.lock_shared();
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool contended = !mutex_.try_lock_shared();
+    if (contended) {
+      mutex_.lock_shared();
+    }
+    profile().recordAcquire(
+        true, contended, micros(std::chrono::steady_clock::now() - start));
+  }
+
+  bool try_lock_shared() {
+    if (!mutex_.try_lock_shared()) {
+      return false;
+    }
+    if (LockProfile::enabled()) {
+      profile().recordAcquire(true, false, 0);
+    }
+    return true;
+  }
+
+  void unlock_shared() {
+    mutex_.unlock_shared();
+  }
+
+ private:
+  static uint64_t micros(std::chrono::steady_clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  }
+
+  void startHold(std::chrono::steady_clock::time_point acquired) {
+    acquiredAt_ = acquired;
+    site_ = LockSite::current();
+    profiledHold_ = true;
+  }
+
+  Mutex mutex_;
+  // Only accessed by the holder of the exclusive lock
+  bool profiledHold_{false};
+  std::chrono::steady_clock::time_point acquiredAt_;
+  const char* site_{nullptr};
+};
+
+} // namespace watchman
@@ -3,8 +3,10 @@
 
 #include <array>
 #include <limits>
+#include <new>
 #include <sstream>
-#ifdef __APPLE__
+#include <thread>
+#ifndef _WIN32
 #include <pthread.h>
 #endif
 #include <folly/Optional.h>
@@ -98,21 +100,28 @@ Log::Log()
 }
 
 Log& getLog() {
-  static Log log;
-  return log;
+  // Never destroyed, as the stderr writer thread may still be using it
+  // while the process exits
+  static Log* log = new Log;
+  return *log;
 }
 
-char* Log::timeString(char* buf, size_t bufsize, timeval tv) {
+namespace {
+// Formats the date and time to the second
+void formatSeconds(char* buf, size_t bufsize, time_t seconds) {
   struct tm tm;
 #ifdef _WIN32
-  time_t seconds = (time_t)tv.tv_sec;
   tm = *localtime(&seconds);
 #else
-  localtime_r(&tv.tv_sec, &tm);
+  localtime_r(&seconds, &tm);
 #endif
+  strftime(buf, bufsize, "%Y-%m-%dT%H:%M:%S", &tm);
+}
+} // namespace
 
+char* Log::timeString(char* buf, size_t bufsize, timeval tv) {
   char timebuf[64];
-  strftime(timebuf, sizeof(timebuf), "%Y-%m-%dT%H:%M:%S", &tm);
+  formatSeconds(timebuf, sizeof(timebuf), (time_t)tv.tv_sec);
   snprintf(buf, bufsize, "%s,%03d", timebuf, (int)tv.tv_usec / 1000);
   return buf;
 }
@@ -120,7 +129,18 @@ char* Log::timeString(char* buf, size_t bufsize, timeval tv) {
 char* Log::currentTimeString(char* buf, size_t bufsize) {
   struct timeval tv;
   gettimeofday(&tv, NULL);
-  return timeString(buf, bufsize, tv);
+
+  // localtime_r takes a lock and consults the timezone, and most messages
+  // are logged in the same second as the one before them, so each thread
+  // keeps the formatted form of the last second that it logged in
+  thread_local time_t lastSeconds = -1;
+  thread_local char lastTimebuf[64];
+  if ((time_t)tv.tv_sec != lastSeconds) {
+    formatSeconds(lastTimebuf, sizeof(lastTimebuf), (time_t)tv.tv_sec);
+    lastSeconds = (time_t)tv.tv_sec;
+  }
+  snprintf(buf, bufsize, "%s,%03d", lastTimebuf, (int)tv.tv_usec / 1000);
+  return buf;
 }
 
 const char* Log::setThreadName(std::string&& name) {
@@ -144,7 +164,7 @@ const char* Log::getThreadName() {
 }
 
 void Log::setStdErrLoggingLevel(LogLevel level) {
-  auto notify = [this]() { doLogToStdErr(); };
+  auto notify = [this]() { wakeStdErrWriter(); };
   switch (level) {
     case OFF:
       errorSub_.reset();
@@ -167,28 +187,78 @@ void Log::setStdErrLoggingLevel(LogLevel level) {
   }
 }
 
-void Log::doLogToStdErr() {
-  std::vector<std::shared_ptr<const watchman::Publisher::Item>> items;
-
+// Messages are written to stderr from a thread of their own, so that the
+// threads that log them don't wait on the write
+void Log::wakeStdErrWriter() {
+  if (!stdErrWriterRunning_.load(std::memory_order_acquire)) {
+    startStdErrWriter();
+  }
   {
-    std::lock_guard<std::mutex> lock(stdErrPrintMutex_);
-    getPending(items, errorSub_, debugSub_);
+    std::lock_guard<std::mutex> lock(stdErrWriterMutex_);
+    stdErrWriterPending_ = true;
+  }
+  stdErrWriterCond_.notify_one();
+}
+
+void Log::startStdErrWriter() {
+  static std::once_flag registered;
+  std::call_once(registered, [] {
+    // Write whatever the thread has yet to get to when we exit
+    atexit([] { getLog().doLogToStdErr(); });
+#ifndef _WIN32
+    pthread_atfork(nullptr, nullptr, [] {
+      // The child only has the thread that forked, and any of the locks
+      // may have been held by one of the others
+      auto& log = getLog();
+      new (&log.stdErrPrintMutex_) std::mutex();
+      new (&log.stdErrWriterMutex_) std::mutex();
+      new (&log.stdErrWriterCond_) std::condition_variable();
+      log.stdErrWriterRunning_.store(false, std::memory_order_release);
+    });
+#endif
+  });
+
+  std::lock_guard<std::mutex> lock(stdErrWriterMutex_);
+  if (!stdErrWriterRunning_.load(std::memory_order_acquire)) {
+    std::thread([this] { stdErrWriterThread(); }).detach();
+    stdErrWriterRunning_.store(true, std::memory_order_release);
+  }
+}
+
+void Log::stdErrWriterThread() {
+  setThreadName("log-stderr");
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(stdErrWriterMutex_);
+      stdErrWriterCond_.wait(lock, [this] { return stdErrWriterPending_; });
+      stdErrWriterPending_ = false;
+    }
+    doLogToStdErr();
   }
+}
+
+void Log::doLogToStdErr() {
+  std::vector<std::shared_ptr<const watchman::Publisher::Item>> items;
 
   bool doFatal = false;
   bool doAbort = false;
   static w_string kFatal("fatal");
   static w_string kAbort("abort");
 
-  for (auto& item : items) {
-    auto& log = json_to_w_string(item->payload.get("log"));
-    ignore_result(::write(STDERR_FILENO, log.data(), log.size()));
+  {
+    std::lock_guard<std::mutex> lock(stdErrPrintMutex_);
+    getPending(items, errorSub_, debugSub_);
+
+    for (auto& item : items) {
+      auto& log = json_to_w_string(item->payload.get("log"));
+      ignore_result(::write(STDERR_FILENO, log.data(), log.size()));
 
-    auto level = json_to_w_string(item->payload.get("level"));
-    if (level == kFatal) {
-      doFatal = true;
-    } else if (level == kAbort) {
-      doAbort = true;
+      auto level = json_to_w_string(item->payload.get("level"));
+      if (level == kFatal) {
+        doFatal = true;
+      } else if (level == kAbort) {
+        doAbort = true;
+      }
     }
   }
 
@@ -1,6 +1,9 @@
 /* Copyright 2016-present Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include "watchman_string.h"
 #include "PubSub.h"
 #include "watchman_preprocessor.h"
@@ -27,6 +30,15 @@ class Log {
 
   void setStdErrLoggingLevel(LogLevel level);
 
+  // Returns true if anything is subscribed to messages of this level.
+  // The log methods check this before building a message, but their
+  // arguments have already been evaluated by then; callers that need to
+  // do some work to produce an argument, such as dumping some json, can
+  // check this first to avoid it.
+  bool isEnabled(LogLevel level) {
+    return levelToPub(level).hasSubscribers();
+  }
+
   // Build a string and log it
   template <typename... Args>
   void log(LogLevel level, Args&&... args) {
@@ -51,6 +63,11 @@ class Log {
                      {"level", typed_string_to_json(logLevelToLabel(level))}});
 
     pub.enqueue(std::move(payload));
+    if (level < OFF) {
+      // Our caller doesn't expect us to return, so this can't be left to
+      // the thread that writes to stderr
+      doLogToStdErr();
+    }
   }
 
   // Format a string and log it
@@ -77,6 +94,11 @@ class Log {
          {"level", typed_string_to_json(logLevelToLabel(level))}});
 
     pub.enqueue(std::move(payload));
+    if (level < OFF) {
+      // Our caller doesn't expect us to return, so this can't be left to
+      // the thread that writes to stderr
+      doLogToStdErr();
+    }
   }
 
   Log();
@@ -86,13 +108,25 @@ class Log {
   std::shared_ptr<Publisher> debugPub_;
   std::shared_ptr<Publisher::Subscriber> errorSub_;
   std::shared_ptr<Publisher::Subscriber> debugSub_;
+  // Held while the pending items are written to stderr, so that they are
+  // written in order
   std::mutex stdErrPrintMutex_;
+  // The thread that writes to stderr is started along with the first
+  // message and woken for those that follow.  A forked child doesn't
+  // inherit it and starts its own.
+  std::atomic<bool> stdErrWriterRunning_{false};
+  std::mutex stdErrWriterMutex_;
+  std::condition_variable stdErrWriterCond_;
+  bool stdErrWriterPending_{false};
 
   inline Publisher& levelToPub(LogLevel level) {
     return level == DBG ? *debugPub_ : *errorPub_;
   }
 
   void doLogToStdErr();
+  void wakeStdErrWriter();
+  void startStdErrWriter();
+  void stdErrWriterThread();
 };
 
 // Get the logger singleton
@@ -108,6 +142,10 @@ void logf(LogLevel level, fmt::string_view format_str, Args&&... args) {
   getLog().logf(level, format_str, std::forward<Args>(args)...);
 }
 
+inline bool isLogEnabled(LogLevel level) {
+  return getLog().isEnabled(level);
+}
+
 #ifdef _WIN32
 LONG WINAPI exception_filter(LPEXCEPTION_POINTERS excep);
 #endif
@@ -0,0 +1,47 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "MappedFileErrors.h"
+#ifndef _WIN32
+#include <setjmp.h>
+#endif
+
+namespace watchman {
+
+#ifndef _WIN32
+namespace {
+// Set while the thread is running catchMappedFileErrors
+thread_local sigjmp_buf* mappedFileJump = nullptr;
+} // namespace
+#endif
+
+bool catchMappedFileErrors(folly::FunctionRef<void()> func) {
+#ifndef _WIN32
+  sigjmp_buf jump;
+  // Restores the signal mask, which blocks SIGBUS while its handler runs
+  if (sigsetjmp(jump, 1)) {
+    mappedFileJump = nullptr;
+    return false;
+  }
+  mappedFileJump = &jump;
+  try {
+    func();
+  } catch (...) {
+    mappedFileJump = nullptr;
+    throw;
+  }
+  mappedFileJump = nullptr;
+#else
+  func();
+#endif
+  return true;
+}
+
+void recoverFromMappedFileError() {
+#ifndef _WIN32
+  if (mappedFileJump) {
+    siglongjmp(*mappedFileJump, 1);
+  }
+#endif
+}
+
+} // namespace watchman
@@ -0,0 +1,24 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <folly/Function.h>
+
+namespace watchman {
+
+// Runs func, which reads from a mapping of a file.  Touching a page of the
+// mapping beyond the end of the file, as happens if the file is truncated
+// while func is reading it, raises SIGBUS; if the handler of SIGBUS calls
+// recoverFromMappedFileError, as that of the server does, func is abandoned
+// and this returns false rather than the process crashing.  func must not
+// hold anything that needs to be destroyed, since it is unwound without
+// running destructors.
+bool catchMappedFileErrors(folly::FunctionRef<void()> func);
+
+// Called by the handler of SIGBUS.  If the thread is running
+// catchMappedFileErrors, this doesn't return, and catchMappedFileErrors
+// returns false instead.  Otherwise the signal wasn't raised by reading a
+// mapping and the handler should go on to treat it as a crash.
+void recoverFromMappedFileError();
+
+} // namespace watchman
@@ -0,0 +1,150 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "Metrics.h"
+#include <folly/Conv.h>
+
+namespace watchman {
+
+std::string MetricsWriter::formatLabels(const Labels& labels) {
+  if (labels.empty()) {
+    return std::string();
+  }
+  std::string result = "{";
+  for (auto& label : labels) {
+    if (result.size() > 1) {
+      result.push_back(',');
+    }
+    result.append(label.first);
+    result.append("=\"");
+    w_string_piece value(label.second);
+    for (size_t i = 0; i < value.size(); ++i) {
+      auto c = value.data()[i];
+      switch (c) {
+        case '\\':
+          result.append("\\\\");
+          break;
+        case '"':
+          result.append("\\\"");
+          break;
+        case '\n':
+          result.append("\\n");
+          break;
+        default:
+          result.push_back(c);
+      }
+    }
+    result.push_back('"');
+  }
+  result.push_back('}');
+  return result;
+}
+
+void MetricsWriter::addSample(
+    const char* name,
+    const char* help,
+    const char* type,
+    std::string sample) {
+  auto& metric = metrics_[name];
+  if (metric.samples.empty()) {
+    metric.help = help;
+    metric.type = type;
+  }
+  metric.samples.push_back(std::move(sample));
+}
+
+void MetricsWriter::counter(
+    const char* name,
+    const char* help,
+    uint64_t value,
+    const Labels& labels) {
+  addSample(
+      name,
+      help,
+      "counter",
+      folly::to<std::string>(name, formatLabels(labels), ' ', value));
+}
+
+void MetricsWriter::gauge(
+    const char* name,
+    const char* help,
+    uint64_t value,
+    const Labels& labels) {
+  addSample(
+      name,
+      help,
+      "gauge",
+      folly::to<std::string>(name, formatLabels(labels), ' ', value));
+}
+
+void MetricsWriter::histogram(
+    const char* name,
+    const char* help,
+    const Histogram& histogram,
+    const Labels& labels) {
+  size_t last = 0;
+  for (size_t i = 0; i < Histogram::kNumBuckets; ++i) {
+    if (histogram.bucketCount(i) > 0) {
+      last = i;
+    }
+  }
+
+  // The buckets are read one at a time while values may be recorded, so
+  // the +Inf bucket takes the cumulative count rather than count(), which
+  // keeps the buckets monotonic
+  std::string sample;
+  uint64_t cumulative = 0;
+  auto bucketLabels = labels;
+  bucketLabels.emplace_back("le", w_string());
+  for (size_t i = 0; i <= last; ++i) {
+    cumulative += histogram.bucketCount(i);
+    bucketLabels.back().second =
+        w_string::build(Histogram::bucketUpperBound(i));
+    sample.append(folly::to<std::string>(
+        name, "_bucket", formatLabels(bucketLabels), ' ', cumulative, '\n'));
+  }
+  bucketLabels.back().second = w_string("+Inf", W_STRING_UNICODE);
+  auto labelText = formatLabels(labels);
+  sample.append(folly::to<std::string>(
+      name,
+      "_bucket",
+      formatLabels(bucketLabels),
+      ' ',
+      cumulative,
+      '\n',
+      name,
+      "_sum",
+      labelText,
+      ' ',
+      histogram.sum(),
+      '\n',
+      name,
+      "_count",
+      labelText,
+      ' ',
+      cumulative));
+  addSample(name, help, "histogram", std::move(sample));
+}
+
+std::string MetricsWriter::render() const {
+  std::string result;
+  for (auto& it : metrics_) {
+    folly::toAppend(
+        "# HELP ",
+        it.first,
+        ' ',
+        it.second.help,
+        "\n# TYPE ",
+        it.first,
+        ' ',
+        it.second.type,
+        '\n',
+        &result);
+    for (auto& sample : it.second.samples) {
+      result.append(sample);
+      result.push_back('\n');
+    }
+  }
+  return result;
+}
+
+} // namespace watchman
@@ -0,0 +1,61 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Histogram.h"
+#include "watchman_string.h"
+
+namespace watchman {
+
+// Formats metrics in the Prometheus text exposition format.  The samples
+// of a metric can be added in any order, such as one root at a time; they
+// are grouped under the metric when the text is rendered.
+class MetricsWriter {
+ public:
+  using Labels = std::vector<std::pair<const char*, w_string>>;
+
+  // A value that only ever increases, such as the number of recrawls
+  void counter(
+      const char* name,
+      const char* help,
+      uint64_t value,
+      const Labels& labels = {});
+  // A value that can go up and down, such as the depth of a queue
+  void gauge(
+      const char* name,
+      const char* help,
+      uint64_t value,
+      const Labels& labels = {});
+  // The buckets of histogram, up to the greatest that isn't empty, along
+  // with its sum and count
+  void histogram(
+      const char* name,
+      const char* help,
+      const Histogram& histogram,
+      const Labels& labels = {});
+
+  std::string render() const;
+
+ private:
+  struct Metric {
+    const char* help;
+    const char* type;
+    std::vector<std::string> samples;
+  };
+
+  void addSample(
+      const char* name,
+      const char* help,
+      const char* type,
+      std::string sample);
+  // Formats {name="value",...}, or nothing if there are no labels
+  static std::string formatLabels(const Labels& labels);
+
+  std::map<std::string, Metric> metrics_;
+};
+
+} // namespace watchman
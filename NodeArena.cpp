@@ -0,0 +1,368 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include "NodeArena.h"
+#include <folly/FileUtil.h>
+#include <folly/Range.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace watchman {
+
+static_assert(
+    (NodeArena::kSlabSize & (NodeArena::kSlabSize - 1)) == 0,
+    "slab size must be a power of two");
+
+namespace {
+#ifdef __linux__
+constexpr bool kHaveHugePages = true;
+#else
+constexpr bool kHaveHugePages = false;
+#endif
+
+constexpr uint32_t kAllSlabsUsed =
+    uint32_t((uint64_t(1) << NodeArena::kSlabsPerHugePage) - 1);
+} // namespace
+
+NodeArena::NodeArena(bool hugePages)
+    : hugePages_(kHaveHugePages && hugePages) {}
+
+NodeArena::~NodeArena() {
+  // The nodes themselves have already been destroyed by their owners;
+  // all that remains is to release the backing memory.
+  while (slabs_) {
+    auto slab = slabs_;
+    slabs_ = slab->next;
+    unmapSlab(slab);
+  }
+}
+
+void* NodeArena::mapAligned(size_t size) {
+#ifdef _WIN32
+  // VirtualAlloc returns addresses aligned to the allocation granularity,
+  // which is 64KiB and thus matches kSlabSize.
+  auto slab =
+      VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (!slab) {
+    throw std::bad_alloc();
+  }
+  return slab;
+#else
+  // mmap only guarantees page alignment, so over-allocate and then
+  // trim the unaligned head and tail of the mapping.
+  auto mapSize = size * 2;
+  auto raw = mmap(
+      nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (raw == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  auto addr = reinterpret_cast<uintptr_t>(raw);
+  auto aligned = (addr + size - 1) & ~(uintptr_t(size) - 1);
+  auto head = aligned - addr;
+  auto tail = mapSize - head - size;
+  if (head) {
+    munmap(raw, head);
+  }
+  if (tail) {
+    munmap(reinterpret_cast<void*>(aligned + size), tail);
+  }
+  return reinterpret_cast<void*>(aligned);
+#endif
+}
+
+void* NodeArena::mapSlab() {
+  if (hugePages_) {
+    if (auto slab = mapHugeSlab()) {
+      return slab;
+    }
+  }
+  return mapAligned(kSlabSize);
+}
+
+void NodeArena::unmapSlab(void* slab) {
+  if (!hugeRegions_.empty() && unmapHugeSlab(slab)) {
+    return;
+  }
+#ifdef _WIN32
+  VirtualFree(slab, 0, MEM_RELEASE);
+#else
+  munmap(slab, kSlabSize);
+#endif
+}
+
+void* NodeArena::mapHugeSlab() {
+#ifdef __linux__
+  while (!partialRegions_.empty()) {
+    auto base = partialRegions_.back();
+    auto it = hugeRegions_.find(base);
+    if (it == hugeRegions_.end() || it->second.used == kAllSlabsUsed) {
+      partialRegions_.pop_back();
+      continue;
+    }
+    auto& region = it->second;
+    auto idx = __builtin_ctz(~region.used);
+    region.used |= uint32_t(1) << idx;
+    if (region.used == kAllSlabsUsed) {
+      partialRegions_.pop_back();
+    }
+    auto slab = reinterpret_cast<void*>(base + idx * kSlabSize);
+    // Unlike a fresh mapping, this slab may have been used before
+    memset(slab, 0, kSlabSize);
+    return slab;
+  }
+
+  HugeRegion region;
+  void* raw = MAP_FAILED;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+  // Ask for 2MiB pages explicitly, as the default huge page size may be
+  // larger.  This fails if the pool doesn't have a page to spare.
+  raw = mmap(
+      nullptr,
+      kHugePageSize,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANON | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT),
+      -1,
+      0);
+  if (raw != MAP_FAILED &&
+      (reinterpret_cast<uintptr_t>(raw) & (kHugePageSize - 1)) != 0) {
+    munmap(raw, kHugePageSize);
+    raw = MAP_FAILED;
+  }
+  region.hugetlb = raw != MAP_FAILED;
+#endif
+  if (raw == MAP_FAILED) {
+    raw = mapAligned(kHugePageSize);
+    if (madvise(raw, kHugePageSize, MADV_HUGEPAGE) != 0) {
+      // The kernel doesn't support transparent huge pages; don't try
+      // again
+      munmap(raw, kHugePageSize);
+      hugePages_ = false;
+      return nullptr;
+    }
+  }
+
+  // Fresh mappings are zero filled, so the first slab is ready to go
+  region.used = 1;
+  auto base = reinterpret_cast<uintptr_t>(raw);
+  hugeRegions_[base] = region;
+  partialRegions_.push_back(base);
+  ++stats_.numHugeRegions;
+  if (region.hugetlb) {
+    ++stats_.numHugetlbRegions;
+  }
+  return raw;
+#else
+  return nullptr;
+#endif
+}
+
+bool NodeArena::unmapHugeSlab(void* slab) {
+#ifdef __linux__
+  auto addr = reinterpret_cast<uintptr_t>(slab);
+  auto base = addr & ~(uintptr_t(kHugePageSize) - 1);
+  auto it = hugeRegions_.find(base);
+  if (it == hugeRegions_.end()) {
+    return false;
+  }
+  auto& region = it->second;
+  bool wasFull = region.used == kAllSlabsUsed;
+  region.used &= ~(uint32_t(1) << ((addr - base) / kSlabSize));
+  if (region.used == 0) {
+    munmap(reinterpret_cast<void*>(base), kHugePageSize);
+    --stats_.numHugeRegions;
+    if (region.hugetlb) {
+      --stats_.numHugetlbRegions;
+    }
+    hugeRegions_.erase(it);
+  } else if (wasFull) {
+    partialRegions_.push_back(base);
+  }
+  return true;
+#else
+  unused_parameter(slab);
+  return false;
+#endif
+}
+
+NodeArena::Slab* NodeArena::newSlab(size_t classIdx) {
+  // Fresh anonymous mappings are zero filled
+  auto slab = static_cast<Slab*>(mapSlab());
+  slab->numLive = 0;
+  slab->sizeClass = uint32_t(classIdx);
+  slab->bumpOffset = uint32_t(kSlabHeaderSize);
+
+  slab->next = slabs_;
+  if (slab->next) {
+    slab->next->prevNext = &slab->next;
+  }
+  slab->prevNext = &slabs_;
+  slabs_ = slab;
+
+  ++stats_.numSlabs;
+  return slab;
+}
+
+void NodeArena::releaseSlab(Slab* slab) {
+  if (slab->next) {
+    slab->next->prevNext = slab->prevNext;
+  }
+  *slab->prevNext = slab->next;
+
+  auto& sc = classes_[slab->sizeClass];
+  if (sc.current == slab) {
+    sc.current = nullptr;
+  }
+
+  --stats_.numSlabs;
+  ++stats_.numSlabsReleased;
+  unmapSlab(slab);
+}
+
+void* NodeArena::allocate(size_t size) {
+  if (size == 0) {
+    size = 1;
+  }
+  if (size > kMaxSlotSize) {
+    auto ptr = calloc(1, size);
+    if (!ptr) {
+      throw std::bad_alloc();
+    }
+    ++stats_.numLarge;
+    return ptr;
+  }
+
+  auto classIdx = classIndex(size);
+  auto slot = slotSize(classIdx);
+  auto& sc = classes_[classIdx];
+  void* ptr;
+
+  if (sc.freeList) {
+    auto freeSlot = sc.freeList;
+    sc.freeList = freeSlot->next;
+    ptr = freeSlot;
+    memset(ptr, 0, slot);
+  } else {
+    if (!sc.current || sc.current->bumpOffset + slot > kSlabSize) {
+      sc.current = newSlab(classIdx);
+    }
+    ptr = reinterpret_cast<char*>(sc.current) + sc.current->bumpOffset;
+    sc.current->bumpOffset += uint32_t(slot);
+  }
+
+  ++slabOf(ptr)->numLive;
+  ++stats_.numLive;
+  stats_.bytesInUse += slot;
+  return ptr;
+}
+
+void NodeArena::deallocate(void* ptr, size_t size) {
+  if (!ptr) {
+    return;
+  }
+  if (size == 0) {
+    size = 1;
+  }
+  if (size > kMaxSlotSize) {
+    free(ptr);
+    --stats_.numLarge;
+    return;
+  }
+
+  auto classIdx = classIndex(size);
+  auto slab = slabOf(ptr);
+  auto freeSlot = static_cast<FreeSlot*>(ptr);
+  freeSlot->next = classes_[classIdx].freeList;
+  classes_[classIdx].freeList = freeSlot;
+
+  --slab->numLive;
+  --stats_.numLive;
+  stats_.bytesInUse -= slotSize(classIdx);
+}
+
+size_t NodeArena::compact() {
+  // Purge the free lists of any slots that belong to empty slabs,
+  // otherwise we'd hand out memory that we're about to unmap.
+  for (auto& sc : classes_) {
+    FreeSlot** link = &sc.freeList;
+    while (*link) {
+      if (slabOf(*link)->numLive == 0) {
+        *link = (*link)->next;
+      } else {
+        link = &(*link)->next;
+      }
+    }
+  }
+
+  size_t released = 0;
+  auto slab = slabs_;
+  while (slab) {
+    auto next = slab->next;
+    if (slab->numLive == 0) {
+      releaseSlab(slab);
+      ++released;
+    }
+    slab = next;
+  }
+  return released;
+}
+
+NodeArena::Stats NodeArena::stats() const {
+  return stats_;
+}
+
+size_t NodeArena::hugePageBytes() const {
+  // Pages from the hugetlbfs pool are always huge
+  size_t bytes = stats_.numHugetlbRegions * kHugePageSize;
+#ifdef __linux__
+  if (stats_.numHugeRegions == bytes / kHugePageSize) {
+    return bytes;
+  }
+  std::string smaps;
+  if (!folly::readFile("/proc/self/smaps", smaps)) {
+    return bytes;
+  }
+
+  // The kernel may merge adjacent regions into a single mapping, and
+  // reports the huge pages of each mapping as a whole, so we count those
+  // of the mappings that consist only of our regions.
+  bool ours = false;
+  folly::StringPiece rest(smaps);
+  while (!rest.empty()) {
+    auto eol = rest.find('\n');
+    auto line = rest.subpiece(0, eol);
+    rest.advance(eol == folly::StringPiece::npos ? rest.size() : eol + 1);
+
+    auto space = line.find(' ');
+    auto key = line.subpiece(0, space);
+    if (key.empty()) {
+      continue;
+    }
+    if (key.back() != ':') {
+      // The start of a mapping: "start-end perms offset ..."
+      auto dash = key.find('-');
+      if (dash == folly::StringPiece::npos) {
+        ours = false;
+        continue;
+      }
+      auto start = strtoull(key.subpiece(0, dash).str().c_str(), nullptr, 16);
+      auto end = strtoull(key.subpiece(dash + 1).str().c_str(), nullptr, 16);
+      ours = start < end && (start & (kHugePageSize - 1)) == 0;
+      for (auto base = start; ours && base < end; base += kHugePageSize) {
+        auto it = hugeRegions_.find(uintptr_t(base));
+        ours = it != hugeRegions_.end() && !it->second.hugetlb;
+      }
+    } else if (ours && key == "AnonHugePages:" && space != line.npos) {
+      // "AnonHugePages:      2048 kB"
+      auto value = line.subpiece(space).str();
+      bytes += size_t(strtoull(value.c_str(), nullptr, 10)) * 1024;
+    }
+  }
+#endif
+  return bytes;
+}
+
+} // namespace watchman
@@ -0,0 +1,202 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "FileInformation.h"
+
+namespace watchman {
+
+/** NodeArena is a slab allocator for the watchman_file and watchman_dir
+ * nodes that make up an InMemoryView.
+ *
+ * Large trees have millions of small nodes; placing each of them in its
+ * own heap allocation costs malloc bookkeeping overhead per node and
+ * spreads the tree across the heap.  The arena carves fixed size slabs
+ * into slots of a handful of size classes and keeps a free list per
+ * class so that freed slots are recycled by subsequent allocations.
+ *
+ * Slabs are aligned to their size, which allows deallocate() to find
+ * the owning slab with a simple mask and track how many slots of each
+ * slab are live.  compact() returns fully unused slabs to the operating
+ * system; it is intended to be called after an age out pass has pruned
+ * a batch of deleted nodes.
+ *
+ * Requests larger than the biggest size class fall back to the system
+ * allocator.
+ *
+ * On Linux the arena can be asked to carve its slabs from 2MiB regions
+ * that are backed by huge pages, which cuts the TLB misses incurred by
+ * walking a large tree.  A region is taken from the hugetlbfs pool if it
+ * has pages to spare, and is otherwise an anonymous mapping that we
+ * madvise() the kernel to back with transparent huge pages.  If neither
+ * is available the arena falls back to mapping each slab on its own.
+ * A region is returned to the system once all of its slabs have been
+ * released.
+ *
+ * Thread safety: the arena has no internal locking.  InMemoryView only
+ * allocates and frees nodes while holding the view write lock, and that
+ * lock serializes access to the arena.
+ */
+class NodeArena {
+ public:
+  // Size of each slab, and its alignment.  64KiB matches the allocation
+  // granularity of VirtualAlloc on Windows.
+  static constexpr size_t kSlabSize = 64 * 1024;
+  // Slot sizes are rounded up to a multiple of this value
+  static constexpr size_t kGranularity = 16;
+  // Largest allocation served from a slab
+  static constexpr size_t kMaxSlotSize = 1024;
+  static constexpr size_t kNumClasses = kMaxSlotSize / kGranularity;
+  // Size of a huge page region, and its alignment
+  static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+  static constexpr size_t kSlabsPerHugePage = kHugePageSize / kSlabSize;
+
+  struct Stats {
+    // Number of slabs currently held by the arena
+    size_t numSlabs{0};
+    // Number of live slab allocations
+    size_t numLive{0};
+    // Sum of the slot sizes of the live slab allocations
+    size_t bytesInUse{0};
+    // Number of live allocations served by the system allocator
+    size_t numLarge{0};
+    // Number of slabs released to the system by compact()
+    size_t numSlabsReleased{0};
+    // Number of huge page regions currently held by the arena, and how
+    // many of those came from the hugetlbfs pool
+    size_t numHugeRegions{0};
+    size_t numHugetlbRegions{0};
+  };
+
+  // What the nodes allocated from the arena hold, by kind.  The arena
+  // can't tell the kinds apart, so the nodes maintain these as they are
+  // created and destroyed.
+  struct Usage {
+    size_t files{0};
+    size_t dirs{0};
+    // The names of files, which are stored inline in their nodes
+    size_t fileNameBytes{0};
+    // The names of dirs, which are separate heap allocations
+    size_t dirNameBytes{0};
+    // The tables that hold the children of dirs
+    size_t childTableBytes{0};
+  };
+
+  // If hugePages is true, slabs are carved from huge page regions
+  // where the system supports it
+  explicit NodeArena(bool hugePages = false);
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+  ~NodeArena();
+
+  // Returns zero-filled storage of at least `size` bytes, suitably
+  // aligned for any node type.  Throws std::bad_alloc on failure.
+  void* allocate(size_t size);
+
+  // Releases storage obtained from allocate().  `size` must match
+  // the size that was passed to allocate().
+  void deallocate(void* ptr, size_t size);
+
+  // Returns slabs that no longer hold any live allocations to the
+  // operating system.  Returns the number of slabs that were released.
+  size_t compact();
+
+  Stats stats() const;
+
+  // Returns the number of bytes of the arena's huge page regions that
+  // the kernel has actually backed with huge pages.  This reads
+  // /proc/self/smaps, so it is intended for debugging rather than for
+  // frequent use.
+  size_t hugePageBytes() const;
+
+  Usage& usage() {
+    return usage_;
+  }
+  const Usage& usage() const {
+    return usage_;
+  }
+
+  // The devices and owners that the stat information of the files
+  // allocated from the arena refers to
+  FileOwnerTable& owners() {
+    return owners_;
+  }
+  const FileOwnerTable& owners() const {
+    return owners_;
+  }
+
+ private:
+  struct FreeSlot {
+    FreeSlot* next;
+  };
+
+  struct Slab {
+    Slab* next;
+    Slab** prevNext;
+    // Number of live allocations in this slab
+    uint32_t numLive;
+    // Size class index of this slab
+    uint32_t sizeClass;
+    // Offset of the first never-used slot; slots beyond this have
+    // not yet been handed out and are not on the free list
+    uint32_t bumpOffset;
+  };
+
+  struct SizeClass {
+    FreeSlot* freeList{nullptr};
+    // Slab that we are carving fresh slots from
+    Slab* current{nullptr};
+  };
+
+  static constexpr size_t kSlabHeaderSize =
+      (sizeof(Slab) + kGranularity - 1) & ~(kGranularity - 1);
+
+  static size_t classIndex(size_t size) {
+    return (size - 1) / kGranularity;
+  }
+  static size_t slotSize(size_t classIdx) {
+    return (classIdx + 1) * kGranularity;
+  }
+  static Slab* slabOf(void* ptr) {
+    return reinterpret_cast<Slab*>(
+        reinterpret_cast<uintptr_t>(ptr) & ~(uintptr_t(kSlabSize) - 1));
+  }
+
+  Slab* newSlab(size_t classIdx);
+  void releaseSlab(Slab* slab);
+
+  void* mapSlab();
+  void unmapSlab(void* slab);
+  void* mapHugeSlab();
+  bool unmapHugeSlab(void* slab);
+
+  static void* mapAligned(size_t size);
+
+  struct HugeRegion {
+    // Bit n is set if the nth slab of the region is in use
+    uint32_t used{0};
+    // Set if the region came from the hugetlbfs pool
+    bool hugetlb{false};
+  };
+  static_assert(kSlabsPerHugePage <= 32, "HugeRegion::used is too small");
+
+  std::array<SizeClass, kNumClasses> classes_;
+  // Cleared if we fail to obtain a huge page region
+  bool hugePages_;
+  // The huge page regions that we hold, by address
+  std::unordered_map<uintptr_t, HugeRegion> hugeRegions_;
+  // Regions that have unused slabs.  This may hold the addresses of
+  // regions that have since filled up or been unmapped.
+  std::vector<uintptr_t> partialRegions_;
+  // All of the slabs owned by the arena
+  Slab* slabs_{nullptr};
+  Stats stats_;
+  Usage usage_;
+  FileOwnerTable owners_;
+};
+
+} // namespace watchman
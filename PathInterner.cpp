@@ -0,0 +1,55 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "PathInterner.h"
+#include <algorithm>
+#include <string>
+
+namespace watchman {
+
+constexpr size_t PathInterner::kMinPruneSize;
+
+w_string PathInterner::intern(w_string_piece dir, w_string_piece name) {
+  thread_local std::string buf;
+  w_string_piece path = name;
+  if (dir.size() > 0) {
+    buf.assign(dir.data(), dir.size());
+    buf.push_back('/');
+    buf.append(name.data(), name.size());
+    path = w_string_piece(buf.data(), buf.size());
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = paths_.find(path);
+  if (it != paths_.end()) {
+    return it->second;
+  }
+
+  if (paths_.size() >= pruneAt_) {
+    pruneLocked();
+  }
+  w_string str(path.data(), path.size());
+  // Computed once here so that the cache lookups don't have to
+  w_string_hval(str);
+  paths_.emplace(w_string_piece(str), str);
+  return str;
+}
+
+void PathInterner::pruneLocked() {
+  for (auto it = paths_.begin(); it != paths_.end();) {
+    // The table holds the only reference.  A count of one can't go up
+    // again behind our back, as other references only come from intern().
+    if (static_cast<w_string_t*>(it->second)->refcnt.load() == 1) {
+      it = paths_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  pruneAt_ = std::max(kMinPruneSize, paths_.size() * 2);
+}
+
+size_t PathInterner::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return paths_.size();
+}
+
+} // namespace watchman
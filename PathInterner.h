@@ -0,0 +1,48 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <mutex>
+#include <unordered_map>
+#include "watchman_string.h"
+
+namespace watchman {
+
+// PathInterner keeps a single copy of each of the root relative paths that
+// the caches of a root are keyed by.  The same file is looked up in the
+// content hash and symlink target caches by the queries that ask for its
+// hash or target, by the cache warming and by the crawler, and each of
+// those used to build its own copy of the path.  Interned, they share one
+// string whose hash value has already been computed, so a cache lookup
+// neither allocates nor hashes the path again, and keys for the same file
+// compare equal on their pointers.
+//
+// Paths that nothing but the interner refers to any longer are dropped
+// each time that the table has doubled in size since the last time that
+// it was pruned.
+class PathInterner {
+ public:
+  // Returns the shared copy of dir joined to name with a `/`, or of just
+  // name if dir is empty.  This only allocates the first time that the
+  // path is seen.
+  w_string intern(w_string_piece dir, w_string_piece name);
+
+  w_string intern(w_string_piece path) {
+    return intern(w_string_piece(), path);
+  }
+
+  // The number of paths in the table, including those that are no longer
+  // referenced and have yet to be pruned
+  size_t size() const;
+
+ private:
+  void pruneLocked();
+
+  mutable std::mutex mutex_;
+  // The keys are pieces of the strings that they map to
+  std::unordered_map<w_string_piece, w_string> paths_;
+  size_t pruneAt_{kMinPruneSize};
+
+  static constexpr size_t kMinPruneSize = 1024;
+};
+
+} // namespace watchman
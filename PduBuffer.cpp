@@ -0,0 +1,165 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "PduBuffer.h"
+#include <folly/portability/SysUio.h>
+#include <algorithm>
+#include <cstring>
+
+namespace watchman {
+
+namespace {
+// The most chunks that each thread keeps for reuse
+constexpr size_t kMaxPooledChunks = 8;
+// The most pieces passed to a single writev call
+constexpr size_t kMaxIovecs = 64;
+
+std::vector<std::unique_ptr<char[]>>& chunkPool() {
+  static thread_local std::vector<std::unique_ptr<char[]>> pool;
+  return pool;
+}
+} // namespace
+
+PduBuffer::~PduBuffer() {
+  auto& pool = chunkPool();
+  for (auto& chunk : chunks_) {
+    if (pool.size() >= kMaxPooledChunks) {
+      break;
+    }
+    pool.emplace_back(std::move(chunk));
+  }
+}
+
+void PduBuffer::newChunk() {
+  auto& pool = chunkPool();
+  if (pool.empty()) {
+    chunks_.emplace_back(new char[kChunkSize]);
+  } else {
+    chunks_.emplace_back(std::move(pool.back()));
+    pool.pop_back();
+  }
+  tail_ = chunks_.back().get();
+  room_ = kChunkSize;
+  lastPieceAtTail_ = false;
+}
+
+void PduBuffer::append(const char* data, size_t size) {
+  size_ += size;
+  while (size > 0) {
+    if (room_ == 0) {
+      newChunk();
+    }
+    auto n = std::min(size, room_);
+    memcpy(tail_, data, n);
+    if (lastPieceAtTail_) {
+      pieces_.back().size += n;
+    } else {
+      pieces_.push_back(Piece{tail_, n});
+      lastPieceAtTail_ = true;
+    }
+    tail_ += n;
+    room_ -= n;
+    data += n;
+    size -= n;
+  }
+}
+
+void PduBuffer::appendReference(const char* data, size_t size) {
+  if (size < kReferenceThreshold) {
+    append(data, size);
+    return;
+  }
+  pieces_.push_back(Piece{data, size});
+  lastPieceAtTail_ = false;
+  size_ += size;
+}
+
+PduBuffer::Reservation PduBuffer::reserve(size_t size) {
+  if (room_ < size) {
+    newChunk();
+  }
+  pieces_.push_back(Piece{tail_, size});
+  lastPieceAtTail_ = true;
+  tail_ += size;
+  room_ -= size;
+  size_ += size;
+  return Reservation{pieces_.size() - 1, size};
+}
+
+void PduBuffer::patch(
+    const Reservation& reservation,
+    const char* data,
+    size_t size) {
+  // Right align data in the reservation, so that it runs into whatever
+  // was appended after it, and drop the space before it
+  auto& piece = pieces_[reservation.piece];
+  auto unused = reservation.size - size;
+  auto dest = const_cast<char*>(piece.data) + unused;
+  memcpy(dest, data, size);
+  piece.data = dest;
+  piece.size -= unused;
+  size_ -= unused;
+}
+
+bool PduBuffer::writeTo(w_stm_t stm) const {
+  size_t next = 0;
+  // How much of pieces_[next] has already been written
+  size_t offset = 0;
+
+  while (next < pieces_.size()) {
+    struct iovec iov[kMaxIovecs];
+    int iovcnt = 0;
+    for (auto i = next; i < pieces_.size() && iovcnt < int(kMaxIovecs); ++i) {
+      auto skip = i == next ? offset : 0;
+      iov[iovcnt].iov_base = const_cast<char*>(pieces_[i].data + skip);
+      iov[iovcnt].iov_len = pieces_[i].size - skip;
+      ++iovcnt;
+    }
+
+    auto x = stm->writev(iov, iovcnt);
+    if (x <= 0) {
+      return false;
+    }
+
+    // Advance past what was written, which may end part way into a piece
+    auto wrote = size_t(x);
+    while (next < pieces_.size() && wrote >= pieces_[next].size - offset) {
+      wrote -= pieces_[next].size - offset;
+      offset = 0;
+      ++next;
+    }
+    offset += wrote;
+  }
+  return true;
+}
+
+void PduBuffer::appendTo(std::string& out) const {
+  out.reserve(out.size() + size_);
+  for (auto& piece : pieces_) {
+    out.append(piece.data, piece.size);
+  }
+}
+
+int PduBuffer::replay(json_dump_callback_t dump, void* data) const {
+  for (auto& piece : pieces_) {
+    auto res = dump(piece.data, piece.size, data);
+    if (res) {
+      return res;
+    }
+  }
+  return 0;
+}
+
+int PduBuffer::appendCallback(const char* buf, size_t size, void* data) {
+  static_cast<PduBuffer*>(data)->append(buf, size);
+  return 0;
+}
+
+int PduBuffer::appendReferenceCallback(
+    const char* buf,
+    size_t size,
+    void* data) {
+  static_cast<PduBuffer*>(data)->appendReference(buf, size);
+  return 0;
+}
+
+} // namespace watchman
@@ -0,0 +1,87 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include "watchman_stream.h"
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// Accumulates an encoded PDU as a list of pieces, so that it can be built
+// in a single pass and then written with one gather write.  Small pieces
+// are copied into a chain of fixed size chunks, which are recycled through
+// a per-thread pool; large pieces are referenced where they are, and must
+// remain valid until the PDU has been written.
+class PduBuffer {
+ public:
+  static constexpr size_t kChunkSize = 64 * 1024;
+  // Pieces at least this large are referenced rather than copied
+  static constexpr size_t kReferenceThreshold = 1024;
+
+  // Space that was set aside by reserve, to be filled in by patch
+  struct Reservation {
+    size_t piece;
+    size_t size;
+  };
+
+  PduBuffer() = default;
+  ~PduBuffer();
+  PduBuffer(const PduBuffer&) = delete;
+  PduBuffer& operator=(const PduBuffer&) = delete;
+
+  // Copies data to the end of the buffer
+  void append(const char* data, size_t size);
+  // Adds data to the end of the buffer without copying it, if it is large
+  // enough for that to be worthwhile; data must outlive the buffer
+  void appendReference(const char* data, size_t size);
+
+  // Sets aside size bytes at the end of the buffer, for something whose
+  // value isn't known until more has been appended
+  Reservation reserve(size_t size);
+  // Fills in the space set aside by reserve with the size bytes of data,
+  // which must be no more than were reserved.  The unused part of the
+  // reservation is removed from the buffer.
+  void patch(const Reservation& reservation, const char* data, size_t size);
+
+  // The number of bytes in the buffer
+  size_t size() const {
+    return size_;
+  }
+
+  // Writes the contents of the buffer to stm, and returns false if that
+  // failed
+  bool writeTo(w_stm_t stm) const;
+  // Appends the contents of the buffer to out
+  void appendTo(std::string& out) const;
+  // Passes the pieces of the buffer to dump in order, and returns its
+  // result if that isn't 0
+  int replay(json_dump_callback_t dump, void* data) const;
+
+  // json_dump_callback_t adapters for append and appendReference, where
+  // data is the PduBuffer
+  static int appendCallback(const char* buf, size_t size, void* data);
+  static int appendReferenceCallback(const char* buf, size_t size, void* data);
+
+ private:
+  struct Piece {
+    const char* data;
+    size_t size;
+  };
+
+  // Starts a new chunk for the copies that follow
+  void newChunk();
+
+  std::vector<Piece> pieces_;
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  // The unused part of the newest chunk
+  char* tail_{nullptr};
+  size_t room_{0};
+  // Whether the last piece ends at tail_, so that a copy can extend it
+  bool lastPieceAtTail_{false};
+  size_t size_{0};
+};
+
+} // namespace watchman
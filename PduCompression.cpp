@@ -0,0 +1,126 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "PduCompression.h"
+#include <folly/Conv.h>
+#include <folly/Optional.h>
+#include <folly/compression/Compression.h>
+#include <folly/io/IOBuf.h>
+#include "watchman.h"
+
+namespace watchman {
+
+namespace {
+using folly::io::CodecType;
+
+// Below this size, compressing a PDU takes longer than sending it would
+constexpr json_int_t kDefaultMinCompressedSize = 1024 * 1024;
+
+CodecType codec_type(PduCodec codec) {
+  return codec == PduCodec::Zstd ? CodecType::ZSTD : CodecType::LZ4_FRAME;
+}
+
+folly::Optional<PduCodec> choose_codec(uint32_t capabilities) {
+  if (capabilities & BSER_CAP_SHARED_MEMORY) {
+    // Large PDUs go through shared memory instead, which is cheaper still
+    return folly::none;
+  }
+  if ((capabilities & BSER_CAP_COMPRESS_ZSTD) &&
+      folly::io::hasCodec(CodecType::ZSTD)) {
+    return PduCodec::Zstd;
+  }
+  if ((capabilities & BSER_CAP_COMPRESS_LZ4) &&
+      folly::io::hasCodec(CodecType::LZ4_FRAME)) {
+    return PduCodec::Lz4;
+  }
+  return folly::none;
+}
+
+// Chains a reference to each piece of a PduBuffer, so that it can be
+// compressed without first being copied into one buffer
+int append_piece(const char* buf, size_t size, void* data) {
+  auto& chain = *static_cast<std::unique_ptr<folly::IOBuf>*>(data);
+  auto piece = folly::IOBuf::wrapBuffer(buf, size);
+  if (chain) {
+    chain->prependChain(std::move(piece));
+  } else {
+    chain = std::move(piece);
+  }
+  return 0;
+}
+
+int append_to_string(const char* buf, size_t size, void* data) {
+  static_cast<std::string*>(data)->append(buf, size);
+  return 0;
+}
+
+bool read_int(const char*& buf, const char* end, json_int_t* val) {
+  json_int_t needed;
+  if (!bunser_int(buf, end - buf, &needed, val)) {
+    return false;
+  }
+  buf += needed;
+  return true;
+}
+} // namespace
+
+bool compressPdu(uint32_t capabilities, const PduBuffer& pdu, PduBuffer& out) {
+  auto codec = choose_codec(capabilities);
+  if (!codec ||
+      json_int_t(pdu.size()) <
+          cfg_get_int("bser_compression_min_size", kDefaultMinCompressedSize)) {
+    return false;
+  }
+
+  std::unique_ptr<folly::IOBuf> chain;
+  pdu.replay(append_piece, &chain);
+  auto compressed = folly::io::getCodec(
+                        codec_type(*codec),
+                        folly::io::COMPRESSION_LEVEL_FASTEST)
+                        ->compress(chain.get());
+
+  std::string prefix;
+  std::string size;
+  bser_ctx_t ctx{2, capabilities, append_to_string};
+  if (w_bser_dump_int(&ctx, json_int_t(*codec), &prefix) ||
+      w_bser_dump_int(&ctx, pdu.size(), &prefix)) {
+    return false;
+  }
+  auto bodySize = prefix.size() + compressed->computeChainDataLength();
+  if (bodySize >= pdu.size() || w_bser_dump_int(&ctx, bodySize, &size)) {
+    // Incompressible, so it is smaller as it is
+    return false;
+  }
+
+  out.append(BSER_COMPRESSED_MAGIC, 2);
+  out.append((const char*)&capabilities, sizeof(capabilities));
+  out.append(size.data(), size.size());
+  out.append(prefix.data(), prefix.size());
+  for (auto range : *compressed) {
+    out.append((const char*)range.data(), range.size());
+  }
+  return true;
+}
+
+std::string decompressPdu(const char* body, size_t size) {
+  auto end = body + size;
+  json_int_t codec;
+  json_int_t pduSize;
+  if (!read_int(body, end, &codec) || !read_int(body, end, &pduSize) ||
+      pduSize < 0) {
+    throw std::runtime_error("invalid compressed PDU header");
+  }
+  if (codec != json_int_t(PduCodec::Zstd) &&
+      codec != json_int_t(PduCodec::Lz4)) {
+    throw std::runtime_error(
+        folly::to<std::string>("unknown PDU compression codec ", codec));
+  }
+  auto type = codec_type(PduCodec(codec));
+  if (!folly::io::hasCodec(type)) {
+    throw std::runtime_error(folly::to<std::string>(
+        "PDU compression codec ", codec, " isn't supported by this build"));
+  }
+  return folly::io::getCodec(type)->uncompress(
+      folly::StringPiece(body, end), uint64_t(pduSize));
+}
+
+} // namespace watchman
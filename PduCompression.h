@@ -0,0 +1,30 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <string>
+#include "PduBuffer.h"
+
+namespace watchman {
+
+// A compressed PDU has the same header as a BSER v2 PDU, with its own
+// magic.  Its body is the integer code of the codec, the integer size of
+// the PDU that was compressed, and then the compressed form of that PDU.
+enum class PduCodec : json_int_t {
+  Zstd = 1,
+  Lz4 = 2,
+};
+
+// If capabilities ask for a codec that this build supports and pdu, a
+// complete BSER v2 or v3 PDU, is large enough for compression to pay off,
+// appends the compressed PDU that holds it to out and returns true.
+// Returns false if pdu should be sent as it is, which is always the case
+// for clients that can map PDUs from shared memory.
+bool compressPdu(uint32_t capabilities, const PduBuffer& pdu, PduBuffer& out);
+
+// Returns the PDU held by the size bytes of body, which is the part of a
+// compressed PDU that follows its length.  Throws std::runtime_error if
+// body isn't valid.
+std::string decompressPdu(const char* body, size_t size);
+
+} // namespace watchman
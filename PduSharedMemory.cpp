@@ -0,0 +1,186 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "PduSharedMemory.h"
+#include <folly/Conv.h>
+#include <atomic>
+#include <cstring>
+#include <string>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "FileDescriptor.h"
+#include "watchman.h"
+
+namespace watchman {
+
+namespace {
+// Below this size, the system calls that set up the file and its mapping
+// take longer than sending the PDU through the socket would
+constexpr json_int_t kDefaultMinSharedMemorySize = 1024 * 1024;
+
+#ifndef _WIN32
+int copy_piece(const char* buf, size_t size, void* data) {
+  auto& dest = *static_cast<char**>(data);
+  memcpy(dest, buf, size);
+  dest += size;
+  return 0;
+}
+
+int append_to_string(const char* buf, size_t size, void* data) {
+  static_cast<std::string*>(data)->append(buf, size);
+  return 0;
+}
+
+// Returns a new file in memory that has no name, so that it goes away once
+// both processes have closed it
+FileDescriptor make_shared_memory_file() {
+#ifdef MFD_CLOEXEC
+  return FileDescriptor(
+      memfd_create("watchman-pdu", MFD_CLOEXEC | MFD_ALLOW_SEALING),
+      FileDescriptor::FDType::Generic);
+#else
+  static std::atomic<uint32_t> counter{0};
+  auto name = folly::to<std::string>(
+      "/watchman-pdu-", getpid(), "-", counter.fetch_add(1));
+  FileDescriptor file(
+      shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600),
+      FileDescriptor::FDType::Generic);
+  if (file) {
+    shm_unlink(name.c_str());
+    file.setCloExec();
+  }
+  return file;
+#endif
+}
+
+// Writes pdu to a new file in memory, or returns an invalid descriptor
+FileDescriptor write_shared_memory_file(const PduBuffer& pdu) {
+  auto file = make_shared_memory_file();
+  if (!file) {
+    log(ERR, "failed to create a shared memory PDU: ", strerror(errno), "\n");
+    return file;
+  }
+  if (ftruncate(file.fd(), off_t(pdu.size())) != 0) {
+    log(ERR, "failed to size a shared memory PDU: ", strerror(errno), "\n");
+    return FileDescriptor();
+  }
+  auto map = mmap(
+      nullptr, pdu.size(), PROT_READ | PROT_WRITE, MAP_SHARED, file.fd(), 0);
+  if (map == MAP_FAILED) {
+    log(ERR, "failed to map a shared memory PDU: ", strerror(errno), "\n");
+    return FileDescriptor();
+  }
+  auto dest = static_cast<char*>(map);
+  pdu.replay(copy_piece, &dest);
+  munmap(map, pdu.size());
+#ifdef F_ADD_SEALS
+  // The client maps the file read only, so there is nothing to gain from
+  // letting either side change it from here on
+  fcntl(
+      file.fd(),
+      F_ADD_SEALS,
+      F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+  return file;
+}
+#endif
+} // namespace
+
+folly::Optional<SharedMemoryPdu> makeSharedMemoryPdu(
+    uint32_t capabilities,
+    const PduBuffer& pdu) {
+#ifndef _WIN32
+  if (!(capabilities & BSER_CAP_SHARED_MEMORY) ||
+      json_int_t(pdu.size()) < cfg_get_int(
+                                   "bser_shared_memory_min_size",
+                                   kDefaultMinSharedMemorySize)) {
+    return folly::none;
+  }
+
+  std::string body;
+  SharedMemoryPdu shared;
+  bser_ctx_t ctx{2, capabilities, append_to_string};
+  if (w_bser_dump_int(&ctx, pdu.size(), &body)) {
+    return folly::none;
+  }
+  shared.header.append(BSER_SHARED_MEMORY_MAGIC, 2);
+  shared.header.append((const char*)&capabilities, sizeof(capabilities));
+  if (w_bser_dump_int(&ctx, body.size(), &shared.header)) {
+    return folly::none;
+  }
+  shared.header.append(body);
+
+  shared.file = write_shared_memory_file(pdu);
+  if (!shared.file) {
+    return folly::none;
+  }
+  return shared;
+#else
+  (void)capabilities;
+  (void)pdu;
+  return folly::none;
+#endif
+}
+
+bool readSharedMemoryPdu(const SharedMemoryPdu& shared, std::string& out) {
+#ifndef _WIN32
+  struct stat st;
+  if (fstat(shared.file.fd(), &st) != 0) {
+    return false;
+  }
+  auto start = out.size();
+  out.resize(start + size_t(st.st_size));
+  size_t done = 0;
+  while (done < size_t(st.st_size)) {
+    auto x = pread(
+        shared.file.fd(),
+        &out[start + done],
+        size_t(st.st_size) - done,
+        off_t(done));
+    if (x <= 0) {
+      out.resize(start);
+      return false;
+    }
+    done += size_t(x);
+  }
+  return true;
+#else
+  (void)shared;
+  (void)out;
+  return false;
+#endif
+}
+
+folly::Optional<bool> sendSharedMemoryPdu(
+    uint32_t capabilities,
+    const PduBuffer& pdu,
+    w_stm_t stm) {
+  auto shared = makeSharedMemoryPdu(capabilities, pdu);
+  if (!shared) {
+    return folly::none;
+  }
+  const auto& header = shared->header;
+  auto x = stm->writeWithDescriptor(
+      header.data(), int(header.size()), shared->file.system_handle());
+  if (x < 0 && errno == ENOTSUP) {
+    return folly::none;
+  }
+  if (x <= 0) {
+    return false;
+  }
+  // The descriptor went with the first bytes; the rest of this small PDU
+  // follows as usual
+  size_t written = size_t(x);
+  while (written < header.size()) {
+    x = stm->write(header.data() + written, int(header.size() - written));
+    if (x <= 0) {
+      return false;
+    }
+    written += size_t(x);
+  }
+  return true;
+}
+
+} // namespace watchman
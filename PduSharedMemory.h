@@ -0,0 +1,49 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <folly/Optional.h>
+#include <string>
+#include "FileDescriptor.h"
+#include "PduBuffer.h"
+#include "watchman_stream.h"
+
+namespace watchman {
+
+// A shared memory PDU has the same header as a BSER v2 PDU, with its own
+// magic.  Its body is the integer size of a complete BSER v2 or v3 PDU
+// that was written to a file in memory, whose descriptor is passed along
+// with the first byte of the shared memory PDU.  The client maps the file
+// and decodes the PDU from it in place.
+
+// A shared memory PDU that is ready to be sent.  file has to be passed
+// along with the first byte of header.
+struct SharedMemoryPdu {
+  std::string header;
+  FileDescriptor file;
+};
+
+// If capabilities say that the client can map shared memory PDUs and pdu,
+// a complete BSER v2 or v3 PDU, is large enough for that to pay off,
+// writes it to a file in memory and returns the shared memory PDU that
+// refers to it.  Returns none if pdu should be sent as it is.
+folly::Optional<SharedMemoryPdu> makeSharedMemoryPdu(
+    uint32_t capabilities,
+    const PduBuffer& pdu);
+
+// Appends the PDU that shared refers to to out, for a stream that turned
+// out not to be able to pass descriptors.  Returns false if the file
+// couldn't be read.
+bool readSharedMemoryPdu(const SharedMemoryPdu& shared, std::string& out);
+
+// If capabilities say that the client can map shared memory PDUs and pdu,
+// a complete BSER v2 or v3 PDU, is large enough for that to pay off,
+// writes it to a file in memory and sends stm the shared memory PDU that
+// refers to it.  Returns whether that succeeded, or none if pdu should be
+// sent as it is, which includes the case where stm can't pass descriptors.
+folly::Optional<bool> sendSharedMemoryPdu(
+    uint32_t capabilities,
+    const PduBuffer& pdu,
+    w_stm_t stm);
+
+} // namespace watchman
@@ -0,0 +1,187 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "PerfAlarms.h"
+#include <folly/FileUtil.h>
+#include <algorithm>
+#include <ctime>
+#include "Logging.h"
+#include "ThreadPool.h"
+
+namespace watchman {
+
+PerfAlarms& PerfAlarms::get() {
+  // Leaked, so that samples taken during shutdown can still be recorded
+  static auto* alarms = new PerfAlarms();
+  return *alarms;
+}
+
+void PerfAlarms::configure(Options options, Capture capture) {
+  auto state = state_.lock();
+  enabled_.store(!options.budgets.empty(), std::memory_order_relaxed);
+  options.maxDumps = std::max(options.maxDumps, size_t(1));
+  state->options = std::move(options);
+  state->capture = std::move(capture);
+  state->windows.clear();
+}
+
+uint64_t PerfAlarms::percentile99(std::vector<uint64_t> samples) {
+  if (samples.empty()) {
+    return 0;
+  }
+  // The smallest sample that at least 99% of the samples are no greater
+  // than
+  auto rank = (samples.size() * 99 + 99) / 100;
+  auto nth = samples.begin() + (rank - 1);
+  std::nth_element(samples.begin(), nth, samples.end());
+  return *nth;
+}
+
+folly::Optional<PerfAlarms::Alarm> PerfAlarms::record(
+    const char* description,
+    const w_string& root,
+    uint64_t wallTimeUs) {
+  if (!enabled_.load(std::memory_order_relaxed) || !root) {
+    return folly::none;
+  }
+  auto state = state_.lock();
+  auto budget = state->options.budgets.find(description);
+  if (budget == state->options.budgets.end()) {
+    return folly::none;
+  }
+
+  auto& window = state->windows[std::make_pair(description, root)];
+  if (window.samples.size() < kWindowSamples) {
+    window.samples.push_back(wallTimeUs);
+  } else {
+    window.samples[window.next] = wallTimeUs;
+    window.next = (window.next + 1) % kWindowSamples;
+  }
+
+  // The percentile can only have gone over budget if this sample is
+  uint64_t budgetUs =
+      std::chrono::duration_cast<std::chrono::microseconds>(budget->second)
+          .count();
+  if (wallTimeUs <= budgetUs || window.samples.size() < kMinSamples) {
+    return folly::none;
+  }
+  auto p99 = percentile99(window.samples);
+  if (p99 <= budgetUs) {
+    return folly::none;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  auto& last = state->lastAlarm[root];
+  if (last != std::chrono::steady_clock::time_point() &&
+      now - last < state->options.minInterval) {
+    ++state->suppressed;
+    return folly::none;
+  }
+  last = now;
+  ++state->raised;
+  return Alarm{description, root, p99, budgetUs, window.samples.size()};
+}
+
+w_string PerfAlarms::raise(const Alarm& alarm) {
+  Capture capture;
+  w_string path;
+  {
+    auto state = state_.lock();
+    if (!state->options.dumpDir) {
+      return nullptr;
+    }
+    capture = state->capture;
+    path = w_string::build(
+        state->options.dumpDir, "/perf-alarm-", state->nextDump, ".json");
+    state->nextDump = (state->nextDump + 1) % state->options.maxDumps;
+  }
+
+  auto reason = w_string::build(
+      "the p99 of ",
+      alarm.description,
+      " for ",
+      alarm.root,
+      " was ",
+      alarm.p99Us / 1000,
+      "ms over the last ",
+      alarm.samples,
+      " samples, which exceeds its budget of ",
+      alarm.budgetUs / 1000,
+      "ms");
+  auto dump = json_object(
+      {{"reason", w_string_to_json(reason)},
+       {"root", w_string_to_json(alarm.root)},
+       {"description",
+        typed_string_to_json(alarm.description.c_str(), W_STRING_UNICODE)},
+       {"p99_us", json_integer(alarm.p99Us)},
+       {"budget_us", json_integer(alarm.budgetUs)},
+       {"samples", json_integer(alarm.samples)},
+       {"pid", json_integer(getpid())},
+       {"time", json_integer(time(nullptr))}});
+  if (capture) {
+    try {
+      dump.set("diagnostics", capture(alarm.root));
+    } catch (const std::exception& exc) {
+      dump.set(
+          "diagnostics_error",
+          typed_string_to_json(exc.what(), W_STRING_MIXED));
+    }
+  }
+
+  try {
+    folly::writeFileAtomic(
+        path.c_str(), json_dumps(dump, JSON_COMPACT), 0600);
+  } catch (const std::exception& exc) {
+    log(ERR,
+        "failed to write perf alarm diagnostics to ",
+        path,
+        ": ",
+        exc.what(),
+        "\n");
+    return nullptr;
+  }
+  log(ERR, "wrote perf alarm diagnostics to ", path, " because ", reason, "\n");
+
+  auto state = state_.lock();
+  state->dumps.push_back(path);
+  while (state->dumps.size() > state->options.maxDumps) {
+    state->dumps.pop_front();
+  }
+  return path;
+}
+
+void PerfAlarms::sample(
+    const char* description,
+    const w_string& root,
+    uint64_t wallTimeUs) {
+  auto alarm = get().record(description, root, wallTimeUs);
+  if (!alarm) {
+    return;
+  }
+  try {
+    getThreadPool().add(
+        ThreadPool::Priority::Background,
+        nullptr,
+        [alarm = std::move(*alarm)] { get().raise(alarm); });
+  } catch (const std::exception&) {
+    // The pool is stopping
+  }
+}
+
+json_ref PerfAlarms::stats() const {
+  auto state = state_.lock();
+  auto budgets = json_object();
+  for (auto& it : state->options.budgets) {
+    budgets.set(it.first.c_str(), json_integer(it.second.count()));
+  }
+  auto dumps = json_array();
+  for (auto& path : state->dumps) {
+    json_array_append_new(dumps, w_string_to_json(path));
+  }
+  return json_object(
+      {{"budgets_ms", std::move(budgets)},
+       {"raised", json_integer(state->raised)},
+       {"suppressed", json_integer(state->suppressed)},
+       {"dumps", std::move(dumps)}});
+}
+
+} // namespace watchman
@@ -0,0 +1,115 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <folly/Optional.h>
+#include <folly/Synchronized.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "watchman_string.h"
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// Watches the latency of operations on each root, such as query_execute,
+// against a budget, so that intermittent slowdowns can be examined after
+// the fact.  When the 99th percentile of the recent samples of an
+// operation on a root exceeds its budget, the diagnostics of the server
+// and of the root are captured and written to a file in a bounded ring of
+// dump files.  A root raises at most one alarm per minInterval.
+class PerfAlarms {
+ public:
+  // Returns the diagnostics of the root, such as its pending paths and
+  // the contention on the locks
+  using Capture = std::function<json_ref(const w_string& root)>;
+
+  struct Options {
+    // The budget of the 99th percentile of each operation, keyed by the
+    // description of its perf samples.  There are no alarms without any.
+    std::unordered_map<std::string, std::chrono::milliseconds> budgets;
+    std::chrono::milliseconds minInterval{std::chrono::minutes(5)};
+    // The dump files are perf-alarm-<n>.json in dumpDir, for n below
+    // maxDumps, which are overwritten in turn
+    w_string dumpDir;
+    size_t maxDumps{10};
+  };
+
+  // The operation whose budget was exceeded
+  struct Alarm {
+    std::string description;
+    w_string root;
+    uint64_t p99Us;
+    uint64_t budgetUs;
+    size_t samples;
+  };
+
+  // The 99th percentile is taken over up to this many of the most recent
+  // samples, and not until there are at least kMinSamples of them, so that
+  // a single slow operation doesn't raise an alarm by itself
+  static constexpr size_t kWindowSamples = 100;
+  static constexpr size_t kMinSamples = 10;
+
+  static PerfAlarms& get();
+
+  void configure(Options options, Capture capture);
+
+  // Records a sample of description for root, and returns the alarm that
+  // it raised, if it took the 99th percentile over budget
+  folly::Optional<Alarm> record(
+      const char* description,
+      const w_string& root,
+      uint64_t wallTimeUs);
+
+  // Captures the diagnostics of alarm and writes them to the next dump
+  // file, returning its path, or nullptr if it couldn't be written
+  w_string raise(const Alarm& alarm);
+
+  // Records the sample with the shared alarms, raising any alarm on the
+  // thread pool, since the caller may be holding locks that the capture
+  // needs
+  static void sample(
+      const char* description,
+      const w_string& root,
+      uint64_t wallTimeUs);
+
+  // Returns the alarms that were raised and the dump files that were
+  // written for debugging purposes
+  json_ref stats() const;
+
+  // The value that 99% of samples are no greater than
+  static uint64_t percentile99(std::vector<uint64_t> samples);
+
+ private:
+  struct Window {
+    std::vector<uint64_t> samples;
+    // Where the next sample goes once samples is full
+    size_t next{0};
+  };
+
+  struct State {
+    Options options;
+    Capture capture;
+    std::map<std::pair<std::string, w_string>, Window> windows;
+    std::unordered_map<w_string, std::chrono::steady_clock::time_point>
+        lastAlarm;
+    size_t nextDump{0};
+    // The most recent dumps, newest last
+    std::deque<w_string> dumps;
+    uint64_t raised{0};
+    // Alarms that weren't raised because the root had raised one recently
+    uint64_t suppressed{0};
+  };
+
+  folly::Synchronized<State, std::mutex> state_;
+  std::atomic<bool> enabled_{false};
+};
+
+} // namespace watchman
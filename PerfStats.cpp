@@ -0,0 +1,161 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "PerfStats.h"
+
+namespace watchman {
+
+namespace {
+constexpr const char* kUsageFieldNames[] = {
+    "user_time_us",
+    "system_time_us",
+    "minor_faults",
+    "major_faults",
+    "block_inputs",
+    "block_outputs",
+    "voluntary_context_switches",
+    "involuntary_context_switches",
+};
+} // namespace
+
+PerfStats::PerfStats() : lastReset_(std::chrono::system_clock::now()) {}
+
+PerfStats& PerfStats::get() {
+  // Leaked, so that threads that exit during shutdown can still fold
+  // their counters into it
+  static auto* stats = new PerfStats();
+  return *stats;
+}
+
+PerfStats::ThreadCounters::ThreadCounters() {
+  auto& stats = PerfStats::get();
+  std::lock_guard<std::mutex> lock(stats.mutex_);
+  stats.threads_.insert(this);
+}
+
+PerfStats::ThreadCounters::~ThreadCounters() {
+  auto& stats = PerfStats::get();
+  std::lock_guard<std::mutex> lock(stats.mutex_);
+  stats.threads_.erase(this);
+  for (auto& it : counters) {
+    auto& exited = stats.exited_[it.first];
+    if (!exited) {
+      exited = std::make_unique<Counters>();
+    }
+    exited->merge(*it.second);
+  }
+}
+
+PerfStats::Counters& PerfStats::countersFor(
+    ThreadCounters& thread,
+    Key&& key) {
+  auto it = thread.counters.find(key);
+  if (it != thread.counters.end()) {
+    return *it->second;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return *thread.counters.emplace(std::move(key), std::make_unique<Counters>())
+              .first->second;
+}
+
+void PerfStats::record(
+    const char* description,
+    const w_string& root,
+    uint64_t wallTimeUs,
+    const Usage& usage) {
+  static thread_local ThreadCounters thread;
+  auto& counters = countersFor(thread, Key(description, root));
+
+  counters.wallTimeUs.record(wallTimeUs);
+  const uint64_t fields[kNumUsageFields] = {
+      usage.userTimeUs,
+      usage.systemTimeUs,
+      usage.minorFaults,
+      usage.majorFaults,
+      usage.blockInputs,
+      usage.blockOutputs,
+      usage.voluntarySwitches,
+      usage.involuntarySwitches,
+  };
+  for (size_t i = 0; i < kNumUsageFields; ++i) {
+    counters.usage[i].fetch_add(fields[i], std::memory_order_relaxed);
+  }
+}
+
+void PerfStats::Counters::merge(const Counters& other) {
+  wallTimeUs.merge(other.wallTimeUs);
+  for (size_t i = 0; i < kNumUsageFields; ++i) {
+    usage[i].fetch_add(
+        other.usage[i].load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+  }
+}
+
+void PerfStats::Counters::reset() {
+  wallTimeUs.reset();
+  for (auto& field : usage) {
+    field.store(0, std::memory_order_relaxed);
+  }
+}
+
+json_ref PerfStats::Counters::toJson() const {
+  auto result = json_object({{"wall_time_us", wallTimeUs.toJson()}});
+  for (size_t i = 0; i < kNumUsageFields; ++i) {
+    result.set(
+        kUsageFieldNames[i],
+        json_integer(usage[i].load(std::memory_order_relaxed)));
+  }
+  return result;
+}
+
+json_ref PerfStats::toJson(bool reset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  CounterMap merged;
+  auto add = [&](const CounterMap& counters) {
+    for (auto& it : counters) {
+      auto& total = merged[it.first];
+      if (!total) {
+        total = std::make_unique<Counters>();
+      }
+      total->merge(*it.second);
+    }
+  };
+  add(exited_);
+  for (auto thread : threads_) {
+    add(thread->counters);
+  }
+
+  auto samples = json_array();
+  for (auto& it : merged) {
+    if (it.second->wallTimeUs.count() == 0) {
+      continue;
+    }
+    auto sample = it.second->toJson();
+    sample.set(
+        {{"description",
+          typed_string_to_json(it.first.first.c_str(), W_STRING_UNICODE)},
+         {"root",
+          it.first.second ? w_string_to_json(it.first.second) : json_null()}});
+    json_array_append_new(samples, std::move(sample));
+  }
+
+  auto result = json_object(
+      {{"since",
+        json_integer(std::chrono::duration_cast<std::chrono::seconds>(
+                         lastReset_.time_since_epoch())
+                         .count())},
+       {"samples", samples}});
+
+  if (reset) {
+    exited_.clear();
+    for (auto thread : threads_) {
+      for (auto& it : thread->counters) {
+        it.second->reset();
+      }
+    }
+    lastReset_ = std::chrono::system_clock::now();
+  }
+  return result;
+}
+
+} // namespace watchman
@@ -0,0 +1,91 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include "Histogram.h"
+#include "watchman_string.h"
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// Aggregates the perf samples that the server takes, such as those of
+// query_execute, full-crawl and sync_to_now, by their description and the
+// root that they were taken for, so that their costs can be examined
+// without logging every sample.  Each thread records into counters of its
+// own without taking a lock; the counters of all of the threads are
+// merged when they are reported.
+class PerfStats {
+ public:
+  // The resources that the process used while a sample was taken.  These
+  // cover every thread of the process, so they include work that was done
+  // concurrently for other samples and roots.
+  struct Usage {
+    uint64_t userTimeUs{0};
+    uint64_t systemTimeUs{0};
+    uint64_t minorFaults{0};
+    uint64_t majorFaults{0};
+    uint64_t blockInputs{0};
+    uint64_t blockOutputs{0};
+    uint64_t voluntarySwitches{0};
+    uint64_t involuntarySwitches{0};
+  };
+
+  static PerfStats& get();
+
+  // root is null for samples that aren't associated with a root
+  void record(
+      const char* description,
+      const w_string& root,
+      uint64_t wallTimeUs,
+      const Usage& usage);
+
+  // Returns the merged counters for each description and root, and when
+  // they were last reset.  If reset is true, the counters are then
+  // cleared.
+  json_ref toJson(bool reset);
+
+ private:
+  static constexpr size_t kNumUsageFields = 8;
+
+  struct Counters {
+    Histogram wallTimeUs;
+    // The sums of the fields of Usage, in order
+    std::array<std::atomic<uint64_t>, kNumUsageFields> usage{};
+
+    void merge(const Counters& other);
+    void reset();
+    json_ref toJson() const;
+  };
+  using Key = std::pair<std::string, w_string>;
+  using CounterMap = std::map<Key, std::unique_ptr<Counters>>;
+
+  // The counters that a thread records into.  Only that thread adds to
+  // the map, and it does so while holding mutex_, so that it can look
+  // up its counters without the lock.
+  struct ThreadCounters {
+    CounterMap counters;
+
+    ThreadCounters();
+    ~ThreadCounters();
+  };
+
+  PerfStats();
+  Counters& countersFor(ThreadCounters& thread, Key&& key);
+
+  std::mutex mutex_;
+  std::unordered_set<ThreadCounters*> threads_;
+  // The counters of the threads that have exited
+  CounterMap exited_;
+  std::chrono::system_clock::time_point lastReset_;
+};
+
+} // namespace watchman
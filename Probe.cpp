@@ -0,0 +1,58 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "Probe.h"
+#include <cstring>
+
+namespace watchman {
+
+namespace {
+template <typename T>
+char* put(char* out, T value) {
+  memcpy(out, &value, sizeof(value));
+  return out + sizeof(value);
+}
+
+template <typename T>
+const char* get(const char* buf, T& value) {
+  memcpy(&value, buf, sizeof(value));
+  return buf + sizeof(value);
+}
+} // namespace
+
+void encodeProbeRequest(const ProbeRequest& request, char* out) {
+  memcpy(out, PROBE_MAGIC, 2);
+  out = put(out + 2, uint8_t(request.op));
+  put(out, request.rootNumber);
+}
+
+ProbeRequest decodeProbeRequest(const char* buf) {
+  ProbeRequest request;
+  uint8_t op;
+  buf = get(buf + 2, op);
+  request.op = ProbeOp(op);
+  get(buf, request.rootNumber);
+  return request;
+}
+
+void encodeProbeResponse(const ProbeResponse& response, char* out) {
+  memcpy(out, PROBE_MAGIC, 2);
+  out = put(out + 2, uint8_t(response.status));
+  out = put(out, response.startTime);
+  out = put(out, response.pid);
+  out = put(out, response.position.rootNumber);
+  put(out, response.position.ticks);
+}
+
+ProbeResponse decodeProbeResponse(const char* buf) {
+  ProbeResponse response;
+  uint8_t status;
+  buf = get(buf + 2, status);
+  response.status = ProbeStatus(status);
+  buf = get(buf, response.startTime);
+  buf = get(buf, response.pid);
+  buf = get(buf, response.position.rootNumber);
+  get(buf, response.position.ticks);
+  return response;
+}
+
+} // namespace watchman
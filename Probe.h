@@ -0,0 +1,63 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "Clock.h"
+
+// A probe is a fixed size binary request for the things that health checks
+// and build wrappers ask for over and over: whether the server is alive,
+// and the current clock of a root.  The server answers it as it reads it
+// from the connection, with a fixed size binary response, rather than
+// decoding a PDU, dispatching a command and encoding a json response.
+//
+// A root is named by its number, which is the third field of the clocks
+// that the clock command returns for it, so that no path has to be
+// resolved.  The numbers are in host byte order, as they are in BSER.
+#define PROBE_MAGIC "\x00\x06"
+
+namespace watchman {
+
+enum class ProbeOp : uint8_t {
+  // Answers with the start time and pid of the server
+  Liveness = 1,
+  // Also answers with the current clock of the root
+  Clock = 2,
+};
+
+enum class ProbeStatus : uint8_t {
+  Ok = 0,
+  // No watched root has the number
+  UnknownRoot = 1,
+  // The op isn't one that we know
+  BadRequest = 2,
+};
+
+struct ProbeRequest {
+  ProbeOp op{ProbeOp::Liveness};
+  uint32_t rootNumber{0};
+};
+
+struct ProbeResponse {
+  ProbeStatus status{ProbeStatus::Ok};
+  uint64_t startTime{0};
+  uint32_t pid{0};
+  // The clock is "c:<startTime>:<pid>:<rootNumber>:<ticks>"
+  ClockPosition position;
+};
+
+// PROBE_MAGIC, the op and the root number
+constexpr size_t kProbeRequestSize = 2 + 1 + 4;
+// PROBE_MAGIC, the status, the start time, the pid, the root number and
+// the ticks
+constexpr size_t kProbeResponseSize = 2 + 1 + 8 + 4 + 4 + 4;
+
+// Encode to, and decode from, buffers of exactly the size above.  Decoding
+// a request doesn't check its op; a response to one that is unknown has
+// the BadRequest status.
+void encodeProbeRequest(const ProbeRequest& request, char* out);
+ProbeRequest decodeProbeRequest(const char* buf);
+void encodeProbeResponse(const ProbeResponse& response, char* out);
+ProbeResponse decodeProbeResponse(const char* buf);
+
+} // namespace watchman
@@ -2,89 +2,112 @@
  * Licensed under the Apache License, Version 2.0 */
 #include "PubSub.h"
 #include <algorithm>
-#include <iterator>
+#include <array>
+#include <limits>
 
 namespace watchman {
 
+namespace {
+// The number of Items in each Block.  Consumed items are only released
+// along with their block, so this is kept small.
+constexpr size_t kItemsPerBlock = 32;
+} // namespace
+
+struct Publisher::Block {
+  // The serial of items[0]
+  const uint64_t firstSerial;
+  std::array<Item, kItemsPerBlock> items;
+  // Set before the first item of the next block is published, and never
+  // changed after that
+  std::shared_ptr<Block> next;
+
+  explicit Block(uint64_t firstSerial) : firstSerial(firstSerial) {}
+
+  ~Block() {
+    // Unlink the blocks that only we reference one at a time, rather than
+    // recursing through the destructors of a long chain of them
+    auto block = std::move(next);
+    while (block && block.use_count() == 1) {
+      block = std::move(block->next);
+    }
+  }
+};
+
+Publisher::state::state()
+    : tail(std::make_shared<Block>(1)),
+      subscribers(std::make_shared<SubscriberList>()) {
+  blocks.emplace_back(tail);
+}
+
+void Publisher::state::append(
+    json_ref&& payload,
+    std::atomic<uint64_t>& published) {
+  if (tailIndex == kItemsPerBlock) {
+    auto block = std::make_shared<Block>(nextSerial);
+    tail->next = block;
+    tail = std::move(block);
+    tailIndex = 0;
+
+    while (!blocks.empty() && blocks.front().expired()) {
+      blocks.pop_front();
+    }
+    blocks.emplace_back(tail);
+  }
+
+  auto& item = tail->items[tailIndex++];
+  item.serial = nextSerial++;
+  item.payload = std::move(payload);
+  // Subscribers may read the item from here on
+  published.store(item.serial, std::memory_order_release);
+}
+
 Publisher::Subscriber::Subscriber(
     std::shared_ptr<Publisher> pub,
     Notifier notify,
     const json_ref& info)
     : serial_(0),
+      index_(0),
       publisher_(std::move(pub)),
       notify_(notify),
       info_(std::move(info)) {}
 
 Publisher::Subscriber::~Subscriber() {
-  // In the loop below we may own a reference to some other
-  // Subscriber instance.  That is fine, but we need to take
-  // care: if we end up with the last reference to that subscriber
-  // we will end up calling its destructor and effective recurse
-  // and attempt to acquire the wlock.   We therefore need to
-  // defer releasing any of the shared_ptr's that we lock in
-  // the loop below until after we have released the wlock.
-  std::vector<std::shared_ptr<Subscriber>> subscribers;
-
   {
-    auto wlock = publisher_->state_.wlock();
-    auto it = wlock->subscribers.begin();
-    while (it != wlock->subscribers.end()) {
-      auto sub = it->lock();
-      // Prune vacated weak_ptr's or those that point to us
-      if (!sub || sub.get() == this) {
-        it = wlock->subscribers.erase(it);
-      } else {
-        ++it;
-        // Defer releasing the sub reference until after we've
-        // release the wlock!
-        subscribers.emplace_back(std::move(sub));
+    auto lock = publisher_->state_.lock();
+    // We are already expired at this point, so pruning the expired
+    // entries takes us out of the list
+    auto subscribers = std::make_shared<SubscriberList>();
+    for (auto& sub : *lock->subscribers) {
+      if (!sub.expired()) {
+        subscribers->emplace_back(sub);
       }
     }
-    // Take this opportunity to reap anything that is no longer
-    // referenced now that we've removed some subscriber(s)
-    wlock->collectGarbage();
+    lock->subscribers = std::move(subscribers);
   }
+  publisher_->numSubscribers_.fetch_sub(1, std::memory_order_relaxed);
 
-  // It is now safe for subscribers to be torn down and release
-  // any references we took ownership of in the loop above.
+  // Our reference to block_ is released after this, which releases
+  // whichever blocks nobody else has yet to read
 }
 
 void Publisher::Subscriber::getPending(
     std::vector<std::shared_ptr<const Item>>& pending) {
-  {
-    auto rlock = publisher_->state_.rlock();
-    auto& items = rlock->items;
-
-    if (items.empty()) {
-      return;
-    }
-
-    // First we walk back to find the end of the range that
-    // we have seen previously.
-    int firstIndex;
-    for (firstIndex = int(items.size()) - 1; firstIndex >= 0; --firstIndex) {
-      if (items[firstIndex]->serial <= serial_) {
-        break;
-      }
-    }
-
-    // We found the item before the one we really want, so
-    // increment the index; we'll copy the remaining items.
-    ++firstIndex;
-    bool updated = false;
-
-    while (firstIndex < int(items.size())) {
-      pending.push_back(items[firstIndex]);
-      ++firstIndex;
-      updated = true;
-    }
-
-    if (updated) {
-      serial_ = pending.back()->serial;
+  auto published = publisher_->published_.load(std::memory_order_acquire);
+  auto serial = serial_.load(std::memory_order_relaxed);
+
+  while (serial < published) {
+    if (index_ == kItemsPerBlock) {
+      // The next item has been published, so the next block is set
+      block_ = block_->next;
+      index_ = 0;
     }
-
-    return;
+    auto& item = block_->items[index_++];
+    // The item shares ownership of its block
+    pending.emplace_back(block_, &item);
+    serial = item.serial;
   }
+
+  serial_.store(serial, std::memory_order_relaxed);
 }
 
 void getPending(
@@ -104,72 +127,55 @@ std::shared_ptr<Publisher::Subscriber> Publisher::subscribe(
     const json_ref& info) {
   auto sub =
       std::make_shared<Publisher::Subscriber>(shared_from_this(), notify, info);
-  state_.wlock()->subscribers.emplace_back(sub);
+
+  {
+    auto lock = state_.lock();
+    // Start reading from the next item to be published.  This is done
+    // along with registering for notifications, so that the subscriber
+    // is notified about every item that it sees.
+    sub->block_ = lock->tail;
+    sub->index_ = lock->tailIndex;
+    sub->serial_.store(lock->nextSerial - 1, std::memory_order_relaxed);
+
+    auto subscribers = std::make_shared<SubscriberList>(*lock->subscribers);
+    subscribers->emplace_back(sub);
+    lock->subscribers = std::move(subscribers);
+  }
+  numSubscribers_.fetch_add(1, std::memory_order_relaxed);
+
   return sub;
 }
 
 bool Publisher::hasSubscribers() const {
-  return !state_.rlock()->subscribers.empty();
+  return numSubscribers_.load(std::memory_order_relaxed) != 0;
 }
 
-void Publisher::state::collectGarbage() {
-  if (items.empty()) {
-    return;
-  }
-
-  uint64_t minSerial = std::numeric_limits<uint64_t>::max();
-  for (auto& it : subscribers) {
-    auto sub = it.lock();
-    if (sub) {
-      minSerial = std::min(minSerial, sub->getSerial());
-    }
-  }
-
-  while (!items.empty() && items.front()->serial < minSerial) {
-    items.pop_front();
+bool Publisher::enqueue(json_ref&& payload) {
+  if (!hasSubscribers()) {
+    return false;
   }
-}
 
-bool Publisher::enqueue(json_ref&& payload) {
-  std::vector<std::shared_ptr<Subscriber>> subscribers;
+  // Subscribers read the payload from their own threads
+  auto promoted = json_promote(payload);
+  std::shared_ptr<const SubscriberList> subscribers;
 
   {
-    auto wlock = state_.wlock();
-
-    // We need to collect live references for the notify portion,
-    // but since we're holding the wlock, take this opportunity to
-    // detect and prune dead subscribers and clean up some garbage.
-    auto it = wlock->subscribers.begin();
-    while (it != wlock->subscribers.end()) {
-      auto sub = it->lock();
-      // Prune vacated weak_ptr's
-      if (!sub) {
-        it = wlock->subscribers.erase(it);
-      } else {
-        ++it;
-        // Remember that live reference so that we can notify
-        // outside of the lock below.
-        subscribers.emplace_back(std::move(sub));
-      }
-    }
-
-    wlock->collectGarbage();
-
-    if (subscribers.empty()) {
+    auto lock = state_.lock();
+    if (lock->subscribers->empty()) {
       return false;
     }
-
-    auto item = std::make_shared<Item>();
-    item->payload = std::move(payload);
-    item->serial = wlock->nextSerial++;
-    wlock->items.emplace_back(std::move(item));
+    subscribers = lock->subscribers;
+    lock->append(std::move(promoted), published_);
   }
 
   // and notify them outside of the lock
-  for (auto& sub : subscribers) {
-    auto& n = sub->getNotify();
-    if (n) {
-      n();
+  for (auto& sub_ref : *subscribers) {
+    auto sub = sub_ref.lock();
+    if (sub) {
+      auto& n = sub->getNotify();
+      if (n) {
+        n();
+      }
     }
   }
   return true;
@@ -178,33 +184,62 @@ bool Publisher::enqueue(json_ref&& payload) {
 json_ref Publisher::getDebugInfo() const {
   auto ret = json_object();
 
-  auto rlock = state_.rlock();
-  ret.set("next_serial", json_integer(rlock->nextSerial));
+  std::shared_ptr<const SubscriberList> subscriber_refs;
+  std::vector<std::weak_ptr<Block>> block_refs;
+  uint64_t nextSerial;
+  {
+    // Take copies so that the subscribers and blocks can be examined
+    // (and possibly released) outside of the lock
+    auto lock = state_.lock();
+    nextSerial = lock->nextSerial;
+    subscriber_refs = lock->subscribers;
+    block_refs.assign(lock->blocks.begin(), lock->blocks.end());
+  }
+  ret.set("next_serial", json_integer(nextSerial));
 
   auto subscribers = json_array();
   auto& subscribers_arr = subscribers.array();
+  uint64_t minSerial = std::numeric_limits<uint64_t>::max();
 
-  for (auto& sub_ref : rlock->subscribers) {
+  for (auto& sub_ref : *subscriber_refs) {
     auto sub = sub_ref.lock();
     if (sub) {
+      minSerial = std::min(minSerial, sub->getSerial());
       auto sub_json = json_object({{"serial", json_integer(sub->getSerial())},
                                    {"info", sub->getInfo()}});
       subscribers_arr.emplace_back(sub_json);
     } else {
-      // This is a subscriber that is now dead. It will be cleaned up the next
-      // time enqueue is called.
+      // This is a subscriber that is being torn down and will remove
+      // itself from the list.
     }
   }
 
   ret.set("subscribers", std::move(subscribers));
 
+  // The items that some subscriber has yet to consume.  Only the
+  // published items of a block are complete.
   auto items = json_array();
   auto& items_arr = items.array();
+  auto published = published_.load(std::memory_order_acquire);
 
-  for (auto& item : rlock->items) {
-    auto item_json = json_object(
-        {{"serial", json_integer(item->serial)}, {"payload", item->payload}});
-    items_arr.emplace_back(item_json);
+  for (auto& block_ref : block_refs) {
+    auto block = block_ref.lock();
+    if (!block) {
+      continue;
+    }
+    for (size_t i = 0; i < kItemsPerBlock; ++i) {
+      auto serial = block->firstSerial + i;
+      if (serial > published) {
+        break;
+      }
+      if (serial <= minSerial) {
+        continue;
+      }
+      auto& item = block->items[i];
+      auto item_json = json_object(
+          {{"serial", json_integer(item.serial)}, {"payload", item.payload}});
+      items_arr.emplace_back(item_json);
+    }
   }
 
   ret.set("items", std::move(items));
@@ -6,8 +6,11 @@
 #include <folly/Synchronized.h>
 #include "thirdparty/jansson/jansson.h"
 
+#include <atomic>
 #include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 namespace watchman {
@@ -15,9 +18,8 @@ namespace watchman {
 class Publisher : public std::enable_shared_from_this<Publisher> {
  public:
   struct Item {
-    // copy of nextSerial_ at the time this was created.
-    // The item can be released when all subscribers have
-    // observed this serial number.
+    // The position of this item in the stream; serials are consecutive.
+    // The item is released once every subscriber has moved past it.
     uint64_t serial;
     json_ref payload;
   };
@@ -26,11 +28,23 @@ class Publisher : public std::enable_shared_from_this<Publisher> {
   // to be woken up when something is published
   using Notifier = std::function<void()>;
 
+ private:
+  // Items are stored in fixed size blocks that are chained together in
+  // the order of their serials, each block holding a reference to the next.
+  // Subscribers hold a reference to the block that they are reading, so a
+  // block is released once every subscriber has read past it.
+  struct Block;
+
+ public:
   // Each subscriber is represented by one of these
   class Subscriber : public std::enable_shared_from_this<Subscriber> {
     // The serial of the last Item to be consumed by
     // this subscriber.
-    uint64_t serial_;
+    std::atomic<uint64_t> serial_;
+    // The block holding the next Item to be consumed, and the index of
+    // the Item within it.  These are only touched by getPending.
+    std::shared_ptr<Block> block_;
+    size_t index_;
     // Subscriber keeps the publisher alive so that no Items are lost
     // if the Publisher is released before all of the subscribers.
     std::shared_ptr<Publisher> publisher_;
@@ -39,6 +53,8 @@ class Publisher : public std::enable_shared_from_this<Publisher> {
     // Information for debugging purposes
     const json_ref info_;
 
+    friend class Publisher;
+
    public:
     ~Subscriber();
     Subscriber(
@@ -48,10 +64,12 @@ class Publisher : public std::enable_shared_from_this<Publisher> {
     Subscriber(const Subscriber&) = delete;
 
     // Returns all as yet unseen published items for this subscriber.
+    // This doesn't take any locks, but must only be called by one
+    // thread at a time for a given subscriber.
     void getPending(std::vector<std::shared_ptr<const Item>>& pending);
 
     inline uint64_t getSerial() const {
-      return serial_;
+      return serial_.load(std::memory_order_relaxed);
     }
 
     inline Notifier& getNotify() {
@@ -63,7 +81,8 @@ class Publisher : public std::enable_shared_from_this<Publisher> {
     }
   };
 
-  // Register a new subscriber.
+  // Register a new subscriber.  It sees the items that are published
+  // from this point on.
   // When the Subscriber object is released, the registration is
   // automatically removed.
   std::shared_ptr<Subscriber> subscribe(
@@ -83,20 +102,31 @@ class Publisher : public std::enable_shared_from_this<Publisher> {
   json_ref getDebugInfo() const;
 
  private:
+  using SubscriberList = std::vector<std::weak_ptr<Subscriber>>;
+
+  // The producer side of the stream; enqueue may be called from any
+  // thread, so this is serialized.  Subscribers never take this lock
+  // to read the stream.
   struct state {
-    state() = default;
+    state();
     state(const state&) = delete;
     // Serial number to use for the next Item
     uint64_t nextSerial{1};
-    // The stream of Items
-    std::deque<std::shared_ptr<const Item>> items;
-    // The subscribers
-    std::vector<std::weak_ptr<Subscriber>> subscribers;
-
-    void collectGarbage();
-    void enqueue(json_ref&& payload);
+    // The block that the next Item is stored in, and its index there
+    std::shared_ptr<Block> tail;
+    size_t tailIndex{0};
+    // The blocks that may still be alive, for getDebugInfo
+    std::deque<std::weak_ptr<Block>> blocks;
+    // The subscribers.  The list is replaced rather than modified, so
+    // that enqueue can notify them outside of the lock.
+    std::shared_ptr<const SubscriberList> subscribers;
+
+    void append(json_ref&& payload, std::atomic<uint64_t>& published);
   };
-  folly::Synchronized<state> state_;
+  folly::Synchronized<state, std::mutex> state_;
+  // The serial of the last Item that subscribers may read
+  std::atomic<uint64_t> published_{0};
+  std::atomic<size_t> numSubscribers_{0};
 
   friend class Subscriber;
 };
@@ -0,0 +1,45 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "QueryCancellation.h"
+
+namespace watchman {
+
+QueryCancellation::QueryCancellation(
+    folly::Optional<std::chrono::steady_clock::time_point> deadline,
+    std::function<bool()> clientGone)
+    : deadline_(deadline), clientGone_(std::move(clientGone)) {}
+
+QueryCancellation::Reason QueryCancellation::poll() {
+  auto current = reason();
+  if (current != Reason::None) {
+    return current;
+  }
+  if (deadline_ && std::chrono::steady_clock::now() >= *deadline_) {
+    reason_.store(Reason::Deadline, std::memory_order_relaxed);
+    return Reason::Deadline;
+  }
+  if (clientGone_) {
+    // Another thread asking at the same moment will have the answer soon
+    // enough
+    std::unique_lock<std::mutex> lock(probeMutex_, std::try_to_lock);
+    if (lock.owns_lock() && clientGone_()) {
+      reason_.store(Reason::Disconnected, std::memory_order_relaxed);
+      return Reason::Disconnected;
+    }
+  }
+  return reason();
+}
+
+const char* QueryCancellation::describe(Reason reason) {
+  switch (reason) {
+    case Reason::None:
+      return "not cancelled";
+    case Reason::Deadline:
+      return "it ran past its timeout";
+    case Reason::Disconnected:
+      return "the client disconnected";
+  }
+  return "unknown";
+}
+
+} // namespace watchman
@@ -0,0 +1,45 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <folly/Optional.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+namespace watchman {
+
+// Tells a query that is executing that it should stop, because it ran past
+// its deadline or because the client that is waiting for it went away.
+// The query checks it now and then as it generates and evaluates files,
+// and the worker threads of a parallel query share it.
+class QueryCancellation {
+ public:
+  enum class Reason : uint8_t { None, Deadline, Disconnected };
+
+  // clientGone, if set, returns true once the client has hung up.  It may
+  // be called from any of the threads that execute the query, but never
+  // from two at once.
+  QueryCancellation(
+      folly::Optional<std::chrono::steady_clock::time_point> deadline,
+      std::function<bool()> clientGone);
+
+  // The reason that the query was cancelled, without checking again
+  Reason reason() const {
+    return reason_.load(std::memory_order_relaxed);
+  }
+
+  // Checks the deadline and asks whether the client has gone, and returns
+  // the reason that the query was cancelled, if it was
+  Reason poll();
+
+  static const char* describe(Reason reason);
+
+ private:
+  const folly::Optional<std::chrono::steady_clock::time_point> deadline_;
+  const std::function<bool()> clientGone_;
+  std::mutex probeMutex_;
+  std::atomic<Reason> reason_{Reason::None};
+};
+
+} // namespace watchman
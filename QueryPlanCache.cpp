@@ -0,0 +1,53 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "QueryPlanCache.h"
+
+namespace watchman {
+
+QueryPlanCache::QueryPlanCache(size_t maxEntries) : maxEntries_(maxEntries) {}
+
+std::shared_ptr<w_query> QueryPlanCache::take(const w_string& key) {
+  auto state = state_.wlock();
+  auto it = state->entries.find(key);
+  if (it == state->entries.end()) {
+    state->misses++;
+    return nullptr;
+  }
+  state->hits++;
+  auto query = std::move(it->second);
+  state->entries.erase(it);
+  return query;
+}
+
+void QueryPlanCache::put(const w_string& key, std::shared_ptr<w_query> query) {
+  if (!enabled() || !query) {
+    return;
+  }
+  auto state = state_.wlock();
+  auto it = state->entries.find(key);
+  if (it != state->entries.end()) {
+    // Another command parsed the same arguments while this one ran
+    it->second = std::move(query);
+    return;
+  }
+  if (state->entries.size() >= maxEntries_) {
+    // Scripts tend to repeat a handful of commands, so which one makes
+    // room hardly matters
+    state->entries.erase(state->entries.begin());
+    state->evictions++;
+  }
+  state->entries.emplace(key, std::move(query));
+}
+
+json_ref QueryPlanCache::stats() const {
+  auto state = state_.rlock();
+  return json_object(
+      {{"enabled", json_boolean(enabled())},
+       {"max_entries", json_integer(maxEntries_)},
+       {"entries", json_integer(state->entries.size())},
+       {"hits", json_integer(state->hits)},
+       {"misses", json_integer(state->misses)},
+       {"evictions", json_integer(state->evictions)}});
+}
+
+} // namespace watchman
@@ -0,0 +1,57 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Synchronized.h>
+#include <memory>
+#include <unordered_map>
+#include "thirdparty/jansson/jansson.h"
+
+struct w_query;
+
+namespace watchman {
+
+// Keeps the queries that the legacy find and since commands of a root
+// have parsed, keyed by their arguments, so that a script that runs the
+// same find over and over doesn't have its patterns translated, parsed and
+// planned each time.
+//
+// A query is taken out of the cache while it is executed and put back
+// afterwards, so that no two threads evaluate the same query at once; a
+// command that runs while another is using the query for the same
+// arguments parses one of its own.
+class QueryPlanCache {
+ public:
+  // Construct a cache that holds up to maxEntries queries.  A cache with a
+  // maxEntries of 0 is disabled.
+  explicit QueryPlanCache(size_t maxEntries);
+
+  bool enabled() const {
+    return maxEntries_ > 0;
+  }
+
+  // Removes the query that was parsed from key and returns it, or returns
+  // nullptr if there is none
+  std::shared_ptr<w_query> take(const w_string& key);
+
+  // Keeps query, which was parsed from key, for the next take() of key
+  void put(const w_string& key, std::shared_ptr<w_query> query);
+
+  // Returns the counters of the cache for debugging purposes
+  json_ref stats() const;
+
+ private:
+  struct State {
+    std::unordered_map<w_string, std::shared_ptr<w_query>> entries;
+
+    size_t hits{0};
+    size_t misses{0};
+    size_t evictions{0};
+  };
+
+  const size_t maxEntries_;
+  folly::Synchronized<State> state_;
+};
+
+} // namespace watchman
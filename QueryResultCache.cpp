@@ -0,0 +1,104 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "QueryResultCache.h"
+
+namespace watchman {
+
+namespace {
+// The encoding of a response depends on what the client asked for, so
+// that is part of the key
+w_string makeKey(
+    const w_string& spec,
+    w_pdu_type pduType,
+    uint32_t capabilities) {
+  return w_string::build(int(pduType), ":", capabilities, ":", spec);
+}
+} // namespace
+
+QueryResultCache::QueryResultCache(size_t maxBytes) : maxBytes_(maxBytes) {}
+
+void QueryResultCache::advanceTo(State& state, const ClockPosition& position) {
+  if (state.position.rootNumber == position.rootNumber &&
+      state.position.ticks == position.ticks) {
+    return;
+  }
+  state.evictions += state.entries.size();
+  state.entries.clear();
+  state.bytes = 0;
+  state.position = position;
+  state.sealed = false;
+}
+
+void QueryResultCache::clear(const ClockPosition& position) {
+  auto state = state_.wlock();
+  advanceTo(*state, position);
+  state->evictions += state->entries.size();
+  state->entries.clear();
+  state->bytes = 0;
+  state->sealed = true;
+}
+
+QueryResultCache::Encoded QueryResultCache::get(
+    const w_string& spec,
+    w_pdu_type pduType,
+    uint32_t capabilities,
+    const ClockPosition& position) {
+  auto state = state_.wlock();
+  advanceTo(*state, position);
+
+  auto it = state->entries.find(makeKey(spec, pduType, capabilities));
+  if (it == state->entries.end()) {
+    state->misses++;
+    return nullptr;
+  }
+  state->hits++;
+  return it->second;
+}
+
+void QueryResultCache::set(
+    const w_string& spec,
+    w_pdu_type pduType,
+    uint32_t capabilities,
+    const ClockPosition& position,
+    Encoded encoded) {
+  auto state = state_.wlock();
+  if (position.rootNumber < state->position.rootNumber ||
+      (position.rootNumber == state->position.rootNumber &&
+       position.ticks < state->position.ticks)) {
+    // Computed at a position that has already been superseded
+    state->rejected++;
+    return;
+  }
+  advanceTo(*state, position);
+
+  if (state->sealed || state->bytes + encoded->size() > maxBytes_) {
+    state->rejected++;
+    return;
+  }
+
+  auto& entry = state->entries[makeKey(spec, pduType, capabilities)];
+  if (entry) {
+    state->bytes -= entry->size();
+  }
+  state->bytes += encoded->size();
+  entry = std::move(encoded);
+  state->stores++;
+}
+
+json_ref QueryResultCache::stats() const {
+  auto state = state_.rlock();
+  return json_object(
+      {{"enabled", json_boolean(enabled())},
+       {"max_bytes", json_integer(maxBytes_)},
+       {"root_number", json_integer(state->position.rootNumber)},
+       {"ticks", json_integer(state->position.ticks)},
+       {"entries", json_integer(state->entries.size())},
+       {"bytes", json_integer(state->bytes)},
+       {"hits", json_integer(state->hits)},
+       {"misses", json_integer(state->misses)},
+       {"stores", json_integer(state->stores)},
+       {"evictions", json_integer(state->evictions)},
+       {"rejected", json_integer(state->rejected)}});
+}
+
+} // namespace watchman
@@ -0,0 +1,85 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Synchronized.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "Clock.h"
+#include "thirdparty/jansson/jansson.h"
+#include "watchman_stream.h"
+// watchman_pdu.h depends on watchman_stream.h
+#include "watchman_pdu.h"
+
+namespace watchman {
+
+// Remembers the encoded responses to recent queries of a root, so that a
+// client that repeats a query that another client has already made at the
+// same clock position is sent the same bytes without the query being
+// executed or its results being encoded again.
+//
+// A response is only valid for the position of the view that it was
+// computed at; the first use of the cache at a new position discards
+// everything that it holds.  Changes that don't move the position, such
+// as aging out deleted files, have to clear() the cache instead.
+class QueryResultCache {
+ public:
+  using Encoded = std::shared_ptr<const std::string>;
+
+  // Construct a cache that holds up to maxBytes of encoded responses.
+  // A cache with a maxBytes of 0 is disabled.
+  explicit QueryResultCache(size_t maxBytes);
+
+  bool enabled() const {
+    return maxBytes_ > 0;
+  }
+
+  // Returns the response to the query spec, encoded as pduType with
+  // capabilities, if one was stored at position
+  Encoded get(
+      const w_string& spec,
+      w_pdu_type pduType,
+      uint32_t capabilities,
+      const ClockPosition& position);
+
+  // Records the encoded response to the query spec at position
+  void set(
+      const w_string& spec,
+      w_pdu_type pduType,
+      uint32_t capabilities,
+      const ClockPosition& position,
+      Encoded encoded);
+
+  // Discards the entries and refuses to store any more until the view
+  // moves past position, so that a query that was executed before the
+  // view changed without ticking can't store its stale response
+  void clear(const ClockPosition& position);
+
+  // Returns the counters of the cache for debugging purposes
+  json_ref stats() const;
+
+ private:
+  struct State {
+    ClockPosition position;
+    // Set by clear() until the position changes
+    bool sealed{false};
+    std::unordered_map<w_string, Encoded> entries;
+    size_t bytes{0};
+
+    size_t hits{0};
+    size_t misses{0};
+    size_t stores{0};
+    size_t evictions{0};
+    size_t rejected{0};
+  };
+
+  // Discards the entries if they are for a position other than position
+  static void advanceTo(State& state, const ClockPosition& position);
+
+  const size_t maxBytes_;
+  folly::Synchronized<State> state_;
+};
+
+} // namespace watchman
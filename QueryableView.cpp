@@ -2,6 +2,7 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "QueryableView.h"
+#include "ThreadPool.h"
 
 namespace watchman {
 QueryableView::~QueryableView() {}
@@ -17,6 +18,14 @@ void QueryableView::suffixGenerator(w_query*, struct w_query_ctx*) const {
   throw QueryExecError("suffixGenerator not implemented");
 }
 
+void QueryableView::basenameGenerator(w_query*, struct w_query_ctx*) const {
+  throw QueryExecError("basenameGenerator not implemented");
+}
+
+bool QueryableView::hasBasenameIndex() const {
+  return false;
+}
+
 /** Walks files that match the supplied set of paths */
 void QueryableView::pathGenerator(w_query*, struct w_query_ctx*) const {
   throw QueryExecError("pathGenerator not implemented");
@@ -38,11 +47,79 @@ time_t QueryableView::getLastAgeOutTimeStamp() const {
   return 0;
 }
 
+folly::Optional<ClockLineage> QueryableView::getPriorClockLineage() const {
+  return folly::none;
+}
+
+folly::Optional<uint32_t> QueryableView::unmatchedChangesThrough(
+    uint32_t,
+    uint32_t,
+    const SettleChanges::Filter&) const {
+  return folly::none;
+}
+
+size_t QueryableView::changedFilesSince(uint32_t, uint32_t) const {
+  return 0;
+}
+
+bool QueryableView::forEachFileChangedSince(
+    uint32_t,
+    uint32_t,
+    const std::function<void(w_string_piece)>&) const {
+  return false;
+}
+
 void QueryableView::ageOut(w_perf_t&, std::chrono::seconds) {}
+bool QueryableView::ageOutInProgress() const {
+  return false;
+}
+bool QueryableView::expandCollapsedDirs(const w_string&) {
+  return false;
+}
+std::vector<w_string> QueryableView::collapseColdDirs(
+    const std::shared_ptr<w_root_t>&,
+    std::chrono::seconds) {
+  return {};
+}
 void QueryableView::startThreads(const std::shared_ptr<w_root_t>&) {}
 void QueryableView::signalThreads() {}
 void QueryableView::wakeThreads() {}
 
+void QueryableView::addMetrics(MetricsWriter&, const MetricsWriter::Labels&)
+    const {}
+
+json_ref QueryableView::getWatcherInfo() const {
+  // Views that aren't fed by a Watcher have no stats to report
+  return json_object({{"name", w_string_to_json(getName())}});
+}
+
+json_ref QueryableView::getMemoryUsage() const {
+  return json_object();
+}
+
+json_ref QueryableView::getLastCrawlInfo() const {
+  return nullptr;
+}
+
+FetchBatching QueryableView::getFetchBatching() const {
+  return FetchBatching{20480, 1024, 256, 20480, std::chrono::milliseconds(100)};
+}
+
+folly::Future<folly::Unit> QueryableView::syncToNowAsync(
+    const std::shared_ptr<w_root_t>& root,
+    std::chrono::milliseconds timeout) {
+  return folly::makeFutureWith([&] { syncToNow(root, timeout); });
+}
+
+folly::Future<folly::Unit> QueryableView::readyToQuery(
+    const std::shared_ptr<w_root_t>& root) {
+  auto ready = waitUntilReadyToQuery(root);
+  if (ready.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+    return folly::makeFuture();
+  }
+  return folly::via(&getThreadPool(), [ready] { ready.wait(); });
+}
+
 bool QueryableView::isVCSOperationInProgress() const {
   static const std::vector<w_string> lockFiles{".hg/wlock", ".git/index.lock"};
   return doAnyOfTheseFilesExist(lockFiles);
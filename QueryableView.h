@@ -4,8 +4,12 @@
 
 #include "watchman_system.h"
 #include "watchman_string.h"
+#include <folly/futures/Future.h>
+#include <functional>
 #include <future>
 #include <vector>
+#include "Metrics.h"
+#include "SettleChanges.h"
 #include "scm/SCM.h"
 #include "watchman_perf.h"
 #include "watchman_query.h"
@@ -27,6 +31,13 @@ class QueryableView : public std::enable_shared_from_this<QueryableView> {
   /** Walks all files with the suffix(es) configured in the query */
   virtual void suffixGenerator(w_query* query, struct w_query_ctx* ctx) const;
 
+  /** Walks all files with the basename(s) chosen by the planner; only
+   * called if hasBasenameIndex() */
+  virtual void basenameGenerator(w_query* query, struct w_query_ctx* ctx)
+      const;
+  /** Whether the view indexes its files by name.  The default is false. */
+  virtual bool hasBasenameIndex() const;
+
   /** Walks files that match the supplied set of paths */
   virtual void pathGenerator(w_query* query, struct w_query_ctx* ctx) const;
 
@@ -37,10 +48,58 @@ class QueryableView : public std::enable_shared_from_this<QueryableView> {
   virtual w_string getCurrentClockString() const = 0;
   virtual uint32_t getLastAgeOutTickValue() const;
   virtual time_t getLastAgeOutTimeStamp() const;
+  /** If the view was restored from a snapshot written by a prior
+   * incarnation of this watch, returns the lineage of the clocks that
+   * the prior incarnation issued */
+  virtual folly::Optional<ClockLineage> getPriorClockLineage() const;
+  /** Prunes the deleted files that are older than minAge.  A view may
+   * do this a slice at a time, in which case ageOutInProgress() is true
+   * until enough calls have been made to complete the pass. */
   virtual void ageOut(w_perf_t& sample, std::chrono::seconds minAge);
+  virtual bool ageOutInProgress() const;
+  /** A view may drop the contents of subtrees that haven't been used in
+   * a while to save memory.  A query that needs all of the files beneath
+   * dir (a full path) calls this first; if it returns true, the dropped
+   * subtrees there have been scheduled to be crawled again and the query
+   * must sync before it generates any files. */
+  virtual bool expandCollapsedDirs(const w_string& dir);
+  /** Collapses the subtrees that have been cold for coldAge right away,
+   * if the view has outgrown its budget, and returns the full paths of
+   * all of the dirs that are now collapsed.  Used for testing. */
+  virtual std::vector<w_string> collapseColdDirs(
+      const std::shared_ptr<w_root_t>& root,
+      std::chrono::seconds coldAge);
+  /** If none of the files that changed after sinceTick, up to the most
+   * recent settle, can match filter, returns the tick of that settle.
+   * The default doesn't know and returns none. */
+  virtual folly::Optional<uint32_t> unmatchedChangesThrough(
+      uint32_t rootNumber,
+      uint32_t sinceTick,
+      const SettleChanges::Filter& filter) const;
+  /** Returns the number of files that changed after sinceTick, up to the
+   * most recent settle, as far as the view knows.  The default doesn't
+   * know of any. */
+  virtual size_t changedFilesSince(uint32_t rootNumber, uint32_t sinceTick)
+      const;
+  /** Calls fn with the name, relative to the root, of each file that
+   * changed after sinceTick, including those that were deleted but not
+   * dirs.  Returns false without calling fn if the view can't account for
+   * all of those changes, because it isn't at rootNumber or the changes
+   * have been aged out.  The default can't account for any. */
+  virtual bool forEachFileChangedSince(
+      uint32_t rootNumber,
+      uint32_t sinceTick,
+      const std::function<void(w_string_piece)>& fn) const;
   virtual void syncToNow(
       const std::shared_ptr<w_root_t>& root,
       std::chrono::milliseconds timeout) = 0;
+  // As syncToNow, but returns a future that is fulfilled once the view is
+  // in sync, or with the error that syncToNow would have thrown, rather
+  // than holding up the caller while it waits.  The default syncs before
+  // returning.
+  virtual folly::Future<folly::Unit> syncToNowAsync(
+      const std::shared_ptr<w_root_t>& root,
+      std::chrono::milliseconds timeout);
 
   // Specialized query function that is used to test whether
   // version control files exist as part of some settling handling.
@@ -60,8 +119,31 @@ class QueryableView : public std::enable_shared_from_this<QueryableView> {
 
   virtual const w_string& getName() const = 0;
 
+  // Adds the metrics that are specific to the view, labelled with labels
+  virtual void addMetrics(
+      MetricsWriter& metrics,
+      const MetricsWriter::Labels& labels) const;
+
+  // Describes the watcher of the view and its stats
+  virtual json_ref getWatcherInfo() const;
+
+  // Returns an estimate of the memory held by the view, by what holds it
+  virtual json_ref getMemoryUsage() const;
+
+  // Describes the most recent full crawl of the view, if it has one
+  virtual json_ref getLastCrawlInfo() const;
+
+  // How queries should batch up the files whose properties they have to
+  // fetch from the view
+  virtual FetchBatching getFetchBatching() const;
+
   virtual std::shared_future<void> waitUntilReadyToQuery(
       const std::shared_ptr<w_root_t>& root) = 0;
+  // As waitUntilReadyToQuery, as a future that callbacks can be chained
+  // onto.  They run on the shared thread pool.  The default holds up a
+  // thread of that pool until waitUntilReadyToQuery is done.
+  virtual folly::Future<folly::Unit> readyToQuery(
+      const std::shared_ptr<w_root_t>& root);
 
   // Return the SCM detected for this watched root
   virtual SCM* getSCM() const = 0;
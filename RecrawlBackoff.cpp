@@ -0,0 +1,123 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "RecrawlBackoff.h"
+#include <folly/Random.h>
+#include <algorithm>
+
+namespace watchman {
+
+RecrawlBackoff::RecrawlBackoff(
+    milliseconds base,
+    milliseconds max,
+    double (*random)())
+    : base_(base), max_(max), random_(random) {}
+
+void RecrawlBackoff::setLimits(milliseconds base, milliseconds max) {
+  base_ = base;
+  max_ = max;
+}
+
+double RecrawlBackoff::defaultRandom() {
+  return folly::Random::randDouble01();
+}
+
+RecrawlBackoff::milliseconds RecrawlBackoff::delayFor(
+    int failures,
+    milliseconds base,
+    milliseconds max) {
+  auto delay = base;
+  for (int i = 1; i < failures && delay < max; ++i) {
+    delay *= 2;
+  }
+  return std::min(delay, max);
+}
+
+RecrawlBackoff::milliseconds RecrawlBackoff::spread(
+    milliseconds delay) const {
+  return milliseconds(int64_t(delay.count() * (0.5 + 0.5 * random_())));
+}
+
+RecrawlBackoff::milliseconds RecrawlBackoff::recrawlScheduled(
+    TimePoint now,
+    bool backoff) {
+  delay_ = milliseconds(0);
+  notBefore_ = folly::none;
+  if (lastRecrawlEnd_ == TimePoint() || now - lastRecrawlEnd_ >= max_) {
+    // Things were healthy for long enough that this is a fresh start
+    streak_ = 0;
+    return delay_;
+  }
+  streak_++;
+  if (backoff) {
+    delay_ = spread(delayFor(streak_, base_, max_));
+    notBefore_ = now + delay_;
+  }
+  return delay_;
+}
+
+bool RecrawlBackoff::recrawlWaiting(TimePoint now) const {
+  return notBefore_ && now < *notBefore_;
+}
+
+void RecrawlBackoff::recrawlStarted() {
+  for (auto& it : subtreeErrors_) {
+    it.second.retryQueued = true;
+  }
+}
+
+void RecrawlBackoff::recrawlFinished(TimePoint now) {
+  lastRecrawlEnd_ = now;
+  notBefore_ = folly::none;
+  subtreeCrawlsFinished();
+}
+
+RecrawlBackoff::milliseconds RecrawlBackoff::subtreeFailed(
+    const w_string& dir,
+    const w_string& reason,
+    TimePoint now) {
+  auto& error = subtreeErrors_[dir];
+  error.reason = reason;
+  error.count++;
+  error.retryQueued = false;
+  auto delay = spread(delayFor(error.count, base_, max_));
+  error.retryAt = now + delay;
+  return delay;
+}
+
+std::vector<w_string> RecrawlBackoff::takeDueSubtrees(TimePoint now) {
+  std::vector<w_string> due;
+  for (auto& it : subtreeErrors_) {
+    auto& error = it.second;
+    if (error.retryQueued || now < error.retryAt) {
+      continue;
+    }
+    error.retryQueued = true;
+    due.push_back(it.first);
+  }
+  return due;
+}
+
+void RecrawlBackoff::subtreeCrawlsFinished() {
+  // A crawl that failed again has put its error back to waiting for the
+  // next retry
+  for (auto it = subtreeErrors_.begin(); it != subtreeErrors_.end();) {
+    if (it->second.retryQueued) {
+      it = subtreeErrors_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+folly::Optional<RecrawlBackoff::TimePoint> RecrawlBackoff::nextSubtreeRetry()
+    const {
+  folly::Optional<TimePoint> due;
+  for (auto& it : subtreeErrors_) {
+    if (!it.second.retryQueued && (!due || it.second.retryAt < *due)) {
+      due = it.second.retryAt;
+    }
+  }
+  return due;
+}
+
+} // namespace watchman
@@ -0,0 +1,109 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Optional.h>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+namespace watchman {
+
+// Decides when the recrawls of a root, and the crawls of the dirs beneath
+// it that couldn't be read, may start.  A recrawl that is needed soon after
+// the last one finished, or a dir that fails to be read again, is usually
+// a flaky filesystem rather than a burst of changes, and retrying straight
+// away tends to fail the same way.  Each one in a row waits for twice as
+// long as the one before, from the base up to the max, spread over the
+// upper half of that so that the watches on the same filesystem don't all
+// retry at once.
+//
+// It has no lock of its own; watchman_root keeps it in its RecrawlInfo.
+// The times are passed in so that it can be tested.
+class RecrawlBackoff {
+ public:
+  using Clock = std::chrono::steady_clock;
+  using TimePoint = Clock::time_point;
+  using milliseconds = std::chrono::milliseconds;
+
+  // A dir beneath the root that we failed to read for a reason that may
+  // be transient
+  struct SubtreeError {
+    w_string reason;
+    int count{0};
+    TimePoint retryAt;
+    // The crawl of the dir has been queued; the error is dropped once that
+    // completes, unless the crawl fails again
+    bool retryQueued{false};
+  };
+
+  // random returns a number between 0 and 1 that the waits are spread by
+  explicit RecrawlBackoff(
+      milliseconds base = milliseconds(1000),
+      milliseconds max = milliseconds(300000),
+      double (*random)() = defaultRandom);
+
+  // Sets the recrawl_backoff_ms and recrawl_backoff_max_ms of the root
+  void setLimits(milliseconds base, milliseconds max);
+
+  // The wait after failures in a row, before it is spread
+  static milliseconds
+  delayFor(int failures, milliseconds base, milliseconds max);
+
+  // Records that a recrawl was scheduled at now, and returns how long it
+  // is to wait before it starts: nothing, unless it follows within max of
+  // the end of the last recrawl and backoff is true
+  milliseconds recrawlScheduled(TimePoint now, bool backoff);
+  // Returns true if the scheduled recrawl is still waiting at now
+  bool recrawlWaiting(TimePoint now) const;
+  // Records that a recrawl is starting, which takes another look at the
+  // dirs that failed to be read
+  void recrawlStarted();
+  // Records that the recrawl finished at now
+  void recrawlFinished(TimePoint now);
+
+  // How many recrawls in a row were scheduled soon after the one before
+  int streak() const {
+    return streak_;
+  }
+  // How long the scheduled recrawl waits, and until when
+  milliseconds recrawlDelay() const {
+    return delay_;
+  }
+  const folly::Optional<TimePoint>& recrawlNotBefore() const {
+    return notBefore_;
+  }
+
+  // Records that dir couldn't be read at now because of reason, and
+  // returns how long it waits before it is crawled again
+  milliseconds
+  subtreeFailed(const w_string& dir, const w_string& reason, TimePoint now);
+  // Returns the dirs whose wait has passed at now, and records that their
+  // crawl has been queued
+  std::vector<w_string> takeDueSubtrees(TimePoint now);
+  // Forgets the dirs whose queued crawl completed without failing
+  void subtreeCrawlsFinished();
+  // When the next dir that is waiting is to be crawled again, if any
+  folly::Optional<TimePoint> nextSubtreeRetry() const;
+
+  const std::unordered_map<w_string, SubtreeError>& subtreeErrors() const {
+    return subtreeErrors_;
+  }
+
+ private:
+  static double defaultRandom();
+  milliseconds spread(milliseconds delay) const;
+
+  milliseconds base_;
+  milliseconds max_;
+  double (*random_)();
+
+  int streak_{0};
+  TimePoint lastRecrawlEnd_;
+  milliseconds delay_{0};
+  folly::Optional<TimePoint> notBefore_;
+  std::unordered_map<w_string, SubtreeError> subtreeErrors_;
+};
+
+} // namespace watchman
@@ -0,0 +1,288 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "ResponseQueue.h"
+#include <folly/portability/SysUio.h>
+#include <algorithm>
+#include <vector>
+#include "PduBuffer.h"
+#include "PduCompression.h"
+#include "PduSharedMemory.h"
+#include "Tracing.h"
+#include "watchman.h"
+
+namespace watchman {
+
+namespace {
+// Leaves room for the responses to a few large queries
+constexpr json_int_t kDefaultMaxQueuedBytes = 64 * 1024 * 1024;
+// The most buffers that each thread keeps for reuse
+constexpr size_t kMaxPooledBuffers = 16;
+// Larger buffers are released rather than kept for reuse
+constexpr size_t kMaxPooledCapacity = 256 * 1024;
+// The most PDUs passed to a single writev call
+constexpr size_t kMaxIovecs = 64;
+
+std::vector<std::string>& bufferPool() {
+  static thread_local std::vector<std::string> pool;
+  return pool;
+}
+
+std::string takeBuffer() {
+  auto& pool = bufferPool();
+  if (pool.empty()) {
+    return std::string();
+  }
+  auto buffer = std::move(pool.back());
+  pool.pop_back();
+  return buffer;
+}
+
+void releaseBuffer(std::string&& buffer) {
+  auto& pool = bufferPool();
+  if (pool.size() >= kMaxPooledBuffers ||
+      buffer.capacity() > kMaxPooledCapacity) {
+    return;
+  }
+  buffer.clear();
+  pool.emplace_back(std::move(buffer));
+}
+
+bool wouldBlock() {
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+size_t configuredMaxBytes() {
+  return size_t(std::max(
+      cfg_get_int("client_max_queued_bytes", kDefaultMaxQueuedBytes),
+      json_int_t(1)));
+}
+} // namespace
+
+std::atomic<uint64_t> ResponseQueue::totalWritten_{0};
+
+ResponseQueue::ResponseQueue(size_t maxBytes)
+    : maxBytes_(maxBytes ? maxBytes : configuredMaxBytes()) {}
+
+bool ResponseQueue::push(
+    enum w_pdu_type pdu_type,
+    uint32_t capabilities,
+    const json_ref& response,
+    const w_string& subscription) {
+  TraceSpan span("encode_response", subscription);
+  Entry entry;
+  entry.data = takeBuffer();
+  entry.subscription = subscription;
+
+  if ((pdu_type == is_bser_v2 || pdu_type == is_bser_v3) &&
+      (capabilities & BSER_CAP_SHARED_MEMORY) && canPassDescriptors_) {
+    PduBuffer buffer;
+    if (w_bser_encode_pdu(
+            pdu_type == is_bser_v2 ? 2 : 3, capabilities, response, buffer)) {
+      releaseBuffer(std::move(entry.data));
+      return false;
+    }
+    lastEncodedBytes_ = buffer.size();
+    auto shared = makeSharedMemoryPdu(capabilities, buffer);
+    if (shared) {
+      entry.data.append(shared->header);
+      entry.descriptor = std::move(shared->file);
+    } else {
+      buffer.appendTo(entry.data);
+    }
+    add(std::move(entry));
+    return true;
+  }
+
+  if (!watchman_json_buffer::pduEncodeToString(
+          pdu_type, capabilities, response, entry.data)) {
+    releaseBuffer(std::move(entry.data));
+    return false;
+  }
+  lastEncodedBytes_ = entry.data.size();
+  add(std::move(entry));
+  return true;
+}
+
+void ResponseQueue::pushEncoded(
+    enum w_pdu_type pdu_type,
+    uint32_t capabilities,
+    const std::string& pdu) {
+  Entry entry;
+  if ((pdu_type == is_bser_v2 || pdu_type == is_bser_v3) &&
+      canPassDescriptors_) {
+    PduBuffer buffer;
+    buffer.appendReference(pdu.data(), pdu.size());
+    auto shared = makeSharedMemoryPdu(capabilities, buffer);
+    if (shared) {
+      entry.data = std::move(shared->header);
+      entry.descriptor = std::move(shared->file);
+      add(std::move(entry));
+      return;
+    }
+  }
+  entry.data = takeBuffer();
+  entry.data.append(pdu);
+  add(std::move(entry));
+}
+
+void ResponseQueue::pushBytes(const char* data, size_t size) {
+  Entry entry;
+  entry.data = takeBuffer();
+  entry.data.append(data, size);
+  add(std::move(entry));
+}
+
+void ResponseQueue::add(Entry&& entry) {
+  auto bytes = bytes_.fetch_add(entry.data.size(), std::memory_order_relaxed) +
+      entry.data.size();
+  if (bytes > highWaterBytes_.load(std::memory_order_relaxed)) {
+    highWaterBytes_.store(bytes, std::memory_order_relaxed);
+  }
+  pdus_.fetch_add(1, std::memory_order_relaxed);
+  entries_.emplace_back(std::move(entry));
+}
+
+void ResponseQueue::popFront() {
+  // What has been written was already taken off bytes_
+  auto& entry = entries_.front();
+  bytes_.fetch_sub(
+      entry.data.size() - entry.written, std::memory_order_relaxed);
+  pdus_.fetch_sub(1, std::memory_order_relaxed);
+  releaseBuffer(std::move(entry.data));
+  entries_.pop_front();
+}
+
+size_t ResponseQueue::removeResults(const w_string& subscription) {
+  size_t removed = 0;
+  auto it = entries_.begin();
+  while (it != entries_.end()) {
+    if (it->written == 0 && it->subscription &&
+        it->subscription == subscription) {
+      bytes_.fetch_sub(it->data.size(), std::memory_order_relaxed);
+      pdus_.fetch_sub(1, std::memory_order_relaxed);
+      releaseBuffer(std::move(it->data));
+      it = entries_.erase(it);
+      ++removed;
+    } else {
+      ++it;
+    }
+  }
+  removed_.fetch_add(removed, std::memory_order_relaxed);
+  return removed;
+}
+
+ResponseQueue::FlushResult ResponseQueue::writeWithDescriptor(w_stm_t stm) {
+  auto& entry = entries_.front();
+  auto x = stm->writeWithDescriptor(
+      entry.data.data(),
+      int(entry.data.size()),
+      entry.descriptor.system_handle());
+  if (x < 0 && errno == ENOTSUP) {
+    // Send the PDU itself instead, and don't bother with shared memory
+    // for this client from here on
+    canPassDescriptors_ = false;
+    std::string pdu;
+    if (!readSharedMemoryPdu(
+            SharedMemoryPdu{std::string(), std::move(entry.descriptor)},
+            pdu)) {
+      log(ERR, "failed to read back a shared memory PDU\n");
+      return FlushResult::Failed;
+    }
+    bytes_.fetch_add(pdu.size(), std::memory_order_relaxed);
+    bytes_.fetch_sub(entry.data.size(), std::memory_order_relaxed);
+    entry.data = std::move(pdu);
+    return FlushResult::Done;
+  }
+  if (x < 0 && wouldBlock()) {
+    return FlushResult::WouldBlock;
+  }
+  if (x <= 0) {
+    return FlushResult::Failed;
+  }
+  // The descriptor went with the first bytes; the rest follows as usual
+  entry.descriptor.close();
+  entry.written = size_t(x);
+  bytes_.fetch_sub(size_t(x), std::memory_order_relaxed);
+  written_.fetch_add(size_t(x), std::memory_order_relaxed);
+  totalWritten_.fetch_add(size_t(x), std::memory_order_relaxed);
+  return FlushResult::Done;
+}
+
+ResponseQueue::FlushResult ResponseQueue::flush(w_stm_t stm) {
+  TraceSpan span("write_responses");
+  while (!entries_.empty()) {
+    if (entries_.front().descriptor) {
+      auto res = writeWithDescriptor(stm);
+      if (res != FlushResult::Done) {
+        return res;
+      }
+      if (entries_.front().written == entries_.front().data.size()) {
+        popFront();
+      }
+      continue;
+    }
+
+    // Gather the PDUs up to the next one that has a descriptor to pass
+    struct iovec iov[kMaxIovecs];
+    int iovcnt = 0;
+    for (auto it = entries_.begin(); it != entries_.end() &&
+         iovcnt < int(kMaxIovecs) && (iovcnt == 0 || !it->descriptor);
+         ++it) {
+      iov[iovcnt].iov_base = &it->data[it->written];
+      iov[iovcnt].iov_len = it->data.size() - it->written;
+      ++iovcnt;
+    }
+
+    auto x = stm->writev(iov, iovcnt);
+    if (x < 0 && wouldBlock()) {
+      return FlushResult::WouldBlock;
+    }
+    if (x <= 0) {
+      return FlushResult::Failed;
+    }
+    written_.fetch_add(size_t(x), std::memory_order_relaxed);
+    totalWritten_.fetch_add(size_t(x), std::memory_order_relaxed);
+  totalWritten_.fetch_add(size_t(x), std::memory_order_relaxed);
+
+    // Advance past what was written, which may end part way into a PDU
+    auto wrote = size_t(x);
+    while (wrote > 0) {
+      auto& entry = entries_.front();
+      auto n = std::min(wrote, entry.data.size() - entry.written);
+      entry.written += n;
+      bytes_.fetch_sub(n, std::memory_order_relaxed);
+      wrote -= n;
+      if (entry.written == entry.data.size()) {
+        popFront();
+      }
+    }
+  }
+  return FlushResult::Done;
+}
+
+bool ResponseQueue::drain(w_stm_t stm) {
+  if (!full()) {
+    return true;
+  }
+  stm->setNonBlock(false);
+  auto res = FlushResult::Done;
+  while (full() && res != FlushResult::Failed) {
+    res = flush(stm);
+  }
+  stm->setNonBlock(true);
+  return res != FlushResult::Failed;
+}
+
+json_ref ResponseQueue::stats() const {
+  return json_object(
+      {{"bytes", json_integer(bytes_.load(std::memory_order_relaxed))},
+       {"pdus", json_integer(pdus_.load(std::memory_order_relaxed))},
+       {"max_bytes", json_integer(maxBytes_)},
+       {"high_water_bytes",
+        json_integer(highWaterBytes_.load(std::memory_order_relaxed))},
+       {"bytes_written", json_integer(written_.load(std::memory_order_relaxed))},
+       {"dropped", json_integer(dropped_.load(std::memory_order_relaxed))},
+       {"removed", json_integer(removed_.load(std::memory_order_relaxed))}});
+}
+
+} // namespace watchman
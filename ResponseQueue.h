@@ -0,0 +1,142 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <atomic>
+#include <deque>
+#include <string>
+#include "FileDescriptor.h"
+#include "watchman_stream.h"
+#include "watchman_string.h"
+#include "thirdparty/jansson/jansson.h"
+// Depends on the declarations of the headers above
+#include "watchman_pdu.h"
+
+namespace watchman {
+
+// The responses that have been encoded for a client and are waiting to be
+// written to it.  They are written without blocking, as far as the client
+// lets us, and picked up from where they left off once it has room for
+// more.  The queue is bounded by the number of bytes that it holds: once
+// it is full, the serving thread stops reading requests from the client,
+// and the results of its subscriptions are dropped or coalesced.  The
+// buffers of the encoded PDUs are recycled through a per-thread pool.
+//
+// The queue is only used by the thread that serves the client, other than
+// the counters that stats reports.
+class ResponseQueue {
+ public:
+  enum class FlushResult {
+    // Everything has been written
+    Done,
+    // The client has no room for more for now
+    WouldBlock,
+    // The client has gone away
+    Failed,
+  };
+
+  // A queue of at most maxBytes; 0 reads the limit from the
+  // client_max_queued_bytes configuration option
+  explicit ResponseQueue(size_t maxBytes = 0);
+  ResponseQueue(const ResponseQueue&) = delete;
+  ResponseQueue& operator=(const ResponseQueue&) = delete;
+
+  // Encodes response as a PDU of pdu_type and adds it to the end of the
+  // queue.  subscription is set if response holds results of that
+  // subscription, which removeResults may take back before they are
+  // written.  Returns false if the response couldn't be encoded.
+  bool push(
+      enum w_pdu_type pdu_type,
+      uint32_t capabilities,
+      const json_ref& response,
+      const w_string& subscription = w_string());
+  // Adds pdu, which has already been encoded for pdu_type and
+  // capabilities, to the end of the queue
+  void pushEncoded(
+      enum w_pdu_type pdu_type,
+      uint32_t capabilities,
+      const std::string& pdu);
+  // Adds size bytes at data, which aren't a PDU of the client's type, such
+  // as the response to a probe, to the end of the queue.  The buffer comes
+  // from the pool, so this doesn't allocate once the pool is warm.
+  void pushBytes(const char* data, size_t size);
+
+  // The size of the last PDU that push encoded, including the part of it
+  // that is passed in shared memory
+  size_t lastEncodedBytes() const {
+    return lastEncodedBytes_;
+  }
+
+  // Takes back the results of subscription that haven't started to be
+  // written, and returns how many there were
+  size_t removeResults(const w_string& subscription);
+
+  // Writes as much of the queue to stm as it takes without blocking.
+  // stm must be in non-blocking mode.
+  FlushResult flush(w_stm_t stm);
+  // Writes to stm, blocking, until the queue is no longer full.  This is
+  // for commands that send their responses as they go, and so have to be
+  // held up by a client that is slow to read them.  Returns false if the
+  // client has gone away.
+  bool drain(w_stm_t stm);
+
+  bool empty() const {
+    return entries_.empty();
+  }
+  bool full() const {
+    return bytes_.load(std::memory_order_relaxed) >= maxBytes_;
+  }
+
+  // Counts a response that was dropped, rather than queued, because the
+  // queue was full
+  void noteDropped() {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // The depth of the queue and its counters, for debugging
+  json_ref stats() const;
+
+  // The bytes of the PDUs that are waiting to be written
+  size_t queuedBytes() const {
+    return bytes_.load(std::memory_order_relaxed);
+  }
+
+  // The bytes written by all of the queues, including those of clients
+  // that have since disconnected
+  static uint64_t totalWritten() {
+    return totalWritten_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Entry {
+    std::string data;
+    // If set, passed to the client along with the first byte of data
+    FileDescriptor descriptor;
+    size_t written{0};
+    // The subscription whose results this holds, if it does
+    w_string subscription;
+  };
+
+  void add(Entry&& entry);
+  // Writes the entry at the front of the queue, whose descriptor is set
+  FlushResult writeWithDescriptor(w_stm_t stm);
+  void popFront();
+
+  const size_t maxBytes_;
+  std::deque<Entry> entries_;
+  // Cleared once the client turns out not to be able to receive
+  // descriptors, so that no more shared memory PDUs are made for it
+  bool canPassDescriptors_{true};
+  size_t lastEncodedBytes_{0};
+
+  std::atomic<size_t> bytes_{0};
+  std::atomic<size_t> pdus_{0};
+  std::atomic<size_t> highWaterBytes_{0};
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> removed_{0};
+
+  static std::atomic<uint64_t> totalWritten_;
+};
+
+} // namespace watchman
@@ -0,0 +1,104 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "RootPathCache.h"
+#include <algorithm>
+#include "FileSystem.h"
+#include "watchman_config.h"
+
+namespace watchman {
+
+namespace {
+// Sets dev and ino to the identity of what path leads to, following
+// symlinks.  Returns false if there is nothing there.
+bool identify(const char* path, uint64_t& dev, uint64_t& ino) {
+#ifndef _WIN32
+  struct stat st;
+  if (::stat(path, &st) != 0) {
+    return false;
+  }
+  dev = uint64_t(st.st_dev);
+  ino = uint64_t(st.st_ino);
+  return true;
+#else
+  // Following a reparse point to what it leads to isn't a single call
+  // here, so every path is resolved afresh
+  (void)path;
+  (void)dev;
+  (void)ino;
+  return false;
+#endif
+}
+} // namespace
+
+RootPathCache::RootPathCache(size_t maxEntries) : maxEntries_(maxEntries) {}
+
+w_string RootPathCache::resolve(const char* path) {
+  if (!enabled()) {
+    return realPath(path);
+  }
+
+  uint64_t dev = 0;
+  uint64_t ino = 0;
+  bool identified = identify(path, dev, ino);
+  w_string key(path, W_STRING_BYTE);
+  if (identified) {
+    auto state = state_.wlock();
+    auto it = state->entries.find(key);
+    if (it != state->entries.end()) {
+      if (it->second.dev == dev && it->second.ino == ino) {
+        state->hits++;
+        return it->second.resolved;
+      }
+      state->entries.erase(it);
+      state->stale++;
+    }
+    state->misses++;
+  }
+
+  auto resolved = realPath(path);
+  if (!identified) {
+    return resolved;
+  }
+
+  auto state = state_.wlock();
+  if (state->entries.size() >= maxEntries_ &&
+      state->entries.find(key) == state->entries.end()) {
+    // Clients tend to name a handful of roots, so which one makes room
+    // hardly matters
+    state->entries.erase(state->entries.begin());
+    state->evictions++;
+  }
+  state->entries[key] = Entry{resolved, dev, ino};
+  return resolved;
+}
+
+void RootPathCache::invalidate(const w_string& resolved) {
+  auto state = state_.wlock();
+  for (auto it = state->entries.begin(); it != state->entries.end();) {
+    if (it->second.resolved == resolved) {
+      it = state->entries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+json_ref RootPathCache::stats() const {
+  auto state = state_.rlock();
+  return json_object(
+      {{"enabled", json_boolean(enabled())},
+       {"max_entries", json_integer(maxEntries_)},
+       {"entries", json_integer(state->entries.size())},
+       {"hits", json_integer(state->hits)},
+       {"misses", json_integer(state->misses)},
+       {"stale", json_integer(state->stale)},
+       {"evictions", json_integer(state->evictions)}});
+}
+
+RootPathCache& getRootPathCache() {
+  static RootPathCache cache(size_t(
+      std::max(cfg_get_int("root_path_cache_size", 1024), json_int_t(0))));
+  return cache;
+}
+
+} // namespace watchman
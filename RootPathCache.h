@@ -0,0 +1,67 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Synchronized.h>
+#include <cstdint>
+#include <unordered_map>
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// Remembers the canonical paths of the paths that clients name their roots
+// by, so that a client that passes a symlink, or a path with a trailing
+// slash, doesn't have it resolved on every request, which takes several
+// syscalls.
+//
+// An entry is only used while its path still leads to the dir that it led
+// to when it was resolved, which a single stat of the path confirms, so
+// that retargeting a symlink takes effect straight away.  The entries that
+// lead to a root are dropped when the root stops being watched, in case
+// its dir was renamed and something else now lives at its path.
+class RootPathCache {
+ public:
+  // Construct a cache that holds up to maxEntries paths.  A cache with a
+  // maxEntries of 0 is disabled.
+  explicit RootPathCache(size_t maxEntries);
+
+  bool enabled() const {
+    return maxEntries_ > 0;
+  }
+
+  // Returns the canonical path of path, as realPath() does, and throws as
+  // it does if path can't be resolved
+  w_string resolve(const char* path);
+
+  // Forgets the paths whose canonical path is resolved
+  void invalidate(const w_string& resolved);
+
+  // Returns the counters of the cache for debugging purposes
+  json_ref stats() const;
+
+ private:
+  struct Entry {
+    w_string resolved;
+    // Identify the dir that the path led to
+    uint64_t dev;
+    uint64_t ino;
+  };
+  struct State {
+    std::unordered_map<w_string, Entry> entries;
+
+    size_t hits{0};
+    size_t misses{0};
+    // Entries whose path no longer led to the same dir
+    size_t stale{0};
+    size_t evictions{0};
+  };
+
+  const size_t maxEntries_;
+  folly::Synchronized<State> state_;
+};
+
+// Returns the cache configured by the root_path_cache_size option
+RootPathCache& getRootPathCache();
+
+} // namespace watchman
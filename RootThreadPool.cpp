@@ -0,0 +1,219 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "RootThreadPool.h"
+#include <algorithm>
+#include "CpuAffinity.h"
+#include "Logging.h"
+#include "watchman_config.h"
+
+namespace watchman {
+
+#ifndef _WIN32
+RootThreadPool::Task::Task(
+    RootThreadPool& pool,
+    std::string name,
+    int fd,
+    Func func)
+    : pool_(pool), name_(std::move(name)), fd_(fd), func_(std::move(func)) {}
+
+void RootThreadPool::Task::wake() {
+  std::lock_guard<std::mutex> lock(pool_.mutex_);
+  switch (state_) {
+    case State::Idle:
+      pool_.queueLocked(shared_from_this());
+      break;
+    case State::Running:
+      rerun_ = true;
+      break;
+    case State::Queued:
+    case State::Done:
+      break;
+  }
+}
+
+RootThreadPool::RootThreadPool(size_t numWorkers) {
+  for (size_t i = 0; i < numWorkers; ++i) {
+    workers_.emplace_back([this, i]() noexcept {
+      w_set_thread_name("RootThreadPool-", i);
+      placePoolThread();
+      runWorker();
+    });
+  }
+  poller_ = std::thread([this]() noexcept {
+    w_set_thread_name("RootThreadPool-poll");
+    placePoolThread();
+    runPoller();
+  });
+}
+
+RootThreadPool::~RootThreadPool() {
+  stop();
+}
+
+std::shared_ptr<RootThreadPool::Task>
+RootThreadPool::add(std::string name, int fd, Func func) {
+  std::shared_ptr<Task> task(
+      new Task(*this, std::move(name), fd, std::move(func)));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_) {
+      throw std::runtime_error("RootThreadPool is stopping");
+    }
+    tasks_.push_back(task);
+    queueLocked(task);
+  }
+  return task;
+}
+
+void RootThreadPool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  pokePoller();
+
+  for (auto& worker : workers_) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+  if (poller_.joinable()) {
+    poller_.join();
+  }
+}
+
+size_t RootThreadPool::numTasks() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tasks_.size();
+}
+
+void RootThreadPool::queueLocked(const std::shared_ptr<Task>& task) {
+  task->state_ = Task::State::Queued;
+  runQueue_.push_back(task);
+  cond_.notify_one();
+}
+
+void RootThreadPool::pokePoller() {
+  // The pipe is non-blocking; if it is full, the poller has yet to see
+  // an earlier poke, which is as good as this one
+  ignore_result(write(pokePipe_.write.fd(), "X", 1));
+}
+
+void RootThreadPool::runWorker() {
+  while (true) {
+    std::shared_ptr<Task> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stopping_ || !runQueue_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      task = std::move(runQueue_.front());
+      runQueue_.pop_front();
+      task->state_ = Task::State::Running;
+      task->rerun_ = false;
+    }
+
+    folly::Optional<Clock::time_point> next;
+    try {
+      next = task->func_();
+    } catch (const std::exception& exc) {
+      log(ERR, "task ", task->name_, " failed: ", exc.what(), "\n");
+    }
+
+    Func done;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!next) {
+        task->state_ = Task::State::Done;
+        tasks_.erase(std::find(tasks_.begin(), tasks_.end(), task));
+        // Release what the task holds outside of the lock
+        done = std::move(task->func_);
+      } else if (task->rerun_) {
+        task->deadline_ = *next;
+        queueLocked(task);
+      } else {
+        task->state_ = Task::State::Idle;
+        task->deadline_ = *next;
+      }
+    }
+    pokePoller();
+  }
+}
+
+void RootThreadPool::runPoller() {
+  std::vector<struct pollfd> pfds;
+  std::vector<std::shared_ptr<Task>> polled;
+
+  while (true) {
+    int timeoutMs = -1;
+    pfds.clear();
+    polled.clear();
+    pfds.push_back({pokePipe_.read.fd(), POLLIN, 0});
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopping_) {
+        return;
+      }
+      auto now = Clock::now();
+      for (auto& task : tasks_) {
+        if (task->state_ != Task::State::Idle) {
+          continue;
+        }
+        if (task->deadline_ <= now) {
+          queueLocked(task);
+          continue;
+        }
+        if (task->deadline_ != Clock::time_point::max()) {
+          // Round up, so that we don't wake up just before the deadline
+          auto ms = std::chrono::ceil<std::chrono::milliseconds>(
+                        task->deadline_ - now)
+                        .count();
+          auto wait = int(std::min<int64_t>(ms, 86400 * 1000));
+          timeoutMs = timeoutMs == -1 ? wait : std::min(timeoutMs, wait);
+        }
+        if (task->fd_ != -1) {
+          pfds.push_back({task->fd_, POLLIN, 0});
+          polled.push_back(task);
+        }
+      }
+    }
+
+    if (poll(pfds.data(), pfds.size(), timeoutMs) <= 0) {
+      continue;
+    }
+    if (pfds[0].revents) {
+      char buf[64];
+      while (read(pokePipe_.read.fd(), buf, sizeof(buf)) > 0) {
+        ;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < polled.size(); ++i) {
+      // A task that was woken meanwhile will read the fd anyway
+      if (pfds[i + 1].revents && polled[i]->state_ == Task::State::Idle) {
+        queueLocked(polled[i]);
+      }
+    }
+  }
+}
+#endif
+
+RootThreadPool* getRootThreadPool() {
+#ifdef _WIN32
+  // The watchers on Windows have no fds for the pool to poll
+  return nullptr;
+#else
+  static std::unique_ptr<RootThreadPool> pool = []() {
+    std::unique_ptr<RootThreadPool> pool;
+    auto threads = cfg_get_int("root_thread_pool_threads", 0);
+    if (threads > 0) {
+      pool = std::make_unique<RootThreadPool>(size_t(threads));
+    }
+    return pool;
+  }();
+  return pool.get();
+#endif
+}
+} // namespace watchman
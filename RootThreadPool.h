@@ -0,0 +1,107 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h" // to avoid system header ordering issue on win32
+#include <folly/Function.h>
+#include <folly/Optional.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Pipe.h"
+
+namespace watchman {
+
+// Runs the background work of many roots on a fixed number of threads,
+// rather than on a notify thread and an IO thread per root, most of which
+// sleep most of the time.  Each piece of work is a Task, which is run when
+// it is woken, when the fd that it waits on becomes readable, or when the
+// deadline that it last returned passes.  One thread polls the fds of all
+// of the tasks.
+//
+// A task never runs on more than one thread at once, and a wakeup that
+// arrives while it is running makes it run again once it returns, so the
+// work of a task happens in the same order as it would on a thread of its
+// own.
+class RootThreadPool {
+ public:
+  using Clock = std::chrono::steady_clock;
+  // Does some work, and returns the time by which the task wants to run
+  // again if nothing wakes it first.  Clock::time_point::max() waits for a
+  // wakeup, and folly::none ends the task.
+  using Func = folly::Function<folly::Optional<Clock::time_point>()>;
+
+  class Task : public std::enable_shared_from_this<Task> {
+   public:
+    // Makes the task run as soon as a worker is free
+    void wake();
+
+    const std::string& name() const {
+      return name_;
+    }
+
+   private:
+    friend class RootThreadPool;
+    enum class State { Idle, Queued, Running, Done };
+
+    Task(RootThreadPool& pool, std::string name, int fd, Func func);
+
+    RootThreadPool& pool_;
+    const std::string name_;
+    const int fd_;
+    Func func_;
+
+    // These are protected by pool_.mutex_
+    State state_{State::Idle};
+    // Set if the task was woken while it was running
+    bool rerun_{false};
+    Clock::time_point deadline_{Clock::time_point::max()};
+  };
+
+  explicit RootThreadPool(size_t numWorkers);
+  ~RootThreadPool();
+  RootThreadPool(const RootThreadPool&) = delete;
+  RootThreadPool& operator=(const RootThreadPool&) = delete;
+
+  // Adds a task that runs func, and runs it as soon as a worker is free.
+  // If fd isn't -1, the task is also run whenever fd is readable; the
+  // caller must keep fd open until the task has ended.
+  std::shared_ptr<Task> add(std::string name, int fd, Func func);
+
+  // Stops the workers once they finish the tasks that they are running,
+  // and waits for them.  Tasks that haven't ended are abandoned.
+  void stop();
+
+  size_t numWorkers() const {
+    return workers_.size();
+  }
+  // The number of tasks that haven't ended
+  size_t numTasks();
+
+ private:
+  void runWorker();
+  void runPoller();
+  // Hands the task to a worker; called with mutex_ held
+  void queueLocked(const std::shared_ptr<Task>& task);
+  // Makes the poller look at the tasks again
+  void pokePoller();
+
+  std::vector<std::thread> workers_;
+  std::thread poller_;
+  Pipe pokePipe_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<std::shared_ptr<Task>> tasks_;
+  std::deque<std::shared_ptr<Task>> runQueue_;
+  bool stopping_{false};
+};
+
+// Returns the pool configured by root_thread_pool_threads, or nullptr if
+// each root is to have threads of its own
+RootThreadPool* getRootThreadPool();
+} // namespace watchman
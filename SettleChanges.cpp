@@ -0,0 +1,104 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "SettleChanges.h"
+#include <algorithm>
+
+namespace watchman {
+
+SettleChanges::SettleChanges(size_t maxBatches) : maxBatches_(maxBatches) {}
+
+void SettleChanges::add(uint32_t rootNumber, Batch batch) {
+  std::sort(batch.dirs.begin(), batch.dirs.end());
+  batch.dirs.erase(
+      std::unique(batch.dirs.begin(), batch.dirs.end()), batch.dirs.end());
+
+  auto state = state_.wlock();
+  if (state->rootNumber != rootNumber ||
+      (!state->batches.empty() &&
+       state->batches.back().toTick != batch.fromTick)) {
+    // The batches must be contiguous for a range of ticks to be known
+    state->batches.clear();
+    state->rootNumber = rootNumber;
+  }
+  state->batches.push_back(std::move(batch));
+  if (state->batches.size() > maxBatches_) {
+    state->batches.pop_front();
+  }
+}
+
+uint32_t SettleChanges::lastTick(uint32_t rootNumber) const {
+  auto state = state_.rlock();
+  if (state->rootNumber != rootNumber || state->batches.empty()) {
+    return 0;
+  }
+  return state->batches.back().toTick;
+}
+
+bool SettleChanges::mayMatch(const Batch& batch, const Filter& filter) {
+  if (batch.overflowed) {
+    return true;
+  }
+  if (filter.suffixes.has_value()) {
+    auto& suffixes = *filter.suffixes;
+    if (std::none_of(suffixes.begin(), suffixes.end(), [&](const w_string& s) {
+          return batch.suffixes.find(s) != batch.suffixes.end();
+        })) {
+      return false;
+    }
+  }
+  if (filter.relativeRoot) {
+    auto& root = filter.relativeRoot;
+    if (!std::binary_search(batch.dirs.begin(), batch.dirs.end(), root)) {
+      // Look for the first dir below root
+      auto below = w_string::build(root, "/");
+      auto it = std::lower_bound(batch.dirs.begin(), batch.dirs.end(), below);
+      if (it == batch.dirs.end() || !it->piece().startsWith(below)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+folly::Optional<uint32_t> SettleChanges::unmatchedThrough(
+    uint32_t rootNumber,
+    uint32_t sinceTick,
+    const Filter& filter) const {
+  auto state = state_.rlock();
+  auto& batches = state->batches;
+  if (state->rootNumber != rootNumber || batches.empty() ||
+      sinceTick < batches.front().fromTick ||
+      sinceTick >= batches.back().toTick) {
+    return folly::none;
+  }
+
+  auto first = std::upper_bound(
+      batches.begin(),
+      batches.end(),
+      sinceTick,
+      [](uint32_t tick, const Batch& batch) { return tick < batch.toTick; });
+  for (auto it = first; it != batches.end(); ++it) {
+    if (mayMatch(*it, filter)) {
+      return folly::none;
+    }
+  }
+  return batches.back().toTick;
+}
+
+size_t SettleChanges::changedFilesSince(
+    uint32_t rootNumber,
+    uint32_t sinceTick) const {
+  auto state = state_.rlock();
+  if (state->rootNumber != rootNumber) {
+    return 0;
+  }
+  size_t files = 0;
+  for (auto& batch : state->batches) {
+    if (batch.toTick > sinceTick) {
+      files += batch.files;
+    }
+  }
+  return files;
+}
+
+} // namespace watchman
@@ -0,0 +1,86 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Optional.h>
+#include <folly/Synchronized.h>
+#include <deque>
+#include <unordered_set>
+#include <vector>
+
+namespace watchman {
+
+// Summarizes the files that changed between each of the recent settles of
+// a view: the suffixes of their names and the dirs that hold them.  The
+// summary is built once per settle, so that each subscription can tell
+// whether any of the changes since it was last notified could match its
+// query without walking those changes itself.
+class SettleChanges {
+ public:
+  // The files that a subscription can match, as far as the summary can
+  // tell them apart
+  struct Filter {
+    // If set, only files with one of these lower case suffixes
+    folly::Optional<std::vector<w_string>> suffixes;
+    // If set, only files in this dir or below it
+    w_string relativeRoot;
+
+    bool empty() const {
+      return !suffixes.has_value() && !relativeRoot;
+    }
+  };
+
+  // The changes after fromTick, up to and including toTick
+  struct Batch {
+    uint32_t fromTick{0};
+    uint32_t toTick{0};
+    // Set if there were too many changes to summarize them
+    bool overflowed{false};
+    // The number of files that changed, which is more than kMaxBatchFiles
+    // if the batch overflowed
+    size_t files{0};
+    std::unordered_set<w_string> suffixes;
+    // The full paths of the dirs that hold the changed files
+    std::vector<w_string> dirs;
+  };
+
+  // The most changed files that a batch summarizes before it is
+  // considered to have overflowed
+  static constexpr size_t kMaxBatchFiles = 32768;
+
+  explicit SettleChanges(size_t maxBatches = 64);
+
+  // Records the next batch of changes of the view at rootNumber.  Its
+  // fromTick must be the toTick of the previous batch; a batch from a new
+  // rootNumber discards the batches from the previous one.
+  void add(uint32_t rootNumber, Batch batch);
+
+  // Returns the toTick of the newest batch for rootNumber, or 0
+  uint32_t lastTick(uint32_t rootNumber) const;
+
+  // If none of the changes after sinceTick, at rootNumber, can match
+  // filter, returns the tick up to which that is known.  Returns none if
+  // some may match, or if the batches don't go back as far as sinceTick.
+  folly::Optional<uint32_t> unmatchedThrough(
+      uint32_t rootNumber,
+      uint32_t sinceTick,
+      const Filter& filter) const;
+
+  // Returns the number of files that changed after sinceTick, at
+  // rootNumber, as far back as the batches go.  A file that changed in
+  // several batches is counted once for each of them.
+  size_t changedFilesSince(uint32_t rootNumber, uint32_t sinceTick) const;
+
+ private:
+  static bool mayMatch(const Batch& batch, const Filter& filter);
+
+  struct State {
+    uint32_t rootNumber{0};
+    std::deque<Batch> batches;
+  };
+  const size_t maxBatches_;
+  folly::Synchronized<State> state_;
+};
+
+} // namespace watchman
@@ -0,0 +1,104 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Synchronized.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "Clock.h"
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// Lets the subscriptions of a root that have the same query and the same
+// since position share one evaluation of the query.  When many clients
+// subscribe to a root with the same expression, each of them would
+// otherwise execute the query when the root settles; with this, the first
+// of them to get there executes it and the others are handed its result.
+//
+// A result is only reused while the view is at the position that it was
+// computed at.  Callers that arrive while the result for their key is
+// being computed wait for it rather than computing it again.
+template <typename Result>
+class SharedSubscriptionResults {
+ public:
+  using ResultPtr = std::shared_ptr<const Result>;
+
+  // Returns the result for key when the view is at position.  If no result
+  // for key has been computed at that position, calls compute, which must
+  // return the result and the position that the result was computed at.
+  // If compute throws, so does this, and the next caller tries again.
+  template <typename Compute>
+  ResultPtr getOrCompute(
+      const w_string& key,
+      const ClockPosition& position,
+      Compute&& compute) {
+    auto entry = lookup(key, position);
+
+    std::lock_guard<std::mutex> guard(entry->mutex);
+    if (entry->result && samePosition(entry->position, position)) {
+      ++shared_;
+      return entry->result;
+    }
+    auto computed = compute();
+    ++evaluations_;
+    entry->result = std::move(computed.first);
+    entry->position = computed.second;
+    return entry->result;
+  }
+
+  // Returns the counters for debugging purposes
+  json_ref stats() const {
+    return json_object(
+        {{"entries", json_integer(entries_.rlock()->size())},
+         {"evaluations", json_integer(evaluations_.load())},
+         {"shared", json_integer(shared_.load())}});
+  }
+
+ private:
+  struct Entry {
+    // Held while the result is read or computed
+    std::mutex mutex;
+    ClockPosition position;
+    ResultPtr result;
+  };
+
+  static bool samePosition(const ClockPosition& a, const ClockPosition& b) {
+    return a.rootNumber == b.rootNumber && a.ticks == b.ticks;
+  }
+
+  std::shared_ptr<Entry> lookup(
+      const w_string& key,
+      const ClockPosition& position) {
+    auto entries = entries_.wlock();
+    // Results from other positions can't be reused, so discard those that
+    // are not being computed or read
+    for (auto it = entries->begin(); it != entries->end();) {
+      auto& entry = it->second;
+      std::unique_lock<std::mutex> lock(entry->mutex, std::try_to_lock);
+      if (lock.owns_lock() && entry.use_count() == 1 &&
+          !samePosition(entry->position, position)) {
+        lock.unlock();
+        it = entries->erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    auto& entry = (*entries)[key];
+    if (!entry) {
+      entry = std::make_shared<Entry>();
+    }
+    return entry;
+  }
+
+  folly::Synchronized<std::unordered_map<w_string, std::shared_ptr<Entry>>>
+      entries_;
+  std::atomic<size_t> evaluations_{0};
+  std::atomic<size_t> shared_{0};
+};
+
+} // namespace watchman
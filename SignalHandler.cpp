@@ -3,6 +3,7 @@
 #include "watchman.h"
 #include <folly/Conv.h>
 #include "Logging.h"
+#include "MappedFileErrors.h"
 
 using namespace watchman;
 
@@ -138,6 +139,20 @@ static void crash_handler(int signo, siginfo_t* si, void*) {
 }
 #endif
 
+#ifndef _WIN32
+static void bus_handler(int signo, siginfo_t* si, void* context) {
+  recoverFromMappedFileError();
+  // This is registered without SA_RESETHAND so that reads of mapped files
+  // can recover more than once, so reset it before crash_handler resends
+  // the signal
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_DFL;
+  sigaction(signo, &sa, nullptr);
+  crash_handler(signo, si, context);
+}
+#endif
+
 namespace {
 void terminationHandler() {
   auto eptr = std::current_exception();
@@ -168,7 +183,11 @@ void setup_signal_handlers() {
 
   sigaction(SIGSEGV, &sa, NULL);
 #ifdef SIGBUS
-  sigaction(SIGBUS, &sa, NULL);
+  struct sigaction bus_sa;
+  memset(&bus_sa, 0, sizeof(bus_sa));
+  bus_sa.sa_sigaction = bus_handler;
+  bus_sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGBUS, &bus_sa, NULL);
 #endif
   sigaction(SIGFPE, &sa, NULL);
   sigaction(SIGILL, &sa, NULL);
@@ -0,0 +1,63 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <folly/Synchronized.h>
+#include <folly/Try.h>
+#include <folly/futures/SharedPromise.h>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace watchman {
+
+/** SingleFlight coalesces concurrent calls for the same key, so that an
+ * expensive computation, such as running hg, is carried out once for all
+ * of the callers that ask for it at the same moment rather than once per
+ * caller.  Nothing is remembered once the computation completes; a call
+ * that starts after that computes the value afresh.
+ */
+template <typename Key, typename Value>
+class SingleFlight {
+ public:
+  /** Returns the result of calling func, or, if a call for key is already
+   * in progress on another thread, waits for that call and returns its
+   * result instead.  An exception thrown by func is thrown to all of the
+   * callers that shared it. */
+  template <typename Func>
+  Value run(const Key& key, Func&& func) {
+    auto future = folly::Future<Value>::makeEmpty();
+    std::shared_ptr<folly::SharedPromise<Value>> promise;
+    {
+      auto inFlight = inFlight_.lock();
+      auto it = inFlight->find(key);
+      if (it != inFlight->end()) {
+        future = it->second->getFuture();
+      } else {
+        promise = std::make_shared<folly::SharedPromise<Value>>();
+        inFlight->emplace(key, promise);
+      }
+    }
+    if (!promise) {
+      return std::move(future).get();
+    }
+
+    auto result = folly::makeTryWith(std::forward<Func>(func));
+    // Calls that start from here on compute the value afresh
+    inFlight_.lock()->erase(key);
+    promise->setTry(folly::Try<Value>(result));
+    return std::move(result).value();
+  }
+
+  /** The number of keys with a call in progress */
+  size_t inFlight() const {
+    return inFlight_.lock()->size();
+  }
+
+ private:
+  folly::Synchronized<
+      std::unordered_map<Key, std::shared_ptr<folly::SharedPromise<Value>>>,
+      std::mutex>
+      inFlight_;
+};
+
+} // namespace watchman
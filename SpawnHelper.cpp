@@ -0,0 +1,473 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "SpawnHelper.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#ifndef _WIN32
+#include <poll.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#endif
+#include "Logging.h"
+#include "Pipe.h"
+
+namespace watchman {
+
+namespace {
+std::unique_ptr<SpawnHelper>& instance() {
+  static std::unique_ptr<SpawnHelper> helper;
+  return helper;
+}
+
+#ifndef _WIN32
+// The most descriptors that a request can pass to the helper
+constexpr size_t kMaxFds = 64;
+// How often the helper checks whether its children have exited while it
+// has some
+constexpr int kReapIntervalMs = 50;
+
+class Writer {
+ public:
+  void u32(uint32_t value) {
+    buf_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  void i32(int32_t value) {
+    buf_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  void str(const std::string& value) {
+    u32(uint32_t(value.size()));
+    buf_.append(value);
+  }
+  void bytes(const void* data, size_t size) {
+    buf_.append(static_cast<const char*>(data), size);
+  }
+  const std::string& buffer() const {
+    return buf_;
+  }
+
+ private:
+  std::string buf_;
+};
+
+class Reader {
+ public:
+  explicit Reader(const std::string& buf)
+      : pos_(buf.data()), end_(buf.data() + buf.size()) {}
+
+  uint32_t u32() {
+    uint32_t value;
+    bytes(&value, sizeof(value));
+    return value;
+  }
+  int32_t i32() {
+    int32_t value;
+    bytes(&value, sizeof(value));
+    return value;
+  }
+  std::string str() {
+    auto size = u32();
+    need(size);
+    std::string value(pos_, size);
+    pos_ += size;
+    return value;
+  }
+  void bytes(void* data, size_t size) {
+    need(size);
+    memcpy(data, pos_, size);
+    pos_ += size;
+  }
+
+ private:
+  void need(size_t size) {
+    if (size_t(end_ - pos_) < size) {
+      throw std::runtime_error("truncated spawn request");
+    }
+  }
+
+  const char* pos_;
+  const char* end_;
+};
+
+bool writeAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    auto n = ::write(fd, data, size);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool readAll(int fd, char* data, size_t size) {
+  while (size > 0) {
+    auto n = ::read(fd, data, size);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Sends a length prefixed message, passing fds along with its first byte
+bool sendMessage(
+    int sock,
+    const std::string& payload,
+    const std::vector<int>& fds) {
+  uint32_t len = uint32_t(payload.size());
+  struct iovec iov;
+  iov.iov_base = &len;
+  iov.iov_len = sizeof(len);
+
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!fds.empty()) {
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  }
+
+  ssize_t n;
+  do {
+    n = ::sendmsg(sock, &msg, 0);
+  } while (n == -1 && errno == EINTR);
+  if (n <= 0) {
+    return false;
+  }
+  auto sent = reinterpret_cast<const char*>(&len) + n;
+  return writeAll(sock, sent, sizeof(len) - n) &&
+      writeAll(sock, payload.data(), payload.size());
+}
+
+// Receives a message sent by sendMessage.  Returns false once the other
+// end has gone away.
+bool receiveMessage(
+    int sock,
+    std::string& payload,
+    std::vector<FileDescriptor>& fds) {
+  uint32_t len;
+  struct iovec iov;
+  iov.iov_base = &len;
+  iov.iov_len = sizeof(len);
+
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * kMaxFds));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+
+  ssize_t n;
+  do {
+    n = ::recvmsg(sock, &msg, 0);
+  } while (n == -1 && errno == EINTR);
+  if (n <= 0) {
+    return false;
+  }
+
+  for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      fds.emplace_back(fd, FileDescriptor::FDType::Unknown);
+      // Keep them out of the children, other than as their targets
+      fds.back().setCloExec();
+    }
+  }
+
+  if (!readAll(
+          sock,
+          reinterpret_cast<char*>(&len) + n,
+          sizeof(len) - size_t(n))) {
+    return false;
+  }
+  payload.resize(len);
+  return readAll(sock, &payload[0], len);
+}
+
+// Spawns the command of a request that the helper received, and sends the
+// error and pid back.  fds are the descriptors that came with it, the
+// last of which is where the exit status of the child is to be written.
+void serveRequest(
+    int sock,
+    const std::string& payload,
+    std::vector<FileDescriptor>& fds,
+    std::unordered_map<pid_t, FileDescriptor>& statusFds) {
+  int err = 0;
+  pid_t pid = 0;
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+
+  try {
+    if (fds.empty()) {
+      throw std::runtime_error("spawn request has no status pipe");
+    }
+    Reader reader(payload);
+    std::vector<std::string> argv(reader.u32());
+    for (auto& arg : argv) {
+      arg = reader.str();
+    }
+    std::vector<std::string> envp(reader.u32());
+    for (auto& env : envp) {
+      env = reader.str();
+    }
+    auto cwd = reader.str();
+    short flags = short(reader.i32());
+    bool setSigMask = reader.u32() != 0;
+    sigset_t sigMask;
+    reader.bytes(&sigMask, sizeof(sigMask));
+
+    auto numActions = reader.u32();
+    for (uint32_t i = 0; i < numActions; ++i) {
+      auto kind = reader.u32();
+      auto source = reader.i32();
+      auto target = reader.i32();
+      auto path = reader.str();
+      auto openFlags = reader.i32();
+      auto mode = reader.i32();
+      if (kind == SpawnHelper::FileAction::Dup2) {
+        if (source < 0 || size_t(source) + 1 >= fds.size()) {
+          throw std::runtime_error("spawn request has a bad descriptor");
+        }
+        err = posix_spawn_file_actions_adddup2(
+            &actions, fds[source].fd(), target);
+      } else {
+        err = posix_spawn_file_actions_addopen(
+            &actions, target, path.c_str(), openFlags, mode);
+      }
+      if (err) {
+        throw std::system_error(err, std::generic_category(), "file action");
+      }
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    if (setSigMask) {
+      posix_spawnattr_setsigmask(&attr, &sigMask);
+    }
+
+    std::vector<char*> args;
+    for (auto& arg : argv) {
+      args.push_back(&arg[0]);
+    }
+    args.push_back(nullptr);
+    std::vector<char*> env;
+    for (auto& e : envp) {
+      env.push_back(&e[0]);
+    }
+    env.push_back(nullptr);
+
+    // The helper has the one thread, so it can change its own cwd
+    if (!cwd.empty() && chdir(cwd.c_str()) != 0) {
+      err = errno;
+    } else if (!args.empty() && args[0]) {
+      err = posix_spawnp(
+          &pid, args[0], &actions, &attr, args.data(), env.data());
+    } else {
+      err = EINVAL;
+    }
+    if (!cwd.empty()) {
+      ignore_result(chdir("/"));
+    }
+  } catch (const std::system_error& exc) {
+    err = exc.code().value();
+  } catch (const std::exception&) {
+    err = EINVAL;
+  }
+
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+
+  if (err == 0) {
+    statusFds[pid] = std::move(fds.back());
+  }
+  int32_t reply[2] = {err, int32_t(pid)};
+  ignore_result(
+      writeAll(sock, reinterpret_cast<const char*>(reply), sizeof(reply)));
+}
+
+// Writes the wait status of the children that have exited to their pipes
+void reapChildren(std::unordered_map<pid_t, FileDescriptor>& statusFds) {
+  while (true) {
+    int status;
+    auto pid = waitpid(-1, &status, WNOHANG);
+    if (pid <= 0) {
+      return;
+    }
+    auto it = statusFds.find(pid);
+    if (it != statusFds.end()) {
+      ignore_result(writeAll(
+          it->second.fd(),
+          reinterpret_cast<const char*>(&status),
+          sizeof(status)));
+      statusFds.erase(it);
+    }
+  }
+}
+
+[[noreturn]] void runHelper(int sock) {
+  // The server may have abandoned a child, and its status pipe with it;
+  // the server ignores SIGPIPE too, and children inherit that either way
+  signal(SIGPIPE, SIG_IGN);
+
+  std::unordered_map<pid_t, FileDescriptor> statusFds;
+  while (true) {
+    pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    auto ready = ::poll(&pfd, 1, statusFds.empty() ? -1 : kReapIntervalMs);
+    if (ready > 0) {
+      std::string payload;
+      std::vector<FileDescriptor> fds;
+      if (!receiveMessage(sock, payload, fds)) {
+        // The server has exited; the children carry on without us
+        break;
+      }
+      serveRequest(sock, payload, fds, statusFds);
+    }
+    reapChildren(statusFds);
+  }
+  _exit(0);
+}
+#endif
+
+std::atomic<bool> alive{false};
+} // namespace
+
+SpawnHelper::SpawnHelper(pid_t pid, FileDescriptor&& socket)
+    : pid_(pid), socket_(std::move(socket)) {}
+
+void SpawnHelper::start() {
+#ifndef _WIN32
+  if (instance()) {
+    return;
+  }
+  SocketPair pair;
+  pair.read.clearNonBlock();
+  pair.write.clearNonBlock();
+
+  auto pid = fork();
+  if (pid == -1) {
+    log(ERR, "failed to fork the spawn helper: ", strerror(errno), "\n");
+    return;
+  }
+  if (pid == 0) {
+    pair.read.close();
+    runHelper(pair.write.fd());
+  }
+
+  log(DBG, "started the spawn helper, pid ", pid, "\n");
+  instance().reset(new SpawnHelper(pid, std::move(pair.read)));
+  alive = true;
+#endif
+}
+
+SpawnHelper* SpawnHelper::get() {
+  return alive ? instance().get() : nullptr;
+}
+
+int SpawnHelper::spawn(
+    const Request& request,
+    pid_t& pid,
+    FileDescriptor& status) {
+#ifndef _WIN32
+  Writer writer;
+  std::vector<int> fds;
+
+  writer.u32(uint32_t(request.argv.size()));
+  for (auto& arg : request.argv) {
+    writer.str(arg);
+  }
+  writer.u32(uint32_t(request.envp.size()));
+  for (auto& env : request.envp) {
+    writer.str(env);
+  }
+  writer.str(request.cwd);
+  writer.i32(request.flags);
+  writer.u32(request.setSigMask);
+  writer.bytes(&request.sigMask, sizeof(request.sigMask));
+
+  writer.u32(uint32_t(request.actions.size()));
+  for (auto& action : request.actions) {
+    int source = -1;
+    if (action.kind == FileAction::Dup2) {
+      // Descriptors are passed once each, and referred to by their index
+      auto it = std::find(fds.begin(), fds.end(), action.sourceFd);
+      source = int(it - fds.begin());
+      if (it == fds.end()) {
+        fds.push_back(action.sourceFd);
+      }
+    }
+    writer.u32(action.kind);
+    writer.i32(source);
+    writer.i32(action.targetFd);
+    writer.str(action.path);
+    writer.i32(action.flags);
+    writer.i32(action.mode);
+  }
+  if (fds.size() + 1 > kMaxFds) {
+    throw std::runtime_error("too many descriptors for the spawn helper");
+  }
+
+  Pipe statusPipe;
+  fds.push_back(statusPipe.write.fd());
+
+  int32_t reply[2];
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!sendMessage(socket_.fd(), writer.buffer(), fds) ||
+        !readAll(
+            socket_.fd(), reinterpret_cast<char*>(reply), sizeof(reply))) {
+      auto err = errno;
+      if (alive.exchange(false)) {
+        log(ERR, "the spawn helper has gone away\n");
+        int status;
+        waitpid(pid_, &status, WNOHANG);
+      }
+      throw std::system_error(
+          err, std::generic_category(), "spawn helper has gone away");
+    }
+  }
+
+  if (reply[0] == 0) {
+    pid = pid_t(reply[1]);
+    status = std::move(statusPipe.read);
+  }
+  return reply[0];
+#else
+  (void)request;
+  (void)pid;
+  (void)status;
+  throw std::runtime_error("there is no spawn helper on Windows");
+#endif
+}
+
+} // namespace watchman
@@ -0,0 +1,72 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <signal.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "FileDescriptor.h"
+
+namespace watchman {
+
+// A small process that is forked from the server while it is young, and
+// spawns children on its behalf.  The cost of spawning a process grows
+// with the size of the address space of its parent on some systems, and
+// the server can grow to many GB, while the helper stays as small as the
+// server was when it started.  Children that it spawns report their exit
+// status back through a pipe, since they aren't children of the server.
+//
+// The helper is only available on POSIX systems.
+class SpawnHelper {
+ public:
+  // What the child is to do with a descriptor before it runs the command,
+  // as a posix_spawn file action
+  struct FileAction {
+    enum Kind { Dup2, Open };
+    Kind kind;
+    // For Dup2, the descriptor that is duplicated as targetFd
+    int sourceFd;
+    int targetFd;
+    // For Open, what is opened as targetFd
+    std::string path;
+    int flags;
+    int mode;
+  };
+
+  struct Request {
+    std::vector<std::string> argv;
+    std::vector<std::string> envp;
+    std::string cwd;
+    short flags{0};
+#ifndef _WIN32
+    bool setSigMask{false};
+    sigset_t sigMask;
+#endif
+    std::vector<FileAction> actions;
+  };
+
+  // Forks the helper.  This must be called while the process has only the
+  // one thread, as the helper carries on running the code of the server
+  // without calling exec.  Does nothing on Windows.
+  static void start();
+
+  // Returns the helper, or nullptr if it was never started or has gone
+  // away
+  static SpawnHelper* get();
+
+  // Has the helper spawn the command of request with posix_spawnp, and
+  // returns its pid along with the read end of a pipe that its wait
+  // status is written to once it exits.  Returns the error of
+  // posix_spawnp if it failed, and throws if the helper can't be reached.
+  int spawn(const Request& request, pid_t& pid, FileDescriptor& status);
+
+ private:
+  SpawnHelper(pid_t pid, FileDescriptor&& socket);
+
+  const pid_t pid_;
+  std::mutex mutex_;
+  FileDescriptor socket_;
+};
+
+} // namespace watchman
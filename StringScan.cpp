@@ -0,0 +1,319 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "StringScan.h"
+#include <folly/lang/Bits.h>
+#include <cstdint>
+#include <cstring>
+#include "watchman_string.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WATCHMAN_STRSCAN_SSE2 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define WATCHMAN_STRSCAN_NEON 1
+#endif
+
+namespace watchman {
+namespace strscan {
+
+namespace scalar {
+namespace {
+inline char lower(char c) {
+  return c >= 'A' && c <= 'Z' ? char(c | 0x20) : c;
+}
+inline bool isAnySlash(char c) {
+  return c == '/' || c == '\\';
+}
+} // namespace
+
+const char* findLastSlash(const char* begin, const char* end) {
+  while (end > begin) {
+    --end;
+    if (is_slash(*end)) {
+      return end;
+    }
+  }
+  return nullptr;
+}
+
+const char* findLastSlashOrDot(const char* begin, const char* end) {
+  while (end > begin) {
+    --end;
+    if (is_slash(*end) || *end == '.') {
+      return end;
+    }
+  }
+  return nullptr;
+}
+
+void toLower(char* dst, const char* src, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    dst[i] = lower(src[i]);
+  }
+}
+
+bool equalCaseless(const char* a, const char* b, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (lower(a[i]) != lower(b[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool hasUpper(const char* src, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (src[i] >= 'A' && src[i] <= 'Z') {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool equalAsPaths(const char* a, const char* b, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    if (a[i] != b[i] && !(isAnySlash(a[i]) && isAnySlash(b[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void replaceSlashes(char* dst, const char* src, size_t len, char sep) {
+  for (size_t i = 0; i < len; ++i) {
+    dst[i] = isAnySlash(src[i]) ? sep : src[i];
+  }
+}
+} // namespace scalar
+
+// memchr is vectorized by the C libraries that we build against, and a
+// vector loop that compares the first and last bytes of the needle at
+// each position measured slower than this on glibc, so there is only
+// this form
+const char* find(
+    const char* haystack,
+    size_t haystackLen,
+    const char* needle,
+    size_t needleLen) {
+  if (needleLen == 0) {
+    return haystack;
+  }
+  if (needleLen > haystackLen) {
+    return nullptr;
+  }
+  auto limit = haystack + haystackLen - needleLen + 1;
+  while ((haystack = static_cast<const char*>(
+              memchr(haystack, needle[0], limit - haystack))) != nullptr) {
+    if (memcmp(haystack, needle, needleLen) == 0) {
+      return haystack;
+    }
+    ++haystack;
+  }
+  return nullptr;
+}
+
+#if defined(WATCHMAN_STRSCAN_SSE2) || defined(WATCHMAN_STRSCAN_NEON)
+namespace {
+constexpr size_t kWidth = 16;
+
+#ifdef WATCHMAN_STRSCAN_SSE2
+using Vec = __m128i;
+// The number of bits of the mask of a comparison for each byte
+constexpr unsigned kBitsPerByte = 1;
+
+inline Vec load(const char* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+inline void store(char* p, Vec v) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+}
+inline Vec splat(char c) {
+  return _mm_set1_epi8(c);
+}
+inline Vec eq(Vec a, Vec b) {
+  return _mm_cmpeq_epi8(a, b);
+}
+inline Vec either(Vec a, Vec b) {
+  return _mm_or_si128(a, b);
+}
+inline Vec both(Vec a, Vec b) {
+  return _mm_and_si128(a, b);
+}
+// Takes the bytes of a where mask is set, and those of b elsewhere
+inline Vec select(Vec mask, Vec a, Vec b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+inline uint64_t toMask(Vec v) {
+  return unsigned(_mm_movemask_epi8(v));
+}
+inline Vec isUpper(Vec v) {
+  // Moves 'A' to the bottom of the signed range, so that one signed
+  // comparison picks out 'A' to 'Z'
+  return _mm_cmplt_epi8(
+      _mm_add_epi8(v, splat(char(0x80 - 'A'))), splat(char(0x80 + 26)));
+}
+#else
+using Vec = uint8x16_t;
+constexpr unsigned kBitsPerByte = 4;
+
+inline Vec load(const char* p) {
+  return vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+}
+inline void store(char* p, Vec v) {
+  vst1q_u8(reinterpret_cast<uint8_t*>(p), v);
+}
+inline Vec splat(char c) {
+  return vdupq_n_u8(uint8_t(c));
+}
+inline Vec eq(Vec a, Vec b) {
+  return vceqq_u8(a, b);
+}
+inline Vec either(Vec a, Vec b) {
+  return vorrq_u8(a, b);
+}
+inline Vec both(Vec a, Vec b) {
+  return vandq_u8(a, b);
+}
+inline Vec select(Vec mask, Vec a, Vec b) {
+  return vbslq_u8(mask, a, b);
+}
+inline uint64_t toMask(Vec v) {
+  // NEON has no movemask; narrowing each 16 bit lane by 4 bits leaves a
+  // nibble for each byte
+  return vget_lane_u64(
+      vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0);
+}
+inline Vec isUpper(Vec v) {
+  return vcleq_u8(vsubq_u8(v, splat('A')), vdupq_n_u8(25));
+}
+#endif
+
+constexpr uint64_t kAllBytes = kBitsPerByte == 1 ? 0xffff : ~uint64_t(0);
+
+inline size_t lastByte(uint64_t mask) {
+  return (folly::findLastSet(mask) - 1) / kBitsPerByte;
+}
+
+inline Vec isSlash(Vec v) {
+#ifdef _WIN32
+  return either(eq(v, splat('/')), eq(v, splat('\\')));
+#else
+  return eq(v, splat('/'));
+#endif
+}
+inline Vec isAnySlash(Vec v) {
+  return either(eq(v, splat('/')), eq(v, splat('\\')));
+}
+inline Vec lower(Vec v) {
+  return either(v, both(isUpper(v), splat(0x20)));
+}
+} // namespace
+
+const char* findLastSlash(const char* begin, const char* end) {
+  while (size_t(end - begin) >= kWidth) {
+    auto mask = toMask(isSlash(load(end - kWidth)));
+    if (mask) {
+      return end - kWidth + lastByte(mask);
+    }
+    end -= kWidth;
+  }
+  return scalar::findLastSlash(begin, end);
+}
+
+const char* findLastSlashOrDot(const char* begin, const char* end) {
+  while (size_t(end - begin) >= kWidth) {
+    auto v = load(end - kWidth);
+    auto mask = toMask(either(isSlash(v), eq(v, splat('.'))));
+    if (mask) {
+      return end - kWidth + lastByte(mask);
+    }
+    end -= kWidth;
+  }
+  return scalar::findLastSlashOrDot(begin, end);
+}
+
+void toLower(char* dst, const char* src, size_t len) {
+  size_t i = 0;
+  for (; i + kWidth <= len; i += kWidth) {
+    store(dst + i, lower(load(src + i)));
+  }
+  scalar::toLower(dst + i, src + i, len - i);
+}
+
+bool equalCaseless(const char* a, const char* b, size_t len) {
+  size_t i = 0;
+  for (; i + kWidth <= len; i += kWidth) {
+    if (toMask(eq(lower(load(a + i)), lower(load(b + i)))) != kAllBytes) {
+      return false;
+    }
+  }
+  return scalar::equalCaseless(a + i, b + i, len - i);
+}
+
+bool hasUpper(const char* src, size_t len) {
+  size_t i = 0;
+  for (; i + kWidth <= len; i += kWidth) {
+    if (toMask(isUpper(load(src + i)))) {
+      return true;
+    }
+  }
+  return scalar::hasUpper(src + i, len - i);
+}
+
+bool equalAsPaths(const char* a, const char* b, size_t len) {
+  size_t i = 0;
+  for (; i + kWidth <= len; i += kWidth) {
+    auto va = load(a + i);
+    auto vb = load(b + i);
+    auto same = either(eq(va, vb), both(isAnySlash(va), isAnySlash(vb)));
+    if (toMask(same) != kAllBytes) {
+      return false;
+    }
+  }
+  return scalar::equalAsPaths(a + i, b + i, len - i);
+}
+
+void replaceSlashes(char* dst, const char* src, size_t len, char sep) {
+  size_t i = 0;
+  auto replacement = splat(sep);
+  for (; i + kWidth <= len; i += kWidth) {
+    auto v = load(src + i);
+    store(dst + i, select(isAnySlash(v), replacement, v));
+  }
+  scalar::replaceSlashes(dst + i, src + i, len - i, sep);
+}
+
+#else
+const char* findLastSlash(const char* begin, const char* end) {
+  return scalar::findLastSlash(begin, end);
+}
+
+const char* findLastSlashOrDot(const char* begin, const char* end) {
+  return scalar::findLastSlashOrDot(begin, end);
+}
+
+void toLower(char* dst, const char* src, size_t len) {
+  scalar::toLower(dst, src, len);
+}
+
+bool equalCaseless(const char* a, const char* b, size_t len) {
+  return scalar::equalCaseless(a, b, len);
+}
+
+bool hasUpper(const char* src, size_t len) {
+  return scalar::hasUpper(src, len);
+}
+
+bool equalAsPaths(const char* a, const char* b, size_t len) {
+  return scalar::equalAsPaths(a, b, len);
+}
+
+void replaceSlashes(char* dst, const char* src, size_t len, char sep) {
+  scalar::replaceSlashes(dst, src, len, sep);
+}
+#endif
+
+} // namespace strscan
+} // namespace watchman
@@ -0,0 +1,65 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <cstddef>
+
+namespace watchman {
+
+// The byte loops behind the path and case folding methods of w_string and
+// w_string_piece, which run for every event and for every file that a
+// query looks at.  They look at 16 bytes at a time with SSE2 on x86-64 and
+// with NEON on aarch64, and a byte at a time elsewhere.  The scalar forms
+// are also available, in namespace scalar, so that the two can be checked
+// against each other and compared, as tests/string_bench.cpp does.
+//
+// Case folding is of ASCII only, which is what tolower() does in the "C"
+// locale that the server runs in.
+namespace strscan {
+
+// Returns the last dir separator, as is_slash() defines them, in
+// [begin, end), or nullptr if there is none
+const char* findLastSlash(const char* begin, const char* end);
+
+// Returns the last dir separator or '.' in [begin, end), or nullptr if
+// there is neither
+const char* findLastSlashOrDot(const char* begin, const char* end);
+
+// Writes the lowercase form of the len bytes at src to dst, which may be
+// the same as src
+void toLower(char* dst, const char* src, size_t len);
+
+// Returns true if the len bytes at a and b are equal once lowercased
+bool equalCaseless(const char* a, const char* b, size_t len);
+
+// Returns true if any of the len bytes at src is upper case, which is to
+// say that lowercasing them would change them
+bool hasUpper(const char* src, size_t len);
+
+// Returns true if the len bytes at a and b are equal, treating '/' and
+// '\\' as equal to each other
+bool equalAsPaths(const char* a, const char* b, size_t len);
+
+// Writes the len bytes at src to dst, which may be the same as src, with
+// each '/' and '\\' replaced by sep
+void replaceSlashes(char* dst, const char* src, size_t len, char sep);
+
+// Returns the first occurrence of the needle in the haystack, or nullptr.
+// This is for systems without memmem.
+const char* find(
+    const char* haystack,
+    size_t haystackLen,
+    const char* needle,
+    size_t needleLen);
+
+namespace scalar {
+const char* findLastSlash(const char* begin, const char* end);
+const char* findLastSlashOrDot(const char* begin, const char* end);
+void toLower(char* dst, const char* src, size_t len);
+bool equalCaseless(const char* a, const char* b, size_t len);
+bool hasUpper(const char* src, size_t len);
+bool equalAsPaths(const char* a, const char* b, size_t len);
+void replaceSlashes(char* dst, const char* src, size_t len, char sep);
+} // namespace scalar
+
+} // namespace strscan
+} // namespace watchman
@@ -0,0 +1,99 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+
+namespace watchman {
+
+/** SuffixList holds the nodes of a view whose names have a particular
+ * suffix, so that the suffix generator can visit them with a sequential
+ * scan rather than by chasing a pointer from each node to the next.
+ *
+ * Removing a node clears the slot that held it rather than moving the
+ * nodes that follow it, leaving a hole that compact() squeezes out.
+ * compact() is triggered automatically once the list has grown to twice
+ * its size after the previous compaction, and age out also calls it once
+ * it has removed a batch of nodes.
+ *
+ * Node must have a member of type `Node**`, named by Slot, that is
+ * initialized to nullptr; the list maintains it so that a node can clear
+ * its slot without a search.  A node that is held by lists of more than
+ * one kind needs a distinct Slot member for each kind.  A node must be
+ * passed to unlink() before it is destroyed.
+ *
+ * Slots live in a std::deque so that adding never moves existing slots
+ * and the slot pointers remain valid.
+ */
+template <typename Node, Node** Node::*Slot = &Node::suffix_slot>
+class SuffixList {
+ public:
+  SuffixList() = default;
+  SuffixList(const SuffixList&) = delete;
+  SuffixList& operator=(const SuffixList&) = delete;
+
+  /** Adds node, which must not already be in a list */
+  void add(Node* node) {
+    if (slots_.size() >= compactThreshold_) {
+      compact();
+    }
+    slots_.push_back(node);
+    node->*Slot = &slots_.back();
+  }
+
+  /** Remove node from whichever list holds it, if any */
+  static void unlink(Node* node) {
+    if (node->*Slot) {
+      *(node->*Slot) = nullptr;
+      node->*Slot = nullptr;
+    }
+  }
+
+  /** Calls fn(node) for each node in the list, in the order in which they
+   * were added, until fn returns false.  fn must not add to or unlink
+   * nodes from the list. */
+  template <typename Fn>
+  void forEach(Fn&& fn) const {
+    for (auto node : slots_) {
+      if (node && !fn(node)) {
+        return;
+      }
+    }
+  }
+
+  /** Squeeze out the holes left behind by unlinked nodes.
+   * Returns the number of slots that were removed. */
+  size_t compact() {
+    std::deque<Node*> live;
+    for (auto node : slots_) {
+      if (node) {
+        live.push_back(node);
+        node->*Slot = &live.back();
+      }
+    }
+    auto removed = slots_.size() - live.size();
+    // Swapping a deque doesn't move its elements, so the slot pointers
+    // that we just assigned remain valid.
+    slots_.swap(live);
+    compactThreshold_ = std::max(kMinCompactThreshold, slots_.size() * 2);
+    return removed;
+  }
+
+  /** Returns the number of slots in the list, including holes */
+  size_t size() const {
+    return slots_.size();
+  }
+
+  bool empty() const {
+    return slots_.empty();
+  }
+
+ private:
+  static constexpr size_t kMinCompactThreshold = 64;
+
+  std::deque<Node*> slots_;
+  size_t compactThreshold_{kMinCompactThreshold};
+};
+
+} // namespace watchman
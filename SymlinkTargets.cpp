@@ -1,5 +1,6 @@
 #include "SymlinkTargets.h"
 #include <folly/ScopeGuard.h>
+#include <algorithm>
 #include <string>
 #include "FileSystem.h"
 #include "Logging.h"
@@ -19,11 +20,31 @@ std::size_t SymlinkTargetCacheKey::hashValue() const {
   return hash_128_to_64(w_string_hval(relativePath), otime.ticks);
 }
 
+namespace {
+// Links are read in batches of about this many, so that a tree with many
+// symlinks doesn't pay for a task per link
+constexpr size_t kMinBatchLinks = 16;
+constexpr size_t kMaxBatchLinks = 1024;
+
+size_t weighTarget(const SymlinkTargetCacheKey& key, const w_string& target) {
+  using Cache = ShardedLRUCache<SymlinkTargetCacheKey, w_string>::ShardType;
+  return Cache::kItemOverhead + key.relativePath.size() + target.size();
+}
+} // namespace
+
 SymlinkTargetCache::SymlinkTargetCache(
     const w_string& rootPath,
     size_t maxItems,
-    std::chrono::milliseconds errorTTL)
-    : cache_(maxItems, errorTTL), rootPath_(rootPath) {}
+    std::chrono::milliseconds errorTTL,
+    size_t maxBytes,
+    std::shared_ptr<CacheMemoryBudget> budget)
+    : cache_(
+          maxItems,
+          errorTTL,
+          (maxBytes > 0 || budget) ? weighTarget : nullptr,
+          maxBytes,
+          std::move(budget)),
+      rootPath_(rootPath) {}
 
 folly::Future<std::shared_ptr<const Node>> SymlinkTargetCache::get(
     const SymlinkTargetCacheKey& key) {
@@ -31,6 +52,107 @@ folly::Future<std::shared_ptr<const Node>> SymlinkTargetCache::get(
       key, [this](const SymlinkTargetCacheKey& k) { return readLink(k); });
 }
 
+namespace {
+// Fulfils the promises of a batch of misses, which are sorted by dir
+template <typename Batch>
+void readLinkBatch(const SymlinkTargetCache& cache, Batch& batch) {
+#ifndef _WIN32
+  bool first = true;
+  w_string_piece openDirName;
+  FileDescriptor dirFd;
+  for (auto& miss : batch) {
+    w_string_piece relativePath(miss.key.relativePath);
+    auto dirName = relativePath.dirName();
+    if (first || dirName != openDirName) {
+      first = false;
+      openDirName = dirName;
+      try {
+        dirFd = openFileHandle(
+            w_string::pathCat({cache.rootPath(), dirName}).c_str(),
+            OpenFileHandleOptions::strictOpenDir());
+      } catch (const std::exception&) {
+        // Reading the links by their full paths reports the error
+        dirFd = FileDescriptor();
+      }
+    }
+    miss.promise.setWith([&] {
+      if (!dirFd) {
+        return cache.readLinkImmediate(miss.key);
+      }
+      return readSymbolicLinkAt(
+          dirFd.fd(), relativePath.baseName().asWString().c_str());
+    });
+  }
+#else
+  for (auto& miss : batch) {
+    miss.promise.setWith([&] { return cache.readLinkImmediate(miss.key); });
+  }
+#endif
+}
+} // namespace
+
+std::vector<folly::Future<std::shared_ptr<const Node>>>
+SymlinkTargetCache::getBatch(
+    const std::vector<SymlinkTargetCacheKey>& keys,
+    ThreadPool::Priority priority) {
+  struct Miss {
+    SymlinkTargetCacheKey key;
+    folly::Promise<w_string> promise;
+  };
+  using Batch = std::vector<Miss>;
+
+  std::vector<Miss> misses;
+  std::vector<folly::Future<std::shared_ptr<const Node>>> futures;
+  futures.reserve(keys.size());
+  for (auto& key : keys) {
+    futures.emplace_back(
+        cache_.get(key, [&misses](const SymlinkTargetCacheKey& k) {
+          misses.push_back(Miss{k, folly::Promise<w_string>()});
+          return misses.back().promise.getFuture();
+        }));
+  }
+  if (misses.empty()) {
+    return futures;
+  }
+
+  // Keep the links in the same dir together, so that each batch opens
+  // as few dirs as possible
+  std::sort(misses.begin(), misses.end(), [](const Miss& a, const Miss& b) {
+    return w_string_piece(a.key.relativePath).dirName() <
+        w_string_piece(b.key.relativePath).dirName();
+  });
+
+  auto workers = std::max(getThreadPool().numWorkers(), size_t(1));
+  auto batchSize = std::min(
+      std::max(misses.size() / (workers * 2), kMinBatchLinks),
+      kMaxBatchLinks);
+
+  auto schedule = [this, priority](std::shared_ptr<Batch> batch) {
+    try {
+      getThreadPool().add(priority, this, [this, batch] {
+        readLinkBatch(*this, *batch);
+      });
+    } catch (const std::exception& exc) {
+      for (auto& miss : *batch) {
+        miss.promise.setException(
+            folly::exception_wrapper(std::current_exception(), exc));
+      }
+    }
+  };
+
+  auto batch = std::make_shared<Batch>();
+  for (auto& miss : misses) {
+    if (batch->size() >= batchSize) {
+      schedule(std::move(batch));
+      batch = std::make_shared<Batch>();
+    }
+    batch->push_back(std::move(miss));
+  }
+  schedule(std::move(batch));
+
+  return futures;
+}
+
 w_string SymlinkTargetCache::readLinkImmediate(
     const SymlinkTargetCacheKey& key) const {
   auto fullPath = w_string::pathCat({rootPath_, key.relativePath});
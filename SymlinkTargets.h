@@ -4,6 +4,7 @@
 #include <string>
 #include "Clock.h"
 #include "LRUCache.h"
+#include "ThreadPool.h"
 #include "thirdparty/jansson/jansson.h"
 
 namespace watchman {
@@ -31,15 +32,19 @@ struct hash<watchman::SymlinkTargetCacheKey> {
 namespace watchman {
 class SymlinkTargetCache {
  public:
-  using Node = LRUCache<SymlinkTargetCacheKey, w_string>::NodeType;
+  using Node = ShardedLRUCache<SymlinkTargetCacheKey, w_string>::NodeType;
 
   // Construct a cache for a given root, holding the specified
   // maximum number of items, using the configured negative
-  // caching TTL.
+  // caching TTL.  If maxBytes is not 0, the estimated size of the
+  // items is limited to it too.  If budget is provided, that size
+  // is charged to it.
   SymlinkTargetCache(
       const w_string& rootPath,
       size_t maxItems,
-      std::chrono::milliseconds errorTTL);
+      std::chrono::milliseconds errorTTL,
+      size_t maxBytes = 0,
+      std::shared_ptr<CacheMemoryBudget> budget = nullptr);
 
   // Obtain the content hash for the given input.
   // If the result is in the cache it will return a ready future
@@ -49,6 +54,14 @@ class SymlinkTargetCache {
   folly::Future<std::shared_ptr<const Node>> get(
       const SymlinkTargetCacheKey& key);
 
+  // Obtain the targets for a set of inputs, returning a future for each
+  // of them in the same order.  The links that are not cached are
+  // grouped by their parent dir and read in the thread pool in batches,
+  // relative to a handle on the dir, rather than a task per link.
+  std::vector<folly::Future<std::shared_ptr<const Node>>> getBatch(
+      const std::vector<SymlinkTargetCacheKey>& keys,
+      ThreadPool::Priority priority = ThreadPool::Priority::Interactive);
+
   // Read the symlink target.
   // This will block the calling thread while the I/O is performed.
   // Throws exceptions for any errors that may occur.
@@ -65,7 +78,7 @@ class SymlinkTargetCache {
   CacheStats stats() const;
 
  private:
-  LRUCache<SymlinkTargetCacheKey, w_string> cache_;
+  ShardedLRUCache<SymlinkTargetCacheKey, w_string> cache_;
   w_string rootPath_;
 };
 } // namespace watchman
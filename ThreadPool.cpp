@@ -1,10 +1,18 @@
 /* Copyright 2017-present Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 */
 #include "ThreadPool.h"
+#include "CpuAffinity.h"
 #include "Logging.h"
 
 namespace watchman {
 
+namespace {
+// The pool and the index of the worker that the calling thread is, if
+// it is one
+thread_local ThreadPool* currentPool{nullptr};
+thread_local size_t currentWorker{0};
+} // namespace
+
 ThreadPool& getThreadPool() {
   static ThreadPool pool;
   return pool;
@@ -24,29 +32,118 @@ void ThreadPool::start(size_t numWorkers, size_t maxItems) {
   }
   maxItems_ = maxItems;
 
+  // The workers look at each other's queues, so they must all exist
+  // before any of them starts
+  for (auto i = 0U; i < numWorkers; ++i) {
+    workers_.emplace_back(std::make_unique<Worker>());
+  }
   for (auto i = 0U; i < numWorkers; ++i) {
-    workers_.emplace_back([ this, i ]() noexcept {
+    workers_[i]->thread = std::thread([this, i]() noexcept {
       w_set_thread_name("ThreadPool-", i);
-      runWorker();
+      placePoolThread();
+      runWorker(i);
     });
   }
 }
 
-void ThreadPool::runWorker() {
-  while (true) {
-    folly::Func task;
+void ThreadPool::FairQueue::push(Key key, folly::Func func) {
+  auto& queue = tasks[key];
+  if (queue.empty()) {
+    keys.push_back(key);
+  }
+  queue.emplace_back(std::move(func));
+}
 
+folly::Func ThreadPool::FairQueue::pop() {
+  // Take the next task of the key at the front, and send the key to the
+  // back if it has more
+  auto key = keys.front();
+  keys.pop_front();
+  auto it = tasks.find(key);
+  auto func = std::move(it->second.front());
+  it->second.pop_front();
+  if (it->second.empty()) {
+    tasks.erase(it);
+  } else {
+    keys.push_back(key);
+  }
+  return func;
+}
+
+folly::Func ThreadPool::takeTask(size_t index) {
+  auto& self = *workers_[index];
+  folly::Func task;
+
+  for (size_t priority = 0; priority < 2 && !task; ++priority) {
+    // Our own tasks first, newest first, as they are the most likely to
+    // be working on data that is still in our cache
     {
-      std::unique_lock<std::mutex> lock(mutex_);
-      condition_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
-      if (stopping_ && tasks_.empty()) {
-        return;
+      std::lock_guard<std::mutex> lock(self.mutex);
+      auto& local = self.local[priority];
+      if (!local.empty()) {
+        task = std::move(local.back());
+        local.pop_back();
+      }
+    }
+    if (!task) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!shared_[priority].empty()) {
+        task = shared_[priority].pop();
       }
-      task = std::move(tasks_.front());
-      tasks_.pop_front();
+    }
+    // Then the oldest of those of the other workers
+    for (size_t i = 1; i < workers_.size() && !task; ++i) {
+      auto& victim = *workers_[(index + i) % workers_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      auto& local = victim.local[priority];
+      if (!local.empty()) {
+        task = std::move(local.front());
+        local.pop_front();
+      }
+    }
+  }
+
+  if (task && queued_-- == maxItems_) {
+    // There may be a thread waiting for room in the queue
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+    }
+    spaceCondition_.notify_all();
+  }
+  return task;
+}
+
+void ThreadPool::runWorker(size_t index) {
+  currentPool = this;
+  currentWorker = index;
+
+  while (true) {
+    auto task = takeTask(index);
+    if (task) {
+      task();
+      continue;
     }
 
-    task();
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++sleepers_;
+    condition_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+    --sleepers_;
+    if (stopping_ && queued_ == 0) {
+      return;
+    }
+  }
+}
+
+void ThreadPool::wakeWorker() {
+  // Adders bump queued_ before looking at sleepers_, and workers bump
+  // sleepers_ before looking at queued_, so at least one of them sees
+  // the other.  Taking the lock ensures that a worker that is about to
+  // sleep is waiting by the time that we notify it.
+  if (sleepers_ > 0) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+    }
+    condition_.notify_one();
   }
 }
 
@@ -56,27 +153,60 @@ void ThreadPool::stop(bool join) {
     stopping_ = true;
   }
   condition_.notify_all();
+  spaceCondition_.notify_all();
 
   if (join) {
     for (auto& worker : workers_) {
-      worker.join();
+      if (worker->thread.joinable()) {
+        worker->thread.join();
+      }
     }
   }
 }
 
+size_t ThreadPool::numWorkers() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return workers_.size();
+}
+
 void ThreadPool::add(folly::Func func) {
+  add(Priority::Interactive, nullptr, std::move(func));
+}
+
+void ThreadPool::addWithPriority(folly::Func func, int8_t priority) {
+  add(priority < folly::Executor::MID_PRI ? Priority::Background
+                                          : Priority::Interactive,
+      nullptr,
+      std::move(func));
+}
+
+void ThreadPool::add(Priority priority, Key key, folly::Func func) {
+  auto index = size_t(priority);
+
+  if (currentPool == this) {
+    // The queue of a stopping pool is drained before its workers exit,
+    // so there's no need to refuse the task
+    auto& self = *workers_[currentWorker];
+    {
+      std::lock_guard<std::mutex> lock(self.mutex);
+      self.local[index].emplace_back(std::move(func));
+    }
+    ++queued_;
+    wakeWorker();
+    return;
+  }
+
   {
     std::unique_lock<std::mutex> lock(mutex_);
-    if (stopping_) {
-      throw std::runtime_error("cannot add tasks after pool has stopped");
-    }
-    if (tasks_.size() + 1 >= maxItems_) {
-      throw std::runtime_error("thread pool queue is full");
+    spaceCondition_.wait(lock, [this] {
+      return stopping_ || workers_.empty() || queued_ < maxItems_;
+    });
+    if (stopping_ || workers_.empty()) {
+      throw std::runtime_error("pool is not running");
     }
-
-    tasks_.emplace_back(std::move(func));
+    shared_[index].push(key, std::move(func));
+    ++queued_;
   }
-
-  condition_.notify_one();
+  wakeWorker();
 }
 } // namespace watchman
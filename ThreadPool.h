@@ -3,39 +3,54 @@
 #pragma once
 #include "watchman_system.h" // to avoid system header ordering issue on win32
 #include <folly/Executor.h>
+#include <atomic>
 #include <condition_variable>
 #include <deque>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 namespace watchman {
 
-// Almost the dumbest possible thread pool implementation.
-// This allows us to set an upper bound on the number of concurrent
-// tasks that are executed in the thread pool.  Contrast with
-// std::async which leaves it to the implementation to decide
-// whether each async invocation spawns a thread or uses a
-// thread pool with an unspecified number of threads.
-// Constraining the concurrency is important for watchman so
-// that we can limit the amount of I/O that we might induce.
-
+// A thread pool that sets an upper bound on the number of concurrent
+// tasks that are executed.  Contrast with std::async which leaves it to
+// the implementation to decide whether each async invocation spawns a
+// thread or uses a thread pool with an unspecified number of threads.
+// Constraining the concurrency is important for watchman so that we can
+// limit the amount of I/O that we might induce.
+//
+// Tasks have one of two priorities: the workers start every queued
+// interactive task, such as hashing files for a query, before any
+// background one, such as warming a cache or saving it to disk.  Within
+// a priority the tasks are grouped by a key, typically the root that
+// they work on, and the workers take a task from each key in turn so
+// that one busy root doesn't hold up the others.
+//
+// Each worker also has its own queue for the tasks that it adds while
+// running a task, such as the parts of a divided crawl or query.  It
+// runs those newest first, without contending with the other workers
+// for a lock, and idle workers steal the oldest of them.
 class ThreadPool : public folly::Executor {
  public:
+  enum class Priority { Interactive, Background };
+  using Key = const void*;
+
   ThreadPool() = default;
   ~ThreadPool() override;
 
   // Start a thread pool with the specified number of worker threads
   // and the specified upper bound on the number of queued jobs.
   // The queue limit is intended as a brake in case the system
-  // is under a heavy backlog, and can also help surface issues
-  // where there a task executing in the pool is blocking on
-  // the results of some other task also running in the thread
-  // pool.
+  // is under a heavy backlog: a thread outside of the pool that adds a
+  // task while it is full waits for there to be room.  A worker never
+  // waits, as the tasks ahead of it may be waiting for it; its task is
+  // queued regardless.
   void start(size_t numWorkers, size_t maxItems);
 
-  // Request that the worker threads terminate.
-  // If `join` is true, wait for the worker threads to terminate.
+  // Request that the worker threads terminate once the queued tasks are
+  // done.  If `join` is true, wait for the worker threads to terminate.
   void stop(bool join = true);
 
   // Run a function in the thread pool.
@@ -43,17 +58,60 @@ class ThreadPool : public folly::Executor {
   // may return before func has been executed.
   // If the thread pool has been stopped, throws a runtime_error.
   void add(folly::Func func) override;
+  // Like add(), except that a priority below folly's MID_PRI makes it a
+  // background task
+  void addWithPriority(folly::Func func, int8_t priority) override;
+  uint8_t getNumPriorities() const override {
+    return 2;
+  }
+  // Like add(), with the priority and fairness key of the task
+  void add(Priority priority, Key key, folly::Func func);
+
+  // Returns the number of worker threads
+  size_t numWorkers();
 
  private:
-  std::vector<std::thread> workers_;
-  std::deque<folly::Func> tasks_;
+  // Tasks grouped by their key, served a key at a time in turn
+  struct FairQueue {
+    std::unordered_map<Key, std::deque<folly::Func>> tasks;
+    std::deque<Key> keys;
+
+    bool empty() const {
+      return keys.empty();
+    }
+    void push(Key key, folly::Func func);
+    folly::Func pop();
+  };
+
+  struct Worker {
+    std::thread thread;
+    // The tasks that this worker added; protected by mutex
+    std::mutex mutex;
+    std::deque<folly::Func> local[2];
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  // The tasks that were added by other threads, by priority
+  FairQueue shared_[2];
 
+  // Protects shared_, stopping_ and the sleeping of the workers
   std::mutex mutex_;
   std::condition_variable condition_;
+  // Signalled when there is room in the queue
+  std::condition_variable spaceCondition_;
   bool stopping_{false};
-  size_t maxItems_;
+  size_t maxItems_{0};
+  // The tasks queued in shared_ and in the local queues of the workers
+  std::atomic<size_t> queued_{0};
+  // The workers that are waiting on condition_
+  std::atomic<size_t> sleepers_{0};
 
-  void runWorker();
+  void runWorker(size_t index);
+  // Takes the next task for the worker at index, or returns an empty
+  // function if there are none
+  folly::Func takeTask(size_t index);
+  // Wakes a sleeping worker, if there are any
+  void wakeWorker();
 };
 
 // Return a reference to the shared thread pool for the watchman process.
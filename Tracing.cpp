@@ -0,0 +1,256 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "Tracing.h"
+#include <folly/FileUtil.h>
+#include <folly/Synchronized.h>
+#include <folly/system/ThreadId.h>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Logging.h"
+#include "ThreadPool.h"
+
+namespace watchman {
+
+std::atomic<bool> Tracing::enabled_{false};
+
+namespace {
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+
+// The buffers of exited threads are kept, so that short lived threads,
+// such as those of clients, show up in the trace, but only this many
+constexpr size_t kMaxExitedBuffers = 64;
+constexpr size_t kDefaultSpansPerThread = 16384;
+constexpr std::chrono::minutes kMinDumpInterval(1);
+
+struct Span {
+  const char* name;
+  w_string detail;
+  steady_clock::time_point start;
+  steady_clock::duration duration;
+};
+
+struct ThreadBuffer {
+  explicit ThreadBuffer(size_t capacity)
+      : tid(folly::getOSThreadID()),
+        thread(Log::getThreadName()),
+        capacity(capacity) {}
+
+  const uint64_t tid;
+  const std::string thread;
+  const size_t capacity;
+  bool exited{false};
+
+  // The owning thread takes this to record, which is uncontended except
+  // while the trace is being read
+  std::mutex mutex;
+  std::vector<Span> spans;
+  // Where the next span goes once spans is at capacity
+  size_t next{0};
+};
+
+struct Registry {
+  std::deque<std::shared_ptr<ThreadBuffer>> buffers;
+  size_t spansPerThread{kDefaultSpansPerThread};
+  std::chrono::milliseconds slowThreshold{0};
+  w_string dumpDir;
+  steady_clock::time_point lastDump;
+};
+
+folly::Synchronized<Registry, std::mutex>& registry() {
+  static auto* registry = new folly::Synchronized<Registry, std::mutex>();
+  return *registry;
+}
+
+// Registers the buffer of the thread on its first span, and retires it
+// when the thread exits
+struct ThreadBufferHolder {
+  std::shared_ptr<ThreadBuffer> buffer;
+
+  ThreadBuffer& get() {
+    if (!buffer) {
+      auto reg = registry().lock();
+      buffer = std::make_shared<ThreadBuffer>(reg->spansPerThread);
+      reg->buffers.push_back(buffer);
+    }
+    return *buffer;
+  }
+
+  ~ThreadBufferHolder() {
+    if (!buffer) {
+      return;
+    }
+    auto reg = registry().lock();
+    buffer->exited = true;
+    size_t exited = 0;
+    for (auto& b : reg->buffers) {
+      exited += b->exited;
+    }
+    // The oldest buffers are at the front
+    for (auto it = reg->buffers.begin();
+         exited > kMaxExitedBuffers && it != reg->buffers.end();) {
+      if ((*it)->exited) {
+        it = reg->buffers.erase(it);
+        --exited;
+      } else {
+        ++it;
+      }
+    }
+  }
+};
+
+thread_local ThreadBufferHolder threadBuffer;
+
+uint64_t micros(steady_clock::duration d) {
+  return duration_cast<microseconds>(d).count();
+}
+} // namespace
+
+void Tracing::setEnabled(bool enabled) {
+  enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void Tracing::setBufferSize(size_t spansPerThread) {
+  registry().lock()->spansPerThread = std::max(spansPerThread, size_t(1));
+}
+
+void Tracing::setSlowDump(std::chrono::milliseconds threshold, w_string dir) {
+  auto reg = registry().lock();
+  reg->slowThreshold = threshold;
+  reg->dumpDir = std::move(dir);
+}
+
+void Tracing::record(
+    const char* name,
+    steady_clock::time_point start,
+    steady_clock::time_point end,
+    w_string&& detail,
+    bool dumpIfSlow) {
+  auto& buffer = threadBuffer.get();
+  {
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    Span span{name, std::move(detail), start, end - start};
+    if (buffer.spans.size() < buffer.capacity) {
+      buffer.spans.push_back(std::move(span));
+    } else {
+      buffer.spans[buffer.next] = std::move(span);
+      buffer.next = (buffer.next + 1) % buffer.capacity;
+    }
+  }
+
+  if (!dumpIfSlow) {
+    return;
+  }
+  {
+    auto reg = registry().lock();
+    if (reg->slowThreshold.count() == 0 || !reg->dumpDir ||
+        end - start <= reg->slowThreshold ||
+        (reg->lastDump != steady_clock::time_point() &&
+         end - reg->lastDump < kMinDumpInterval)) {
+      return;
+    }
+    reg->lastDump = end;
+  }
+
+  auto tookMs =
+      duration_cast<std::chrono::milliseconds>(end - start).count();
+  auto reason = w_string::build(name, " took ", tookMs, "ms");
+  try {
+    getThreadPool().add(ThreadPool::Priority::Background, nullptr, [reason] {
+      dumpToFile(reason);
+    });
+  } catch (const std::exception&) {
+    // The pool is stopping
+  }
+}
+
+json_ref Tracing::toTraceEvents() {
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    auto reg = registry().lock();
+    buffers.assign(reg->buffers.begin(), reg->buffers.end());
+  }
+
+  auto pid = json_integer(getpid());
+  auto events = json_array();
+  for (auto& buffer : buffers) {
+    auto tid = json_integer(buffer->tid);
+    json_array_append_new(
+        events,
+        json_object(
+            {{"name", typed_string_to_json("thread_name", W_STRING_UNICODE)},
+             {"ph", typed_string_to_json("M", W_STRING_UNICODE)},
+             {"pid", pid},
+             {"tid", tid},
+             {"args",
+              json_object(
+                  {{"name",
+                    typed_string_to_json(
+                        buffer->thread.c_str(), W_STRING_UNICODE)}})}}));
+
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    for (size_t i = 0; i < buffer->spans.size(); ++i) {
+      auto& span = buffer->spans[(buffer->next + i) % buffer->spans.size()];
+      auto event = json_object(
+          {{"name", typed_string_to_json(span.name, W_STRING_UNICODE)},
+           {"ph", typed_string_to_json("X", W_STRING_UNICODE)},
+           {"ts", json_integer(micros(span.start.time_since_epoch()))},
+           {"dur", json_integer(micros(span.duration))},
+           {"pid", pid},
+           {"tid", tid}});
+      if (span.detail) {
+        event.set(
+            "args", json_object({{"detail", w_string_to_json(span.detail)}}));
+      }
+      json_array_append_new(events, std::move(event));
+    }
+  }
+  return events;
+}
+
+void Tracing::clear() {
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    auto reg = registry().lock();
+    buffers.assign(reg->buffers.begin(), reg->buffers.end());
+  }
+  for (auto& buffer : buffers) {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    buffer->spans.clear();
+    buffer->next = 0;
+  }
+}
+
+w_string Tracing::dumpToFile(w_string_piece reason) {
+  auto dir = registry().lock()->dumpDir;
+  if (!dir) {
+    return nullptr;
+  }
+  auto path = w_string::build(
+      dir,
+      "/trace-",
+      getpid(),
+      "-",
+      duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count(),
+      ".json");
+
+  auto trace = json_object(
+      {{"traceEvents", toTraceEvents()},
+       {"displayTimeUnit", typed_string_to_json("ms", W_STRING_UNICODE)}});
+  try {
+    folly::writeFileAtomic(
+        path.c_str(), json_dumps(trace, JSON_COMPACT), 0600);
+  } catch (const std::exception& exc) {
+    log(ERR, "failed to write the trace to ", path, ": ", exc.what(), "\n");
+    return nullptr;
+  }
+  log(ERR, "wrote the trace to ", path, " because ", reason, "\n");
+  return path;
+}
+
+} // namespace watchman
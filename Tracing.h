@@ -0,0 +1,89 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <atomic>
+#include <chrono>
+#include <string>
+#include "watchman_string.h"
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// Records spans, such as a query being executed or the IO thread
+// processing a batch of pending paths, into a ring buffer per thread, so
+// that the recent history of the server can be viewed on a timeline in
+// chrome://tracing or Perfetto.  Tracing is off by default, in which case
+// a TraceSpan costs a relaxed load.
+class Tracing {
+ public:
+  static bool enabled() {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+  static void setEnabled(bool enabled);
+
+  // Sets the number of spans that each thread keeps; older spans are
+  // overwritten.  Applies to the threads that record their first span
+  // after it is called.
+  static void setBufferSize(size_t spansPerThread);
+  // If a span that is marked as dumpIfSlow takes longer than threshold,
+  // the trace is written to a file in dir, at most once per minute.  A
+  // threshold of 0 disables this.
+  static void setSlowDump(std::chrono::milliseconds threshold, w_string dir);
+
+  static void record(
+      const char* name,
+      std::chrono::steady_clock::time_point start,
+      std::chrono::steady_clock::time_point end,
+      w_string&& detail,
+      bool dumpIfSlow);
+
+  // Returns the recorded spans as an array of Chrome trace events
+  static json_ref toTraceEvents();
+  static void clear();
+
+  // Writes the trace to a file in the slow dump dir and returns its path
+  static w_string dumpToFile(w_string_piece reason);
+
+ private:
+  static std::atomic<bool> enabled_;
+};
+
+// Records the time between its construction and destruction as a span
+// named name, annotated with detail, such as the root that it is for
+class TraceSpan {
+ public:
+  explicit TraceSpan(
+      const char* name,
+      w_string detail = nullptr,
+      bool dumpIfSlow = false)
+      : name_(Tracing::enabled() ? name : nullptr) {
+    if (name_) {
+      detail_ = std::move(detail);
+      dumpIfSlow_ = dumpIfSlow;
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~TraceSpan() {
+    if (name_) {
+      Tracing::record(
+          name_,
+          start_,
+          std::chrono::steady_clock::now(),
+          std::move(detail_),
+          dumpIfSlow_);
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  const char* name_;
+  w_string detail_;
+  bool dumpIfSlow_{false};
+  std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace watchman
@@ -0,0 +1,27 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <cstdint>
+
+namespace watchman {
+
+// Describes the files that exist beneath a dir, which the InMemoryView keeps
+// up to date as they change.  See watchman_dir::getTreeSummary().
+struct TreeSummary {
+  // A fingerprint of the names, types, sizes, modification times and inode
+  // numbers of the files, which changes whenever one of them does
+  uint64_t hash{0};
+  // The files other than dirs, and the dirs
+  uint64_t files{0};
+  uint64_t dirs{0};
+  // The total size of the files other than dirs
+  uint64_t bytes{0};
+  // The newest modification time of the files and dirs, or 0 if there are
+  // none
+  struct timespec newestMtime {
+    0, 0
+  };
+};
+
+} // namespace watchman
@@ -0,0 +1,91 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "TriggerScheduler.h"
+#include <algorithm>
+#include "watchman_config.h"
+
+namespace watchman {
+
+TriggerScheduler& getTriggerScheduler() {
+  static TriggerScheduler scheduler(size_t(
+      std::max(json_int_t(0), cfg_get_int("trigger_max_concurrent", 0))));
+  return scheduler;
+}
+
+TriggerScheduler::TriggerScheduler(size_t maxRunning)
+    : maxRunning_(maxRunning) {}
+
+std::unordered_map<TriggerScheduler::Key, TriggerScheduler::Waiter>::iterator
+TriggerScheduler::State::next() {
+  auto best = waiting.end();
+  for (auto it = waiting.begin(); it != waiting.end(); ++it) {
+    if (best == waiting.end() ||
+        it->second.priority > best->second.priority ||
+        (it->second.priority == best->second.priority &&
+         it->second.sequence < best->second.sequence)) {
+      best = it;
+    }
+  }
+  return best;
+}
+
+bool TriggerScheduler::tryAcquire(
+    Key key,
+    int priority,
+    std::function<void()> wake) {
+  auto state = state_.lock();
+
+  auto it = state->waiting.find(key);
+  if (it == state->waiting.end()) {
+    it = state->waiting
+             .emplace(
+                 key, Waiter{priority, state->nextSequence++, std::move(wake)})
+             .first;
+  } else {
+    // Keep its place in the queue
+    it->second.priority = priority;
+    it->second.wake = std::move(wake);
+  }
+
+  if ((maxRunning_ > 0 && state->running >= maxRunning_) ||
+      state->next() != it) {
+    return false;
+  }
+
+  state->waiting.erase(it);
+  ++state->running;
+
+  // There may be a slot left over for the next in line
+  if (maxRunning_ == 0 || state->running < maxRunning_) {
+    auto next = state->next();
+    if (next != state->waiting.end()) {
+      next->second.wake();
+    }
+  }
+  return true;
+}
+
+void TriggerScheduler::cancel(Key key) {
+  auto state = state_.lock();
+  state->waiting.erase(key);
+}
+
+void TriggerScheduler::release() {
+  auto state = state_.lock();
+  if (state->running > 0) {
+    --state->running;
+  }
+  auto next = state->next();
+  if (next != state->waiting.end()) {
+    next->second.wake();
+  }
+}
+
+json_ref TriggerScheduler::stats() {
+  auto state = state_.lock();
+  return json_object({{"running", json_integer(state->running)},
+                      {"waiting", json_integer(state->waiting.size())},
+                      {"max_running", json_integer(maxRunning_)}});
+}
+
+} // namespace watchman
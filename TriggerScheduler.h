@@ -0,0 +1,66 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <folly/Synchronized.h>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include "thirdparty/jansson/jansson.h"
+
+namespace watchman {
+
+// Limits how many trigger commands run at once across all of the
+// triggers.  A trigger that has a command to run asks for a slot; if
+// there is none to spare, or a trigger that comes before it is waiting
+// for one, it is queued, and its wake function is called once it is its
+// turn to ask again.  The triggers that are waiting are served in order
+// of priority, and then in the order that they asked.
+class TriggerScheduler {
+ public:
+  using Key = const void*;
+
+  // maxRunning of 0 doesn't limit the number of commands
+  explicit TriggerScheduler(size_t maxRunning);
+  TriggerScheduler(const TriggerScheduler&) = delete;
+  TriggerScheduler& operator=(const TriggerScheduler&) = delete;
+
+  // Takes a slot for key and returns true, or queues key and returns
+  // false.  wake is called, with the scheduler locked, when key should
+  // ask again.
+  bool tryAcquire(Key key, int priority, std::function<void()> wake);
+  // Takes key out of the queue, if it is waiting.  Once this returns,
+  // its wake function won't be called.
+  void cancel(Key key);
+  // Gives back a slot that tryAcquire took, and wakes the trigger that is
+  // next in line for it
+  void release();
+
+  // The number of commands that are running and of the triggers that are
+  // waiting to run one, for debugging
+  json_ref stats();
+
+ private:
+  struct Waiter {
+    int priority;
+    uint64_t sequence;
+    std::function<void()> wake;
+  };
+  struct State {
+    size_t running{0};
+    uint64_t nextSequence{0};
+    std::unordered_map<Key, Waiter> waiting;
+
+    // The waiting trigger that is next in line, or waiting.end()
+    std::unordered_map<Key, Waiter>::iterator next();
+  };
+
+  const size_t maxRunning_;
+  folly::Synchronized<State, std::mutex> state_;
+};
+
+// Return a reference to the scheduler of the triggers, whose limit is the
+// trigger_max_concurrent configuration option
+TriggerScheduler& getTriggerScheduler();
+
+} // namespace watchman
@@ -0,0 +1,159 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "WildMatcher.h"
+#include <folly/Range.h>
+#include <string.h>
+#include "GlobSuffixIndex.h"
+#include "thirdparty/wildmatch/wildmatch.h"
+
+namespace watchman {
+
+namespace {
+bool isSpecial(char c) {
+  return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+// Matches the case folding performed by wildmatch with WM_CASEFOLD
+char fold(char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A' + 'a';
+  }
+  return c;
+}
+
+std::string foldString(const char* begin, const char* end, bool caseFold) {
+  std::string result(begin, end);
+  if (caseFold) {
+    for (auto& c : result) {
+      c = fold(c);
+    }
+  }
+  return result;
+}
+} // namespace
+
+WildMatcher::WildMatcher(std::string pattern, int flags)
+    : pattern_(std::move(pattern)), flags_(flags) {
+  bool caseFold = flags_ & WM_CASEFOLD;
+  const char* begin = pattern_.data();
+  const char* end = begin + pattern_.size();
+
+  // The literal prefix ends at the first special.  A run of separators in
+  // the pattern matches a single separator, so it ends there as well.
+  const char* p = begin;
+  while (p < end && !isSpecial(*p)) {
+    if (*p == '/' && p + 1 < end && p[1] == '/') {
+      ++p;
+      break;
+    }
+    ++p;
+  }
+  prefix_ = foldString(begin, p, caseFold);
+
+  if (p == end) {
+    kind_ = Kind::Literal;
+    return;
+  }
+
+  auto tail = GlobSuffixIndex::literalTail(pattern_);
+  const char* tailBegin = tail.data();
+  suffix_ = foldString(tailBegin, end, caseFold);
+
+  if (p == begin && *p == '*' && tailBegin == begin + 1 && tail.size() > 0) {
+    kind_ = Kind::Suffix;
+    prefix_.clear();
+    return;
+  }
+
+  if (p + 2 == end && p[0] == '*' && p[1] == '*' && prefix_.size() >= 2 &&
+      prefix_.back() == '/' && prefix_[prefix_.size() - 2] != '/') {
+    kind_ = Kind::DirPrefix;
+    suffix_.clear();
+    return;
+  }
+
+  // The longest literal run between the prefix and the tail.  Character
+  // classes and escapes are not worth parsing for this, so the search
+  // stops at the first of those.  Matching case insensitively would need
+  // a folding substring search, so that doesn't get an inner literal.
+  if (caseFold) {
+    return;
+  }
+  const char* runBegin = p;
+  for (const char* q = p; q <= tailBegin; ++q) {
+    if (q == tailBegin || isSpecial(*q) || *q == '/') {
+      if (q - runBegin > ptrdiff_t(inner_.size())) {
+        inner_.assign(runBegin, q);
+      }
+      if (q == tailBegin || *q == '[' || *q == '\\') {
+        break;
+      }
+      runBegin = q + 1;
+    }
+  }
+}
+
+bool WildMatcher::equal(const char* text, const char* literal, size_t len)
+    const {
+  if (!(flags_ & WM_CASEFOLD)) {
+    return memcmp(text, literal, len) == 0;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    if (fold(text[i]) != literal[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool WildMatcher::match(w_string_piece subject) const {
+  const char* text = subject.data();
+  size_t len = subject.size();
+
+  switch (kind_) {
+    case Kind::Literal:
+      return len == prefix_.size() && equal(text, prefix_.data(), len);
+
+    case Kind::Suffix:
+      if (len < suffix_.size() ||
+          !equal(text + len - suffix_.size(), suffix_.data(), suffix_.size())) {
+        return false;
+      }
+      // A leading period has to be matched explicitly, not by the `*`
+      if ((flags_ & WM_PERIOD) && text[0] == '.') {
+        return false;
+      }
+      // and with WM_PATHNAME the `*` cannot match a separator
+      return !(flags_ & WM_PATHNAME) ||
+          memchr(text, '/', len - suffix_.size()) == nullptr;
+
+    case Kind::DirPrefix:
+      if (len < prefix_.size() ||
+          !equal(text, prefix_.data(), prefix_.size())) {
+        return false;
+      }
+      // The `**` matches everything below the dir, except that a name that
+      // immediately follows the separator cannot start with a period
+      return !(
+          (flags_ & WM_PERIOD) && (flags_ & WM_PATHNAME) &&
+          text[prefix_.size()] == '.');
+
+    case Kind::Generic:
+      if (len < prefix_.size() + suffix_.size() ||
+          !equal(text, prefix_.data(), prefix_.size()) ||
+          !equal(text + len - suffix_.size(), suffix_.data(), suffix_.size())) {
+        return false;
+      }
+      if (!inner_.empty()) {
+        folly::StringPiece middle(
+            text + prefix_.size(), text + len - suffix_.size());
+        if (middle.find(inner_) == folly::StringPiece::npos) {
+          return false;
+        }
+      }
+      return wildmatch(pattern_.c_str(), text, flags_, nullptr) == WM_MATCH;
+  }
+  return false;
+}
+
+} // namespace watchman
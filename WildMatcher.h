@@ -0,0 +1,62 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <string>
+#include "watchman_string.h"
+
+namespace watchman {
+
+// WildMatcher matches strings against a single wildmatch pattern.
+//
+// The pattern is analyzed once, up front.  Patterns that are a plain
+// literal or have the common `*.ext` and `dir/**` shapes are matched with
+// a couple of comparisons rather than by wildmatch.  For all other
+// patterns, the literal prefix, literal tail and longest inner literal are
+// extracted so that most non-matching strings are rejected with a memcmp
+// or a memchr driven substring search.  Only the strings that get past
+// those checks are handed to wildmatch, so the results are always the
+// same as those of calling wildmatch directly.
+class WildMatcher {
+ public:
+  // flags is a combination of the WM_XXX flags accepted by wildmatch
+  WildMatcher(std::string pattern, int flags);
+
+  // Returns true if subject matches the pattern.  Like wildmatch, this
+  // requires that subject is NUL terminated.
+  bool match(w_string_piece subject) const;
+
+  const std::string& pattern() const {
+    return pattern_;
+  }
+
+  // Whether the pattern has no specials, so that only a subject equal to
+  // it matches
+  bool isLiteral() const {
+    return kind_ == Kind::Literal;
+  }
+
+ private:
+  enum class Kind {
+    // No specials; the subject must be equal to the pattern
+    Literal,
+    // `*` followed by a literal without a separator
+    Suffix,
+    // A literal followed by `/**`
+    DirPrefix,
+    // Anything else; prefiltered and then run through wildmatch
+    Generic,
+  };
+
+  bool equal(const char* a, const char* b, size_t len) const;
+
+  std::string pattern_;
+  int flags_;
+  Kind kind_{Kind::Generic};
+  // Literals that a matching subject starts with, ends with and contains
+  // between the two.  For a Literal pattern, prefix_ holds all of it.
+  std::string prefix_;
+  std::string suffix_;
+  std::string inner_;
+};
+
+} // namespace watchman
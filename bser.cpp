@@ -2,6 +2,7 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include "PduBuffer.h"
 #include "thirdparty/jansson/jansson_private.h"
 
 /*
@@ -32,6 +33,15 @@
 #define BSER_TEMPLATE 0x0b
 #define BSER_SKIP 0x0c
 #define BSER_UTF8STRING 0x0d
+// The string dictionary of BSER v3.  A DEFINE is followed by a string
+// value, which is added to the dictionary of the PDU; a REF is followed by
+// the int index of a string in the dictionary; a PREFIXED is followed by
+// the int index of a string in the dictionary, the int length of the
+// prefix of it to use, and a string value to append to that prefix, and
+// the whole string is added to the dictionary.
+#define BSER_STRING_DEFINE 0x0e
+#define BSER_STRING_REF 0x0f
+#define BSER_STRING_PREFIXED 0x10
 
 static const char bser_true = BSER_TRUE;
 static const char bser_false = BSER_FALSE;
@@ -42,9 +52,25 @@ static const char bser_object_hdr = BSER_OBJECT;
 static const char bser_template_hdr = BSER_TEMPLATE;
 static const char bser_utf8string_hdr = BSER_UTF8STRING;
 static const char bser_skip = BSER_SKIP;
+static const char bser_string_define_hdr = BSER_STRING_DEFINE;
+static const char bser_string_ref_hdr = BSER_STRING_REF;
+static const char bser_string_prefixed_hdr = BSER_STRING_PREFIXED;
+
+// Strings shorter than this aren't worth adding to the dictionary
+static constexpr size_t kMinDictionaryString = 4;
+// The shortest prefix that is worth referring to rather than repeating
+static constexpr size_t kMinSharedPrefix = 4;
+
+struct bser_string_table {
+  std::unordered_map<w_string_piece, uint32_t> index;
+  // The most recently added string, which the next one is front coded
+  // against
+  w_string_piece last;
+  uint32_t size{0};
+};
 
 static bool is_bser_version_supported(const bser_ctx_t* ctx) {
-  return ctx->bser_version == 1 || ctx->bser_version == 2;
+  return ctx->bser_version >= 1 && ctx->bser_version <= 3;
 }
 
 static int bser_real(const bser_ctx_t* ctx, double val, void* data) {
@@ -186,15 +212,13 @@ static int bser_int(const bser_ctx_t* ctx, json_int_t val, void* data) {
   return ctx->dump(iptr, size, data);
 }
 
-static int bser_generic_string(
+// stable is set when str remains valid until the output is written
+static int bser_plain_string(
     const bser_ctx_t* ctx,
     w_string_piece str,
     void* data,
-    const char hdr) {
-  if (!is_bser_version_supported(ctx)) {
-    return -1;
-  }
-
+    const char hdr,
+    bool stable) {
   if (ctx->dump(&hdr, sizeof(hdr), data)) {
     return -1;
   }
@@ -203,25 +227,109 @@ static int bser_generic_string(
     return -1;
   }
 
-  if (ctx->dump(str.data(), str.size(), data)) {
+  auto dump = stable && ctx->dump_ref ? ctx->dump_ref : ctx->dump;
+  if (dump(str.data(), str.size(), data)) {
     return -1;
   }
 
   return 0;
 }
 
-static int
-bser_bytestring(const bser_ctx_t* ctx, w_string_piece str, void* data) {
-  return bser_generic_string(ctx, str, data, bser_bytestring_hdr);
+// Encodes str as a reference to an earlier copy of it in the dictionary,
+// or else adds it to the dictionary, front coded against the string added
+// before it when they share a dir prefix.
+static int bser_dictionary_string(
+    const bser_ctx_t* ctx,
+    w_string_piece str,
+    void* data,
+    const char hdr) {
+  auto table = ctx->strings;
+  auto it = table->index.find(str);
+  if (it != table->index.end()) {
+    if (ctx->dump(&bser_string_ref_hdr, sizeof(bser_string_ref_hdr), data)) {
+      return -1;
+    }
+    return bser_int(ctx, it->second, data);
+  }
+
+  // Only whole dirs are shared, which also keeps the suffix valid UTF-8
+  size_t shared = 0;
+  auto limit = std::min(table->last.size(), str.size());
+  while (shared < limit && table->last[shared] == str[shared]) {
+    ++shared;
+  }
+  while (shared > 0 && str[shared - 1] != '/') {
+    --shared;
+  }
+
+  auto lastIndex = table->size - 1;
+  table->index.emplace(str, table->size++);
+  table->last = str;
+
+  if (shared < kMinSharedPrefix) {
+    if (ctx->dump(
+            &bser_string_define_hdr, sizeof(bser_string_define_hdr), data)) {
+      return -1;
+    }
+    return bser_plain_string(ctx, str, data, hdr, true);
+  }
+  if (ctx->dump(
+          &bser_string_prefixed_hdr, sizeof(bser_string_prefixed_hdr), data) ||
+      bser_int(ctx, lastIndex, data) || bser_int(ctx, shared, data)) {
+    return -1;
+  }
+  return bser_plain_string(
+      ctx,
+      w_string_piece(str.data() + shared, str.size() - shared),
+      data,
+      hdr,
+      true);
 }
 
-static int
-bser_utf8string(const bser_ctx_t* ctx, w_string_piece str, void* data) {
+static int bser_generic_string(
+    const bser_ctx_t* ctx,
+    w_string_piece str,
+    void* data,
+    const char hdr,
+    bool stable) {
+  if (!is_bser_version_supported(ctx)) {
+    return -1;
+  }
+
+  // The table refers to the strings that it has seen, so only stable ones
+  // can be added to it
+  if (ctx->strings && stable && str.size() >= kMinDictionaryString) {
+    return bser_dictionary_string(ctx, str, data, hdr);
+  }
+  return bser_plain_string(ctx, str, data, hdr, stable);
+}
+
+static int bser_bytestring(
+    const bser_ctx_t* ctx,
+    w_string_piece str,
+    void* data,
+    bool stable = true) {
+  return bser_generic_string(ctx, str, data, bser_bytestring_hdr, stable);
+}
+
+static int bser_utf8string(
+    const bser_ctx_t* ctx,
+    w_string_piece str,
+    void* data,
+    bool stable = true) {
   if ((ctx->bser_capabilities & BSER_CAP_DISABLE_UNICODE) ||
       ctx->bser_version == 1) {
-    return bser_bytestring(ctx, str, data);
+    return bser_bytestring(ctx, str, data, stable);
   }
-  return bser_generic_string(ctx, str, data, bser_utf8string_hdr);
+  return bser_generic_string(ctx, str, data, bser_utf8string_hdr, stable);
+}
+
+// Object keys, and the keys of templates, are never in the dictionary
+static int bser_key(const bser_ctx_t* ctx, w_string_piece key, void* data) {
+  if (!is_bser_version_supported(ctx)) {
+    return -1;
+  }
+  return bser_plain_string(ctx, key, data, bser_bytestring_hdr, true);
 }
 
 static int
@@ -230,7 +338,7 @@ bser_mixedstring(const bser_ctx_t* ctx, w_string_piece str, void* data) {
       !(BSER_CAP_DISABLE_UNICODE_FOR_ERRORS & ctx->bser_capabilities) &&
       !(BSER_CAP_DISABLE_UNICODE & ctx->bser_capabilities)) {
     auto utf8_clean = str.asUTF8Clean();
-    return bser_utf8string(ctx, utf8_clean, data);
+    return bser_utf8string(ctx, utf8_clean, data, false);
   } else {
     return bser_bytestring(ctx, str, data);
   }
@@ -238,6 +346,13 @@ bser_mixedstring(const bser_ctx_t* ctx, w_string_piece str, void* data) {
 
 static int bser_array(const bser_ctx_t* ctx, const json_t* array, void* data);
 
+static int
+bser_template_keys(const bser_ctx_t* ctx, const json_t* templ, void* data) {
+  auto keysCtx = *ctx;
+  keysCtx.strings = nullptr;
+  return bser_array(&keysCtx, templ, data);
+}
+
 static int bser_template(
     const bser_ctx_t* ctx,
     const json_t* array,
@@ -255,7 +370,7 @@ static int bser_template(
   }
 
   // The template goes next
-  if (bser_array(ctx, templ, data)) {
+  if (bser_template_keys(ctx, templ, data)) {
     return -1;
   }
 
@@ -267,9 +382,11 @@ static int bser_template(
 
   pn = json_array_size(templ);
 
-  // For each object
+  // For each object.  The rows and their values are borrowed rather than
+  // referenced, as they may be arena values; see JsonArena.
+  auto& rows = json_to_array(array)->table;
   for (i = 0; i < n; i++) {
-    auto obj = json_array_get(array, i);
+    const json_t* obj = rows[i];
     size_t pi;
 
     // For each factored key
@@ -317,10 +434,9 @@ static int bser_array(const bser_ctx_t* ctx, const json_t* array, void* data) {
     return -1;
   }
 
+  auto& values = json_to_array(array)->table;
   for (i = 0; i < n; i++) {
-    auto val = json_array_get(array, i);
-
-    if (w_bser_dump(ctx, val, data)) {
+    if (w_bser_dump(ctx, values[i], data)) {
       return -1;
     }
   }
@@ -328,7 +444,7 @@ static int bser_array(const bser_ctx_t* ctx, const json_t* array, void* data) {
   return 0;
 }
 
-static int bser_object(const bser_ctx_t* ctx, const json_ref& obj, void* data) {
+static int bser_object(const bser_ctx_t* ctx, const json_t* obj, void* data) {
   size_t n;
 
   if (!is_bser_version_supported(ctx)) {
@@ -344,11 +460,11 @@ static int bser_object(const bser_ctx_t* ctx, const json_ref& obj, void* data) {
     return -1;
   }
 
-  for (auto& it : obj.object()) {
+  for (auto& it : json_to_object(obj)->map) {
     auto& key = it.first;
     auto& val = it.second;
 
-    if (bser_bytestring(ctx, key.c_str(), data)) {
+    if (bser_key(ctx, key.c_str(), data)) {
       return -1;
     }
     if (w_bser_dump(ctx, val, data)) {
@@ -359,7 +475,7 @@ static int bser_object(const bser_ctx_t* ctx, const json_ref& obj, void* data) {
   return 0;
 }
 
-int w_bser_dump(const bser_ctx_t* ctx, const json_ref& json, void* data) {
+int w_bser_dump(const bser_ctx_t* ctx, const json_t* json, void* data) {
   int type = json_typeof(json);
 
   if (!is_bser_version_supported(ctx)) {
@@ -376,21 +492,9 @@ int w_bser_dump(const bser_ctx_t* ctx, const json_ref& json, void* data) {
     case JSON_REAL:
       return bser_real(ctx, json_real_value(json), data);
     case JSON_INTEGER:
-      return bser_int(ctx, json.asInt(), data);
-    case JSON_STRING: {
-      auto& wstr = json_to_w_string(json);
-      switch (wstr.type()) {
-        case W_STRING_BYTE:
-          return bser_bytestring(ctx, wstr, data);
-        case W_STRING_UNICODE:
-          return bser_utf8string(ctx, wstr, data);
-        case W_STRING_MIXED:
-          return bser_mixedstring(ctx, wstr, data);
-        default:
-          w_assert(false, "unknown string type 0x%02x", wstr.type());
-          return -1;
-      }
-    }
+      return bser_int(ctx, json_integer_value(json), data);
+    case JSON_STRING:
+      return w_bser_dump_string(ctx, json_to_w_string(json), data);
     case JSON_ARRAY:
       return bser_array(ctx, json, data);
     case JSON_OBJECT:
@@ -400,65 +504,261 @@ int w_bser_dump(const bser_ctx_t* ctx, const json_ref& json, void* data) {
   }
 }
 
-static int measure(const char*, size_t size, void* ptr) {
-  auto tot = (json_int_t*)ptr;
-  *tot += size;
+static int append_to_string(const char* buf, size_t size, void* data) {
+  static_cast<std::string*>(data)->append(buf, size);
   return 0;
 }
 
-int w_bser_write_pdu(
+// Encodes the PDU header followed by the body that dumpBody writes into
+// buffer.  The size of the body isn't known until it has been written, so
+// space for the largest encoding of it is set aside and then filled in
+// with the smallest encoding of the actual size, as a measuring pass
+// would have produced.
+template <typename DumpBody>
+static int encode_pdu(
     const uint32_t bser_version,
     const uint32_t bser_capabilities,
-    json_dump_callback_t dump,
-    const json_ref& json,
-    void* data) {
-  json_int_t m_size = 0;
-  bser_ctx_t ctx{bser_version, bser_capabilities, measure};
+    DumpBody&& dumpBody,
+    bser_string_table* strings,
+    watchman::PduBuffer& buffer) {
+  using watchman::PduBuffer;
+  bser_ctx_t ctx{bser_version,
+                 bser_capabilities,
+                 PduBuffer::appendCallback,
+                 PduBuffer::appendReferenceCallback,
+                 strings};
 
   if (!is_bser_version_supported(&ctx)) {
     return -1;
   }
 
-  if (w_bser_dump(&ctx, json, &m_size)) {
+  if (bser_version == 1) {
+    buffer.append(BSER_MAGIC, 2);
+  } else {
+    buffer.append(bser_version == 2 ? BSER_V2_MAGIC : BSER_V3_MAGIC, 2);
+    buffer.append((const char*)&bser_capabilities, sizeof(bser_capabilities));
+  }
+
+  auto header = buffer.reserve(1 + sizeof(int64_t));
+  auto bodyStart = buffer.size();
+  if (dumpBody(&ctx, &buffer)) {
     return -1;
   }
 
-  // To actually write the contents
-  ctx.dump = dump;
+  std::string size;
+  bser_ctx_t sizeCtx{bser_version, bser_capabilities, append_to_string};
+  if (bser_int(&sizeCtx, buffer.size() - bodyStart, &size)) {
+    return -1;
+  }
+  buffer.patch(header, size.data(), size.size());
+  return 0;
+}
 
-  if (bser_version == 2) {
-    if (dump(BSER_V2_MAGIC, 2, data)) {
+static int encode_object_with_encoded_member(
+    const bser_ctx_t* ctx,
+    const json_ref& json,
+    const w_string& key,
+    w_string_piece encoded,
+    void* data) {
+  if (ctx->dump(&bser_object_hdr, sizeof(bser_object_hdr), data)) {
+    return -1;
+  }
+  if (bser_int(ctx, json_object_size(json) + 1, data)) {
+    return -1;
+  }
+  for (auto& it : json.object()) {
+    if (bser_key(ctx, it.first, data)) {
       return -1;
     }
-  } else {
-    if (dump(BSER_MAGIC, 2, data)) {
+    if (w_bser_dump(ctx, it.second, data)) {
       return -1;
     }
   }
+  if (bser_key(ctx, key, data)) {
+    return -1;
+  }
+  auto dump = ctx->dump_ref ? ctx->dump_ref : ctx->dump;
+  return dump(encoded.data(), encoded.size(), data);
+}
 
-  if (bser_version == 2) {
-    if (dump(
-            (const char*)&bser_capabilities, sizeof(bser_capabilities), data)) {
+int w_bser_encode_pdu(
+    const uint32_t bser_version,
+    const uint32_t bser_capabilities,
+    const json_ref& json,
+    watchman::PduBuffer& buffer) {
+  bser_string_table strings;
+  return encode_pdu(
+      bser_version,
+      bser_capabilities,
+      [&](const bser_ctx_t* ctx, void* data) {
+        return w_bser_dump(ctx, json, data);
+      },
+      bser_version == 3 ? &strings : nullptr,
+      buffer);
+}
+
+int w_bser_encode_pdu_with_encoded_member(
+    const uint32_t bser_version,
+    const uint32_t bser_capabilities,
+    const json_ref& json,
+    const w_string& key,
+    w_string_piece encoded,
+    watchman::PduBuffer& buffer) {
+  return encode_pdu(
+      bser_version,
+      bser_capabilities,
+      [&](const bser_ctx_t* ctx, void* data) {
+        return encode_object_with_encoded_member(
+            ctx, json, key, encoded, data);
+      },
+      // The encoded member was encoded without the dictionary, and the
+      // members before it must not add strings that it doesn't know about
+      nullptr,
+      buffer);
+}
+
+int w_bser_write_pdu(
+    const uint32_t bser_version,
+    const uint32_t bser_capabilities,
+    json_dump_callback_t dump,
+    const json_ref& json,
+    void* data) {
+  watchman::PduBuffer buffer;
+  if (w_bser_encode_pdu(bser_version, bser_capabilities, json, buffer)) {
+    return -1;
+  }
+  return buffer.replay(dump, data);
+}
+
+int w_bser_write_pdu_with_encoded_member(
+    const uint32_t bser_version,
+    const uint32_t bser_capabilities,
+    json_dump_callback_t dump,
+    const json_ref& json,
+    const w_string& key,
+    w_string_piece encoded,
+    void* data) {
+  watchman::PduBuffer buffer;
+  if (w_bser_encode_pdu_with_encoded_member(
+          bser_version, bser_capabilities, json, key, encoded, buffer)) {
+    return -1;
+  }
+  return buffer.replay(dump, data);
+}
+
+int w_bser_dump_int(const bser_ctx_t* ctx, json_int_t val, void* data) {
+  return bser_int(ctx, val, data);
+}
+
+int w_bser_dump_real(const bser_ctx_t* ctx, double val, void* data) {
+  return bser_real(ctx, val, data);
+}
+
+int w_bser_dump_bool(const bser_ctx_t* ctx, bool val, void* data) {
+  if (!is_bser_version_supported(ctx)) {
+    return -1;
+  }
+  return val ? ctx->dump(&bser_true, sizeof(bser_true), data)
+             : ctx->dump(&bser_false, sizeof(bser_false), data);
+}
+
+int w_bser_dump_bytestring(
+    const bser_ctx_t* ctx,
+    w_string_piece str,
+    void* data) {
+  return bser_bytestring(ctx, str, data, false);
+}
+
+int w_bser_dump_string(const bser_ctx_t* ctx, const w_string& str, void* data) {
+  switch (str.type()) {
+    case W_STRING_BYTE:
+      return bser_bytestring(ctx, str, data);
+    case W_STRING_UNICODE:
+      return bser_utf8string(ctx, str, data);
+    case W_STRING_MIXED:
+      return bser_mixedstring(ctx, str, data);
+    default:
+      w_assert(false, "unknown string type 0x%02x", str.type());
       return -1;
-    }
   }
+}
 
-  if (bser_int(&ctx, m_size, data)) {
+int w_bser_dump_array_header(
+    const bser_ctx_t* ctx,
+    size_t count,
+    const json_ref& templ,
+    void* data) {
+  if (!is_bser_version_supported(ctx)) {
     return -1;
   }
 
-  if (w_bser_dump(&ctx, json, data)) {
+  if (templ) {
+    if (ctx->dump(&bser_template_hdr, sizeof(bser_template_hdr), data)) {
+      return -1;
+    }
+    if (bser_template_keys(ctx, templ, data)) {
+      return -1;
+    }
+  } else if (ctx->dump(&bser_array_hdr, sizeof(bser_array_hdr), data)) {
     return -1;
   }
 
-  return 0;
+  return bser_int(ctx, count, data);
+}
+
+namespace {
+// The state that is shared by the values of a PDU while it is decoded
+struct bunser_ctx {
+  // The string dictionary of a BSER v3 PDU, or nullptr
+  std::vector<json_ref>* strings;
+  // The object keys that have been decoded so far.  Requests, and the
+  // objects of template arrays, use the same few keys over and over, so
+  // each is only copied out of the PDU once.
+  std::vector<w_string> keys;
+
+  explicit bunser_ctx(std::vector<json_ref>* strings) : strings(strings) {}
+
+  w_string key(const char* start, size_t len);
+};
+
+// Past this many distinct keys, the rest are copied every time
+constexpr size_t kMaxSharedKeys = 64;
+
+w_string bunser_ctx::key(const char* start, size_t len) {
+  for (auto& key : keys) {
+    if (key.size() == len && memcmp(key.data(), start, len) == 0) {
+      return key;
+    }
+  }
+  w_string key(start, len, W_STRING_BYTE);
+  if (keys.size() < kMaxSharedKeys) {
+    keys.push_back(key);
+  }
+  return key;
+}
+
+// The number of elements to set aside room for in a container that
+// claims to have count of them.  Every element takes at least a byte, so
+// this stops a bogus count from causing a huge allocation.
+size_t bunser_size_hint(json_int_t count, const char* buf, const char* end) {
+  return size_t(
+      std::max(json_int_t(0), std::min(count, json_int_t(end - buf))));
 }
+} // namespace
+
+static json_ref bunser_value(
+    const char* buf,
+    const char* end,
+    json_int_t* needed,
+    json_error_t* jerr,
+    bunser_ctx* ctx);
 
 static json_ref bunser_array(
     const char* buf,
     const char* end,
     json_int_t* used,
-    json_error_t* jerr) {
+    json_error_t* jerr,
+    bunser_ctx* ctx) {
   json_int_t needed;
   json_int_t total = 0;
   json_int_t i, nelems;
@@ -490,10 +790,10 @@ static json_ref bunser_array(
   total += needed;
   buf += needed;
 
-  auto arrval = json_array();
+  auto arrval = json_array_of_size(bunser_size_hint(nelems, buf, end));
   for (i = 0; i < nelems; i++) {
     needed = 0;
-    auto item = bunser(buf, end, &needed, jerr);
+    auto item = bunser_value(buf, end, &needed, jerr, ctx);
 
     total += needed;
     buf += needed;
@@ -518,7 +818,8 @@ static json_ref bunser_template(
     const char* buf,
     const char* end,
     json_int_t* used,
-    json_error_t* jerr) {
+    json_error_t* jerr,
+    bunser_ctx* ctx) {
   json_int_t needed = 0;
   json_int_t total = 0;
   json_int_t i, nelems;
@@ -538,7 +839,7 @@ static json_ref bunser_template(
   }
 
   // Load in the property names template
-  auto templ = bunser_array(buf, end, &needed, jerr);
+  auto templ = bunser_array(buf, end, &needed, jerr, ctx);
   if (!templ) {
     *used = needed + total;
     return nullptr;
@@ -563,10 +864,24 @@ static json_ref bunser_template(
 
   np = json_array_size(templ);
 
+  // The keys are shared by all of the objects.  Values for a key that
+  // isn't a string are dropped.
+  std::vector<w_string> keys;
+  keys.reserve(np);
+  for (auto& name : json_to_array(templ)->table) {
+    if (json_is_string(name)) {
+      auto& str = json_to_w_string(name);
+      keys.emplace_back(ctx->key(str.data(), str.size()));
+    } else {
+      keys.emplace_back();
+    }
+  }
+
   // Now load up the array with object values
-  auto arrval = json_array_of_size((size_t)nelems);
+  auto arrval = json_array_of_size(bunser_size_hint(nelems, buf, end));
   for (i = 0; i < nelems; i++) {
     auto item = json_object_of_size((size_t)np);
+    auto& map = json_to_object(item)->map;
     for (ip = 0; ip < np; ip++) {
       if (*buf == BSER_SKIP) {
         buf++;
@@ -575,7 +890,7 @@ static json_ref bunser_template(
       }
 
       needed = 0;
-      auto val = bunser(buf, end, &needed, jerr);
+      auto val = bunser_value(buf, end, &needed, jerr, ctx);
       if (!val) {
         *used = needed + total;
         return nullptr;
@@ -583,10 +898,9 @@ static json_ref bunser_template(
       buf += needed;
       total += needed;
 
-      json_object_set_new_nocheck(
-          item,
-          json_string_value(json_array_get(templ, (size_t)ip)),
-          std::move(val));
+      if (keys[ip]) {
+        map[keys[ip]] = std::move(val);
+      }
     }
 
     json_array_append_new(arrval, std::move(item));
@@ -600,11 +914,11 @@ static json_ref bunser_object(
     const char* buf,
     const char* end,
     json_int_t* used,
-    json_error_t* jerr) {
+    json_error_t* jerr,
+    bunser_ctx* ctx) {
   json_int_t needed;
   json_int_t total = 0;
   json_int_t i, nelems;
-  char keybuf[128];
 
   total = 1;
   buf++;
@@ -621,7 +935,8 @@ static json_ref bunser_object(
   total += needed;
   buf += needed;
 
-  auto objval = json_object();
+  auto objval = json_object_of_size(bunser_size_hint(nelems, buf, end));
+  auto& map = json_to_object(objval)->map;
   for (i = 0; i < nelems; i++) {
     const char* start;
     json_int_t slen;
@@ -635,18 +950,10 @@ static json_ref bunser_object(
     }
     total += needed;
     buf += needed;
-
-    // Saves us allocating a string when the library is going to
-    // do that anyway
-    if ((uint16_t)slen > sizeof(keybuf) - 1) {
-      snprintf(jerr->text, sizeof(jerr->text), "object key is too long");
-      return nullptr;
-    }
-    memcpy(keybuf, start, (size_t)slen);
-    keybuf[slen] = '\0';
+    auto key = ctx->key(start, (size_t)slen);
 
     // Read value
-    auto item = bunser(buf, end, &needed, jerr);
+    auto item = bunser_value(buf, end, &needed, jerr, ctx);
     total += needed;
     buf += needed;
 
@@ -655,22 +962,123 @@ static json_ref bunser_object(
       return nullptr;
     }
 
-    if (json_object_set_new_nocheck(objval, keybuf, std::move(item))) {
-      *used = total;
-      snprintf(jerr->text, sizeof(jerr->text), "failed to add object property");
+    map[key] = std::move(item);
+  }
+
+  *used = total;
+  return objval;
+}
+
+// Decodes the string value at buf, which must be a bytestring or a UTF-8
+// string, into its text and type
+static bool bunser_typed_string(
+    const char* buf,
+    const char* end,
+    json_int_t* needed,
+    w_string_piece* text,
+    w_string_type_t* type,
+    json_error_t* jerr) {
+  const char* start;
+  json_int_t len;
+  if ((buf[0] != BSER_BYTESTRING && buf[0] != BSER_UTF8STRING) ||
+      !bunser_generic_string(buf, end - buf, needed, &start, &len)) {
+    snprintf(jerr->text, sizeof(jerr->text), "invalid bytestring encoding");
+    return false;
+  }
+  *text = w_string_piece(start, len);
+  *type = buf[0] == BSER_BYTESTRING ? W_STRING_BYTE : W_STRING_UNICODE;
+  return true;
+}
+
+static json_ref bunser_dictionary_string(
+    const char* buf,
+    const char* end,
+    json_int_t* used,
+    json_error_t* jerr,
+    bunser_ctx* ctx) {
+  auto strings = ctx->strings;
+  json_int_t needed = 0;
+  json_int_t total = 1;
+  auto op = buf[0];
+  buf++;
+
+  if (!strings) {
+    *used = total;
+    snprintf(
+        jerr->text,
+        sizeof(jerr->text),
+        "string dictionary encoding 0x%02x outside of a BSER v3 PDU",
+        (int)op);
+    return nullptr;
+  }
+
+  // The index of the string in the dictionary, for REF and PREFIXED
+  json_int_t index = 0;
+  json_int_t prefixLen = 0;
+  if (op != BSER_STRING_DEFINE) {
+    if (!bunser_int(buf, end - buf, &needed, &index) || index < 0 ||
+        index >= json_int_t(strings->size())) {
+      *used = total + std::max(needed, json_int_t(0));
+      snprintf(jerr->text, sizeof(jerr->text), "invalid string reference");
       return nullptr;
     }
+    total += needed;
+    buf += needed;
+  }
+  if (op == BSER_STRING_REF) {
+    *used = total;
+    return (*strings)[index];
+  }
+  if (op == BSER_STRING_PREFIXED) {
+    auto& prefixOf = json_to_w_string((*strings)[index]);
+    if (!bunser_int(buf, end - buf, &needed, &prefixLen) || prefixLen < 0 ||
+        prefixLen > json_int_t(prefixOf.size())) {
+      *used = total + std::max(needed, json_int_t(0));
+      snprintf(jerr->text, sizeof(jerr->text), "invalid string prefix length");
+      return nullptr;
+    }
+    total += needed;
+    buf += needed;
   }
 
+  w_string_piece text;
+  w_string_type_t type;
+  needed = 0;
+  if (!bunser_typed_string(buf, end, &needed, &text, &type, jerr)) {
+    *used = total + needed;
+    return nullptr;
+  }
+  total += needed;
   *used = total;
-  return objval;
+
+  json_ref value;
+  if (op == BSER_STRING_PREFIXED) {
+    std::string joined(json_to_w_string((*strings)[index]).data(), prefixLen);
+    joined.append(text.data(), text.size());
+    value = typed_string_to_json(joined.data(), joined.size(), type);
+  } else {
+    value = typed_string_to_json(text.data(), text.size(), type);
+  }
+  strings->push_back(value);
+  return value;
 }
 
 json_ref bunser(
     const char* buf,
     const char* end,
     json_int_t* needed,
-    json_error_t* jerr) {
+    json_error_t* jerr,
+    std::vector<json_ref>* strings) {
+  bunser_ctx ctx(strings);
+  return bunser_value(buf, end, needed, jerr, &ctx);
+}
+
+static json_ref bunser_value(
+    const char* buf,
+    const char* end,
+    json_int_t* needed,
+    json_error_t* jerr,
+    bunser_ctx* ctx) {
   json_int_t ival;
 
   switch (buf[0]) {
@@ -717,11 +1125,15 @@ json_ref bunser(
       *needed = 1;
       return json_null();
     case BSER_ARRAY:
-      return bunser_array(buf, end, needed, jerr);
+      return bunser_array(buf, end, needed, jerr, ctx);
     case BSER_TEMPLATE:
-      return bunser_template(buf, end, needed, jerr);
+      return bunser_template(buf, end, needed, jerr, ctx);
     case BSER_OBJECT:
-      return bunser_object(buf, end, needed, jerr);
+      return bunser_object(buf, end, needed, jerr, ctx);
+    case BSER_STRING_DEFINE:
+    case BSER_STRING_REF:
+    case BSER_STRING_PREFIXED:
+      return bunser_dictionary_string(buf, end, needed, jerr, ctx);
     default:
       snprintf(
           jerr->text,
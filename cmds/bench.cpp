@@ -0,0 +1,778 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include <folly/Conv.h>
+#include <folly/FileUtil.h>
+#include <folly/ScopeGuard.h>
+#include <folly/String.h>
+#include <folly/memory/Malloc.h>
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+using namespace watchman;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+namespace {
+
+// The measurements from a single execution of the query
+struct BenchSample {
+  nanoseconds latency{0};
+  int64_t numWalked{0};
+  size_t numResults{0};
+  size_t bytesEncoded{0};
+  uint64_t bytesAllocated{0};
+};
+
+// Returns the number of bytes that have been allocated by this thread, or
+// 0 if that isn't known
+uint64_t thread_bytes_allocated() {
+#if defined(FOLLY_USE_JEMALLOC) && !FOLLY_SANITIZE
+  if (folly::usingJEMalloc()) {
+    uint64_t allocated = 0;
+    size_t len = sizeof(allocated);
+    if (mallctl("thread.allocated", &allocated, &len, nullptr, 0) == 0) {
+      return allocated;
+    }
+  }
+#endif
+  return 0;
+}
+
+bool allocations_are_counted() {
+#if defined(FOLLY_USE_JEMALLOC) && !FOLLY_SANITIZE
+  return folly::usingJEMalloc();
+#else
+  return false;
+#endif
+}
+
+uint32_t parse_count(
+    const json_ref& options,
+    const char* name,
+    uint32_t defval,
+    uint32_t minval,
+    uint32_t maxval) {
+  auto value = options.get_default(name);
+  if (!value) {
+    return defval;
+  }
+  if (!value.isInt() || value.asInt() < json_int_t(minval) ||
+      value.asInt() > json_int_t(maxval)) {
+    throw CommandValidationError(
+        name, " must be an integer between ", minval, " and ", maxval);
+  }
+  return uint32_t(value.asInt());
+}
+
+// One synthetic client: parses its own copy of the query and executes it
+// as the query command would, including encoding the files for the
+// client
+class BenchClient {
+ public:
+  BenchClient(
+      const std::shared_ptr<w_root_t>& root,
+      const json_ref& querySpec,
+      const watchman_client* client)
+      : root_(root),
+        query_(w_query_parse(root, querySpec)),
+        pduType_(client->pdu_type),
+        capabilities_(client->capabilities) {
+    if (pduType_ == is_bser || pduType_ == is_bser_v2) {
+      query_->render_bser = true;
+      query_->render_bser_version = pduType_ == is_bser ? 1 : 2;
+      query_->render_bser_capabilities = capabilities_;
+    }
+    // The files are encoded in one piece below
+    query_->stream_chunk_size = 0;
+  }
+
+  BenchSample run() {
+    BenchSample sample;
+    auto allocated = thread_bytes_allocated();
+    auto start = steady_clock::now();
+
+    auto res = w_query_execute(query_.get(), root_, nullptr);
+    std::string encoded;
+    if (query_->render_bser) {
+      encoded = query_->packed_names
+          ? w_query_res_encode_packed_names(query_.get(), res)
+          : w_query_res_encode_bser_results(query_.get(), res);
+      sample.numResults = res.numBserRows;
+    } else {
+      watchman_json_buffer::pduEncodeToString(
+          pduType_, capabilities_, res.resultsArray, encoded);
+      sample.numResults = json_array_size(res.resultsArray);
+    }
+
+    sample.latency = steady_clock::now() - start;
+    sample.bytesAllocated = thread_bytes_allocated() - allocated;
+    sample.numWalked = res.numWalked;
+    sample.bytesEncoded = encoded.size();
+    return sample;
+  }
+
+ private:
+  std::shared_ptr<w_root_t> root_;
+  std::shared_ptr<w_query> query_;
+  w_pdu_type pduType_;
+  uint32_t capabilities_;
+};
+
+json_ref duration_to_json(nanoseconds duration) {
+  return json_integer(duration_cast<microseconds>(duration).count());
+}
+
+// Returns the pct percentile of the sorted latencies, by nearest rank
+nanoseconds percentile(const std::vector<nanoseconds>& sorted, double pct) {
+  auto rank = size_t(std::ceil(pct / 100 * sorted.size()));
+  return sorted[std::max(rank, size_t(1)) - 1];
+}
+
+// Counts the latencies into buckets whose upper bounds are powers of two
+// microseconds
+json_ref latency_histogram(const std::vector<nanoseconds>& sorted) {
+  auto histogram = json_array();
+  int64_t bound = 1;
+  size_t count = 0;
+  for (auto latency : sorted) {
+    auto us = duration_cast<microseconds>(latency).count();
+    while (us > bound) {
+      if (count > 0) {
+        json_array_append_new(
+            histogram,
+            json_object(
+                {{"le_us", json_integer(bound)},
+                 {"count", json_integer(count)}}));
+        count = 0;
+      }
+      bound *= 2;
+    }
+    ++count;
+  }
+  if (count > 0) {
+    json_array_append_new(
+        histogram,
+        json_object(
+            {{"le_us", json_integer(bound)}, {"count", json_integer(count)}}));
+  }
+  return histogram;
+}
+
+#ifndef _WIN32
+// The shape of the synthetic tree that debug-bench-crawl makes
+struct TreeShape {
+  uint32_t depth;
+  uint32_t fanout;
+  uint32_t filesPerDir;
+  uint32_t symlinksPerDir;
+};
+
+struct TreeCounts {
+  uint64_t dirs{0};
+  uint64_t files{0};
+  uint64_t symlinks{0};
+};
+
+// The most entries that the tree may have, so that a typo in the shape
+// can't fill the disk
+constexpr uint64_t kMaxTreeEntries = 10000000;
+
+[[noreturn]] void throw_errno(const char* what, const std::string& path) {
+  throw std::system_error(
+      errno, std::generic_category(), folly::to<std::string>(what, path));
+}
+
+// Populates the existing dir at path, which is at the given level of the
+// tree, and the dirs below it
+void make_tree(
+    const std::string& path,
+    const TreeShape& shape,
+    uint32_t level,
+    TreeCounts& counts) {
+  ++counts.dirs;
+  for (uint32_t i = 0; i < shape.filesPerDir; ++i) {
+    auto file = folly::to<std::string>(path, "/f", i);
+    int fd = open(file.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      throw_errno("failed to create ", file);
+    }
+    close(fd);
+    ++counts.files;
+  }
+  for (uint32_t i = 0; i < shape.symlinksPerDir; ++i) {
+    auto link = folly::to<std::string>(path, "/l", i);
+    // Relative to the dir, so that the tree can be moved
+    auto target = shape.filesPerDir
+        ? folly::to<std::string>("f", i % shape.filesPerDir)
+        : std::string(".");
+    if (symlink(target.c_str(), link.c_str()) == -1) {
+      throw_errno("failed to create ", link);
+    }
+    ++counts.symlinks;
+  }
+  if (level == shape.depth) {
+    return;
+  }
+  for (uint32_t i = 0; i < shape.fanout; ++i) {
+    auto dir = folly::to<std::string>(path, "/d", i);
+    if (mkdir(dir.c_str(), 0755) == -1) {
+      throw_errno("failed to create ", dir);
+    }
+    make_tree(dir, shape, level + 1, counts);
+  }
+}
+
+// Removes what make_tree made, along with path itself.  Anything that is
+// already gone is ignored, so that a partially made tree can be removed.
+void remove_tree(
+    const std::string& path,
+    const TreeShape& shape,
+    uint32_t level) {
+  for (uint32_t i = 0; i < shape.filesPerDir; ++i) {
+    unlink(folly::to<std::string>(path, "/f", i).c_str());
+  }
+  for (uint32_t i = 0; i < shape.symlinksPerDir; ++i) {
+    unlink(folly::to<std::string>(path, "/l", i).c_str());
+  }
+  if (level < shape.depth) {
+    for (uint32_t i = 0; i < shape.fanout; ++i) {
+      remove_tree(folly::to<std::string>(path, "/d", i), shape, level + 1);
+    }
+  }
+  if (rmdir(path.c_str()) == -1 && errno != ENOENT) {
+    log(ERR, "failed to remove ", path, ": ", folly::errnoStr(errno), "\n");
+  }
+}
+
+void write_watcher_config(const std::string& path, const std::string& name) {
+  auto config = json_dumps(
+      json_object({{"watcher",
+                    typed_string_to_json(name.c_str(), W_STRING_UNICODE)}}),
+      0);
+  auto file = path + "/.watchmanconfig";
+  if (!folly::writeFile(config, file.c_str())) {
+    throw_errno("failed to write ", file);
+  }
+}
+
+#ifdef HAVE_SYS_RESOURCE_H
+int64_t timeval_us(const struct timeval& tv) {
+  return int64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+// Describes the resources that the process used between before and after
+json_ref rusage_delta(const struct rusage& before, const struct rusage& after) {
+  auto maxRssKb = int64_t(after.ru_maxrss);
+#ifdef __APPLE__
+  // Which macOS reports in bytes
+  maxRssKb /= 1024;
+#endif
+  return json_object(
+      {{"user_time_us",
+        json_integer(timeval_us(after.ru_utime) - timeval_us(before.ru_utime))},
+       {"system_time_us",
+        json_integer(timeval_us(after.ru_stime) - timeval_us(before.ru_stime))},
+       {"minor_faults", json_integer(after.ru_minflt - before.ru_minflt)},
+       {"major_faults", json_integer(after.ru_majflt - before.ru_majflt)},
+       {"voluntary_context_switches",
+        json_integer(after.ru_nvcsw - before.ru_nvcsw)},
+       {"involuntary_context_switches",
+        json_integer(after.ru_nivcsw - before.ru_nivcsw)},
+       {"peak_rss_kb", json_integer(maxRssKb)}});
+}
+#endif
+
+// Watches the tree at path with the named watcher, waits for the initial
+// crawl to complete and describes how it went
+json_ref bench_crawl(
+    const std::string& path,
+    const std::string& watcher,
+    const TreeCounts& counts) {
+  write_watcher_config(path, watcher);
+
+#ifdef HAVE_SYS_RESOURCE_H
+  struct rusage usageBefore;
+  getrusage(RUSAGE_SELF, &usageBefore);
+#endif
+  auto start = steady_clock::now();
+  auto root = w_root_resolve(path.c_str(), true);
+  SCOPE_EXIT {
+    root->stopWatch();
+  };
+  auto view = root->view();
+  view->waitUntilReadyToQuery(root).wait();
+  auto elapsed = steady_clock::now() - start;
+#ifdef HAVE_SYS_RESOURCE_H
+  struct rusage usageAfter;
+  getrusage(RUSAGE_SELF, &usageAfter);
+#endif
+
+  auto seconds = std::max(std::chrono::duration<double>(elapsed).count(), 1e-9);
+  auto result = json_object(
+      {{"requested", typed_string_to_json(watcher.c_str(), W_STRING_UNICODE)},
+       {"watcher", w_string_to_json(view->getName())},
+       {"elapsed_us", duration_to_json(elapsed)},
+       {"dirs_per_second", json_real(counts.dirs / seconds)},
+       {"files_per_second",
+        json_real((counts.files + counts.symlinks) / seconds)}});
+  if (auto crawl = view->getLastCrawlInfo()) {
+    // Each dir is opened and read, and each entry that the crawler
+    // couldn't vouch for from the listing is stat'ed
+    auto entries = json_integer_value(crawl.get("entries"));
+    auto deferred = json_integer_value(crawl.get("deferred_stats"));
+    result.set(
+        {{"crawl", crawl},
+         {"dir_reads", crawl.get("dirs")},
+         {"stats", json_integer(entries - deferred)}});
+  }
+#ifdef HAVE_SYS_RESOURCE_H
+  result.set("usage", rusage_delta(usageBefore, usageAfter));
+#endif
+  return result;
+}
+#endif
+
+} // namespace
+
+/* debug-bench-query /root {query} [{options}]
+ * Executes the query repeatedly from one or more synthetic clients and
+ * reports how long it took.  The options are:
+ * iterations: the number of measured executions by each client
+ * concurrency: the number of clients that execute the query at once
+ * warmup: the number of unmeasured executions before the clients start */
+static void cmd_debug_bench_query(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 3 && json_array_size(args) != 4) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-bench-query'");
+    return;
+  }
+
+  auto root = resolveRoot(client, args);
+  const auto& querySpec = args.at(2);
+  auto options = json_array_size(args) == 4 ? args.at(3) : json_object();
+  if (!options.isObject()) {
+    throw CommandValidationError("options must be an object");
+  }
+  auto iterations = parse_count(options, "iterations", 100, 1, 1000000);
+  auto concurrency = parse_count(options, "concurrency", 1, 1, 64);
+  auto warmup = parse_count(options, "warmup", 10, 0, 1000000);
+
+  std::vector<std::unique_ptr<BenchClient>> clients;
+  for (uint32_t i = 0; i < concurrency; ++i) {
+    clients.emplace_back(
+        std::make_unique<BenchClient>(root, querySpec, client));
+  }
+
+  for (uint32_t i = 0; i < warmup; ++i) {
+    clients.front()->run();
+  }
+
+  std::vector<std::vector<BenchSample>> samples(concurrency);
+  std::vector<std::exception_ptr> errors(concurrency);
+  auto start = steady_clock::now();
+  {
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < concurrency; ++i) {
+      threads.emplace_back([&, i] {
+        try {
+          samples[i].reserve(iterations);
+          for (uint32_t j = 0; j < iterations; ++j) {
+            samples[i].push_back(clients[i]->run());
+          }
+        } catch (const std::exception&) {
+          errors[i] = std::current_exception();
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+  auto elapsed = steady_clock::now() - start;
+  for (auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  std::vector<nanoseconds> latencies;
+  nanoseconds totalLatency{0};
+  int64_t numWalked = 0;
+  size_t numResults = 0;
+  size_t bytesEncoded = 0;
+  uint64_t bytesAllocated = 0;
+  for (auto& clientSamples : samples) {
+    for (auto& sample : clientSamples) {
+      latencies.push_back(sample.latency);
+      totalLatency += sample.latency;
+      numWalked += sample.numWalked;
+      numResults += sample.numResults;
+      bytesEncoded += sample.bytesEncoded;
+      bytesAllocated += sample.bytesAllocated;
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto count = latencies.size();
+  auto elapsedSeconds =
+      std::max(std::chrono::duration<double>(elapsed).count(), 1e-9);
+
+  auto bench = json_object(
+      {{"iterations", json_integer(iterations)},
+       {"concurrency", json_integer(concurrency)},
+       {"warmup", json_integer(warmup)},
+       {"elapsed_us", duration_to_json(elapsed)},
+       {"latency_us",
+        json_object(
+            {{"min", duration_to_json(latencies.front())},
+             {"mean", duration_to_json(totalLatency / int64_t(count))},
+             {"p50", duration_to_json(percentile(latencies, 50))},
+             {"p90", duration_to_json(percentile(latencies, 90))},
+             {"p99", duration_to_json(percentile(latencies, 99))},
+             {"max", duration_to_json(latencies.back())}})},
+       {"histogram", latency_histogram(latencies)},
+       {"num_walked_per_iteration", json_integer(numWalked / int64_t(count))},
+       {"files_walked_per_second", json_real(numWalked / elapsedSeconds)},
+       {"num_results_per_iteration", json_integer(numResults / count)},
+       {"bytes_encoded_per_iteration", json_integer(bytesEncoded / count)}});
+  if (allocations_are_counted()) {
+    bench.set(
+        "bytes_allocated_per_iteration", json_integer(bytesAllocated / count));
+  }
+
+  auto resp = make_response();
+  resp.set("bench", std::move(bench));
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-bench-query",
+    cmd_debug_bench_query,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
+namespace {
+// A query that debug-bench-query-suite measures, and the case whose cost
+// per file it is compared against, if any
+struct SuiteCase {
+  const char* name;
+  const char* baseline;
+  json_ref spec;
+};
+
+std::vector<SuiteCase> suite_cases() {
+  auto query = [](std::initializer_list<std::pair<const char*, json_ref>> q) {
+    // Without a sync, so that the cookie doesn't dominate the cost
+    auto spec = json_object(q);
+    spec.set("sync_timeout", json_integer(0));
+    if (!spec.get_default("fields")) {
+      spec.set("fields", json_array({typed_string_to_json("name")}));
+    }
+    return spec;
+  };
+  auto str = [](const char* s) { return typed_string_to_json(s); };
+  auto fields = [&](std::initializer_list<const char*> names) {
+    auto array = json_array();
+    for (auto name : names) {
+      json_array_append_new(array, str(name));
+    }
+    return query({{"fields", array}});
+  };
+  auto term = [&](json_ref expr) { return query({{"expression", expr}}); };
+
+  std::vector<SuiteCase> cases{
+      {"generator/all", nullptr, query({})},
+      {"generator/suffix",
+       nullptr,
+       query({{"suffix", json_array({str("c")})}})},
+      {"generator/glob", nullptr, query({{"glob", json_array({str("**/*")})}})},
+      {"generator/path", nullptr, query({{"path", json_array({str("")})}})},
+      {"generator/since", nullptr, query({{"since", json_integer(1)}})},
+      {"term/true", nullptr, term(json_array({str("true")}))},
+      {"term/name",
+       "term/true",
+       term(json_array({str("name"), str("watchman-bench-no-such-file")}))},
+      {"term/suffix",
+       "term/true",
+       term(json_array({str("suffix"), str("c")}))},
+      {"term/match",
+       "term/true",
+       term(json_array({str("match"), str("*.c"), str("wholename")}))},
+#ifdef HAVE_PCRE_H
+      {"term/pcre",
+       "term/true",
+       term(json_array({str("pcre"), str("\\.c$"), str("wholename")}))},
+#endif
+      {"term/dirname",
+       "term/true",
+       term(json_array({str("dirname"), str("watchman-bench-no-such-dir")}))},
+      {"term/since",
+       "term/true",
+       term(json_array({str("since"), json_integer(1)}))},
+      {"fields/name", nullptr, fields({"name"})},
+      {"fields/basic",
+       "fields/name",
+       fields({"name", "exists", "new", "size", "mode"})},
+      {"fields/times",
+       "fields/name",
+       fields({"name", "mtime_ms", "ctime_ms", "oclock", "cclock"})},
+      {"fields/stat",
+       "fields/name",
+       fields({"name", "type", "ino", "dev", "nlink", "uid", "gid"})},
+  };
+  return cases;
+}
+
+bool case_selected(const char* name, const json_ref& only) {
+  if (!only) {
+    return true;
+  }
+  w_string_piece caseName(name);
+  for (auto& prefix : only.array()) {
+    if (caseName.startsWith(json_to_w_string(prefix))) {
+      return true;
+    }
+  }
+  return false;
+}
+} // namespace
+
+/* debug-bench-query-suite /root [{options}]
+ * Measures the parsing of a fixed set of queries, and their execution
+ * against the root, so that the cost of each generator, expression term
+ * and set of fields can be compared between versions of watchman.  The
+ * terms and fields are also reported relative to a baseline query that
+ * walks the same files without them.  The options are:
+ * iterations: the number of measured executions of each query
+ * warmup: the number of unmeasured executions of each query
+ * parse_iterations: the number of times that each query is parsed
+ * only: an array of prefixes of the names of the cases to run */
+static void cmd_debug_bench_query_suite(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 2 && json_array_size(args) != 3) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-bench-query-suite'");
+    return;
+  }
+
+  auto root = resolveRoot(client, args);
+  auto options = json_array_size(args) == 3 ? args.at(2) : json_object();
+  if (!options.isObject()) {
+    throw CommandValidationError("options must be an object");
+  }
+  auto iterations = parse_count(options, "iterations", 20, 1, 1000000);
+  auto warmup = parse_count(options, "warmup", 2, 0, 1000000);
+  auto parseIterations =
+      parse_count(options, "parse_iterations", 1000, 1, 1000000);
+  auto only = options.get_default("only");
+  if (only) {
+    if (!only.isArray()) {
+      throw CommandValidationError("only must be an array of strings");
+    }
+    for (auto& prefix : only.array()) {
+      if (!prefix.isString()) {
+        throw CommandValidationError("only must be an array of strings");
+      }
+    }
+  }
+
+  std::unordered_map<std::string, double> nsPerFile;
+  auto results = json_array();
+  for (auto& c : suite_cases()) {
+    if (!case_selected(c.name, only)) {
+      continue;
+    }
+
+    auto parseStart = steady_clock::now();
+    for (uint32_t i = 0; i < parseIterations; ++i) {
+      w_query_parse(root, c.spec);
+    }
+    auto parseElapsed = steady_clock::now() - parseStart;
+
+    BenchClient bench(root, c.spec, client);
+    for (uint32_t i = 0; i < warmup; ++i) {
+      bench.run();
+    }
+    std::vector<nanoseconds> latencies;
+    nanoseconds totalLatency{0};
+    BenchSample last;
+    for (uint32_t i = 0; i < iterations; ++i) {
+      last = bench.run();
+      latencies.push_back(last.latency);
+      totalLatency += last.latency;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto mean = totalLatency / int64_t(iterations);
+
+    auto result = json_object(
+        {{"name", typed_string_to_json(c.name, W_STRING_UNICODE)},
+         {"parse_ns",
+          json_integer(
+              duration_cast<nanoseconds>(parseElapsed).count() /
+              parseIterations)},
+         {"mean_us", duration_to_json(mean)},
+         {"p50_us", duration_to_json(percentile(latencies, 50))},
+         {"p99_us", duration_to_json(percentile(latencies, 99))},
+         {"num_walked", json_integer(last.numWalked)},
+         {"num_results", json_integer(last.numResults)}});
+    if (last.numWalked > 0) {
+      auto perFile = double(mean.count()) / last.numWalked;
+      nsPerFile[c.name] = perFile;
+      result.set("ns_per_file", json_real(perFile));
+      auto baseline = c.baseline ? nsPerFile.find(c.baseline) : nsPerFile.end();
+      if (baseline != nsPerFile.end()) {
+        result.set("extra_ns_per_file", json_real(perFile - baseline->second));
+      }
+    }
+    json_array_append_new(results, std::move(result));
+  }
+
+  auto resp = make_response();
+  resp.set(
+      "bench",
+      json_object(
+          {{"iterations", json_integer(iterations)},
+           {"warmup", json_integer(warmup)},
+           {"parse_iterations", json_integer(parseIterations)},
+           {"cases", std::move(results)}}));
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-bench-query-suite",
+    cmd_debug_bench_query_suite,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
+#ifndef _WIN32
+/* debug-bench-crawl {options}
+ * Makes a synthetic tree and measures how long the initial crawl of it
+ * takes with each watcher.  The options are:
+ * dir: where to make the tree, such as on tmpfs or on a real disk
+ * depth: the number of levels of dirs below the top of the tree
+ * fanout: the number of dirs in each dir above the bottom level
+ * files_per_dir: the number of empty files in each dir
+ * symlinks_per_dir: the number of symlinks to those files in each dir
+ * watchers: the names of the watchers to crawl with; all by default
+ * iterations: the number of crawls with each watcher
+ * keep: if true, the tree is left in place afterwards */
+static void cmd_debug_bench_crawl(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 2 || !args.at(1).isObject()) {
+    send_error_response(
+        client, "expected 'debug-bench-crawl' to be passed an options object");
+    return;
+  }
+  const auto& options = args.at(1);
+  auto dir = options.get_default("dir");
+  if (!dir || !dir.isString() ||
+      !w_is_path_absolute_cstr(json_string_value(dir))) {
+    throw CommandValidationError("dir must be an absolute path");
+  }
+  TreeShape shape;
+  shape.depth = parse_count(options, "depth", 4, 0, 32);
+  shape.fanout = parse_count(options, "fanout", 8, 1, 1000000);
+  shape.filesPerDir = parse_count(options, "files_per_dir", 32, 0, 1000000);
+  shape.symlinksPerDir =
+      parse_count(options, "symlinks_per_dir", 0, 0, 1000000);
+  auto iterations = parse_count(options, "iterations", 1, 1, 1000);
+  auto keep = options.get_default("keep", json_false()).asBool();
+
+  // Check the size of the tree before making any of it
+  uint64_t dirs = 0;
+  uint64_t dirsAtLevel = 1;
+  for (uint32_t level = 0; level <= shape.depth; ++level) {
+    dirs += dirsAtLevel;
+    if (dirs * (1 + shape.filesPerDir + shape.symlinksPerDir) >
+        kMaxTreeEntries) {
+      throw CommandValidationError(
+          "the tree would have more than ", kMaxTreeEntries, " entries");
+    }
+    dirsAtLevel *= shape.fanout;
+  }
+
+  std::vector<std::string> watchers;
+  auto watchersOption = options.get_default("watchers");
+  if (watchersOption) {
+    if (!watchersOption.isArray()) {
+      throw CommandValidationError("watchers must be an array of strings");
+    }
+    for (auto& name : watchersOption.array()) {
+      if (!name.isString()) {
+        throw CommandValidationError("watchers must be an array of strings");
+      }
+      watchers.emplace_back(json_string_value(name));
+    }
+  } else {
+    watchers = WatcherRegistry::getWatcherNames();
+    std::sort(watchers.begin(), watchers.end());
+  }
+
+  static std::atomic<uint32_t> benchNumber{0};
+  auto path = folly::to<std::string>(
+      json_string_value(dir),
+      "/watchman-bench-crawl-",
+      getpid(),
+      "-",
+      benchNumber++);
+  if (mkdir(path.c_str(), 0755) == -1) {
+    throw_errno("failed to create ", path);
+  }
+  SCOPE_EXIT {
+    if (!keep) {
+      unlink((path + "/.watchmanconfig").c_str());
+      remove_tree(path, shape, 0);
+    }
+  };
+
+  TreeCounts counts;
+  auto generateStart = steady_clock::now();
+  make_tree(path, shape, 0, counts);
+  auto generateElapsed = steady_clock::now() - generateStart;
+
+  auto crawls = json_array();
+  for (auto& watcher : watchers) {
+    for (uint32_t i = 0; i < iterations; ++i) {
+      try {
+        json_array_append_new(crawls, bench_crawl(path, watcher, counts));
+      } catch (const std::exception& exc) {
+        json_array_append_new(
+            crawls,
+            json_object(
+                {{"requested",
+                  typed_string_to_json(watcher.c_str(), W_STRING_UNICODE)},
+                 {"error", typed_string_to_json(exc.what(), W_STRING_MIXED)}}));
+        break;
+      }
+    }
+  }
+
+  auto resp = make_response();
+  resp.set(
+      "bench",
+      json_object(
+          {{"tree",
+            json_object(
+                {{"path",
+                  typed_string_to_json(path.c_str(), W_STRING_BYTE)},
+                 {"dirs", json_integer(counts.dirs)},
+                 {"files", json_integer(counts.files)},
+                 {"symlinks", json_integer(counts.symlinks)},
+                 {"generate_us", duration_to_json(generateElapsed)}})},
+           {"crawls", std::move(crawls)}}));
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG("debug-bench-crawl", cmd_debug_bench_crawl, CMD_DAEMON, NULL)
+#endif
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -4,7 +4,14 @@
 #include "watchman.h"
 #include <folly/chrono/Conv.h>
 #include <iomanip>
+#include <unordered_map>
+#include "CpuAffinity.h"
+#include "CrawlScheduler.h"
 #include "Logging.h"
+#include "PerfAlarms.h"
+#include "PerfStats.h"
+#include "RootPathCache.h"
+#include "Tracing.h"
 
 using namespace watchman;
 
@@ -22,13 +29,86 @@ static void cmd_debug_recrawl(
 
   auto resp = make_response();
 
-  root->scheduleRecrawl("debug-recrawl");
+  // Asked for explicitly, so it doesn't wait for any backoff
+  root->scheduleRecrawl("debug-recrawl", false);
 
   resp.set("recrawl", json_true());
   send_and_dispose_response(client, std::move(resp));
 }
 W_CMD_REG("debug-recrawl", cmd_debug_recrawl, CMD_DAEMON, w_cmd_realpath_root)
 
+static void cmd_debug_overflow_recovery(
+    struct watchman_client* client,
+    const json_ref& args) {
+  /* resolve the root */
+  if (json_array_size(args) != 2) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-overflow-recovery'");
+    return;
+  }
+
+  auto root = resolveRoot(client, args);
+
+  auto resp = make_response();
+
+  // Behave as though the watcher lost track of everything
+  root->scheduleOverflowRecovery("debug-overflow-recovery", {});
+
+  resp.set("overflow_recovery", json_true());
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-overflow-recovery",
+    cmd_debug_overflow_recovery,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
+static void cmd_debug_query_result_cache(
+    struct watchman_client* client,
+    const json_ref& args) {
+  /* resolve the root */
+  if (json_array_size(args) != 2) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-query-result-cache'");
+    return;
+  }
+
+  auto root = resolveRoot(client, args);
+
+  auto resp = make_response();
+  resp.set("cache", root->queryResultCache.stats());
+  resp.set("plan_cache", root->queryPlanCache.stats());
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-query-result-cache",
+    cmd_debug_query_result_cache,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
+static void cmd_debug_scm_changed_files_cache(
+    struct watchman_client* client,
+    const json_ref& args) {
+  /* resolve the root */
+  if (json_array_size(args) != 2) {
+    send_error_response(
+        client,
+        "wrong number of arguments for 'debug-scm-changed-files-cache'");
+    return;
+  }
+
+  auto root = resolveRoot(client, args);
+
+  auto resp = make_response();
+  resp.set("cache", root->scmChangedFiles->stats());
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-scm-changed-files-cache",
+    cmd_debug_scm_changed_files_cache,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
 static void cmd_debug_show_cursors(
     struct watchman_client* client,
     const json_ref& args) {
@@ -50,8 +130,7 @@ static void cmd_debug_show_cursors(
     cursors = json_object_of_size(map->size());
     for (const auto& it : *map) {
       const auto& name = it.first;
-      const auto& ticks = it.second;
-      cursors.set(name.c_str(), json_integer(ticks));
+      cursors.set(name.c_str(), json_integer(it.second.load()));
     }
   }
 
@@ -87,6 +166,40 @@ static void cmd_debug_ageout(
 }
 W_CMD_REG("debug-ageout", cmd_debug_ageout, CMD_DAEMON, w_cmd_realpath_root)
 
+/* debug-collapse
+ * Collapses the subtrees that have been cold for the given number of
+ * seconds now, rather than waiting for the IO thread to look, and lists
+ * the dirs that are collapsed */
+static void cmd_debug_collapse(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 3) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-collapse'");
+    return;
+  }
+
+  auto root = resolveRoot(client, args);
+
+  std::chrono::seconds cold_age(json_array_get(args, 2).asInt());
+
+  auto collapsed = json_array();
+  for (auto& dir : root->view()->collapseColdDirs(root, cold_age)) {
+    w_string_piece name(dir);
+    name.advance(root->root_path.size() + 1);
+    json_array_append(collapsed, w_string_to_json(name.asWString()));
+  }
+
+  auto resp = make_response();
+  resp.set("collapsed", std::move(collapsed));
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-collapse",
+    cmd_debug_collapse,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
 static void cmd_debug_poison(
     struct watchman_client* client,
     const json_ref& args) {
@@ -181,12 +294,14 @@ static json_ref getDebugSubscriptionInfo(watchman_root* root) {
         for (auto& response : sub.second->lastResponses) {
           char timebuf[64];
           last_responses.array().push_back(json_object({
-              {"written_time",
+              {"queued_time",
                typed_string_to_json(Log::timeString(
                    timebuf,
                    std::size(timebuf),
-                   folly::to<timeval>(response.written)))},
-              {"response", response.response},
+                   folly::to<timeval>(response.queued)))},
+              // The client's thread may still be using the arena values
+              // of the response
+              {"response", json_promote(response.response)},
           }));
         }
 
@@ -194,6 +309,38 @@ static json_ref getDebugSubscriptionInfo(watchman_root* root) {
             {"name", w_string_to_json(sub.first)},
             {"client_id", json_integer(user_client->unique_id)},
             {"last_responses", last_responses},
+            {"overflow",
+             typed_string_to_json(
+                 sub.second->overflowPolicy ==
+                         watchman_client_subscription::OverflowPolicy::Drop
+                     ? "drop"
+                     : "coalesce",
+                 W_STRING_UNICODE)},
+            {"dropped_results", json_integer(sub.second->droppedResults)},
+            {"coalesced_results", json_integer(sub.second->coalescedResults)},
+            {"dispatch",
+             json_object({
+                 {"mode",
+                  typed_string_to_json(
+                      sub.second->dispatchMode ==
+                              watchman_client_subscription::DispatchMode::
+                                  Throughput
+                          ? "throughput"
+                          : "latency",
+                      W_STRING_UNICODE)},
+                 {"min_interval_ms",
+                  json_integer(sub.second->minInterval.count())},
+                 {"max_batch_files", json_integer(sub.second->maxBatchFiles)},
+                 {"dispatches", json_integer(sub.second->dispatches)},
+                 {"coalesced_settles",
+                  json_integer(sub.second->coalescedSettles)},
+                 {"last_latency_us",
+                  json_integer(sub.second->lastDispatchLatencyUs)},
+                 {"max_latency_us",
+                  json_integer(sub.second->maxDispatchLatencyUs)},
+             })},
+            {"metrics", sub.second->getMetrics()},
+            {"client_queue", user_client->outgoing.stats()},
         }));
       }
     }
@@ -215,6 +362,8 @@ static void cmd_debug_get_subscriptions(
 
   auto subscriptions = getDebugSubscriptionInfo(root.get());
   resp.object().emplace("subscriptions", subscriptions);
+  resp.set("overflow_recovery", root->getOverflowRecoveryInfo());
+  resp.set("shared_results", root->sharedSubscriptionResults.stats());
 
   send_and_dispose_response(clientbase, std::move(resp));
 }
@@ -244,5 +393,305 @@ W_CMD_REG(
     CMD_DAEMON,
     w_cmd_realpath_root)
 
+// Reports the throughput of the watcher of a root, the events that the
+// system dropped and its watches against their limit
+static void cmd_debug_watcher_info(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 2) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-watcher-info'");
+    return;
+  }
+  auto root = resolveRoot(client, args);
+
+  auto resp = make_response();
+  resp.set(
+      {{"root", w_string_to_json(root->root_path)},
+       {"watcher", root->view()->getWatcherInfo()}});
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-watcher-info",
+    cmd_debug_watcher_info,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
+// Reports the perf samples that were taken since the stats were last
+// reset, aggregated by their description and root, and the perf alarms
+// that have been raised.
+// ["debug-perf-stats", {"reset": true}] also resets the samples.
+static void cmd_debug_perf_stats(
+    struct watchman_client* client,
+    const json_ref& args) {
+  bool reset = false;
+  if (json_array_size(args) > 2) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-perf-stats'");
+    return;
+  }
+  if (json_array_size(args) == 2) {
+    const auto& options = args.at(1);
+    if (!options.isObject()) {
+      send_error_response(
+          client, "expected the options of 'debug-perf-stats' to be an object");
+      return;
+    }
+    reset = options.get_default("reset", json_false()).asBool();
+  }
+
+  auto resp = make_response();
+  resp.set(
+      {{"perf_stats", PerfStats::get().toJson(reset)},
+       {"perf_logger", perf_logger_stats()},
+       {"perf_alarms", PerfAlarms::get().stats()}});
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG("debug-perf-stats", cmd_debug_perf_stats, CMD_DAEMON, NULL)
+
+// Reports how many times each command that has run was dispatched, how
+// many of those failed or are under way, and how long they took.
+// ["debug-command-stats", {"reset": true}] also resets the stats.
+static void cmd_debug_command_stats(
+    struct watchman_client* client,
+    const json_ref& args) {
+  bool reset = false;
+  if (json_array_size(args) > 2) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-command-stats'");
+    return;
+  }
+  if (json_array_size(args) == 2) {
+    const auto& options = args.at(1);
+    if (!options.isObject()) {
+      send_error_response(
+          client,
+          "expected the options of 'debug-command-stats' to be an object");
+      return;
+    }
+    reset = options.get_default("reset", json_false()).asBool();
+  }
+
+  auto commands = json_object();
+  for (auto def : get_all_commands()) {
+    if (def->stats.calls() == 0 && def->stats.inflight() == 0) {
+      continue;
+    }
+    commands.set(def->name, def->stats.toJson(reset));
+  }
+
+  auto resp = make_response();
+  resp.set("command_stats", std::move(commands));
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG("debug-command-stats", cmd_debug_command_stats, CMD_DAEMON, NULL)
+
+// Reports the contention on the view, pending and clients locks.
+// ["debug-lock-stats", {"enable": true, "reset": true}] turns the
+// profiling on or off and clears the stats after reporting them.
+static void cmd_debug_lock_stats(
+    struct watchman_client* client,
+    const json_ref& args) {
+  bool reset = false;
+  if (json_array_size(args) > 2) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-lock-stats'");
+    return;
+  }
+  if (json_array_size(args) == 2) {
+    const auto& options = args.at(1);
+    if (!options.isObject()) {
+      send_error_response(
+          client, "expected the options of 'debug-lock-stats' to be an object");
+      return;
+    }
+    auto enable = options.get_default("enable");
+    if (enable) {
+      LockProfile::setEnabled(enable.asBool());
+    }
+    reset = options.get_default("reset", json_false()).asBool();
+  }
+
+  auto resp = make_response();
+  resp.set(
+      {{"enabled", json_boolean(LockProfile::enabled())},
+       {"locks", LockProfile::allToJson(reset)}});
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG("debug-lock-stats", cmd_debug_lock_stats, CMD_DAEMON, NULL)
+
+// Lists the full crawls that are running and those that are waiting for
+// max_concurrent_crawls to let them run, in the order that they will run
+static void cmd_debug_crawl_queue(
+    struct watchman_client* client,
+    const json_ref&) {
+  auto& scheduler = getCrawlScheduler();
+  auto crawls = json_array();
+  for (auto& entry : scheduler.getQueue()) {
+    crawls.array().push_back(json_object(
+        {{"root", w_string_to_json(entry.name)},
+         {"running", json_boolean(entry.running)},
+         {"waited_on", json_boolean(entry.prioritized)},
+         {"position", json_integer(entry.position)},
+         {"age_ms", json_integer(entry.age.count())}}));
+  }
+
+  auto resp = make_response();
+  resp.set(
+      {{"max_concurrent", json_integer(scheduler.maxConcurrent())},
+       {"crawls", std::move(crawls)}});
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG("debug-crawl-queue", cmd_debug_crawl_queue, CMD_DAEMON, NULL)
+
+// Reports how often the paths that name roots were resolved from the cache
+static void cmd_debug_root_path_cache(
+    struct watchman_client* client,
+    const json_ref&) {
+  auto resp = make_response();
+  resp.set("cache", getRootPathCache().stats());
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-root-path-cache",
+    cmd_debug_root_path_cache,
+    CMD_DAEMON,
+    NULL)
+
+// Shows which CPUs each of the threads of the server may run on, and
+// where each of them last ran, to check the effect of the placement
+// options
+static void cmd_debug_thread_placement(
+    struct watchman_client* client,
+    const json_ref&) {
+  auto threads = json_array();
+  for (auto& placement : getThreadPlacements()) {
+    threads.array().push_back(json_object(
+        {{"tid", json_integer(placement.tid)},
+         {"name", typed_string_to_json(placement.name.c_str(), W_STRING_BYTE)},
+         {"cpus", typed_string_to_json(
+                      placement.allowed.toString().c_str(), W_STRING_BYTE)},
+         {"last_cpu", json_integer(placement.lastCpu)},
+         {"numa_node", json_integer(placement.numaNode)}}));
+  }
+
+  auto resp = make_response();
+  resp.set("threads", std::move(threads));
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-thread-placement",
+    cmd_debug_thread_placement,
+    CMD_DAEMON,
+    NULL)
+
+// Returns the recorded trace in the Chrome trace event format; the
+// response can be loaded into chrome://tracing or Perfetto as it is.
+// ["debug-trace", {"enable": true, "clear": true, "dump": true}] turns
+// tracing on or off, clears the trace after returning it, or writes it
+// to a file next to the state file rather than returning it.
+static void cmd_debug_trace(
+    struct watchman_client* client,
+    const json_ref& args) {
+  bool clear = false;
+  bool dump = false;
+  if (json_array_size(args) > 2) {
+    send_error_response(client, "wrong number of arguments for 'debug-trace'");
+    return;
+  }
+  if (json_array_size(args) == 2) {
+    const auto& options = args.at(1);
+    if (!options.isObject()) {
+      send_error_response(
+          client, "expected the options of 'debug-trace' to be an object");
+      return;
+    }
+    auto enable = options.get_default("enable");
+    if (enable) {
+      Tracing::setEnabled(enable.asBool());
+    }
+    clear = options.get_default("clear", json_false()).asBool();
+    dump = options.get_default("dump", json_false()).asBool();
+  }
+
+  auto resp = make_response();
+  resp.set("enabled", json_boolean(Tracing::enabled()));
+  if (dump) {
+    auto path = Tracing::dumpToFile("it was requested");
+    if (!path) {
+      send_error_response(client, "failed to write the trace");
+      return;
+    }
+    resp.set("path", w_string_to_json(path));
+  } else {
+    resp.set(
+        {{"traceEvents", Tracing::toTraceEvents()},
+         {"displayTimeUnit", typed_string_to_json("ms", W_STRING_UNICODE)}});
+  }
+  if (clear) {
+    Tracing::clear();
+  }
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG("debug-trace", cmd_debug_trace, CMD_DAEMON, NULL)
+
 /* vim:ts=2:sw=2:et:
  */
+
+// Reports an estimate of the memory held by each watched root, broken
+// down by what holds it, along with that of the outgoing queues of the
+// clients and the logs of the responses sent to subscribers.  The counts
+// are maintained as the memory is allocated, so this is cheap enough to
+// use against a busy server.
+static void cmd_debug_memory(struct watchman_client* client, const json_ref&) {
+  struct SubscriptionUsage {
+    size_t subscriptions{0};
+    size_t loggedResponses{0};
+    size_t loggedBytes{0};
+  };
+  std::unordered_map<w_string, SubscriptionUsage> subscriptions;
+  size_t numClients = 0;
+  size_t queuedBytes = 0;
+  {
+    auto clientsLock = ::clients.rlock();
+    for (const auto& c : *clientsLock) {
+      ++numClients;
+      queuedBytes += c->outgoing.queuedBytes();
+      auto* user_client = dynamic_cast<watchman_user_client*>(c.get());
+      if (!user_client) {
+        continue;
+      }
+      for (const auto& sub : user_client->subscriptions) {
+        auto& usage = subscriptions[sub.second->root->root_path];
+        ++usage.subscriptions;
+        usage.loggedResponses += sub.second->lastResponses.size();
+        for (const auto& response : sub.second->lastResponses) {
+          usage.loggedBytes += response.bytes;
+        }
+      }
+    }
+  }
+
+  auto roots = w_root_memory_usage_to_json();
+  for (auto& root : roots.array()) {
+    auto it = subscriptions.find(json_to_w_string(root.get("root")));
+    if (it == subscriptions.end()) {
+      continue;
+    }
+    root.set(
+        {{"subscriptions", json_integer(it->second.subscriptions)},
+         {"subscription_logged_responses",
+          json_integer(it->second.loggedResponses)},
+         {"subscription_logged_bytes", json_integer(it->second.loggedBytes)}});
+  }
+
+  auto resp = make_response();
+  resp.set(
+      {{"roots", std::move(roots)},
+       {"clients",
+        json_object(
+            {{"count", json_integer(numClients)},
+             {"queued_bytes", json_integer(queuedBytes)}})}});
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG("debug-memory", cmd_debug_memory, CMD_DAEMON, NULL)
@@ -15,22 +15,30 @@ static void cmd_find(struct watchman_client* client, const json_ref& args) {
 
   auto root = resolveRoot(client, args);
 
-  auto query = w_query_parse_legacy(root, args, 2, nullptr, nullptr, nullptr);
+  w_string cacheKey;
+  std::shared_ptr<w_query> query;
   if (client->client_mode) {
+    query = w_query_parse_legacy(root, args, 2, nullptr, nullptr, nullptr);
     query->sync_timeout = std::chrono::milliseconds(0);
+  } else {
+    query = w_query_parse_legacy_cached(root, args, 2, nullptr, cacheKey);
   }
+  prepareQueryRendering(client, query.get());
 
-  auto res = w_query_execute(query.get(), root, nullptr);
+  auto res =
+      w_query_execute(query.get(), root, nullptr, client->hangupProbe());
   auto response = make_response();
-  response.set({{"clock", res.clockAtStartOfQuery.toJson()},
-                {"files", std::move(res.resultsArray)}});
+  response.set("clock", res.clockAtStartOfQuery.toJson());
 
-  send_and_dispose_response(client, std::move(response));
+  sendQueryResponse(client, query.get(), res, std::move(response));
+  if (cacheKey) {
+    root->queryPlanCache.put(cacheKey, std::move(query));
+  }
 }
 W_CMD_REG(
     "find",
     cmd_find,
-    CMD_DAEMON | CMD_ALLOW_ANY_USER,
+    CMD_DAEMON | CMD_ALLOW_ANY_USER | CMD_CONCURRENT,
     w_cmd_realpath_root)
 
 /* vim:ts=2:sw=2:et:
@@ -147,7 +147,11 @@ static void cmd_get_config(
   resp.set("config", std::move(config));
   send_and_dispose_response(client, std::move(resp));
 }
-W_CMD_REG("get-config", cmd_get_config, CMD_DAEMON, w_cmd_realpath_root)
+W_CMD_REG(
+    "get-config",
+    cmd_get_config,
+    CMD_DAEMON | CMD_CONCURRENT,
+    w_cmd_realpath_root)
 
 /* vim:ts=2:sw=2:et:
  */
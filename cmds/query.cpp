@@ -2,9 +2,86 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 using namespace watchman;
 
+namespace {
+// Sets the fields of a query response other than the files
+void setQueryResultFields(json_ref& response, w_query_res& res) {
+  response.set({{"is_fresh_instance", json_boolean(res.is_fresh_instance)},
+                {"clock", res.clockAtStartOfQuery.toJson()}});
+  if (res.savedStateInfo) {
+    response.set({{"saved-state-info", std::move(res.savedStateInfo)}});
+  }
+  if (res.explain) {
+    response.set({{"explain", std::move(res.explain)}});
+  }
+  if (res.nextPageToken) {
+    response.set({{"next_page_token", w_string_to_json(res.nextPageToken)}});
+  }
+  if (res.hasMore) {
+    response.set({{"has_more", json_true()}});
+  }
+}
+} // namespace
+
+void prepareQueryRendering(watchman_client* client, w_query* query) {
+  query->render_bser =
+      (client->pdu_type == is_bser || client->pdu_type == is_bser_v2) &&
+      !client->client_mode && query->stream_chunk_size == 0;
+  if (query->render_bser) {
+    query->render_bser_version = client->pdu_type == is_bser ? 1 : 2;
+    query->render_bser_capabilities = client->capabilities;
+  }
+}
+
+void sendQueryResponse(
+    watchman_client* client,
+    w_query* query,
+    w_query_res& res,
+    json_ref&& response) {
+  if (!query->render_bser) {
+    response.set("files", std::move(res.resultsArray));
+    send_and_dispose_response(client, std::move(response));
+    return;
+  }
+
+  auto files = w_query_res_encode_bser_results(query, res);
+  annotate_with_request_tag(client, response);
+  std::string encoded;
+  if (!watchman_json_buffer::bserPduEncodeToString(
+          client->pdu_type,
+          client->capabilities,
+          response,
+          w_string("files", W_STRING_UNICODE),
+          files,
+          encoded)) {
+    throw QueryExecError("failed to encode the query results");
+  }
+  client->writeEncodedResponseNow(encoded);
+}
+
+// Syncs the root of the query before it is dispatched, so that nothing is
+// held up while the sync waits for the watcher; see command_wait_func
+static folly::Future<folly::Unit> wait_for_query_sync(
+    watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 3 || !args.at(2).isObject()) {
+    // cmd_query reports what is wrong with it
+    return folly::makeFuture();
+  }
+  auto timeout = args.at(2).get_default(
+      "sync_timeout", json_integer(DEFAULT_QUERY_SYNC_MS.count()));
+  if (!timeout.isInt() || timeout.asInt() <= 0) {
+    return folly::makeFuture();
+  }
+  auto root = resolveRoot(client, args);
+  return root->syncToNowAsync(std::chrono::milliseconds(timeout.asInt()));
+}
+
 /* query /root {query} */
 static void cmd_query(struct watchman_client* client, const json_ref& args) {
   if (json_array_size(args) != 3) {
@@ -15,30 +92,343 @@ static void cmd_query(struct watchman_client* client, const json_ref& args) {
   auto root = resolveRoot(client, args);
 
   const auto& query_spec = args.at(2);
+  scopeQueryToSharedWatch(args, query_spec);
   auto query = w_query_parse(root, query_spec);
 
   if (client->client_mode) {
     query->sync_timeout = std::chrono::milliseconds(0);
+    // Only the final response is printed in client mode
+    query->stream_chunk_size = 0;
   }
 
-  auto res = w_query_execute(query.get(), root, nullptr);
-  auto response = make_response();
-  response.set({{"is_fresh_instance", json_boolean(res.is_fresh_instance)},
-                {"clock", res.clockAtStartOfQuery.toJson()},
-                {"files", std::move(res.resultsArray)}});
-  if (res.savedStateInfo) {
-    response.set({{"saved-state-info", std::move(res.savedStateInfo)}});
+  // The root may have been synced before the command was dispatched; see
+  // wait_for_query_sync
+  if (query->sync_timeout.count()) {
+    try {
+      if (command_wait_synced(client)) {
+        query->sync_timeout = std::chrono::milliseconds(0);
+      }
+    } catch (const std::exception& exc) {
+      throw QueryExecError("synchronization failed: ", exc.what());
+    }
   }
 
+  if (query->stream_chunk_size > 0) {
+    // Send the results as they are produced, each chunk as a partial
+    // response; the final response holds the rest of them.  The view
+    // doesn't pass them on while it is locked, as this may block on the
+    // client.
+    query->result_sink = [client](json_ref&& files) {
+      auto partial = make_response();
+      partial.set({{"partial", json_true()}, {"files", std::move(files)}});
+      if (!client->writeResponseNow(std::move(partial))) {
+        throw QueryExecError("failed to send partial results to the client");
+      }
+    };
+  }
+
+  // A BSER client can be sent rows that are encoded as the files are
+  // rendered, rather than built up as json values and then encoded.  BSER
+  // v3 clients are sent the json values, so that the names of the files
+  // can be encoded against the string dictionary of the response.
+  // Packed names don't go through the dictionary, so they are rendered the
+  // same way for any version.
+  if (query->packed_names) {
+    if ((client->pdu_type != is_bser && client->pdu_type != is_bser_v2 &&
+         client->pdu_type != is_bser_v3) ||
+        client->client_mode) {
+      send_error_response(
+          client, "packed_names requires a BSER connection to the server");
+      return;
+    }
+    query->render_bser = true;
+    query->render_bser_version = client->pdu_type == is_bser
+        ? 1
+        : client->pdu_type == is_bser_v2 ? 2 : 3;
+    query->render_bser_capabilities = client->capabilities;
+  } else {
+    prepareQueryRendering(client, query.get());
+  }
+
+  // Without a since clock, the response depends only on the query and the
+  // position of the view, so a client that repeats a query that was made
+  // at the same position can be sent the response that we already encoded.
+  // A response to a tagged request is only good for that request.
+  auto& cache = root->queryResultCache;
+  bool cacheable = cache.enabled() && !client->client_mode &&
+      !client->request_tag && !query->since_spec &&
+      query->stream_chunk_size == 0 && !query->explain && !query->profile &&
+      query->bench_iterations == 0;
+  w_string cacheKey;
+  if (cacheable) {
+    // Sync first so that we look up the position that the query would
+    // have been executed at
+    if (query->sync_timeout.count()) {
+      try {
+        root->syncToNow(query->sync_timeout);
+      } catch (const std::exception& exc) {
+        throw QueryExecError("synchronization failed: ", exc.what());
+      }
+      query->sync_timeout = std::chrono::milliseconds(0);
+    }
+
+    auto canonical = json_dumps(query_spec, JSON_COMPACT | JSON_SORT_KEYS);
+    cacheKey = w_string(canonical.data(), canonical.size(), W_STRING_BYTE);
+    auto encoded = cache.get(
+        cacheKey,
+        client->pdu_type,
+        client->capabilities,
+        root->view()->getMostRecentRootNumberAndTickValue());
+    if (encoded) {
+      client->writeEncodedResponseNow(*encoded);
+      return;
+    }
+  }
+
+  auto res =
+      w_query_execute(query.get(), root, nullptr, client->hangupProbe());
+  auto response = make_response();
+  setQueryResultFields(response, res);
+
   add_root_warnings_to_response(response, root);
+  if (response.get_default("warning")) {
+    // The warning can be cleared without the clock ticking, so it must not
+    // be repeated to the clients that make this query later
+    cacheable = false;
+  }
+
+  // The files are encoded ahead of the rest of the response so that the
+  // profile can report how long that took
+  std::string files;
+  if (query->render_bser || res.profile) {
+    auto start = std::chrono::steady_clock::now();
+    if (query->packed_names) {
+      files = w_query_res_encode_packed_names(query.get(), res);
+    } else if (query->render_bser) {
+      files = w_query_res_encode_bser_results(query.get(), res);
+    } else {
+      watchman_json_buffer::pduEncodeToString(
+          client->pdu_type, client->capabilities, res.resultsArray, files);
+    }
+    if (res.profile) {
+      res.profile.set(
+          "serialize_us",
+          json_integer(std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count()));
+      response.set({{"profile", std::move(res.profile)}});
+    }
+  }
+
+  if (query->render_bser) {
+    annotate_with_request_tag(client, response);
+    auto encoded = std::make_shared<std::string>();
+    if (!watchman_json_buffer::bserPduEncodeToString(
+            client->pdu_type,
+            client->capabilities,
+            response,
+            w_string("files", W_STRING_UNICODE),
+            files,
+            *encoded)) {
+      throw QueryExecError("failed to encode the query results");
+    }
+    if (cacheable) {
+      cache.set(
+          cacheKey,
+          client->pdu_type,
+          client->capabilities,
+          res.clockAtStartOfQuery.position(),
+          encoded);
+    }
+    client->writeEncodedResponseNow(*encoded);
+    return;
+  }
+
+  response.set("files", std::move(res.resultsArray));
+
+  if (cacheable) {
+    auto encoded = std::make_shared<std::string>();
+    if (watchman_json_buffer::pduEncodeToString(
+            client->pdu_type, client->capabilities, response, *encoded)) {
+      cache.set(
+          cacheKey,
+          client->pdu_type,
+          client->capabilities,
+          res.clockAtStartOfQuery.position(),
+          encoded);
+      client->writeEncodedResponseNow(*encoded);
+      return;
+    }
+  }
 
   send_and_dispose_response(client, std::move(response));
 }
-W_CMD_REG(
+W_CMD_REG_WAIT(
     "query",
     cmd_query,
-    CMD_DAEMON | CMD_CLIENT | CMD_ALLOW_ANY_USER,
-    w_cmd_realpath_root)
+    CMD_DAEMON | CMD_CLIENT | CMD_ALLOW_ANY_USER | CMD_CONCURRENT,
+    w_cmd_realpath_root,
+    wait_for_query_sync)
+
+namespace {
+struct MultiQueryItem {
+  std::shared_ptr<w_root_t> root;
+  std::shared_ptr<w_query> query;
+  // The response to the query, or an object holding its error
+  json_ref result;
+};
+
+json_ref errorResult(const char* prefix, const std::exception& exc) {
+  return json_object(
+      {{"error", typed_string_to_json(w_string::build(prefix, exc.what()))}});
+}
+} // namespace
+
+/* multi-query [[/root, {query}], ...]
+ * Runs several queries, against one root or many, in one round trip.  The
+ * roots are each resolved and synced once, however many of the queries
+ * name them, and the queries then run concurrently.  The response holds
+ * the responses of the queries, in order, in its "results" array; a query
+ * that fails has an object with just its "error" there rather than
+ * failing the others. */
+static void cmd_multi_query(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 2 || !args.at(1).isArray()) {
+    throw CommandValidationError(
+        "multi-query expects an array of [root, query] pairs");
+  }
+  const auto& specs = args.at(1).array();
+
+  std::vector<MultiQueryItem> items(specs.size());
+  // The roots that have been resolved, and the longest sync_timeout of the
+  // queries against each
+  std::unordered_map<w_string, std::shared_ptr<w_root_t>> roots;
+  std::unordered_map<w_root_t*, std::chrono::milliseconds> syncTimeouts;
+
+  for (size_t i = 0; i < specs.size(); ++i) {
+    auto& item = items[i];
+    const auto& spec = specs[i];
+    if (!spec.isArray() || json_array_size(spec) != 2) {
+      throw CommandValidationError(
+          "multi-query expects an array of [root, query] pairs");
+    }
+    auto name = json_string_value(spec.at(0));
+    if (!name) {
+      throw CommandValidationError(
+          "the root of each multi-query entry must be a string");
+    }
+
+    try {
+      auto rootArgs = json_array(
+          {typed_string_to_json("multi-query"), spec.at(0)});
+      w_cmd_realpath_root_cached(rootArgs);
+      auto path = json_to_w_string(rootArgs.at(1));
+      auto it = roots.find(path);
+      if (it == roots.end()) {
+        it = roots.emplace(path, resolveRoot(client, rootArgs)).first;
+      }
+      item.root = it->second;
+      scopeQueryToSharedWatch(rootArgs, spec.at(1));
+    } catch (const std::exception& exc) {
+      item.result = errorResult("", exc);
+      continue;
+    }
+
+    try {
+      item.query = w_query_parse(item.root, spec.at(1));
+    } catch (const std::exception& exc) {
+      item.result = errorResult("failed to parse query: ", exc);
+      continue;
+    }
+    if (client->client_mode) {
+      item.query->sync_timeout = std::chrono::milliseconds(0);
+    }
+    auto& timeout = syncTimeouts[item.root.get()];
+    timeout = std::max(timeout, item.query->sync_timeout);
+    item.query->sync_timeout = std::chrono::milliseconds(0);
+  }
+
+  // One cookie per root, rather than one per query
+  std::unordered_map<w_root_t*, std::string> syncErrors;
+  for (auto& it : roots) {
+    auto timeout = syncTimeouts[it.second.get()];
+    if (timeout.count() == 0) {
+      continue;
+    }
+    try {
+      it.second->syncToNow(timeout);
+    } catch (const std::exception& exc) {
+      syncErrors[it.second.get()] = exc.what();
+    }
+  }
+
+  std::vector<size_t> runnable;
+  for (size_t i = 0; i < items.size(); ++i) {
+    auto& item = items[i];
+    if (!item.query) {
+      continue;
+    }
+    auto syncError = syncErrors.find(item.root.get());
+    if (syncError != syncErrors.end()) {
+      item.result = json_object(
+          {{"error",
+            typed_string_to_json(w_string::build(
+                "synchronization failed: ", syncError->second))}});
+      continue;
+    }
+    runnable.push_back(i);
+  }
+
+  // The queries run on threads of their own, rather than on the thread
+  // pool, as evaluating a query can itself wait on work in the pool
+  std::atomic<size_t> next{0};
+  auto worker = [&] {
+    for (auto i = next++; i < runnable.size(); i = next++) {
+      auto& item = items[runnable[i]];
+      try {
+        auto res = w_query_execute(
+            item.query.get(), item.root, nullptr, client->hangupProbe());
+        auto result = json_object();
+        setQueryResultFields(result, res);
+        if (res.profile) {
+          result.set("profile", std::move(res.profile));
+        }
+        add_root_warnings_to_response(result, item.root);
+        result.set("files", std::move(res.resultsArray));
+        item.result = std::move(result);
+      } catch (const std::exception& exc) {
+        item.result = errorResult("", exc);
+      }
+    }
+  };
+  auto numThreads = std::min<size_t>(
+      runnable.size(), std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < numThreads; ++i) {
+    threads.emplace_back([&, i] {
+      w_set_thread_name("multi-query ", i);
+      worker();
+    });
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  auto results = json_array_of_size(items.size());
+  for (auto& item : items) {
+    json_array_append_new(results, std::move(item.result));
+  }
+  auto response = make_response();
+  response.set("results", std::move(results));
+  send_and_dispose_response(client, std::move(response));
+}
+W_CMD_REG(
+    "multi-query",
+    cmd_multi_query,
+    CMD_DAEMON | CMD_CLIENT | CMD_ALLOW_ANY_USER | CMD_CONCURRENT,
+    NULL)
 
 /* vim:ts=2:sw=2:et:
  */
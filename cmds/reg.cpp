@@ -3,6 +3,7 @@
 
 #include "watchman.h"
 #include <folly/ScopeGuard.h>
+#include "CommandAdmission.h"
 
 using namespace watchman;
 
@@ -45,6 +46,42 @@ command_handler_def* lookup(const json_ref& args, int mode) {
   return lookup_command(json_to_w_string(jstr), mode);
 }
 
+bool is_concurrent_command(const json_ref& args, int mode) {
+  try {
+    auto def = lookup(args, mode);
+    return def && (def->flags & CMD_CONCURRENT);
+  } catch (const std::exception&) {
+    // dispatch_command will report what is wrong with it
+    return false;
+  }
+}
+
+folly::Optional<folly::Future<folly::Unit>> start_command_wait(
+    watchman_client* client,
+    const json_ref& args,
+    int mode) {
+  try {
+    auto def = lookup(args, mode);
+    if (!def || !def->wait || !poisoned_reason.rlock()->empty() ||
+        (!client->client_is_owner && (def->flags & CMD_ALLOW_ANY_USER) == 0)) {
+      return folly::none;
+    }
+    return def->wait(client, args);
+  } catch (const std::exception& exc) {
+    // dispatch_command will run into it too, and report it
+    logf(DBG, "not waiting before dispatching command: {}\n", exc.what());
+    return folly::none;
+  }
+}
+
+bool command_wait_synced(watchman_client* client) {
+  if (!client->commandWait) {
+    return false;
+  }
+  client->commandWait->throwIfFailed();
+  return true;
+}
+
 void preprocess_command(
     json_ref& args,
     enum w_pdu_type output_pdu,
@@ -82,6 +119,15 @@ bool dispatch_command(
     int mode) {
   command_handler_def* def;
   char sample_name[128];
+  // Counts the command in its CommandStats once it is known, up until the
+  // error response, if any, has been sent
+  folly::Optional<CommandStats::Call> call;
+  auto errorResponses = client->errorResponses;
+  SCOPE_EXIT {
+    if (call && client->errorResponses != errorResponses) {
+      call->fail();
+    }
+  };
 
   // Stash a reference to the current command to make it easier to log
   // the command context in some of the error paths
@@ -96,6 +142,11 @@ bool dispatch_command(
       send_error_response(client, "Unknown command");
       return false;
     }
+    call.emplace(
+        def->stats,
+        CommandStats::pduFor(client->pdu_type),
+        CommandStats::clientClassFor(
+            client->getPeerProcessID(), client->client_is_owner));
 
     if (!poisoned_reason.rlock()->empty() &&
         (def->flags & CMD_POISON_IMMUNE) == 0) {
@@ -109,6 +160,30 @@ bool dispatch_command(
       return false;
     }
 
+    // Hold back expensive commands while too many are running; see
+    // CommandAdmission
+    std::unique_ptr<CommandAdmission::Ticket> ticket;
+    auto& admission = getCommandAdmission();
+    auto priority = mode == CMD_DAEMON && admission.enabled()
+        ? CommandAdmission::classify(def->name, args)
+        : CommandAdmission::Priority::Interactive;
+    if (priority != CommandAdmission::Priority::Interactive) {
+      // The tagged requests of a client count against its limit too
+      const void* admissionKey = client;
+      if (auto request = dynamic_cast<watchman_request_client*>(client)) {
+        admissionKey = request->parent.get();
+      }
+      ticket = admission.admit(priority, admissionKey);
+      if (!ticket) {
+        send_error_response(
+            client,
+            "too many %s queries are running or waiting to run; "
+            "try again later",
+            CommandAdmission::priorityName(priority));
+        return false;
+      }
+    }
+
     // Scope for the perf sample
     {
       logf(DBG, "dispatch_command: {}\n", def->name);
@@ -123,6 +198,7 @@ bool dispatch_command(
       sample.set_wall_time_thresh(
           cfg_get_double("slow_command_log_threshold_seconds", 1.0));
 
+      LockSite site(def->name);
       def->func(client, args);
 
       if (sample.finish()) {
@@ -130,7 +206,7 @@ bool dispatch_command(
         sample.add_meta(
             "client",
             json_object(
-                {{"pid", json_integer(client->stm->getPeerProcessID())}}));
+                {{"pid", json_integer(client->getPeerProcessID())}}));
         sample.log();
       } else {
         logf(DBG, "dispatch_command: {} (completed)\n", def->name);
@@ -0,0 +1,169 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include "ContentHashRemote.h"
+#include "saved_state/SavedStateInterface.h"
+#include "scm/SCM.h"
+
+using namespace watchman;
+
+namespace {
+
+// The version of the saved state that save-state writes
+constexpr int kSavedStateVersion = 1;
+
+// Throws unless the working copy is checked out at the merge base with
+// mergeBaseWith and has no changes relative to it; returns the merge base
+w_string requireCleanCheckout(const SCM* scm, const w_string& mergeBaseWith) {
+  auto mergeBase = scm->mergeBaseWith(mergeBaseWith);
+  auto changed = scm->getFilesChangedSinceMergeBaseWith(mergeBase);
+  if (!changed.empty()) {
+    throw std::runtime_error(folly::to<std::string>(
+        "saved states can only be saved from a clean checkout of the merge "
+        "base with ",
+        mergeBaseWith,
+        ", but ",
+        changed.size(),
+        " files differ from ",
+        mergeBase,
+        ", including ",
+        changed.front()));
+  }
+  return mergeBase;
+}
+
+// Writes the content hashes of the files to the content_hash_shared_dir of
+// the root, if it has one, for other checkouts of commitId to look up.
+// Returns the path of the manifest, or nullptr if it wasn't written.
+w_string writeContentHashManifest(
+    const std::shared_ptr<w_root_t>& root,
+    const w_string& commitId,
+    const json_ref& files) {
+  auto sharedDir = root->config.getString("content_hash_shared_dir", "");
+  if (!*sharedDir) {
+    return nullptr;
+  }
+  auto algorithm = ContentHashAlgorithm::Sha1;
+  auto hashSize = contentHashSize(algorithm);
+  ContentHashRemote::Manifest manifest;
+  for (auto& file : files.array()) {
+    // Files that couldn't be hashed are simply left out
+    auto hex = file.get("content.sha1hex");
+    std::string digest;
+    if (!hex.isString() || !folly::unhexlify(json_string_value(hex), digest) ||
+        digest.size() != hashSize) {
+      continue;
+    }
+    ContentHashRemote::ManifestEntry entry{
+        size_t(file.get("size").asInt()), ContentHashRemote::HashValue{}};
+    memcpy(entry.hash.data(), digest.data(), hashSize);
+    manifest[json_to_w_string(file.get("name"))] = entry;
+  }
+  auto path = ContentHashRemote::manifestPath(sharedDir, commitId, algorithm);
+  folly::writeFileAtomic(
+      path.c_str(),
+      ContentHashRemote::formatManifest(manifest, algorithm),
+      0644);
+  return path;
+}
+
+} // namespace
+
+/* save-state /root {options}
+ * Saves a saved state for the commit that the root is checked out at,
+ * which must be the merge base of the working copy with mergebase-with,
+ * to the storage that a scm-aware query with the same options would look
+ * it up in.  The options are:
+ * mergebase-with: the revision to take the merge base of the working
+ *   copy with, as in a scm-aware since clause
+ * saved-state: {storage:, config:} as in a scm-aware since clause
+ *
+ * The saved state is a JSON object holding the commit id and the name,
+ * size, mode and SHA-1 content hash of each file in the view, from which
+ * another checkout of the commit can be bootstrapped without crawling and
+ * hashing.  The hashes are also published to content_hash_shared_dir, if
+ * the root has one. */
+static void cmd_save_state(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 3 || !args.at(2).isObject()) {
+    send_error_response(
+        client,
+        "expected 'save-state' to be passed a root and an options object");
+    return;
+  }
+  const auto& options = args.at(2);
+  auto mergeBaseWith = options.get_default("mergebase-with");
+  if (!mergeBaseWith || !mergeBaseWith.isString()) {
+    throw CommandValidationError("mergebase-with must be a string");
+  }
+  auto savedState = options.get_default("saved-state");
+  if (!savedState || !savedState.isObject() ||
+      !savedState.get_default("storage").isString() ||
+      !savedState.get_default("config").isObject()) {
+    throw CommandValidationError(
+        "saved-state must be an object with a storage string and a config "
+        "object");
+  }
+
+  auto root = resolveRoot(client, args);
+  auto scm = root->view()->getSCM();
+  if (!scm) {
+    send_error_response(client, "root is not under source control");
+    return;
+  }
+  auto savedStateInterface = SavedStateInterface::getInterface(
+      json_to_w_string(savedState.get("storage")),
+      savedState.get("config"),
+      scm,
+      root);
+
+  auto commitId =
+      requireCleanCheckout(scm, json_to_w_string(mergeBaseWith));
+
+  // Syncs with the filesystem, so that the view matches the checkout
+  auto query = w_query_parse(
+      root,
+      json_object(
+          {{"expression", json_array({typed_string_to_json("type"),
+                                      typed_string_to_json("f")})},
+           {"fields",
+            json_array({typed_string_to_json("name"),
+                        typed_string_to_json("size"),
+                        typed_string_to_json("mode"),
+                        typed_string_to_json("content.sha1hex")})}}));
+  auto res =
+      w_query_execute(query.get(), root, nullptr, client->hangupProbe());
+
+  // The files that we hashed must all be those of the commit
+  if (requireCleanCheckout(scm, json_to_w_string(mergeBaseWith)) !=
+      commitId) {
+    throw std::runtime_error(
+        "the checkout changed while the saved state was being saved");
+  }
+
+  auto numFiles = json_array_size(res.resultsArray);
+  auto data = json_dumps(
+      json_object(
+          {{"version", json_integer(kSavedStateVersion)},
+           {"commit-id", w_string_to_json(commitId)},
+           {"files", res.resultsArray}}),
+      JSON_COMPACT);
+  auto resp = make_response();
+  resp.set(
+      {{"commit-id", w_string_to_json(commitId)},
+       {"files", json_integer(numFiles)},
+       {"saved-state-info", savedStateInterface->saveState(commitId, data)}});
+  if (auto manifest =
+          writeContentHashManifest(root, commitId, res.resultsArray)) {
+    resp.set("content-hash-manifest", w_string_to_json(manifest));
+  }
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG("save-state", cmd_save_state, CMD_DAEMON, w_cmd_realpath_root)
+
+/* vim:ts=2:sw=2:et:
+ */
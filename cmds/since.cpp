@@ -24,24 +24,30 @@ static void cmd_since(struct watchman_client* client, const json_ref& args) {
     return;
   }
 
-  auto query = w_query_parse_legacy(root, args, 3, nullptr, clockspec, nullptr);
+  w_string cacheKey;
+  auto query =
+      w_query_parse_legacy_cached(root, args, 3, clockspec, cacheKey);
+  prepareQueryRendering(client, query.get());
 
-  auto res = w_query_execute(query.get(), root, nullptr);
+  auto res =
+      w_query_execute(query.get(), root, nullptr, client->hangupProbe());
   auto response = make_response();
   response.set({{"is_fresh_instance", json_boolean(res.is_fresh_instance)},
-                {"clock", res.clockAtStartOfQuery.toJson()},
-                {"files", std::move(res.resultsArray)}});
+                {"clock", res.clockAtStartOfQuery.toJson()}});
   if (res.savedStateInfo) {
     response.set({{"saved-state-info", std::move(res.savedStateInfo)}});
   }
 
   add_root_warnings_to_response(response, root);
-  send_and_dispose_response(client, std::move(response));
+  sendQueryResponse(client, query.get(), res, std::move(response));
+  if (cacheKey) {
+    root->queryPlanCache.put(cacheKey, std::move(query));
+  }
 }
 W_CMD_REG(
     "since",
     cmd_since,
-    CMD_DAEMON | CMD_ALLOW_ANY_USER,
+    CMD_DAEMON | CMD_ALLOW_ANY_USER | CMD_CONCURRENT,
     w_cmd_realpath_root)
 
 /* vim:ts=2:sw=2:et:
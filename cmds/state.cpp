@@ -16,6 +16,7 @@ struct state_arg {
   w_string name;
   ms sync_timeout;
   json_ref metadata;
+  bool defer_processing;
 };
 
 // Parses the args for state-enter and state-leave
@@ -26,6 +27,7 @@ static bool parse_state_arg(
   parsed->sync_timeout = DEFAULT_QUERY_SYNC_MS;
   parsed->metadata = nullptr;
   parsed->name = nullptr;
+  parsed->defer_processing = false;
 
   if (json_array_size(args) != 3) {
     send_error_response(
@@ -43,9 +45,11 @@ static bool parse_state_arg(
     return true;
   }
 
-  // [cmd, root, {name:, metadata:, sync_timeout:}]
+  // [cmd, root, {name:, metadata:, sync_timeout:, defer_processing:}]
   parsed->name = json_to_w_string(state_args.get("name"));
   parsed->metadata = state_args.get_default("metadata");
+  parsed->defer_processing =
+      state_args.get_default("defer_processing", json_false()).asBool();
   parsed->sync_timeout =
       ms(state_args
              .get_default(
@@ -76,6 +80,9 @@ void ClientStateAssertions::queueAssertion(
     }
   }
   states_[assertion->name].push_back(assertion);
+  if (assertion->deferProcessing) {
+    ++deferringProcessing_;
+  }
 }
 
 json_ref ClientStateAssertions::debugStates() const {
@@ -117,6 +124,9 @@ bool ClientStateAssertions::removeAssertion(
     if (*assertionIter == assertion) {
       assertion->disposition = ClientStateDisposition::Done;
       queue.erase(assertionIter);
+      if (assertion->deferProcessing) {
+        --deferringProcessing_;
+      }
 
       // If there are no more entries queued with this name, remove
       // the name from the states map.
@@ -190,7 +200,8 @@ static void cmd_state_enter(
     return;
   }
 
-  auto assertion = std::make_shared<ClientStateAssertion>(root, parsed.name);
+  auto assertion = std::make_shared<ClientStateAssertion>(
+      root, parsed.name, parsed.defer_processing);
 
   // Ask the root to track the assertion and maintain ordering.
   // This will throw if the state is already asserted or pending assertion
@@ -229,6 +240,9 @@ static void cmd_state_enter(
           // The client side of this will get removed when the client
           // disconnects or attempts to leave the state.
           root->assertedStates.wlock()->removeAssertion(assertion);
+          if (assertion->deferProcessing) {
+            root->view()->wakeThreads();
+          }
           return;
         }
         auto clock = w_string_to_json(root->view()->getCurrentClockString());
@@ -279,6 +293,11 @@ static void leave_state(
 
   // Now remove the state assertion
   assertion->root->assertedStates.wlock()->removeAssertion(assertion);
+  if (assertion->deferProcessing) {
+    // Have the IO thread apply what it held back, if nothing else holds
+    // it back now
+    assertion->root->view()->wakeThreads();
+  }
   // Increment state transition counter for this root
   assertion->root->stateTransCount++;
 
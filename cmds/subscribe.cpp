@@ -2,7 +2,12 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <atomic>
+#include <thread>
+#include "FairThreadPool.h"
 #include "MapUtil.h"
+#include "PerfAlarms.h"
+#include "Tracing.h"
 #include "watchman_error_category.h"
 
 using namespace watchman;
@@ -10,7 +15,7 @@ using namespace watchman;
 watchman_client_subscription::watchman_client_subscription(
     const std::shared_ptr<w_root_t>& root,
     std::weak_ptr<watchman_client> client)
-    : root(root), weakClient(client) {}
+    : root(root), rootPath(root->root_path), weakClient(client) {}
 
 std::shared_ptr<watchman_user_client>
 watchman_client_subscription::lockClient() {
@@ -125,15 +130,181 @@ void watchman_client_subscription::processSubscription() {
   }
 }
 
-void watchman_client_subscription::processSubscriptionImpl() {
-  auto client = lockClient();
-  if (!client) {
-    watchman::log(
-        watchman::ERR,
-        "encountered a vacated client while running subscription rules\n");
+json_ref watchman_client_subscription::getMetrics() const {
+  return json_object(
+      {{"settle_to_dispatch_us", settleToDispatchUs.toJson()},
+       {"evaluation_us", evaluationUs.toJson()},
+       {"encode_us", encodeUs.toJson()},
+       {"encoded_bytes", encodedBytes.toJson()},
+       {"deferred_dispatches", json_integer(deferredDispatches)},
+       {"dropped_dispatches", json_integer(droppedDispatches)}});
+}
+
+void watchman_client_subscription::noteSettle(
+    std::chrono::steady_clock::time_point now) {
+  if (settledAt_) {
+    coalescedSettles++;
+    return;
+  }
+  settledAt_ = now;
+}
+
+folly::Optional<std::chrono::steady_clock::time_point>
+watchman_client_subscription::dispatchIfDue(
+    std::chrono::steady_clock::time_point now) {
+  if (!settledAt_ || evaluating_) {
+    // The client is pinged once the evaluation completes, which will
+    // dispatch what has been noted in the meantime
+    return folly::none;
+  }
+
+  if (minInterval.count() > 0) {
+    auto due = dispatchMode == DispatchMode::Throughput
+        ? *settledAt_ + minInterval
+        : std::max(*settledAt_, lastDispatch_ + minInterval);
+    if (now < due) {
+      auto position = root->view()->getMostRecentRootNumberAndTickValue();
+      if (maxBatchFiles == 0 ||
+          root->view()->changedFilesSince(
+              position.rootNumber, last_sub_tick) < maxBatchFiles) {
+        return due;
+      }
+      watchman::log(
+          watchman::DBG,
+          "dispatching subscription ",
+          name,
+          " early; at least ",
+          maxBatchFiles,
+          " files changed\n");
+    }
+  }
+
+  auto settledAt = *settledAt_;
+  settledAt_.reset();
+  lastDispatch_ = now;
+  evaluating_ = true;
+
+  // Subscriptions are evaluated in a pool shared by all clients, taking
+  // turns between roots, so that the subscriptions of a client don't wait
+  // for each other, nor the subscriptions of one root for another
+  std::weak_ptr<watchman_client> client = weakClient;
+  try {
+    getSubscriptionThreadPool().add(
+        root.get(), [self = shared_from_this(), client, settledAt] {
+          self->evaluate(client, settledAt);
+        });
+    return folly::none;
+  } catch (const std::exception& exc) {
+    // The pool is stopping or backlogged, so evaluate it here instead
+    log(DBG,
+        "evaluating subscription ",
+        name,
+        " in the client thread: ",
+        exc.what(),
+        "\n");
+  }
+  evaluate(client, settledAt);
+  return folly::none;
+}
+
+void watchman_client_subscription::evaluate(
+    const std::weak_ptr<watchman_client>& client,
+    std::chrono::steady_clock::time_point settledAt) {
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+
+  w_perf_t sample("dispatch_subscription");
+  LockSite site("dispatch_subscription");
+  TraceSpan span("dispatch_subscription", name, true);
+  sample.set_root(root);
+  auto start = std::chrono::steady_clock::now();
+  uint64_t waited = duration_cast<microseconds>(start - settledAt).count();
+  settleToDispatchUs.record(waited);
+  PerfAlarms::sample("settle_to_dispatch", root->root_path, waited);
+
+  try {
+    processSubscription();
+  } catch (const std::exception& exc) {
+    log(ERR,
+        "error while processing subscription ",
+        name,
+        ": ",
+        exc.what(),
+        "\n");
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  uint64_t evaluation = duration_cast<microseconds>(end - start).count();
+  evaluationUs.record(evaluation);
+  uint64_t latency = duration_cast<microseconds>(end - settledAt).count();
+  dispatches++;
+  lastDispatchLatencyUs = latency;
+  if (latency > maxDispatchLatencyUs) {
+    maxDispatchLatencyUs = latency;
+  }
+
+  if (sample.finish()) {
+    sample.add_root_meta(root);
+    auto meta = getMetrics();
+    meta.set({{"name", w_string_to_json(name)},
+              {"settle_to_dispatch_us", json_integer(waited)},
+              {"evaluation_us", json_integer(evaluation)}});
+    sample.add_meta("subscription", std::move(meta));
+    sample.log();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(evaluationMutex_);
+    evaluated_ = true;
+  }
+  evaluationDone_.notify_all();
+
+  // Wake the client to collect the results
+  if (auto locked = client.lock()) {
+    locked->ping->notify();
+  }
+}
+
+void watchman_client_subscription::collectResults(
+    watchman_user_client* client,
+    bool wait) {
+  if (!evaluating_) {
+    return;
+  }
+
+  std::deque<json_ref> responses;
+  {
+    std::unique_lock<std::mutex> lock(evaluationMutex_);
+    if (wait) {
+      evaluationDone_.wait(lock, [this] { return evaluated_; });
+    } else if (!evaluated_) {
+      return;
+    }
+    responses.swap(evaluatedResponses_);
+    evaluated_ = false;
+  }
+  evaluating_ = false;
+
+  for (auto& response : responses) {
+    client->enqueueResponse(std::move(response), false);
+  }
+  for (auto& response : heldNotifications_) {
+    client->enqueueResponse(std::move(response), false);
+  }
+  heldNotifications_.clear();
+}
+
+void watchman_client_subscription::sendNotification(
+    watchman_user_client* client,
+    json_ref&& response) {
+  if (evaluating_) {
+    heldNotifications_.push_back(std::move(response));
     return;
   }
+  client->enqueueResponse(std::move(response), false);
+}
 
+void watchman_client_subscription::processSubscriptionImpl() {
   sub_action action;
   w_string policy_name;
   auto position = root->view()->getMostRecentRootNumberAndTickValue();
@@ -156,6 +327,7 @@ void watchman_client_subscription::processSubscriptionImpl() {
           last_sub_tick,
           "\n");
       executeQuery = false;
+      droppedDispatches++;
     } else if (action == sub_action::defer) {
       watchman::log(
           watchman::DBG,
@@ -165,6 +337,7 @@ void watchman_client_subscription::processSubscriptionImpl() {
           policy_name,
           " is vacated\n");
       executeQuery = false;
+      deferredDispatches++;
     } else if (vcs_defer && root->view()->isVCSOperationInProgress()) {
       watchman::log(
           watchman::DBG,
@@ -172,12 +345,14 @@ void watchman_client_subscription::processSubscriptionImpl() {
           name,
           " until VCS operations complete\n");
       executeQuery = false;
+      deferredDispatches++;
+    } else if (skipUnmatchedChanges(position)) {
+      executeQuery = false;
     }
 
     if (executeQuery) {
       try {
-        last_sub_tick =
-            runSubscriptionRules(client.get(), root).position().ticks;
+        last_sub_tick = runSubscriptionRules(root).position().ticks;
       } catch (const std::exception& exc) {
         // This may happen if an SCM aware query fails to run hg for
         // whatever reason.  Since last_sub_tick is not advanced,
@@ -199,7 +374,52 @@ void watchman_client_subscription::processSubscriptionImpl() {
   }
 }
 
-void watchman_client_subscription::updateSubscriptionTicks(w_query_res* res) {
+// If the view can tell that none of the files that changed since the
+// subscription was last run can match its query, advances the
+// subscription over those changes rather than executing the query
+bool watchman_client_subscription::skipUnmatchedChanges(
+    const ClockPosition& position) {
+  auto since_spec = query->since_spec.get();
+  if (changeFilter.empty() || !since_spec || since_spec->tag != w_cs_clock ||
+      since_spec->hasScmParams()) {
+    return false;
+  }
+
+  auto view = root->view();
+  auto priorLineage = view->getPriorClockLineage();
+  auto since = since_spec->evaluate(
+      position,
+      view->getLastAgeOutTickValue(),
+      nullptr,
+      priorLineage.get_pointer());
+  if (since.clock.is_fresh_instance) {
+    // The subscriber needs to be told about that
+    return false;
+  }
+
+  auto through = view->unmatchedChangesThrough(
+      position.rootNumber, since.clock.ticks, changeFilter);
+  if (!through) {
+    return false;
+  }
+
+  watchman::log(
+      watchman::DBG,
+      "no changes for subscription ",
+      name,
+      " since ",
+      since.clock.ticks,
+      ", advanced ticks to ",
+      *through,
+      "\n");
+  last_sub_tick = *through;
+  query->since_spec = std::make_unique<ClockSpec>(
+      ClockPosition(position.rootNumber, *through));
+  return true;
+}
+
+void watchman_client_subscription::updateSubscriptionTicks(
+    const w_query_res* res) {
   // create a new spec that will be used the next time
   query->since_spec = std::make_unique<ClockSpec>(res->clockAtStartOfQuery);
 }
@@ -234,7 +454,8 @@ json_ref watchman_client_subscription::buildSubscriptionResults(
   logf(DBG, "running subscription {} {}\n", name, fmt::ptr(this));
 
   try {
-    auto res = w_query_execute(query.get(), root, time_generator);
+    auto resPtr = w_query_execute_shared(query.get(), root, time_generator);
+    const auto& res = *resPtr;
 
     logf(
         DBG,
@@ -280,12 +501,12 @@ json_ref watchman_client_subscription::buildSubscriptionResults(
 
     response.set({{"is_fresh_instance", json_boolean(res.is_fresh_instance)},
                   {"clock", res.clockAtStartOfQuery.toJson()},
-                  {"files", std::move(res.resultsArray)},
-                  {"root", w_string_to_json(root->root_path)},
+                  {"files", res.resultsArray},
+                  {"root", w_string_to_json(rootPath)},
                   {"subscription", w_string_to_json(name)},
                   {"unilateral", json_true()}});
     if (res.savedStateInfo) {
-      response.set({{"saved-state-info", std::move(res.savedStateInfo)}});
+      response.set({{"saved-state-info", res.savedStateInfo}});
     }
 
     return response;
@@ -301,7 +522,6 @@ json_ref watchman_client_subscription::buildSubscriptionResults(
 }
 
 ClockSpec watchman_client_subscription::runSubscriptionRules(
-    watchman_user_client* client,
     const std::shared_ptr<w_root_t>& root) {
   ClockSpec position;
 
@@ -310,11 +530,29 @@ ClockSpec watchman_client_subscription::runSubscriptionRules(
 
   if (response) {
     add_root_warnings_to_response(response, root);
-    client->enqueueResponse(std::move(response), false);
+    // Handed to the client thread by collectResults
+    std::lock_guard<std::mutex> lock(evaluationMutex_);
+    evaluatedResponses_.push_back(std::move(response));
   }
   return position;
 }
 
+// Syncs the root before flush-subscriptions is dispatched, so that nothing
+// is held up while the sync waits for the watcher; see command_wait_func
+static folly::Future<folly::Unit> wait_for_flush_sync(
+    watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 3 || !args.at(2).isObject()) {
+    return folly::makeFuture();
+  }
+  auto timeout = args.at(2).get_default("sync_timeout");
+  if (!timeout || !timeout.isInt() || timeout.asInt() <= 0) {
+    return folly::makeFuture();
+  }
+  auto root = resolveRoot(client, args);
+  return root->syncToNowAsync(std::chrono::milliseconds(timeout.asInt()));
+}
+
 static void cmd_flush_subscriptions(
     struct watchman_client* clientbase,
     const json_ref& args) {
@@ -388,7 +626,11 @@ static void cmd_flush_subscriptions(
     }
   }
 
-  root->syncToNow(std::chrono::milliseconds(sync_timeout));
+  // The root may have been synced before the command was dispatched; see
+  // wait_for_flush_sync
+  if (sync_timeout <= 0 || !command_wait_synced(client)) {
+    root->syncToNow(std::chrono::milliseconds(sync_timeout));
+  }
 
   auto resp = make_response();
   auto synced = json_array();
@@ -398,6 +640,9 @@ static void cmd_flush_subscriptions(
   for (auto& sub_name_str : subs_to_sync) {
     auto sub_iter = client->subscriptions.find(sub_name_str);
     auto& sub = sub_iter->second;
+    // Let an evaluation that is under way finish, and send its results
+    // ahead of ours
+    sub->collectResults(client, true);
 
     sub_action action;
     w_string policy_name;
@@ -444,11 +689,12 @@ static void cmd_flush_subscriptions(
   add_root_warnings_to_response(resp, root);
   send_and_dispose_response(client, std::move(resp));
 }
-W_CMD_REG(
+W_CMD_REG_WAIT(
     "flush-subscriptions",
     cmd_flush_subscriptions,
     CMD_DAEMON | CMD_ALLOW_ANY_USER,
-    w_cmd_realpath_root)
+    w_cmd_realpath_root,
+    wait_for_flush_sync)
 
 /* unsubscribe /root subname
  * Cancels a subscription */
@@ -485,79 +731,99 @@ W_CMD_REG(
     CMD_DAEMON | CMD_ALLOW_ANY_USER,
     w_cmd_realpath_root)
 
-/* subscribe /root subname {query}
- * Subscribes the client connection to the specified root. */
-static void cmd_subscribe(
-    struct watchman_client* clientbase,
-    const json_ref& args) {
-  std::shared_ptr<watchman_client_subscription> sub;
-  json_ref resp, initial_subscription_results;
-  json_ref jfield_list;
-  json_ref jname;
-  std::shared_ptr<w_query> query;
-  json_ref query_spec;
-  json_ref defer_list;
-  json_ref drop_list;
-  struct watchman_user_client* client =
-      (struct watchman_user_client*)clientbase;
-
-  if (json_array_size(args) != 4) {
-    send_error_response(client, "wrong number of arguments for subscribe");
-    return;
-  }
-
-  auto root = resolveRoot(client, args);
-
-  jname = args.at(2);
-  if (!jname.isString()) {
-    send_error_response(
-        client, "expected 2nd parameter to be subscription name");
-    return;
-  }
-
-  query_spec = args.at(3);
-
-  query = w_query_parse(root, query_spec);
-
-  defer_list = query_spec.get_default("defer");
+// Parses the subscription named name, with the query query_spec, of client
+// to root.  args are those of the command, whose root the query is scoped
+// to.  Throws CommandValidationError if the subscription is invalid.
+static std::shared_ptr<watchman_client_subscription> parse_subscription(
+    struct watchman_user_client* client,
+    const std::shared_ptr<w_root_t>& root,
+    const json_ref& args,
+    const w_string& name,
+    const json_ref& query_spec) {
+  scopeQueryToSharedWatch(args, query_spec);
+  auto query = w_query_parse(root, query_spec);
+  query->incremental_glob = true;
+
+  auto defer_list = query_spec.get_default("defer");
   if (defer_list && !defer_list.isArray()) {
-    send_error_response(client, "defer field must be an array of strings");
-    return;
+    throw CommandValidationError("defer field must be an array of strings");
   }
 
-  drop_list = query_spec.get_default("drop");
+  auto drop_list = query_spec.get_default("drop");
   if (drop_list && !drop_list.isArray()) {
-    send_error_response(client, "drop field must be an array of strings");
-    return;
+    throw CommandValidationError("drop field must be an array of strings");
   }
 
-  sub = std::make_shared<watchman_client_subscription>(
+  auto sub = std::make_shared<watchman_client_subscription>(
       root, client->shared_from_this());
 
-  sub->name = json_to_w_string(jname);
+  sub->rootPath = json_to_w_string(args.at(1));
+  sub->name = name;
   sub->query = query;
+  if (query->expr) {
+    sub->changeFilter.suffixes = query->expr->impliedSuffixes();
+  }
+  sub->changeFilter.relativeRoot = query->relative_root;
 
   auto defer = query_spec.get_default("defer_vcs", json_true());
   if (!defer.isBool()) {
-    send_error_response(client, "defer_vcs must be boolean");
-    return;
+    throw CommandValidationError("defer_vcs must be boolean");
   }
   sub->vcs_defer = defer.asBool();
 
-  if (drop_list || defer_list) {
-    size_t i;
+  auto overflow = query_spec.get_default("overflow");
+  if (overflow) {
+    const char* policy = json_string_value(overflow);
+    if (policy && !strcmp(policy, "coalesce")) {
+      sub->overflowPolicy =
+          watchman_client_subscription::OverflowPolicy::Coalesce;
+    } else if (policy && !strcmp(policy, "drop")) {
+      sub->overflowPolicy = watchman_client_subscription::OverflowPolicy::Drop;
+    } else {
+      throw CommandValidationError(
+          "overflow must be either \"coalesce\" or \"drop\"");
+    }
+  }
 
-    if (defer_list) {
-      for (i = 0; i < json_array_size(defer_list); i++) {
-        sub->drop_or_defer[json_to_w_string(json_array_get(defer_list, i))] =
-            false;
-      }
+  auto dispatch = query_spec.get_default("dispatch");
+  if (dispatch) {
+    const char* mode = json_string_value(dispatch);
+    if (mode && !strcmp(mode, "latency")) {
+      sub->dispatchMode = watchman_client_subscription::DispatchMode::Latency;
+    } else if (mode && !strcmp(mode, "throughput")) {
+      sub->dispatchMode =
+          watchman_client_subscription::DispatchMode::Throughput;
+    } else {
+      throw CommandValidationError(
+          "dispatch must be either \"latency\" or \"throughput\"");
     }
-    if (drop_list) {
-      for (i = 0; i < json_array_size(drop_list); i++) {
-        sub->drop_or_defer[json_to_w_string(json_array_get(drop_list, i))] =
-            true;
-      }
+  }
+
+  auto min_interval =
+      query_spec.get_default("min_interval_ms", json_integer(0));
+  if (!min_interval.isInt() || min_interval.asInt() < 0) {
+    throw CommandValidationError(
+        "min_interval_ms must be a non-negative integer");
+  }
+  sub->minInterval = std::chrono::milliseconds(min_interval.asInt());
+
+  auto max_batch = query_spec.get_default("max_batch_files", json_integer(0));
+  if (!max_batch.isInt() || max_batch.asInt() < 0) {
+    throw CommandValidationError(
+        "max_batch_files must be a non-negative integer");
+  }
+  sub->maxBatchFiles = size_t(max_batch.asInt());
+
+  if (defer_list) {
+    for (size_t i = 0; i < json_array_size(defer_list); i++) {
+      sub->drop_or_defer[json_to_w_string(json_array_get(defer_list, i))] =
+          false;
+    }
+  }
+  if (drop_list) {
+    for (size_t i = 0; i < json_array_size(drop_list); i++) {
+      sub->drop_or_defer[json_to_w_string(json_array_get(drop_list, i))] =
+          true;
     }
   }
 
@@ -574,40 +840,47 @@ static void cmd_subscribe(
       sub->drop_or_defer["hg.transaction"] = false; // defer
     }
   }
+  return sub;
+}
 
-  // Connect the root to our subscription
-  {
-    auto client_id = w_string::build(client->unique_id);
-    auto client_stream = w_string::build(fmt::ptr(client->stm.get()));
-    auto info_json =
-        json_object({{"name", w_string_to_json(sub->name)},
-                     {"query", sub->query->query_spec},
-                     {"client", w_string_to_json(client_id)},
-                     {"stm", w_string_to_json(client_stream)},
-                     {"is_owner", json_boolean(client->stm->peerIsOwner())},
-                     {"pid", json_integer(client->stm->getPeerProcessID())}});
-
-    std::weak_ptr<watchman_client> clientRef(client->shared_from_this());
-    client->unilateralSub.insert(std::make_pair(
-        sub,
-        root->unilateralResponses->subscribe(
-            [clientRef, sub]() {
-              auto client = clientRef.lock();
-              if (client) {
-                client->ping->notify();
-              }
-            },
-            info_json)));
-  }
+// Connects sub to its root, so that the client is notified of changes
+static void register_subscription(
+    struct watchman_user_client* client,
+    const std::shared_ptr<w_root_t>& root,
+    const std::shared_ptr<watchman_client_subscription>& sub) {
+  auto client_id = w_string::build(client->unique_id);
+  auto client_stream = w_string::build(fmt::ptr(client->stm.get()));
+  auto info_json =
+      json_object({{"name", w_string_to_json(sub->name)},
+                   {"query", sub->query->query_spec},
+                   {"client", w_string_to_json(client_id)},
+                   {"stm", w_string_to_json(client_stream)},
+                   {"is_owner", json_boolean(client->stm->peerIsOwner())},
+                   {"pid", json_integer(client->stm->getPeerProcessID())}});
+
+  std::weak_ptr<watchman_client> clientRef(client->shared_from_this());
+  client->unilateralSub.insert(std::make_pair(
+      sub,
+      root->unilateralResponses->subscribe(
+          [clientRef, sub]() {
+            auto client = clientRef.lock();
+            if (client) {
+              client->ping->notify();
+            }
+          },
+          info_json)));
 
   client->subscriptions[sub->name] = sub;
+}
 
-  resp = make_response();
-  resp.set("subscribe", json_ref(jname));
-
-  add_root_warnings_to_response(resp, root);
+// Sets the fields that describe the initial state of sub in resp, and
+// returns the initial results of sub, if there are any
+static json_ref build_initial_subscription_response(
+    json_ref& resp,
+    const std::shared_ptr<w_root_t>& root,
+    watchman_client_subscription& sub) {
   ClockSpec position;
-  initial_subscription_results = sub->buildSubscriptionResults(
+  auto initial_subscription_results = sub.buildSubscriptionResults(
       root, position, OnStateTransition::DontAdvance);
   resp.set("clock", position.toJson());
   auto saved_state_info =
@@ -619,7 +892,7 @@ static void cmd_subscribe(
   auto asserted_states = json_array();
   {
     auto rootAssertedStates = root->assertedStates.rlock();
-    for (const auto& key : sub->drop_or_defer) {
+    for (const auto& key : sub.drop_or_defer) {
       if (rootAssertedStates->isStateAsserted(key.first)) {
         // Not sure what to do in case of failure here. -jupi
         json_array_append(asserted_states, w_string_to_json(key.first));
@@ -627,6 +900,41 @@ static void cmd_subscribe(
     }
   }
   resp.set("asserted-states", json_ref(asserted_states));
+  return initial_subscription_results;
+}
+
+/* subscribe /root subname {query}
+ * Subscribes the client connection to the specified root. */
+static void cmd_subscribe(
+    struct watchman_client* clientbase,
+    const json_ref& args) {
+  struct watchman_user_client* client =
+      (struct watchman_user_client*)clientbase;
+
+  if (json_array_size(args) != 4) {
+    send_error_response(client, "wrong number of arguments for subscribe");
+    return;
+  }
+
+  auto root = resolveRoot(client, args);
+
+  const auto& jname = args.at(2);
+  if (!jname.isString()) {
+    send_error_response(
+        client, "expected 2nd parameter to be subscription name");
+    return;
+  }
+
+  auto sub = parse_subscription(
+      client, root, args, json_to_w_string(jname), args.at(3));
+  register_subscription(client, root, sub);
+
+  auto resp = make_response();
+  resp.set("subscribe", json_ref(jname));
+
+  add_root_warnings_to_response(resp, root);
+  auto initial_subscription_results =
+      build_initial_subscription_response(resp, root, *sub);
 
   send_and_dispose_response(client, std::move(resp));
   if (initial_subscription_results) {
@@ -639,5 +947,126 @@ W_CMD_REG(
     CMD_DAEMON | CMD_ALLOW_ANY_USER,
     w_cmd_realpath_root)
 
+// As wait_for_flush_sync, for the longest sync_timeout of the queries
+// that subscribe-many is passed
+static folly::Future<folly::Unit> wait_for_subscribe_many_sync(
+    watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 3 || !args.at(2).isObject()) {
+    return folly::makeFuture();
+  }
+  json_int_t timeout = 0;
+  for (auto& it : args.at(2).object()) {
+    if (!it.second.isObject()) {
+      return folly::makeFuture();
+    }
+    auto value = it.second.get_default(
+        "sync_timeout", json_integer(DEFAULT_QUERY_SYNC_MS.count()));
+    if (!value.isInt()) {
+      return folly::makeFuture();
+    }
+    timeout = std::max(timeout, value.asInt());
+  }
+  if (timeout <= 0) {
+    return folly::makeFuture();
+  }
+  auto root = resolveRoot(client, args);
+  return root->syncToNowAsync(std::chrono::milliseconds(timeout));
+}
+
+/* subscribe-many /root {subname: {query}, ...}
+ * Subscribes the client connection to the specified root with each of the
+ * named queries, as subscribe would, in one round trip.  The subscriptions
+ * are all registered, or if any of them is invalid, none of them are.  The
+ * root is synced once for all of them, the initial queries run
+ * concurrently, and subscriptions with the same query share an evaluation.
+ * Rather than as unilateral PDUs, the initial results are returned in the
+ * response, in a "subscriptions" object that holds, for each name, what
+ * subscribe would have responded with together with the "files" and
+ * "is_fresh_instance" of the initial results. */
+static void cmd_subscribe_many(
+    struct watchman_client* clientbase,
+    const json_ref& args) {
+  struct watchman_user_client* client =
+      (struct watchman_user_client*)clientbase;
+
+  if (json_array_size(args) != 3 || !args.at(2).isObject()) {
+    send_error_response(
+        client,
+        "expected 'subscribe-many' to be passed a root and an object of "
+        "named queries");
+    return;
+  }
+
+  auto root = resolveRoot(client, args);
+
+  std::vector<std::shared_ptr<watchman_client_subscription>> subs;
+  auto syncTimeout = std::chrono::milliseconds(0);
+  for (auto& it : args.at(2).object()) {
+    auto sub = parse_subscription(client, root, args, it.first, it.second);
+    syncTimeout = std::max(syncTimeout, sub->query->sync_timeout);
+    subs.push_back(std::move(sub));
+  }
+  if (client->client_mode) {
+    syncTimeout = std::chrono::milliseconds(0);
+  }
+  // One cookie for all of them, which may have been written before the
+  // command was dispatched; see wait_for_subscribe_many_sync
+  if (syncTimeout.count() > 0 && !command_wait_synced(client)) {
+    root->syncToNow(syncTimeout);
+  }
+
+  for (auto& sub : subs) {
+    register_subscription(client, root, sub);
+  }
+
+  // The queries run on threads of their own, as in multi-query
+  std::vector<json_ref> responses(subs.size());
+  std::atomic<size_t> next{0};
+  auto worker = [&] {
+    for (auto i = next++; i < subs.size(); i = next++) {
+      auto resp = json_object();
+      auto initial = build_initial_subscription_response(resp, root, *subs[i]);
+      resp.set(
+          {{"files", initial ? initial.get("files") : json_array()},
+           {"is_fresh_instance",
+            initial ? initial.get("is_fresh_instance") : json_false()}});
+      responses[i] = std::move(resp);
+    }
+  };
+  auto numThreads = std::min<size_t>(
+      subs.size(), std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < numThreads; ++i) {
+    threads.emplace_back([&, i] {
+      w_set_thread_name("subscribe-many ", i);
+      worker();
+    });
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  auto names = json_array_of_size(subs.size());
+  auto subscriptions = json_object();
+  for (size_t i = 0; i < subs.size(); ++i) {
+    json_array_append_new(names, w_string_to_json(subs[i]->name));
+    subscriptions.set(subs[i]->name, std::move(responses[i]));
+  }
+  auto resp = make_response();
+  resp.set(
+      {{"subscribe-many", std::move(names)},
+       {"subscriptions", std::move(subscriptions)}});
+  add_root_warnings_to_response(resp, root);
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG_WAIT(
+    "subscribe-many",
+    cmd_subscribe_many,
+    CMD_DAEMON | CMD_ALLOW_ANY_USER,
+    w_cmd_realpath_root,
+    wait_for_subscribe_many_sync)
+
 /* vim:ts=2:sw=2:et:
  */
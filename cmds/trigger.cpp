@@ -4,17 +4,87 @@
 #include "watchman.h"
 
 #include <memory>
+#include "TriggerScheduler.h"
 
 using namespace watchman;
 
-bool watchman_trigger_command::waitNoIntr() {
-  if (!w_is_stopping() && !stopTrigger_) {
-    if (current_proc && current_proc->terminated()) {
-      current_proc.reset();
-      return true;
+namespace {
+// How often the trigger thread checks whether its children have exited
+constexpr int kReapIntervalMs = 100;
+} // namespace
+
+void watchman_trigger_command::finishRun(Run& run, bool failed) {
+  uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - run.started)
+                    .count();
+  stats.lastRunMs = ms;
+  stats.totalRunMs += ms;
+  if (ms > stats.maxRunMs) {
+    stats.maxRunMs = ms;
+  }
+  if (failed) {
+    stats.failures++;
+  }
+  getTriggerScheduler().release();
+}
+
+void watchman_trigger_command::reapChildren() {
+  for (auto it = running.begin(); it != running.end();) {
+    if (!it->proc->terminated()) {
+      ++it;
+      continue;
+    }
+    finishRun(*it, it->proc->wait() != 0);
+    it = running.erase(it);
+  }
+  stats.running = running.size();
+}
+
+void watchman_trigger_command::killOldest() {
+  auto& run = running.front();
+  run.proc->kill();
+  run.proc->wait();
+  finishRun(run, false);
+  // The next run picks up the changes that this one was given
+  query->since_spec = std::move(run.since);
+  running.pop_front();
+  stats.running = running.size();
+}
+
+void watchman_trigger_command::maybeRun(const std::shared_ptr<w_root_t>& root) {
+  if (!runPending_) {
+    return;
+  }
+
+  if (running.size() >= max_concurrency) {
+    if (on_busy == TriggerOnBusy::Queue) {
+      // Runs once a child exits
+      return;
     }
+    logf(DBG, "restarting trigger {}\n", triggername);
+    killOldest();
+    stats.restarts++;
+  }
+
+  auto ping = ping_.get();
+  if (!getTriggerScheduler().tryAcquire(
+          this, priority, [ping] { ping->notify(); })) {
+    if (!waiting_) {
+      logf(DBG, "trigger {} is waiting for its turn\n", triggername);
+      stats.waited++;
+      waiting_ = true;
+    }
+    return;
+  }
+
+  waiting_ = false;
+  runPending_ = false;
+  if (maybeSpawn(root)) {
+    stats.runs++;
+    stats.running = running.size();
+  } else {
+    getTriggerScheduler().release();
   }
-  return false;
 }
 
 void watchman_trigger_command::run(const std::shared_ptr<w_root_t>& root) {
@@ -28,34 +98,39 @@ void watchman_trigger_command::run(const std::shared_ptr<w_root_t>& root) {
     watchman::log(watchman::DBG, "waiting for settle\n");
 
     while (!w_is_stopping() && !stopTrigger_) {
-      ignore_result(w_poll_events(pfd, 1, 86400));
+      // Children are reaped by polling, so we only need to wake up without
+      // being pinged while there are some
+      ignore_result(
+          w_poll_events(pfd, 1, running.empty() ? -1 : kReapIntervalMs));
       if (w_is_stopping() || stopTrigger_) {
         break;
       }
       while (ping_->testAndClear()) {
         pending.clear();
         subscriber_->getPending(pending);
-        bool seenSettle = false;
         for (auto& item : pending) {
           if (item->payload.get_default("settled")) {
-            seenSettle = true;
+            if (runPending_) {
+              stats.coalesced++;
+            }
+            runPending_ = true;
             break;
           }
         }
-
-        if (seenSettle) {
-          if (!maybeSpawn(root)) {
-            continue;
-          }
-          waitNoIntr();
-        }
       }
+
+      reapChildren();
+      maybeRun(root);
     }
 
-    if (current_proc) {
-      current_proc->kill();
-      current_proc->wait();
+    getTriggerScheduler().cancel(this);
+    for (auto& run : running) {
+      run.proc->kill();
+      run.proc->wait();
+      finishRun(run, false);
     }
+    running.clear();
+    stats.running = 0;
   } catch (const std::exception& exc) {
     watchman::log(
         watchman::ERR,
@@ -67,6 +142,18 @@ void watchman_trigger_command::run(const std::shared_ptr<w_root_t>& root) {
   watchman::log(watchman::DBG, "out of loop\n");
 }
 
+json_ref watchman_trigger_command::statsToJson() const {
+  return json_object({{"runs", json_integer(stats.runs)},
+                      {"running", json_integer(stats.running)},
+                      {"restarts", json_integer(stats.restarts)},
+                      {"failures", json_integer(stats.failures)},
+                      {"coalesced", json_integer(stats.coalesced)},
+                      {"waited", json_integer(stats.waited)},
+                      {"last_run_ms", json_integer(stats.lastRunMs)},
+                      {"max_run_ms", json_integer(stats.maxRunMs)},
+                      {"total_run_ms", json_integer(stats.totalRunMs)}});
+}
+
 /* trigger-del /root triggername
  * Delete a trigger from a root
  */
@@ -129,7 +216,17 @@ static void cmd_trigger_list(
   auto resp = make_response();
   auto arr = root->triggerListToJson();
 
-  resp.set("triggers", std::move(arr));
+  auto stats = json_object();
+  {
+    auto map = root->triggers.rlock();
+    for (const auto& it : *map) {
+      stats.set(it.first, it.second->statsToJson());
+    }
+  }
+
+  resp.set({{"triggers", std::move(arr)},
+            {"stats", std::move(stats)},
+            {"scheduler", getTriggerScheduler().stats()}});
   send_and_dispose_response(client, std::move(resp));
 }
 W_CMD_REG("trigger-list", cmd_trigger_list, CMD_DAEMON, w_cmd_realpath_root)
@@ -220,6 +317,7 @@ watchman_trigger_command::watchman_trigger_command(
     : definition(trig),
       append_files(false),
       stdin_style(input_dev_null),
+      stdin_delivery(input_via_file),
       max_files_stdin(0),
       stdout_flags(0),
       stderr_flags(0),
@@ -238,6 +336,7 @@ watchman_trigger_command::watchman_trigger_command(
   if (!query) {
     return;
   }
+  query->incremental_glob = true;
 
   auto name = trig.get_default("name");
   if (!name || !name.isString()) {
@@ -260,6 +359,7 @@ watchman_trigger_command::watchman_trigger_command(
     // "easy" workaround, we'll capture the list of names from the deduping
     // mechanism.
     query->dedup_results = true;
+    query->collect_file_names = true;
   }
 
   auto ele = definition.get_default("stdin");
@@ -283,6 +383,32 @@ watchman_trigger_command::watchman_trigger_command(
     throw CommandValidationError("invalid value for stdin");
   }
 
+  auto encoding = definition.get_default("stdin_encoding");
+  if (encoding) {
+    const char* str = json_string_value(encoding);
+    if (str && !strcmp(str, "bser")) {
+      if (stdin_style != input_json) {
+        throw CommandValidationError(
+            "stdin_encoding requires stdin to be a list of fields");
+      }
+      stdin_style = input_bser;
+    } else if (!str || strcmp(str, "json")) {
+      throw CommandValidationError(
+          "stdin_encoding must be either \"json\" or \"bser\"");
+    }
+  }
+
+  auto delivery = definition.get_default("stdin_delivery");
+  if (delivery) {
+    const char* str = json_string_value(delivery);
+    if (str && !strcmp(str, "pipe")) {
+      stdin_delivery = input_via_pipe;
+    } else if (!str || strcmp(str, "file")) {
+      throw CommandValidationError(
+          "stdin_delivery must be either \"file\" or \"pipe\"");
+    }
+  }
+
   // unlimited unless specified
   auto ival = trig.get_default("max_files_stdin", json_integer(0)).asInt();
   if (ival < 0) {
@@ -290,6 +416,28 @@ watchman_trigger_command::watchman_trigger_command(
   }
   max_files_stdin = ival;
 
+  priority = int(trig.get_default("priority", json_integer(0)).asInt());
+
+  auto concurrency =
+      trig.get_default("max_concurrency", json_integer(1)).asInt();
+  if (concurrency < 1) {
+    throw CommandValidationError("max_concurrency must be >= 1");
+  }
+  max_concurrency = size_t(concurrency);
+
+  auto onBusy = trig.get_default("on_busy");
+  if (onBusy) {
+    const char* str = json_string_value(onBusy);
+    if (str && !strcmp(str, "restart")) {
+      on_busy = TriggerOnBusy::Restart;
+    } else if (str && !strcmp(str, "queue")) {
+      on_busy = TriggerOnBusy::Queue;
+    } else {
+      throw CommandValidationError(
+          "on_busy must be either \"restart\" or \"queue\"");
+    }
+  }
+
   parse_redirection(trig, stdout_name, &stdout_flags, "stdout");
   parse_redirection(trig, stderr_name, &stderr_flags, "stderr");
 
@@ -352,6 +500,7 @@ static void cmd_trigger(struct watchman_client* client, const json_ref& args) {
       return;
     }
   }
+  scopeQueryToSharedWatch(args, trig);
 
   cmd = std::make_unique<watchman_trigger_command>(root, trig);
 
@@ -3,10 +3,11 @@
 
 #include "watchman.h"
 #include "LogConfig.h"
+#include "RootPathCache.h"
 
 using namespace watchman;
 
-void w_cmd_realpath_root(json_ref& args) {
+static void realpath_root(json_ref& args, bool cached) {
   const char* path;
 
   if (json_array_size(args) < 2) {
@@ -20,7 +21,7 @@ void w_cmd_realpath_root(json_ref& args) {
   }
 
   try {
-    auto resolved = realPath(path);
+    auto resolved = cached ? getRootPathCache().resolve(path) : realPath(path);
     args.array()[1] = w_string_to_json(resolved);
   } catch (const std::exception& exc) {
     throw CommandValidationError(
@@ -30,6 +31,16 @@ void w_cmd_realpath_root(json_ref& args) {
         exc.what());
   }
 }
+
+// The CLI resolves each path once, so it has no use for the cache, which
+// is sized by the global config that it doesn't load
+void w_cmd_realpath_root(json_ref& args) {
+  realpath_root(args, false);
+}
+
+void w_cmd_realpath_root_cached(json_ref& args) {
+  realpath_root(args, true);
+}
 W_CAP_REG("clock-sync-timeout")
 
 /* clock /root [options]
@@ -79,7 +90,7 @@ static void cmd_clock(struct watchman_client* client, const json_ref& args) {
 W_CMD_REG(
     "clock",
     cmd_clock,
-    CMD_DAEMON | CMD_ALLOW_ANY_USER,
+    CMD_DAEMON | CMD_ALLOW_ANY_USER | CMD_CONCURRENT,
     w_cmd_realpath_root)
 
 /* watch-del /root
@@ -93,6 +104,16 @@ static void cmd_watch_delete(
     return;
   }
 
+  // A shared watch goes away without disturbing the root that serves it
+  auto path = w_root_canonical_path(json_to_w_string(args.at(1)).c_str());
+  if (w_root_unshare(path)) {
+    w_state_save();
+    auto resp = make_response();
+    resp.set({{"watch-del", json_true()}, {"root", w_string_to_json(path)}});
+    send_and_dispose_response(client, std::move(resp));
+    return;
+  }
+
   auto root = resolveRoot(client, args);
 
   auto resp = make_response();
@@ -117,14 +138,21 @@ W_CMD_REG(
     NULL)
 
 /* watch-list
- * Returns a list of watched roots */
+ * Returns a list of watched roots, along with a description of any
+ * overflow recoveries and recrawls that they have performed */
 static void cmd_watch_list(struct watchman_client* client, const json_ref&) {
   auto resp = make_response();
   auto root_paths = w_root_watch_list_to_json();
   resp.set("roots", std::move(root_paths));
+  resp.set("overflow_recovery", w_root_overflow_recovery_to_json());
+  resp.set("recrawl", w_root_recrawl_to_json());
   send_and_dispose_response(client, std::move(resp));
 }
-W_CMD_REG("watch-list", cmd_watch_list, CMD_DAEMON | CMD_ALLOW_ANY_USER, NULL)
+W_CMD_REG(
+    "watch-list",
+    cmd_watch_list,
+    CMD_DAEMON | CMD_ALLOW_ANY_USER | CMD_CONCURRENT,
+    NULL)
 
 // For each directory component in candidate_dir to the root of the filesystem,
 // look for root_file.  If root_file is present, update relpath to reflect the
@@ -247,6 +275,19 @@ static w_string resolve_projpath(const json_ref& args, w_string& relpath) {
       "a watch. Try pulling and checking out a newer version of the project?");
 }
 
+// Waits for the crawl of the root that is to be watched before the command
+// is dispatched, so that nothing is held up while it runs; see
+// command_wait_func
+static folly::Future<folly::Unit> wait_for_watch(
+    watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 2) {
+    return folly::makeFuture();
+  }
+  auto root = resolveOrCreateRoot(client, args);
+  return root->view()->readyToQuery(root);
+}
+
 /* watch /root */
 static void cmd_watch(struct watchman_client* client, const json_ref& args) {
   /* resolve the root */
@@ -268,15 +309,45 @@ static void cmd_watch(struct watchman_client* client, const json_ref& args) {
   } else {
     resp.set({{"watch", w_string_to_json(root->root_path)},
               {"watcher", w_string_to_json(root->view()->getName())}});
+
+    // A shared watch is named as the client asked for it, so that the
+    // client goes on to use that name, and its queries are scoped to it
+    auto path = json_to_w_string(args.at(1));
+    w_string enclosingPath;
+    w_string relativePath;
+    if (w_root_find_shared(
+            w_root_canonical_path(path.c_str()),
+            enclosingPath,
+            relativePath)) {
+      resp.set({{"watch", w_string_to_json(path)},
+                {"shared_with", w_string_to_json(root->root_path)}});
+    }
   }
   add_root_warnings_to_response(resp, root);
   send_and_dispose_response(client, std::move(resp));
 }
-W_CMD_REG(
+W_CMD_REG_WAIT(
     "watch",
     cmd_watch,
-    CMD_DAEMON | CMD_ALLOW_ANY_USER,
-    w_cmd_realpath_root)
+    CMD_DAEMON | CMD_ALLOW_ANY_USER | CMD_CONCURRENT,
+    w_cmd_realpath_root,
+    wait_for_watch)
+
+// As wait_for_watch, for the project root that encloses the path
+static folly::Future<folly::Unit> wait_for_watch_project(
+    watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 2) {
+    return folly::makeFuture();
+  }
+  // resolve_projpath rewrites the path in the args that it is given, and
+  // cmd_watch_project needs to see the path that the client asked for
+  auto projectArgs = json_copy(args);
+  w_string rel_path_from_watch;
+  resolve_projpath(projectArgs, rel_path_from_watch);
+  auto root = resolveOrCreateRoot(client, projectArgs);
+  return root->view()->readyToQuery(root);
+}
 
 static void cmd_watch_project(
     struct watchman_client* client,
@@ -311,11 +382,12 @@ static void cmd_watch_project(
   }
   send_and_dispose_response(client, std::move(resp));
 }
-W_CMD_REG(
+W_CMD_REG_WAIT(
     "watch-project",
     cmd_watch_project,
-    CMD_DAEMON | CMD_ALLOW_ANY_USER,
-    w_cmd_realpath_root)
+    CMD_DAEMON | CMD_ALLOW_ANY_USER | CMD_CONCURRENT,
+    w_cmd_realpath_root,
+    wait_for_watch_project)
 
 /* vim:ts=2:sw=2:et:
  */
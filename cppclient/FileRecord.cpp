@@ -0,0 +1,413 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "FileRecord.h"
+
+#include <cstring>
+
+#include "WatchmanConnection.h"
+
+namespace watchman {
+
+using namespace folly;
+
+namespace {
+constexpr uint8_t kBserArray = 0x00;
+constexpr uint8_t kBserObject = 0x01;
+constexpr uint8_t kBserByteString = 0x02;
+constexpr uint8_t kBserInt8 = 0x03;
+constexpr uint8_t kBserInt16 = 0x04;
+constexpr uint8_t kBserInt32 = 0x05;
+constexpr uint8_t kBserInt64 = 0x06;
+constexpr uint8_t kBserReal = 0x07;
+constexpr uint8_t kBserTrue = 0x08;
+constexpr uint8_t kBserFalse = 0x09;
+constexpr uint8_t kBserNull = 0x0a;
+constexpr uint8_t kBserTemplate = 0x0b;
+constexpr uint8_t kBserSkip = 0x0c;
+constexpr uint8_t kBserUtf8String = 0x0d;
+
+// Reads BSER values from a contiguous buffer.  The string tables of BSER v3
+// aren't understood, which is fine as we never ask the server for them.
+class BserReader {
+ public:
+  BserReader(const uint8_t* pos, const uint8_t* end) : pos_(pos), end_(end) {}
+
+  const uint8_t* position() const {
+    return pos_;
+  }
+
+  uint8_t peekType() const {
+    need(1);
+    return *pos_;
+  }
+
+  int64_t readInt() {
+    switch (readType()) {
+      case kBserInt8:
+        return readRaw<int8_t>();
+      case kBserInt16:
+        return readRaw<int16_t>();
+      case kBserInt32:
+        return readRaw<int32_t>();
+      case kBserInt64:
+        return readRaw<int64_t>();
+      default:
+        throw WatchmanError("expected a BSER integer");
+    }
+  }
+
+  StringPiece readString() {
+    auto type = readType();
+    if (type != kBserByteString && type != kBserUtf8String) {
+      throw WatchmanError("expected a BSER string");
+    }
+    return readStringBody();
+  }
+
+  double readReal() {
+    if (readType() != kBserReal) {
+      throw WatchmanError("expected a BSER real");
+    }
+    return readRaw<double>();
+  }
+
+  bool readBool() {
+    switch (readType()) {
+      case kBserTrue:
+        return true;
+      case kBserFalse:
+        return false;
+      default:
+        throw WatchmanError("expected a BSER boolean");
+    }
+  }
+
+  // Reads the header of an array or object, returning its length
+  size_t readContainer(uint8_t type) {
+    if (readType() != type) {
+      throw WatchmanError(
+          type == kBserArray ? "expected a BSER array"
+                             : "expected a BSER object");
+    }
+    return readLength();
+  }
+
+  // Reads the header of a template, filling in its keys and returning the
+  // number of rows
+  size_t readTemplate(std::vector<StringPiece>& keys) {
+    if (readType() != kBserTemplate) {
+      throw WatchmanError("expected a BSER template");
+    }
+    auto numKeys = readContainer(kBserArray);
+    keys.clear();
+    for (size_t i = 0; i < numKeys; ++i) {
+      keys.push_back(readString());
+    }
+    return readLength();
+  }
+
+  // Returns true, and moves past it, if the next value is the skip marker
+  // that stands for a missing value in a template row
+  bool readSkip() {
+    if (peekType() != kBserSkip) {
+      return false;
+    }
+    ++pos_;
+    return true;
+  }
+
+  void skip() {
+    switch (readType()) {
+      case kBserArray:
+        for (auto n = readLength(); n > 0; --n) {
+          skip();
+        }
+        return;
+      case kBserObject:
+        for (auto n = readLength(); n > 0; --n) {
+          readString();
+          skip();
+        }
+        return;
+      case kBserByteString:
+      case kBserUtf8String:
+        readStringBody();
+        return;
+      case kBserInt8:
+        advance(sizeof(int8_t));
+        return;
+      case kBserInt16:
+        advance(sizeof(int16_t));
+        return;
+      case kBserInt32:
+        advance(sizeof(int32_t));
+        return;
+      case kBserInt64:
+        advance(sizeof(int64_t));
+        return;
+      case kBserReal:
+        advance(sizeof(double));
+        return;
+      case kBserTrue:
+      case kBserFalse:
+      case kBserNull:
+        return;
+      case kBserTemplate: {
+        --pos_;
+        std::vector<StringPiece> keys;
+        for (auto rows = readTemplate(keys); rows > 0; --rows) {
+          for (size_t i = 0; i < keys.size(); ++i) {
+            if (!readSkip()) {
+              skip();
+            }
+          }
+        }
+        return;
+      }
+      default:
+        throw WatchmanError("invalid BSER value type");
+    }
+  }
+
+  dynamic readDynamic() {
+    switch (peekType()) {
+      case kBserArray: {
+        auto n = readContainer(kBserArray);
+        auto result = dynamic::array();
+        for (; n > 0; --n) {
+          result.push_back(readDynamic());
+        }
+        return result;
+      }
+      case kBserObject: {
+        auto n = readContainer(kBserObject);
+        auto result = dynamic::object();
+        for (; n > 0; --n) {
+          auto key = readString();
+          result.insert(key, readDynamic());
+        }
+        return result;
+      }
+      case kBserByteString:
+      case kBserUtf8String:
+        return readString();
+      case kBserInt8:
+      case kBserInt16:
+      case kBserInt32:
+      case kBserInt64:
+        return readInt();
+      case kBserReal:
+        return readReal();
+      case kBserTrue:
+      case kBserFalse:
+        return readBool();
+      case kBserNull:
+        ++pos_;
+        return nullptr;
+      case kBserTemplate: {
+        std::vector<StringPiece> keys;
+        auto rows = readTemplate(keys);
+        auto result = dynamic::array();
+        for (; rows > 0; --rows) {
+          auto row = dynamic::object();
+          for (auto& key : keys) {
+            if (!readSkip()) {
+              row.insert(key, readDynamic());
+            }
+          }
+          result.push_back(std::move(row));
+        }
+        return result;
+      }
+      default:
+        throw WatchmanError("invalid BSER value type");
+    }
+  }
+
+ private:
+  void need(size_t n) const {
+    if (size_t(end_ - pos_) < n) {
+      throw WatchmanError("BSER value runs past the end of the PDU");
+    }
+  }
+
+  void advance(size_t n) {
+    need(n);
+    pos_ += n;
+  }
+
+  uint8_t readType() {
+    auto type = peekType();
+    ++pos_;
+    return type;
+  }
+
+  template <typename T>
+  T readRaw() {
+    need(sizeof(T));
+    T value;
+    memcpy(&value, pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return value;
+  }
+
+  size_t readLength() {
+    auto len = readInt();
+    if (len < 0) {
+      throw WatchmanError("negative BSER length");
+    }
+    return size_t(len);
+  }
+
+  StringPiece readStringBody() {
+    auto len = readLength();
+    need(len);
+    StringPiece str(reinterpret_cast<const char*>(pos_), len);
+    pos_ += len;
+    return str;
+  }
+
+  const uint8_t* pos_;
+  const uint8_t* end_;
+};
+
+// Reads the value that a field of a record starts with, throwing if the
+// field is missing
+BserReader fieldReader(const uint8_t* value, const uint8_t* end) {
+  if (!value) {
+    throw WatchmanError("the field has no value for this file");
+  }
+  return BserReader(value, end);
+}
+} // namespace
+
+size_t FileRecord::find(StringPiece name) const {
+  for (size_t i = 0; i < names_.size(); ++i) {
+    if (names_[i] == name) {
+      return i;
+    }
+  }
+  return names_.size();
+}
+
+bool FileRecord::isNull(size_t i) const {
+  return values_[i] && *values_[i] == kBserNull;
+}
+
+StringPiece FileRecord::getString(size_t i) const {
+  return fieldReader(values_[i], end_).readString();
+}
+
+int64_t FileRecord::getInt(size_t i) const {
+  return fieldReader(values_[i], end_).readInt();
+}
+
+double FileRecord::getDouble(size_t i) const {
+  auto reader = fieldReader(values_[i], end_);
+  // Times without a fractional part may arrive as integers
+  if (reader.peekType() == kBserReal) {
+    return reader.readReal();
+  }
+  return double(reader.readInt());
+}
+
+bool FileRecord::getBool(size_t i) const {
+  return fieldReader(values_[i], end_).readBool();
+}
+
+dynamic FileRecord::getDynamic(size_t i) const {
+  if (!values_[i]) {
+    return nullptr;
+  }
+  return BserReader(values_[i], end_).readDynamic();
+}
+
+StreamingResponse::StreamingResponse(std::unique_ptr<IOBuf> body)
+    : body_(std::move(body)) {
+  body_->coalesce();
+  end_ = body_->tail();
+  BserReader reader(body_->data(), end_);
+  auto n = reader.readContainer(kBserObject);
+  keys_.reserve(n);
+  for (; n > 0; --n) {
+    auto key = reader.readString();
+    keys_.emplace_back(key, reader.position());
+    reader.skip();
+  }
+}
+
+bool StreamingResponse::has(StringPiece name) const {
+  for (auto& key : keys_) {
+    if (key.first == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+dynamic StreamingResponse::get(StringPiece name) const {
+  for (auto& key : keys_) {
+    if (key.first == name) {
+      return BserReader(key.second, end_).readDynamic();
+    }
+  }
+  return nullptr;
+}
+
+dynamic StreamingResponse::decode(const FileCallback& onFile) const {
+  auto result = dynamic::object();
+  for (auto& key : keys_) {
+    if (onFile && key.first == "files") {
+      decodeFiles(key.second, onFile);
+      continue;
+    }
+    result.insert(key.first, BserReader(key.second, end_).readDynamic());
+  }
+  return result;
+}
+
+void StreamingResponse::decodeFiles(
+    const uint8_t* value,
+    const FileCallback& onFile) const {
+  BserReader reader(value, end_);
+  FileRecord record;
+  record.end_ = end_;
+
+  if (reader.peekType() == kBserTemplate) {
+    auto rows = reader.readTemplate(record.names_);
+    record.values_.resize(record.names_.size());
+    for (; rows > 0; --rows) {
+      for (auto& field : record.values_) {
+        if (reader.readSkip()) {
+          field = nullptr;
+        } else {
+          field = reader.position();
+          reader.skip();
+        }
+      }
+      onFile(record);
+    }
+    return;
+  }
+
+  for (auto n = reader.readContainer(kBserArray); n > 0; --n) {
+    record.names_.clear();
+    record.values_.clear();
+    if (reader.peekType() == kBserObject) {
+      for (auto fields = reader.readContainer(kBserObject); fields > 0;
+           --fields) {
+        record.names_.push_back(reader.readString());
+        record.values_.push_back(reader.position());
+        reader.skip();
+      }
+    } else {
+      record.names_.emplace_back();
+      record.values_.push_back(reader.position());
+      reader.skip();
+    }
+    onFile(record);
+  }
+}
+
+} // namespace watchman
@@ -0,0 +1,97 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <folly/Range.h>
+#include <folly/dynamic.h>
+#include <folly/io/IOBuf.h>
+
+namespace watchman {
+
+// One entry of the "files" array of a query or subscription response, read
+// straight from the BSER that the server sent rather than from a
+// folly::dynamic.  The fields are in the order that the query's "fields"
+// listed them, and each one is only decoded when it is asked for, into the
+// type that the caller asks for.  A FileRecord and the strings that it
+// yields refer to the response PDU, and are only valid for the duration of
+// the callback that they were passed to.
+class FileRecord {
+ public:
+  // The number of fields in this record
+  size_t size() const {
+    return values_.size();
+  }
+
+  // The name of field i.  When the query has a single field the server
+  // sends bare values, and this is empty.
+  folly::StringPiece fieldName(size_t i) const {
+    return names_[i];
+  }
+
+  // Returns the index of the field called name, or size() if there is none
+  size_t find(folly::StringPiece name) const;
+
+  // Returns true if the server had no value of field i for this file, as
+  // with the symlink_target of a regular file
+  bool isMissing(size_t i) const {
+    return values_[i] == nullptr;
+  }
+
+  bool isNull(size_t i) const;
+
+  // The typed accessors throw WatchmanError if field i is missing or is of
+  // a different type
+  folly::StringPiece getString(size_t i) const;
+  int64_t getInt(size_t i) const;
+  double getDouble(size_t i) const;
+  bool getBool(size_t i) const;
+
+  // Decodes field i, whatever its type; a missing field is null
+  folly::dynamic getDynamic(size_t i) const;
+
+ private:
+  friend class StreamingResponse;
+
+  std::vector<folly::StringPiece> names_;
+  // Where the BSER value of each field starts, or nullptr if it is missing
+  std::vector<const uint8_t*> values_;
+  const uint8_t* end_{nullptr};
+};
+
+using FileCallback = std::function<void(const FileRecord&)>;
+
+// The BSER value of a response PDU.  The top level keys are found without
+// decoding their values, so that the caller can look at the small ones
+// before deciding how to decode the rest.
+class StreamingResponse {
+ public:
+  // body holds the BSER value of the PDU, without the PDU header
+  explicit StreamingResponse(std::unique_ptr<folly::IOBuf> body);
+
+  // Returns true if the response has a top level key called name
+  bool has(folly::StringPiece name) const;
+
+  // Decodes the value of the top level key called name, or returns null if
+  // there is none
+  folly::dynamic get(folly::StringPiece name) const;
+
+  // Decodes the whole response.  If onFile is set, each entry of the
+  // "files" array is passed to it as it is read, rather than being added
+  // to the result, which has no "files" key.
+  folly::dynamic decode(const FileCallback& onFile = nullptr) const;
+
+ private:
+  void decodeFiles(const uint8_t* value, const FileCallback& onFile) const;
+
+  std::unique_ptr<folly::IOBuf> body_;
+  const uint8_t* end_;
+  // The top level keys, and where the value of each one starts
+  std::vector<std::pair<folly::StringPiece, const uint8_t*>> keys_;
+};
+
+} // namespace watchman
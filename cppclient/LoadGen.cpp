@@ -0,0 +1,561 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+/*
+  A load generator for the server, to see how it copes with many clients.
+  It opens --clients connections, makes --subscriptions_per_client
+  subscriptions on each of them and sends --queries_per_second queries
+  between them, while it writes to --churn_per_second of the --files files
+  that it creates in a directory of --root.  It then reports:
+
+   * the latency from a file being written to each subscription that
+     matches it being notified of it,
+   * the latency of the queries, and those that failed or that weren't
+     sent because --max_outstanding_queries were still waiting for their
+     responses,
+   * the CPU time of the server and its RSS, sampled every second, when
+     --server_pid is given and /proc is available, and the CPU time of the
+     load generator itself, so that it can be told when that is what
+     limits the load.
+
+  The subscriptions and queries are picked from --subscription_mix and
+  --query_mix, which weigh the kinds of each; see kSubscriptionKinds and
+  kQueryKinds below.  The report is written to stdout as JSON, so that the
+  runs for a change can be compared with those without it.  For example:
+
+  $ LoadGen --root=/tmp/load --clients=1000 --queries_per_second=500 \
+      --server_pid=$(pgrep -u $USER -x watchman)
+
+  Build with something like:
+  $ LDFLAGS=$(pkg-config watchmanclient --libs) \
+      CPPFLAGS=$(pkg-config watchmanclient --cflags) \
+      make LoadGen
+*/
+
+#include <watchman/WatchmanClient.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <folly/Conv.h>
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <folly/experimental/io/FsUtil.h>
+#include <folly/futures/Future.h>
+#include <folly/init/Init.h>
+#include <folly/io/async/EventBaseThread.h>
+#include <folly/json.h>
+#include <folly/portability/GFlags.h>
+#include <glog/logging.h>
+
+DEFINE_string(root, "", "The directory to watch and to write files in");
+DEFINE_string(sock, "", "The socket of the server, if not the default one");
+DEFINE_int32(clients, 100, "The number of connections to open");
+DEFINE_int32(io_threads, 4, "The threads that serve the connections");
+DEFINE_int32(
+    subscriptions_per_client,
+    1,
+    "The subscriptions that each connection makes");
+DEFINE_string(
+    subscription_mix,
+    "all=1",
+    "The weights of the kinds of subscription, such as all=3,name=1");
+DEFINE_int32(
+    queries_per_second,
+    0,
+    "The queries that are sent each second, between all of the clients");
+DEFINE_string(
+    query_mix,
+    "since=1",
+    "The weights of the kinds of query, such as since=2,glob=1,clock=1");
+DEFINE_int32(
+    max_outstanding_queries,
+    1000,
+    "The most queries that may wait for their responses at once");
+DEFINE_int32(files, 1000, "The number of files to write to");
+DEFINE_int32(churn_per_second, 100, "The files that are written each second");
+DEFINE_int32(duration_seconds, 30, "How long to generate the load for");
+DEFINE_int32(
+    drain_seconds,
+    2,
+    "How long to wait for notifications and responses after the load stops");
+DEFINE_int32(
+    server_pid,
+    0,
+    "The process id of the server, to report its CPU time and RSS");
+
+using namespace folly;
+using namespace watchman;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+namespace {
+
+// The directory of --root that the files are written in
+constexpr StringPiece kChurnDir = "loadgen";
+
+// Matches every file, so each write is notified to each of them
+constexpr StringPiece kSubscribeAll = "all";
+// Matches the files by their suffix, which the server can't narrow down
+// without looking at each changed file
+constexpr StringPiece kSubscribeSuffix = "suffix";
+// Matches a single file, so that most writes are filtered out
+constexpr StringPiece kSubscribeName = "name";
+const std::vector<StringPiece> kSubscriptionKinds = {
+    kSubscribeAll,
+    kSubscribeSuffix,
+    kSubscribeName};
+
+// The files that changed since the clock of the start of the run
+constexpr StringPiece kQuerySince = "since";
+// The files that match a glob
+constexpr StringPiece kQueryGlob = "glob";
+// The files that match a suffix expression
+constexpr StringPiece kQuerySuffix = "suffix";
+// The clock of the root, which needs only a sync
+constexpr StringPiece kQueryClock = "clock";
+const std::vector<StringPiece> kQueryKinds = {
+    kQuerySince,
+    kQueryGlob,
+    kQuerySuffix,
+    kQueryClock};
+
+// Picks kinds at random, in proportion to their weights
+class Mix {
+ public:
+  Mix(StringPiece flag, const std::string& spec, std::vector<StringPiece> kinds)
+      : kinds_(std::move(kinds)), weights_(kinds_.size(), 0) {
+    std::vector<StringPiece> items;
+    split(',', spec, items, true);
+    for (auto item : items) {
+      StringPiece kind;
+      StringPiece weight;
+      if (!split('=', item, kind, weight)) {
+        throw std::invalid_argument(
+            to<std::string>("--", flag, ": expected kind=weight, not ", item));
+      }
+      auto it = std::find(kinds_.begin(), kinds_.end(), kind);
+      if (it == kinds_.end()) {
+        throw std::invalid_argument(
+            to<std::string>("--", flag, ": unknown kind ", kind));
+      }
+      weights_[it - kinds_.begin()] = to<double>(weight);
+    }
+    if (std::all_of(weights_.begin(), weights_.end(), [](double w) {
+          return w <= 0;
+        })) {
+      throw std::invalid_argument(
+          to<std::string>("--", flag, ": no kind has a positive weight"));
+    }
+    distribution_ = std::discrete_distribution<size_t>(
+        weights_.begin(), weights_.end());
+  }
+
+  StringPiece pick(std::mt19937& rng) {
+    return kinds_[distribution_(rng)];
+  }
+
+ private:
+  std::vector<StringPiece> kinds_;
+  std::vector<double> weights_;
+  std::discrete_distribution<size_t> distribution_;
+};
+
+// Latencies that are recorded from one thread at a time
+class Latencies {
+ public:
+  void record(nanoseconds latency) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    samples_.push_back(latency);
+  }
+
+  void appendTo(std::vector<nanoseconds>& all) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    all.insert(all.end(), samples_.begin(), samples_.end());
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<nanoseconds> samples_;
+};
+
+// Returns the pct percentile of the sorted latencies, by nearest rank
+nanoseconds percentile(const std::vector<nanoseconds>& sorted, double pct) {
+  auto rank = size_t(std::ceil(pct / 100 * sorted.size()));
+  return sorted[std::max(rank, size_t(1)) - 1];
+}
+
+dynamic summarize(std::vector<nanoseconds> latencies) {
+  auto summary = dynamic::object("count", latencies.size());
+  if (latencies.empty()) {
+    return summary;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  auto us = [](nanoseconds latency) {
+    return duration_cast<microseconds>(latency).count();
+  };
+  summary["p50_us"] = us(percentile(latencies, 50));
+  summary["p90_us"] = us(percentile(latencies, 90));
+  summary["p99_us"] = us(percentile(latencies, 99));
+  summary["p999_us"] = us(percentile(latencies, 99.9));
+  summary["max_us"] = us(latencies.back());
+  return summary;
+}
+
+int64_t nowNs() {
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string fileName(int index) {
+  return to<std::string>(kChurnDir, "/f", index, ".txt");
+}
+
+// Returns the index of the file that name, relative to --root, is for, or
+// -1 if it isn't one of the files that are written to
+int fileIndex(StringPiece name) {
+  if (!name.removePrefix(kChurnDir) || !name.removePrefix("/f") ||
+      !name.removeSuffix(".txt")) {
+    return -1;
+  }
+  auto index = tryTo<int>(name);
+  if (!index || *index < 0 || *index >= FLAGS_files) {
+    return -1;
+  }
+  return *index;
+}
+
+// The CPU time and RSS of a process, read from /proc
+struct ProcessUsage {
+  microseconds cpu{0};
+  int64_t rssKb{0};
+};
+
+Optional<ProcessUsage> readProcessUsage(pid_t pid) {
+  std::string stat;
+  std::string status;
+  if (!readFile(to<std::string>("/proc/", pid, "/stat").c_str(), stat) ||
+      !readFile(to<std::string>("/proc/", pid, "/status").c_str(), status)) {
+    return none;
+  }
+
+  // The name of the command, in parentheses, may contain spaces, so the
+  // fields are counted from the state that follows it
+  auto paren = stat.rfind(')');
+  if (paren == std::string::npos) {
+    return none;
+  }
+  std::vector<StringPiece> fields;
+  split(' ', StringPiece(stat).subpiece(paren + 2), fields, true);
+  // utime and stime are the 14th and 15th fields, the state the 3rd
+  if (fields.size() < 13) {
+    return none;
+  }
+  auto ticks = to<int64_t>(fields[11]) + to<int64_t>(fields[12]);
+  ProcessUsage usage;
+  usage.cpu = microseconds(ticks * 1000000 / sysconf(_SC_CLK_TCK));
+
+  std::vector<StringPiece> lines;
+  split('\n', status, lines, true);
+  for (auto line : lines) {
+    if (line.removePrefix("VmRSS:")) {
+      usage.rssKb = to<int64_t>(trimWhitespace(line.subpiece(
+          0, line.find(" kB"))));
+    }
+  }
+  return usage;
+}
+
+microseconds selfCpuTime() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  auto toUs = [](const struct timeval& tv) {
+    return int64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+  };
+  return microseconds(toUs(usage.ru_utime) + toUs(usage.ru_stime));
+}
+
+// A connection to the server and what was sent and received on it
+struct Client {
+  std::unique_ptr<WatchmanClient> client;
+  EventBase* eventBase;
+  WatchPathPtr root;
+  Latencies notifications;
+  Latencies queries;
+};
+
+dynamic subscriptionQuery(StringPiece kind, int index) {
+  auto query = dynamic::object("fields", dynamic::array("name"));
+  if (kind == kSubscribeSuffix) {
+    query["expression"] = dynamic::array("suffix", "txt");
+  } else if (kind == kSubscribeName) {
+    query["expression"] =
+        dynamic::array("name", fileName(index % FLAGS_files), "wholename");
+  }
+  return query;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  folly::init(&argc, &argv);
+  if (FLAGS_root.empty() || FLAGS_clients < 1 || FLAGS_io_threads < 1 ||
+      FLAGS_files < 1) {
+    std::cerr << "--root is required, and --clients, --io_threads and "
+                 "--files must be positive"
+              << std::endl;
+    return 1;
+  }
+  std::mt19937 rng(std::random_device{}());
+  Mix subscriptionMix(
+      "subscription_mix", FLAGS_subscription_mix, kSubscriptionKinds);
+  Mix queryMix("query_mix", FLAGS_query_mix, kQueryKinds);
+
+  auto churnDir = fs::path(FLAGS_root) / kChurnDir.str();
+  fs::create_directories(churnDir);
+  for (int i = 0; i < FLAGS_files; ++i) {
+    writeFile(std::string(), (fs::path(FLAGS_root) / fileName(i)).c_str());
+  }
+  // The time of the last write to each file, in nanoseconds of the steady
+  // clock, which the notifications of it are measured from
+  std::vector<std::atomic<int64_t>> lastWrite(FLAGS_files);
+
+  std::vector<std::unique_ptr<EventBaseThread>> ioThreads;
+  for (int i = 0; i < FLAGS_io_threads; ++i) {
+    ioThreads.push_back(std::make_unique<EventBaseThread>());
+  }
+
+  std::atomic<uint64_t> subscriptionErrors{0};
+  std::vector<std::unique_ptr<Client>> clients;
+  std::vector<SemiFuture<Unit>> ready;
+  for (int i = 0; i < FLAGS_clients; ++i) {
+    auto c = std::make_unique<Client>();
+    c->eventBase = ioThreads[i % ioThreads.size()]->getEventBase();
+    c->client = std::make_unique<WatchmanClient>(
+        c->eventBase,
+        FLAGS_sock.empty() ? Optional<std::string>()
+                           : Optional<std::string>(FLAGS_sock));
+    auto client = c.get();
+    ready.push_back(
+        client->client->connect()
+            .deferValue([client](dynamic&&) {
+              return client->client->watch(FLAGS_root);
+            })
+            .deferValue([client](WatchPathPtr root) { client->root = root; }));
+    clients.push_back(std::move(c));
+  }
+  for (auto& result : collectAll(std::move(ready)).get()) {
+    result.throwUnlessValue();
+  }
+  LOG(INFO) << "Connected " << clients.size() << " clients";
+
+  int subscriptionIndex = 0;
+  std::vector<SemiFuture<SubscriptionPtr>> subscribed;
+  for (auto& c : clients) {
+    auto client = c.get();
+    for (int i = 0; i < FLAGS_subscriptions_per_client; ++i) {
+      auto query =
+          subscriptionQuery(subscriptionMix.pick(rng), subscriptionIndex++);
+      subscribed.push_back(client->client->subscribe(
+          query,
+          client->root,
+          client->eventBase,
+          [client, &lastWrite, &subscriptionErrors](Try<dynamic>&& data) {
+            auto now = nowNs();
+            if (data.hasException()) {
+              ++subscriptionErrors;
+              return;
+            }
+            auto files = data->get_ptr("files");
+            auto fresh = data->get_ptr("is_fresh_instance");
+            // The initial results and state-enter/leave aren't for writes
+            if (!files || (fresh && fresh->asBool())) {
+              return;
+            }
+            for (auto& file : *files) {
+              auto index = fileIndex(file.asString());
+              if (index < 0) {
+                continue;
+              }
+              auto written = lastWrite[index].load();
+              if (written != 0) {
+                client->notifications.record(nanoseconds(now - written));
+              }
+            }
+          }));
+    }
+  }
+  for (auto& result : collectAll(std::move(subscribed)).get()) {
+    result.throwUnlessValue();
+  }
+  LOG(INFO) << "Made " << subscriptionIndex << " subscriptions";
+
+  auto sinceClock = clients[0]->client->getClock(clients[0]->root).get();
+
+  pid_t serverPid = FLAGS_server_pid;
+  auto serverBefore = serverPid ? readProcessUsage(serverPid) : none;
+  auto selfBefore = selfCpuTime();
+  int64_t peakRssKb = serverBefore ? serverBefore->rssKb : 0;
+  auto start = steady_clock::now();
+  auto deadline = start + std::chrono::seconds(FLAGS_duration_seconds);
+
+  std::atomic<uint64_t> writes{0};
+  std::thread churner([&] {
+    if (FLAGS_churn_per_second <= 0) {
+      return;
+    }
+    auto interval = nanoseconds(1000000000 / FLAGS_churn_per_second);
+    auto next = steady_clock::now();
+    int index = 0;
+    for (uint64_t n = 0;; ++n) {
+      next += interval;
+      if (next >= deadline) {
+        break;
+      }
+      std::this_thread::sleep_until(next);
+      lastWrite[index].store(nowNs());
+      writeFile(
+          to<std::string>(n), (fs::path(FLAGS_root) / fileName(index)).c_str());
+      ++writes;
+      index = (index + 1) % FLAGS_files;
+    }
+  });
+
+  std::atomic<uint64_t> queriesSent{0};
+  std::atomic<uint64_t> queryErrors{0};
+  std::atomic<uint64_t> queriesSkipped{0};
+  std::atomic<int64_t> outstanding{0};
+  std::thread querier([&] {
+    if (FLAGS_queries_per_second <= 0) {
+      return;
+    }
+    std::mt19937 queryRng(std::random_device{}());
+    auto interval = nanoseconds(1000000000 / FLAGS_queries_per_second);
+    auto next = steady_clock::now();
+    for (size_t n = 0;; ++n) {
+      next += interval;
+      if (next >= deadline) {
+        break;
+      }
+      std::this_thread::sleep_until(next);
+      if (outstanding.load() >= FLAGS_max_outstanding_queries) {
+        ++queriesSkipped;
+        continue;
+      }
+      auto client = clients[n % clients.size()].get();
+      auto kind = queryMix.pick(queryRng);
+      SemiFuture<Unit> response = makeSemiFuture();
+      if (kind == kQueryClock) {
+        response = client->client->getClock(client->root).deferValue(
+            [](Clock&&) {});
+      } else {
+        auto query = dynamic::object("fields", dynamic::array("name"));
+        if (kind == kQuerySince) {
+          query["since"] = sinceClock;
+        } else if (kind == kQueryGlob) {
+          query["glob"] = dynamic::array(to<std::string>(kChurnDir, "/*.txt"));
+        } else {
+          query["expression"] = dynamic::array("suffix", "txt");
+        }
+        response = client->client->query(std::move(query), client->root)
+                       .deferValue([](QueryResult&&) {});
+      }
+      ++queriesSent;
+      ++outstanding;
+      auto sent = steady_clock::now();
+      std::move(response)
+          .via(client->eventBase)
+          .thenTry([&, client, sent](Try<Unit>&& result) {
+            if (result.hasException()) {
+              ++queryErrors;
+            } else {
+              client->queries.record(steady_clock::now() - sent);
+            }
+            --outstanding;
+          });
+    }
+  });
+
+  while (steady_clock::now() < deadline) {
+    /* sleep override */ std::this_thread::sleep_for(std::chrono::seconds(1));
+    if (serverPid) {
+      if (auto usage = readProcessUsage(serverPid)) {
+        peakRssKb = std::max(peakRssKb, usage->rssKb);
+      }
+    }
+  }
+  churner.join();
+  querier.join();
+  auto elapsed = steady_clock::now() - start;
+  auto serverAfter = serverPid ? readProcessUsage(serverPid) : none;
+  auto selfAfter = selfCpuTime();
+
+  // Give the last notifications and responses a chance to arrive
+  auto drainDeadline =
+      steady_clock::now() + std::chrono::seconds(FLAGS_drain_seconds);
+  while (outstanding.load() > 0 && steady_clock::now() < drainDeadline) {
+    /* sleep override */
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  /* sleep override */ std::this_thread::sleep_until(drainDeadline);
+
+  for (auto& c : clients) {
+    c->client->close();
+  }
+  // Let the callbacks that are still queued on the io threads run
+  ioThreads.clear();
+
+  std::vector<nanoseconds> notificationLatencies;
+  std::vector<nanoseconds> queryLatencies;
+  for (auto& c : clients) {
+    c->notifications.appendTo(notificationLatencies);
+    c->queries.appendTo(queryLatencies);
+  }
+
+  auto seconds = duration_cast<microseconds>(elapsed).count() / 1e6;
+  auto notifications = summarize(std::move(notificationLatencies));
+  notifications["errors"] = subscriptionErrors.load();
+  auto queries = summarize(std::move(queryLatencies));
+  queries["sent"] = queriesSent.load();
+  queries["errors"] = queryErrors.load();
+  queries["skipped"] = queriesSkipped.load();
+  queries["per_second"] = queriesSent.load() / seconds;
+  auto report = dynamic::object();
+  report["clients"] = clients.size();
+  report["subscriptions"] = subscriptionIndex;
+  report["duration_seconds"] = seconds;
+  report["writes"] = writes.load();
+  report["writes_per_second"] = writes.load() / seconds;
+  report["notifications"] = std::move(notifications);
+  report["queries"] = std::move(queries);
+  report["loadgen_cpu_us"] = (selfAfter - selfBefore).count();
+  if (serverBefore && serverAfter) {
+    auto cpu = (serverAfter->cpu - serverBefore->cpu).count();
+    auto server = dynamic::object();
+    server["cpu_us"] = cpu;
+    server["cpu_utilization"] = cpu / 1e6 / seconds;
+    server["rss_kb_before"] = serverBefore->rssKb;
+    server["rss_kb_after"] = serverAfter->rssKb;
+    server["rss_kb_peak"] = peakRssKb;
+    report["server"] = std::move(server);
+  } else if (serverPid) {
+    LOG(WARNING) << "Couldn't read the usage of process " << serverPid
+                 << " from /proc";
+  }
+  std::cout << toPrettyJson(report) << std::endl;
+
+  fs::remove_all(churnDir);
+  return 0;
+}
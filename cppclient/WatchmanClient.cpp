@@ -3,7 +3,11 @@
 
 #include "WatchmanClient.h"
 
+#include <algorithm>
+#include <limits>
+
 #include <folly/Format.h>
+#include <folly/futures/Future.h>
 #include <glog/logging.h>
 
 namespace watchman {
@@ -14,21 +18,33 @@ WatchmanClient::WatchmanClient(
     EventBase* eventBase,
     Optional<std::string>&& socketPath,
     folly::Executor* cpuExecutor,
-    ErrorCallback errorCallback)
-    : conn_(std::make_shared<WatchmanConnection>(
-          eventBase,
-          std::move(socketPath),
-          Optional<WatchmanConnection::Callback>([this](Try<dynamic>&& data) {
-            connectionCallback(std::move(data));
-          }),
-          cpuExecutor)),
-      errorCallback_(errorCallback) {}
-
-void WatchmanClient::connectionCallback(Try<dynamic>&& try_data) {
-  // If an exception occurs notify all subscription callbacks. Other outstanding
-  // one-shots etc. will get exceptions returned via their futures if needed.
+    ErrorCallback errorCallback,
+    size_t connections)
+    : errorCallback_(errorCallback) {
+  connections = std::max<size_t>(connections, 1);
+  conns_.reserve(connections);
+  for (size_t i = 0; i < connections; ++i) {
+    conns_.push_back(std::make_shared<WatchmanConnection>(
+        eventBase,
+        Optional<std::string>(socketPath),
+        Optional<WatchmanConnection::Callback>([this, i](Try<dynamic>&& data) {
+          connectionCallback(i, std::move(data));
+        }),
+        cpuExecutor));
+  }
+}
+
+void WatchmanClient::connectionCallback(
+    size_t connection,
+    Try<dynamic>&& try_data) {
+  // If an exception occurs notify the callbacks of the subscriptions on the
+  // connection. Other outstanding one-shots etc. will get exceptions returned
+  // via their futures if needed.
   if (try_data.hasException()) {
     for (auto& subscription : subscriptionMap_) {
+      if (subscription.second->connection_ != connection) {
+        continue;
+      }
       subscription.second->executor_->add(
           [sub_ptr = subscription.second, try_data]() mutable {
             if (sub_ptr->active_) {
@@ -64,19 +80,62 @@ void WatchmanClient::connectionCallback(Try<dynamic>&& try_data) {
 }
 
 SemiFuture<dynamic> WatchmanClient::connect(dynamic versionArgs) {
-  return conn_->connect(versionArgs);
+  if (conns_.size() == 1) {
+    return conns_[0]->connect(versionArgs);
+  }
+  std::vector<Future<dynamic>> futures;
+  for (auto& conn : conns_) {
+    futures.push_back(conn->connect(versionArgs));
+  }
+  return collectAll(std::move(futures))
+      .deferValue([](std::vector<Try<dynamic>> versions) {
+        for (auto& version : versions) {
+          version.throwIfFailed();
+        }
+        return std::move(versions.front()).value();
+      });
 }
 
 void WatchmanClient::close() {
-  return conn_->close();
+  for (auto& conn : conns_) {
+    conn->close();
+  }
+}
+
+bool WatchmanClient::isDead() {
+  for (auto& conn : conns_) {
+    if (conn->isDead()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t WatchmanClient::leastLoaded() {
+  size_t best = 0;
+  size_t bestLoad = std::numeric_limits<size_t>::max();
+  for (size_t i = 0; i < conns_.size(); ++i) {
+    if (conns_[i]->isDead()) {
+      continue;
+    }
+    auto load = conns_[i]->outstanding();
+    if (load < bestLoad) {
+      best = i;
+      bestLoad = load;
+      if (load == 0) {
+        break;
+      }
+    }
+  }
+  return best;
 }
 
 SemiFuture<dynamic> WatchmanClient::run(const dynamic& cmd) {
-  return conn_->run(cmd);
+  return conns_[leastLoaded()]->run(cmd);
 }
 
 Future<WatchPathPtr> WatchmanClient::watchImpl(StringPiece path) {
-  return conn_->run(dynamic::array("watch-project", path))
+  return conns_[leastLoaded()]->run(dynamic::array("watch-project", path))
       .thenValue([=](dynamic&& data) {
         auto relative_path = data["relative_path"];
         Optional<std::string> relative_path_optional;
@@ -93,7 +152,8 @@ SemiFuture<WatchPathPtr> WatchmanClient::watch(StringPiece path) {
 }
 
 SemiFuture<std::string> WatchmanClient::getClock(WatchPathPtr path) {
-  return conn_->run(dynamic::array("clock", path->root_))
+  return conns_[leastLoaded()]
+      ->run(dynamic::array("clock", path->root_))
       .thenValue([](dynamic data) { return data["clock"].asString(); });
 }
 
@@ -108,6 +168,47 @@ SemiFuture<QueryResult> WatchmanClient::query(
           [](folly::dynamic&& res) { return QueryResult{std::move(res)}; });
 }
 
+SemiFuture<std::vector<Try<QueryResult>>> WatchmanClient::multiQuery(
+    std::vector<std::pair<dynamic, WatchPathPtr>> queries) {
+  auto specs = dynamic::array();
+  for (auto& query : queries) {
+    auto& path = query.second;
+    if (path->relativePath_) {
+      query.first["relative_root"] = *path->relativePath_;
+    }
+    specs.push_back(dynamic::array(path->root_, std::move(query.first)));
+  }
+  return run(dynamic::array("multi-query", std::move(specs)))
+      .deferValue([](dynamic&& res) {
+        std::vector<Try<QueryResult>> results;
+        for (auto& result : res["results"]) {
+          if (result.get_ptr("error")) {
+            results.emplace_back(
+                make_exception_wrapper<WatchmanResponseError>(result));
+          } else {
+            results.emplace_back(QueryResult{std::move(result)});
+          }
+        }
+        return results;
+      });
+}
+
+SemiFuture<QueryResult> WatchmanClient::queryFiles(
+    dynamic queryObj,
+    WatchPathPtr path,
+    FileCallback onFile) {
+  if (path->relativePath_) {
+    queryObj["relative_root"] = *path->relativePath_;
+  }
+  return conns_[leastLoaded()]
+      ->runStreaming(
+          dynamic::array("query", path->root_, std::move(queryObj)),
+          std::move(onFile))
+      .semi()
+      .deferValue(
+          [](folly::dynamic&& res) { return QueryResult{std::move(res)}; });
+}
+
 SemiFuture<SubscriptionPtr> WatchmanClient::subscribe(
     dynamic query,
     WatchPathPtr path,
@@ -119,6 +220,10 @@ SemiFuture<SubscriptionPtr> WatchmanClient::subscribe(
       : std::move(subscriptionName);
   auto subscription =
       std::make_shared<Subscription>(executor, std::move(callback), name, path);
+  // The server delivers the updates of a subscription on the connection
+  // that made it, and only flushes or cancels it when asked on that one
+  subscription->connection_ = leastLoaded();
+  auto& conn = conns_[subscription->connection_];
   {
     std::lock_guard<std::mutex> guard(mutex_);
     subscriptionMap_[name] = subscription;
@@ -126,7 +231,8 @@ SemiFuture<SubscriptionPtr> WatchmanClient::subscribe(
   if (path->relativePath_) {
     query["relative_root"] = *(path->relativePath_);
   }
-  return run(dynamic::array("subscribe", path->root_, name, query))
+  return conn->run(dynamic::array("subscribe", path->root_, name, query))
+      .semi()
       .deferValue([subscription = std::move(subscription),
                    name = name](const dynamic& data) {
         CHECK(data["subscribe"] == name)
@@ -163,7 +269,7 @@ SemiFuture<dynamic> WatchmanClient::flushSubscription(
   dynamic args = dynamic::object;
   args["sync_timeout"] = timeout.count();
   args["subscriptions"] = dynamic::array(sub->name_);
-  return run(
+  return conns_[sub->connection_]->run(
       dynamic::array("flush-subscriptions", sub->watchPath_->root_, args));
 }
 
@@ -171,7 +277,7 @@ SemiFuture<dynamic> WatchmanClient::unsubscribe(SubscriptionPtr sub) {
   CHECK(sub->active_) << "Already unsubscribed.";
 
   sub->active_ = false;
-  return conn_
+  return conns_[sub->connection_]
       ->run(dynamic::array("unsubscribe", sub->watchPath_->root_, sub->name_))
       .ensure([=] {
         std::lock_guard<std::mutex> guard(mutex_);
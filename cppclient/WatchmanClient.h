@@ -64,6 +64,7 @@
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <folly/Executor.h>
 #include <folly/Optional.h>
@@ -115,6 +116,9 @@ struct Subscription {
   const std::string name_;
   WatchPathPtr watchPath_;
   bool active_{true};
+  // The index of the pooled connection that the subscription was made on,
+  // which its updates arrive on and which must carry its other commands
+  size_t connection_{0};
 };
 
 using SubscriptionPtr = std::shared_ptr<Subscription>;
@@ -124,11 +128,19 @@ struct WatchmanClient {
       folly::EventBase* eventBase,
       folly::Optional<std::string>&& sockPath = {},
       folly::Executor* cpuExecutor = {},
-      ErrorCallback errCb = {});
+      ErrorCallback errCb = {},
+      // The number of connections to the server to keep.  Commands go to
+      // the connection with the fewest outstanding commands, so that a
+      // slow query doesn't hold up the others.  Each connection learns the
+      // capabilities of the server, such as running tagged requests
+      // concurrently, for itself.
+      size_t connections = 1);
 
   /**
    * Establishes a connection, returning version and capability information per
    * https://facebook.github.io/watchman/docs/cmd/version.html#capabilities
+   * When there are several connections this yields the response to the
+   * first, once all of them have been established.
    */
   folly::SemiFuture<folly::dynamic> connect(
       folly::dynamic versionArgs = folly::dynamic::object()(
@@ -136,17 +148,17 @@ struct WatchmanClient {
           folly::dynamic::array("relative_root")));
 
   /**
-   * Close the underlying connection to Watchman, including automatically
+   * Close the underlying connections to Watchman, including automatically
    * unsubscribing from all subscriptions.
    */
   void close();
 
   /**
-   * Returns true if the underlying connection is closed or broken.
+   * Returns true if any of the underlying connections is closed or broken.
+   * Commands go to the remaining ones, but the subscriptions that were made
+   * on a broken connection are gone.
    */
-  bool isDead() {
-    return conn_->isDead();
-  }
+  bool isDead();
 
   /**
    * Execute a watchman command, yielding the command response.
@@ -186,6 +198,27 @@ struct WatchmanClient {
       folly::dynamic queryObj,
       WatchPathPtr path);
 
+  /**
+   * Sends several queries in one request, each a queryObj as for query()
+   * and the path that it is against. The server syncs each root once and
+   * runs the queries concurrently. The results are in the order of the
+   * queries, and a query that failed holds a WatchmanResponseError without
+   * failing the others. Requires the cmd-multi-query capability.
+   */
+  folly::SemiFuture<std::vector<folly::Try<QueryResult>>> multiQuery(
+      std::vector<std::pair<folly::dynamic, WatchPathPtr>> queries);
+
+  /**
+   * As query() above, but each file of the result is passed to onFile as it
+   * is decoded rather than being held in the result, which has no "files"
+   * key. This keeps the memory used by large results in check. See
+   * WatchmanConnection::runStreaming() for details.
+   */
+  folly::SemiFuture<QueryResult> queryFiles(
+      folly::dynamic queryObj,
+      WatchPathPtr path,
+      FileCallback onFile);
+
   /**
    * Establishes a subscription that will trigger callback (via your specified
    * executor) whenever matching files change.
@@ -221,16 +254,22 @@ struct WatchmanClient {
   folly::SemiFuture<folly::dynamic> unsubscribe(SubscriptionPtr subscription);
 
   /** Intended for test only. */
-  WatchmanConnection& getConnection() {
-    return *conn_;
+  WatchmanConnection& getConnection(size_t index = 0) {
+    return *conns_[index];
   }
 
  private:
-  void connectionCallback(folly::Try<folly::dynamic>&& try_data);
+  void connectionCallback(
+      size_t connection,
+      folly::Try<folly::dynamic>&& try_data);
+
+  // Returns the index of the live connection with the fewest outstanding
+  // commands, or of the first connection if all of them are dead
+  size_t leastLoaded();
 
   folly::Future<WatchPathPtr> watchImpl(folly::StringPiece path);
 
-  std::shared_ptr<WatchmanConnection> conn_;
+  std::vector<std::shared_ptr<WatchmanConnection>> conns_;
   ErrorCallback errorCallback_;
   std::unordered_map<std::string, SubscriptionPtr> subscriptionMap_;
   std::mutex mutex_;
@@ -6,8 +6,10 @@
 #include <folly/ExceptionWrapper.h>
 #include <folly/SocketAddress.h>
 #include <folly/Subprocess.h>
+#include <folly/compression/Compression.h>
 #include <folly/executors/InlineExecutor.h>
 #include <folly/experimental/bser/Bser.h>
+#include <folly/io/Cursor.h>
 
 namespace watchman {
 
@@ -19,11 +21,164 @@ static const std::vector<dynamic> kUnilateralLabels{"subscription", "log"};
 
 static const dynamic kError("error");
 static const dynamic kCapabilities("capabilities");
+static const dynamic kCompressionCapability("bser-compression");
+static const dynamic kTaggedRequestsCapability("tagged-requests");
+static const dynamic kTag("tag");
+static const dynamic kCommand("command");
+
+// The BSER v2 capabilities that ask the server to send all strings as byte
+// strings, which is all that folly::bser understands, and to compress large
+// responses with zstd or lz4
+static constexpr uint32_t kBserCapDisableUnicode = 0x1;
+static constexpr uint32_t kBserCapCompressZstd = 0x4;
+static constexpr uint32_t kBserCapCompressLz4 = 0x8;
+
+// The second byte of the magic of BSER v1, v2 and compressed PDUs
+static constexpr uint8_t kBserV1Magic = 0x01;
+static constexpr uint8_t kBserV2Magic = 0x02;
+static constexpr uint8_t kBserCompressedMagic = 0x04;
+
+// The codecs of compressed PDUs
+static constexpr int64_t kPduCodecZstd = 1;
+static constexpr int64_t kPduCodecLz4 = 2;
 
 // We'll just dispatch bser decodes and callbacks inline unless they
 // give us an alternative environment
 static InlineExecutor inlineExecutor;
 
+// Returns the compression capabilities for the codecs that folly was built
+// with
+static uint32_t localCompressionCapabilities() {
+  uint32_t capabilities = 0;
+  if (io::hasCodec(io::CodecType::ZSTD)) {
+    capabilities |= kBserCapCompressZstd;
+  }
+  if (io::hasCodec(io::CodecType::LZ4_FRAME)) {
+    capabilities |= kBserCapCompressLz4;
+  }
+  return capabilities;
+}
+
+static int64_t decodeBserInt(io::Cursor& cursor) {
+  switch (cursor.read<int8_t>()) {
+    case 0x03:
+      return cursor.read<int8_t>();
+    case 0x04:
+      return cursor.read<int16_t>();
+    case 0x05:
+      return cursor.read<int32_t>();
+    case 0x06:
+      return cursor.read<int64_t>();
+    default:
+      throw std::runtime_error("invalid BSER integer encoding");
+  }
+}
+
+// Reads the magic of the PDU at cursor, and the capabilities that follow
+// it in v2 and compressed PDUs
+static uint8_t decodePduMagic(io::Cursor& cursor) {
+  auto first = cursor.read<uint8_t>();
+  auto magic = cursor.read<uint8_t>();
+  if (first != 0 ||
+      (magic != kBserV1Magic && magic != kBserV2Magic &&
+       magic != kBserCompressedMagic)) {
+    throw std::runtime_error("invalid BSER magic header");
+  }
+  if (magic != kBserV1Magic) {
+    cursor.skip(sizeof(uint32_t));
+  }
+  return magic;
+}
+
+// Like decodePduLength, for BSER v1, v2 and compressed PDUs
+static size_t decodeAnyPduLength(const IOBuf* buf) {
+  io::Cursor cursor(buf);
+  decodePduMagic(cursor);
+  auto len = decodeBserInt(cursor);
+  return cursor.getCurrentPosition() + len;
+}
+
+// BSER encodes cmd as a v2 PDU with capabilities.  With
+// kBserCapDisableUnicode the body is the same as that of a v1 PDU.
+static std::unique_ptr<IOBuf> toBserV2IOBuf(
+    const dynamic& cmd,
+    uint32_t capabilities) {
+  auto body = toBserIOBuf(cmd, serialization_opts());
+  body->trimStart(2);
+  auto pdu = IOBuf::create(2 + sizeof(capabilities));
+  auto data = pdu->writableData();
+  data[0] = 0;
+  data[1] = kBserV2Magic;
+  memcpy(data + 2, &capabilities, sizeof(capabilities));
+  pdu->append(2 + sizeof(capabilities));
+  pdu->prependChain(std::move(body));
+  return pdu;
+}
+
+// Reads the body of a compressed PDU, which cursor is at the start of,
+// and returns the PDU that it holds
+static std::unique_ptr<IOBuf> uncompressPdu(io::Cursor& cursor) {
+  auto codec = decodeBserInt(cursor);
+  auto size = decodeBserInt(cursor);
+  if (size < 0 || (codec != kPduCodecZstd && codec != kPduCodecLz4)) {
+    throw std::runtime_error("invalid compressed PDU header");
+  }
+  std::unique_ptr<IOBuf> compressed;
+  cursor.clone(compressed, cursor.totalLength());
+  auto inner = io::getCodec(
+                   codec == kPduCodecZstd ? io::CodecType::ZSTD
+                                          : io::CodecType::LZ4_FRAME)
+                   ->uncompress(compressed.get(), uint64_t(size));
+  io::Cursor innerCursor(inner.get());
+  if (decodePduMagic(innerCursor) == kBserCompressedMagic) {
+    throw std::runtime_error("compressed PDU holds a compressed PDU");
+  }
+  return inner;
+}
+
+// Like parseBser, for BSER v1, v2 and compressed PDUs
+static dynamic parseAnyPdu(const IOBuf* pdu) {
+  io::Cursor cursor(pdu);
+  auto magic = decodePduMagic(cursor);
+  if (magic == kBserV1Magic) {
+    return parseBser(pdu);
+  }
+  auto len = decodeBserInt(cursor);
+
+  if (magic == kBserV2Magic) {
+    // The strings are all byte strings, so the body can be parsed as that
+    // of a v1 PDU
+    std::unique_ptr<IOBuf> body;
+    cursor.clone(body, cursor.totalLength());
+    auto v1 = IOBuf::create(3 + sizeof(len));
+    auto data = v1->writableData();
+    data[0] = 0;
+    data[1] = kBserV1Magic;
+    data[2] = 0x06;
+    memcpy(data + 3, &len, sizeof(len));
+    v1->append(3 + sizeof(len));
+    v1->prependChain(std::move(body));
+    return parseBser(v1.get());
+  }
+
+  return parseAnyPdu(uncompressPdu(cursor).get());
+}
+
+// Returns the BSER value that a BSER v1, v2 or compressed PDU holds,
+// without the PDU header.  The strings of v2 PDUs are all byte strings, so
+// the value is read the same way as that of a v1 PDU.
+static std::unique_ptr<IOBuf> pduBody(const IOBuf* pdu) {
+  io::Cursor cursor(pdu);
+  auto magic = decodePduMagic(cursor);
+  decodeBserInt(cursor);
+  if (magic == kBserCompressedMagic) {
+    return pduBody(uncompressPdu(cursor).get());
+  }
+  std::unique_ptr<IOBuf> body;
+  cursor.clone(body, cursor.totalLength());
+  return body;
+}
+
 WatchmanConnection::WatchmanConnection(
     EventBase* eventBase,
     Optional<std::string>&& sockPath,
@@ -80,6 +235,15 @@ Future<dynamic> WatchmanConnection::connect(folly::dynamic versionArgs) {
   if (!versionArgs.isObject()) {
     throw WatchmanError("versionArgs must be object");
   }
+  // Learn whether the server can run commands concurrently, and whether it
+  // can compress large responses
+  if (!versionArgs.get_ptr("optional")) {
+    versionArgs["optional"] = dynamic::array();
+  }
+  versionArgs["optional"].push_back(kTaggedRequestsCapability);
+  if (localCompressionCapabilities() != 0) {
+    versionArgs["optional"].push_back(kCompressionCapability);
+  }
   versionCmd_ = folly::dynamic::array("version", versionArgs);
 
   auto res = getSockPath().thenValue(
@@ -127,6 +291,20 @@ Try<dynamic> WatchmanConnection::watchmanResponseToTry(dynamic&& value) {
   return Try<dynamic>(std::move(value));
 }
 
+// Decodes a response that was read with StreamingResponse, passing its
+// files to the callback of cmd if it has one.  A malformed response or an
+// exception from the callback fails only cmd, as the PDU has already been
+// split from the stream.
+Try<dynamic> WatchmanConnection::decodeResponse(
+    const StreamingResponse& response,
+    QueuedCommand& cmd) {
+  try {
+    return watchmanResponseToTry(response.decode(cmd.onFile));
+  } catch (const std::exception& ex) {
+    return Try<dynamic>(exception_wrapper(std::current_exception(), ex));
+  }
+}
+
 void WatchmanConnection::connectSuccess() noexcept {
   try {
     sock_->setReadCB(this);
@@ -144,6 +322,18 @@ void WatchmanConnection::connectSuccess() noexcept {
                 shared_this->watchmanResponseToTry(std::move(result)));
             return;
           }
+          auto compression =
+              result[kCapabilities].get_ptr(kCompressionCapability);
+          if (compression && compression->isBool() &&
+              compression->asBool()) {
+            shared_this->bserCapabilities_.store(
+                kBserCapDisableUnicode | localCompressionCapabilities());
+          }
+          auto tagged =
+              result[kCapabilities].get_ptr(kTaggedRequestsCapability);
+          if (tagged && tagged->isBool() && tagged->asBool()) {
+            shared_this->useTags_.store(true);
+          }
           shared_this->connectPromise_.setValue(std::move(result));
         })
         .thenError([shared_this =
@@ -164,11 +354,27 @@ void WatchmanConnection::connectErr(
   connectPromise_.setException(ex);
 }
 
-WatchmanConnection::QueuedCommand::QueuedCommand(const dynamic& command)
-    : cmd(command) {}
+WatchmanConnection::QueuedCommand::QueuedCommand(
+    const dynamic& command,
+    FileCallback onFile)
+    : cmd(command), onFile(std::move(onFile)) {}
 
 Future<dynamic> WatchmanConnection::run(const dynamic& command) noexcept {
-  auto cmd = std::make_shared<QueuedCommand>(command);
+  return runCommand(std::make_shared<QueuedCommand>(command));
+}
+
+Future<dynamic> WatchmanConnection::runStreaming(
+    const dynamic& command,
+    FileCallback onFile) noexcept {
+  auto cmd = std::make_shared<QueuedCommand>(command, std::move(onFile));
+  streamingCommands_.fetch_add(1);
+  return runCommand(std::move(cmd)).ensure([shared_this = shared_from_this()] {
+    shared_this->streamingCommands_.fetch_sub(1);
+  });
+}
+
+Future<dynamic> WatchmanConnection::runCommand(
+    std::shared_ptr<QueuedCommand> cmd) noexcept {
   if (broken_) {
     cmd->promise.setException(WatchmanError("The connection was broken"));
     return cmd->promise.getFuture();
@@ -179,6 +385,14 @@ Future<dynamic> WatchmanConnection::run(const dynamic& command) noexcept {
     return cmd->promise.getFuture();
   }
 
+  if (useTags_.load()) {
+    eventBase_->runInEventBaseThread(
+        [shared_this = shared_from_this(), cmd] {
+          shared_this->sendRequest(cmd);
+        });
+    return cmd->promise.getFuture();
+  }
+
   bool shouldWrite;
   {
     std::lock_guard<std::mutex> g(mutex_);
@@ -197,12 +411,21 @@ Future<dynamic> WatchmanConnection::run(const dynamic& command) noexcept {
   return cmd->promise.getFuture();
 }
 
+size_t WatchmanConnection::outstanding() {
+  std::lock_guard<std::mutex> g(mutex_);
+  return commandQ_.size() + requests_.size();
+}
+
 // Generate a failure for all queued commands
 void WatchmanConnection::failQueuedCommands(
     const folly::exception_wrapper& ex) {
   std::lock_guard<std::mutex> g(mutex_);
   auto q = commandQ_;
   commandQ_.clear();
+  for (auto& it : requests_) {
+    q.push_back(it.second);
+  }
+  requests_.clear();
 
   broken_ = true;
   for (auto& cmd : q) {
@@ -219,6 +442,14 @@ void WatchmanConnection::failQueuedCommands(
   }
 }
 
+std::unique_ptr<IOBuf> WatchmanConnection::encodeCommand(const dynamic& cmd) {
+  auto capabilities = bserCapabilities_.load();
+  if (capabilities) {
+    return toBserV2IOBuf(cmd, capabilities);
+  }
+  return toBserIOBuf(cmd, serialization_opts());
+}
+
 // Sends the next eligible command to the Watchman service
 void WatchmanConnection::sendCommand(bool pop) {
   std::shared_ptr<QueuedCommand> cmd;
@@ -237,13 +468,51 @@ void WatchmanConnection::sendCommand(bool pop) {
     cmd = commandQ_.front();
   }
 
-  sock_->writeChain(this, toBserIOBuf(cmd->cmd, serialization_opts()));
+  sock_->writeChain(this, encodeCommand(cmd->cmd));
 }
 
 void WatchmanConnection::popAndSendCommand() {
   sendCommand(/* pop = */ true);
 }
 
+// Sends cmd with a new tag, without waiting for the responses to the
+// commands that are already in flight
+void WatchmanConnection::sendRequest(std::shared_ptr<QueuedCommand> cmd) {
+  int64_t tag = 0;
+  bool broken;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    broken = broken_;
+    if (!broken) {
+      tag = nextTag_++;
+      requests_.emplace(tag, cmd);
+    }
+  }
+  if (broken) {
+    cmd->promise.setException(WatchmanError("The connection was broken"));
+    return;
+  }
+  sock_->writeChain(
+      this, encodeCommand(dynamic::object(kTag, tag)(kCommand, cmd->cmd)));
+}
+
+// Removes and returns the command that was sent with tag, or returns
+// nullptr if there is none
+std::shared_ptr<WatchmanConnection::QueuedCommand>
+WatchmanConnection::takeRequest(const dynamic& tag) {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!tag.isInt()) {
+    return nullptr;
+  }
+  auto it = requests_.find(tag.asInt());
+  if (it == requests_.end()) {
+    return nullptr;
+  }
+  auto cmd = std::move(it->second);
+  requests_.erase(it);
+  return cmd;
+}
+
 // Called when AsyncSocket::writeChain completes
 void WatchmanConnection::writeSuccess() noexcept {
   // Don't care particularly
@@ -284,7 +553,7 @@ std::unique_ptr<folly::IOBuf> WatchmanConnection::splitNextPdu() {
   // Do we have enough data to decode the next item?
   size_t pdu_len = 0;
   try {
-    pdu_len = decodePduLength(bufQ_.front());
+    pdu_len = decodeAnyPduLength(bufQ_.front());
   } catch (const std::out_of_range&) {
     // Don't have enough data yet
     return nullptr;
@@ -324,14 +593,27 @@ void WatchmanConnection::decodeNextResponse() {
     }
 
     try {
-      auto decoded = parseBser(pdu.get());
+      // While there are streaming commands in flight, look at the keys of
+      // the response before decoding it, so that the files of a response
+      // to one of them can be passed to its callback
+      Optional<StreamingResponse> streaming;
+      dynamic decoded;
+      if (streamingCommands_.load() > 0) {
+        streaming.emplace(pduBody(pdu.get()));
+      } else {
+        decoded = parseAnyPdu(pdu.get());
+      }
 
       bool is_unilateral = false;
       // Check for a unilateral response
       for (const auto& k : kUnilateralLabels) {
-        if (decoded.get_ptr(k)) {
+        if (streaming ? streaming->has(k.getString())
+                      : decoded.get_ptr(k) != nullptr) {
           // This is a unilateral response
           if (callback_.has_value()) {
+            if (streaming) {
+              decoded = streaming->decode();
+            }
             callback_.value()(watchmanResponseToTry(std::move(decoded)));
             is_unilateral = true;
             break;
@@ -346,6 +628,22 @@ void WatchmanConnection::decodeNextResponse() {
         continue;
       }
 
+      // A response to a command that was sent with a tag
+      auto tag = streaming ? streaming->get(kTag.getString())
+                           : decoded.getDefault(kTag);
+      if (!tag.isNull()) {
+        auto cmd = takeRequest(tag);
+        if (!cmd) {
+          failQueuedCommands(
+              std::runtime_error("Received a response with an unknown tag"));
+          return;
+        }
+        cmd->promise.setTry(
+            streaming ? decodeResponse(*streaming, *cmd)
+                      : watchmanResponseToTry(std::move(decoded)));
+        continue;
+      }
+
       // It's actually a command response; get the cmd so that we
       // can fulfil its promise
       std::shared_ptr<QueuedCommand> cmd;
@@ -361,7 +659,9 @@ void WatchmanConnection::decodeNextResponse() {
 
       // Dispatch outside of the lock in case it tries to send another
       // command
-      cmd->promise.setTry(watchmanResponseToTry(std::move(decoded)));
+      cmd->promise.setTry(
+          streaming ? decodeResponse(*streaming, *cmd)
+                    : watchmanResponseToTry(std::move(decoded)));
 
       // Now we're in a position to send the next queued command.
       // We remove it after dispatching the try above in case that
@@ -6,6 +6,7 @@
 #include <atomic>
 #include <deque>
 #include <memory>
+#include <unordered_map>
 
 #include <folly/ExceptionWrapper.h>
 #include <folly/Optional.h>
@@ -15,6 +16,8 @@
 #include <folly/io/async/AsyncSocket.h>
 #include <folly/io/async/EventBase.h>
 
+#include "FileRecord.h"
+
 namespace watchman {
 
 // General watchman error
@@ -65,12 +68,30 @@ class WatchmanConnection
           folly::dynamic::array("relative_root")));
 
   // Issue a watchman command, yielding the results at a later time.
-  // If the connection was terminated, will throw immediately
+  // If the connection was terminated, will throw immediately.
+  // Once connected to a server that supports tagged requests, commands are
+  // sent straight away rather than after the response to the previous
+  // one, and the server may run them concurrently.
   folly::Future<folly::dynamic> run(const folly::dynamic& command) noexcept;
 
+  // Like run(), for commands such as query whose response has a "files"
+  // array.  Rather than being decoded into the response, each file is
+  // passed to onFile as it is read from the PDU, so that the memory used
+  // doesn't grow with the number of files; the response that the future
+  // yields has no "files" key.  onFile is called on the thread that decodes
+  // responses, before the future is fulfilled.  If it throws, the future
+  // yields the exception.
+  folly::Future<folly::dynamic> runStreaming(
+      const folly::dynamic& command,
+      FileCallback onFile) noexcept;
+
   // Close the connection.  All queued commands will be cancelled
   void close();
 
+  // Returns the number of commands that have been issued and not yet
+  // answered
+  size_t outstanding();
+
   // Returns true if the connection has been closed or is in a broken state
   bool isDead() {
     return closing_ || broken_;
@@ -86,16 +107,28 @@ class WatchmanConnection
   struct QueuedCommand {
     folly::dynamic cmd;
     folly::Promise<folly::dynamic> promise;
+    // Set for commands issued by runStreaming()
+    FileCallback onFile;
 
-    explicit QueuedCommand(const folly::dynamic& command);
+    explicit QueuedCommand(
+        const folly::dynamic& command,
+        FileCallback onFile = nullptr);
   };
 
   folly::Future<std::string> getSockPath();
+  folly::Future<folly::dynamic> runCommand(
+      std::shared_ptr<QueuedCommand> cmd) noexcept;
   void failQueuedCommands(const folly::exception_wrapper& ex);
+  std::unique_ptr<folly::IOBuf> encodeCommand(const folly::dynamic& cmd);
   void sendCommand(bool pop = false);
   void popAndSendCommand();
+  void sendRequest(std::shared_ptr<QueuedCommand> cmd);
+  std::shared_ptr<QueuedCommand> takeRequest(const folly::dynamic& id);
   void decodeNextResponse();
   folly::Try<folly::dynamic> watchmanResponseToTry(folly::dynamic&& value);
+  folly::Try<folly::dynamic> decodeResponse(
+      const StreamingResponse& response,
+      QueuedCommand& cmd);
   std::unique_ptr<folly::IOBuf> splitNextPdu();
 
   // ConnectCallback
@@ -123,9 +156,23 @@ class WatchmanConnection
   std::shared_ptr<folly::AsyncSocket> sock_;
   std::mutex mutex_;
   std::deque<std::shared_ptr<QueuedCommand>> commandQ_;
+  // Commands that were sent with a tag, keyed by the tag, which the
+  // server may answer in any order
+  std::unordered_map<int64_t, std::shared_ptr<QueuedCommand>> requests_;
+  int64_t nextTag_{1};
   folly::IOBufQueue bufQ_{folly::IOBufQueue::cacheChainLength()};
   bool broken_{false};
   bool closing_{false};
   std::atomic<bool> decoding_{false};
+  // If set, commands are sent as BSER v2 PDUs with these capabilities,
+  // which are chosen once the server has reported its capabilities
+  std::atomic<uint32_t> bserCapabilities_{0};
+  // Set once the server has reported that it supports tagged requests
+  std::atomic<bool> useTags_{false};
+  // The number of runStreaming() commands awaiting their responses.  While
+  // there are any, every PDU is read with StreamingResponse rather than
+  // parsed straight into a folly::dynamic, as we can't tell which command a
+  // response is for until its keys have been found.
+  std::atomic<size_t> streamingCommands_{0};
 };
 } // namespace watchman
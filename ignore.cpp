@@ -19,7 +19,30 @@ void watchman_ignore::add(const w_string& path, bool is_vcs_ignore) {
   }
 }
 
-bool watchman_ignore::isIgnored(const char* path, uint32_t pathlen) const {
+namespace {
+// Sets relative to the portion of path below root, or to all of path if
+// root is empty.  Returns false if path is not below root.
+bool belowRoot(
+    const w_string& root,
+    w_string_piece path,
+    w_string_piece& relative) {
+  if (root.size() == 0) {
+    relative = path;
+    return true;
+  }
+  if (path.size() <= root.size() + 1 || !path.startsWith(root) ||
+      !is_slash(path.data()[root.size()])) {
+    return false;
+  }
+  relative = w_string_piece(
+      path.data() + root.size() + 1, path.size() - root.size() - 1);
+  return true;
+}
+
+bool isIgnoredByTree(
+    const art_tree<uint8_t, w_string>& tree,
+    const char* path,
+    uint32_t pathlen) {
   const char* skip_prefix;
   uint32_t len;
   auto leaf = tree.longestMatch((const unsigned char*)path, (int)pathlen);
@@ -87,13 +110,170 @@ bool watchman_ignore::isIgnored(const char* path, uint32_t pathlen) const {
   return false;
 #endif
 }
+} // namespace
+
+bool watchman_ignore::addGlob(
+    const w_string& root_path,
+    w_string_piece pattern) {
+  std::string line(pattern.data(), pattern.size());
+  // Nothing below an ignored dir is seen, so there is nothing for a
+  // negated pattern to bring back
+  if (line.empty() || line[0] == '#' || line[0] == '!') {
+    return false;
+  }
+  if (line.back() == '/') {
+    line.pop_back();
+  }
+  // `**/name` is the same as `name`, which is cheaper to match
+  while (line.size() > 3 && line.compare(0, 3, "**/") == 0) {
+    line.erase(0, 3);
+  }
+  bool baseNameOnly = line.find('/') == std::string::npos;
+  if (!baseNameOnly && line[0] == '/') {
+    line.erase(0, 1);
+  }
+  if (line.empty()) {
+    return false;
+  }
+
+  glob_root = root_path;
+  if (!baseNameOnly) {
+    glob_path_patterns.emplace_back(line, WM_PATHNAME);
+  } else if (line.find_first_of("*?[\\") == std::string::npos) {
+    glob_strings.emplace_back(line.data(), line.size());
+    glob_names.insert(w_string_piece(glob_strings.back()));
+  } else {
+    glob_name_patterns.emplace_back(line, WM_PATHNAME);
+  }
+  return true;
+}
+
+void watchman_ignore::addInclude(
+    const w_string& root_path,
+    const w_string& path) {
+  include_root = root_path;
+  include_strings.push_back(path);
+  include_dirs.insert(w_string_piece(include_strings.back()));
+
+  w_string_piece dir(path);
+  while (dir.size() > root_path.size()) {
+    dir = dir.dirName();
+    if (include_ancestors.find(dir) != include_ancestors.end()) {
+      // We've already been here for another include
+      break;
+    }
+    include_strings.emplace_back(dir.data(), dir.size());
+    include_ancestors.insert(w_string_piece(include_strings.back()));
+  }
+}
+
+bool watchman_ignore::isOutsideIncludes(w_string_piece path, bool isDir)
+    const {
+  if (include_dirs.empty()) {
+    return false;
+  }
+  w_string_piece relative;
+  if (!belowRoot(include_root, path, relative)) {
+    return false;
+  }
+  if (include_ancestors.find(path) != include_ancestors.end()) {
+    return false;
+  }
+  // Is it, or one of the dirs leading to it, included?
+  for (auto end = size_t(relative.data() - path.data()); end <= path.size();
+       ++end) {
+    if (end < path.size() && !is_slash(path[end])) {
+      continue;
+    }
+    if (include_dirs.find(w_string_piece(path.data(), end)) !=
+        include_dirs.end()) {
+      return false;
+    }
+  }
+  if (!isDir) {
+    return include_ancestors.find(path.dirName()) == include_ancestors.end();
+  }
+  return true;
+}
+
+bool watchman_ignore::isIgnored(const char* path, uint32_t pathlen) const {
+  if (isIgnoredByTree(tree, path, pathlen)) {
+    return true;
+  }
+  if (isOutsideIncludes(w_string_piece(path, pathlen), false)) {
+    return true;
+  }
+  if (glob_strings.empty() && glob_name_patterns.empty() &&
+      glob_path_patterns.empty()) {
+    return false;
+  }
+
+  // The watchers that call this report paths at any depth below an
+  // ignored dir, so each of the dirs leading to path has to be matched
+  w_string_piece relative;
+  if (!belowRoot(glob_root, w_string_piece(path, pathlen), relative)) {
+    return false;
+  }
+  thread_local std::string buf;
+  buf.assign(path, pathlen);
+  auto begin = size_t(relative.data() - path);
+  for (auto end = begin; end <= pathlen; ++end) {
+    if (end < pathlen && !is_slash(buf[end])) {
+      continue;
+    }
+    // Matching wants a NUL terminated subject
+    auto saved = buf[end];
+    buf[end] = 0;
+    bool ignored = isIgnoreGlob(w_string_piece(buf.data(), end));
+    buf[end] = saved;
+    if (ignored) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool watchman_ignore::isIgnoreGlob(w_string_piece path) const {
+  if (glob_strings.empty() && glob_name_patterns.empty() &&
+      glob_path_patterns.empty()) {
+    return false;
+  }
+  w_string_piece relative;
+  if (!belowRoot(glob_root, path, relative)) {
+    return false;
+  }
+  auto name = relative.baseName();
+  if (glob_names.find(name) != glob_names.end()) {
+    return true;
+  }
+  for (auto& matcher : glob_name_patterns) {
+    if (matcher.match(name)) {
+      return true;
+    }
+  }
+  for (auto& matcher : glob_path_patterns) {
+    if (matcher.match(relative)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool watchman_ignore::isIgnoredBelow(const w_string& dir) const {
+  if (isIgnored(dir.data(), dir.size())) {
+    return true;
+  }
+  // The grandchildren of a vcs dir are ignored
+  return !ignore_vcs.empty() && isIgnoreVCS(dir.dirName());
+}
 
 bool watchman_ignore::isIgnoreVCS(const w_string& path) const {
   return ignore_vcs.find(path) != ignore_vcs.end();
 }
 
 bool watchman_ignore::isIgnoreDir(const w_string& path) const {
-  return ignore_dirs.find(path) != ignore_dirs.end();
+  return ignore_dirs.find(path) != ignore_dirs.end() || isIgnoreGlob(path) ||
+      isOutsideIncludes(path, false);
 }
 
 /* vim:ts=2:sw=2:et:
@@ -300,7 +300,9 @@ public class WatchmanConnection {
   private static Callable<Map<String, Object>> incomingMessageGetterFromTransport(WatchmanTransport transport)
       throws IOException {
     final InputStream inputStream = transport.getInputStream();
-    final BserDeserializer deserializer = new BserDeserializer(BserDeserializer.KeyOrdering.UNSORTED);
+    final BserDeserializer deserializer = new BserDeserializer(
+        BserDeserializer.KeyOrdering.UNSORTED,
+        BserDeserializer.TemplateRepresentation.COMPACT);
     return new Callable<Map<String, Object>>() {
       @Override
       public Map<String, Object> call() throws Exception {
@@ -33,6 +33,7 @@ import java.nio.charset.CodingErrorAction;
 import java.nio.charset.StandardCharsets;
 
 import java.util.ArrayList;
+import java.util.Arrays;
 import java.util.Collections;
 import java.util.LinkedHashMap;
 import java.util.List;
@@ -47,6 +48,9 @@ import com.facebook.watchman.Deserializer;
  * Decoder for the BSER binary JSON format used by the Watchman service:
  *
  * https://facebook.github.io/watchman/docs/bser.html
+ *
+ * A deserializer reuses the buffer that it reads each value into, so it must
+ * not be shared between threads.
  */
 public class BserDeserializer implements Deserializer {
   public enum KeyOrdering {
@@ -54,6 +58,20 @@ public class BserDeserializer implements Deserializer {
       SORTED
   }
 
+  public enum TemplateRepresentation {
+      /**
+       * Each row of a template is decoded to a {@code Map} of its own, as
+       * objects are.
+       */
+      MAPS,
+      /**
+       * A template is decoded to a {@link BserTemplateList}, which holds the
+       * values of all of its rows in one array.  This is much cheaper for
+       * the large lists of files that watchman sends as templates.
+       */
+      COMPACT
+  }
+
   /**
    * Exception thrown when BSER parser unexpectedly reaches the end of
    * the input stream.
@@ -70,8 +88,13 @@ public class BserDeserializer implements Deserializer {
   }
 
   private final KeyOrdering keyOrdering;
+  private final TemplateRepresentation templateRepresentation;
   private final CharsetDecoder utf8Decoder;
 
+  // The buffer that PDUs are read into, which is reused for the next PDU
+  // unless it had to grow past MAX_RETAINED_BUFFER_SIZE
+  @Nullable private ByteBuffer bserBuffer;
+
   /**
    * If {@code keyOrdering} is {@code SORTED}, any {@code Map} objects
    * in the resulting value will have their keys sorted in natural
@@ -79,7 +102,14 @@ public class BserDeserializer implements Deserializer {
    * same order with which they were encoded.
    */
   public BserDeserializer(KeyOrdering keyOrdering) {
+    this(keyOrdering, TemplateRepresentation.MAPS);
+  }
+
+  public BserDeserializer(
+      KeyOrdering keyOrdering,
+      TemplateRepresentation templateRepresentation) {
     this.keyOrdering = keyOrdering;
+    this.templateRepresentation = templateRepresentation;
     this.utf8Decoder = StandardCharsets.UTF_8
         .newDecoder()
         .onMalformedInput(CodingErrorAction.REPORT);
@@ -91,6 +121,9 @@ public class BserDeserializer implements Deserializer {
   // 2 bytes marker, 1 byte int size, up to 8 bytes int64 value
   private static final int SNIFF_BUFFER_SIZE = 13;
 
+  private static final int MIN_BUFFER_SIZE = 8192;
+  private static final int MAX_RETAINED_BUFFER_SIZE = 16 * 1024 * 1024;
+
   /**
    * Deserializes the next BSER-encoded value from the stream.
    *
@@ -101,9 +134,11 @@ public class BserDeserializer implements Deserializer {
   @Nullable
   public Object deserializeBserValue(InputStream inputStream) throws IOException {
     try {
-      return deserializeRecursive(readBserBuffer(inputStream));
+      return deserializeRecursive(readBserValue(inputStream));
     } catch (BufferUnderflowException e) {
       throw new BserEofException("Prematurely reached end of BSER buffer", e);
+    } finally {
+      releaseBuffer();
     }
   }
 
@@ -116,6 +151,26 @@ public class BserDeserializer implements Deserializer {
     return (Map<String, Object>) deserializeBserValue(inputStream);
   }
 
+  /**
+   * Reads the next BSER-encoded PDU from the stream, and returns a
+   * {@link BserReader} of its value, so that the caller can decode just
+   * the parts of it that it wants.  The reader refers to a buffer that this
+   * deserializer reuses, so it can only be used until the next value is
+   * read from this deserializer.  Reading past the end of the value throws
+   * {@link BufferUnderflowException}.
+   */
+  public BserReader readBserValue(InputStream inputStream) throws IOException {
+    return new BserReader(readBserBuffer(inputStream), utf8Decoder);
+  }
+
+  // Drops the buffer rather than keeping it for the next PDU if it had to
+  // grow very large for this one
+  private void releaseBuffer() {
+    if (bserBuffer != null && bserBuffer.capacity() > MAX_RETAINED_BUFFER_SIZE) {
+      bserBuffer = null;
+    }
+  }
+
   private ByteBuffer readBserBuffer(InputStream inputStream) throws IOException {
     ByteBuffer sniffBuffer = ByteBuffer.allocate(SNIFF_BUFFER_SIZE).order(ByteOrder.nativeOrder());
     Preconditions.checkState(sniffBuffer.hasArray());
@@ -166,9 +221,14 @@ public class BserDeserializer implements Deserializer {
     }
     int bytesRemaining = deserializeIntLen(sniffBuffer, lengthType);
 
-    ByteBuffer bserBuffer = ByteBuffer.allocate(bytesRemaining)
-        .order(ByteOrder.nativeOrder());
-    Preconditions.checkState(bserBuffer.hasArray());
+    releaseBuffer();
+    if (bserBuffer == null || bserBuffer.capacity() < bytesRemaining) {
+      bserBuffer = ByteBuffer.allocate(Math.max(bytesRemaining, MIN_BUFFER_SIZE))
+          .order(ByteOrder.nativeOrder());
+      Preconditions.checkState(bserBuffer.hasArray());
+    }
+    bserBuffer.clear();
+    bserBuffer.limit(bytesRemaining);
 
     int remainingBytesRead = ByteStreams.read(
         inputStream,
@@ -219,42 +279,20 @@ public class BserDeserializer implements Deserializer {
     }
   }
 
-  private String deserializeString(ByteBuffer buffer) throws IOException {
-    byte intType = buffer.get();
-    int len = deserializeIntLen(buffer, intType);
-
-    // We use a CharsetDecoder here instead of String(byte[], Charset)
-    // because we want it to throw an exception for any non-UTF-8 input.
-    buffer.limit(buffer.position() + len);
-
-    try {
-      // We'll likely have many duplicates of this string. Java 7 and
-      // up have not-insane behavior of String.intern(), so we'll use
-      // it to deduplicate the String instances.
-      //
-      // See: http://java-performance.info/string-intern-in-java-6-7-8/
-      return utf8Decoder.decode(buffer).toString().intern();
-    } finally {
-      buffer.limit(buffer.capacity());
-    }
-  }
-
-  private List<Object> deserializeArray(ByteBuffer buffer) throws IOException {
-    byte intType = buffer.get();
-    int numItems = deserializeIntLen(buffer, intType);
+  private List<Object> deserializeArray(BserReader reader) throws IOException {
+    int numItems = reader.readArrayStart();
     if (numItems == 0) {
       return Collections.emptyList();
     }
     ArrayList<Object> list = new ArrayList<Object>(numItems);
     for (int i = 0; i < numItems; i++) {
-      list.add(deserializeRecursive(buffer));
+      list.add(deserializeRecursive(reader));
     }
     return list;
   }
 
-  private Map<String, Object> deserializeObject(ByteBuffer buffer) throws IOException {
-    byte intType = buffer.get();
-    int numItems = deserializeIntLen(buffer, intType);
+  private Map<String, Object> deserializeObject(BserReader reader) throws IOException {
+    int numItems = reader.readObjectStart();
     if (numItems == 0) {
       return Collections.emptyMap();
     }
@@ -265,28 +303,19 @@ public class BserDeserializer implements Deserializer {
       map = new TreeMap<String, Object>();
     }
     for (int i = 0; i < numItems; i++) {
-      byte stringType = buffer.get();
-      if (stringType != BSER_STRING) {
-        throw new IOException(
-            String.format(
-                "Unrecognized BSER object key type %d, expected string",
-                stringType));
-      }
-      String key = deserializeString(buffer);
-      Object value = deserializeRecursive(buffer);
+      String key = reader.readObjectKey();
+      Object value = deserializeRecursive(reader);
       map.put(key, value);
     }
     return map;
   }
 
-  private List<Map<String, Object>> deserializeTemplate(ByteBuffer buffer) throws IOException {
-    byte arrayType = buffer.get();
-    if (arrayType != BSER_ARRAY) {
-      throw new IOException(String.format("Expected ARRAY to follow TEMPLATE, got %d", arrayType));
+  private List<Map<String, Object>> deserializeTemplate(BserReader reader) throws IOException {
+    String[] keys = reader.readTemplateStart();
+    int numItems = reader.readLength();
+    if (templateRepresentation == TemplateRepresentation.COMPACT) {
+      return deserializeCompactTemplate(reader, keys, numItems);
     }
-    List<Object> keys = deserializeArray(buffer);
-    byte numItemsType = buffer.get();
-    int numItems = deserializeIntLen(buffer, numItemsType);
     ArrayList<Map<String, Object>> result = new ArrayList<Map<String, Object>>();
     for (int itemIdx = 0; itemIdx < numItems; itemIdx++) {
       Map<String, Object> obj;
@@ -295,11 +324,9 @@ public class BserDeserializer implements Deserializer {
       } else {
         obj = new TreeMap<String, Object>();
       }
-      for (int keyIdx = 0; keyIdx < keys.size(); keyIdx++) {
-        byte keyValueType = buffer.get();
-        if (keyValueType != BSER_SKIP) {
-          String key = (String) keys.get(keyIdx);
-          obj.put(key, deserializeRecursiveWithType(buffer, keyValueType));
+      for (int keyIdx = 0; keyIdx < keys.length; keyIdx++) {
+        if (!reader.readSkip()) {
+          obj.put(keys[keyIdx], deserializeRecursive(reader));
         }
       }
       result.add(obj);
@@ -307,36 +334,74 @@ public class BserDeserializer implements Deserializer {
     return result;
   }
 
-  @Nullable
-  private Object deserializeRecursive(ByteBuffer buffer) throws IOException {
-    byte type = buffer.get();
-    return deserializeRecursiveWithType(buffer, type);
+  private List<Map<String, Object>> deserializeCompactTemplate(
+      BserReader reader,
+      String[] keys,
+      int numItems) throws IOException {
+    // column[i] is where the value of the i'th key on the wire goes in a
+    // row, which puts the keys of a row in order when they are sorted
+    int[] column = new int[keys.length];
+    String[] columnKeys = keys;
+    if (keyOrdering == KeyOrdering.SORTED) {
+      columnKeys = keys.clone();
+      Arrays.sort(columnKeys);
+      for (int i = 0; i < keys.length; i++) {
+        column[i] = Arrays.binarySearch(columnKeys, keys[i]);
+      }
+    } else {
+      for (int i = 0; i < keys.length; i++) {
+        column[i] = i;
+      }
+    }
+
+    // Each value takes at least a byte, which bounds how much a corrupt
+    // row count can make us allocate
+    long numValues = (long) numItems * keys.length;
+    if (numValues > Integer.MAX_VALUE) {
+      throw new IOException(
+          String.format("BSER template has too many values (%d)", numValues));
+    }
+    Object[] values = new Object[(int) Math.min(numValues, reader.remaining())];
+    if (values.length < numValues) {
+      throw new BufferUnderflowException();
+    }
+    for (int offset = 0; offset < values.length; offset += keys.length) {
+      for (int keyIdx = 0; keyIdx < keys.length; keyIdx++) {
+        values[offset + column[keyIdx]] = reader.readSkip()
+            ? BserTemplateList.MISSING
+            : deserializeRecursive(reader);
+      }
+    }
+    return new BserTemplateList(columnKeys, values, numItems);
   }
 
-  private Object deserializeRecursiveWithType(ByteBuffer buffer, byte type) throws IOException {
+  @Nullable
+  private Object deserializeRecursive(BserReader reader) throws IOException {
+    byte type = reader.peekType();
     switch (type) {
       case BSER_INT8:
       case BSER_INT16:
       case BSER_INT32:
       case BSER_INT64:
-        return deserializeNumber(buffer, type);
+        return reader.readNumber();
       case BSER_REAL:
-        return buffer.getDouble();
+        return reader.readDouble();
       case BSER_TRUE:
-        return true;
       case BSER_FALSE:
-        return false;
+        return reader.readBoolean();
       case BSER_NULL:
+        reader.readNull();
         return null;
       case BSER_STRING:
-        return deserializeString(buffer);
+        return reader.readString();
       case BSER_ARRAY:
-        return deserializeArray(buffer);
+        return deserializeArray(reader);
       case BSER_OBJECT:
-        return deserializeObject(buffer);
+        return deserializeObject(reader);
       case BSER_TEMPLATE:
-        return deserializeTemplate(buffer);
+        return deserializeTemplate(reader);
       default:
+        reader.readType();
         throw new IOException(String.format("Unrecognized BSER value type %d", type));
     }
   }
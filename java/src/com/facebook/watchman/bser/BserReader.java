@@ -0,0 +1,330 @@
+/*
+ * Copyright 2020-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+package com.facebook.watchman.bser;
+
+// CHECKSTYLE.OFF: AvoidStarImport
+import static com.facebook.watchman.bser.BserConstants.*;
+
+import java.io.IOException;
+
+import java.nio.BufferUnderflowException;
+import java.nio.ByteBuffer;
+import java.nio.charset.CharsetDecoder;
+import java.nio.charset.CodingErrorAction;
+import java.nio.charset.StandardCharsets;
+
+/**
+ * Pull decoder for a BSER value held in a {@link ByteBuffer}.  Rather than
+ * building the whole value, the caller asks for each part of it in turn, and
+ * can skip over the parts that it has no use for:
+ *
+ * <pre>
+ *   int numKeys = reader.readObjectStart();
+ *   for (int i = 0; i &lt; numKeys; i++) {
+ *     String key = reader.readObjectKey();
+ *     if (key.equals("files") &amp;&amp; reader.peekType() == BSER_TEMPLATE) {
+ *       String[] fields = reader.readTemplateStart();
+ *       int numFiles = reader.readLength();
+ *       for (int file = 0; file &lt; numFiles; file++) {
+ *         for (String field : fields) {
+ *           if (!reader.readSkip()) {
+ *             ... read or skip the value of field for this file ...
+ *           }
+ *         }
+ *       }
+ *     } else {
+ *       reader.skipValue();
+ *     }
+ *   }
+ * </pre>
+ *
+ * The buffer must be in native byte order, and the value is read from its
+ * position up to its limit.  Reading past the limit throws
+ * {@link BufferUnderflowException}.  A reader is not thread safe.
+ */
+public class BserReader {
+  private final ByteBuffer buffer;
+  private final CharsetDecoder utf8Decoder;
+
+  public BserReader(ByteBuffer buffer) {
+    this(
+        buffer,
+        StandardCharsets.UTF_8.newDecoder().onMalformedInput(CodingErrorAction.REPORT));
+  }
+
+  BserReader(ByteBuffer buffer, CharsetDecoder utf8Decoder) {
+    this.buffer = buffer;
+    this.utf8Decoder = utf8Decoder;
+  }
+
+  /**
+   * Returns true if there is more to read.
+   */
+  public boolean hasRemaining() {
+    return buffer.hasRemaining();
+  }
+
+  int remaining() {
+    return buffer.remaining();
+  }
+
+  /**
+   * Returns the type byte of the next value, one of the constants in
+   * {@link BserConstants}, without moving past it.
+   */
+  public byte peekType() {
+    if (!buffer.hasRemaining()) {
+      throw new BufferUnderflowException();
+    }
+    return buffer.get(buffer.position());
+  }
+
+  /**
+   * Reads an integer of any width, returning it as the boxed type of that
+   * width.
+   */
+  public Number readNumber() throws IOException {
+    return readNumberBody(buffer.get());
+  }
+
+  public long readLong() throws IOException {
+    return readNumber().longValue();
+  }
+
+  /**
+   * Reads an integer that counts something, such as the number of rows
+   * that follow the keys of a template.
+   */
+  public int readLength() throws IOException {
+    return readLengthBody(buffer.get());
+  }
+
+  public double readDouble() throws IOException {
+    expect(BSER_REAL, "real");
+    return buffer.getDouble();
+  }
+
+  public boolean readBoolean() throws IOException {
+    byte type = buffer.get();
+    switch (type) {
+      case BSER_TRUE:
+        return true;
+      case BSER_FALSE:
+        return false;
+      default:
+        throw new IOException(String.format("Expected BSER boolean, got %d", type));
+    }
+  }
+
+  public void readNull() throws IOException {
+    expect(BSER_NULL, "null");
+  }
+
+  public String readString() throws IOException {
+    expect(BSER_STRING, "string");
+    return readStringBody();
+  }
+
+  /**
+   * Reads the start of an array, returning the number of values in it.
+   */
+  public int readArrayStart() throws IOException {
+    expect(BSER_ARRAY, "array");
+    return readLengthBody(buffer.get());
+  }
+
+  /**
+   * Reads the start of an object, returning the number of keys in it.
+   * Each key is read with {@link #readObjectKey()}, followed by its value.
+   */
+  public int readObjectStart() throws IOException {
+    expect(BSER_OBJECT, "object");
+    return readLengthBody(buffer.get());
+  }
+
+  public String readObjectKey() throws IOException {
+    byte type = buffer.get();
+    if (type != BSER_STRING) {
+      throw new IOException(
+          String.format("Unrecognized BSER object key type %d, expected string", type));
+    }
+    return readStringBody();
+  }
+
+  /**
+   * Reads the start of a template, returning its keys.  The number of rows
+   * follows, to be read with {@link #readLength()}, and then the values of
+   * the keys for each row in turn.  A key that a row has no value for is
+   * marked by a skip, which {@link #readSkip()} moves past.
+   */
+  public String[] readTemplateStart() throws IOException {
+    expect(BSER_TEMPLATE, "template");
+    byte arrayType = buffer.get();
+    if (arrayType != BSER_ARRAY) {
+      throw new IOException(String.format("Expected ARRAY to follow TEMPLATE, got %d", arrayType));
+    }
+    String[] keys = new String[readLengthBody(buffer.get())];
+    for (int i = 0; i < keys.length; i++) {
+      keys[i] = readString();
+    }
+    return keys;
+  }
+
+  /**
+   * If the next value is the skip marker of a template row, moves past it
+   * and returns true.
+   */
+  public boolean readSkip() {
+    if (peekType() != BSER_SKIP) {
+      return false;
+    }
+    buffer.get();
+    return true;
+  }
+
+  /**
+   * Moves past the next value without decoding any of it.
+   */
+  public void skipValue() throws IOException {
+    byte type = buffer.get();
+    switch (type) {
+      case BSER_INT8:
+      case BSER_INT16:
+      case BSER_INT32:
+      case BSER_INT64:
+        readNumberBody(type);
+        return;
+      case BSER_REAL:
+        advance(8);
+        return;
+      case BSER_TRUE:
+      case BSER_FALSE:
+      case BSER_NULL:
+        return;
+      case BSER_STRING:
+        advance(readLengthBody(buffer.get()));
+        return;
+      case BSER_ARRAY:
+        for (int n = readLengthBody(buffer.get()); n > 0; n--) {
+          skipValue();
+        }
+        return;
+      case BSER_OBJECT:
+        for (int n = readLengthBody(buffer.get()); n > 0; n--) {
+          skipValue();
+          skipValue();
+        }
+        return;
+      case BSER_TEMPLATE:
+        buffer.position(buffer.position() - 1);
+        int numKeys = readTemplateStart().length;
+        for (int rows = readLength(); rows > 0; rows--) {
+          for (int i = 0; i < numKeys; i++) {
+            if (!readSkip()) {
+              skipValue();
+            }
+          }
+        }
+        return;
+      default:
+        throw new IOException(String.format("Unrecognized BSER value type %d", type));
+    }
+  }
+
+  /**
+   * Reads the body of a string whose type byte has already been read.
+   */
+  String readStringBody() throws IOException {
+    int len = readLengthBody(buffer.get());
+    if (len > buffer.remaining()) {
+      throw new BufferUnderflowException();
+    }
+
+    // We use a CharsetDecoder here instead of String(byte[], Charset)
+    // because we want it to throw an exception for any non-UTF-8 input.
+    int limit = buffer.limit();
+    buffer.limit(buffer.position() + len);
+
+    try {
+      // We'll likely have many duplicates of this string. Java 7 and
+      // up have not-insane behavior of String.intern(), so we'll use
+      // it to deduplicate the String instances.
+      //
+      // See: http://java-performance.info/string-intern-in-java-6-7-8/
+      return utf8Decoder.decode(buffer).toString().intern();
+    } finally {
+      buffer.limit(limit);
+    }
+  }
+
+  /**
+   * Reads the body of an integer whose type byte has already been read.
+   */
+  Number readNumberBody(byte type) throws IOException {
+    switch (type) {
+      case BSER_INT8:
+        return buffer.get();
+      case BSER_INT16:
+        return buffer.getShort();
+      case BSER_INT32:
+        return buffer.getInt();
+      case BSER_INT64:
+        return buffer.getLong();
+      default:
+        throw new IOException(String.format("Invalid BSER number encoding %d", type));
+    }
+  }
+
+  int readLengthBody(byte type) throws IOException {
+    long value = readNumberBody(type).longValue();
+    if (value > Integer.MAX_VALUE) {
+      throw new IOException(
+          String.format(
+              "BSER length out of range (%d > %d)",
+              value,
+              Integer.MAX_VALUE));
+    } else if (value < 0) {
+      throw new IOException(
+          String.format(
+              "BSER length out of range (%d < 0)",
+              value));
+    }
+    return (int) value;
+  }
+
+  /**
+   * Reads the type byte of the next value, which the caller has already
+   * peeked at.
+   */
+  byte readType() {
+    return buffer.get();
+  }
+
+  private void expect(byte expected, String what) throws IOException {
+    byte type = buffer.get();
+    if (type != expected) {
+      throw new IOException(String.format("Expected BSER %s, got %d", what, type));
+    }
+  }
+
+  private void advance(int len) {
+    if (len > buffer.remaining()) {
+      throw new BufferUnderflowException();
+    }
+    buffer.position(buffer.position() + len);
+  }
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2020-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+package com.facebook.watchman.bser;
+
+import java.util.AbstractList;
+import java.util.AbstractMap;
+import java.util.AbstractSet;
+import java.util.Iterator;
+import java.util.Map;
+import java.util.NoSuchElementException;
+import java.util.RandomAccess;
+import java.util.Set;
+
+import javax.annotation.Nullable;
+
+/**
+ * The rows of a BSER template, as a read-only list of read-only maps.
+ *
+ * Watchman sends the files of query results and subscription updates as
+ * templates.  Rather than a map for each file, this holds the keys of the
+ * template once and the values of all of the rows in a single array, and
+ * {@link #get(int)} returns a view of a row.  A row has no entry for a key
+ * that the template skipped for it.
+ */
+public class BserTemplateList extends AbstractList<Map<String, Object>>
+    implements RandomAccess {
+  // Stands for the value of a key that a row doesn't have
+  static final Object MISSING = new Object();
+
+  private final String[] keys;
+  private final Object[] values;
+  private final int size;
+
+  /**
+   * values holds the values of keys for each of the size rows in turn, with
+   * {@link #MISSING} for the keys that a row doesn't have.
+   */
+  BserTemplateList(String[] keys, Object[] values, int size) {
+    this.keys = keys;
+    this.values = values;
+    this.size = size;
+  }
+
+  @Override
+  public Map<String, Object> get(int index) {
+    if (index < 0 || index >= size) {
+      throw new IndexOutOfBoundsException(
+          String.format("Index %d out of bounds for length %d", index, size));
+    }
+    return new Row(index * keys.length);
+  }
+
+  @Override
+  public int size() {
+    return size;
+  }
+
+  private class Row extends AbstractMap<String, Object> {
+    private final int offset;
+
+    Row(int offset) {
+      this.offset = offset;
+    }
+
+    private int indexOf(@Nullable Object key) {
+      for (int i = 0; i < keys.length; i++) {
+        if (keys[i].equals(key)) {
+          return i;
+        }
+      }
+      return -1;
+    }
+
+    @Override
+    public boolean containsKey(@Nullable Object key) {
+      int i = indexOf(key);
+      return i >= 0 && values[offset + i] != MISSING;
+    }
+
+    @Override
+    @Nullable
+    public Object get(@Nullable Object key) {
+      int i = indexOf(key);
+      if (i < 0 || values[offset + i] == MISSING) {
+        return null;
+      }
+      return values[offset + i];
+    }
+
+    @Override
+    public Set<Map.Entry<String, Object>> entrySet() {
+      return new AbstractSet<Map.Entry<String, Object>>() {
+        @Override
+        public Iterator<Map.Entry<String, Object>> iterator() {
+          return new Iterator<Map.Entry<String, Object>>() {
+            private int next = advance(0);
+
+            private int advance(int i) {
+              while (i < keys.length && values[offset + i] == MISSING) {
+                i++;
+              }
+              return i;
+            }
+
+            @Override
+            public boolean hasNext() {
+              return next < keys.length;
+            }
+
+            @Override
+            public Map.Entry<String, Object> next() {
+              if (next >= keys.length) {
+                throw new NoSuchElementException();
+              }
+              Map.Entry<String, Object> entry =
+                  new AbstractMap.SimpleImmutableEntry<String, Object>(
+                      keys[next], values[offset + next]);
+              next = advance(next + 1);
+              return entry;
+            }
+
+            @Override
+            public void remove() {
+              throw new UnsupportedOperationException();
+            }
+          };
+        }
+
+        @Override
+        public int size() {
+          int count = 0;
+          for (int i = 0; i < keys.length; i++) {
+            if (values[offset + i] != MISSING) {
+              count++;
+            }
+          }
+          return count;
+        }
+      };
+    }
+  }
+}
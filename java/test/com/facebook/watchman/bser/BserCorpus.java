@@ -0,0 +1,66 @@
+/*
+ * Copyright 2020-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+package com.facebook.watchman.bser;
+
+import java.io.File;
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+
+/**
+ * Locates the corpus of PDUs that is shared by all of the BSER
+ * implementations in the watchman repository; see
+ * tests/bser_corpus/README.md there.
+ *
+ * The directory can be set with the {@code bser.corpus.dir} system
+ * property, and otherwise is found relative to the java directory.
+ */
+final class BserCorpus {
+  private BserCorpus() {}
+
+  static File dir() {
+    return new File(System.getProperty("bser.corpus.dir", "../tests/bser_corpus"));
+  }
+
+  /**
+   * Returns the v1 PDUs of the corpus, which are the ones that this
+   * implementation speaks, or an empty list if the corpus isn't available.
+   */
+  static List<File> v1Pdus() {
+    List<File> pdus = new ArrayList<File>();
+    File[] files = dir().listFiles();
+    if (files == null) {
+      return pdus;
+    }
+    Arrays.sort(files);
+    for (File file : files) {
+      if (file.getName().endsWith(".bser") && file.getName().contains(".v1.")) {
+        pdus.add(file);
+      }
+    }
+    return pdus;
+  }
+
+  /**
+   * Returns the canonical encoding of the value in pdu, which is what
+   * encoding the decoded value must produce.
+   */
+  static File canonical(File pdu) {
+    String name = pdu.getName();
+    return new File(pdu.getParentFile(), name.substring(0, name.indexOf(".v1.")) + ".v1.bser");
+  }
+}
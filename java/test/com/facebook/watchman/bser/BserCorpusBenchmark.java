@@ -0,0 +1,107 @@
+/*
+ * Copyright 2020-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+package com.facebook.watchman.bser;
+
+import com.google.common.io.Files;
+
+import java.io.ByteArrayInputStream;
+import java.io.File;
+import java.io.IOException;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * Measures the throughput of this BSER implementation on the v1 PDUs of
+ * the shared corpus:
+ *
+ *   java com.facebook.watchman.bser.BserCorpusBenchmark [seconds] [substring]
+ *
+ * For each PDU this reports how quickly it is decoded, and how quickly the
+ * decoded value is encoded again, in MB of BSER per second, so that the
+ * numbers can be compared with those of the drivers for the other
+ * languages.
+ */
+public class BserCorpusBenchmark {
+  private interface Operation {
+    void run() throws IOException;
+  }
+
+  /**
+   * Returns the mean time in seconds of an operation, running it for at
+   * least minTime seconds.
+   */
+  private static double measure(Operation operation, double minTime) throws IOException {
+    operation.run();
+    long iterations = 0;
+    long start = System.nanoTime();
+    while (true) {
+      operation.run();
+      iterations++;
+      double elapsed = (System.nanoTime() - start) / 1e9;
+      if (elapsed >= minTime && iterations >= 3) {
+        return elapsed / iterations;
+      }
+    }
+  }
+
+  public static void main(String[] args) throws IOException {
+    double minTime = args.length > 0 ? Double.parseDouble(args[0]) : 0.5;
+    String only = args.length > 1 ? args[1] : "";
+
+    final BserDeserializer deserializer =
+        new BserDeserializer(BserDeserializer.KeyOrdering.UNSORTED);
+    final BserSerializer serializer = new BserSerializer();
+    System.out.println(
+        String.format(
+            "%-8s %-36s %9s %12s %12s", "impl", "pdu", "bytes", "decode MB/s", "encode MB/s"));
+    for (File pdu : BserCorpus.v1Pdus()) {
+      if (!pdu.getName().contains(only)) {
+        continue;
+      }
+      final byte[] data = Files.toByteArray(pdu);
+      final Object value = deserializer.deserializeBserValue(new ByteArrayInputStream(data));
+      double decode = measure(
+          new Operation() {
+            @Override
+            public void run() throws IOException {
+              deserializer.deserializeBserValue(new ByteArrayInputStream(data));
+            }
+          },
+          minTime);
+      double encode = measure(
+          new Operation() {
+            @Override
+            public void run() throws IOException {
+              serializer.serializeToBuffer(
+                  value,
+                  ByteBuffer.allocate(data.length).order(ByteOrder.nativeOrder()));
+            }
+          },
+          minTime);
+      double mb = data.length / 1e6;
+      System.out.println(
+          String.format(
+              "%-8s %-36s %9d %12.1f %12.1f",
+              "java",
+              pdu.getName(),
+              data.length,
+              mb / decode,
+              mb / encode));
+    }
+  }
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2020-present Facebook, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+package com.facebook.watchman.bser;
+
+import static org.hamcrest.Matchers.equalTo;
+import static org.junit.Assert.assertThat;
+
+import com.google.common.io.BaseEncoding;
+import com.google.common.io.Files;
+
+import java.io.ByteArrayInputStream;
+import java.io.File;
+import java.io.IOException;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+import java.util.Arrays;
+import java.util.List;
+
+import org.junit.Assume;
+import org.junit.Test;
+
+public class BserCorpusTest {
+  @Test
+  public void decodedPdusEncodeToTheirCanonicalForm() throws IOException {
+    List<File> pdus = BserCorpus.v1Pdus();
+    Assume.assumeTrue(!pdus.isEmpty());
+    // The corpus is little endian
+    Assume.assumeTrue(ByteOrder.nativeOrder() == ByteOrder.LITTLE_ENDIAN);
+
+    BserDeserializer deserializer =
+        new BserDeserializer(BserDeserializer.KeyOrdering.UNSORTED);
+    BserSerializer serializer = new BserSerializer();
+    for (File pdu : pdus) {
+      Object value = deserializer.deserializeBserValue(
+          new ByteArrayInputStream(Files.toByteArray(pdu)));
+      ByteBuffer buffer = serializer.serializeToBuffer(
+          value,
+          ByteBuffer.allocate(8192).order(ByteOrder.nativeOrder()));
+      byte[] encoded = Arrays.copyOf(buffer.array(), buffer.position());
+      assertThat(
+          pdu.getName(),
+          BaseEncoding.base16().encode(encoded),
+          equalTo(BaseEncoding.base16().encode(Files.toByteArray(BserCorpus.canonical(pdu)))));
+    }
+  }
+}
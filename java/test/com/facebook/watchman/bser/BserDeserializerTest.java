@@ -19,6 +19,7 @@ package com.facebook.watchman.bser;
 import static org.hamcrest.Matchers.closeTo;
 import static org.hamcrest.Matchers.contains;
 import static org.hamcrest.Matchers.equalTo;
+import static org.hamcrest.Matchers.instanceOf;
 import static org.hamcrest.Matchers.is;
 import static org.hamcrest.Matchers.nullValue;
 import static org.hamcrest.Matchers.sameInstance;
@@ -197,6 +198,90 @@ public class BserDeserializerTest {
                 Matchers.<String, Object>hasEntry("age", (byte) 25))));
   }
 
+  @Test
+  public void deserializeCompactTemplate() throws IOException {
+    BserDeserializer deserializer = new BserDeserializer(
+        BserDeserializer.KeyOrdering.UNSORTED,
+        BserDeserializer.TemplateRepresentation.COMPACT);
+    List<Map<String, Object>> deserialized = (List<Map<String, Object>>)
+        deserializer.deserializeBserValue(
+            getByteStream(
+                "000103280B0003020203046E616D6502030361676503030203046672656403140203" +
+                "0470657465031E0C0319"));
+
+    assertThat(deserialized, instanceOf(BserTemplateList.class));
+    assertThat(
+        deserialized,
+        equalTo(
+            (List<Map<String, Object>>) ImmutableList.<Map<String, Object>>of(
+                ImmutableMap.<String, Object>of("name", "fred", "age", (byte) 20),
+                ImmutableMap.<String, Object>of("name", "pete", "age", (byte) 30),
+                ImmutableMap.<String, Object>of("age", (byte) 25))));
+    assertThat(deserialized.get(2).containsKey("name"), is(false));
+    assertThat(deserialized.get(2).get("name"), is(nullValue()));
+  }
+
+  @Test
+  public void deserializeSortedCompactTemplate() throws IOException {
+    BserDeserializer deserializer = new BserDeserializer(
+        BserDeserializer.KeyOrdering.SORTED,
+        BserDeserializer.TemplateRepresentation.COMPACT);
+    List<Map<String, Object>> deserialized = (List<Map<String, Object>>)
+        deserializer.deserializeBserValue(
+            getByteStream(
+                "000103280B0003020203046E616D6502030361676503030203046672656403140203" +
+                "0470657465031E0C0319"));
+
+    assertThat(
+        deserialized.get(0).keySet(),
+        Matchers.<String>contains("age", "name"));
+    assertThat(deserialized.get(1).get("name"), equalTo((Object) "pete"));
+  }
+
+  @Test
+  public void readValueWithBserReader() throws IOException {
+    BserDeserializer deserializer = new BserDeserializer(BserDeserializer.KeyOrdering.UNSORTED);
+    BserReader reader = deserializer.readBserValue(
+        getByteStream("0001031B010303020303666F6F0323020303626172034202030362617A03F0"));
+    assertThat(reader.readObjectStart(), equalTo(3));
+    assertThat(reader.readObjectKey(), equalTo("foo"));
+    reader.skipValue();
+    assertThat(reader.readObjectKey(), equalTo("bar"));
+    assertThat(reader.peekType(), equalTo(BserConstants.BSER_INT8));
+    assertThat(reader.readLong(), equalTo(0x42L));
+    assertThat(reader.readObjectKey(), equalTo("baz"));
+    reader.skipValue();
+    assertThat(reader.hasRemaining(), is(false));
+  }
+
+  @Test
+  public void skipTemplateWithBserReader() throws IOException {
+    BserDeserializer deserializer = new BserDeserializer(BserDeserializer.KeyOrdering.UNSORTED);
+    BserReader reader = deserializer.readBserValue(
+        getByteStream(
+            "0001032D0003020B0003020203046E616D6502030361676503030203046672656403140203" +
+            "0470657465031E0C03190342"));
+    assertThat(reader.readArrayStart(), equalTo(2));
+    reader.skipValue();
+    assertThat(reader.readNumber(), equalTo((Object) (byte) 0x42));
+    assertThat(reader.hasRemaining(), is(false));
+  }
+
+  @Test
+  public void deserializeReusesBufferAcrossValues() throws IOException {
+    BserDeserializer deserializer = new BserDeserializer(BserDeserializer.KeyOrdering.UNSORTED);
+    String deserialized = (String) deserializer.deserializeBserValue(
+        getByteStream("0001030E02030B68656C6C6F20776F726C64"));
+    List<Object> deserialized2 = (List<Object>) deserializer.deserializeBserValue(
+        getByteStream("000103090003030323034203F0"));
+    Byte deserialized3 = (Byte) deserializer.deserializeBserValue(getByteStream("000103020342"));
+    assertThat(deserialized, equalTo("hello world"));
+    assertThat(
+        deserialized2,
+        equalTo((List<Object>) ImmutableList.<Object>of((byte) 0x23, (byte) 0x42, (byte) 0xF0)));
+    assertThat(deserialized3, equalTo((byte) 0x42));
+  }
+
   @Test
   public void deserializeInt8() throws IOException {
     BserDeserializer deserializer = new BserDeserializer(BserDeserializer.KeyOrdering.UNSORTED);
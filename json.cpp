@@ -2,12 +2,71 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include "PduBuffer.h"
+#include "PduCompression.h"
+#include "PduSharedMemory.h"
+#include "Probe.h"
+#include <folly/Synchronized.h>
+#include <mutex>
 
 using namespace watchman;
 
+namespace {
+// The most idle buffers that are kept for reuse
+constexpr size_t kMaxPooledBuffers = 8;
+
+using BufferPool = folly::Synchronized<std::vector<char*>, std::mutex>;
+
+// Buffers of WATCHMAN_IO_BUF_SIZE bytes that were released by the
+// connections that have gone away, so that a short lived connection, such
+// as that of a CLI invocation, needn't allocate buffers of its own
+BufferPool& bufferPool() {
+  // Leaked, since connections may outlive static destruction
+  static auto* pool = new BufferPool();
+  return *pool;
+}
+
+char* allocBuffer() {
+  {
+    auto pool = bufferPool().lock();
+    if (!pool->empty()) {
+      auto buf = pool->back();
+      pool->pop_back();
+      return buf;
+    }
+  }
+  return (char*)malloc(WATCHMAN_IO_BUF_SIZE);
+}
+
+// Returns buf, which holds allocd bytes, to the pool; a buffer that grew to
+// hold a large PDU is trimmed back to the usual size first
+void releaseBuffer(char* buf, uint32_t allocd) {
+  if (allocd != WATCHMAN_IO_BUF_SIZE) {
+    auto trimmed = (char*)realloc(buf, WATCHMAN_IO_BUF_SIZE);
+    if (!trimmed) {
+      free(buf);
+      return;
+    }
+    buf = trimmed;
+  }
+  {
+    auto pool = bufferPool().lock();
+    if (pool->size() < kMaxPooledBuffers) {
+      pool->push_back(buf);
+      return;
+    }
+  }
+  free(buf);
+}
+} // namespace
+
 W_CAP_REG("bser-v2")
+W_CAP_REG("bser-v3")
+W_CAP_REG("bser-compression")
+W_CAP_REG("bser-shared-memory")
+W_CAP_REG("probe")
 watchman_json_buffer::watchman_json_buffer()
-    : buf((char*)malloc(WATCHMAN_IO_BUF_SIZE)),
+    : buf(allocBuffer()),
       allocd(WATCHMAN_IO_BUF_SIZE),
       rpos(0),
       wpos(0),
@@ -24,7 +83,7 @@ void watchman_json_buffer::clear() {
 }
 
 watchman_json_buffer::~watchman_json_buffer() {
-  free(buf);
+  releaseBuffer(buf, allocd);
 }
 
 // Shunt down, return available size
@@ -82,6 +141,15 @@ inline enum w_pdu_type watchman_json_buffer::detectPdu() {
   if (memcmp(buf + rpos, BSER_V2_MAGIC, 2) == 0) {
     return is_bser_v2;
   }
+  if (memcmp(buf + rpos, BSER_V3_MAGIC, 2) == 0) {
+    return is_bser_v3;
+  }
+  if (memcmp(buf + rpos, BSER_COMPRESSED_MAGIC, 2) == 0) {
+    return is_bser_compressed;
+  }
+  if (memcmp(buf + rpos, PROBE_MAGIC, 2) == 0) {
+    return is_probe;
+  }
   return is_json_compact;
 }
 
@@ -155,7 +223,7 @@ bool watchman_json_buffer::decodePduInfo(
     json_int_t* bser_capabilities,
     json_error_t* jerr) {
   json_int_t needed;
-  if (bser_version == 2) {
+  if (bser_version >= 2) {
     uint32_t capabilities;
     while (wpos - rpos < sizeof(capabilities)) {
       if (!fillBuffer(stm)) {
@@ -185,23 +253,22 @@ bool watchman_json_buffer::decodePduInfo(
   return true;
 }
 
-json_ref watchman_json_buffer::readBserPdu(
+// Reads the header of the PDU at rpos, and then the rest of it, and
+// returns its length in len.  The body starts at rpos.
+bool watchman_json_buffer::readBserBody(
     w_stm_t stm,
     uint32_t bser_version,
+    json_int_t* len,
     json_error_t* jerr) {
-  json_int_t needed;
   json_int_t val;
   json_int_t bser_capabilities;
   uint32_t ideal;
   int r;
-  json_ref obj;
 
   rpos += 2;
 
-  // We don't handle EAGAIN cleanly in here
-  stm->setNonBlock(false);
   if (!decodePduInfo(stm, bser_version, &val, &bser_capabilities, jerr)) {
-    return nullptr;
+    return false;
   }
 
   // val tells us exactly how much storage we need for this PDU
@@ -219,7 +286,7 @@ json_ref watchman_json_buffer::readBserPdu(
             sizeof(jerr->text),
             "out of memory while allocating %" PRIu32 " bytes",
             ideal);
-        return nullptr;
+        return false;
       }
 
       buf = newBuf;
@@ -242,12 +309,38 @@ json_ref watchman_json_buffer::readBserPdu(
           wpos,
           rpos,
           strerror(errno));
-      return nullptr;
+      return false;
     }
     wpos += r;
   }
 
-  obj = bunser(buf + rpos, buf + wpos, &needed, jerr);
+  *len = val;
+  return true;
+}
+
+json_ref watchman_json_buffer::readBserPdu(
+    w_stm_t stm,
+    uint32_t bser_version,
+    json_error_t* jerr) {
+  json_int_t needed;
+  json_int_t len;
+  json_ref obj;
+
+  // We don't handle EAGAIN cleanly in here
+  stm->setNonBlock(false);
+  if (!readBserBody(stm, bser_version, &len, jerr)) {
+    return nullptr;
+  }
+
+  obj = bunser(
+      buf + rpos,
+      buf + wpos,
+      &needed,
+      jerr,
+      bser_version == 3 ? &bserStrings_ : nullptr);
+  // The table is only needed while decoding; its storage is kept for the
+  // next PDU
+  bserStrings_.clear();
 
   // Ensure that we move the read position to the wpos; we consumed it all
   rpos = wpos;
@@ -256,6 +349,55 @@ json_ref watchman_json_buffer::readBserPdu(
   return obj;
 }
 
+json_ref watchman_json_buffer::readCompressedPdu(
+    w_stm_t stm,
+    json_error_t* jerr) {
+  json_int_t len;
+
+  stm->setNonBlock(false);
+  // A compressed PDU has the same header as a BSER v2 PDU
+  if (!readBserBody(stm, 2, &len, jerr)) {
+    return nullptr;
+  }
+
+  std::string pdu;
+  try {
+    pdu = decompressPdu(buf + rpos, len);
+  } catch (const std::exception& exc) {
+    snprintf(jerr->text, sizeof(jerr->text), "%s", exc.what());
+    return nullptr;
+  }
+
+  // Replace the compressed PDU in the buffer with the PDU that it holds,
+  // and decode that instead
+  clear();
+  if (pdu.size() > allocd) {
+    auto newBuf = (char*)realloc(buf, pdu.size());
+    if (!newBuf) {
+      snprintf(
+          jerr->text,
+          sizeof(jerr->text),
+          "out of memory while allocating %" PRIu64 " bytes",
+          uint64_t(pdu.size()));
+      return nullptr;
+    }
+    buf = newBuf;
+    allocd = uint32_t(pdu.size());
+  }
+  memcpy(buf, pdu.data(), pdu.size());
+  wpos = uint32_t(pdu.size());
+
+  pdu_type = detectPdu();
+  if (pdu_type != is_bser_v2 && pdu_type != is_bser_v3) {
+    snprintf(
+        jerr->text,
+        sizeof(jerr->text),
+        "compressed PDU doesn't hold a BSER v2 or v3 PDU");
+    return nullptr;
+  }
+  return decodePdu(stm, jerr);
+}
+
 bool watchman_json_buffer::readAndDetectPdu(w_stm_t stm, json_error_t* jerr) {
   enum w_pdu_type pdu;
   // The client might send us different kinds of PDUs over the same connection,
@@ -278,7 +420,7 @@ bool watchman_json_buffer::readAndDetectPdu(w_stm_t stm, json_error_t* jerr) {
     pdu = detectPdu();
   }
 
-  if (pdu == is_bser_v2) {
+  if (pdu == is_bser_v2 || pdu == is_bser_v3 || pdu == is_bser_compressed) {
     // read capabilities (since we haven't increased rpos, first two bytes are
     // still the header)
     while (wpos - rpos < 2 + sizeof(capabilities)) {
@@ -429,8 +571,13 @@ bool watchman_json_buffer::streamPdu(w_stm_t stm, json_error_t* jerr) {
     case is_json_pretty:
       return streamUntilNewLine(stm);
     case is_bser:
-    case is_bser_v2: {
-      if (pdu_type == is_bser_v2) {
+    case is_bser_v2:
+    case is_bser_v3:
+    case is_bser_compressed: {
+      if (pdu_type == is_bser_v3) {
+        bser_version = 3;
+      } else if (pdu_type == is_bser_v2 || pdu_type == is_bser_compressed) {
+        // A compressed PDU has the same header as a BSER v2 PDU
         bser_version = 2;
       } else {
         bser_version = 1;
@@ -455,6 +602,21 @@ json_ref watchman_json_buffer::decodePdu(w_stm_t stm, json_error_t* jerr) {
       return readJsonPrettyPdu(stm, jerr);
     case is_bser_v2:
       return readBserPdu(stm, 2, jerr);
+    case is_bser_v3:
+      return readBserPdu(stm, 3, jerr);
+    case is_bser_compressed:
+      return readCompressedPdu(stm, jerr);
+    case is_probe:
+      if (wpos - rpos < kProbeRequestSize) {
+        // readProbe picks it up once the rest of it arrives
+        errno = EAGAIN;
+      } else {
+        snprintf(
+            jerr->text,
+            sizeof(jerr->text),
+            "probes are only answered by the server");
+      }
+      return nullptr;
     default: // bser v1
       return readBserPdu(stm, 1, jerr);
   }
@@ -498,6 +660,25 @@ bool watchman_json_buffer::passThru(
   return res;
 }
 
+bool watchman_json_buffer::readProbe(
+    w_stm_t stm,
+    watchman::ProbeRequest& probe) {
+  shuntDown();
+  // Only read if decodeNext would have to, so that we don't wait for more
+  // input after a short PDU.  A failure here is seen again, and reported,
+  // by decodeNext.
+  if (wpos - rpos < 2 ||
+      (detectPdu() == is_probe && wpos - rpos < kProbeRequestSize)) {
+    fillBuffer(stm);
+  }
+  if (detectPdu() != is_probe || wpos - rpos < kProbeRequestSize) {
+    return false;
+  }
+  probe = decodeProbeRequest(buf + rpos);
+  rpos += kProbeRequestSize;
+  return true;
+}
+
 json_ref watchman_json_buffer::decodeNext(w_stm_t stm, json_error_t* jerr) {
   *jerr = json_error_t();
   if (!readAndDetectPdu(stm, jerr)) {
@@ -566,17 +747,22 @@ bool watchman_json_buffer::bserEncodeToStream(
     uint32_t bser_capabilities,
     const json_ref& json,
     w_stm_t stm) {
-  struct jbuffer_write_data data = {stm, this};
-  int res;
-
-  res = w_bser_write_pdu(
-      bser_version, bser_capabilities, jbuffer_write_data::write, json, &data);
-
-  if (res != 0) {
+  PduBuffer buffer;
+  if (w_bser_encode_pdu(bser_version, bser_capabilities, json, buffer)) {
     return false;
   }
-
-  return data.flush();
+  if (bser_version < 2) {
+    return buffer.writeTo(stm);
+  }
+  auto shared = sendSharedMemoryPdu(bser_capabilities, buffer, stm);
+  if (shared) {
+    return *shared;
+  }
+  PduBuffer compressed;
+  if (compressPdu(bser_capabilities, buffer, compressed)) {
+    return compressed.writeTo(stm);
+  }
+  return buffer.writeTo(stm);
 }
 
 bool watchman_json_buffer::jsonEncodeToStream(
@@ -613,11 +799,103 @@ bool watchman_json_buffer::pduEncodeToStream(
       return bserEncodeToStream(1, capabilities, json, stm);
     case is_bser_v2:
       return bserEncodeToStream(2, capabilities, json, stm);
+    case is_bser_v3:
+      return bserEncodeToStream(3, capabilities, json, stm);
+    case need_data:
+    default:
+      return false;
+  }
+}
+
+static uint32_t bser_version_of(enum w_pdu_type pdu_type) {
+  switch (pdu_type) {
+    case is_bser_v2:
+      return 2;
+    case is_bser_v3:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+// Appends pdu to out, compressed if capabilities ask for that
+static void append_pdu(
+    enum w_pdu_type pdu_type,
+    uint32_t capabilities,
+    const PduBuffer& pdu,
+    std::string& out) {
+  PduBuffer compressed;
+  if (pdu_type != is_bser && compressPdu(capabilities, pdu, compressed)) {
+    compressed.appendTo(out);
+  } else {
+    pdu.appendTo(out);
+  }
+}
+
+static int append_to_string(const char* buffer, size_t size, void* data) {
+  static_cast<std::string*>(data)->append(buffer, size);
+  return 0;
+}
+
+bool watchman_json_buffer::pduEncodeToString(
+    enum w_pdu_type pdu_type,
+    uint32_t capabilities,
+    const json_ref& json,
+    std::string& out) {
+  switch (pdu_type) {
+    case is_json_compact:
+    case is_json_pretty:
+      if (json_dump_callback(
+              json,
+              append_to_string,
+              &out,
+              pdu_type == is_json_compact ? JSON_COMPACT : JSON_INDENT(4)) !=
+          0) {
+        return false;
+      }
+      out.push_back('\n');
+      return true;
+    case is_bser:
+    case is_bser_v2:
+    case is_bser_v3: {
+      PduBuffer buffer;
+      if (w_bser_encode_pdu(
+              bser_version_of(pdu_type), capabilities, json, buffer)) {
+        return false;
+      }
+      append_pdu(pdu_type, capabilities, buffer, out);
+      return true;
+    }
     case need_data:
     default:
       return false;
   }
 }
 
+bool watchman_json_buffer::bserPduEncodeToString(
+    enum w_pdu_type pdu_type,
+    uint32_t capabilities,
+    const json_ref& json,
+    const w_string& key,
+    w_string_piece encoded,
+    std::string& out) {
+  if (pdu_type != is_bser && pdu_type != is_bser_v2 &&
+      pdu_type != is_bser_v3) {
+    return false;
+  }
+  PduBuffer buffer;
+  if (w_bser_encode_pdu_with_encoded_member(
+          bser_version_of(pdu_type),
+          capabilities,
+          json,
+          key,
+          encoded,
+          buffer)) {
+    return false;
+  }
+  append_pdu(pdu_type, capabilities, buffer, out);
+  return true;
+}
+
 /* vim:ts=2:sw=2:et:
  */
@@ -0,0 +1,320 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include <folly/Conv.h>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "CommandAdmission.h"
+#include "LockProfile.h"
+#include "Logging.h"
+#include "Metrics.h"
+#include "PerfAlarms.h"
+#include "PerfStats.h"
+#include "ResponseQueue.h"
+#include "Tracing.h"
+
+// The metrics listener is an opt-in TCP listener, enabled by setting
+// metrics-listener-address, that answers every HTTP request with the
+// metrics of the server and of each watched root, so that they can be
+// scraped by Prometheus or anything that understands its text format.
+
+using namespace watchman;
+
+namespace {
+// The most bytes of a request that are read before answering it
+constexpr size_t kMaxRequestBytes = 8192;
+// How long a scraper has to send its request or accept the response
+constexpr int kTimeoutSeconds = 5;
+
+// Adds the metrics of the clients and their subscriptions
+void addClientMetrics(MetricsWriter& metrics) {
+  std::unordered_map<w_string, uint64_t> subscriptions;
+  std::unordered_map<w_string, std::unique_ptr<Histogram>> settleToDispatch;
+  size_t numClients;
+  {
+    auto clientsLock = clients.rlock();
+    numClients = clientsLock->size();
+    for (const auto& c : *clientsLock) {
+      auto* user_client = dynamic_cast<watchman_user_client*>(c.get());
+      if (!user_client) {
+        continue;
+      }
+      for (const auto& sub : user_client->subscriptions) {
+        auto& path = sub.second->root->root_path;
+        ++subscriptions[path];
+        auto& histogram = settleToDispatch[path];
+        if (!histogram) {
+          histogram = std::make_unique<Histogram>();
+        }
+        histogram->merge(sub.second->settleToDispatchUs);
+      }
+    }
+  }
+
+  metrics.gauge("watchman_clients", "Connected clients", numClients);
+  metrics.counter(
+      "watchman_response_bytes_written_total",
+      "Bytes of responses written to clients",
+      ResponseQueue::totalWritten());
+  metrics.counter(
+      "watchman_idle_wakeups_total",
+      "Times that a thread waiting for events woke up because its timeout "
+      "elapsed rather than because it was signalled",
+      w_poll_idle_wakeups());
+  for (auto& it : subscriptions) {
+    MetricsWriter::Labels labels{{"root", it.first}};
+    metrics.gauge(
+        "watchman_root_subscriptions",
+        "Active subscriptions to the root",
+        it.second,
+        labels);
+    // Made up of the subscriptions that are active, so it is reset
+    // whenever one of them ends
+    metrics.histogram(
+        "watchman_root_settle_to_dispatch_us",
+        "Microseconds from the root settling to a subscription being run",
+        *settleToDispatch[it.first],
+        labels);
+  }
+}
+
+// Adds the metrics of the admission control of queries
+void addAdmissionMetrics(MetricsWriter& metrics) {
+  auto& admission = getCommandAdmission();
+  if (!admission.enabled()) {
+    return;
+  }
+  auto stats = admission.getStats();
+  for (auto priority : {CommandAdmission::Priority::Normal,
+                        CommandAdmission::Priority::Background}) {
+    auto i = size_t(priority);
+    MetricsWriter::Labels labels{
+        {"priority",
+         w_string(CommandAdmission::priorityName(priority), W_STRING_UNICODE)}};
+    metrics.counter(
+        "watchman_queries_admitted_total",
+        "Queries that were allowed to run",
+        stats.admitted[i],
+        labels);
+    metrics.counter(
+        "watchman_queries_queued_total",
+        "Queries that had to wait for others to finish",
+        stats.queued[i],
+        labels);
+    metrics.counter(
+        "watchman_queries_rejected_total",
+        "Queries that were rejected because too many were waiting or they "
+        "waited for too long",
+        stats.rejected[i],
+        labels);
+    metrics.gauge(
+        "watchman_queries_running",
+        "Queries that are running",
+        stats.running[i],
+        labels);
+    metrics.gauge(
+        "watchman_queries_waiting",
+        "Queries that are waiting to run",
+        stats.waiting[i],
+        labels);
+  }
+}
+
+// Adds the dispatches of each command that has run and their latencies
+void addCommandMetrics(MetricsWriter& metrics) {
+  for (auto def : get_all_commands()) {
+    if (def->stats.calls() == 0 && def->stats.inflight() == 0) {
+      continue;
+    }
+    def->stats.addMetrics(metrics, def->name);
+  }
+}
+
+// The subscriptions to a root that spent the most time evaluating, and
+// their metrics, when a perf alarm was raised for it
+constexpr size_t kAlarmSubscriptions = 5;
+
+json_ref getCostlySubscriptions(const w_string& root) {
+  std::vector<std::pair<uint64_t, json_ref>> costly;
+  {
+    auto clientsLock = clients.rlock();
+    for (const auto& c : *clientsLock) {
+      auto* user_client = dynamic_cast<watchman_user_client*>(c.get());
+      if (!user_client) {
+        continue;
+      }
+      for (const auto& sub : user_client->subscriptions) {
+        if (sub.second->root->root_path != root) {
+          continue;
+        }
+        auto metrics = sub.second->getMetrics();
+        metrics.set("name", w_string_to_json(sub.second->name));
+        costly.emplace_back(
+            sub.second->evaluationUs.sum(), std::move(metrics));
+      }
+    }
+  }
+  std::sort(costly.begin(), costly.end(), [](const auto& a, const auto& b) {
+    return a.first > b.first;
+  });
+  auto result = json_array();
+  for (size_t i = 0; i < costly.size() && i < kAlarmSubscriptions; ++i) {
+    json_array_append_new(result, std::move(costly[i].second));
+  }
+  return result;
+}
+
+// Captures the diagnostics of the root and the server for a perf alarm
+json_ref capturePerfAlarm(const w_string& rootPath) {
+  auto diagnostics = json_object(
+      {{"subscriptions", getCostlySubscriptions(rootPath)},
+       {"locks", LockProfile::allToJson(false)},
+       {"perf_stats", PerfStats::get().toJson(false)}});
+  // The root may have been unwatched since the sample was taken
+  auto root = w_root_resolve(rootPath.c_str(), false);
+  if (root) {
+    MetricsWriter metrics;
+    root->addMetrics(metrics);
+    auto text = metrics.render();
+    diagnostics.set(
+        {{"metrics",
+          typed_string_to_json(text.data(), text.size(), W_STRING_UNICODE)},
+         {"watcher", root->view()->getWatcherInfo()},
+         {"recrawl", root->getRecrawlInfo()}});
+  }
+  if (Tracing::enabled()) {
+    diagnostics.set("trace", Tracing::toTraceEvents());
+  }
+  return diagnostics;
+}
+
+std::string renderMetrics() {
+  MetricsWriter metrics;
+  addClientMetrics(metrics);
+  addAdmissionMetrics(metrics);
+  addCommandMetrics(metrics);
+  metrics.gauge(
+      "watchman_watched_roots",
+      "Roots that are being watched",
+      json_array_size(w_root_watch_list_to_json()));
+  w_root_add_metrics(metrics);
+  return metrics.render();
+}
+
+void setTimeouts(const FileDescriptor& fd) {
+#ifdef _WIN32
+  DWORD timeout = kTimeoutSeconds * 1000;
+#else
+  struct timeval timeout {};
+  timeout.tv_sec = kTimeoutSeconds;
+#endif
+  for (auto option : {SO_RCVTIMEO, SO_SNDTIMEO}) {
+    ::setsockopt(
+        fd.system_handle(),
+        SOL_SOCKET,
+        option,
+        (char*)&timeout,
+        sizeof(timeout));
+  }
+}
+
+bool writeAll(watchman_stream* stm, const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    auto n = stm->write(data.data() + written, int(data.size() - written));
+    if (n <= 0) {
+      return false;
+    }
+    written += size_t(n);
+  }
+  return true;
+}
+} // namespace
+
+namespace watchman {
+
+void configurePerfAlarms() {
+  PerfAlarms::Options options;
+  auto budgets = cfg_get_json("perf_alarm_budgets_ms");
+  if (budgets && budgets.isObject()) {
+    for (auto& it : budgets.object()) {
+      if (!it.second.isNumber() || json_number_value(it.second) <= 0) {
+        log(ERR,
+            "ignoring perf_alarm_budgets_ms for ",
+            it.first,
+            " because it is not a positive number\n");
+        continue;
+      }
+      options.budgets[std::string(it.first.data(), it.first.size())] =
+          std::chrono::milliseconds(int64_t(json_number_value(it.second)));
+    }
+  }
+  options.minInterval = std::chrono::seconds(
+      cfg_get_int("perf_alarm_min_interval_seconds", 300));
+  options.maxDumps = size_t(std::max(
+      json_int_t(1), cfg_get_int("perf_alarm_max_dumps", 10)));
+  if (!watchman_state_file.empty()) {
+    options.dumpDir =
+        w_string_piece(watchman_state_file).dirName().asWString();
+  }
+  PerfAlarms::get().configure(std::move(options), capturePerfAlarm);
+}
+
+void serveMetricsConnection(FileDescriptor&& fd) {
+  fd.clearNonBlock();
+  setTimeouts(fd);
+  auto stm = w_stm_fdopen(std::move(fd));
+
+  // Only the request line matters, but the rest of the request is read so
+  // that closing the connection doesn't reset it before it is answered
+  std::string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == std::string::npos) {
+    if (request.size() >= kMaxRequestBytes) {
+      return;
+    }
+    auto n = stm->read(buf, sizeof(buf));
+    if (n <= 0) {
+      return;
+    }
+    request.append(buf, size_t(n));
+  }
+
+  auto lineEnd = request.find("\r\n");
+  auto line = request.substr(0, lineEnd);
+  std::string status = "200 OK";
+  std::string body;
+  if (line.compare(0, 4, "GET ") != 0 && line.compare(0, 5, "HEAD ") != 0) {
+    status = "405 Method Not Allowed";
+  } else {
+    auto pathStart = line.find(' ') + 1;
+    auto path = line.substr(pathStart, line.find(' ', pathStart) - pathStart);
+    if (path == "/" || path == "/metrics") {
+      body = renderMetrics();
+    } else {
+      status = "404 Not Found";
+    }
+  }
+
+  auto response = folly::to<std::string>(
+      "HTTP/1.0 ",
+      status,
+      "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ",
+      body.size(),
+      "\r\nConnection: close\r\n\r\n");
+  if (line.compare(0, 4, "GET ") == 0) {
+    response.append(body);
+  }
+  if (!writeAll(stm.get(), response)) {
+    log(DBG, "failed to write the metrics to a scraper\n");
+  }
+}
+
+} // namespace watchman
+
+/* vim:ts=2:sw=2:et:
+ */
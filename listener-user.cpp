@@ -103,6 +103,30 @@ std::shared_ptr<w_root_t> resolveOrCreateRoot(
   return doResolveOrCreateRoot(client, args, true);
 }
 
+void scopeQueryToSharedWatch(const json_ref& args, const json_ref& querySpec) {
+  const char* name = json_string_value(json_array_get(args, 1));
+  if (!name || !querySpec.isObject()) {
+    return;
+  }
+  w_string enclosingPath;
+  w_string relativePath;
+  if (!w_root_find_shared(
+          w_root_canonical_path(name), enclosingPath, relativePath)) {
+    return;
+  }
+
+  auto scoped = relativePath;
+  auto relative_root = querySpec.get_default("relative_root");
+  if (relative_root && relative_root.isString()) {
+    auto path = json_to_w_string(relative_root);
+    if (!path.empty()) {
+      scoped = w_string::pathCat({relativePath, path});
+    }
+  }
+  json_object_set_new_nocheck(
+      querySpec, "relative_root", w_string_to_json(scoped));
+}
+
 watchman_user_client::watchman_user_client(
     std::unique_ptr<watchman_stream>&& stm)
     : watchman_client(std::move(stm)) {}
@@ -5,22 +5,36 @@
 #include <folly/Exception.h>
 #include <folly/MapUtil.h>
 #include <folly/Optional.h>
+#include <folly/ScopeGuard.h>
 #include <folly/SocketAddress.h>
 #include <folly/Synchronized.h>
 #include <folly/net/NetworkSocket.h>
 #include <atomic>
 #include <chrono>
+#include <functional>
 #include <thread>
+#include "ClientReactor.h"
+#include "FairThreadPool.h"
+#include "Probe.h"
 #include "SignalHandler.h"
+#include "ThreadPool.h"
+#include "Tracing.h"
 
 using namespace watchman;
 
-folly::Synchronized<std::unordered_set<std::shared_ptr<watchman_client>>>
-    clients;
+SyncClients clients;
 static FileDescriptor listener_fd;
 static std::vector<std::shared_ptr<watchman_event>> listener_thread_events;
 static std::atomic<bool> stopping = false;
 static constexpr size_t kResponseLogLimit = 8;
+// How often a client that is waited for without the client reactor is
+// retried while there are responses that it has had no room for
+static constexpr int kWriteRetryMs = 50;
+// Whether commands with a command_wait_func are dispatched once what they
+// wait for is done, rather than waiting for it in the thread that runs them
+static bool suspend_waiting_commands = true;
+
+W_CAP_REG("tagged-requests")
 
 bool w_is_stopping(void) {
   return stopping.load(std::memory_order_relaxed);
@@ -34,9 +48,18 @@ json_ref make_response(void) {
   return resp;
 }
 
+void annotate_with_request_tag(watchman_client* client, json_ref& response) {
+  // Unilateral responses that a command sends, such as the initial results
+  // of a subscription, aren't responses to the request
+  if (client->request_tag && !response.get_default("unilateral")) {
+    response.set("tag", json_ref(client->request_tag));
+  }
+}
+
 void send_and_dispose_response(
     struct watchman_client* client,
     json_ref&& response) {
+  annotate_with_request_tag(client, response);
   client->enqueueResponse(std::move(response), false);
 }
 
@@ -49,6 +72,7 @@ void send_error_response(struct watchman_client* client, const char* fmt, ...) {
 
   auto resp = make_response();
   resp.set("error", w_string_to_json(errorText));
+  ++client->errorResponses;
 
   if (client->perf_sample) {
     client->perf_sample->add_meta("error", w_string_to_json(errorText));
@@ -74,27 +98,31 @@ namespace {
 // TODO: If used in a hot loop, EdenFS has a faster implementation.
 // https://github.com/facebookexperimental/eden/blob/c745d644d969dae1e4c0d184c19320fac7c27ae5/eden/fs/utils/IDGen.h
 std::atomic<uint64_t> id_generator{1};
-} // namespace
-
-watchman_client::watchman_client() : watchman_client(nullptr) {}
 
-watchman_client::watchman_client(std::unique_ptr<watchman_stream>&& stm)
-    : unique_id{id_generator++},
-      stm(std::move(stm)),
-      ping(
+std::unique_ptr<watchman_event> make_ping(watchman_stream* stm) {
 #ifdef _WIN32
-          this->stm->getFileDescriptor().fdType() ==
-                  FileDescriptor::FDType::Socket
-              ? w_event_make_sockets()
-              : w_event_make_named_pipe()
+  return stm->getFileDescriptor().fdType() == FileDescriptor::FDType::Socket
+      ? w_event_make_sockets()
+      : w_event_make_named_pipe();
 #else
-          w_event_make_sockets()
+  (void)stm;
+  return w_event_make_sockets();
 #endif
+}
+} // namespace
+
+watchman_client::watchman_client() : watchman_client(nullptr) {}
 
-      ) {
+watchman_client::watchman_client(std::unique_ptr<watchman_stream>&& stm)
+    : watchman_client(std::move(stm), make_ping(stm.get())) {
   logf(DBG, "accepted client:stm={}\n", fmt::ptr(this->stm.get()));
 }
 
+watchman_client::watchman_client(
+    std::unique_ptr<watchman_stream>&& stm,
+    std::unique_ptr<watchman_event>&& ping)
+    : unique_id{id_generator++}, stm(std::move(stm)), ping(std::move(ping)) {}
+
 watchman_client::~watchman_client() {
   debugSub.reset();
   errorSub.reset();
@@ -114,6 +142,99 @@ void watchman_client::enqueueResponse(json_ref&& resp, bool ping) {
   }
 }
 
+bool watchman_client::queueResponses() {
+  while (!responses.empty()) {
+    if (!outgoing.push(pdu_type, capabilities, responses.front())) {
+      log(ERR, "failed to encode a response for client ", unique_id, "\n");
+      return false;
+    }
+    responses.pop_front();
+  }
+  return true;
+}
+
+bool watchman_client::writeResponseNow(json_ref&& resp) {
+  annotate_with_request_tag(this, resp);
+  enqueueResponse(std::move(resp), false);
+  return writeEncodedResponseNow(std::string());
+}
+
+bool watchman_client::writeEncodedResponseNow(const std::string& pdu) {
+  if (!queueResponses()) {
+    return false;
+  }
+  if (!pdu.empty()) {
+    outgoing.pushEncoded(pdu_type, capabilities, pdu);
+  }
+  return outgoing.flush(stm.get()) != ResponseQueue::FlushResult::Failed &&
+      outgoing.drain(stm.get());
+}
+
+pid_t watchman_client::getPeerProcessID() const {
+  return stm ? stm->getPeerProcessID() : 0;
+}
+
+std::function<bool()> watchman_client::hangupProbe() {
+  if (!stm) {
+    return nullptr;
+  }
+  // The client outlives the commands that it runs
+  auto stream = stm.get();
+  return [stream] { return stream->peerHasClosed(); };
+}
+
+watchman_request_client::watchman_request_client(
+    std::shared_ptr<watchman_user_client> parent,
+    json_ref request_tag)
+    : watchman_client(nullptr, nullptr), parent(std::move(parent)) {
+  this->request_tag = std::move(request_tag);
+  pdu_type = this->parent->pdu_type;
+  capabilities = this->parent->capabilities;
+  client_is_owner = this->parent->client_is_owner;
+}
+
+void watchman_request_client::run(const json_ref& command) {
+  dispatch_command(this, command, CMD_DAEMON);
+  handOffResponses();
+  parent->ping->notify();
+}
+
+bool watchman_request_client::writeResponseNow(json_ref&& resp) {
+  annotate_with_request_tag(this, resp);
+  enqueueResponse(std::move(resp), false);
+  handOffResponses();
+  parent->ping->notify();
+  return true;
+}
+
+bool watchman_request_client::writeEncodedResponseNow(const std::string& pdu) {
+  handOffResponses();
+  parent->concurrentResponses.wlock()->push_back(
+      watchman_user_client::ConcurrentResponse{json_ref(), pdu});
+  parent->ping->notify();
+  return true;
+}
+
+pid_t watchman_request_client::getPeerProcessID() const {
+  return parent->getPeerProcessID();
+}
+
+std::function<bool()> watchman_request_client::hangupProbe() {
+  return parent->hangupProbe();
+}
+
+void watchman_request_client::handOffResponses() {
+  if (responses.empty()) {
+    return;
+  }
+  auto queue = parent->concurrentResponses.wlock();
+  for (auto& response : responses) {
+    queue->push_back(watchman_user_client::ConcurrentResponse{
+        std::move(response), std::string()});
+  }
+  responses.clear();
+}
+
 void w_request_shutdown(void) {
   stopping.store(true, std::memory_order_relaxed);
   // Knock listener thread out of poll/accept
@@ -122,204 +243,592 @@ void w_request_shutdown(void) {
   }
 }
 
-// The client thread reads and decodes json packets,
-// then dispatches the commands that it finds
-static void client_thread(
-    std::shared_ptr<watchman_user_client> client) noexcept {
-  // Keep a persistent vector around so that we can avoid allocating
-  // and releasing heap memory when we collect items from the publisher
-  std::vector<std::shared_ptr<const watchman::Publisher::Item>> pending;
+// Runs the commands of tagged requests, concurrently with the clients'
+// other requests
+static ThreadPool& request_thread_pool() {
+  static ThreadPool pool;
+  return pool;
+}
 
-  client->stm->setNonBlock(true);
-  w_set_thread_name(
-      "client=",
-      client->unique_id,
-      ":stm=",
-      uintptr_t(client->stm.get()),
-      ":pid=",
-      client->stm->getPeerProcessID());
+// Runs the command of a tagged request on the request thread pool, or here
+// if the pool is stopping or backlogged
+static void run_request(
+    const std::shared_ptr<watchman_request_client>& request_client,
+    const json_ref& command) {
+  try {
+    request_thread_pool().add([request_client, command] {
+      request_client->run(command);
+    });
+  } catch (const std::exception& exc) {
+    logf(ERR, "running request in place: {}\n", exc.what());
+    request_client->run(command);
+  }
+}
 
-  client->client_is_owner = client->stm->peerIsOwner();
+// Dispatches command, from a request tagged with tag if it isn't null, in
+// the thread that serves the client, once its wait, if it has one, is over
+static void dispatch_waited_command(
+    const std::shared_ptr<watchman_user_client>& client,
+    const json_ref& command,
+    const json_ref& tag,
+    folly::Optional<folly::Try<folly::Unit>>&& waited) {
+  client->commandWait = std::move(waited);
+  client->request_tag = tag;
+  SCOPE_EXIT {
+    client->request_tag = nullptr;
+    client->commandWait.reset();
+  };
+  dispatch_command(client.get(), command, CMD_DAEMON);
+}
 
-  struct watchman_event_poll pfd[2];
-  pfd[0].evt = client->stm->getEvents();
-  pfd[1].evt = client->ping.get();
+// As dispatch_waited_command, except that if the command has a wait to do
+// first, the client is suspended until it has been done instead, and
+// resume_suspended_request dispatches it
+static void dispatch_in_client_thread(
+    const std::shared_ptr<watchman_user_client>& client,
+    const json_ref& command,
+    const json_ref& tag) {
+  auto wait = suspend_waiting_commands
+      ? start_command_wait(client.get(), command, CMD_DAEMON)
+      : folly::none;
+  if (!wait) {
+    dispatch_waited_command(client, command, tag, folly::none);
+    return;
+  }
+  if (wait->isReady()) {
+    dispatch_waited_command(client, command, tag, std::move(wait->result()));
+    return;
+  }
 
-  bool client_alive = true;
-  while (!w_is_stopping() && client_alive) {
-    // Wait for input from either the client socket or
-    // via the ping pipe, which signals that some other
-    // thread wants to unilaterally send data to the client
+  client->suspended = watchman_user_client::SuspendedRequest{command, tag};
+  std::weak_ptr<watchman_user_client> clientRef(client);
+  std::move(*wait).thenTry([clientRef](folly::Try<folly::Unit>&& result) {
+    if (auto client = clientRef.lock()) {
+      *client->suspendedWait.wlock() = std::move(result);
+      client->ping->notify();
+    }
+  });
+}
 
-    ignore_result(w_poll_events(pfd, 2, 2000));
-    if (w_is_stopping()) {
-      break;
+// Dispatches the suspended request of the client if its wait is over.
+// Returns false if it is still waiting.
+static bool resume_suspended_request(
+    const std::shared_ptr<watchman_user_client>& client) {
+  folly::Optional<folly::Try<folly::Unit>> result;
+  client->suspendedWait.wlock()->swap(result);
+  if (!result) {
+    return false;
+  }
+  auto request = std::move(*client->suspended);
+  client->suspended.reset();
+  dispatch_waited_command(
+      client, request.command, request.tag, std::move(result));
+  return true;
+}
+
+// Dispatches a request, which is either a command or, from a client that
+// tags its requests, an object that holds the command and its tag
+static void dispatch_request(
+    const std::shared_ptr<watchman_user_client>& client,
+    const json_ref& request) {
+  if (!request.isObject()) {
+    dispatch_in_client_thread(client, request, nullptr);
+    return;
+  }
+
+  auto tag = request.get_default("tag");
+  auto command = request.get_default("command");
+  if (!tag || !(tag.isInt() || tag.isString()) || !command) {
+    send_error_response(
+        client.get(),
+        "expected a request to be a command, or an object with an integer "
+        "or string tag and a command");
+    return;
+  }
+
+  if (is_concurrent_command(command, CMD_DAEMON)) {
+    auto request_client =
+        std::make_shared<watchman_request_client>(client, tag);
+    try {
+      auto wait = suspend_waiting_commands
+          ? start_command_wait(request_client.get(), command, CMD_DAEMON)
+          : folly::none;
+      if (wait) {
+        // Nothing holds a thread until what it waits for is done
+        std::move(*wait).thenTry(
+            [request_client, command](folly::Try<folly::Unit>&& result) {
+              request_client->commandWait = std::move(result);
+              run_request(request_client, command);
+            });
+        return;
+      }
+      request_thread_pool().add([request_client, command] {
+        request_client->run(command);
+      });
+      return;
+    } catch (const std::exception& exc) {
+      // The pool is stopping or backlogged, so run it here instead
+      logf(ERR, "running request in the client thread: {}\n", exc.what());
     }
+  }
+
+  dispatch_in_client_thread(client, command, tag);
+}
+
+namespace {
+enum class ClientStatus {
+  Disconnected,
+  // Waiting for more input, or for a ping
+  Waiting,
+  // More input was read along with the last request
+  HasInput,
+  // Waiting for more input, for a ping, or for room to write the
+  // responses that are queued for the client
+  Writing,
+  // Waiting for a ping or for room to write the responses that are queued
+  // for the client.  It is too far behind in reading them for us to read
+  // its next request.
+  Backlogged,
+  // Waiting for a ping, or for room to write the responses that are
+  // queued for the client, while the command of its last request waits
+  // to be dispatched.  Its next request isn't read until then.
+  Suspended,
+};
+} // namespace
+
+// Answers a probe as soon as it has been read, ahead of anything that would
+// normally happen to a request; see Probe.h.  Returns false if the client
+// has gone away.
+static bool answer_probe(
+    watchman_user_client* client,
+    const ProbeRequest& probe) {
+  ProbeResponse response;
+  auto lineage = ClockLineage::forPosition(ClockPosition());
+  response.startTime = lineage.startTime;
+  response.pid = uint32_t(lineage.pid);
+  switch (probe.op) {
+    case ProbeOp::Liveness:
+      break;
+    case ProbeOp::Clock:
+      if (!w_root_probe_clock(probe.rootNumber, response.position)) {
+        response.status = ProbeStatus::UnknownRoot;
+      }
+      break;
+    default:
+      response.status = ProbeStatus::BadRequest;
+  }
 
-    if (pfd[0].ready) {
-      json_error_t jerr;
-      auto request = client->reader.decodeNext(client->stm.get(), &jerr);
+  // Behind the responses to the requests that came before it
+  if (!client->queueResponses()) {
+    return false;
+  }
+  char encoded[kProbeResponseSize];
+  encodeProbeResponse(response, encoded);
+  client->outgoing.pushBytes(encoded, sizeof(encoded));
+  return true;
+}
+
+// Reads and dispatches the next request of the client if readable is set,
+// then sends whatever has been queued up for it, including the responses
+// to the request and anything that it has been pinged about
+static ClientStatus serve_client_once(
+    const std::shared_ptr<watchman_user_client>& client,
+    bool readable) {
+  // Keep a persistent vector around so that we can avoid allocating
+  // and releasing heap memory when we collect items from the publisher
+  static thread_local std::vector<
+      std::shared_ptr<const watchman::Publisher::Item>>
+      pending;
+  bool dispatched = false;
+
+  if (client->suspended) {
+    dispatched = resume_suspended_request(client);
+    readable = false;
+  }
 
-      if (!request && errno == EAGAIN) {
-        // That's fine
-      } else if (!request) {
-        // Not so cool
-        if (client->reader.wpos == client->reader.rpos) {
-          // If they disconnected in between PDUs, no need to log
-          // any error
-          goto disconnected;
+  ProbeRequest probe;
+  if (readable && !client->outgoing.full() &&
+      client->reader.readProbe(client->stm.get(), probe)) {
+    if (!answer_probe(client.get(), probe)) {
+      return ClientStatus::Disconnected;
+    }
+    dispatched = true;
+  } else if (readable && !client->outgoing.full()) {
+    json_error_t jerr;
+    auto request = client->reader.decodeNext(client->stm.get(), &jerr);
+
+    if (!request && errno == EAGAIN) {
+      // That's fine
+    } else if (!request) {
+      // Not so cool
+      if (client->reader.wpos == client->reader.rpos) {
+        // If they disconnected in between PDUs, no need to log
+        // any error
+        return ClientStatus::Disconnected;
+      }
+      send_error_response(
+          client.get(),
+          "invalid json at position %d: %s",
+          jerr.position,
+          jerr.text);
+      logf(ERR, "invalid data from client: {}\n", jerr.text);
+
+      return ClientStatus::Disconnected;
+    } else if (request) {
+      client->pdu_type = client->reader.pdu_type;
+      client->capabilities = client->reader.capabilities;
+      dispatch_request(client, request);
+      dispatched = true;
+    }
+  }
+
+  while (client->ping->testAndClear()) {
+    // Pick up what requests that were run on worker threads have sent.
+    // An encoded pdu is written straight away, after what was queued
+    // ahead of it.
+    std::deque<watchman_user_client::ConcurrentResponse> concurrent;
+    client->concurrentResponses.wlock()->swap(concurrent);
+    for (auto& item : concurrent) {
+      if (item.response) {
+        client->enqueueResponse(std::move(item.response), false);
+      } else {
+        if (!client->queueResponses()) {
+          return ClientStatus::Disconnected;
         }
-        send_error_response(
-            client.get(),
-            "invalid json at position %d: %s",
-            jerr.position,
-            jerr.text);
-        logf(ERR, "invalid data from client: {}\n", jerr.text);
-
-        goto disconnected;
-      } else if (request) {
-        client->pdu_type = client->reader.pdu_type;
-        client->capabilities = client->reader.capabilities;
-        dispatch_command(client.get(), request, CMD_DAEMON);
+        client->outgoing.pushEncoded(
+            client->pdu_type, client->capabilities, item.pdu);
+      }
+    }
+
+    // Enqueue refs to pending log payloads, unless the client is too far
+    // behind to take them
+    pending.clear();
+    getPending(pending, client->debugSub, client->errorSub);
+    for (auto& item : pending) {
+      if (client->outgoing.full()) {
+        client->outgoing.noteDropped();
+        continue;
       }
+      client->enqueueResponse(json_ref(item->payload), false);
     }
 
-    if (pfd[1].ready) {
-      while (client->ping->testAndClear()) {
-        // Enqueue refs to pending log payloads
-        pending.clear();
-        getPending(pending, client->debugSub, client->errorSub);
-        for (auto& item : pending) {
-          client->enqueueResponse(json_ref(item->payload), false);
+    // Maybe we have subscriptions to dispatch?
+    std::vector<w_string> subsToDelete;
+    for (auto& subiter : client->unilateralSub) {
+      auto sub = subiter.first;
+      auto subStream = subiter.second;
+
+      watchman::log(watchman::DBG, "consider fan out sub ", sub->name, "\n");
+
+      pending.clear();
+      subStream->getPending(pending);
+      bool seenSettle = false;
+      for (auto& item : pending) {
+        if (watchman::isLogEnabled(watchman::DBG)) {
+          watchman::log(
+              watchman::DBG,
+              "Unilateral payload for sub ",
+              sub->name,
+              " ",
+              json_dumps(item->payload, 0),
+              "\n");
+        }
+
+        if (item->payload.get_default("canceled")) {
+          watchman::log(
+              watchman::ERR,
+              "Cancel subscription ",
+              sub->name,
+              " due to root cancellation\n");
+
+          auto resp = make_response();
+          resp.set({{"root", w_string_to_json(sub->rootPath)},
+                    {"unilateral", json_true()},
+                    {"canceled", json_true()},
+                    {"subscription", w_string_to_json(sub->name)}});
+          client->enqueueResponse(std::move(resp), false);
+          // Remember to cancel this subscription.
+          // We can't do it in this loop because that would
+          // invalidate the iterators and cause a headache.
+          subsToDelete.push_back(sub->name);
+          continue;
         }
 
-        // Maybe we have subscriptions to dispatch?
-        std::vector<w_string> subsToDelete;
-        for (auto& subiter : client->unilateralSub) {
-          auto sub = subiter.first;
-          auto subStream = subiter.second;
+        if (item->payload.get_default("state-enter") ||
+            item->payload.get_default("state-leave")) {
+          auto resp = make_response();
+          json_object_update(item->payload, resp);
+          // We have the opportunity to populate additional response
+          // fields here (since we don't want to block the command).
+          // We don't populate the fat clock for SCM aware queries
+          // because determination of mergeBase could add latency.
+          resp.set({{"root", w_string_to_json(sub->rootPath)},
+                    {"unilateral", json_true()},
+                    {"subscription", w_string_to_json(sub->name)}});
+          sub->sendNotification(client.get(), std::move(resp));
 
           watchman::log(
-              watchman::DBG, "consider fan out sub ", sub->name, "\n");
-
-          pending.clear();
-          subStream->getPending(pending);
-          bool seenSettle = false;
-          for (auto& item : pending) {
-            auto dumped = json_dumps(item->payload, 0);
-            watchman::log(
-                watchman::DBG,
-                "Unilateral payload for sub ",
-                sub->name,
-                " ",
-                dumped,
-                "\n");
-
-            if (item->payload.get_default("canceled")) {
-              watchman::log(
-                  watchman::ERR,
-                  "Cancel subscription ",
-                  sub->name,
-                  " due to root cancellation\n");
-
-              auto resp = make_response();
-              resp.set({{"root", item->payload.get_default("root")},
-                        {"unilateral", json_true()},
-                        {"canceled", json_true()},
-                        {"subscription", w_string_to_json(sub->name)}});
-              client->enqueueResponse(std::move(resp), false);
-              // Remember to cancel this subscription.
-              // We can't do it in this loop because that would
-              // invalidate the iterators and cause a headache.
-              subsToDelete.push_back(sub->name);
-              continue;
-            }
-
-            if (item->payload.get_default("state-enter") ||
-                item->payload.get_default("state-leave")) {
-              auto resp = make_response();
-              json_object_update(item->payload, resp);
-              // We have the opportunity to populate additional response
-              // fields here (since we don't want to block the command).
-              // We don't populate the fat clock for SCM aware queries
-              // because determination of mergeBase could add latency.
-              resp.set({{"unilateral", json_true()},
-                        {"subscription", w_string_to_json(sub->name)}});
-              client->enqueueResponse(std::move(resp), false);
-
-              watchman::log(
-                  watchman::DBG,
-                  "Fan out subscription state change for ",
-                  sub->name,
-                  "\n");
-              continue;
-            }
-
-            if (!sub->debug_paused && item->payload.get_default("settled")) {
-              seenSettle = true;
-              continue;
-            }
-          }
-
-          if (seenSettle) {
-            sub->processSubscription();
-          }
+              watchman::DBG,
+              "Fan out subscription state change for ",
+              sub->name,
+              "\n");
+          continue;
         }
 
-        for (auto& name : subsToDelete) {
-          client->unsubByName(name);
+        if (!sub->debug_paused && item->payload.get_default("settled")) {
+          seenSettle = true;
+          continue;
         }
       }
+
+      if (seenSettle) {
+        sub->noteSettle(std::chrono::steady_clock::now());
+      }
     }
 
-    /* now send our response(s) */
-    while (!client->responses.empty() && client_alive) {
-      auto& response_to_send = client->responses.front();
-
-      client->stm->setNonBlock(false);
-      /* Return the data in the same format that was used to ask for it.
-       * Update client liveness based on send success.
-       */
-      client_alive = client->writer.pduEncodeToStream(
-          client->pdu_type,
-          client->capabilities,
-          response_to_send,
-          client->stm.get());
-      client->stm->setNonBlock(true);
-
-      json_ref subscriptionValue = response_to_send.get_default("subscription");
-      if (subscriptionValue && subscriptionValue.isString() &&
-          json_string_value(subscriptionValue)) {
-        auto subscriptionName = json_to_w_string(subscriptionValue);
-        if (auto* sub =
-                folly::get_ptr(client->subscriptions, subscriptionName)) {
-          if ((*sub)->lastResponses.size() >= kResponseLogLimit) {
-            (*sub)->lastResponses.pop_front();
-          }
-          (*sub)->lastResponses.push_back(
-              watchman_client_subscription::LoggedResponse{
-                  std::chrono::system_clock::now(), response_to_send});
-        }
+    for (auto& name : subsToDelete) {
+      client->unsubByName(name);
+    }
+  }
+
+  // Collect the results of the subscriptions that have been evaluated,
+  // dispatch those whose settles are due, which may be on account of an
+  // earlier ping, and note when the rest will be
+  client->nextDispatch.reset();
+  auto now = std::chrono::steady_clock::now();
+  for (auto& subiter : client->unilateralSub) {
+    subiter.first->collectResults(client.get());
+    auto due = subiter.first->dispatchIfDue(now);
+    if (due && (!client->nextDispatch || *due < *client->nextDispatch)) {
+      client->nextDispatch = due;
+    }
+  }
+
+  /* now send our response(s) */
+  if (!client->queueResponses() ||
+      client->outgoing.flush(client->stm.get()) ==
+          ResponseQueue::FlushResult::Failed) {
+    return ClientStatus::Disconnected;
+  }
+
+  if (client->outgoing.full()) {
+    return ClientStatus::Backlogged;
+  }
+  if (client->suspended) {
+    return ClientStatus::Suspended;
+  }
+  if (dispatched && client->reader.wpos != client->reader.rpos) {
+    return ClientStatus::HasInput;
+  }
+  if (!client->outgoing.empty()) {
+    return ClientStatus::Writing;
+  }
+  return ClientStatus::Waiting;
+}
+
+bool watchman_user_client::queueResponses() {
+  while (!responses.empty()) {
+    auto response = std::move(responses.front());
+    responses.pop_front();
+
+    std::shared_ptr<watchman_client_subscription> sub;
+    json_ref subscriptionValue = response.get_default("subscription");
+    if (subscriptionValue && subscriptionValue.isString() &&
+        json_string_value(subscriptionValue)) {
+      auto subscriptionName = json_to_w_string(subscriptionValue);
+      if (auto* found = folly::get_ptr(subscriptions, subscriptionName)) {
+        sub = *found;
       }
+    }
+
+    // Only the results of a subscription are held back from a client that
+    // is behind; its other notifications, such as state-enter, are always
+    // delivered
+    bool isResults = sub && response.get_default("files");
+    if (isResults && outgoing.full()) {
+      if (sub->overflowPolicy ==
+          watchman_client_subscription::OverflowPolicy::Drop) {
+        sub->droppedResults++;
+        outgoing.noteDropped();
+        log(DBG, "client is behind; dropped results of ", sub->name, "\n");
+        continue;
+      }
+
+      auto removed = outgoing.removeResults(sub->name);
+      sub->coalescedResults += removed + 1;
+      log(DBG,
+          "client is behind; coalesced ",
+          removed + 1,
+          " results of ",
+          sub->name,
+          "\n");
+      auto notice = make_response();
+      notice.set({{"root", response.get_default("root")},
+                  {"subscription", w_string_to_json(sub->name)},
+                  {"unilateral", json_true()},
+                  {"clock", response.get_default("clock")},
+                  {"is_fresh_instance", json_true()},
+                  {"overflowed", json_true()},
+                  {"files", json_array()}});
+      response = std::move(notice);
+    }
 
-      client->responses.pop_front();
+    auto encodeStart = std::chrono::steady_clock::now();
+    if (!outgoing.push(
+            pdu_type,
+            capabilities,
+            response,
+            isResults ? sub->name : w_string())) {
+      log(ERR, "failed to encode a response for client ", unique_id, "\n");
+      return false;
+    }
+
+    if (isResults) {
+      sub->encodeUs.record(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::steady_clock::now() - encodeStart)
+              .count());
+      sub->encodedBytes.record(outgoing.lastEncodedBytes());
+    }
+
+    if (sub) {
+      if (sub->lastResponses.size() >= kResponseLogLimit) {
+        sub->lastResponses.pop_front();
+      }
+      sub->lastResponses.push_back(watchman_client_subscription::LoggedResponse{
+          std::chrono::system_clock::now(),
+          response,
+          outgoing.lastEncodedBytes()});
     }
   }
+  return true;
+}
 
-disconnected:
+static void set_client_thread_name(
+    const char* prefix,
+    const std::shared_ptr<watchman_user_client>& client) {
   w_set_thread_name(
-      "NOT_CONN:client=",
+      prefix,
+      "client=",
       client->unique_id,
       ":stm=",
       uintptr_t(client->stm.get()),
       ":pid=",
       client->stm->getPeerProcessID());
+}
+
+// How long until the subscriptions of client that are being held back
+// are due to be dispatched, or zero if there are none
+static std::chrono::milliseconds time_to_next_dispatch(
+    const watchman_user_client& client) {
+  if (!client.nextDispatch) {
+    return std::chrono::milliseconds(0);
+  }
+  return std::max(
+      std::chrono::ceil<std::chrono::milliseconds>(
+          *client.nextDispatch - std::chrono::steady_clock::now()),
+      std::chrono::milliseconds(1));
+}
+
+static void client_disconnected(
+    const std::shared_ptr<watchman_user_client>& client) {
+  set_client_thread_name("NOT_CONN:", client);
   // Remove the client from the map before we tear it down, as this makes
   // it easier to flush out pending writes on windows without worrying
   // about w_log_to_clients contending for the write buffers
   clients.wlock()->erase(client);
 }
 
+// The client thread reads and decodes json packets,
+// then dispatches the commands that it finds.  It is used where the
+// client can't be waited for by the client reactor.
+static void client_thread(
+    std::shared_ptr<watchman_user_client> client) noexcept {
+  set_client_thread_name("", client);
+
+  struct watchman_event_poll pfd[2];
+  pfd[0].evt = client->stm->getEvents();
+  pfd[1].evt = client->ping.get();
+
+  auto status = ClientStatus::Waiting;
+  while (!w_is_stopping() && status != ClientStatus::Disconnected) {
+    // Wait for input from either the client socket or
+    // via the ping pipe, which signals that some other
+    // thread wants to unilaterally send data to the client.
+    // Input that has already been read doesn't need to be waited for.
+    // Room to write can't be waited for here, so a client that has
+    // responses queued up is retried every so often; one that is
+    // backlogged isn't read from until it has caught up, nor is one whose
+    // command is waiting to be dispatched.
+    // An idle client sleeps until one of those is signalled, or a
+    // subscription is due to be dispatched; shutting down pings it.
+    pfd[0].ready = false;
+    if (status == ClientStatus::Backlogged) {
+      ignore_result(w_poll_events(&pfd[1], 1, kWriteRetryMs));
+    } else {
+      int timeoutms = -1;
+      if (status == ClientStatus::HasInput) {
+        timeoutms = 0;
+      } else if (!client->outgoing.empty()) {
+        timeoutms = kWriteRetryMs;
+      }
+      auto dispatchIn = time_to_next_dispatch(*client);
+      if (dispatchIn.count() > 0 &&
+          (timeoutms < 0 || dispatchIn.count() < timeoutms)) {
+        timeoutms = int(dispatchIn.count());
+      }
+      if (status == ClientStatus::Suspended) {
+        ignore_result(w_poll_events(&pfd[1], 1, timeoutms));
+      } else {
+        ignore_result(w_poll_events(pfd, 2, timeoutms));
+      }
+    }
+    if (w_is_stopping()) {
+      break;
+    }
+
+    status = serve_client_once(
+        client, pfd[0].ready || status == ClientStatus::HasInput);
+  }
+
+  client_disconnected(client);
+}
+
+static std::unique_ptr<ClientReactor> client_reactor;
+
+// Serves a client of the client reactor until it has to wait again
+static ClientReactor::Next serve_reactor_client(
+    const std::shared_ptr<watchman_user_client>& client,
+    bool readable) {
+  set_client_thread_name("", client);
+  auto status = ClientStatus::Waiting;
+  do {
+    if (w_is_stopping()) {
+      status = ClientStatus::Disconnected;
+      break;
+    }
+    status = serve_client_once(client, readable);
+    readable = true;
+  } while (status == ClientStatus::HasInput);
+
+  auto dispatchIn = time_to_next_dispatch(*client);
+  switch (status) {
+    case ClientStatus::Disconnected:
+      client_disconnected(client);
+      return {ClientReactor::Wait::Disconnected};
+    case ClientStatus::Writing:
+      return {ClientReactor::Wait::InputOrOutput, dispatchIn};
+    case ClientStatus::Backlogged:
+      return {ClientReactor::Wait::Output, dispatchIn};
+    case ClientStatus::Suspended:
+      return {client->outgoing.empty() ? ClientReactor::Wait::Ping
+                                       : ClientReactor::Wait::Output,
+              dispatchIn};
+    default:
+      return {ClientReactor::Wait::Input, dispatchIn};
+  }
+}
+
 // This is just a placeholder.
 // This catches SIGUSR1 so we don't terminate.
 // We use this to interrupt blocking syscalls
@@ -357,12 +866,22 @@ void w_listener_prep_inetd() {
 
 #endif
 
-static FileDescriptor get_listener_tcp_socket() {
+// The length of the queue of connections that are waiting to be accepted.
+// The system quietly caps this at its own limit, such as
+// net.core.somaxconn on Linux.
+static int listen_backlog() {
+  return int(std::max(cfg_get_int("listen_backlog", 1024), json_int_t(1)));
+}
+
+// Binds to the address in the named configuration option, which is in
+// <address>:<port> form
+static FileDescriptor get_listener_tcp_socket(
+    const char* addressOption,
+    const char* what) {
   FileDescriptor listener_fd;
 
   folly::SocketAddress addr;
-  addr.setFromHostPort(
-      Configuration().getString("tcp-listener-address", nullptr));
+  addr.setFromHostPort(Configuration().getString(addressOption, nullptr));
 
   listener_fd = FileDescriptor(
       ::socket(addr.getFamily(), SOCK_STREAM, 0),
@@ -394,13 +913,13 @@ static FileDescriptor get_listener_tcp_socket() {
       "failed");
 
   folly::checkUnixError(
-      ::listen(listener_fd.system_handle(), 200),
+      ::listen(listener_fd.system_handle(), listen_backlog()),
       "listen on ",
       addr.getAddressStr(),
       "failed");
 
   addr.setFromLocalAddress(folly::NetworkSocket(listener_fd.system_handle()));
-  log(ERR, "Started TCP listener on ", addr.describe(), "\n");
+  log(ERR, "Started ", what, " on ", addr.describe(), "\n");
 
   return listener_fd;
 }
@@ -490,7 +1009,7 @@ static FileDescriptor get_listener_unix_domain_socket(const char* path) {
   }
 #endif
 
-  if (::listen(listener_fd.system_handle(), 200) != 0) {
+  if (::listen(listener_fd.system_handle(), listen_backlog()) != 0) {
     logf(ERR, "listen({}): {}\n", path, strerror(errno));
     return FileDescriptor();
   }
@@ -502,13 +1021,42 @@ static std::shared_ptr<watchman_client> make_new_client(
     std::unique_ptr<watchman_stream>&& stm) {
   auto client = std::make_shared<watchman_user_client>(std::move(stm));
 
+  client->stm->setNonBlock(true);
+  client->client_is_owner = client->stm->peerIsOwner();
+
   clients.wlock()->insert(client);
 
-  // Start a thread for the client.
-  // We used to use libevent for this, but we have
-  // a low volume of concurrent clients and the json
-  // parse/encode APIs are not easily used in a non-blocking
-  // server architecture.
+#ifndef _WIN32
+  if (client_reactor &&
+      client->stm->getFileDescriptor().fdType() ==
+          FileDescriptor::FDType::Socket) {
+    // Idle clients are waited for by the reactor, and only use a thread
+    // while they are being served.  The json parse/encode APIs are not
+    // easily used in a non-blocking way, so a request is read and
+    // dispatched by a worker that blocks until it is complete.
+    client_reactor->add(
+        client->stm->getEvents()->system_handle(),
+        client->ping->system_handle(),
+        [client](bool readable) {
+          return serve_reactor_client(client, readable);
+        });
+    return client;
+  }
+#else
+  if (client_reactor &&
+      client_reactor->addPipe(
+          client->stm.get(),
+          client->ping.get(),
+          [client](bool readable) {
+            return serve_reactor_client(client, readable);
+          })) {
+    // The reads and writes of the pipe complete on the reactor's
+    // completion port, rather than in the client's own thread
+    return client;
+  }
+#endif
+
+  // Start a thread for the client
   try {
     std::thread thr([client] { client_thread(client); });
 
@@ -615,6 +1163,22 @@ static void named_pipe_accept_loop() {
 
   listener_thread_events.push_back(listener_event);
 
+  if (client_reactor) {
+    auto path = get_named_pipe_sock_path();
+    if (client_reactor->listenPipe(
+            cfg_get_int("win32_concurrent_accepts", 32),
+            [path] { return create_pipe_server(path.c_str()); },
+            [](FileDescriptor&& client_fd) {
+              make_new_client(w_stm_fdopen(std::move(client_fd)));
+            })) {
+      logf(ERR, "waiting for pipe clients on {}\n", path);
+      while (!w_is_stopping()) {
+        WaitForSingleObject((HANDLE)listener_event->system_handle(), INFINITE);
+      }
+      return;
+    }
+  }
+
   for (json_int_t i = 0; i < cfg_get_int("win32_concurrent_accepts", 32); ++i) {
     acceptors.push_back(std::thread([i, listener_event]() {
       w_set_thread_name("accept", i);
@@ -628,81 +1192,112 @@ static void named_pipe_accept_loop() {
 #endif
 
 /** A helper for owning and running a socket-style (rather than
- * named pipe style) accept loop that runs in another thread.
+ * named pipe style) accept loop that runs in other threads.
  */
 class AcceptLoop {
-  std::thread thread_;
-  bool joined_{false};
+ public:
+  // Takes ownership of an accepted connection
+  using Handler = std::function<void(FileDescriptor&&)>;
+
+ private:
+  // The most connections that an acceptor takes in one go before it
+  // polls again, so that it notices when we are stopping
+  static constexpr size_t kMaxAcceptBatch = 64;
+
+  std::vector<std::thread> threads_;
+
+  static FileDescriptor accept_one(watchman_stream& listener) {
+#ifdef HAVE_ACCEPT4
+    return FileDescriptor(
+        accept4(
+            listener.getFileDescriptor().system_handle(),
+            nullptr,
+            0,
+            SOCK_CLOEXEC),
+        FileDescriptor::FDType::Socket);
+#else
+    return FileDescriptor(
+        ::accept(listener.getFileDescriptor().system_handle(), nullptr, 0),
+        FileDescriptor::FDType::Socket);
+#endif
+  }
 
   static void accept_thread(
-      FileDescriptor&& listenerDescriptor,
-      std::shared_ptr<watchman_event> listener_event) {
-    auto listener = w_stm_fdopen(std::move(listenerDescriptor));
+      std::shared_ptr<watchman_stream> listener,
+      std::shared_ptr<watchman_event> listener_event,
+      const Handler& handler) {
     while (!w_is_stopping()) {
-      FileDescriptor client_fd;
       struct watchman_event_poll pfd[2];
-      int bufsize;
 
       pfd[0].evt = listener->getEvents();
       pfd[1].evt = listener_event.get();
 
-      if (w_poll_events(pfd, 2, 60000) == 0) {
+      // Stopping signals listener_event, so there is no need to wake up
+      // to check for it
+      if (w_poll_events(pfd, 2, -1) <= 0) {
         if (w_is_stopping()) {
           break;
         }
-        // Timed out, or error.
+        // Interrupted, or error.
         continue;
       }
 
-      if (w_is_stopping()) {
-        break;
-      }
-
-#ifdef HAVE_ACCEPT4
-      client_fd = FileDescriptor(
-          accept4(
-              listener->getFileDescriptor().system_handle(),
-              nullptr,
-              0,
-              SOCK_CLOEXEC),
-          FileDescriptor::FDType::Socket);
-#else
-      client_fd = FileDescriptor(
-          ::accept(listener->getFileDescriptor().system_handle(), nullptr, 0),
-          FileDescriptor::FDType::Socket);
-#endif
-      if (!client_fd) {
-        continue;
+      // The listener is non-blocking, so we take the connections that are
+      // waiting until there are no more, rather than polling again for
+      // each of them.  When there are several acceptors, one of the
+      // others may have taken them first.
+      for (size_t i = 0; i < kMaxAcceptBatch && !w_is_stopping(); ++i) {
+        auto client_fd = accept_one(*listener);
+        if (!client_fd) {
+          break;
+        }
+        client_fd.setCloExec();
+        int bufsize = WATCHMAN_IO_BUF_SIZE;
+        ::setsockopt(
+            client_fd.system_handle(),
+            SOL_SOCKET,
+            SO_SNDBUF,
+            (char*)&bufsize,
+            sizeof(bufsize));
+
+        handler(std::move(client_fd));
       }
-      client_fd.setCloExec();
-      bufsize = WATCHMAN_IO_BUF_SIZE;
-      ::setsockopt(
-          client_fd.system_handle(),
-          SOL_SOCKET,
-          SO_SNDBUF,
-          (char*)&bufsize,
-          sizeof(bufsize));
-
-      make_new_client(w_stm_fdopen(std::move(client_fd)));
     }
   }
 
  public:
-  /** Start an accept loop thread using the provided socket
+  // Serves an accepted connection as a watchman client
+  static void serve_client(FileDescriptor&& client_fd) {
+    make_new_client(w_stm_fdopen(std::move(client_fd)));
+  }
+
+  /** Start `acceptors` accept loop threads using the provided socket
    * descriptor (`fd`).  The `name` parameter is used to name the
-   * thread */
-  AcceptLoop(std::string name, FileDescriptor&& fd) {
+   * threads.  Each accepted connection is passed to `handler`, which
+   * by default serves it as a watchman client. */
+  AcceptLoop(
+      std::string name,
+      FileDescriptor&& fd,
+      Handler handler = serve_client,
+      size_t acceptors = 1) {
     fd.setCloExec();
     fd.setNonBlock();
+    std::shared_ptr<watchman_stream> listener = w_stm_fdopen(std::move(fd));
 
+    // Notified when we are stopping, which wakes all of the acceptors
     std::shared_ptr<watchman_event> listener_event(w_event_make_sockets());
     listener_thread_events.push_back(listener_event);
 
-    thread_ = std::thread(
-        [listener_fd = std::move(fd), name, listener_event]() mutable {
+    for (size_t i = 0; i < std::max(acceptors, size_t(1)); ++i) {
+      threads_.emplace_back([listener, name, i, listener_event, handler]() {
+        if (i == 0) {
           w_set_thread_name(name);
-          accept_thread(std::move(listener_fd), listener_event);
-        });
+        } else {
+          w_set_thread_name(name, "-", i);
+        }
+        accept_thread(listener, listener_event, handler);
+      });
+    }
   }
 
   AcceptLoop(const AcceptLoop&) = delete;
@@ -713,13 +1308,9 @@ class AcceptLoop {
   }
 
   AcceptLoop& operator=(AcceptLoop&& other) {
-    thread_ = std::move(other.thread_);
-    joined_ = other.joined_;
-    // Ensure that we don't try to join the source,
-    // as std::thread::join will std::terminate in that case.
-    // If it weren't for this we could use the compiler
-    // default implementation of move.
-    other.joined_ = true;
+    threads_ = std::move(other.threads_);
+    // Ensure that we don't try to join the threads of the source again
+    other.threads_.clear();
     return *this;
   }
 
@@ -728,11 +1319,10 @@ class AcceptLoop {
   }
 
   void join() {
-    if (joined_) {
-      return;
+    for (auto& thread : threads_) {
+      thread.join();
     }
-    thread_.join();
-    joined_ = true;
+    threads_.clear();
   }
 };
 
@@ -825,8 +1415,31 @@ bool w_start_listener() {
 #endif
   setup_signal_handlers();
 
+  LockProfile::setEnabled(cfg_get_bool("lock_profiling", false));
+  Tracing::setBufferSize(cfg_get_int("trace_buffer_spans", 16384));
+  Tracing::setSlowDump(
+      std::chrono::milliseconds(cfg_get_int("trace_slow_threshold_ms", 0)),
+      watchman_state_file.empty()
+          ? w_string()
+          : w_string_piece(watchman_state_file).dirName().asWString());
+  Tracing::setEnabled(cfg_get_bool("tracing", false));
+  configurePerfAlarms();
+
+  request_thread_pool().start(
+      cfg_get_int("request_thread_pool_worker_threads", 8),
+      cfg_get_int("thread_pool_max_items", 1024 * 1024));
+  getSubscriptionThreadPool().start(
+      cfg_get_int("subscription_thread_pool_worker_threads", 4),
+      cfg_get_int("thread_pool_max_items", 1024 * 1024));
+
+  suspend_waiting_commands = cfg_get_bool("suspend_waiting_commands", true);
+  if (cfg_get_bool("client_reactor", true)) {
+    client_reactor = std::make_unique<ClientReactor>();
+  }
+
   folly::Optional<AcceptLoop> tcp_loop;
   folly::Optional<AcceptLoop> unix_loop;
+  folly::Optional<AcceptLoop> metrics_loop;
 
   // When we unwind, ensure that we stop the accept threads
   SCOPE_EXIT {
@@ -835,6 +1448,7 @@ bool w_start_listener() {
     }
     unix_loop.clear();
     tcp_loop.clear();
+    metrics_loop.clear();
   };
 
   if (listener_fd) {
@@ -849,11 +1463,26 @@ bool w_start_listener() {
   }
 
   if (listener_fd) {
-    unix_loop.assign(AcceptLoop("unix-listener", std::move(listener_fd)));
+    unix_loop.assign(AcceptLoop(
+        "unix-listener",
+        std::move(listener_fd),
+        AcceptLoop::serve_client,
+        size_t(std::max(
+            cfg_get_int("unix_listener_acceptors", 1), json_int_t(1)))));
   }
 
   if (Configuration().getBool("tcp-listener-enable", false)) {
-    tcp_loop.assign(AcceptLoop("tcp-listener", get_listener_tcp_socket()));
+    tcp_loop.assign(AcceptLoop(
+        "tcp-listener",
+        get_listener_tcp_socket("tcp-listener-address", "TCP listener")));
+  }
+
+  if (Configuration().getString("metrics-listener-address", nullptr)) {
+    metrics_loop.assign(AcceptLoop(
+        "metrics-listener",
+        get_listener_tcp_socket(
+            "metrics-listener-address", "metrics listener"),
+        serveMetricsConnection));
   }
 
   startSanityCheckThread();
@@ -870,6 +1499,7 @@ bool w_start_listener() {
   // to shutdown.
   unix_loop.clear();
   tcp_loop.clear();
+  metrics_loop.clear();
 
   // Wait for clients, waking any sleeping clients up in the process
   {
@@ -912,6 +1542,12 @@ bool w_start_listener() {
     }
   }
 
+  if (client_reactor) {
+    client_reactor->stop();
+  }
+  request_thread_pool().stop();
+  getSubscriptionThreadPool().stop();
+
   w_state_shutdown();
 
   return true;
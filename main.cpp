@@ -4,6 +4,7 @@
 #include "ChildProcess.h"
 #include "LogConfig.h"
 #include "Logging.h"
+#include "SpawnHelper.h"
 #include "ThreadPool.h"
 #ifndef _WIN32
 #include <poll.h>
@@ -23,6 +24,7 @@ static int show_help = 0;
 static int show_version = 0;
 static int enable_tcp = 0;
 static std::string tcp_host;
+static std::string metrics_host;
 static enum w_pdu_type server_pdu = is_bser;
 static enum w_pdu_type output_pdu = is_json_pretty;
 static uint32_t server_capabilities = 0;
@@ -49,11 +51,12 @@ static int json_input_arg = 0;
 #endif
 
 static std::string compute_user_name(void);
-static void compute_file_name(
+static bool compute_file_name(
     std::string& str,
     const std::string& user,
     const char* suffix,
-    const char* what);
+    const char* what,
+    bool prepare_dir = true);
 
 static bool lock_pidfile(void) {
   // We defer computing this path until we're in the server context because
@@ -279,6 +282,12 @@ static void run_service() {
   }
 
 #ifndef _WIN32
+  // The helper is forked without exec, so this has to happen while we
+  // have the one thread, and before SIGCHLD is blocked below
+  if (cfg_get_bool("spawn_helper", false)) {
+    watchman::SpawnHelper::start();
+  }
+
   // Block SIGCHLD by default; we only want it to be delivered
   // to the reaper thread and only when it is ready to reap.
   // This MUST happen before we spawn any threads so that they
@@ -618,7 +627,14 @@ static void parse_encoding(const std::string& enc, enum w_pdu_type* pdu) {
     *pdu = is_bser_v2;
     return;
   }
-  log(ERR, "Invalid encoding '", enc, "', use one of json, bser or bser-v2\n");
+  if (enc == "bser-v3") {
+    *pdu = is_bser_v3;
+    return;
+  }
+  log(ERR,
+      "Invalid encoding '",
+      enc,
+      "', use one of json, bser, bser-v2 or bser-v3\n");
   exit(EX_USAGE);
 }
 
@@ -639,135 +655,183 @@ static const char* get_env_with_fallback(
   return val;
 }
 
-static void compute_file_name(
-    std::string& str,
-    const std::string& user,
-    const char* suffix,
-    const char* what) {
-  bool str_computed = false;
-  if (str.empty()) {
-    str_computed = true;
-    /* We'll put our various artifacts in a user specific dir
-     * within the state dir location */
-    const char* state_parent = !test_state_dir.empty() ? test_state_dir.c_str()
-                                                       :
+// Returns the user specific dir within the state dir location that we put
+// our various artifacts in
+static std::string compute_state_dir(const std::string& user) {
+  const char* state_parent = !test_state_dir.empty() ? test_state_dir.c_str()
+                                                     :
 #ifdef WATCHMAN_STATE_DIR
-                                                       WATCHMAN_STATE_DIR
+                                                     WATCHMAN_STATE_DIR
 #else
-                                                       watchman_tmp_dir
+                                                     watchman_tmp_dir
 #endif
-        ;
+      ;
 
-    auto state_dir = folly::to<std::string>(state_parent, "/", user, "-state");
+  return folly::to<std::string>(state_parent, "/", user, "-state");
+}
 
-    if (mkdir(state_dir.c_str(), 0700) == 0 || errno == EEXIST) {
 #ifndef _WIN32
-      // verify ownership
-      struct stat st;
-      int dir_fd;
-      int ret = 0;
-      uid_t euid = geteuid();
-      // TODO: also allow a gid to be specified here
-      const char* sock_group_name = cfg_get_string("sock_group", nullptr);
-      // S_ISGID is set so that files inside this directory inherit the group
-      // name
-      mode_t dir_perms =
-          cfg_get_perms(
-              "sock_access", false /* write bits */, true /* execute bits */) |
-          S_ISGID;
-
-      auto dirp = w_dir_open(
-          state_dir.c_str(), false /* don't need strict symlink rules */);
-
-      dir_fd = dirp->getFd();
-      if (dir_fd == -1) {
-        log(ERR, "dirfd(", state_dir, "): ", strerror(errno), "\n");
-        goto bail;
-      }
+// Returns true if the state dir that dir_fd is open on is owned by us and
+// others can't write to it; otherwise logs why and returns false, as the
+// socket in it can't be trusted to lead to our server
+static bool state_dir_is_secure(int dir_fd, const std::string& state_dir) {
+  struct stat st;
+  uid_t euid = geteuid();
+
+  if (fstat(dir_fd, &st) != 0) {
+    log(ERR, "fstat(", state_dir, "): ", strerror(errno), "\n");
+    return false;
+  }
+  if (euid != st.st_uid) {
+    log(ERR,
+        "the owner of ",
+        state_dir,
+        " is uid ",
+        st.st_uid,
+        " and doesn't match your euid ",
+        euid,
+        "\n");
+    return false;
+  }
+  if (st.st_mode & 0022) {
+    log(ERR,
+        "the permissions on ",
+        state_dir,
+        " allow others to write to it. "
+        "Verify that you own the contents and then fix its "
+        "permissions by running `chmod 0700 '",
+        state_dir,
+        "'`\n");
+    return false;
+  }
+  return true;
+}
+#endif
 
-      if (fstat(dir_fd, &st) != 0) {
-        log(ERR, "fstat(", state_dir, "): ", strerror(errno), "\n");
+// Checks the state dir before the CLI connects to the server through the
+// socket in it, without changing it.  It is only created and has its
+// group and permissions set by prepare_state_dir, when a server is to be
+// run; until then it needn't exist.
+static void check_state_dir(const std::string& state_dir) {
+#ifndef _WIN32
+  FileDescriptor dir(
+      open(state_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+      FileDescriptor::FDType::Generic);
+  if (!dir) {
+    if (errno == ENOENT) {
+      return;
+    }
+    log(ERR, "open(", state_dir, "): ", strerror(errno), "\n");
+    exit(1);
+  }
+  if (!state_dir_is_secure(dir.fd(), state_dir)) {
+    exit(1);
+  }
+#else
+  (void)state_dir;
+#endif
+}
+
+// Creates the state dir if needed, and checks that it is owned by us and
+// has the permissions that the config asks for
+static void prepare_state_dir(const std::string& state_dir, const char* what) {
+  if (mkdir(state_dir.c_str(), 0700) == 0 || errno == EEXIST) {
+#ifndef _WIN32
+    int dir_fd;
+    int ret = 0;
+    // TODO: also allow a gid to be specified here
+    const char* sock_group_name = cfg_get_string("sock_group", nullptr);
+    // S_ISGID is set so that files inside this directory inherit the group
+    // name
+    mode_t dir_perms =
+        cfg_get_perms(
+            "sock_access", false /* write bits */, true /* execute bits */) |
+        S_ISGID;
+
+    auto dirp = w_dir_open(
+        state_dir.c_str(), false /* don't need strict symlink rules */);
+
+    dir_fd = dirp->getFd();
+    if (dir_fd == -1) {
+      log(ERR, "dirfd(", state_dir, "): ", strerror(errno), "\n");
+      goto bail;
+    }
+
+    if (!state_dir_is_secure(dir_fd, state_dir)) {
+      ret = 1;
+      goto bail;
+    }
+
+    if (sock_group_name) {
+      const struct group* sock_group = w_get_group(sock_group_name);
+      if (!sock_group) {
         ret = 1;
         goto bail;
       }
-      if (euid != st.st_uid) {
+
+      if (fchown(dir_fd, -1, sock_group->gr_gid) == -1) {
         log(ERR,
-            "the owner of ",
-            state_dir,
-            " is uid ",
-            st.st_uid,
-            " and doesn't match your euid ",
-            euid,
+            "setting up group '",
+            sock_group_name,
+            "' failed: ",
+            strerror(errno),
             "\n");
         ret = 1;
         goto bail;
       }
-      if (st.st_mode & 0022) {
-        log(ERR,
-            "the permissions on ",
-            state_dir,
-            " allow others to write to it. "
-            "Verify that you own the contents and then fix its "
-            "permissions by running `chmod 0700 '",
-            state_dir,
-            "'`\n");
-        ret = 1;
-        goto bail;
-      }
-
-      if (sock_group_name) {
-        const struct group* sock_group = w_get_group(sock_group_name);
-        if (!sock_group) {
-          ret = 1;
-          goto bail;
-        }
-
-        if (fchown(dir_fd, -1, sock_group->gr_gid) == -1) {
-          log(ERR,
-              "setting up group '",
-              sock_group_name,
-              "' failed: ",
-              strerror(errno),
-              "\n");
-          ret = 1;
-          goto bail;
-        }
-      }
-
-      // Depending on group and world accessibility, change permissions on the
-      // directory. We can't leave the directory open and set permissions on the
-      // socket because not all POSIX systems respect permissions on UNIX domain
-      // sockets, but all POSIX systems respect permissions on the containing
-      // directory.
-      logf(DBG, "Setting permissions on state dir to {:o}\n", dir_perms);
-      if (fchmod(dir_fd, dir_perms) == -1) {
-        logf(
-            ERR,
-            "fchmod({}, {:o}): {}\n",
-            state_dir,
-            dir_perms,
-            strerror(errno));
-        ret = 1;
-        goto bail;
-      }
+    }
 
-    bail:
-      if (ret) {
-        exit(ret);
-      }
-#endif
-    } else {
-      log(ERR,
-          "while computing ",
-          what,
-          ": failed to create ",
+    // Depending on group and world accessibility, change permissions on the
+    // directory. We can't leave the directory open and set permissions on the
+    // socket because not all POSIX systems respect permissions on UNIX domain
+    // sockets, but all POSIX systems respect permissions on the containing
+    // directory.
+    logf(DBG, "Setting permissions on state dir to {:o}\n", dir_perms);
+    if (fchmod(dir_fd, dir_perms) == -1) {
+      logf(
+          ERR,
+          "fchmod({}, {:o}): {}\n",
           state_dir,
-          ": ",
-          strerror(errno),
-          "\n");
-      exit(1);
+          dir_perms,
+          strerror(errno));
+      ret = 1;
+      goto bail;
     }
 
+  bail:
+    if (ret) {
+      exit(ret);
+    }
+#endif
+  } else {
+    log(ERR,
+        "while computing ",
+        what,
+        ": failed to create ",
+        state_dir,
+        ": ",
+        strerror(errno),
+        "\n");
+    exit(1);
+  }
+}
+
+// Computes str as the named file within the state dir, unless it was set
+// on the command line, and returns true if it was computed.  The state dir
+// is only prepared when prepare_dir is true.
+static bool compute_file_name(
+    std::string& str,
+    const std::string& user,
+    const char* suffix,
+    const char* what,
+    bool prepare_dir) {
+  bool str_computed = false;
+  if (str.empty()) {
+    str_computed = true;
+    auto state_dir = compute_state_dir(user);
+    if (prepare_dir) {
+      prepare_state_dir(state_dir, what);
+    }
     str = folly::to<std::string>(state_dir, "/", suffix);
   }
 #ifndef _WIN32
@@ -781,6 +845,7 @@ static void compute_file_name(
         "\n");
   }
 #endif
+  return str_computed;
 }
 
 static std::string compute_user_name(void) {
@@ -824,6 +889,13 @@ static std::string compute_user_name(void) {
   return user;
 }
 
+// Whether unix_sock_name was computed rather than set on the command line,
+// in which case its dir is prepared by setup_service_files()
+static bool sock_name_computed = false;
+
+// Computes the names that are needed to connect to the server, and checks
+// that the state dir can be trusted, without changing it; the CLI has no
+// need to prepare it when the server is already running
 static void setup_sock_name(void) {
   auto user = compute_user_name();
 
@@ -834,10 +906,11 @@ static void setup_sock_name(void) {
     named_pipe_path = folly::to<std::string>("\\\\.\\pipe\\watchman-", user);
   }
 #endif
-  compute_file_name(unix_sock_name, user, "sock", "sockname");
-
-  compute_file_name(watchman_state_file, user, "state", "statefile");
-  compute_file_name(log_name, user, "log", "logfile");
+  sock_name_computed = compute_file_name(
+      unix_sock_name, user, "sock", "sockname", false /* prepare_dir */);
+  if (sock_name_computed) {
+    check_state_dir(compute_state_dir(user));
+  }
 
   if (unix_sock_name.size() >= sizeof(un.sun_path) - 1) {
     log(FATAL, unix_sock_name, ": path is too long\n");
@@ -973,6 +1046,13 @@ static struct watchman_getopt opts[] = {
      &tcp_host,
      "ADDRESS",
      IS_DAEMON},
+    {"metrics-listener-address",
+     0,
+     "Specify in <address>:<port> the address to serve Prometheus metrics on",
+     REQ_STRING,
+     &metrics_host,
+     "ADDRESS",
+     IS_DAEMON},
     {"logfile",
      'o',
      "Specify path to logfile",
@@ -1072,7 +1152,6 @@ static struct watchman_getopt opts[] = {
     {0, 0, 0, OPT_NONE, 0, 0, 0}};
 
 static void parse_cmdline(int* argcp, char*** argvp) {
-  cfg_load_global_config_file();
   w_getopt(opts, argcp, argvp, &daemon_argv);
   if (show_help) {
     usage(opts, stdout);
@@ -1095,6 +1174,22 @@ static void parse_cmdline(int* argcp, char*** argvp) {
   if (getenv("WATCHMAN_NO_SPAWN")) {
     no_spawn = true;
   }
+}
+
+// Loads the global config and prepares the state dir and the names of the
+// files in it.  This is only needed to run the server, or a command in
+// client mode; a command for a server that is already running is sent
+// without it, which keeps the cost of running the CLI close to that of
+// talking to the server.
+static void setup_service_files(void) {
+  cfg_load_global_config_file();
+
+  auto user = compute_user_name();
+  if (sock_name_computed) {
+    prepare_state_dir(compute_state_dir(user), "sockname");
+  }
+  compute_file_name(watchman_state_file, user, "state", "statefile");
+  compute_file_name(log_name, user, "log", "logfile");
 
   if (Configuration().getBool("tcp-listener-enable", false)) {
     // hg requires the state-enter/state-leave commands, which are disabled over
@@ -1126,14 +1221,14 @@ static json_ref build_command(int argc, char** argv) {
       if (output_encoding.empty()) {
         output_pdu = is_bser;
       }
-    } else if (buf.pdu_type == is_bser_v2) {
-      // If they used bser v2 for the input, select bser v2 for output
-      // unless they explicitly requested something else
+    } else if (buf.pdu_type == is_bser_v2 || buf.pdu_type == is_bser_v3) {
+      // If they used bser v2 or v3 for the input, select the same for
+      // output unless they explicitly requested something else
       if (server_encoding.empty()) {
-        server_pdu = is_bser_v2;
+        server_pdu = buf.pdu_type;
       }
       if (output_encoding.empty()) {
-        output_pdu = is_bser_v2;
+        output_pdu = buf.pdu_type;
       }
     }
 
@@ -1212,6 +1307,7 @@ int main(int argc, char** argv) {
   parse_cmdline(&argc, &argv);
 
   if (foreground) {
+    setup_service_files();
     run_service();
     return 0;
   }
@@ -1221,6 +1317,12 @@ int main(int argc, char** argv) {
   preprocess_command(cmd, output_pdu, output_capabilities);
 
   bool ran = try_command(cmd, 0);
+  if (!ran && should_start(errno)) {
+    // The global config may name another way to connect to the server, so
+    // try again with it before starting one
+    setup_service_files();
+    ran = try_command(cmd, 0);
+  }
   if (!ran && should_start(errno)) {
     if (no_spawn) {
       if (!no_local) {
@@ -0,0 +1,68 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+// Measures the throughput of this BSER implementation on the v1 PDUs of
+// the shared corpus in tests/bser_corpus:
+//
+//   node bench.js [minimum seconds per measurement] [substring of pdu]
+//
+// For each PDU this reports how quickly it is decoded, and how quickly
+// the decoded value is encoded again, in MB of BSER per second, so that
+// the numbers can be compared with those of the drivers for the other
+// languages.
+
+var bser = require('./');
+var corpus = require('./test/corpus');
+
+var minTime = parseFloat(process.argv[2] || '0.5');
+var only = process.argv[3] || '';
+
+// Returns the mean time in seconds of a call to func, running it for at
+// least minTime seconds
+function measure(func) {
+  func();
+  var iterations = 0;
+  var start = process.hrtime();
+  for (;;) {
+    func();
+    iterations++;
+    var elapsed = process.hrtime(start);
+    var seconds = elapsed[0] + elapsed[1] / 1e9;
+    if (seconds >= minTime && iterations >= 3) {
+      return seconds / iterations;
+    }
+  }
+}
+
+// Pads str to width, on the left if alignRight is set
+function pad(str, width, alignRight) {
+  str = String(str);
+  while (str.length < width) {
+    str = alignRight ? ' ' + str : str + ' ';
+  }
+  return str;
+}
+
+var manifest = corpus.loadManifest();
+if (!manifest) {
+  throw new Error('the BSER corpus is not available in ' + corpus.dir);
+}
+console.log(pad('impl', 8) + ' ' + pad('pdu', 36) + ' ' +
+    pad('bytes', 9, true) + ' ' + pad('decode MB/s', 12, true) + ' ' +
+    pad('encode MB/s', 12, true));
+manifest.forEach(function(entry) {
+  entry.pdus.forEach(function(pdu) {
+    if (pdu.indexOf('.v1.') == -1 || pdu.indexOf(only) == -1) {
+      return;
+    }
+    var data = corpus.read(pdu);
+    var value = bser.loadFromBuffer(data);
+    var decode = measure(function() { bser.loadFromBuffer(data); });
+    var encode = measure(function() { bser.dumpToBuffer(value); });
+    var mb = data.length / 1e6;
+    console.log(pad('node', 8) + ' ' + pad(pdu, 36) + ' ' +
+        pad(data.length, 9, true) + ' ' +
+        pad((mb / decode).toFixed(1), 12, true) + ' ' +
+        pad((mb / encode).toFixed(1), 12, true));
+  });
+});
@@ -17,9 +17,39 @@ function nextPow2(size) {
   return Math.pow(2, Math.ceil(Math.log(size) / Math.LN2));
 }
 
+var DEFAULT_BUFFER_SIZE = 8192;
+
+// Buffers that Accumulators have grown out of, keyed by size, so that the
+// next one to need a buffer that big can reuse it rather than allocating.
+// A client that receives a stream of large subscription updates would
+// otherwise allocate and discard a buffer of several MB for each of them.
+var bufferPool = {};
+var MAX_POOLED_PER_SIZE = 2;
+
+// Returns a buffer of size bytes (a power of 2) with unspecified contents
+function allocBuffer(size) {
+  var free = bufferPool[size];
+  if (free && free.length > 0) {
+    return free.pop();
+  }
+  return Buffer.allocUnsafe(size);
+}
+
+// Returns buf to the pool.  Nothing may refer to it afterwards; the decoder
+// copies everything that it returns out of its buffer.
+function releaseBuffer(buf) {
+  var free = bufferPool[buf.length];
+  if (!free) {
+    free = bufferPool[buf.length] = [];
+  }
+  if (free.length < MAX_POOLED_PER_SIZE) {
+    free.push(buf);
+  }
+}
+
 // Expandable buffer that we can provide a size hint for
 function Accumulator(initsize) {
-  this.buf = Buffer.alloc(nextPow2(initsize || 8192));
+  this.buf = allocBuffer(nextPow2(initsize || DEFAULT_BUFFER_SIZE));
   this.readOffset = 0;
   this.writeOffset = 0;
 }
@@ -55,11 +85,26 @@ Accumulator.prototype.reserve = function(size) {
   }
 
   // Allocate a replacement and copy it in
-  var buf = Buffer.alloc(nextPow2(this.buf.length + size - this.writeAvail()));
-  this.buf.copy(buf);
+  var buf = allocBuffer(nextPow2(this.buf.length + size - this.writeAvail()));
+  this.buf.copy(buf, 0, 0, this.writeOffset);
+  releaseBuffer(this.buf);
   this.buf = buf;
 }
 
+// If everything has been read and the buffer has grown past the default
+// size, returns it to the pool and goes back to a default sized one, so
+// that an idle decoder doesn't hold on to the space that its largest PDU
+// needed
+Accumulator.prototype.shrink = function() {
+  if (this.readAvail() > 0 || this.buf.length <= DEFAULT_BUFFER_SIZE) {
+    return;
+  }
+  releaseBuffer(this.buf);
+  this.buf = allocBuffer(DEFAULT_BUFFER_SIZE);
+  this.readOffset = 0;
+  this.writeOffset = 0;
+}
+
 // Append buffer or string.  Will resize as needed
 Accumulator.prototype.append = function(buf) {
   if (Buffer.isBuffer(buf)) {
@@ -108,8 +153,10 @@ Accumulator.prototype.peekInt = function(size) {
     case 8:
         var big = this.buf.slice(this.readOffset, this.readOffset + 8);
         if (isBigEndian) {
-          // On a big endian system we can simply pass the buffer directly
-          return new Int64(big);
+          // On a big endian system we can simply pass the bytes directly,
+          // but Int64 keeps the buffer that it is given, and ours will be
+          // overwritten
+          return new Int64(Buffer.from(big));
         }
         // Otherwise we need to byteswap
         return new Int64(byteswap64(big));
@@ -212,11 +259,27 @@ var ST_FILL_PDU = 1; // Know the length, need to read whole content
 var MAX_INT8 = 127;
 var MAX_INT16 = 32767;
 var MAX_INT32 = 2147483647;
-
-function BunserBuf() {
+var MIN_INT8 = -128;
+var MIN_INT16 = -32768;
+var MIN_INT32 = -2147483648;
+
+/**
+ * @param options An object with the following optional keys:
+ *   * 'filesHandler' (function) Called with the other keys of each PDU
+ *     whose value is an object with a 'files' array, before that array is
+ *     decoded.  If it returns a function, each entry of the array is passed
+ *     to that as it is decoded, rather than being collected into an array,
+ *     and the emitted value has no 'files' key.
+ *   * 'namesOnly' (boolean) Decode each entry of such a 'files' array as
+ *     just its name string, skipping over its other fields without
+ *     building an object for it.
+ */
+function BunserBuf(options) {
   EE.call(this);
   this.buf = new Accumulator();
   this.state = ST_NEED_PDU;
+  this.filesHandler = (options && options.filesHandler) || null;
+  this.namesOnly = !!(options && options.namesOnly);
 }
 util.inherits(BunserBuf, EE);
 exports.BunserBuf = BunserBuf;
@@ -285,12 +348,13 @@ BunserBuf.prototype.process = function(synchronous) {
     }
 
     // We have enough to decode it
-    var val = this.decodeAny();
+    var val = this.decodePdu();
     if (synchronous) {
       return val;
     }
-    this.emit('value', val);
     this.state = ST_NEED_PDU;
+    this.buf.shrink();
+    this.emit('value', val);
   }
 
   if (!synchronous && this.buf.readAvail() > 0) {
@@ -346,6 +410,164 @@ BunserBuf.prototype.decodeAny = function() {
   }
 }
 
+// Decodes the value of a PDU, handing the entries of its 'files' array to
+// the filesHandler or decoding only their names if we were asked to
+BunserBuf.prototype.decodePdu = function() {
+  if ((!this.filesHandler && !this.namesOnly) ||
+      this.buf.peekInt(1) != BSER_OBJECT) {
+    return this.decodeAny();
+  }
+  this.expectCode(BSER_OBJECT);
+  var nitems = this.decodeInt();
+  var res = {};
+  // The other keys may come after 'files', so we skip over it and come
+  // back to it once we have them
+  var filesOffset = -1;
+  for (var i = 0; i < nitems; ++i) {
+    var key = this.decodeString();
+    if (key === 'files' && filesOffset == -1 &&
+        (this.buf.peekInt(1) == BSER_ARRAY ||
+         this.buf.peekInt(1) == BSER_TEMPLATE)) {
+      filesOffset = this.buf.readOffset;
+      this.skipAny();
+      continue;
+    }
+    res[key] = this.decodeAny();
+  }
+  if (filesOffset == -1) {
+    return res;
+  }
+
+  var end = this.buf.readOffset;
+  this.buf.readOffset = filesOffset;
+  var onFile = this.filesHandler ? this.filesHandler(res) : null;
+  var files = this.decodeFiles(typeof onFile === 'function' ? onFile : null);
+  if (files) {
+    res.files = files;
+  }
+  this.buf.readOffset = end;
+  return res;
+}
+
+// Decodes a 'files' array, passing each entry to onFile if it is set, or
+// else returning them in an array
+BunserBuf.prototype.decodeFiles = function(onFile) {
+  var arr = onFile ? null : [];
+  var entry;
+  if (this.buf.peekInt(1) == BSER_TEMPLATE) {
+    this.expectCode(BSER_TEMPLATE);
+    var keys = this.decodeArray();
+    var nameidx = this.namesOnly ? keys.indexOf('name') : -1;
+    var nitems = this.decodeInt();
+    for (var i = 0; i < nitems; ++i) {
+      entry = this.namesOnly ? null : {};
+      for (var keyidx = 0; keyidx < keys.length; ++keyidx) {
+        if (this.buf.peekInt(1) == BSER_SKIP) {
+          this.buf.readAdvance(1);
+        } else if (!this.namesOnly) {
+          entry[keys[keyidx]] = this.decodeAny();
+        } else if (keyidx == nameidx) {
+          entry = this.decodeAny();
+        } else {
+          this.skipAny();
+        }
+      }
+      if (onFile) {
+        onFile(entry);
+      } else {
+        arr.push(entry);
+      }
+    }
+    return arr;
+  }
+
+  this.expectCode(BSER_ARRAY);
+  var nitems = this.decodeInt();
+  for (var i = 0; i < nitems; ++i) {
+    if (this.namesOnly && this.buf.peekInt(1) == BSER_OBJECT) {
+      entry = this.decodeName();
+    } else {
+      entry = this.decodeAny();
+    }
+    if (onFile) {
+      onFile(entry);
+    } else {
+      arr.push(entry);
+    }
+  }
+  return arr;
+}
+
+// Decodes the 'name' field of an object, skipping its other fields
+BunserBuf.prototype.decodeName = function() {
+  this.expectCode(BSER_OBJECT);
+  var nitems = this.decodeInt();
+  var name = null;
+  for (var i = 0; i < nitems; ++i) {
+    if (this.decodeString() === 'name') {
+      name = this.decodeAny();
+    } else {
+      this.skipAny();
+    }
+  }
+  return name;
+}
+
+// Moves past the next value without decoding it
+BunserBuf.prototype.skipAny = function() {
+  var code = this.buf.peekInt(1);
+  switch (code) {
+    case BSER_INT8:
+    case BSER_INT16:
+    case BSER_INT32:
+    case BSER_INT64:
+      this.decodeInt();
+      return;
+    case BSER_REAL:
+      this.buf.readAdvance(9);
+      return;
+    case BSER_TRUE:
+    case BSER_FALSE:
+    case BSER_NULL:
+      this.buf.readAdvance(1);
+      return;
+    case BSER_STRING:
+      this.buf.readAdvance(1);
+      var len = this.decodeInt();
+      if (len < 0) {
+        this.raise("negative string length " + len);
+      }
+      this.buf.readAdvance(len);
+      return;
+    case BSER_ARRAY:
+      this.buf.readAdvance(1);
+      for (var n = this.decodeInt(); n > 0; --n) {
+        this.skipAny();
+      }
+      return;
+    case BSER_OBJECT:
+      this.buf.readAdvance(1);
+      for (var n = this.decodeInt(); n > 0; --n) {
+        this.skipAny();
+        this.skipAny();
+      }
+      return;
+    case BSER_TEMPLATE:
+      this.buf.readAdvance(1);
+      var nkeys = this.decodeArray().length;
+      for (var n = this.decodeInt() * nkeys; n > 0; --n) {
+        if (this.buf.peekInt(1) == BSER_SKIP) {
+          this.buf.readAdvance(1);
+        } else {
+          this.skipAny();
+        }
+      }
+      return;
+    default:
+      this.raise("unhandled bser opcode " + code);
+  }
+}
+
 BunserBuf.prototype.decodeArray = function() {
   this.expectCode(BSER_ARRAY);
   var nitems = this.decodeInt();
@@ -474,15 +696,16 @@ function dump_int64(buf, val) {
   buf.append(le);
 }
 
+// Uses the smallest encoding that can hold val, as the other
+// implementations do
 function dump_int(buf, val) {
-  var abs = Math.abs(val);
-  if (abs <= MAX_INT8) {
+  if (val >= MIN_INT8 && val <= MAX_INT8) {
     buf.writeByte(BSER_INT8);
     buf.writeInt(val, 1);
-  } else if (abs <= MAX_INT16) {
+  } else if (val >= MIN_INT16 && val <= MAX_INT16) {
     buf.writeByte(BSER_INT16);
     buf.writeInt(val, 2);
-  } else if (abs <= MAX_INT32) {
+  } else if (val >= MIN_INT32 && val <= MAX_INT32) {
     buf.writeByte(BSER_INT32);
     buf.writeInt(val, 4);
   } else {
@@ -84,3 +84,99 @@ assert.equal(buffer.toString('hex'), "000105020000000301");
 buffer = bser.dumpToBuffer(1.1);
 assert.equal(buffer.toString('hex'), "00010509000000079a9999999999f13f");
 
+
+// Check against the corpus shared by all of the BSER implementations.
+// This decoder and encoder only speak BSER v1.
+var corpus = require('./corpus');
+var manifest = corpus.loadManifest();
+if (manifest) {
+  manifest.forEach(function(entry) {
+    var expected = JSON.parse(corpus.read(entry.name + '.json'));
+    entry.pdus.forEach(function(pdu) {
+      if (pdu.indexOf('.v1.') == -1) {
+        return;
+      }
+      assert.deepStrictEqual(bser.loadFromBuffer(corpus.read(pdu)), expected,
+          pdu);
+    });
+    var canonical = corpus.read(entry.name + '.v1.bser');
+    assert.ok(bser.dumpToBuffer(expected).equals(canonical), entry.name);
+  });
+}
+
+// Decode the files of a response as they are read, in each of the forms
+// that the server sends them in
+function decodeFiles(val, options) {
+  var bunser = new bser.BunserBuf(options);
+  return bunser.append(bser.dumpToBuffer(val), true);
+}
+var files = [
+  {name: 'a.js', size: 1, exists: true},
+  {name: 'b.js', size: 2, exists: false},
+];
+var streamed = [];
+var resp = decodeFiles({clock: 'c:1', files: files}, {
+  filesHandler: function(head) {
+    assert.deepStrictEqual(head, {clock: 'c:1'});
+    return function(file) { streamed.push(file); };
+  }
+});
+assert.deepStrictEqual(resp, {clock: 'c:1'});
+assert.deepStrictEqual(streamed, files);
+
+// A handler that returns nothing leaves the files in the response
+resp = decodeFiles({files: files, clock: 'c:1'}, {
+  filesHandler: function(head) { return null; }
+});
+assert.deepStrictEqual(resp, {files: files, clock: 'c:1'});
+
+resp = decodeFiles({files: files, clock: 'c:1'}, {namesOnly: true});
+assert.deepStrictEqual(resp, {files: ['a.js', 'b.js'], clock: 'c:1'});
+resp = decodeFiles({files: ['a.js', 'b.js']}, {namesOnly: true});
+assert.deepStrictEqual(resp, {files: ['a.js', 'b.js']});
+
+// The server sends templates when the client speaks BSER.  This is
+// {files: template [size, exists, name] [[1, true, 'a.js'],
+// [2, false, skip]], clock: 'c:1'}
+var body = Buffer.concat([
+  Buffer.from([0x01, 0x03, 0x02, 0x02, 0x03, 0x05]), Buffer.from('files'),
+  Buffer.from([0x0b, 0x00, 0x03, 0x03]),
+  Buffer.from([0x02, 0x03, 0x04]), Buffer.from('size'),
+  Buffer.from([0x02, 0x03, 0x06]), Buffer.from('exists'),
+  Buffer.from([0x02, 0x03, 0x04]), Buffer.from('name'),
+  Buffer.from([0x03, 0x02]),
+  Buffer.from([0x03, 0x01, 0x08, 0x02, 0x03, 0x04]), Buffer.from('a.js'),
+  Buffer.from([0x03, 0x02, 0x09, 0x0c]),
+  Buffer.from([0x02, 0x03, 0x05]), Buffer.from('clock'),
+  Buffer.from([0x02, 0x03, 0x03]), Buffer.from('c:1'),
+]);
+var pdu = Buffer.concat([Buffer.from([0x00, 0x01, 0x05, 0, 0, 0, 0]), body]);
+pdu.writeInt32LE(body.length, 3);
+assert.deepStrictEqual(bser.loadFromBuffer(pdu),
+    {files: [{size: 1, exists: true, name: 'a.js'},
+             {size: 2, exists: false}],
+     clock: 'c:1'});
+streamed = [];
+resp = new bser.BunserBuf({
+  namesOnly: true,
+  filesHandler: function() {
+    return function(name) { streamed.push(name); };
+  }
+}).append(pdu, true);
+assert.deepStrictEqual(resp, {clock: 'c:1'});
+assert.deepStrictEqual(streamed, ['a.js', null]);
+
+// Buffers that a decoder grows out of are reused, and it goes back to a
+// small buffer once it has no more to read
+var bunser = new bser.BunserBuf();
+var values = [];
+bunser.on('value', function(v) { values.push(v); });
+var big = {files: []};
+for (var i = 0; i < 10000; ++i) {
+  big.files.push('some/long/enough/path/' + i);
+}
+bunser.append(bser.dumpToBuffer(big));
+process.nextTick(function() {
+  assert.deepStrictEqual(values, [big]);
+  assert.equal(bunser.buf.buf.length, 8192);
+});
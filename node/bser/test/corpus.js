@@ -0,0 +1,28 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+// Locates the corpus of PDUs that is shared by all of the BSER
+// implementations in the watchman repository; see
+// tests/bser_corpus/README.md there.
+
+var fs = require('fs');
+var path = require('path');
+
+var corpusDir = path.join(
+    process.env.WATCHMAN_SRC_DIR || path.join(__dirname, '..', '..', '..'),
+    'tests', 'bser_corpus');
+exports.dir = corpusDir;
+
+exports.read = function(name) {
+  return fs.readFileSync(path.join(corpusDir, name));
+}
+
+// Returns the list of entries in the corpus, or null if it isn't
+// available, as when this is installed from npm
+exports.loadManifest = function() {
+  var manifest = path.join(corpusDir, 'manifest.json');
+  if (!fs.existsSync(manifest)) {
+    return null;
+  }
+  return JSON.parse(fs.readFileSync(manifest));
+}
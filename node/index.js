@@ -17,6 +17,14 @@ var unilateralTags = ['subscription', 'log'];
  *   * 'watchmanBinaryPath' (string) Absolute path to the watchman binary.
  *     If not provided, the Client locates the binary using the PATH specified
  *     by the node child_process's default env.
+ *   * 'namesOnly' (boolean) Decode the entries of the 'files' arrays of
+ *     responses and subscription updates as just their name strings,
+ *     without building an object for each of them.  The other fields that
+ *     a query asks for are skipped.
+ *   * 'streamSubscriptionFiles' (boolean) Rather than collecting the files
+ *     of a subscription update into an array, emit a 'subscriptionFile'
+ *     event with each one and the rest of the update as they are decoded.
+ *     The 'subscription' event that follows has no 'files' key.
  */
 function Client(options) {
   var self = this;
@@ -26,6 +34,9 @@ function Client(options) {
   if (options && options.watchmanBinaryPath) {
     this.watchmanBinaryPath = options.watchmanBinaryPath.trim();
   };
+  this.namesOnly = !!(options && options.namesOnly);
+  this.streamSubscriptionFiles =
+    !!(options && options.streamSubscriptionFiles);
   this.commands = [];
 }
 util.inherits(Client, EE);
@@ -72,7 +83,21 @@ Client.prototype.connect = function() {
 
   function makeSock(sockname) {
     // bunser will decode the watchman BSER protocol for us
-    self.bunser = new bser.BunserBuf();
+    self.bunser = new bser.BunserBuf({
+      namesOnly: self.namesOnly,
+      filesHandler: function(head) {
+        if ('subscription' in head) {
+          if (!self.streamSubscriptionFiles) {
+            return null;
+          }
+          return function(file) {
+            self.emit('subscriptionFile', file, head);
+          };
+        }
+        var cmd = self.currentCommand;
+        return cmd && cmd.onFile ? cmd.onFile : null;
+      }
+    });
     // For each decoded line:
     self.bunser.on('value', function(obj) {
       // Figure out if this is a unliteral response or if it is the
@@ -217,10 +242,20 @@ Client.prototype.connect = function() {
 }
 
 Client.prototype.command = function(args, done) {
-  done = done || function() {};
+  this.queueCommand({cmd: args, cb: done || function() {}});
+}
+
+// Like command, but passes each entry of the 'files' array of the response
+// to onFile as it is decoded, rather than collecting them into an array.
+// The response passed to done has no 'files' key.  This avoids holding the
+// whole result of a large query in memory at once.
+Client.prototype.streamCommand = function(args, onFile, done) {
+  this.queueCommand({cmd: args, cb: done || function() {}, onFile: onFile});
+}
 
+Client.prototype.queueCommand = function(command) {
   // Queue up the command
-  this.commands.push({cmd: args, cb: done});
+  this.commands.push(command);
 
   // Establish a connection if we don't already have one
   if (!this.socket) {
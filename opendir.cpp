@@ -11,6 +11,12 @@
 #include <sys/utsname.h>
 #include <sys/vnode.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef SYS_getdents64
+#define WATCHMAN_USE_GETDENTS64 1
+#endif
+#endif
 #include "FileDescriptor.h"
 
 using namespace watchman;
@@ -50,6 +56,18 @@ typedef struct {
 } __attribute__((packed)) bulk_attr_item;
 #endif
 
+#ifdef WATCHMAN_USE_GETDENTS64
+// The record format produced by getdents64(2).  glibc didn't grow a
+// wrapper for the syscall until 2.30, so we declare this ourselves.
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
 #ifndef _WIN32
 class DirHandle : public watchman_dir_handle {
 #ifdef HAVE_GETATTRLISTBULK
@@ -59,6 +77,14 @@ class DirHandle : public watchman_dir_handle {
   int retcount_{0};
   char buf_[64 * (sizeof(bulk_attr_item) + NAME_MAX * 3 + 1)];
   char* cursor_{nullptr};
+#endif
+#ifdef WATCHMAN_USE_GETDENTS64
+  // We read the dir ourselves rather than via readdir(), so that we can
+  // use a larger buffer than libc and need fewer syscalls for big dirs
+  FileDescriptor fd_;
+  alignas(linux_dirent64) char buf_[64 * 1024];
+  char* cursor_{nullptr};
+  char* end_{nullptr};
 #endif
   DIR* d_{nullptr};
   struct watchman_dir_ent ent_;
@@ -197,6 +223,15 @@ DirHandle::DirHandle(const char* path, bool strict)
     attrlist_.fileattr = ATTR_FILE_TOTALSIZE | ATTR_FILE_LINKCOUNT;
     return;
   }
+#endif
+#ifdef WATCHMAN_USE_GETDENTS64
+  auto opts = strict ? OpenFileHandleOptions::strictOpenDir()
+                     : OpenFileHandleOptions::openDir();
+  fd_ = openFileHandle(path, opts);
+  if (!fd_.getInfo().isDir()) {
+    throw std::system_error(ENOTDIR, std::generic_category(), path);
+  }
+  return;
 #endif
   d_ = strict ? opendir_nofollow(path) : opendir(path);
 
@@ -260,6 +295,8 @@ const watchman_dir_ent* DirHandle::readDir() {
     }
 
     w_string_piece name{};
+    ent_.d_type = DType::Unknown;
+    ent_.d_ino = 0;
 
     if (item->returned.commonattr & ATTR_CMN_NAME) {
       ent_.d_name = ((char*)&item->name) + item->name.attr_dataoffset;
@@ -367,6 +404,34 @@ const watchman_dir_ent* DirHandle::readDir() {
         break;
     }
     ent_.has_stat = true;
+    ent_.d_type = ent_.stat.dtype();
+    ent_.d_ino = ent_.stat.ino;
+    return &ent_;
+  }
+#endif
+
+#ifdef WATCHMAN_USE_GETDENTS64
+  if (fd_) {
+    if (cursor_ == end_) {
+      auto len = syscall(SYS_getdents64, fd_.fd(), buf_, sizeof(buf_));
+      if (len == -1) {
+        throw std::system_error(errno, std::generic_category(), "getdents64");
+      }
+      if (len == 0) {
+        // End of the stream
+        return nullptr;
+      }
+      cursor_ = buf_;
+      end_ = buf_ + len;
+    }
+
+    auto item = reinterpret_cast<linux_dirent64*>(cursor_);
+    cursor_ += item->d_reclen;
+
+    ent_.d_name = item->d_name;
+    ent_.d_type = DType(item->d_type);
+    ent_.d_ino = item->d_ino;
+    ent_.has_stat = false;
     return &ent_;
   }
 #endif
@@ -384,6 +449,10 @@ const watchman_dir_ent* DirHandle::readDir() {
   }
 
   ent_.d_name = dent->d_name;
+#if defined(_DIRENT_HAVE_D_TYPE) || defined(__APPLE__)
+  ent_.d_type = DType(dent->d_type);
+#endif
+  ent_.d_ino = dent->d_ino;
   ent_.has_stat = false;
   return &ent_;
 }
@@ -400,7 +469,11 @@ int DirHandle::getFd() const {
     return fd_.fd();
   }
 #endif
+#ifdef WATCHMAN_USE_GETDENTS64
+  return fd_.fd();
+#else
   return dirfd(d_);
+#endif
 }
 #endif
 
@@ -2,7 +2,10 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <folly/Optional.h>
 #include <folly/Synchronized.h>
+#include <algorithm>
+#include <numeric>
 
 using namespace watchman;
 
@@ -10,6 +13,7 @@ static const struct flag_map kflags[] = {
     {W_PENDING_CRAWL_ONLY, "CRAWL_ONLY"},
     {W_PENDING_RECURSIVE, "RECURSIVE"},
     {W_PENDING_VIA_NOTIFY, "VIA_NOTIFY"},
+    {W_PENDING_REMOVED, "REMOVED"},
     {0, NULL},
 };
 
@@ -44,6 +48,32 @@ static bool is_path_prefix(
   return is_slash(path[common_prefix]);
 }
 
+// Returns true if path is ancestor or is beneath it
+static bool is_same_or_beneath(const w_string& path, const w_string& ancestor) {
+  if (path.size() < ancestor.size() ||
+      memcmp(path.data(), ancestor.data(), ancestor.size()) != 0) {
+    return false;
+  }
+  return path.size() == ancestor.size() ||
+      is_slash(path.data()[ancestor.size()]);
+}
+
+// Orders paths such that each dir is immediately followed by the paths
+// beneath it, by treating the separator as lower than any other byte.
+// A plain byte-wise ordering would put "foo-bar" between "foo" and
+// "foo/bar".
+static bool path_tree_less(const w_string& a, const w_string& b) {
+  auto len = std::min(a.size(), b.size());
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char ca = is_slash(a.data()[i]) ? 0 : (unsigned char)a.data()[i];
+    unsigned char cb = is_slash(b.data()[i]) ? 0 : (unsigned char)b.data()[i];
+    if (ca != cb) {
+      return ca < cb;
+    }
+  }
+  return a.size() < b.size();
+}
+
 // Helper to un-doubly-link a pending item.
 void PendingCollectionBase::unlinkItem(
     std::shared_ptr<watchman_pending_fs>& p) {
@@ -76,9 +106,10 @@ void PendingCollectionBase::linkHead(std::shared_ptr<watchman_pending_fs>&& p) {
 
 /* initialize a pending_coll */
 PendingCollectionBase::PendingCollectionBase(
-    std::condition_variable& cond,
-    std::atomic<bool>& pinged)
-    : cond_(cond), pinged_(pinged) {}
+    std::condition_variable_any& cond,
+    std::atomic<bool>& pinged,
+    const std::shared_ptr<std::function<void()>>& wakeHook)
+    : cond_(cond), pinged_(pinged), wakeHook_(wakeHook) {}
 
 /* destroy a pending_coll */
 PendingCollectionBase::~PendingCollectionBase() {
@@ -89,16 +120,28 @@ PendingCollectionBase::~PendingCollectionBase() {
 void PendingCollectionBase::drain() {
   pending_.reset();
   tree_.clear();
+  possibleCookie_ = false;
 }
 
 void PendingCollectionBase::ping() {
   pinged_ = true;
   cond_.notify_all();
+  if (auto hook = std::atomic_load(&wakeHook_)) {
+    (*hook)();
+  }
 }
 
 void PendingCollection::ping() {
   pinged_ = true;
   cond_.notify_all();
+  if (auto hook = std::atomic_load(&wakeHook_)) {
+    (*hook)();
+  }
+}
+
+void PendingCollection::setWakeHook(std::function<void()> hook) {
+  std::atomic_store(
+      &wakeHook_, std::make_shared<std::function<void()>>(std::move(hook)));
 }
 
 // Deletion is a bit awkward in this radix tree implementation.
@@ -187,13 +230,22 @@ void PendingCollectionBase::maybePruneObsoletedChildren(
   }
 }
 
-void PendingCollectionBase::consolidateItem(watchman_pending_fs* p, int flags) {
+void PendingCollectionBase::consolidateItem(
+    watchman_pending_fs* p,
+    int flags,
+    std::unique_ptr<watchman::FileInformation> stat) {
   // Increase the strength of the pending item if either of these
   // flags are set.
   // We upgrade crawl-only as well as recursive; it indicates that
   // we've recently just performed the stat and we want to avoid
   // infinitely trying to stat-and-crawl
   p->flags |= flags & (W_PENDING_CRAWL_ONLY | W_PENDING_RECURSIVE);
+  // The removal may have been followed by something else
+  if (!(flags & W_PENDING_REMOVED)) {
+    p->flags &= ~W_PENDING_REMOVED;
+  }
+  // Whatever the watcher told us before is out of date
+  p->stat = std::move(stat);
 
   maybePruneObsoletedChildren(p->path, p->flags);
 }
@@ -239,13 +291,18 @@ watchman_pending_fs::watchman_pending_fs(
 bool PendingCollectionBase::add(
     const w_string& path,
     struct timeval now,
-    int flags) {
+    int flags,
+    const watchman::FileInformation* stat) {
   char flags_label[128];
+  std::unique_ptr<watchman::FileInformation> ownedStat;
+  if (stat) {
+    ownedStat = std::make_unique<watchman::FileInformation>(*stat);
+  }
 
   auto existing = tree_.search(path);
   if (existing) {
     /* Entry already exists: consolidate */
-    consolidateItem(existing->get(), flags);
+    consolidateItem(existing->get(), flags, std::move(ownedStat));
     /* all done */
     return true;
   }
@@ -256,12 +313,16 @@ bool PendingCollectionBase::add(
 
   // Try to allocate the new node before we prune any children.
   auto p = std::make_shared<watchman_pending_fs>(path, now, flags);
+  p->stat = std::move(ownedStat);
 
   maybePruneObsoletedChildren(path, flags);
 
   w_expand_flags(kflags, flags, flags_label, sizeof(flags_label));
   logf(DBG, "add_pending: {} {}\n", path, flags_label);
 
+  if (!possibleCookie_ && watchman::CookieSync::isPossiblyACookie(path)) {
+    possibleCookie_ = true;
+  }
   tree_.insert(path, p);
   linkHead(std::move(p));
 
@@ -280,13 +341,14 @@ bool PendingCollectionBase::add(
  * src is effectively drained in the process.
  * Caller must own the lock on both src and target. */
 void PendingCollectionBase::append(PendingCollectionBase* src) {
+  possibleCookie_ = possibleCookie_ || src->possibleCookie_;
   auto p = src->stealItems();
   while (p) {
     auto target_p =
         tree_.search((const uint8_t*)p->path.data(), p->path.size());
     if (target_p) {
       /* Entry already exists: consolidate */
-      consolidateItem(target_p->get(), p->flags);
+      consolidateItem(target_p->get(), p->flags, std::move(p->stat));
       p = std::move(p->next);
       continue;
     }
@@ -305,8 +367,107 @@ void PendingCollectionBase::append(PendingCollectionBase* src) {
   }
 }
 
+void PendingCollectionBase::appendBatch(
+    std::vector<std::shared_ptr<watchman_pending_fs>>&& chains) {
+  std::vector<std::shared_ptr<watchman_pending_fs>> items;
+  for (auto& chain : chains) {
+    auto p = std::move(chain);
+    while (p) {
+      auto next = std::move(p->next);
+      p->prev.reset();
+      items.push_back(std::move(p));
+      p = std::move(next);
+    }
+  }
+  chains.clear();
+  if (items.empty()) {
+    return;
+  }
+
+  // The sort is stable, so the duplicates of a path appear in the order
+  // in which they were added and we consolidate into the first of them,
+  // just as add() would.
+  std::vector<uint32_t> order(items.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return path_tree_less(items[a]->path, items[b]->path);
+  });
+
+  std::vector<bool> keep(items.size(), false);
+  // The surviving recursive items that contain the current path
+  std::vector<uint32_t> containing;
+  // The most recently kept item
+  watchman_pending_fs* prev = nullptr;
+  uint32_t prevIdx = 0;
+  uint32_t obsoleted = 0;
+  for (auto idx : order) {
+    auto p = items[idx].get();
+    while (!containing.empty() &&
+           !is_same_or_beneath(p->path, items[containing.back()]->path)) {
+      containing.pop_back();
+    }
+
+    if (prev && prev->path == p->path) {
+      auto wasRecursive = prev->flags & W_PENDING_RECURSIVE;
+      prev->flags |= p->flags & (W_PENDING_CRAWL_ONLY | W_PENDING_RECURSIVE);
+      if (!(p->flags & W_PENDING_REMOVED)) {
+        prev->flags &= ~W_PENDING_REMOVED;
+      }
+      prev->stat = std::move(p->stat);
+      if (!wasRecursive && (prev->flags & W_PENDING_RECURSIVE)) {
+        containing.push_back(prevIdx);
+      }
+      continue;
+    }
+
+    // The same rules as maybePruneObsoletedChildren
+    if (!containing.empty() && (p->flags & W_PENDING_CRAWL_ONLY) == 0 &&
+        !watchman::CookieSync::isPossiblyACookie(p->path)) {
+      ++obsoleted;
+      continue;
+    }
+
+    keep[idx] = true;
+    prev = p;
+    prevIdx = idx;
+    if (p->flags & W_PENDING_RECURSIVE) {
+      containing.push_back(idx);
+    }
+  }
+
+  logf(
+      DBG,
+      "appendBatch: {} items, {} obsoleted within the batch\n",
+      items.size(),
+      obsoleted);
+
+  // The survivors don't obsolete each other, so if we started out empty
+  // there is nothing left to consolidate
+  bool wasEmpty = tree_.size() == 0;
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (!keep[i]) {
+      continue;
+    }
+    auto& p = items[i];
+    if (!wasEmpty) {
+      auto target_p = tree_.search(p->path);
+      if (target_p) {
+        consolidateItem(target_p->get(), p->flags, std::move(p->stat));
+        continue;
+      }
+      if (isObsoletedByContainingDir(p->path)) {
+        continue;
+      }
+      maybePruneObsoletedChildren(p->path, p->flags);
+    }
+    tree_.insert(p->path, p);
+    linkHead(std::move(p));
+  }
+}
+
 std::shared_ptr<watchman_pending_fs> PendingCollectionBase::stealItems() {
   tree_.clear();
+  possibleCookie_ = false;
   return std::move(pending_);
 }
 
@@ -324,30 +485,95 @@ bool PendingCollectionBase::checkAndResetPinged() {
 }
 
 PendingCollection::PendingCollection()
-    : folly::Synchronized<PendingCollectionBase, std::mutex>(
-          PendingCollectionBase(cond_, pinged_)),
+    : folly::Synchronized<PendingCollectionBase, PendingMutex>(
+          PendingCollectionBase(cond_, pinged_, wakeHook_)),
       pinged_(false) {}
 
+PendingCollection::~PendingCollection() {
+  auto chain = queue_.exchange(nullptr, std::memory_order_acquire);
+  while (chain) {
+    auto next = chain->next;
+    delete chain;
+    chain = next;
+  }
+}
+
 PendingCollection::LockedPtr PendingCollection::lockAndWait(
     std::chrono::milliseconds timeoutms,
     bool& pinged) {
   auto lock = this->lock();
 
-  if (lock->checkAndResetPinged()) {
+  if (lock->checkAndResetPinged() || hasQueued()) {
     pinged = true;
     return lock;
   }
 
+  // folly only exposes the std::unique_lock of a std::mutex, so the wait
+  // releases and reacquires the lock through the LockedPtr instead
+  struct Relocker {
+    LockedPtr& locked;
+    folly::Optional<decltype(std::declval<LockedPtr&>().scopedUnlock())>
+        unlocked;
+
+    void unlock() {
+      unlocked.emplace(locked.scopedUnlock());
+    }
+    void lock() {
+      unlocked.clear();
+    }
+  } relocker{lock, folly::none};
+
   if (timeoutms.count() == -1) {
-    cond_.wait(lock.getUniqueLock());
+    cond_.wait(relocker);
   } else {
-    cond_.wait_for(lock.getUniqueLock(), timeoutms);
+    cond_.wait_for(relocker, timeoutms);
   }
 
-  pinged = lock->checkAndResetPinged();
+  pinged = lock->checkAndResetPinged() || hasQueued();
 
   return lock;
 }
 
+void PendingCollection::enqueue(std::shared_ptr<watchman_pending_fs> items) {
+  if (!items) {
+    return;
+  }
+  auto chain = new QueuedChain{std::move(items), nullptr};
+  // Once the chain is published the consumer may take and free it, so
+  // we must only look at our copy of the head from here on
+  auto head = queue_.load(std::memory_order_relaxed);
+  do {
+    chain->next = head;
+  } while (!queue_.compare_exchange_weak(
+      head, chain, std::memory_order_release, std::memory_order_relaxed));
+
+  if (!head) {
+    // The consumer may have seen an empty queue and be about to wait;
+    // by pinging under the lock we either happen before its check or
+    // wake it from its wait.
+    this->lock()->ping();
+  }
+}
+
+std::vector<std::shared_ptr<watchman_pending_fs>>
+PendingCollection::takeQueued() {
+  std::vector<std::shared_ptr<watchman_pending_fs>> chains;
+  // Taking the whole stack at once means that there is no ABA hazard
+  auto chain = queue_.exchange(nullptr, std::memory_order_acquire);
+  while (chain) {
+    chains.push_back(std::move(chain->items));
+    auto next = chain->next;
+    delete chain;
+    chain = next;
+  }
+  // The stack is newest first
+  std::reverse(chains.begin(), chains.end());
+  return chains;
+}
+
+bool PendingCollection::hasQueued() const {
+  return queue_.load(std::memory_order_acquire) != nullptr;
+}
+
 /* vim:ts=2:sw=2:et:
  */
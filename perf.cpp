@@ -3,11 +3,16 @@
 
 #include "watchman_system.h"
 #include "watchman.h"
-#include <folly/Synchronized.h>
-#include <condition_variable>
+#include <folly/MPMCQueue.h>
+#include <folly/Random.h>
+#include <algorithm>
+#include <atomic>
 #include <thread>
 #include "ChildProcess.h"
 #include "Logging.h"
+#include "PerfAlarms.h"
+#include "PerfStats.h"
+#include "Pipe.h"
 #include "watchman_perf.h"
 
 using namespace watchman;
@@ -15,22 +20,54 @@ using Options = ChildProcess::Options;
 using Environment = ChildProcess::Environment;
 
 namespace {
+// How long to wait before respawning a streaming logger that exited or
+// could not be spawned; samples are dropped in the meantime
+constexpr std::chrono::seconds kRespawnDelay(5);
+
+// What happened to the samples that were to be passed to
+// perf_logger_command.  These outlive the thread, so that they can be
+// reported without starting it.
+struct LoggerCounters {
+  std::atomic<uint64_t> queued{0};
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> sampledOut{0};
+  std::atomic<uint64_t> logged{0};
+  std::atomic<uint64_t> failed{0};
+  std::atomic<uint64_t> spawned{0};
+};
+LoggerCounters loggerCounters;
+
+// Feeds the samples that are to be logged to perf_logger_command.  They
+// are queued in a bounded queue, so that a slow logger can't make them
+// accumulate without limit; when it is full, samples are dropped and
+// counted.  The logger is either spawned once per batch of samples, with
+// the samples as its arguments, or, with perf_logger_command_streaming,
+// spawned once and fed one JSON encoded sample per line on its stdin.
 class PerfLogThread {
-  struct State {
-    explicit State(bool start) : running(start) {}
-
-    bool running;
-    json_ref samples;
-  };
-
-  folly::Synchronized<State, std::mutex> state_;
+  // An empty sample tells the thread to stop once it has logged the
+  // samples that were queued before it
+  folly::MPMCQueue<std::string> queue_;
+  std::atomic<bool> running_;
   std::thread thread_;
-  std::condition_variable cond_;
+
+  // Only used by the thread
+  json_ref perfCmd_;
+  w_string stateDir_;
+  std::unique_ptr<ChildProcess> logger_;
+  FileDescriptor loggerStdin_;
+  std::chrono::steady_clock::time_point nextSpawn_;
 
   void loop() noexcept;
+  Options loggerOptions() const;
+  void spawnBatch(const std::vector<std::string>& batch);
+  bool writeToLogger(const std::string& sample);
+  void stopLogger();
 
  public:
-  explicit PerfLogThread(bool start) : state_(folly::in_place, start) {
+  explicit PerfLogThread(bool start)
+      : queue_(std::max<json_int_t>(
+            1, cfg_get_int("perf_logger_queue_max_samples", 1024))),
+        running_(start) {
     if (start) {
       thread_ = std::thread([this] { loop(); });
     }
@@ -41,24 +78,19 @@ class PerfLogThread {
   }
 
   void stop() {
-    {
-      auto state = state_.lock();
-      if (!state->running) {
-        return;
-      }
-      state->running = false;
+    if (!running_.exchange(false)) {
+      return;
     }
-    cond_.notify_all();
+    queue_.blockingWrite(std::string());
     thread_.join();
   }
 
-  void addSample(json_ref&& sample) {
-    auto wlock = state_.lock();
-    if (!wlock->samples) {
-      wlock->samples = json_array();
+  void addSample(std::string&& sample) {
+    if (queue_.write(std::move(sample))) {
+      ++loggerCounters.queued;
+    } else {
+      ++loggerCounters.dropped;
     }
-    json_array_append_new(wlock->samples, std::move(sample));
-    cond_.notify_one();
   }
 };
 
@@ -68,6 +100,19 @@ PerfLogThread& getPerfThread(bool start = true) {
   static PerfLogThread perfThread(start);
   return perfThread;
 }
+
+// Returns the fraction of the samples with the given description that
+// are passed to perf_logger_command
+double perfLoggerSampleRate(const char* description) {
+  auto rate = cfg_get_json("perf_logger_sample_rate");
+  if (!rate) {
+    return 1.0;
+  }
+  if (rate.isNumber()) {
+    return json_number_value(rate);
+  }
+  return json_number_value(rate.get_default(description, json_real(1.0)));
+}
 } // namespace
 
 watchman_perf_sample::watchman_perf_sample(const char* description)
@@ -78,7 +123,31 @@ watchman_perf_sample::watchman_perf_sample(const char* description)
 #endif
 }
 
+watchman_perf_sample::~watchman_perf_sample() {
+  if (!finished) {
+    return;
+  }
+  PerfStats::Usage total;
+#ifdef HAVE_SYS_RESOURCE_H
+  auto micros = [](const struct timeval& tv) {
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec;
+  };
+  total.userTimeUs = micros(usage.ru_utime);
+  total.systemTimeUs = micros(usage.ru_stime);
+  total.minorFaults = usage.ru_minflt;
+  total.majorFaults = usage.ru_majflt;
+  total.blockInputs = usage.ru_inblock;
+  total.blockOutputs = usage.ru_oublock;
+  total.voluntarySwitches = usage.ru_nvcsw;
+  total.involuntarySwitches = usage.ru_nivcsw;
+#endif
+  auto wallTimeUs = uint64_t(duration.tv_sec) * 1000000 + duration.tv_usec;
+  PerfStats::get().record(description, root_path, wallTimeUs, total);
+  PerfAlarms::sample(description, root_path, wallTimeUs);
+}
+
 bool watchman_perf_sample::finish() {
+  finished = true;
   gettimeofday(&time_end, nullptr);
   w_timeval_sub(time_end, time_begin, &duration);
 #ifdef HAVE_SYS_RESOURCE_H
@@ -136,9 +205,17 @@ void watchman_perf_sample::add_root_meta(
   // Note: if the root lock isn't held, we may read inaccurate numbers for
   // some of these properties.  We're ok with that, and don't want to force
   // the root lock to be re-acquired just for this.
+  int recrawlCount;
+  int recoveryCount;
+  {
+    auto info = root->recrawlInfo.rlock();
+    recrawlCount = info->recrawlCount;
+    recoveryCount = info->recoveryCount;
+  }
   auto meta = json_object(
       {{"path", w_string_to_json(root->root_path)},
-       {"recrawl_count", json_integer(root->recrawlInfo.rlock()->recrawlCount)},
+       {"recrawl_count", json_integer(recrawlCount)},
+       {"overflow_recovery_count", json_integer(recoveryCount)},
        {"case_sensitive",
         json_boolean(root->case_sensitive == CaseSensitivity::CaseSensitive)}});
 
@@ -150,6 +227,11 @@ void watchman_perf_sample::add_root_meta(
   }
 
   add_meta("root", std::move(meta));
+  root_path = root->root_path;
+}
+
+void watchman_perf_sample::set_root(const std::shared_ptr<w_root_t>& root) {
+  root_path = root->root_path;
 }
 
 void watchman_perf_sample::set_wall_time_thresh(double thresh) {
@@ -161,80 +243,140 @@ void watchman_perf_sample::force_log() {
 }
 
 void PerfLogThread::loop() noexcept {
-  json_ref samples;
-  json_ref perf_cmd;
-  int64_t sample_batch;
-
   w_set_thread_name("perflog");
 
-  auto stateDir = w_string_piece(watchman_state_file).dirName().asWString();
+  stateDir_ = w_string_piece(watchman_state_file).dirName().asWString();
 
-  perf_cmd = cfg_get_json("perf_logger_command");
-  if (perf_cmd.isString()) {
-    perf_cmd = json_array({perf_cmd});
+  perfCmd_ = cfg_get_json("perf_logger_command");
+  if (perfCmd_.isString()) {
+    perfCmd_ = json_array({perfCmd_});
   }
-  if (!perf_cmd.isArray()) {
+  if (!perfCmd_.isArray()) {
     logf(
         FATAL,
         "perf_logger_command must be either a string or an array of strings\n");
   }
 
-  sample_batch = cfg_get_int("perf_logger_command_max_samples_per_call", 4);
+  auto streaming = cfg_get_bool("perf_logger_command_streaming", false);
+  size_t sampleBatch = std::max<json_int_t>(
+      1, cfg_get_int("perf_logger_command_max_samples_per_call", 4));
 
-  while (true) {
-    {
-      auto state = state_.lock();
-      while (true) {
-        if (state->samples) {
-          // We found samples to process
-          break;
-        }
-        if (!state->running) {
-          // No samples remaining, and we have been asked to quit.
-          return;
-        }
-        cond_.wait(state.getUniqueLock());
+  bool stopping = false;
+  while (!stopping) {
+    std::string sample;
+    queue_.blockingRead(sample);
+    if (sample.empty()) {
+      break;
+    }
+
+    if (streaming) {
+      if (writeToLogger(sample)) {
+        ++loggerCounters.logged;
+      } else {
+        ++loggerCounters.failed;
       }
+      continue;
+    }
 
-      samples = nullptr;
-      std::swap(samples, state->samples);
+    std::vector<std::string> batch;
+    batch.push_back(std::move(sample));
+    while (batch.size() < sampleBatch && queue_.read(sample)) {
+      if (sample.empty()) {
+        stopping = true;
+        break;
+      }
+      batch.push_back(std::move(sample));
     }
+    spawnBatch(batch);
+  }
 
-    if (samples) {
-      while (json_array_size(samples) > 0) {
-        int i = 0;
-        auto cmd = json_array();
-
-        json_array_extend(cmd, perf_cmd);
-
-        while (i < sample_batch && json_array_size(samples) > 0) {
-          try {
-            auto stringy = json_dumps(json_array_get(samples, 0), 0);
-            json_array_append_new(
-                cmd, typed_string_to_json(stringy.c_str(), W_STRING_MIXED));
-          } catch (const std::runtime_error&) {
-          }
-          json_array_remove(samples, 0);
-          i++;
-        }
+  stopLogger();
+}
 
-        ChildProcess::Options opts;
-        opts.environment().set({{"WATCHMAN_STATE_DIR", stateDir},
-                                {"WATCHMAN_SOCK", get_sock_name_legacy()}});
-        opts.open(STDIN_FILENO, "/dev/null", O_RDONLY, 0666);
-        opts.open(STDOUT_FILENO, "/dev/null", O_WRONLY, 0666);
-        opts.open(STDERR_FILENO, "/dev/null", O_WRONLY, 0666);
-
-        try {
-          ChildProcess proc(cmd, std::move(opts));
-          proc.wait();
-        } catch (const std::exception& exc) {
-          watchman::log(
-              watchman::ERR, "failed to spawn perf logger: ", exc.what(), "\n");
-        }
+Options PerfLogThread::loggerOptions() const {
+  Options opts;
+  opts.environment().set({{"WATCHMAN_STATE_DIR", stateDir_},
+                          {"WATCHMAN_SOCK", get_sock_name_legacy()}});
+  opts.open(STDOUT_FILENO, "/dev/null", O_WRONLY, 0666);
+  opts.open(STDERR_FILENO, "/dev/null", O_WRONLY, 0666);
+  return opts;
+}
+
+void PerfLogThread::spawnBatch(const std::vector<std::string>& batch) {
+  auto cmd = json_array();
+  json_array_extend(cmd, perfCmd_);
+  for (auto& sample : batch) {
+    json_array_append_new(
+        cmd, typed_string_to_json(sample.c_str(), W_STRING_MIXED));
+  }
+
+  auto opts = loggerOptions();
+  opts.open(STDIN_FILENO, "/dev/null", O_RDONLY, 0666);
+  try {
+    ChildProcess proc(cmd, std::move(opts));
+    ++loggerCounters.spawned;
+    proc.wait();
+    loggerCounters.logged += batch.size();
+  } catch (const std::exception& exc) {
+    loggerCounters.failed += batch.size();
+    watchman::log(
+        watchman::ERR, "failed to spawn perf logger: ", exc.what(), "\n");
+  }
+}
+
+bool PerfLogThread::writeToLogger(const std::string& sample) {
+  if (!logger_) {
+    if (std::chrono::steady_clock::now() < nextSpawn_) {
+      return false;
+    }
+    Pipe pipe;
+    pipe.write.clearNonBlock();
+    auto opts = loggerOptions();
+    opts.dup2(pipe.read, STDIN_FILENO);
+    try {
+      logger_ = std::make_unique<ChildProcess>(perfCmd_, std::move(opts));
+    } catch (const std::exception& exc) {
+      watchman::log(
+          watchman::ERR, "failed to spawn perf logger: ", exc.what(), "\n");
+      nextSpawn_ = std::chrono::steady_clock::now() + kRespawnDelay;
+      return false;
+    }
+    ++loggerCounters.spawned;
+    loggerStdin_ = std::move(pipe.write);
+  }
+
+  auto line = sample + "\n";
+  const char* buf = line.data();
+  size_t remaining = line.size();
+  while (remaining > 0) {
+    auto res = loggerStdin_.write(buf, int(remaining));
+    if (res.hasError()) {
+      if (res.error() == std::errc::interrupted) {
+        continue;
       }
+      watchman::log(
+          watchman::ERR,
+          "perf logger stopped reading its samples: ",
+          res.error().message(),
+          "\n");
+      stopLogger();
+      nextSpawn_ = std::chrono::steady_clock::now() + kRespawnDelay;
+      return false;
     }
+    buf += res.value();
+    remaining -= res.value();
+  }
+  return true;
+}
+
+void PerfLogThread::stopLogger() {
+  if (!logger_) {
+    return;
   }
+  // Closing its stdin tells the logger that there are no more samples
+  loggerStdin_.close();
+  logger_->wait();
+  logger_.reset();
 }
 
 void watchman_perf_sample::log() {
@@ -273,12 +415,27 @@ void watchman_perf_sample::log() {
 
   // Send this to our logging thread for async processing
   auto& perfThread = getPerfThread();
-  perfThread.addSample(std::move(info));
+  auto rate = perfLoggerSampleRate(description);
+  if (rate < 1.0 && folly::Random::randDouble01() >= rate) {
+    ++loggerCounters.sampledOut;
+    return;
+  }
+  perfThread.addSample(std::move(dumped));
 }
 
 void perf_shutdown() {
   getPerfThread(false).stop();
 }
 
+json_ref perf_logger_stats() {
+  return json_object(
+      {{"queued", json_integer(loggerCounters.queued.load())},
+       {"dropped", json_integer(loggerCounters.dropped.load())},
+       {"sampled_out", json_integer(loggerCounters.sampledOut.load())},
+       {"logged", json_integer(loggerCounters.logged.load())},
+       {"failed", json_integer(loggerCounters.failed.load())},
+       {"spawned", json_integer(loggerCounters.spawned.load())}});
+}
+
 /* vim:ts=2:sw=2:et:
  */
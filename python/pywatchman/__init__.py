@@ -37,7 +37,7 @@ import subprocess
 import sys
 import time
 
-from . import capabilities, compat, encoding, load
+from . import capabilities, compat, compression, encoding, load, sharedmem
 
 
 # Sometimes it's really hard to get Python extensions to compile,
@@ -295,6 +295,11 @@ class SocketTransport(Transport):
 
     sock = None
     timeout = None
+    # Whether descriptors can be received through the socket
+    can_receive_fds = False
+    # Once set to a list, descriptors received through the socket are
+    # appended to it
+    fds = None
 
     def __init__(self):
         pass
@@ -303,6 +308,8 @@ class SocketTransport(Transport):
         if self.sock:
             self.sock.close()
             self.sock = None
+        while self.fds:
+            os.close(self.fds.pop())
 
     def setTimeout(self, value):
         self.timeout = value
@@ -310,7 +317,10 @@ class SocketTransport(Transport):
 
     def readBytes(self, size):
         try:
-            buf = [self.sock.recv(size)]
+            if self.fds is not None:
+                buf = [sharedmem.recv(self.sock, size, self.fds)]
+            else:
+                buf = [self.sock.recv(size)]
             if not buf[0]:
                 raise WatchmanError("empty watchman response")
             return buf[0]
@@ -328,6 +338,8 @@ class SocketTransport(Transport):
 class UnixSocketTransport(SocketTransport):
     """ local unix domain socket transport """
 
+    can_receive_fds = sharedmem.available()
+
     def __init__(self, sockpath, timeout):
         super(UnixSocketTransport, self).__init__()
         self.sockpath = sockpath
@@ -758,7 +770,18 @@ class Bser2WithFallbackCodec(BserCodec):
         else:
             bserv2_key = "optional"
 
-        self.send(["version", {bserv2_key: ["bser-v2"]}])
+        # BSER v3 compresses the names in the responses, where the server
+        # supports it
+        capabilities = {"optional": ["bser-v3"]}
+        capabilities.setdefault(bserv2_key, []).append("bser-v2")
+        if compression.capabilities():
+            # Large responses can be compressed, where the server supports it
+            capabilities["optional"].append("bser-compression")
+        if getattr(transport, "can_receive_fds", False):
+            # Large responses can be mapped from shared memory, where the
+            # server supports it
+            capabilities["optional"].append("bser-shared-memory")
+        self.send(["version", capabilities])
 
         capabilities = self.receive()
 
@@ -768,21 +791,46 @@ class Bser2WithFallbackCodec(BserCodec):
                 "upgrade your watchman server."
             )
 
-        if capabilities["capabilities"]["bser-v2"]:
+        if capabilities["capabilities"].get("bser-v3"):
+            self.bser_version = 3
+            self.bser_capabilities = 0
+        elif capabilities["capabilities"]["bser-v2"]:
             self.bser_version = 2
             self.bser_capabilities = 0
         else:
             self.bser_version = 1
             self.bser_capabilities = 0
 
+        if self.bser_version >= 2 and capabilities["capabilities"].get(
+            "bser-compression"
+        ):
+            self.bser_capabilities |= compression.capabilities()
+        if self.bser_version >= 2 and capabilities["capabilities"].get(
+            "bser-shared-memory"
+        ):
+            self.transport.fds = []
+            self.bser_capabilities |= sharedmem.BSER_CAP_SHARED_MEMORY
+
     def receive(self):
         buf = [self.transport.readBytes(sniff_len)]
         if not buf[0]:
             raise WatchmanError("empty watchman response")
 
-        recv_bser_version, recv_bser_capabilities, elen = bser.pdu_info(buf[0])
+        compressed = compression.is_compressed(buf[0])
+        shared = sharedmem.is_shared_memory(buf[0])
+        if compressed:
+            elen = compression.pdu_len(buf[0])
+        elif shared:
+            # The descriptor may have cut the first read short
+            while len(buf[0]) < sharedmem.header_len(buf[0]):
+                buf[0] += self.transport.readBytes(
+                    sharedmem.header_len(buf[0]) - len(buf[0])
+                )
+            elen = sharedmem.pdu_len(buf[0])
+        else:
+            recv_bser_version, recv_bser_capabilities, elen = bser.pdu_info(buf[0])
 
-        if hasattr(self, "bser_version"):
+        if hasattr(self, "bser_version") and not compressed and not shared:
             # Readjust BSER version and capabilities if necessary
             self.bser_version = max(self.bser_version, recv_bser_version)
             self.capabilities = self.bser_capabilities & recv_bser_capabilities
@@ -794,6 +842,12 @@ class Bser2WithFallbackCodec(BserCodec):
 
         response = b"".join(buf)
         try:
+            if compressed:
+                response = compression.decompress(response)
+            elif shared:
+                if not self.transport.fds:
+                    raise ValueError("shared memory PDU came without a descriptor")
+                response = sharedmem.load(response, self.transport.fds.pop(0))
             res = self._loads(response)
             return res
         except ValueError as e:
@@ -869,6 +923,8 @@ class client(object):
     tport = None
     useImmutableBser = None
     pid = None
+    # Whether the service supports tagged requests; None until it is asked
+    taggedRequests = None
 
     def __init__(
         self,
@@ -1085,10 +1141,19 @@ class client(object):
         so care should be taken when making changes here.
         """
 
+        result = self._receive()
+        if self._hasprop(result, "error"):
+            raise CommandError(result["error"])
+        return result
+
+    def _receive(self):
+        """ receive the next PDU, buffering it if it is a unilateral log or
+        subscription PDU, without raising for an error response """
+
         self._connect()
         result = self.recvConn.receive()
         if self._hasprop(result, "error"):
-            raise CommandError(result["error"])
+            return result
 
         if self._hasprop(result, "log"):
             self.logs.append(result["log"])
@@ -1196,6 +1261,65 @@ class client(object):
             ex.setCommand(args)
             raise
 
+    def query_batch(self, *commands):
+        """ Send several commands to the watchman service and return the list
+        of their responses, in the same order as the commands
+
+        Where the service supports tagged requests, all of the commands are
+        sent before any of their responses are read, and the service may run
+        them concurrently.  Otherwise each command is sent once the response
+        to the one before it has been received, as with query.  Each command
+        is a list or tuple of the arguments that would be passed to query.
+        If any of the commands fail, CommandError is raised for the first of
+        them once all of the responses have been received.
+        """
+
+        if self.taggedRequests is None:
+            if self.transport == CLIProcessTransport:
+                # The CLI only takes a single command
+                self.taggedRequests = False
+            else:
+                res = self.capabilityCheck(optional=["tagged-requests"])
+                self.taggedRequests = bool(res["capabilities"]["tagged-requests"])
+        if not self.taggedRequests:
+            return [self.query(*command) for command in commands]
+
+        log("calling client.query_batch")
+        self._connect()
+        try:
+            for tag, command in enumerate(commands):
+                self.sendConn.send({"tag": tag, "command": list(command)})
+
+            responses = [None] * len(commands)
+            remaining = len(commands)
+            while remaining:
+                res = self._receive()
+                if not self._hasprop(res, "tag"):
+                    if self._hasprop(res, "error"):
+                        raise CommandError(res["error"])
+                    # A unilateral response, which _receive has buffered
+                    continue
+                tag = res["tag"]
+                if not (0 <= tag < len(commands)) or responses[tag] is not None:
+                    raise WatchmanError("response has an unexpected tag %r" % tag)
+                responses[tag] = res
+                remaining -= 1
+        except EnvironmentError as ee:
+            raise WatchmanEnvironmentError(
+                "I/O error communicating with watchman daemon",
+                ee.errno,
+                ee.strerror,
+                commands,
+            )
+        except WatchmanError as ex:
+            ex.setCommand(commands)
+            raise
+
+        for command, res in zip(commands, responses):
+            if self._hasprop(res, "error"):
+                raise CommandError(res["error"], command)
+        return responses
+
     def capabilityCheck(self, optional=None, required=None):
         """ Perform a server capability check """
         res = self.query(
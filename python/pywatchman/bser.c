@@ -69,6 +69,9 @@ typedef unsigned __int64 uint64_t;
 #define BSER_TEMPLATE  0x0b
 #define BSER_SKIP      0x0c
 #define BSER_UTF8STRING 0x0d
+#define BSER_STRING_DEFINE 0x0e
+#define BSER_STRING_REF 0x0f
+#define BSER_STRING_PREFIXED 0x10
 // clang-format on
 
 // An immutable object representation of BSER_OBJECT.
@@ -250,10 +253,21 @@ typedef struct loads_ctx {
   const char* value_errors;
   uint32_t bser_version;
   uint32_t bser_capabilities;
+  // The string dictionary of a BSER v3 PDU: the bytes of each string, and
+  // the value that was decoded from them
+  PyObject* strings;
+  PyObject* values;
+  // Set by loads(lazy=True), in which case arrays and templates are
+  // decoded into bserLazyArray proxies that read their items from this
+  // memoryview of the PDU
+  int lazy;
+  PyObject* buffer;
 } unser_ctx_t;
 
 static PyObject*
 bser_loads_recursive(const char** ptr, const char* end, const unser_ctx_t* ctx);
+static PyObject*
+bunser_lazy_array(const char** ptr, const char* end, const unser_ctx_t* ctx);
 
 static const char bser_true = BSER_TRUE;
 static const char bser_false = BSER_FALSE;
@@ -315,8 +329,14 @@ static int bser_init(bser_t* bser, uint32_t version, uint32_t capabilities) {
 // Version 2 also carries an integer indicating the capabilities. The
 // capabilities integer comes before the PDU size.
 #define EMPTY_HEADER_V2 "\x00\x02\x00\x00\x00\x00\x05\x00\x00\x00\x00"
+
+// Version 3 has the same header as version 2.  We don't compress the
+// strings that we send, so the body is the same too.
+#define EMPTY_HEADER_V3 "\x00\x03\x00\x00\x00\x00\x05\x00\x00\x00\x00"
   if (version == 2) {
     bser_append(bser, EMPTY_HEADER_V2, sizeof(EMPTY_HEADER_V2) - 1);
+  } else if (version == 3) {
+    bser_append(bser, EMPTY_HEADER_V3, sizeof(EMPTY_HEADER_V3) - 1);
   } else {
     bser_append(bser, EMPTY_HEADER, sizeof(EMPTY_HEADER) - 1);
   }
@@ -563,6 +583,7 @@ static PyObject* bser_dumps(PyObject* self, PyObject* args, PyObject* kw) {
     len = bser.wpos - (sizeof(EMPTY_HEADER) - 1);
     memcpy(bser.buf + 3, &len, sizeof(len));
   } else {
+    // Versions 2 and 3 have the same header
     len = bser.wpos - (sizeof(EMPTY_HEADER_V2) - 1);
     // The BSER capabilities block comes before the PDU length
     memcpy(bser.buf + 2, &bser_capabilities, sizeof(bser_capabilities));
@@ -583,6 +604,10 @@ int bunser_int(const char** ptr, const char* end, int64_t* val) {
   int32_t i32;
   int64_t i64;
 
+  if (buf >= end) {
+    PyErr_SetString(PyExc_ValueError, "input buffer to small for int encoding");
+    return 0;
+  }
   switch (buf[0]) {
     case BSER_INT8:
       needed = 2;
@@ -641,7 +666,7 @@ static int bunser_bytestring(
     return 0;
   }
 
-  if (buf + *len > end) {
+  if (*len < 0 || *len > end - buf) {
     PyErr_Format(PyExc_ValueError, "invalid string length in bser data");
     return 0;
   }
@@ -658,6 +683,10 @@ bunser_array(const char** ptr, const char* end, const unser_ctx_t* ctx) {
   int mutable = ctx->mutable;
   PyObject* res;
 
+  if (ctx->lazy) {
+    return bunser_lazy_array(ptr, end, ctx);
+  }
+
   // skip array header
   buf++;
   if (!bunser_int(&buf, end, &nitems)) {
@@ -775,16 +804,17 @@ bunser_object(const char** ptr, const char* end, const unser_ctx_t* ctx) {
   return res;
 }
 
-static PyObject*
-bunser_template(const char** ptr, const char* end, const unser_ctx_t* ctx) {
+// Loads the template keys that follow the template header at *ptr, and
+// the number of rows, leaving *ptr at the first row
+static PyObject* bunser_template_keys(
+    const char** ptr,
+    const char* end,
+    const unser_ctx_t* ctx,
+    int64_t* nitems) {
   const char* buf = *ptr;
-  int64_t nitems, i;
-  int mutable = ctx->mutable;
-  PyObject* arrval;
   PyObject* keys;
-  Py_ssize_t numkeys, keyidx;
   unser_ctx_t keys_ctx = {0};
-  if (mutable) {
+  if (ctx->mutable) {
     keys_ctx.mutable = 1;
     // Decode keys as UTF-8 in this case.
     keys_ctx.value_encoding = "utf-8";
@@ -794,7 +824,7 @@ bunser_template(const char** ptr, const char* end, const unser_ctx_t* ctx) {
     // lookup time.
   }
 
-  if (buf[1] != BSER_ARRAY) {
+  if (end - buf < 2 || buf[1] != BSER_ARRAY) {
     PyErr_Format(PyExc_ValueError, "Expect ARRAY to follow TEMPLATE");
     return NULL;
   }
@@ -810,72 +840,105 @@ bunser_template(const char** ptr, const char* end, const unser_ctx_t* ctx) {
     return NULL;
   }
 
-  numkeys = PySequence_Length(keys);
-
   // Load number of array elements
-  if (!bunser_int(ptr, end, &nitems)) {
+  if (!bunser_int(ptr, end, nitems)) {
     Py_DECREF(keys);
     return 0;
   }
 
-  if (nitems > LONG_MAX) {
+  if (*nitems > LONG_MAX) {
     PyErr_Format(PyExc_ValueError, "Too many items for python");
     Py_DECREF(keys);
     return NULL;
   }
+  return keys;
+}
 
-  arrval = PyList_New((Py_ssize_t)nitems);
-  if (!arrval) {
-    Py_DECREF(keys);
+// Loads the template row at *ptr, with the given keys, into a dict or a
+// bserObject
+static PyObject* bunser_template_row(
+    const char** ptr,
+    const char* end,
+    const unser_ctx_t* ctx,
+    PyObject* keys) {
+  Py_ssize_t numkeys = PySequence_Length(keys);
+  Py_ssize_t keyidx;
+  int mutable = ctx->mutable;
+  PyObject* dict = NULL;
+  bserObject* obj = NULL;
+
+  if (mutable) {
+    dict = PyDict_New();
+  } else {
+    obj = PyObject_New(bserObject, &bserObjectType);
+    if (obj) {
+      obj->keys = keys;
+      Py_INCREF(obj->keys);
+      obj->values = PyTuple_New(numkeys);
+    }
+    dict = (PyObject*)obj;
+  }
+  if (!dict) {
     return NULL;
   }
 
-  for (i = 0; i < nitems; i++) {
-    PyObject* dict = NULL;
-    bserObject* obj = NULL;
+  for (keyidx = 0; keyidx < numkeys; keyidx++) {
+    PyObject* key;
+    PyObject* ele;
 
-    if (mutable) {
-      dict = PyDict_New();
+    if (*ptr < end && **ptr == BSER_SKIP) {
+      *ptr = *ptr + 1;
+      ele = Py_None;
+      Py_INCREF(ele);
     } else {
-      obj = PyObject_New(bserObject, &bserObjectType);
-      if (obj) {
-        obj->keys = keys;
-        Py_INCREF(obj->keys);
-        obj->values = PyTuple_New(numkeys);
-      }
-      dict = (PyObject*)obj;
+      ele = bser_loads_recursive(ptr, end, ctx);
     }
-    if (!dict) {
-    fail:
-      Py_DECREF(keys);
-      Py_DECREF(arrval);
+
+    if (!ele) {
+      Py_DECREF(dict);
       return NULL;
     }
 
-    for (keyidx = 0; keyidx < numkeys; keyidx++) {
-      PyObject* key;
-      PyObject* ele;
+    if (mutable) {
+      key = PyList_GET_ITEM(keys, keyidx);
+      PyDict_SetItem(dict, key, ele);
+      Py_DECREF(ele);
+    } else {
+      PyTuple_SET_ITEM(obj->values, keyidx, ele);
+      // DECREF(ele) not required as SET_ITEM steals the ref
+    }
+  }
 
-      if (**ptr == BSER_SKIP) {
-        *ptr = *ptr + 1;
-        ele = Py_None;
-        Py_INCREF(ele);
-      } else {
-        ele = bser_loads_recursive(ptr, end, ctx);
-      }
+  return dict;
+}
 
-      if (!ele) {
-        goto fail;
-      }
+static PyObject*
+bunser_template(const char** ptr, const char* end, const unser_ctx_t* ctx) {
+  int64_t nitems, i;
+  PyObject* arrval;
+  PyObject* keys;
 
-      if (mutable) {
-        key = PyList_GET_ITEM(keys, keyidx);
-        PyDict_SetItem(dict, key, ele);
-        Py_DECREF(ele);
-      } else {
-        PyTuple_SET_ITEM(obj->values, keyidx, ele);
-        // DECREF(ele) not required as SET_ITEM steals the ref
-      }
+  if (ctx->lazy) {
+    return bunser_lazy_array(ptr, end, ctx);
+  }
+
+  keys = bunser_template_keys(ptr, end, ctx, &nitems);
+  if (!keys) {
+    return NULL;
+  }
+
+  arrval = PyList_New((Py_ssize_t)nitems);
+  if (!arrval) {
+    Py_DECREF(keys);
+    return NULL;
+  }
+
+  for (i = 0; i < nitems; i++) {
+    PyObject* dict = bunser_template_row(ptr, end, ctx, keys);
+    if (!dict) {
+      Py_DECREF(keys);
+      Py_DECREF(arrval);
+      return NULL;
     }
 
     PyList_SET_ITEM(arrval, i, dict);
@@ -887,6 +950,114 @@ bunser_template(const char** ptr, const char* end, const unser_ctx_t* ctx) {
   return arrval;
 }
 
+// Makes the value of a string of the given BSER_BYTESTRING or
+// BSER_UTF8STRING type from its bytes
+static PyObject* bunser_string_value(
+    const char* start,
+    int64_t len,
+    char type,
+    const unser_ctx_t* ctx) {
+  if (len > LONG_MAX) {
+    PyErr_Format(PyExc_ValueError, "string too long for python");
+    return NULL;
+  }
+
+  if (type == BSER_UTF8STRING) {
+    return PyUnicode_Decode(start, (long)len, "utf-8", "strict");
+  }
+  if (ctx->value_encoding != NULL) {
+    return PyUnicode_Decode(
+        start, (long)len, ctx->value_encoding, ctx->value_errors);
+  }
+  return PyBytes_FromStringAndSize(start, (long)len);
+}
+
+static PyObject* bunser_dictionary_string(
+    const char** ptr,
+    const char* end,
+    const unser_ctx_t* ctx) {
+  const char* buf = *ptr;
+  char op = buf[0];
+  int64_t index = 0, prefix_len = 0, len;
+  const char* start;
+  char type;
+  PyObject *raw, *value;
+
+  if (!ctx->strings) {
+    PyErr_Format(
+        PyExc_ValueError,
+        "string dictionary opcode 0x%02x outside of a BSER v3 PDU",
+        op);
+    return NULL;
+  }
+
+  buf++;
+  if (op != BSER_STRING_DEFINE) {
+    if (!bunser_int(&buf, end, &index)) {
+      return NULL;
+    }
+    if (index < 0 || index >= PyList_GET_SIZE(ctx->strings)) {
+      PyErr_Format(PyExc_ValueError, "invalid string reference in bser data");
+      return NULL;
+    }
+  }
+
+  if (op == BSER_STRING_REF) {
+    *ptr = buf;
+    value = PyList_GET_ITEM(ctx->values, (Py_ssize_t)index);
+    Py_INCREF(value);
+    return value;
+  }
+
+  if (op == BSER_STRING_PREFIXED) {
+    if (!bunser_int(&buf, end, &prefix_len)) {
+      return NULL;
+    }
+    if (prefix_len < 0 ||
+        prefix_len > PyBytes_GET_SIZE(
+                         PyList_GET_ITEM(ctx->strings, (Py_ssize_t)index))) {
+      PyErr_Format(PyExc_ValueError, "invalid string prefix in bser data");
+      return NULL;
+    }
+  }
+
+  type = buf[0];
+  if (type != BSER_BYTESTRING && type != BSER_UTF8STRING) {
+    PyErr_Format(PyExc_ValueError, "expected a string in bser data");
+    return NULL;
+  }
+  if (!bunser_bytestring(&buf, end, &start, &len)) {
+    return NULL;
+  }
+  *ptr = buf;
+
+  if (op == BSER_STRING_PREFIXED) {
+    PyObject* prefix_of = PyList_GET_ITEM(ctx->strings, (Py_ssize_t)index);
+    raw = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)(prefix_len + len));
+    if (!raw) {
+      return NULL;
+    }
+    memcpy(PyBytes_AS_STRING(raw), PyBytes_AS_STRING(prefix_of), prefix_len);
+    memcpy(PyBytes_AS_STRING(raw) + prefix_len, start, len);
+  } else {
+    raw = PyBytes_FromStringAndSize(start, (Py_ssize_t)len);
+    if (!raw) {
+      return NULL;
+    }
+  }
+
+  value = bunser_string_value(
+      PyBytes_AS_STRING(raw), PyBytes_GET_SIZE(raw), type, ctx);
+  if (!value || PyList_Append(ctx->strings, raw) ||
+      PyList_Append(ctx->values, value)) {
+    Py_DECREF(raw);
+    Py_XDECREF(value);
+    return NULL;
+  }
+  Py_DECREF(raw);
+  return value;
+}
+
 static PyObject* bser_loads_recursive(
     const char** ptr,
     const char* end,
@@ -935,27 +1106,7 @@ static PyObject* bser_loads_recursive(
       Py_INCREF(Py_None);
       return Py_None;
 
-    case BSER_BYTESTRING: {
-      const char* start;
-      int64_t len;
-
-      if (!bunser_bytestring(ptr, end, &start, &len)) {
-        return NULL;
-      }
-
-      if (len > LONG_MAX) {
-        PyErr_Format(PyExc_ValueError, "string too long for python");
-        return NULL;
-      }
-
-      if (ctx->value_encoding != NULL) {
-        return PyUnicode_Decode(
-            start, (long)len, ctx->value_encoding, ctx->value_errors);
-      } else {
-        return PyBytes_FromStringAndSize(start, (long)len);
-      }
-    }
-
+    case BSER_BYTESTRING:
     case BSER_UTF8STRING: {
       const char* start;
       int64_t len;
@@ -964,14 +1115,14 @@ static PyObject* bser_loads_recursive(
         return NULL;
       }
 
-      if (len > LONG_MAX) {
-        PyErr_Format(PyExc_ValueError, "string too long for python");
-        return NULL;
-      }
-
-      return PyUnicode_Decode(start, (long)len, "utf-8", "strict");
+      return bunser_string_value(start, len, buf[0], ctx);
     }
 
+    case BSER_STRING_DEFINE:
+    case BSER_STRING_REF:
+    case BSER_STRING_PREFIXED:
+      return bunser_dictionary_string(ptr, end, ctx);
+
     case BSER_ARRAY:
       return bunser_array(ptr, end, ctx);
 
@@ -988,6 +1139,438 @@ static PyObject* bser_loads_recursive(
   return NULL;
 }
 
+// Moves *ptr past the value that it points at, without decoding it.  This
+// doesn't understand the string dictionary of BSER v3, which is why lazy
+// loads of v3 PDUs are done eagerly.
+static int bunser_skip(const char** ptr, const char* end) {
+  const char* buf = *ptr;
+  int64_t nitems, len, i;
+
+  if (buf >= end) {
+    PyErr_SetString(PyExc_ValueError, "input buffer too small for bser data");
+    return 0;
+  }
+
+  switch (buf[0]) {
+    case BSER_INT8:
+    case BSER_INT16:
+    case BSER_INT32:
+    case BSER_INT64:
+      return bunser_int(ptr, end, &len);
+
+    case BSER_REAL:
+      if (end - buf < 1 + (Py_ssize_t)sizeof(double)) {
+        PyErr_SetString(PyExc_ValueError, "input buffer too small for real");
+        return 0;
+      }
+      *ptr = buf + 1 + sizeof(double);
+      return 1;
+
+    case BSER_TRUE:
+    case BSER_FALSE:
+    case BSER_NULL:
+      *ptr = buf + 1;
+      return 1;
+
+    case BSER_BYTESTRING:
+    case BSER_UTF8STRING: {
+      const char* start;
+      return bunser_bytestring(ptr, end, &start, &len);
+    }
+
+    case BSER_ARRAY:
+      buf++;
+      if (!bunser_int(&buf, end, &nitems)) {
+        return 0;
+      }
+      *ptr = buf;
+      for (i = 0; i < nitems; i++) {
+        if (!bunser_skip(ptr, end)) {
+          return 0;
+        }
+      }
+      return 1;
+
+    case BSER_OBJECT:
+      buf++;
+      if (!bunser_int(&buf, end, &nitems)) {
+        return 0;
+      }
+      *ptr = buf;
+      for (i = 0; i < nitems; i++) {
+        if (!bunser_skip(ptr, end) || !bunser_skip(ptr, end)) {
+          return 0;
+        }
+      }
+      return 1;
+
+    case BSER_TEMPLATE: {
+      int64_t numkeys, keyidx;
+      if (end - buf < 2 || buf[1] != BSER_ARRAY) {
+        PyErr_Format(PyExc_ValueError, "Expect ARRAY to follow TEMPLATE");
+        return 0;
+      }
+      buf += 2;
+      if (!bunser_int(&buf, end, &numkeys)) {
+        return 0;
+      }
+      *ptr = buf;
+      for (keyidx = 0; keyidx < numkeys; keyidx++) {
+        if (!bunser_skip(ptr, end)) {
+          return 0;
+        }
+      }
+      if (!bunser_int(ptr, end, &nitems)) {
+        return 0;
+      }
+      for (i = 0; i < nitems * numkeys; i++) {
+        if (*ptr < end && **ptr == BSER_SKIP) {
+          *ptr = *ptr + 1;
+        } else if (!bunser_skip(ptr, end)) {
+          return 0;
+        }
+      }
+      return 1;
+    }
+
+    default:
+      PyErr_Format(PyExc_ValueError, "unhandled bser opcode 0x%02x", buf[0]);
+      return 0;
+  }
+}
+
+// The result of loads(lazy=True) for an array or a template: a read only
+// sequence that keeps the PDU alive and decodes each item when it is
+// accessed, so that the memory used by a large response is that of the PDU
+// plus an offset per item, rather than a Python object per value.  Items
+// are decoded afresh on each access.
+// clang-format off
+typedef struct {
+  PyObject_HEAD
+  PyObject *buffer;     // memoryview of the PDU
+  PyObject *keys;       // template keys, or NULL for an array
+  Py_ssize_t nitems;
+  Py_ssize_t *offsets;  // where each item starts in the buffer
+  int mutable;
+  PyObject *value_encoding; // bytes, or NULL
+  PyObject *value_errors;   // bytes, or NULL
+} bserLazyArray;
+// clang-format on
+
+static Py_ssize_t bserlazy_length(PyObject* o) {
+  return ((bserLazyArray*)o)->nitems;
+}
+
+static PyObject* bserlazy_item(PyObject* o, Py_ssize_t i) {
+  bserLazyArray* arr = (bserLazyArray*)o;
+  Py_buffer* view = PyMemoryView_GET_BUFFER(arr->buffer);
+  const char* base = (const char*)view->buf;
+  const char* ptr;
+  unser_ctx_t ctx = {0};
+
+  if (i < 0 || i >= arr->nitems) {
+    PyErr_SetString(PyExc_IndexError, "bser array index out of range");
+    return NULL;
+  }
+
+  ctx.mutable = arr->mutable;
+  ctx.lazy = 1;
+  ctx.buffer = arr->buffer;
+  if (arr->value_encoding) {
+    ctx.value_encoding = PyBytes_AS_STRING(arr->value_encoding);
+    ctx.value_errors = PyBytes_AS_STRING(arr->value_errors);
+  }
+
+  ptr = base + arr->offsets[i];
+  if (arr->keys) {
+    return bunser_template_row(&ptr, base + view->len, &ctx, arr->keys);
+  }
+  return bser_loads_recursive(&ptr, base + view->len, &ctx);
+}
+
+static PyObject* bserlazy_subscript(PyObject* o, PyObject* key) {
+  bserLazyArray* arr = (bserLazyArray*)o;
+  Py_ssize_t i, start, stop, step, len;
+  PyObject* res;
+
+  if (PyIndex_Check(key)) {
+    i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+    if (i == -1 && PyErr_Occurred()) {
+      return NULL;
+    }
+    if (i < 0) {
+      i += arr->nitems;
+    }
+    return bserlazy_item(o, i);
+  }
+
+  if (!PySlice_Check(key)) {
+    PyErr_SetString(PyExc_TypeError, "bser array indices must be integers");
+    return NULL;
+  }
+#if PY_MAJOR_VERSION >= 3
+  if (PySlice_GetIndicesEx(key, arr->nitems, &start, &stop, &step, &len)) {
+#else
+  if (PySlice_GetIndicesEx(
+          (PySliceObject*)key, arr->nitems, &start, &stop, &step, &len)) {
+#endif
+    return NULL;
+  }
+  res = PyList_New(len);
+  if (!res) {
+    return NULL;
+  }
+  for (i = 0; i < len; i++) {
+    PyObject* ele = bserlazy_item(o, start + i * step);
+    if (!ele) {
+      Py_DECREF(res);
+      return NULL;
+    }
+    PyList_SET_ITEM(res, i, ele);
+  }
+  return res;
+}
+
+// Compares the items with those of other, as a list would
+static PyObject* bserlazy_richcompare(PyObject* o, PyObject* other, int op) {
+  bserLazyArray* arr = (bserLazyArray*)o;
+  PyObject* items;
+  PyObject* res;
+
+  items = arr->mutable ? PySequence_List(o) : PySequence_Tuple(o);
+  if (!items) {
+    return NULL;
+  }
+  if (PyObject_TypeCheck(other, Py_TYPE(o))) {
+    PyObject* other_items =
+        arr->mutable ? PySequence_List(other) : PySequence_Tuple(other);
+    if (!other_items) {
+      Py_DECREF(items);
+      return NULL;
+    }
+    res = PyObject_RichCompare(items, other_items, op);
+    Py_DECREF(other_items);
+  } else {
+    res = PyObject_RichCompare(items, other, op);
+  }
+  Py_DECREF(items);
+  return res;
+}
+
+static void bserlazy_dealloc(PyObject* o) {
+  bserLazyArray* arr = (bserLazyArray*)o;
+
+  Py_CLEAR(arr->buffer);
+  Py_CLEAR(arr->keys);
+  Py_CLEAR(arr->value_encoding);
+  Py_CLEAR(arr->value_errors);
+  PyMem_Free(arr->offsets);
+  PyObject_Del(o);
+}
+
+// clang-format off
+static PySequenceMethods bserlazy_sq = {
+  bserlazy_length,           /* sq_length */
+  0,                         /* sq_concat */
+  0,                         /* sq_repeat */
+  bserlazy_item,             /* sq_item */
+  0,                         /* sq_ass_item */
+  0,                         /* sq_contains */
+  0,                         /* sq_inplace_concat */
+  0                          /* sq_inplace_repeat */
+};
+
+static PyMappingMethods bserlazy_map = {
+  bserlazy_length,           /* mp_length */
+  bserlazy_subscript,        /* mp_subscript */
+  0                          /* mp_ass_subscript */
+};
+
+PyTypeObject bserLazyArrayType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  "bser_lazy_array",         /* tp_name */
+  sizeof(bserLazyArray),     /* tp_basicsize */
+  0,                         /* tp_itemsize */
+  bserlazy_dealloc,          /* tp_dealloc */
+  0,                         /* tp_print */
+  0,                         /* tp_getattr */
+  0,                         /* tp_setattr */
+  0,                         /* tp_compare */
+  0,                         /* tp_repr */
+  0,                         /* tp_as_number */
+  &bserlazy_sq,              /* tp_as_sequence */
+  &bserlazy_map,             /* tp_as_mapping */
+  0,                         /* tp_hash  */
+  0,                         /* tp_call */
+  0,                         /* tp_str */
+  0,                         /* tp_getattro */
+  0,                         /* tp_setattro */
+  0,                         /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,        /* tp_flags */
+  "bser lazy array",         /* tp_doc */
+  0,                         /* tp_traverse */
+  0,                         /* tp_clear */
+  bserlazy_richcompare,      /* tp_richcompare */
+  0,                         /* tp_weaklistoffset */
+  0,                         /* tp_iter */
+  0,                         /* tp_iternext */
+  0,                         /* tp_methods */
+  0,                         /* tp_members */
+  0,                         /* tp_getset */
+  0,                         /* tp_base */
+  0,                         /* tp_dict */
+  0,                         /* tp_descr_get */
+  0,                         /* tp_descr_set */
+  0,                         /* tp_dictoffset */
+  0,                         /* tp_init */
+  0,                         /* tp_alloc */
+  0,                         /* tp_new */
+};
+// clang-format on
+
+// Loads an array of byte strings, such as the files of a query for just
+// their names, straight into a list or tuple of bytes.  Returns NULL
+// without an exception, and leaves *ptr alone, if an item is not a byte
+// string.
+static PyObject* bunser_bytestring_array(
+    const char** ptr,
+    const char* end,
+    int64_t nitems,
+    int mutable) {
+  const char* buf = *ptr;
+  PyObject* res;
+  int64_t i;
+
+  res = mutable ? PyList_New((Py_ssize_t)nitems)
+                : PyTuple_New((Py_ssize_t)nitems);
+  if (!res) {
+    return NULL;
+  }
+  for (i = 0; i < nitems; i++) {
+    const char* start;
+    int64_t len;
+    PyObject* ele;
+
+    if (buf >= end || buf[0] != BSER_BYTESTRING) {
+      Py_DECREF(res);
+      return NULL;
+    }
+    if (!bunser_bytestring(&buf, end, &start, &len)) {
+      Py_DECREF(res);
+      return NULL;
+    }
+    ele = PyBytes_FromStringAndSize(start, (Py_ssize_t)len);
+    if (!ele) {
+      Py_DECREF(res);
+      return NULL;
+    }
+    if (mutable) {
+      PyList_SET_ITEM(res, (Py_ssize_t)i, ele);
+    } else {
+      PyTuple_SET_ITEM(res, (Py_ssize_t)i, ele);
+    }
+  }
+  *ptr = buf;
+  return res;
+}
+
+// Loads the array or template at *ptr into a bserLazyArray, finding where
+// each item starts without decoding it
+static PyObject*
+bunser_lazy_array(const char** ptr, const char* end, const unser_ctx_t* ctx) {
+  Py_buffer* view = PyMemoryView_GET_BUFFER(ctx->buffer);
+  const char* base = (const char*)view->buf;
+  const char* buf = *ptr;
+  PyObject* keys = NULL;
+  Py_ssize_t numkeys = 0, keyidx;
+  int64_t nitems, i;
+  bserLazyArray* arr;
+
+  if (buf[0] == BSER_TEMPLATE) {
+    keys = bunser_template_keys(&buf, end, ctx, &nitems);
+    if (!keys) {
+      return NULL;
+    }
+    numkeys = PySequence_Length(keys);
+    if (nitems < 0 || (numkeys > 0 && nitems > end - buf)) {
+      PyErr_Format(PyExc_ValueError, "invalid template length in bser data");
+      Py_DECREF(keys);
+      return NULL;
+    }
+  } else {
+    buf++;
+    if (!bunser_int(&buf, end, &nitems)) {
+      return NULL;
+    }
+    // Each item takes at least a byte, which bounds the offsets that we
+    // allocate below by the size of the PDU
+    if (nitems < 0 || nitems > end - buf) {
+      PyErr_Format(PyExc_ValueError, "invalid array length in bser data");
+      return NULL;
+    }
+    // Names are all that is sent for queries with a single name field, and
+    // there is no gain in deferring the decode of a single string
+    if (ctx->value_encoding == NULL && nitems > 0 && buf < end &&
+        buf[0] == BSER_BYTESTRING) {
+      PyObject* res =
+          bunser_bytestring_array(&buf, end, nitems, ctx->mutable);
+      if (res) {
+        *ptr = buf;
+        return res;
+      }
+      if (PyErr_Occurred()) {
+        return NULL;
+      }
+    }
+  }
+
+  arr = PyObject_New(bserLazyArray, &bserLazyArrayType);
+  if (!arr) {
+    Py_XDECREF(keys);
+    return NULL;
+  }
+  arr->buffer = ctx->buffer;
+  Py_INCREF(arr->buffer);
+  arr->keys = keys;
+  arr->nitems = (Py_ssize_t)nitems;
+  arr->mutable = ctx->mutable;
+  arr->value_encoding = NULL;
+  arr->value_errors = NULL;
+  arr->offsets = PyMem_New(Py_ssize_t, nitems > 0 ? nitems : 1);
+  if (!arr->offsets) {
+    Py_DECREF(arr);
+    return PyErr_NoMemory();
+  }
+  if (ctx->value_encoding) {
+    arr->value_encoding = PyBytes_FromString(ctx->value_encoding);
+    arr->value_errors = PyBytes_FromString(ctx->value_errors);
+    if (!arr->value_encoding || !arr->value_errors) {
+      Py_DECREF(arr);
+      return NULL;
+    }
+  }
+
+  for (i = 0; i < nitems; i++) {
+    arr->offsets[i] = buf - base;
+    if (keys) {
+      for (keyidx = 0; keyidx < numkeys; keyidx++) {
+        if (buf < end && buf[0] == BSER_SKIP) {
+          buf++;
+        } else if (!bunser_skip(&buf, end)) {
+          Py_DECREF(arr);
+          return NULL;
+        }
+      }
+    } else if (!bunser_skip(&buf, end)) {
+      Py_DECREF(arr);
+      return NULL;
+    }
+  }
+
+  *ptr = buf;
+  return (PyObject*)arr;
+}
+
 static int _pdu_info_helper(
     const char* data,
     const char* end,
@@ -1006,6 +1589,8 @@ static int _pdu_info_helper(
     bser_version = 1;
   } else if (memcmp(data, EMPTY_HEADER_V2, 2) == 0) {
     bser_version = 2;
+  } else if (memcmp(data, EMPTY_HEADER_V3, 2) == 0) {
+    bser_version = 3;
   } else {
     PyErr_SetString(PyExc_ValueError, "invalid bser header");
     return 0;
@@ -1013,10 +1598,10 @@ static int _pdu_info_helper(
 
   data += 2;
 
-  if (bser_version == 2) {
+  if (bser_version >= 2) {
     // Expect an integer telling us what capabilities are supported by the
     // remote server (currently unused).
-    if (!memcpy(&bser_capabilities, &data, sizeof(bser_capabilities))) {
+    if (!memcpy(&bser_capabilities, data, sizeof(bser_capabilities))) {
       return 0;
     }
     data += sizeof(bser_capabilities);
@@ -1095,8 +1680,10 @@ static PyObject* bser_pdu_len(PyObject* self, PyObject* args) {
 }
 
 static PyObject* bser_loads(PyObject* self, PyObject* args, PyObject* kw) {
+  // A buffer rather than a string, so that a PDU can be decoded in place
+  // from any bytes-like object, such as a mapping of shared memory
+  Py_buffer view;
   const char* data = NULL;
-  int datalen = 0;
   const char* start;
   const char* end;
   int64_t expected_len;
@@ -1104,29 +1691,34 @@ static PyObject* bser_loads(PyObject* self, PyObject* args, PyObject* kw) {
   PyObject* mutable_obj = NULL;
   const char* value_encoding = NULL;
   const char* value_errors = NULL;
+  PyObject* lazy_obj = NULL;
   unser_ctx_t ctx = {1, 0};
+  PyObject* res = NULL;
 
   static char* kw_list[] = {
-      "buf", "mutable", "value_encoding", "value_errors", NULL};
+      "buf", "mutable", "value_encoding", "value_errors", "lazy", NULL};
 
   (void)self;
 
   if (!PyArg_ParseTupleAndKeywords(
           args,
           kw,
-          "s#|Ozz:loads",
+          "s*|OzzO:loads",
           kw_list,
-          &start,
-          &datalen,
+          &view,
           &mutable_obj,
           &value_encoding,
-          &value_errors)) {
+          &value_errors,
+          &lazy_obj)) {
     return NULL;
   }
 
   if (mutable_obj) {
     ctx.mutable = PyObject_IsTrue(mutable_obj) > 0 ? 1 : 0;
   }
+  if (lazy_obj) {
+    ctx.lazy = PyObject_IsTrue(lazy_obj) > 0 ? 1 : 0;
+  }
   ctx.value_encoding = value_encoding;
   if (value_encoding == NULL) {
     ctx.value_errors = NULL;
@@ -1135,8 +1727,9 @@ static PyObject* bser_loads(PyObject* self, PyObject* args, PyObject* kw) {
   } else {
     ctx.value_errors = value_errors;
   }
+  start = (const char*)view.buf;
   data = start;
-  end = data + datalen;
+  end = data + view.len;
 
   if (!_pdu_info_helper(
           data,
@@ -1145,17 +1738,57 @@ static PyObject* bser_loads(PyObject* self, PyObject* args, PyObject* kw) {
           &ctx.bser_capabilities,
           &expected_len,
           &position)) {
-    return NULL;
+    goto done;
   }
 
   data = start + position;
   // Verify
   if (expected_len + data != end) {
     PyErr_SetString(PyExc_ValueError, "bser data len != header len");
-    return NULL;
+    goto done;
   }
 
-  return bser_loads_recursive(&data, end, &ctx);
+  if (ctx.bser_version == 3) {
+    ctx.strings = PyList_New(0);
+    ctx.values = PyList_New(0);
+    if (!ctx.strings || !ctx.values) {
+      goto done;
+    }
+  }
+
+  if (ctx.lazy && ctx.bser_version == 3) {
+    // The strings of a v3 PDU can refer to those before them, so they have
+    // to be decoded in order
+    ctx.lazy = 0;
+  } else if (ctx.lazy) {
+    // The lazy arrays hold on to the PDU through a memoryview of the object
+    // that was passed in, or of a copy if that can't be viewed, as with str
+    if (view.obj && PyObject_CheckBuffer(view.obj)) {
+      ctx.buffer = PyMemoryView_FromObject(view.obj);
+    } else {
+      PyObject* copy = PyBytes_FromStringAndSize(start, view.len);
+      if (copy) {
+        ctx.buffer = PyMemoryView_FromObject(copy);
+        Py_DECREF(copy);
+      }
+    }
+    if (!ctx.buffer) {
+      goto done;
+    }
+    // Decode from the memoryview, which the lazy arrays' offsets are from
+    start = (const char*)PyMemoryView_GET_BUFFER(ctx.buffer)->buf;
+    data = start + position;
+    end = start + view.len;
+  }
+
+  res = bser_loads_recursive(&data, end, &ctx);
+
+done:
+  Py_XDECREF(ctx.strings);
+  Py_XDECREF(ctx.values);
+  Py_XDECREF(ctx.buffer);
+  PyBuffer_Release(&view);
+  return res;
 }
 
 static PyObject* bser_load(PyObject* self, PyObject* args, PyObject* kw) {
@@ -1168,21 +1801,23 @@ static PyObject* bser_load(PyObject* self, PyObject* args, PyObject* kw) {
   PyObject* mutable_obj = NULL;
   PyObject* value_encoding = NULL;
   PyObject* value_errors = NULL;
+  PyObject* lazy_obj = NULL;
 
   static char* kw_list[] = {
-      "fp", "mutable", "value_encoding", "value_errors", NULL};
+      "fp", "mutable", "value_encoding", "value_errors", "lazy", NULL};
 
   (void)self;
 
   if (!PyArg_ParseTupleAndKeywords(
           args,
           kw,
-          "O|OOO:load",
+          "O|OOOO:load",
           kw_list,
           &fp,
           &mutable_obj,
           &value_encoding,
-          &value_errors)) {
+          &value_errors,
+          &lazy_obj)) {
     return NULL;
   }
 
@@ -1213,6 +1848,9 @@ static PyObject* bser_load(PyObject* self, PyObject* args, PyObject* kw) {
   if (value_errors) {
     PyDict_SetItemString(load_method_kwargs, "value_errors", value_errors);
   }
+  if (lazy_obj) {
+    PyDict_SetItemString(load_method_kwargs, "lazy", lazy_obj);
+  }
   string = PyObject_Call(load_method, load_method_args, load_method_kwargs);
   Py_DECREF(load_method_kwargs);
   Py_DECREF(load_method_args);
@@ -1251,6 +1889,7 @@ PyMODINIT_FUNC PyInit_bser(void) {
 
   mod = PyModule_Create(&bser_module);
   PyType_Ready(&bserObjectType);
+  PyType_Ready(&bserLazyArrayType);
 
   return mod;
 }
@@ -1259,6 +1898,7 @@ PyMODINIT_FUNC PyInit_bser(void) {
 PyMODINIT_FUNC initbser(void) {
   (void)Py_InitModule("bser", bser_methods);
   PyType_Ready(&bserObjectType);
+  PyType_Ready(&bserLazyArrayType);
 }
 #endif // PY_MAJOR_VERSION >= 3
 
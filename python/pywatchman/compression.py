@@ -0,0 +1,97 @@
+# Copyright 2020 Facebook, Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#  * Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+#
+#  * Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+#  * Neither the name Facebook nor the names of its contributors may be used to
+#    endorse or promote products derived from this software without specific
+#    prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+from .pybser import Bunser
+
+
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
+
+try:
+    import lz4.frame as lz4_frame
+except ImportError:
+    lz4_frame = None
+
+
+# The BSER v2 capabilities that ask the server to compress large responses
+BSER_CAP_COMPRESS_ZSTD = 0x4
+BSER_CAP_COMPRESS_LZ4 = 0x8
+
+COMPRESSED_MAGIC = b"\x00\x04"
+
+PDU_CODEC_ZSTD = 1
+PDU_CODEC_LZ4 = 2
+
+
+def capabilities():
+    """ Returns the compression capabilities for the codecs that can be
+        imported """
+    res = 0
+    if zstandard is not None:
+        res |= BSER_CAP_COMPRESS_ZSTD
+    if lz4_frame is not None:
+        res |= BSER_CAP_COMPRESS_LZ4
+    return res
+
+
+def is_compressed(buf):
+    return buf[0:2] == COMPRESSED_MAGIC
+
+
+def pdu_len(buf):
+    """ Returns the total length of the compressed PDU that starts buf """
+    if len(buf) < 7:
+        raise ValueError("Invalid compressed PDU header")
+    expected_len, pos = Bunser.unser_int(buf, 6)
+    return expected_len + pos
+
+
+def decompress(buf):
+    """ Returns the BSER v2 or v3 PDU that the compressed PDU buf holds """
+    expected_len, pos = Bunser.unser_int(buf, 6)
+    if len(buf) != expected_len + pos:
+        raise ValueError(
+            "compressed PDU len %d != header len %d" % (len(buf), expected_len + pos)
+        )
+    codec, pos = Bunser.unser_int(buf, pos)
+    size, pos = Bunser.unser_int(buf, pos)
+    data = buf[pos:]
+    if codec == PDU_CODEC_ZSTD and zstandard is not None:
+        pdu = zstandard.ZstdDecompressor().decompress(data, max_output_size=size)
+    elif codec == PDU_CODEC_LZ4 and lz4_frame is not None:
+        pdu = lz4_frame.decompress(data)
+    else:
+        raise ValueError("Unsupported PDU compression codec %d" % codec)
+    if len(pdu) != size:
+        raise ValueError("decompressed PDU len %d != header len %d" % (len(pdu), size))
+    return pdu
@@ -0,0 +1,93 @@
+# Copyright 2020 Facebook, Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#  * Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+#
+#  * Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+#  * Neither the name Facebook nor the names of its contributors may be used to
+#    endorse or promote products derived from this software without specific
+#    prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import collections
+
+from . import compat, encoding
+
+
+"""Decodes the names of query results that were returned with the
+packed_names query option."""
+
+
+MAGIC = b"WPN1"
+FLAG_FRESH_INSTANCE = 1
+FLAG_FRONT_CODED = 2
+
+PackedNames = collections.namedtuple(
+    "PackedNames", ["clock", "is_fresh_instance", "names"]
+)
+
+
+def _read_varint(buf, pos):
+    value = 0
+    shift = 0
+    while True:
+        byte = buf[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return value, pos
+        shift += 7
+
+
+def unpack(blob):
+    """Decodes the `files` of a response to a query that set packed_names.
+
+    blob may be the bytes, or the str that the client decoded them to with
+    its value encoding.  Returns a PackedNames whose names are bytes."""
+    if compat.PYTHON3 and isinstance(blob, str):
+        blob = encoding.encode_local(blob)
+    buf = bytearray(blob)
+    if bytes(buf[:4]) != MAGIC:
+        raise ValueError("not a packed names blob")
+    flags = buf[4]
+    count, pos = _read_varint(buf, 5)
+    clock_len, pos = _read_varint(buf, pos)
+    clock = bytes(buf[pos : pos + clock_len]).decode("ascii")
+    pos += clock_len
+
+    names = []
+    prev = b""
+    front_coded = flags & FLAG_FRONT_CODED
+    for _ in range(count):
+        shared = 0
+        if front_coded:
+            shared, pos = _read_varint(buf, pos)
+        length, pos = _read_varint(buf, pos)
+        name = prev[:shared] + bytes(buf[pos : pos + length])
+        pos += length
+        names.append(name)
+        prev = name
+    if pos != len(buf):
+        raise ValueError("packed names blob has trailing data")
+
+    return PackedNames(clock, bool(flags & FLAG_FRESH_INSTANCE), names)
@@ -54,6 +54,9 @@ BSER_NULL = b"\x0a"
 BSER_TEMPLATE = b"\x0b"
 BSER_SKIP = b"\x0c"
 BSER_UTF8STRING = b"\x0d"
+BSER_STRING_DEFINE = b"\x0e"
+BSER_STRING_REF = b"\x0f"
+BSER_STRING_PREFIXED = b"\x10"
 
 if compat.PYTHON3:
     STRING_TYPES = (str, bytes)
@@ -72,6 +75,9 @@ else:
 # int32 for the header
 EMPTY_HEADER = b"\x00\x01\x05\x00\x00\x00\x00"
 EMPTY_HEADER_V2 = b"\x00\x02\x00\x00\x00\x00\x05\x00\x00\x00\x00"
+# Version 3 has the same header as version 2.  We don't compress the strings
+# that we send, so the body is the same too.
+EMPTY_HEADER_V3 = b"\x00\x03\x00\x00\x00\x00\x05\x00\x00\x00\x00"
 
 
 def _int_size(x):
@@ -106,11 +112,10 @@ class _bser_buffer(object):
             )
             self.wpos = len(EMPTY_HEADER)
         else:
-            assert self.bser_version == 2
-            struct.pack_into(
-                tobytes(len(EMPTY_HEADER_V2)) + b"s", self.buf, 0, EMPTY_HEADER_V2
-            )
-            self.wpos = len(EMPTY_HEADER_V2)
+            assert self.bser_version in (2, 3)
+            header = EMPTY_HEADER_V2 if self.bser_version == 2 else EMPTY_HEADER_V3
+            struct.pack_into(tobytes(len(header)) + b"s", self.buf, 0, header)
+            self.wpos = len(header)
 
     def ensure_size(self, size):
         while ctypes.sizeof(self.buf) - self.wpos < size:
@@ -280,6 +285,7 @@ def dumps(obj, version=1, capabilities=0):
         obj_len = bser_buf.wpos - len(EMPTY_HEADER)
         struct.pack_into(b"=i", bser_buf.buf, 3, obj_len)
     else:
+        # Versions 2 and 3 have headers of the same size
         obj_len = bser_buf.wpos - len(EMPTY_HEADER_V2)
         struct.pack_into(b"=i", bser_buf.buf, 2, capabilities)
         struct.pack_into(b"=i", bser_buf.buf, 7, obj_len)
@@ -316,9 +322,13 @@ class _BunserDict(object):
 
 
 class Bunser(object):
-    def __init__(self, mutable=True, value_encoding=None, value_errors=None):
+    def __init__(
+        self, mutable=True, value_encoding=None, value_errors=None, dictionary=False
+    ):
         self.mutable = mutable
         self.value_encoding = value_encoding
+        # The string dictionary of a BSER v3 PDU, as (bytes, value) pairs
+        self.strings = [] if dictionary else None
 
         if value_encoding is None:
             self.value_errors = None
@@ -366,6 +376,40 @@ class Bunser(object):
             # str_len stays the same because that's the length in bytes
         return (str_val, pos + str_len)
 
+    def unser_dictionary_string(self, buf, pos):
+        if self.strings is None:
+            raise ValueError("string dictionary opcode outside of a BSER v3 PDU")
+        op = _buf_pos(buf, pos)
+        pos += 1
+        if op != BSER_STRING_DEFINE:
+            index, pos = self.unser_int(buf, pos)
+            if not 0 <= index < len(self.strings):
+                raise ValueError("Invalid bser string reference %d" % index)
+        if op == BSER_STRING_REF:
+            return (self.strings[index][1], pos)
+
+        prefix = b""
+        if op == BSER_STRING_PREFIXED:
+            prefix_len, pos = self.unser_int(buf, pos)
+            prefix_of = self.strings[index][0]
+            if not 0 <= prefix_len <= len(prefix_of):
+                raise ValueError("Invalid bser string prefix length %d" % prefix_len)
+            prefix = prefix_of[:prefix_len]
+
+        str_type = _buf_pos(buf, pos)
+        if str_type != BSER_BYTESTRING and str_type != BSER_UTF8STRING:
+            raise ValueError("Expected a bser string at position %s" % pos)
+        str_len, pos = self.unser_int(buf, pos + 1)
+        raw = prefix + struct.unpack_from(tobytes(str_len) + b"s", buf, pos)[0]
+        if str_type == BSER_UTF8STRING:
+            str_val = raw.decode("utf-8")
+        elif self.value_encoding is not None:
+            str_val = raw.decode(self.value_encoding, self.value_errors)
+        else:
+            str_val = raw
+        self.strings.append((raw, str_val))
+        return (str_val, pos + str_len)
+
     def unser_array(self, buf, pos):
         arr_len, pos = self.unser_int(buf, pos + 1)
         arr = []
@@ -462,6 +506,12 @@ class Bunser(object):
             return self.unser_object(buf, pos)
         elif val_type == BSER_TEMPLATE:
             return self.unser_template(buf, pos)
+        elif (
+            val_type == BSER_STRING_DEFINE
+            or val_type == BSER_STRING_REF
+            or val_type == BSER_STRING_PREFIXED
+        ):
+            return self.unser_dictionary_string(buf, pos)
         else:
             raise ValueError(
                 "unhandled bser opcode 0x%s"
@@ -475,10 +525,10 @@ def _pdu_info_helper(buf):
         bser_version = 1
         bser_capabilities = 0
         expected_len, pos2 = Bunser.unser_int(buf, 2)
-    elif buf[0:2] == EMPTY_HEADER_V2[0:2]:
+    elif buf[0:2] == EMPTY_HEADER_V2[0:2] or buf[0:2] == EMPTY_HEADER_V3[0:2]:
         if len(buf) < 8:
             raise ValueError("Invalid BSER header")
-        bser_version = 2
+        bser_version = 2 if buf[0:2] == EMPTY_HEADER_V2[0:2] else 3
         bser_capabilities = struct.unpack_from("I", buf, 2)[0]
         expected_len, pos2 = Bunser.unser_int(buf, 6)
     else:
@@ -497,7 +547,7 @@ def pdu_len(buf):
     return info[2] + info[3]
 
 
-def loads(buf, mutable=True, value_encoding=None, value_errors=None):
+def loads(buf, mutable=True, value_encoding=None, value_errors=None, lazy=False):
     """Deserialize a BSER-encoded blob.
 
     @param buf: The buffer to deserialize.
@@ -514,6 +564,11 @@ def loads(buf, mutable=True, value_encoding=None, value_errors=None):
                          The other most common argument is 'surrogateescape' on
                          Python 3. If value_encoding is None, this is ignored.
     @type value_errors: str
+
+    @param lazy: Accepted for compatibility with the C implementation, which
+                 can decode the items of arrays on access. This
+                 implementation always decodes eagerly.
+    @type lazy: bool
     """
 
     info = _pdu_info_helper(buf)
@@ -526,13 +581,16 @@ def loads(buf, mutable=True, value_encoding=None, value_errors=None):
         )
 
     bunser = Bunser(
-        mutable=mutable, value_encoding=value_encoding, value_errors=value_errors
+        mutable=mutable,
+        value_encoding=value_encoding,
+        value_errors=value_errors,
+        dictionary=info[0] == 3,
     )
 
     return bunser.loads_recursive(buf, pos)[0]
 
 
-def load(fp, mutable=True, value_encoding=None, value_errors=None):
+def load(fp, mutable=True, value_encoding=None, value_errors=None, lazy=False):
     from . import load
 
-    return load.load(fp, mutable, value_encoding, value_errors)
+    return load.load(fp, mutable, value_encoding, value_errors, lazy)
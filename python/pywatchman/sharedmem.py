@@ -0,0 +1,101 @@
+# Copyright 2020 Facebook, Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#  * Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+#
+#  * Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+#  * Neither the name Facebook nor the names of its contributors may be used to
+#    endorse or promote products derived from this software without specific
+#    prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import array
+import mmap
+import os
+import socket
+
+from .pybser import Bunser
+
+
+# The BSER v2 capability that asks the server to pass large responses in
+# shared memory
+BSER_CAP_SHARED_MEMORY = 0x10
+
+SHARED_MEMORY_MAGIC = b"\x00\x05"
+
+
+def available():
+    """ Returns True if descriptors can be received over unix sockets """
+    return os.name == "posix" and hasattr(socket.socket, "recvmsg")
+
+
+def recv(sock, size, fds):
+    """ Receives up to size bytes from sock, like sock.recv, and appends any
+        descriptors that came with them to fds """
+    int_size = array.array("i").itemsize
+    data, ancdata, _flags, _addr = sock.recvmsg(size, socket.CMSG_SPACE(int_size))
+    for level, kind, cdata in ancdata:
+        if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+            received = array.array("i")
+            received.frombytes(cdata[: len(cdata) - (len(cdata) % int_size)])
+            fds.extend(received)
+    return data
+
+
+def is_shared_memory(buf):
+    return buf[0:2] == SHARED_MEMORY_MAGIC
+
+
+def header_len(buf):
+    """ Returns how many bytes of the shared memory PDU that starts buf must
+        be read before its length can be found """
+    if len(buf) < 7:
+        return 7
+    return 7 + {3: 1, 4: 2, 5: 4, 6: 8}.get(ord(buf[6:7]), 0)
+
+
+def pdu_len(buf):
+    """ Returns the total length of the shared memory PDU that starts buf """
+    if len(buf) < 7:
+        raise ValueError("Invalid shared memory PDU header")
+    expected_len, pos = Bunser.unser_int(buf, 6)
+    return expected_len + pos
+
+
+def load(buf, fd):
+    """ Returns a read only mapping of the BSER v2 or v3 PDU that the shared
+        memory PDU buf refers to, and closes fd, the descriptor that came
+        with it """
+    try:
+        expected_len, pos = Bunser.unser_int(buf, 6)
+        if len(buf) != expected_len + pos:
+            raise ValueError(
+                "shared memory PDU len %d != header len %d"
+                % (len(buf), expected_len + pos)
+            )
+        size, pos = Bunser.unser_int(buf, pos)
+        if os.fstat(fd).st_size < size:
+            raise ValueError("shared memory PDU is smaller than its header says")
+        return mmap.mmap(fd, size, access=mmap.ACCESS_READ)
+    finally:
+        os.close(fd)
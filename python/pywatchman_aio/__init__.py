@@ -256,6 +256,19 @@ class AIOClient(object):
             ex.setCommand(args)
             raise ex
 
+    async def multi_query(self, queries):
+        """Run several queries in one request and return their responses.
+
+        `queries` is a list of (root, query) pairs.  Each root is synced
+        once, however many of the queries are against it, and the queries
+        run concurrently on the server.  The responses are returned in the
+        same order; a query that failed has a dict with just its "error" in
+        its place, rather than raising.
+        """
+
+        res = await self.query("multi-query", [[root, q] for root, q in queries])
+        return res["results"]
+
     async def capability_check(self, optional=None, required=None):
         """Perform a server capability check."""
 
@@ -0,0 +1,78 @@
+#!/usr/bin/env python
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+"""Measures the throughput of the BSER implementations of pywatchman on
+the PDUs of the shared corpus in tests/bser_corpus.
+
+    python -m tests.bser_bench [--min-time SECONDS] [--only SUBSTRING]
+
+For each PDU this reports how quickly it is decoded, and how quickly the
+decoded value is encoded again, in MB of BSER per second, so that the
+numbers can be compared with those of the drivers for the other
+languages.
+"""
+
+from __future__ import absolute_import, division, print_function
+
+import argparse
+import json
+import os
+import time
+
+from pywatchman import bser, pybser
+
+
+CORPUS_DIR = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), "..", "..", "tests", "bser_corpus"
+)
+
+
+def measure(func, min_time):
+    """Returns the mean time in seconds of a call to func, running it for
+    at least min_time seconds"""
+    func()
+    iterations = 0
+    start = time.perf_counter()
+    while True:
+        func()
+        iterations += 1
+        elapsed = time.perf_counter() - start
+        if elapsed >= min_time and iterations >= 3:
+            return elapsed / iterations
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--corpus", default=CORPUS_DIR)
+    parser.add_argument("--min-time", type=float, default=0.5)
+    parser.add_argument("--only", default="")
+    args = parser.parse_args()
+
+    with open(os.path.join(args.corpus, "manifest.json")) as f:
+        manifest = json.load(f)
+
+    print(
+        "%-8s %-36s %9s %12s %12s"
+        % ("impl", "pdu", "bytes", "decode MB/s", "encode MB/s")
+    )
+    for (mod, impl) in ((bser, "bser"), (pybser, "pybser")):
+        for entry in manifest:
+            for pdu in entry["pdus"]:
+                if args.only not in pdu:
+                    continue
+                with open(os.path.join(args.corpus, pdu), "rb") as f:
+                    data = f.read()
+                value = mod.loads(data)
+                version = 1 if ".v1." in pdu else 2
+                decode = measure(lambda: mod.loads(data), args.min_time)
+                encode = measure(lambda: mod.dumps(value, version), args.min_time)
+                mb = len(data) / 1e6
+                print(
+                    "%-8s %-36s %9d %12.1f %12.1f"
+                    % (impl, pdu, len(data), mb / decode, mb / encode)
+                )
+
+
+if __name__ == "__main__":
+    main()
@@ -5,7 +5,10 @@ from __future__ import absolute_import, division, print_function
 import binascii
 import collections
 import inspect
+import json
 import os
+import socket
+import struct
 import sys
 import tempfile
 import uuid
@@ -18,8 +21,10 @@ from pywatchman import (
     bser,
     client,
     compat,
+    compression,
     load,
     pybser,
+    sharedmem,
 )
 
 
@@ -371,6 +376,141 @@ class TestBSERDump(unittest.TestCase):
         for i in range(0, len(exp)):
             self.assertItemAttributes(exp[i], res[i])
 
+    def test_lazy(self):
+        templ = (
+            b"\x00\x01\x03\x28"
+            + b"\x0b\x00\x03\x02\x02\x03\x04\x6e\x61\x6d\x65\x02"
+            + b"\x03\x03\x61\x67\x65\x03\x03\x02\x03\x04\x66\x72"
+            + b"\x65\x64\x03\x14\x02\x03\x04\x70\x65\x74\x65\x03"
+            + b"\x1e\x0c\x03\x19"
+        )
+        exp = [
+            {"name": b"fred", "age": 20},
+            {"name": b"pete", "age": 30},
+            {"name": None, "age": 25},
+        ]
+        res = self.bser_mod.loads(templ, lazy=True)
+        self.assertEqual(3, len(res))
+        self.assertEqual(exp[2], res[-1])
+        self.assertEqual(exp[1:], res[1:])
+        self.assertEqual(exp, list(res))
+        self.assertEqual(exp, res)
+        self.assertRaises(IndexError, lambda: res[3])
+        res = self.bser_mod.loads(templ, False, lazy=True)
+        for i in range(0, len(exp)):
+            self.assertItemAttributes(exp[i], res[i])
+
+        val = {
+            "files": [{"name": b"a", "size": 1}, {"name": b"b", "size": 2}],
+            "names": [b"a", b"b", b"c"],
+            "mixed": [b"a", 1, [b"b", None]],
+            "clock": b"c:1",
+        }
+        enc = self.bser_mod.dumps(val)
+        dec = self.bser_mod.loads(enc, lazy=True)
+        self.assertEqual(val, dec)
+        self.assertEqual(val["mixed"][2], dec["mixed"][2])
+        # The items are decoded from the PDU after loads has returned
+        dec = self.bser_mod.loads(bytearray(enc), lazy=True)
+        self.assertEqual(val["files"][1], dec["files"][1])
+        fp = FakeFile(enc)
+        self.assertEqual(val, self.bser_mod.load(fp, lazy=True))
+        dec = self.bser_mod.loads(enc, lazy=True, value_encoding="utf-8")
+        self.assertEqual("b", dec["files"][1]["name"])
+        self.assertEqual(["a", "b", "c"], dec["names"])
+
+    def test_string_dictionary(self):
+        # A BSER v3 blob from the C test suite in watchman, where a name is
+        # defined, front coded and referenced
+        body = (
+            b"\x01\x03\x01\x02\x03\x05files\x00\x03\x05"
+            + b"\x0e\x0d\x03\x0bsrc/lib/a.c"
+            + b"\x10\x03\x00\x03\x08\x0d\x03\x03b.c"
+            + b"\x0f\x03\x00"
+            + b"\x0d\x03\x01x"
+            + b"\x10\x03\x01\x03\x08\x02\x03\x02\xd0\xff"
+        )
+        pdu = b"\x00\x03\x00\x00\x00\x00\x03" + bytes([len(body)]) + body
+        self.assertEqual((3, 0, len(pdu)), self.bser_mod.pdu_info(pdu))
+        exp = {
+            "files": [
+                "src/lib/a.c",
+                "src/lib/b.c",
+                "src/lib/a.c",
+                "x",
+                b"src/lib/\xd0\xff",
+            ]
+        }
+        self.assertEqual(exp, self.bser_mod.loads(pdu))
+        res = self.bser_mod.loads(pdu, False)
+        self.assertEqual(tuple(exp["files"]), res["files"])
+        dec = self.bser_mod.loads(
+            pdu, value_encoding="utf-8", value_errors="surrogateescape"
+        )
+        self.assertEqual("src/lib/\udcd0\udcff", dec["files"][4])
+
+        # The dictionary is only understood in v3
+        v2 = b"\x00\x02" + pdu[2:]
+        self.assertRaises(ValueError, self.bser_mod.loads, v2)
+        # and references must be to strings that have been defined
+        bad = pdu[: -len(body)] + body.replace(b"\x0f\x03\x00", b"\x0f\x03\x07")
+        self.assertRaises(ValueError, self.bser_mod.loads, bad)
+
+    def test_dumps_v3(self):
+        enc = self.bser_mod.dumps(["Tom"], version=3)
+        self.assertEqual(enc[0:2], b"\x00\x03")
+        self.assertEqual(enc[2:], self.bser_mod.dumps(["Tom"], version=2)[2:])
+        self.assertEqual([b"Tom"], self.bser_mod.loads(enc))
+
+    def test_compressed_pdu(self):
+        inner = self.bser_mod.dumps({"files": ["src/lib/a.c"] * 100}, version=2)
+
+        def wrap(codec, data):
+            body = struct.pack("=bbbi", 3, codec, 5, len(inner)) + data
+            return b"\x00\x04\x00\x00\x00\x00" + struct.pack("=bi", 5, len(body)) + body
+
+        # A codec that we don't know about
+        pdu = wrap(7, inner)
+        self.assertTrue(compression.is_compressed(pdu))
+        self.assertFalse(compression.is_compressed(inner))
+        self.assertEqual(len(pdu), compression.pdu_len(pdu[0:11]))
+        self.assertRaises(ValueError, compression.decompress, pdu)
+
+        if compression.zstandard is not None:
+            data = compression.zstandard.ZstdCompressor().compress(inner)
+            pdu = wrap(compression.PDU_CODEC_ZSTD, data)
+            self.assertEqual(inner, compression.decompress(pdu))
+        if compression.lz4_frame is not None:
+            data = compression.lz4_frame.compress(inner)
+            pdu = wrap(compression.PDU_CODEC_LZ4, data)
+            self.assertEqual(inner, compression.decompress(pdu))
+            self.assertRaises(ValueError, compression.decompress, pdu[:-1])
+
+    @unittest.skipIf(not sharedmem.available(), "can't pass descriptors")
+    def test_shared_memory_pdu(self):
+        inner = self.bser_mod.dumps({"files": ["src/lib/a.c"] * 100}, version=2)
+        body = struct.pack("=bi", 5, len(inner))
+        pdu = b"\x00\x05\x10\x00\x00\x00" + struct.pack("=bi", 5, len(body)) + body
+        self.assertTrue(sharedmem.is_shared_memory(pdu))
+        self.assertFalse(sharedmem.is_shared_memory(inner))
+        self.assertEqual(len(pdu), sharedmem.pdu_len(pdu[0:11]))
+
+        left, right = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+        with tempfile.TemporaryFile() as f, left, right:
+            f.write(inner)
+            f.flush()
+            fd = struct.pack("i", f.fileno())
+            left.sendmsg([pdu], [(socket.SOL_SOCKET, socket.SCM_RIGHTS, fd)])
+            fds = []
+            self.assertEqual(pdu, sharedmem.recv(right, len(pdu), fds))
+            self.assertEqual(len(fds), 1)
+
+            mapping = sharedmem.load(pdu, fds[0])
+            self.assertEqual(inner, mapping[:])
+            self.assertEqual(self.bser_mod.loads(inner), self.bser_mod.loads(mapping))
+            self.assertRaises(OSError, os.fstat, fds[0])
+            mapping.close()
+
     def test_pdu_info(self):
         enc = self.bser_mod.dumps(1)
         DEFAULT_BSER_VERSION = 1
@@ -409,6 +549,44 @@ class TestBSERDump(unittest.TestCase):
         self.assertRaises(ValueError, self.bser_mod.pdu_info, b"\x00\x02")
 
 
+# The corpus that every BSER implementation is checked against; see
+# tests/bser_corpus/README.md in the watchman repository
+BSER_CORPUS_DIR = os.path.join(
+    os.path.dirname(os.path.abspath(__file__)), "..", "..", "tests", "bser_corpus"
+)
+
+
+@expand_bser_mods
+class TestBSERCorpus(unittest.TestCase):
+    def setUp(self):
+        self.init_bser_mod()
+        manifest = os.path.join(BSER_CORPUS_DIR, "manifest.json")
+        if not os.path.exists(manifest):
+            self.skipTest("the BSER corpus is not available")
+        with open(manifest) as f:
+            self.manifest = json.load(f)
+
+    def read(self, name):
+        with open(os.path.join(BSER_CORPUS_DIR, name), "rb") as f:
+            return f.read()
+
+    def test_decode(self):
+        for entry in self.manifest:
+            expected = json.loads(self.read(entry["name"] + ".json").decode("utf-8"))
+            for pdu in entry["pdus"]:
+                dec = self.bser_mod.loads(self.read(pdu), value_encoding="utf-8")
+                self.assertEqual(expected, dec, pdu)
+
+    def test_encode(self):
+        # The encoders write byte strings in every version, so only the v1
+        # encoding is canonical for them
+        for entry in self.manifest:
+            data = self.read(entry["name"] + ".json").decode("utf-8")
+            value = json.loads(data, object_pairs_hook=collections.OrderedDict)
+            enc = self.bser_mod.dumps(value)
+            self.assertEqual(self.read(entry["name"] + ".v1.bser"), enc, entry["name"])
+
+
 if __name__ == "__main__":
     suite = load_tests(unittest.TestLoader())
     unittest.TextTestRunner().run(suite)
@@ -3,26 +3,48 @@
 
 #include "watchman.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
+#include "InMemoryView.h"
 
 /* Basic boolean and compound expressions */
 
-class NotExpr : public QueryExpr {
+class NotExpr : public SpecializedQueryExpr<NotExpr> {
   std::unique_ptr<QueryExpr> expr;
 
  public:
   explicit NotExpr(std::unique_ptr<QueryExpr> other_expr)
       : expr(std::move(other_expr)) {}
 
-  EvaluateResult evaluate(w_query_ctx* ctx, FileResult* file) override {
-    auto res = expr->evaluate(ctx, file);
+  template <typename File>
+  EvaluateResult evaluateFile(w_query_ctx* ctx, File* file) {
+    auto res = evaluateQueryExpr(*expr, ctx, file);
     if (!res.has_value()) {
       return res;
     }
     return !*res;
   }
 
+  QueryExprCost cost() const override {
+    return expr->cost();
+  }
+
+  void wrapTerms(
+      const std::function<std::unique_ptr<QueryExpr>(
+          std::unique_ptr<QueryExpr>)>& wrap) override {
+    expr = wrap(std::move(expr));
+  }
+
+  void plan() override {
+    expr->plan();
+  }
+
+  json_ref describe() const override {
+    return json_array(
+        {typed_string_to_json("not", W_STRING_UNICODE), expr->describe()});
+  }
+
   static std::unique_ptr<QueryExpr> parse(
       w_query* query,
       const json_ref& term) {
@@ -39,12 +61,17 @@ class NotExpr : public QueryExpr {
 
 W_TERM_PARSER("not", NotExpr::parse)
 
-class TrueExpr : public QueryExpr {
+class TrueExpr : public SpecializedQueryExpr<TrueExpr> {
  public:
-  EvaluateResult evaluate(w_query_ctx*, FileResult*) override {
+  template <typename File>
+  EvaluateResult evaluateFile(w_query_ctx*, File*) {
     return true;
   }
 
+  QueryExprCost cost() const override {
+    return QueryExprCost::Name;
+  }
+
   static std::unique_ptr<QueryExpr> parse(w_query*, const json_ref&) {
     return std::make_unique<TrueExpr>();
   }
@@ -52,12 +79,17 @@ class TrueExpr : public QueryExpr {
 
 W_TERM_PARSER("true", TrueExpr::parse)
 
-class FalseExpr : public QueryExpr {
+class FalseExpr : public SpecializedQueryExpr<FalseExpr> {
  public:
-  EvaluateResult evaluate(w_query_ctx*, FileResult*) override {
+  template <typename File>
+  EvaluateResult evaluateFile(w_query_ctx*, File*) {
     return false;
   }
 
+  QueryExprCost cost() const override {
+    return QueryExprCost::Name;
+  }
+
   static std::unique_ptr<QueryExpr> parse(w_query*, const json_ref&) {
     return std::make_unique<FalseExpr>();
   }
@@ -65,7 +97,7 @@ class FalseExpr : public QueryExpr {
 
 W_TERM_PARSER("false", FalseExpr::parse)
 
-class ListExpr : public QueryExpr {
+class ListExpr : public SpecializedQueryExpr<ListExpr> {
   bool allof;
   std::vector<std::unique_ptr<QueryExpr>> exprs;
 
@@ -73,11 +105,12 @@ class ListExpr : public QueryExpr {
   ListExpr(bool isAll, std::vector<std::unique_ptr<QueryExpr>> exprs)
       : allof(isAll), exprs(std::move(exprs)) {}
 
-  EvaluateResult evaluate(w_query_ctx* ctx, FileResult* file) override {
+  template <typename File>
+  EvaluateResult evaluateFile(w_query_ctx* ctx, File* file) {
     bool needData = false;
 
     for (auto& expr : exprs) {
-      auto res = expr->evaluate(ctx, file);
+      auto res = evaluateQueryExpr(*expr, ctx, file);
 
       if (!res.has_value()) {
         needData = true;
@@ -107,6 +140,201 @@ class ListExpr : public QueryExpr {
     return allof;
   }
 
+  QueryExprCost cost() const override {
+    auto cost = QueryExprCost::Name;
+    for (auto& expr : exprs) {
+      cost = std::max(cost, expr->cost());
+    }
+    return cost;
+  }
+
+  void wrapTerms(
+      const std::function<std::unique_ptr<QueryExpr>(
+          std::unique_ptr<QueryExpr>)>& wrap) override {
+    for (auto& expr : exprs) {
+      expr = wrap(std::move(expr));
+    }
+  }
+
+  void plan() override {
+    // Hoist the terms of nested lists of the same kind into this one,
+    // so that they can be ordered along with our own terms
+    std::vector<std::unique_ptr<QueryExpr>> flattened;
+    for (auto& expr : exprs) {
+      expr->plan();
+      auto list = dynamic_cast<ListExpr*>(expr.get());
+      if (list && list->allof == allof) {
+        for (auto& child : list->exprs) {
+          flattened.emplace_back(std::move(child));
+        }
+      } else {
+        flattened.emplace_back(std::move(expr));
+      }
+    }
+
+    // Evaluate the cheapest terms first; evaluate() stops at the first
+    // term that decides the result.  The sort is stable so that terms
+    // of the same cost keep the order that the client gave them.
+    std::stable_sort(
+        flattened.begin(), flattened.end(), [](const auto& a, const auto& b) {
+          return a->cost() < b->cost();
+        });
+
+    // Terms that were apart may now be adjacent and able to aggregate
+    exprs.clear();
+    for (auto& expr : flattened) {
+      append(exprs, std::move(expr), allof);
+    }
+  }
+
+  json_ref describe() const override {
+    auto desc = json_array_of_size(exprs.size() + 1);
+    json_array_append_new(desc, opName(allof));
+    for (auto& expr : exprs) {
+      json_array_append_new(desc, expr->describe());
+    }
+    return desc;
+  }
+
+  folly::Optional<std::vector<w_string>> impliedSuffixes() const override {
+    return combineImplied(&QueryExpr::impliedSuffixes);
+  }
+
+  folly::Optional<std::vector<w_string>> impliedBasenames() const override {
+    return combineImplied(&QueryExpr::impliedBasenames);
+  }
+
+  folly::Optional<std::vector<w_string>> impliedPaths() const override {
+    return combineImplied(&QueryExpr::impliedPaths);
+  }
+
+  folly::Optional<std::vector<w_query_path>> impliedDirs() const override {
+    if (allof) {
+      for (auto& expr : exprs) {
+        auto dirs = expr->impliedDirs();
+        if (dirs) {
+          return dirs;
+        }
+      }
+      return folly::none;
+    }
+
+    std::vector<w_query_path> all;
+    for (auto& expr : exprs) {
+      auto dirs = expr->impliedDirs();
+      if (!dirs) {
+        return folly::none;
+      }
+      for (auto& dir : *dirs) {
+        addDir(all, std::move(dir));
+      }
+    }
+    return all;
+  }
+
+  // Adds dir to dirs, merging it with a dir that holds it or that it holds
+  // so that the path generator doesn't produce a file twice
+  static void addDir(std::vector<w_query_path>& dirs, w_query_path dir) {
+    // The depth that an ancestor needs to reach as far as its descendant,
+    // or -1 for no limit
+    auto reach = [](const w_query_path& ancestor,
+                    const w_query_path& descendant) {
+      if (ancestor.depth < 0 || descendant.depth < 0) {
+        return -1;
+      }
+      // The number of levels that descendant is below ancestor
+      const auto& name = descendant.name;
+      int levels = ancestor.name.size() == 0 && name.size() > 0 ? 1 : 0;
+      for (auto i = ancestor.name.size(); i < name.size(); ++i) {
+        if (name.data()[i] == '/') {
+          ++levels;
+        }
+      }
+      return std::max(ancestor.depth, descendant.depth + levels);
+    };
+
+    for (auto it = dirs.begin(); it != dirs.end(); ++it) {
+      if (isWithin(dir.name, it->name)) {
+        it->depth = reach(*it, dir);
+        return;
+      }
+      if (isWithin(it->name, dir.name)) {
+        dir.depth = reach(dir, *it);
+        dirs.erase(it);
+        // It may hold others too
+        addDir(dirs, std::move(dir));
+        return;
+      }
+    }
+    dirs.push_back(std::move(dir));
+  }
+
+  // True if path is dir or is beneath it
+  static bool isWithin(const w_string& path, const w_string& dir) {
+    if (dir.size() == 0) {
+      return true;
+    }
+    return w_string_piece(path).startsWith(dir) &&
+        (path.size() == dir.size() || path.data()[dir.size()] == '/');
+  }
+
+  using ImpliedStrings =
+      folly::Optional<std::vector<w_string>> (QueryExpr::*)() const;
+
+  // Combines the sets of strings that implied returns for each of the
+  // terms into the set that constrains the whole list
+  folly::Optional<std::vector<w_string>> combineImplied(
+      ImpliedStrings implied) const {
+    if (allof) {
+      // Any one of the terms constrains the whole list
+      for (auto& expr : exprs) {
+        auto strings = (expr.get()->*implied)();
+        if (strings) {
+          return strings;
+        }
+      }
+      return folly::none;
+    }
+
+    // Each of the terms must be constrained
+    std::vector<w_string> all;
+    for (auto& expr : exprs) {
+      auto strings = (expr.get()->*implied)();
+      if (!strings) {
+        return folly::none;
+      }
+      all.insert(all.end(), strings->begin(), strings->end());
+    }
+    std::sort(all.begin(), all.end());
+    all.erase(std::unique(all.begin(), all.end()), all.end());
+    return all;
+  }
+
+  static json_ref opName(bool allof) {
+    return typed_string_to_json(allof ? "allof" : "anyof", W_STRING_UNICODE);
+  }
+
+  // Appends expr to list, combining it with the last expression in
+  // the list if they can be aggregated
+  static void append(
+      std::vector<std::unique_ptr<QueryExpr>>& list,
+      std::unique_ptr<QueryExpr> expr,
+      bool allof) {
+    if (!list.empty()) {
+      auto op = allof ? AggregateOp::AllOf : AggregateOp::AnyOf;
+      auto aggExpr = list.back()->aggregate(expr.get(), op);
+      if (aggExpr) {
+        if (!aggExpr->term) {
+          aggExpr->term = json_array(
+              {opName(allof), list.back()->describe(), expr->describe()});
+        }
+        list.back() = std::move(aggExpr);
+        return;
+      }
+    }
+    list.emplace_back(std::move(expr));
+  }
+
   static std::unique_ptr<QueryExpr>
   parse(w_query* query, const json_ref& term, bool allof) {
     std::vector<std::unique_ptr<QueryExpr>> list;
@@ -124,20 +352,7 @@ class ListExpr : public QueryExpr {
 
     for (size_t i = 0; i < n; i++) {
       const auto& exp = term.at(i + 1);
-
-      auto op = allof ? AggregateOp::AllOf : AggregateOp::AnyOf;
-      auto parsed = w_query_expr_parse(query, exp);
-      if (list.empty()) {
-        list.emplace_back(std::move(parsed));
-      } else {
-        // Try to aggregate with previous expression
-        auto aggExpr = list.back().get()->aggregate(parsed.get(), op);
-        if (aggExpr) {
-          list.back() = std::move(aggExpr);
-        } else {
-          list.emplace_back(std::move(parsed));
-        }
-      }
+      append(list, w_query_expr_parse(query, exp), allof);
     }
 
     return std::make_unique<ListExpr>(allof, std::move(list));
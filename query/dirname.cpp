@@ -3,6 +3,7 @@
 
 #include "watchman.h"
 
+#include <climits>
 #include <memory>
 
 using watchman::CaseSensitivity;
@@ -14,18 +15,17 @@ static inline bool is_dir_sep(int c) {
 class DirNameExpr : public QueryExpr {
   w_string dirname;
   struct w_query_int_compare depth;
-  using StartsWith = bool (*)(w_string_t* str, w_string_t* prefix);
-  StartsWith startswith;
+  bool caseless;
 
  public:
   explicit DirNameExpr(
       w_string dirname,
       struct w_query_int_compare depth,
-      StartsWith startswith)
-      : dirname(dirname), depth(depth), startswith(startswith) {}
+      bool caseless)
+      : dirname(dirname), depth(depth), caseless(caseless) {}
 
   EvaluateResult evaluate(w_query_ctx* ctx, FileResult*) override {
-    auto& str = w_query_ctx_get_wholename(ctx);
+    auto str = w_query_ctx_get_wholename(ctx);
     size_t i;
 
     if (str.size() <= dirname.size()) {
@@ -45,7 +45,8 @@ class DirNameExpr : public QueryExpr {
       return false;
     }
 
-    if (!startswith(str, dirname)) {
+    if (caseless ? !str.startsWithCaseInsensitive(dirname)
+                 : !str.startsWith(dirname)) {
       return false;
     }
 
@@ -61,6 +62,41 @@ class DirNameExpr : public QueryExpr {
     return eval_int_compare(actual_depth, &depth);
   }
 
+  QueryExprCost cost() const override {
+    return QueryExprCost::Name;
+  }
+
+  folly::Optional<std::vector<w_query_path>> impliedDirs() const override {
+    // The view is looked up by exact name
+    if (caseless) {
+      return folly::none;
+    }
+    // The files directly within dirname are at depth 0, which the path
+    // generator also counts from, and a depth of -1 has no limit
+    json_int_t maxDepth;
+    switch (depth.op) {
+      case W_QUERY_ICMP_EQ:
+      case W_QUERY_ICMP_LE:
+        maxDepth = depth.operand;
+        break;
+      case W_QUERY_ICMP_LT:
+        maxDepth = depth.operand - 1;
+        break;
+      default:
+        maxDepth = -1;
+        break;
+    }
+    std::vector<w_query_path> dirs;
+    if (maxDepth >= 0 || depth.op == W_QUERY_ICMP_NE ||
+        depth.op == W_QUERY_ICMP_GT || depth.op == W_QUERY_ICMP_GE) {
+      dirs.push_back(w_query_path{
+          dirname.normalizeSeparators(),
+          int(std::min<json_int_t>(maxDepth, INT_MAX))});
+    }
+    // Otherwise no depth can match, and there is nothing to walk
+    return dirs;
+  }
+
   // ["dirname", "foo"] -> ["dirname", "foo", ["depth", "ge", 0]]
   static std::unique_ptr<QueryExpr>
   parse(w_query*, const json_ref& term, CaseSensitivity case_sensitive) {
@@ -111,9 +147,7 @@ class DirNameExpr : public QueryExpr {
     return std::make_unique<DirNameExpr>(
         json_to_w_string(name),
         depth_comp,
-        case_sensitive == CaseSensitivity::CaseInSensitive
-            ? w_string_startswith_caseless
-            : w_string_startswith);
+        case_sensitive == CaseSensitivity::CaseInSensitive);
   }
   static std::unique_ptr<QueryExpr> parseDirName(
       w_query* query,
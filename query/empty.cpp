@@ -4,10 +4,12 @@
 #include "watchman.h"
 
 #include <memory>
+#include "InMemoryView.h"
 
-class ExistsExpr : public QueryExpr {
+class ExistsExpr : public SpecializedQueryExpr<ExistsExpr> {
  public:
-  EvaluateResult evaluate(struct w_query_ctx*, FileResult* file) override {
+  template <typename File>
+  EvaluateResult evaluateFile(struct w_query_ctx*, File* file) {
     return file->exists();
   }
 
@@ -4,13 +4,17 @@
 #include "watchman.h"
 
 #include <folly/ScopeGuard.h>
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include "InMemoryView.h"
 #include "LocalFileResult.h"
+#include "Tracing.h"
 #include "saved_state/SavedStateInterface.h"
 
 using namespace watchman;
 
 namespace {
-constexpr size_t kMaximumRenderBatchSize = 1024;
 }
 
 FileResult::~FileResult() {}
@@ -23,7 +27,51 @@ folly::Optional<DType> FileResult::dtype() {
   return statInfo->dtype();
 }
 
+folly::Optional<w_string> FileResult::renamedFrom() {
+  return w_string();
+}
+
+folly::Optional<TreeSummary> FileResult::treeSummary() {
+  return folly::none;
+}
+
+bool FileResult::baseNameIsFolded() {
+  return false;
+}
+
+const void* FileResult::identity() {
+  return nullptr;
+}
+
+folly::Optional<FileResult::ContentDigest> FileResult::getContentHash(
+    ContentHashAlgorithm) {
+  throw std::runtime_error(
+      "this kind of watch does not support the requested content hash");
+}
+
 w_string w_query_ctx::computeWholeName(FileResult* file) const {
+  auto parent = computeWholeNameDir(file);
+  if (parent.size() == 0) {
+    return file->baseName().asWString();
+  }
+  return w_string::build(parent, "/", file->baseName());
+}
+
+w_string_piece w_query_ctx::computeWholeName(
+    FileResult* file,
+    std::string& buf) const {
+  auto parent = computeWholeNameDir(file);
+  auto base = file->baseName();
+  buf.clear();
+  if (parent.size() > 0) {
+    buf.append(parent.data(), parent.size());
+    buf.push_back('/');
+  }
+  buf.append(base.data(), base.size());
+  return w_string_piece(buf.data(), buf.size());
+}
+
+w_string_piece w_query_ctx::computeWholeNameDir(FileResult* file) const {
   uint32_t name_start;
 
   if (query->relative_root) {
@@ -37,19 +85,19 @@ w_string w_query_ctx::computeWholeName(FileResult* file) const {
   // Record the name relative to the root
   auto parent = file->dirName();
   if (name_start > parent.size()) {
-    return file->baseName().asWString();
+    return w_string_piece();
   }
   parent.advance(name_start);
-  return w_string::build(parent, "/", file->baseName());
+  return parent;
 }
 
-const w_string& w_query_ctx_get_wholename(struct w_query_ctx* ctx) {
-  if (ctx->wholename) {
-    return ctx->wholename;
+w_string_piece w_query_ctx_get_wholename(struct w_query_ctx* ctx) {
+  if (ctx->wholenameValid) {
+    return w_string_piece(ctx->wholenameBuf.data(), ctx->wholenameBuf.size());
   }
 
-  ctx->wholename = ctx->computeWholeName(ctx->file.get());
-  return ctx->wholename;
+  ctx->wholenameValid = true;
+  return ctx->computeWholeName(ctx->file, ctx->wholenameBuf);
 }
 
 /* Query evaluator */
@@ -57,10 +105,28 @@ void w_query_process_file(
     w_query* query,
     struct w_query_ctx* ctx,
     std::unique_ptr<FileResult> file) {
-  ctx->wholename.reset();
-  ctx->file = std::move(file);
+  auto* candidate = file.get();
+  w_query_process_file(
+      query, ctx, *candidate, [&] { return std::move(file); });
+}
+
+// File is either FileResult or InMemoryFileResult, for which the expression
+// is evaluated through its specialized path
+template <typename File>
+static void processFile(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    File& file,
+    folly::FunctionRef<std::unique_ptr<FileResult>()> promote) {
+  if (ctx->limitReached() || ctx->cancelled()) {
+    // There is no need to look at any more files
+    return;
+  }
+
+  ctx->wholenameValid = false;
+  ctx->file = &file;
   SCOPE_EXIT {
-    ctx->file.reset();
+    ctx->file = nullptr;
   };
 
   // For fresh instances, only return files that currently exist
@@ -71,10 +137,10 @@ void w_query_process_file(
   // for every file.  See also related TODO in batchFetchNow.
   if (!ctx->disableFreshInstance && !ctx->since.is_timestamp &&
       ctx->since.clock.is_fresh_instance) {
-    auto exists = ctx->file->exists();
+    auto exists = file.exists();
     if (!exists.has_value()) {
       // Reconsider this one later
-      ctx->addToEvalBatch(std::move(ctx->file));
+      ctx->addToEvalBatch(promote());
       return;
     }
     if (!exists.value()) {
@@ -85,29 +151,50 @@ void w_query_process_file(
   // We produce an output for this file if there is no expression,
   // or if the expression matched.
   if (query->expr) {
-    auto match = query->expr->evaluate(ctx, ctx->file.get());
+    auto match = evaluateQueryExpr(*query->expr, ctx, &file);
 
     if (!match.has_value()) {
       // Reconsider this one later
-      ctx->addToEvalBatch(std::move(ctx->file));
+      ctx->addToEvalBatch(promote());
       return;
     } else if (!*match) {
       return;
     }
   }
 
-  if (ctx->query->dedup_results) {
-    w_string_t* name = w_query_ctx_get_wholename(ctx);
-
-    auto inserted = ctx->dedup.insert(name);
-    if (!inserted.second) {
-      // Already present in the results, no need to emit it again
-      ctx->num_deduped++;
-      return;
-    }
+  if (ctx->query->dedup_results && !ctx->addToDedup()) {
+    // Already present in the results, no need to emit it again
+    ctx->num_deduped++;
+    return;
   }
 
-  ctx->maybeRender(std::move(ctx->file));
+  ctx->addMatch(promote());
+}
+
+void w_query_process_file(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    FileResult& file,
+    folly::FunctionRef<std::unique_ptr<FileResult>()> promote) {
+  processFile(query, ctx, file, promote);
+}
+
+void w_query_process_file(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    InMemoryFileResult& file,
+    folly::FunctionRef<std::unique_ptr<FileResult>()> promote) {
+  processFile(query, ctx, file, promote);
+}
+
+bool w_query_ctx::addToDedup() {
+  auto identity = file->identity();
+  if (identity && dedupByIdentity && !query->collect_file_names) {
+    // Spares assembling the name of each candidate and copying it
+    return dedupIdentities.insert(identity).second;
+  }
+  // The set outlives the file, so this one has to be a w_string
+  return dedup.insert(w_query_ctx_get_wholename(this).asWString()).second;
 }
 
 bool w_query_ctx::dirMatchesRelativeRoot(w_string_piece fullDirectoryPath) {
@@ -149,47 +236,123 @@ void time_generator(
   root->view()->timeGenerator(query, ctx);
 }
 
+// Runs a generator, recording how long it took and how many files it
+// walked if the query is being profiled
+template <typename Generator>
+static void
+run_generator(struct w_query_ctx* ctx, const char* name, Generator&& gen) {
+  if (!ctx->query->profile) {
+    gen();
+    return;
+  }
+  auto numWalked = ctx->getNumWalked();
+  auto start = std::chrono::steady_clock::now();
+  gen();
+  ctx->generatorProfiles.push_back(w_query_ctx::GeneratorProfile{
+      name,
+      std::chrono::steady_clock::now() - start,
+      ctx->getNumWalked() - numWalked});
+}
+
 static void default_generators(
     w_query* query,
     const std::shared_ptr<w_root_t>& root,
     struct w_query_ctx* ctx) {
   bool generated = false;
 
+  // A node that is aged out between two generators may have its memory
+  // reused by a file that the next one produces
+  int numGenerators = int(query->suffixes.has_value()) +
+      int(query->basenames.has_value()) + int(query->paths.has_value()) +
+      int(bool(query->glob_tree)) +
+      int(ctx->since.is_timestamp || !ctx->since.clock.is_fresh_instance);
+  if (numGenerators > 1) {
+    ctx->dedupByIdentity = false;
+  }
+
   // Time based query
   if (ctx->since.is_timestamp || !ctx->since.clock.is_fresh_instance) {
-    time_generator(query, root, ctx);
+    run_generator(ctx, "since", [&] { time_generator(query, root, ctx); });
     generated = true;
   }
 
   // Suffix
   if (query->suffixes.has_value()) {
-    root->view()->suffixGenerator(query, ctx);
+    run_generator(
+        ctx, query->planned_suffixes ? "suffix (planned)" : "suffix", [&] {
+          root->view()->suffixGenerator(query, ctx);
+        });
+    generated = true;
+  }
+
+  if (query->basenames.has_value()) {
+    run_generator(ctx, "basename (planned)", [&] {
+      root->view()->basenameGenerator(query, ctx);
+    });
     generated = true;
   }
 
   if (query->paths.has_value()) {
-    root->view()->pathGenerator(query, ctx);
+    run_generator(
+        ctx, query->planned_paths ? "path (planned)" : "path", [&] {
+          root->view()->pathGenerator(query, ctx);
+        });
     generated = true;
   }
 
   if (query->glob_tree) {
-    root->view()->globGenerator(query, ctx);
+    run_generator(
+        ctx, query->incremental_glob ? "glob (incremental)" : "glob", [&] {
+          root->view()->globGenerator(query, ctx);
+        });
     generated = true;
   }
 
   // And finally, if there were no other generators, we walk all known
   // files
   if (!generated) {
-    root->view()->allFilesGenerator(query, ctx);
+    run_generator(
+        ctx, "all", [&] { root->view()->allFilesGenerator(query, ctx); });
   }
 }
 
+// Describes the generators that default_generators would run
+static json_ref explain_default_generators(
+    w_query* query,
+    struct w_query_ctx* ctx) {
+  auto generators = json_array();
+  auto add = [&](const char* name) {
+    json_array_append_new(
+        generators, typed_string_to_json(name, W_STRING_UNICODE));
+  };
+  if (ctx->since.is_timestamp || !ctx->since.clock.is_fresh_instance) {
+    add("since");
+  }
+  if (query->suffixes.has_value()) {
+    add(query->planned_suffixes ? "suffix (planned)" : "suffix");
+  }
+  if (query->basenames.has_value()) {
+    add("basename (planned)");
+  }
+  if (query->paths.has_value()) {
+    add(query->planned_paths ? "path (planned)" : "path");
+  }
+  if (query->glob_tree) {
+    add(query->incremental_glob ? "glob (incremental)" : "glob");
+  }
+  if (json_array_size(generators) == 0) {
+    add("all");
+  }
+  return generators;
+}
+
 static void execute_common(
     struct w_query_ctx* ctx,
     w_perf_t* sample,
     w_query_res* res,
     w_query_generator generator) {
   if (ctx->query->dedup_results) {
+    ctx->dedupIdentities.reserve(64);
     ctx->dedup.reserve(64);
   }
 
@@ -197,18 +360,34 @@ static void execute_common(
   res->is_fresh_instance =
       !ctx->since.is_timestamp && ctx->since.clock.is_fresh_instance;
 
+  if (ctx->query->explain) {
+    res->explain = json_object(
+        {{"expression",
+          ctx->query->expr ? ctx->query->expr->describe() : json_null()},
+         {"generators",
+          generator
+              ? json_array({typed_string_to_json("custom", W_STRING_UNICODE)})
+              : explain_default_generators(ctx->query, ctx)}});
+  }
+
   if (!(res->is_fresh_instance && ctx->query->empty_on_fresh_instance)) {
-    if (!generator) {
-      generator = default_generators;
+    if (generator) {
+      run_generator(
+          ctx, "custom", [&] { generator(ctx->query, ctx->root, ctx); });
+    } else {
+      default_generators(ctx->query, ctx->root, ctx);
     }
-
-    generator(ctx->query, ctx->root, ctx);
   }
 
+  // A cancelled query stops generating files, so what it has is partial
+  ctx->throwIfCancelled();
+
   // We may have some file results pending re-evaluation,
   // so make sure that we process them before we get to
   // the render phase below.
   ctx->fetchEvalBatchNow();
+  ctx->throwIfCancelled();
+  ctx->renderSorted();
   while (!ctx->fetchRenderBatchNow()) {
     // Depending on the implementation of the query terms and
     // the field renderers, we may need to do a couple of fetches
@@ -220,6 +399,11 @@ static void execute_common(
   // changes or journal truncation]; update res to match
   res->is_fresh_instance |= ctx->since.clock.is_fresh_instance;
 
+  res->numWalked = ctx->getNumWalked();
+  if (ctx->query->profile) {
+    res->profile = w_query_profile_to_json(ctx);
+  }
+
   if (sample && sample->finish()) {
     sample->add_root_meta(ctx->root);
     sample->add_meta(
@@ -227,14 +411,45 @@ static void execute_common(
         json_object(
             {{"fresh_instance", json_boolean(res->is_fresh_instance)},
              {"num_deduped", json_integer(ctx->num_deduped)},
-             {"num_results", json_integer(json_array_size(ctx->resultsArray))},
+             {"num_results",
+              json_integer(
+                  ctx->numStreamed + ctx->numBserRows +
+                  json_array_size(ctx->resultsArray))},
              {"num_walked", json_integer(ctx->getNumWalked())},
+             {"view_lock_wait_us",
+              json_integer(ctx->viewLockWaitTime.count())},
              {"query", ctx->query->query_spec}}));
+    if (res->profile) {
+      sample->add_meta("query_profile", json_ref(res->profile));
+    }
     sample->log();
   }
 
+  if (res->explain) {
+    res->explain.set("num_walked", json_integer(ctx->getNumWalked()));
+  }
+
   res->resultsArray = ctx->resultsArray;
-  res->dedupedFileNames = std::move(ctx->dedup);
+  res->bserRows = std::move(ctx->bserRows);
+  res->numBserRows = ctx->numBserRows;
+  res->nextPageToken = std::move(ctx->nextPageToken);
+  if (ctx->resumeTicks) {
+    res->hasMore = true;
+    res->clockAtStartOfQuery.clock.position.ticks = *ctx->resumeTicks;
+  }
+  if (ctx->query->collect_file_names) {
+    res->dedupedFileNames = std::move(ctx->dedup);
+  }
+}
+
+static json_ref make_results_array(w_query* query) {
+  auto results = json_array();
+  // build a template for the serializer
+  if (query->fieldList.size() > 1) {
+    json_array_set_template_new(
+        results, field_list_to_json_name_array(query->fieldList));
+  }
+  return results;
 }
 
 w_query_ctx::w_query_ctx(
@@ -243,22 +458,54 @@ w_query_ctx::w_query_ctx(
     bool disableFreshInstance)
     : query(q),
       root(root),
-      resultsArray(json_array()),
-      disableFreshInstance{disableFreshInstance} {
-  // build a template for the serializer
-  if (query->fieldList.size() > 1) {
-    json_array_set_template_new(
-        resultsArray, field_list_to_json_name_array(query->fieldList));
+      resultsArray(make_results_array(q)),
+      disableFreshInstance{disableFreshInstance},
+      evalBatchSizer_(
+          root->view()->getFetchBatching(),
+          FetchBatchSizer::Stage::Eval),
+      renderBatchSizer_(
+          root->view()->getFetchBatching(),
+          FetchBatchSizer::Stage::Render) {}
+
+std::unique_ptr<w_query_ctx> w_query_ctx::makeWorkerContext() const {
+  auto worker =
+      std::make_unique<w_query_ctx>(query, root, disableFreshInstance);
+  worker->since = since;
+  worker->clockAtStartOfQuery = clockAtStartOfQuery;
+  worker->lastAgeOutTickValueAtStartOfQuery =
+      lastAgeOutTickValueAtStartOfQuery;
+  worker->priorClockLineage = priorClockLineage;
+  worker->cancellation = cancellation;
+  return worker;
+}
+
+void w_query_ctx::mergeWorkerContext(w_query_ctx& worker) {
+  w_assert(
+      worker.evalBatch_.empty() && worker.renderBatch_.empty(),
+      "worker context has unfinished files");
+  json_array_extend(resultsArray, worker.resultsArray);
+  bserRows.append(worker.bserRows);
+  numBserRows += worker.numBserRows;
+  renderTime += worker.renderTime;
+  evalBatchFetchTime += worker.evalBatchFetchTime;
+  renderBatchFetchTime += worker.renderBatchFetchTime;
+  maybeStreamResults();
+  for (auto& name : worker.dedup) {
+    dedup.insert(name);
   }
+  dedupIdentities.insert(
+      worker.dedupIdentities.begin(), worker.dedupIdentities.end());
+  num_deduped += worker.num_deduped;
+  numWalked_ += worker.numWalked_;
 }
 
 void w_query_ctx::addToEvalBatch(std::unique_ptr<FileResult>&& file) {
   evalBatch_.emplace_back(std::move(file));
 
-  // Find a balance between local memory usage, latency in fetching
-  // and the cost of fetching the data needed to re-evaluate this batch.
-  // TODO: maybe allow passing this number in via the query?
-  if (evalBatch_.size() >= 20480) {
+  // The view says how to balance local memory usage, latency in fetching
+  // and the cost of fetching the data needed to re-evaluate this batch,
+  // and the size adapts to how long the fetches take
+  if (evalBatch_.size() >= evalBatchSizer_.size()) {
     fetchEvalBatchNow();
   }
 }
@@ -267,7 +514,16 @@ void w_query_ctx::fetchEvalBatchNow() {
   if (evalBatch_.empty()) {
     return;
   }
+  if (cancellation && cancellation->poll() != QueryCancellation::Reason::None) {
+    // Don't fetch what nobody is going to look at
+    evalBatch_.clear();
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
   evalBatch_.front()->batchFetchProperties(evalBatch_);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  evalBatchFetchTime += elapsed;
+  evalBatchSizer_.record(evalBatch_.size(), elapsed);
 
   auto toProcess = std::move(evalBatch_);
 
@@ -278,20 +534,305 @@ void w_query_ctx::fetchEvalBatchNow() {
   w_assert(evalBatch_.empty(), "should have no files that NeedDataLoad");
 }
 
+bool w_query_ctx::limitReached() const {
+  // An ordered query has to see all of the files to find the first ones
+  return query->limit > 0 && !query->order_by_name && !query->order_by_ticks &&
+      numMatched >= size_t(query->offset) + query->limit;
+}
+
+// How many files a query looks at between checks of its deadline and its
+// client, which take a clock read and a syscall
+static constexpr uint32_t kCancelPollInterval = 1024;
+
+bool w_query_ctx::cancelled() {
+  if (!cancellation) {
+    return false;
+  }
+  if (++callsSinceCancelPoll_ < kCancelPollInterval) {
+    return cancellation->reason() != QueryCancellation::Reason::None;
+  }
+  callsSinceCancelPoll_ = 0;
+  return cancellation->poll() != QueryCancellation::Reason::None;
+}
+
+void w_query_ctx::throwIfCancelled() const {
+  if (!cancellation) {
+    return;
+  }
+  auto reason = cancellation->poll();
+  if (reason != QueryCancellation::Reason::None) {
+    throw QueryExecError(
+        "cancelled because ", QueryCancellation::describe(reason));
+  }
+}
+
+// The order of the names of a query that is ordered by name.  When it is
+// also grouped by directory, the names are ordered by their directory and
+// then by their base name, so that the files of each directory are together.
+static bool nameLess(
+    const w_query* query,
+    w_string_piece a,
+    w_string_piece b) {
+  if (query->group_by_dir) {
+    auto aDir = a.dirName();
+    auto bDir = b.dirName();
+    if (!(aDir == bDir)) {
+      return aDir < bDir;
+    }
+    return a.baseName() < b.baseName();
+  }
+  return a < b;
+}
+
+namespace {
+struct NamedFileLess {
+  const w_query* query;
+
+  bool operator()(
+      const std::pair<w_string, std::unique_ptr<FileResult>>& a,
+      const std::pair<w_string, std::unique_ptr<FileResult>>& b) const {
+    return nameLess(query, a.first.piece(), b.first.piece());
+  }
+};
+} // namespace
+
+// Stably groups the files by their directory, with the groups in the order
+// in which the first file of each was generated
+static void groupByDir(
+    std::vector<std::pair<w_string, std::unique_ptr<FileResult>>>& files) {
+  std::unordered_map<w_string_piece, size_t> groups;
+  std::vector<size_t> groupOf(files.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    groupOf[i] =
+        groups.emplace(files[i].first.piece().dirName(), groups.size())
+            .first->second;
+  }
+  if (groups.size() <= 1) {
+    return;
+  }
+
+  // Where each group starts in the grouped files
+  std::vector<size_t> next(groups.size() + 1);
+  for (auto group : groupOf) {
+    ++next[group + 1];
+  }
+  for (size_t group = 1; group < next.size(); ++group) {
+    next[group] += next[group - 1];
+  }
+  groups.clear();
+
+  std::vector<std::pair<w_string, std::unique_ptr<FileResult>>> grouped(
+      files.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    grouped[next[groupOf[i]]++] = std::move(files[i]);
+  }
+  files = std::move(grouped);
+}
+
+void w_query_ctx::addMatch(std::unique_ptr<FileResult>&& file) {
+  if (query->order_by_ticks) {
+    ++numMatched;
+    auto otime = file->otime();
+    auto ticks = otime ? otime->ticks : 0;
+    if (droppedFromTick_ && ticks >= *droppedFromTick_) {
+      return;
+    }
+    byTick_[ticks].emplace_back(std::move(file));
+    ++numByTick_;
+    while (query->limit > 0 && byTick_.size() > 1) {
+      auto latest = std::prev(byTick_.end());
+      if (numByTick_ - latest->second.size() < query->limit) {
+        break;
+      }
+      numByTick_ -= latest->second.size();
+      droppedFromTick_ = latest->first;
+      byTick_.erase(latest);
+    }
+    return;
+  }
+
+  if (!query->order_by_name) {
+    if (numMatched++ < query->offset) {
+      return;
+    }
+    if (query->group_by_dir) {
+      // Held until all of them have matched, and grouped then unless the
+      // generator already emitted them by directory
+      sorted_.emplace_back(
+          generatedInDirOrder ? w_string() : computeWholeName(file.get()),
+          std::move(file));
+      return;
+    }
+    maybeRender(std::move(file));
+    return;
+  }
+
+  auto name = computeWholeName(file.get());
+  if (query->page_token &&
+      !nameLess(query, query->page_token.piece(), name.piece())) {
+    // Returned in an earlier page
+    return;
+  }
+  ++numMatched;
+
+  // Only the first offset + limit files by name need to be kept
+  NamedFileLess less{query};
+  sorted_.emplace_back(std::move(name), std::move(file));
+  std::push_heap(sorted_.begin(), sorted_.end(), less);
+  if (query->limit > 0 &&
+      sorted_.size() > size_t(query->offset) + query->limit) {
+    std::pop_heap(sorted_.begin(), sorted_.end(), less);
+    sorted_.pop_back();
+  }
+}
+
+void w_query_ctx::renderSorted() {
+  if (!query->order_by_name && !query->group_by_dir &&
+      !query->order_by_ticks) {
+    return;
+  }
+  auto files = std::move(sorted_);
+  sorted_.clear();
+  if (query->order_by_ticks) {
+    files.reserve(numByTick_);
+    for (auto& it : byTick_) {
+      for (auto& file : it.second) {
+        files.emplace_back(w_string(), std::move(file));
+      }
+    }
+    if (droppedFromTick_ && !byTick_.empty()) {
+      resumeTicks = byTick_.rbegin()->first;
+    }
+    byTick_.clear();
+  } else if (query->order_by_name) {
+    std::sort_heap(files.begin(), files.end(), NamedFileLess{query});
+    files.erase(
+        files.begin(),
+        files.begin() + std::min(files.size(), size_t(query->offset)));
+    if (query->limit > 0 &&
+        numMatched > size_t(query->offset) + query->limit && !files.empty()) {
+      nextPageToken = files.back().first;
+    }
+  } else if (!generatedInDirOrder) {
+    groupByDir(files);
+  }
+
+  // The files are rendered into place so that those that need data to be
+  // loaded don't fall out of order
+  std::vector<folly::Optional<json_ref>> rendered(files.size());
+  std::vector<std::string> rows(query->render_bser ? files.size() : 0);
+  std::vector<size_t> pending(files.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    pending[i] = i;
+  }
+  while (true) {
+    std::vector<size_t> needData;
+    auto renderStart = std::chrono::steady_clock::now();
+    for (auto i : pending) {
+      bool done;
+      if (query->render_bser) {
+        done = file_result_to_bser(
+            query->fieldList, files[i].second, this, &rows[i]);
+      } else {
+        rendered[i] =
+            file_result_to_json(query->fieldList, files[i].second, this);
+        done = rendered[i].has_value();
+      }
+      if (!done) {
+        needData.push_back(i);
+      }
+    }
+    renderTime += std::chrono::steady_clock::now() - renderStart;
+    if (needData.empty()) {
+      break;
+    }
+
+    std::vector<std::unique_ptr<FileResult>> batch;
+    batch.reserve(needData.size());
+    for (auto i : needData) {
+      batch.emplace_back(std::move(files[i].second));
+    }
+    auto fetchStart = std::chrono::steady_clock::now();
+    batch.front()->batchFetchProperties(batch);
+    renderBatchFetchTime += std::chrono::steady_clock::now() - fetchStart;
+    for (size_t j = 0; j < needData.size(); ++j) {
+      files[needData[j]].second = std::move(batch[j]);
+    }
+    pending = std::move(needData);
+  }
+
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (query->render_bser) {
+      bserRows.append(rows[i]);
+      ++numBserRows;
+    } else {
+      addResult(std::move(rendered[i].value()));
+    }
+  }
+}
+
 void w_query_ctx::maybeRender(std::unique_ptr<FileResult>&& file) {
-  auto maybeRendered = file_result_to_json(query->fieldList, file, this);
-  if (maybeRendered.has_value()) {
-    json_array_append_new(resultsArray, std::move(maybeRendered.value()));
+  bool rendered;
+  if (query->profile) {
+    auto start = std::chrono::steady_clock::now();
+    rendered = tryRender(file);
+    renderTime += std::chrono::steady_clock::now() - start;
+  } else {
+    rendered = tryRender(file);
+  }
+  if (rendered) {
     return;
   }
 
   addToRenderBatch(std::move(file));
 }
 
+bool w_query_ctx::tryRender(const std::unique_ptr<FileResult>& file) {
+  if (query->render_bser) {
+    if (!file_result_to_bser(query->fieldList, file, this, &bserRows)) {
+      return false;
+    }
+    ++numBserRows;
+    return true;
+  }
+
+  auto maybeRendered = file_result_to_json(query->fieldList, file, this);
+  if (!maybeRendered.has_value()) {
+    return false;
+  }
+  addResult(std::move(maybeRendered.value()));
+  return true;
+}
+
+void w_query_ctx::addResult(json_ref&& rendered) {
+  json_array_append_new(resultsArray, std::move(rendered));
+  maybeStreamResults();
+}
+
+JsonArena* w_query_ctx::resultArena() const {
+  if (!resultArena_) {
+    resultArena_ = JsonArena::make();
+  }
+  return resultArena_.get();
+}
+
+void w_query_ctx::maybeStreamResults() {
+  if (!streamResults) {
+    return;
+  }
+  auto size = json_array_size(resultsArray);
+  if (size < query->stream_chunk_size) {
+    return;
+  }
+  numStreamed += size;
+  auto results = std::move(resultsArray);
+  resultsArray = make_results_array(query);
+  query->result_sink(std::move(results));
+}
+
 void w_query_ctx::addToRenderBatch(std::unique_ptr<FileResult>&& file) {
   renderBatch_.emplace_back(std::move(file));
-  // TODO: maybe allow passing this number in via the query?
-  if (renderBatch_.size() >= kMaximumRenderBatchSize) {
+  if (renderBatch_.size() >= renderBatchSizer_.size()) {
     fetchRenderBatchNow();
   }
 }
@@ -300,18 +841,20 @@ bool w_query_ctx::fetchRenderBatchNow() {
   if (renderBatch_.empty()) {
     return true;
   }
+  auto start = std::chrono::steady_clock::now();
   renderBatch_.front()->batchFetchProperties(renderBatch_);
+  auto fetched = std::chrono::steady_clock::now();
+  renderBatchFetchTime += fetched - start;
+  renderBatchSizer_.record(renderBatch_.size(), fetched - start);
 
   auto toProcess = std::move(renderBatch_);
 
   for (auto& file : toProcess) {
-    auto maybeRendered = file_result_to_json(query->fieldList, file, this);
-    if (maybeRendered.has_value()) {
-      json_array_append_new(resultsArray, std::move(maybeRendered.value()));
-    } else {
+    if (!tryRender(file)) {
       renderBatch_.emplace_back(std::move(file));
     }
   }
+  renderTime += std::chrono::steady_clock::now() - fetched;
 
   return renderBatch_.empty();
 }
@@ -319,10 +862,29 @@ bool w_query_ctx::fetchRenderBatchNow() {
 // Capability indicating support for scm-aware since queries
 W_CAP_REG("scm-since")
 
+// True if the query produces the files in its scope whether or not they
+// changed since a clock, and so can't run against a view that has
+// collapsed some of them; see QueryableView::expandCollapsedDirs
+static bool needsAllFilesInScope(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    const w_query_generator& generator) {
+  if (ctx->since.is_timestamp) {
+    return true;
+  }
+  if (ctx->since.clock.is_fresh_instance && !query->empty_on_fresh_instance) {
+    return true;
+  }
+  return !generator &&
+      (query->suffixes.has_value() || query->basenames.has_value() ||
+       query->paths.has_value() || query->glob_tree);
+}
+
 w_query_res w_query_execute(
     w_query* query,
     const std::shared_ptr<w_root_t>& root,
-    w_query_generator generator) {
+    w_query_generator generator,
+    std::function<bool()> clientGone) {
   w_query_res res;
   std::shared_ptr<w_query> altQuery;
   ClockSpec resultClock(ClockPosition{});
@@ -330,6 +892,8 @@ w_query_res w_query_execute(
   auto requestId = query->request_id;
 
   w_perf_t sample("query_execute");
+  sample.set_root(root);
+  TraceSpan span("query_execute", root->root_path, true);
   if (requestId && !requestId.empty()) {
     log(DBG, "request_id = ", requestId, "\n");
     sample.add_meta("request_id", w_string_to_json(requestId));
@@ -399,8 +963,8 @@ w_query_res w_query_execute(
                         const std::shared_ptr<w_root_t>& r,
                         struct w_query_ctx* c) {
           auto changedFiles =
-              root->view()->getSCM()->getFilesChangedSinceMergeBaseWith(
-                  modifiedMergebase, requestId);
+              root->scmChangedFiles->getFilesChangedSinceMergeBase(
+                  root, modifiedMergebase, requestId);
 
           auto pathList = json_array_of_size(changedFiles.size());
           for (auto& f : changedFiles) {
@@ -411,6 +975,7 @@ w_query_res w_query_execute(
           w_clock_t clock{0, 0};
           clock.ticks = spec.ticks;
           time(&clock.timestamp);
+          auto dirCache = std::make_shared<LocalFileResult::DirCache>();
           for (auto& pathEntry : pathList.array()) {
             auto path = json_to_w_string(pathEntry);
 
@@ -426,7 +991,10 @@ w_query_res w_query_execute(
             // to see a directory returned from that call; we're only going
             // to enumerate !dirs for this case.
             w_query_process_file(
-                q, c, std::make_unique<LocalFileResult>(r, fullPath, clock));
+                q,
+                c,
+                std::make_unique<LocalFileResult>(
+                    r, fullPath, clock, dirCache));
           }
         };
       } else if (query->fail_if_no_saved_state) {
@@ -445,6 +1013,15 @@ w_query_res w_query_execute(
   }
 
   w_query_ctx ctx(query, root, disableFreshInstance);
+  ctx.streamResults = query->stream_chunk_size > 0 && query->result_sink;
+  if (query->timeout.count() || clientGone) {
+    folly::Optional<std::chrono::steady_clock::time_point> deadline;
+    if (query->timeout.count()) {
+      deadline = std::chrono::steady_clock::now() + query->timeout;
+    }
+    ctx.cancellation =
+        std::make_shared<QueryCancellation>(deadline, std::move(clientGone));
+  }
   if (query->sync_timeout.count()) {
     try {
       root->syncToNow(query->sync_timeout);
@@ -468,6 +1045,7 @@ w_query_res w_query_execute(
       ClockSpec(root->view()->getMostRecentRootNumberAndTickValue());
   ctx.lastAgeOutTickValueAtStartOfQuery =
       root->view()->getLastAgeOutTickValue();
+  ctx.priorClockLineage = root->view()->getPriorClockLineage();
 
   // Copy in any scm parameters
   res.clockAtStartOfQuery = resultClock;
@@ -475,11 +1053,29 @@ w_query_res w_query_execute(
   res.clockAtStartOfQuery.clock = ctx.clockAtStartOfQuery.clock;
 
   // Evaluate the cursor for this root
-  ctx.since = query->since_spec ? query->since_spec->evaluate(
-                                      ctx.clockAtStartOfQuery.position(),
-                                      ctx.lastAgeOutTickValueAtStartOfQuery,
-                                      &root->inner.cursors)
-                                : w_query_since();
+  ctx.since = query->since_spec
+      ? query->since_spec->evaluate(
+            ctx.clockAtStartOfQuery.position(),
+            ctx.lastAgeOutTickValueAtStartOfQuery,
+            &root->inner.cursors,
+            ctx.priorClockLineage.get_pointer())
+      : w_query_since();
+
+  if (!ctx.disableFreshInstance &&
+      needsAllFilesInScope(query, &ctx, generator) &&
+      root->view()->expandCollapsedDirs(query->relative_root)) {
+    try {
+      root->syncToNow(
+          query->sync_timeout.count() ? query->sync_timeout
+                                      : DEFAULT_QUERY_SYNC_MS);
+    } catch (const std::exception& exc) {
+      throw QueryExecError("synchronization failed: ", exc.what());
+    }
+    // The results include the files that were crawled just now
+    ctx.clockAtStartOfQuery =
+        ClockSpec(root->view()->getMostRecentRootNumberAndTickValue());
+    res.clockAtStartOfQuery.clock = ctx.clockAtStartOfQuery.clock;
+  }
 
   if (query->bench_iterations > 0) {
     for (uint32_t i = 0; i < query->bench_iterations; ++i) {
@@ -487,6 +1083,7 @@ w_query_res w_query_execute(
       w_query_res r;
       c.clockAtStartOfQuery = ctx.clockAtStartOfQuery;
       c.since = ctx.since;
+      c.cancellation = ctx.cancellation;
       execute_common(&c, nullptr, &r, generator);
     }
   }
@@ -495,5 +1092,34 @@ w_query_res w_query_execute(
   return res;
 }
 
+std::shared_ptr<const w_query_res> w_query_execute_shared(
+    w_query* query,
+    const std::shared_ptr<w_root_t>& root,
+    w_query_generator generator) {
+  auto since_spec = query->since_spec.get();
+  if (since_spec &&
+      (since_spec->hasScmParams() || since_spec->tag == w_cs_named_cursor)) {
+    // Evaluating these has effects beyond the result: it consults the
+    // SCM or advances the cursor
+    return std::make_shared<const w_query_res>(
+        w_query_execute(query, root, std::move(generator)));
+  }
+
+  auto key = json_dumps(query->query_spec, JSON_COMPACT | JSON_SORT_KEYS);
+  // Only some of the queries collect the names
+  key.push_back(query->collect_file_names ? '#' : '@');
+  if (since_spec) {
+    key.append(json_dumps(since_spec->toJson(), JSON_COMPACT | JSON_SORT_KEYS));
+  }
+  return root->sharedSubscriptionResults.getOrCompute(
+      w_string(key.data(), key.size(), W_STRING_BYTE),
+      root->view()->getMostRecentRootNumberAndTickValue(),
+      [&] {
+        auto res = std::make_shared<const w_query_res>(
+            w_query_execute(query, root, std::move(generator)));
+        return std::make_pair(res, res->clockAtStartOfQuery.position());
+      });
+}
+
 /* vim:ts=2:sw=2:et:
  */
@@ -2,15 +2,35 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include "ContentHash.h"
 #include "watchman_error_category.h"
 
 using namespace watchman;
 using folly::Optional;
 
+/* Each field has a make_xxx function that renders it as a json value.
+ * The commonly requested fields also have an encode_xxx function that
+ * appends the same value in BSER form straight to the output of a query
+ * that is set to render_bser, so that a row of results can be produced
+ * without allocating any json values.  Fields without one are rendered
+ * with make_xxx and then encoded. */
+
 static Optional<json_ref> make_name(FileResult* file, const w_query_ctx* ctx) {
   return w_string_to_json(ctx->computeWholeName(file));
 }
 
+static bool encode_name(
+    FileResult* file,
+    const w_query_ctx* ctx,
+    const bser_ctx_t* bser,
+    std::string* out) {
+  // The name is copied into the output, so it can be assembled in a
+  // buffer that this thread reuses rather than in a new w_string
+  thread_local std::string buf;
+  w_bser_dump_bytestring(bser, ctx->computeWholeName(file, buf), out);
+  return true;
+}
+
 static Optional<json_ref> make_symlink(FileResult* file, const w_query_ctx*) {
   auto target = file->readLink();
   if (!target.has_value()) {
@@ -19,21 +39,70 @@ static Optional<json_ref> make_symlink(FileResult* file, const w_query_ctx*) {
   return *target ? w_string_to_json(*target) : json_null();
 }
 
-static Optional<json_ref> make_sha1_hex(FileResult* file, const w_query_ctx*) {
+static Optional<json_ref> make_renamed_from(
+    FileResult* file,
+    const w_query_ctx* ctx) {
+  auto from = file->renamedFrom();
+  if (!from.has_value()) {
+    return folly::none;
+  }
+  if (!*from) {
+    return json_null();
+  }
+  // Relative to the root, as the old name may lie outside of the
+  // relative_root of the query
+  w_string_piece name(*from);
+  name.advance(ctx->root->root_path.size() + 1);
+  return w_string_to_json(name.asWString());
+}
+
+static Optional<json_ref> make_tree_hash(
+    FileResult* file,
+    const w_query_ctx*) {
+  auto summary = file->treeSummary();
+  if (!summary.has_value()) {
+    return json_null();
+  }
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016" PRIx64, summary->hash);
+  return typed_string_to_json(buf, W_STRING_UNICODE);
+}
+
+static Optional<json_ref> make_tree_stats(
+    FileResult* file,
+    const w_query_ctx*) {
+  auto summary = file->treeSummary();
+  if (!summary.has_value()) {
+    return json_null();
+  }
+  auto& mtime = summary->newestMtime;
+  return json_object(
+      {{"files", json_integer(summary->files)},
+       {"dirs", json_integer(summary->dirs)},
+       {"size", json_integer(summary->bytes)},
+       {"mtime", json_integer(mtime.tv_sec)},
+       {"mtime_ns",
+        json_integer(int64_t(mtime.tv_sec) * 1000000000 + mtime.tv_nsec)}});
+}
+
+// Renders the first `size` bytes of the digest returned by getDigest as
+// a hex string
+template <typename GetDigest>
+static Optional<json_ref> make_hash_hex(GetDigest&& getDigest, size_t size) {
   try {
-    auto hash = file->getContentSha1();
+    auto hash = getDigest();
     if (!hash.has_value()) {
       // Need to load it still
       return folly::none;
     }
-    char buf[40];
+    char buf[std::tuple_size<FileResult::ContentDigest>::value * 2];
     static const char* hexDigit = "0123456789abcdef";
-    for (size_t i = 0; i < hash->size(); ++i) {
+    for (size_t i = 0; i < size; ++i) {
       auto& digit = (*hash)[i];
       buf[(i * 2) + 0] = hexDigit[digit >> 4];
       buf[(i * 2) + 1] = hexDigit[digit & 0xf];
     }
-    return w_string_to_json(w_string(buf, sizeof(buf), W_STRING_UNICODE));
+    return w_string_to_json(w_string(buf, size * 2, W_STRING_UNICODE));
   } catch (const std::system_error& exc) {
     auto errcode = exc.code();
     if (errcode == watchman::error_code::no_such_file_or_directory ||
@@ -53,6 +122,28 @@ static Optional<json_ref> make_sha1_hex(FileResult* file, const w_query_ctx*) {
   }
 }
 
+static Optional<json_ref> make_sha1_hex(FileResult* file, const w_query_ctx*) {
+  return make_hash_hex(
+      [file] { return file->getContentSha1(); },
+      std::tuple_size<FileResult::ContentHash>::value);
+}
+
+static Optional<json_ref> make_blake3_hex(
+    FileResult* file,
+    const w_query_ctx*) {
+  return make_hash_hex(
+      [file] { return file->getContentHash(ContentHashAlgorithm::Blake3); },
+      contentHashSize(ContentHashAlgorithm::Blake3));
+}
+
+static Optional<json_ref> make_xxh128_hex(
+    FileResult* file,
+    const w_query_ctx*) {
+  return make_hash_hex(
+      [file] { return file->getContentHash(ContentHashAlgorithm::Xxh128); },
+      contentHashSize(ContentHashAlgorithm::Xxh128));
+}
+
 static Optional<json_ref> make_size(FileResult* file, const w_query_ctx*) {
   auto size = file->size();
   if (!size.has_value()) {
@@ -61,6 +152,19 @@ static Optional<json_ref> make_size(FileResult* file, const w_query_ctx*) {
   return json_integer(size.value());
 }
 
+static bool encode_size(
+    FileResult* file,
+    const w_query_ctx*,
+    const bser_ctx_t* bser,
+    std::string* out) {
+  auto size = file->size();
+  if (!size.has_value()) {
+    return false;
+  }
+  w_bser_dump_int(bser, size.value(), out);
+  return true;
+}
+
 static Optional<json_ref> make_exists(FileResult* file, const w_query_ctx*) {
   auto exists = file->exists();
   if (!exists.has_value()) {
@@ -69,25 +173,53 @@ static Optional<json_ref> make_exists(FileResult* file, const w_query_ctx*) {
   return json_boolean(exists.value());
 }
 
-static Optional<json_ref> make_new(FileResult* file, const w_query_ctx* ctx) {
-  bool is_new = false;
+static bool encode_exists(
+    FileResult* file,
+    const w_query_ctx*,
+    const bser_ctx_t* bser,
+    std::string* out) {
+  auto exists = file->exists();
+  if (!exists.has_value()) {
+    return false;
+  }
+  w_bser_dump_bool(bser, exists.value(), out);
+  return true;
+}
 
+static Optional<bool> is_new(FileResult* file, const w_query_ctx* ctx) {
   if (!ctx->since.is_timestamp && ctx->since.clock.is_fresh_instance) {
-    is_new = true;
-  } else {
-    auto ctime = file->ctime();
-    if (!ctime.has_value()) {
-      // Reconsider this one later
-      return folly::none;
-    }
-    if (ctx->since.is_timestamp) {
-      is_new = ctx->since.timestamp > ctime->timestamp;
-    } else {
-      is_new = ctime->ticks > ctx->since.clock.ticks;
-    }
+    return true;
+  }
+  auto ctime = file->ctime();
+  if (!ctime.has_value()) {
+    // Reconsider this one later
+    return folly::none;
   }
+  if (ctx->since.is_timestamp) {
+    return ctx->since.timestamp > ctime->timestamp;
+  }
+  return ctime->ticks > ctx->since.clock.ticks;
+}
 
-  return json_boolean(is_new);
+static Optional<json_ref> make_new(FileResult* file, const w_query_ctx* ctx) {
+  auto value = is_new(file, ctx);
+  if (!value.has_value()) {
+    return folly::none;
+  }
+  return json_boolean(value.value());
+}
+
+static bool encode_new(
+    FileResult* file,
+    const w_query_ctx* ctx,
+    const bser_ctx_t* bser,
+    std::string* out) {
+  auto value = is_new(file, ctx);
+  if (!value.has_value()) {
+    return false;
+  }
+  w_bser_dump_bool(bser, value.value(), out);
+  return true;
 }
 
 #define MAKE_CLOCK_FIELD(name, member)                      \
@@ -118,39 +250,80 @@ static_assert(
     sizeof(json_int_t) >= sizeof(time_t),
     "json_int_t isn't large enough to hold a time_t");
 
-#define MAKE_INT_FIELD(name, member)          \
-  static Optional<json_ref> make_##name(      \
-      FileResult* file, const w_query_ctx*) { \
-    auto stat = file->stat();                 \
-    if (!stat.has_value()) {                  \
-      /* need to load data */                 \
-      return folly::none;                     \
-    }                                         \
-    return json_integer(stat->member);        \
-  }
-
-#define MAKE_TIME_INT_FIELD(name, member, scale)                  \
-  static Optional<json_ref> make_##name(                          \
-      FileResult* file, const w_query_ctx*) {                     \
-    auto spec = file->member();                                   \
-    if (!spec.has_value()) {                                      \
-      /* need to load data */                                     \
-      return folly::none;                                         \
-    }                                                             \
-    return json_integer(                                          \
-        ((int64_t)spec->tv_sec * scale) +                         \
-        ((int64_t)spec->tv_nsec * scale / WATCHMAN_NSEC_IN_SEC)); \
-  }
-
-#define MAKE_TIME_DOUBLE_FIELD(name, member)               \
-  static Optional<json_ref> make_##name(                   \
-      FileResult* file, const w_query_ctx*) {              \
-    auto spec = file->member();                            \
-    if (!spec.has_value()) {                               \
-      /* need to load data */                              \
-      return folly::none;                                  \
-    }                                                      \
-    return json_real(spec->tv_sec + 1e-9 * spec->tv_nsec); \
+#define MAKE_INT_FIELD(name, member)                                  \
+  static Optional<json_ref> make_##name(                              \
+      FileResult* file, const w_query_ctx*) {                         \
+    auto stat = file->stat();                                         \
+    if (!stat.has_value()) {                                          \
+      /* need to load data */                                         \
+      return folly::none;                                             \
+    }                                                                 \
+    return json_integer(stat->member);                                \
+  }                                                                   \
+  static bool encode_##name(                                          \
+      FileResult* file,                                               \
+      const w_query_ctx*,                                             \
+      const bser_ctx_t* bser,                                         \
+      std::string* out) {                                             \
+    auto stat = file->stat();                                         \
+    if (!stat.has_value()) {                                          \
+      /* need to load data */                                         \
+      return false;                                                   \
+    }                                                                 \
+    w_bser_dump_int(bser, stat->member, out);                         \
+    return true;                                                      \
+  }
+
+#define TIME_INT_VALUE(spec, scale)     \
+  (((int64_t)(spec)->tv_sec * scale) + \
+   ((int64_t)(spec)->tv_nsec * scale / WATCHMAN_NSEC_IN_SEC))
+
+#define MAKE_TIME_INT_FIELD(name, member, scale)             \
+  static Optional<json_ref> make_##name(                     \
+      FileResult* file, const w_query_ctx*) {                \
+    auto spec = file->member();                              \
+    if (!spec.has_value()) {                                 \
+      /* need to load data */                                \
+      return folly::none;                                    \
+    }                                                        \
+    return json_integer(TIME_INT_VALUE(spec, scale));        \
+  }                                                          \
+  static bool encode_##name(                                 \
+      FileResult* file,                                      \
+      const w_query_ctx*,                                    \
+      const bser_ctx_t* bser,                                \
+      std::string* out) {                                    \
+    auto spec = file->member();                              \
+    if (!spec.has_value()) {                                 \
+      /* need to load data */                                \
+      return false;                                          \
+    }                                                        \
+    w_bser_dump_int(bser, TIME_INT_VALUE(spec, scale), out); \
+    return true;                                             \
+  }
+
+#define MAKE_TIME_DOUBLE_FIELD(name, member)                          \
+  static Optional<json_ref> make_##name(                              \
+      FileResult* file, const w_query_ctx*) {                         \
+    auto spec = file->member();                                       \
+    if (!spec.has_value()) {                                          \
+      /* need to load data */                                         \
+      return folly::none;                                             \
+    }                                                                 \
+    return json_real(spec->tv_sec + 1e-9 * spec->tv_nsec);            \
+  }                                                                   \
+  static bool encode_##name(                                          \
+      FileResult* file,                                               \
+      const w_query_ctx*,                                             \
+      const bser_ctx_t* bser,                                         \
+      std::string* out) {                                             \
+    auto spec = file->member();                                       \
+    if (!spec.has_value()) {                                          \
+      /* need to load data */                                         \
+      return false;                                                   \
+    }                                                                 \
+    w_bser_dump_real(bser, spec->tv_sec + 1e-9 * spec->tv_nsec, out); \
+    return true;                                                      \
   }
 
 /* For each type (e.g. "m"), define fields
@@ -179,38 +352,48 @@ MAKE_INT_FIELD(nlink, nlink)
 
 // clang-format off
 #define MAKE_TIME_FIELD_DEFS(type) \
-  { #type "time", make_##type##time}, \
-  { #type "time_ms", make_##type##time_ms},\
-  { #type "time_us", make_##type##time_us}, \
-  { #type "time_ns", make_##type##time_ns}, \
-  { #type "time_f", make_##type##time_f}
+  { #type "time", make_##type##time, encode_##type##time}, \
+  { #type "time_ms", make_##type##time_ms, encode_##type##time_ms},\
+  { #type "time_us", make_##type##time_us, encode_##type##time_us}, \
+  { #type "time_ns", make_##type##time_ns, encode_##type##time_ns}, \
+  { #type "time_f", make_##type##time_f, encode_##type##time_f}
 // clang-format on
 
-static Optional<json_ref> make_type_field(
-    FileResult* file,
-    const w_query_ctx*) {
+// Returns the letter code for the type of file, or nullptr if its type
+// isn't known until its data is loaded
+static const w_string* type_string(FileResult* file) {
+  static const w_string kRegular("f", W_STRING_UNICODE);
+  static const w_string kDir("d", W_STRING_UNICODE);
+  static const w_string kSymlink("l", W_STRING_UNICODE);
+  static const w_string kBlock("b", W_STRING_UNICODE);
+  static const w_string kChar("c", W_STRING_UNICODE);
+  static const w_string kFifo("p", W_STRING_UNICODE);
+  static const w_string kSocket("s", W_STRING_UNICODE);
+  static const w_string kDoor("D", W_STRING_UNICODE);
+  static const w_string kUnknown("?", W_STRING_UNICODE);
+
   auto dtype = file->dtype();
   if (dtype.has_value()) {
     switch (*dtype) {
       case DType::Regular:
-        return typed_string_to_json("f", W_STRING_UNICODE);
+        return &kRegular;
       case DType::Dir:
-        return typed_string_to_json("d", W_STRING_UNICODE);
+        return &kDir;
       case DType::Symlink:
-        return typed_string_to_json("l", W_STRING_UNICODE);
+        return &kSymlink;
       case DType::Block:
-        return typed_string_to_json("b", W_STRING_UNICODE);
+        return &kBlock;
       case DType::Char:
-        return typed_string_to_json("c", W_STRING_UNICODE);
+        return &kChar;
       case DType::Fifo:
-        return typed_string_to_json("p", W_STRING_UNICODE);
+        return &kFifo;
       case DType::Socket:
-        return typed_string_to_json("s", W_STRING_UNICODE);
+        return &kSocket;
       case DType::Whiteout:
         // Whiteout shouldn't generally be visible to userspace,
         // and we don't have a defined letter code for it, so
         // treat it as "who knows!?"
-        return typed_string_to_json("?", W_STRING_UNICODE);
+        return &kUnknown;
       case DType::Unknown:
       default:
           // Not enough info; fall through and use the full stat data
@@ -221,39 +404,62 @@ static Optional<json_ref> make_type_field(
   // Bias towards the more common file types first
   auto optionalStat = file->stat();
   if (!optionalStat.has_value()) {
-    return folly::none;
+    return nullptr;
   }
 
   auto stat = optionalStat.value();
   if (stat.isFile()) {
-    return typed_string_to_json("f", W_STRING_UNICODE);
+    return &kRegular;
   }
   if (stat.isDir()) {
-    return typed_string_to_json("d", W_STRING_UNICODE);
+    return &kDir;
   }
   if (stat.isSymlink()) {
-    return typed_string_to_json("l", W_STRING_UNICODE);
+    return &kSymlink;
   }
 #ifndef _WIN32
   if (S_ISBLK(stat.mode)) {
-    return typed_string_to_json("b", W_STRING_UNICODE);
+    return &kBlock;
   }
   if (S_ISCHR(stat.mode)) {
-    return typed_string_to_json("c", W_STRING_UNICODE);
+    return &kChar;
   }
   if (S_ISFIFO(stat.mode)) {
-    return typed_string_to_json("p", W_STRING_UNICODE);
+    return &kFifo;
   }
   if (S_ISSOCK(stat.mode)) {
-    return typed_string_to_json("s", W_STRING_UNICODE);
+    return &kSocket;
   }
 #endif
 #ifdef S_ISDOOR
   if (S_ISDOOR(stat.mode)) {
-    return typed_string_to_json("D", W_STRING_UNICODE);
+    return &kDoor;
   }
 #endif
-  return typed_string_to_json("?", W_STRING_UNICODE);
+  return &kUnknown;
+}
+
+static Optional<json_ref> make_type_field(
+    FileResult* file,
+    const w_query_ctx*) {
+  auto type = type_string(file);
+  if (!type) {
+    return folly::none;
+  }
+  return w_string_to_json(*type);
+}
+
+static bool encode_type_field(
+    FileResult* file,
+    const w_query_ctx*,
+    const bser_ctx_t* bser,
+    std::string* out) {
+  auto type = type_string(file);
+  if (!type) {
+    return false;
+  }
+  w_bser_dump_string(bser, *type, out);
+  return true;
 }
 
 // Helper to construct the list of field defs
@@ -261,30 +467,51 @@ static std::unordered_map<w_string, w_query_field_renderer> build_defs() {
   struct {
     const char* name;
     Optional<json_ref> (*make)(FileResult* file, const w_query_ctx* ctx);
+    decltype(w_query_field_renderer::encodeBser) encodeBser;
   } defs[] = {
-      {"name", make_name},
-      {"symlink_target", make_symlink},
-      {"exists", make_exists},
-      {"size", make_size},
-      {"mode", make_mode},
-      {"uid", make_uid},
-      {"gid", make_gid},
+      {"name", make_name, encode_name},
+      {"symlink_target", make_symlink, nullptr},
+      {"renamed_from", make_renamed_from, nullptr},
+      {"tree_hash", make_tree_hash, nullptr},
+      {"tree_stats", make_tree_stats, nullptr},
+      {"exists", make_exists, encode_exists},
+      {"size", make_size, encode_size},
+      {"mode", make_mode, encode_mode},
+      {"uid", make_uid, encode_uid},
+      {"gid", make_gid, encode_gid},
       MAKE_TIME_FIELD_DEFS(a),
       MAKE_TIME_FIELD_DEFS(m),
       MAKE_TIME_FIELD_DEFS(c),
-      {"ino", make_ino},
-      {"dev", make_dev},
-      {"nlink", make_nlink},
-      {"new", make_new},
-      {"oclock", make_oclock},
-      {"cclock", make_cclock},
-      {"type", make_type_field},
-      {"content.sha1hex", make_sha1_hex},
+      {"ino", make_ino, encode_ino},
+      {"dev", make_dev, encode_dev},
+      {"nlink", make_nlink, encode_nlink},
+      {"new", make_new, encode_new},
+      {"oclock", make_oclock, nullptr},
+      {"cclock", make_cclock, nullptr},
+      {"type", make_type_field, encode_type_field},
+      {"content.sha1hex", make_sha1_hex, nullptr},
   };
   std::unordered_map<w_string, w_query_field_renderer> map;
   for (auto& def : defs) {
     w_string name(def.name, W_STRING_UNICODE);
-    map.emplace(name, w_query_field_renderer{name, def.make});
+    map.emplace(name, w_query_field_renderer{name, def.make, def.encodeBser});
+  }
+
+  // The faster hashes are optional dependencies, so we only advertise
+  // them, and their capabilities, when this build can compute them
+  struct {
+    ContentHashAlgorithm algorithm;
+    const char* name;
+    Optional<json_ref> (*make)(FileResult* file, const w_query_ctx* ctx);
+  } hashDefs[] = {
+      {ContentHashAlgorithm::Blake3, "content.blake3hex", make_blake3_hex},
+      {ContentHashAlgorithm::Xxh128, "content.xxh128hex", make_xxh128_hex},
+  };
+  for (auto& def : hashDefs) {
+    if (isContentHashAlgorithmAvailable(def.algorithm)) {
+      w_string name(def.name, W_STRING_UNICODE);
+      map.emplace(name, w_query_field_renderer{name, def.make, nullptr});
+    }
   }
 
   return map;
@@ -311,6 +538,9 @@ Optional<json_ref> file_result_to_json(
     const w_query_field_list& fieldList,
     const std::unique_ptr<FileResult>& file,
     const w_query_ctx* ctx) {
+  // The rows are thrown away along with the results that hold them, so
+  // they are allocated in bulk rather than one value at a time
+  JsonArenaScope arena(ctx->resultArena());
   if (fieldList.size() == 1) {
     return fieldList.front()->make(file.get(), ctx);
   }
@@ -327,6 +557,153 @@ Optional<json_ref> file_result_to_json(
   return value;
 }
 
+static int append_to_string(const char* buffer, size_t size, void* data) {
+  static_cast<std::string*>(data)->append(buffer, size);
+  return 0;
+}
+
+namespace {
+constexpr char kPackedNamesMagic[4] = {'W', 'P', 'N', '1'};
+constexpr uint8_t kPackedNamesFreshInstance = 1;
+constexpr uint8_t kPackedNamesFrontCoded = 2;
+
+// Appends value as an unsigned LEB128 varint
+void append_varint(std::string* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back(char(uint8_t(value) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(char(value));
+}
+
+// Reads a varint that append_varint wrote to our own buffer
+uint64_t read_varint(const char*& pos) {
+  uint64_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    auto byte = uint8_t(*pos++);
+    value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+} // namespace
+
+bool file_result_to_bser(
+    const w_query_field_list& fieldList,
+    const std::unique_ptr<FileResult>& file,
+    const w_query_ctx* ctx,
+    std::string* out) {
+  if (ctx->query->packed_names) {
+    // A packed row is just the length prefixed name, and the name never
+    // needs data to be loaded
+    thread_local std::string buf;
+    auto name = ctx->computeWholeName(file.get(), buf);
+    append_varint(out, name.size());
+    out->append(name.data(), name.size());
+    return true;
+  }
+
+  bser_ctx_t bser{ctx->query->render_bser_version,
+                  ctx->query->render_bser_capabilities,
+                  append_to_string};
+  auto rowStart = out->size();
+
+  // A row of a template array is just the values of the fields, in the
+  // order of the template, and the single field results are bare values
+  for (auto& f : fieldList) {
+    if (f->encodeBser) {
+      if (f->encodeBser(file.get(), ctx, &bser, out)) {
+        continue;
+      }
+    } else {
+      auto ele = f->make(file.get(), ctx);
+      if (ele.has_value()) {
+        w_bser_dump(&bser, ele.value(), out);
+        continue;
+      }
+    }
+    // Need data to be loaded; discard the partial row
+    out->resize(rowStart);
+    return false;
+  }
+  return true;
+}
+
+std::string w_query_res_encode_bser_results(
+    const w_query* query,
+    const w_query_res& res) {
+  bser_ctx_t bser{query->render_bser_version,
+                  query->render_bser_capabilities,
+                  append_to_string};
+  std::string encoded;
+  // Keep this consistent with the template applied to the results array
+  // by make_results_array()
+  w_bser_dump_array_header(
+      &bser,
+      res.numBserRows,
+      query->fieldList.size() > 1
+          ? field_list_to_json_name_array(query->fieldList)
+          : json_ref(),
+      &encoded);
+  encoded.append(res.bserRows);
+  return encoded;
+}
+
+std::string w_query_res_encode_packed_names(
+    const w_query* query,
+    const w_query_res& res) {
+  // The blob is:
+  //   magic    "WPN1"
+  //   flags    one byte; kPackedNamesFreshInstance, kPackedNamesFrontCoded
+  //   count    varint number of names
+  //   clock    varint length, then the clock string
+  //   names    count times either varint length, then the name, or when
+  //            front coded, varint length of the prefix shared with the
+  //            previous name, varint length of the rest, then the rest
+  std::string blob;
+  blob.reserve(res.bserRows.size() + 64);
+  blob.append(kPackedNamesMagic, sizeof(kPackedNamesMagic));
+  blob.push_back(char(
+      (res.is_fresh_instance ? kPackedNamesFreshInstance : 0) |
+      (query->packed_names_front_coded ? kPackedNamesFrontCoded : 0)));
+  append_varint(&blob, res.numBserRows);
+  auto clock = res.clockAtStartOfQuery.position().toClockString();
+  append_varint(&blob, clock.size());
+  blob.append(clock.data(), clock.size());
+
+  if (!query->packed_names_front_coded) {
+    blob.append(res.bserRows);
+  } else {
+    // The workers of a parallel query render their rows independently, so
+    // the front coding is applied here rather than as the rows are rendered
+    const char* pos = res.bserRows.data();
+    w_string_piece prev;
+    for (size_t i = 0; i < res.numBserRows; ++i) {
+      auto len = size_t(read_varint(pos));
+      w_string_piece name(pos, len);
+      pos += len;
+      size_t shared = 0;
+      auto limit = std::min(prev.size(), name.size());
+      while (shared < limit && prev[shared] == name[shared]) {
+        ++shared;
+      }
+      append_varint(&blob, shared);
+      append_varint(&blob, len - shared);
+      blob.append(name.data() + shared, len - shared);
+      prev = name;
+    }
+  }
+
+  bser_ctx_t bser{query->render_bser_version,
+                  query->render_bser_capabilities,
+                  append_to_string};
+  std::string encoded;
+  w_bser_dump_bytestring(
+      &bser, w_string_piece(blob.data(), blob.size()), &encoded);
+  return encoded;
+}
+
 void parse_field_list(json_ref field_list, w_query_field_list* selected) {
   uint32_t i;
 
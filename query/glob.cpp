@@ -3,7 +3,10 @@
 
 #include "watchman.h"
 #include <folly/ScopeGuard.h>
+#include <algorithm>
 #include <memory>
+#include <string>
+#include <vector>
 #include "InMemoryView.h"
 #include "thirdparty/wildmatch/wildmatch.h"
 
@@ -25,6 +28,12 @@ using watchman::CaseSensitivity;
  * tree concurrently.  If the watchman_dir tree has no matching component
  * then we can terminate evaluation of that portion of the pattern tree
  * early.
+ *
+ * Components without specials are looked up by name.  The others are
+ * indexed by their literal tails in a GlobSuffixIndex held by their
+ * parent, so that each entry of a dir is classified against all of them
+ * at once and only the few candidates that it yields need to be run
+ * through wildmatch.
  */
 
 W_CAP_REG("glob_generator")
@@ -146,6 +155,32 @@ static bool add_glob(
   return true;
 }
 
+// Build the prefilters for the children of node and its descendants once
+// the tree is complete.  A case insensitive query cannot look anything up
+// by name, so all of its children have to be matched.
+static void compile_glob_tree(
+    struct watchman_glob_tree* node,
+    CaseSensitivity case_sensitive) {
+  bool case_fold = case_sensitive != CaseSensitivity::CaseSensitive;
+
+  node->matched_index = watchman::GlobSuffixIndex(case_fold);
+  for (auto& kid : node->children) {
+    if (kid->had_specials || case_fold) {
+      node->matched_children.push_back(kid.get());
+      node->matched_index.add(kid->pattern);
+      if (kid->is_leaf) {
+        node->has_matched_leaf = true;
+      }
+    }
+    compile_glob_tree(kid.get(), case_sensitive);
+  }
+
+  node->doublestar_index = watchman::GlobSuffixIndex(case_fold);
+  for (auto& kid : node->doublestar_children) {
+    node->doublestar_index.add(kid->pattern);
+  }
+}
+
 void parse_globs(w_query* res, const json_ref& query) {
   size_t i;
 
@@ -184,6 +219,8 @@ void parse_globs(w_query* res, const json_ref& query) {
       throw QueryParseError("failed to compile multi-glob");
     }
   }
+
+  compile_glob_tree(res->glob_tree.get(), res->case_sensitive);
 }
 
 /** Concatenate dir_name and name around a unix style directory
@@ -208,6 +245,14 @@ static inline std::string make_path_name(
 }
 
 namespace watchman {
+
+static inline int glob_match_flags(const struct w_query_ctx* ctx) {
+  return ctx->query->glob_flags |
+      (ctx->query->case_sensitive == CaseSensitivity::CaseSensitive
+           ? 0
+           : WM_CASEFOLD);
+}
+
 /** This is our specialized handler for the ** recursive glob pattern.
  * This is the unhappy path because we have no choice but to recursively
  * walk the tree; we have no way to prune portions that won't match.
@@ -221,15 +266,19 @@ namespace watchman {
  * as any one of them matches the file node.
  */
 void InMemoryView::globGeneratorDoublestar(
+    FileEmitter& emitter,
     struct w_query_ctx* ctx,
     const struct watchman_dir* dir,
     const struct watchman_glob_tree* node,
     const char* dir_name,
     uint32_t dir_name_len) const {
-  bool matched;
+  auto flags = glob_match_flags(ctx) | WM_PATHNAME;
 
   // First step is to walk the set of files contained in this node
   for (auto& it : dir->files) {
+    if (emitter.done()) {
+      return;
+    }
     auto file = it.second.get();
     auto file_name = file->getName();
 
@@ -240,33 +289,28 @@ void InMemoryView::globGeneratorDoublestar(
       continue;
     }
 
-    auto subject = make_path_name(
-        dir_name, dir_name_len, file_name.data(), file_name.size());
-
-    // Now that we have computed the name of this candidate file node,
-    // attempt to match against each of the possible doublestar patterns
-    // in turn.  As soon as any one of them matches we can stop this loop
-    // as it doesn't make a lot of sense to yield multiple results for
-    // the same file.
-    for (const auto& child_node : node->doublestar_children) {
-      matched =
-          wildmatch(
-              child_node->pattern.c_str(),
+    // The index only yields the doublestar patterns whose literal tail
+    // the name ends with; each of those is then matched against the full
+    // name of the candidate file node in turn.  As soon as any one of them
+    // matches we can stop this loop as it doesn't make a lot of sense to
+    // yield multiple results for the same file.  Most files have no
+    // candidates at all, so their full name is only computed on demand.
+    std::string subject;
+    node->doublestar_index.forEachCandidate(file_name, [&](uint32_t index) {
+      if (subject.empty()) {
+        subject = make_path_name(
+            dir_name, dir_name_len, file_name.data(), file_name.size());
+      }
+      if (wildmatch(
+              node->doublestar_children[index]->pattern.c_str(),
               subject.c_str(),
-              ctx->query->glob_flags | WM_PATHNAME |
-                  (ctx->query->case_sensitive == CaseSensitivity::CaseSensitive
-                       ? 0
-                       : WM_CASEFOLD),
-              0) == WM_MATCH;
-
-      if (matched) {
-        w_query_process_file(
-            ctx->query, ctx, make_unique<InMemoryFileResult>(file, caches_));
-        // No sense running multiple matches for this same file node
-        // if this one succeeded.
-        break;
+              flags,
+              0) == WM_MATCH) {
+        emitter.emit(file);
+        return true;
       }
-    }
+      return false;
+    });
   }
 
   // And now walk down to any dirs; all dirs are eligible
@@ -280,110 +324,260 @@ void InMemoryView::globGeneratorDoublestar(
 
     auto subject = make_path_name(
         dir_name, dir_name_len, child->name.data(), child->name.size());
-    globGeneratorDoublestar(ctx, child, node, subject.data(), subject.size());
+    globGeneratorDoublestar(
+        emitter, ctx, child, node, subject.data(), subject.size());
   }
 }
 
 /* Match each child of node against the children of dir */
 void InMemoryView::globGeneratorTree(
+    FileEmitter& emitter,
     struct w_query_ctx* ctx,
     const struct watchman_glob_tree* node,
     const struct watchman_dir* dir) const {
+  if (emitter.done()) {
+    return;
+  }
   if (!node->doublestar_children.empty()) {
-    globGeneratorDoublestar(ctx, dir, node, nullptr, 0);
+    globGeneratorDoublestar(emitter, ctx, dir, node, nullptr, 0);
   }
 
-  for (const auto& child_node : node->children) {
-    w_assert(!child_node->is_doublestar, "should not get here with ** glob");
-
-    // If there are child dirs, consider them for recursion.
-    // Note that we don't restrict this to !leaf because the user may have
-    // set their globs list to something like ["some_dir", "some_dir/file"]
-    // and we don't want to preclude matching the latter.
-    if (!dir->dirs.empty()) {
-      // Attempt direct lookup if possible
-      if (!child_node->had_specials &&
-          ctx->query->case_sensitive == CaseSensitivity::CaseSensitive) {
-        w_string_piece component(
-            child_node->pattern.data(), child_node->pattern.size());
+  // Attempt direct lookup where possible
+  if (ctx->query->case_sensitive == CaseSensitivity::CaseSensitive) {
+    for (const auto& child_node : node->children) {
+      w_assert(!child_node->is_doublestar, "should not get here with ** glob");
+
+      if (child_node->had_specials) {
+        continue;
+      }
+
+      w_string_piece component(
+          child_node->pattern.data(), child_node->pattern.size());
+
+      // Note that we don't restrict this to !leaf because the user may have
+      // set their globs list to something like ["some_dir", "some_dir/file"]
+      // and we don't want to preclude matching the latter.
+      if (!dir->dirs.empty()) {
         const auto child_dir = dir->getChildDir(component);
 
         if (child_dir) {
-          globGeneratorTree(ctx, child_node.get(), child_dir);
-        }
-      } else {
-        // Otherwise we have to walk and match
-        for (auto& it : dir->dirs) {
-          const auto child_dir = it.second.get();
-
-          if (!child_dir->last_check_existed) {
-            // Globs can only match files in dirs that exist
-            continue;
-          }
-
-          if (wildmatch(
-                  child_node->pattern.c_str(),
-                  child_dir->name.c_str(),
-                  ctx->query->glob_flags |
-                      (ctx->query->case_sensitive ==
-                               CaseSensitivity::CaseSensitive
-                           ? 0
-                           : WM_CASEFOLD),
-                  0) == WM_MATCH) {
-            globGeneratorTree(ctx, child_node.get(), child_dir);
-          }
+          globGeneratorTree(emitter, ctx, child_node.get(), child_dir);
         }
       }
-    }
 
-    // If the node is a leaf we are in a position to match files.
-    if (child_node->is_leaf && !dir->files.empty()) {
-      // Attempt direct lookup if possible
-      if (!child_node->had_specials &&
-          ctx->query->case_sensitive == CaseSensitivity::CaseSensitive) {
-        w_string_piece component(
-            child_node->pattern.data(), child_node->pattern.size());
+      // If the node is a leaf we are in a position to match files.
+      if (child_node->is_leaf && !dir->files.empty()) {
         auto file = dir->getChildFile(component);
 
         if (file) {
           ctx->bumpNumWalked();
           if (file->exists) {
             // Globs can only match files that exist
-            w_query_process_file(
-                ctx->query,
-                ctx,
-                make_unique<InMemoryFileResult>(file, caches_));
+            emitter.emit(file);
           }
         }
-      } else {
-        for (auto& it : dir->files) {
-          // Otherwise we have to walk and match
-          auto file = it.second.get();
-          auto file_name = file->getName();
-          ctx->bumpNumWalked();
+      }
+    }
+  }
 
-          if (!file->exists) {
-            // Globs can only match files that exist
-            continue;
-          }
+  if (node->matched_children.empty()) {
+    return;
+  }
 
-          if (wildmatch(
-                  child_node->pattern.c_str(),
-                  file_name.data(),
-                  ctx->query->glob_flags |
-                      (ctx->query->case_sensitive ==
-                               CaseSensitivity::CaseSensitive
-                           ? 0
-                           : WM_CASEFOLD),
-                  0) == WM_MATCH) {
-            w_query_process_file(
-                ctx->query,
-                ctx,
-                make_unique<InMemoryFileResult>(file, caches_));
-          }
-        }
+  // Otherwise we have to walk and match.  Each entry is classified against
+  // all of the remaining children in one pass.
+  auto flags = glob_match_flags(ctx);
+
+  // If there are child dirs, consider them for recursion.
+  for (auto& it : dir->dirs) {
+    const auto child_dir = it.second.get();
+
+    if (!child_dir->last_check_existed) {
+      // Globs can only match files in dirs that exist
+      continue;
+    }
+
+    node->matched_index.forEachCandidate(child_dir->name, [&](uint32_t index) {
+      const auto child_node = node->matched_children[index];
+      if (wildmatch(
+              child_node->pattern.c_str(), child_dir->name.c_str(), flags, 0) ==
+          WM_MATCH) {
+        globGeneratorTree(emitter, ctx, child_node, child_dir);
+      }
+      return false;
+    });
+  }
+
+  if (!node->has_matched_leaf) {
+    return;
+  }
+
+  for (auto& it : dir->files) {
+    if (emitter.done()) {
+      return;
+    }
+    auto file = it.second.get();
+    auto file_name = file->getName();
+    ctx->bumpNumWalked();
+
+    if (!file->exists) {
+      // Globs can only match files that exist
+      continue;
+    }
+
+    node->matched_index.forEachCandidate(file_name, [&](uint32_t index) {
+      const auto child_node = node->matched_children[index];
+      if (child_node->is_leaf &&
+          wildmatch(child_node->pattern.c_str(), file_name.data(), flags, 0) ==
+              WM_MATCH) {
+        emitter.emit(file);
+        // A file only needs to be emitted once
+        return true;
       }
+      return false;
+    });
+  }
+}
+
+/* Returns true if the file at path, relative to the dir that node is
+ * matched against, is one that globGeneratorTree would emit for node.
+ * This matches the components of the path against the tree rather than
+ * walking the tree to find the files that it matches. */
+static bool glob_tree_matches(
+    const struct watchman_glob_tree* node,
+    const std::string& path,
+    int flags) {
+  for (const auto& child_node : node->doublestar_children) {
+    auto doublestar_flags = flags | WM_PATHNAME;
+    if (wildmatch(
+            child_node->pattern.c_str(), path.c_str(), doublestar_flags, 0) ==
+        WM_MATCH) {
+      return true;
+    }
+  }
+
+  auto sep = path.find('/');
+  auto component = path.substr(0, sep);
+  for (const auto& child_node : node->children) {
+    if (sep == std::string::npos && !child_node->is_leaf) {
+      continue;
+    }
+    // Components without specials are matched literally by wildmatch, so
+    // there is no need to treat them separately
+    if (wildmatch(child_node->pattern.c_str(), component.c_str(), flags, 0) !=
+        WM_MATCH) {
+      continue;
+    }
+    if (sep == std::string::npos ||
+        glob_tree_matches(child_node.get(), path.substr(sep + 1), flags)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Returns the path of file relative to dir, or an empty string if it isn't
+ * beneath dir */
+static std::string path_relative_to(
+    const watchman_file* file,
+    const watchman_dir* dir) {
+  std::vector<w_string_piece> components{file->getName()};
+  for (auto parent = file->parent; parent != dir; parent = parent->parent) {
+    if (!parent) {
+      return std::string();
     }
+    components.push_back(parent->name);
+  }
+
+  std::string path;
+  for (auto it = components.rbegin(); it != components.rend(); ++it) {
+    if (!path.empty()) {
+      path.push_back('/');
+    }
+    path.append(it->data(), it->size());
+  }
+  return path;
+}
+
+/* Returns the file at path relative to dir, if the view has one */
+static const watchman_file* lookup_relative(
+    const watchman_dir* dir,
+    w_string_piece path) {
+  const char* start = path.data();
+  const char* end = start + path.size();
+  while (dir) {
+    auto sep = std::find(start, end, '/');
+    if (sep == end) {
+      return dir->getChildFile(w_string_piece(start, size_t(end - start)));
+    }
+    dir = dir->getChildDir(w_string_piece(start, size_t(sep - start)));
+    start = sep + 1;
+  }
+  return nullptr;
+}
+
+void InMemoryView::globGeneratorIncremental(
+    FileEmitter& emitter,
+    struct w_query_ctx* ctx,
+    const SyncView::ConstLockedPtr& view,
+    const struct watchman_dir* dir) const {
+  auto query = ctx->query;
+  auto matches = query->glob_matches.lock();
+  uint32_t rootNumber = rootNumber_;
+  // More files may yet be changed at the current tick, so those that were
+  // changed at it are matched again next time
+  uint32_t ticks = mostRecentTick_ - 1;
+
+  if (!matches->valid || matches->rootNumber != rootNumber) {
+    std::vector<const watchman_file*> emitted;
+    emitter.recordEmitted(&emitted);
+    globGeneratorTree(emitter, ctx, query->glob_tree.get(), dir);
+    emitter.recordEmitted(nullptr);
+
+    // The walk may have stopped before it found every match
+    matches->valid = !emitter.done();
+    matches->names.clear();
+    if (matches->valid) {
+      for (auto file : emitted) {
+        auto path = path_relative_to(file, dir);
+        matches->names.insert(w_string(path.data(), path.size()));
+      }
+    }
+    matches->rootNumber = rootNumber;
+    matches->ticks = ticks;
+    return;
+  }
+
+  // Files are only added to the matches here.  The files that were deleted
+  // or aged out since are found to be missing when the matches are looked
+  // up below.
+  auto flags = glob_match_flags(ctx);
+  view->journal.forEachSince(matches->ticks, [&](const watchman_file* file) {
+    ctx->bumpNumWalked();
+    if (!file->exists) {
+      return true;
+    }
+    auto path = path_relative_to(file, dir);
+    if (!path.empty() &&
+        glob_tree_matches(query->glob_tree.get(), path, flags)) {
+      matches->names.insert(w_string(path.data(), path.size()));
+    }
+    return true;
+  });
+  matches->ticks = ticks;
+
+  for (auto it = matches->names.begin(); it != matches->names.end();) {
+    if (emitter.done()) {
+      return;
+    }
+    ctx->bumpNumWalked();
+    auto file = lookup_relative(dir, *it);
+    if (!file || !file->exists) {
+      it = matches->names.erase(it);
+      continue;
+    }
+    emitter.emit(file);
+    ++it;
   }
 }
 
@@ -397,18 +591,28 @@ void InMemoryView::globGenerator(w_query* query, struct w_query_ctx* ctx)
     relative_root = root_path;
   }
 
-  auto view = view_.rlock();
+  FileEmitter emitter(*this, query, ctx);
+
+  {
+    auto view = lockViewForQuery(ctx);
 
-  const auto dir = resolveDir(view, relative_root);
-  if (!dir) {
-    throw QueryExecError(folly::to<std::string>(
-        "glob_generator could not resolve ",
-        relative_root,
-        ", check your "
-        "relative_root parameter!"));
+    const auto dir = resolveDir(view, relative_root);
+    if (!dir) {
+      throw QueryExecError(folly::to<std::string>(
+          "glob_generator could not resolve ",
+          relative_root,
+          ", check your "
+          "relative_root parameter!"));
+    }
+
+    if (query->incremental_glob) {
+      globGeneratorIncremental(emitter, ctx, view, dir);
+    } else {
+      globGeneratorTree(emitter, ctx, query->glob_tree.get(), dir);
+    }
   }
 
-  globGeneratorTree(ctx, query->glob_tree.get(), dir);
+  emitter.flush();
 }
 } // namespace watchman
 
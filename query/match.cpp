@@ -5,15 +5,13 @@
 
 #include <memory>
 #include <string>
+#include "WildMatcher.h"
 #include "thirdparty/wildmatch/wildmatch.h"
 using watchman::CaseSensitivity;
 
 class WildMatchExpr : public QueryExpr {
-  std::string pattern;
-  CaseSensitivity caseSensitive;
+  watchman::WildMatcher matcher;
   bool wholename;
-  bool noescape;
-  bool includedotfiles;
 
  public:
   WildMatchExpr(
@@ -22,15 +20,17 @@ class WildMatchExpr : public QueryExpr {
       bool wholename,
       bool noescape,
       bool includedotfiles)
-      : pattern(pat),
-        caseSensitive(caseSensitive),
-        wholename(wholename),
-        noescape(noescape),
-        includedotfiles(includedotfiles) {}
+      : matcher(
+            pat,
+            (includedotfiles ? 0 : WM_PERIOD) | (noescape ? WM_NOESCAPE : 0) |
+                (wholename ? WM_PATHNAME : 0) |
+                (caseSensitive == CaseSensitivity::CaseInSensitive
+                     ? WM_CASEFOLD
+                     : 0)),
+        wholename(wholename) {}
 
   EvaluateResult evaluate(struct w_query_ctx* ctx, FileResult* file) override {
     w_string_piece str;
-    bool res;
 
     if (wholename) {
       str = w_query_ctx_get_wholename(ctx);
@@ -44,17 +44,22 @@ class WildMatchExpr : public QueryExpr {
     str = normBuf;
 #endif
 
-    res =
-        wildmatch(
-            pattern.c_str(),
-            str.data(),
-            (includedotfiles ? 0 : WM_PERIOD) | (noescape ? WM_NOESCAPE : 0) |
-                (wholename ? WM_PATHNAME : 0) |
-                (caseSensitive == CaseSensitivity::CaseInSensitive ? WM_CASEFOLD
-                                                                   : 0),
-            0) == WM_MATCH;
+    return matcher.match(str);
+  }
 
-    return res;
+  QueryExprCost cost() const override {
+    return QueryExprCost::Pattern;
+  }
+
+  folly::Optional<std::vector<w_string>> impliedBasenames() const override {
+    if (!matcher.isLiteral()) {
+      return folly::none;
+    }
+    w_string_piece pattern(matcher.pattern());
+    if (wholename) {
+      pattern = pattern.baseName();
+    }
+    return std::vector<w_string>{pattern.asLowerCase()};
   }
 
   static std::unique_ptr<QueryExpr>
@@ -2,15 +2,18 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <algorithm>
+#include "FrozenStringSet.h"
 using watchman::CaseSensitivity;
+using watchman::FrozenStringSet;
 
 class NameExpr : public QueryExpr {
   w_string name;
-  std::unordered_set<w_string> set;
+  FrozenStringSet set;
   CaseSensitivity caseSensitive;
   bool wholename;
   explicit NameExpr(
-      std::unordered_set<w_string>&& set,
+      FrozenStringSet&& set,
       CaseSensitivity caseSensitive,
       bool wholename)
       : set(std::move(set)),
@@ -20,23 +23,15 @@ class NameExpr : public QueryExpr {
  public:
   EvaluateResult evaluate(struct w_query_ctx* ctx, FileResult* file) override {
     if (!set.empty()) {
-      bool matched;
-      w_string str;
-
+      // The set folds the case of the candidate itself, and is probed
+      // with the pieces of the wholename so that it needn't be built
       if (wholename) {
-        str = w_query_ctx_get_wholename(ctx);
-        if (caseSensitive == CaseSensitivity::CaseInSensitive) {
-          str = str.piece().asLowerCase();
-        }
-      } else {
-        str = caseSensitive == CaseSensitivity::CaseInSensitive
-            ? file->baseName().asLowerCase()
-            : file->baseName().asWString();
+        return set.containsPath(
+            ctx->computeWholeNameDir(file),
+            file->baseName(),
+            file->baseNameIsFolded());
       }
-
-      matched = set.find(str) != set.end();
-
-      return matched;
+      return set.contains(file->baseName(), file->baseNameIsFolded());
     }
 
     w_string_piece str;
@@ -47,18 +42,58 @@ class NameExpr : public QueryExpr {
       str = file->baseName();
     }
 
-    if (caseSensitive == CaseSensitivity::CaseInSensitive) {
+    if (caseSensitive == CaseSensitivity::CaseInSensitive &&
+        (wholename || !file->baseNameIsFolded())) {
       return w_string_equal_caseless(str, name);
     }
+    // name was folded when it was parsed, if it needed to be
     return str == name;
   }
 
+  QueryExprCost cost() const override {
+    return QueryExprCost::Name;
+  }
+
+  folly::Optional<std::vector<w_string>> impliedPaths() const override {
+    // The view is looked up by exact name
+    if (!wholename || caseSensitive == CaseSensitivity::CaseInSensitive) {
+      return folly::none;
+    }
+    if (!set.empty()) {
+      return set.keys();
+    }
+    if (name) {
+      return std::vector<w_string>{name};
+    }
+    return folly::none;
+  }
+
+  folly::Optional<std::vector<w_string>> impliedBasenames() const override {
+    std::vector<w_string> names;
+    auto add = [&](const w_string& key) {
+      auto base = wholename ? key.piece().baseName() : key.piece();
+      names.push_back(base.asLowerCase(key.type()));
+    };
+    if (!set.empty()) {
+      for (auto& key : set.keys()) {
+        add(key);
+      }
+    } else if (name) {
+      add(name);
+    } else {
+      return folly::none;
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    return names;
+  }
+
   static std::unique_ptr<QueryExpr>
   parse(w_query*, const json_ref& term, CaseSensitivity caseSensitive) {
     const char *pattern = nullptr, *scope = "basename";
     const char* which =
         caseSensitive == CaseSensitivity::CaseInSensitive ? "iname" : "name";
-    std::unordered_set<w_string> set;
+    std::vector<w_string> set;
 
     if (!term.isArray()) {
       throw QueryParseError("Expected array for '", which, "' term");
@@ -99,17 +134,8 @@ class NameExpr : public QueryExpr {
 
       set.reserve(json_array_size(name));
       for (i = 0; i < json_array_size(name); i++) {
-        w_string element;
         const auto& jele = name.at(i);
-        auto ele = json_to_w_string(jele);
-
-        if (caseSensitive == CaseSensitivity::CaseInSensitive) {
-          element = ele.piece().asLowerCase(ele.type()).normalizeSeparators();
-        } else {
-          element = ele.normalizeSeparators();
-        }
-
-        set.insert(element);
+        set.push_back(json_to_w_string(jele).normalizeSeparators());
       }
 
     } else if (name.isString()) {
@@ -122,10 +148,17 @@ class NameExpr : public QueryExpr {
     }
 
     auto data = new NameExpr(
-        std::move(set), caseSensitive, !strcmp(scope, "wholename"));
+        FrozenStringSet(
+            std::move(set),
+            caseSensitive == CaseSensitivity::CaseInSensitive),
+        caseSensitive,
+        !strcmp(scope, "wholename"));
 
     if (pattern) {
       data->name = json_to_w_string(name).normalizeSeparators();
+      if (caseSensitive == CaseSensitivity::CaseInSensitive) {
+        data->name = data->name.piece().asLowerCase(data->name.type());
+      }
     }
 
     return std::unique_ptr<QueryExpr>(data);
@@ -3,6 +3,9 @@
 
 #include "watchman.h"
 
+#include <limits>
+#include "InMemoryView.h"
+
 using namespace watchman;
 
 // This can't be a simple global because other compilation units
@@ -22,6 +25,42 @@ std::unique_ptr<QueryExpr> QueryExpr::aggregate(
   return nullptr;
 }
 
+EvaluateResult QueryExpr::evaluateInMemory(
+    w_query_ctx* ctx,
+    InMemoryFileResult* file) {
+  return evaluate(ctx, file);
+}
+
+QueryExprCost QueryExpr::cost() const {
+  return QueryExprCost::Data;
+}
+
+void QueryExpr::plan() {}
+
+json_ref QueryExpr::describe() const {
+  return term;
+}
+
+folly::Optional<std::vector<w_string>> QueryExpr::impliedSuffixes() const {
+  return folly::none;
+}
+
+folly::Optional<std::vector<w_string>> QueryExpr::impliedBasenames() const {
+  return folly::none;
+}
+
+folly::Optional<std::vector<w_string>> QueryExpr::impliedPaths() const {
+  return folly::none;
+}
+
+folly::Optional<std::vector<w_query_path>> QueryExpr::impliedDirs() const {
+  return folly::none;
+}
+
+void QueryExpr::wrapTerms(
+    const std::function<std::unique_ptr<QueryExpr>(
+        std::unique_ptr<QueryExpr>)>&) {}
+
 bool w_query_register_expression_parser(
     const char* term,
     w_query_expr_parser parser) {
@@ -62,7 +101,11 @@ std::unique_ptr<QueryExpr> w_query_expr_parse(
     throw QueryParseError(
         folly::to<std::string>("unknown expression term '", name, "'"));
   }
-  return it->second(query, exp);
+  auto expr = it->second(query, exp);
+  if (!expr->term) {
+    expr->term = exp;
+  }
+  return expr;
 }
 
 static bool parse_since(w_query* res, const json_ref& query) {
@@ -211,6 +254,51 @@ static void parse_query_expression(w_query* res, const json_ref& query) {
   res->expr = w_query_expr_parse(res, exp);
 }
 
+// Rewrites the parsed query into a form that is cheaper to execute
+static void plan_query(w_query* res, const std::shared_ptr<w_root_t>& root) {
+  if (!res->expr) {
+    return;
+  }
+
+  res->expr->plan();
+
+  // Without a generator, every file in the view is generated and then
+  // filtered by the expression.  If the expression can only match a
+  // known list of files, those can be looked up directly, and if it can
+  // only match files with particular names or suffixes, the basename or
+  // suffix index yields far fewer candidates, as does walking just the
+  // subtree of a dirname term.  This doesn't apply to "since" queries because
+  // they already walk only the recently changed files.
+  if (res->since_spec || res->paths || res->glob_tree || res->suffixes) {
+    return;
+  }
+  auto paths = res->expr->impliedPaths();
+  if (paths) {
+    res->paths.emplace();
+    res->paths->reserve(paths->size());
+    for (auto& path : *paths) {
+      res->paths->push_back(w_query_path{std::move(path), 0, true});
+    }
+    res->planned_paths = true;
+    return;
+  }
+  auto dirs = res->expr->impliedDirs();
+  if (dirs) {
+    res->paths = std::move(*dirs);
+    res->planned_paths = true;
+    return;
+  }
+  if (root->view()->hasBasenameIndex()) {
+    res->basenames = res->expr->impliedBasenames();
+    if (res->basenames) {
+      res->planned_basenames = true;
+      return;
+    }
+  }
+  res->suffixes = res->expr->impliedSuffixes();
+  res->planned_suffixes = res->suffixes.has_value();
+}
+
 static void parse_request_id(w_query* res, const json_ref& query) {
   auto request_id = query.get_default("request_id");
   if (!request_id) {
@@ -258,6 +346,22 @@ static void parse_lock_timeout(w_query* res, const json_ref& query) {
   res->lock_timeout = value;
 }
 
+static void parse_timeout(w_query* res, const json_ref& query) {
+  auto timeout = query.get_default("timeout", json_integer(0));
+
+  if (!timeout.isInt()) {
+    throw QueryParseError("timeout must be an integer value >= 0");
+  }
+
+  auto value = timeout.asInt();
+
+  if (value < 0) {
+    throw QueryParseError("timeout must be an integer value >= 0");
+  }
+
+  res->timeout = std::chrono::milliseconds(value);
+}
+
 static bool
 parse_bool_param(const json_ref& query, const char* name, bool default_value) {
   auto value = query.get_default(name, json_boolean(default_value));
@@ -274,6 +378,129 @@ static void parse_dedup(w_query* res, const json_ref& query) {
   res->dedup_results = parse_bool_param(query, "dedup_results", false);
 }
 
+static void parse_explain(w_query* res, const json_ref& query) {
+  res->explain = parse_bool_param(query, "explain", false);
+}
+W_CAP_REG("explain")
+
+static void parse_profile(w_query* res, const json_ref& query) {
+  res->profile = parse_bool_param(query, "profile", false);
+}
+W_CAP_REG("profile")
+
+W_CAP_REG("stream_results")
+
+// Accepts either a boolean, to stream with the default chunk size, or the
+// number of files to send in each chunk
+static void parse_stream_results(w_query* res, const json_ref& query) {
+  auto stream = query.get_default("stream_results");
+  if (!stream) {
+    return;
+  }
+  if (stream.isBool()) {
+    res->stream_chunk_size = stream.asBool() ? 10000 : 0;
+    return;
+  }
+  if (!stream.isInt() || stream.asInt() <= 0 ||
+      stream.asInt() > std::numeric_limits<uint32_t>::max()) {
+    throw QueryParseError(
+        "'stream_results' must be a boolean or a positive integer");
+  }
+  res->stream_chunk_size = uint32_t(stream.asInt());
+}
+
+static uint32_t parse_uint32_param(
+    const json_ref& query,
+    const char* name,
+    json_int_t min_value) {
+  auto value = query.get_default(name, json_integer(0));
+  if (!value.isInt() || value.asInt() < min_value ||
+      value.asInt() > std::numeric_limits<uint32_t>::max()) {
+    throw QueryParseError(
+        "'", name, "' must be an integer value >= ", min_value);
+  }
+  return uint32_t(value.asInt());
+}
+
+W_CAP_REG("limit")
+
+static void parse_limit(w_query* res, const json_ref& query) {
+  if (query.get_default("limit")) {
+    res->limit = parse_uint32_param(query, "limit", 1);
+  }
+  res->offset = parse_uint32_param(query, "offset", 0);
+
+  auto order_by = query.get_default("order_by");
+  if (order_by) {
+    auto order =
+        order_by.isString() ? json_to_w_string(order_by) : w_string();
+    if (order == w_string_piece("name")) {
+      res->order_by_name = true;
+    } else if (order == w_string_piece("ticks")) {
+      res->order_by_ticks = true;
+      if (res->offset) {
+        // The clock of the response says where to resume instead
+        throw QueryParseError("'offset' can't be used with ordering by ticks");
+      }
+    } else {
+      throw QueryParseError("'order_by' must be \"name\" or \"ticks\"");
+    }
+  }
+
+  auto page_token = query.get_default("page_token");
+  if (page_token) {
+    if (!res->order_by_name) {
+      throw QueryParseError("'page_token' requires ordering by name");
+    }
+    if (!page_token.isString()) {
+      throw QueryParseError("'page_token' must be a string");
+    }
+    res->page_token = json_to_w_string(page_token);
+  }
+}
+
+W_CAP_REG("group_by_dir")
+
+static void parse_group_by_dir(w_query* res, const json_ref& query) {
+  res->group_by_dir = parse_bool_param(query, "group_by_dir", false);
+  if (res->group_by_dir && res->order_by_ticks) {
+    throw QueryParseError(
+        "'group_by_dir' can't be used with ordering by ticks");
+  }
+}
+
+W_CAP_REG("packed_names")
+
+// Must follow parse_field_list, as only the names can be packed
+static void parse_packed_names(w_query* res, const json_ref& query) {
+  auto packed = query.get_default("packed_names");
+  if (!packed) {
+    return;
+  }
+  if (packed.isBool()) {
+    res->packed_names = packed.asBool();
+  } else if (
+      packed.isString() &&
+      json_to_w_string(packed).piece() == w_string_piece("front_coded")) {
+    res->packed_names = true;
+    res->packed_names_front_coded = true;
+  } else {
+    throw QueryParseError(
+        "'packed_names' must be a boolean or \"front_coded\"");
+  }
+  if (!res->packed_names) {
+    return;
+  }
+  if (res->fieldList.size() != 1 ||
+      res->fieldList[0]->name.piece() != w_string_piece("name")) {
+    throw QueryParseError("'packed_names' requires 'fields' to be [\"name\"]");
+  }
+  if (res->stream_chunk_size) {
+    throw QueryParseError(
+        "'packed_names' can't be combined with 'stream_results'");
+  }
+}
+
 static void parse_fail_if_no_saved_state(w_query* res, const json_ref& query) {
   res->fail_if_no_saved_state =
       parse_bool_param(query, "fail_if_no_saved_state", false);
@@ -319,7 +546,13 @@ std::shared_ptr<w_query> w_query_parse(
   parse_case_sensitive(res, root, query);
   parse_sync(res, query);
   parse_dedup(res, query);
+  parse_explain(res, query);
+  parse_profile(res, query);
+  parse_stream_results(res, query);
+  parse_limit(res, query);
+  parse_group_by_dir(res, query);
   parse_lock_timeout(res, query);
+  parse_timeout(res, query);
   parse_relative_root(root, res, query);
   parse_empty_on_fresh_instance(res, query);
   parse_fail_if_no_saved_state(res, query);
@@ -338,9 +571,15 @@ std::shared_ptr<w_query> w_query_parse(
 
   parse_query_expression(res, query);
 
+  plan_query(res, root);
+  if (res->profile) {
+    w_query_profile_terms(res);
+  }
+
   parse_request_id(res, query);
 
   parse_field_list(query.get_default("fields"), &res->fieldList);
+  parse_packed_names(res, query);
 
   res->query_spec = query;
 
@@ -515,5 +754,49 @@ std::shared_ptr<w_query> w_query_parse_legacy(
   return query;
 }
 
+std::shared_ptr<w_query> w_query_parse_legacy_cached(
+    const std::shared_ptr<w_root_t>& root,
+    const json_ref& args,
+    int start,
+    const char* clockspec,
+    w_string& cacheKey) {
+  cacheKey = nullptr;
+  auto& cache = root->queryPlanCache;
+  if (!cache.enabled() || !args.isArray()) {
+    return w_query_parse_legacy(root, args, start, nullptr, clockspec, nullptr);
+  }
+
+  // The patterns make up the key, along with whether there is a clock,
+  // which affects how the query is planned; the clock itself is swapped in
+  // below
+  std::string key(clockspec ? "since" : "find");
+  for (auto i = size_t(start); i < json_array_size(args); i++) {
+    const char* arg = json_string_value(json_array_get(args, i));
+    if (!arg) {
+      // Leave it to the parser to report
+      return w_query_parse_legacy(
+          root, args, start, nullptr, clockspec, nullptr);
+    }
+    key.push_back('\0');
+    key.append(arg);
+  }
+  cacheKey = w_string(key.data(), key.size(), W_STRING_BYTE);
+
+  auto query = cache.take(cacheKey);
+  if (!query) {
+    return w_query_parse_legacy(root, args, start, nullptr, clockspec, nullptr);
+  }
+  if (clockspec) {
+    auto since = typed_string_to_json(clockspec, W_STRING_UNICODE);
+    auto spec = ClockSpec::parseOptionalClockSpec(since);
+    if (!spec) {
+      throw QueryParseError("invalid value for 'since'");
+    }
+    query->since_spec = std::move(spec);
+    json_object_set_new_nocheck(query->query_spec, "since", std::move(since));
+  }
+  return query;
+}
+
 /* vim:ts=2:sw=2:et:
  */
@@ -3,30 +3,131 @@
 
 #include "watchman.h"
 
+#include <algorithm>
 #include <memory>
 
 #ifdef HAVE_PCRE_H
 
+#include "LRUCache.h"
+
 using watchman::CaseSensitivity;
 
-class PcreExpr : public QueryExpr {
-  pcre* re;
-  pcre_extra* extra;
-  bool wholename;
+namespace {
 
- public:
-  explicit PcreExpr(pcre* re, pcre_extra* extra, bool wholename)
-      : re(re), extra(extra), wholename(wholename) {}
+// A compiled and studied pattern.  Instances are shared between all of the
+// queries and subscriptions that use the same pattern with the same
+// options, and are immutable once built, so they can be used by any
+// number of threads at once.
+struct CompiledPcre {
+  pcre* re{nullptr};
+  pcre_extra* extra{nullptr};
+
+  CompiledPcre() = default;
+  CompiledPcre(const CompiledPcre&) = delete;
+  CompiledPcre& operator=(const CompiledPcre&) = delete;
 
-  ~PcreExpr() override {
+  ~CompiledPcre() {
+    if (extra) {
+#ifdef PCRE_STUDY_JIT_COMPILE
+      pcre_free_study(extra);
+#else
+      pcre_free(extra);
+#endif
+    }
     if (re) {
       pcre_free(re);
     }
-    if (extra) {
-      pcre_free(extra);
+  }
+};
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+// JIT compiled patterns need a stack of their own to run on.  The default
+// one is a small region of the machine stack, so each thread that matches
+// gets a larger stack that is reused for all of its matches.
+pcre_jit_stack* jit_stack_for_thread(void*) {
+  struct JitStack {
+    pcre_jit_stack* stack{pcre_jit_stack_alloc(32 * 1024, 1024 * 1024)};
+    ~JitStack() {
+      if (stack) {
+        pcre_jit_stack_free(stack);
+      }
     }
+  };
+  static thread_local JitStack jit_stack;
+  // A nullptr makes pcre fall back to the machine stack
+  return jit_stack.stack;
+}
+#endif
+
+using PcreCache =
+    watchman::LRUCache<w_string, std::shared_ptr<const CompiledPcre>>;
+
+PcreCache& get_pcre_cache() {
+  static PcreCache cache(
+      std::max(cfg_get_int("pcre_cache_size", 1024), json_int_t(1)),
+      std::chrono::milliseconds(0));
+  return cache;
+}
+
+// Returns the compiled form of pattern, compiling and studying it if it
+// isn't already in the cache
+std::shared_ptr<const CompiledPcre>
+compile_pcre(const char* which, const char* pattern, int options) {
+  auto& cache = get_pcre_cache();
+  auto key = w_string::build(options, ":", pattern);
+  if (auto node = cache.get(key)) {
+    return node->value();
+  }
+
+  const char* errptr = nullptr;
+  int erroff = 0;
+  int errcode = 0;
+  auto compiled = std::make_shared<CompiledPcre>();
+
+  compiled->re =
+      pcre_compile2(pattern, options, &errcode, &errptr, &erroff, nullptr);
+  if (!compiled->re) {
+    throw QueryParseError(folly::to<std::string>(
+        "invalid ",
+        which,
+        ": code ",
+        errcode,
+        " ",
+        errptr,
+        " at offset ",
+        erroff,
+        " in ",
+        pattern));
   }
 
+#ifdef PCRE_STUDY_JIT_COMPILE
+  compiled->extra = pcre_study(compiled->re, PCRE_STUDY_JIT_COMPILE, &errptr);
+  if (compiled->extra) {
+    // This is a no-op if the JIT isn't available or failed to compile this
+    // pattern, in which case the interpreter is used
+    pcre_assign_jit_stack(compiled->extra, jit_stack_for_thread, nullptr);
+  }
+#else
+  compiled->extra = pcre_study(compiled->re, 0, &errptr);
+#endif
+
+  std::shared_ptr<const CompiledPcre> result = std::move(compiled);
+  cache.set(key, std::shared_ptr<const CompiledPcre>(result));
+  return result;
+}
+
+} // namespace
+
+class PcreExpr : public QueryExpr {
+  std::shared_ptr<const CompiledPcre> compiled;
+  bool wholename;
+
+ public:
+  explicit PcreExpr(
+      std::shared_ptr<const CompiledPcre> compiled,
+      bool wholename)
+      : compiled(std::move(compiled)), wholename(wholename) {}
+
   EvaluateResult evaluate(struct w_query_ctx* ctx, FileResult* file) override {
     w_string_piece str;
     int rc;
@@ -37,7 +138,15 @@ class PcreExpr : public QueryExpr {
       str = file->baseName();
     }
 
-    rc = pcre_exec(re, extra, str.data(), str.size(), 0, 0, nullptr, 0);
+    rc = pcre_exec(
+        compiled->re,
+        compiled->extra,
+        str.data(),
+        str.size(),
+        0,
+        0,
+        nullptr,
+        0);
 
     if (rc == PCRE_ERROR_NOMATCH) {
       return false;
@@ -49,16 +158,15 @@ class PcreExpr : public QueryExpr {
     return false;
   }
 
+  QueryExprCost cost() const override {
+    return QueryExprCost::Pattern;
+  }
+
   static std::unique_ptr<QueryExpr>
   parse(w_query*, const json_ref& term, CaseSensitivity caseSensitive) {
     const char *pattern, *scope = "basename";
     const char* which =
         caseSensitive == CaseSensitivity::CaseInSensitive ? "ipcre" : "pcre";
-    pcre* re;
-    const char* errptr = nullptr;
-    int erroff = 0;
-    int errcode = 0;
-
     if (term.array().size() > 1 && term.at(1).isString()) {
       pattern = json_string_value(term.at(1));
     } else {
@@ -82,29 +190,13 @@ class PcreExpr : public QueryExpr {
           "Invalid scope '", scope, "' for ", which, " expression"));
     }
 
-    re = pcre_compile2(
-        pattern,
-        caseSensitive == CaseSensitivity::CaseInSensitive ? PCRE_CASELESS : 0,
-        &errcode,
-        &errptr,
-        &erroff,
-        nullptr);
-    if (!re) {
-      throw QueryParseError(folly::to<std::string>(
-          "invalid ",
-          which,
-          ": code ",
-          errcode,
-          " ",
-          errptr,
-          " at offset ",
-          erroff,
-          " in ",
-          pattern));
-    }
-
     return std::make_unique<PcreExpr>(
-        re, pcre_study(re, 0, &errptr), !strcmp(scope, "wholename"));
+        compile_pcre(
+            which,
+            pattern,
+            caseSensitive == CaseSensitivity::CaseInSensitive ? PCRE_CASELESS
+                                                              : 0),
+        !strcmp(scope, "wholename"));
   }
   static std::unique_ptr<QueryExpr> parsePcre(
       w_query* query,
@@ -120,6 +212,33 @@ class PcreExpr : public QueryExpr {
 W_TERM_PARSER("pcre", PcreExpr::parsePcre)
 W_TERM_PARSER("ipcre", PcreExpr::parseIPcre)
 
+static void cmd_debug_pcre_cache(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 1) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-pcre-cache'");
+    return;
+  }
+
+  int jit = 0;
+#ifdef PCRE_CONFIG_JIT
+  pcre_config(PCRE_CONFIG_JIT, &jit);
+#endif
+
+  auto stats = get_pcre_cache().stats();
+  auto resp = make_response();
+  resp.set({{"cacheHit", json_integer(stats.cacheHit)},
+            {"cacheMiss", json_integer(stats.cacheMiss)},
+            {"cacheEvict", json_integer(stats.cacheEvict)},
+            {"cacheStore", json_integer(stats.cacheStore)},
+            {"cacheLoad", json_integer(stats.cacheLoad)},
+            {"size", json_integer(stats.size)},
+            {"jit", json_boolean(jit != 0)}});
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG("debug-pcre-cache", cmd_debug_pcre_cache, CMD_DAEMON, NULL)
+
 #endif
 
 /* vim:ts=2:sw=2:et:
@@ -0,0 +1,140 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+#include <chrono>
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+/* Support for the "profile" query option.  Each term of the expression is
+ * wrapped in a ProfiledExpr that counts the evaluations of the term and
+ * their outcomes, and how long they took.  The time of a term includes
+ * the time of the terms that it is composed of. */
+
+namespace {
+class ProfiledExpr : public QueryExpr {
+  std::unique_ptr<QueryExpr> inner_;
+  QueryTermProfile& profile_;
+
+ public:
+  ProfiledExpr(std::unique_ptr<QueryExpr> inner, QueryTermProfile& profile)
+      : inner_(std::move(inner)), profile_(profile) {
+    term = inner_->term;
+  }
+
+  EvaluateResult evaluate(w_query_ctx* ctx, FileResult* file) override {
+    auto start = steady_clock::now();
+    auto result = inner_->evaluate(ctx, file);
+    profile_.nanos.fetch_add(
+        duration_cast<nanoseconds>(steady_clock::now() - start).count(),
+        std::memory_order_relaxed);
+    profile_.evaluations.fetch_add(1, std::memory_order_relaxed);
+    if (!result.has_value()) {
+      profile_.deferred.fetch_add(1, std::memory_order_relaxed);
+    } else if (*result) {
+      profile_.matches.fetch_add(1, std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+  QueryExprCost cost() const override {
+    return inner_->cost();
+  }
+
+  json_ref describe() const override {
+    return inner_->describe();
+  }
+
+  folly::Optional<std::vector<w_string>> impliedSuffixes() const override {
+    return inner_->impliedSuffixes();
+  }
+
+  folly::Optional<std::vector<w_string>> impliedBasenames() const override {
+    return inner_->impliedBasenames();
+  }
+
+  folly::Optional<std::vector<w_string>> impliedPaths() const override {
+    return inner_->impliedPaths();
+  }
+
+  folly::Optional<std::vector<w_query_path>> impliedDirs() const override {
+    return inner_->impliedDirs();
+  }
+};
+
+json_ref term_name(const QueryExpr& expr) {
+  auto desc = expr.describe();
+  if (desc && desc.isArray() && json_array_size(desc) > 0) {
+    desc = desc.at(0);
+  }
+  if (!desc || !desc.isString()) {
+    return typed_string_to_json("unknown", W_STRING_UNICODE);
+  }
+  return desc;
+}
+
+std::unique_ptr<QueryExpr>
+profile_term(w_query* query, std::unique_ptr<QueryExpr> expr, uint32_t depth) {
+  // Recorded before the terms of expr, so that the profiles are listed in
+  // the order of a depth first walk of the expression
+  query->term_profiles.emplace_back(term_name(*expr), depth);
+  auto& profile = query->term_profiles.back();
+  expr->wrapTerms([&](std::unique_ptr<QueryExpr> child) {
+    return profile_term(query, std::move(child), depth + 1);
+  });
+  return std::make_unique<ProfiledExpr>(std::move(expr), profile);
+}
+
+json_ref duration_to_json(nanoseconds duration) {
+  return json_integer(duration_cast<microseconds>(duration).count());
+}
+} // namespace
+
+void w_query_profile_terms(w_query* query) {
+  if (query->expr) {
+    query->expr = profile_term(query, std::move(query->expr), 0);
+  }
+}
+
+json_ref w_query_profile_to_json(const w_query_ctx* ctx) {
+  auto terms = json_array();
+  for (auto& profile : ctx->query->term_profiles) {
+    json_array_append_new(
+        terms,
+        json_object(
+            {{"term", profile.name},
+             {"depth", json_integer(profile.depth)},
+             {"evaluations", json_integer(profile.evaluations.load())},
+             {"matches", json_integer(profile.matches.load())},
+             {"deferred", json_integer(profile.deferred.load())},
+             {"time_us",
+              duration_to_json(nanoseconds(profile.nanos.load()))}}));
+  }
+
+  auto generators = json_array();
+  for (auto& profile : ctx->generatorProfiles) {
+    json_array_append_new(
+        generators,
+        json_object({{"generator",
+                      typed_string_to_json(profile.name, W_STRING_UNICODE)},
+                     {"num_walked", json_integer(profile.numWalked)},
+                     {"time_us", duration_to_json(profile.time)}}));
+  }
+
+  return json_object(
+      {{"terms", terms},
+       {"generators", generators},
+       {"view_lock_wait_us", json_integer(ctx->viewLockWaitTime.count())},
+       {"eval_batch_fetch_us", duration_to_json(ctx->evalBatchFetchTime)},
+       {"render_batch_fetch_us", duration_to_json(ctx->renderBatchFetchTime)},
+       {"eval_batch_size", json_integer(ctx->evalBatchSize())},
+       {"render_batch_size", json_integer(ctx->renderBatchSize())},
+       {"render_us", duration_to_json(ctx->renderTime)}});
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -26,18 +26,39 @@ class SinceExpr : public QueryExpr {
       : spec(std::move(spec)), field(field) {}
 
   EvaluateResult evaluate(struct w_query_ctx* ctx, FileResult* file) override {
-    time_t tval = 0;
+    if (spec->tag == w_cs_timestamp) {
+      // The comparison doesn't depend on the state of the view, so skip
+      // resolving the clockspec for each file
+      return evaluateTimestamp(file, spec->timestamp);
+    }
 
     auto since = spec->evaluate(
         ctx->clockAtStartOfQuery.position(),
-        ctx->lastAgeOutTickValueAtStartOfQuery);
+        ctx->lastAgeOutTickValueAtStartOfQuery,
+        nullptr,
+        ctx->priorClockLineage.get_pointer());
+    if (since.is_timestamp) {
+      return evaluateTimestamp(file, since.timestamp);
+    }
 
-    // Note that we use >= for the time comparisons in here so that we
-    // report the things that changed inclusive of the boundary presented.
-    // This is especially important for clients using the coarse unix
-    // timestamp as the since basis, as they would be much more
-    // likely to miss out on changes if we didn't.
+    // Only the clock fields accept a clock; parse rejects the others
+    const auto clock =
+        (field == since_what::SINCE_OCLOCK) ? file->otime() : file->ctime();
+    if (!clock.has_value()) {
+      return folly::none;
+    }
+    if (since.clock.is_fresh_instance) {
+      return file->exists();
+    }
+    return clock->ticks > since.clock.ticks;
+  }
 
+  // Note that we use >= for the time comparisons in here so that we
+  // report the things that changed inclusive of the boundary presented.
+  // This is especially important for clients using the coarse unix
+  // timestamp as the since basis, as they would be much more
+  // likely to miss out on changes if we didn't.
+  EvaluateResult evaluateTimestamp(FileResult* file, time_t timestamp) {
     switch (field) {
       case since_what::SINCE_OCLOCK:
       case since_what::SINCE_CCLOCK: {
@@ -46,35 +67,26 @@ class SinceExpr : public QueryExpr {
         if (!clock.has_value()) {
           return folly::none;
         }
-
-        if (since.is_timestamp) {
-          return clock->timestamp >= since.timestamp;
-        }
-        if (since.clock.is_fresh_instance) {
-          return file->exists();
-        }
-        return clock->ticks > since.clock.ticks;
+        return clock->timestamp >= timestamp;
       }
       case since_what::SINCE_MTIME: {
-        auto stat = file->stat();
-        if (!stat.has_value()) {
+        // Only the timestamps are needed, which can be cheaper to fetch
+        // than the full stat information
+        auto mtime = file->modifiedTime();
+        if (!mtime.has_value()) {
           return folly::none;
         }
-        tval = stat->mtime.tv_sec;
-        break;
+        return mtime->tv_sec >= timestamp;
       }
       case since_what::SINCE_CTIME: {
-        auto stat = file->stat();
-        if (!stat.has_value()) {
+        auto ctime = file->changedTime();
+        if (!ctime.has_value()) {
           return folly::none;
         }
-        tval = stat->ctime.tv_sec;
-        break;
+        return ctime->tv_sec >= timestamp;
       }
     }
-
-    assert(since.is_timestamp);
-    return tval >= since.timestamp;
+    return false;
   }
 
   static std::unique_ptr<QueryExpr> parse(w_query*, const json_ref& term) {
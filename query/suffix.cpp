@@ -2,33 +2,56 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include "FrozenStringSet.h"
+#include "InMemoryView.h"
 
 #include <memory>
 
-class SuffixExpr : public QueryExpr {
-  std::unordered_set<w_string> suffixSet_;
+using watchman::FrozenStringSet;
+
+class SuffixExpr : public SpecializedQueryExpr<SuffixExpr> {
+  FrozenStringSet suffixSet_;
 
  public:
-  explicit SuffixExpr(std::unordered_set<w_string>&& suffixSet)
-      : suffixSet_(std::move(suffixSet)) {}
+  explicit SuffixExpr(std::vector<w_string>&& suffixSet)
+      : suffixSet_(std::move(suffixSet), true) {}
 
-  EvaluateResult evaluate(struct w_query_ctx*, FileResult* file) override {
+  template <typename File>
+  EvaluateResult evaluateFile(struct w_query_ctx*, File* file) {
     if (suffixSet_.size() < 3) {
       // For small suffix sets, benchmarks indicated that iteration provides
-      // better performance since no suffix allocation is necessary.
-      for (auto const& suffix : suffixSet_) {
+      // better performance than hashing the suffix.
+      for (auto const& suffix : suffixSet_.keys()) {
         if (file->baseName().hasSuffix(suffix)) {
           return true;
         }
       }
       return false;
     }
-    auto suffix = file->baseName().asLowerCaseSuffix();
-    return suffix && (suffixSet_.find(suffix) != suffixSet_.end());
+    // The set folds the case of the suffix as it is looked up, unless the
+    // name is known not to need it
+    auto suffix = file->baseName().suffix();
+    return suffix.size() > 0 &&
+        suffixSet_.contains(suffix, file->baseNameIsFolded());
+  }
+
+  QueryExprCost cost() const override {
+    return QueryExprCost::Name;
+  }
+
+  folly::Optional<std::vector<w_string>> impliedSuffixes() const override {
+    for (auto const& suffix : suffixSet_.keys()) {
+      // The suffix index is keyed by the text after the last dot, so it
+      // can't produce the files that match a compound suffix
+      if (memchr(suffix.data(), '.', suffix.size())) {
+        return folly::none;
+      }
+    }
+    return suffixSet_.keys();
   }
 
   static std::unique_ptr<QueryExpr> parse(w_query*, const json_ref& term) {
-    std::unordered_set<w_string> suffixSet;
+    std::vector<w_string> suffixSet;
 
     if (!term.isArray()) {
       throw QueryParseError("Expected array for 'suffix' term");
@@ -48,10 +71,10 @@ class SuffixExpr : public QueryExpr {
           throw QueryParseError(
               "Argument 2 to 'suffix' must be either a string or an array of string");
         }
-        suffixSet.insert(json_to_w_string(ele).piece().asLowerCase());
+        suffixSet.push_back(json_to_w_string(ele).piece().asLowerCase());
       }
     } else if (suffix.isString()) {
-      suffixSet.insert(json_to_w_string(suffix).piece().asLowerCase());
+      suffixSet.push_back(json_to_w_string(suffix).piece().asLowerCase());
     } else {
       throw QueryParseError(
           "Argument 2 to 'suffix' must be either a string or an array of string");
@@ -69,11 +92,14 @@ class SuffixExpr : public QueryExpr {
     if (otherExpr == nullptr) {
       return nullptr;
     }
-    std::unordered_set<w_string> suffixSet;
+    std::vector<w_string> suffixSet;
     suffixSet.reserve(suffixSet_.size() + otherExpr->suffixSet_.size());
     suffixSet.insert(
-        otherExpr->suffixSet_.begin(), otherExpr->suffixSet_.end());
-    suffixSet.insert(suffixSet_.begin(), suffixSet_.end());
+        suffixSet.end(),
+        otherExpr->suffixSet_.keys().begin(),
+        otherExpr->suffixSet_.keys().end());
+    suffixSet.insert(
+        suffixSet.end(), suffixSet_.keys().begin(), suffixSet_.keys().end());
     return std::make_unique<SuffixExpr>(std::move(suffixSet));
   }
 };
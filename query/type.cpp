@@ -4,16 +4,18 @@
 #include "watchman.h"
 
 #include <memory>
+#include "InMemoryView.h"
 
 using watchman::DType;
 
-class TypeExpr : public QueryExpr {
+class TypeExpr : public SpecializedQueryExpr<TypeExpr> {
   char arg;
 
  public:
   explicit TypeExpr(char arg) : arg(arg) {}
 
-  EvaluateResult evaluate(struct w_query_ctx*, FileResult* file) override {
+  template <typename File>
+  EvaluateResult evaluateFile(struct w_query_ctx*, File* file) {
     auto optionalDtype = file->dtype();
     if (!optionalDtype.has_value()) {
       return folly::none;
@@ -69,6 +71,10 @@ class TypeExpr : public QueryExpr {
     }
   }
 
+  QueryExprCost cost() const override {
+    return QueryExprCost::Name;
+  }
+
   static std::unique_ptr<QueryExpr> parse(w_query*, const json_ref& term) {
     const char *typestr, *found;
     char arg;
@@ -12,30 +12,42 @@ void watchman_root::considerAgeOut() {
 
   time(&now);
 
-  if (now <= view()->getLastAgeOutTimeStamp() + gc_interval) {
+  // A pass that was done in slices continues whenever we're idle
+  if (!view()->ageOutInProgress() &&
+      now <= view()->getLastAgeOutTimeStamp() + gc_interval) {
     // Don't check too often
     return;
   }
 
-  performAgeOut(std::chrono::seconds(gc_age));
+  performAgeOut(std::chrono::seconds(gc_age), false);
 }
 
-void watchman_root::performAgeOut(std::chrono::seconds min_age) {
+void watchman_root::performAgeOut(std::chrono::seconds min_age, bool complete) {
+  do {
+    ageOutSlice(min_age);
+  } while (complete && view()->ageOutInProgress());
+}
+
+void watchman_root::ageOutSlice(std::chrono::seconds min_age) {
   // Find deleted nodes older than the gc_age setting.
   // This is particularly useful in cases where your tree observes a
   // large number of creates and deletes for many unique filenames in
   // a given dir (eg: temporary/randomized filenames generated as part
   // of build tooling or atomic renames)
   w_perf_t sample("age_out");
+  sample.set_root(shared_from_this());
 
   view()->ageOut(sample, std::chrono::seconds(min_age));
+  // Aging out doesn't tick the clock, so the responses that were cached at
+  // the current position may list files that no longer exist in the view
+  queryResultCache.clear(view()->getMostRecentRootNumberAndTickValue());
 
   // Age out cursors too.
   {
     auto cursors = inner.cursors.wlock();
     auto it = cursors->begin();
     while (it != cursors->end()) {
-      if (it->second < view()->getLastAgeOutTickValue()) {
+      if (it->second.load() < view()->getLastAgeOutTickValue()) {
         it = cursors->erase(it);
       } else {
         ++it;
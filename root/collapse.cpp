@@ -0,0 +1,257 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include <algorithm>
+#include "InMemoryView.h"
+
+// Memory bounded views.
+//
+// On a very large tree most of the view describes files that nobody has
+// touched in a long while.  When view_memory_budget is set and the view
+// grows past it, we look for the subtrees in which nothing has changed
+// for cold_subtree_seconds and that no query has needed all of in that
+// time, and drop the nodes beneath them, biggest first, until the view
+// fits.  The dir node at the top of each such subtree stays, marked as
+// collapsed, along with the watches on the dirs beneath it.
+//
+// The dropped nodes are brought back by crawling the collapsed dir again:
+//
+// - A change that the watcher reports beneath a collapsed dir is turned
+//   into a crawl of that dir.
+// - A query that needs all of the files in its scope, rather than those
+//   that changed since a clock, crawls the collapsed dirs in that scope
+//   before it runs; see expandCollapsedDirs().
+//
+// A since query whose clock predates the most recent change in a subtree
+// that was collapsed can't be answered from the view, so collapsing a
+// subtree raises the fresh instance watermark to its subtree_tick in the
+// same way that age out does.
+
+namespace watchman {
+
+namespace {
+// How often the IO thread looks at the size of the view
+constexpr std::chrono::seconds kCollapseCheckInterval{60};
+
+// True if a and b are the same path, or if one of them is beneath the other
+bool pathsOverlap(w_string_piece a, w_string_piece b) {
+  if (a.size() > b.size()) {
+    std::swap(a, b);
+  }
+  return b.startsWith(a) && (b.size() == a.size() || is_slash(b[a.size()]));
+}
+
+// The number of file and dir nodes beneath dir
+size_t countNodes(const watchman_dir* dir) {
+  size_t nodes = dir->files.size() + dir->dirs.size();
+  for (auto& it : dir->dirs) {
+    nodes += countNodes(it.second.get());
+  }
+  return nodes;
+}
+
+struct ColdDir {
+  watchman_dir* dir;
+  size_t nodes;
+};
+
+// Finds the topmost dirs beneath dir that can be collapsed
+void findColdDirs(
+    watchman_dir* dir,
+    time_t cutoff,
+    const std::vector<w_string>& queried,
+    std::vector<ColdDir>& cold) {
+  for (auto& it : dir->dirs) {
+    auto child = it.second.get();
+    if (child->collapsed || !child->last_check_existed) {
+      continue;
+    }
+    bool wanted = false;
+    bool beneathWanted = false;
+    if (!queried.empty()) {
+      auto path = child->getFullPath();
+      for (auto& q : queried) {
+        if (pathsOverlap(path, q)) {
+          wanted = true;
+          beneathWanted |= path.piece().startsWith(q);
+        }
+      }
+    }
+    if (beneathWanted) {
+      // A recent query needed all of this subtree
+      continue;
+    }
+    if (!wanted && child->subtree_time < cutoff) {
+      auto nodes = countNodes(child);
+      if (nodes > 0) {
+        cold.push_back(ColdDir{child, nodes});
+      }
+      continue;
+    }
+    findColdDirs(child, cutoff, queried, cold);
+  }
+}
+} // namespace
+
+size_t InMemoryView::viewBytes(const SyncView::LockedPtr& view) const {
+  auto& usage = arena_.usage();
+  return arena_.stats().bytesInUse + usage.fileNameBytes +
+      usage.dirNameBytes + usage.childTableBytes +
+      view->journal.size() * sizeof(ChangeJournal<watchman_file>::Entry);
+}
+
+void InMemoryView::maybeCollapseColdDirs(
+    const std::shared_ptr<w_root_t>& root) {
+  if (viewMemoryBudget_ == 0 || !root->inner.done_initial ||
+      ageOutInProgress_) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (now - lastCollapseCheck_ < kCollapseCheckInterval) {
+    return;
+  }
+  lastCollapseCheck_ = now;
+  collapseColdDirs(root, coldSubtreeAge_);
+}
+
+std::vector<w_string> InMemoryView::collapseColdDirs(
+    const std::shared_ptr<w_root_t>& root,
+    std::chrono::seconds coldAge) {
+  auto collapsedDirs = [](const auto& view) {
+    return std::vector<w_string>(
+        view->collapsedDirs.begin(), view->collapsedDirs.end());
+  };
+  if (viewMemoryBudget_ == 0 || !root->inner.done_initial ||
+      ageOutInProgress_) {
+    return collapsedDirs(view_.rlock());
+  }
+
+  time_t cutoff = time(nullptr) - coldAge.count();
+  std::vector<w_string> queried;
+  {
+    auto fullyQueried = fullyQueriedDirs_.lock();
+    for (auto it = fullyQueried->begin(); it != fullyQueried->end();) {
+      if (it->second < cutoff) {
+        it = fullyQueried->erase(it);
+      } else {
+        queried.push_back(it->first);
+        ++it;
+      }
+    }
+  }
+
+  w_perf_t sample("collapse_cold_dirs");
+  std::vector<w_string> collapsed;
+  {
+    auto view = view_.wlock();
+    auto before = viewBytes(view);
+    if (before <= viewMemoryBudget_) {
+      return collapsedDirs(view);
+    }
+
+    std::vector<ColdDir> cold;
+    findColdDirs(view->root_dir.get(), cutoff, queried, cold);
+    std::sort(
+        cold.begin(), cold.end(), [](const ColdDir& a, const ColdDir& b) {
+          return a.nodes > b.nodes;
+        });
+
+    size_t numCollapsed = 0;
+    size_t numNodes = 0;
+    for (auto& it : cold) {
+      if (viewBytes(view) <= viewMemoryBudget_) {
+        break;
+      }
+      auto dir = it.dir;
+      logf(DBG, "collapsing {} ({} nodes)\n", dir->getFullPath(), it.nodes);
+      last_age_out_tick = std::max(last_age_out_tick, dir->subtree_tick);
+      // Freeing the nodes unlinks them from the journal and suffix lists
+      dir->clearChildren();
+      dir->collapsed = true;
+      view->collapsedDirs.insert(dir->getFullPath());
+      ++numCollapsed;
+      numNodes += it.nodes;
+    }
+
+    if (numCollapsed == 0) {
+      return collapsedDirs(view);
+    }
+    arena_.compact();
+    view->journal.compact();
+    compactSuffixLists(view);
+    auto after = viewBytes(view);
+
+    logf(
+        ERR,
+        "collapsed {} cold dirs holding {} nodes, view is now {} bytes\n",
+        numCollapsed,
+        numNodes,
+        after);
+    sample.add_meta(
+        "collapse",
+        json_object(
+            {{"dirs", json_integer(numCollapsed)},
+             {"nodes", json_integer(numNodes)},
+             {"bytes_before", json_integer(before)},
+             {"bytes_after", json_integer(after)},
+             {"collapsed_dirs", json_integer(view->collapsedDirs.size())}}));
+    collapsed = collapsedDirs(view);
+  }
+  if (sample.finish()) {
+    sample.add_root_meta(root);
+    sample.log();
+  }
+  return collapsed;
+}
+
+w_string InMemoryView::findCollapsedParent(
+    const SyncView::LockedPtr& view,
+    const w_string& full_path) const {
+  if (view->collapsedDirs.empty()) {
+    return nullptr;
+  }
+  w_string_piece path(full_path);
+  for (size_t i = root_path.size() + 1; i < path.size(); ++i) {
+    if (is_slash(path[i])) {
+      auto it = view->collapsedDirs.find(w_string(path.data(), i));
+      if (it != view->collapsedDirs.end()) {
+        return *it;
+      }
+    }
+  }
+  return nullptr;
+}
+
+bool InMemoryView::expandCollapsedDirs(const w_string& dir) {
+  if (viewMemoryBudget_ == 0) {
+    return false;
+  }
+  auto scope = dir ? dir : root_path;
+  fullyQueriedDirs_.lock()->insert_or_assign(scope, time(nullptr));
+
+  std::vector<w_string> collapsed;
+  {
+    auto view = view_.rlock();
+    for (auto& path : view->collapsedDirs) {
+      if (pathsOverlap(path, scope)) {
+        collapsed.push_back(path);
+      }
+    }
+  }
+  if (collapsed.empty()) {
+    return false;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  auto pending = pending_.lock();
+  for (auto& path : collapsed) {
+    // The crawler clears the collapsed flag
+    pending->add(path, now, W_PENDING_CRAWL_ONLY | W_PENDING_RECURSIVE);
+  }
+  pending->ping();
+  return true;
+}
+
+} // namespace watchman
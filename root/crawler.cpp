@@ -3,22 +3,137 @@
 
 #include "watchman_system.h"
 #include "watchman.h"
+#include <folly/futures/Future.h>
 #include "InMemoryView.h"
 #include "watchman_error_category.h"
 
 using namespace watchman;
 
+namespace {
+// Don't bother fanning out for dirs with fewer entries than this
+constexpr size_t kMinParallelStatEntries = 32;
+// Smallest number of entries that we'll hand to a worker in one go
+constexpr size_t kMinStatChunkSize = 16;
+// Aim to split the stats into this many chunks per worker, so that
+// workers that finish early can pick up the slack left by slow stats
+constexpr size_t kStatChunksPerWorker = 4;
+// How far apart, in seconds, the last change to a dir and the time that we
+// observed it must be for us to trust that a change in the same timestamp
+// granule can't have slipped past its stat
+constexpr time_t kDirSettledSlopSeconds = 2;
+
+// The view's stat of a dir was taken no earlier than the last time that
+// we saw the dir change.  Provided that was comfortably after the dir's
+// own change time, anything added to, removed from or renamed in the dir
+// since then would have moved its mtime on, so if its stat still matches
+// the dir still has the names that the view has for it.
+bool isSettledSinceObserved(
+    const watchman_file* dirFile,
+    const watchman::FileInformation& info) {
+  auto changed = std::max(info.mtime.tv_sec, info.ctime.tv_sec);
+  return changed + kDirSettledSlopSeconds < dirFile->otime.timestamp;
+}
+} // namespace
+
 static void
 apply_dir_size_hint(struct watchman_dir* dir, uint32_t ndirs, uint32_t nfiles) {
   if (dir->files.empty() && nfiles > 0) {
-    dir->files.reserve(nfiles);
+    dir->reserveFiles(nfiles);
   }
   if (dir->dirs.empty() && ndirs > 0) {
-    dir->dirs.reserve(ndirs);
+    dir->reserveDirs(ndirs);
   }
 }
 
 namespace watchman {
+
+// An entry that the crawler has read from a dir and that it will pass
+// on to processPath once the whole dir has been read
+struct InMemoryView::CrawlEntry {
+  w_string name;
+  w_string fullPath;
+  watchman_dir_ent dirent;
+  int flags;
+};
+
+void InMemoryView::statCrawlEntry(
+    int dirFd,
+    CaseSensitivity caseSensitive,
+    CrawlEntry& entry) {
+#ifndef _WIN32
+  // The dir handle was opened with the same strict, nofollow name checks
+  // as getFileInformation() applies, so stat'ing the leaf relative to it
+  // is equivalent when we don't need to confirm the case of the name, and
+  // costs one syscall rather than several.
+  if (dirFd != -1 && caseSensitive != CaseSensitivity::CaseInSensitive) {
+    struct stat st;
+    if (fstatat(dirFd, entry.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      entry.dirent.stat = FileInformation(st);
+      entry.dirent.has_stat = true;
+    }
+    // Otherwise leave it to statPath to stat it again and deal with
+    // the error in the usual way
+    return;
+  }
+#else
+  unused_parameter(dirFd);
+#endif
+  try {
+    entry.dirent.stat =
+        getFileInformation(entry.fullPath.c_str(), caseSensitive);
+    entry.dirent.has_stat = true;
+  } catch (const std::system_error&) {
+    // As above, statPath will deal with it
+  }
+}
+
+void InMemoryView::statCrawlEntriesInParallel(
+    const std::shared_ptr<w_root_t>& root,
+    int dirFd,
+    std::vector<CrawlEntry>& entries) {
+  std::vector<CrawlEntry*> todo;
+  for (auto& entry : entries) {
+    if (!entry.dirent.has_stat) {
+      todo.push_back(&entry);
+    }
+  }
+  if (todo.size() < kMinParallelStatEntries) {
+    for (auto entry : todo) {
+      statCrawlEntry(dirFd, root->case_sensitive, *entry);
+    }
+    return;
+  }
+
+  if (!crawlPoolStarted_) {
+    crawlPool_.start(
+        crawlParallelism_, crawlParallelism_ * kStatChunksPerWorker * 2);
+    crawlPoolStarted_ = true;
+  }
+
+  auto chunkSize = std::max(
+      kMinStatChunkSize,
+      (todo.size() + crawlParallelism_ * kStatChunksPerWorker - 1) /
+          (crawlParallelism_ * kStatChunksPerWorker));
+  auto caseSensitive = root->case_sensitive;
+
+  // The workers only touch the entries and the filesystem; we continue
+  // to hold the view lock while we wait for them so that the results are
+  // applied to the same tree that we read the dir from.
+  std::vector<folly::Future<folly::Unit>> futures;
+  for (size_t begin = 0; begin < todo.size(); begin += chunkSize) {
+    auto end = std::min(todo.size(), begin + chunkSize);
+    futures.emplace_back(
+        folly::via(&crawlPool_, [&todo, begin, end, dirFd, caseSensitive] {
+          for (auto i = begin; i < end; ++i) {
+            statCrawlEntry(dirFd, caseSensitive, *todo[i]);
+          }
+        }));
+  }
+  folly::collectAll(futures.begin(), futures.end()).wait();
+
+  crawlStats_.parallelStats += todo.size();
+}
+
 void InMemoryView::crawler(
     const std::shared_ptr<w_root_t>& root,
     SyncView::LockedPtr& view,
@@ -43,6 +158,13 @@ void InMemoryView::crawler(
 
   auto dir = resolveDir(view, dir_name, true);
 
+  if (dir->collapsed) {
+    // Bring back everything that was dropped from beneath it
+    dir->collapsed = false;
+    view->collapsedDirs.erase(dir_name);
+    recursive = true;
+  }
+
   // Detect root directory replacement.
   // The inode number check is handled more generally by the sister code
   // in stat.cpp.  We need to special case it for the root because we never
@@ -90,32 +212,55 @@ void InMemoryView::crawler(
   try {
     osdir = watcher_->startWatchDir(root, dir, path);
   } catch (const std::system_error& err) {
+    if (dir->stat_deferred) {
+      // Our parent assumed that this dir still existed; have statPath
+      // take a proper look at it
+      dir->stat_deferred = false;
+      coll->add(dir_name, now, 0);
+    }
     handle_open_errno(root, dir, now, "opendir", err.code());
     markDirDeleted(view, dir, now, true);
     return;
   }
 
-  if (dir->files.empty()) {
-    // Pre-size our hash(es) if we can, so that we can avoid collisions
-    // and re-hashing during initial crawl
-    uint32_t num_dirs = 0;
+  // Set if the names in this dir are known to be those in the view
+  bool listFromView = false;
+  // Set if the files in this dir are also trusted to be as the view has
+  // them, so that only its child dirs are looked at
+  bool skipFileStats = false;
+
+  if (dir->stat_deferred) {
+    // The crawler for our parent skipped stat'ing this dir because it was
+    // about to be crawled; bring its stat up to date now that it is open
+    dir->stat_deferred = false;
+    bool refreshed = false;
 #ifndef _WIN32
+    auto dirFile = dir->parent ? dir->parent->getChildFile(dir->name) : nullptr;
     struct stat st;
     int dfd = osdir->getFd();
-    if (dfd != -1 && fstat(dfd, &st) == 0) {
-      num_dirs = (uint32_t)st.st_nlink;
+    if (dirFile && dfd != -1 && fstat(dfd, &st) == 0) {
+      FileInformation info(st);
+      auto saved = dirFile->getStat();
+      if (did_file_change(&saved, &info)) {
+        dirFile->setStat(info);
+        markFileChanged(view, dirFile, now);
+      } else if (isUnchangedSinceSnapshot(info)) {
+        listFromView = true;
+      } else if (validatingRecrawl_ && isSettledSinceObserved(dirFile, info)) {
+        listFromView = true;
+        skipFileStats = true;
+      }
+      refreshed = true;
     }
 #endif
-    // st.st_nlink is usually number of dirs + 2 (., ..).
-    // If it is less than 2 then it doesn't follow that convention.
-    // We just pass it through for the dir size hint and the hash
-    // table implementation will round that up to the next power of 2
-    apply_dir_size_hint(
-        dir,
-        num_dirs,
-        uint32_t(root->config.getInt("hint_num_files_per_dir", 64)));
+    if (!refreshed) {
+      coll->add(dir_name, now, 0);
+    }
   }
 
+  // Set if this dir's hash tables are empty, in which case we size them
+  // once we have read it
+  bool presize = dir->files.empty();
   /* flag for delete detection */
   for (auto& it : dir->files) {
     auto file = it.second.get();
@@ -124,44 +269,155 @@ void InMemoryView::crawler(
     }
   }
 
-  try {
-    while ((dirent = osdir->readDir()) != nullptr) {
-      // Don't follow parent/self links
-      if (dirent->d_name[0] == '.' &&
-          (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))) {
+  // statPath will queue a crawl of any child dir that we pass on with
+  // W_PENDING_RECURSIVE, unless we are an ignored VCS dir
+  bool canDeferDirStats = !root->ignore.isIgnoreVCS(dir_name);
+
+  std::vector<CrawlEntry> entries;
+  auto addEntry = [&](const w_string& name, const watchman_dir_ent& dirent) {
+    // Queue it up for analysis if the file is newly existing
+    file = dir->getChildFile(name);
+    if (file) {
+      file->maybe_deleted = false;
+    }
+    if (!file || !file->exists || stat_all || recursive) {
+      auto full_path = dir->getFullPathToChild(name);
+      CrawlEntry entry{
+          name,
+          full_path,
+          dirent,
+          ((recursive || !file || !file->exists) ? W_PENDING_RECURSIVE : 0)};
+
+      // If the listing shows that this is the same dir that we already
+      // know about, and statPath is going to have it crawled, there's
+      // no need to stat it here: its crawl can do that more cheaply
+      // from the dir handle.  We hand statPath the stat that we already
+      // have so that it sees no change.
+      if (canDeferDirStats && file && !dirent.has_stat &&
+          (entry.flags & W_PENDING_RECURSIVE) && file->stat.isDir() &&
+          dirent.d_type == DType::Dir && dirent.d_ino != 0 &&
+          dirent.d_ino == uint64_t(file->stat.ino()) &&
+          !root->ignore.isIgnoreDir(full_path)) {
+        auto childDir = dir->getChildDir(name);
+        if (childDir) {
+          childDir->stat_deferred = true;
+          entry.dirent.stat = file->getStat();
+          entry.dirent.has_stat = true;
+          ++crawlStats_.deferredStats;
+        }
+      }
+
+      entries.push_back(std::move(entry));
+    }
+  };
+
+  if (listFromView) {
+    // Nothing has been added to, removed from or renamed in this dir since
+    // the snapshot, so we can take its names from the view rather than
+    // reading it.  The files themselves still need to be stat'd, as
+    // changing the contents of a file doesn't touch its dir, unless this
+    // is a recrawl that has been told to trust them.
+    std::vector<w_string> names;
+    names.reserve(dir->files.size());
+    for (auto& it : dir->files) {
+      if (it.second->exists) {
+        names.push_back(it.second->getName().asWString());
+      }
+    }
+    for (auto& name : names) {
+      auto known = dir->getChildFile(name);
+      if (skipFileStats && !known->stat.isDir()) {
+        known->maybe_deleted = false;
+        ++crawlStats_.skippedStats;
         continue;
       }
+      watchman_dir_ent listed;
+      listed.has_stat = false;
+      listed.d_name = nullptr;
+      listed.d_type = known->stat.dtype();
+      listed.d_ino = uint64_t(known->stat.ino());
+      addEntry(name, listed);
+    }
+    ++crawlStats_.unchangedDirs;
+  } else {
+    try {
+      while ((dirent = osdir->readDir()) != nullptr) {
+        // Don't follow parent/self links
+        if (dirent->d_name[0] == '.' &&
+            (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))) {
+          continue;
+        }
+        addEntry(w_string(dirent->d_name, W_STRING_BYTE), *dirent);
+      }
+    } catch (const std::system_error& exc) {
+      log(ERR,
+          "Error while reading dir ",
+          path,
+          ": ",
+          exc.what(),
+          ", re-adding to pending list to re-assess\n");
+      coll->add(path, now, 0);
+    }
+  }
+  ++crawlStats_.dirs;
+  crawlStats_.entries += entries.size();
 
-      // Queue it up for analysis if the file is newly existing
-      w_string name(dirent->d_name, W_STRING_BYTE);
-      file = dir->getChildFile(name);
-      if (file) {
-        file->maybe_deleted = false;
+  if (presize) {
+    // Every entry in the listing is new to us, so we know exactly how big
+    // our hash tables need to be, and can avoid re-hashing them as
+    // processPath adds the entries
+    uint32_t num_dirs = 0;
+    bool typesKnown = true;
+    for (auto& entry : entries) {
+      if (entry.dirent.d_type == DType::Dir) {
+        ++num_dirs;
+      } else if (entry.dirent.d_type == DType::Unknown) {
+        typesKnown = false;
+      }
+    }
+#ifndef _WIN32
+    if (!typesKnown) {
+      // st.st_nlink is usually number of dirs + 2 (., ..).
+      // If it is less than 2 then it doesn't follow that convention.
+      // We just pass it through for the dir size hint and the hash
+      // table implementation will round that up to the next power of 2
+      struct stat st;
+      int dfd = osdir->getFd();
+      if (dfd != -1 && fstat(dfd, &st) == 0) {
+        num_dirs = std::max(num_dirs, uint32_t(st.st_nlink));
       }
-      if (!file || !file->exists || stat_all || recursive) {
-        auto full_path = dir->getFullPathToChild(name);
-        logf(DBG, "in crawler calling process_path on {}\n", full_path);
-        processPath(
-            root,
-            view,
-            coll,
-            full_path,
-            now,
-            ((recursive || !file || !file->exists) ? W_PENDING_RECURSIVE : 0),
-            dirent);
+    }
+#endif
+    apply_dir_size_hint(dir, num_dirs, uint32_t(entries.size()));
+  }
+
+  // Stat the entries while we still have the dir open, so that we can
+  // do so relative to it
+#ifndef _WIN32
+  int dirFd = osdir->getFd();
+#else
+  int dirFd = -1;
+#endif
+  if (crawlParallelism_ > 1) {
+    statCrawlEntriesInParallel(root, dirFd, entries);
+  } else if (dirFd != -1) {
+    for (auto& entry : entries) {
+      if (!entry.dirent.has_stat) {
+        statCrawlEntry(dirFd, root->case_sensitive, entry);
       }
     }
-  } catch (const std::system_error& exc) {
-    log(ERR,
-        "Error while reading dir ",
-        path,
-        ": ",
-        exc.what(),
-        ", re-adding to pending list to re-assess\n");
-    coll->add(path, now, 0);
   }
   osdir.reset();
 
+  for (auto& entry : entries) {
+    // The dirent that we copied refers to storage owned by the dir
+    // handle; point it at our copy of the name instead
+    entry.dirent.d_name = const_cast<char*>(entry.name.c_str());
+    logf(DBG, "in crawler calling process_path on {}\n", entry.fullPath);
+    processPath(
+        root, view, coll, entry.fullPath, now, entry.flags, &entry.dirent);
+  }
+
   // Anything still in maybe_deleted is actually deleted.
   // Arrange to re-process it shortly
   for (auto& it : dir->files) {
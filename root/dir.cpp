@@ -2,13 +2,82 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include "NodeArena.h"
+
+using watchman::hash_128_to_64;
+using watchman::TreeSummary;
 
 void watchman_dir::Deleter::operator()(watchman_file* file) const {
   free_file_node(file);
 }
 
-watchman_dir::watchman_dir(w_string name, watchman_dir* parent)
-    : name(name), parent(parent) {}
+void watchman_dir::Deleter::operator()(watchman_dir* dir) const {
+  auto arena = dir->arena;
+  dir->~watchman_dir();
+  arena->deallocate(dir, sizeof(watchman_dir));
+}
+
+watchman_dir::watchman_dir(
+    w_string name,
+    watchman_dir* parent,
+    watchman::NodeArena* arena)
+    : name(name), parent(parent), arena(arena) {
+  auto& usage = arena->usage();
+  ++usage.dirs;
+  usage.dirNameBytes += name.size();
+}
+
+watchman_dir::~watchman_dir() {
+  auto& usage = arena->usage();
+  --usage.dirs;
+  usage.dirNameBytes -= name.size();
+  usage.childTableBytes -= files.allocatedBytes() + dirs.allocatedBytes();
+}
+
+std::unique_ptr<watchman_dir, watchman_dir::Deleter> watchman_dir::make(
+    watchman::NodeArena& arena,
+    w_string name,
+    watchman_dir* parent) {
+  auto mem = arena.allocate(sizeof(watchman_dir));
+  watchman_dir* dir;
+  try {
+    dir = new (mem) watchman_dir(std::move(name), parent, &arena);
+  } catch (...) {
+    arena.deallocate(mem, sizeof(watchman_dir));
+    throw;
+  }
+  return std::unique_ptr<watchman_dir, Deleter>(dir, Deleter());
+}
+
+watchman_dir* watchman_dir::makeChildDir(const w_string& name) {
+  invalidateTreeSummary();
+  dirs.erase(name);
+  auto before = dirs.allocatedBytes();
+  auto dir = dirs.emplace(make(*arena, name, this)).first->second.get();
+  arena->usage().childTableBytes += dirs.allocatedBytes() - before;
+  return dir;
+}
+
+watchman_file* watchman_dir::addChildFile(
+    std::unique_ptr<watchman_file, Deleter> file) {
+  invalidateTreeSummary();
+  auto before = files.allocatedBytes();
+  auto result = files.emplace(std::move(file)).first->second.get();
+  arena->usage().childTableBytes += files.allocatedBytes() - before;
+  return result;
+}
+
+void watchman_dir::reserveFiles(size_t n) {
+  auto before = files.allocatedBytes();
+  files.reserve(n);
+  arena->usage().childTableBytes += files.allocatedBytes() - before;
+}
+
+void watchman_dir::reserveDirs(size_t n) {
+  auto before = dirs.allocatedBytes();
+  dirs.reserve(n);
+  arena->usage().childTableBytes += dirs.allocatedBytes() - before;
+}
 
 w_string watchman_dir::getFullPath() const {
   return getFullPathToChild(w_string_piece());
@@ -22,6 +91,13 @@ watchman_file* watchman_dir::getChildFile(w_string_piece name) const {
   return it->second.get();
 }
 
+void watchman_dir::clearChildren() {
+  arena->usage().childTableBytes -=
+      files.allocatedBytes() + dirs.allocatedBytes();
+  dirs.clear();
+  files.clear();
+}
+
 watchman_dir* watchman_dir::getChildDir(w_string_piece name) const {
   auto it = dirs.find(name);
   if (it == dirs.end()) {
@@ -30,5 +106,102 @@ watchman_dir* watchman_dir::getChildDir(w_string_piece name) const {
   return it->second.get();
 }
 
+void watchman_dir::markSubtreeChanged(const w_clock_t& otime) {
+  // A parent's subtree_tick is never less than its child's, so we can stop
+  // at the first dir that is already up to date
+  for (auto dir = this; dir && dir->subtree_tick < otime.ticks;
+       dir = dir->parent) {
+    dir->subtree_tick = otime.ticks;
+    dir->subtree_time = std::max(dir->subtree_time, otime.timestamp);
+  }
+}
+
+folly::Optional<TreeSummary> watchman_dir::getTreeSummary() const {
+  auto& cache = tree_summary;
+  TreeSummary summary;
+  summary.hash = cache.hash.load(std::memory_order_acquire);
+  if (summary.hash) {
+    summary.files = cache.files.load(std::memory_order_relaxed);
+    summary.dirs = cache.dirs.load(std::memory_order_relaxed);
+    summary.bytes = cache.bytes.load(std::memory_order_relaxed);
+    summary.newestMtime.tv_sec =
+        cache.newestMtimeSec.load(std::memory_order_relaxed);
+    summary.newestMtime.tv_nsec =
+        cache.newestMtimeNsec.load(std::memory_order_relaxed);
+    return summary;
+  }
+  if (collapsed) {
+    return folly::none;
+  }
+
+  auto newer = [&](const struct timespec& mtime) {
+    if (mtime.tv_sec > summary.newestMtime.tv_sec ||
+        (mtime.tv_sec == summary.newestMtime.tv_sec &&
+         mtime.tv_nsec > summary.newestMtime.tv_nsec)) {
+      summary.newestMtime = mtime;
+    }
+  };
+
+  // The sum of the hashes of the entries, so that it doesn't depend on the
+  // order of the table
+  uint64_t sum = 0;
+  uint64_t count = 0;
+  for (auto& it : files) {
+    auto file = it.second.get();
+    if (!file->exists) {
+      continue;
+    }
+    auto name = file->getName();
+    auto mtime = file->stat.mtime();
+    auto hash = hash_128_to_64(
+        w_hash_bytes(name.data(), name.size(), 0), file->stat.mode());
+    hash = hash_128_to_64(hash, uint64_t(file->stat.size()));
+    hash = hash_128_to_64(hash, uint64_t(mtime.tv_sec));
+    hash = hash_128_to_64(hash, uint64_t(mtime.tv_nsec));
+    hash = hash_128_to_64(hash, uint64_t(file->stat.ino()));
+    newer(mtime);
+    if (file->stat.isDir()) {
+      ++summary.dirs;
+      if (auto dir = getChildDir(name)) {
+        auto subtree = dir->getTreeSummary();
+        if (!subtree) {
+          return folly::none;
+        }
+        hash = hash_128_to_64(hash, subtree->hash);
+        summary.files += subtree->files;
+        summary.dirs += subtree->dirs;
+        summary.bytes += subtree->bytes;
+        newer(subtree->newestMtime);
+      }
+    } else {
+      ++summary.files;
+      summary.bytes += uint64_t(file->stat.size());
+    }
+    sum += hash;
+    ++count;
+  }
+
+  // 0 means that it isn't known
+  summary.hash = std::max(hash_128_to_64(sum, count), uint64_t(1));
+  cache.files.store(summary.files, std::memory_order_relaxed);
+  cache.dirs.store(summary.dirs, std::memory_order_relaxed);
+  cache.bytes.store(summary.bytes, std::memory_order_relaxed);
+  cache.newestMtimeSec.store(
+      summary.newestMtime.tv_sec, std::memory_order_relaxed);
+  cache.newestMtimeNsec.store(
+      summary.newestMtime.tv_nsec, std::memory_order_relaxed);
+  cache.hash.store(summary.hash, std::memory_order_release);
+  return summary;
+}
+
+void watchman_dir::invalidateTreeSummary() {
+  for (auto dir = this; dir; dir = dir->parent) {
+    if (!dir->tree_summary.hash.exchange(0, std::memory_order_relaxed)) {
+      // So is that of each parent
+      break;
+    }
+  }
+}
+
 /* vim:ts=2:sw=2:et:
  */
@@ -0,0 +1,257 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include <thread>
+#include "InMemoryView.h"
+
+namespace watchman {
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+namespace {
+json_ref writer_to_json(const EventTraceWriter& writer) {
+  return json_object(
+      {{"path", w_string_to_json(writer.path())},
+       {"batches", json_integer(writer.batches())},
+       {"events", json_integer(writer.events())},
+       {"bytes", json_integer(writer.bytes())}});
+}
+} // namespace
+
+void InMemoryView::recordEventBatch(const watchman_pending_fs* items) {
+  auto writer = eventTraceWriter_.lock();
+  if (!*writer) {
+    return;
+  }
+  try {
+    (*writer)->writeBatch(items);
+  } catch (const std::exception& exc) {
+    logf(
+        ERR,
+        "stopped recording the events of {}: {}\n",
+        root_path,
+        exc.what());
+    recordingEvents_ = false;
+    writer->reset();
+  }
+}
+
+json_ref InMemoryView::replayEventTrace(
+    const EventTrace& trace,
+    double speed,
+    milliseconds timeout) {
+  // Build the chains up front, so that what we measure is the IO thread
+  // rather than us.  The cookies of the recorded root wouldn't mean
+  // anything to this one, so leave them out.
+  std::vector<std::shared_ptr<watchman_pending_fs>> chains;
+  std::vector<size_t> sizes;
+  size_t events = 0;
+  {
+    PendingCollection pending;
+    auto lock = pending.lock();
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    for (auto& batch : trace.batches) {
+      for (auto& event : batch.events) {
+        w_string_piece name(event.name);
+        if (name.baseName().startsWith(WATCHMAN_COOKIE_PREFIX)) {
+          continue;
+        }
+        lock->add(
+            name.empty() ? root_path : w_string::pathCat({root_path, name}),
+            now,
+            event.flags);
+      }
+      sizes.push_back(lock->size());
+      events += lock->size();
+      chains.push_back(lock->stealItems());
+    }
+  }
+
+  auto pathsBefore = pathsProcessed_.load();
+  auto cpuBefore = ioThreadCpuTime_.load();
+  auto settlesBefore = lastSettle_.lock()->count;
+  auto start = steady_clock::now();
+  auto lastEnqueued = start;
+  for (size_t i = 0; i < chains.size(); ++i) {
+    if (speed > 0) {
+      std::this_thread::sleep_until(
+          start +
+          duration_cast<steady_clock::duration>(
+              trace.batches[i].offset / speed));
+    }
+    if (!chains[i]) {
+      continue;
+    }
+    // These don't take part in the numbering of the batches of the notify
+    // thread, so a sync during the replay may not wait for them
+    watcherEvents_ += sizes[i];
+    pending_.enqueue(std::move(chains[i]));
+    lastEnqueued = steady_clock::now();
+  }
+  auto replayElapsed = steady_clock::now() - start;
+
+  // The IO thread only settles once it wakes to find nothing left to do,
+  // so a settle after the last batch was enqueued means that it has
+  // processed all of them
+  steady_clock::time_point settledAt;
+  uint64_t settles;
+  {
+    auto settle = lastSettle_.lock();
+    if (!settleCond_.wait_for(settle.getUniqueLock(), timeout, [&] {
+          return settle->at > lastEnqueued;
+        })) {
+      throw std::system_error(
+          ETIMEDOUT,
+          std::generic_category(),
+          folly::to<std::string>(
+              "the view didn't settle within ",
+              timeout.count(),
+              "ms of the end of the replay"));
+    }
+    settledAt = settle->at;
+    settles = settle->count - settlesBefore;
+  }
+
+  auto paths = pathsProcessed_.load() - pathsBefore;
+  auto cpu = std::chrono::nanoseconds(ioThreadCpuTime_.load() - cpuBefore);
+  auto recorded = trace.batches.empty() ? microseconds(0)
+                                        : trace.batches.back().offset;
+  return json_object(
+      {{"recorded_root", w_string_to_json(trace.rootPath)},
+       {"batches", json_integer(trace.batches.size())},
+       {"events", json_integer(events)},
+       {"speed", json_real(speed)},
+       {"recorded_ms", json_integer(recorded.count() / 1000)},
+       {"replay_ms",
+        json_integer(duration_cast<milliseconds>(replayElapsed).count())},
+       {"settle_latency_ms",
+        json_integer(
+            duration_cast<milliseconds>(settledAt - lastEnqueued).count())},
+       {"settles", json_integer(settles)},
+       {"paths_processed", json_integer(paths)},
+       {"coalescing_ratio",
+        json_real(paths > 0 ? double(events) / paths : 0.0)},
+       {"io_thread_cpu_ms",
+        json_integer(duration_cast<milliseconds>(cpu).count())}});
+}
+
+/* debug-record-events /root {options}
+ * Starts or stops recording the batches of paths that the watcher of the
+ * root reports to a trace file, for replay by debug-bench-replay.  The
+ * options are:
+ * path: the absolute path of the trace file to start recording to
+ * stop: if true, stop recording */
+void InMemoryView::debugRecordEvents(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 3 || !args.at(2).isObject()) {
+    send_error_response(
+        client,
+        "expected 'debug-record-events' to be passed a root and an "
+        "options object");
+    return;
+  }
+  const auto& options = args.at(2);
+  auto path = options.get_default("path");
+  auto stop = options.get_default("stop", json_false()).asBool();
+  if (stop == bool(path)) {
+    throw CommandValidationError("pass exactly one of path or stop");
+  }
+  if (path &&
+      (!path.isString() || !w_is_path_absolute_cstr(json_string_value(path)))) {
+    throw CommandValidationError("path must be an absolute path");
+  }
+
+  auto root = resolveRoot(client, args);
+  auto view = std::dynamic_pointer_cast<watchman::InMemoryView>(root->view());
+  if (!view) {
+    send_error_response(client, "root is not an InMemoryView watcher");
+    return;
+  }
+
+  auto resp = make_response();
+  auto writer = view->eventTraceWriter_.lock();
+  if (*writer) {
+    view->recordingEvents_ = false;
+    auto stopped = std::move(*writer);
+    stopped->flush();
+    resp.set("stopped", writer_to_json(*stopped));
+  }
+  if (path) {
+    *writer = std::make_unique<EventTraceWriter>(
+        json_to_w_string(path), view->root_path);
+    view->recordingEvents_ = true;
+    resp.set("recording", writer_to_json(**writer));
+  }
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-record-events",
+    InMemoryView::debugRecordEvents,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
+/* debug-bench-replay /root {options}
+ * Feeds the batches recorded by debug-record-events to the IO thread of
+ * the root, and measures how long it takes to settle afterwards and how
+ * much CPU time it spends doing so.  The options are:
+ * trace: the absolute path of the trace file
+ * speed: the rate relative to the recording at which to replay the
+ *   batches; 0 replays them as quickly as possible
+ * timeout_ms: how long to wait for the root to settle */
+void InMemoryView::debugBenchReplay(
+    struct watchman_client* client,
+    const json_ref& args) {
+  if (json_array_size(args) != 3 || !args.at(2).isObject()) {
+    send_error_response(
+        client,
+        "expected 'debug-bench-replay' to be passed a root and an "
+        "options object");
+    return;
+  }
+  const auto& options = args.at(2);
+  auto path = options.get_default("trace");
+  if (!path || !path.isString() ||
+      !w_is_path_absolute_cstr(json_string_value(path))) {
+    throw CommandValidationError("trace must be an absolute path");
+  }
+  auto speedOption = options.get_default("speed", json_real(1.0));
+  if (!speedOption.isNumber() || json_number_value(speedOption) < 0) {
+    throw CommandValidationError("speed must be a non-negative number");
+  }
+  auto speed = json_number_value(speedOption);
+  auto timeoutOption =
+      options.get_default("timeout_ms", json_integer(60000));
+  if (!timeoutOption.isInt() || timeoutOption.asInt() <= 0) {
+    throw CommandValidationError("timeout_ms must be a positive integer");
+  }
+
+  auto root = resolveRoot(client, args);
+  auto view = std::dynamic_pointer_cast<watchman::InMemoryView>(root->view());
+  if (!view) {
+    send_error_response(client, "root is not an InMemoryView watcher");
+    return;
+  }
+
+  auto trace = EventTrace::load(json_string_value(path));
+  view->waitUntilReadyToQuery(root).wait();
+
+  auto resp = make_response();
+  resp.set(
+      "bench",
+      view->replayEventTrace(
+          trace, speed, milliseconds(timeoutOption.asInt())));
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-bench-replay",
+    InMemoryView::debugBenchReplay,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
+} // namespace watchman
@@ -2,6 +2,8 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include "NodeArena.h"
+#include "StringScan.h"
 #ifdef __APPLE__
 #include <sys/attr.h>
 #endif
@@ -48,48 +50,24 @@ bool did_file_change(
   return false;
 }
 
-void watchman_file::removeFromFileList() {
-  if (next) {
-    next->prev = prev;
-  }
-  // file->prev points to the address of either
-  // `previous_file->next` OR `root->inner.latest_file`.
-  // This next assignment is therefore fixing up either
-  // the linkage from the prior file node or from the
-  // head of the list.
-  if (prev) {
-    *prev = next;
-  }
-}
-
-void watchman_file::removeFromSuffixList() {
-  if (suffix_next) {
-    suffix_next->suffix_prev = suffix_prev;
-  }
-  // suffix_prev points to the address of either
-  // `previous_file->suffix_next` OR the `file_list_head.head`
-  // tracked in `root->inner.suffixes`.
-  // This next assignment is therefore fixing up either
-  // the linkage from the prior file node or from the
-  // head of the list.
-  if (suffix_prev) {
-    *suffix_prev = suffix_next;
-  }
+static inline size_t file_node_size(size_t name_len) {
+  return sizeof(watchman_file) + sizeof(uint32_t) + name_len + 1;
 }
 
 /* We embed our name string in the tail end of the struct that we're
  * allocating here.  This turns out to be more memory efficient due
- * to the way that the allocator bins sizeof(watchman_file); there's
+ * to the way that the arena bins sizeof(watchman_file); there's
  * a bit of unusable space after the end of the structure that happens
  * to be about the right size to fit a typical filename.
  * Embedding the name in the end allows us to make the most of this
  * memory and free up the separate heap allocation for file_name.
+ * The node is drawn from the arena of the parent dir.
  */
 std::unique_ptr<watchman_file, watchman_dir::Deleter> watchman_file::make(
     const w_string& name,
     watchman_dir* parent) {
-  auto file = (watchman_file*)calloc(
-      1, sizeof(watchman_file) + sizeof(uint32_t) + name.size() + 1);
+  auto file =
+      (watchman_file*)parent->arena->allocate(file_node_size(name.size()));
   std::unique_ptr<watchman_file, watchman_dir::Deleter> filePtr(
       file, watchman_dir::Deleter());
 
@@ -102,18 +80,42 @@ std::unique_ptr<watchman_file, watchman_dir::Deleter> watchman_file::make(
 
   file->parent = parent;
   file->exists = true;
+  file->name_folded = !watchman::strscan::hasUpper(name.data(), name.size());
+
+  auto& usage = parent->arena->usage();
+  ++usage.files;
+  usage.fileNameBytes += name.size();
 
   return filePtr;
 }
 
+watchman::FileInformation watchman_file::getStat() const {
+  return stat.expand(parent->arena->owners());
+}
+
+void watchman_file::setStat(const watchman::FileInformation& st) {
+  stat = watchman::CompactFileInformation(st, parent->arena->owners());
+  parent->invalidateTreeSummary();
+}
+
 watchman_file::~watchman_file() {
-  removeFromFileList();
-  removeFromSuffixList();
+  watchman::ChangeJournal<watchman_file>::unlink(this);
+  watchman::SuffixList<watchman_file>::unlink(this);
+  watchman::SuffixList<watchman_file, &watchman_file::basename_slot>::unlink(
+      this);
 }
 
 void free_file_node(struct watchman_file* file) {
+  // The arena needs the size of the allocation; compute it before we
+  // destroy the node.  The parent dir is guaranteed to outlive its files.
+  auto nameSize = file->getName().size();
+  auto size = file_node_size(nameSize);
+  auto arena = file->parent->arena;
+  auto& usage = arena->usage();
+  --usage.files;
+  usage.fileNameBytes -= nameSize;
   file->~watchman_file();
-  free(file);
+  arena->deallocate(file, size);
 }
 
 /* vim:ts=2:sw=2:et:
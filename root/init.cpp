@@ -7,6 +7,27 @@
 
 using namespace watchman;
 
+// Returns the cache of the files changed since merge bases for the root
+static std::shared_ptr<ChangedFilesCache> makeChangedFilesCache(
+    const Configuration& config,
+    const w_string& rootPath) {
+  w_string path;
+  if (config.getBool("scm_changed_files_cache_persist", false)) {
+    // The root path is also recorded in the cache, so a collision will
+    // simply cause the cache to be ignored
+    path = w_string::format(
+        "{}/scmchanges-{:08x}.cache",
+        w_string_piece(watchman_state_file).dirName(),
+        w_string_piece(rootPath).hashValue());
+  }
+  return std::make_shared<ChangedFilesCache>(
+      path,
+      rootPath,
+      size_t(std::max(
+          config.getInt("scm_changed_files_cache_max_entries", 16),
+          json_int_t(0))));
+}
+
 static json_ref load_root_config(const char* path) {
   char cfgfilename[WATCHMAN_NAME_MAX];
   json_error_t err;
@@ -56,6 +77,61 @@ void watchman_root::applyIgnoreConfiguration() {
   }
 }
 
+void watchman_root::applyIgnoreGlobConfiguration() {
+  auto globs = config.get("ignore_globs");
+  if (!globs) {
+    return;
+  }
+  if (!globs.isArray()) {
+    logf(ERR, "ignore_globs must be an array of strings\n");
+    return;
+  }
+
+  for (auto& jglob : globs.array()) {
+    if (!jglob.isString()) {
+      logf(ERR, "ignore_globs must be an array of strings\n");
+      continue;
+    }
+
+    auto pattern = json_to_w_string(jglob);
+    if (!ignore.addGlob(root_path, pattern)) {
+      logf(ERR, "ignore_globs: {} can't be used to ignore dirs\n", pattern);
+      continue;
+    }
+    logf(DBG, "ignoring dirs matching {} in {}\n", pattern, root_path);
+  }
+}
+
+void watchman_root::applyIncludeConfiguration() {
+  auto includes = config.get("watch_includes");
+  if (!includes) {
+    return;
+  }
+  if (!includes.isArray()) {
+    logf(ERR, "watch_includes must be an array of strings\n");
+    return;
+  }
+
+  for (auto& jinclude : includes.array()) {
+    if (!jinclude.isString()) {
+      logf(ERR, "watch_includes must be an array of strings\n");
+      continue;
+    }
+
+    auto fullname = w_string::pathCat({root_path, json_to_w_string(jinclude)});
+    if (fullname.size() <= root_path.size()) {
+      continue;
+    }
+    ignore.addInclude(root_path, fullname);
+    logf(DBG, "watching {} and the dirs leading to it\n", fullname);
+  }
+
+  // We have to see our cookies
+  if (!ignore.include_dirs.empty() && cookies.cookieDir() != root_path) {
+    ignore.addInclude(root_path, cookies.cookieDir());
+  }
+}
+
 // internal initialization for root
 void watchman_root::init() {
   // This just opens and releases the dir.  If an exception is thrown
@@ -85,10 +161,26 @@ watchman_root::watchman_root(const w_string& root_path, const w_string& fs_type)
       gc_age(int(config.getInt("gc_age_seconds", DEFAULT_GC_AGE))),
       idle_reap_age(
           int(config.getInt("idle_reap_age_seconds", DEFAULT_REAP_AGE))),
-      unilateralResponses(std::make_shared<watchman::Publisher>()) {
+      unilateralResponses(std::make_shared<watchman::Publisher>()),
+      queryResultCache(size_t(std::max(
+          config.getInt("query_result_cache_max_bytes", 0),
+          json_int_t(0)))),
+      queryPlanCache(size_t(std::max(
+          config.getInt("query_plan_cache_size", 32),
+          json_int_t(0)))),
+      scmChangedFiles(makeChangedFilesCache(config, root_path)) {
   ++live_roots;
+  recrawlInfo.wlock()->backoff.setLimits(
+      std::chrono::milliseconds(
+          std::max(config.getInt("recrawl_backoff_ms", 1000), json_int_t(0))),
+      std::chrono::milliseconds(std::max(
+          config.getInt("recrawl_backoff_max_ms", 300000), json_int_t(0))));
+  cookies.setBatchWindow(std::chrono::milliseconds(
+      std::max(config.getInt("cookie_batch_window_ms", 20), json_int_t(0))));
   applyIgnoreConfiguration();
+  applyIgnoreGlobConfiguration();
   applyIgnoreVCSConfiguration();
+  applyIncludeConfiguration();
   init();
 }
 
@@ -2,10 +2,37 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <folly/ScopeGuard.h>
+#include <cmath>
+#include "ContentHashStore.h"
 #include "InMemoryView.h"
+#include "Tracing.h"
 
 namespace watchman {
 
+namespace {
+// The event rate is averaged over roughly this long
+constexpr double kEventRateTimeConstantSeconds = 1.0;
+// The event rate, in events per second, at which the adaptive settle
+// period is half way between settle_min and settle_max
+constexpr double kSettleHalfRate = 1000.0;
+// The most recent recrawls that we describe in watch-list
+constexpr size_t kMaxRecrawlHistory = 8;
+
+// The CPU time consumed by the calling thread, or 0 if the system can't
+// tell us
+std::chrono::nanoseconds currentThreadCpuTime() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+    return std::chrono::seconds(ts.tv_sec) +
+        std::chrono::nanoseconds(ts.tv_nsec);
+  }
+#endif
+  return std::chrono::nanoseconds(0);
+}
+} // namespace
+
 std::shared_future<void> InMemoryView::waitUntilReadyToQuery(
     const std::shared_ptr<w_root_t>& root) {
   auto lockPair = acquireLockedPair(root->recrawlInfo, crawlState_);
@@ -14,7 +41,11 @@ std::shared_future<void> InMemoryView::waitUntilReadyToQuery(
     return lockPair.second->future;
   }
 
-  if (root->inner.done_initial && !lockPair.first->shouldRecrawl) {
+  if (root->inner.done_initial &&
+      (!lockPair.first->shouldRecrawl ||
+       lockPair.first->backoff.recrawlNotBefore())) {
+    // A recrawl that is backing off may not start for minutes, so we
+    // answer from the view that we have in the meantime.
     // Return an already satisfied future
     std::promise<void> p;
     p.set_value();
@@ -25,15 +56,102 @@ std::shared_future<void> InMemoryView::waitUntilReadyToQuery(
   lockPair.second->promise = std::make_unique<std::promise<void>>();
   lockPair.second->future =
       std::shared_future<void>(lockPair.second->promise->get_future());
+  // Somebody is waiting for this root, so its crawl goes ahead of those
+  // that nobody is waiting for.  If the crawl hasn't been queued yet,
+  // fullCrawl sees the promise and does this itself.
+  if (auto request = *crawlRequest_.rlock()) {
+    request->prioritize();
+  }
   return lockPair.second->future;
 }
 
+folly::Future<folly::Unit> InMemoryView::readyToQuery(
+    const std::shared_ptr<w_root_t>& root) {
+  auto ready = waitUntilReadyToQuery(root);
+  if (ready.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+    return folly::makeFuture();
+  }
+  auto state = crawlState_.wlock();
+  if (!state->promise) {
+    // The crawl finished after we looked
+    return folly::makeFuture();
+  }
+  if (!state->asyncPromise) {
+    state->asyncPromise =
+        std::make_unique<folly::SharedPromise<folly::Unit>>();
+  }
+  // It is fulfilled by the IO thread with the crawl state locked, so
+  // nothing else may run there
+  return state->asyncPromise->getFuture().via(&getThreadPool());
+}
+
+void InMemoryView::crawl_state::fulfil() {
+  if (promise) {
+    promise->set_value();
+    promise.reset();
+  }
+  if (asyncPromise) {
+    asyncPromise->setValue();
+    asyncPromise.reset();
+  }
+}
+
+bool InMemoryView::waitForCrawlSlot() {
+  auto request = getCrawlScheduler().enqueue(root_path);
+  *crawlRequest_.wlock() = request;
+  // signalThreads cancels the request that it finds in crawlRequest_, so
+  // if it ran before we stored this one, we have to cancel it ourselves
+  if (stopThreads_) {
+    request->cancel();
+  }
+  if (crawlState_.rlock()->promise) {
+    request->prioritize();
+  }
+
+  auto position = request->position();
+  if (position > 0) {
+    logf(
+        ERR,
+        "waiting to crawl {}; {} crawls are ahead of it\n",
+        root_path,
+        position - 1);
+  }
+  return request->wait();
+}
+
+void InMemoryView::finishedWithCrawlSlot() {
+  // The request is only referenced here, so this lets the next crawl run
+  crawlRequest_.wlock()->reset();
+}
+
 void InMemoryView::fullCrawl(
     const std::shared_ptr<w_root_t>& root,
     PendingCollection::LockedPtr& pending) {
   struct timeval start;
 
+  if (!waitForCrawlSlot()) {
+    // We're stopping, and the caller will see that
+    finishedWithCrawlSlot();
+    return;
+  }
+  SCOPE_EXIT {
+    finishedWithCrawlSlot();
+  };
+
   w_perf_t sample("full-crawl");
+  TraceSpan span("full_crawl", root_path);
+  crawlStats_ = CrawlStats();
+  // A recrawl starts from the view that we already have
+  validatingRecrawl_ = trustUnchangedDirsOnRecrawl_ &&
+      root->recrawlInfo.rlock()->recrawlCount > 0;
+  SCOPE_EXIT {
+    validatingRecrawl_ = false;
+  };
+  auto crawlStart = std::chrono::steady_clock::now();
+  auto batch = enqueuedNotifyBatch();
+  json_ref crawlInfo;
+  // The crawl takes another look at the dirs that failed before
+  root->recrawlInfo.wlock()->backoff.recrawlStarted();
   {
     auto view = view_.wlock();
     // Ensure that we observe these files with a new, distinct clock,
@@ -55,19 +173,58 @@ void InMemoryView::fullCrawl(
       while (processPending(root, view, pending, false)) {
         ;
       }
+      warmSymlinkTargets();
     }
+    // Recorded before those waiting for the crawl are woken, so that they
+    // can see how it went
+    auto crawlSeconds = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - crawlStart)
+                            .count();
+    crawlInfo = json_object(
+        {{"parallelism", json_integer(crawlParallelism_)},
+         {"dirs", json_integer(crawlStats_.dirs)},
+         {"entries", json_integer(crawlStats_.entries)},
+         {"parallel_stats", json_integer(crawlStats_.parallelStats)},
+         {"deferred_stats", json_integer(crawlStats_.deferredStats)},
+         {"unchanged_dirs", json_integer(crawlStats_.unchangedDirs)},
+         {"skipped_stats", json_integer(crawlStats_.skippedStats)},
+         {"seconds", json_real(crawlSeconds)},
+         {"entries_per_second",
+          json_integer(
+              crawlSeconds > 0 ? int64_t(crawlStats_.entries / crawlSeconds)
+                               : 0)}});
+    *lastCrawlInfo_.lock() = crawlInfo;
     {
       auto lockPair = acquireLockedPair(root->recrawlInfo, crawlState_);
-      lockPair.first->shouldRecrawl = false;
-      if (lockPair.second->promise) {
-        lockPair.second->promise->set_value();
-        lockPair.second->promise.reset();
+      auto& info = *lockPair.first;
+      if (info.recrawlCount > 0) {
+        info.recrawlSeconds += crawlSeconds;
+        info.recrawlHistory.push_back(json_object(
+            {{"reason", w_string_to_json(info.recrawlReason)},
+             {"time", json_integer(start.tv_sec)},
+             {"delay_ms", json_integer(info.backoff.recrawlDelay().count())},
+             {"streak", json_integer(info.backoff.streak())},
+             {"seconds", json_real(crawlSeconds)},
+             {"dirs", json_integer(crawlStats_.dirs)},
+             {"entries", json_integer(crawlStats_.entries)}}));
+        if (info.recrawlHistory.size() > kMaxRecrawlHistory) {
+          info.recrawlHistory.pop_front();
+        }
+      }
+      if (info.recrawlCount > 0) {
+        info.backoff.recrawlFinished(std::chrono::steady_clock::now());
+      } else {
+        info.backoff.subtreeCrawlsFinished();
       }
+      lockPair.first->shouldRecrawl = false;
+      lockPair.second->fulfil();
       root->inner.done_initial = true;
     }
     root->cookies.abortAllCookies();
   }
+  markNotifyBatchProcessed(batch);
   sample.add_root_meta(root);
+  sample.add_meta("crawl", std::move(crawlInfo));
 
   sample.finish();
   sample.force_log();
@@ -79,9 +236,29 @@ void InMemoryView::fullCrawl(
       root->recrawlInfo.rlock()->recrawlCount ? "re" : "");
 }
 
+uint64_t InMemoryView::enqueuedNotifyBatch() const {
+  auto batch = notifyBatch_.load();
+  // An odd batch is still being read, so only the one before it is
+  // complete
+  return batch - (batch & 1);
+}
+
+void InMemoryView::markNotifyBatchProcessed(uint64_t batch) {
+  {
+    auto processed = processedBatch_.lock();
+    if (*processed >= batch) {
+      return;
+    }
+    *processed = batch;
+  }
+  processedBatchCond_.notify_all();
+}
+
 // Performs settle-time actions.
 // Returns true if the root was reaped and the io thread should terminate.
-static bool do_settle_things(const std::shared_ptr<w_root_t>& root) {
+static bool do_settle_things(
+    const std::shared_ptr<w_root_t>& root,
+    int settleMs) {
   // No new pending items were given to us, so consider that
   // we may now be settled.
 
@@ -94,9 +271,11 @@ static bool do_settle_things(const std::shared_ptr<w_root_t>& root) {
 
   auto view = std::dynamic_pointer_cast<watchman::InMemoryView>(root->view());
   w_assert(view, "we're called from InMemoryView, wat?");
-  view->warmContentCache();
+  view->warmContentCache(root);
+  view->recordSettleChanges();
 
-  auto settledPayload = json_object({{"settled", json_true()}});
+  auto settledPayload = json_object(
+      {{"settled", json_true()}, {"settle_ms", json_integer(settleMs)}});
   root->unilateralResponses->enqueue(std::move(settledPayload));
 
   if (root->considerReap()) {
@@ -108,11 +287,56 @@ static bool do_settle_things(const std::shared_ptr<w_root_t>& root) {
   return false;
 }
 
+void InMemoryView::resumeFromSnapshot(const std::shared_ptr<w_root_t>& root) {
+  // Changes replayed by the watcher are observed with a new clock, as
+  // they would be by the crawl
+  auto view = view_.wlock();
+  mostRecentTick_++;
+  auto lockPair = acquireLockedPair(root->recrawlInfo, crawlState_);
+  if (lockPair.first->shouldRecrawl) {
+    // The replay has already found that it can't be trusted
+    return;
+  }
+  lockPair.second->fulfil();
+  root->inner.done_initial = true;
+  logf(ERR, "resumed from the view snapshot without a crawl\n");
+}
+
 void InMemoryView::clientModeCrawl(const std::shared_ptr<w_root_t>& root) {
   PendingCollection pending;
 
-  auto lock = pending.lock();
-  fullCrawl(root, lock);
+  // Pick up the view that the last invocation left behind, so that the
+  // crawl only has to confirm it rather than build it from scratch
+  uint32_t restoredTick = 0;
+  if (enableSnapshot_ && loadSnapshot(root)) {
+    validatingSnapshot_ = true;
+    restoredTick = mostRecentTick_;
+  }
+  SCOPE_EXIT {
+    validatingSnapshot_ = false;
+  };
+
+  {
+    auto lock = pending.lock();
+    fullCrawl(root, lock);
+  }
+
+  if (!enableSnapshot_) {
+    return;
+  }
+  if (restoredTick) {
+    // The crawl itself takes a tick; anything that it found to have
+    // changed is in the journal after the one that we restored
+    bool changed = false;
+    view_.rlock()->journal.forEachSince(restoredTick, [&](watchman_file*) {
+      changed = true;
+      return false;
+    });
+    if (!changed) {
+      return;
+    }
+  }
+  saveSnapshot(root);
 }
 
 bool InMemoryView::handleShouldRecrawl(const std::shared_ptr<w_root_t>& root) {
@@ -121,6 +345,10 @@ bool InMemoryView::handleShouldRecrawl(const std::shared_ptr<w_root_t>& root) {
     if (!info->shouldRecrawl) {
       return false;
     }
+    if (info->backoff.recrawlWaiting(std::chrono::steady_clock::now())) {
+      // Still backing off; limitTimeoutToRecrawls wakes us in time
+      return false;
+    }
   }
 
   if (!root->inner.cancelled) {
@@ -132,24 +360,137 @@ bool InMemoryView::handleShouldRecrawl(const std::shared_ptr<w_root_t>& root) {
   return true;
 }
 
-void InMemoryView::ioThread(const std::shared_ptr<w_root_t>& root) {
-  int timeoutms, biggest_timeout;
-  PendingCollection pending;
-  auto localPendingLock = pending.lock();
+void InMemoryView::queueSubtreeRecrawls(
+    const std::shared_ptr<w_root_t>& root,
+    PendingCollection::LockedPtr& pending) {
+  auto info = root->recrawlInfo.wlock();
+  if (info->shouldRecrawl) {
+    return;
+  }
+  auto due = info->backoff.takeDueSubtrees(std::chrono::steady_clock::now());
+  if (due.empty()) {
+    return;
+  }
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  for (auto& dir : due) {
+    logf(
+        ERR,
+        "crawling {} again after: {}\n",
+        dir,
+        info->backoff.subtreeErrors().at(dir).reason);
+    // Only the dir that failed, rather than the whole tree
+    pending->add(dir, tv, W_PENDING_CRAWL_ONLY | W_PENDING_RECURSIVE);
+  }
+}
 
-  timeoutms = root->trigger_settle;
+void InMemoryView::limitTimeoutToRecrawls(
+    const std::shared_ptr<w_root_t>& root,
+    IoThreadState& state) {
+  folly::Optional<std::chrono::steady_clock::time_point> due;
+  {
+    auto info = root->recrawlInfo.rlock();
+    if (info->shouldRecrawl) {
+      due = info->backoff.recrawlNotBefore();
+    } else {
+      due = info->backoff.nextSubtreeRetry();
+    }
+  }
+  if (!due) {
+    return;
+  }
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       *due - std::chrono::steady_clock::now())
+                       .count() +
+      1;
+  state.timeoutms =
+      std::max(1, int(std::min<int64_t>(state.timeoutms, remaining)));
+}
+
+void InMemoryView::updateEventRate(size_t numEvents) {
+  auto now = std::chrono::steady_clock::now();
+  auto elapsed =
+      std::chrono::duration<double>(now - lastEventRateUpdate_).count();
+  lastEventRateUpdate_ = now;
+  if (elapsed <= 0) {
+    return;
+  }
+  // An exponentially weighted moving average of the rate, weighting each
+  // sample by how much of the time constant it covers
+  auto weight = 1 - std::exp(-elapsed / kEventRateTimeConstantSeconds);
+  eventRate_ += weight * (numEvents / elapsed - eventRate_);
+}
+
+int InMemoryView::getSettleTimeout(const std::shared_ptr<w_root_t>& root) {
+  if (settleMax_ <= settleMin_) {
+    return root->trigger_settle;
+  }
+  // Stretch smoothly from the minimum for isolated changes towards the
+  // maximum for a sustained storm of them
+  auto fraction = eventRate_ / (eventRate_ + kSettleHalfRate);
+  return settleMin_ + int(std::lround((settleMax_ - settleMin_) * fraction));
+}
+
+void InMemoryView::startIoThread(
+    const std::shared_ptr<w_root_t>& root,
+    IoThreadState& state) {
+  lastEventRateUpdate_ = std::chrono::steady_clock::now();
+  state.settleMs = getSettleTimeout(root);
+  state.timeoutms = state.settleMs;
+  markIoThreadCpuTime(state);
 
   // Upper bound on sleep delay.  These options are measured in seconds.
-  biggest_timeout = root->gc_interval;
-  if (biggest_timeout == 0 ||
-      (root->idle_reap_age != 0 && root->idle_reap_age < biggest_timeout)) {
-    biggest_timeout = root->idle_reap_age;
+  state.biggestTimeout = root->gc_interval;
+  if (state.biggestTimeout == 0 ||
+      (root->idle_reap_age != 0 &&
+       root->idle_reap_age < state.biggestTimeout)) {
+    state.biggestTimeout = root->idle_reap_age;
   }
-  if (biggest_timeout == 0) {
-    biggest_timeout = 86400;
+  if (state.biggestTimeout == 0) {
+    state.biggestTimeout = 86400;
   }
   // And convert to milliseconds
-  biggest_timeout *= 1000;
+  state.biggestTimeout *= 1000;
+
+  if (enableSnapshot_) {
+    // If we can pick up where a prior incarnation left off, the initial
+    // full crawl below just validates the restored view and only
+    // reports the things that changed while we weren't watching.
+    // If the watcher is replaying those things, we don't need the
+    // crawl at all.
+    if (loadSnapshot(root) && watcher_->resumedFromPosition()) {
+      resumeFromSnapshot(root);
+    }
+    lastSnapshotTime_ = std::chrono::steady_clock::now();
+  }
+
+  if (batchStatQueueDepth_ > 0) {
+    batchStat_ = BatchStat::create(batchStatQueueDepth_, root->case_sensitive);
+    if (!batchStat_) {
+      log(ERR,
+          "batch_stat_queue_depth is set, but batched stats are not "
+          "supported on this system; stat'ing files one at a time\n");
+    }
+  }
+}
+
+void InMemoryView::markIoThreadCpuTime(IoThreadState& state) {
+  state.cpuMark = currentThreadCpuTime();
+}
+
+void InMemoryView::publishIoThreadCpuTime(IoThreadState& state) {
+  // Accumulated a step at a time, so that this also works when the steps
+  // run on the threads of a RootThreadPool
+  auto cpu = currentThreadCpuTime();
+  ioThreadCpuTime_ += (cpu - state.cpuMark).count();
+  state.cpuMark = cpu;
+}
+
+void InMemoryView::ioThread(const std::shared_ptr<w_root_t>& root) {
+  LockSite site("io_thread");
+  IoThreadState state;
+  auto localPendingLock = state.pending.lock();
+  startIoThread(root, state);
 
   while (!stopThreads_) {
     bool pinged;
@@ -158,52 +499,156 @@ void InMemoryView::ioThread(const std::shared_ptr<w_root_t>& root) {
       /* first order of business is to find all the files under our root */
       fullCrawl(root, localPendingLock);
 
-      timeoutms = root->trigger_settle;
+      state.settleMs = getSettleTimeout(root);
+      state.timeoutms = state.settleMs;
     }
 
     // Wait for the notify thread to give us pending items, or for
     // the settle period to expire
     {
-      logf(DBG, "poll_events timeout={}ms\n", timeoutms);
-      auto targetPendingLock =
-          pending_.lockAndWait(std::chrono::milliseconds(timeoutms), pinged);
+      logf(DBG, "poll_events timeout={}ms\n", state.timeoutms);
+      auto targetPendingLock = pending_.lockAndWait(
+          std::chrono::milliseconds(state.timeoutms), pinged);
       logf(DBG, " ... wake up (pinged={})\n", pinged);
       localPendingLock->append(&*targetPendingLock);
     }
-
-    if (handleShouldRecrawl(root)) {
-      fullCrawl(root, localPendingLock);
-      timeoutms = root->trigger_settle;
-      continue;
+    if (!ioThreadStep(root, state, localPendingLock, pinged)) {
+      break;
     }
+  }
 
-    if (!pinged && localPendingLock->size() == 0) {
-      if (do_settle_things(root)) {
-        break;
-      }
-      timeoutms = std::min(biggest_timeout, timeoutms * 2);
-      continue;
-    }
+  stopIoThread(root);
+}
 
-    // Otherwise we have pending items to stat and crawl
+bool InMemoryView::ioThreadStep(
+    const std::shared_ptr<w_root_t>& root,
+    IoThreadState& state,
+    PendingCollection::LockedPtr& localPendingLock,
+    bool pinged) {
+  auto wokeAt = std::chrono::steady_clock::now();
+  // Everything in the batches up to this one is in the queue that we
+  // take below
+  auto batch = enqueuedNotifyBatch();
+  localPendingLock->appendBatch(pending_.takeQueued());
+  // The items that were held back by the last step aren't new
+  auto numPending = localPendingLock->size();
+  updateEventRate(
+      numPending > state.deferredItems ? numPending - state.deferredItems : 0);
+  state.deferredItems = 0;
+
+  // Make sure that we wake up for the next recrawl or subtree retry,
+  // however long we would otherwise sleep for
+  SCOPE_EXIT {
+    limitTimeoutToRecrawls(root, state);
+  };
+
+  handleOverflowRecovery(root, localPendingLock);
+
+  if (handleShouldRecrawl(root)) {
+    fullCrawl(root, localPendingLock);
+    state.settleMs = getSettleTimeout(root);
+    state.timeoutms = state.settleMs;
+    return true;
+  }
 
-    // We are now, by definition, unsettled, so reduce sleep timeout
-    // to the settle duration ready for the next loop through
-    timeoutms = root->trigger_settle;
+  if (root->inner.done_initial) {
+    queueSubtreeRecrawls(root, localPendingLock);
+  }
 
+  if (!pinged && localPendingLock->size() == 0) {
+    markNotifyBatchProcessed(batch);
+    publishIoThreadCpuTime(state);
     {
-      auto view = view_.wlock();
-      if (!root->inner.done_initial) {
-        // we need to recrawl.  Discard these notifications
-        localPendingLock->drain();
-        continue;
-      }
+      auto settle = lastSettle_.lock();
+      settle->count++;
+      settle->at = wokeAt;
+    }
+    settleCond_.notify_all();
+    TraceSpan span("settle", root_path);
+    if (do_settle_things(root, state.settleMs)) {
+      return false;
+    }
+    maybeSaveSnapshot(root);
+    maybeCollapseColdDirs(root);
+    if (auto& store = caches_.contentHashCache.store()) {
+      store->scheduleSave();
+    }
+    if (ageOutInProgress_) {
+      // Come back for the next slice as soon as we're idle again
+      state.timeoutms = state.settleMs;
+    } else {
+      state.timeoutms = std::min(state.biggestTimeout, state.timeoutms * 2);
+    }
+    return true;
+  }
 
-      mostRecentTick_++;
+  // Otherwise we have pending items to stat and crawl
 
-      while (processPending(root, view, localPendingLock, false)) {
-        ;
-      }
+  // We are now, by definition, unsettled, so reduce sleep timeout
+  // to the settle duration ready for the next loop through
+  state.settleMs = getSettleTimeout(root);
+  state.timeoutms = state.settleMs;
+
+  if (shouldDeferPending(root, localPendingLock, pinged)) {
+    // Let the changes pile up in the collection, which coalesces them as
+    // they arrive, and apply them once they stop arriving for the settle
+    // period or the state is left
+    state.deferredItems = localPendingLock->size();
+    publishIoThreadCpuTime(state);
+    return true;
+  }
+
+  {
+    TraceSpan span("process_pending", root_path);
+    auto view = view_.wlock();
+    if (!root->inner.done_initial) {
+      // we need to recrawl.  Discard these notifications
+      localPendingLock->drain();
+      return true;
+    }
+
+    mostRecentTick_++;
+
+    while (processPending(root, view, localPendingLock, false)) {
+      ;
+    }
+    warmSymlinkTargets();
+  }
+  root->recrawlInfo.wlock()->backoff.subtreeCrawlsFinished();
+  publishIoThreadCpuTime(state);
+  markNotifyBatchProcessed(batch);
+  return true;
+}
+
+bool InMemoryView::shouldDeferPending(
+    const std::shared_ptr<w_root_t>& root,
+    const PendingCollection::LockedPtr& coll,
+    bool pinged) const {
+  if (!pinged) {
+    // We waited for the settle period without anything new turning up
+    return false;
+  }
+  if (coll->hasPossibleCookie()) {
+    // A query is waiting for us to catch up with everything up to its
+    // cookie
+    return false;
+  }
+  return root->assertedStates.rlock()->isDeferringProcessing();
+}
+
+void InMemoryView::stopIoThread(const std::shared_ptr<w_root_t>& root) {
+  if (auto& store = caches_.contentHashCache.store()) {
+    store->save();
+  }
+  root->scmChangedFiles->save();
+
+  if (enableSnapshot_) {
+    if (w_is_stopping()) {
+      // The server is shutting down; save our state for the next one
+      saveSnapshot(root);
+    } else {
+      // The watch was removed, so the snapshot is of no further use
+      removeSnapshot();
     }
   }
 }
@@ -244,6 +689,13 @@ void InMemoryView::processPath(
     return;
   }
 
+  // The parts of the tree beneath a collapsed dir aren't in the view; the
+  // crawl of that dir will pick up this change along with everything else
+  if (auto collapsed = findCollapsedParent(view, full_path)) {
+    coll->add(collapsed, now, W_PENDING_CRAWL_ONLY | W_PENDING_RECURSIVE);
+    return;
+  }
+
   if (w_string_equal(full_path, root_path) ||
       (flags & W_PENDING_CRAWL_ONLY) == W_PENDING_CRAWL_ONLY) {
     crawler(
@@ -258,14 +710,61 @@ void InMemoryView::processPath(
   }
 }
 
+size_t InMemoryView::prefetchPendingStats(
+    const std::shared_ptr<w_root_t>& root,
+    const watchman_pending_fs* item,
+    std::vector<PrefetchedStat>& prefetched) {
+  prefetched.clear();
+
+  std::vector<const char*> paths;
+  size_t looked = 0;
+  for (; item && looked < batchStatQueueDepth_;
+       item = item->next.get(), ++looked) {
+    // Only the items that processPath hands to statPath are of interest
+    if (w_string_startswith(item->path, cookies_.cookiePrefix()) ||
+        w_string_equal(item->path, root_path) ||
+        (item->flags & W_PENDING_CRAWL_ONLY) == W_PENDING_CRAWL_ONLY ||
+        (item->flags & W_PENDING_REMOVED) || item->stat ||
+        root->ignore.isIgnoreDir(item->path)) {
+      continue;
+    }
+    prefetched.push_back(PrefetchedStat{item, watchman_dir_ent()});
+    paths.push_back(item->path.c_str());
+  }
+
+  std::vector<BatchStat::Result> results;
+  if (!paths.empty() && !batchStat_->statPaths(paths, results)) {
+    // The ring is no use to us; go back to stat'ing synchronously
+    batchStat_.reset();
+    prefetched.clear();
+    return looked;
+  }
+
+  // Leave the failures for statPath to report
+  size_t numOk = 0;
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (!results[i].error) {
+      prefetched[numOk].item = prefetched[i].item;
+      prefetched[numOk].ent.has_stat = true;
+      prefetched[numOk].ent.stat = results[i].info;
+      ++numOk;
+    }
+  }
+  prefetched.resize(numOk);
+  return looked;
+}
+
 bool InMemoryView::processPending(
     const std::shared_ptr<w_root_t>& root,
     SyncView::LockedPtr& view,
     PendingCollection::LockedPtr& coll,
     bool pullFromRoot) {
   if (pullFromRoot) {
-    auto srcLock = pending_.lock();
-    coll->append(&*srcLock);
+    {
+      auto srcLock = pending_.lock();
+      coll->append(&*srcLock);
+    }
+    coll->appendBatch(pending_.takeQueued());
   }
 
   if (!coll->size()) {
@@ -275,9 +774,35 @@ bool InMemoryView::processPending(
   logf(DBG, "processing {} events in {}\n", coll->size(), root_path);
 
   auto pending = coll->stealItems();
+  size_t processed = 0;
+  std::vector<PrefetchedStat> prefetched;
+  size_t prefetchPos = 0;
+  size_t windowRemaining = 0;
 
   while (pending) {
     if (!stopThreads_) {
+      const watchman_dir_ent* preStat = nullptr;
+      if (batchStat_) {
+        if (windowRemaining == 0) {
+          prefetchPos = 0;
+          windowRemaining =
+              prefetchPendingStats(root, pending.get(), prefetched);
+        }
+        --windowRemaining;
+        if (prefetchPos < prefetched.size() &&
+            prefetched[prefetchPos].item == pending.get()) {
+          preStat = &prefetched[prefetchPos++].ent;
+        }
+      }
+      auto notifiedStat = watchman_dir_ent();
+      if (pending->stat) {
+        // The watcher told us what the path looks like now; the prefetch
+        // skipped it
+        notifiedStat.has_stat = true;
+        notifiedStat.stat = *pending->stat;
+        preStat = &notifiedStat;
+      }
+
       processPath(
           root,
           view,
@@ -285,12 +810,14 @@ bool InMemoryView::processPending(
           pending->path,
           pending->now,
           pending->flags,
-          nullptr);
+          preStat);
+      ++processed;
     }
 
     pending = std::move(pending->next);
   }
 
+  pathsProcessed_ += processed;
   return true;
 }
 } // namespace watchman
@@ -0,0 +1,69 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+using namespace watchman;
+
+void watchman_root::addMetrics(MetricsWriter& metrics) {
+  MetricsWriter::Labels labels{{"root", root_path}};
+
+  int recrawlCount;
+  int recoveryCount;
+  {
+    auto info = recrawlInfo.rlock();
+    recrawlCount = info->recrawlCount;
+    recoveryCount = info->recoveryCount;
+  }
+  metrics.counter(
+      "watchman_root_recrawls_total",
+      "Full recrawls of the root",
+      recrawlCount,
+      labels);
+  metrics.counter(
+      "watchman_root_overflow_recoveries_total",
+      "Recoveries from lost notifications that avoided a full recrawl",
+      recoveryCount,
+      labels);
+
+  auto queryCache = queryResultCache.stats();
+  auto cacheLabels = labels;
+  cacheLabels.emplace_back("cache", w_string("query_result", W_STRING_UNICODE));
+  metrics.counter(
+      "watchman_root_cache_hits_total",
+      "Lookups that were answered by a cache of the root",
+      json_integer_value(queryCache.get("hits")),
+      cacheLabels);
+  metrics.counter(
+      "watchman_root_cache_misses_total",
+      "Lookups that a cache of the root had to compute",
+      json_integer_value(queryCache.get("misses")),
+      cacheLabels);
+  metrics.gauge(
+      "watchman_root_cache_bytes",
+      "The estimated bytes held by a cache of the root",
+      json_integer_value(queryCache.get("bytes")),
+      cacheLabels);
+
+  // During recrawl, the view may be re-assigned
+  if (auto v = view()) {
+    v->addMetrics(metrics, labels);
+  }
+}
+
+json_ref watchman_root::getMemoryUsage() {
+  auto v = view();
+  auto usage = v ? v->getMemoryUsage() : json_object();
+  auto queryCacheBytes =
+      json_integer_value(queryResultCache.stats().get("bytes"));
+  auto viewBytes =
+      json_integer_value(usage.get_default("total_bytes", json_integer(0)));
+  usage.set(
+      {{"root", w_string_to_json(root_path)},
+       {"query_result_cache_bytes", json_integer(queryCacheBytes)},
+       {"total_bytes", json_integer(viewBytes + queryCacheBytes)}});
+  return usage;
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -3,6 +3,7 @@
 
 #include "watchman.h"
 #include "InMemoryView.h"
+#include "Tracing.h"
 
 namespace watchman {
 
@@ -12,6 +13,7 @@ namespace watchman {
 // descriptor and then queues the filesystem IO work until after
 // we have drained the inotify descriptor
 void InMemoryView::notifyThread(const std::shared_ptr<w_root_t>& root) {
+  LockSite site("notify_thread");
   PendingCollection pending;
   auto localLock = pending.lock();
 
@@ -32,22 +34,87 @@ void InMemoryView::notifyThread(const std::shared_ptr<w_root_t>& root) {
   while (!stopThreads_) {
     // big number because not all watchers can deal with
     // -1 meaning infinite wait at the moment
-    if (watcher_->waitNotify(86400)) {
-      while (watcher_->consumeNotify(root, localLock)) {
-        if (localLock->size() >= WATCHMAN_BATCH_LIMIT) {
-          break;
-        }
-        if (!watcher_->waitNotify(0)) {
-          break;
-        }
-      }
-      if (localLock->size() > 0) {
-        auto lock = pending_.lock();
-        lock->append(&*localLock);
-        lock->ping();
-      }
+    int timeoutms = 86400;
+    if (auto deadline = notifyBatchDeadline()) {
+      timeoutms = int(std::max(
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              *deadline - std::chrono::steady_clock::now())
+              .count(),
+          int64_t(0)));
     }
+    if (watcher_->waitNotify(timeoutms)) {
+      consumeNotifyBatch(root, localLock);
+    } else if (holdingNotifyBatch_) {
+      handOffNotifyBatch(localLock);
+    }
+  }
+}
+
+void InMemoryView::consumeNotifyBatch(
+    const std::shared_ptr<w_root_t>& root,
+    PendingCollection::LockedPtr& localLock) {
+  // Odd while we're reading the batch, and while we hold on to it; see
+  // syncWithoutCookie
+  if (!holdingNotifyBatch_) {
+    notifyBatch_++;
+  }
+  TraceSpan span("consume_notify", root_path);
+  while (true) {
+    auto start = std::chrono::steady_clock::now();
+    bool consumed = watcher_->consumeNotify(root, localLock);
+    watcher_->stats.consumeMicros +=
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count();
+    if (!consumed) {
+      break;
+    }
+    if (localLock->size() >= WATCHMAN_BATCH_LIMIT) {
+      break;
+    }
+    if (!watcher_->waitNotify(0)) {
+      break;
+    }
+  }
+
+  // A change that follows a quiet spell is handed over straight away.
+  // One that follows closely on the last batch is likely part of a
+  // burst, and is held on to until the interval since that batch has
+  // passed, unless someone is waiting for a cookie in it.
+  if (notifyBatchInterval_.count() > 0 && localLock->size() > 0 &&
+      localLock->size() < WATCHMAN_BATCH_LIMIT &&
+      !localLock->hasPossibleCookie() &&
+      std::chrono::steady_clock::now() <
+          lastNotifyHandoff_ + notifyBatchInterval_) {
+    holdingNotifyBatch_ = true;
+    return;
+  }
+  handOffNotifyBatch(localLock);
+}
+
+void InMemoryView::handOffNotifyBatch(
+    PendingCollection::LockedPtr& localLock) {
+  if (localLock->size() > 0) {
+    watcherEvents_ += localLock->size();
+    auto items = localLock->stealItems();
+    if (recordingEvents_) {
+      recordEventBatch(items.get());
+    }
+    // Hand the batch to the IO thread without contending with it
+    // for the lock on pending_
+    pending_.enqueue(std::move(items));
+    lastNotifyHandoff_ = std::chrono::steady_clock::now();
+  }
+  holdingNotifyBatch_ = false;
+  notifyBatch_++;
+}
+
+folly::Optional<std::chrono::steady_clock::time_point>
+InMemoryView::notifyBatchDeadline() const {
+  if (!holdingNotifyBatch_) {
+    return folly::none;
   }
+  return lastNotifyHandoff_ + notifyBatchInterval_;
 }
 } // namespace watchman
 
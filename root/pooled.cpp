@@ -0,0 +1,125 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "InMemoryView.h"
+
+// When root_thread_pool_threads is set, the work of the notify and IO
+// threads of each root is done by tasks in a RootThreadPool, so that a
+// server with many mostly idle roots doesn't need a pair of threads for
+// each of them.  The tasks run the same steps as the threads do, and
+// each of them only ever runs on one thread at a time, so the work of a
+// root happens in the same order either way.
+
+namespace watchman {
+
+#ifndef _WIN32
+namespace {
+using Deadline = folly::Optional<RootThreadPool::Clock::time_point>;
+} // namespace
+
+bool InMemoryView::startNotifyTask(
+    const std::shared_ptr<w_root_t>& root,
+    RootThreadPool& pool) {
+  if (!watcher_->start(root)) {
+    logf(
+        ERR,
+        "failed to start root {}, cancelling watch: {}\n",
+        root->root_path,
+        root->failure_reason);
+    root->cancel();
+    return false;
+  }
+
+  auto self = std::static_pointer_cast<InMemoryView>(shared_from_this());
+  auto pending = std::make_shared<PendingCollection>();
+  notifyTask_ = pool.add(
+      folly::to<std::string>("notify ", root_path),
+      watcher_->getNotifyFd(),
+      [self, root, pending]() -> Deadline {
+        if (self->stopThreads_) {
+          return folly::none;
+        }
+        try {
+          // This also returns false once signalThreads has been called
+          auto localLock = pending->lock();
+          if (self->watcher_->waitNotify(0)) {
+            self->consumeNotifyBatch(root, localLock);
+          } else if (self->holdingNotifyBatch_) {
+            self->handOffNotifyBatch(localLock);
+          }
+        } catch (const std::exception& e) {
+          log(ERR, "Exception: ", e.what(), " cancel root\n");
+          root->cancel();
+          return folly::none;
+        }
+        // Wait for the fd of the watcher to be readable, or until a batch
+        // that is being held has to be handed over
+        if (auto deadline = self->notifyBatchDeadline()) {
+          return *deadline;
+        }
+        return RootThreadPool::Clock::time_point::max();
+      });
+  return true;
+}
+
+void InMemoryView::startIoTask(
+    const std::shared_ptr<w_root_t>& root,
+    RootThreadPool& pool) {
+  auto self = std::static_pointer_cast<InMemoryView>(shared_from_this());
+  auto state = std::make_shared<IoThreadState>();
+  ioTask_ = pool.add(
+      folly::to<std::string>("io ", root_path),
+      -1,
+      [self, root, state, started = false]() mutable -> Deadline {
+        LockSite site("io_thread");
+        try {
+          if (!started) {
+            self->startIoThread(root, *state);
+            started = true;
+          }
+          if (!self->stopThreads_) {
+            // This run may be on a different thread than the last one
+            self->markIoThreadCpuTime(*state);
+            auto localPendingLock = state->pending.lock();
+            bool keepGoing = true;
+            if (!root->inner.done_initial) {
+              // As on the IO thread, we wait for the settle period after
+              // the crawl before considering whether we're settled
+              self->fullCrawl(root, localPendingLock);
+              state->settleMs = self->getSettleTimeout(root);
+              state->timeoutms = state->settleMs;
+            } else {
+              bool pinged;
+              {
+                auto targetPendingLock = self->pending_.lock();
+                pinged = targetPendingLock->checkAndResetPinged() ||
+                    self->pending_.hasQueued();
+                localPendingLock->append(&*targetPendingLock);
+              }
+              keepGoing =
+                  self->ioThreadStep(root, *state, localPendingLock, pinged);
+            }
+            self->publishIoThreadCpuTime(*state);
+            if (keepGoing) {
+              return RootThreadPool::Clock::now() +
+                  std::chrono::milliseconds(state->timeoutms);
+            }
+          }
+          self->stopIoThread(root);
+        } catch (const std::exception& e) {
+          log(ERR, "Exception: ", e.what(), " cancel root\n");
+          root->cancel();
+        }
+        return folly::none;
+      });
+
+  // pending_ is pinged when the notify task hands it a batch, and by
+  // anything that needs the IO thread to look at the root again.  The
+  // task runs once more now, in case it was pinged before the hook was
+  // in place.
+  pending_.setWakeHook([task = ioTask_] { task->wake(); });
+  ioTask_->wake();
+}
+#endif
+} // namespace watchman
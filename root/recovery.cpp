@@ -0,0 +1,194 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include <unordered_set>
+#include "InMemoryView.h"
+
+// Recovery from a notification overflow.
+//
+// When the kernel drops notifications we don't know which of the changes
+// we missed, so the conservative response is to recrawl the whole tree.
+// On a large tree that is expensive, and every subscriber sees a fresh
+// instance.  Instead, we can rescan the places where the changes that we
+// missed could be:
+//
+// - Any dir that gained, lost or had an entry renamed over has a new
+//   mtime, so we stat every dir in the view and rescan those whose stat
+//   no longer matches the one we recorded.
+// - Files that are modified in place don't touch their dir, so we also
+//   rescan the dirs that the watcher saw activity in shortly before the
+//   overflow, as those are where an in-flight build or checkout is most
+//   likely to still be writing.
+//
+// An in-place modification of a file in a dir that was otherwise idle
+// can still go unnoticed, which is why this is opt-in.  If the scope of
+// the rescan exceeds the overflow_recovery_budget we recrawl as before.
+
+namespace watchman {
+
+namespace {
+// The most rescanned dirs that we'll name in the recovery description
+constexpr size_t kMaxReportedRecoveryDirs = 64;
+} // namespace
+
+void InMemoryView::handleOverflowRecovery(
+    const std::shared_ptr<w_root_t>& root,
+    PendingCollection::LockedPtr& pending) {
+  w_string why;
+  std::vector<w_string> activeDirs;
+  {
+    auto info = root->recrawlInfo.wlock();
+    if (!info->shouldRecover) {
+      return;
+    }
+    info->shouldRecover = false;
+    why = std::move(info->recoveryReason);
+    activeDirs = std::move(info->recoveryDirs);
+    info->recoveryDirs.clear();
+    if (info->shouldRecrawl || !root->inner.done_initial) {
+      // A crawl is going to examine everything anyway
+      return;
+    }
+  }
+
+  if (overflowRecoveryBudget_ == 0) {
+    root->scheduleRecrawl(why.c_str());
+    return;
+  }
+
+  w_perf_t sample("overflow-recovery");
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  std::vector<w_string> rescan;
+  std::unordered_set<w_string> seen;
+  auto addDir = [&](const w_string& path) {
+    if (seen.insert(path).second) {
+      rescan.push_back(path);
+    }
+  };
+  size_t examinedDirs = 0;
+  size_t changedDirs = 0;
+  size_t rescannedFiles = 0;
+  bool overBudget = false;
+
+  {
+    auto view = view_.wlock();
+
+    // The root has no file node to compare against, but it is only one
+    // dir, so we always take another look at it
+    addDir(root->root_path);
+
+    for (auto& dirName : activeDirs) {
+      if (resolveDir(view, dirName, false)) {
+        addDir(dirName);
+      }
+    }
+
+    std::vector<const watchman_dir*> stack{view->root_dir.get()};
+    while (!stack.empty() && !overBudget) {
+      auto dir = stack.back();
+      stack.pop_back();
+
+      for (auto& it : dir->dirs) {
+        auto child = it.second.get();
+        auto file = dir->getChildFile(child->name);
+        if (!child->last_check_existed || !file || !file->exists) {
+          continue;
+        }
+        auto path = child->getFullPath();
+        if (root->ignore.isIgnoreDir(path)) {
+          continue;
+        }
+
+        ++examinedDirs;
+        try {
+          auto st = getFileInformation(path.c_str(), root->case_sensitive);
+          auto saved = file->getStat();
+          if (did_file_change(&saved, &st)) {
+            ++changedDirs;
+            addDir(path);
+          }
+          stack.push_back(child);
+        } catch (const std::system_error&) {
+          // Its crawl will find that it has gone
+          ++changedDirs;
+          addDir(path);
+        }
+      }
+
+      overBudget = rescan.size() > overflowRecoveryBudget_;
+    }
+
+    if (!overBudget) {
+      for (auto& dirName : rescan) {
+        // The crawl picks up the entries that were added or removed...
+        pending->add(dirName, now, W_PENDING_CRAWL_ONLY);
+
+        // ... and statPath tells us which of the others have changed
+        auto dir = resolveDir(view, dirName, false);
+        if (!dir) {
+          continue;
+        }
+        for (auto& it : dir->files) {
+          auto file = it.second.get();
+          if (file->exists) {
+            pending->add(
+                dir->getFullPathToChild(file->getName()), now, 0);
+            ++rescannedFiles;
+          }
+        }
+      }
+    }
+  }
+
+  auto dirs = json_array();
+  for (size_t i = 0; i < rescan.size() && i < kMaxReportedRecoveryDirs; ++i) {
+    json_array_append_new(dirs, w_string_to_json(rescan[i]));
+  }
+  auto scope = json_object(
+      {{"reason", w_string_to_json(why)},
+       {"time", json_integer(now.tv_sec)},
+       {"budget", json_integer(overflowRecoveryBudget_)},
+       {"active_dirs", json_integer(activeDirs.size())},
+       {"examined_dirs", json_integer(examinedDirs)},
+       {"changed_dirs", json_integer(changedDirs)},
+       {"rescanned_dirs", json_integer(overBudget ? 0 : rescan.size())},
+       {"rescanned_files", json_integer(rescannedFiles)},
+       {"dirs", dirs},
+       {"recrawl", json_boolean(overBudget)}});
+
+  {
+    auto info = root->recrawlInfo.wlock();
+    if (!overBudget) {
+      info->recoveryCount++;
+    }
+    info->lastRecovery = scope;
+  }
+
+  sample.add_root_meta(root);
+  sample.add_meta("overflow_recovery", std::move(scope));
+  sample.finish();
+  sample.force_log();
+  sample.log();
+
+  if (overBudget) {
+    auto reason = w_string::build(
+        why,
+        " and more than ",
+        overflowRecoveryBudget_,
+        " dirs may have changed");
+    root->scheduleRecrawl(reason.c_str());
+    return;
+  }
+
+  logf(
+      ERR,
+      "recovering from {}: rescanning {} dirs and {} files\n",
+      why,
+      rescan.size(),
+      rescannedFiles);
+}
+
+} // namespace watchman
@@ -0,0 +1,165 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "InMemoryView.h"
+
+// Dir rename detection.
+//
+// statPath sees a dir that was renamed within the root as the old dir
+// disappearing and a new one appearing, in either order.  Left to itself
+// it marks the old subtree deleted and crawls the new one recursively,
+// which stats every file beneath it.
+//
+// When detect_dir_renames is set we index the dirs in the view by device
+// and inode number.  When statPath finds a new dir whose inode is that of
+// a dir that is gone from elsewhere in the view, the nodes beneath the new
+// dir are recreated from those beneath the old one, stat information and
+// all.  The old nodes are still marked deleted so that since queries
+// report the old names as gone.  Each recreated dir is then crawled
+// without recursion, which watches it under its new name and picks up any
+// difference between its listing and the nodes that we recreated, without
+// stat'ing the files that we already know about.
+//
+// A recreated dir remembers where it was renamed from, which the
+// renamed_from field reports for the files beneath it until they next
+// change.
+
+namespace watchman {
+
+w_string renamedFromPath(const watchman_file* file) {
+  const watchman_dir* dir = file->parent;
+  if (file->stat.isDir()) {
+    // The node of a dir that was renamed is reported along with the
+    // files beneath it
+    if (auto self = dir->getChildDir(file->getName())) {
+      dir = self;
+    }
+  }
+  for (; dir; dir = dir->parent) {
+    if (dir->renamed_tick == file->otime.ticks && dir->renamed_from) {
+      auto newPath = dir->getFullPath();
+      auto path = file->parent->getFullPathToChild(file->getName());
+      w_string_piece rest(path);
+      rest.advance(newPath.size());
+      return w_string::build(dir->renamed_from, rest);
+    }
+  }
+  return nullptr;
+}
+
+void InMemoryView::noteDirInode(
+    SyncView::LockedPtr& view,
+    const w_string& full_path,
+    const FileInformation& st) {
+  view->dirsByInode[DirInode{st.dev, st.ino}] = full_path;
+}
+
+bool InMemoryView::adoptRenamedDir(
+    const std::shared_ptr<w_root_t>& root,
+    SyncView::LockedPtr& view,
+    PendingCollection::LockedPtr& coll,
+    watchman_dir* parentDir,
+    const w_string& full_path,
+    const FileInformation& st,
+    struct timeval now) {
+  auto it = view->dirsByInode.find(DirInode{st.dev, st.ino});
+  if (it == view->dirsByInode.end() || it->second == full_path) {
+    return false;
+  }
+  auto oldPath = it->second;
+
+  auto oldDir = resolveDir(view, oldPath, false);
+  if (!oldDir || !oldDir->parent || oldDir->collapsed) {
+    return false;
+  }
+  auto oldFile = oldDir->parent->getChildFile(oldDir->name);
+  if (!oldFile) {
+    return false;
+  }
+  auto oldStat = oldFile->getStat();
+  if (oldStat.ino != st.ino || oldStat.dev != st.dev) {
+    // The index is stale
+    return false;
+  }
+
+  if (oldFile->exists) {
+    // We're seeing the new name before the removal of the old one
+    try {
+      auto current = getFileInformation(oldPath.c_str(), root->case_sensitive);
+      if (current.ino == st.ino && current.dev == st.dev) {
+        // It's still there too, so this is something like a bind mount
+        // rather than a rename
+        return false;
+      }
+    } catch (const std::system_error&) {
+      // It's gone, as we expected
+    }
+    markDirDeleted(view, oldDir, now, true);
+    oldFile->exists = false;
+    markFileChanged(view, oldFile, now);
+  }
+
+  logf(DBG, "{} was renamed from {}\n", full_path, oldPath);
+  auto newDir = parentDir->makeChildDir(full_path.baseName());
+  // markDirDeleted gave the nodes that it removed the same tick as the
+  // node of the dir itself, which distinguishes them from the nodes of
+  // files that were deleted before the rename
+  cloneRenamedDir(view, coll, oldDir, newDir, oldFile->otime.ticks, now);
+  newDir->renamed_from = oldPath;
+  newDir->renamed_tick = mostRecentTick_;
+  noteDirInode(view, full_path, st);
+  return true;
+}
+
+void InMemoryView::cloneRenamedDir(
+    SyncView::LockedPtr& view,
+    PendingCollection::LockedPtr& coll,
+    const watchman_dir* src,
+    watchman_dir* dst,
+    uint32_t deletedTick,
+    const struct timeval& now) {
+  dst->reserveFiles(src->files.size());
+  for (auto& it : src->files) {
+    auto file = it.second.get();
+    if (file->exists || file->otime.ticks != deletedTick) {
+      continue;
+    }
+    auto name = file->getName().asWString();
+    auto copy = getOrCreateChildFile(view, dst, name, now);
+    copy->setStat(file->getStat());
+    copy->exists = true;
+    markFileChanged(view, copy, now);
+
+    if (copy->stat.isDir()) {
+      auto srcChild = src->getChildDir(name);
+      auto dstChild = dst->makeChildDir(name);
+      noteDirInode(view, dst->getFullPathToChild(name), copy->getStat());
+      if (srcChild) {
+        cloneRenamedDir(view, coll, srcChild, dstChild, deletedTick, now);
+      } else {
+        coll->add(
+            dst->getFullPathToChild(name),
+            now,
+            W_PENDING_CRAWL_ONLY | W_PENDING_RECURSIVE);
+      }
+    }
+  }
+  // Watch it under its new name, and look for anything that we missed
+  coll->add(dst->getFullPath(), now, W_PENDING_CRAWL_ONLY);
+}
+
+void InMemoryView::pruneDirInodes(SyncView::LockedPtr& view) {
+  for (auto it = view->dirsByInode.begin(); it != view->dirsByInode.end();) {
+    auto dir = resolveDir(view, it->second, false);
+    auto file = dir && dir->parent ? dir->parent->getChildFile(dir->name)
+                                   : nullptr;
+    if (file && file->exists && file->stat.ino() == it->first.ino) {
+      ++it;
+    } else {
+      it = view->dirsByInode.erase(it);
+    }
+  }
+}
+
+} // namespace watchman
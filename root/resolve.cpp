@@ -4,6 +4,7 @@
 #include "watchman.h"
 #include "FileSystem.h"
 #include "InMemoryView.h"
+#include "RootPathCache.h"
 #include "watchman_error_category.h"
 
 using namespace watchman;
@@ -97,6 +98,56 @@ static void check_allowed_fs(const char* filename, const w_string& fs_type) {
   }
 }
 
+// Returns the root whose view serves root_str, if root_str is a shared
+// watch or can be made one because share_nested_watches is set and a
+// watched root encloses it.  Returns nullptr if it is to be watched by
+// itself.
+static std::shared_ptr<w_root_t> resolveSharedRoot(
+    const w_string& root_str,
+    bool auto_watch,
+    bool* created) {
+  w_string enclosingPath;
+  w_string relativePath;
+  if (!w_root_find_shared(root_str, enclosingPath, relativePath)) {
+    if (!auto_watch || !cfg_get_bool("share_nested_watches", false) ||
+        !w_root_share_enclosing(root_str, enclosingPath, relativePath)) {
+      return nullptr;
+    }
+    logf(
+        ERR,
+        "sharing the watch of {} with {}, which encloses it\n",
+        root_str,
+        enclosingPath);
+    w_state_save();
+  }
+
+  try {
+    // Never watch the enclosing root afresh on behalf of a dir within it,
+    // but do restore it if the server restarted
+    return root_resolve(enclosingPath.c_str(), false, created);
+  } catch (const RootResolveError&) {
+    // The enclosing root is no longer watched, so this dir has to be
+    // watched by itself
+    logf(
+        ERR,
+        "{} is no longer watched; no longer sharing its watch with {}\n",
+        enclosingPath,
+        root_str);
+    w_root_unshare(root_str);
+    w_state_save();
+    return nullptr;
+  }
+}
+
+w_string w_root_canonical_path(const char* filename) {
+  try {
+    auto& cache = getRootPathCache();
+    return cache.enabled() ? cache.resolve(filename) : realPath(filename);
+  } catch (const std::system_error&) {
+    return w_string(filename, W_STRING_BYTE);
+  }
+}
+
 std::shared_ptr<w_root_t>
 root_resolve(const char* filename, bool auto_watch, bool* created) {
   std::error_code realpath_err;
@@ -119,6 +170,21 @@ root_resolve(const char* filename, bool auto_watch, bool* created) {
     throw RootResolveError("cannot watch \"/\"");
   }
 
+  if (getRootPathCache().enabled()) {
+    // The commands that name a root have already resolved its path, so it
+    // is usually exactly the path of a watched root, which doesn't need
+    // resolving a second time
+    auto map = watched_roots.rlock();
+    const auto& it = map->find(w_string(filename, W_STRING_BYTE));
+    if (it != map->end()) {
+      root = it->second;
+    }
+  }
+  if (root) {
+    time(&root->inner.last_cmd_timestamp);
+    return root;
+  }
+
   w_string root_str;
 
   try {
@@ -164,6 +230,18 @@ root_resolve(const char* filename, bool auto_watch, bool* created) {
         "realpath(", filename, ") -> ", realpath_err.message());
   }
 
+  if (!root) {
+    if (auto shared = resolveSharedRoot(root_str, auto_watch, created)) {
+      return shared;
+    }
+  }
+
+  if (!root && w_root_claim_pending_restore(root_str)) {
+    // It was watched before the server restarted, and hasn't been restored
+    // yet; the first client to use it restores it
+    auto_watch = true;
+  }
+
   if (root || !auto_watch) {
     if (!root) {
       throw RootResolveError("directory ", root_str, " is not watched");
@@ -0,0 +1,488 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include <folly/FileUtil.h>
+#include <folly/system/MemoryMapping.h>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include "InMemoryView.h"
+
+// Persistent snapshots of the InMemoryView.
+//
+// A snapshot records the dir tree together with the stat information,
+// existence and ticks of each file, so that a restarted server can
+// resume from the state that a prior incarnation observed rather than
+// starting over with a fresh instance.
+//
+// The layout is a simple sequence of fixed width fields in native byte
+// order; a byte order mark in the header rejects snapshots that were
+// written on a foreign system.
+//
+//   header:  magic, version, byte order mark, root path, case
+//            sensitivity, root inode, clock lineage, age out tick and
+//            timestamp, time of writing, watcher resume position
+//   dir:     last_check_existed, file count, files..., dir count,
+//            { name, dir }...
+//   file:    name, flags, otime, ctime, stat
+//   trailer: end marker
+//
+// Strings are a uint32_t length followed by the bytes of the string.
+
+namespace watchman {
+
+namespace {
+constexpr char kSnapshotMagic[8] = {'W', 'M', 'V', 'S', 'N', 'A', 'P', 0};
+constexpr uint32_t kSnapshotVersion = 3;
+constexpr uint32_t kByteOrderMark = 0x01020304;
+constexpr uint32_t kEndMarker = 0x21444e45;
+
+constexpr uint8_t kFileExists = 1;
+constexpr uint8_t kFileInJournal = 2;
+
+// Allows for filesystems with coarse timestamps
+constexpr time_t kSnapshotSlopSeconds = 2;
+
+class SnapshotWriter {
+ public:
+  template <typename T>
+  void put(T value) {
+    static_assert(std::is_trivially_copyable<T>::value, "must be POD");
+    buf_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  void putString(w_string_piece str) {
+    put(uint32_t(str.size()));
+    buf_.append(str.data(), str.size());
+  }
+
+  void putTimespec(const struct timespec& ts) {
+    put(int64_t(ts.tv_sec));
+    put(int64_t(ts.tv_nsec));
+  }
+
+  void putClock(const w_clock_t& clock) {
+    put(int64_t(clock.timestamp));
+    put(clock.ticks);
+  }
+
+  void putStat(const FileInformation& st) {
+    put(uint32_t(st.mode));
+    put(int64_t(st.size));
+    put(uint32_t(st.uid));
+    put(uint32_t(st.gid));
+    put(uint64_t(st.ino));
+    put(uint64_t(st.dev));
+    put(uint64_t(st.nlink));
+#ifdef _WIN32
+    put(st.fileAttributes);
+#endif
+    putTimespec(st.atime);
+    putTimespec(st.mtime);
+    putTimespec(st.ctime);
+  }
+
+  const std::string& data() const {
+    return buf_;
+  }
+
+ private:
+  std::string buf_;
+};
+
+class SnapshotReader {
+ public:
+  explicit SnapshotReader(folly::ByteRange data)
+      : cur_(data.begin()), end_(data.end()) {}
+
+  template <typename T>
+  T get() {
+    static_assert(std::is_trivially_copyable<T>::value, "must be POD");
+    need(sizeof(T));
+    T value;
+    memcpy(&value, cur_, sizeof(T));
+    cur_ += sizeof(T);
+    return value;
+  }
+
+  w_string_piece getString() {
+    auto len = get<uint32_t>();
+    need(len);
+    w_string_piece str(reinterpret_cast<const char*>(cur_), len);
+    cur_ += len;
+    return str;
+  }
+
+  struct timespec getTimespec() {
+    struct timespec ts;
+    ts.tv_sec = time_t(get<int64_t>());
+    ts.tv_nsec = long(get<int64_t>());
+    return ts;
+  }
+
+  w_clock_t getClock() {
+    w_clock_t clock;
+    clock.timestamp = time_t(get<int64_t>());
+    clock.ticks = get<uint32_t>();
+    return clock;
+  }
+
+  FileInformation getStat() {
+    FileInformation st;
+    st.mode = mode_t(get<uint32_t>());
+    st.size = off_t(get<int64_t>());
+    st.uid = uid_t(get<uint32_t>());
+    st.gid = gid_t(get<uint32_t>());
+    st.ino = ino_t(get<uint64_t>());
+    st.dev = dev_t(get<uint64_t>());
+    st.nlink = nlink_t(get<uint64_t>());
+#ifdef _WIN32
+    st.fileAttributes = get<uint32_t>();
+#endif
+    st.atime = getTimespec();
+    st.mtime = getTimespec();
+    st.ctime = getTimespec();
+    return st;
+  }
+
+  bool atEnd() const {
+    return cur_ == end_;
+  }
+
+ private:
+  void need(size_t len) {
+    if (size_t(end_ - cur_) < len) {
+      throw std::runtime_error("snapshot is truncated");
+    }
+  }
+
+  const uint8_t* cur_;
+  const uint8_t* end_;
+};
+
+struct SnapshotHeader {
+  ino_t rootInode;
+  ClockLineage lineage;
+  uint32_t lastAgeOutTick;
+  time_t lastAgeOutTimestamp;
+  time_t savedAt;
+  w_string_piece resumePosition;
+};
+
+// Reads and checks the header; throws if the snapshot can't be used for
+// root
+SnapshotHeader readHeader(
+    SnapshotReader& reader,
+    const std::shared_ptr<w_root_t>& root) {
+  for (auto c : kSnapshotMagic) {
+    if (reader.get<char>() != c) {
+      throw std::runtime_error("not a view snapshot");
+    }
+  }
+  if (reader.get<uint32_t>() != kSnapshotVersion) {
+    throw std::runtime_error("unsupported snapshot version");
+  }
+  if (reader.get<uint32_t>() != kByteOrderMark) {
+    throw std::runtime_error("snapshot has a foreign byte order");
+  }
+  if (reader.getString() != w_string_piece(root->root_path)) {
+    throw std::runtime_error("snapshot is for a different root");
+  }
+  if (bool(reader.get<uint8_t>()) !=
+      (root->case_sensitive == CaseSensitivity::CaseSensitive)) {
+    throw std::runtime_error("snapshot case sensitivity doesn't match");
+  }
+  SnapshotHeader header;
+  header.rootInode = ino_t(reader.get<uint64_t>());
+  if (getFileInformation(root->root_path.c_str(), root->case_sensitive).ino !=
+      header.rootInode) {
+    throw std::runtime_error("root has been replaced since the snapshot");
+  }
+
+  header.lineage.startTime = reader.get<uint64_t>();
+  header.lineage.pid = reader.get<int32_t>();
+  header.lineage.rootNumber = reader.get<uint32_t>();
+  header.lineage.ticks = reader.get<uint32_t>();
+  header.lastAgeOutTick = reader.get<uint32_t>();
+  header.lastAgeOutTimestamp = time_t(reader.get<int64_t>());
+  header.savedAt = time_t(reader.get<int64_t>());
+  header.resumePosition = reader.getString();
+  return header;
+}
+
+void writeDir(SnapshotWriter& writer, const watchman_dir* dir) {
+  writer.put(uint8_t(dir->last_check_existed));
+
+  writer.put(uint32_t(dir->files.size()));
+  for (auto& it : dir->files) {
+    auto file = it.second.get();
+    writer.putString(file->getName());
+    writer.put(uint8_t(
+        (file->exists ? kFileExists : 0) |
+        (file->journal_entry ? kFileInJournal : 0)));
+    writer.putClock(file->otime);
+    writer.putClock(file->ctime);
+    writer.putStat(file->getStat());
+  }
+
+  writer.put(uint32_t(dir->dirs.size()));
+  for (auto& it : dir->dirs) {
+    auto child = it.second.get();
+    writer.putString(child->name);
+    writeDir(writer, child);
+  }
+}
+} // namespace
+
+w_string InMemoryView::getSnapshotPath() const {
+  auto stateDir = w_string_piece(watchman_state_file).dirName();
+  // The root path is also recorded in the snapshot, so a collision
+  // will simply cause the snapshot to be rejected
+  return w_string::format(
+      "{}/view-{:08x}.snapshot",
+      stateDir,
+      w_string_piece(root_path).hashValue());
+}
+
+void InMemoryView::saveSnapshot(const std::shared_ptr<w_root_t>& root) {
+  w_perf_t sample("save_snapshot");
+  SnapshotWriter writer;
+  ClockLineage lineage;
+
+  // Read before we check that the view holds everything that the watcher
+  // has passed on, so that the position can't run ahead of the view
+  auto resumePosition = watcher_->getResumePosition();
+  if (resumePosition &&
+      ((notifyBatch_.load() & 1) ||
+       *processedBatch_.lock() < enqueuedNotifyBatch())) {
+    // Some changes are still on their way to the view
+    resumePosition = nullptr;
+  }
+
+  {
+    auto view = view_.rlock();
+    if (!root->inner.done_initial || !view->collapsedDirs.empty()) {
+      // The view is incomplete; it isn't worth saving
+      return;
+    }
+    lineage = ClockLineage::forPosition(getMostRecentRootNumberAndTickValue());
+
+    for (auto c : kSnapshotMagic) {
+      writer.put(c);
+    }
+    writer.put(kSnapshotVersion);
+    writer.put(kByteOrderMark);
+    writer.putString(root_path);
+    writer.put(uint8_t(root->case_sensitive == CaseSensitivity::CaseSensitive));
+    writer.put(uint64_t(view->rootInode));
+    writer.put(lineage.startTime);
+    writer.put(int32_t(lineage.pid));
+    writer.put(lineage.rootNumber);
+    writer.put(lineage.ticks);
+    writer.put(last_age_out_tick);
+    writer.put(int64_t(last_age_out_timestamp));
+    writer.put(int64_t(time(nullptr)));
+    writer.putString(resumePosition ? w_string_piece(resumePosition) : "");
+
+    writeDir(writer, view->root_dir.get());
+  }
+  writer.put(kEndMarker);
+
+  auto path = getSnapshotPath();
+  try {
+    folly::writeFileAtomic(path.c_str(), writer.data(), 0600);
+  } catch (const std::exception& exc) {
+    log(ERR, "failed to write view snapshot ", path, ": ", exc.what(), "\n");
+    return;
+  }
+  lastSnapshotTick_ = lineage.ticks;
+  lastSnapshotTime_ = std::chrono::steady_clock::now();
+
+  sample.add_root_meta(root);
+  sample.add_meta(
+      "save_snapshot",
+      json_object(
+          {{"path", w_string_to_json(path)},
+           {"bytes", json_integer(writer.data().size())},
+           {"ticks", json_integer(lineage.ticks)}}));
+  sample.finish();
+  sample.log();
+}
+
+void InMemoryView::removeSnapshot() {
+  auto path = getSnapshotPath();
+  unlink(path.c_str());
+}
+
+void InMemoryView::maybeSaveSnapshot(const std::shared_ptr<w_root_t>& root) {
+  if (!enableSnapshot_ || mostRecentTick_ == lastSnapshotTick_ ||
+      std::chrono::steady_clock::now() - lastSnapshotTime_ <
+          snapshotInterval_) {
+    return;
+  }
+  saveSnapshot(root);
+}
+
+bool InMemoryView::loadSnapshot(const std::shared_ptr<w_root_t>& root) {
+  auto path = getSnapshotPath();
+  w_perf_t sample("load_snapshot");
+
+  std::unique_ptr<folly::MemoryMapping> mapping;
+  try {
+    mapping = std::make_unique<folly::MemoryMapping>(path.c_str());
+  } catch (const std::exception& exc) {
+    log(DBG, "no view snapshot at ", path, ": ", exc.what(), "\n");
+    return false;
+  }
+
+  auto data = mapping->range();
+  if (data.size() < sizeof(kEndMarker) ||
+      memcmp(
+          data.end() - sizeof(kEndMarker),
+          &kEndMarker,
+          sizeof(kEndMarker)) != 0) {
+    log(ERR, "ignoring incomplete view snapshot ", path, "\n");
+    return false;
+  }
+
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  auto view = view_.wlock();
+  size_t num_files = 0;
+  size_t num_dirs = 0;
+  ClockLineage lineage;
+
+  try {
+    SnapshotReader reader(data);
+
+    auto header = readHeader(reader, root);
+    lineage = header.lineage;
+
+    // Files are added to the journal in the order in which they changed,
+    // which isn't the order in which we encounter them in the tree
+    std::vector<watchman_file*> journaled;
+
+    // Recursively populate dir from the reader
+    std::function<void(watchman_dir*)> readDir = [&](watchman_dir* dir) {
+      dir->last_check_existed = reader.get<uint8_t>();
+
+      auto nfiles = reader.get<uint32_t>();
+      dir->reserveFiles(nfiles);
+      for (uint32_t i = 0; i < nfiles; ++i) {
+        auto name = reader.getString();
+        auto flags = reader.get<uint8_t>();
+        auto file = getOrCreateChildFile(
+            view, dir, w_string(name.data(), name.size()), now);
+        file->exists = flags & kFileExists;
+        file->otime = reader.getClock();
+        dir->markSubtreeChanged(file->otime);
+        file->ctime = reader.getClock();
+        file->setStat(reader.getStat());
+        if (flags & kFileInJournal) {
+          journaled.push_back(file);
+        }
+        ++num_files;
+      }
+
+      auto ndirs = reader.get<uint32_t>();
+      dir->reserveDirs(ndirs);
+      for (uint32_t i = 0; i < ndirs; ++i) {
+        auto name = reader.getString();
+        auto child = dir->makeChildDir(w_string(name.data(), name.size()));
+        readDir(child);
+        ++num_dirs;
+      }
+    };
+    readDir(view->root_dir.get());
+
+    if (reader.get<uint32_t>() != kEndMarker || !reader.atEnd()) {
+      throw std::runtime_error("snapshot has trailing garbage");
+    }
+
+    std::stable_sort(
+        journaled.begin(),
+        journaled.end(),
+        [](const watchman_file* a, const watchman_file* b) {
+          return a->otime.ticks < b->otime.ticks;
+        });
+    for (auto file : journaled) {
+      view->journal.append(file, file->otime.ticks);
+    }
+
+    view->rootInode = header.rootInode;
+    view->priorClockLineage = lineage;
+    mostRecentTick_ = std::max(mostRecentTick_.load(), lineage.ticks);
+    last_age_out_tick = header.lastAgeOutTick;
+    last_age_out_timestamp = header.lastAgeOutTimestamp;
+    snapshotSavedAt_ = header.savedAt;
+  } catch (const std::exception& exc) {
+    log(ERR, "ignoring view snapshot ", path, ": ", exc.what(), "\n");
+    // Discard anything that we populated before we hit the problem.
+    // The files unlink themselves from the suffix and basename lists as
+    // they are destroyed, so the tree must go first.
+    view->root_dir = watchman_dir::make(arena_, root_path, nullptr);
+    view->suffixes.clear();
+    view->basenames.clear();
+    view->rootInode = 0;
+    return false;
+  }
+
+  log(ERR,
+      "restored ",
+      num_files,
+      " files and ",
+      num_dirs,
+      " dirs from view snapshot ",
+      path,
+      "\n");
+
+  sample.add_root_meta(root);
+  sample.add_meta(
+      "load_snapshot",
+      json_object(
+          {{"path", w_string_to_json(path)},
+           {"bytes", json_integer(data.size())},
+           {"files", json_integer(num_files)},
+           {"dirs", json_integer(num_dirs)},
+           {"ticks", json_integer(lineage.ticks)}}));
+  sample.finish();
+  sample.force_log();
+  sample.log();
+  return true;
+}
+
+w_string InMemoryView::readSnapshotResumePosition(
+    const std::shared_ptr<w_root_t>& root) const {
+  auto path = getSnapshotPath();
+  try {
+    folly::MemoryMapping mapping(path.c_str());
+    SnapshotReader reader(mapping.range());
+    auto position = readHeader(reader, root).resumePosition;
+    if (position.empty()) {
+      return nullptr;
+    }
+    return w_string(position.data(), position.size());
+  } catch (const std::exception&) {
+    // loadSnapshot reports the problem
+    return nullptr;
+  }
+}
+
+bool InMemoryView::isUnchangedSinceSnapshot(const FileInformation& info) const {
+  if (!validatingSnapshot_) {
+    return false;
+  }
+  // The stat of the dir was recorded at some point before the snapshot
+  // was written, and a change made in the same timestamp granule as that
+  // wouldn't show up in it, so only trust dirs that had settled well
+  // before then
+  auto changed = std::max(info.mtime.tv_sec, info.ctime.tv_sec);
+  return changed + kSnapshotSlopSeconds < snapshotSavedAt_;
+}
+
+} // namespace watchman
+
+/* vim:ts=2:sw=2:et:
+ */
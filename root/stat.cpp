@@ -51,6 +51,52 @@ bool InMemoryView::propagateToParentDirIfAppropriate(
   return false;
 }
 
+bool InMemoryView::verifyContentChange(
+    const w_string& full_path,
+    const FileInformation& saved,
+    const FileInformation& st,
+    struct timeval now) {
+  if (full_path.size() <= root_path.size()) {
+    return false;
+  }
+  w_string_piece relativePath(full_path);
+  relativePath.advance(root_path.size() + 1);
+  auto path = caches_.paths.intern(relativePath);
+
+  auto prior = caches_.contentHashCache.peek(ContentHashCacheKey{
+      path, size_t(saved.size), saved.mtime, uint64_t(saved.ino)});
+  if (!prior) {
+    // Without the prior hash, there's nothing to compare against
+    return false;
+  }
+
+  // The callback may run on this thread if the hash is already cached.
+  // That's fine: we hold the view lock and a local pending collection,
+  // but not pending_.
+  auto self = std::static_pointer_cast<InMemoryView>(shared_from_this());
+  caches_.contentHashCache
+      .get(ContentHashCacheKey{
+          path, size_t(st.size), st.mtime, uint64_t(st.ino)})
+      .thenTry([self, prior, full_path, now](
+                   folly::Try<std::shared_ptr<const ContentHashCache::Node>>&&
+                       result) {
+        if (result.hasValue() && result.value()->result().hasValue() &&
+            result.value()->value() == prior->value()) {
+          ++self->contentChangesSuppressed_;
+          return;
+        }
+        // It changed, or we couldn't tell; report it in the usual way
+        ++self->contentChangesConfirmed_;
+        if (self->stopThreads_) {
+          return;
+        }
+        auto pending = self->pending_.lock();
+        pending->add(full_path, now, W_PENDING_VIA_NOTIFY);
+        pending->ping();
+      });
+  return true;
+}
+
 void InMemoryView::statPath(
     const std::shared_ptr<w_root_t>& root,
     SyncView::LockedPtr& view,
@@ -87,6 +133,10 @@ void InMemoryView::statPath(
 
   if (pre_stat && pre_stat->has_stat) {
     st = pre_stat->stat;
+  } else if (flags & W_PENDING_REMOVED) {
+    // The watcher told us that it's gone
+    logf(DBG, "{} was removed, not stat'ing it\n", path);
+    errcode = std::make_error_code(std::errc::no_such_file_or_directory);
   } else {
     try {
       st = getFileInformation(path, root->case_sensitive);
@@ -161,7 +211,7 @@ void InMemoryView::statPath(
             root,
             coll,
             now,
-            file->stat,
+            file->getStat(),
             dir_name,
             parentDir,
             /* isUnlink= */ true) &&
@@ -192,6 +242,11 @@ void InMemoryView::statPath(
         errcode.category().name(),
         "\n");
   } else {
+    if (st.isDir() && root->ignore.isOutsideIncludes(full_path, true)) {
+      logf(DBG, "{} is outside of watch_includes\n", full_path);
+      return;
+    }
+
     if (!file) {
       file = getOrCreateChildFile(view, parentDir, file_name, now);
     }
@@ -205,7 +260,25 @@ void InMemoryView::statPath(
        * to crawl it again */
       recursive = true;
     }
-    if (!file->exists || via_notify || did_file_change(&file->stat, &st)) {
+    bool changed = false;
+    bool wasMissing = !file->exists;
+    auto saved = file->getStat();
+
+    if (suppressUnchangedContent_ && file->exists && saved.isFile() &&
+        st.isFile() && saved.size == st.size &&
+        did_file_change(&saved, &st) &&
+        verifyContentChange(full_path, saved, st, now)) {
+      // Most likely it was touched, or rewritten with the same content.
+      // Keep the stat up to date, but don't report it as changed unless
+      // the re-hash finds that the content differs.
+      logf(DBG, "deferring change to {} until it is re-hashed\n", path);
+      file->setStat(st);
+      propagateToParentDirIfAppropriate(
+          root, coll, now, st, dir_name, parentDir, /* isUnlink= */ false);
+      return;
+    }
+
+    if (!file->exists || via_notify || did_file_change(&saved, &st)) {
       logf(
           DBG,
           "file changed exists={} via_notify={} stat-changed={} isdir={} {}\n",
@@ -216,17 +289,26 @@ void InMemoryView::statPath(
           path);
       file->exists = true;
       markFileChanged(view, file, now);
+      changed = true;
 
       // If the inode number changed then we definitely need to recursively
       // examine any children because we cannot assume that the kernel will
       // have given us the correct hints about this change.  BTRFS is one
       // example of a filesystem where this has been observed to happen.
-      if (file->stat.ino != st.ino) {
+      if (saved.ino != st.ino) {
         recursive = true;
       }
     }
 
-    memcpy(&file->stat, &st, sizeof(file->stat));
+    file->setStat(st);
+
+    if (changed && st.isSymlink() && enableSymlinkTargetWarming_ &&
+        full_path.size() > root_path.size()) {
+      w_string_piece relativePath(full_path);
+      relativePath.advance(root_path.size() + 1);
+      symlinksToWarm_.push_back(SymlinkTargetCacheKey{
+          caches_.paths.intern(relativePath), file->otime});
+    }
 
     // check for symbolic link
     if (st.isSymlink() && root->config.getBool("watch_symlinks", false)) {
@@ -234,12 +316,18 @@ void InMemoryView::statPath(
     }
 
     if (st.isDir()) {
+      bool adopted = false;
       if (dir_ent == NULL) {
         recursive = true;
+        adopted = detectDirRenames_ &&
+            adoptRenamedDir(root, view, coll, parentDir, full_path, st, now);
       } else {
         // Ensure that we believe that this node exists
         dir_ent->last_check_existed = true;
       }
+      if (detectDirRenames_ && (wasMissing || saved.ino != st.ino)) {
+        noteDirInode(view, full_path, st);
+      }
 
       // Don't recurse if our parent is an ignore dir
       if (!root->ignore.isIgnoreVCS(dir_name) ||
@@ -251,14 +339,15 @@ void InMemoryView::statPath(
           coll->add(
               full_path,
               now,
-              W_PENDING_CRAWL_ONLY | (recursive ? W_PENDING_RECURSIVE : 0));
+              W_PENDING_CRAWL_ONLY |
+                  (recursive && !adopted ? W_PENDING_RECURSIVE : 0));
         } else {
           /* we get told about changes on the child, so we only
            * need to crawl if we've never seen the dir before.
            * An exception is that fsevents will only report the root
            * of a dir rename and not a rename event for all of its
            * children. */
-          if (recursive) {
+          if (recursive && !adopted) {
             coll->add(
                 full_path, now, W_PENDING_RECURSIVE | W_PENDING_CRAWL_ONLY);
           }
@@ -3,14 +3,23 @@
 
 #include "watchman.h"
 #include "InMemoryView.h"
+#include "Tracing.h"
 #include "watchman_error_category.h"
 
 using namespace watchman;
 using folly::to;
 
+folly::Future<folly::Unit> watchman_root::syncToNowAsync(
+    std::chrono::milliseconds timeout) {
+  auto root = shared_from_this();
+  return view()->syncToNowAsync(root, timeout);
+}
+
 void watchman_root::syncToNow(std::chrono::milliseconds timeout) {
   w_perf_t sample("sync_to_now");
   auto root = shared_from_this();
+  sample.set_root(root);
+  TraceSpan span("sync_to_now", root_path, true);
   try {
     view()->syncToNow(root, timeout);
     if (sample.finish()) {
@@ -49,7 +58,9 @@ void watchman::InMemoryView::syncToNow(
     const std::shared_ptr<w_root_t>& root,
     std::chrono::milliseconds timeout) {
   try {
-    cookies_.syncToNow(timeout);
+    if (!syncWithoutCookie(root, timeout)) {
+      cookies_.syncToNow(timeout);
+    }
   } catch (const std::system_error& exc) {
     if (exc.code() == watchman::error_code::no_such_file_or_directory ||
         exc.code() == watchman::error_code::permission_denied ||
@@ -106,5 +117,109 @@ void watchman::InMemoryView::syncToNow(
   }
 }
 
+/* If the watcher has no notifications left to read, then every change made
+ * before now is in a batch that the notify thread has read, and we only
+ * need to wait for the IO thread to process that batch, rather than for a
+ * cookie to make the round trip through the watcher.
+ * Returns false if that can't be shown, in which case the caller needs to
+ * use a cookie.  Throws a std::system_error with an ETIMEDOUT error if the
+ * timeout expires before the IO thread catches up. */
+bool watchman::InMemoryView::syncWithoutCookie(
+    const std::shared_ptr<w_root_t>& root,
+    std::chrono::milliseconds timeout) {
+  if (!canSyncWithoutCookie(root)) {
+    return false;
+  }
+  // This must be read after the watcher was found to be drained.  If a
+  // batch is being read now, it may hold changes that were made before
+  // the call, so we need that batch to have been processed too.
+  auto batch = notifyBatch_.load();
+  auto target = batch + (batch & 1);
+
+  auto processed = processedBatch_.lock();
+  if (!processedBatchCond_.wait_for(
+          processed.getUniqueLock(), timeout, [&] {
+            return *processed >= target;
+          })) {
+    throw std::system_error(
+        ETIMEDOUT,
+        std::generic_category(),
+        "syncToNow: timed out waiting for the IO thread to process the "
+        "pending notifications");
+  }
+  return true;
+}
+
+bool watchman::InMemoryView::canSyncWithoutCookie(
+    const std::shared_ptr<w_root_t>& root) const {
+  return enableCookieFreeSync_ && root->inner.done_initial &&
+      !root->recrawlInfo.rlock()->shouldRecrawl && watcher_->isDrained();
+}
+
+namespace {
+// Waits for a cookie to be observed, writing another if a recrawl aborts
+// the one that was written.  The callbacks run on the shared thread pool,
+// rather than on the IO thread that observes the cookie.
+folly::Future<folly::Unit> syncCookie(
+    CookieSync& cookies,
+    std::shared_ptr<w_root_t> root) {
+  return folly::makeFutureWith([&] { return cookies.sync(); })
+      .via(&getThreadPool())
+      .thenError(
+          folly::tag_t<CookieSyncAborted>{},
+          [&cookies, root](const CookieSyncAborted&) {
+            return syncCookie(cookies, root);
+          });
+}
+} // namespace
+
+/* As syncToNow, except that nothing is held up while the crawl finishes
+ * and the cookie makes its way through the watcher.  The cases that
+ * syncToNow handles specially, such as the cookie dir being removed, are
+ * left to it, on a thread of the shared pool. */
+folly::Future<folly::Unit> watchman::InMemoryView::syncToNowAsync(
+    const std::shared_ptr<w_root_t>& root,
+    std::chrono::milliseconds timeout) {
+  using namespace std::chrono;
+  auto deadline = steady_clock::now() + timeout;
+  auto remaining = [deadline] {
+    return std::max(
+        duration_cast<milliseconds>(deadline - steady_clock::now()),
+        milliseconds(1));
+  };
+  return readyToQuery(root)
+      .via(&getThreadPool())
+      .thenValue([this, root, remaining](folly::Unit) {
+        if (canSyncWithoutCookie(root)) {
+          // The IO thread only has the batch that it holds left to do
+          syncToNow(root, remaining());
+          return folly::makeFuture();
+        }
+        return syncCookie(cookies_, root);
+      })
+      .thenError(
+          folly::tag_t<std::system_error>{},
+          [this, root, remaining](const std::system_error& exc) {
+            if (exc.code() == watchman::error_code::timed_out) {
+              throw exc;
+            }
+            syncToNow(root, remaining());
+          })
+      .within(timeout)
+      .thenError(
+          folly::tag_t<folly::FutureTimeout>{},
+          [root, timeout](const folly::FutureTimeout&) {
+            auto why = to<std::string>(
+                "syncToNow: timed out waiting for cookie file to be "
+                "observed by watcher within ",
+                timeout.count(),
+                " milliseconds");
+            if (!root->inner.done_initial) {
+              why += ". (performing initial crawl)";
+            }
+            throw std::system_error(ETIMEDOUT, std::generic_category(), why);
+          });
+}
+
 /* vim:ts=2:sw=2:et:
  */
@@ -11,7 +11,9 @@ std::shared_ptr<watchman::QueryableView> watchman_root::view() {
   return inner.view_;
 }
 
-void watchman_root::scheduleRecrawl(const char* why) {
+using std::chrono::milliseconds;
+
+void watchman_root::scheduleRecrawl(const char* why, bool backoff) {
   {
     auto info = recrawlInfo.wlock();
 
@@ -29,12 +31,118 @@ void watchman_root::scheduleRecrawl(const char* why) {
 
       watchman::log(
           watchman::ERR, root_path, ": ", why, ": scheduling a tree recrawl\n");
+
+      info->recrawlReason = w_string(why, W_STRING_UNICODE);
+      auto delay = info->backoff.recrawlScheduled(
+          std::chrono::steady_clock::now(), backoff);
+      if (delay.count() > 0) {
+        watchman::log(
+            watchman::ERR,
+            root_path,
+            ": recrawled ",
+            info->backoff.streak(),
+            " times in quick succession; waiting ",
+            delay.count(),
+            "ms before the next recrawl\n");
+      }
     }
     info->shouldRecrawl = true;
   }
   view()->wakeThreads();
 }
 
+void watchman_root::scheduleSubtreeRecrawl(
+    const w_string& dir,
+    const w_string& why) {
+  auto delay = recrawlInfo.wlock()->backoff.subtreeFailed(
+      dir, why, std::chrono::steady_clock::now());
+  watchman::log(
+      watchman::ERR,
+      root_path,
+      ": will crawl ",
+      dir,
+      " again in ",
+      delay.count(),
+      "ms\n");
+  // This is called by the IO thread as it crawls, and it works out how
+  // long to sleep for from the errors once it is done, so there is no
+  // need to wake it
+}
+
+json_ref watchman_root::getRecrawlInfo() {
+  auto info = recrawlInfo.rlock();
+  auto now = std::chrono::steady_clock::now();
+  auto remainingMs = [&](std::chrono::steady_clock::time_point when) {
+    return json_integer(
+        when > now
+            ? std::chrono::duration_cast<milliseconds>(when - now).count()
+            : 0);
+  };
+
+  auto history = json_array();
+  for (auto& entry : info->recrawlHistory) {
+    json_array_append(history, entry);
+  }
+  auto subtrees = json_object();
+  for (auto& it : info->backoff.subtreeErrors()) {
+    subtrees.set(
+        it.first,
+        json_object(
+            {{"reason", w_string_to_json(it.second.reason)},
+             {"count", json_integer(it.second.count)},
+             {"retry_in_ms", remainingMs(it.second.retryAt)}}));
+  }
+
+  auto result = json_object(
+      {{"count", json_integer(info->recrawlCount)},
+       {"pending", json_boolean(info->shouldRecrawl && inner.done_initial)},
+       {"streak", json_integer(info->backoff.streak())},
+       {"total_seconds", json_real(info->recrawlSeconds)},
+       {"history", history},
+       {"subtree_errors", subtrees}});
+  auto& notBefore = info->backoff.recrawlNotBefore();
+  if (info->shouldRecrawl && notBefore) {
+    result.set("next_in_ms", remainingMs(*notBefore));
+  }
+  return result;
+}
+
+void watchman_root::scheduleOverflowRecovery(
+    const char* why,
+    std::vector<w_string> activeDirs) {
+  {
+    auto info = recrawlInfo.wlock();
+
+    if (info->shouldRecrawl) {
+      // The recrawl will cover it
+      return;
+    }
+    if (!info->shouldRecover) {
+      watchman::log(
+          watchman::ERR,
+          root_path,
+          ": ",
+          why,
+          ": scheduling recovery of the recently changed dirs\n");
+      info->recoveryReason = w_string(why, W_STRING_UNICODE);
+    }
+    info->shouldRecover = true;
+    info->recoveryDirs.insert(
+        info->recoveryDirs.end(),
+        std::make_move_iterator(activeDirs.begin()),
+        std::make_move_iterator(activeDirs.end()));
+  }
+  view()->wakeThreads();
+}
+
+json_ref watchman_root::getOverflowRecoveryInfo() {
+  auto info = recrawlInfo.rlock();
+  return json_object(
+      {{"count", json_integer(info->recoveryCount)},
+       {"pending", json_boolean(info->shouldRecover)},
+       {"last", info->lastRecovery ? info->lastRecovery : json_null()}});
+}
+
 void watchman_root::signalThreads() {
   view()->signalThreads();
 }
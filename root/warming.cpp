@@ -0,0 +1,377 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include <folly/ScopeGuard.h>
+#include <folly/String.h>
+#include <algorithm>
+#include <thread>
+#include "InMemoryView.h"
+#ifdef __APPLE__
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Content hash cache warming.
+//
+// When the view settles, the IO thread collects the files that have
+// changed since the cache was last warmed and hands them to a dedicated
+// warming thread.  Files that are matched by the expression of an active
+// subscription are likely to have their hashes requested soon, so they
+// are warmed before the others.
+//
+// Warming is speculative, so it shouldn't compete with the workload that
+// made the changes:
+//
+// - The warming thread asks the kernel to give its I/O the lowest
+//   priority, and its reads can be limited to a configured rate.
+// - If the view changes again before the queue is drained, the rest of
+//   the queue is abandoned; a build or checkout is probably still writing
+//   those files.  The next settle collects them again, together with the
+//   files that have changed since.
+
+namespace watchman {
+
+namespace {
+
+// Asks the system to service the I/O of the calling thread only when
+// the disk is otherwise idle
+void lowerIoPriority() {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  // These are from linux/ioprio.h, which isn't always installed
+  constexpr int kIoprioWhoProcess = 1;
+  constexpr int kIoprioClassIdle = 3;
+  constexpr int kIoprioClassShift = 13;
+  // With IOPRIO_WHO_PROCESS, 0 means the calling thread
+  if (syscall(
+          SYS_ioprio_set,
+          kIoprioWhoProcess,
+          0,
+          kIoprioClassIdle << kIoprioClassShift) != 0) {
+    logf(DBG, "ioprio_set failed: {}\n", folly::errnoStr(errno));
+  }
+#elif defined(__APPLE__)
+  if (setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE) !=
+      0) {
+    logf(DBG, "setiopolicy_np failed: {}\n", folly::errnoStr(errno));
+  }
+#elif defined(_WIN32)
+  SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#endif
+}
+
+// Returns the queries of the subscriptions to root
+std::vector<std::shared_ptr<w_query>> getSubscriptionQueries(
+    const std::shared_ptr<w_root_t>& root) {
+  std::vector<std::shared_ptr<w_query>> queries;
+  for (const auto& c : *::clients.rlock()) {
+    auto* user_client = dynamic_cast<watchman_user_client*>(c.get());
+    if (!user_client) {
+      continue;
+    }
+    for (const auto& sub : user_client->subscriptions) {
+      if (sub.second->root == root && sub.second->query) {
+        queries.push_back(sub.second->query);
+      }
+    }
+  }
+  return queries;
+}
+
+} // namespace
+
+void InMemoryView::warmContentCache(const std::shared_ptr<w_root_t>& root) {
+  if (!enableContentCacheWarming_) {
+    return;
+  }
+
+  uint32_t tick = mostRecentTick_;
+  if (lastWarmedTick_ == tick || warmState_.lock()->tick == tick) {
+    // Nothing has changed since we last looked
+    return;
+  }
+
+  watchman::log(
+      watchman::DBG, "considering files for content hash cache warming\n");
+
+  // Each query needs a context in which to evaluate its expression
+  auto queries = getSubscriptionQueries(root);
+  std::vector<std::unique_ptr<w_query_ctx>> contexts;
+  for (auto& query : queries) {
+    contexts.emplace_back(
+        std::make_unique<w_query_ctx>(query.get(), root, true));
+  }
+
+  auto isSubscribed = [&](const watchman_file* f) {
+    for (auto& ctx : contexts) {
+      if (!ctx->fileMatchesRelativeRoot(f)) {
+        continue;
+      }
+      if (!ctx->query->expr) {
+        return true;
+      }
+      ctx->wholenameValid = false;
+      InMemoryFileResult file(f, caches_);
+      ctx->file = &file;
+      SCOPE_EXIT {
+        ctx->file = nullptr;
+      };
+      try {
+        auto match = evaluateQueryExpr(*ctx->query->expr, ctx.get(), &file);
+        // Terms that need more data than we have to hand, such as
+        // content hashes, don't count as a match
+        if (match.has_value() && *match) {
+          return true;
+        }
+      } catch (const std::exception&) {
+      }
+    }
+    return false;
+  };
+
+  std::deque<ContentHashCacheKey> subscribed;
+  std::deque<ContentHashCacheKey> other;
+  {
+    // Walk back in time until we hit the boundary, or hit the limit
+    // on the number of files we should warm up.
+    auto view = view_.rlock();
+    size_t n = 0;
+    view->journal.forEachSince(lastWarmedTick_, [&](watchman_file* f) {
+      if (n >= maxFilesToWarmInContentCache_) {
+        return false;
+      }
+
+      if (f->exists && f->stat.isFile()) {
+        auto dirStr = f->parent->getFullPath();
+        w_string_piece dir(dirStr);
+        dir.advance(caches_.contentHashCache.rootPath().size());
+
+        // If dirName is the root, dir.size() will now be zero
+        if (dir.size() > 0) {
+          // if not at the root, skip the slash character at the
+          // front of dir
+          dir.advance(1);
+        }
+        ContentHashCacheKey key{caches_.paths.intern(dir, f->getName()),
+                                size_t(f->stat.size()),
+                                f->stat.mtime(),
+                                uint64_t(f->stat.ino())};
+
+        if (isSubscribed(f)) {
+          subscribed.push_back(std::move(key));
+        } else {
+          other.push_back(std::move(key));
+        }
+        ++n;
+      }
+      return true;
+    });
+  }
+
+  auto self = std::static_pointer_cast<InMemoryView>(shared_from_this());
+  {
+    auto state = warmState_.lock();
+    // Anything left over from the prior tick is superseded
+    state->cancelled += state->subscribed.size() + state->other.size();
+    state->subscribed = std::move(subscribed);
+    state->other = std::move(other);
+    state->tick = tick;
+    state->scheduled += state->subscribed.size() + state->other.size();
+
+    watchman::log(
+        watchman::DBG,
+        "warmContentCache: scheduled ",
+        state->subscribed.size(),
+        " subscribed and ",
+        state->other.size(),
+        " other files for hashing at tick ",
+        tick,
+        "\n");
+
+    if (!state->threadStarted) {
+      state->threadStarted = true;
+      std::thread thread([self]() {
+        w_set_thread_name(
+            "warm ", uintptr_t(self.get()), " ", self->root_path);
+        self->placeThread();
+        self->warmThread();
+      });
+      thread.detach();
+    }
+    warmCond_.notify_all();
+
+    if (syncContentCacheWarming_) {
+      // Wait for them to finish, or to be superseded
+      warmCond_.wait(state.getUniqueLock(), [&] {
+        return stopThreads_ || state->tick != tick ||
+            (state->subscribed.empty() && state->other.empty() &&
+             !state->busy);
+      });
+      watchman::log(watchman::DBG, "warmContentCache: hashing complete\n");
+    }
+  }
+}
+
+void InMemoryView::warmSymlinkTargets() {
+  if (symlinksToWarm_.empty()) {
+    return;
+  }
+  // Nothing waits for the results; they're picked up from the cache by
+  // the queries that want them
+  caches_.symlinkTargetCache.getBatch(
+      symlinksToWarm_, ThreadPool::Priority::Background);
+  symlinksToWarm_.clear();
+}
+
+void InMemoryView::warmThread() {
+  LockSite site("warm_thread");
+  lowerIoPriority();
+
+  while (!stopThreads_) {
+    ContentHashCacheKey key;
+    uint32_t tick;
+    {
+      auto state = warmState_.lock();
+      if (state->tick != 0 && state->tick != mostRecentTick_ &&
+          (!state->subscribed.empty() || !state->other.empty())) {
+        // The view has changed again; the remaining files are likely
+        // to be changing too
+        state->cancelled += state->subscribed.size() + state->other.size();
+        state->subscribed.clear();
+        state->other.clear();
+        warmCond_.notify_all();
+      }
+      if (state->subscribed.empty() && state->other.empty()) {
+        warmCond_.wait(state.getUniqueLock());
+        continue;
+      }
+      auto& queue =
+          state->subscribed.empty() ? state->other : state->subscribed;
+      key = std::move(queue.front());
+      queue.pop_front();
+      tick = state->tick;
+      state->busy = true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    warmOne(key);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    // Spread the reads out so that we don't exceed the budget
+    std::chrono::microseconds delay{0};
+    if (warmBytesPerSecond_ > 0) {
+      auto allowed = std::chrono::microseconds(
+          key.fileSize * 1000000 / warmBytesPerSecond_);
+      delay = std::max(
+          std::chrono::microseconds(0),
+          allowed -
+              std::chrono::duration_cast<std::chrono::microseconds>(elapsed));
+    }
+
+    auto state = warmState_.lock();
+    state->busy = false;
+    state->hashingTime +=
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+    if (state->tick == tick && state->subscribed.empty() &&
+        state->other.empty()) {
+      // Everything up to tick has been warmed
+      lastWarmedTick_ = tick;
+    }
+    warmCond_.notify_all();
+
+    if (delay.count() > 0) {
+      state->throttledTime += delay;
+      warmCond_.wait_for(
+          state.getUniqueLock(), delay, [&] { return bool(stopThreads_); });
+    }
+  }
+}
+
+void InMemoryView::warmOne(const ContentHashCacheKey& key) {
+  auto fullPath = w_string::pathCat({root_path, key.relativePath});
+
+  // Hashing a file that has since changed is wasted effort; the change
+  // will be picked up at the next settle
+  try {
+    auto st = getFileInformation(fullPath.c_str());
+    if (size_t(st.size) != key.fileSize ||
+        st.mtime.tv_sec != key.mtime.tv_sec ||
+        st.mtime.tv_nsec != key.mtime.tv_nsec) {
+      warmState_.lock()->stale++;
+      return;
+    }
+  } catch (const std::exception&) {
+    warmState_.lock()->stale++;
+    return;
+  }
+
+  bool computed;
+  auto result = caches_.contentHashCache.getOnThisThread(key, computed);
+  // This only blocks if another thread is already computing the hash
+  result.wait();
+  auto& node = result.result();
+
+  auto state = warmState_.lock();
+  if (!node.hasValue() || node.value()->result().hasException()) {
+    state->errors++;
+  } else if (computed) {
+    state->hashed++;
+    state->bytesHashed += key.fileSize;
+  } else {
+    state->cached++;
+  }
+}
+
+void InMemoryView::debugContentWarming(
+    struct watchman_client* client,
+    const json_ref& args) {
+  /* resolve the root */
+  if (json_array_size(args) != 2) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-content-warming'");
+    return;
+  }
+
+  auto root = resolveRoot(client, args);
+
+  auto view = std::dynamic_pointer_cast<watchman::InMemoryView>(root->view());
+  if (!view) {
+    send_error_response(client, "root is not an InMemoryView watcher");
+    return;
+  }
+
+  auto resp = make_response();
+  auto state = view->warmState_.lock();
+  auto seconds = std::chrono::duration<double>(state->hashingTime).count();
+  resp.set(
+      {{"enabled", json_boolean(view->enableContentCacheWarming_)},
+       {"bytes_per_second_limit",
+        json_integer(int64_t(view->warmBytesPerSecond_))},
+       {"tick", json_integer(state->tick)},
+       {"last_warmed_tick", json_integer(view->lastWarmedTick_.load())},
+       {"backlog_subscribed", json_integer(state->subscribed.size())},
+       {"backlog_other", json_integer(state->other.size())},
+       {"scheduled", json_integer(state->scheduled)},
+       {"hashed", json_integer(state->hashed)},
+       {"cached", json_integer(state->cached)},
+       {"stale", json_integer(state->stale)},
+       {"cancelled", json_integer(state->cancelled)},
+       {"errors", json_integer(state->errors)},
+       {"bytes_hashed", json_integer(int64_t(state->bytesHashed))},
+       {"hashing_ms", json_integer(state->hashingTime.count() / 1000)},
+       {"throttled_ms", json_integer(state->throttledTime.count() / 1000)},
+       {"bytes_per_second",
+        json_integer(
+            seconds > 0 ? int64_t(double(state->bytesHashed) / seconds)
+                        : 0)}});
+  send_and_dispose_response(client, std::move(resp));
+}
+W_CMD_REG(
+    "debug-content-warming",
+    InMemoryView::debugContentWarming,
+    CMD_DAEMON,
+    w_cmd_realpath_root)
+
+} // namespace watchman
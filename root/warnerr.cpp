@@ -15,6 +15,9 @@ void handle_open_errno(
     const std::error_code& err) {
   auto dir_name = dir->getFullPath();
   bool log_warning = true;
+  // Errors other than those that tell us what is there, such as EIO or
+  // ESTALE on a network filesystem, may go away if we try again
+  bool transient = false;
 
   if (err == watchman::error_code::no_such_file_or_directory ||
       err == watchman::error_code::not_a_directory ||
@@ -30,6 +33,7 @@ void handle_open_errno(
     return;
   } else {
     log_warning = true;
+    transient = true;
   }
 
   if (w_string_equal(dir_name, root->root_path)) {
@@ -64,6 +68,9 @@ void handle_open_errno(
   if (log_warning) {
     root->recrawlInfo.wlock()->warning = warn;
   }
+  if (transient) {
+    root->scheduleSubtreeRecrawl(dir_name, warn);
+  }
 }
 
 /* vim:ts=2:sw=2:et:
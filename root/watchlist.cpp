@@ -2,8 +2,12 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include "RootPathCache.h"
 
 #include <folly/Synchronized.h>
+#include <algorithm>
+#include <deque>
+#include <thread>
 #include <vector>
 
 using namespace watchman;
@@ -12,6 +16,111 @@ folly::Synchronized<std::unordered_map<w_string, std::shared_ptr<w_root_t>>>
     watched_roots;
 std::atomic<long> live_roots{0};
 
+namespace {
+// A root from the state file that hasn't been watched yet.  When
+// restore_roots_lazily is set, w_root_load_state leaves the roots that have
+// no triggers in this list, most recently used first.  A client that
+// touches one of them watches it straight away, and a background thread
+// watches the rest one at a time, in order.
+struct PendingRestore {
+  w_string path;
+  time_t lastAccess;
+};
+folly::Synchronized<std::deque<PendingRestore>> pendingRestores;
+
+// A shared watch; see w_root_find_shared.  Entries whose enclosing root is
+// no longer watched are dropped when they are next resolved.
+struct SharedWatch {
+  w_string enclosingPath;
+  w_string relativePath;
+};
+folly::Synchronized<std::unordered_map<w_string, SharedWatch>> sharedWatches;
+
+bool isWatched(const w_string& path) {
+  auto map = watched_roots.rlock();
+  return map->find(path) != map->end();
+}
+
+void restorePendingRoots() {
+  w_set_thread_name("restore");
+  while (!w_is_stopping()) {
+    w_string path;
+    {
+      auto pending = pendingRestores.wlock();
+      if (pending->empty()) {
+        break;
+      }
+      path = pending->front().path;
+      pending->pop_front();
+    }
+
+    std::shared_ptr<w_root_t> root;
+    try {
+      root = w_root_resolve(path.c_str(), true);
+    } catch (const std::exception& exc) {
+      logf(ERR, "failed to restore the watch of {}: {}\n", path, exc.what());
+      continue;
+    }
+
+    // Let its crawl finish before starting the next, so that the roots
+    // that were used most recently are ready first
+    auto ready = root->view()->waitUntilReadyToQuery(root);
+    while (!w_is_stopping() && !root->inner.cancelled &&
+           ready.wait_for(std::chrono::seconds(1)) !=
+               std::future_status::ready) {
+    }
+  }
+  logf(DBG, "done restoring roots\n");
+}
+} // namespace
+
+bool w_root_claim_pending_restore(const w_string& path) {
+  auto pending = pendingRestores.wlock();
+  auto it = std::find_if(
+      pending->begin(), pending->end(), [&path](const PendingRestore& entry) {
+        return entry.path == path;
+      });
+  if (it == pending->end()) {
+    return false;
+  }
+  pending->erase(it);
+  return true;
+}
+
+bool w_root_find_shared(
+    const w_string& path,
+    w_string& enclosingPath,
+    w_string& relativePath) {
+  auto shared = sharedWatches.rlock();
+  auto it = shared->find(path);
+  if (it == shared->end()) {
+    return false;
+  }
+  enclosingPath = it->second.enclosingPath;
+  relativePath = it->second.relativePath;
+  return true;
+}
+
+bool w_root_share_enclosing(
+    const w_string& path,
+    w_string& enclosingPath,
+    w_string& relativePath) {
+  w_string_piece prefix;
+  w_string_piece relative;
+  if (!findEnclosingRoot(path, prefix, relative) || relative.empty()) {
+    return false;
+  }
+  enclosingPath = prefix.asWString();
+  relativePath = relative.asWString();
+  sharedWatches.wlock()->emplace(
+      path, SharedWatch{enclosingPath, relativePath});
+  return true;
+}
+
+bool w_root_unshare(const w_string& path) {
+  return sharedWatches.wlock()->erase(path) > 0;
+}
+
 bool watchman_root::removeFromWatched() {
   auto map = watched_roots.wlock();
   auto it = map->find(root_path);
@@ -22,6 +131,8 @@ bool watchman_root::removeFromWatched() {
   // another, so make sure we're removing the right object
   if (it->second.get() == this) {
     map->erase(it);
+    // Its path might not lead to the same dir the next time it is watched
+    getRootPathCache().invalidate(root_path);
     return true;
   }
   return false;
@@ -87,6 +198,22 @@ json_ref w_root_stop_watch_all(void) {
     json_array_append_new(stopped, w_string_to_json(root->root_path));
   }
 
+  {
+    // Forget the roots that have yet to be restored, too
+    auto pending = pendingRestores.wlock();
+    for (auto& entry : *pending) {
+      json_array_append_new(stopped, w_string_to_json(entry.path));
+    }
+    pending->clear();
+  }
+  {
+    auto shared = sharedWatches.wlock();
+    for (auto& it : *shared) {
+      json_array_append_new(stopped, w_string_to_json(it.first));
+    }
+    shared->clear();
+  }
+
   w_state_save();
 
   return stopped;
@@ -95,13 +222,96 @@ json_ref w_root_stop_watch_all(void) {
 json_ref w_root_watch_list_to_json(void) {
   auto arr = json_array();
 
+  {
+    auto map = watched_roots.rlock();
+    for (const auto& it : *map) {
+      auto root = it.second;
+      json_array_append_new(arr, w_string_to_json(root->root_path));
+    }
+  }
+  {
+    auto shared = sharedWatches.rlock();
+    for (const auto& it : *shared) {
+      if (isWatched(it.second.enclosingPath)) {
+        json_array_append_new(arr, w_string_to_json(it.first));
+      }
+    }
+  }
+
+  return arr;
+}
+
+bool w_root_probe_clock(uint32_t rootNumber, ClockPosition& position) {
+  auto map = watched_roots.rlock();
+  for (const auto& it : *map) {
+    auto current = it.second->view()->getMostRecentRootNumberAndTickValue();
+    if (current.rootNumber == rootNumber) {
+      position = current;
+      return true;
+    }
+  }
+  return false;
+}
+
+json_ref w_root_overflow_recovery_to_json(void) {
+  auto obj = json_object();
+
   auto map = watched_roots.rlock();
   for (const auto& it : *map) {
     auto root = it.second;
-    json_array_append_new(arr, w_string_to_json(root->root_path));
+    auto info = root->getOverflowRecoveryInfo();
+    if (!info.get("last").isNull()) {
+      obj.set(root->root_path, std::move(info));
+    }
   }
 
-  return arr;
+  return obj;
+}
+
+json_ref w_root_recrawl_to_json(void) {
+  auto obj = json_object();
+
+  auto map = watched_roots.rlock();
+  for (const auto& it : *map) {
+    auto root = it.second;
+    auto info = root->getRecrawlInfo();
+    if (info.get("count").asInt() > 0 ||
+        json_object_size(info.get("subtree_errors")) > 0) {
+      obj.set(root->root_path, std::move(info));
+    }
+  }
+
+  return obj;
+}
+
+void w_root_add_metrics(MetricsWriter& metrics) {
+  std::vector<std::shared_ptr<w_root_t>> roots;
+  {
+    auto map = watched_roots.rlock();
+    for (const auto& it : *map) {
+      roots.push_back(it.second);
+    }
+  }
+  // Not under the lock on watched_roots, so that a slow root doesn't hold
+  // up watching or unwatching the others
+  for (auto& root : roots) {
+    root->addMetrics(metrics);
+  }
+}
+
+json_ref w_root_memory_usage_to_json(void) {
+  std::vector<std::shared_ptr<w_root_t>> roots;
+  {
+    auto map = watched_roots.rlock();
+    for (const auto& it : *map) {
+      roots.push_back(it.second);
+    }
+  }
+  auto usage = json_array();
+  for (auto& root : roots) {
+    json_array_append_new(usage, root->getMemoryUsage());
+  }
+  return usage;
 }
 
 bool w_root_save_state(json_ref& state) {
@@ -119,6 +329,8 @@ bool w_root_save_state(json_ref& state) {
       auto obj = json_object();
 
       json_object_set_new(obj, "path", w_string_to_json(root->root_path));
+      json_object_set_new(
+          obj, "last_access", json_integer(root->inner.last_cmd_timestamp));
 
       auto triggers = root->triggerListToJson();
       json_object_set_new(obj, "triggers", std::move(triggers));
@@ -126,9 +338,35 @@ bool w_root_save_state(json_ref& state) {
       json_array_append_new(watched_dirs, std::move(obj));
     }
   }
+  {
+    // The roots that haven't been restored yet have no triggers
+    auto pending = pendingRestores.rlock();
+    for (const auto& entry : *pending) {
+      json_array_append_new(
+          watched_dirs,
+          json_object(
+              {{"path", w_string_to_json(entry.path)},
+               {"last_access", json_integer(entry.lastAccess)},
+               {"triggers", json_array()}}));
+    }
+  }
 
   json_object_set_new(state, "watched", std::move(watched_dirs));
 
+  auto shared_dirs = json_array();
+  {
+    auto shared = sharedWatches.rlock();
+    for (const auto& it : *shared) {
+      json_array_append_new(
+          shared_dirs,
+          json_object(
+              {{"path", w_string_to_json(it.first)},
+               {"enclosing", w_string_to_json(it.second.enclosingPath)},
+               {"relative_path", w_string_to_json(it.second.relativePath)}}));
+    }
+  }
+  json_object_set_new(state, "shared", std::move(shared_dirs));
+
   return result;
 }
 
@@ -148,6 +386,25 @@ json_ref watchman_root::triggerListToJson() const {
 bool w_root_load_state(const json_ref& state) {
   size_t i;
 
+  // The shared watches come back along with the roots that serve them
+  auto shared = state.get_default("shared");
+  if (shared && shared.isArray()) {
+    auto wlock = sharedWatches.wlock();
+    for (i = 0; i < json_array_size(shared); i++) {
+      const auto& obj = shared.at(i);
+      auto path = obj.get_default("path");
+      auto enclosing = obj.get_default("enclosing");
+      auto relative = obj.get_default("relative_path");
+      if (!path || !path.isString() || !enclosing || !enclosing.isString() ||
+          !relative || !relative.isString()) {
+        continue;
+      }
+      wlock->emplace(
+          json_to_w_string(path),
+          SharedWatch{json_to_w_string(enclosing), json_to_w_string(relative)});
+    }
+  }
+
   auto watched = state.get_default("watched");
   if (!watched) {
     return true;
@@ -157,6 +414,14 @@ bool w_root_load_state(const json_ref& state) {
     return false;
   }
 
+  bool lazy = cfg_get_bool("restore_roots_lazily", true);
+  // A root that would have been reaped for being idle, had the server been
+  // running, isn't restored at all.  The config of the root itself can't be
+  // consulted without watching it, so only the global setting applies.
+  auto pruneAge = cfg_get_int("idle_reap_age_seconds", DEFAULT_REAP_AGE);
+  auto now = time(nullptr);
+  std::vector<PendingRestore> deferred;
+
   for (i = 0; i < json_array_size(watched); i++) {
     const auto& obj = watched.at(i);
     bool created = false;
@@ -165,6 +430,32 @@ bool w_root_load_state(const json_ref& state) {
 
     auto triggers = obj.get_default("triggers");
     filename = json_string_value(json_object_get(obj, "path"));
+    if (!filename) {
+      continue;
+    }
+
+    // State files written before last_access was recorded count as recent
+    auto lastAccessRef = obj.get_default("last_access");
+    time_t lastAccess = lastAccessRef && lastAccessRef.isInt()
+        ? time_t(lastAccessRef.asInt())
+        : now;
+    bool hasTriggers = triggers && json_array_size(triggers) > 0;
+
+    if (!hasTriggers && pruneAge > 0 && now > lastAccess + pruneAge) {
+      logf(
+          ERR,
+          "not restoring the watch of {}, which has had no activity in {} "
+          "seconds.  Set idle_reap_age_seconds in the global config to "
+          "control this behavior\n",
+          filename,
+          now - lastAccess);
+      continue;
+    }
+    if (lazy && !hasTriggers) {
+      deferred.push_back(
+          PendingRestore{w_string(filename, W_STRING_BYTE), lastAccess});
+      continue;
+    }
 
     std::shared_ptr<w_root_t> root;
     try {
@@ -172,6 +463,9 @@ bool w_root_load_state(const json_ref& state) {
     } catch (const std::exception&) {
       continue;
     }
+    if (created) {
+      root->inner.last_cmd_timestamp = lastAccess;
+    }
 
     {
       auto wlock = root->triggers.wlock();
@@ -220,6 +514,25 @@ bool w_root_load_state(const json_ref& state) {
     }
   }
 
+  if (!deferred.empty()) {
+    std::stable_sort(
+        deferred.begin(),
+        deferred.end(),
+        [](const PendingRestore& a, const PendingRestore& b) {
+          return a.lastAccess > b.lastAccess;
+        });
+    logf(
+        ERR,
+        "restoring {} watches in the background, most recently used first\n",
+        deferred.size());
+    {
+      auto pending = pendingRestores.wlock();
+      std::move(deferred.begin(), deferred.end(), std::back_inserter(*pending));
+    }
+    std::thread thr(restorePendingRoots);
+    thr.detach();
+  }
+
   return true;
 }
 
@@ -0,0 +1,78 @@
+//! Measures the throughput of this BSER implementation on the v2 PDUs of
+//! the corpus in tests/bser_corpus:
+//!
+//!   cargo run --release --example corpus_bench [seconds] [substring]
+//!
+//! For each PDU this reports how quickly it is decoded, and how quickly the
+//! decoded value is encoded again, in MB of BSER per second, so that the
+//! numbers can be compared with those of the drivers for the other
+//! languages.
+
+use serde_bser::value::Value;
+use std::fs;
+use std::path::PathBuf;
+use std::time::Instant;
+
+/// Returns the mean time in seconds of a call to func, running it for at
+/// least min_time seconds
+fn measure<F: FnMut()>(mut func: F, min_time: f64) -> f64 {
+    func();
+    let mut iterations = 0;
+    let start = Instant::now();
+    loop {
+        func();
+        iterations += 1;
+        let elapsed = start.elapsed().as_secs_f64();
+        if elapsed >= min_time && iterations >= 3 {
+            return elapsed / iterations as f64;
+        }
+    }
+}
+
+fn main() {
+    let mut args = std::env::args().skip(1);
+    let min_time: f64 = args.next().map_or(0.5, |arg| arg.parse().unwrap());
+    let only = args.next().unwrap_or_default();
+
+    let dir = PathBuf::from(env!("CARGO_MANIFEST_DIR")).join("../../tests/bser_corpus");
+    let mut pdus: Vec<PathBuf> = fs::read_dir(&dir)
+        .expect("the BSER corpus is not available")
+        .map(|entry| entry.unwrap().path())
+        .filter(|path| path.extension().map_or(false, |ext| ext == "bser"))
+        .collect();
+    pdus.sort();
+
+    println!(
+        "{:<8} {:<36} {:>9} {:>12} {:>12}",
+        "impl", "pdu", "bytes", "decode MB/s", "encode MB/s"
+    );
+    for path in pdus {
+        let name = path.file_name().unwrap().to_string_lossy().into_owned();
+        if !name.contains(".v2.") || !name.contains(&only) {
+            continue;
+        }
+        let data = fs::read(&path).unwrap();
+        let value: Value = serde_bser::from_slice(&data).unwrap();
+        let decode = measure(
+            || {
+                let _: Value = serde_bser::from_slice(&data).unwrap();
+            },
+            min_time,
+        );
+        let encode = measure(
+            || {
+                serde_bser::ser::serialize(Vec::with_capacity(data.len()), &value).unwrap();
+            },
+            min_time,
+        );
+        let mb = data.len() as f64 / 1e6;
+        println!(
+            "{:<8} {:<36} {:>9} {:>12.1} {:>12.1}",
+            "rust",
+            name,
+            data.len(),
+            mb / decode,
+            mb / encode
+        );
+    }
+}
@@ -1,7 +1,9 @@
 use std::convert::TryInto;
-use std::ffi::OsString;
+use std::ffi::{OsStr, OsString};
 use std::fmt::Write;
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
+
+use serde::de;
 
 /// The ByteString type represents values encoded using BSER_BYTESTRING.
 /// The purpose of this encoding is to represent bytestrings with an arbitrary
@@ -63,33 +65,36 @@ impl ByteString {
     /// string, with invalid sequences escaped using `\xXX` hex notation.
     /// This is for diagnostic and display purposes.
     pub fn as_escaped_string(&self) -> String {
-        let mut input = self.0.as_slice();
-        let mut output = String::new();
+        escape_bytes(self.0.as_slice())
+    }
+}
 
-        loop {
-            match ::std::str::from_utf8(input) {
-                Ok(valid) => {
-                    output.push_str(valid);
-                    break;
-                }
-                Err(error) => {
-                    let (valid, after_valid) = input.split_at(error.valid_up_to());
-                    unsafe { output.push_str(::std::str::from_utf8_unchecked(valid)) }
-
-                    if let Some(invalid_sequence_length) = error.error_len() {
-                        for b in &after_valid[..invalid_sequence_length] {
-                            write!(output, "\\x{:x}", b).unwrap();
-                        }
-                        input = &after_valid[invalid_sequence_length..];
-                    } else {
-                        break;
+fn escape_bytes(mut input: &[u8]) -> String {
+    let mut output = String::new();
+
+    loop {
+        match ::std::str::from_utf8(input) {
+            Ok(valid) => {
+                output.push_str(valid);
+                break;
+            }
+            Err(error) => {
+                let (valid, after_valid) = input.split_at(error.valid_up_to());
+                unsafe { output.push_str(::std::str::from_utf8_unchecked(valid)) }
+
+                if let Some(invalid_sequence_length) = error.error_len() {
+                    for b in &after_valid[..invalid_sequence_length] {
+                        write!(output, "\\x{:x}", b).unwrap();
                     }
+                    input = &after_valid[invalid_sequence_length..];
+                } else {
+                    break;
                 }
             }
         }
-
-        output
     }
+
+    output
 }
 
 /// Guaranteed conversion from an owned byte vector to a ByteString
@@ -177,3 +182,132 @@ impl TryInto<ByteString> for PathBuf {
         Ok(self.into_os_string().try_into()?)
     }
 }
+
+/// The ByteStr type is the borrowed counterpart of ByteString: a
+/// BSER_BYTESTRING (or BSER_UTF8STRING) value that refers to the buffer it
+/// was deserialized from rather than being copied out of it.
+///
+/// It can only be deserialized by `from_slice`, which borrows from its input.
+#[derive(Clone, Copy, PartialEq, Eq, Hash)]
+pub struct ByteStr<'a>(&'a [u8]);
+
+impl<'a> std::fmt::Debug for ByteStr<'a> {
+    fn fmt(&self, fmt: &mut std::fmt::Formatter) -> Result<(), std::fmt::Error> {
+        let escaped = self.as_escaped_string();
+        write!(fmt, "\"{}\"", escaped.escape_debug())
+    }
+}
+
+impl<'a> std::fmt::Display for ByteStr<'a> {
+    fn fmt(&self, fmt: &mut std::fmt::Formatter) -> Result<(), std::fmt::Error> {
+        let escaped = self.as_escaped_string();
+        write!(fmt, "\"{}\"", escaped.escape_default())
+    }
+}
+
+impl<'a> std::ops::Deref for ByteStr<'a> {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        self.0
+    }
+}
+
+impl<'a> ByteStr<'a> {
+    /// Returns the raw bytes, with the lifetime of the buffer they refer to
+    pub fn as_bytes(&self) -> &'a [u8] {
+        self.0
+    }
+
+    /// See ByteString::as_escaped_string
+    pub fn as_escaped_string(&self) -> String {
+        escape_bytes(self.0)
+    }
+
+    /// Copies the bytes into a ByteString
+    pub fn to_byte_string(&self) -> ByteString {
+        ByteString(self.0.to_vec())
+    }
+}
+
+impl<'a> From<&'a [u8]> for ByteStr<'a> {
+    fn from(bytes: &'a [u8]) -> Self {
+        Self(bytes)
+    }
+}
+
+impl<'a> From<&'a str> for ByteStr<'a> {
+    fn from(s: &'a str) -> Self {
+        Self(s.as_bytes())
+    }
+}
+
+impl<'a> From<ByteStr<'a>> for ByteString {
+    fn from(s: ByteStr<'a>) -> Self {
+        s.to_byte_string()
+    }
+}
+
+/// Attempt to view a ByteStr as a UTF-8 str
+impl<'a> TryInto<&'a str> for ByteStr<'a> {
+    type Error = std::str::Utf8Error;
+
+    fn try_into(self) -> Result<&'a str, Self::Error> {
+        std::str::from_utf8(self.0)
+    }
+}
+
+/// Viewing a ByteStr as an OsStr is guaranteed to succeed on unix systems,
+/// and succeeds on Windows systems when it holds UTF-8, as with ByteString
+impl<'a> TryInto<&'a OsStr> for ByteStr<'a> {
+    type Error = std::str::Utf8Error;
+
+    #[cfg(unix)]
+    fn try_into(self) -> Result<&'a OsStr, Self::Error> {
+        Ok(std::os::unix::ffi::OsStrExt::from_bytes(self.0))
+    }
+
+    #[cfg(windows)]
+    fn try_into(self) -> Result<&'a OsStr, Self::Error> {
+        let s: &'a str = self.try_into()?;
+        Ok(OsStr::new(s))
+    }
+}
+
+/// Viewing a ByteStr as a Path is subject to the same rules as viewing it
+/// as an OsStr
+impl<'a> TryInto<&'a Path> for ByteStr<'a> {
+    type Error = std::str::Utf8Error;
+
+    fn try_into(self) -> Result<&'a Path, Self::Error> {
+        let os: &'a OsStr = self.try_into()?;
+        Ok(Path::new(os))
+    }
+}
+
+impl<'de: 'a, 'a> de::Deserialize<'de> for ByteStr<'a> {
+    fn deserialize<D>(deserializer: D) -> Result<Self, D::Error>
+    where
+        D: de::Deserializer<'de>,
+    {
+        struct ByteStrVisitor;
+
+        impl<'de> de::Visitor<'de> for ByteStrVisitor {
+            type Value = ByteStr<'de>;
+
+            fn expecting(&self, formatter: &mut std::fmt::Formatter) -> std::fmt::Result {
+                formatter.write_str("a string borrowed from the input buffer")
+            }
+
+            fn visit_borrowed_bytes<E>(self, value: &'de [u8]) -> Result<Self::Value, E> {
+                Ok(ByteStr(value))
+            }
+
+            fn visit_borrowed_str<E>(self, value: &'de str) -> Result<Self::Value, E> {
+                Ok(ByteStr(value.as_bytes()))
+            }
+        }
+
+        deserializer.deserialize_bytes(ByteStrVisitor)
+    }
+}
@@ -77,6 +77,9 @@ where
     /// Return a borrowed or copied version of the next n bytes.
     #[inline]
     pub fn read_bytes<'s>(&'s mut self, len: i64) -> Result<Reference<'de, 's, [u8]>> {
+        if len < 0 {
+            bail!("negative length {} while reading bytes/string", len);
+        }
         let len = len as usize;
         self.read.next_bytes(len, &mut self.scratch)
     }
@@ -121,7 +121,7 @@ where
 
                 // TODO: handle possible IO interruption better here -- will
                 // probably need some intermediate states.
-                let keys = self.template_keys()?;
+                let keys = template::read_keys(self)?;
                 let nitems = self.bunser.check_next_int()?;
                 let template = template::Template::new(self, keys, nitems as usize, &guard);
                 visitor.visit_seq(template)
@@ -141,10 +141,56 @@ where
     make_visit_num!(visit_i64, next_i64);
     make_visit_num!(visit_f64, next_f64);
 
-    fn template_keys(&mut self) -> Result<Vec<template::Key<'de>>> {
-        // The list of keys is actually an array, so just use the deserializer
-        // to process it.
-        de::Deserialize::deserialize(self)
+    /// Move past the next value without visiting it. This is what unknown
+    /// struct fields and other ignored values cost, so strings aren't
+    /// validated and nothing is built for containers.
+    fn skip_value(&mut self) -> Result<()> {
+        match self.bunser.peek()? {
+            BSER_ARRAY => {
+                let _guard = self.remaining_depth.acquire("array")?;
+                self.bunser.discard();
+                let nitems = self.bunser.check_next_int()?;
+                for _ in 0..nitems {
+                    self.skip_value()?;
+                }
+            }
+            BSER_OBJECT => {
+                let _guard = self.remaining_depth.acquire("object")?;
+                self.bunser.discard();
+                let nitems = self.bunser.check_next_int()?;
+                for _ in 0..nitems {
+                    self.skip_value()?;
+                    self.skip_value()?;
+                }
+            }
+            BSER_TEMPLATE => {
+                let _guard = self.remaining_depth.acquire("template")?;
+                self.bunser.discard();
+                let nkeys = template::read_keys(self)?.len() as i64;
+                let nitems = self.bunser.check_next_int()?;
+                for _ in 0..nitems.saturating_mul(nkeys) {
+                    if self.bunser.peek()? == BSER_SKIP {
+                        self.bunser.discard();
+                    } else {
+                        self.skip_value()?;
+                    }
+                }
+            }
+            BSER_BYTESTRING | BSER_UTF8STRING => {
+                self.bunser.discard();
+                let len = self.bunser.check_next_int()?;
+                self.bunser.read_bytes(len)?;
+            }
+            BSER_TRUE | BSER_FALSE | BSER_NULL => self.bunser.discard(),
+            BSER_REAL => {
+                self.bunser.next_f64()?;
+            }
+            BSER_INT8 | BSER_INT16 | BSER_INT32 | BSER_INT64 => {
+                self.bunser.check_next_int()?;
+            }
+            ch => bail!(ErrorKind::DeInvalidStartByte("next item".into(), ch)),
+        }
+        Ok(())
     }
 
     fn visit_bytestring<V>(&mut self, visitor: V) -> Result<V::Value>
@@ -271,9 +317,17 @@ where
         }
     }
 
+    #[inline]
+    fn deserialize_ignored_any<V>(self, visitor: V) -> Result<V::Value>
+    where
+        V: de::Visitor<'de>,
+    {
+        self.skip_value()?;
+        visitor.visit_unit()
+    }
+
     forward_to_deserialize_any! {
         bool i8 i16 i32 i64 u8 u16 u32 u64 f32 f64 char str string bytes
         byte_buf unit unit_struct seq tuple tuple_struct map struct identifier
-        ignored_any
     }
 }
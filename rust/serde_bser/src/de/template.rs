@@ -1,12 +1,13 @@
 use std::borrow::Cow;
-use std::rc::Rc;
+use std::str;
 
+use error_chain::bail;
 use serde::{de, forward_to_deserialize_any, Deserialize};
 
 use crate::errors::*;
 use crate::header::*;
 
-use super::read::DeRead;
+use super::read::{DeRead, Reference};
 use super::reentrant::ReentrantGuard;
 use super::Deserializer;
 
@@ -20,6 +21,35 @@ use super::Deserializer;
 #[derive(Clone, Debug, Deserialize)]
 pub struct Key<'a>(#[serde(borrow)] Cow<'a, str>);
 
+/// Read the array of keys at the start of a template, borrowing them from
+/// the input where it allows that. This is done directly rather than by
+/// deserializing a `Vec<Key>`, as a large result set may be made up of
+/// many small templates.
+pub fn read_keys<'de, R>(de: &mut Deserializer<R>) -> Result<Vec<Key<'de>>>
+where
+    R: DeRead<'de>,
+{
+    match de.bunser.peek()? {
+        BSER_ARRAY => de.bunser.discard(),
+        ch => bail!(ErrorKind::DeInvalidStartByte("template keys".into(), ch)),
+    }
+    let nkeys = de.bunser.check_next_int()?;
+    let mut keys = Vec::new();
+    for _ in 0..nkeys {
+        match de.bunser.peek()? {
+            BSER_BYTESTRING | BSER_UTF8STRING => de.bunser.discard(),
+            ch => bail!(ErrorKind::DeInvalidStartByte("template key".into(), ch)),
+        }
+        let len = de.bunser.check_next_int()?;
+        let key = match de.bunser.read_bytes(len)?.map_result(str::from_utf8)? {
+            Reference::Borrowed(s) => Cow::Borrowed(s),
+            Reference::Copied(s) => Cow::Owned(s.to_owned()),
+        };
+        keys.push(Key(key));
+    }
+    Ok(keys)
+}
+
 /// A BSER template is logically an array of objects, all with the same or
 /// similar keys.
 ///
@@ -40,7 +70,7 @@ pub struct Key<'a>(#[serde(borrow)] Cow<'a, str>);
 /// key.
 pub struct Template<'a, 'de, R> {
     de: &'a mut Deserializer<R>,
-    keys: Rc<Vec<Key<'de>>>,
+    keys: Vec<Key<'de>>,
     remaining: usize,
 }
 
@@ -56,7 +86,7 @@ impl<'a, 'de, R: 'a> Template<'a, 'de, R> {
     ) -> Self {
         Template {
             de,
-            keys: Rc::new(keys),
+            keys,
             remaining: nitems,
         }
     }
@@ -78,7 +108,7 @@ where
             self.remaining -= 1;
             let obj_de = ObjectDeserializer {
                 de: &mut *self.de,
-                keys: self.keys.clone(),
+                keys: &self.keys,
             };
             let value = seed.deserialize(obj_de)?;
             Ok(Some(value))
@@ -88,7 +118,7 @@ where
 
 struct ObjectDeserializer<'a, 'de, R> {
     de: &'a mut Deserializer<R>,
-    keys: Rc<Vec<Key<'de>>>,
+    keys: &'a [Key<'de>],
 }
 
 impl<'a, 'de, R> de::Deserializer<'de> for ObjectDeserializer<'a, 'de, R>
@@ -135,7 +165,7 @@ where
 
 struct TemplateObject<'a, 'de, R> {
     de: &'a mut Deserializer<R>,
-    keys: Rc<Vec<Key<'de>>>,
+    keys: &'a [Key<'de>],
     cur: usize,
 }
 
@@ -143,7 +173,7 @@ impl<'a, 'de, R> TemplateObject<'a, 'de, R>
 where
     R: 'a + DeRead<'de>,
 {
-    fn new(de: &'a mut Deserializer<R>, keys: Rc<Vec<Key<'de>>>) -> Self {
+    fn new(de: &'a mut Deserializer<R>, keys: &'a [Key<'de>]) -> Self {
         TemplateObject { de, keys, cur: 0 }
     }
 }
@@ -255,11 +285,25 @@ where
         visitor.visit_newtype_struct(self)
     }
 
+    #[inline]
+    fn deserialize_ignored_any<V>(self, visitor: V) -> Result<V::Value>
+    where
+        V: de::Visitor<'de>,
+    {
+        match self.de.bunser.peek()? {
+            BSER_SKIP => {
+                self.de.bunser.discard();
+                visitor.visit_unit()
+            }
+            _ => self.de.deserialize_ignored_any(visitor),
+        }
+    }
+
     // TODO: do we also need to do enum here?
 
     forward_to_deserialize_any! {
         bool i8 i16 i32 i64 u8 u16 u32 u64 f32 f64 char str string bytes
         byte_buf unit unit_struct seq tuple tuple_struct map struct identifier
-        ignored_any enum
+        enum
     }
 }
@@ -5,6 +5,7 @@ use std::borrow::Cow;
 use std::collections::HashMap;
 use std::io::Cursor;
 
+use crate::bytestring::ByteStr;
 use crate::from_reader;
 use crate::from_slice;
 
@@ -498,3 +499,70 @@ fn test_arrays_untagged_enum() {
         })
     );
 }
+
+#[derive(Debug, Deserialize, PartialEq)]
+struct BorrowedFileInfo<'a> {
+    #[serde(borrow)]
+    name: ByteStr<'a>,
+}
+
+#[derive(Debug, Deserialize, PartialEq)]
+struct BorrowedFiles<'a> {
+    #[serde(borrow)]
+    files: Vec<BorrowedFileInfo<'a>>,
+    clock: &'a str,
+}
+
+#[test]
+fn test_borrowed_template() {
+    // The same response as test_compact_arrays; only the names are wanted,
+    // so the sizes and the other top level keys are skipped over.
+    let bser_v2 = b"\x00\x02\x00\x00\x00\x00\x04\xeb\x00\x01\x03\x04\x02\x03\x05files\x0b\x00\x03\x02\x0d\x03\x04name\x0d\x03\x04size\x03\x02\x02\x038fbcode/scm/hg/lib/hg_watchman_client/tester/target/debug\x04\x80\x01\x02\x03\x3dfbcode/scm/hg/lib/hg_watchman_client/tester/target/debug/deps\x04\x80\x0c\x02\x03\x05clock\x0d\x03\x19c\x3a1525428959\x3a45796\x3a2\x3a7717\x02\x03\x11is_fresh_instance\x09\x02\x03\x07version\x0d\x03\x054.9.1";
+
+    let decoded = from_slice::<BorrowedFiles<'_>>(bser_v2).unwrap();
+    assert_eq!(
+        decoded,
+        BorrowedFiles {
+            files: vec![
+                BorrowedFileInfo {
+                    name: (&b"fbcode/scm/hg/lib/hg_watchman_client/tester/target/debug"[..]).into(),
+                },
+                BorrowedFileInfo {
+                    name: (&b"fbcode/scm/hg/lib/hg_watchman_client/tester/target/debug/deps"[..])
+                        .into(),
+                },
+            ],
+            clock: "c:1525428959:45796:2:7717",
+        }
+    );
+
+    // The names point into the input rather than at copies of it
+    let range = bser_v2.as_ptr_range();
+    assert!(range.contains(&decoded.files[0].name.as_bytes().as_ptr()));
+}
+
+#[derive(Debug, Deserialize, PartialEq)]
+struct TemplateAbc {
+    abc: i32,
+}
+
+#[test]
+fn test_template_skip() {
+    // The template of test_template, with a missing value and a string in
+    // the fields that aren't wanted
+    let bser_v2 = b"\x00\x02\x00\x00\x00\x00\x05(\x00\x00\x00\x0b\x00\x03\x03\x02\x03\x03abc\x02\
+                    \x03\x03def\x02\x03\x03ghi\x03\x02\x03{\x02\x03\x03bar\n\x04\xc8\x01\x0c\x04\
+                    \x15\x03";
+    let decoded = from_slice::<Vec<TemplateAbc>>(bser_v2).unwrap();
+    assert_eq!(
+        decoded,
+        vec![TemplateAbc { abc: 123 }, TemplateAbc { abc: 456 }]
+    );
+
+    let reader = Cursor::new(bser_v2.to_vec()).reader();
+    let decoded: Vec<TemplateAbc> = from_reader(reader).unwrap();
+    assert_eq!(
+        decoded,
+        vec![TemplateAbc { abc: 123 }, TemplateAbc { abc: 456 }]
+    );
+}
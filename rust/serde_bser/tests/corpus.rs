@@ -0,0 +1,54 @@
+//! Checks this implementation against the corpus of PDUs that is shared by
+//! all of the BSER implementations; see tests/bser_corpus/README.md in the
+//! watchman repository.
+
+use serde_bser::value::Value;
+use std::fs;
+use std::path::PathBuf;
+
+fn corpus_dir() -> PathBuf {
+    PathBuf::from(env!("CARGO_MANIFEST_DIR")).join("../../tests/bser_corpus")
+}
+
+/// Returns the names of the v2 PDUs in the corpus, which are the ones that
+/// this implementation speaks.  This is empty if the corpus isn't
+/// available, as when this is built from crates.io
+fn corpus_pdus() -> Vec<String> {
+    let mut pdus: Vec<String> = match fs::read_dir(corpus_dir()) {
+        Ok(entries) => entries
+            .filter_map(|entry| entry.ok())
+            .map(|entry| entry.file_name().to_string_lossy().into_owned())
+            .filter(|name| name.ends_with(".bser") && name.contains(".v2."))
+            .collect(),
+        Err(_) => vec![],
+    };
+    pdus.sort();
+    pdus
+}
+
+fn decode(name: &str) -> Value {
+    let data = fs::read(corpus_dir().join(name)).unwrap();
+    serde_bser::from_slice(&data).unwrap_or_else(|e| panic!("{}: {}", name, e))
+}
+
+#[test]
+fn templates_decode_to_the_plain_value() {
+    for pdu in corpus_pdus() {
+        if let Some(plain) = pdu.strip_suffix(".tmpl.bser") {
+            assert_eq!(decode(&pdu), decode(&format!("{}.bser", plain)), "{}", pdu);
+        }
+    }
+}
+
+// Maps are unordered here, and object keys are encoded as utf-8 strings
+// rather than byte strings, so the encoding can't match the canonical one
+// byte for byte; it has to decode to the same value.
+#[test]
+fn encoded_values_decode_to_the_same_value() {
+    for pdu in corpus_pdus() {
+        let value = decode(&pdu);
+        let encoded = serde_bser::ser::serialize(Vec::new(), &value).unwrap();
+        let decoded: Value = serde_bser::from_slice(&encoded).unwrap();
+        assert_eq!(value, decoded, "{}", pdu);
+    }
+}
@@ -55,7 +55,8 @@ pub mod prelude {
     pub use crate::fields::*;
     pub use crate::pdu::*;
     pub use crate::query_result_type;
-    pub use crate::{CanonicalPath, Client, Connector, ResolvedRoot};
+    pub use crate::{CanonicalPath, Client, Connector, QueryResultBuffer, ResolvedRoot};
+    pub use serde_bser::bytestring::ByteStr;
 }
 
 use prelude::*;
@@ -591,6 +592,20 @@ impl ClientInner {
     where
         Request: serde::Serialize + std::fmt::Debug,
         Response: serde::de::DeserializeOwned,
+    {
+        let pdu_data = self.generic_request_pdu(request).await?;
+        let response: Response = bunser(&pdu_data)?;
+        Ok(response)
+    }
+
+    /// Like generic_request, but returns the undecoded response PDU so that
+    /// the caller can deserialize values that borrow from it.
+    pub(crate) async fn generic_request_pdu<Request>(
+        &mut self,
+        request: Request,
+    ) -> Result<Vec<u8>, Error>
+    where
+        Request: serde::Serialize + std::fmt::Debug,
     {
         // Step 1: serialize into a bser byte buffer
         let mut request_data = vec![];
@@ -621,7 +636,6 @@ impl ClientInner {
             error: Option<String>,
         }
 
-        // Step 5: deserialize into the caller-desired format
         let maybe_err: MaybeError = bunser(&pdu_data)?;
         if let Some(message) = maybe_err.error {
             return Err(Error::WatchmanServerError {
@@ -630,8 +644,32 @@ impl ClientInner {
             });
         }
 
-        let response: Response = bunser(&pdu_data)?;
-        Ok(response)
+        Ok(pdu_data)
+    }
+}
+
+/// The undecoded response to a query made by
+/// [Client::query_buffer](struct.Client.html#method.query_buffer).
+/// Its `decode` method yields a `QueryResult` whose file records may borrow
+/// their strings from this buffer rather than copying them out of it.
+pub struct QueryResultBuffer {
+    pdu: Vec<u8>,
+}
+
+impl QueryResultBuffer {
+    /// Decode the response. `F` may borrow from the buffer, for example by
+    /// using `&str` or `ByteStr` fields marked with `#[serde(borrow)]`, and
+    /// should deserialize the list of fields that the query asked for.
+    /// Fields of the records that `F` doesn't name are skipped over without
+    /// being decoded.
+    pub fn decode<'a, F>(&'a self) -> Result<QueryResult<F>, Error>
+    where
+        F: serde::Deserialize<'a> + std::fmt::Debug + Clone,
+    {
+        serde_bser::from_slice(&self.pdu).map_err(|source| Error::Deserialize {
+            source: Box::new(source),
+            data: self.pdu.clone(),
+        })
     }
 }
 
@@ -890,6 +928,66 @@ impl Client {
         Ok(response)
     }
 
+    /// Perform a watchman query, returning the response undecoded so that
+    /// its file records can be deserialized into a type that borrows from it.
+    /// This avoids allocating a copy of every file name for queries that
+    /// match a large number of files.
+    ///
+    /// Unlike `query`, the fields to return are taken from the `fields`
+    /// member of `query`, which should list the fields that the type passed
+    /// to `QueryResultBuffer::decode` deserializes.
+    ///
+    /// ```
+    /// use watchman_client::prelude::*;
+    /// use serde::Deserialize;
+    ///
+    /// #[derive(Deserialize, Debug, Clone)]
+    /// struct NameAndSize<'a> {
+    ///     #[serde(borrow)]
+    ///     name: ByteStr<'a>,
+    ///     size: u64,
+    /// }
+    ///
+    /// async fn query(
+    ///    client: &mut Client,
+    ///    resolved: &ResolvedRoot
+    /// ) -> Result<(), Box<dyn std::error::Error>> {
+    ///    let buffer = client
+    ///        .query_buffer(
+    ///            &resolved,
+    ///            QueryRequestCommon {
+    ///                glob: Some(vec!["**/*.rs".to_string()]),
+    ///                fields: vec!["name", "size"],
+    ///                ..Default::default()
+    ///            },
+    ///        )
+    ///        .await?;
+    ///    let response: QueryResult<NameAndSize> = buffer.decode()?;
+    ///    for file in response.files.unwrap_or_default() {
+    ///        println!("{} {}", file.name, file.size);
+    ///    }
+    ///    Ok(())
+    /// }
+    /// ```
+    pub async fn query_buffer(
+        &self,
+        root: &ResolvedRoot,
+        query: QueryRequestCommon,
+    ) -> Result<QueryResultBuffer, Error> {
+        let query = QueryRequest(
+            "query",
+            root.root.clone(),
+            QueryRequestCommon {
+                relative_root: root.relative.clone(),
+                ..query
+            },
+        );
+
+        let mut inner = self.inner.lock().await;
+        let pdu = inner.generic_request_pdu(query).await?;
+        Ok(QueryResultBuffer { pdu })
+    }
+
     /// Create a Subscription that will yield file changes as they occur in
     /// real time.
     /// The `F` type is a struct defined by the
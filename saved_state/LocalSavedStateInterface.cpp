@@ -3,7 +3,9 @@
 
 #include "watchman.h"
 #include "LocalSavedStateInterface.h"
+#include "SavedStateIndex.h"
 #include "watchman_cmd.h"
+#include <folly/FileUtil.h>
 
 static const int kDefaultMaxCommits{10};
 
@@ -28,8 +30,8 @@ LocalSavedStateInterface::LocalSavedStateInterface(
   } else {
     maxCommits_ = kDefaultMaxCommits;
   }
-  // Local path to search for saved states. This path will only ever be read,
-  // never written.
+  // Local path to search for saved states. This path is only written to by
+  // saveState().
   auto localStoragePath = savedStateConfig.get_default("local-storage-path");
   if (!localStoragePath) {
     throw QueryParseError(
@@ -54,21 +56,30 @@ LocalSavedStateInterface::getMostRecentSavedStateImpl(
     w_string_piece lookupCommitId) const {
   auto commitIds =
       scm_->getCommitsPriorToAndIncluding(lookupCommitId, maxCommits_);
+  // The saved states of all of the commits are in the same dir, so we list
+  // it rather than looking for each of them
+  std::shared_ptr<const SavedStateIndex::Names> names;
+  w_string dir;
   for (auto& commitId : commitIds) {
     auto path = getLocalPath(commitId);
+    auto pathDir = w_string_piece(path).dirName().asWString();
+    if (!names || dir != pathDir) {
+      dir = pathDir;
+      names = SavedStateIndex::get().list(dir);
+    }
     // We could return a path that no longer exists if the path is removed
     // (for example by saved state GC) after we check that the path exists
     // here, but before the client reads the state. We've explicitly chosen to
     // return the state without additional safety guarantees, and leave it to
     // the client to ensure GC happens only after states are no longer likely
     // to be used.
-    if (w_path_exists(path.c_str())) {
+    if (names &&
+        names->find(w_string_piece(path).baseName().asWString()) !=
+            names->end()) {
       log(DBG, "Found saved state for commit ", commitId, "\n");
       SavedStateInterface::SavedStateResult result;
       result.commitId = commitId;
-      result.savedStateInfo =
-          json_object({{"local-path", w_string_to_json(path)},
-                       {"commit-id", w_string_to_json(commitId)}});
+      result.savedStateInfo = savedStateInfo(path, commitId);
       return result;
     }
   }
@@ -79,6 +90,32 @@ LocalSavedStateInterface::getMostRecentSavedStateImpl(
   return result;
 }
 
+json_ref LocalSavedStateInterface::saveState(
+    w_string_piece commitId,
+    folly::StringPiece data) const {
+  auto path = getLocalPath(commitId);
+  auto dir = w_string_piece(path).dirName().asWString();
+  if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+    throw std::system_error(
+        errno,
+        std::generic_category(),
+        folly::to<std::string>("failed to create saved state dir ", dir));
+  }
+  // Written atomically so that a concurrent lookup never finds a partial
+  // state
+  folly::writeFileAtomic(path.c_str(), data, 0644);
+  log(DBG, "Saved state for commit ", commitId, " to ", path, "\n");
+  return savedStateInfo(path, commitId);
+}
+
+json_ref LocalSavedStateInterface::savedStateInfo(
+    const w_string& path,
+    w_string_piece commitId) {
+  return json_object(
+      {{"local-path", w_string_to_json(path)},
+       {"commit-id", w_string_to_json(commitId.asWString())}});
+}
+
 w_string LocalSavedStateInterface::getLocalPath(w_string_piece commitId) const {
   w_string filename;
   if (!projectMetadata_) {
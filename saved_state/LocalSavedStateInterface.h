@@ -19,15 +19,22 @@ namespace watchman {
 // saved state is not available, returns an error message in the saved state
 // info JSON. If a saved state is available, returns the local path for the
 // state in the saved state info JSON, along with the saved state commit id.
+//
+// States that are saved are written to the same place, creating the
+// project dir if need be.
 class LocalSavedStateInterface : public SavedStateInterface {
  public:
   LocalSavedStateInterface(const json_ref& savedStateConfig, const SCM* scm);
 
   SavedStateInterface::SavedStateResult getMostRecentSavedStateImpl(
       w_string_piece lookupCommitId) const override;
+  json_ref saveState(w_string_piece commitId, folly::StringPiece data)
+      const override;
   w_string getLocalPath(w_string_piece commitId) const;
 
  private:
+  static json_ref savedStateInfo(const w_string& path, w_string_piece commitId);
+
   json_int_t maxCommits_;
   w_string localStoragePath_;
   const SCM* scm_;
@@ -0,0 +1,75 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman.h"
+#include "SavedStateIndex.h"
+#include <ctime>
+#include "Logging.h"
+
+namespace watchman {
+
+namespace {
+// A dir that changed less than this long before it was listed is listed
+// again on its next use, whether or not its stat changed since
+constexpr time_t kRacySeconds = 2;
+
+bool sameDir(const FileInformation& a, const FileInformation& b) {
+  return a.ino == b.ino && a.size == b.size &&
+      a.mtime.tv_sec == b.mtime.tv_sec && a.mtime.tv_nsec == b.mtime.tv_nsec &&
+      a.ctime.tv_sec == b.ctime.tv_sec && a.ctime.tv_nsec == b.ctime.tv_nsec;
+}
+} // namespace
+
+SavedStateIndex& SavedStateIndex::get() {
+  static SavedStateIndex index;
+  return index;
+}
+
+std::shared_ptr<const SavedStateIndex::Names> SavedStateIndex::list(
+    const w_string& dir) {
+  struct stat st;
+  if (stat(dir.c_str(), &st) != 0) {
+    state_.lock()->dirs.erase(dir);
+    return nullptr;
+  }
+  FileInformation info(st);
+
+  {
+    auto state = state_.lock();
+    auto it = state->dirs.find(dir);
+    if (it != state->dirs.end() && !it->second.racy &&
+        sameDir(it->second.info, info)) {
+      return it->second.names;
+    }
+  }
+
+  auto names = std::make_shared<Names>();
+  try {
+    auto handle = w_dir_open(dir.c_str(), /* strict= */ false);
+    while (auto ent = handle->readDir()) {
+      if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+        continue;
+      }
+      names->insert(w_string(ent->d_name, W_STRING_BYTE));
+    }
+  } catch (const std::system_error& exc) {
+    log(ERR, "failed to list saved states in ", dir, ": ", exc.what(), "\n");
+    state_.lock()->dirs.erase(dir);
+    return nullptr;
+  }
+
+  Listing listing;
+  listing.info = info;
+  listing.racy = time(nullptr) - info.mtime.tv_sec < kRacySeconds;
+  listing.names = std::move(names);
+
+  auto state = state_.lock();
+  state->numListings++;
+  state->dirs[dir] = listing;
+  return listing.names;
+}
+
+size_t SavedStateIndex::numListings() const {
+  return state_.lock()->numListings;
+}
+
+} // namespace watchman
@@ -0,0 +1,49 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include "watchman_string.h"
+#include <folly/Synchronized.h>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include "FileInformation.h"
+
+namespace watchman {
+
+// Remembers the names of the entries of the saved state storage dirs that
+// it has been asked about, so that looking for the saved state of each of
+// a number of commits costs a single stat of the dir rather than a stat
+// for each commit.  A dir is listed again when its stat shows that it has
+// changed since it was last listed.
+class SavedStateIndex {
+ public:
+  using Names = std::unordered_set<w_string>;
+
+  // The index that is shared by all queries
+  static SavedStateIndex& get();
+
+  // Returns the names of the entries of dir, or nullptr if it doesn't
+  // exist or can't be read
+  std::shared_ptr<const Names> list(const w_string& dir);
+
+  // How many times a dir has been listed
+  size_t numListings() const;
+
+ private:
+  struct Listing {
+    FileInformation info;
+    // True if the dir changed so recently that another change within the
+    // resolution of its mtime may not be in names
+    bool racy{false};
+    std::shared_ptr<const Names> names;
+  };
+  struct State {
+    std::unordered_map<w_string, Listing> dirs;
+    size_t numListings{0};
+  };
+  mutable folly::Synchronized<State, std::mutex> state_;
+};
+
+} // namespace watchman
@@ -67,4 +67,9 @@ SavedStateInterface::getMostRecentSavedState(
     return result;
   }
 }
+
+json_ref SavedStateInterface::saveState(w_string_piece, folly::StringPiece)
+    const {
+  throw std::runtime_error("saved states can't be saved to this storage type");
+}
 } // namespace watchman
@@ -3,6 +3,7 @@
 #pragma once
 
 #include "watchman.h"
+#include <folly/Range.h>
 #include "thirdparty/jansson/jansson.h"
 
 namespace watchman {
@@ -44,6 +45,13 @@ class SavedStateInterface {
   // the storage type.
   SavedStateResult getMostRecentSavedState(w_string_piece lookupCommitId) const;
 
+  // Records data as the saved state for commitId, replacing any that was
+  // saved for it before, and returns the saved state info that a lookup of
+  // the commit will find.  Throws if the storage type can't be written to
+  // or if the write fails.
+  virtual json_ref saveState(w_string_piece commitId, folly::StringPiece data)
+      const;
+
  protected:
   w_string project_;
   w_string projectMetadata_;
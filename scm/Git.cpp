@@ -0,0 +1,981 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman.h"
+#include "Git.h"
+#include <folly/FileUtil.h>
+#include <folly/ScopeGuard.h>
+#include <folly/String.h>
+#include <folly/lang/Bits.h>
+#include <queue>
+#include <unordered_set>
+#include "FileSystem.h"
+#include "Logging.h"
+#include "WildMatcher.h"
+#include "watchman_opendir.h"
+
+// Capability indicating support for the git SCM
+W_CAP_REG("scm-git")
+
+using namespace std::chrono;
+using folly::to;
+
+namespace watchman {
+
+namespace {
+constexpr size_t kMergeBaseCacheSize = 64;
+constexpr size_t kDiffCacheSize = 64;
+// Symbolic refs that point to symbolic refs are followed this far
+constexpr int kMaxRefDepth = 5;
+// Tags that point to tags are followed this far
+constexpr int kMaxTagDepth = 10;
+
+constexpr uint32_t kModeTypeMask = 0170000;
+constexpr uint32_t kModeTree = 0040000;
+constexpr uint32_t kModeSymlink = 0120000;
+constexpr uint32_t kModeGitlink = 0160000;
+
+std::string rtrim(std::string str) {
+  while (!str.empty() && isspace(static_cast<unsigned char>(str.back()))) {
+    str.pop_back();
+  }
+  return str;
+}
+
+bool isAbsolute(const std::string& path) {
+  return w_string_piece(path).pathIsAbsolute();
+}
+
+// The .git of a worktree or a submodule is a file that names the real
+// git dir
+std::string findGitDir(const w_string& scmRoot) {
+  auto dotGit = to<std::string>(scmRoot, "/.git");
+  std::string contents;
+  if (!folly::readFile(dotGit.c_str(), contents)) {
+    return dotGit;
+  }
+  folly::StringPiece target(contents);
+  if (!target.removePrefix("gitdir: ")) {
+    return dotGit;
+  }
+  auto dir = rtrim(target.str());
+  return isAbsolute(dir) ? dir : to<std::string>(scmRoot, "/", dir);
+}
+
+// The git dir of a worktree names the git dir of the repository that it
+// shares the objects and refs of
+std::string findCommonDir(const std::string& gitDir) {
+  std::string contents;
+  auto path = to<std::string>(gitDir, "/commondir");
+  if (!folly::readFile(path.c_str(), contents)) {
+    return gitDir;
+  }
+  auto dir = rtrim(std::move(contents));
+  return isAbsolute(dir) ? dir : to<std::string>(gitDir, "/", dir);
+}
+
+std::string findRootPrefix(const w_string& rootPath, const w_string& scmRoot) {
+  if (rootPath.size() <= scmRoot.size()) {
+    return std::string();
+  }
+  std::string prefix(
+      rootPath.data() + scmRoot.size() + 1,
+      rootPath.size() - scmRoot.size() - 1);
+#ifdef _WIN32
+  std::replace(prefix.begin(), prefix.end(), '\\', '/');
+#endif
+  prefix.push_back('/');
+  return prefix;
+}
+
+// Ref names come from clients, so keep them inside of the git dir
+bool isSafeRefName(folly::StringPiece name) {
+  return !name.empty() && name.front() != '/' &&
+      name.find("..") == folly::StringPiece::npos &&
+      name.find('\\') == folly::StringPiece::npos;
+}
+
+// Refs that each worktree has its own of
+bool isPerWorktreeRef(folly::StringPiece name) {
+  return name.find('/') == folly::StringPiece::npos ||
+      name.startsWith("refs/bisect/") || name.startsWith("refs/worktree/") ||
+      name.startsWith("refs/rewritten/");
+}
+
+// The names that git tries, in order, for a revision that isn't an id
+std::vector<std::string> refCandidates(const std::string& name) {
+  if (name == "HEAD" || folly::StringPiece(name).startsWith("refs/")) {
+    return {name};
+  }
+  std::vector<std::string> candidates;
+  if (std::all_of(name.begin(), name.end(), [](char c) {
+        return (c >= 'A' && c <= 'Z') || c == '_';
+      })) {
+    // ORIG_HEAD and friends
+    candidates.push_back(name);
+  }
+  candidates.push_back(to<std::string>("refs/", name));
+  candidates.push_back(to<std::string>("refs/tags/", name));
+  candidates.push_back(to<std::string>("refs/heads/", name));
+  candidates.push_back(to<std::string>("refs/remotes/", name));
+  candidates.push_back(to<std::string>("refs/remotes/", name, "/HEAD"));
+  return candidates;
+}
+
+FileInformation lstatPath(const std::string& path) {
+#ifndef _WIN32
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) {
+    throw std::system_error(errno, std::generic_category(), "lstat");
+  }
+  return FileInformation(st);
+#else
+  return getFileInformation(path.c_str(), CaseSensitivity::CaseSensitive);
+#endif
+}
+
+bool fileExists(const std::string& path) {
+  try {
+    lstatPath(path);
+    return true;
+  } catch (const std::system_error&) {
+    return false;
+  }
+}
+
+// An entry of the index, as described in git's index-format.txt
+struct IndexEntry {
+  std::string path;
+  GitOid oid;
+  uint32_t mode;
+  uint32_t mtimeSec;
+  uint32_t mtimeNsec;
+  uint32_t size;
+  int stage;
+  bool skipWorktree;
+};
+
+uint32_t loadBig32(const char* p) {
+  return folly::Endian::big(folly::loadUnaligned<uint32_t>(p));
+}
+
+uint16_t loadBig16(const char* p) {
+  return folly::Endian::big(folly::loadUnaligned<uint16_t>(p));
+}
+
+std::vector<IndexEntry> readIndex(const std::string& path) {
+  std::vector<IndexEntry> entries;
+  std::string data;
+  if (!folly::readFile(path.c_str(), data)) {
+    // A repository that has never had anything added has no index
+    return entries;
+  }
+  if (data.size() < 12 || memcmp(data.data(), "DIRC", 4) != 0) {
+    throw SCMError("malformed git index ", path);
+  }
+  auto version = loadBig32(data.data() + 4);
+  if (version < 2 || version > 4) {
+    throw SCMError("unsupported git index version ", version);
+  }
+  auto count = loadBig32(data.data() + 8);
+  entries.reserve(count);
+
+  const char* p = data.data() + 12;
+  // The trailing checksum isn't part of the entries or the extensions
+  const char* end = data.data() + data.size() - 20;
+  auto truncated = [&path]() { return SCMError("truncated git index ", path); };
+
+  std::string previous;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (end - p < 62) {
+      throw truncated();
+    }
+    IndexEntry entry;
+    entry.mtimeSec = loadBig32(p + 8);
+    entry.mtimeNsec = loadBig32(p + 12);
+    entry.mode = loadBig32(p + 24);
+    entry.size = loadBig32(p + 36);
+    entry.oid = GitOid::fromBytes(reinterpret_cast<const uint8_t*>(p + 40));
+    auto flags = loadBig16(p + 60);
+    entry.stage = (flags >> 12) & 3;
+    size_t headerSize = 62;
+    uint16_t extendedFlags = 0;
+    if (flags & 0x4000) {
+      if (version < 3 || end - p < 64) {
+        throw truncated();
+      }
+      extendedFlags = loadBig16(p + 62);
+      headerSize = 64;
+    }
+    entry.skipWorktree = extendedFlags & 0x4000;
+    auto name = p + headerSize;
+
+    if (version == 4) {
+      // The name drops some bytes from the end of the previous name, and
+      // then adds its own
+      uint64_t strip = 0;
+      uint8_t c;
+      do {
+        if (name == end) {
+          throw truncated();
+        }
+        c = uint8_t(*name++);
+        strip = (strip << 7) | (c & 0x7f);
+        if (c & 0x80) {
+          ++strip;
+        }
+      } while (c & 0x80);
+      auto nul = static_cast<const char*>(memchr(name, 0, end - name));
+      if (!nul || strip > previous.size()) {
+        throw truncated();
+      }
+      entry.path = previous.substr(0, previous.size() - strip);
+      entry.path.append(name, nul - name);
+      p = nul + 1;
+    } else {
+      size_t nameLength = flags & 0xfff;
+      if (nameLength == 0xfff) {
+        auto nul = static_cast<const char*>(memchr(name, 0, end - name));
+        if (!nul) {
+          throw truncated();
+        }
+        nameLength = nul - name;
+      }
+      // Entries are padded with NULs to a multiple of 8 bytes
+      auto entrySize = (headerSize + nameLength + 8) & ~size_t(7);
+      if (size_t(end - p) < entrySize) {
+        throw truncated();
+      }
+      entry.path.assign(name, nameLength);
+      p += entrySize;
+    }
+
+    previous = entry.path;
+    entries.push_back(std::move(entry));
+  }
+
+  while (end - p >= 8) {
+    if (memcmp(p, "link", 4) == 0) {
+      // The entries are spread over this index and a shared one
+      throw SCMError("split git indices are not supported");
+    }
+    p += 8 + size_t(loadBig32(p + 4));
+  }
+  return entries;
+}
+
+// The patterns of the .gitignore files that apply to a directory, and of
+// info/exclude, as described in gitignore(5)
+class GitIgnore {
+ public:
+  // Adds the patterns of the file at path, which are relative to the
+  // directory base; base is empty or ends in a slash
+  void push(const std::string& base, const std::string& path) {
+    Level level{base, {}};
+    std::string contents;
+    if (folly::readFile(path.c_str(), contents)) {
+      std::vector<folly::StringPiece> lines;
+      folly::split('\n', contents, lines);
+      for (auto& line : lines) {
+        parse(line.str(), level.patterns);
+      }
+    }
+    levels_.push_back(std::move(level));
+  }
+
+  void pop() {
+    levels_.pop_back();
+  }
+
+  bool ignored(const std::string& path, bool isDir) const {
+    auto slash = path.rfind('/');
+    const char* baseName =
+        path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+
+    // The deepest files win, and within a file the last pattern wins
+    for (auto level = levels_.rbegin(); level != levels_.rend(); ++level) {
+      const char* relative = path.c_str() + level->base.size();
+      for (auto pattern = level->patterns.rbegin();
+           pattern != level->patterns.rend();
+           ++pattern) {
+        if (pattern->dirOnly && !isDir) {
+          continue;
+        }
+        if (pattern->matcher.match(
+                w_string_piece(pattern->baseNameOnly ? baseName : relative))) {
+          return !pattern->negate;
+        }
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct Pattern {
+    WildMatcher matcher;
+    bool negate;
+    bool dirOnly;
+    // Patterns without a slash match the name at any depth
+    bool baseNameOnly;
+  };
+  struct Level {
+    std::string base;
+    std::vector<Pattern> patterns;
+  };
+
+  static void parse(std::string line, std::vector<Pattern>& patterns) {
+    // Trailing spaces are ignored unless they are escaped
+    while (!line.empty() &&
+           (line.back() == ' ' || line.back() == '\t' || line.back() == '\r') &&
+           !(line.size() > 1 && line[line.size() - 2] == '\\')) {
+      line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') {
+      return;
+    }
+    bool negate = false;
+    if (line[0] == '!') {
+      negate = true;
+      line.erase(0, 1);
+    } else if (line[0] == '\\' && line.size() > 1 &&
+               (line[1] == '#' || line[1] == '!')) {
+      line.erase(0, 1);
+    }
+    bool dirOnly = false;
+    if (!line.empty() && line.back() == '/') {
+      dirOnly = true;
+      line.pop_back();
+    }
+    bool baseNameOnly = line.find('/') == std::string::npos;
+    if (!baseNameOnly && line[0] == '/') {
+      line.erase(0, 1);
+    }
+    if (line.empty()) {
+      return;
+    }
+    patterns.push_back(
+        Pattern{WildMatcher(line, WM_PATHNAME), negate, dirOnly, baseNameOnly});
+  }
+
+  std::vector<Level> levels_;
+};
+
+// Adds the files under the directory dir of the repository at top that
+// are neither tracked nor ignored to paths; dir is empty or ends in a
+// slash
+void findUntracked(
+    const std::string& top,
+    const std::string& dir,
+    const std::unordered_set<std::string>& tracked,
+    GitIgnore& ignore,
+    std::set<std::string>& paths) {
+  auto fullDir = to<std::string>(top, "/", dir);
+  std::vector<std::pair<std::string, DType>> children;
+  bool hasIgnoreFile = false;
+  try {
+    auto handle = w_dir_open(fullDir.c_str());
+    while (auto ent = handle->readDir()) {
+      folly::StringPiece name(ent->d_name);
+      if (name == "." || name == ".." || name == ".git") {
+        continue;
+      }
+      if (name == ".gitignore") {
+        hasIgnoreFile = true;
+      }
+      children.emplace_back(name.str(), ent->d_type);
+    }
+  } catch (const std::system_error& exc) {
+    log(DBG, "failed to read ", fullDir, ": ", exc.what(), "\n");
+    return;
+  }
+
+  if (hasIgnoreFile) {
+    ignore.push(dir, to<std::string>(fullDir, ".gitignore"));
+  }
+  SCOPE_EXIT {
+    if (hasIgnoreFile) {
+      ignore.pop();
+    }
+  };
+
+  for (auto& child : children) {
+    auto path = to<std::string>(dir, child.first);
+    auto dtype = child.second;
+    if (dtype == DType::Unknown) {
+      try {
+        dtype = lstatPath(to<std::string>(top, "/", path)).dtype();
+      } catch (const std::system_error&) {
+        continue;
+      }
+    }
+    bool isDir = dtype == DType::Dir;
+    if (ignore.ignored(path, isDir)) {
+      continue;
+    }
+    if (!isDir) {
+      if (tracked.find(path) == tracked.end()) {
+        paths.insert(std::move(path));
+      }
+      continue;
+    }
+    // Submodules and other repositories are left to themselves
+    if (tracked.find(path) != tracked.end() ||
+        fileExists(to<std::string>(top, "/", path, "/.git"))) {
+      continue;
+    }
+    findUntracked(top, to<std::string>(path, "/"), tracked, ignore, paths);
+  }
+}
+
+// Orders tree entries as git does, where trees sort as if their names
+// ended in a slash
+int compareTreeEntries(const GitTreeEntry& a, const GitTreeEntry& b) {
+  auto len = std::min(a.name.size(), b.name.size());
+  auto cmp = memcmp(a.name.data(), b.name.data(), len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  auto next = [len](const GitTreeEntry& entry) -> int {
+    if (entry.name.size() > len) {
+      return static_cast<unsigned char>(entry.name[len]);
+    }
+    return entry.isTree() ? '/' : 0;
+  };
+  return next(a) - next(b);
+}
+} // namespace
+
+Git::Git(w_string_piece rootPath, w_string_piece scmRoot)
+    : SCM(rootPath, scmRoot),
+      gitDir_(findGitDir(getSCMRoot())),
+      commonDir_(findCommonDir(gitDir_)),
+      rootPrefix_(findRootPrefix(getRootPath(), getSCMRoot())),
+      objects_(to<std::string>(commonDir_, "/objects")),
+      mergeBases_(kMergeBaseCacheSize, milliseconds(0)),
+      diffs_(kDiffCacheSize, milliseconds(0)) {}
+
+std::shared_ptr<const std::unordered_map<std::string, GitOid>>
+Git::packedRefs() const {
+  auto path = to<std::string>(commonDir_, "/packed-refs");
+  FileInformation info;
+  try {
+    info = lstatPath(path);
+  } catch (const std::system_error&) {
+    // No packed refs
+  }
+
+  auto cache = packedRefs_.lock();
+  if (cache->refs && info.size == cache->info.size &&
+      info.mtime.tv_sec == cache->info.mtime.tv_sec &&
+      info.mtime.tv_nsec == cache->info.mtime.tv_nsec) {
+    return cache->refs;
+  }
+
+  auto refs = std::make_shared<std::unordered_map<std::string, GitOid>>();
+  std::string contents;
+  if (folly::readFile(path.c_str(), contents)) {
+    std::vector<folly::StringPiece> lines;
+    folly::split('\n', contents, lines);
+    for (auto& line : lines) {
+      // <hex> <name>, with comments and the peeled targets of tags, which
+      // start with ^, mixed in
+      if (line.size() < 42 || line[40] != ' ') {
+        continue;
+      }
+      auto oid = GitOid::fromHex(line.subpiece(0, 40));
+      if (oid) {
+        (*refs)[rtrim(line.subpiece(41).str())] = *oid;
+      }
+    }
+  }
+  cache->info = info;
+  cache->refs = refs;
+  return refs;
+}
+
+folly::Optional<GitOid> Git::readRef(const std::string& name, int depth) const {
+  if (depth > kMaxRefDepth) {
+    throw SCMError("too many levels of symbolic git refs at ", name);
+  }
+  if (!isSafeRefName(name)) {
+    return folly::none;
+  }
+
+  auto path = to<std::string>(
+      isPerWorktreeRef(name) ? gitDir_ : commonDir_, "/", name);
+  std::string contents;
+  if (folly::readFile(path.c_str(), contents)) {
+    contents = rtrim(std::move(contents));
+    folly::StringPiece target(contents);
+    if (target.removePrefix("ref: ")) {
+      return readRef(target.str(), depth + 1);
+    }
+    return GitOid::fromHex(contents);
+  }
+
+  auto refs = packedRefs();
+  auto it = refs->find(name);
+  if (it != refs->end()) {
+    return it->second;
+  }
+  return folly::none;
+}
+
+folly::Optional<GitOid> Git::resolveRef(const std::string& name) const {
+  for (auto& candidate : refCandidates(name)) {
+    if (auto oid = readRef(candidate, 0)) {
+      return oid;
+    }
+  }
+  return folly::none;
+}
+
+GitOid Git::resolveCommit(w_string_piece rev) const {
+  std::string name(rev.data(), rev.size());
+  auto oid = GitOid::fromHex(name);
+  if (!oid) {
+    oid = resolveRef(name);
+  }
+  if (!oid) {
+    throw SCMError("unknown git revision ", name);
+  }
+
+  // Annotated tags point to the commit through tag objects
+  for (int depth = 0; depth < kMaxTagDepth; ++depth) {
+    auto object = objects_.read(*oid);
+    if (object->type == GitObjectType::Commit) {
+      return *oid;
+    }
+    if (object->type != GitObjectType::Tag) {
+      throw SCMError("git revision ", name, " is not a commit");
+    }
+    oid = parseGitTagTarget(object->data);
+  }
+  throw SCMError("too many levels of git tags at ", name);
+}
+
+GitOid Git::mergeBase(const GitOid& a, const GitOid& b) const {
+  if (a == b) {
+    return a;
+  }
+  auto key = to<std::string>(a.asKey(), b.asKey());
+  if (auto node = mergeBases_.get(key)) {
+    return node->value();
+  }
+
+  // Walk back from both commits, newest first, marking the commits that
+  // each can reach; the first that both can reach is the merge base.
+  // When there is more than one merge base, this is the most recent of
+  // them, as `hg log -r 'ancestor(.,x)'` would pick.
+  enum : uint8_t { kFromA = 1, kFromB = 2 };
+  struct Node {
+    uint8_t flags;
+    GitCommit commit;
+  };
+  std::unordered_map<GitOid, Node, GitOidHasher> nodes;
+  using Item = std::pair<int64_t, GitOid>;
+  auto older = [](const Item& x, const Item& y) { return x.first < y.first; };
+  std::priority_queue<Item, std::vector<Item>, decltype(older)> queue(older);
+
+  auto paint = [&](const GitOid& oid, uint8_t flags) {
+    auto it = nodes.find(oid);
+    if (it == nodes.end()) {
+      it = nodes.emplace(oid, Node{0, objects_.readCommit(oid)}).first;
+    }
+    if ((it->second.flags & flags) == flags) {
+      return;
+    }
+    it->second.flags |= flags;
+    queue.emplace(it->second.commit.time, oid);
+  };
+
+  paint(a, kFromA);
+  paint(b, kFromB);
+  while (!queue.empty()) {
+    auto oid = queue.top().second;
+    queue.pop();
+    auto& node = nodes.at(oid);
+    if (node.flags == (kFromA | kFromB)) {
+      mergeBases_.set(key, GitOid(oid));
+      return oid;
+    }
+    auto flags = node.flags;
+    auto parents = node.commit.parents;
+    for (auto& parent : parents) {
+      paint(parent, flags);
+    }
+  }
+  throw SCMError(
+      "git commits ", a.toHex(), " and ", b.toHex(), " have no merge base");
+}
+
+void Git::listTree(
+    const GitOid& tree,
+    const std::string& prefix,
+    std::vector<w_string>& paths) const {
+  auto object = objects_.read(tree);
+  for (auto& entry : parseGitTree(object->data)) {
+    auto path = to<std::string>(prefix, entry.name);
+    if (entry.isTree()) {
+      listTree(entry.oid, to<std::string>(path, "/"), paths);
+    } else {
+      paths.emplace_back(path.data(), path.size());
+    }
+  }
+}
+
+void Git::diffTrees(
+    const GitOid* a,
+    const GitOid* b,
+    const std::string& prefix,
+    SCM::StatusResult& result) const {
+  if (a && b && *a == *b) {
+    return;
+  }
+  std::shared_ptr<const GitObject> treeA;
+  std::shared_ptr<const GitObject> treeB;
+  std::vector<GitTreeEntry> entriesA;
+  std::vector<GitTreeEntry> entriesB;
+  if (a) {
+    treeA = objects_.read(*a);
+    entriesA = parseGitTree(treeA->data);
+  }
+  if (b) {
+    treeB = objects_.read(*b);
+    entriesB = parseGitTree(treeB->data);
+  }
+
+  auto removed = [&](const GitTreeEntry& entry) {
+    auto path = to<std::string>(prefix, entry.name);
+    if (entry.isTree()) {
+      listTree(entry.oid, to<std::string>(path, "/"), result.removedFiles);
+    } else {
+      result.removedFiles.emplace_back(path.data(), path.size());
+    }
+  };
+  auto added = [&](const GitTreeEntry& entry) {
+    auto path = to<std::string>(prefix, entry.name);
+    if (entry.isTree()) {
+      listTree(entry.oid, to<std::string>(path, "/"), result.addedFiles);
+    } else {
+      result.addedFiles.emplace_back(path.data(), path.size());
+    }
+  };
+
+  // Both trees are sorted, so walk them together.  A tree and a file of
+  // the same name don't sort together, so they come out as the removal of
+  // one and the addition of the other.
+  size_t i = 0;
+  size_t j = 0;
+  while (i < entriesA.size() || j < entriesB.size()) {
+    int cmp = i == entriesA.size()
+        ? 1
+        : j == entriesB.size() ? -1
+                               : compareTreeEntries(entriesA[i], entriesB[j]);
+    if (cmp < 0) {
+      removed(entriesA[i++]);
+    } else if (cmp > 0) {
+      added(entriesB[j++]);
+    } else {
+      auto& entryA = entriesA[i++];
+      auto& entryB = entriesB[j++];
+      if (entryA.oid == entryB.oid && entryA.mode == entryB.mode) {
+        continue;
+      }
+      auto path = to<std::string>(prefix, entryA.name);
+      if (entryA.isTree()) {
+        diffTrees(
+            &entryA.oid, &entryB.oid, to<std::string>(path, "/"), result);
+      } else {
+        result.changedFiles.emplace_back(path.data(), path.size());
+      }
+    }
+  }
+}
+
+std::shared_ptr<const Git::FlatTree> Git::flattenTree(
+    const GitOid& tree) const {
+  {
+    auto cached = flatTree_.lock();
+    if (cached->second && cached->first == tree) {
+      return cached->second;
+    }
+  }
+
+  auto flat = std::make_shared<FlatTree>();
+  std::vector<std::pair<GitOid, std::string>> pending{{tree, std::string()}};
+  while (!pending.empty()) {
+    auto dir = std::move(pending.back());
+    pending.pop_back();
+    auto object = objects_.read(dir.first);
+    for (auto& entry : parseGitTree(object->data)) {
+      auto path = to<std::string>(dir.second, entry.name);
+      if (entry.isTree()) {
+        pending.emplace_back(entry.oid, to<std::string>(path, "/"));
+      } else {
+        flat->emplace(std::move(path), TrackedFile{entry.oid, entry.mode});
+      }
+    }
+  }
+
+  *flatTree_.lock() = std::make_pair(tree, flat);
+  return flat;
+}
+
+void Git::workingCopyChanges(const GitOid& head, std::set<std::string>& paths)
+    const {
+  auto top = to<std::string>(getSCMRoot());
+  auto indexPath = to<std::string>(gitDir_, "/index");
+  FileInformation indexInfo;
+  try {
+    indexInfo = lstatPath(indexPath);
+  } catch (const std::system_error&) {
+    // There is no index
+  }
+  auto entries = readIndex(indexPath);
+  auto headTree = flattenTree(objects_.readCommit(head).tree);
+
+  std::unordered_set<std::string> tracked;
+  std::vector<std::string> sparseDirs;
+  tracked.reserve(entries.size());
+  for (auto& entry : entries) {
+    tracked.insert(entry.path);
+    if (!underRoot(entry.path)) {
+      continue;
+    }
+    auto type = entry.mode & kModeTypeMask;
+    if (type == kModeTree) {
+      // A sparse index stands in for the files under this directory
+      sparseDirs.push_back(to<std::string>(entry.path, "/"));
+      continue;
+    }
+    if (entry.stage != 0) {
+      // Unmerged
+      paths.insert(entry.path);
+      continue;
+    }
+
+    // Staged changes
+    auto it = headTree->find(entry.path);
+    if (it == headTree->end() || it->second.oid != entry.oid ||
+        it->second.mode != entry.mode) {
+      paths.insert(entry.path);
+      continue;
+    }
+    if (entry.skipWorktree || type == kModeGitlink) {
+      continue;
+    }
+
+    // Unstaged changes, which git would find the same way before hashing
+    // the file to be sure.  Files that changed in the same second as the
+    // index was written may have changed since, so they count as changed.
+    FileInformation info;
+    try {
+      info = lstatPath(to<std::string>(top, "/", entry.path));
+    } catch (const std::system_error&) {
+      paths.insert(entry.path);
+      continue;
+    }
+    bool isSymlink = type == kModeSymlink;
+    if (isSymlink != info.isSymlink() || (!isSymlink && !info.isFile()) ||
+        uint32_t(info.size) != entry.size ||
+        uint32_t(info.mtime.tv_sec) != entry.mtimeSec ||
+        (entry.mtimeNsec != 0 &&
+         uint32_t(info.mtime.tv_nsec) != entry.mtimeNsec) ||
+        info.mtime.tv_sec >= indexInfo.mtime.tv_sec) {
+      paths.insert(entry.path);
+      continue;
+    }
+#ifndef _WIN32
+    if (!isSymlink && bool(entry.mode & 0100) != bool(info.mode & S_IXUSR)) {
+      paths.insert(entry.path);
+    }
+#endif
+  }
+
+  // Files that were removed from the index
+  for (auto& file : *headTree) {
+    if (!underRoot(file.first) || tracked.find(file.first) != tracked.end()) {
+      continue;
+    }
+    if (std::any_of(
+            sparseDirs.begin(), sparseDirs.end(), [&](const std::string& dir) {
+              return folly::StringPiece(file.first).startsWith(dir);
+            })) {
+      continue;
+    }
+    paths.insert(file.first);
+  }
+
+  // Files that aren't tracked, and aren't ignored.  The ignore files of
+  // the directories above the root apply to it too.
+  GitIgnore ignore;
+  auto xdgConfig = getenv("XDG_CONFIG_HOME");
+  auto home = getenv("HOME");
+  if (xdgConfig && *xdgConfig) {
+    ignore.push(std::string(), to<std::string>(xdgConfig, "/git/ignore"));
+  } else if (home && *home) {
+    ignore.push(std::string(), to<std::string>(home, "/.config/git/ignore"));
+  }
+  ignore.push(std::string(), to<std::string>(commonDir_, "/info/exclude"));
+  size_t pos = 0;
+  while (true) {
+    auto slash = rootPrefix_.find('/', pos);
+    if (slash == std::string::npos) {
+      break;
+    }
+    auto dir = rootPrefix_.substr(0, pos);
+    ignore.push(dir, to<std::string>(top, "/", dir, ".gitignore"));
+    pos = slash + 1;
+  }
+  findUntracked(top, rootPrefix_, tracked, ignore, paths);
+}
+
+bool Git::underRoot(const std::string& path) const {
+  return folly::StringPiece(path).startsWith(rootPrefix_);
+}
+
+std::vector<w_string> Git::relativeToRoot(
+    const std::vector<w_string>& paths) const {
+  std::vector<w_string> result;
+  result.reserve(paths.size());
+  for (auto& path : paths) {
+    w_string_piece piece(path);
+    if (piece.startsWith(rootPrefix_)) {
+      result.emplace_back(
+          piece.data() + rootPrefix_.size(), piece.size() - rootPrefix_.size());
+    }
+  }
+  return result;
+}
+
+w_string Git::getDirStateToken() const {
+  // A checkout or commit rewrites the index, but moving HEAD with
+  // `git reset --soft` doesn't
+  auto path = to<std::string>(gitDir_, "/index");
+  try {
+    auto info = lstatPath(path);
+    return w_string::format(
+        "{}:{}:{}.{}:{}",
+        info.ino,
+        info.size,
+        info.mtime.tv_sec,
+        info.mtime.tv_nsec,
+        resolveCommit("HEAD").toHex());
+  } catch (const std::exception& exc) {
+    log(DBG,
+        "failed to compute the dirstate token of ",
+        path,
+        ": ",
+        exc.what(),
+        "\n");
+    return nullptr;
+  }
+}
+
+w_string Git::mergeBaseWith(
+    w_string_piece commitId,
+    w_string /* requestId */) const {
+  auto head = resolveCommit("HEAD");
+  auto base = mergeBase(head, resolveCommit(commitId));
+  auto hex = base.toHex();
+  log(DBG, "git merge base of HEAD and ", commitId, " is ", hex, "\n");
+  return w_string(hex.data(), hex.size());
+}
+
+std::vector<w_string> Git::getFilesChangedSinceMergeBaseWith(
+    w_string_piece commitId,
+    w_string /* requestId */) const {
+  // Like `hg status --rev commitId`, this is the difference between the
+  // commit and the working copy, which is made up of the difference
+  // between the commit and HEAD and that between HEAD and the working copy
+  auto head = resolveCommit("HEAD");
+  auto base = resolveCommit(commitId);
+
+  std::set<std::string> paths;
+  auto committed = getFilesChangedBetweenCommits(
+      w_string_piece(base.toHex()), w_string_piece(head.toHex()));
+  for (auto files :
+       {&committed.changedFiles,
+        &committed.addedFiles,
+        &committed.removedFiles}) {
+    for (auto& file : *files) {
+      paths.insert(to<std::string>(rootPrefix_, file));
+    }
+  }
+  workingCopyChanges(head, paths);
+
+  std::vector<w_string> result;
+  result.reserve(paths.size());
+  for (auto& path : paths) {
+    if (underRoot(path)) {
+      result.emplace_back(
+          path.data() + rootPrefix_.size(), path.size() - rootPrefix_.size());
+    }
+  }
+  return result;
+}
+
+SCM::StatusResult Git::getFilesChangedBetweenCommits(
+    w_string_piece commitA,
+    w_string_piece commitB,
+    w_string /* requestId */) const {
+  auto a = resolveCommit(commitA);
+  auto b = resolveCommit(commitB);
+  auto key = to<std::string>(a.asKey(), b.asKey());
+
+  std::shared_ptr<const LRUCache<std::string, SCM::StatusResult>::NodeType>
+      node = diffs_.get(key);
+  if (!node) {
+    auto treeA = objects_.readCommit(a).tree;
+    auto treeB = objects_.readCommit(b).tree;
+    SCM::StatusResult diff;
+    diffTrees(&treeA, &treeB, std::string(), diff);
+    log(DBG,
+        "git diff of ",
+        a.toHex(),
+        " and ",
+        b.toHex(),
+        ": ",
+        diff.changedFiles.size(),
+        " changed, ",
+        diff.addedFiles.size(),
+        " added, ",
+        diff.removedFiles.size(),
+        " removed\n");
+    node = diffs_.set(key, std::move(diff));
+  }
+
+  auto& diff = node->value();
+  SCM::StatusResult result;
+  result.changedFiles = relativeToRoot(diff.changedFiles);
+  result.addedFiles = relativeToRoot(diff.addedFiles);
+  result.removedFiles = relativeToRoot(diff.removedFiles);
+  return result;
+}
+
+time_point<system_clock> Git::getCommitDate(
+    w_string_piece commitId,
+    w_string /* requestId */) const {
+  auto commit = objects_.readCommit(resolveCommit(commitId));
+  return system_clock::from_time_t(time_t(commit.time));
+}
+
+std::vector<w_string> Git::getCommitsPriorToAndIncluding(
+    w_string_piece commitId,
+    int numCommits,
+    w_string /* requestId */) const {
+  std::vector<w_string> result;
+  auto oid = resolveCommit(commitId);
+  for (int i = 0; i < numCommits; ++i) {
+    auto hex = oid.toHex();
+    result.emplace_back(hex.data(), hex.size());
+    auto commit = objects_.readCommit(oid);
+    if (commit.parents.empty()) {
+      break;
+    }
+    // Follow the first parents, as _firstancestors does for hg
+    oid = commit.parents[0];
+  }
+  return result;
+}
+} // namespace watchman
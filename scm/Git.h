@@ -0,0 +1,107 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+
+#include <folly/Synchronized.h>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "FileInformation.h"
+#include "GitObjectStore.h"
+#include "LRUCache.h"
+#include "SCM.h"
+
+namespace watchman {
+
+// An SCM for git repositories that reads the repository itself, rather
+// than running git: refs and packed-refs to resolve revisions, the
+// commit-graph and objects to walk history and diff trees, and the index
+// and working copy to compute the status.
+class Git : public SCM {
+ public:
+  Git(w_string_piece rootPath, w_string_piece scmRoot);
+  w_string mergeBaseWith(w_string_piece commitId, w_string requestId = nullptr)
+      const override;
+  std::vector<w_string> getFilesChangedSinceMergeBaseWith(
+      w_string_piece commitId,
+      w_string requestId = nullptr) const override;
+  SCM::StatusResult getFilesChangedBetweenCommits(
+      w_string_piece commitA,
+      w_string_piece commitB,
+      w_string requestId = nullptr) const override;
+  std::chrono::time_point<std::chrono::system_clock> getCommitDate(
+      w_string_piece commitId,
+      w_string requestId = nullptr) const override;
+  std::vector<w_string> getCommitsPriorToAndIncluding(
+      w_string_piece commitId,
+      int numCommits,
+      w_string requestId = nullptr) const override;
+  w_string getDirStateToken() const override;
+
+ private:
+  // A file in a tree, or in the index
+  struct TrackedFile {
+    GitOid oid;
+    uint32_t mode;
+  };
+  using FlatTree = std::unordered_map<std::string, TrackedFile>;
+
+  // Resolves a full object id, or the name of a ref, to a commit
+  GitOid resolveCommit(w_string_piece rev) const;
+  folly::Optional<GitOid> resolveRef(const std::string& name) const;
+  folly::Optional<GitOid> readRef(const std::string& name, int depth) const;
+  std::shared_ptr<const std::unordered_map<std::string, GitOid>> packedRefs()
+      const;
+
+  GitOid mergeBase(const GitOid& a, const GitOid& b) const;
+  // Adds the paths that differ between the trees a and b, either of which
+  // may be null, to result
+  void diffTrees(
+      const GitOid* a,
+      const GitOid* b,
+      const std::string& prefix,
+      SCM::StatusResult& result) const;
+  void listTree(
+      const GitOid& tree,
+      const std::string& prefix,
+      std::vector<w_string>& paths) const;
+  std::shared_ptr<const FlatTree> flattenTree(const GitOid& tree) const;
+  // Adds the paths whose working copy differs from the commit head, and
+  // those that are neither tracked nor ignored, to paths
+  void workingCopyChanges(const GitOid& head, std::set<std::string>& paths)
+      const;
+
+  // Turns paths relative to the repository into paths relative to the
+  // root, leaving out those that are outside of it
+  std::vector<w_string> relativeToRoot(const std::vector<w_string>& paths)
+      const;
+  bool underRoot(const std::string& path) const;
+
+  // Where HEAD and the index are; the .git dir, or that of the worktree
+  std::string gitDir_;
+  // Where the objects and shared refs are
+  std::string commonDir_;
+  // The path of the root relative to the repository, with a trailing
+  // slash, or empty if the root is the top of the repository
+  std::string rootPrefix_;
+  GitObjectStore objects_;
+
+  struct PackedRefs {
+    FileInformation info;
+    std::shared_ptr<const std::unordered_map<std::string, GitOid>> refs;
+  };
+  mutable folly::Synchronized<PackedRefs, std::mutex> packedRefs_;
+  // Merge bases and diffs are functions of the commits that they are
+  // computed from, so they never need to be invalidated
+  mutable LRUCache<std::string, GitOid> mergeBases_;
+  mutable LRUCache<std::string, SCM::StatusResult> diffs_;
+  mutable folly::Synchronized<
+      std::pair<GitOid, std::shared_ptr<const FlatTree>>,
+      std::mutex>
+      flatTree_;
+};
+} // namespace watchman
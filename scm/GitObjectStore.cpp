@@ -0,0 +1,729 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "GitObjectStore.h"
+#include <folly/FileUtil.h>
+#include <folly/compression/Compression.h>
+#include <folly/lang/Bits.h>
+#include <folly/system/MemoryMapping.h>
+#include <algorithm>
+#include <unordered_map>
+#include "Logging.h"
+#include "SCM.h"
+#include "watchman_opendir.h"
+
+namespace watchman {
+
+namespace {
+// How many of the objects that have been read are kept around
+constexpr size_t kObjectCacheSize = 4096;
+// How many of the objects that deltas in a pack are based on are kept
+// around, as many deltas tend to share a base
+constexpr size_t kDeltaBaseCacheSize = 256;
+// Bounds the length of a chain of deltas, to defend against corruption
+constexpr int kMaxDeltaDepth = 10000;
+
+enum PackObjectType {
+  kPackOfsDelta = 6,
+  kPackRefDelta = 7,
+};
+
+uint32_t loadBig32(const uint8_t* p) {
+  return folly::Endian::big(folly::loadUnaligned<uint32_t>(p));
+}
+
+uint64_t loadBig64(const uint8_t* p) {
+  return folly::Endian::big(folly::loadUnaligned<uint64_t>(p));
+}
+
+int hexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+const char* typeName(GitObjectType type) {
+  switch (type) {
+    case GitObjectType::Commit:
+      return "commit";
+    case GitObjectType::Tree:
+      return "tree";
+    case GitObjectType::Blob:
+      return "blob";
+    case GitObjectType::Tag:
+      return "tag";
+  }
+  return "unknown";
+}
+
+// Inflates the zlib stream at the start of input, which is size bytes
+// once inflated.  Whatever follows the stream in input is ignored.
+std::string inflate(folly::ByteRange input, size_t size) {
+  thread_local auto codec =
+      folly::io::getStreamCodec(folly::io::CodecType::ZLIB);
+  codec->resetStream();
+
+  // A spare byte lets zlib see the end of the stream, and tells us if the
+  // object is larger than it claimed to be
+  std::string data(size + 1, '\0');
+  folly::MutableByteRange output(
+      reinterpret_cast<uint8_t*>(&data[0]), data.size());
+  while (!codec->uncompressStream(input, output)) {
+    if (input.empty() || output.empty()) {
+      throw SCMError("git object is not the size that it claims to be");
+    }
+  }
+  if (output.size() != 1) {
+    throw SCMError("git object is not the size that it claims to be");
+  }
+  data.resize(size);
+  return data;
+}
+
+// Applies the delta to base, as described in git's pack-format.txt
+std::string applyDelta(const std::string& base, const std::string& delta) {
+  auto p = reinterpret_cast<const uint8_t*>(delta.data());
+  auto end = p + delta.size();
+
+  auto varint = [&]() {
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t c;
+    do {
+      if (p == end) {
+        throw SCMError("truncated git delta");
+      }
+      c = *p++;
+      value |= uint64_t(c & 0x7f) << shift;
+      shift += 7;
+    } while (c & 0x80);
+    return value;
+  };
+
+  if (varint() != base.size()) {
+    throw SCMError("git delta doesn't apply to its base");
+  }
+  auto size = varint();
+  std::string result;
+  result.reserve(size);
+
+  while (p < end) {
+    auto op = *p++;
+    if (op & 0x80) {
+      // Copy from the base
+      uint64_t offset = 0;
+      uint64_t length = 0;
+      for (int i = 0; i < 4; ++i) {
+        if (op & (1 << i)) {
+          if (p == end) {
+            throw SCMError("truncated git delta");
+          }
+          offset |= uint64_t(*p++) << (8 * i);
+        }
+      }
+      for (int i = 0; i < 3; ++i) {
+        if (op & (0x10 << i)) {
+          if (p == end) {
+            throw SCMError("truncated git delta");
+          }
+          length |= uint64_t(*p++) << (8 * i);
+        }
+      }
+      if (length == 0) {
+        length = 0x10000;
+      }
+      if (offset + length > base.size()) {
+        throw SCMError("git delta copies from beyond its base");
+      }
+      result.append(base, offset, length);
+    } else if (op) {
+      // Insert the next op bytes of the delta
+      if (size_t(end - p) < op) {
+        throw SCMError("truncated git delta");
+      }
+      result.append(reinterpret_cast<const char*>(p), op);
+      p += op;
+    } else {
+      throw SCMError("git delta has a reserved instruction");
+    }
+  }
+
+  if (result.size() != size) {
+    throw SCMError("git delta produced the wrong size of object");
+  }
+  return result;
+}
+} // namespace
+
+folly::Optional<GitOid> GitOid::fromHex(folly::StringPiece hex) {
+  GitOid oid;
+  if (hex.size() != oid.bytes.size() * 2) {
+    return folly::none;
+  }
+  for (size_t i = 0; i < oid.bytes.size(); ++i) {
+    auto hi = hexValue(hex[2 * i]);
+    auto lo = hexValue(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0) {
+      return folly::none;
+    }
+    oid.bytes[i] = uint8_t((hi << 4) | lo);
+  }
+  return oid;
+}
+
+GitOid GitOid::fromBytes(const uint8_t* raw) {
+  GitOid oid;
+  memcpy(oid.bytes.data(), raw, oid.bytes.size());
+  return oid;
+}
+
+std::string GitOid::toHex() const {
+  static const char kDigits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(bytes.size() * 2);
+  for (auto b : bytes) {
+    hex.push_back(kDigits[b >> 4]);
+    hex.push_back(kDigits[b & 0xf]);
+  }
+  return hex;
+}
+
+GitCommit parseGitCommit(folly::StringPiece data) {
+  GitCommit commit;
+  bool haveTree = false;
+
+  // The headers run up to the first empty line
+  while (!data.empty()) {
+    auto eol = data.find('\n');
+    auto line = eol == folly::StringPiece::npos ? data : data.subpiece(0, eol);
+    data.advance(eol == folly::StringPiece::npos ? data.size() : eol + 1);
+    if (line.empty()) {
+      break;
+    }
+
+    if (line.removePrefix("tree ")) {
+      auto oid = GitOid::fromHex(line);
+      if (!oid) {
+        throw SCMError("git commit has a malformed tree");
+      }
+      commit.tree = *oid;
+      haveTree = true;
+    } else if (line.removePrefix("parent ")) {
+      auto oid = GitOid::fromHex(line);
+      if (!oid) {
+        throw SCMError("git commit has a malformed parent");
+      }
+      commit.parents.push_back(*oid);
+    } else if (line.removePrefix("committer ")) {
+      // Name <email> time tz
+      auto email = line.rfind('>');
+      if (email != folly::StringPiece::npos) {
+        auto rest = line.subpiece(email + 1);
+        while (!rest.empty() && rest.front() == ' ') {
+          rest.advance(1);
+        }
+        auto space = rest.find(' ');
+        if (space != folly::StringPiece::npos) {
+          rest = rest.subpiece(0, space);
+        }
+        commit.time = folly::to<int64_t>(rest);
+      }
+    }
+  }
+
+  if (!haveTree) {
+    throw SCMError("git commit has no tree");
+  }
+  return commit;
+}
+
+std::vector<GitTreeEntry> parseGitTree(folly::StringPiece data) {
+  std::vector<GitTreeEntry> entries;
+  while (!data.empty()) {
+    // <octal mode> <name>\0<20 byte oid>
+    auto space = data.find(' ');
+    if (space == folly::StringPiece::npos) {
+      throw SCMError("malformed git tree");
+    }
+    uint32_t mode = 0;
+    for (auto c : data.subpiece(0, space)) {
+      if (c < '0' || c > '7') {
+        throw SCMError("malformed git tree");
+      }
+      mode = (mode << 3) | uint32_t(c - '0');
+    }
+    data.advance(space + 1);
+
+    auto nul = data.find('\0');
+    if (nul == folly::StringPiece::npos || data.size() < nul + 21) {
+      throw SCMError("malformed git tree");
+    }
+    auto name = data.subpiece(0, nul);
+    auto oid = GitOid::fromBytes(
+        reinterpret_cast<const uint8_t*>(data.data()) + nul + 1);
+    data.advance(nul + 21);
+
+    entries.push_back(GitTreeEntry{mode, name, oid});
+  }
+  return entries;
+}
+
+GitOid parseGitTagTarget(folly::StringPiece data) {
+  if (data.removePrefix("object ")) {
+    auto oid = GitOid::fromHex(data.subpiece(0, 40));
+    if (oid) {
+      return *oid;
+    }
+  }
+  throw SCMError("malformed git tag");
+}
+
+// A pack and its index, which are mapped into memory.  Only version 2
+// indices are understood; git has written those since 1.5.2.
+class GitObjectStore::Pack {
+ public:
+  Pack(const std::string& idxPath, const std::string& packPath)
+      : idx_(idxPath.c_str()),
+        pack_(packPath.c_str()),
+        bases_(kDeltaBaseCacheSize, std::chrono::milliseconds(0)) {
+    auto idx = idx_.range();
+    if (idx.size() < 8 + 256 * 4 || memcmp(idx.data(), "\377tOc", 4) != 0 ||
+        loadBig32(idx.data() + 4) != 2) {
+      throw SCMError("unsupported git pack index ", idxPath);
+    }
+    fanout_ = idx.data() + 8;
+    count_ = loadBig32(fanout_ + 255 * 4);
+    oids_ = fanout_ + 256 * 4;
+    // The CRCs of the objects come between their ids and their offsets
+    offsets_ = oids_ + size_t(count_) * 24;
+    largeOffsets_ = offsets_ + size_t(count_) * 4;
+    if (size_t(largeOffsets_ - idx.data()) > idx.size()) {
+      throw SCMError("truncated git pack index ", idxPath);
+    }
+    largeOffsetsEnd_ = idx.data() + idx.size();
+  }
+
+  // The file name of the index, by which the packs are told apart when
+  // they are rescanned
+  std::string name;
+
+  // Returns the offset of oid in the pack, if it is there
+  folly::Optional<uint64_t> find(const GitOid& oid) const {
+    auto first = oid.bytes[0];
+    uint32_t lo = first == 0 ? 0 : loadBig32(fanout_ + (first - 1) * 4);
+    uint32_t hi = loadBig32(fanout_ + first * 4);
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      auto cmp = memcmp(oids_ + size_t(mid) * 20, oid.bytes.data(), 20);
+      if (cmp == 0) {
+        return offsetAt(mid);
+      }
+      if (cmp < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return folly::none;
+  }
+
+  // Reads the object at offset.  Deltas against objects that are in
+  // other packs, or are loose, are resolved through store.
+  GitObject read(uint64_t offset, const GitObjectStore& store) const {
+    // Follow the chain of deltas down to its base
+    std::vector<std::string> deltas;
+    auto startOffset = offset;
+    GitObject object;
+    while (true) {
+      if (auto node = bases_.get(offset)) {
+        object = *node->value();
+        break;
+      }
+      if (deltas.size() > size_t(kMaxDeltaDepth)) {
+        throw SCMError("git delta chain is too long");
+      }
+
+      auto pack = pack_.range();
+      if (offset >= pack.size()) {
+        throw SCMError("git pack offset is out of range");
+      }
+      auto p = pack.data() + offset;
+      auto end = pack.data() + pack.size();
+
+      // The type and size, as a varint
+      uint8_t c = *p++;
+      auto type = (c >> 4) & 7;
+      uint64_t size = c & 0x0f;
+      int shift = 4;
+      while (c & 0x80) {
+        if (p == end) {
+          throw SCMError("truncated git pack");
+        }
+        c = *p++;
+        size |= uint64_t(c & 0x7f) << shift;
+        shift += 7;
+      }
+
+      if (type == kPackOfsDelta) {
+        // The base is the given distance before this object
+        if (p == end) {
+          throw SCMError("truncated git pack");
+        }
+        c = *p++;
+        uint64_t distance = c & 0x7f;
+        while (c & 0x80) {
+          if (p == end) {
+            throw SCMError("truncated git pack");
+          }
+          c = *p++;
+          distance = ((distance + 1) << 7) | (c & 0x7f);
+        }
+        if (distance > offset) {
+          throw SCMError("git delta base is out of range");
+        }
+        deltas.push_back(inflate(folly::ByteRange(p, end), size));
+        offset -= distance;
+      } else if (type == kPackRefDelta) {
+        if (end - p < 20) {
+          throw SCMError("truncated git pack");
+        }
+        auto base = GitOid::fromBytes(p);
+        deltas.push_back(inflate(folly::ByteRange(p + 20, end), size));
+        object = *store.read(base);
+        break;
+      } else if (type >= 1 && type <= 4) {
+        object.type = GitObjectType(type);
+        object.data = inflate(folly::ByteRange(p, end), size);
+        if (!deltas.empty()) {
+          bases_.set(offset, std::make_shared<const GitObject>(object));
+        }
+        break;
+      } else {
+        throw SCMError("git pack has an object of unknown type ", type);
+      }
+    }
+
+    for (auto it = deltas.rbegin(); it != deltas.rend(); ++it) {
+      object.data = applyDelta(object.data, *it);
+    }
+    if (!deltas.empty()) {
+      // Other deltas are likely to be based on this one too
+      bases_.set(startOffset, std::make_shared<const GitObject>(object));
+    }
+    return object;
+  }
+
+ private:
+  uint64_t offsetAt(uint32_t index) const {
+    auto offset = loadBig32(offsets_ + size_t(index) * 4);
+    if (!(offset & 0x80000000)) {
+      return offset;
+    }
+    // Offsets past 2GB are in a table of their own
+    auto large = largeOffsets_ + size_t(offset & 0x7fffffff) * 8;
+    if (large + 8 > largeOffsetsEnd_) {
+      throw SCMError("git pack index offset is out of range");
+    }
+    return loadBig64(large);
+  }
+
+  folly::MemoryMapping idx_;
+  folly::MemoryMapping pack_;
+  const uint8_t* fanout_;
+  const uint8_t* oids_;
+  const uint8_t* offsets_;
+  const uint8_t* largeOffsets_;
+  const uint8_t* largeOffsetsEnd_;
+  uint32_t count_;
+  mutable LRUCache<uint64_t, std::shared_ptr<const GitObject>> bases_;
+};
+
+// The commit-graph file, which holds the tree, parents and time of the
+// commits that it covers so that walking history doesn't need to
+// inflate and parse the commits themselves.  Chains of split
+// commit-graph files aren't understood; the commits are read from the
+// objects instead.
+class GitObjectStore::CommitGraph {
+ public:
+  explicit CommitGraph(const std::string& path) : map_(path.c_str()) {
+    auto data = map_.range();
+    if (data.size() < 8 || memcmp(data.data(), "CGPH", 4) != 0 ||
+        data[4] != 1 || data[5] != 1) {
+      throw SCMError("unsupported git commit-graph ", path);
+    }
+    auto numChunks = data[6];
+    if (data[7] != 0) {
+      throw SCMError("git commit-graph ", path, " is part of a chain");
+    }
+    if (data.size() < 8 + (size_t(numChunks) + 1) * 12) {
+      throw SCMError("truncated git commit-graph ", path);
+    }
+
+    for (size_t i = 0; i < numChunks; ++i) {
+      auto entry = data.data() + 8 + i * 12;
+      auto offset = loadBig64(entry + 4);
+      auto nextOffset = loadBig64(entry + 12 + 4);
+      if (offset > data.size() || nextOffset > data.size() ||
+          nextOffset < offset) {
+        throw SCMError("git commit-graph ", path, " has a bad chunk");
+      }
+      auto chunk = data.data() + offset;
+      auto id = loadBig32(entry);
+      if (id == 0x4f494446 /* OIDF */) {
+        fanout_ = chunk;
+      } else if (id == 0x4f49444c /* OIDL */) {
+        oids_ = chunk;
+      } else if (id == 0x43444154 /* CDAT */) {
+        commits_ = chunk;
+        commitsSize_ = nextOffset - offset;
+      } else if (id == 0x45444745 /* EDGE */) {
+        edges_ = chunk;
+        edgesSize_ = (nextOffset - offset) / 4;
+      }
+    }
+    if (!fanout_ || !oids_ || !commits_) {
+      throw SCMError("git commit-graph ", path, " is missing a chunk");
+    }
+    count_ = loadBig32(fanout_ + 255 * 4);
+    if (commitsSize_ < size_t(count_) * 36) {
+      throw SCMError("truncated git commit-graph ", path);
+    }
+  }
+
+  bool lookup(const GitOid& oid, GitCommit& commit) const {
+    auto first = oid.bytes[0];
+    uint32_t lo = first == 0 ? 0 : loadBig32(fanout_ + (first - 1) * 4);
+    uint32_t hi = loadBig32(fanout_ + first * 4);
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      auto cmp = memcmp(oids_ + size_t(mid) * 20, oid.bytes.data(), 20);
+      if (cmp == 0) {
+        decode(mid, commit);
+        return true;
+      }
+      if (cmp < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return false;
+  }
+
+ private:
+  static constexpr uint32_t kParentNone = 0x70000000;
+  static constexpr uint32_t kExtraEdges = 0x80000000;
+
+  GitOid oidAt(uint32_t index) const {
+    if (index >= count_) {
+      throw SCMError("git commit-graph parent is out of range");
+    }
+    return GitOid::fromBytes(oids_ + size_t(index) * 20);
+  }
+
+  void decode(uint32_t index, GitCommit& commit) const {
+    auto entry = commits_ + size_t(index) * 36;
+    commit.tree = GitOid::fromBytes(entry);
+    commit.parents.clear();
+
+    auto parent1 = loadBig32(entry + 20);
+    auto parent2 = loadBig32(entry + 24);
+    if (parent1 != kParentNone) {
+      commit.parents.push_back(oidAt(parent1));
+    }
+    if (parent2 != kParentNone) {
+      if (parent2 & kExtraEdges) {
+        // The second and later parents of an octopus merge are listed in
+        // the EDGE chunk, the last of them having the top bit set
+        for (auto edge = parent2 & ~kExtraEdges;; ++edge) {
+          if (!edges_ || edge >= edgesSize_) {
+            throw SCMError("git commit-graph edge is out of range");
+          }
+          auto value = loadBig32(edges_ + size_t(edge) * 4);
+          commit.parents.push_back(oidAt(value & ~kExtraEdges));
+          if (value & kExtraEdges) {
+            break;
+          }
+        }
+      } else {
+        commit.parents.push_back(oidAt(parent2));
+      }
+    }
+
+    // The top 30 bits are the generation number, the bottom 34 the time
+    auto timeHi = loadBig32(entry + 28) & 0x3;
+    auto timeLo = loadBig32(entry + 32);
+    commit.time = int64_t((uint64_t(timeHi) << 32) | timeLo);
+  }
+
+  folly::MemoryMapping map_;
+  const uint8_t* fanout_{nullptr};
+  const uint8_t* oids_{nullptr};
+  const uint8_t* commits_{nullptr};
+  size_t commitsSize_{0};
+  const uint8_t* edges_{nullptr};
+  size_t edgesSize_{0};
+  uint32_t count_{0};
+};
+
+GitObjectStore::GitObjectStore(std::string objectsDir)
+    : objectsDir_(std::move(objectsDir)),
+      cache_(kObjectCacheSize, std::chrono::milliseconds(0)) {}
+
+GitObjectStore::~GitObjectStore() {}
+
+std::shared_ptr<const GitObject> GitObjectStore::read(const GitOid& oid) const {
+  auto key = oid.asKey().str();
+  if (auto node = cache_.get(key)) {
+    return node->value();
+  }
+
+  auto object = readPacked(oid, false);
+  if (!object) {
+    object = readLoose(oid);
+  }
+  if (!object) {
+    // It may have been packed since we last looked
+    object = readPacked(oid, true);
+  }
+  if (!object) {
+    throw SCMError("git object ", oid.toHex(), " not found");
+  }
+
+  auto result = std::make_shared<const GitObject>(std::move(*object));
+  cache_.set(key, std::shared_ptr<const GitObject>(result));
+  return result;
+}
+
+GitCommit GitObjectStore::readCommit(const GitOid& oid) const {
+  GitCommit commit;
+  auto graph = commitGraph();
+  if (graph && graph->lookup(oid, commit)) {
+    return commit;
+  }
+
+  auto object = read(oid);
+  if (object->type != GitObjectType::Commit) {
+    throw SCMError(
+        "git object ", oid.toHex(), " is a ", typeName(object->type));
+  }
+  return parseGitCommit(object->data);
+}
+
+folly::Optional<GitObject> GitObjectStore::readLoose(const GitOid& oid) const {
+  auto hex = oid.toHex();
+  auto path = folly::to<std::string>(
+      objectsDir_, "/", hex.substr(0, 2), "/", hex.substr(2));
+  std::string compressed;
+  if (!folly::readFile(path.c_str(), compressed)) {
+    return folly::none;
+  }
+
+  std::string data;
+  try {
+    data = folly::io::getCodec(folly::io::CodecType::ZLIB)
+               ->uncompress(compressed);
+  } catch (const std::exception& exc) {
+    throw SCMError("failed to inflate git object ", path, ": ", exc.what());
+  }
+
+  // <type> <size>\0<data>
+  auto nul = data.find('\0');
+  auto space = data.find(' ');
+  if (nul == std::string::npos || space == std::string::npos || space > nul) {
+    throw SCMError("malformed git object ", path);
+  }
+  auto type = folly::StringPiece(data.data(), space);
+  GitObject object;
+  if (type == "commit") {
+    object.type = GitObjectType::Commit;
+  } else if (type == "tree") {
+    object.type = GitObjectType::Tree;
+  } else if (type == "blob") {
+    object.type = GitObjectType::Blob;
+  } else if (type == "tag") {
+    object.type = GitObjectType::Tag;
+  } else {
+    throw SCMError("git object ", path, " has an unknown type");
+  }
+  object.data = data.substr(nul + 1);
+  return object;
+}
+
+folly::Optional<GitObject> GitObjectStore::readPacked(
+    const GitOid& oid,
+    bool rescan) const {
+  std::vector<std::shared_ptr<Pack>> packs;
+  {
+    auto state = state_.lock();
+    if (rescan || !state->scanned) {
+      // Keep the packs that we have open, so that their caches survive
+      std::unordered_map<std::string, std::shared_ptr<Pack>> existing;
+      for (auto& pack : state->packs) {
+        existing.emplace(pack->name, pack);
+      }
+      state->packs.clear();
+      state->scanned = true;
+
+      auto packDir = folly::to<std::string>(objectsDir_, "/pack");
+      try {
+        auto dir = w_dir_open(packDir.c_str());
+        while (auto ent = dir->readDir()) {
+          folly::StringPiece name(ent->d_name);
+          if (!name.endsWith(".idx")) {
+            continue;
+          }
+          auto it = existing.find(name.str());
+          if (it != existing.end()) {
+            state->packs.push_back(it->second);
+            continue;
+          }
+          auto base = folly::to<std::string>(
+              packDir, "/", name.subpiece(0, name.size() - 4));
+          try {
+            auto pack = std::make_shared<Pack>(
+                folly::to<std::string>(base, ".idx"),
+                folly::to<std::string>(base, ".pack"));
+            pack->name = name.str();
+            state->packs.push_back(std::move(pack));
+          } catch (const std::exception& exc) {
+            log(ERR, "ignoring git pack ", base, ": ", exc.what(), "\n");
+          }
+        }
+      } catch (const std::system_error& exc) {
+        log(DBG, "no git packs in ", packDir, ": ", exc.what(), "\n");
+      }
+    }
+    packs = state->packs;
+  }
+
+  for (auto& pack : packs) {
+    if (auto offset = pack->find(oid)) {
+      return pack->read(*offset, *this);
+    }
+  }
+  return folly::none;
+}
+
+std::shared_ptr<const GitObjectStore::CommitGraph> GitObjectStore::commitGraph()
+    const {
+  auto state = state_.lock();
+  if (!state->commitGraphLoaded) {
+    state->commitGraphLoaded = true;
+    auto path = folly::to<std::string>(objectsDir_, "/info/commit-graph");
+    try {
+      state->commitGraph = std::make_shared<const CommitGraph>(path);
+    } catch (const std::exception& exc) {
+      log(DBG, "not using git commit-graph ", path, ": ", exc.what(), "\n");
+    }
+  }
+  return state->commitGraph;
+}
+
+} // namespace watchman
@@ -0,0 +1,123 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <folly/Optional.h>
+#include <folly/Range.h>
+#include <folly/Synchronized.h>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "LRUCache.h"
+
+namespace watchman {
+
+// The SHA-1 that names a git object
+struct GitOid {
+  std::array<uint8_t, 20> bytes;
+
+  // Parses a 40 character hex object id, returning folly::none if hex
+  // isn't one
+  static folly::Optional<GitOid> fromHex(folly::StringPiece hex);
+  static GitOid fromBytes(const uint8_t* raw);
+
+  std::string toHex() const;
+  folly::StringPiece asKey() const {
+    return folly::StringPiece(
+        reinterpret_cast<const char*>(bytes.data()), bytes.size());
+  }
+
+  bool operator==(const GitOid& other) const {
+    return bytes == other.bytes;
+  }
+  bool operator!=(const GitOid& other) const {
+    return bytes != other.bytes;
+  }
+};
+
+struct GitOidHasher {
+  size_t operator()(const GitOid& oid) const {
+    // The id is already a hash, so any part of it will do
+    size_t value;
+    memcpy(&value, oid.bytes.data(), sizeof(value));
+    return value;
+  }
+};
+
+enum class GitObjectType { Commit = 1, Tree = 2, Blob = 3, Tag = 4 };
+
+struct GitObject {
+  GitObjectType type;
+  std::string data;
+};
+
+struct GitCommit {
+  GitOid tree;
+  std::vector<GitOid> parents;
+  // The committer time, in seconds since the epoch
+  int64_t time{0};
+};
+
+// Parses the data of a commit object
+GitCommit parseGitCommit(folly::StringPiece data);
+
+struct GitTreeEntry {
+  uint32_t mode;
+  // Points into the data of the tree
+  folly::StringPiece name;
+  GitOid oid;
+
+  bool isTree() const {
+    return (mode & 0170000) == 0040000;
+  }
+};
+
+// Parses the entries of a tree object, whose names point into data
+std::vector<GitTreeEntry> parseGitTree(folly::StringPiece data);
+
+// Returns the object that the tag object data points to
+GitOid parseGitTagTarget(folly::StringPiece data);
+
+// Reads the objects of a git repository from its loose objects and its
+// packs, and the commits from its commit-graph file when it has one.
+// Objects are immutable, so what has been read is cached without any
+// need to invalidate it; packs are rescanned when an object can't be
+// found, as they may have been repacked since they were last scanned.
+class GitObjectStore {
+ public:
+  explicit GitObjectStore(std::string objectsDir);
+  ~GitObjectStore();
+
+  // Returns the object oid.  Throws SCMError if there is no such object,
+  // or if it can't be read.
+  std::shared_ptr<const GitObject> read(const GitOid& oid) const;
+
+  // Returns the commit oid, from the commit-graph if it is there
+  GitCommit readCommit(const GitOid& oid) const;
+
+ private:
+  class Pack;
+  class CommitGraph;
+
+  folly::Optional<GitObject> readLoose(const GitOid& oid) const;
+  // Looks for oid in the packs, reading what they are again when rescan
+  // is true
+  folly::Optional<GitObject> readPacked(const GitOid& oid, bool rescan) const;
+  std::shared_ptr<const CommitGraph> commitGraph() const;
+
+  struct State {
+    std::vector<std::shared_ptr<Pack>> packs;
+    bool scanned{false};
+    std::shared_ptr<const CommitGraph> commitGraph;
+    bool commitGraphLoaded{false};
+  };
+
+  const std::string objectsDir_;
+  mutable folly::Synchronized<State, std::mutex> state_;
+  mutable LRUCache<std::string, std::shared_ptr<const GitObject>> cache_;
+};
+
+} // namespace watchman
@@ -0,0 +1,174 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "HgCommandServer.h"
+#include <folly/lang/Bits.h>
+#include <cctype>
+#include "Logging.h"
+#include "Pipe.h"
+#include "SCM.h"
+
+namespace watchman {
+
+// The protocol is described at https://www.mercurial-scm.org/wiki/CommandServer
+// The server sends messages that are a channel byte, followed by the length
+// of the data as a big endian uint32, followed by the data.  Commands that
+// are sent to it are a line with the name of the command, followed by the
+// length of its arguments and then the arguments.
+
+HgCommandServer::HgCommandServer(
+    const std::string& hgPath,
+    ChildProcess::Options&& options) {
+  Pipe input;
+  Pipe output;
+#ifndef _WIN32
+  input.read.clearNonBlock();
+  input.write.clearNonBlock();
+  output.read.clearNonBlock();
+  output.write.clearNonBlock();
+#endif
+  options.dup2(input.read, STDIN_FILENO);
+  options.dup2(output.write, STDOUT_FILENO);
+
+  try {
+    proc_ = std::make_unique<ChildProcess>(
+        std::vector<w_string_piece>{hgPath,
+                                    "serve",
+                                    "--cmdserver",
+                                    "pipe",
+                                    "--config",
+                                    "ui.interactive=false"},
+        std::move(options));
+  } catch (const std::exception& exc) {
+    throw SCMError("failed to start the hg command server: ", exc.what());
+  }
+  input.read.close();
+  output.write.close();
+  toServer_ = std::move(input.write);
+  fromServer_ = std::move(output.read);
+
+  try {
+    std::string hello;
+    auto channel = readMessage(hello);
+    if (channel != 'o' || hello.find("runcommand") == std::string::npos) {
+      throw SCMError("unexpected hello from the hg command server: ", hello);
+    }
+  } catch (const std::exception&) {
+    proc_->kill();
+    proc_->wait();
+    throw;
+  }
+}
+
+HgCommandServer::~HgCommandServer() {
+  // The server exits once its input is closed, but it may be stuck in a
+  // command that failed part way through
+  toServer_.close();
+  fromServer_.close();
+  proc_->kill();
+  proc_->wait();
+}
+
+void HgCommandServer::writeAll(const char* data, size_t size) {
+  while (size > 0) {
+    auto result = toServer_.write(data, int(size));
+    if (result.hasError()) {
+      throw SCMError(
+          "failed to write to the hg command server: ",
+          result.error().message());
+    }
+    data += result.value();
+    size -= result.value();
+  }
+}
+
+void HgCommandServer::readAll(char* data, size_t size) {
+  while (size > 0) {
+    auto result = fromServer_.read(data, int(size));
+    if (result.hasError()) {
+      throw SCMError(
+          "failed to read from the hg command server: ",
+          result.error().message());
+    }
+    if (result.value() == 0) {
+      throw SCMError("the hg command server exited unexpectedly");
+    }
+    data += result.value();
+    size -= result.value();
+  }
+}
+
+char HgCommandServer::readMessage(std::string& data) {
+  char header[5];
+  readAll(header, sizeof(header));
+  auto size = folly::Endian::big(folly::loadUnaligned<uint32_t>(header + 1));
+  data.resize(size);
+  if (size > 0) {
+    readAll(&data[0], size);
+  }
+  return header[0];
+}
+
+HgCommandServer::Result HgCommandServer::runCommand(
+    const std::vector<w_string_piece>& args,
+    const ChildProcess::pipeReadCallback& outputCallback) {
+  std::string request("runcommand\n");
+  std::string joined;
+  for (size_t i = 0; i < args.size(); ++i) {
+    if (i > 0) {
+      joined.push_back('\0');
+    }
+    joined.append(args[i].data(), args[i].size());
+  }
+  auto size = folly::Endian::big(uint32_t(joined.size()));
+  request.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  request.append(joined);
+  writeAll(request.data(), request.size());
+
+  std::string output;
+  std::string error;
+  std::string data;
+  while (true) {
+    auto channel = readMessage(data);
+    switch (channel) {
+      case 'o':
+        if (outputCallback) {
+          outputCallback(w_string_piece(data.data(), data.size()));
+        } else {
+          output.append(data);
+        }
+        break;
+      case 'e':
+        error.append(data);
+        break;
+      case 'r': {
+        if (data.size() != sizeof(int32_t)) {
+          throw SCMError("malformed result from the hg command server");
+        }
+        auto status =
+            folly::Endian::big(folly::loadUnaligned<int32_t>(data.data()));
+        return Result{status,
+                      outputCallback ? w_string(nullptr)
+                                     : w_string(output.data(), output.size()),
+                      w_string(error.data(), error.size())};
+      }
+      case 'I':
+      case 'L': {
+        // The command wants input, which we don't have; tell it that it
+        // is at the end of its input
+        uint32_t none = 0;
+        writeAll(reinterpret_cast<const char*>(&none), sizeof(none));
+        break;
+      }
+      default:
+        // Channels with upper case names require an answer, which we
+        // don't know how to give
+        if (isupper(channel)) {
+          throw SCMError(
+              "unsupported channel ", channel, " from the hg command server");
+        }
+        log(DBG, "ignoring hg command server channel ", channel, "\n");
+    }
+  }
+}
+
+} // namespace watchman
@@ -0,0 +1,51 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman_system.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include "ChildProcess.h"
+#include "FileDescriptor.h"
+
+namespace watchman {
+
+// A long lived `hg serve --cmdserver pipe` process for a repository, which
+// runs hg commands without paying for the startup of python each time.
+// It runs one command at a time; callers that want to run commands
+// concurrently need one of these each.
+class HgCommandServer {
+ public:
+  struct Result {
+    int status;
+    w_string output;
+    w_string error;
+  };
+
+  // Starts the server with options, which set up its environment and cwd,
+  // and waits for it to say hello.  Throws SCMError if it fails to start.
+  HgCommandServer(const std::string& hgPath, ChildProcess::Options&& options);
+  ~HgCommandServer();
+
+  // Runs the hg command with the arguments args, which don't include the
+  // name of hg itself.  Throws SCMError if the server fails, after which
+  // it must not be used again.
+  // If outputCallback is set, the output is passed to it as it arrives
+  // and the output of the result is null.
+  Result runCommand(
+      const std::vector<w_string_piece>& args,
+      const ChildProcess::pipeReadCallback& outputCallback = nullptr);
+
+ private:
+  void writeAll(const char* data, size_t size);
+  void readAll(char* data, size_t size);
+  // Reads the next message from the server into data and returns the
+  // channel that it came on
+  char readMessage(std::string& data);
+
+  FileDescriptor toServer_;
+  FileDescriptor fromServer_;
+  std::unique_ptr<ChildProcess> proc_;
+};
+
+} // namespace watchman
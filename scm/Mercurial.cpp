@@ -2,10 +2,13 @@
  * Licensed under the Apache License, Version 2.0 */
 #include "watchman.h"
 #include "Mercurial.h"
+#include <folly/Optional.h>
 #include <folly/String.h>
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include "ChildProcess.h"
 #include "Logging.h"
 
@@ -34,6 +37,25 @@ struct MercurialResult {
   w_string output;
 };
 
+[[noreturn]] void throwMercurialError(
+    const std::vector<w_string_piece>& cmdline,
+    folly::StringPiece description,
+    const w_string& stdoutData,
+    const w_string& stderrData) {
+  auto output = folly::StringPiece{stdoutData}.str();
+  auto error = folly::StringPiece{stderrData}.str();
+  replaceEmbeddedNulls(output);
+  replaceEmbeddedNulls(error);
+  throw SCMError{"failed to ",
+                 description,
+                 "\ncmd = ",
+                 folly::join(" ", cmdline),
+                 "\nstdout = ",
+                 output,
+                 "\nstderr = ",
+                 error};
+}
+
 MercurialResult runMercurial(
     std::vector<w_string_piece> cmdline,
     ChildProcess::Options options,
@@ -42,28 +64,87 @@ MercurialResult runMercurial(
   auto outputs = proc.communicate();
   auto status = proc.wait();
   if (status) {
-    auto output = folly::StringPiece{outputs.first}.str();
-    auto error = folly::StringPiece{outputs.second}.str();
-    replaceEmbeddedNulls(output);
-    replaceEmbeddedNulls(error);
-    throw SCMError{"failed to ",
-                   description,
-                   "\ncmd = ",
-                   folly::join(" ", cmdline),
-                   "\nstdout = ",
-                   output,
-                   "\nstderr = ",
-                   error};
+    throwMercurialError(cmdline, description, outputs.first, outputs.second);
   }
 
   return MercurialResult{std::move(outputs.first)};
 }
 
+// Splits output that arrives in chunks into the records that end with
+// delim, holding on to a partial record until the rest of it arrives
+class RecordSplitter {
+ public:
+  RecordSplitter(
+      char delim,
+      const std::function<void(w_string_piece)>& onRecord)
+      : delim_(delim), onRecord_(onRecord) {}
+
+  void operator()(w_string_piece chunk) {
+    const char* begin = chunk.data();
+    const char* end = begin + chunk.size();
+    while (begin != end) {
+      auto found =
+          static_cast<const char*>(memchr(begin, delim_, end - begin));
+      if (!found) {
+        partial_.append(begin, end - begin);
+        return;
+      }
+      if (partial_.empty()) {
+        emit(w_string_piece(begin, found - begin));
+      } else {
+        partial_.append(begin, found - begin);
+        emit(w_string_piece(partial_.data(), partial_.size()));
+        partial_.clear();
+      }
+      begin = found + 1;
+    }
+  }
+
+  // Passes on the last record, if the output didn't end with delim
+  void finish() {
+    if (!partial_.empty()) {
+      emit(w_string_piece(partial_.data(), partial_.size()));
+      partial_.clear();
+    }
+  }
+
+  // True once any record has been passed on
+  bool emitted() const {
+    return emitted_;
+  }
+
+ private:
+  void emit(w_string_piece record) {
+    emitted_ = true;
+    onRecord_(record);
+  }
+
+  char delim_;
+  const std::function<void(w_string_piece)>& onRecord_;
+  std::string partial_;
+  bool emitted_{false};
+};
+
+// The command servers of a repository stop being started after this many
+// fail to start in a row, since hg is unlikely to be able to run one
+constexpr size_t kMaxCommandServerStartFailures = 3;
+
+constexpr size_t kPriorCommitsCacheSize = 64;
+
+// Returns true if commitId is a full commit hash, rather than a name that
+// can refer to different commits over time
+bool isFullHash(w_string_piece commitId) {
+  return commitId.size() == 40 &&
+      std::all_of(commitId.data(), commitId.data() + 40, [](char c) {
+           return isxdigit(uint8_t(c)) != 0;
+         });
+}
+
 } // namespace
 
 namespace watchman {
 
-ChildProcess::Options Mercurial::makeHgOptions(w_string requestId) const {
+ChildProcess::Options Mercurial::makeBaseHgOptions(w_string requestId) const {
   ChildProcess::Options opt;
   // Ensure that the hgrc doesn't mess with the behavior
   // of the commands that we're runing.
@@ -104,14 +185,159 @@ ChildProcess::Options Mercurial::makeHgOptions(w_string requestId) const {
   // rather than whatever is hardcoded in its config.
   opt.environment().set("WATCHMAN_SOCK", get_sock_name_legacy());
 
+  opt.chdir(getRootPath());
+  opt.useSpawnHelper();
+
+  return opt;
+}
+
+ChildProcess::Options Mercurial::makeHgOptions(w_string requestId) const {
+  auto opt = makeBaseHgOptions(requestId);
   opt.nullStdin();
   opt.pipeStdout();
   opt.pipeStderr();
-  opt.chdir(getRootPath());
-
   return opt;
 }
 
+w_string Mercurial::runHg(
+    std::vector<w_string_piece> cmdline,
+    w_string requestId,
+    folly::StringPiece description) const {
+  if (auto server = acquireCommandServer()) {
+    folly::Optional<HgCommandServer::Result> result;
+    try {
+      result = server->runCommand(
+          std::vector<w_string_piece>(cmdline.begin() + 1, cmdline.end()));
+    } catch (const SCMError& exc) {
+      log(ERR,
+          "hg command server for ",
+          getRootPath(),
+          " failed, so running hg directly: ",
+          exc.what(),
+          "\n");
+      server.reset();
+    }
+    releaseCommandServer(std::move(server));
+
+    if (result) {
+      if (result->status) {
+        throwMercurialError(
+            cmdline, description, result->output, result->error);
+      }
+      return result->output;
+    }
+  }
+
+  return runMercurial(cmdline, makeHgOptions(requestId), description).output;
+}
+
+void Mercurial::runHgStreaming(
+    std::vector<w_string_piece> cmdline,
+    w_string requestId,
+    folly::StringPiece description,
+    char delim,
+    const std::function<void(w_string_piece)>& onRecord) const {
+  RecordSplitter splitter(delim, onRecord);
+  auto outputCallback = [&splitter](w_string_piece chunk) { splitter(chunk); };
+
+  if (auto server = acquireCommandServer()) {
+    folly::Optional<HgCommandServer::Result> result;
+    try {
+      result = server->runCommand(
+          std::vector<w_string_piece>(cmdline.begin() + 1, cmdline.end()),
+          outputCallback);
+    } catch (const SCMError& exc) {
+      server.reset();
+      releaseCommandServer(nullptr);
+      if (splitter.emitted()) {
+        // The consumer has seen part of the output, so running hg again
+        // would hand it some of the records twice
+        throw;
+      }
+      log(ERR,
+          "hg command server for ",
+          getRootPath(),
+          " failed, so running hg directly: ",
+          exc.what(),
+          "\n");
+    }
+    if (server) {
+      releaseCommandServer(std::move(server));
+    }
+
+    if (result) {
+      if (result->status) {
+        throwMercurialError(cmdline, description, nullptr, result->error);
+      }
+      splitter.finish();
+      return;
+    }
+  }
+
+  ChildProcess proc{cmdline, makeHgOptions(requestId)};
+  auto error = proc.communicateStreaming(outputCallback);
+  auto status = proc.wait();
+  if (status) {
+    throwMercurialError(cmdline, description, nullptr, error);
+  }
+  splitter.finish();
+}
+
+std::unique_ptr<HgCommandServer> Mercurial::acquireCommandServer() const {
+  {
+    auto servers = commandServers_.lock();
+    if (!servers->idle.empty()) {
+      auto server = std::move(servers->idle.back());
+      servers->idle.pop_back();
+      return server;
+    }
+    if (servers->count >= maxCommandServers_ ||
+        servers->startFailures >= kMaxCommandServerStartFailures) {
+      return nullptr;
+    }
+    ++servers->count;
+  }
+
+  // Start it without holding the lock, so that the other servers can be
+  // taken and returned meanwhile
+  try {
+    auto opt = makeBaseHgOptions(nullptr);
+#ifdef _WIN32
+    opt.open(STDERR_FILENO, "NUL", O_WRONLY, 0);
+#else
+    opt.open(STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+#endif
+    auto server =
+        std::make_unique<HgCommandServer>(hgExecutablePath(), std::move(opt));
+    commandServers_.lock()->startFailures = 0;
+    log(DBG, "started an hg command server for ", getRootPath(), "\n");
+    return server;
+  } catch (const std::exception& exc) {
+    auto servers = commandServers_.lock();
+    --servers->count;
+    ++servers->startFailures;
+    log(ERR,
+        "failed to start an hg command server for ",
+        getRootPath(),
+        ": ",
+        exc.what(),
+        servers->startFailures >= kMaxCommandServerStartFailures
+            ? "; no longer trying\n"
+            : "\n");
+    return nullptr;
+  }
+}
+
+void Mercurial::releaseCommandServer(
+    std::unique_ptr<HgCommandServer> server) const {
+  auto servers = commandServers_.lock();
+  if (server) {
+    servers->idle.emplace_back(std::move(server));
+  } else {
+    --servers->count;
+  }
+}
+
 Mercurial::infoCache::infoCache(std::string path) : dirStatePath(path) {
   dirstate = FileInformation();
 }
@@ -168,7 +394,28 @@ bool Mercurial::infoCache::dotChanged() {
 
 Mercurial::Mercurial(w_string_piece rootPath, w_string_piece scmRoot)
     : SCM(rootPath, scmRoot),
-      cache_(infoCache(to<std::string>(getSCMRoot(), "/.hg/dirstate"))) {}
+      cache_(infoCache(to<std::string>(getSCMRoot(), "/.hg/dirstate"))),
+      maxCommandServers_(size_t(
+          std::max(json_int_t(0), cfg_get_int("hg_command_servers", 0)))),
+      priorCommits_(kPriorCommitsCacheSize, milliseconds(0)) {}
+
+w_string Mercurial::getDirStateToken() const {
+  auto path = cache_.rlock()->dirStatePath;
+  try {
+    auto info =
+        getFileInformation(path.c_str(), CaseSensitivity::CaseSensitive);
+    // hg replaces the dirstate when it writes it, so the inode changes too
+    return w_string::format(
+        "{}:{}:{}.{}",
+        info.ino,
+        info.size,
+        info.mtime.tv_sec,
+        info.mtime.tv_nsec);
+  } catch (const std::system_error& exc) {
+    log(DBG, "stat(", path, ") failed: ", exc.what(), "\n");
+    return nullptr;
+  }
+}
 
 w_string Mercurial::mergeBaseWith(w_string_piece commitId, w_string requestId)
     const {
@@ -191,15 +438,19 @@ w_string Mercurial::mergeBaseWith(w_string_piece commitId, w_string requestId)
     startDirState = cache->dirstate;
   }
 
+  // Subscriptions of several clients tend to ask for the same merge base
+  // as soon as the working copy moves, so share one hg among them
   auto revset = to<std::string>("ancestor(.,", commitId, ")");
-  auto result = runMercurial(
-      {hgExecutablePath(), "log", "-T", "{node}", "-r", revset},
-      makeHgOptions(requestId),
-      "query for the merge base");
-
-  if (result.output.size() != 40) {
+  auto result = mergeBaseFlights_.run(idString, [&] {
+    return runHg(
+        {hgExecutablePath(), "log", "-T", "{node}", "-r", revset},
+        requestId,
+        "query for the merge base");
+  });
+
+  if (result.size() != 40) {
     throw SCMError(
-        "expected merge base to be a 40 character string, got ", result.output);
+        "expected merge base to be a 40 character string, got ", result);
   }
 
   {
@@ -211,10 +462,10 @@ w_string Mercurial::mergeBaseWith(w_string_piece commitId, w_string requestId)
     // the new state
     auto cache = cache_.wlock();
     if (fileTimeEqual(startDirState, cache->dirstate)) {
-      cache->mergeBases[idString] = result.output;
+      cache->mergeBases[idString] = result;
     }
   }
-  return result.output;
+  return result;
 }
 
 std::vector<w_string> Mercurial::getFilesChangedSinceMergeBaseWith(
@@ -222,7 +473,7 @@ std::vector<w_string> Mercurial::getFilesChangedSinceMergeBaseWith(
     w_string requestId) const {
   // The "" argument at the end causes paths to be printed out relative to the
   // cwd (set to root path above).
-  auto result = runMercurial(
+  auto result = runHg(
       {hgExecutablePath(),
        "--traceback",
        "status",
@@ -230,11 +481,11 @@ std::vector<w_string> Mercurial::getFilesChangedSinceMergeBaseWith(
        "--rev",
        commitId,
        ""},
-      makeHgOptions(requestId),
+      requestId,
       "query for files changed since merge base");
 
   std::vector<w_string> lines;
-  w_string_piece(result.output).split(lines, '\n');
+  w_string_piece(result).split(lines, '\n');
   return lines;
 }
 
@@ -242,10 +493,23 @@ SCM::StatusResult Mercurial::getFilesChangedBetweenCommits(
     w_string_piece commitA,
     w_string_piece commitB,
     w_string requestId) const {
+  return changedBetweenFlights_.run(
+      to<std::string>(commitA, ":", commitB), [&] {
+        return runFilesChangedBetweenCommits(commitA, commitB, requestId);
+      });
+}
+
+SCM::StatusResult Mercurial::runFilesChangedBetweenCommits(
+    w_string_piece commitA,
+    w_string_piece commitB,
+    w_string requestId) const {
   // The "" argument at the end causes paths to be printed out
   // relative to the cwd (set to root path above).
-
-  auto hgresult = runMercurial(
+  // A large rebase can change enough files for the output to run to
+  // hundreds of megabytes, so parse it as it arrives
+  SCM::StatusResult result;
+  size_t numLines = 0;
+  runHgStreaming(
       {hgExecutablePath(),
        "--traceback",
        "status",
@@ -255,30 +519,27 @@ SCM::StatusResult Mercurial::getFilesChangedBetweenCommits(
        "--rev",
        commitB,
        ""},
-      makeHgOptions(requestId),
-      "get files changed between commits");
-
-  std::vector<w_string> lines;
-  w_string_piece(hgresult.output).split(lines, '\0');
-
-  SCM::StatusResult result;
-  log(DBG, "processing ", lines.size(), " status lines\n");
-  for (auto& line : lines) {
-    if (line.size() < 3) {
-      continue;
-    }
-    w_string fileName(line.data() + 2, line.size() - 2);
-    switch (line.data()[0]) {
-      case 'A':
-        result.addedFiles.emplace_back(std::move(fileName));
-        break;
-      case 'D':
-        result.removedFiles.emplace_back(std::move(fileName));
-        break;
-      default:
-        result.changedFiles.emplace_back(std::move(fileName));
-    }
-  }
+      requestId,
+      "get files changed between commits",
+      '\0',
+      [&](w_string_piece line) {
+        ++numLines;
+        if (line.size() < 3) {
+          return;
+        }
+        w_string fileName(line.data() + 2, line.size() - 2);
+        switch (line.data()[0]) {
+          case 'A':
+            result.addedFiles.emplace_back(std::move(fileName));
+            break;
+          case 'D':
+            result.removedFiles.emplace_back(std::move(fileName));
+            break;
+          default:
+            result.changedFiles.emplace_back(std::move(fileName));
+        }
+      });
+  log(DBG, "processed ", numLines, " status lines\n");
 
   return result;
 }
@@ -286,7 +547,7 @@ SCM::StatusResult Mercurial::getFilesChangedBetweenCommits(
 time_point<system_clock> Mercurial::getCommitDate(
     w_string_piece commitId,
     w_string requestId) const {
-  auto result = runMercurial(
+  auto result = runHg(
       {hgExecutablePath(),
        "--traceback",
        "log",
@@ -294,9 +555,9 @@ time_point<system_clock> Mercurial::getCommitDate(
        commitId.data(),
        "-T",
        "{date}\n"},
-      makeHgOptions(requestId),
+      requestId,
       "get commit date");
-  return Mercurial::convertCommitDate(result.output.c_str());
+  return Mercurial::convertCommitDate(result.c_str());
 }
 
 time_point<system_clock> Mercurial::convertCommitDate(const char* commitDate) {
@@ -312,9 +573,17 @@ std::vector<w_string> Mercurial::getCommitsPriorToAndIncluding(
     w_string_piece commitId,
     int numCommits,
     w_string requestId) const {
+  auto key = to<std::string>(commitId, ":", numCommits);
+  bool cacheable = isFullHash(commitId);
+  if (cacheable) {
+    if (auto node = priorCommits_.get(key)) {
+      return node->value();
+    }
+  }
+
   auto revset = to<std::string>(
       "reverse(last(_firstancestors(", commitId, "), ", numCommits, "))\n");
-  auto result = runMercurial(
+  auto result = runHg(
       {hgExecutablePath(),
        "--traceback",
        "log",
@@ -322,11 +591,14 @@ std::vector<w_string> Mercurial::getCommitsPriorToAndIncluding(
        revset,
        "-T",
        "{node}\n"},
-      makeHgOptions(requestId),
+      requestId,
       "get prior commits");
 
   std::vector<w_string> lines;
-  w_string_piece(result.output).split(lines, '\n');
+  w_string_piece(result).split(lines, '\n');
+  if (cacheable) {
+    priorCommits_.set(key, std::vector<w_string>(lines));
+  }
   return lines;
 }
 } // namespace watchman
@@ -4,11 +4,18 @@
 #include "watchman_system.h"
 
 #include <folly/Synchronized.h>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "ChildProcess.h"
 #include "FileInformation.h"
+#include "HgCommandServer.h"
+#include "LRUCache.h"
 #include "SCM.h"
+#include "SingleFlight.h"
 
 namespace watchman {
 
@@ -34,11 +41,52 @@ class Mercurial : public SCM {
       w_string_piece commitId,
       int numCommits,
       w_string requestId = nullptr) const override;
+  w_string getDirStateToken() const override;
 
  private:
+  // Returns options for invoking hg, other than for its stdio
+  ChildProcess::Options makeBaseHgOptions(w_string requestId) const;
   // Returns options for invoking hg
   ChildProcess::Options makeHgOptions(w_string requestId) const;
 
+  // Runs the hg command cmdline, the first of which is hg itself, and
+  // returns its output.  The command runs on a command server if there
+  // is one to spare, and is spawned otherwise.
+  w_string runHg(
+      std::vector<w_string_piece> cmdline,
+      w_string requestId,
+      folly::StringPiece description) const;
+  // Like runHg, but splits the output into the records that end with delim
+  // and passes each to onRecord as it arrives, so that a large output
+  // needn't be held in memory all at once
+  void runHgStreaming(
+      std::vector<w_string_piece> cmdline,
+      w_string requestId,
+      folly::StringPiece description,
+      char delim,
+      const std::function<void(w_string_piece)>& onRecord) const;
+  // Does the work of getFilesChangedBetweenCommits
+  SCM::StatusResult runFilesChangedBetweenCommits(
+      w_string_piece commitA,
+      w_string_piece commitB,
+      w_string requestId) const;
+  // Takes an idle command server, or starts one if there are fewer than
+  // maxCommandServers_.  Returns nullptr if there is none to be had.
+  std::unique_ptr<HgCommandServer> acquireCommandServer() const;
+  // Returns server to the idle servers.  Pass nullptr if it failed, so
+  // that another can be started in its place.
+  void releaseCommandServer(std::unique_ptr<HgCommandServer> server) const;
+
+  struct CommandServers {
+    std::vector<std::unique_ptr<HgCommandServer>> idle;
+    // How many servers there are, including those running a command
+    size_t count{0};
+    // How many times in a row a server failed to start
+    size_t startFailures{0};
+  };
+  const size_t maxCommandServers_;
+  mutable folly::Synchronized<CommandServers, std::mutex> commandServers_;
+
   struct infoCache {
     std::string dirStatePath;
     FileInformation dirstate;
@@ -50,5 +98,12 @@ class Mercurial : public SCM {
     w_string lookupMergeBase(const std::string& commitId);
   };
   mutable folly::Synchronized<infoCache> cache_;
+  // The history of a commit never changes, so the commits prior to the
+  // one identified by a full hash never need to be invalidated
+  mutable LRUCache<std::string, std::vector<w_string>> priorCommits_;
+  // The hg commands that are in progress, by the commits that they were
+  // run for, so that concurrent requests for the same thing share one
+  mutable SingleFlight<std::string, w_string> mergeBaseFlights_;
+  mutable SingleFlight<std::string, SCM::StatusResult> changedBetweenFlights_;
 };
 } // namespace watchman
@@ -3,6 +3,7 @@
 #include "watchman.h"
 #include "SCM.h"
 #include <memory>
+#include "Git.h"
 #include "Mercurial.h"
 
 namespace watchman {
@@ -23,6 +24,10 @@ const w_string& SCM::getSCMRoot() const {
   return scmRoot_;
 }
 
+w_string SCM::getDirStateToken() const {
+  return nullptr;
+}
+
 w_string findFileInDirTree(
     w_string_piece rootPath,
     std::initializer_list<w_string_piece> candidates) {
@@ -62,6 +67,7 @@ std::unique_ptr<SCM> SCM::scmForPath(w_string_piece rootPath) {
   }
 
   if (base == kGit) {
+    return std::make_unique<Git>(rootPath, scmRoot.piece().dirName());
   }
 
   return nullptr;
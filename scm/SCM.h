@@ -96,6 +96,14 @@ class SCM {
       int numCommits,
       w_string requestId = nullptr) const = 0;
 
+  // Returns a token that changes whenever the working copy parent or the
+  // set of tracked files does, such as by a commit or a checkout, but not
+  // when the contents of the working copy change.  The results of
+  // getFilesChangedSinceMergeBaseWith() can be reused for as long as the
+  // token is unchanged, provided that changes to the files in the working
+  // copy are accounted for.  Returns nullptr if the SCM can't tell.
+  virtual w_string getDirStateToken() const;
+
  private:
   w_string rootPath_;
   w_string scmRoot_;
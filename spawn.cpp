@@ -3,7 +3,16 @@
 
 #include "watchman_system.h"
 #include "watchman.h"
+#include <folly/Synchronized.h>
+#include <climits>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/mman.h>
+#endif
+#include "Pipe.h"
 
 using watchman::ChildProcess;
 using watchman::FileDescriptor;
@@ -11,83 +20,279 @@ using Options = watchman::ChildProcess::Options;
 using Environment = watchman::ChildProcess::Environment;
 using namespace watchman;
 
-static std::unique_ptr<watchman_stream> prepare_stdin(
+// The stdin of the child.  For input_via_pipe, pipe is the write end of
+// stream, and data is what is to be written to it once the child is
+// running.
+struct ChildStdin {
+  std::unique_ptr<watchman_stream> stream;
+  FileDescriptor pipe;
+  std::string data;
+};
+
+// Encodes the first numFiles of the results in the input style of cmd.
+// The rows of the results may come from an arena and be shared with other
+// triggers, so they are only read here and never referenced.
+static bool encode_stdin(
     struct watchman_trigger_command* cmd,
-    w_query_res* res) {
-  char stdin_file_name[WATCHMAN_NAME_MAX];
+    const json_ref& results,
+    size_t numFiles,
+    std::string& data) {
+  auto& fileList = results.array();
+  auto files = results;
+  if (numFiles < fileList.size() &&
+      (cmd->stdin_style == input_json || cmd->stdin_style == input_bser)) {
+    files = json_array_of_size(numFiles);
+    for (size_t i = 0; i < numFiles; ++i) {
+      json_array_append_new(files, json_promote(fileList[i]));
+    }
+  }
 
-  if (cmd->stdin_style == trigger_input_style::input_dev_null) {
-    return w_stm_open("/dev/null", O_RDONLY | O_CLOEXEC);
+  switch (cmd->stdin_style) {
+    case input_json:
+      logf(DBG, "input_json: sending json object to stm\n");
+      data = json_dumps(files, 0);
+      data.push_back('\n');
+      return true;
+    case input_bser:
+      // A complete PDU, so that it can be decoded the same way as the
+      // responses from the server
+      return watchman_json_buffer::pduEncodeToString(
+          is_bser_v2, 0, files, data);
+    case input_name_list:
+      for (size_t i = 0; i < numFiles; ++i) {
+        auto& nameStr = json_to_w_string(fileList[i]);
+        data.append(nameStr.data(), nameStr.size());
+        data.push_back('\n');
+      }
+      return true;
+    case input_dev_null:
+      break;
   }
+  return true;
+}
 
-  // Adjust result to fit within the specified limit
-  if (cmd->max_files_stdin > 0) {
-    auto& fileList = res->resultsArray.array();
-    auto n_files = std::min(size_t(cmd->max_files_stdin), fileList.size());
-    fileList.resize(std::min(fileList.size(), n_files));
+// Writes all of data to stdin_file, and returns false if that failed
+static bool write_stdin_file(
+    watchman_stream* stdin_file,
+    const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    auto size = int(std::min(data.size() - written, size_t(INT_MAX)));
+    auto wrote = stdin_file->write(data.data() + written, size);
+    if (wrote <= 0) {
+      logf(
+          ERR,
+          "write failure while producing trigger stdin: {}\n",
+          strerror(errno));
+      return false;
+    }
+    written += wrote;
   }
+  return true;
+}
 
-  /* prepare the input stream for the child process */
-  snprintf(
-      stdin_file_name,
-      sizeof(stdin_file_name),
-      "%s/wmanXXXXXX",
-      watchman_tmp_dir);
-  auto stdin_file = w_mkstemp(stdin_file_name);
-  if (!stdin_file) {
+// Returns a file that holds data, positioned at its start.  The file has
+// no name; on Linux it lives in memory rather than in the temporary dir.
+static std::unique_ptr<watchman_stream> make_stdin_file(
+    const std::string& data) {
+  std::unique_ptr<watchman_stream> stdin_file;
+
+#ifdef MFD_CLOEXEC
+  FileDescriptor memfd(
+      memfd_create("watchman-trigger-stdin", MFD_CLOEXEC),
+      FileDescriptor::FDType::Generic);
+  if (memfd) {
+    stdin_file = w_stm_fdopen(std::move(memfd));
+  } else {
     logf(
-        ERR,
-        "unable to create a temporary file: {} {}\n",
-        stdin_file_name,
+        DBG,
+        "memfd_create failed, using a temporary file: {}\n",
         strerror(errno));
-    return NULL;
+  }
+#endif
+
+  if (!stdin_file) {
+    char stdin_file_name[WATCHMAN_NAME_MAX];
+    snprintf(
+        stdin_file_name,
+        sizeof(stdin_file_name),
+        "%s/wmanXXXXXX",
+        watchman_tmp_dir);
+    stdin_file = w_mkstemp(stdin_file_name);
+    if (!stdin_file) {
+      logf(
+          ERR,
+          "unable to create a temporary file: {} {}\n",
+          stdin_file_name,
+          strerror(errno));
+      return nullptr;
+    }
+
+    /* unlink the file, we don't need it in the filesystem;
+     * we'll pass the fd on to the child as stdin */
+    unlink(stdin_file_name); // FIXME: windows path translation
   }
 
-  /* unlink the file, we don't need it in the filesystem;
-   * we'll pass the fd on to the child as stdin */
-  unlink(stdin_file_name); // FIXME: windows path translation
+  if (!write_stdin_file(stdin_file.get(), data)) {
+    return nullptr;
+  }
+  stdin_file->rewind();
+  return stdin_file;
+}
 
-  switch (cmd->stdin_style) {
-    case input_json: {
-      w_jbuffer_t buffer;
+#if defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+namespace {
+// The stdin of the triggers that are given the same results, in the same
+// input style, which is encoded and written once for all of them.  It is
+// a memfd that is sealed once written, so that it can't be changed; each
+// child is given a read-only descriptor of its own, with a file offset of
+// its own.
+struct SharedStdin {
+  std::mutex mutex;
+  // The results that it was encoded from; their address alone may have
+  // been reused
+  std::weak_ptr<const w_query_res> res;
+  std::unique_ptr<watchman_stream> memfd;
+};
+
+using SharedStdinMap = folly::Synchronized<
+    std::unordered_map<std::string, std::shared_ptr<SharedStdin>>,
+    std::mutex>;
+
+SharedStdinMap& sharedStdinFiles() {
+  static SharedStdinMap files;
+  return files;
+}
+} // namespace
 
-      logf(DBG, "input_json: sending json object to stm\n");
-      if (!buffer.jsonEncodeToStream(res->resultsArray, stdin_file.get(), 0)) {
-        logf(
-            ERR,
-            "input_json: failed to write json data to stream: {}\n",
-            strerror(errno));
-        return NULL;
+// Returns a file that holds the encoding of the first numFiles of the
+// results in res, for cmd, sharing it with the other triggers that are
+// given res.  Returns nullptr if it couldn't be shared.
+static std::unique_ptr<watchman_stream> open_shared_stdin_file(
+    struct watchman_trigger_command* cmd,
+    const std::shared_ptr<const w_query_res>& res,
+    size_t numFiles) {
+  auto key = fmt::format(
+      "{}:{}:{}", fmt::ptr(res.get()), int(cmd->stdin_style), numFiles);
+  std::shared_ptr<SharedStdin> shared;
+  {
+    auto sharedFiles = sharedStdinFiles().lock();
+    // Those of results that are gone can't be asked for again
+    for (auto it = sharedFiles->begin(); it != sharedFiles->end();) {
+      if (it->second->res.expired()) {
+        it = sharedFiles->erase(it);
+      } else {
+        ++it;
       }
-      break;
     }
-    case input_name_list:
-      for (auto& name : res->resultsArray.array()) {
-        auto& nameStr = json_to_w_string(name);
-        if (stdin_file->write(nameStr.data(), nameStr.size()) !=
-                (int)nameStr.size() ||
-            stdin_file->write("\n", 1) != 1) {
-          logf(
-              ERR,
-              "write failure while producing trigger stdin: {}\n",
-              strerror(errno));
-          return nullptr;
-        }
-      }
-      break;
-    case input_dev_null:
-      // already handled above
-      break;
+    auto& entry = (*sharedFiles)[key];
+    if (!entry) {
+      entry = std::make_shared<SharedStdin>();
+      entry->res = res;
+    }
+    shared = entry;
   }
 
-  stdin_file->rewind();
-  return stdin_file;
+  std::lock_guard<std::mutex> guard(shared->mutex);
+  if (!shared->memfd) {
+    std::string data;
+    if (!encode_stdin(cmd, res->resultsArray, numFiles, data)) {
+      return nullptr;
+    }
+    FileDescriptor memfd(
+        memfd_create(
+            "watchman-trigger-stdin", MFD_CLOEXEC | MFD_ALLOW_SEALING),
+        FileDescriptor::FDType::Generic);
+    if (!memfd) {
+      return nullptr;
+    }
+    auto stream = w_stm_fdopen(std::move(memfd));
+    if (!write_stdin_file(stream.get(), data)) {
+      return nullptr;
+    }
+    if (fcntl(
+            stream->getFileDescriptor().fd(),
+            F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+      logf(DBG, "unable to seal the trigger stdin: {}\n", strerror(errno));
+      return nullptr;
+    }
+    shared->memfd = std::move(stream);
+  }
+
+  auto path = fmt::format(
+      "/proc/self/fd/{}", shared->memfd->getFileDescriptor().fd());
+  FileDescriptor fd(
+      open(path.c_str(), O_RDONLY | O_CLOEXEC),
+      FileDescriptor::FDType::Generic);
+  if (!fd) {
+    logf(DBG, "unable to reopen the trigger stdin: {}\n", strerror(errno));
+    return nullptr;
+  }
+  return w_stm_fdopen(std::move(fd));
 }
+#endif
 
-static void spawn_command(
+// The results may be shared with other triggers, so are left as they are
+static ChildStdin prepare_stdin(
+    struct watchman_trigger_command* cmd,
+    const std::shared_ptr<const w_query_res>& res) {
+  ChildStdin input;
+
+  if (cmd->stdin_style == trigger_input_style::input_dev_null) {
+    input.stream = w_stm_open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return input;
+  }
+
+  // Only as many of the results as fit within the specified limit
+  auto numFiles = json_array_size(res->resultsArray);
+  if (cmd->max_files_stdin > 0) {
+    numFiles = std::min(numFiles, size_t(cmd->max_files_stdin));
+  }
+
+#if defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+  if (cmd->stdin_delivery != input_via_pipe) {
+    input.stream = open_shared_stdin_file(cmd, res, numFiles);
+    if (input.stream) {
+      return input;
+    }
+  }
+#endif
+
+  std::string data;
+  if (!encode_stdin(cmd, res->resultsArray, numFiles, data)) {
+    logf(ERR, "failed to encode the trigger stdin\n");
+    return input;
+  }
+
+#ifndef _WIN32
+  if (cmd->stdin_delivery == input_via_pipe) {
+    try {
+      Pipe pipe;
+      // The child expects to block on reading its stdin; the write end
+      // stays non-blocking so that the writer can be stopped
+      pipe.read.clearNonBlock();
+      input.stream = w_stm_fdopen(std::move(pipe.read));
+      input.pipe = std::move(pipe.write);
+      input.data = std::move(data);
+    } catch (const std::exception& exc) {
+      logf(
+          ERR, "unable to create a pipe for trigger stdin: {}\n", exc.what());
+    }
+    return input;
+  }
+#endif
+
+  input.stream = make_stdin_file(data);
+  return input;
+}
+
+// Starts a child that runs the command of cmd with res, and adds it to
+// cmd->running.  Returns false if it couldn't be started.
+static bool spawn_command(
     const std::shared_ptr<w_root_t>& root,
     struct watchman_trigger_command* cmd,
-    w_query_res* res,
+    const std::shared_ptr<const w_query_res>& res,
     struct ClockSpec* since_spec) {
   long arg_max;
   size_t argspace_remaining;
@@ -108,14 +313,15 @@ static void spawn_command(
   // Allow some misc working overhead
   argspace_remaining -= 32;
 
-  // Record an overflow before we call prepare_stdin(), which mutates
-  // and resizes the results to fit the specified limit.
+  // prepare_stdin() only passes on as many of the results as fit within
+  // the limit
   if (cmd->max_files_stdin > 0 &&
       res->resultsArray.array().size() > cmd->max_files_stdin) {
     file_overflow = true;
   }
 
-  auto stdin_file = prepare_stdin(cmd, res);
+  auto input = prepare_stdin(cmd, res);
+  auto& stdin_file = input.stream;
   if (!stdin_file) {
     logf(
         ERR,
@@ -123,7 +329,7 @@ static void spawn_command(
         root->root_path,
         cmd->triggername,
         strerror(errno));
-    return;
+    return false;
   }
 
   // Assumption: that only one thread will be executing on a given
@@ -188,6 +394,7 @@ static void spawn_command(
   opts.setSigMask(mask);
 #endif
   opts.setFlags(POSIX_SPAWN_SETPGROUP);
+  opts.useSpawnHelper();
 
   opts.dup2(stdin_file->getFileDescriptor(), STDIN_FILENO);
 
@@ -222,12 +429,20 @@ static void spawn_command(
   watchman::log(watchman::DBG, "using ", working_dir, " for working dir\n");
   opts.chdir(working_dir.c_str());
 
+  bool spawned = false;
   try {
-    if (cmd->current_proc) {
-      cmd->current_proc->kill();
-      cmd->current_proc->wait();
+    watchman_trigger_command::Run run;
+    run.proc = std::make_unique<ChildProcess>(args, std::move(opts));
+    run.started = std::chrono::steady_clock::now();
+    if (since_spec) {
+      run.since = std::make_unique<ClockSpec>(*since_spec);
     }
-    cmd->current_proc = std::make_unique<ChildProcess>(args, std::move(opts));
+    if (input.pipe) {
+      run.stdinWriter = std::make_unique<TriggerStdinWriter>(
+          cmd->triggername, std::move(input.pipe), std::move(input.data));
+    }
+    cmd->running.push_back(std::move(run));
+    spawned = true;
   } catch (const std::exception& exc) {
     watchman::log(
         watchman::ERR,
@@ -242,16 +457,62 @@ static void spawn_command(
 
   // We have integration tests that check for this string
   watchman::log(
-      cmd->current_proc ? watchman::DBG : watchman::ERR,
+      spawned ? watchman::DBG : watchman::ERR,
       "posix_spawnp: ",
       cmd->triggername,
       "\n");
+  return spawned;
+}
+
+TriggerStdinWriter::TriggerStdinWriter(
+    const w_string& triggername,
+    FileDescriptor&& pipe,
+    std::string&& data)
+    : thread_([this,
+               triggername,
+               pipe = std::move(pipe),
+               data = std::move(data)]() noexcept {
+        w_set_thread_name("trigger stdin ", triggername);
+        size_t written = 0;
+        while (written < data.size() && !stop_) {
+          auto size = int(std::min(data.size() - written, size_t(INT_MAX)));
+          auto res = pipe.write(data.data() + written, size);
+          if (res.hasValue()) {
+            written += res.value();
+            continue;
+          }
+#ifndef _WIN32
+          auto err = res.error().value();
+          if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR) {
+            // Wait for the child to make room, checking now and then
+            // whether it has been replaced or the trigger stopped
+            pollfd pfd;
+            pfd.fd = pipe.fd();
+            pfd.events = POLLOUT;
+            ignore_result(::poll(&pfd, 1, 100));
+            continue;
+          }
+          if (err == EPIPE) {
+            // The child doesn't want the rest of it
+            logf(DBG, "trigger {} closed its stdin\n", triggername);
+            break;
+          }
+#endif
+          logf(
+              ERR,
+              "write failure while streaming trigger stdin: {}\n",
+              res.error().message());
+          break;
+        }
+      }) {}
+
+TriggerStdinWriter::~TriggerStdinWriter() {
+  stop_ = true;
+  thread_.join();
 }
 
 bool watchman_trigger_command::maybeSpawn(
     const std::shared_ptr<w_root_t>& root) {
-  bool didRun = false;
-
   // If it looks like we're in a repo undergoing a rebase or
   // other similar operation, we want to defer triggers until
   // things settle down
@@ -277,33 +538,34 @@ bool watchman_trigger_command::maybeSpawn(
   query->sync_timeout = std::chrono::milliseconds(0);
   watchman::log(watchman::DBG, "assessing trigger ", triggername, "\n");
   try {
-    auto res = w_query_execute(query.get(), root, time_generator);
+    // Triggers with the same query share the result, and the stdin that
+    // is encoded from it
+    auto res = w_query_execute_shared(query.get(), root, time_generator);
 
     watchman::log(
         watchman::DBG,
         "trigger \"",
         triggername,
         "\" generated ",
-        res.resultsArray.array().size(),
+        res->resultsArray.array().size(),
         " results\n");
 
     // create a new spec that will be used the next time
     auto saved_spec = std::move(query->since_spec);
-    query->since_spec = std::make_unique<ClockSpec>(res.clockAtStartOfQuery);
+    query->since_spec = std::make_unique<ClockSpec>(res->clockAtStartOfQuery);
 
     watchman::log(
         watchman::DBG,
         "updating trigger \"",
         triggername,
         "\" use ",
-        res.clockAtStartOfQuery.position().ticks,
+        res->clockAtStartOfQuery.position().ticks,
         " ticks next time\n");
 
-    if (!res.resultsArray.array().empty()) {
-      didRun = true;
-      spawn_command(root, this, &res, saved_spec.get());
+    if (res->resultsArray.array().empty()) {
+      return false;
     }
-    return didRun;
+    return spawn_command(root, this, res, saved_spec.get());
   } catch (const QueryExecError& e) {
     watchman::log(
         watchman::ERR,
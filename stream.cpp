@@ -2,6 +2,8 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <folly/portability/SysUio.h>
+#include <atomic>
 
 std::unique_ptr<watchman_stream> w_stm_connect(int timeoutms) {
   // Default to using unix domain sockets unless disabled by config
@@ -24,11 +26,46 @@ std::unique_ptr<watchman_stream> w_stm_connect(int timeoutms) {
   return nullptr;
 }
 
+int watchman_stream::writev(const struct iovec* iov, int iovcnt) {
+  for (int i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len > 0) {
+      return write(iov[i].iov_base, int(iov[i].iov_len));
+    }
+  }
+  return 0;
+}
+
+bool watchman_stream::peerHasClosed() {
+  return false;
+}
+
+int watchman_stream::writeWithDescriptor(
+    const void*,
+    int,
+    watchman::FileDescriptor::system_handle_type) {
+  errno = ENOTSUP;
+  return -1;
+}
+
+static std::atomic<uint64_t> poll_idle_wakeups{0};
+
 int w_poll_events(struct watchman_event_poll* p, int n, int timeoutms) {
+  int res;
 #ifdef _WIN32
   if (!p->evt->isSocket()) {
-    return w_poll_events_named_pipe(p, n, timeoutms);
-  }
+    res = w_poll_events_named_pipe(p, n, timeoutms);
+  } else
 #endif
-  return w_poll_events_sockets(p, n, timeoutms);
+  {
+    res = w_poll_events_sockets(p, n, timeoutms);
+  }
+  // A zero timeout is a check rather than a sleep
+  if (res == 0 && timeoutms != 0) {
+    poll_idle_wakeups.fetch_add(1, std::memory_order_relaxed);
+  }
+  return res;
+}
+
+uint64_t w_poll_idle_wakeups() {
+  return poll_idle_wakeups.load(std::memory_order_relaxed);
 }
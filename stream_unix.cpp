@@ -13,6 +13,7 @@
 #endif
 #include <folly/SocketAddress.h>
 #include <folly/net/NetworkSocket.h>
+#include <folly/portability/SysUio.h>
 #include <memory>
 #include "FileDescriptor.h"
 #include "Pipe.h"
@@ -151,25 +152,30 @@ class UnixStream : public watchman_stream {
     return res.value();
   }
 
+  // Waits for the socket to be writable, for blocking writes
+  bool waitWritable() {
+    struct pollfd pfd;
+    pfd.fd = fd.system_handle();
+    pfd.events = POLLOUT;
+#ifdef _WIN32
+    if (WSAPoll(&pfd, 1, kWriteTimeout) == 0) {
+      errno = map_win32_err(WSAGetLastError());
+      return false;
+    }
+#else
+    if (poll(&pfd, 1, kWriteTimeout) == 0) {
+      return false;
+    }
+#endif
+    return !(pfd.revents & (POLLERR | POLLHUP));
+  }
+
   int write(const void* buf, int size) override {
     if (blocking_) {
       int wrote = 0;
 
       while (size > 0) {
-        struct pollfd pfd;
-        pfd.fd = fd.system_handle();
-        pfd.events = POLLOUT;
-#ifdef _WIN32
-        if (WSAPoll(&pfd, 1, kWriteTimeout) == 0) {
-          errno = map_win32_err(WSAGetLastError());
-          break;
-        }
-#else
-        if (poll(&pfd, 1, kWriteTimeout) == 0) {
-          break;
-        }
-#endif
-        if (pfd.revents & (POLLERR | POLLHUP)) {
+        if (!waitWritable()) {
           break;
         }
         auto x = fd.write(buf, size);
@@ -206,6 +212,73 @@ class UnixStream : public watchman_stream {
     return x.value();
   }
 
+  int writev(const struct iovec* iov, int iovcnt) override {
+    if (blocking_ && !waitWritable()) {
+      return -1;
+    }
+    auto x = fd.writev(iov, iovcnt);
+    if (x.hasError()) {
+#ifdef _WIN32
+      errno = map_win32_err(x.error().value());
+#else
+      errno = x.error().value();
+#endif
+      return -1;
+    }
+    errno = 0;
+    return x.value();
+  }
+
+  int writeWithDescriptor(
+      const void* buf,
+      int size,
+      FileDescriptor::system_handle_type descriptor) override {
+#ifndef _WIN32
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(fd.fd(), (struct sockaddr*)&addr, &addrlen) != 0 ||
+        addr.ss_family != AF_UNIX) {
+      errno = ENOTSUP;
+      return -1;
+    }
+    if (blocking_ && !waitWritable()) {
+      return -1;
+    }
+
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(buf);
+    iov.iov_len = size_t(size);
+    union {
+      struct cmsghdr hdr;
+      char bytes[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.bytes;
+    msg.msg_controllen = sizeof(control.bytes);
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &descriptor, sizeof(int));
+
+    int x;
+    do {
+      x = int(sendmsg(fd.fd(), &msg, 0));
+    } while (x == -1 && errno == EINTR);
+    if (x >= 0) {
+      errno = 0;
+    }
+    return x;
+#else
+    return watchman_stream::writeWithDescriptor(buf, size, descriptor);
+#endif
+  }
+
   w_evt_t getEvents() override {
     return &evt;
   }
@@ -267,6 +340,19 @@ class UnixStream : public watchman_stream {
 #endif
   }
 
+  bool peerHasClosed() override {
+    struct pollfd pfd;
+    pfd.fd = fd.system_handle();
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, 0) <= 0) {
+      return false;
+    }
+    // A peer that has only shut down its writing end is still waiting for
+    // what we have to say, so that isn't treated as closed
+    return (pfd.revents & (POLLHUP | POLLERR)) != 0;
+  }
+
   pid_t getPeerProcessID() const override {
     if (!credvalid) {
       return 0;
@@ -78,6 +78,13 @@ class win_handle : public watchman_stream {
   char* read_cursor{read_buf};
   int read_avail{0};
   bool blocking{true};
+  // Set once the handle's completions go to an I/O completion port, after
+  // which a write is completed by whoever waits on the port
+  bool port_mode{false};
+  // The write that is in flight in port mode.  It is part of the handle so
+  // that the packet of a write can be told apart from that of a read.
+  overlapped_op port_write_op{};
+  HANDLE port_write_event{nullptr};
 
   explicit win_handle(FileDescriptor&& handle);
   ~win_handle();
@@ -100,6 +107,13 @@ class win_handle : public watchman_stream {
   pid_t getPeerProcessID() const override {
     return 0;
   }
+
+  bool peerHasClosed() override {
+    if (PeekNamedPipe(handle(), nullptr, 0, nullptr, nullptr, nullptr)) {
+      return false;
+    }
+    return GetLastError() == ERROR_BROKEN_PIPE;
+  }
 };
 
 #if 1
@@ -206,6 +220,11 @@ win_handle::~win_handle() {
 
   if (read_pending) {
     if (CancelIoEx(handle(), &read_pending->olap)) {
+      if (port_mode) {
+        // Nothing else will wait for the cancellation to complete
+        DWORD bytes;
+        GetOverlappedResult(handle(), &read_pending->olap, &bytes, TRUE);
+      }
       free(read_pending);
       read_pending = nullptr;
     }
@@ -223,6 +242,9 @@ win_handle::~win_handle() {
       free(b);
     }
   }
+  if (port_write_event) {
+    CloseHandle(port_write_event);
+  }
 
   DeleteCriticalSection(&mtx);
 }
@@ -485,7 +507,9 @@ write_completed(DWORD err, DWORD bytes, LPOVERLAPPED olap) {
   // Free the prior struct after possibly initiating another write
   // to minimize the chance of the same address being reused and
   // confusing the completion status
-  free(op);
+  if (op != &h->port_write_op) {
+    free(op);
+  }
 }
 
 // Must be called with the mutex held
@@ -500,6 +524,29 @@ static void initiate_write(class win_handle* h) {
     h->write_tail = nullptr;
   }
 
+  if (h->port_mode) {
+    auto op = &h->port_write_op;
+    memset(&op->olap, 0, sizeof(op->olap));
+    // The packet is still queued to the port; the event is only for
+    // shutdown() to wait on
+    op->olap.hEvent = h->port_write_event;
+    op->h = h;
+    op->wbuf = wbuf;
+    h->write_pending = op;
+    if (!WriteFile(h->handle(), wbuf->cursor, wbuf->len, nullptr, &op->olap)) {
+      DWORD err = GetLastError();
+      if (err != ERROR_IO_PENDING) {
+        stream_debug("WriteFile: failed %s\n", win32_strerror(err));
+        h->write_pending = nullptr;
+        h->errcode = err;
+        h->error_pending = true;
+        free(wbuf);
+        h->waitable.notify();
+      }
+    }
+    return;
+  }
+
   h->write_pending = (overlapped_op*)calloc(1, sizeof(*h->write_pending));
   h->write_pending->h = h;
   h->write_pending->wbuf = wbuf;
@@ -598,6 +645,19 @@ bool win_handle::shutdown() {
   DWORD bytes;
 
   blocking = true;
+  if (port_mode) {
+    // Whoever waits on the port has stopped passing us our completions by
+    // now, so we collect those of the remaining writes ourselves
+    while (write_pending) {
+      DWORD err = 0;
+      bytes = 0;
+      if (!GetOverlappedResult(handle(), &write_pending->olap, &bytes, TRUE)) {
+        err = GetLastError();
+      }
+      write_completed(err, bytes, &write_pending->olap);
+    }
+    return true;
+  }
   while (write_pending) {
     olap_res = get_overlapped_result_ex(
         handle(), &write_pending->olap, &bytes, INFINITE, true);
@@ -611,6 +671,35 @@ bool win_handle::peerIsOwner() {
   return true;
 }
 
+bool w_stm_use_completion_port(watchman_stream* stm) {
+  auto h = dynamic_cast<win_handle*>(stm);
+  if (!h || h->file_type != FILE_TYPE_PIPE) {
+    return false;
+  }
+  EnterCriticalSection(&h->mtx);
+  if (!h->port_mode && !h->read_pending && !h->write_pending) {
+    h->port_write_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    h->port_mode = h->port_write_event != nullptr;
+  }
+  LeaveCriticalSection(&h->mtx);
+  return h->port_mode;
+}
+
+bool w_stm_completed(
+    watchman_stream* stm,
+    OVERLAPPED* olap,
+    DWORD err,
+    DWORD bytes) {
+  auto h = dynamic_cast<win_handle*>(stm);
+  // The OVERLAPPED of a read may have been freed by now, so we only
+  // compare against it; reads collect their own results
+  if (!h || olap != &h->port_write_op.olap) {
+    return false;
+  }
+  write_completed(err, bytes, olap);
+  return true;
+}
+
 std::unique_ptr<watchman_event> w_event_make_named_pipe(void) {
   return std::make_unique<WindowsEvent>();
 }
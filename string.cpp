@@ -5,6 +5,9 @@
 #include <stdarg.h>
 #include <new>
 #include <stdexcept>
+#include "StringScan.h"
+
+namespace strscan = watchman::strscan;
 
 static void w_string_addref(w_string_t* str);
 static void w_string_delref(w_string_t* str);
@@ -39,13 +42,8 @@ w_string w_string_piece::asLowerCase(w_string_type_t stringType) const {
   buf = const_cast<char*>(s->buf);
   s->type = stringType;
 
-  auto cursor = s_;
-  while (cursor < e_) {
-    *buf = (char)tolower((uint8_t)*cursor);
-    ++cursor;
-    ++buf;
-  }
-  *buf = 0;
+  strscan::toLower(buf, s_, size());
+  buf[size()] = 0;
 
   return w_string(s, false);
 }
@@ -68,13 +66,8 @@ w_string w_string_piece::asLowerCaseSuffix(w_string_type_t stringType) const {
   buf = const_cast<char*>(s->buf);
   s->type = stringType;
 
-  auto cursor = suffixPiece.s_;
-  while (cursor < suffixPiece.e_) {
-    *buf = (char)tolower((uint8_t)*cursor);
-    ++cursor;
-    ++buf;
-  }
-  *buf = 0;
+  strscan::toLower(buf, suffixPiece.s_, suffixPiece.size());
+  buf[suffixPiece.size()] = 0;
 
   return w_string(s, false);
 }
@@ -99,97 +92,73 @@ bool w_string_piece::pathIsEqual(w_string_piece other) const {
     return false;
   }
 
+  if (size() == 0) {
+    return true;
+  }
+
   auto A = data();
   auto B = other.data();
 
-  auto end = A + size();
-  for (; A < end; ++A, ++B) {
-    if (*A == *B) {
-      continue;
-    }
-    if (A == data()) {
-      // This is a bit awful, but msys and other similar software
-      // can set the cwd to a lowercase drive letter.  Since we
-      // can't ever watch at a level higher than drive letters,
-      // we really shouldn't care about a case difference there
-      // so we relax the strictness of the check here.
-      // This case only triggers for the first character of the
-      // path.  Paths evaluated with this method are always
-      // absolute.  In theory, we should also do something
-      // reasonable for UNC paths, but folks shouldn't be
-      // watching those with watchman anyway.
-      if (tolower(*A) == tolower(*B)) {
-        continue;
-      }
-    }
-
-    if (is_slash(*A) && is_slash(*B)) {
-      continue;
-    }
+  // This is a bit awful, but msys and other similar software
+  // can set the cwd to a lowercase drive letter.  Since we
+  // can't ever watch at a level higher than drive letters,
+  // we really shouldn't care about a case difference there
+  // so we relax the strictness of the check here.
+  // This case only triggers for the first character of the
+  // path.  Paths evaluated with this method are always
+  // absolute.  In theory, we should also do something
+  // reasonable for UNC paths, but folks shouldn't be
+  // watching those with watchman anyway.
+  if (*A != *B && tolower(*A) != tolower(*B) &&
+      !(is_slash(*A) && is_slash(*B))) {
     return false;
   }
-  return true;
+  return strscan::equalAsPaths(A + 1, B + 1, size() - 1);
 #else
   return *this == other;
 #endif
 }
 
 w_string_piece w_string_piece::dirName() const {
-  if (e_ == s_) {
+  auto end = strscan::findLastSlash(s_, e_);
+  if (!end) {
     return nullptr;
   }
-  for (auto end = e_ - 1; end >= s_; --end) {
-    if (is_slash(*end)) {
-      /* found the end of the parent dir */
+  /* found the end of the parent dir */
 #ifdef _WIN32
-      if (end > s_ && end[-1] == ':') {
-        // Special case for "C:\"; we want to keep the
-        // trailing slash for this case so that we continue
-        // to consider it an absolute path
-        return w_string_piece(s_, 1 + end - s_);
-      }
-#endif
-      return w_string_piece(s_, end - s_);
-    }
+  if (end > s_ && end[-1] == ':') {
+    // Special case for "C:\"; we want to keep the
+    // trailing slash for this case so that we continue
+    // to consider it an absolute path
+    return w_string_piece(s_, 1 + end - s_);
   }
-  return nullptr;
+#endif
+  return w_string_piece(s_, end - s_);
 }
 
 w_string_piece w_string_piece::baseName() const {
-  if (e_ == s_) {
+  auto end = strscan::findLastSlash(s_, e_);
+  if (!end) {
     return *this;
   }
-  for (auto end = e_ - 1; end >= s_; --end) {
-    if (is_slash(*end)) {
-      /* found the end of the parent dir */
+  /* found the end of the parent dir */
 #ifdef _WIN32
-      if (end == e_ && end > s_ && end[-1] == ':') {
-        // Special case for "C:\"; we want the baseName to
-        // be this same component so that we continue
-        // to consider it an absolute path
-        return *this;
-      }
-#endif
-      return w_string_piece(end + 1, e_ - (end + 1));
-    }
+  if (end == e_ && end > s_ && end[-1] == ':') {
+    // Special case for "C:\"; we want the baseName to
+    // be this same component so that we continue
+    // to consider it an absolute path
+    return *this;
   }
-
-  return *this;
+#endif
+  return w_string_piece(end + 1, e_ - (end + 1));
 }
 
 w_string_piece w_string_piece::suffix() const {
-  if (e_ == s_) {
+  auto end = strscan::findLastSlashOrDot(s_, e_);
+  if (!end || is_slash(*end)) {
     return nullptr;
   }
-  for (auto end = e_ - 1; end >= s_; --end) {
-    if (is_slash(*end)) {
-      return nullptr;
-    }
-    if (*end == '.') {
-      return w_string_piece(end + 1, e_ - (end + 1));
-    }
-  }
-  return nullptr;
+  return w_string_piece(end + 1, e_ - (end + 1));
 }
 
 bool w_string_piece::operator<(w_string_piece other) const {
@@ -231,18 +200,7 @@ bool w_string_piece::startsWithCaseInsensitive(w_string_piece prefix) const {
   if (prefix.size() > size()) {
     return false;
   }
-
-  auto me = s_;
-  auto pref = prefix.s_;
-
-  while (pref < prefix.e_) {
-    if (tolower((uint8_t)*me) != tolower((uint8_t)*pref)) {
-      return false;
-    }
-    ++pref;
-    ++me;
-  }
-  return true;
+  return strscan::equalCaseless(s_, prefix.s_, prefix.size());
 }
 
 // string
@@ -346,7 +304,7 @@ w_string w_string::asLowerCaseSuffix() const {
 w_string w_string::normalizeSeparators(char targetSeparator) const {
   w_string_t* s;
   char* buf;
-  uint32_t i, len;
+  uint32_t len;
 
   len = str_->len;
 
@@ -373,13 +331,7 @@ w_string w_string::normalizeSeparators(char targetSeparator) const {
   s->len = len;
   buf = const_cast<char*>(s->buf);
 
-  for (i = 0; i < len; i++) {
-    if (str_->buf[i] == '/' || str_->buf[i] == '\\') {
-      buf[i] = targetSeparator;
-    } else {
-      buf[i] = str_->buf[i];
-    }
-  }
+  strscan::replaceSlashes(buf, str_->buf, len, targetSeparator);
   buf[len] = 0;
 
   return s;
@@ -542,17 +494,10 @@ bool w_string_equal(const w_string_t* a, const w_string_t* b) {
 }
 
 bool w_string_equal_caseless(w_string_piece a, w_string_piece b) {
-  uint32_t i;
-
   if (a.size() != b.size()) {
     return false;
   }
-  for (i = 0; i < a.size(); i++) {
-    if (tolower((uint8_t)a[i]) != tolower((uint8_t)b[i])) {
-      return false;
-    }
-  }
-  return true;
+  return strscan::equalCaseless(a.data(), b.data(), a.size());
 }
 
 bool w_string_piece::hasSuffix(w_string_piece suffix) const {
@@ -585,17 +530,10 @@ bool w_string_startswith(w_string_t* str, w_string_t* prefix) {
 }
 
 bool w_string_startswith_caseless(w_string_t* str, w_string_t* prefix) {
-  size_t i;
-
   if (prefix->len > str->len) {
     return false;
   }
-  for (i = 0; i < prefix->len; i++) {
-    if (tolower((uint8_t)str->buf[i]) != tolower((uint8_t)prefix->buf[i])) {
-      return false;
-    }
-  }
-  return true;
+  return strscan::equalCaseless(str->buf, prefix->buf, prefix->len);
 }
 
 bool w_string_contains_cstr_len(
@@ -603,27 +541,14 @@ bool w_string_contains_cstr_len(
     const char* needle,
     uint32_t nlen) {
 #if HAVE_MEMMEM
+  // The C library's memmem is already vectorized
   return memmem(str->buf, str->len, needle, nlen) != NULL;
 #else
   // Most likely only for Windows.
-  // Inspired by http://stackoverflow.com/a/24000056/149111
-  const char* haystack = str->buf;
-  uint32_t hlen = str->len;
-  const char* limit;
-
-  if (nlen == 0 || hlen < nlen) {
+  if (nlen == 0) {
     return false;
   }
-
-  limit = haystack + hlen - nlen + 1;
-  while ((haystack = (const char*)memchr(
-              haystack, needle[0], limit - haystack)) != NULL) {
-    if (memcmp(haystack, needle, nlen) == 0) {
-      return true;
-    }
-    haystack++;
-  }
-  return false;
+  return strscan::find(str->buf, str->len, needle, nlen) != nullptr;
 #endif
 }
 
@@ -0,0 +1,74 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <string>
+#include <vector>
+#include "BatchStat.h"
+#include "watchman_error_category.h"
+
+using namespace watchman;
+
+#ifndef _WIN32
+TEST(BatchStat, matchesLstat) {
+  auto batch = BatchStat::create(4);
+  if (!batch) {
+    // Not supported in this build or by this kernel; callers
+    // fall back to getFileInformation()
+    return;
+  }
+
+  char tmpl[] = "/tmp/batchstatXXXXXX";
+  ASSERT_NE(mkdtemp(tmpl), nullptr);
+  std::string dir(tmpl);
+
+  std::vector<std::string> names;
+  for (int i = 0; i < 10; ++i) {
+    auto name = dir + "/file" + std::to_string(i);
+    FILE* fp = fopen(name.c_str(), "w");
+    ASSERT_NE(fp, nullptr);
+    fprintf(fp, "%*d", i, i);
+    fclose(fp);
+    names.push_back(name);
+  }
+  auto link = dir + "/link";
+  ASSERT_EQ(symlink("file0", link.c_str()), 0);
+  names.push_back(link);
+  names.push_back(dir);
+  names.push_back(dir + "/missing");
+
+  std::vector<const char*> paths;
+  for (auto& name : names) {
+    paths.push_back(name.c_str());
+  }
+
+  std::vector<BatchStat::Result> results;
+  ASSERT_TRUE(batch->statPaths(paths, results));
+  ASSERT_EQ(results.size(), paths.size());
+
+  for (size_t i = 0; i < paths.size() - 1; ++i) {
+    struct stat st;
+    ASSERT_EQ(lstat(paths[i], &st), 0);
+    FileInformation expect(st);
+    auto& result = results[i];
+    EXPECT_FALSE(result.error) << paths[i];
+    EXPECT_EQ(result.info.mode, expect.mode) << paths[i];
+    EXPECT_EQ(result.info.size, expect.size) << paths[i];
+    EXPECT_EQ(result.info.ino, expect.ino) << paths[i];
+    EXPECT_EQ(result.info.dev, expect.dev) << paths[i];
+    EXPECT_EQ(result.info.nlink, expect.nlink) << paths[i];
+    EXPECT_EQ(result.info.mtime.tv_sec, expect.mtime.tv_sec) << paths[i];
+    EXPECT_EQ(result.info.mtime.tv_nsec, expect.mtime.tv_nsec) << paths[i];
+  }
+  EXPECT_TRUE(results[0].info.isFile());
+  EXPECT_TRUE(results[names.size() - 3].info.isSymlink());
+  EXPECT_TRUE(results[names.size() - 2].info.isDir());
+  EXPECT_EQ(
+      results.back().error, watchman::error_code::no_such_file_or_directory);
+
+  for (size_t i = 0; i < names.size() - 2; ++i) {
+    unlink(paths[i]);
+  }
+  rmdir(dir.c_str());
+}
+#endif
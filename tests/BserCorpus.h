@@ -0,0 +1,104 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include "watchman.h"
+#include <folly/FileUtil.h>
+#include <folly/String.h>
+#include <stdexcept>
+#include <string>
+
+// Access to the corpus of PDUs that is shared by all of the BSER
+// implementations; see tests/bser_corpus/README.md
+namespace watchman {
+namespace bser_corpus {
+
+inline std::string defaultDir() {
+#ifdef WATCHMAN_TEST_SRC_DIR
+  return WATCHMAN_TEST_SRC_DIR "/tests/bser_corpus";
+#else
+  return "tests/bser_corpus";
+#endif
+}
+
+inline std::string readFile(const std::string& dir, const std::string& name) {
+  std::string data;
+  auto path = folly::to<std::string>(dir, "/", name);
+  if (!folly::readFile(path.c_str(), data)) {
+    throw std::runtime_error(folly::to<std::string>(
+        "couldn't read ", path, ": ", folly::errnoStr(errno)));
+  }
+  return data;
+}
+
+// The list of entries, each with the name of its value and its PDUs
+inline json_ref loadManifest(const std::string& dir) {
+  auto data = readFile(dir, "manifest.json");
+  json_error_t jerr;
+  auto manifest = json_loadb(data.data(), data.size(), 0, &jerr);
+  if (!manifest) {
+    throw std::runtime_error(folly::to<std::string>(
+        "couldn't parse ", dir, "/manifest.json: ", jerr.text));
+  }
+  return manifest;
+}
+
+inline json_ref loadValue(const std::string& dir, const json_ref& entry) {
+  auto name = json_string_value(entry.get("name"));
+  auto data = readFile(dir, folly::to<std::string>(name, ".json"));
+  json_error_t jerr;
+  auto value = json_loadb(data.data(), data.size(), 0, &jerr);
+  if (!value) {
+    throw std::runtime_error(folly::to<std::string>(
+        "couldn't parse the value of ", name, ": ", jerr.text));
+  }
+  return value;
+}
+
+// The parts of a v1 or v2 PDU
+struct Pdu {
+  uint32_t version;
+  uint32_t capabilities{0};
+  // Points into the data that the PDU was split from
+  w_string_piece body;
+};
+
+inline Pdu splitPdu(const std::string& data) {
+  Pdu pdu;
+  if (data.compare(0, 2, BSER_MAGIC, 2) == 0) {
+    pdu.version = 1;
+  } else if (data.compare(0, 2, BSER_V2_MAGIC, 2) == 0) {
+    pdu.version = 2;
+  } else {
+    throw std::runtime_error("not a BSER v1 or v2 PDU");
+  }
+  size_t pos = 2;
+  if (pdu.version == 2) {
+    if (data.size() < pos + sizeof(pdu.capabilities)) {
+      throw std::runtime_error("truncated BSER PDU header");
+    }
+    memcpy(&pdu.capabilities, data.data() + pos, sizeof(pdu.capabilities));
+    pos += sizeof(pdu.capabilities);
+  }
+  json_int_t needed;
+  json_int_t len;
+  if (!bunser_int(data.data() + pos, data.size() - pos, &needed, &len) ||
+      data.size() - pos - needed != size_t(len)) {
+    throw std::runtime_error("bad BSER PDU length");
+  }
+  pdu.body = w_string_piece(data.data() + pos + needed, len);
+  return pdu;
+}
+
+inline json_ref decodeBody(w_string_piece body) {
+  json_int_t needed;
+  json_error_t jerr;
+  auto value = bunser(body.data(), body.data() + body.size(), &needed, &jerr);
+  if (!value) {
+    throw std::runtime_error(
+        folly::to<std::string>("couldn't decode BSER: ", jerr.text));
+  }
+  return value;
+}
+
+} // namespace bser_corpus
+} // namespace watchman
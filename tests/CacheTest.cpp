@@ -135,3 +135,105 @@ TEST(CacheTest, future) {
   EXPECT_EQ(cache.size(), 5)
       << "cache should still be full (no excess) but has " << cache.size();
 }
+
+TEST(CacheTest, sharded) {
+  ShardedLRUCache<std::string, int> cache(400, kErrorTTL, 4);
+  EXPECT_EQ(cache.numShards(), 4);
+
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(cache.set(std::to_string(i), int(i))->value(), i) << "inserted";
+  }
+  EXPECT_LE(cache.size(), 400) << "each shard is limited to 100 items";
+  EXPECT_GT(cache.size(), 300) << "the items are spread across the shards";
+  EXPECT_EQ(cache.get("999")->value(), 999) << "most recent item is kept";
+  EXPECT_EQ(cache.get("0"), nullptr) << "least recent item is evicted";
+
+  EXPECT_EQ(cache.erase("999")->value(), 999) << "erased 999";
+  EXPECT_EQ(cache.get("999"), nullptr) << "999 is gone";
+
+  folly::ManualExecutor exec;
+  auto getter = [&exec](const std::string& k) {
+    return folly::makeFuture(k).via(&exec).thenValue(
+        [](std::string key) { return int(key.size()); });
+  };
+  auto f1 = cache.get("pending", getter);
+  auto f2 = cache.get("pending", getter);
+  exec.drain();
+  EXPECT_EQ(std::move(f1).get()->value(), 7);
+  EXPECT_EQ(std::move(f2).get()->value(), 7) << "shared the pending lookup";
+
+  auto stats = cache.stats();
+  EXPECT_EQ(stats.size, cache.size());
+  EXPECT_EQ(stats.cacheStore, 1001) << "1000 sets and one lookup";
+  EXPECT_EQ(stats.cacheErase, 1);
+  EXPECT_EQ(stats.cacheShare, 1);
+  EXPECT_EQ(stats.cacheHit, 1);
+  EXPECT_EQ(stats.cacheMiss, 3) << "0, 999 after erase, and pending";
+
+  cache.clear();
+  EXPECT_EQ(cache.size(), 0) << "cleared every shard";
+  EXPECT_EQ(cache.stats().clearCount, 1);
+}
+
+TEST(CacheTest, shardedSmallCacheIsNotSplit) {
+  ShardedLRUCache<int, int> cache(5, kErrorTTL);
+  EXPECT_EQ(cache.numShards(), 1);
+  for (int i = 0; i < 6; ++i) {
+    cache.set(i, int(i));
+  }
+  EXPECT_EQ(cache.size(), 5);
+  EXPECT_EQ(cache.get(0), nullptr) << "exact LRU with a single shard";
+}
+
+TEST(CacheTest, weighed) {
+  auto weigher = [](const std::string&, const std::string& value) {
+    return value.size();
+  };
+  LRUCache<std::string, std::string> cache(100, kErrorTTL, weigher, 10);
+
+  cache.set("a", std::string("xxxx"));
+  cache.set("b", std::string("xxxx"));
+  EXPECT_EQ(cache.stats().bytes, 8);
+  cache.set("c", std::string("xxxx"));
+  EXPECT_EQ(cache.get("a"), nullptr) << "a was evicted to make room for c";
+  EXPECT_EQ(cache.stats().bytes, 8);
+
+  cache.set("b", std::string("x"));
+  EXPECT_EQ(cache.stats().bytes, 5) << "replacing b released its weight";
+  cache.erase("c");
+  EXPECT_EQ(cache.stats().bytes, 1) << "erasing c released its weight";
+
+  cache.set("big", std::string(11, 'x'));
+  EXPECT_EQ(cache.get("big"), nullptr) << "too heavy for the whole cache";
+  EXPECT_EQ(cache.stats().bytes, 0);
+}
+
+TEST(CacheTest, sharedBudget) {
+  auto weigher = [](const int&, const int&) { return size_t(10); };
+  auto budget = std::make_shared<CacheMemoryBudget>(100);
+  LRUCache<int, int> small(100, kErrorTTL, weigher, 0, budget);
+  {
+    LRUCache<int, int> large(100, kErrorTTL, weigher, 0, budget);
+
+    for (int i = 0; i < 3; ++i) {
+      small.set(i, int(i));
+    }
+    for (int i = 0; i < 7; ++i) {
+      large.set(i, int(i));
+    }
+    EXPECT_EQ(budget->usedBytes(), 100) << "exactly at the budget";
+
+    large.set(7, 7);
+    EXPECT_EQ(budget->usedBytes(), 100) << "the budget was enforced";
+    EXPECT_EQ(large.size(), 7) << "the largest cache was shrunk";
+    EXPECT_EQ(large.get(0), nullptr) << "by evicting its oldest item";
+
+    small.set(3, 3);
+    EXPECT_EQ(small.size(), 4) << "the small cache can still grow";
+    EXPECT_EQ(large.size(), 6) << "at the expense of the large cache";
+  }
+  EXPECT_EQ(budget->usedBytes(), 40) << "the large cache released its bytes";
+
+  small.clear();
+  EXPECT_EQ(budget->usedBytes(), 0) << "clearing released the bytes";
+}
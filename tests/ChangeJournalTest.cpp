@@ -0,0 +1,138 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <vector>
+#include "ChangeJournal.h"
+
+using namespace watchman;
+
+namespace {
+struct Node {
+  int id;
+  ChangeJournal<Node>::Entry* journal_entry{nullptr};
+
+  explicit Node(int id) : id(id) {}
+};
+
+std::vector<int> idsSince(const ChangeJournal<Node>& journal, uint32_t tick) {
+  std::vector<int> ids;
+  journal.forEachSince(tick, [&](Node* node) {
+    ids.push_back(node->id);
+    return true;
+  });
+  return ids;
+}
+} // namespace
+
+TEST(ChangeJournal, orderAndSince) {
+  ChangeJournal<Node> journal;
+  Node a(1), b(2), c(3);
+
+  EXPECT_TRUE(journal.empty());
+  EXPECT_EQ(idsSince(journal, 0), std::vector<int>{});
+
+  journal.append(&a, 1);
+  journal.append(&b, 2);
+  journal.append(&c, 3);
+  EXPECT_EQ(idsSince(journal, 0), (std::vector<int>{3, 2, 1}));
+  EXPECT_EQ(idsSince(journal, 1), (std::vector<int>{3, 2}));
+  EXPECT_EQ(idsSince(journal, 3), std::vector<int>{});
+
+  // Changing a moves it to the newest end and leaves a hole behind
+  journal.append(&a, 4);
+  EXPECT_EQ(idsSince(journal, 0), (std::vector<int>{1, 3, 2}));
+  EXPECT_EQ(idsSince(journal, 2), (std::vector<int>{1, 3}));
+  EXPECT_EQ(journal.size(), 4);
+
+  // Re-appending the newest node just revises its tick
+  journal.append(&a, 5);
+  EXPECT_EQ(journal.size(), 4);
+  EXPECT_EQ(idsSince(journal, 4), std::vector<int>{1});
+
+  // Ticks may repeat
+  journal.append(&b, 5);
+  EXPECT_EQ(idsSince(journal, 4), (std::vector<int>{2, 1}));
+
+  ChangeJournal<Node>::unlink(&c);
+  EXPECT_EQ(c.journal_entry, nullptr);
+  EXPECT_EQ(idsSince(journal, 0), (std::vector<int>{2, 1}));
+
+  EXPECT_EQ(journal.compact(), 3);
+  EXPECT_EQ(journal.size(), 2);
+  EXPECT_EQ(idsSince(journal, 0), (std::vector<int>{2, 1}));
+  EXPECT_EQ(idsSince(journal, 4), (std::vector<int>{2, 1}));
+
+  // The entries were moved by compaction; make sure that the nodes
+  // know where they went
+  journal.append(&a, 6);
+  EXPECT_EQ(idsSince(journal, 0), (std::vector<int>{1, 2}));
+  ChangeJournal<Node>::unlink(&b);
+  EXPECT_EQ(idsSince(journal, 0), std::vector<int>{1});
+}
+
+TEST(ChangeJournal, unlinkWhileVisitingAndStop) {
+  ChangeJournal<Node> journal;
+  std::vector<Node> nodes;
+  for (int i = 0; i < 10; ++i) {
+    nodes.emplace_back(i);
+  }
+  for (auto& node : nodes) {
+    journal.append(&node, uint32_t(node.id));
+  }
+
+  // Unlink the even nodes while walking
+  journal.forEach([&](Node* node) {
+    if (node->id % 2 == 0) {
+      ChangeJournal<Node>::unlink(node);
+    }
+    return true;
+  });
+  EXPECT_EQ(idsSince(journal, 0), (std::vector<int>{9, 7, 5, 3, 1}));
+
+  // Stop early
+  std::vector<int> ids;
+  journal.forEach([&](Node* node) {
+    ids.push_back(node->id);
+    return ids.size() < 2;
+  });
+  EXPECT_EQ(ids, (std::vector<int>{9, 7}));
+}
+
+TEST(ChangeJournal, autoCompact) {
+  ChangeJournal<Node> journal;
+  Node a(1), b(2);
+  journal.append(&b, 0);
+
+  // Alternating between two nodes leaves a hole with every append;
+  // the journal must not grow without bound
+  for (uint32_t tick = 1; tick < 100000; ++tick) {
+    journal.append(tick % 2 ? &a : &b, tick);
+  }
+  EXPECT_LT(journal.size(), 4096);
+  EXPECT_EQ(idsSince(journal, 0), (std::vector<int>{1, 2}));
+  EXPECT_EQ(idsSince(journal, 99998), std::vector<int>{1});
+}
+
+TEST(ChangeJournal, positions) {
+  ChangeJournal<Node> journal;
+  Node a(1), b(2), c(3);
+  journal.append(&a, 1);
+  journal.append(&b, 2);
+  journal.append(&c, 2);
+  journal.append(&a, 3);
+
+  EXPECT_EQ(journal.entryAt(0).node, nullptr);
+  EXPECT_EQ(journal.entryAt(1).node, &b);
+  EXPECT_EQ(journal.entryAt(3).node, &a);
+  EXPECT_EQ(journal.positionOf(0), 0);
+  EXPECT_EQ(journal.positionOf(2), 1);
+  EXPECT_EQ(journal.positionOf(3), 3);
+  EXPECT_EQ(journal.positionOf(4), 4);
+
+  auto generation = journal.generation();
+  journal.compact();
+  EXPECT_NE(journal.generation(), generation);
+  EXPECT_EQ(journal.entryAt(0).node, &b);
+  EXPECT_EQ(journal.positionOf(3), 2);
+}
@@ -0,0 +1,108 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include "ChildTable.h"
+
+using namespace watchman;
+
+namespace {
+struct NameOf {
+  std::string_view operator()(const std::unique_ptr<std::string>& s) const {
+    return *s;
+  }
+};
+
+// A hash function with lots of collisions, so that we exercise
+// the probing and backward shift deletion logic
+struct BadHash {
+  size_t operator()(std::string_view s) const {
+    return s.empty() ? 0 : size_t(s[0]);
+  }
+};
+
+template <typename Hash>
+using Table =
+    ChildTable<std::string_view, std::unique_ptr<std::string>, NameOf, Hash>;
+
+template <typename Hash>
+void exerciseTable() {
+  Table<Hash> table;
+  std::set<std::string> expected;
+
+  EXPECT_TRUE(table.empty());
+  EXPECT_TRUE(table.find("nope") == table.end());
+  EXPECT_EQ(table.erase("nope"), 0);
+
+  for (int i = 0; i < 500; ++i) {
+    auto name = std::to_string(i);
+    auto result = table.emplace(std::make_unique<std::string>(name));
+    EXPECT_TRUE(result.second);
+    EXPECT_EQ(*result.first->second, name);
+    expected.insert(name);
+  }
+  EXPECT_EQ(table.size(), 500);
+
+  // Duplicate insert leaves the original in place
+  auto dup = table.emplace(std::make_unique<std::string>("7"));
+  EXPECT_FALSE(dup.second);
+  EXPECT_EQ(table.size(), 500);
+
+  // Remove every third entry
+  for (int i = 0; i < 500; i += 3) {
+    EXPECT_EQ(table.erase(std::to_string(i)), 1);
+    expected.erase(std::to_string(i));
+  }
+  EXPECT_EQ(table.size(), expected.size());
+
+  for (int i = 0; i < 500; ++i) {
+    auto name = std::to_string(i);
+    auto it = table.find(name);
+    if (expected.count(name)) {
+      ASSERT_TRUE(it != table.end()) << name;
+      EXPECT_EQ(*it->second, name);
+    } else {
+      EXPECT_TRUE(it == table.end()) << name;
+    }
+  }
+
+  std::set<std::string> iterated;
+  for (auto& it : table) {
+    iterated.insert(*it.second);
+  }
+  EXPECT_EQ(iterated, expected);
+
+  table.clear();
+  EXPECT_TRUE(table.empty());
+  EXPECT_TRUE(table.begin() == table.end());
+}
+} // namespace
+
+TEST(ChildTableTest, basics) {
+  exerciseTable<std::hash<std::string_view>>();
+}
+
+TEST(ChildTableTest, collisions) {
+  exerciseTable<BadHash>();
+}
+
+TEST(ChildTableTest, reserve) {
+  Table<std::hash<std::string_view>> table;
+  EXPECT_EQ(table.allocatedBytes(), 0);
+  table.reserve(100);
+  auto reserved = table.allocatedBytes();
+  EXPECT_GE(reserved, 100 * sizeof(void*));
+  for (int i = 0; i < 100; ++i) {
+    table.emplace(std::make_unique<std::string>(std::to_string(i)));
+  }
+  EXPECT_EQ(table.size(), 100);
+  // The reservation was enough, so the table didn't grow
+  EXPECT_EQ(table.allocatedBytes(), reserved);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_TRUE(table.find(std::to_string(i)) != table.end());
+  }
+}
@@ -0,0 +1,136 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <atomic>
+#include <thread>
+#include "CommandAdmission.h"
+
+using namespace watchman;
+using Priority = CommandAdmission::Priority;
+
+namespace {
+CommandAdmission::Config limitNormal(size_t limit) {
+  CommandAdmission::Config config;
+  config.maxRunning[size_t(Priority::Normal)] = limit;
+  return config;
+}
+
+const int clientA = 1;
+const int clientB = 2;
+} // namespace
+
+TEST(CommandAdmission, interactiveCommandsAreNeverHeldBack) {
+  CommandAdmission admission(limitNormal(1));
+  auto normal = admission.admit(Priority::Normal, &clientA);
+  ASSERT_TRUE(normal);
+  auto a = admission.admit(Priority::Interactive, &clientA);
+  auto b = admission.admit(Priority::Interactive, &clientA);
+  EXPECT_TRUE(a);
+  EXPECT_TRUE(b);
+}
+
+TEST(CommandAdmission, limitsConcurrentCommandsOfAPriority) {
+  CommandAdmission admission(limitNormal(1));
+  auto first = admission.admit(Priority::Normal, &clientA);
+  ASSERT_TRUE(first);
+
+  std::atomic<bool> admitted{false};
+  std::thread waiter([&] {
+    auto second = admission.admit(Priority::Normal, &clientB);
+    admitted = bool(second);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(admitted);
+  EXPECT_EQ(1, admission.getStats().waiting[size_t(Priority::Normal)]);
+
+  // Background commands have a limit of their own
+  EXPECT_TRUE(admission.admit(Priority::Background, &clientA));
+
+  first.reset();
+  waiter.join();
+  EXPECT_TRUE(admitted);
+
+  auto stats = admission.getStats();
+  EXPECT_EQ(2, stats.admitted[size_t(Priority::Normal)]);
+  EXPECT_EQ(1, stats.queued[size_t(Priority::Normal)]);
+  EXPECT_EQ(0, stats.running[size_t(Priority::Normal)]);
+}
+
+TEST(CommandAdmission, limitsConcurrentCommandsOfAClient) {
+  CommandAdmission::Config config;
+  config.maxRunningPerClient = 1;
+  config.maxWait = std::chrono::milliseconds(10);
+  CommandAdmission admission(config);
+
+  auto a = admission.admit(Priority::Normal, &clientA);
+  ASSERT_TRUE(a);
+  // Another client isn't held up by the first
+  EXPECT_TRUE(admission.admit(Priority::Background, &clientB));
+  // The first client has to wait, and gives up after maxWait
+  EXPECT_FALSE(admission.admit(Priority::Background, &clientA));
+  EXPECT_EQ(1, admission.getStats().rejected[size_t(Priority::Background)]);
+}
+
+TEST(CommandAdmission, rejectsAfterWaitingForTooLong) {
+  auto config = limitNormal(1);
+  config.maxWait = std::chrono::milliseconds(10);
+  CommandAdmission admission(config);
+  auto running = admission.admit(Priority::Normal, &clientA);
+  ASSERT_TRUE(running);
+  EXPECT_FALSE(admission.admit(Priority::Normal, &clientB));
+  EXPECT_EQ(0, admission.getStats().waiting[size_t(Priority::Normal)]);
+}
+
+TEST(CommandAdmission, rejectsWhenTooManyAreWaiting) {
+  auto config = limitNormal(1);
+  config.maxQueued = 1;
+  CommandAdmission admission(config);
+  auto first = admission.admit(Priority::Normal, &clientA);
+  ASSERT_TRUE(first);
+  std::thread waiter([&] { admission.admit(Priority::Normal, &clientB); });
+  while (admission.getStats().waiting[size_t(Priority::Normal)] == 0) {
+    std::this_thread::yield();
+  }
+  EXPECT_FALSE(admission.admit(Priority::Normal, &clientB));
+  first.reset();
+  waiter.join();
+  EXPECT_EQ(1, admission.getStats().rejected[size_t(Priority::Normal)]);
+}
+
+TEST(CommandAdmission, classifiesCommands) {
+  auto query = [](json_ref spec) {
+    return CommandAdmission::classify(
+        "query",
+        json_array(
+            {typed_string_to_json("query"),
+             typed_string_to_json("/root"),
+             spec}));
+  };
+
+  EXPECT_EQ(
+      Priority::Interactive,
+      CommandAdmission::classify(
+          "clock", json_array({typed_string_to_json("clock")})));
+  EXPECT_EQ(
+      Priority::Background,
+      CommandAdmission::classify(
+          "find", json_array({typed_string_to_json("find")})));
+  EXPECT_EQ(
+      Priority::Interactive,
+      query(json_object({{"since", typed_string_to_json("c:1:2")}})));
+  EXPECT_EQ(
+      Priority::Normal,
+      query(json_object({{"suffix", typed_string_to_json("js")}})));
+  EXPECT_EQ(Priority::Background, query(json_object()));
+
+  // A query can ask to be treated as less urgent, but not as more
+  EXPECT_EQ(
+      Priority::Background,
+      query(json_object(
+          {{"since", typed_string_to_json("c:1:2")},
+           {"priority", typed_string_to_json("background")}})));
+  EXPECT_EQ(
+      Priority::Background,
+      query(json_object({{"priority", typed_string_to_json("interactive")}})));
+}
@@ -0,0 +1,113 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "CommandStats.h"
+#include <folly/portability/GTest.h>
+
+using namespace watchman;
+
+TEST(CommandStats, classifiesPdusAndClients) {
+  EXPECT_EQ(CommandStats::Pdu::Json, CommandStats::pduFor(is_json_compact));
+  EXPECT_EQ(CommandStats::Pdu::Json, CommandStats::pduFor(is_json_pretty));
+  EXPECT_EQ(CommandStats::Pdu::Bser, CommandStats::pduFor(is_bser));
+  EXPECT_EQ(CommandStats::Pdu::BserV3, CommandStats::pduFor(is_bser_v3));
+  EXPECT_EQ(CommandStats::Pdu::Other, CommandStats::pduFor(need_data));
+
+  EXPECT_EQ(
+      CommandStats::ClientClass::Owner,
+      CommandStats::clientClassFor(123, true));
+  EXPECT_EQ(
+      CommandStats::ClientClass::OtherUser,
+      CommandStats::clientClassFor(123, false));
+  EXPECT_EQ(
+      CommandStats::ClientClass::Unknown,
+      CommandStats::clientClassFor(0, true));
+}
+
+TEST(CommandStats, countsCallsErrorsAndInflight) {
+  CommandStats stats;
+  {
+    CommandStats::Call call(
+        stats, CommandStats::Pdu::Json, CommandStats::ClientClass::Owner);
+    EXPECT_EQ(1, stats.calls());
+    EXPECT_EQ(1, stats.inflight());
+  }
+  {
+    CommandStats::Call call(
+        stats, CommandStats::Pdu::BserV2, CommandStats::ClientClass::Owner);
+    call.fail();
+  }
+  EXPECT_EQ(2, stats.calls());
+  EXPECT_EQ(1, stats.errors());
+  EXPECT_EQ(0, stats.inflight());
+
+  auto json = stats.latencyUs(
+      CommandStats::Pdu::Json, CommandStats::ClientClass::Owner);
+  ASSERT_NE(nullptr, json);
+  EXPECT_EQ(1, json->count());
+  EXPECT_NE(
+      nullptr,
+      stats.latencyUs(
+          CommandStats::Pdu::BserV2, CommandStats::ClientClass::Owner));
+  // Nothing is allocated for what no client has sent
+  EXPECT_EQ(
+      nullptr,
+      stats.latencyUs(
+          CommandStats::Pdu::Json, CommandStats::ClientClass::Unknown));
+}
+
+TEST(CommandStats, toJsonListsLatenciesAndResets) {
+  CommandStats stats;
+  {
+    CommandStats::Call call(
+        stats,
+        CommandStats::Pdu::Bser,
+        CommandStats::ClientClass::OtherUser);
+  }
+  CommandStats::Call inflight(
+      stats, CommandStats::Pdu::Json, CommandStats::ClientClass::Owner);
+
+  auto json = stats.toJson(true);
+  EXPECT_EQ(2, json_integer_value(json.get("calls")));
+  EXPECT_EQ(0, json_integer_value(json.get("errors")));
+  EXPECT_EQ(1, json_integer_value(json.get("inflight")));
+  auto& latencies = json.get("latencies").array();
+  ASSERT_EQ(1, latencies.size());
+  EXPECT_EQ(
+      w_string_piece("bser"),
+      w_string_piece(json_to_w_string(latencies[0].get("pdu"))));
+  EXPECT_EQ(
+      w_string_piece("other-user"),
+      w_string_piece(json_to_w_string(latencies[0].get("client"))));
+  EXPECT_EQ(
+      1, json_integer_value(latencies[0].get("latency_us").get("count")));
+
+  json = stats.toJson(false);
+  EXPECT_EQ(0, json_integer_value(json.get("calls")));
+  EXPECT_EQ(1, json_integer_value(json.get("inflight")));
+  EXPECT_EQ(0, json.get("latencies").array().size());
+}
+
+TEST(CommandStats, addsMetricsLabelledByCommand) {
+  CommandStats stats;
+  {
+    CommandStats::Call call(
+        stats, CommandStats::Pdu::Json, CommandStats::ClientClass::Owner);
+    call.fail();
+  }
+  MetricsWriter metrics;
+  stats.addMetrics(metrics, "query");
+  auto text = metrics.render();
+  EXPECT_NE(
+      std::string::npos,
+      text.find("watchman_command_calls_total{command=\"query\"} 1\n"));
+  EXPECT_NE(
+      std::string::npos,
+      text.find("watchman_command_errors_total{command=\"query\"} 1\n"));
+  EXPECT_NE(
+      std::string::npos,
+      text.find("watchman_command_inflight{command=\"query\"} 0\n"));
+  EXPECT_NE(
+      std::string::npos,
+      text.find("watchman_command_latency_us_count{command=\"query\","
+                "pdu=\"json\",client=\"owner\"} 1\n"));
+}
@@ -0,0 +1,82 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <stdexcept>
+#include "ContentHashRemote.h"
+
+using namespace watchman;
+
+namespace {
+const char* const kSha1 = "da39a3ee5e6b4b0d3255bfef95601890afd80709";
+}
+
+TEST(ContentHashRemote, parsesManifest) {
+  auto manifest = ContentHashRemote::parseManifest(
+      folly::to<std::string>(
+          kSha1, " 0 empty\n", kSha1, " 12 dir/with space.txt\n\n"),
+      ContentHashAlgorithm::Sha1);
+  ASSERT_EQ(2, manifest.size());
+
+  auto& empty = manifest.at(w_string("empty", W_STRING_BYTE));
+  EXPECT_EQ(0, empty.fileSize);
+  EXPECT_EQ(0xda, empty.hash[0]);
+  EXPECT_EQ(0x09, empty.hash[19]);
+  // The remainder of the value is zero filled
+  EXPECT_EQ(0, empty.hash[20]);
+
+  auto& spaced = manifest.at(w_string("dir/with space.txt", W_STRING_BYTE));
+  EXPECT_EQ(12, spaced.fileSize);
+}
+
+TEST(ContentHashRemote, parsesManifestWithoutTrailingNewline) {
+  auto manifest = ContentHashRemote::parseManifest(
+      folly::to<std::string>(kSha1, " 3 a"), ContentHashAlgorithm::Sha1);
+  EXPECT_EQ(1, manifest.count(w_string("a", W_STRING_BYTE)));
+}
+
+TEST(ContentHashRemote, rejectsMalformedManifests) {
+  auto parse = [](const std::string& data) {
+    return ContentHashRemote::parseManifest(data, ContentHashAlgorithm::Sha1);
+  };
+  // Missing the size and path
+  EXPECT_THROW(parse(kSha1), std::runtime_error);
+  // Missing the path
+  EXPECT_THROW(
+      parse(folly::to<std::string>(kSha1, " 3 ")), std::runtime_error);
+  // Not hex
+  EXPECT_THROW(parse("zz 3 a"), std::runtime_error);
+  // A digest of another algorithm
+  EXPECT_THROW(parse("da39a3ee 3 a"), std::runtime_error);
+  // Not a size
+  EXPECT_THROW(
+      parse(folly::to<std::string>(kSha1, " big a")), std::runtime_error);
+}
+
+TEST(ContentHashRemote, formatsManifestsThatParse) {
+  ContentHashRemote::Manifest manifest;
+  ContentHashRemote::ManifestEntry entry{7, ContentHashRemote::HashValue{}};
+  entry.hash[0] = 0xab;
+  manifest[w_string("b", W_STRING_BYTE)] = entry;
+  entry.fileSize = 9;
+  manifest[w_string("a", W_STRING_BYTE)] = entry;
+
+  auto data =
+      ContentHashRemote::formatManifest(manifest, ContentHashAlgorithm::Sha1);
+  // Ordered by path
+  EXPECT_EQ(
+      folly::to<std::string>(
+          "ab",
+          std::string(38, '0'),
+          " 9 a\n",
+          "ab",
+          std::string(38, '0'),
+          " 7 b\n"),
+      data);
+
+  auto parsed =
+      ContentHashRemote::parseManifest(data, ContentHashAlgorithm::Sha1);
+  ASSERT_EQ(2, parsed.size());
+  EXPECT_EQ(7, parsed.at(w_string("b", W_STRING_BYTE)).fileSize);
+  EXPECT_EQ(entry.hash, parsed.at(w_string("a", W_STRING_BYTE)).hash);
+}
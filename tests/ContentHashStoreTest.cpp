@@ -0,0 +1,121 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/FileUtil.h>
+#include <folly/portability/GTest.h>
+#include <string>
+#include "ContentHashStore.h"
+
+using namespace watchman;
+
+namespace {
+ContentHashCacheKey makeKey(const char* name, size_t size, uint64_t ino) {
+  struct timespec mtime {
+    1000, 500
+  };
+  return ContentHashCacheKey{w_string(name, W_STRING_BYTE), size, mtime, ino};
+}
+
+ContentHashStore::HashValue makeHash(uint8_t seed) {
+  ContentHashStore::HashValue value{};
+  for (size_t i = 0; i < contentHashSize(ContentHashAlgorithm::Sha1); ++i) {
+    value[i] = uint8_t(seed + i);
+  }
+  return value;
+}
+
+class ContentHashStoreTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char tmpl[] = "/tmp/contenthashstoreXXXXXX";
+    ASSERT_NE(mkdtemp(tmpl), nullptr);
+    dir_ = tmpl;
+    path_ = w_string::pathCat({w_string(dir_.c_str(), W_STRING_BYTE),
+                               w_string("store", W_STRING_BYTE)});
+  }
+
+  void TearDown() override {
+    unlink(path_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  std::shared_ptr<ContentHashStore> makeStore(size_t maxItems = 16) {
+    return std::make_shared<ContentHashStore>(
+        path_, w_string("/some/root", W_STRING_BYTE), maxItems);
+  }
+
+  std::string dir_;
+  w_string path_;
+};
+} // namespace
+
+TEST_F(ContentHashStoreTest, survivesRestart) {
+  {
+    auto store = makeStore();
+    EXPECT_FALSE(store->lookup(makeKey("a", 10, 1)).has_value());
+    store->store(makeKey("a", 10, 1), makeHash(1));
+    store->store(makeKey("b", 20, 2), makeHash(2));
+    store->save();
+  }
+
+  auto store = makeStore();
+  auto hash = store->lookup(makeKey("a", 10, 1));
+  ASSERT_TRUE(hash.has_value());
+  EXPECT_EQ(makeHash(1), *hash);
+  hash = store->lookup(makeKey("b", 20, 2));
+  ASSERT_TRUE(hash.has_value());
+  EXPECT_EQ(makeHash(2), *hash);
+
+  // Any change to the metadata invalidates the record
+  EXPECT_FALSE(store->lookup(makeKey("a", 11, 1)).has_value());
+  EXPECT_FALSE(store->lookup(makeKey("a", 10, 3)).has_value());
+  auto key = makeKey("a", 10, 1);
+  key.mtime.tv_nsec++;
+  EXPECT_FALSE(store->lookup(key).has_value());
+  key = makeKey("a", 10, 1);
+  key.algorithm = ContentHashAlgorithm::Blake3;
+  EXPECT_FALSE(store->lookup(key).has_value());
+}
+
+TEST_F(ContentHashStoreTest, newVersionReplacesRecord) {
+  auto store = makeStore();
+  store->store(makeKey("a", 10, 1), makeHash(1));
+  store->store(makeKey("a", 12, 1), makeHash(3));
+  EXPECT_FALSE(store->lookup(makeKey("a", 10, 1)).has_value());
+  auto hash = store->lookup(makeKey("a", 12, 1));
+  ASSERT_TRUE(hash.has_value());
+  EXPECT_EQ(makeHash(3), *hash);
+}
+
+TEST_F(ContentHashStoreTest, dropsLeastRecentlyUsed) {
+  {
+    auto store = makeStore(2);
+    store->store(makeKey("a", 10, 1), makeHash(1));
+    store->store(makeKey("b", 10, 2), makeHash(2));
+    store->store(makeKey("c", 10, 3), makeHash(3));
+    // Using a makes b the least recently used
+    EXPECT_TRUE(store->lookup(makeKey("a", 10, 1)).has_value());
+    store->save();
+  }
+
+  auto store = makeStore(2);
+  EXPECT_TRUE(store->lookup(makeKey("a", 10, 1)).has_value());
+  EXPECT_FALSE(store->lookup(makeKey("b", 10, 2)).has_value());
+  EXPECT_TRUE(store->lookup(makeKey("c", 10, 3)).has_value());
+}
+
+TEST_F(ContentHashStoreTest, ignoresDamagedStore) {
+  {
+    auto store = makeStore();
+    store->store(makeKey("a", 10, 1), makeHash(1));
+    store->save();
+  }
+
+  std::string data;
+  ASSERT_TRUE(folly::readFile(path_.c_str(), data));
+  data.resize(data.size() - 8);
+  ASSERT_TRUE(folly::writeFile(data, path_.c_str()));
+
+  auto store = makeStore();
+  EXPECT_FALSE(store->lookup(makeKey("a", 10, 1)).has_value());
+}
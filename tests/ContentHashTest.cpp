@@ -0,0 +1,71 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/futures/Future.h>
+#include <folly/portability/GTest.h>
+#include <string>
+#include <vector>
+#include "ContentHash.h"
+#include "FileSystem.h"
+#include "ThreadPool.h"
+
+using namespace watchman;
+
+#ifndef _WIN32
+TEST(ContentHash, batchMatchesImmediate) {
+  getThreadPool().start(4, 1024);
+
+  char tmpl[] = "/tmp/contenthashXXXXXX";
+  ASSERT_NE(mkdtemp(tmpl), nullptr);
+  w_string root(tmpl, W_STRING_BYTE);
+
+  // A mix of small files, which are batched together, and a file that
+  // is large enough to be read ahead
+  std::vector<size_t> sizes{0, 1, 100, 4096, 300000, 3 * 1024 * 1024 + 17};
+  for (size_t i = 0; i < 200; ++i) {
+    sizes.push_back(i * 37);
+  }
+
+  std::vector<ContentHashCacheKey> keys;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    auto name = w_string::build("file", i);
+    auto path = w_string::pathCat({root, name});
+    FILE* fp = fopen(path.c_str(), "w");
+    ASSERT_NE(fp, nullptr);
+    for (size_t j = 0; j < sizes[i]; ++j) {
+      fputc(int((i + j * 7) & 0xff), fp);
+    }
+    fclose(fp);
+
+    auto st = getFileInformation(path.c_str());
+    keys.push_back(ContentHashCacheKey{
+        name, size_t(st.size), st.mtime, uint64_t(st.ino)});
+  }
+  // The same file twice shares the one computation
+  keys.push_back(keys[4]);
+
+  ContentHashCache cache(root, keys.size() * 2, std::chrono::seconds(1));
+  auto futures = cache.getBatch(keys);
+  ASSERT_EQ(futures.size(), keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto node = std::move(futures[i]).get();
+    auto path = w_string::pathCat({root, keys[i].relativePath});
+    EXPECT_EQ(
+        ContentHashCache::computeHashImmediate(path.c_str()), node->value())
+        << path;
+  }
+  EXPECT_EQ(cache.stats().cacheStore, keys.size() - 1);
+
+  // A second batch is satisfied by the cache
+  futures = cache.getBatch(keys);
+  for (auto& f : futures) {
+    std::move(f).get();
+  }
+  EXPECT_EQ(cache.stats().cacheStore, keys.size() - 1);
+
+  for (auto& key : keys) {
+    unlink(w_string::pathCat({root, key.relativePath}).c_str());
+  }
+  rmdir(root.c_str());
+}
+#endif
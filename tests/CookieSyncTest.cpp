@@ -0,0 +1,105 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman.h"
+#include <folly/portability/GTest.h>
+#include <thread>
+
+using namespace watchman;
+using namespace std::chrono;
+
+namespace {
+class CookieSyncTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char tmpl[] = "/tmp/cookiesyncXXXXXX";
+    ASSERT_NE(mkdtemp(tmpl), nullptr);
+    dir_ = w_string(tmpl, W_STRING_BYTE);
+  }
+
+  void TearDown() override {
+    rmdir(dir_.c_str());
+  }
+
+  // Returns the name of the serial'th cookie that sync creates
+  static w_string cookieName(const CookieSync& sync, int serial) {
+    return w_string::build(sync.cookiePrefix(), serial);
+  }
+
+  // Waits for the file at path to be created, as a watcher would
+  static bool waitForFile(const w_string& path) {
+    auto deadline = steady_clock::now() + seconds(10);
+    while (steady_clock::now() < deadline) {
+      if (w_path_exists(path.c_str())) {
+        return true;
+      }
+      std::this_thread::sleep_for(milliseconds(1));
+    }
+    return false;
+  }
+
+  w_string dir_;
+};
+} // namespace
+
+TEST_F(CookieSyncTest, callersShareTheCookieAfterTheOneInFlight) {
+  CookieSync sync(dir_);
+  sync.setBatchWindow(seconds(10));
+
+  std::thread first([&] { sync.syncToNow(seconds(10)); });
+  auto firstCookie = cookieName(sync, 0);
+  ASSERT_TRUE(waitForFile(firstCookie));
+
+  // These arrive while the first cookie is in flight, so they wait for
+  // the next one, which is not written yet
+  std::thread second([&] { sync.syncToNow(seconds(10)); });
+  std::thread third([&] { sync.syncToNow(seconds(10)); });
+  std::this_thread::sleep_for(milliseconds(100));
+  auto nextCookie = cookieName(sync, 1);
+  EXPECT_FALSE(w_path_exists(nextCookie.c_str()));
+
+  // Observing the first cookie releases its caller and writes the next
+  sync.notifyCookie(firstCookie);
+  first.join();
+  ASSERT_TRUE(waitForFile(nextCookie));
+  sync.notifyCookie(nextCookie);
+  second.join();
+  third.join();
+
+  // Only two cookies were ever written
+  EXPECT_FALSE(w_path_exists(cookieName(sync, 2).c_str()));
+}
+
+TEST_F(CookieSyncTest, lostCookieDoesNotHoldUpTheNext) {
+  CookieSync sync(dir_);
+  sync.setBatchWindow(milliseconds(50));
+
+  std::thread first([&] {
+    EXPECT_THROW(sync.syncToNow(milliseconds(500)), std::system_error);
+  });
+  ASSERT_TRUE(waitForFile(cookieName(sync, 0)));
+
+  // The first cookie is never observed, so the second caller writes its
+  // own once the window has passed
+  std::thread second([&] { sync.syncToNow(seconds(10)); });
+  auto nextCookie = cookieName(sync, 1);
+  ASSERT_TRUE(waitForFile(nextCookie));
+  sync.notifyCookie(nextCookie);
+  second.join();
+  first.join();
+
+  sync.abortAllCookies();
+}
+
+TEST_F(CookieSyncTest, withoutAWindowEachCallerWritesACookie) {
+  CookieSync sync(dir_);
+
+  std::thread first([&] { sync.syncToNow(seconds(10)); });
+  ASSERT_TRUE(waitForFile(cookieName(sync, 0)));
+  std::thread second([&] { sync.syncToNow(seconds(10)); });
+  ASSERT_TRUE(waitForFile(cookieName(sync, 1)));
+
+  sync.notifyCookie(cookieName(sync, 1));
+  second.join();
+  sync.notifyCookie(cookieName(sync, 0));
+  first.join();
+}
@@ -0,0 +1,48 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <thread>
+#include "CpuAffinity.h"
+
+using namespace watchman;
+
+TEST(CpuAffinity, parsesCpuLists) {
+  auto set = CpuSet::parse("0-3,8, 10-11,2");
+  ASSERT_TRUE(set.hasValue());
+  EXPECT_EQ((std::vector<int>{0, 1, 2, 3, 8, 10, 11}), set->cpus());
+  EXPECT_EQ("0-3,8,10-11", set->toString());
+
+  EXPECT_EQ("5", CpuSet::parse("5")->toString());
+  EXPECT_TRUE(CpuSet::parse("")->empty());
+
+  EXPECT_FALSE(CpuSet::parse("3-1").hasValue());
+  EXPECT_FALSE(CpuSet::parse("1,,2").hasValue());
+  EXPECT_FALSE(CpuSet::parse("a-b").hasValue());
+  EXPECT_FALSE(CpuSet::parse("-1").hasValue());
+}
+
+#ifdef __linux__
+TEST(CpuAffinity, placesTheCallingThread) {
+  auto allowed = CpuSet::ofThread();
+  ASSERT_FALSE(allowed.empty());
+
+  std::thread thread([&] {
+    CpuSet one(std::vector<int>{allowed.cpus().front()});
+    EXPECT_FALSE(one.applyToCurrentThread());
+    EXPECT_EQ(one, CpuSet::ofThread());
+  });
+  thread.join();
+
+  // Only the other thread was placed
+  EXPECT_EQ(allowed, CpuSet::ofThread());
+
+  bool foundSelf = false;
+  for (auto& placement : getThreadPlacements()) {
+    if (placement.allowed == allowed && placement.lastCpu >= 0) {
+      foundSelf = true;
+    }
+  }
+  EXPECT_TRUE(foundSelf);
+}
+#endif
@@ -0,0 +1,86 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <atomic>
+#include <thread>
+#include "CrawlScheduler.h"
+
+using namespace watchman;
+
+TEST(CrawlScheduler, runsEverythingWithoutALimit) {
+  CrawlScheduler scheduler(0);
+  auto a = scheduler.enqueue(w_string("/a"));
+  auto b = scheduler.enqueue(w_string("/b"));
+  EXPECT_EQ(0, a->position());
+  EXPECT_EQ(0, b->position());
+  EXPECT_TRUE(a->wait());
+  EXPECT_TRUE(b->wait());
+}
+
+TEST(CrawlScheduler, limitsConcurrentCrawls) {
+  CrawlScheduler scheduler(1);
+  auto a = scheduler.enqueue(w_string("/a"));
+  auto b = scheduler.enqueue(w_string("/b"));
+  auto c = scheduler.enqueue(w_string("/c"));
+  EXPECT_EQ(0, a->position());
+  EXPECT_EQ(1, b->position());
+  EXPECT_EQ(2, c->position());
+
+  std::atomic<bool> ran{false};
+  std::thread waiter([&] { ran = b->wait(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(ran);
+  a.reset();
+  waiter.join();
+  EXPECT_TRUE(ran);
+  EXPECT_EQ(1, c->position());
+}
+
+TEST(CrawlScheduler, runsWaitedOnCrawlsFirst) {
+  CrawlScheduler scheduler(1);
+  auto a = scheduler.enqueue(w_string("/a"));
+  auto b = scheduler.enqueue(w_string("/b"));
+  auto c = scheduler.enqueue(w_string("/c"));
+  auto d = scheduler.enqueue(w_string("/d"));
+  d->prioritize();
+  c->prioritize();
+  EXPECT_EQ(1, d->position());
+  EXPECT_EQ(2, c->position());
+  EXPECT_EQ(3, b->position());
+
+  auto queue = scheduler.getQueue();
+  ASSERT_EQ(4, queue.size());
+  EXPECT_EQ(w_string("/a"), queue[0].name);
+  EXPECT_TRUE(queue[0].running);
+  EXPECT_EQ(w_string("/d"), queue[1].name);
+  EXPECT_TRUE(queue[1].prioritized);
+  EXPECT_EQ(w_string("/c"), queue[2].name);
+  EXPECT_EQ(w_string("/b"), queue[3].name);
+  EXPECT_FALSE(queue[3].prioritized);
+
+  a.reset();
+  EXPECT_EQ(0, d->position());
+  d.reset();
+  EXPECT_EQ(0, c->position());
+}
+
+TEST(CrawlScheduler, cancelsQueuedCrawls) {
+  CrawlScheduler scheduler(1);
+  auto a = scheduler.enqueue(w_string("/a"));
+  auto b = scheduler.enqueue(w_string("/b"));
+  auto c = scheduler.enqueue(w_string("/c"));
+
+  std::atomic<bool> ran{true};
+  std::thread waiter([&] { ran = b->wait(); });
+  b->cancel();
+  waiter.join();
+  EXPECT_FALSE(ran);
+  EXPECT_EQ(1, c->position());
+
+  // Cancelling a running crawl does nothing
+  a->cancel();
+  EXPECT_TRUE(a->wait());
+  a.reset();
+  EXPECT_TRUE(c->wait());
+}
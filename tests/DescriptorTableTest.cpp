@@ -0,0 +1,46 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include "DescriptorTable.h"
+#include "watchman_string.h"
+
+using namespace watchman;
+
+TEST(DescriptorTable, setFindAndErase) {
+  DescriptorTable<w_string> table;
+  EXPECT_TRUE(table.empty());
+  EXPECT_EQ(nullptr, table.find(3));
+  EXPECT_EQ(nullptr, table.find(-1));
+
+  table.set(3, w_string("/a", W_STRING_BYTE));
+  table.set(7, w_string("/b", W_STRING_BYTE));
+  EXPECT_EQ(2, table.size());
+  ASSERT_NE(nullptr, table.find(3));
+  EXPECT_EQ(w_string("/a", W_STRING_BYTE), *table.find(3));
+  EXPECT_EQ(nullptr, table.find(5));
+
+  // Replacing a value doesn't add another
+  table.set(3, w_string("/c", W_STRING_BYTE));
+  EXPECT_EQ(2, table.size());
+  EXPECT_EQ(w_string("/c", W_STRING_BYTE), *table.find(3));
+
+  EXPECT_TRUE(table.erase(7));
+  EXPECT_FALSE(table.erase(7));
+  EXPECT_FALSE(table.erase(100));
+  EXPECT_EQ(1, table.size());
+  EXPECT_EQ(nullptr, table.find(7));
+
+  // Setting an empty value erases it
+  table.set(3, nullptr);
+  EXPECT_TRUE(table.empty());
+  EXPECT_EQ(nullptr, table.find(3));
+}
+
+TEST(DescriptorTable, clear) {
+  DescriptorTable<w_string> table;
+  table.set(1, w_string("/a", W_STRING_BYTE));
+  table.clear();
+  EXPECT_TRUE(table.empty());
+  EXPECT_EQ(nullptr, table.find(1));
+}
@@ -0,0 +1,118 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/FileUtil.h>
+#include <folly/portability/GTest.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "EventTrace.h"
+#include "watchman_pending.h"
+
+using namespace watchman;
+
+namespace {
+class EventTraceTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char tmpl[] = "/tmp/eventtraceXXXXXX";
+    ASSERT_NE(mkdtemp(tmpl), nullptr);
+    dir_ = tmpl;
+    path_ = w_string::pathCat({w_string(dir_.c_str(), W_STRING_BYTE),
+                               w_string("trace", W_STRING_BYTE)});
+  }
+
+  void TearDown() override {
+    unlink(path_.c_str());
+    rmdir(dir_.c_str());
+  }
+
+  // Makes a chain of items for the paths, as the notify thread would
+  static std::shared_ptr<watchman_pending_fs> makeBatch(
+      const std::vector<std::pair<const char*, int>>& paths) {
+    PendingCollection pending;
+    auto lock = pending.lock();
+    struct timeval now {
+      0, 0
+    };
+    for (auto& it : paths) {
+      lock->add(w_string(it.first, W_STRING_BYTE), now, it.second);
+    }
+    return lock->stealItems();
+  }
+
+  // The names relative to /root and flags of the chain, in chain order
+  static std::vector<std::pair<std::string, int>> expected(
+      const watchman_pending_fs* items) {
+    std::vector<std::pair<std::string, int>> result;
+    for (auto item = items; item; item = item->next.get()) {
+      std::string path(item->path.data(), item->path.size());
+      if (path == "/root") {
+        result.emplace_back("", item->flags);
+      } else if (path.compare(0, 6, "/root/") == 0) {
+        result.emplace_back(path.substr(6), item->flags);
+      }
+    }
+    return result;
+  }
+
+  static std::vector<std::pair<std::string, int>> actual(
+      const EventTrace::Batch& batch) {
+    std::vector<std::pair<std::string, int>> result;
+    for (auto& event : batch.events) {
+      result.emplace_back(
+          std::string(event.name.data(), event.name.size()), event.flags);
+    }
+    return result;
+  }
+
+  std::string dir_;
+  w_string path_;
+};
+} // namespace
+
+TEST_F(EventTraceTest, round_trip) {
+  auto first = makeBatch(
+      {{"/root/src/main.cpp", W_PENDING_VIA_NOTIFY},
+       {"/root/src/main.h", W_PENDING_VIA_NOTIFY},
+       {"/root/src/util", W_PENDING_VIA_NOTIFY | W_PENDING_RECURSIVE},
+       {"/root", W_PENDING_VIA_NOTIFY},
+       {"/elsewhere/file", W_PENDING_VIA_NOTIFY}});
+  auto second = makeBatch({{"/root/README", W_PENDING_VIA_NOTIFY}});
+  {
+    EventTraceWriter writer(path_, w_string("/root", W_STRING_BYTE));
+    writer.writeBatch(first.get());
+    writer.writeBatch(nullptr);
+    writer.writeBatch(second.get());
+    EXPECT_EQ(3, writer.batches());
+    EXPECT_EQ(5, writer.events());
+  }
+
+  auto trace = EventTrace::load(path_.c_str());
+  EXPECT_EQ(w_string("/root", W_STRING_BYTE), trace.rootPath);
+  ASSERT_EQ(3, trace.batches.size());
+  EXPECT_EQ(5, trace.numEvents());
+  EXPECT_EQ(expected(first.get()), actual(trace.batches[0]));
+  EXPECT_TRUE(trace.batches[1].events.empty());
+  EXPECT_EQ(expected(second.get()), actual(trace.batches[2]));
+  EXPECT_LE(trace.batches[0].offset, trace.batches[1].offset);
+  EXPECT_LE(trace.batches[1].offset, trace.batches[2].offset);
+}
+
+TEST_F(EventTraceTest, rejects_bad_traces) {
+  EXPECT_THROW(EventTrace::load(path_.c_str()), std::system_error);
+
+  ASSERT_TRUE(folly::writeFile(std::string("not a trace"), path_.c_str()));
+  EXPECT_THROW(EventTrace::load(path_.c_str()), std::runtime_error);
+
+  {
+    EventTraceWriter writer(path_, w_string("/root", W_STRING_BYTE));
+    auto batch = makeBatch({{"/root/some/file", W_PENDING_VIA_NOTIFY}});
+    writer.writeBatch(batch.get());
+  }
+  std::string data;
+  ASSERT_TRUE(folly::readFile(path_.c_str(), data));
+  data.resize(data.size() - 1);
+  ASSERT_TRUE(folly::writeFile(data, path_.c_str()));
+  EXPECT_THROW(EventTrace::load(path_.c_str()), std::runtime_error);
+}
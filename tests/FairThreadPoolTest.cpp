@@ -0,0 +1,60 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <folly/synchronization/Baton.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "FairThreadPool.h"
+
+using namespace watchman;
+
+TEST(FairThreadPool, takesTurnsBetweenKeys) {
+  FairThreadPool pool;
+  pool.start(1, 1024);
+
+  int rootA;
+  int rootB;
+  std::mutex mutex;
+  std::vector<std::string> order;
+  auto record = [&](const char* name) {
+    return [&mutex, &order, name] {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.emplace_back(name);
+    };
+  };
+
+  // Hold up the only worker until everything has been queued
+  folly::Baton<> started;
+  folly::Baton<> queued;
+  pool.add(&rootA, [&started, &queued] {
+    started.post();
+    queued.wait();
+  });
+  started.wait();
+  pool.add(&rootA, record("a1"));
+  pool.add(&rootA, record("a2"));
+  pool.add(&rootA, record("a3"));
+  pool.add(&rootB, record("b1"));
+  pool.add(&rootB, record("b2"));
+  queued.post();
+  pool.stop();
+
+  std::vector<std::string> expected{"a1", "b1", "a2", "b2", "a3"};
+  EXPECT_EQ(expected, order);
+}
+
+TEST(FairThreadPool, rejectsTasksWhenNotRunning) {
+  FairThreadPool pool;
+  int key;
+  EXPECT_THROW(pool.add(&key, [] {}), std::runtime_error);
+
+  pool.start(2, 1024);
+  folly::Baton<> ran;
+  pool.add(&key, [&ran] { ran.post(); });
+  ran.wait();
+  pool.stop();
+
+  EXPECT_THROW(pool.add(&key, [] {}), std::runtime_error);
+}
@@ -0,0 +1,54 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include "FetchBatchSizer.h"
+
+using namespace watchman;
+using namespace std::chrono;
+using Stage = FetchBatchSizer::Stage;
+
+namespace {
+FetchBatching batching() {
+  return FetchBatching{100, 10, 8, 1000, milliseconds(10)};
+}
+} // namespace
+
+TEST(FetchBatchSizer, startsAtTheInitialSizeOfTheStage) {
+  EXPECT_EQ(100, FetchBatchSizer(batching(), Stage::Eval).size());
+  EXPECT_EQ(10, FetchBatchSizer(batching(), Stage::Render).size());
+
+  auto outOfBounds = batching();
+  outOfBounds.initialEval = 5000;
+  outOfBounds.initialRender = 1;
+  EXPECT_EQ(1000, FetchBatchSizer(outOfBounds, Stage::Eval).size());
+  EXPECT_EQ(8, FetchBatchSizer(outOfBounds, Stage::Render).size());
+}
+
+TEST(FetchBatchSizer, growsWhileFetchesAreFast) {
+  FetchBatchSizer sizer(batching(), Stage::Eval);
+  sizer.record(100, milliseconds(1));
+  // At most doubles each time
+  EXPECT_EQ(200, sizer.size());
+  for (int i = 0; i < 10; ++i) {
+    sizer.record(sizer.size(), microseconds(1));
+  }
+  EXPECT_EQ(1000, sizer.size());
+}
+
+TEST(FetchBatchSizer, shrinksWhileFetchesAreSlow) {
+  FetchBatchSizer sizer(batching(), Stage::Eval);
+  // 50 files would take the target latency at this rate
+  sizer.record(100, milliseconds(20));
+  EXPECT_EQ(75, sizer.size());
+  for (int i = 0; i < 20; ++i) {
+    sizer.record(sizer.size(), seconds(1));
+  }
+  EXPECT_EQ(8, sizer.size());
+}
+
+TEST(FetchBatchSizer, ignoresSmallTrailingBatches) {
+  FetchBatchSizer sizer(batching(), Stage::Eval);
+  sizer.record(3, seconds(1));
+  EXPECT_EQ(100, sizer.size());
+}
@@ -0,0 +1,84 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include "FileInformation.h"
+
+using namespace watchman;
+
+namespace {
+FileInformation makeInfo(dev_t dev, uid_t uid, gid_t gid) {
+  FileInformation info;
+#ifndef _WIN32
+  info.mode = S_IFREG | 0644;
+#else
+  info.mode = _S_IFREG | 0644;
+#endif
+  info.size = 123456789012;
+  info.dev = dev;
+  info.uid = uid;
+  info.gid = gid;
+  info.ino = 42;
+  info.nlink = 3;
+  info.atime = {1600000000, 1};
+  info.mtime = {1600000001, 999999999};
+  info.ctime = {1600000002, 500};
+  return info;
+}
+
+void expectSame(const FileInformation& a, const FileInformation& b) {
+  EXPECT_EQ(a.mode, b.mode);
+  EXPECT_EQ(a.size, b.size);
+  EXPECT_EQ(a.dev, b.dev);
+  EXPECT_EQ(a.uid, b.uid);
+  EXPECT_EQ(a.gid, b.gid);
+  EXPECT_EQ(a.ino, b.ino);
+  EXPECT_EQ(a.nlink, b.nlink);
+  EXPECT_EQ(a.atime.tv_sec, b.atime.tv_sec);
+  EXPECT_EQ(a.atime.tv_nsec, b.atime.tv_nsec);
+  EXPECT_EQ(a.mtime.tv_sec, b.mtime.tv_sec);
+  EXPECT_EQ(a.mtime.tv_nsec, b.mtime.tv_nsec);
+  EXPECT_EQ(a.ctime.tv_sec, b.ctime.tv_sec);
+  EXPECT_EQ(a.ctime.tv_nsec, b.ctime.tv_nsec);
+}
+} // namespace
+
+TEST(FileInformationTest, compactRoundTrips) {
+  FileOwnerTable owners;
+  auto info = makeInfo(7, 1000, 100);
+  CompactFileInformation compact(info, owners);
+  expectSame(compact.expand(owners), info);
+
+  EXPECT_TRUE(compact.isFile());
+  EXPECT_FALSE(compact.isDir());
+  EXPECT_EQ(compact.size(), info.size);
+  EXPECT_EQ(compact.ino(), info.ino);
+  EXPECT_EQ(compact.mtime().tv_nsec, info.mtime.tv_nsec);
+
+  EXPECT_LT(sizeof(CompactFileInformation), sizeof(FileInformation));
+}
+
+TEST(FileInformationTest, zeroedCompactExpands) {
+  FileOwnerTable owners;
+  CompactFileInformation compact;
+  expectSame(compact.expand(owners), FileInformation());
+}
+
+TEST(FileInformationTest, ownersAreShared) {
+  FileOwnerTable owners;
+  EXPECT_EQ(owners.size(), 1);
+
+  auto a = makeInfo(7, 1000, 100);
+  auto b = makeInfo(7, 1001, 100);
+  CompactFileInformation ca(a, owners);
+  CompactFileInformation cb(b, owners);
+  CompactFileInformation ca2(a, owners);
+  EXPECT_EQ(owners.size(), 3);
+
+  expectSame(ca.expand(owners), a);
+  expectSame(cb.expand(owners), b);
+  expectSame(ca2.expand(owners), a);
+
+  EXPECT_EQ(owners.intern(FileOwner{7, 1001, 100}), 2);
+  EXPECT_EQ(owners.intern(FileOwner{}), 0);
+}
@@ -0,0 +1,77 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/Conv.h>
+#include <folly/portability/GTest.h>
+#include <string>
+#include <vector>
+#include "FrozenStringSet.h"
+
+using namespace watchman;
+
+TEST(FrozenStringSet, empty) {
+  FrozenStringSet set;
+  EXPECT_TRUE(set.empty());
+  EXPECT_FALSE(set.contains("foo"));
+  EXPECT_FALSE(set.contains(""));
+
+  FrozenStringSet built(std::vector<w_string>{});
+  EXPECT_TRUE(built.empty());
+  EXPECT_FALSE(built.contains("foo"));
+}
+
+TEST(FrozenStringSet, contains) {
+  FrozenStringSet set(
+      std::vector<w_string>{"foo", "bar", "dir/baz", "foo", "Mixed"});
+  EXPECT_EQ(4, set.size());
+  EXPECT_TRUE(set.contains("foo"));
+  EXPECT_TRUE(set.contains("bar"));
+  EXPECT_TRUE(set.contains("dir/baz"));
+  EXPECT_TRUE(set.contains("Mixed"));
+  EXPECT_FALSE(set.contains("mixed"));
+  EXPECT_FALSE(set.contains("fo"));
+  EXPECT_FALSE(set.contains("fooo"));
+  EXPECT_FALSE(set.contains("baz"));
+}
+
+TEST(FrozenStringSet, containsPath) {
+  FrozenStringSet set(std::vector<w_string>{"a/b/c", "top"});
+  EXPECT_TRUE(set.containsPath("a/b", "c"));
+  EXPECT_TRUE(set.containsPath("a", "b/c"));
+  EXPECT_TRUE(set.containsPath(w_string_piece(), "top"));
+  EXPECT_FALSE(set.containsPath("a", "c"));
+  EXPECT_FALSE(set.containsPath("a/b", "top"));
+  EXPECT_FALSE(set.containsPath("a/b/c", ""));
+}
+
+TEST(FrozenStringSet, caseFold) {
+  FrozenStringSet set(std::vector<w_string>{"Foo/Bar.H", "baz"}, true);
+  EXPECT_EQ(w_string("foo/bar.h"), set.keys()[0]);
+  EXPECT_TRUE(set.contains("foo/bar.h"));
+  EXPECT_TRUE(set.contains("FOO/BAR.H"));
+  EXPECT_TRUE(set.containsPath("FOO", "bar.h"));
+  EXPECT_TRUE(set.contains("BAZ"));
+  EXPECT_FALSE(set.contains("foo/bar.c"));
+}
+
+TEST(FrozenStringSet, caseFoldAlreadyFolded) {
+  FrozenStringSet set(std::vector<w_string>{"Foo/Bar.H", "baz"}, true);
+  EXPECT_TRUE(set.contains("baz", true));
+  EXPECT_TRUE(set.containsPath("FOO", "bar.h", true));
+  EXPECT_FALSE(set.contains("bax", true));
+}
+
+TEST(FrozenStringSet, manyKeys) {
+  std::vector<w_string> keys;
+  for (int i = 0; i < 50000; ++i) {
+    keys.emplace_back(w_string::build("dir", i % 97, "/file", i, ".cpp"));
+  }
+  FrozenStringSet set(keys);
+  EXPECT_EQ(keys.size(), set.size());
+  for (int i = 0; i < 50000; ++i) {
+    auto dir = folly::to<std::string>("dir", i % 97);
+    auto name = folly::to<std::string>("file", i, ".cpp");
+    EXPECT_TRUE(set.containsPath(dir, name)) << dir << "/" << name;
+    EXPECT_FALSE(set.containsPath(dir, name + ".orig"));
+  }
+}
@@ -0,0 +1,116 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "GlobSuffixIndex.h"
+#include "thirdparty/wildmatch/wildmatch.h"
+
+using namespace watchman;
+
+namespace {
+std::vector<uint32_t> candidates(
+    const GlobSuffixIndex& index,
+    w_string_piece name) {
+  std::vector<uint32_t> result;
+  index.forEachCandidate(name, [&](uint32_t i) {
+    result.push_back(i);
+    return false;
+  });
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+std::string tail(const char* pattern) {
+  auto piece = GlobSuffixIndex::literalTail(pattern);
+  return std::string(piece.data(), piece.size());
+}
+
+using Indices = std::vector<uint32_t>;
+} // namespace
+
+TEST(GlobSuffixIndex, literalTail) {
+  EXPECT_EQ("", tail("*"));
+  EXPECT_EQ(".h", tail("*.h"));
+  EXPECT_EQ(".cpp", tail("**/*.cpp"));
+  EXPECT_EQ("bar.h", tail("**/foo/bar.h"));
+  EXPECT_EQ("", tail("foo*"));
+  EXPECT_EQ("", tail("foo.[ch]"));
+  EXPECT_EQ("", tail("foo\\*"));
+  EXPECT_EQ("plain", tail("plain"));
+}
+
+TEST(GlobSuffixIndex, classifiesByTail) {
+  GlobSuffixIndex index;
+  EXPECT_EQ(0, index.add("**/*.h"));
+  EXPECT_EQ(1, index.add("**/*.cpp"));
+  EXPECT_EQ(2, index.add("**/*_test.cpp"));
+  EXPECT_EQ(3, index.add("foo*"));
+  EXPECT_EQ(4, index.size());
+
+  EXPECT_EQ((Indices{0, 3}), candidates(index, "watchman.h"));
+  EXPECT_EQ((Indices{1, 3}), candidates(index, "glob.cpp"));
+  EXPECT_EQ((Indices{1, 2, 3}), candidates(index, "glob_test.cpp"));
+  EXPECT_EQ((Indices{3}), candidates(index, "README"));
+  EXPECT_EQ((Indices{3}), candidates(index, "H"));
+}
+
+TEST(GlobSuffixIndex, caseFold) {
+  GlobSuffixIndex sensitive(false);
+  sensitive.add("*.H");
+  EXPECT_EQ((Indices{}), candidates(sensitive, "foo.h"));
+  EXPECT_EQ((Indices{0}), candidates(sensitive, "foo.H"));
+
+  GlobSuffixIndex folded(true);
+  folded.add("*.H");
+  EXPECT_EQ((Indices{0}), candidates(folded, "foo.h"));
+  EXPECT_EQ((Indices{0}), candidates(folded, "FOO.H"));
+}
+
+TEST(GlobSuffixIndex, neverRejectsAMatch) {
+  std::vector<const char*> patterns = {"*.h",
+                                       "**/*.h",
+                                       "**/foo/*.h",
+                                       "a/**/b.txt",
+                                       "*\\.c",
+                                       "[ab].c",
+                                       "?.c",
+                                       "**",
+                                       "foo/**",
+                                       ".*rc"};
+  std::vector<const char*> paths = {"x.h",
+                                    "a/x.h",
+                                    "a/foo/x.h",
+                                    "a/b.txt",
+                                    "a/c/b.txt",
+                                    "x.c",
+                                    "a.c",
+                                    "foo/bar",
+                                    ".bashrc",
+                                    "a/.x.h"};
+  for (auto flags : {0, WM_PATHNAME, WM_PATHNAME | WM_PERIOD}) {
+    GlobSuffixIndex index;
+    for (auto pattern : patterns) {
+      index.add(pattern);
+    }
+    for (auto path : paths) {
+      std::string name(path);
+      auto slash = name.rfind('/');
+      if (slash != std::string::npos) {
+        name = name.substr(slash + 1);
+      }
+      auto yielded =
+          candidates(index, w_string_piece(name.data(), name.size()));
+      for (uint32_t i = 0; i < patterns.size(); ++i) {
+        if (wildmatch(patterns[i], path, flags, nullptr) == WM_MATCH) {
+          EXPECT_NE(
+              std::find(yielded.begin(), yielded.end(), i), yielded.end())
+              << patterns[i] << " matches " << path << " with flags "
+              << flags;
+        }
+      }
+    }
+  }
+}
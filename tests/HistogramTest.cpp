@@ -0,0 +1,98 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <thread>
+#include <vector>
+#include "Histogram.h"
+
+using namespace watchman;
+
+TEST(Histogram, empty) {
+  Histogram histogram;
+  EXPECT_EQ(0, histogram.count());
+  EXPECT_EQ(0, histogram.quantile(0.5));
+
+  auto json = histogram.toJson();
+  EXPECT_EQ(0, json_integer_value(json.get("count")));
+  EXPECT_EQ(0, json_array_size(json.get("buckets")));
+}
+
+TEST(Histogram, estimatesQuantilesFromBuckets) {
+  Histogram histogram;
+  for (uint64_t i = 1; i <= 100; ++i) {
+    histogram.record(i);
+  }
+  EXPECT_EQ(100, histogram.count());
+  EXPECT_EQ(5050, histogram.sum());
+  EXPECT_EQ(100, histogram.max());
+
+  // The 50th value is in the bucket of 32..63, and the 90th and 99th in
+  // that of 64..127, which is capped by the max
+  EXPECT_EQ(63, histogram.quantile(0.5));
+  EXPECT_EQ(100, histogram.quantile(0.9));
+  EXPECT_EQ(100, histogram.quantile(0.99));
+  EXPECT_EQ(1, histogram.quantile(0));
+}
+
+TEST(Histogram, bucketsArePowersOfTwo) {
+  Histogram histogram;
+  histogram.record(0);
+  histogram.record(1);
+  histogram.record(2);
+  histogram.record(3);
+  histogram.record(4);
+  histogram.record(UINT32_MAX);
+
+  auto buckets = histogram.toJson().get("buckets");
+  ASSERT_EQ(5, json_array_size(buckets));
+  auto expect = [&](size_t index, json_int_t least, json_int_t count) {
+    auto bucket = buckets.at(index);
+    EXPECT_EQ(least, json_integer_value(bucket.at(0)));
+    EXPECT_EQ(count, json_integer_value(bucket.at(1)));
+  };
+  expect(0, 0, 1);
+  expect(1, 1, 1);
+  expect(2, 2, 2);
+  expect(3, 4, 1);
+  expect(4, json_int_t(1) << 31, 1);
+}
+
+TEST(Histogram, recordsFromManyThreads) {
+  Histogram histogram;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&histogram] {
+      for (uint64_t i = 0; i < 1000; ++i) {
+        histogram.record(i);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(4000, histogram.count());
+  EXPECT_EQ(4 * 999 * 1000 / 2, histogram.sum());
+  EXPECT_EQ(999, histogram.max());
+}
+
+TEST(Histogram, mergeAndReset) {
+  Histogram a;
+  Histogram b;
+  a.record(1);
+  a.record(100);
+  b.record(3);
+  b.record(1000);
+
+  a.merge(b);
+  EXPECT_EQ(4, a.count());
+  EXPECT_EQ(1104, a.sum());
+  EXPECT_EQ(1000, a.max());
+  EXPECT_EQ(2, b.count());
+
+  a.reset();
+  EXPECT_EQ(0, a.count());
+  EXPECT_EQ(0, a.sum());
+  EXPECT_EQ(0, a.max());
+  EXPECT_EQ(0, json_array_size(a.toJson().get("buckets")));
+}
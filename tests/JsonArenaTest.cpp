@@ -0,0 +1,101 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <string>
+#include "thirdparty/jansson/jansson.h"
+
+namespace {
+json_ref makeRow(const char* name, json_int_t size) {
+  return json_object({{"name", typed_string_to_json(name, W_STRING_UNICODE)},
+                      {"size", json_integer(size)},
+                      {"exists", json_true()}});
+}
+} // namespace
+
+TEST(JsonArenaTest, allocatesFromTheCurrentArena) {
+  auto arena = JsonArena::make();
+  json_ref row;
+  {
+    JsonArenaScope scope(arena.get());
+    EXPECT_EQ(arena.get(), JsonArena::current());
+    row = makeRow("foo", 42);
+  }
+  EXPECT_EQ(nullptr, JsonArena::current());
+
+  EXPECT_TRUE(static_cast<json_t*>(row)->arena);
+  EXPECT_TRUE(static_cast<json_t*>(row.get("name"))->arena);
+  // The singletons are never allocated
+  EXPECT_FALSE(static_cast<json_t*>(row.get("exists"))->arena);
+
+  auto heap = json_object();
+  EXPECT_FALSE(static_cast<json_t*>(heap)->arena);
+}
+
+TEST(JsonArenaTest, nullScopeAllocatesFromTheHeap) {
+  auto arena = JsonArena::make();
+  JsonArenaScope scope(arena.get());
+  {
+    JsonArenaScope heap(nullptr);
+    EXPECT_FALSE(static_cast<json_t*>(json_integer(1))->arena);
+  }
+  EXPECT_TRUE(static_cast<json_t*>(json_integer(1))->arena);
+}
+
+TEST(JsonArenaTest, valuesOutliveTheArenaHandle) {
+  json_ref row;
+  {
+    auto arena = JsonArena::make();
+    JsonArenaScope scope(arena.get());
+    row = makeRow("foo", 42);
+  }
+  EXPECT_EQ("foo", json_to_w_string(row.get("name")));
+  EXPECT_EQ(42, row.get("size").asInt());
+}
+
+TEST(JsonArenaTest, encodesLikeHeapValues) {
+  auto results = json_array();
+  auto arena = JsonArena::make();
+  {
+    JsonArenaScope scope(arena.get());
+    for (int i = 0; i < 1000; ++i) {
+      json_array_append_new(
+          results, makeRow(std::to_string(i).c_str(), i * 1024));
+    }
+  }
+
+  auto heapResults = json_array();
+  for (int i = 0; i < 1000; ++i) {
+    json_array_append_new(
+        heapResults, makeRow(std::to_string(i).c_str(), i * 1024));
+  }
+
+  EXPECT_EQ(
+      json_dumps(heapResults, JSON_COMPACT | JSON_SORT_KEYS),
+      json_dumps(results, JSON_COMPACT | JSON_SORT_KEYS));
+}
+
+TEST(JsonArenaTest, promoteCopiesArenaValuesToTheHeap) {
+  auto response = json_object({{"unilateral", json_true()}});
+  auto arena = JsonArena::make();
+  {
+    JsonArenaScope scope(arena.get());
+    response.set("files", json_array({makeRow("foo", 1), makeRow("bar", 2)}));
+  }
+
+  auto promoted = json_promote(response);
+  EXPECT_NE(static_cast<json_t*>(response), static_cast<json_t*>(promoted));
+  auto& files = promoted.get("files").array();
+  ASSERT_EQ(2u, files.size());
+  for (auto& file : files) {
+    EXPECT_FALSE(static_cast<json_t*>(file)->arena);
+    EXPECT_FALSE(static_cast<json_t*>(file.get("name"))->arena);
+  }
+  EXPECT_EQ(
+      json_dumps(response, JSON_COMPACT | JSON_SORT_KEYS),
+      json_dumps(promoted, JSON_COMPACT | JSON_SORT_KEYS));
+
+  // Values that hold nothing from an arena are returned as they are
+  auto heap = makeRow("baz", 3);
+  EXPECT_EQ(static_cast<json_t*>(heap), static_cast<json_t*>(json_promote(heap)));
+}
@@ -0,0 +1,112 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <stdexcept>
+#include <string>
+#include "thirdparty/jansson/jansson.h"
+
+namespace {
+// json_loadb parses the buffer directly, and json_loads through the lexer;
+// they must agree on everything
+void expectSameResult(const std::string& doc, size_t flags = 0) {
+  json_error_t bufferError;
+  json_error_t lexerError;
+  auto fromBuffer = json_loadb(doc.data(), doc.size(), flags, &bufferError);
+  auto fromLexer = json_loads(doc.c_str(), flags, &lexerError);
+
+  ASSERT_EQ(bool(fromLexer), bool(fromBuffer)) << doc;
+  if (fromLexer) {
+    EXPECT_EQ(
+        json_dumps(fromLexer, JSON_COMPACT | JSON_SORT_KEYS | JSON_ENCODE_ANY),
+        json_dumps(fromBuffer, JSON_COMPACT | JSON_SORT_KEYS | JSON_ENCODE_ANY))
+        << doc;
+    EXPECT_EQ(lexerError.position, bufferError.position) << doc;
+  } else {
+    EXPECT_STREQ(lexerError.text, bufferError.text) << doc;
+    EXPECT_EQ(lexerError.line, bufferError.line) << doc;
+    EXPECT_EQ(lexerError.column, bufferError.column) << doc;
+  }
+}
+} // namespace
+
+TEST(JsonLoadTest, acceptsValidDocuments) {
+  for (auto doc : {
+           "[]",
+           "{}",
+           " [ 1 , 2 ] \n",
+           "[\"query\", \"/root\", {\"fields\": [\"name\", \"size\"]}]",
+           "{\"a\": {\"b\": [true, false, null]}}",
+           "{\"dup\": 1, \"dup\": 2}",
+           "[0, -0, 12, -12, 9223372036854775807, -9223372036854775808]",
+           "[1.5, -0.25, 1e3, 2E-2, 1.5e+10]",
+           "[\"plain text that is long enough to take several chunks\"]",
+           "[\"\\\"\\\\\\/\\b\\f\\n\\r\\t\"]",
+           "[\"\\u00e9\\u20ac\\ud83d\\udca9\"]",
+           "[\"caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x92\xa9\"]",
+           "[\"\"]",
+       }) {
+    expectSameResult(doc);
+  }
+}
+
+TEST(JsonLoadTest, rejectsInvalidDocuments) {
+  for (auto doc : {
+           "",
+           "   ",
+           "1",
+           "[",
+           "[1,]",
+           "[1 2]",
+           "{\"a\" 1}",
+           "{\"\": 1}",
+           "{1: 2}",
+           "[01]",
+           "[1.]",
+           "[1e]",
+           "[-]",
+           "[truex]",
+           "[nul]",
+           "[9223372036854775808]",
+           "[-9223372036854775809]",
+           "[1e400]",
+           "[\"unterminated]",
+           "[\"tab\there\"]",
+           "[\"\\x\"]",
+           "[\"\\u00\"]",
+           "[\"\\u0000\"]",
+           "[\"\\ud83d\"]",
+           "[\"\\udca9\"]",
+           "[\"\xc3\"]",
+           "[\"\xff\"]",
+           "[] []",
+       }) {
+    expectSameResult(doc);
+  }
+}
+
+TEST(JsonLoadTest, honorsFlags) {
+  expectSameResult("42", JSON_DECODE_ANY);
+  expectSameResult("\"str\"", JSON_DECODE_ANY);
+  expectSameResult("[1] trailing", JSON_DISABLE_EOF_CHECK);
+  expectSameResult("{\"dup\": 1, \"dup\": 2}", JSON_REJECT_DUPLICATES);
+}
+
+TEST(JsonLoadTest, dumpsEscapedStrings) {
+  auto str = typed_string_to_json(
+      "plain \"quoted\" back\\slash /slash\n\x01 caf\xc3\xa9 \xf0\x9f\x92\xa9",
+      W_STRING_BYTE);
+  EXPECT_EQ(
+      "\"plain \\\"quoted\\\" back\\\\slash /slash\\n\\u0001 "
+      "caf\xc3\xa9 \xf0\x9f\x92\xa9\"",
+      json_dumps(str, JSON_ENCODE_ANY));
+  EXPECT_EQ(
+      "\"plain \\\"quoted\\\" back\\\\slash \\/slash\\n\\u0001 "
+      "caf\\u00e9 \\ud83d\\udca9\"",
+      json_dumps(
+          str, JSON_ENCODE_ANY | JSON_ENSURE_ASCII | JSON_ESCAPE_SLASH));
+
+  // Invalid UTF-8 can't be dumped
+  auto invalid = typed_string_to_json("bad \xff byte", W_STRING_BYTE);
+  EXPECT_THROW(json_dumps(invalid, JSON_ENCODE_ANY), std::runtime_error);
+}
@@ -3,6 +3,7 @@
 
 #include "watchman.h"
 #include "saved_state/LocalSavedStateInterface.h"
+#include <folly/FileUtil.h>
 #include <folly/logging/xlog.h>
 #include <folly/portability/GTest.h>
 #include <folly/test/TestUtils.h>
@@ -118,3 +119,26 @@ TEST(LocalSavedStateInterfaceTest, path) {
   expectedPath = "/absolute/path/foo/hash_meta";
   EXPECT_EQ(path, expectedPath);
 }
+
+TEST(LocalSavedStateInterfaceTest, saveState) {
+  char tmpl[] = "/tmp/savedstateXXXXXX";
+  ASSERT_NE(mkdtemp(tmpl), nullptr);
+  LocalSavedStateInterface interface(
+      json_object({{"local-storage-path", w_string_to_json(tmpl)},
+                   {"project", w_string_to_json("foo")}}),
+      nullptr);
+
+  // The project dir is created, and saving again replaces the state
+  interface.saveState("hash", "first");
+  auto info = interface.saveState("hash", "second");
+  auto path = interface.getLocalPath("hash");
+  EXPECT_EQ(json_to_w_string(info.get("local-path")), path);
+  EXPECT_EQ(json_to_w_string(info.get("commit-id")), w_string("hash"));
+  std::string data;
+  ASSERT_TRUE(folly::readFile(path.c_str(), data));
+  EXPECT_EQ(data, "second");
+
+  unlink(path.c_str());
+  rmdir(w_string_piece(path).dirName().asWString().c_str());
+  rmdir(tmpl);
+}
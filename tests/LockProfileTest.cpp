@@ -0,0 +1,78 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "LockProfile.h"
+#include <folly/SharedMutex.h>
+#include <folly/Synchronized.h>
+#include <folly/portability/GTest.h>
+#include <thread>
+
+using namespace watchman;
+using namespace std::chrono;
+
+namespace {
+struct ExclusiveTestLock {
+  static constexpr const char* kName = "exclusive-test";
+};
+struct SharedTestLock {
+  static constexpr const char* kName = "shared-test";
+};
+using ExclusiveMutex = ProfiledMutex<std::mutex, ExclusiveTestLock>;
+using SharedMutex = ProfiledMutex<folly::SharedMutex, SharedTestLock>;
+
+class LockProfileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    LockProfile::allToJson(true);
+    LockProfile::setEnabled(true);
+  }
+  void TearDown() override {
+    LockProfile::setEnabled(false);
+  }
+};
+} // namespace
+
+TEST_F(LockProfileTest, recordsWaitsAndLongestHolds) {
+  folly::Synchronized<int, ExclusiveMutex> value(0);
+
+  {
+    LockSite site("slow_holder");
+    auto locked = value.lock();
+    std::thread waiter([&] { ++*value.lock(); });
+    std::this_thread::sleep_for(milliseconds(50));
+    locked.unlock();
+    waiter.join();
+  }
+  ++*value.lock();
+
+  auto stats = LockProfile::allToJson(false).get("exclusive-test");
+  EXPECT_EQ(3, json_integer_value(stats.get("acquisitions")));
+  EXPECT_EQ(1, json_integer_value(stats.get("contended")));
+  EXPECT_GE(
+      json_integer_value(stats.get("exclusive_wait_us").get("max")), 40000);
+  EXPECT_EQ(3, json_integer_value(stats.get("hold_us").get("count")));
+
+  auto longest = stats.get("longest_holds");
+  ASSERT_EQ(3, json_array_size(longest));
+  EXPECT_EQ(
+      w_string_piece("slow_holder"),
+      w_string_piece(json_to_w_string(longest.at(0).get("site"))));
+  EXPECT_GE(json_integer_value(longest.at(0).get("hold_us")), 40000);
+}
+
+TEST_F(LockProfileTest, sharedLocksRecordOnlyTheirWaits) {
+  folly::Synchronized<int, SharedMutex> value(0);
+  EXPECT_EQ(0, *value.rlock());
+  ++*value.wlock();
+
+  auto stats = LockProfile::allToJson(true).get("shared-test");
+  EXPECT_EQ(2, json_integer_value(stats.get("acquisitions")));
+  EXPECT_EQ(1, json_integer_value(stats.get("shared_wait_us").get("count")));
+  EXPECT_EQ(1, json_integer_value(stats.get("hold_us").get("count")));
+
+  // Resetting clears the stats, and nothing is recorded while disabled
+  LockProfile::setEnabled(false);
+  ++*value.wlock();
+  stats = LockProfile::allToJson(false).get("shared-test");
+  EXPECT_EQ(0, json_integer_value(stats.get("acquisitions")));
+  EXPECT_EQ(0, json_array_size(stats.get("longest_holds")));
+}
@@ -0,0 +1,76 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <stdexcept>
+#include "MappedFileErrors.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace watchman;
+
+namespace {
+void busHandler(int) {
+  recoverFromMappedFileError();
+  abort();
+}
+
+// Installs busHandler for the duration of a test
+class MappedFileErrorsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    struct sigaction sa {};
+    sa.sa_handler = busHandler;
+    ASSERT_EQ(0, sigaction(SIGBUS, &sa, &prior_));
+  }
+
+  void TearDown() override {
+    sigaction(SIGBUS, &prior_, nullptr);
+  }
+
+ private:
+  struct sigaction prior_ {};
+};
+} // namespace
+
+TEST_F(MappedFileErrorsTest, returnsTrueWhenNothingFaults) {
+  int calls = 0;
+  EXPECT_TRUE(catchMappedFileErrors([&] { ++calls; }));
+  EXPECT_EQ(1, calls);
+}
+
+TEST_F(MappedFileErrorsTest, passesExceptionsThrough) {
+  EXPECT_THROW(
+      catchMappedFileErrors([] { throw std::runtime_error("boom"); }),
+      std::runtime_error);
+  // Nothing is left behind to catch a later fault
+  EXPECT_TRUE(catchMappedFileErrors([] {}));
+}
+
+TEST_F(MappedFileErrorsTest, recoversFromReadingATruncatedFile) {
+  char path[] = "/tmp/mappedfileXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(-1, fd);
+  unlink(path);
+  auto pageSize = size_t(sysconf(_SC_PAGESIZE));
+  ASSERT_EQ(0, ftruncate(fd, off_t(pageSize * 2)));
+  auto addr = mmap(nullptr, pageSize * 2, PROT_READ, MAP_PRIVATE, fd, 0);
+  ASSERT_NE(MAP_FAILED, addr);
+  ASSERT_EQ(0, ftruncate(fd, 0));
+
+  auto data = static_cast<const volatile char*>(addr);
+  char value = 1;
+  // It can recover more than once
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_FALSE(catchMappedFileErrors([&] { value = data[pageSize]; }));
+  }
+  EXPECT_EQ(1, value);
+
+  munmap(addr, pageSize * 2);
+  close(fd);
+}
+#endif
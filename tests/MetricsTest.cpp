@@ -0,0 +1,55 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "Metrics.h"
+#include <folly/portability/GTest.h>
+
+using namespace watchman;
+
+TEST(Metrics, groupsSamplesUnderTheirMetric) {
+  MetricsWriter metrics;
+  metrics.counter("b_total", "B", 1, {{"root", w_string("/one")}});
+  metrics.gauge("a", "A", 7);
+  metrics.counter("b_total", "B", 2, {{"root", w_string("/two")}});
+
+  EXPECT_EQ(
+      "# HELP a A\n"
+      "# TYPE a gauge\n"
+      "a 7\n"
+      "# HELP b_total B\n"
+      "# TYPE b_total counter\n"
+      "b_total{root=\"/one\"} 1\n"
+      "b_total{root=\"/two\"} 2\n",
+      metrics.render());
+}
+
+TEST(Metrics, escapesLabelValues) {
+  MetricsWriter metrics;
+  metrics.gauge("a", "A", 1, {{"root", w_string("/a \"b\"\\c\nd")}});
+  EXPECT_EQ(
+      "# HELP a A\n"
+      "# TYPE a gauge\n"
+      "a{root=\"/a \\\"b\\\"\\\\c\\nd\"} 1\n",
+      metrics.render());
+}
+
+TEST(Metrics, histogramBucketsAreCumulative) {
+  Histogram histogram;
+  histogram.record(0);
+  histogram.record(3);
+  histogram.record(5);
+  histogram.record(6);
+
+  MetricsWriter metrics;
+  metrics.histogram("h", "H", histogram, {{"root", w_string("/r")}});
+  EXPECT_EQ(
+      "# HELP h H\n"
+      "# TYPE h histogram\n"
+      "h_bucket{root=\"/r\",le=\"0\"} 1\n"
+      "h_bucket{root=\"/r\",le=\"1\"} 1\n"
+      "h_bucket{root=\"/r\",le=\"3\"} 2\n"
+      "h_bucket{root=\"/r\",le=\"7\"} 4\n"
+      "h_bucket{root=\"/r\",le=\"+Inf\"} 4\n"
+      "h_sum{root=\"/r\"} 14\n"
+      "h_count{root=\"/r\"} 4\n",
+      metrics.render());
+}
@@ -0,0 +1,131 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <cstring>
+#include <vector>
+#include "NodeArena.h"
+
+using namespace watchman;
+
+TEST(NodeArenaTest, allocatesZeroedAlignedMemory) {
+  NodeArena arena;
+
+  for (size_t size : {1, 15, 16, 17, 200, 1024}) {
+    auto ptr = static_cast<char*>(arena.allocate(size));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(ptr) % NodeArena::kGranularity, 0)
+        << "size " << size;
+    for (size_t i = 0; i < size; ++i) {
+      EXPECT_EQ(ptr[i], 0) << "byte " << i << " of size " << size;
+    }
+    memset(ptr, 0xff, size);
+    arena.deallocate(ptr, size);
+  }
+
+  // Recycled slots are zeroed again
+  auto ptr = static_cast<char*>(arena.allocate(200));
+  for (size_t i = 0; i < 200; ++i) {
+    EXPECT_EQ(ptr[i], 0) << "byte " << i;
+  }
+  arena.deallocate(ptr, 200);
+
+  EXPECT_EQ(arena.stats().numLive, 0);
+  EXPECT_EQ(arena.stats().bytesInUse, 0);
+}
+
+TEST(NodeArenaTest, reusesFreedSlots) {
+  NodeArena arena;
+
+  auto a = arena.allocate(100);
+  arena.deallocate(a, 100);
+  auto b = arena.allocate(100);
+  EXPECT_EQ(a, b) << "freed slot is handed out again";
+  arena.deallocate(b, 100);
+}
+
+TEST(NodeArenaTest, largeAllocationsUseTheSystemAllocator) {
+  NodeArena arena;
+
+  auto ptr = arena.allocate(NodeArena::kMaxSlotSize + 1);
+  EXPECT_EQ(arena.stats().numLarge, 1);
+  EXPECT_EQ(arena.stats().numSlabs, 0);
+  arena.deallocate(ptr, NodeArena::kMaxSlotSize + 1);
+  EXPECT_EQ(arena.stats().numLarge, 0);
+}
+
+TEST(NodeArenaTest, compactReleasesEmptySlabs) {
+  NodeArena arena;
+  std::vector<void*> ptrs;
+
+  for (size_t i = 0; i < 10000; ++i) {
+    ptrs.push_back(arena.allocate(128));
+  }
+  auto slabs = arena.stats().numSlabs;
+  EXPECT_GT(slabs, 1);
+
+  // Nothing is free, so nothing can be released
+  EXPECT_EQ(arena.compact(), 0);
+
+  // Free everything except the first allocation, which pins its slab
+  for (size_t i = 1; i < ptrs.size(); ++i) {
+    arena.deallocate(ptrs[i], 128);
+  }
+  EXPECT_EQ(arena.compact(), slabs - 1);
+  EXPECT_EQ(arena.stats().numSlabs, 1);
+  EXPECT_EQ(arena.stats().numSlabsReleased, slabs - 1);
+
+  // The arena remains usable after compaction and doesn't hand out
+  // memory from the released slabs
+  for (size_t i = 1; i < ptrs.size(); ++i) {
+    ptrs[i] = arena.allocate(128);
+    memset(ptrs[i], 'x', 128);
+  }
+  for (auto ptr : ptrs) {
+    arena.deallocate(ptr, 128);
+  }
+  EXPECT_EQ(arena.stats().numLive, 0);
+}
+
+TEST(NodeArenaTest, hugePageRegionsAreReleasedWhenEmpty) {
+  // Falls back to ordinary slabs where huge pages aren't available, in
+  // which case this checks that the fallback works
+  NodeArena arena(true);
+  std::vector<char*> ptrs;
+
+  for (size_t i = 0; i < 40000; ++i) {
+    auto ptr = static_cast<char*>(arena.allocate(128));
+    for (size_t j = 0; j < 128; ++j) {
+      ASSERT_EQ(ptr[j], 0) << "allocation " << i << " byte " << j;
+    }
+    memset(ptr, 'x', 128);
+    ptrs.push_back(ptr);
+  }
+  auto stats = arena.stats();
+  EXPECT_GT(stats.numSlabs, NodeArena::kSlabsPerHugePage);
+  if (stats.numHugeRegions > 0) {
+    EXPECT_GE(
+        stats.numHugeRegions * NodeArena::kSlabsPerHugePage, stats.numSlabs);
+  }
+  EXPECT_LE(
+      arena.hugePageBytes(), stats.numHugeRegions * NodeArena::kHugePageSize);
+
+  // Release half of the slabs, and check that reusing their space from
+  // the regions hands out zeroed memory
+  for (size_t i = 0; i < ptrs.size() / 2; ++i) {
+    arena.deallocate(ptrs[i], 128);
+  }
+  arena.compact();
+  for (size_t i = 0; i < ptrs.size() / 2; ++i) {
+    ptrs[i] = static_cast<char*>(arena.allocate(128));
+    for (size_t j = 0; j < 128; ++j) {
+      ASSERT_EQ(ptrs[i][j], 0) << "allocation " << i << " byte " << j;
+    }
+  }
+
+  for (auto ptr : ptrs) {
+    arena.deallocate(ptr, 128);
+  }
+  arena.compact();
+  EXPECT_EQ(arena.stats().numSlabs, 0);
+  EXPECT_EQ(arena.stats().numHugeRegions, 0);
+}
@@ -0,0 +1,38 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <string>
+#include "PathInterner.h"
+
+using namespace watchman;
+
+TEST(PathInterner, sharesOneCopyOfEachPath) {
+  PathInterner interner;
+  auto a = interner.intern("foo/bar", "baz.txt");
+  auto b = interner.intern("foo/bar/baz.txt");
+  auto c = interner.intern("foo", "bar/baz.txt");
+  EXPECT_EQ(w_string("foo/bar/baz.txt"), a);
+  EXPECT_EQ(static_cast<w_string_t*>(a), static_cast<w_string_t*>(b));
+  EXPECT_EQ(static_cast<w_string_t*>(a), static_cast<w_string_t*>(c));
+  EXPECT_TRUE(static_cast<w_string_t*>(a)->hval_computed);
+
+  auto top = interner.intern("", "baz.txt");
+  EXPECT_EQ(w_string("baz.txt"), top);
+  EXPECT_NE(static_cast<w_string_t*>(a), static_cast<w_string_t*>(top));
+  EXPECT_EQ(2, interner.size());
+}
+
+TEST(PathInterner, prunesUnreferencedPaths) {
+  PathInterner interner;
+  auto kept = interner.intern("kept");
+  for (int i = 0; i < 5000; ++i) {
+    interner.intern("dir", std::to_string(i).c_str());
+  }
+  // The paths that were dropped straight away have been pruned along the
+  // way, and the one that is still referenced has survived
+  EXPECT_LT(interner.size(), 2100);
+  EXPECT_EQ(
+      static_cast<w_string_t*>(kept),
+      static_cast<w_string_t*>(interner.intern("kept")));
+}
@@ -0,0 +1,115 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/FileUtil.h>
+#include <folly/portability/GTest.h>
+#include <string>
+#include "PerfAlarms.h"
+
+using namespace watchman;
+using namespace std::chrono_literals;
+
+namespace {
+const w_string kRoot("/root", W_STRING_BYTE);
+
+PerfAlarms::Options budget(std::chrono::milliseconds ms) {
+  PerfAlarms::Options options;
+  options.budgets["query_execute"] = ms;
+  return options;
+}
+} // namespace
+
+TEST(PerfAlarms, percentile99) {
+  EXPECT_EQ(0, PerfAlarms::percentile99({}));
+  EXPECT_EQ(7, PerfAlarms::percentile99({7}));
+
+  std::vector<uint64_t> samples;
+  for (uint64_t i = 100; i >= 1; --i) {
+    samples.push_back(i);
+  }
+  EXPECT_EQ(99, PerfAlarms::percentile99(samples));
+  samples.push_back(1000);
+  EXPECT_EQ(100, PerfAlarms::percentile99(samples));
+}
+
+TEST(PerfAlarms, disabledWithoutBudgets) {
+  PerfAlarms alarms;
+  for (size_t i = 0; i < PerfAlarms::kWindowSamples; ++i) {
+    EXPECT_FALSE(alarms.record("query_execute", kRoot, 1000000));
+  }
+}
+
+TEST(PerfAlarms, waitsForEnoughSamples) {
+  PerfAlarms alarms;
+  alarms.configure(budget(1ms), nullptr);
+  for (size_t i = 1; i < PerfAlarms::kMinSamples; ++i) {
+    EXPECT_FALSE(alarms.record("query_execute", kRoot, 5000));
+  }
+  // Operations without a budget don't raise alarms
+  EXPECT_FALSE(alarms.record("sync_to_now", kRoot, 5000));
+
+  auto alarm = alarms.record("query_execute", kRoot, 5000);
+  ASSERT_TRUE(alarm);
+  EXPECT_EQ("query_execute", alarm->description);
+  EXPECT_EQ(kRoot, alarm->root);
+  EXPECT_EQ(5000, alarm->p99Us);
+  EXPECT_EQ(1000, alarm->budgetUs);
+  EXPECT_EQ(PerfAlarms::kMinSamples, alarm->samples);
+}
+
+TEST(PerfAlarms, ignoresOccasionalSlowSamples) {
+  PerfAlarms alarms;
+  alarms.configure(budget(1ms), nullptr);
+  for (size_t i = 0; i < PerfAlarms::kWindowSamples * 2; ++i) {
+    // One in a hundred is under the 99th percentile
+    auto wallTimeUs = i % PerfAlarms::kWindowSamples == 0 ? 5000 : 10;
+    EXPECT_FALSE(alarms.record("query_execute", kRoot, wallTimeUs));
+  }
+}
+
+TEST(PerfAlarms, rateLimitsEachRoot) {
+  PerfAlarms alarms;
+  alarms.configure(budget(1ms), nullptr);
+  for (size_t i = 1; i < PerfAlarms::kMinSamples; ++i) {
+    alarms.record("query_execute", kRoot, 5000);
+  }
+  EXPECT_TRUE(alarms.record("query_execute", kRoot, 5000));
+  EXPECT_FALSE(alarms.record("query_execute", kRoot, 5000));
+
+  auto stats = alarms.stats();
+  EXPECT_EQ(1, stats.get("raised").asInt());
+  EXPECT_EQ(1, stats.get("suppressed").asInt());
+}
+
+TEST(PerfAlarms, raiseWritesDiagnostics) {
+  char tmpl[] = "/tmp/perfalarmsXXXXXX";
+  ASSERT_NE(mkdtemp(tmpl), nullptr);
+  auto options = budget(1ms);
+  options.dumpDir = w_string(tmpl, W_STRING_BYTE);
+  options.maxDumps = 2;
+
+  PerfAlarms alarms;
+  alarms.configure(options, [](const w_string& root) {
+    return json_object({{"root", w_string_to_json(root)}});
+  });
+  PerfAlarms::Alarm alarm{"query_execute", kRoot, 5000, 1000, 10};
+
+  auto first = alarms.raise(alarm);
+  ASSERT_TRUE(first);
+  EXPECT_EQ(w_string::build(tmpl, "/perf-alarm-0.json"), first);
+  std::string contents;
+  ASSERT_TRUE(folly::readFile(first.c_str(), contents));
+  auto dump = json_loads(contents.c_str(), 0, nullptr);
+  EXPECT_EQ(5000, dump.get("p99_us").asInt());
+  EXPECT_EQ(kRoot, json_to_w_string(dump.get("diagnostics").get("root")));
+
+  // The ring of dump files wraps around
+  auto second = alarms.raise(alarm);
+  auto third = alarms.raise(alarm);
+  EXPECT_EQ(first, third);
+  EXPECT_EQ(2, alarms.stats().get("dumps").array().size());
+
+  unlink(first.c_str());
+  unlink(second.c_str());
+  rmdir(tmpl);
+}
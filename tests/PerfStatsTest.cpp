@@ -0,0 +1,73 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "PerfStats.h"
+#include <folly/portability/GTest.h>
+#include <thread>
+#include <vector>
+
+using namespace watchman;
+
+namespace {
+// Returns the aggregated sample with the given description and root, or
+// null if there is none
+json_ref findSample(
+    const json_ref& stats,
+    const char* description,
+    const char* root) {
+  for (auto& sample : stats.get("samples").array()) {
+    if (w_string_piece(json_to_w_string(sample.get("description"))) !=
+        w_string_piece(description)) {
+      continue;
+    }
+    auto sampleRoot = sample.get("root");
+    if (root ? sampleRoot.isString() &&
+                w_string_piece(json_to_w_string(sampleRoot)) ==
+                    w_string_piece(root)
+             : sampleRoot.isNull()) {
+      return sample;
+    }
+  }
+  return nullptr;
+}
+} // namespace
+
+TEST(PerfStats, aggregatesAcrossThreadsByDescriptionAndRoot) {
+  auto& stats = PerfStats::get();
+  PerfStats::Usage usage;
+  usage.userTimeUs = 10;
+  usage.majorFaults = 1;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 100; ++i) {
+        stats.record("perf-stats-test", w_string("/a"), 5, usage);
+      }
+      stats.record("perf-stats-test", nullptr, 7, usage);
+    });
+  }
+  // This thread is still running when the stats are reported
+  stats.record("perf-stats-test", w_string("/a"), 5, usage);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  auto result = stats.toJson(true);
+  auto rootA = findSample(result, "perf-stats-test", "/a");
+  ASSERT_TRUE(rootA);
+  EXPECT_EQ(401, json_integer_value(rootA.get("wall_time_us").get("count")));
+  EXPECT_EQ(4010, json_integer_value(rootA.get("user_time_us")));
+  EXPECT_EQ(401, json_integer_value(rootA.get("major_faults")));
+
+  auto noRoot = findSample(result, "perf-stats-test", nullptr);
+  ASSERT_TRUE(noRoot);
+  EXPECT_EQ(4, json_integer_value(noRoot.get("wall_time_us").get("count")));
+  EXPECT_EQ(7, json_integer_value(noRoot.get("wall_time_us").get("max")));
+
+  // Resetting forgets the samples of exited and running threads alike
+  EXPECT_FALSE(findSample(stats.toJson(false), "perf-stats-test", "/a"));
+  stats.record("perf-stats-test", w_string("/a"), 5, usage);
+  rootA = findSample(stats.toJson(false), "perf-stats-test", "/a");
+  ASSERT_TRUE(rootA);
+  EXPECT_EQ(1, json_integer_value(rootA.get("wall_time_us").get("count")));
+}
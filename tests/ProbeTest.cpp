@@ -0,0 +1,49 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <cstring>
+#include "Probe.h"
+
+using namespace watchman;
+
+TEST(Probe, requestsRoundTrip) {
+  ProbeRequest request;
+  request.op = ProbeOp::Clock;
+  request.rootNumber = 42;
+
+  char buf[kProbeRequestSize];
+  encodeProbeRequest(request, buf);
+  EXPECT_EQ(0, memcmp(buf, PROBE_MAGIC, 2));
+
+  auto decoded = decodeProbeRequest(buf);
+  EXPECT_EQ(ProbeOp::Clock, decoded.op);
+  EXPECT_EQ(42, decoded.rootNumber);
+}
+
+TEST(Probe, responsesRoundTrip) {
+  ProbeResponse response;
+  response.status = ProbeStatus::UnknownRoot;
+  response.startTime = 1600000000;
+  response.pid = 1234;
+  response.position = ClockPosition(7, 99);
+
+  char buf[kProbeResponseSize];
+  encodeProbeResponse(response, buf);
+  EXPECT_EQ(0, memcmp(buf, PROBE_MAGIC, 2));
+
+  auto decoded = decodeProbeResponse(buf);
+  EXPECT_EQ(ProbeStatus::UnknownRoot, decoded.status);
+  EXPECT_EQ(1600000000, decoded.startTime);
+  EXPECT_EQ(1234, decoded.pid);
+  EXPECT_EQ(7, decoded.position.rootNumber);
+  EXPECT_EQ(99, decoded.position.ticks);
+}
+
+TEST(Probe, unknownOpsSurviveDecoding) {
+  char buf[kProbeRequestSize];
+  ProbeRequest request;
+  encodeProbeRequest(request, buf);
+  buf[2] = 0x7f;
+  EXPECT_EQ(ProbeOp(0x7f), decodeProbeRequest(buf).op);
+}
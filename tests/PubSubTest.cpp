@@ -0,0 +1,142 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "PubSub.h"
+
+using namespace watchman;
+
+namespace {
+using Pending = std::vector<std::shared_ptr<const Publisher::Item>>;
+
+size_t refcount(const json_ref& json) {
+  return static_cast<json_t*>(json)->refcount.load();
+}
+} // namespace
+
+TEST(PubSubTest, onlyQueuesWithSubscribers) {
+  auto pub = std::make_shared<Publisher>();
+  EXPECT_FALSE(pub->hasSubscribers());
+  EXPECT_FALSE(pub->enqueue(json_integer(1)));
+
+  int notified = 0;
+  auto sub = pub->subscribe([&notified] { ++notified; });
+  EXPECT_TRUE(pub->hasSubscribers());
+  EXPECT_TRUE(pub->enqueue(json_integer(2)));
+  EXPECT_EQ(1, notified);
+
+  sub.reset();
+  EXPECT_FALSE(pub->hasSubscribers());
+  EXPECT_FALSE(pub->enqueue(json_integer(3)));
+}
+
+TEST(PubSubTest, subscribersReadInOrderAcrossBlocks) {
+  auto pub = std::make_shared<Publisher>();
+  auto early = pub->subscribe(nullptr);
+
+  for (int i = 0; i < 50; ++i) {
+    pub->enqueue(json_integer(i));
+  }
+  // A late subscriber only sees what is published after it subscribes
+  auto late = pub->subscribe(nullptr);
+  for (int i = 50; i < 100; ++i) {
+    pub->enqueue(json_integer(i));
+  }
+
+  Pending pending;
+  early->getPending(pending);
+  ASSERT_EQ(100u, pending.size());
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i, pending[i]->payload.asInt());
+    EXPECT_EQ(uint64_t(i + 1), pending[i]->serial);
+  }
+  EXPECT_EQ(100u, early->getSerial());
+
+  pending.clear();
+  late->getPending(pending);
+  ASSERT_EQ(50u, pending.size());
+  EXPECT_EQ(50, pending.front()->payload.asInt());
+
+  // Nothing more until something else is published
+  pending.clear();
+  early->getPending(pending);
+  EXPECT_TRUE(pending.empty());
+}
+
+TEST(PubSubTest, itemsAreReleasedOnceConsumed) {
+  auto pub = std::make_shared<Publisher>();
+  auto sub1 = pub->subscribe(nullptr);
+  auto sub2 = pub->subscribe(nullptr);
+
+  auto payload = json_object({{"first", json_true()}});
+  pub->enqueue(json_ref(payload));
+  EXPECT_EQ(2u, refcount(payload));
+
+  // Publish enough to move the stream well past the first item's block
+  for (int i = 0; i < 200; ++i) {
+    pub->enqueue(json_integer(i));
+  }
+
+  Pending pending;
+  sub1->getPending(pending);
+  pending.clear();
+  // sub2 hasn't read it yet
+  EXPECT_EQ(2u, refcount(payload));
+  EXPECT_FALSE(pub->getDebugInfo().get("items").array().empty());
+
+  sub2->getPending(pending);
+  pending.clear();
+  EXPECT_EQ(1u, refcount(payload));
+  EXPECT_TRUE(pub->getDebugInfo().get("items").array().empty());
+}
+
+TEST(PubSubTest, concurrentProducers) {
+  constexpr int kThreads = 4;
+  constexpr int kItemsPerThread = 1000;
+  auto pub = std::make_shared<Publisher>();
+  auto sub = pub->subscribe(nullptr);
+
+  std::atomic<bool> done{false};
+  std::vector<int> seen(kThreads, 0);
+  uint64_t lastSerial = 0;
+  bool inOrder = true;
+  std::thread consumer([&] {
+    Pending pending;
+    auto consume = [&] {
+      pending.clear();
+      sub->getPending(pending);
+      for (auto& item : pending) {
+        inOrder = inOrder && item->serial == lastSerial + 1;
+        lastSerial = item->serial;
+        ++seen[item->payload.asInt()];
+      }
+    };
+    while (!done.load()) {
+      consume();
+    }
+    consume();
+  });
+
+  std::vector<std::thread> producers;
+  for (int t = 0; t < kThreads; ++t) {
+    producers.emplace_back([&pub, t] {
+      for (int i = 0; i < kItemsPerThread; ++i) {
+        pub->enqueue(json_integer(t));
+      }
+    });
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  done.store(true);
+  consumer.join();
+
+  EXPECT_TRUE(inOrder);
+  EXPECT_EQ(uint64_t(kThreads * kItemsPerThread), lastSerial);
+  for (int t = 0; t < kThreads; ++t) {
+    EXPECT_EQ(kItemsPerThread, seen[t]);
+  }
+}
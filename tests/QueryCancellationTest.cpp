@@ -0,0 +1,40 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include "QueryCancellation.h"
+
+using namespace watchman;
+using Reason = QueryCancellation::Reason;
+
+TEST(QueryCancellation, notCancelledWithoutCause) {
+  QueryCancellation cancellation(folly::none, nullptr);
+  EXPECT_EQ(Reason::None, cancellation.poll());
+  EXPECT_EQ(Reason::None, cancellation.reason());
+}
+
+TEST(QueryCancellation, cancelledPastDeadline) {
+  QueryCancellation cancellation(
+      std::chrono::steady_clock::now() - std::chrono::milliseconds(1),
+      nullptr);
+  // Only poll() looks at the clock
+  EXPECT_EQ(Reason::None, cancellation.reason());
+  EXPECT_EQ(Reason::Deadline, cancellation.poll());
+  EXPECT_EQ(Reason::Deadline, cancellation.reason());
+}
+
+TEST(QueryCancellation, cancelledOnceClientIsGone) {
+  bool gone = false;
+  int probes = 0;
+  QueryCancellation cancellation(
+      std::chrono::steady_clock::now() + std::chrono::hours(1), [&] {
+        ++probes;
+        return gone;
+      });
+  EXPECT_EQ(Reason::None, cancellation.poll());
+  gone = true;
+  EXPECT_EQ(Reason::Disconnected, cancellation.poll());
+  // The reason sticks without asking again
+  EXPECT_EQ(Reason::Disconnected, cancellation.poll());
+  EXPECT_EQ(2, probes);
+}
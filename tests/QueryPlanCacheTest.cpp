@@ -0,0 +1,47 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include "QueryPlanCache.h"
+#include "watchman_query.h"
+
+using namespace watchman;
+
+namespace {
+const w_string kFind("find\0*.c", 8, W_STRING_BYTE);
+const w_string kSince("since\0*.c", 9, W_STRING_BYTE);
+} // namespace
+
+TEST(QueryPlanCache, takesWhatWasPut) {
+  QueryPlanCache cache(4);
+  EXPECT_EQ(nullptr, cache.take(kFind));
+
+  auto query = std::make_shared<w_query>();
+  cache.put(kFind, query);
+  EXPECT_EQ(nullptr, cache.take(kSince));
+  EXPECT_EQ(query, cache.take(kFind));
+
+  // It is out of the cache until it is put back
+  EXPECT_EQ(nullptr, cache.take(kFind));
+
+  auto stats = cache.stats();
+  EXPECT_EQ(1, stats.get("hits").asInt());
+  EXPECT_EQ(3, stats.get("misses").asInt());
+}
+
+TEST(QueryPlanCache, evictsWhenFull) {
+  QueryPlanCache cache(1);
+  cache.put(kFind, std::make_shared<w_query>());
+  cache.put(kSince, std::make_shared<w_query>());
+
+  EXPECT_EQ(1, cache.stats().get("entries").asInt());
+  EXPECT_EQ(1, cache.stats().get("evictions").asInt());
+  EXPECT_NE(nullptr, cache.take(kSince));
+}
+
+TEST(QueryPlanCache, disabledCacheKeepsNothing) {
+  QueryPlanCache cache(0);
+  EXPECT_FALSE(cache.enabled());
+  cache.put(kFind, std::make_shared<w_query>());
+  EXPECT_EQ(nullptr, cache.take(kFind));
+}
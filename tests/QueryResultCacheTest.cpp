@@ -0,0 +1,77 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <string>
+#include "QueryResultCache.h"
+
+using namespace watchman;
+
+namespace {
+QueryResultCache::Encoded encode(const char* str) {
+  return std::make_shared<const std::string>(str);
+}
+
+const w_string kSpec("{\"fields\":[\"name\"]}", W_STRING_BYTE);
+} // namespace
+
+TEST(QueryResultCache, hitsAtSamePosition) {
+  QueryResultCache cache(1024);
+  ClockPosition position(1, 10);
+
+  EXPECT_EQ(nullptr, cache.get(kSpec, is_bser, 0, position));
+  cache.set(kSpec, is_bser, 0, position, encode("response"));
+
+  auto hit = cache.get(kSpec, is_bser, 0, position);
+  ASSERT_NE(nullptr, hit);
+  EXPECT_EQ("response", *hit);
+
+  // The encoding is part of the key
+  EXPECT_EQ(nullptr, cache.get(kSpec, is_json_compact, 0, position));
+  EXPECT_EQ(nullptr, cache.get(kSpec, is_bser_v2, 1, position));
+
+  auto stats = cache.stats();
+  EXPECT_EQ(1, stats.get("hits").asInt());
+  EXPECT_EQ(3, stats.get("misses").asInt());
+}
+
+TEST(QueryResultCache, evictedByNextTick) {
+  QueryResultCache cache(1024);
+  cache.get(kSpec, is_bser, 0, ClockPosition(1, 10));
+  cache.set(kSpec, is_bser, 0, ClockPosition(1, 10), encode("response"));
+
+  EXPECT_EQ(nullptr, cache.get(kSpec, is_bser, 0, ClockPosition(1, 11)));
+  EXPECT_EQ(1, cache.stats().get("evictions").asInt());
+
+  // A response computed before the tick is no longer useful
+  cache.set(kSpec, is_bser, 0, ClockPosition(1, 10), encode("response"));
+  EXPECT_EQ(nullptr, cache.get(kSpec, is_bser, 0, ClockPosition(1, 11)));
+  EXPECT_EQ(1, cache.stats().get("rejected").asInt());
+}
+
+TEST(QueryResultCache, respectsMaxBytes) {
+  QueryResultCache cache(10);
+  ClockPosition position(1, 10);
+  cache.set(kSpec, is_bser, 0, position, encode("0123456789abc"));
+  EXPECT_EQ(nullptr, cache.get(kSpec, is_bser, 0, position));
+  EXPECT_EQ(0, cache.stats().get("bytes").asInt());
+}
+
+TEST(QueryResultCache, clearRefusesStoresUntilNextTick) {
+  QueryResultCache cache(1024);
+  ClockPosition position(1, 10);
+  cache.set(kSpec, is_bser, 0, position, encode("response"));
+
+  cache.clear(position);
+  EXPECT_EQ(nullptr, cache.get(kSpec, is_bser, 0, position));
+  EXPECT_EQ(1, cache.stats().get("evictions").asInt());
+
+  // A query that was executed before the clear may be stale
+  cache.set(kSpec, is_bser, 0, position, encode("response"));
+  EXPECT_EQ(nullptr, cache.get(kSpec, is_bser, 0, position));
+  EXPECT_EQ(1, cache.stats().get("rejected").asInt());
+
+  ClockPosition next(1, 11);
+  cache.set(kSpec, is_bser, 0, next, encode("response"));
+  EXPECT_NE(nullptr, cache.get(kSpec, is_bser, 0, next));
+}
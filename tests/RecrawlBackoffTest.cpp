@@ -0,0 +1,166 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include "RecrawlBackoff.h"
+
+using namespace watchman;
+using std::chrono::milliseconds;
+using TimePoint = RecrawlBackoff::TimePoint;
+
+namespace {
+// Waits for the whole of each backoff rather than a random part of it
+double noSpread() {
+  return 1.0;
+}
+
+RecrawlBackoff makeBackoff() {
+  return RecrawlBackoff(milliseconds(100), milliseconds(1000), noSpread);
+}
+
+const TimePoint kStart = TimePoint() + std::chrono::hours(1);
+} // namespace
+
+TEST(RecrawlBackoff, doublesUpToTheMax) {
+  EXPECT_EQ(
+      milliseconds(100),
+      RecrawlBackoff::delayFor(1, milliseconds(100), milliseconds(1000)));
+  EXPECT_EQ(
+      milliseconds(400),
+      RecrawlBackoff::delayFor(3, milliseconds(100), milliseconds(1000)));
+  EXPECT_EQ(
+      milliseconds(1000),
+      RecrawlBackoff::delayFor(30, milliseconds(100), milliseconds(1000)));
+}
+
+TEST(RecrawlBackoff, spreadsOverTheUpperHalf) {
+  RecrawlBackoff backoff(
+      milliseconds(100), milliseconds(1000), [] { return 0.0; });
+  backoff.recrawlScheduled(kStart, true);
+  backoff.recrawlFinished(kStart);
+  EXPECT_EQ(milliseconds(50), backoff.recrawlScheduled(kStart, true));
+}
+
+TEST(RecrawlBackoff, firstRecrawlDoesNotWait) {
+  auto backoff = makeBackoff();
+  EXPECT_EQ(milliseconds(0), backoff.recrawlScheduled(kStart, true));
+  EXPECT_FALSE(backoff.recrawlWaiting(kStart));
+  EXPECT_EQ(0, backoff.streak());
+}
+
+TEST(RecrawlBackoff, spacesOutRepeatedRecrawls) {
+  auto backoff = makeBackoff();
+  auto now = kStart;
+  backoff.recrawlScheduled(now, true);
+  backoff.recrawlFinished(now);
+
+  milliseconds expected[] = {milliseconds(100),
+                             milliseconds(200),
+                             milliseconds(400),
+                             milliseconds(800),
+                             milliseconds(1000)};
+  for (auto delay : expected) {
+    now += milliseconds(10);
+    EXPECT_EQ(delay, backoff.recrawlScheduled(now, true));
+    EXPECT_TRUE(backoff.recrawlWaiting(now));
+    EXPECT_TRUE(backoff.recrawlWaiting(now + delay - milliseconds(1)));
+    EXPECT_FALSE(backoff.recrawlWaiting(now + delay));
+    now += delay;
+    backoff.recrawlStarted();
+    backoff.recrawlFinished(now);
+  }
+  EXPECT_EQ(5, backoff.streak());
+}
+
+TEST(RecrawlBackoff, explicitRecrawlDoesNotWait) {
+  auto backoff = makeBackoff();
+  backoff.recrawlScheduled(kStart, true);
+  backoff.recrawlFinished(kStart);
+  EXPECT_EQ(
+      milliseconds(0),
+      backoff.recrawlScheduled(kStart + milliseconds(10), false));
+  EXPECT_FALSE(backoff.recrawlWaiting(kStart + milliseconds(10)));
+  // It still counts towards the streak
+  EXPECT_EQ(1, backoff.streak());
+}
+
+TEST(RecrawlBackoff, resetsOnceHealthy) {
+  auto backoff = makeBackoff();
+  auto now = kStart;
+  for (int i = 0; i < 4; ++i) {
+    now += backoff.recrawlScheduled(now, true);
+    backoff.recrawlFinished(now);
+  }
+  EXPECT_EQ(3, backoff.streak());
+
+  // Nothing needed a recrawl for longer than the max
+  now += milliseconds(1000);
+  EXPECT_EQ(milliseconds(0), backoff.recrawlScheduled(now, true));
+  EXPECT_EQ(0, backoff.streak());
+  backoff.recrawlFinished(now);
+  EXPECT_EQ(
+      milliseconds(100),
+      backoff.recrawlScheduled(now + milliseconds(10), true));
+}
+
+TEST(RecrawlBackoff, retriesOnlyTheFailedSubtree) {
+  auto backoff = makeBackoff();
+  w_string dir("/root/flaky", W_STRING_BYTE);
+  w_string reason("EIO", W_STRING_BYTE);
+  EXPECT_EQ(milliseconds(100), backoff.subtreeFailed(dir, reason, kStart));
+  EXPECT_EQ(kStart + milliseconds(100), *backoff.nextSubtreeRetry());
+  EXPECT_TRUE(backoff.takeDueSubtrees(kStart + milliseconds(99)).empty());
+
+  auto due = backoff.takeDueSubtrees(kStart + milliseconds(100));
+  ASSERT_EQ(1, due.size());
+  EXPECT_EQ(dir, due[0]);
+  // It is only queued once
+  EXPECT_TRUE(backoff.takeDueSubtrees(kStart + milliseconds(100)).empty());
+  EXPECT_FALSE(backoff.nextSubtreeRetry().has_value());
+
+  // A full recrawl isn't needed for it
+  EXPECT_FALSE(backoff.recrawlNotBefore().has_value());
+  EXPECT_EQ(0, backoff.streak());
+}
+
+TEST(RecrawlBackoff, backsOffSubtreeThatFailsAgain) {
+  auto backoff = makeBackoff();
+  w_string dir("/root/flaky", W_STRING_BYTE);
+  w_string reason("EIO", W_STRING_BYTE);
+  auto now = kStart;
+  now += backoff.subtreeFailed(dir, reason, now);
+  backoff.takeDueSubtrees(now);
+  // The crawl fails again before it completes
+  EXPECT_EQ(milliseconds(200), backoff.subtreeFailed(dir, reason, now));
+  backoff.subtreeCrawlsFinished();
+  ASSERT_EQ(1, backoff.subtreeErrors().size());
+  EXPECT_EQ(2, backoff.subtreeErrors().at(dir).count);
+}
+
+TEST(RecrawlBackoff, forgetsSubtreeOnceHealthy) {
+  auto backoff = makeBackoff();
+  w_string dir("/root/flaky", W_STRING_BYTE);
+  w_string reason("EIO", W_STRING_BYTE);
+  auto now = kStart;
+  now += backoff.subtreeFailed(dir, reason, now);
+  now += backoff.subtreeFailed(dir, reason, now);
+  backoff.takeDueSubtrees(now);
+  backoff.subtreeCrawlsFinished();
+  EXPECT_TRUE(backoff.subtreeErrors().empty());
+
+  // Failing again later starts from the base again
+  EXPECT_EQ(milliseconds(100), backoff.subtreeFailed(dir, reason, now));
+}
+
+TEST(RecrawlBackoff, recrawlCoversFailedSubtrees) {
+  auto backoff = makeBackoff();
+  backoff.subtreeFailed(
+      w_string("/root/flaky", W_STRING_BYTE),
+      w_string("EIO", W_STRING_BYTE),
+      kStart);
+  backoff.recrawlScheduled(kStart, true);
+  backoff.recrawlStarted();
+  EXPECT_FALSE(backoff.nextSubtreeRetry().has_value());
+  backoff.recrawlFinished(kStart + milliseconds(10));
+  EXPECT_TRUE(backoff.subtreeErrors().empty());
+}
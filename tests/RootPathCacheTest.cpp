@@ -0,0 +1,64 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <string>
+#include "FileSystem.h"
+#include "RootPathCache.h"
+
+using namespace watchman;
+
+namespace {
+size_t counter(const RootPathCache& cache, const char* name) {
+  return size_t(json_integer_value(cache.stats().get(name)));
+}
+} // namespace
+
+#ifndef _WIN32
+TEST(RootPathCache, followsRetargetedSymlinks) {
+  char tmpl[] = "/tmp/rootpathcacheXXXXXX";
+  ASSERT_NE(mkdtemp(tmpl), nullptr);
+  std::string dir(tmpl);
+  auto a = dir + "/a";
+  auto b = dir + "/b";
+  auto link = dir + "/link";
+  ASSERT_EQ(mkdir(a.c_str(), 0700), 0);
+  ASSERT_EQ(mkdir(b.c_str(), 0700), 0);
+  ASSERT_EQ(symlink("a", link.c_str()), 0);
+
+  RootPathCache cache(8);
+  auto resolvedA = realPath(a.c_str());
+  EXPECT_EQ(cache.resolve(link.c_str()), resolvedA);
+  EXPECT_EQ(cache.resolve(link.c_str()), resolvedA);
+  EXPECT_EQ(1, counter(cache, "hits"));
+  EXPECT_EQ(1, counter(cache, "misses"));
+
+  ASSERT_EQ(unlink(link.c_str()), 0);
+  ASSERT_EQ(symlink("b", link.c_str()), 0);
+  EXPECT_EQ(cache.resolve(link.c_str()), realPath(b.c_str()));
+  EXPECT_EQ(1, counter(cache, "stale"));
+
+  cache.invalidate(realPath(b.c_str()));
+  EXPECT_EQ(0, counter(cache, "entries"));
+
+  unlink(link.c_str());
+  rmdir(a.c_str());
+  rmdir(b.c_str());
+  rmdir(dir.c_str());
+}
+
+TEST(RootPathCache, evictsWhenFull) {
+  RootPathCache cache(1);
+  cache.resolve("/tmp");
+  cache.resolve("/");
+  EXPECT_EQ(1, counter(cache, "entries"));
+  EXPECT_EQ(1, counter(cache, "evictions"));
+}
+#endif
+
+TEST(RootPathCache, disabledCacheResolvesEveryTime) {
+  RootPathCache cache(0);
+  EXPECT_FALSE(cache.enabled());
+  EXPECT_THROW(cache.resolve("/no/such/path/at/all"), std::system_error);
+  EXPECT_EQ(0, counter(cache, "misses"));
+}
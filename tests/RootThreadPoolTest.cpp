@@ -0,0 +1,132 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <folly/synchronization/Baton.h>
+#include <atomic>
+#include "Pipe.h"
+#include "RootThreadPool.h"
+
+using namespace watchman;
+
+#ifndef _WIN32
+namespace {
+using Clock = RootThreadPool::Clock;
+constexpr auto kForever = Clock::time_point::max();
+constexpr auto kTimeout = std::chrono::seconds(10);
+} // namespace
+
+TEST(RootThreadPool, runsTasksWhenAddedAndWoken) {
+  RootThreadPool pool(2);
+  std::atomic<int> runs{0};
+  folly::Baton<> first;
+  folly::Baton<> second;
+  auto task = pool.add("task", -1, [&]() -> folly::Optional<Clock::time_point> {
+    if (++runs == 1) {
+      first.post();
+    } else {
+      second.post();
+    }
+    return kForever;
+  });
+  ASSERT_TRUE(first.try_wait_for(kTimeout));
+  EXPECT_FALSE(second.try_wait_for(std::chrono::milliseconds(50)));
+  task->wake();
+  ASSERT_TRUE(second.try_wait_for(kTimeout));
+  EXPECT_EQ(2, runs);
+}
+
+TEST(RootThreadPool, runsAgainIfWokenWhileRunning) {
+  RootThreadPool pool(4);
+  std::atomic<int> running{0};
+  std::atomic<bool> overlapped{false};
+  std::atomic<int> runs{0};
+  folly::Baton<> started;
+  folly::Baton<> release;
+  folly::Baton<> rerun;
+  std::shared_ptr<RootThreadPool::Task> task;
+  task = pool.add("task", -1, [&]() -> folly::Optional<Clock::time_point> {
+    if (++running > 1) {
+      overlapped = true;
+    }
+    auto run = ++runs;
+    if (run == 1) {
+      started.post();
+      release.wait();
+    } else if (run == 2) {
+      rerun.post();
+    }
+    --running;
+    return kForever;
+  });
+  ASSERT_TRUE(started.try_wait_for(kTimeout));
+  // Neither of these may run the task alongside the run that is blocked,
+  // and together they make it run just once more
+  task->wake();
+  task->wake();
+  release.post();
+  ASSERT_TRUE(rerun.try_wait_for(kTimeout));
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(2, runs);
+  EXPECT_FALSE(overlapped);
+}
+
+TEST(RootThreadPool, runsAtDeadline) {
+  RootThreadPool pool(1);
+  std::atomic<int> runs{0};
+  folly::Baton<> done;
+  auto start = Clock::now();
+  pool.add("task", -1, [&]() -> folly::Optional<Clock::time_point> {
+    if (++runs == 3) {
+      done.post();
+      return kForever;
+    }
+    return Clock::now() + std::chrono::milliseconds(20);
+  });
+  ASSERT_TRUE(done.try_wait_for(kTimeout));
+  EXPECT_GE(Clock::now() - start, std::chrono::milliseconds(40));
+}
+
+TEST(RootThreadPool, runsWhenFdIsReadable) {
+  // The pipe has to outlive the pool, which polls it
+  Pipe pipe;
+  RootThreadPool pool(1);
+  std::atomic<int> runs{0};
+  folly::Baton<> first;
+  folly::Baton<> readable;
+  pool.add(
+      "task", pipe.read.fd(), [&]() -> folly::Optional<Clock::time_point> {
+        char buf[16];
+        if (read(pipe.read.fd(), buf, sizeof(buf)) > 0) {
+          readable.post();
+        } else if (++runs == 1) {
+          first.post();
+        }
+        return kForever;
+      });
+  ASSERT_TRUE(first.try_wait_for(kTimeout));
+  EXPECT_FALSE(readable.try_wait_for(std::chrono::milliseconds(50)));
+  ASSERT_EQ(1, write(pipe.write.fd(), "x", 1));
+  EXPECT_TRUE(readable.try_wait_for(kTimeout));
+}
+
+TEST(RootThreadPool, endsTasksThatReturnNone) {
+  RootThreadPool pool(1);
+  std::atomic<int> runs{0};
+  folly::Baton<> ran;
+  auto task = pool.add("task", -1, [&]() -> folly::Optional<Clock::time_point> {
+    ++runs;
+    ran.post();
+    return folly::none;
+  });
+  ASSERT_TRUE(ran.try_wait_for(kTimeout));
+  // The task is forgotten once its worker has taken the lock again
+  for (int i = 0; i < 1000 && pool.numTasks() != 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(0, pool.numTasks());
+  task->wake();
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(1, runs);
+}
+#endif
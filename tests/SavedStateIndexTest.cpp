@@ -0,0 +1,85 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman.h"
+#include <folly/portability/GTest.h>
+#include "saved_state/SavedStateIndex.h"
+
+using namespace watchman;
+
+namespace {
+class SavedStateIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char tmpl[] = "/tmp/savedstateindexXXXXXX";
+    ASSERT_NE(mkdtemp(tmpl), nullptr);
+    dir_ = w_string(tmpl, W_STRING_BYTE);
+  }
+
+  void TearDown() override {
+    for (auto& name : created_) {
+      unlink(name.c_str());
+    }
+    rmdir(dir_.c_str());
+  }
+
+  void touch(const char* name) {
+    auto path = w_string::pathCat({dir_, w_string(name, W_STRING_BYTE)});
+    FILE* f = fopen(path.c_str(), "w");
+    ASSERT_NE(f, nullptr);
+    fclose(f);
+    created_.push_back(path);
+  }
+
+  // Makes the dir look as though it last changed long enough ago that
+  // its listing can be trusted until it changes again
+  void age() {
+    struct timeval times[2] = {{1000, 0}, {1000, 0}};
+    ASSERT_EQ(utimes(dir_.c_str(), times), 0);
+  }
+
+  static bool contains(
+      const std::shared_ptr<const SavedStateIndex::Names>& names,
+      const char* name) {
+    return names->find(w_string(name, W_STRING_BYTE)) != names->end();
+  }
+
+  w_string dir_;
+  std::vector<w_string> created_;
+};
+} // namespace
+
+TEST_F(SavedStateIndexTest, listsTheDirOnlyWhenItChanges) {
+  SavedStateIndex index;
+  touch("aaaa");
+  age();
+
+  auto names = index.list(dir_);
+  ASSERT_TRUE(names);
+  EXPECT_TRUE(contains(names, "aaaa"));
+  EXPECT_FALSE(contains(names, "bbbb"));
+  EXPECT_EQ(index.list(dir_), names);
+  EXPECT_EQ(index.numListings(), 1u);
+
+  touch("bbbb");
+  age();
+  // The mtime is the same as before, but the ctime of the dir is not
+  names = index.list(dir_);
+  EXPECT_TRUE(contains(names, "bbbb"));
+  EXPECT_EQ(index.numListings(), 2u);
+}
+
+TEST_F(SavedStateIndexTest, recentChangesAreListedAgain) {
+  SavedStateIndex index;
+  touch("aaaa");
+
+  // The dir changed within the resolution that we trust its mtime to
+  index.list(dir_);
+  index.list(dir_);
+  EXPECT_EQ(index.numListings(), 2u);
+}
+
+TEST_F(SavedStateIndexTest, missingDir) {
+  SavedStateIndex index;
+  auto missing = w_string::pathCat({dir_, w_string("nope", W_STRING_BYTE)});
+  EXPECT_FALSE(index.list(missing));
+}
@@ -0,0 +1,99 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include "SettleChanges.h"
+
+using namespace watchman;
+
+namespace {
+SettleChanges::Batch batch(
+    uint32_t fromTick,
+    uint32_t toTick,
+    std::vector<w_string> suffixes,
+    std::vector<w_string> dirs) {
+  SettleChanges::Batch batch;
+  batch.fromTick = fromTick;
+  batch.toTick = toTick;
+  batch.suffixes.insert(suffixes.begin(), suffixes.end());
+  batch.dirs = std::move(dirs);
+  return batch;
+}
+
+SettleChanges::Filter suffixFilter(std::vector<w_string> suffixes) {
+  SettleChanges::Filter filter;
+  filter.suffixes = std::move(suffixes);
+  return filter;
+}
+
+SettleChanges::Filter rootFilter(const char* relativeRoot) {
+  SettleChanges::Filter filter;
+  filter.relativeRoot = w_string(relativeRoot, W_STRING_BYTE);
+  return filter;
+}
+} // namespace
+
+TEST(SettleChanges, suffixes) {
+  SettleChanges changes;
+  changes.add(1, batch(0, 10, {"js", "json"}, {"/root"}));
+  changes.add(1, batch(10, 20, {"txt"}, {"/root"}));
+  EXPECT_EQ(20, changes.lastTick(1));
+
+  EXPECT_EQ(20, changes.unmatchedThrough(1, 10, suffixFilter({"js"})));
+  EXPECT_EQ(folly::none, changes.unmatchedThrough(1, 5, suffixFilter({"js"})));
+  EXPECT_EQ(
+      folly::none, changes.unmatchedThrough(1, 10, suffixFilter({"c", "txt"})));
+  EXPECT_EQ(20, changes.unmatchedThrough(1, 0, suffixFilter({"c"})));
+}
+
+TEST(SettleChanges, relativeRoot) {
+  SettleChanges changes;
+  changes.add(1, batch(0, 10, {"js"}, {"/root/a-b", "/root/a/c", "/root/d"}));
+
+  EXPECT_EQ(folly::none, changes.unmatchedThrough(1, 0, rootFilter("/root/a")));
+  EXPECT_EQ(folly::none, changes.unmatchedThrough(1, 0, rootFilter("/root/d")));
+  EXPECT_EQ(10, changes.unmatchedThrough(1, 0, rootFilter("/root/a/b")));
+  EXPECT_EQ(10, changes.unmatchedThrough(1, 0, rootFilter("/root/e")));
+  EXPECT_EQ(10, changes.unmatchedThrough(1, 0, rootFilter("/root/a-")));
+}
+
+TEST(SettleChanges, unknownRanges) {
+  SettleChanges changes(2);
+  auto filter = suffixFilter({"c"});
+  changes.add(1, batch(0, 10, {"js"}, {}));
+  changes.add(1, batch(10, 20, {"js"}, {}));
+  changes.add(1, batch(20, 30, {"js"}, {}));
+
+  // Only the two most recent batches are kept
+  EXPECT_EQ(folly::none, changes.unmatchedThrough(1, 5, filter));
+  EXPECT_EQ(30, changes.unmatchedThrough(1, 15, filter));
+  // Nothing is known about changes after the newest batch
+  EXPECT_EQ(folly::none, changes.unmatchedThrough(1, 30, filter));
+  // Nor about another root number
+  EXPECT_EQ(folly::none, changes.unmatchedThrough(2, 15, filter));
+
+  // A batch that doesn't follow on from the previous one starts afresh
+  changes.add(1, batch(35, 40, {"js"}, {}));
+  EXPECT_EQ(folly::none, changes.unmatchedThrough(1, 25, filter));
+  EXPECT_EQ(40, changes.unmatchedThrough(1, 35, filter));
+
+  auto overflowed = batch(40, 50, {}, {});
+  overflowed.overflowed = true;
+  changes.add(1, std::move(overflowed));
+  EXPECT_EQ(folly::none, changes.unmatchedThrough(1, 35, filter));
+}
+
+TEST(SettleChanges, changedFiles) {
+  SettleChanges changes;
+  auto first = batch(0, 10, {"js"}, {});
+  first.files = 3;
+  changes.add(1, std::move(first));
+  auto second = batch(10, 20, {"js"}, {});
+  second.files = 4;
+  changes.add(1, std::move(second));
+
+  EXPECT_EQ(7, changes.changedFilesSince(1, 0));
+  EXPECT_EQ(4, changes.changedFilesSince(1, 10));
+  EXPECT_EQ(0, changes.changedFilesSince(1, 20));
+  EXPECT_EQ(0, changes.changedFilesSince(2, 0));
+}
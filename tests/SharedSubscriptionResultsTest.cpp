@@ -0,0 +1,90 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <string>
+#include "SharedSubscriptionResults.h"
+
+using namespace watchman;
+
+namespace {
+using Results = SharedSubscriptionResults<std::string>;
+
+const w_string kKey("{\"fields\":[\"name\"]}@", W_STRING_BYTE);
+
+std::pair<Results::ResultPtr, ClockPosition> result(
+    const char* str,
+    ClockPosition position) {
+  return std::make_pair(std::make_shared<const std::string>(str), position);
+}
+} // namespace
+
+TEST(SharedSubscriptionResults, sharedAtSamePosition) {
+  Results results;
+  ClockPosition position(1, 10);
+  int computed = 0;
+  auto compute = [&] {
+    ++computed;
+    return result("files", position);
+  };
+
+  auto first = results.getOrCompute(kKey, position, compute);
+  auto second = results.getOrCompute(kKey, position, compute);
+  EXPECT_EQ(1, computed);
+  EXPECT_EQ("files", *first);
+  EXPECT_EQ(first, second);
+
+  // A different key is computed separately
+  w_string other("{\"fields\":[\"size\"]}@", W_STRING_BYTE);
+  results.getOrCompute(other, position, compute);
+  EXPECT_EQ(2, computed);
+
+  auto stats = results.stats();
+  EXPECT_EQ(2, stats.get("evaluations").asInt());
+  EXPECT_EQ(1, stats.get("shared").asInt());
+}
+
+TEST(SharedSubscriptionResults, recomputedAtNewPosition) {
+  Results results;
+  results.getOrCompute(
+      kKey, ClockPosition(1, 10), [] { return result("old", {1, 10}); });
+
+  auto res = results.getOrCompute(
+      kKey, ClockPosition(1, 11), [] { return result("new", {1, 11}); });
+  EXPECT_EQ("new", *res);
+
+  // The result is kept at the position that it was computed at, which may
+  // be later than the position that the caller saw
+  res = results.getOrCompute(
+      kKey, ClockPosition(1, 12), [] { return result("newer", {1, 13}); });
+  EXPECT_EQ("newer", *res);
+  res = results.getOrCompute(
+      kKey, ClockPosition(1, 13), [] { return result("unused", {1, 13}); });
+  EXPECT_EQ("newer", *res);
+}
+
+TEST(SharedSubscriptionResults, discardsStaleEntries) {
+  Results results;
+  results.getOrCompute(
+      kKey, ClockPosition(1, 10), [] { return result("a", {1, 10}); });
+  w_string other("other@", W_STRING_BYTE);
+  results.getOrCompute(
+      other, ClockPosition(1, 11), [] { return result("b", {1, 11}); });
+  EXPECT_EQ(1, results.stats().get("entries").asInt());
+}
+
+TEST(SharedSubscriptionResults, retriesAfterFailure) {
+  Results results;
+  ClockPosition position(1, 10);
+  EXPECT_THROW(
+      results.getOrCompute(
+          kKey,
+          position,
+          []() -> std::pair<Results::ResultPtr, ClockPosition> {
+            throw std::runtime_error("failed");
+          }),
+      std::runtime_error);
+  auto res = results.getOrCompute(
+      kKey, position, [&] { return result("ok", position); });
+  EXPECT_EQ("ok", *res);
+}
@@ -0,0 +1,63 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <folly/synchronization/Baton.h>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "SingleFlight.h"
+
+using namespace watchman;
+
+TEST(SingleFlight, concurrentCallsShareOneComputation) {
+  SingleFlight<std::string, int> flights;
+  std::atomic<int> calls{0};
+  folly::Baton<> started;
+  folly::Baton<> release;
+
+  int first = 0;
+  std::thread leader([&] {
+    first = flights.run("key", [&] {
+      ++calls;
+      started.post();
+      release.wait();
+      return 42;
+    });
+  });
+  started.wait();
+
+  int second = 0;
+  std::thread follower([&] {
+    second = flights.run("key", [&] {
+      ++calls;
+      return 7;
+    });
+  });
+  // A different key doesn't wait for the first
+  EXPECT_EQ(3, flights.run("other", [] { return 3; }));
+
+  // There is no way to observe the follower waiting on the leader, so
+  // give it a moment to get there
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  release.post();
+  leader.join();
+  follower.join();
+
+  EXPECT_EQ(42, first);
+  // The follower either shared the leader's result or, if it was slow to
+  // start, ran after the leader had finished
+  EXPECT_TRUE(second == 42 || second == 7);
+  EXPECT_EQ(second == 42 ? 1 : 2, calls.load());
+  EXPECT_EQ(0, flights.inFlight());
+}
+
+TEST(SingleFlight, exceptionsReachTheCaller) {
+  SingleFlight<std::string, int> flights;
+  EXPECT_THROW(
+      flights.run("key", []() -> int { throw std::runtime_error("boom"); }),
+      std::runtime_error);
+  // A failure isn't remembered
+  EXPECT_EQ(1, flights.run("key", [] { return 1; }));
+}
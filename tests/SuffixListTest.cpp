@@ -0,0 +1,121 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <memory>
+#include <vector>
+#include "SuffixList.h"
+
+using namespace watchman;
+
+namespace {
+struct Node {
+  int id;
+  Node** suffix_slot{nullptr};
+  Node** other_slot{nullptr};
+
+  explicit Node(int id) : id(id) {}
+};
+
+using OtherList = SuffixList<Node, &Node::other_slot>;
+
+template <typename List>
+std::vector<int> ids(const List& list) {
+  std::vector<int> result;
+  list.forEach([&](Node* node) {
+    result.push_back(node->id);
+    return true;
+  });
+  return result;
+}
+} // namespace
+
+TEST(SuffixList, addAndUnlink) {
+  SuffixList<Node> list;
+  Node a(1), b(2), c(3);
+
+  EXPECT_TRUE(list.empty());
+  list.add(&a);
+  list.add(&b);
+  list.add(&c);
+  EXPECT_EQ(ids(list), (std::vector<int>{1, 2, 3}));
+
+  SuffixList<Node>::unlink(&b);
+  EXPECT_EQ(b.suffix_slot, nullptr);
+  EXPECT_EQ(ids(list), (std::vector<int>{1, 3}));
+  // The hole remains until the list is compacted
+  EXPECT_EQ(list.size(), 3);
+
+  // Unlinking a node that isn't in a list is harmless
+  SuffixList<Node>::unlink(&b);
+
+  EXPECT_EQ(list.compact(), 1);
+  EXPECT_EQ(list.size(), 2);
+  EXPECT_EQ(ids(list), (std::vector<int>{1, 3}));
+
+  // The slots are still tracked after compaction
+  SuffixList<Node>::unlink(&a);
+  EXPECT_EQ(ids(list), std::vector<int>{3});
+  SuffixList<Node>::unlink(&c);
+  EXPECT_EQ(list.compact(), 2);
+  EXPECT_TRUE(list.empty());
+}
+
+TEST(SuffixList, stopsWhenAsked) {
+  SuffixList<Node> list;
+  Node a(1), b(2), c(3);
+  list.add(&a);
+  list.add(&b);
+  list.add(&c);
+
+  std::vector<int> seen;
+  list.forEach([&](Node* node) {
+    seen.push_back(node->id);
+    return node->id != 2;
+  });
+  EXPECT_EQ(seen, (std::vector<int>{1, 2}));
+}
+
+TEST(SuffixList, compactsAsItGrows) {
+  SuffixList<Node> list;
+  std::vector<std::unique_ptr<Node>> nodes;
+  for (int i = 0; i < 1000; ++i) {
+    nodes.push_back(std::make_unique<Node>(i));
+    list.add(nodes.back().get());
+    // Keep only every tenth node
+    if (i % 10 != 0) {
+      SuffixList<Node>::unlink(nodes.back().get());
+    }
+  }
+  // Holes were squeezed out along the way
+  EXPECT_LT(list.size(), 500);
+
+  auto live = ids(list);
+  EXPECT_EQ(live.size(), 100);
+  for (size_t i = 0; i < live.size(); ++i) {
+    EXPECT_EQ(live[i], int(i * 10));
+  }
+}
+
+TEST(SuffixList, nodeInListsOfTwoKinds) {
+  SuffixList<Node> suffixes;
+  OtherList others;
+  Node a(1), b(2);
+
+  suffixes.add(&a);
+  suffixes.add(&b);
+  others.add(&b);
+  others.add(&a);
+  EXPECT_EQ(ids(others), (std::vector<int>{2, 1}));
+
+  // Each kind of list tracks its own slot
+  OtherList::unlink(&b);
+  EXPECT_EQ(b.other_slot, nullptr);
+  EXPECT_NE(b.suffix_slot, nullptr);
+  EXPECT_EQ(ids(others), std::vector<int>{1});
+  EXPECT_EQ(ids(suffixes), (std::vector<int>{1, 2}));
+
+  SuffixList<Node>::unlink(&a);
+  EXPECT_EQ(ids(suffixes), std::vector<int>{2});
+  EXPECT_EQ(ids(others), std::vector<int>{1});
+}
@@ -0,0 +1,156 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <folly/synchronization/Baton.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ThreadPool.h"
+
+using namespace watchman;
+
+namespace {
+// Records the order in which tasks run
+class Recorder {
+ public:
+  folly::Func record(const char* name) {
+    return [this, name] {
+      std::lock_guard<std::mutex> lock(mutex_);
+      order_.emplace_back(name);
+    };
+  }
+
+  std::vector<std::string> order() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return order_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<std::string> order_;
+};
+} // namespace
+
+TEST(ThreadPool, runsInteractiveTasksFirst) {
+  ThreadPool pool;
+  pool.start(1, 1024);
+  Recorder recorder;
+
+  // Hold up the only worker until everything has been queued
+  folly::Baton<> started;
+  folly::Baton<> queued;
+  pool.add([&started, &queued] {
+    started.post();
+    queued.wait();
+  });
+  started.wait();
+  pool.add(ThreadPool::Priority::Background, nullptr, recorder.record("b1"));
+  pool.add(ThreadPool::Priority::Interactive, nullptr, recorder.record("i1"));
+  pool.addWithPriority(recorder.record("b2"), folly::Executor::LO_PRI);
+  pool.add(recorder.record("i2"));
+  queued.post();
+  pool.stop();
+
+  std::vector<std::string> expected{"i1", "i2", "b1", "b2"};
+  EXPECT_EQ(expected, recorder.order());
+}
+
+TEST(ThreadPool, takesTurnsBetweenKeys) {
+  ThreadPool pool;
+  pool.start(1, 1024);
+  Recorder recorder;
+  int rootA;
+  int rootB;
+
+  folly::Baton<> started;
+  folly::Baton<> queued;
+  pool.add([&started, &queued] {
+    started.post();
+    queued.wait();
+  });
+  started.wait();
+  auto interactive = ThreadPool::Priority::Interactive;
+  pool.add(interactive, &rootA, recorder.record("a1"));
+  pool.add(interactive, &rootA, recorder.record("a2"));
+  pool.add(interactive, &rootA, recorder.record("a3"));
+  pool.add(interactive, &rootB, recorder.record("b1"));
+  pool.add(interactive, &rootB, recorder.record("b2"));
+  queued.post();
+  pool.stop();
+
+  std::vector<std::string> expected{"a1", "b1", "a2", "b2", "a3"};
+  EXPECT_EQ(expected, recorder.order());
+}
+
+TEST(ThreadPool, idleWorkersStealTasksAddedByWorkers) {
+  ThreadPool pool;
+  pool.start(4, 1024);
+
+  // A single task fans out into tasks that block until all of them are
+  // running at once, which needs the other workers to steal them
+  std::atomic<int> running{0};
+  folly::Baton<> allRunning;
+  folly::Baton<> done;
+  std::atomic<int> finished{0};
+  pool.add([&] {
+    for (int i = 0; i < 3; ++i) {
+      pool.add([&] {
+        if (++running == 3) {
+          allRunning.post();
+        }
+        allRunning.wait();
+        if (++finished == 3) {
+          done.post();
+        }
+      });
+    }
+  });
+  EXPECT_TRUE(done.try_wait_for(std::chrono::seconds(10)));
+  pool.stop();
+}
+
+TEST(ThreadPool, waitsForRoomInsteadOfThrowing) {
+  ThreadPool pool;
+  pool.start(1, 2);
+
+  folly::Baton<> started;
+  folly::Baton<> release;
+  pool.add([&started, &release] {
+    started.post();
+    release.wait();
+  });
+  started.wait();
+  std::atomic<int> ran{0};
+  pool.add([&ran] { ++ran; });
+  pool.add([&ran] { ++ran; });
+
+  // The queue is full, so this has to wait for the worker to take a task
+  std::atomic<bool> added{false};
+  std::thread adder([&] {
+    pool.add([&ran] { ++ran; });
+    added = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(added);
+  release.post();
+  adder.join();
+  EXPECT_TRUE(added);
+  pool.stop();
+  EXPECT_EQ(3, ran);
+}
+
+TEST(ThreadPool, rejectsTasksWhenNotRunning) {
+  ThreadPool pool;
+  EXPECT_THROW(pool.add([] {}), std::runtime_error);
+
+  pool.start(2, 1024);
+  folly::Baton<> ran;
+  pool.add([&ran] { ran.post(); });
+  ran.wait();
+  pool.stop();
+
+  EXPECT_THROW(pool.add([] {}), std::runtime_error);
+}
@@ -0,0 +1,83 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "Tracing.h"
+#include <folly/portability/GTest.h>
+#include <thread>
+
+using namespace watchman;
+
+namespace {
+class TracingTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    Tracing::clear();
+    Tracing::setEnabled(true);
+  }
+  void TearDown() override {
+    Tracing::setEnabled(false);
+    Tracing::setBufferSize(16384);
+    Tracing::clear();
+  }
+
+  // Returns the complete events named name
+  static std::vector<json_ref> spansNamed(const char* name) {
+    std::vector<json_ref> spans;
+    auto events = Tracing::toTraceEvents();
+    for (size_t i = 0; i < json_array_size(events); ++i) {
+      auto event = events.at(i);
+      if (json_string_value(event.get("ph")) == std::string("X") &&
+          json_string_value(event.get("name")) == std::string(name)) {
+        spans.push_back(event);
+      }
+    }
+    return spans;
+  }
+};
+} // namespace
+
+TEST_F(TracingTest, recordsSpansOfEachThread) {
+  auto work = [] {
+    TraceSpan span("test_work", w_string("/some/root", W_STRING_UNICODE));
+  };
+  std::thread first(work);
+  std::thread second(work);
+  first.join();
+  second.join();
+
+  auto spans = spansNamed("test_work");
+  ASSERT_EQ(2, spans.size());
+  EXPECT_NE(spans[0].get("tid").asInt(), spans[1].get("tid").asInt());
+  for (auto& span : spans) {
+    EXPECT_GE(span.get("dur").asInt(), 0);
+    EXPECT_EQ(
+        std::string("/some/root"),
+        json_string_value(span.get("args").get("detail")));
+  }
+
+  Tracing::clear();
+  EXPECT_TRUE(spansNamed("test_work").empty());
+}
+
+TEST_F(TracingTest, nothingIsRecordedWhileDisabled) {
+  Tracing::setEnabled(false);
+  std::thread([] { TraceSpan span("test_disabled"); }).join();
+  EXPECT_TRUE(spansNamed("test_disabled").empty());
+}
+
+TEST_F(TracingTest, oldestSpansAreOverwritten) {
+  Tracing::setBufferSize(4);
+  std::thread([] {
+    for (int i = 0; i < 10; ++i) {
+      TraceSpan span("test_ring", w_string::build(i));
+    }
+  }).join();
+
+  auto spans = spansNamed("test_ring");
+  ASSERT_EQ(4, spans.size());
+  // The most recent spans are kept, oldest first
+  for (size_t i = 0; i < spans.size(); ++i) {
+    EXPECT_EQ(
+        std::to_string(6 + i),
+        json_string_value(spans[i].get("args").get("detail")));
+  }
+}
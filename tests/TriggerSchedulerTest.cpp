@@ -0,0 +1,63 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/portability/GTest.h>
+#include <string>
+#include <vector>
+#include "TriggerScheduler.h"
+
+using namespace watchman;
+
+TEST(TriggerScheduler, servesWaitersByPriorityThenOrder) {
+  TriggerScheduler scheduler(1);
+  int a, b, c, d;
+  std::vector<std::string> woken;
+  auto wake = [&woken](const char* name) {
+    return [&woken, name] { woken.emplace_back(name); };
+  };
+
+  EXPECT_TRUE(scheduler.tryAcquire(&a, 0, wake("a")));
+  EXPECT_FALSE(scheduler.tryAcquire(&b, 0, wake("b")));
+  EXPECT_FALSE(scheduler.tryAcquire(&c, 0, wake("c")));
+  EXPECT_FALSE(scheduler.tryAcquire(&d, 5, wake("d")));
+  EXPECT_TRUE(woken.empty());
+
+  // The trigger of the highest priority goes first, and the one that is
+  // woken has to be the one to take the slot
+  scheduler.release();
+  EXPECT_EQ(std::vector<std::string>{"d"}, woken);
+  EXPECT_FALSE(scheduler.tryAcquire(&b, 0, wake("b")));
+  EXPECT_TRUE(scheduler.tryAcquire(&d, 5, wake("d")));
+
+  // Then the triggers of equal priority in the order that they asked
+  scheduler.release();
+  EXPECT_TRUE(scheduler.tryAcquire(&b, 0, wake("b")));
+  scheduler.release();
+  EXPECT_TRUE(scheduler.tryAcquire(&c, 0, wake("c")));
+  scheduler.release();
+
+  auto stats = scheduler.stats();
+  EXPECT_EQ(0, json_integer_value(stats.get("running")));
+  EXPECT_EQ(0, json_integer_value(stats.get("waiting")));
+}
+
+TEST(TriggerScheduler, cancelledWaitersAreNotWoken) {
+  TriggerScheduler scheduler(1);
+  int a, b;
+  bool woken = false;
+
+  EXPECT_TRUE(scheduler.tryAcquire(&a, 0, [] {}));
+  EXPECT_FALSE(scheduler.tryAcquire(&b, 0, [&woken] { woken = true; }));
+  scheduler.cancel(&b);
+  scheduler.release();
+  EXPECT_FALSE(woken);
+}
+
+TEST(TriggerScheduler, zeroIsUnlimited) {
+  TriggerScheduler scheduler(0);
+  int keys[16];
+  for (auto& key : keys) {
+    EXPECT_TRUE(scheduler.tryAcquire(&key, 0, [] {}));
+  }
+  EXPECT_EQ(16, json_integer_value(scheduler.stats().get("running")));
+}
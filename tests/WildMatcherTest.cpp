@@ -0,0 +1,134 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "watchman_system.h"
+#include <folly/Conv.h>
+#include <folly/logging/xlog.h>
+#include <folly/portability/GTest.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "WildMatcher.h"
+#include "thirdparty/jansson/jansson.h"
+#include "thirdparty/wildmatch/wildmatch.h"
+
+using namespace watchman;
+
+#define WILDMATCH_TEST_JSON_FILE "tests/wildmatch_test.json"
+
+namespace {
+struct TestCase {
+  int flags;
+  std::string text;
+  std::string pattern;
+};
+
+std::vector<TestCase> loadTestCases() {
+  FILE* test_cases_file = fopen(WILDMATCH_TEST_JSON_FILE, "r");
+#ifdef WATCHMAN_TEST_SRC_DIR
+  if (!test_cases_file) {
+    test_cases_file =
+        fopen(WATCHMAN_TEST_SRC_DIR "/" WILDMATCH_TEST_JSON_FILE, "r");
+  }
+#endif
+  if (!test_cases_file) {
+    test_cases_file = fopen("watchman/" WILDMATCH_TEST_JSON_FILE, "r");
+  }
+  if (!test_cases_file) {
+    throw std::runtime_error(folly::to<std::string>(
+        "Couldn't open ", WILDMATCH_TEST_JSON_FILE, ": ", strerror(errno)));
+  }
+  json_error_t error;
+  auto test_cases = json_loadf(test_cases_file, 0, &error);
+  fclose(test_cases_file);
+  if (!test_cases) {
+    throw std::runtime_error(folly::to<std::string>(
+        "Error decoding JSON: ", error.text, " line=", error.line));
+  }
+
+  std::vector<TestCase> result;
+  for (size_t i = 0; i < json_array_size(test_cases); ++i) {
+    auto data = json_array_get(test_cases, i);
+    result.push_back(TestCase{int(data.at(1).asInt()),
+                              json_string_value(data.at(2)),
+                              json_string_value(data.at(3))});
+  }
+  return result;
+}
+
+bool wildmatchMatches(const TestCase& test, int flags) {
+  return wildmatch(
+             test.pattern.c_str(), test.text.c_str(), flags, nullptr) ==
+      WM_MATCH;
+}
+} // namespace
+
+TEST(WildMatcher, agreesWithWildmatch) {
+  // Exercise every flag combination that a match term can produce, not
+  // just the ones that the test cases were written for
+  for (const auto& test : loadTestCases()) {
+    for (int extra = 0; extra <= (WM_CASEFOLD | WM_PATHNAME | WM_PERIOD);
+         ++extra) {
+      auto flags = test.flags | extra;
+      WildMatcher matcher(test.pattern, flags);
+      EXPECT_EQ(wildmatchMatches(test, flags), matcher.match(test.text))
+          << "Pattern [" << test.pattern << "] matching text [" << test.text
+          << "] with flags " << flags;
+    }
+  }
+}
+
+TEST(WildMatcher, specializedShapes) {
+  WildMatcher suffix("*.h", WM_PATHNAME | WM_PERIOD);
+  EXPECT_TRUE(suffix.match("foo.h"));
+  EXPECT_FALSE(suffix.match("foo.c"));
+  EXPECT_FALSE(suffix.match(".foo.h"));
+  EXPECT_FALSE(suffix.match("dir/foo.h"));
+
+  WildMatcher dir("src/**", WM_PATHNAME | WM_PERIOD);
+  EXPECT_TRUE(dir.match("src/foo.h"));
+  EXPECT_TRUE(dir.match("src/a/.b"));
+  EXPECT_FALSE(dir.match("src"));
+  EXPECT_FALSE(dir.match("src/.git"));
+  EXPECT_FALSE(dir.match("srcs/foo.h"));
+
+  WildMatcher folded("SRC/*.H", WM_PATHNAME | WM_CASEFOLD);
+  EXPECT_TRUE(folded.match("src/foo.h"));
+  EXPECT_FALSE(folded.match("src/foo.c"));
+}
+
+// Compares the time taken to run the test cases through wildmatch and
+// through WildMatcher.  The patterns are compiled outside the timed loop,
+// as they are when a query is parsed.
+TEST(WildMatcher, benchmark) {
+  auto tests = loadTestCases();
+  std::vector<WildMatcher> matchers;
+  for (const auto& test : tests) {
+    matchers.emplace_back(test.pattern, test.flags);
+  }
+  const int iterations = 2000;
+  size_t expected = 0;
+  size_t matched = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    for (const auto& test : tests) {
+      expected += wildmatchMatches(test, test.flags);
+    }
+  }
+  auto wildmatchTime = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    for (size_t j = 0; j < tests.size(); ++j) {
+      matched += matchers[j].match(tests[j].text);
+    }
+  }
+  auto matcherTime = std::chrono::steady_clock::now() - start;
+
+  EXPECT_EQ(expected, matched);
+  XLOG(ERR) << "wildmatch took "
+            << std::chrono::duration<double>(wildmatchTime).count()
+            << "s and WildMatcher took "
+            << std::chrono::duration<double>(matcherTime).count() << "s for "
+            << iterations * tests.size() << " matches";
+}
@@ -4,12 +4,16 @@
  * Copyright 2012 Armon Dadgar. See thirdparty/libart/LICENSE. */
 #include "watchman_system.h"
 #include <fcntl.h>
+#include <folly/Conv.h>
 #include <folly/logging/xlog.h>
 #include <folly/portability/GTest.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
 
 #include "thirdparty/libart/src/art.h"
 
@@ -405,3 +409,83 @@ TEST(Art, insert_search_uuid) {
   XLOG(ERR) << "maximum is " << l->key;
   EXPECT_TRUE(l && l->key == "ffffcb46-a92e-4822-82af-a7190f9c1ec5");
 }
+
+TEST(Art, iter_high_bytes) {
+  // Keys that differ in bytes above 0x7f must still be visited in
+  // unsigned order, including once a node has grown to a Node16
+  art_tree<int> t;
+  std::vector<std::string> keys;
+  for (int c = 0x70; c < 0x90; c += 2) {
+    keys.push_back(std::string("dir/") + char(c));
+  }
+  for (auto it = keys.rbegin(); it != keys.rend(); ++it) {
+    t.insert(*it, 0);
+  }
+
+  std::vector<std::string> visited;
+  t.iter([&](const std::string& key, int&) {
+    visited.push_back(key);
+    return 0;
+  });
+  EXPECT_EQ(keys, visited);
+  EXPECT_EQ(keys.front(), t.minimum()->key);
+  EXPECT_EQ(keys.back(), t.maximum()->key);
+  for (auto& key : keys) {
+    EXPECT_TRUE(t.search(key)) << key;
+  }
+}
+
+namespace {
+std::vector<std::string> benchmarkPaths() {
+  // Roughly the shape of the paths that a storm of events in a large
+  // tree would queue up in a pending collection
+  std::vector<std::string> paths;
+  for (int dir = 0; dir < 200; ++dir) {
+    for (int file = 0; file < 100; ++file) {
+      paths.push_back(folly::to<std::string>(
+          "/data/users/someone/repo/src/module", dir, "/file", file, ".cpp"));
+    }
+  }
+  return paths;
+}
+
+template <typename Fn>
+double timeIt(Fn&& fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+} // namespace
+
+TEST(Art, benchmark_churn) {
+  auto paths = benchmarkPaths();
+  const int rounds = 20;
+  art_tree<int> t;
+  size_t found = 0;
+
+  auto insertTime = 0.0, searchTime = 0.0, eraseTime = 0.0;
+  for (int round = 0; round < rounds; ++round) {
+    insertTime += timeIt([&] {
+      for (auto& path : paths) {
+        t.insert(path, round);
+      }
+    });
+    searchTime += timeIt([&] {
+      for (auto& path : paths) {
+        found += t.search(path) != nullptr;
+      }
+    });
+    eraseTime += timeIt([&] {
+      for (auto& path : paths) {
+        t.erase(path);
+      }
+    });
+  }
+
+  EXPECT_EQ(paths.size() * rounds, found);
+  EXPECT_EQ(0, t.size());
+  auto ops = double(paths.size() * rounds);
+  XLOG(ERR) << "insert: " << ops / insertTime << "/s, search: "
+            << ops / searchTime << "/s, erase: " << ops / eraseTime << "/s";
+}
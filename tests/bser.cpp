@@ -3,8 +3,11 @@
 
 #include "watchman.h"
 #include <folly/ScopeGuard.h>
+#include <folly/compression/Compression.h>
 #include <folly/logging/xlog.h>
 #include <folly/portability/GTest.h>
+#include "PduCompression.h"
+#include "tests/BserCorpus.h"
 #include "thirdparty/jansson/jansson_private.h"
 
 #define UTF8_PILE_OF_POO "\xf0\x9f\x92\xa9"
@@ -290,5 +293,225 @@ TEST(Bser, bser_tests) {
   check_bser_typed_strings();
 }
 
+// A PDU that spans several buffer chunks and references large strings must
+// encode the same as the header followed by the separately dumped body
+TEST(Bser, large_pdu) {
+  auto arr = json_array();
+  for (int i = 0; i < 200; ++i) {
+    json_array_append_new(arr, json_integer(i * 1000));
+    json_array_append_new(
+        arr,
+        typed_string_to_json(
+            std::string(1000 + i * 7, 'a' + i % 26).c_str(), W_STRING_BYTE));
+  }
+  auto json = json_object(
+      {{"files", arr},
+       {"version", typed_string_to_json("1", W_STRING_UNICODE)}});
+
+  for (uint32_t version = 1; version <= 2; ++version) {
+    auto body = bdumps(version, 0, json);
+    ASSERT_NE(body, nullptr);
+    int32_t size = int32_t(body->size());
+    ASSERT_GT(size, 65536);
+
+    std::string expected = version == 1 ? S("\x00\x01") : S("\x00\x02");
+    if (version == 2) {
+      expected.append(4, '\0');
+    }
+    expected.push_back(0x05);
+    expected.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    expected.append(*body);
+
+    auto pdu = bdumps_pdu(version, 0, json);
+    ASSERT_NE(pdu, nullptr);
+    EXPECT_EQ(*pdu, expected);
+
+    std::string encoded;
+    EXPECT_TRUE(watchman_json_buffer::pduEncodeToString(
+        version == 1 ? is_bser : is_bser_v2, 0, json, encoded));
+    EXPECT_EQ(encoded, expected);
+  }
+}
+
+TEST(Bser, v3_string_dictionary) {
+  auto names = json_array(
+      {typed_string_to_json("src/lib/a.c", W_STRING_UNICODE),
+       typed_string_to_json("src/lib/b.c", W_STRING_UNICODE),
+       typed_string_to_json("src/lib/a.c", W_STRING_UNICODE),
+       typed_string_to_json("x", W_STRING_UNICODE),
+       typed_string_to_json("src/lib/\xd0\xff", W_STRING_BYTE)});
+  auto json = json_object({{"files", names}});
+
+  std::string pdu;
+  ASSERT_TRUE(
+      watchman_json_buffer::pduEncodeToString(is_bser_v3, 0, json, pdu));
+
+  // The body follows the magic, the capabilities and the length
+  auto body = pdu.substr(2 + 4 + 2);
+  EXPECT_EQ(
+      body,
+      S("\x01\x03\x01"
+        "\x02\x03\x05"
+        "files"
+        "\x00\x03\x05"
+        "\x0e\x0d\x03\x0b"
+        "src/lib/a.c"
+        "\x10\x03\x00\x03\x08\x0d\x03\x03"
+        "b.c"
+        "\x0f\x03\x00"
+        "\x0d\x03\x01"
+        "x"
+        "\x10\x03\x01\x03\x08\x02\x03\x02"
+        "\xd0\xff"));
+
+  std::vector<json_ref> strings;
+  json_int_t needed;
+  json_error_t jerr;
+  auto decoded =
+      bunser(body.data(), body.data() + body.size(), &needed, &jerr, &strings);
+  ASSERT_TRUE(decoded) << jerr.text;
+  EXPECT_TRUE(json_equal(json, decoded));
+  EXPECT_EQ(strings.size(), 3u);
+  EXPECT_EQ(
+      json_to_w_string(decoded.get("files").at(4)).type(), W_STRING_BYTE);
+
+  // The dictionary encodings are only understood in v3 PDUs
+  EXPECT_FALSE(bunser(body.data(), body.data() + body.size(), &needed, &jerr));
+}
+
+TEST(Bser, compressed_pdu) {
+  auto arr = json_array();
+  for (int i = 0; i < 100000; ++i) {
+    json_array_append_new(
+        arr,
+        typed_string_to_json(
+            folly::to<std::string>("src/lib/file", i, ".c").c_str(),
+            W_STRING_BYTE));
+  }
+  auto json = json_object({{"files", arr}});
+
+  for (auto capabilities : {BSER_CAP_COMPRESS_ZSTD, BSER_CAP_COMPRESS_LZ4}) {
+    auto type = capabilities == BSER_CAP_COMPRESS_ZSTD
+        ? folly::io::CodecType::ZSTD
+        : folly::io::CodecType::LZ4_FRAME;
+    if (!folly::io::hasCodec(type)) {
+      continue;
+    }
+
+    std::string plain;
+    ASSERT_TRUE(
+        watchman_json_buffer::pduEncodeToString(is_bser_v2, 0, json, plain));
+    std::string pdu;
+    ASSERT_TRUE(watchman_json_buffer::pduEncodeToString(
+        is_bser_v2, capabilities, json, pdu));
+    ASSERT_EQ(pdu.substr(0, 2), S(BSER_COMPRESSED_MAGIC));
+    EXPECT_LT(pdu.size(), plain.size() / 4);
+
+    // Skip the magic, capabilities and length to reach the body
+    json_int_t needed;
+    json_int_t len;
+    ASSERT_TRUE(bunser_int(pdu.data() + 6, pdu.size() - 6, &needed, &len));
+    auto body = 6 + needed;
+    EXPECT_EQ(json_int_t(pdu.size()) - body, len);
+
+    auto inner = watchman::decompressPdu(pdu.data() + body, len);
+    EXPECT_EQ(inner.substr(0, 2), S(BSER_V2_MAGIC));
+    EXPECT_EQ(inner.size(), plain.size());
+    json_error_t jerr;
+    auto decoded = bunser(
+        inner.data() + 11, inner.data() + inner.size(), &needed, &jerr);
+    ASSERT_TRUE(decoded) << jerr.text;
+    EXPECT_TRUE(json_equal(json, decoded));
+  }
+
+  // Small PDUs, and clients that didn't ask, get uncompressed PDUs
+  std::string pdu;
+  ASSERT_TRUE(watchman_json_buffer::pduEncodeToString(
+      is_bser_v2,
+      BSER_CAP_COMPRESS_ZSTD,
+      json_object({{"version", typed_string_to_json("1", W_STRING_UNICODE)}}),
+      pdu));
+  EXPECT_EQ(pdu.substr(0, 2), S(BSER_V2_MAGIC));
+  pdu.clear();
+  ASSERT_TRUE(
+      watchman_json_buffer::pduEncodeToString(is_bser_v2, 0, json, pdu));
+  EXPECT_EQ(pdu.substr(0, 2), S(BSER_V2_MAGIC));
+}
+
+TEST(Bser, decoded_keys_are_shared) {
+  std::string longKey(200, 'k');
+  auto rows = json_array();
+  for (int i = 0; i < 3; ++i) {
+    json_array_append_new(
+        rows,
+        json_object(
+            {{"name", typed_string_to_json("a", W_STRING_BYTE)},
+             {longKey.c_str(), json_integer(i)}}));
+  }
+  auto templ = json_array({typed_string_to_json("name", W_STRING_BYTE),
+                           typed_string_to_json(longKey.c_str(), W_STRING_BYTE)});
+
+  for (bool useTemplate : {false, true}) {
+    auto json = json_copy(rows);
+    if (useTemplate) {
+      json_array_set_template(json, templ);
+    }
+    auto encoded = bdumps(2, 0, json);
+    ASSERT_NE(encoded, nullptr);
+
+    json_int_t needed;
+    json_error_t jerr;
+    auto decoded = bunser(
+        encoded->data(), encoded->data() + encoded->size(), &needed, &jerr);
+    ASSERT_TRUE(decoded) << jerr.text;
+    EXPECT_TRUE(json_equal(json, decoded));
+
+    // Each key is copied out of the PDU once, however many objects use it
+    auto keyOf = [&](size_t i) {
+      for (auto& it : decoded.at(i).object()) {
+        if (it.first.size() == longKey.size()) {
+          return it.first.data();
+        }
+      }
+      return static_cast<const char*>(nullptr);
+    };
+    ASSERT_NE(keyOf(0), nullptr);
+    EXPECT_EQ(keyOf(0), keyOf(1));
+    EXPECT_EQ(keyOf(0), keyOf(2));
+  }
+}
+
+// Every PDU of the corpus that is shared with the other implementations
+// decodes to its value, and encoding the decoded value again produces the
+// canonical encoding.  Objects are unordered here, so the encoding is held
+// to the canonical size, and to decoding to the same value, rather than
+// to the same bytes.
+TEST(Bser, corpus_conformance) {
+  using namespace watchman::bser_corpus;
+  auto dir = defaultDir();
+  auto manifest = loadManifest(dir);
+  ASSERT_GT(json_array_size(manifest), 0);
+
+  for (auto& entry : manifest.array()) {
+    auto expected = loadValue(dir, entry);
+    for (auto& name : entry.get("pdus").array()) {
+      SCOPED_TRACE(json_string_value(name));
+      auto data = readFile(dir, json_string_value(name));
+      auto pdu = splitPdu(data);
+      auto decoded = decodeBody(pdu.body);
+      EXPECT_TRUE(json_equal(expected, decoded));
+
+      // Templates are only encoded for arrays that are given one
+      if (strstr(json_string_value(name), ".tmpl.")) {
+        continue;
+      }
+      auto encoded = bdumps(pdu.version, 0, decoded);
+      ASSERT_NE(encoded, nullptr);
+      EXPECT_EQ(encoded->size(), pdu.body.size());
+      EXPECT_TRUE(json_equal(expected, decodeBody(*encoded)));
+    }
+  }
+}
+
 /* vim:ts=2:sw=2:et:
  */
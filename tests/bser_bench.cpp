@@ -0,0 +1,88 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+/* Measures the throughput of the BSER codec on the PDUs of the corpus that
+ * is shared by all of the BSER implementations:
+ *
+ *   bser_bench [min seconds per measurement] [substring of pdu] [corpus dir]
+ *
+ * For each PDU this reports how quickly it is decoded, and how quickly the
+ * decoded value is encoded again, in MB of BSER per second, so that the
+ * numbers can be compared with those of the drivers for the other
+ * languages.  Encoding goes through w_bser_encode_pdu, as responses do. */
+
+#include "watchman.h"
+#include <chrono>
+#include "PduBuffer.h"
+#include "tests/BserCorpus.h"
+
+using namespace watchman;
+
+// Returns the mean time in seconds of a call to func, running it for at
+// least minTime seconds
+template <typename Func>
+static double measure(Func&& func, double minTime) {
+  func();
+  size_t iterations = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (true) {
+    func();
+    ++iterations;
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (elapsed.count() >= minTime && iterations >= 3) {
+      return elapsed.count() / iterations;
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  double minTime = argc > 1 ? atof(argv[1]) : 0.5;
+  std::string only = argc > 2 ? argv[2] : "";
+  std::string dir = argc > 3 ? argv[3] : bser_corpus::defaultDir();
+
+  try {
+    auto manifest = bser_corpus::loadManifest(dir);
+    printf(
+        "%-8s %-36s %9s %12s %12s\n",
+        "impl",
+        "pdu",
+        "bytes",
+        "decode MB/s",
+        "encode MB/s");
+    for (auto& entry : manifest.array()) {
+      for (auto& name : entry.get("pdus").array()) {
+        std::string pduName = json_string_value(name);
+        if (pduName.find(only) == std::string::npos) {
+          continue;
+        }
+        auto data = bser_corpus::readFile(dir, pduName);
+        auto pdu = bser_corpus::splitPdu(data);
+        auto value = bser_corpus::decodeBody(pdu.body);
+
+        auto decode = measure(
+            [&] { bser_corpus::decodeBody(pdu.body); }, minTime);
+        auto encode = measure(
+            [&] {
+              PduBuffer buffer;
+              if (w_bser_encode_pdu(pdu.version, 0, value, buffer)) {
+                throw std::runtime_error("failed to encode " + pduName);
+              }
+            },
+            minTime);
+        double mb = data.size() / 1e6;
+        printf(
+            "%-8s %-36s %9zu %12.1f %12.1f\n",
+            "cpp",
+            pduName.c_str(),
+            data.size(),
+            mb / decode,
+            mb / encode);
+      }
+    }
+  } catch (const std::exception& exc) {
+    fprintf(stderr, "bser_bench: %s\n", exc.what());
+    return 1;
+  }
+  return 0;
+}
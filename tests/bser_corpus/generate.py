@@ -0,0 +1,281 @@
+#!/usr/bin/env python3
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+"""Regenerates the BSER conformance corpus in this directory.
+
+Each entry is written as:
+
+  NAME.json           the value, with object keys in encoding order
+  NAME.v1.bser        the canonical BSER v1 encoding of the value
+  NAME.v2.bser        the canonical BSER v2 encoding of the value
+  NAME.v1.tmpl.bser   the value with its arrays of objects encoded as
+  NAME.v2.tmpl.bser   templates, for the entries that have any
+
+See README.md for what canonical means and how the corpus is used.
+The encoder here is deliberately independent of the implementations
+that the corpus checks.  The data is pseudo random with a fixed seed, so
+running this again produces identical files.
+"""
+
+import json
+import os
+import struct
+
+
+BSER_ARRAY = 0x00
+BSER_OBJECT = 0x01
+BSER_BYTESTRING = 0x02
+BSER_INT8 = 0x03
+BSER_INT16 = 0x04
+BSER_INT32 = 0x05
+BSER_INT64 = 0x06
+BSER_REAL = 0x07
+BSER_TRUE = 0x08
+BSER_FALSE = 0x09
+BSER_NULL = 0x0A
+BSER_TEMPLATE = 0x0B
+BSER_UTF8STRING = 0x0D
+
+WATCHMAN_VERSION = "2020.08.17.00"
+ROOT = "/home/user/repo"
+
+
+class Lcg(object):
+    """A tiny deterministic generator, so that the corpus does not depend
+    on the random module of any particular Python release"""
+
+    def __init__(self, seed):
+        self.state = seed
+
+    def next(self, bound):
+        self.state = (self.state * 6364136223846793005 + 1442695040888963407) % (
+            1 << 64
+        )
+        return (self.state >> 33) % bound
+
+
+def encode_int(out, value):
+    for (tag, fmt, lo, hi) in (
+        (BSER_INT8, "<b", -0x80, 0x7F),
+        (BSER_INT16, "<h", -0x8000, 0x7FFF),
+        (BSER_INT32, "<i", -0x80000000, 0x7FFFFFFF),
+        (BSER_INT64, "<q", -0x8000000000000000, 0x7FFFFFFFFFFFFFFF),
+    ):
+        if lo <= value <= hi:
+            out.append(tag)
+            out.extend(struct.pack(fmt, value))
+            return
+    raise ValueError("cannot represent %d" % value)
+
+
+def encode_string(out, value, tag):
+    data = value.encode("utf-8")
+    out.append(tag)
+    encode_int(out, len(data))
+    out.extend(data)
+
+
+def is_template_array(value):
+    if not value or not all(isinstance(v, dict) and v for v in value):
+        return False
+    keys = list(value[0].keys())
+    return all(list(v.keys()) == keys for v in value)
+
+
+def encode_value(out, value, version, templates):
+    # Values are utf-8 strings in v2, but object keys are always byte
+    # strings, as the server encodes them
+    string_tag = BSER_BYTESTRING if version == 1 else BSER_UTF8STRING
+    if value is None:
+        out.append(BSER_NULL)
+    elif value is True:
+        out.append(BSER_TRUE)
+    elif value is False:
+        out.append(BSER_FALSE)
+    elif isinstance(value, int):
+        encode_int(out, value)
+    elif isinstance(value, float):
+        out.append(BSER_REAL)
+        out.extend(struct.pack("<d", value))
+    elif isinstance(value, str):
+        encode_string(out, value, string_tag)
+    elif isinstance(value, list):
+        if templates and is_template_array(value):
+            keys = list(value[0].keys())
+            out.append(BSER_TEMPLATE)
+            out.append(BSER_ARRAY)
+            encode_int(out, len(keys))
+            for key in keys:
+                encode_string(out, key, BSER_BYTESTRING)
+            encode_int(out, len(value))
+            for row in value:
+                for key in keys:
+                    encode_value(out, row[key], version, templates)
+        else:
+            out.append(BSER_ARRAY)
+            encode_int(out, len(value))
+            for item in value:
+                encode_value(out, item, version, templates)
+    elif isinstance(value, dict):
+        out.append(BSER_OBJECT)
+        encode_int(out, len(value))
+        for key, item in value.items():
+            encode_string(out, key, BSER_BYTESTRING)
+            encode_value(out, item, version, templates)
+    else:
+        raise TypeError("cannot encode %r" % (value,))
+
+
+def encode_pdu(value, version, templates=False):
+    body = bytearray()
+    encode_value(body, value, version, templates)
+    if version == 1:
+        header = b"\x00\x01" + struct.pack("<bi", BSER_INT32, len(body))
+    else:
+        header = b"\x00\x02" + struct.pack("<ibi", 0, BSER_INT32, len(body))
+    return header + bytes(body)
+
+
+def file_names(rng, count):
+    dirs = ["fbcode", "xplat", "www", "configerator", "build"]
+    exts = [".cpp", ".h", ".py", ".js", ".rs", ".java", ".json", ".md"]
+    odd = [u"café", u"résumé", u"\U0001f4a9", u"日本"]
+    names = []
+    for i in range(count):
+        parts = [dirs[rng.next(len(dirs))]]
+        for _ in range(1 + rng.next(4)):
+            parts.append("dir%d" % rng.next(50))
+        stem = "file_%d" % i
+        if rng.next(40) == 0:
+            stem = "%s_%s" % (odd[rng.next(len(odd))], stem)
+        parts.append(stem + exts[rng.next(len(exts))])
+        names.append("/".join(parts))
+    return names
+
+
+def query_response(rng, count):
+    files = []
+    for name in file_names(rng, count):
+        is_dir = rng.next(10) == 0
+        files.append(
+            {
+                "name": name,
+                "exists": rng.next(20) != 0,
+                "size": rng.next(1 << 20),
+                "mode": 16877 if is_dir else 33188,
+                "mtime_ms": 1597000000000 + rng.next(1 << 30),
+                "new": rng.next(8) == 0,
+                "type": "d" if is_dir else "f",
+            }
+        )
+    return {
+        "version": WATCHMAN_VERSION,
+        "clock": "c:1597650000:12345:1:%d" % (100 + count),
+        "is_fresh_instance": False,
+        "files": files,
+    }
+
+
+def subscription_payload(rng, count):
+    return {
+        "version": WATCHMAN_VERSION,
+        "unilateral": True,
+        "subscription": "sub-files",
+        "root": ROOT,
+        "clock": "c:1597650000:12345:1:%d" % (200 + count),
+        "since": "c:1597650000:12345:1:200",
+        "is_fresh_instance": False,
+        "files": file_names(rng, count),
+    }
+
+
+def subscription_objects(rng, count):
+    payload = subscription_payload(rng, 0)
+    files = query_response(rng, count)["files"]
+    for f in files:
+        del f["mtime_ms"]
+        f["content.sha1hex"] = "%040x" % rng.next(1 << 62)
+    payload["subscription"] = "sub-objects"
+    payload["files"] = files
+    return payload
+
+
+def state_payload():
+    return {
+        "version": WATCHMAN_VERSION,
+        "unilateral": True,
+        "subscription": "sub-files",
+        "root": ROOT,
+        "clock": "c:1597650000:12345:1:300",
+        "state-enter": "hg.update",
+        "metadata": {
+            "rev": "0123456789abcdef0123456789abcdef01234567",
+            "distance": 3,
+            "partial": False,
+            "status": "ok",
+        },
+    }
+
+
+def scalars():
+    return {
+        "int8": [0, 1, -1, 127, -128],
+        "int16": [128, -129, 32767, -32768],
+        "int32": [32768, -32769, 2147483647, -2147483648],
+        # Kept within what a double can hold exactly, which is the most that
+        # the JavaScript decoder returns as a number
+        "int64": [2147483648, -2147483649, 1099511627776, 9007199254740991],
+        # None of these are integral, so that JavaScript keeps them real
+        "real": [0.5, -1.25, 3.141592653589793, 1.5e-100, 123456.789],
+        "bool": [True, False],
+        "null": None,
+        "string": ["", "a", "x" * 200, "y" * 40000, u"café", u"\U0001f4a9"],
+        "empty_array": [],
+        "empty_object": {},
+        "nested": {"a": {"b": [[], [{}], [[1, [2, [3]]]]]}},
+    }
+
+
+ENTRIES = [
+    ("scalars", lambda: scalars()),
+    ("query_response_small", lambda: query_response(Lcg(1), 100)),
+    ("query_response_large", lambda: query_response(Lcg(2), 2000)),
+    ("subscription_files", lambda: subscription_payload(Lcg(3), 500)),
+    ("subscription_objects", lambda: subscription_objects(Lcg(4), 500)),
+    ("subscription_state", lambda: state_payload()),
+]
+
+
+def has_templates(value):
+    if isinstance(value, list):
+        return is_template_array(value) or any(has_templates(v) for v in value)
+    if isinstance(value, dict):
+        return any(has_templates(v) for v in value.values())
+    return False
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    manifest = []
+    for (name, make) in ENTRIES:
+        value = make()
+        with open(os.path.join(here, name + ".json"), "w") as f:
+            json.dump(value, f, ensure_ascii=False, indent=1)
+            f.write("\n")
+        variants = [("v1", 1, False), ("v2", 2, False)]
+        if has_templates(value):
+            variants += [("v1.tmpl", 1, True), ("v2.tmpl", 2, True)]
+        pdus = []
+        for (suffix, version, templates) in variants:
+            pdu = name + "." + suffix + ".bser"
+            with open(os.path.join(here, pdu), "wb") as f:
+                f.write(encode_pdu(value, version, templates))
+            pdus.append(pdu)
+        manifest.append({"name": name, "pdus": pdus})
+    with open(os.path.join(here, "manifest.json"), "w") as f:
+        json.dump(manifest, f, indent=1)
+        f.write("\n")
+
+
+if __name__ == "__main__":
+    main()
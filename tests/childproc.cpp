@@ -96,3 +96,63 @@ TEST(ChildProcess, inputThreaded) {
 TEST(ChildProcess, inputNotThreaded) {
   test_pipe_input(false);
 }
+
+void test_streaming_output(bool threaded) {
+#ifndef _WIN32
+  Options opts;
+  opts.pipeStdout();
+  ChildProcess seq({"seq", "1", "20000"}, std::move(opts));
+
+  std::string streamed;
+  size_t chunks = 0;
+  auto readable = [&](w_string_piece chunk) {
+    streamed.append(chunk.data(), chunk.size());
+    ++chunks;
+  };
+  auto writable = [](watchman::FileDescriptor&) { return true; };
+  auto outputs = threaded ? seq.threadedCommunicate(writable, readable)
+                          : seq.pollingCommunicate(writable, readable);
+  seq.wait();
+
+  EXPECT_FALSE(outputs.first);
+  EXPECT_GT(chunks, 1);
+  std::vector<std::string> lines;
+  w_string_piece(streamed).split(lines, '\n');
+  ASSERT_EQ(20000, lines.size());
+  EXPECT_EQ("1", lines.front());
+  EXPECT_EQ("20000", lines.back());
+#else
+  (void)threaded;
+#endif
+}
+
+TEST(ChildProcess, streamingOutputThreaded) {
+  test_streaming_output(true);
+}
+
+TEST(ChildProcess, streamingOutputNotThreaded) {
+  test_streaming_output(false);
+}
+
+TEST(ChildProcess, spawnHelper) {
+#ifndef _WIN32
+  watchman::SpawnHelper::start();
+  ASSERT_NE(nullptr, watchman::SpawnHelper::get());
+
+  Options opts;
+  opts.pipeStdout();
+  opts.chdir("/");
+  opts.useSpawnHelper();
+  ChildProcess pwd({"pwd"}, std::move(opts));
+  auto outputs = pwd.communicate();
+  EXPECT_EQ(0, pwd.wait());
+  EXPECT_EQ(w_string("/\n"), outputs.first);
+
+  Options failOpts;
+  failOpts.useSpawnHelper();
+  ChildProcess fail({"false"}, std::move(failOpts));
+  auto status = fail.wait();
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(1, WEXITSTATUS(status));
+#endif
+}
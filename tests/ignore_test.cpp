@@ -99,6 +99,91 @@ TEST(Ignore, correctness) {
   run_correctness_test(&state, tests, sizeof(tests) / sizeof(tests[0]));
 }
 
+TEST(Ignore, ignoredBelow) {
+  struct watchman_ignore state;
+  init_state(&state);
+
+  EXPECT_TRUE(state.isIgnoredBelow(w_string("build")));
+  EXPECT_TRUE(state.isIgnoredBelow(w_string("build/lower")));
+  EXPECT_TRUE(state.isIgnoredBelow(w_string(".hg/store")));
+  EXPECT_TRUE(state.isIgnoredBelow(w_string(".hg/store/data")));
+  // The entries of a vcs dir itself, such as cookie files, are seen
+  EXPECT_FALSE(state.isIgnoredBelow(w_string(".hg")));
+  EXPECT_FALSE(state.isIgnoredBelow(w_string("some")));
+  EXPECT_FALSE(state.isIgnoredBelow(w_string("builda")));
+}
+
+TEST(Ignore, globs) {
+  struct watchman_ignore state;
+  w_string root("/root", W_STRING_UNICODE);
+  EXPECT_TRUE(state.addGlob(root, "node_modules"));
+  EXPECT_TRUE(state.addGlob(root, "**/*.egg-info/"));
+  EXPECT_TRUE(state.addGlob(root, "/out/gen"));
+  EXPECT_TRUE(state.addGlob(root, "docs/**/_build"));
+  EXPECT_FALSE(state.addGlob(root, "!node_modules/keep"));
+  EXPECT_FALSE(state.addGlob(root, "# a comment"));
+
+  static const struct test_case tests[] = {
+      {"/root/node_modules", true},
+      {"/root/a/b/node_modules", true},
+      {"/root/a/node_modules/b/c", true},
+      {"/root/node_modules_extra", false},
+      {"/root/a/node_module", false},
+      {"/root/pkg/foo.egg-info/PKG-INFO", true},
+      {"/root/pkg/foo.egg", false},
+      {"/root/out/gen", true},
+      {"/root/out/gen/x", true},
+      {"/root/out/generated", false},
+      {"/root/a/out/gen", false},
+      {"/root/docs/_build", true},
+      {"/root/docs/a/b/_build/x", true},
+      {"/root/src/_build", false},
+      {"/root", false},
+      {"/other/node_modules", false},
+  };
+
+  run_correctness_test(&state, tests, sizeof(tests) / sizeof(tests[0]));
+
+  // The crawler tests each dir on the way down, so only the last component
+  // of the path is matched here
+  EXPECT_TRUE(state.isIgnoreDir(w_string("/root/a/node_modules")));
+  EXPECT_TRUE(state.isIgnoreDir(w_string("/root/out/gen")));
+  EXPECT_FALSE(state.isIgnoreDir(w_string("/root/node_modules/a")));
+}
+
+TEST(Ignore, includes) {
+  struct watchman_ignore state;
+  w_string root("/root", W_STRING_UNICODE);
+  state.addInclude(root, w_string("/root/projects/app", W_STRING_UNICODE));
+  state.addInclude(root, w_string("/root/lib", W_STRING_UNICODE));
+
+  static const struct test_case tests[] = {
+      {"/root", false},
+      {"/root/README", false},
+      {"/root/projects", false},
+      {"/root/projects/README", false},
+      {"/root/projects/app", false},
+      {"/root/projects/app/src/main.c", false},
+      {"/root/projects/apple/x", true},
+      {"/root/projects/other/x", true},
+      {"/root/lib/a/b/c", false},
+      {"/root/other/x", true},
+      {"/other/x", false},
+  };
+
+  run_correctness_test(&state, tests, sizeof(tests) / sizeof(tests[0]));
+
+  // Once stat'd, a dir directly in an ancestor of an included dir is only
+  // watched if it is included or leads to an included dir
+  EXPECT_TRUE(state.isOutsideIncludes(w_string("/root/other"), true));
+  EXPECT_FALSE(state.isOutsideIncludes(w_string("/root/other"), false));
+  EXPECT_TRUE(state.isOutsideIncludes(w_string("/root/projects/docs"), true));
+  EXPECT_FALSE(state.isOutsideIncludes(w_string("/root/projects"), true));
+  EXPECT_FALSE(state.isOutsideIncludes(w_string("/root/lib/a"), true));
+  EXPECT_TRUE(state.isIgnoreDir(w_string("/root/other/x")));
+  EXPECT_FALSE(state.isIgnoreDir(w_string("/root/lib/a")));
+}
+
 // Load up the words data file and build a list of strings from that list.
 // Each of those strings is prefixed with the supplied string.
 // If there are fewer than limit entries available in the data file, we will
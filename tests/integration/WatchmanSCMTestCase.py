@@ -79,6 +79,31 @@ class WatchmanSCMTestCase(WatchmanTestCase.WatchmanTestCase):
 
         return out, err
 
+    def skipIfNoGit(self):
+        try:
+            self.git(["--version"])
+        except Exception as e:
+            self.skipTest("git is not available: %s" % str(e))
+
+    def git(self, args, cwd=None):
+        env = dict(os.environ)
+        env["GIT_AUTHOR_NAME"] = env["GIT_COMMITTER_NAME"] = "John Smith"
+        env["GIT_AUTHOR_EMAIL"] = env["GIT_COMMITTER_EMAIL"] = "smith@example.com"
+        env["GIT_CONFIG_NOSYSTEM"] = "1"
+        env["HOME"] = cwd or os.getcwd()
+        p = subprocess.Popen(
+            ["git"] + args,
+            env=env,
+            cwd=cwd,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        out, err = p.communicate()
+        if p.returncode != 0:
+            raise Exception("git %r failed: %s, %s" % (args, out, err))
+
+        return out, err
+
     def resolveCommitHash(self, revset, cwd=None):
         return self.hg(args=["log", "-T", "{node}", "-r", revset], cwd=cwd)[0].decode(
             "utf-8"
@@ -0,0 +1,105 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestBasenameIndex(WatchmanTestCase.WatchmanTestCase):
+    def makeRoot(self, enabled=True):
+        root = self.mkdtemp()
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"basename_index": enabled}))
+        os.mkdir(os.path.join(root, "a"))
+        os.mkdir(os.path.join(root, "b"))
+        self.touchRelative(root, "BUCK")
+        self.touchRelative(root, "a", "BUCK")
+        self.touchRelative(root, "b", "Buck")
+        self.touchRelative(root, "a", "foo.c")
+        self.touchRelative(root, "b", "foo.c")
+        self.watchmanCommand("watch", root)
+        self.assertFileList(
+            root,
+            [
+                ".watchmanconfig",
+                "BUCK",
+                "a",
+                "a/BUCK",
+                "a/foo.c",
+                "b",
+                "b/Buck",
+                "b/foo.c",
+            ],
+        )
+        return root
+
+    def query(self, root, expression):
+        return self.watchmanCommand(
+            "query",
+            root,
+            {"expression": expression, "fields": ["name"], "explain": True},
+        )
+
+    def test_choosesBasenameGenerator(self):
+        root = self.makeRoot()
+        res = self.query(root, ["name", "BUCK"])
+        if self.isCaseInsensitive():
+            self.assertFileListsEqual(res["files"], ["BUCK", "a/BUCK", "b/Buck"])
+        else:
+            self.assertFileListsEqual(res["files"], ["BUCK", "a/BUCK"])
+        self.assertEqual(res["explain"]["generators"], ["basename (planned)"])
+        # Only the files that share the lower-cased name are walked
+        self.assertEqual(res["explain"]["num_walked"], 3)
+
+        res = self.query(root, ["iname", ["buck", "FOO.C"]])
+        self.assertFileListsEqual(
+            res["files"], ["BUCK", "a/BUCK", "a/foo.c", "b/Buck", "b/foo.c"]
+        )
+        self.assertEqual(res["explain"]["generators"], ["basename (planned)"])
+
+        res = self.query(root, ["allof", ["type", "f"], ["match", "foo.c"]])
+        self.assertFileListsEqual(res["files"], ["a/foo.c", "b/foo.c"])
+        self.assertEqual(res["explain"]["generators"], ["basename (planned)"])
+        self.assertEqual(res["explain"]["num_walked"], 2)
+
+        # A pattern can match names that aren't in the index
+        res = self.query(root, ["match", "foo.*"])
+        self.assertFileListsEqual(res["files"], ["a/foo.c", "b/foo.c"])
+        self.assertEqual(res["explain"]["generators"], ["all"])
+
+    def test_tracksChanges(self):
+        root = self.makeRoot()
+        os.mkdir(os.path.join(root, "c"))
+        self.touchRelative(root, "c", "foo.c")
+        os.unlink(os.path.join(root, "a", "foo.c"))
+        self.assertFileList(
+            root,
+            [
+                ".watchmanconfig",
+                "BUCK",
+                "a",
+                "a/BUCK",
+                "b",
+                "b/Buck",
+                "b/foo.c",
+                "c",
+                "c/foo.c",
+            ],
+        )
+
+        res = self.query(root, ["allof", ["exists"], ["name", "foo.c"]])
+        self.assertFileListsEqual(res["files"], ["b/foo.c", "c/foo.c"])
+        self.assertEqual(res["explain"]["generators"], ["basename (planned)"])
+
+    def test_disabledByDefault(self):
+        root = self.makeRoot(enabled=False)
+        res = self.query(root, ["name", "foo.c"])
+        self.assertFileListsEqual(res["files"], ["a/foo.c", "b/foo.c"])
+        self.assertEqual(res["explain"]["generators"], ["all"])
@@ -0,0 +1,43 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import pywatchman
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestBenchQuery(WatchmanTestCase.WatchmanTestCase):
+    def test_benchQuery(self):
+        root = self.mkdtemp()
+        files = ["a.js", "b.js", "c.txt"]
+        for name in files:
+            self.touchRelative(root, name)
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, files)
+
+        res = self.watchmanCommand(
+            "debug-bench-query",
+            root,
+            {"expression": ["suffix", "js"], "fields": ["name"]},
+            {"iterations": 20, "concurrency": 3, "warmup": 2},
+        )
+        bench = res["bench"]
+        self.assertEqual(bench["iterations"], 20)
+        self.assertEqual(bench["concurrency"], 3)
+        self.assertEqual(bench["num_results_per_iteration"], 2)
+        self.assertGreater(bench["bytes_encoded_per_iteration"], 0)
+        latency = bench["latency_us"]
+        self.assertLessEqual(latency["min"], latency["p50"])
+        self.assertLessEqual(latency["p50"], latency["p90"])
+        self.assertLessEqual(latency["p90"], latency["p99"])
+        self.assertLessEqual(latency["p99"], latency["max"])
+        self.assertEqual(sum(b["count"] for b in bench["histogram"]), 60)
+
+        with self.assertRaises(pywatchman.WatchmanError):
+            self.watchmanCommand(
+                "debug-bench-query", root, {"fields": ["name"]}, {"concurrency": 0}
+            )
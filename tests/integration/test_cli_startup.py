@@ -0,0 +1,49 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+import os.path
+import subprocess
+import tempfile
+import unittest
+
+import WatchmanInstance
+
+
+class TestCliStartup(unittest.TestCase):
+    def runCli(self, sockpath, env):
+        cli_cmd = [
+            os.environ.get("WATCHMAN_BINARY", "watchman"),
+            "--unix-listener-path={0}".format(sockpath.unix_domain),
+            "--named-pipe-path={0}".format(sockpath.named_pipe),
+            "--no-spawn",
+            "--no-local",
+            "--no-pretty",
+            "get-sockname",
+        ]
+        proc = subprocess.Popen(
+            cli_cmd, env=env, stderr=subprocess.PIPE, stdout=subprocess.PIPE
+        )
+        stdout, stderr = proc.communicate()
+        return proc.poll(), stdout.decode("utf-8"), stderr.decode("utf-8")
+
+    def test_globalConfigIsNotLoadedWhileServerIsUp(self):
+        sockpath = WatchmanInstance.getSharedInstance().getSockPath()
+        with tempfile.NamedTemporaryFile(mode="w", suffix=".json", delete=False) as f:
+            f.write("{ this is not json")
+        try:
+            env = os.environ.copy()
+            env["WATCHMAN_CONFIG_FILE"] = f.name
+            status, stdout, stderr = self.runCli(sockpath, env)
+        finally:
+            os.unlink(f.name)
+
+        self.assertEqual(status, 0, stderr)
+        self.assertEqual(json.loads(stdout)["unix_domain"], sockpath.unix_domain)
+        # The config is only needed to start the server
+        self.assertNotIn("failed to parse json", stderr)
@@ -0,0 +1,115 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+import time
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestCollapse(WatchmanTestCase.WatchmanTestCase):
+    def makeTree(self):
+        root = self.mkdtemp()
+        # Any view is over a budget this small, so only the age decides
+        # what is collapsed
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"view_memory_budget": 1}))
+        for d in ("cold", "cold/sub", "hot"):
+            os.mkdir(os.path.join(root, d))
+        self.touchRelative(root, "cold", "a")
+        self.touchRelative(root, "cold", "sub", "b")
+        self.touchRelative(root, "hot", "h")
+        self.watchmanCommand("watch", root)
+        return root
+
+    def allFiles(self, *extra):
+        return [
+            ".watchmanconfig",
+            "cold",
+            "cold/a",
+            "cold/sub",
+            "cold/sub/b",
+            "hot",
+            "hot/h",
+        ] + list(extra)
+
+    def collapse(self, root, age):
+        return sorted(self.watchmanCommand("debug-collapse", root, age)["collapsed"])
+
+    def since(self, root, clock):
+        return self.watchmanCommand("query", root, {"since": clock, "fields": ["name"]})
+
+    def test_hotSubtreeStays(self):
+        root = self.makeTree()
+        self.assertFileList(root, self.allFiles())
+        time.sleep(3)
+        self.touchRelative(root, "hot", "h2")
+        self.watchmanCommand("clock", root, {"sync_timeout": 2000})
+        # A query that needs all of cold keeps it from being collapsed too
+        res = self.watchmanCommand(
+            "query", root, {"relative_root": "cold", "fields": ["name"]}
+        )
+        self.assertFileListsEqual(res["files"], ["a", "sub", "sub/b"])
+
+        self.assertEqual([], self.collapse(root, 1))
+
+    def test_queryRecrawlsCollapsed(self):
+        root = self.makeTree()
+        self.assertFileList(root, self.allFiles())
+        before_late = self.watchmanCommand("clock", root, {"sync_timeout": 2000})
+        self.touchRelative(root, "cold", "late")
+        after_late = self.watchmanCommand("clock", root, {"sync_timeout": 2000})
+        time.sleep(3)
+        self.touchRelative(root, "hot", "h2")
+        self.watchmanCommand("clock", root, {"sync_timeout": 2000})
+
+        self.assertEqual(["cold"], self.collapse(root, 1))
+
+        # A since query from after the last change to cold doesn't need it
+        res = self.since(root, after_late["clock"])
+        self.assertFalse(res["is_fresh_instance"])
+        self.assertFileListContains(res["files"], ["hot/h2"])
+        self.assertEqual([], [f for f in res["files"] if f.startswith("cold")])
+        self.assertEqual(["cold"], self.collapse(root, 3600))
+
+        # but one from before it can't be answered from the view any more,
+        # and so gets all of the files, including those that were collapsed
+        res = self.since(root, before_late["clock"])
+        self.assertTrue(res["is_fresh_instance"])
+        self.assertFileListsEqual(res["files"], self.allFiles("cold/late", "hot/h2"))
+        self.assertEqual([], self.collapse(root, 3600))
+
+        # Nothing changed after that, and the crawl isn't reported again
+        res = self.since(root, res["clock"])
+        self.assertFalse(res["is_fresh_instance"])
+        self.assertEqual([], res["files"])
+        self.assertFileList(root, self.allFiles("cold/late", "hot/h2"))
+
+    def test_changeRecrawlsCollapsed(self):
+        root = self.makeTree()
+        self.assertFileList(root, self.allFiles())
+        time.sleep(3)
+        self.touchRelative(root, "hot", "h2")
+        self.watchmanCommand("clock", root, {"sync_timeout": 2000})
+
+        self.assertEqual(["cold"], self.collapse(root, 1))
+        clock = self.watchmanCommand("clock", root, {"sync_timeout": 2000})["clock"]
+
+        # A change beneath cold crawls it again
+        self.touchRelative(root, "cold", "sub", "new")
+        self.assertWaitFor(lambda: self.collapse(root, 3600) == [])
+
+        res = self.since(root, clock)
+        self.assertFalse(res["is_fresh_instance"])
+        self.assertFileListContains(res["files"], ["cold/sub/new"])
+        self.assertFileList(root, self.allFiles("cold/sub/new", "hot/h2"))
+
+        # The clock moved on past the crawl
+        res = self.since(root, res["clock"])
+        self.assertEqual([], res["files"])
@@ -132,6 +132,12 @@ class TestContentHash(WatchmanTestCase.WatchmanTestCase):
         self.assertEqual(stats["cacheStore"], 2)
         self.assertEqual(stats["cacheLoad"], 2)
 
+        warming = self.watchmanCommand("debug-content-warming", root)
+        self.assertTrue(warming["enabled"])
+        self.assertEqual(warming["hashed"], 2)
+        self.assertEqual(warming["backlog_subscribed"], 0)
+        self.assertEqual(warming["backlog_other"], 0)
+
         res = self.watchmanCommand(
             "query",
             root,
@@ -173,3 +179,94 @@ class TestContentHash(WatchmanTestCase.WatchmanTestCase):
         self.assertEqual(stats["cacheMiss"], 2)
         self.assertEqual(stats["cacheStore"], 2)
         self.assertEqual(stats["cacheLoad"], 2)
+
+    def test_fastContentHash(self):
+        fields = {
+            "content.blake3hex": ("blake3", 64),
+            "content.xxh128hex": ("xxhash", 32),
+        }
+        caps = self.watchmanCommand(
+            "version", {"optional": ["field-" + name for name in fields]}
+        )["capabilities"]
+        fields = {
+            name: info for name, info in fields.items() if caps["field-" + name]
+        }
+        if not fields:
+            self.skipTest("no fast content hashes in this build")
+
+        root = self.mkdtemp()
+        content = b"hello\n"
+        with open(os.path.join(root, "foo"), "wb") as f:
+            f.write(content)
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, ["foo"])
+
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": ["name", "foo"],
+                "fields": ["name", "content.sha1hex"] + sorted(fields),
+            },
+        )
+        result = res["files"][0]
+        self.assertEqual(hashlib.sha1(content).hexdigest(), result["content.sha1hex"])
+        for name, (module, length) in fields.items():
+            self.assertEqual(length, len(result[name]))
+            try:
+                mod = __import__(module)
+            except ImportError:
+                continue
+            if module == "blake3":
+                expect_hex = mod.blake3(content).hexdigest()
+            else:
+                expect_hex = mod.xxh3_128_hexdigest(content)
+            self.assertEqual(expect_hex, result[name])
+
+        # Each algorithm is cached separately
+        stats = self.watchmanCommand("debug-contenthash", root)
+        self.assertEqual(stats["size"], 1 + len(fields))
+
+    def test_suppressUnchangedContent(self):
+        root = self.mkdtemp()
+        foo = os.path.join(root, "foo")
+
+        self.write_file_and_hash(foo, "hello\n")
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"suppress_unchanged_content": True}))
+
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, [".watchmanconfig", "foo"])
+
+        # Changes are only suppressed for files whose hash is cached
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {"expression": ["name", "foo"], "fields": ["name", "content.sha1hex"]},
+        )
+        clock = res["clock"]
+
+        def unchangedContent():
+            stats = self.watchmanCommand("debug-contenthash", root)
+            return stats["unchanged_content"]
+
+        # Touching it doesn't report it as changed
+        st = os.stat(foo)
+        os.utime(foo, (st.st_atime + 10, st.st_mtime + 10))
+        self.assertWaitForEqual(
+            {"suppressed": 1, "confirmed": 0}, unchangedContent
+        )
+        res = self.watchmanCommand(
+            "query", root, {"since": clock, "fields": ["name"]}
+        )
+        self.assertEqual([], res["files"])
+
+        # Changing it without changing its size does
+        self.write_file_and_hash(foo, "howdy\n")
+        self.assertWaitFor(lambda: unchangedContent()["confirmed"] == 1)
+        self.assertWaitFor(
+            lambda: self.watchmanCommand(
+                "query", root, {"since": clock, "fields": ["name"]}
+            )["files"]
+            == ["foo"]
+        )
@@ -5,6 +5,7 @@
 # no unicode literals
 from __future__ import absolute_import, division, print_function
 
+import json
 import os
 import os.path
 import shutil
@@ -60,3 +61,47 @@ class TestDirMove(WatchmanTestCase.WatchmanTestCase):
         self.build_under(root, "dir", latency=1)
 
         self.assertFileList(root, ["dir", "dir/a"])
+
+    def test_renameDetected(self):
+        root = self.mkdtemp()
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"detect_dir_renames": True}))
+        os.makedirs(os.path.join(root, "src", "sub"))
+        self.touchRelative(root, "src", "a")
+        self.touchRelative(root, "src", "sub", "b")
+
+        self.watchmanCommand("watch", root)
+        self.assertFileList(
+            root, [".watchmanconfig", "src", "src/a", "src/sub", "src/sub/b"]
+        )
+        clock = self.watchmanCommand("clock", root)["clock"]
+
+        os.rename(os.path.join(root, "src"), os.path.join(root, "dst"))
+        self.assertFileList(
+            root, [".watchmanconfig", "dst", "dst/a", "dst/sub", "dst/sub/b"]
+        )
+
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {"since": clock, "fields": ["name", "exists", "renamed_from"]},
+        )
+        files = {f["name"]: f for f in res["files"]}
+        for name in ["src", "src/a", "src/sub", "src/sub/b"]:
+            self.assertFalse(files[name]["exists"], files)
+        for name in ["dst", "dst/a", "dst/sub", "dst/sub/b"]:
+            self.assertTrue(files[name]["exists"], files)
+            self.assertEqual(
+                files[name]["renamed_from"], "src" + name[len("dst") :], files
+            )
+
+        # A file that changes is no longer reported as renamed
+        self.touchRelative(root, "dst", "a")
+        self.assertWaitFor(
+            lambda: self.watchmanCommand(
+                "query",
+                root,
+                {"path": ["dst/a"], "fields": ["name", "renamed_from"]},
+            )["files"]
+            == [{"name": "dst/a", "renamed_from": None}]
+        )
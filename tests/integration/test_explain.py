@@ -0,0 +1,139 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import os
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestExplain(WatchmanTestCase.WatchmanTestCase):
+    def makeRoot(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, "subdir"))
+        self.touchRelative(root, "foo.js")
+        self.touchRelative(root, "foo.c")
+        self.touchRelative(root, "subdir", "bar.js")
+        self.touchRelative(root, "subdir", "bar.txt")
+        self.watchmanCommand("watch", root)
+        self.assertFileList(
+            root,
+            ["foo.js", "foo.c", "subdir", "subdir/bar.js", "subdir/bar.txt"],
+        )
+        return root
+
+    def test_reordersTerms(self):
+        root = self.makeRoot()
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": [
+                    "allof",
+                    ["pcre", "bar"],
+                    ["allof", ["size", "ge", 0], ["type", "f"]],
+                    ["suffix", "js"],
+                ],
+                "fields": ["name"],
+                "explain": True,
+            },
+        )
+        self.assertFileListsEqual(res["files"], ["subdir/bar.js"])
+
+        # The nested allof is flattened and the cheap terms come first
+        expr = res["explain"]["expression"]
+        self.assertEqual(expr[0], "allof")
+        self.assertEqual([t[0] for t in expr[1:]], ["type", "suffix", "pcre", "size"])
+
+    def test_choosesSuffixGenerator(self):
+        root = self.makeRoot()
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": ["allof", ["type", "f"], ["suffix", "js"]],
+                "fields": ["name"],
+                "explain": True,
+            },
+        )
+        self.assertFileListsEqual(res["files"], ["foo.js", "subdir/bar.js"])
+        self.assertEqual(res["explain"]["generators"], ["suffix (planned)"])
+        self.assertEqual(res["explain"]["num_walked"], 2)
+
+        # Not every file that matches an anyof need have one of the suffixes
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": ["anyof", ["name", "foo.c"], ["suffix", "js"]],
+                "fields": ["name"],
+                "explain": True,
+            },
+        )
+        self.assertFileListsEqual(res["files"], ["foo.c", "foo.js", "subdir/bar.js"])
+        self.assertEqual(res["explain"]["generators"], ["all"])
+
+    def test_choosesPathGenerator(self):
+        root = self.makeRoot()
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": [
+                    "name",
+                    ["foo.c", "subdir", "subdir/bar.js", "missing"],
+                    "wholename",
+                ],
+                "case_sensitive": True,
+                "fields": ["name"],
+                "explain": True,
+            },
+        )
+        self.assertFileListsEqual(res["files"], ["foo.c", "subdir", "subdir/bar.js"])
+        self.assertEqual(res["explain"]["generators"], ["path (planned)"])
+        self.assertEqual(res["explain"]["num_walked"], 3)
+
+    def test_walksDirnameSubtree(self):
+        root = self.makeRoot()
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": [
+                    "allof",
+                    ["suffix", "js"],
+                    ["dirname", "subdir", ["depth", "le", 1]],
+                ],
+                "case_sensitive": True,
+                "fields": ["name"],
+                "explain": True,
+            },
+        )
+        self.assertFileListsEqual(res["files"], ["subdir/bar.js"])
+        self.assertEqual(res["explain"]["generators"], ["path (planned)"])
+        self.assertEqual(res["explain"]["num_walked"], 2)
+
+        # A name list that folds case can't be looked up by name
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": ["iname", ["FOO.C", "SUBDIR/BAR.JS"], "wholename"],
+                "fields": ["name"],
+                "explain": True,
+            },
+        )
+        self.assertFileListsEqual(res["files"], ["foo.c", "subdir/bar.js"])
+        self.assertEqual(res["explain"]["generators"], ["all"])
+
+    def test_explainIsOptional(self):
+        root = self.makeRoot()
+        res = self.watchmanCommand(
+            "query", root, {"expression": ["suffix", "c"], "fields": ["name"]}
+        )
+        self.assertFileListsEqual(res["files"], ["foo.c"])
+        self.assertNotIn("explain", res)
@@ -0,0 +1,61 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+import os.path
+import sys
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestFanotify(WatchmanTestCase.WatchmanTestCase):
+    def checkOSApplicability(self):
+        if not sys.platform.startswith("linux"):
+            self.skipTest("N/A unless Linux")
+
+    def watchWithFanotify(self, root):
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"watcher": "fanotify"}))
+        res = self.watchmanCommand("watch", root)
+        if res["watcher"] != "fanotify":
+            # Needs Linux 5.9 and the privileges to mark the filesystem
+            self.skipTest("fanotify is not available here")
+
+    def test_fanotify(self):
+        root = self.mkdtemp()
+        os.makedirs(os.path.join(root, "a", "b"))
+        self.watchWithFanotify(root)
+        self.assertFileList(root, [".watchmanconfig", "a", "a/b"])
+
+        self.touchRelative(root, "a", "b", "1")
+        os.mkdir(os.path.join(root, "c"))
+        self.touchRelative(root, "c", "2")
+        self.assertFileList(
+            root, [".watchmanconfig", "a", "a/b", "a/b/1", "c", "c/2"]
+        )
+
+        # The handles of the moved dirs must not resolve to the old paths
+        os.rename(os.path.join(root, "a"), os.path.join(root, "d"))
+        self.touchRelative(root, "d", "b", "3")
+        os.unlink(os.path.join(root, "c", "2"))
+        self.assertFileList(
+            root, [".watchmanconfig", "c", "d", "d/b", "d/b/1", "d/b/3"]
+        )
+
+    def test_move_in_from_outside(self):
+        root = self.mkdtemp()
+        outside = self.mkdtemp()
+        os.mkdir(os.path.join(outside, "e"))
+        self.watchWithFanotify(root)
+
+        # Provoke an event in the dir while it is outside of the root
+        self.touchRelative(outside, "e", "1")
+        os.rename(os.path.join(outside, "e"), os.path.join(root, "e"))
+        self.touchRelative(root, "e", "2")
+        self.assertFileList(root, [".watchmanconfig", "e", "e/1", "e/2"])
@@ -80,3 +80,23 @@ class TestFields(WatchmanTestCase.WatchmanTestCase):
 
         for field in ["cclock", "oclock"]:
             self.assertRegex(file[field], "^c:\d+:\d+:\d+:\d+$")
+
+    def test_type_and_single_field(self):
+        root = self.mkdtemp()
+        self.watchmanCommand("watch", root)
+        self.touchRelative(root, "a")
+        os.mkdir(os.path.join(root, "dir"))
+        self.assertFileList(root, files=["a", "dir"])
+
+        result = self.watchmanCommand(
+            "query", root, {"fields": ["name", "exists", "size", "type"]}
+        )
+        files = {f["name"]: f for f in result["files"]}
+        self.assertEqual(
+            files["a"], {"name": "a", "exists": True, "size": 0, "type": "f"}
+        )
+        self.assertEqual(files["dir"]["type"], "d")
+
+        # A single field is rendered as a list of bare values
+        result = self.watchmanCommand("query", root, {"fields": ["name"]})
+        self.assertEqual(sorted(result["files"]), ["a", "dir"])
@@ -35,3 +35,28 @@ class TestInfo(WatchmanTestCase.WatchmanTestCase):
         self.watchmanCommand("watch", root)
         resp = self.watchmanCommand("get-config", root)
         self.assertEqual(resp["config"], config)
+
+    def test_debug_watcher_info(self):
+        root = self.mkdtemp()
+        self.watchmanCommand("watch", root)
+        self.touchRelative(root, "foo")
+        self.assertFileList(root, ["foo"])
+
+        resp = self.watchmanCommand("debug-watcher-info", root)
+        watcher = resp["watcher"]
+        self.assertTrue(watcher["name"])
+        if watcher["name"] == "eden":
+            return
+        stats = watcher["stats"]
+        for key in (
+            "batches",
+            "events",
+            "coalesced_events",
+            "bytes_read",
+            "overflows",
+            "consume_micros",
+            "watches",
+            "watch_limit",
+        ):
+            self.assertIn(key, stats)
+        self.assertEqual(stats["overflows"], 0)
@@ -0,0 +1,59 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import os
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestMultiQuery(WatchmanTestCase.WatchmanTestCase):
+    def makeRoot(self, names):
+        root = self.mkdtemp()
+        for name in names:
+            self.touchRelative(root, name)
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, names)
+        return root
+
+    def test_multiQuery(self):
+        a = self.makeRoot(["a.c", "a.h"])
+        b = self.makeRoot(["b.c"])
+        res = self.watchmanCommand(
+            "multi-query",
+            [
+                [a, {"expression": ["suffix", "c"], "fields": ["name"]}],
+                [b, {"fields": ["name"], "sync_timeout": 1000}],
+                [a, {"fields": ["name"]}],
+            ],
+        )
+        results = res["results"]
+        self.assertEqual(len(results), 3)
+        self.assertFileListsEqual(results[0]["files"], ["a.c"])
+        self.assertFileListsEqual(results[1]["files"], ["b.c"])
+        self.assertFileListsEqual(results[2]["files"], ["a.c", "a.h"])
+        for result in results:
+            self.assertIn("clock", result)
+            self.assertIn("is_fresh_instance", result)
+
+    def test_multiQueryErrors(self):
+        a = self.makeRoot(["a.c"])
+        res = self.watchmanCommand(
+            "multi-query",
+            [
+                [os.path.join(a, "nope"), {"fields": ["name"]}],
+                [a, {"expression": ["bogus"]}],
+                [a, {"fields": ["name"]}],
+            ],
+        )
+        results = res["results"]
+        self.assertIn("error", results[0])
+        self.assertIn("failed to parse query", results[1]["error"])
+        self.assertFileListsEqual(results[2]["files"], ["a.c"])
+
+        with self.assertRaises(Exception):
+            self.watchmanCommand("multi-query", a, {"fields": ["name"]})
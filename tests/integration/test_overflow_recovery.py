@@ -0,0 +1,63 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+import os.path
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestOverflowRecovery(WatchmanTestCase.WatchmanTestCase):
+    def makeRoot(self, budget):
+        root = self.mkdtemp()
+        os.makedirs(os.path.join(root, "a", "b"))
+        os.mkdir(os.path.join(root, "c"))
+        self.touchRelative(root, "a", "b", "1")
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"overflow_recovery_budget": budget}))
+        self.watchmanCommand("watch", root)
+        self.assertFileList(
+            root, [".watchmanconfig", "a", "a/b", "a/b/1", "c"]
+        )
+        return root
+
+    def getRecovery(self, root):
+        return self.watchmanCommand("debug-get-subscriptions", root)[
+            "overflow_recovery"
+        ]
+
+    def test_recovery(self):
+        root = self.makeRoot(100)
+        res = self.watchmanCommand("query", root, {"fields": ["name"]})
+        clock = res["clock"]
+
+        self.watchmanCommand("debug-overflow-recovery", root)
+        self.assertWaitFor(lambda: self.getRecovery(root)["count"] == 1)
+
+        recovery = self.getRecovery(root)
+        self.assertFalse(recovery["last"]["recrawl"], recovery)
+        self.assertEqual(
+            recovery["last"]["reason"], "debug-overflow-recovery"
+        )
+        self.assertEqual(recovery["last"]["examined_dirs"], 3, recovery)
+
+        watch_list = self.watchmanCommand("watch-list")
+        self.assertIn(root, watch_list["overflow_recovery"])
+
+        # The recovery doesn't report the files that it found unchanged
+        self.touchRelative(root, "c", "2")
+        self.assertFileList(
+            root, [".watchmanconfig", "a", "a/b", "a/b/1", "c", "c/2"]
+        )
+        res = self.watchmanCommand(
+            "query", root, {"since": clock, "fields": ["name"]}
+        )
+        self.assertFalse(res["is_fresh_instance"], res)
+        self.assertTrue("warning" not in res, res)
+        self.assertFileListsEqual(res["files"], ["c/2", "c"])
@@ -0,0 +1,82 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import os
+
+import pywatchman
+import WatchmanTestCase
+from pywatchman import packednames
+
+
+@WatchmanTestCase.expand_matrix
+class TestPackedNames(WatchmanTestCase.WatchmanTestCase):
+    def makeRoot(self):
+        root = self.mkdtemp()
+        files = []
+        for d in range(3):
+            dirname = "dir%d" % d
+            os.mkdir(os.path.join(root, dirname))
+            for i in range(5):
+                name = "file%d.js" % i
+                self.touchRelative(root, dirname, name)
+                files.append("%s/%s" % (dirname, name))
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, files + ["dir%d" % d for d in range(3)])
+        return root, files
+
+    @WatchmanTestCase.skip_for(codecs=["json"])
+    def test_packed_names(self):
+        root, files = self.makeRoot()
+        for packed in (True, "front_coded"):
+            res = self.watchmanCommand(
+                "query",
+                root,
+                {
+                    "expression": ["suffix", "js"],
+                    "fields": ["name"],
+                    "packed_names": packed,
+                },
+            )
+            unpacked = packednames.unpack(res["files"])
+            self.assertEqual(unpacked.clock, res["clock"])
+            self.assertTrue(unpacked.is_fresh_instance)
+            self.assertEqual(
+                sorted(name.decode("utf-8") for name in unpacked.names),
+                sorted(files),
+            )
+
+        self.touchRelative(root, "dir1", "file9.js")
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": ["suffix", "js"],
+                "fields": ["name"],
+                "since": unpacked.clock,
+                "packed_names": "front_coded",
+            },
+        )
+        unpacked = packednames.unpack(res["files"])
+        self.assertFalse(unpacked.is_fresh_instance)
+        self.assertEqual(unpacked.names, [b"dir1/file9.js"])
+
+    @WatchmanTestCase.skip_for(codecs=["bser", "bser-v1"])
+    def test_packed_names_requires_bser(self):
+        root, files = self.makeRoot()
+        with self.assertRaises(pywatchman.CommandError) as ctx:
+            self.watchmanCommand(
+                "query", root, {"fields": ["name"], "packed_names": True}
+            )
+        self.assertIn("packed_names requires a BSER connection", str(ctx.exception))
+
+    def test_packed_names_requires_name_field(self):
+        root, files = self.makeRoot()
+        with self.assertRaises(pywatchman.CommandError) as ctx:
+            self.watchmanCommand(
+                "query", root, {"fields": ["name", "size"], "packed_names": True}
+            )
+        self.assertIn("'packed_names' requires 'fields'", str(ctx.exception))
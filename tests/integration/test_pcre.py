@@ -73,3 +73,22 @@ class TestPcre(WatchmanTestCase.WatchmanTestCase):
         out = self.watchmanCommand("find", root, "-P", ".*C$")
         self.assertEqual(1, len(out["files"]))
         self.assertFileListsEqual(["foo.c"], [out["files"][0]["name"]])
+
+    def test_pcre_cache(self):
+        self.check_pcre()
+
+        root = self.mkdtemp()
+        self.touchRelative(root, "foo.c")
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, ["foo.c"])
+
+        query = {"expression": ["pcre", "^fo+\\.c$"], "fields": ["name"]}
+        before = self.watchmanCommand("debug-pcre-cache")
+        for _ in range(2):
+            res = self.watchmanCommand("query", root, query)
+            self.assertFileListsEqual(["foo.c"], res["files"])
+        after = self.watchmanCommand("debug-pcre-cache")
+
+        # The second query reuses the pattern compiled by the first
+        self.assertGreaterEqual(after["cacheHit"] - before["cacheHit"], 1)
+        self.assertGreaterEqual(after["size"], 1)
@@ -0,0 +1,191 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import os
+
+import pywatchman
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestQueryLimit(WatchmanTestCase.WatchmanTestCase):
+    def makeRoot(self):
+        root = self.mkdtemp()
+        files = []
+        for d in range(4):
+            dirname = "dir%d" % d
+            os.mkdir(os.path.join(root, dirname))
+            for i in range(10):
+                name = "file%d.js" % i
+                self.touchRelative(root, dirname, name)
+                files.append("%s/%s" % (dirname, name))
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, files + ["dir%d" % d for d in range(4)])
+        return root, files
+
+    def test_limit(self):
+        root, files = self.makeRoot()
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": ["suffix", "js"],
+                "fields": ["name"],
+                "limit": 3,
+                "explain": True,
+            },
+        )
+        self.assertEqual(len(res["files"]), 3)
+        self.assertTrue(set(res["files"]).issubset(set(files)))
+        # The walk stops once the limit is reached
+        self.assertLess(res["explain"]["num_walked"], len(files))
+        self.assertNotIn("next_page_token", res)
+
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {"expression": ["suffix", "js"], "fields": ["name"], "offset": 38},
+        )
+        self.assertEqual(len(res["files"]), 2)
+
+    def test_pages(self):
+        root, files = self.makeRoot()
+        query = {
+            "expression": ["suffix", "js"],
+            "fields": ["name"],
+            "order_by": "name",
+            "limit": 15,
+        }
+        pages = []
+        while True:
+            res = self.watchmanCommand("query", root, query)
+            pages.append(res["files"])
+            if "next_page_token" not in res:
+                break
+            self.assertEqual(res["next_page_token"], res["files"][-1])
+            query["page_token"] = res["next_page_token"]
+
+        self.assertEqual([len(page) for page in pages], [15, 15, 10])
+        self.assertEqual(sum(pages, []), sorted(files))
+
+        query = {
+            "expression": ["suffix", "js"],
+            "fields": ["name"],
+            "order_by": "name",
+            "offset": 1,
+            "limit": 2,
+        }
+        res = self.watchmanCommand("query", root, query)
+        self.assertEqual(res["files"], sorted(files)[1:3])
+
+    def test_order_by_ticks(self):
+        root, files = self.makeRoot()
+        clock = self.watchmanCommand("clock", root)["clock"]
+        # Change the files one at a time, so that each has a tick of its own
+        changed = []
+        for i in range(10):
+            name = "dir%d/file%d.js" % (i % 4, i)
+            self.touchRelative(root, name)
+            self.watchmanCommand("clock", root, {"sync_timeout": 2000})
+            changed.append(name)
+
+        query = {
+            "expression": ["type", "f"],
+            "fields": ["name"],
+            "order_by": "ticks",
+            "limit": 4,
+            "since": clock,
+        }
+        pages = []
+        while True:
+            res = self.watchmanCommand("query", root, query)
+            pages.append(res["files"])
+            if not res.get("has_more"):
+                break
+            query["since"] = res["clock"]
+
+        self.assertEqual([len(page) for page in pages], [4, 4, 2])
+        self.assertEqual(sum(pages, []), changed)
+
+    def assertGroupedByDir(self, names):
+        dirs = [os.path.dirname(name) for name in names]
+        # Each dir forms a single run of names
+        runs = [d for i, d in enumerate(dirs) if i == 0 or dirs[i - 1] != d]
+        self.assertEqual(len(runs), len(set(runs)))
+
+    def test_group_by_dir(self):
+        root, files = self.makeRoot()
+        clock = self.watchmanCommand("clock", root)["clock"]
+        # Interleave the changes to the dirs
+        for i in range(10):
+            for d in range(4):
+                self.touchRelative(root, "dir%d" % d, "file%d.js" % i)
+
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {"expression": ["suffix", "js"], "fields": ["name"], "group_by_dir": True},
+        )
+        self.assertEqual(sorted(res["files"]), sorted(files))
+        self.assertGroupedByDir(res["files"])
+
+        # The files that the since generator finds are grouped after they
+        # match
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": ["suffix", "js"],
+                "fields": ["name"],
+                "since": clock,
+                "group_by_dir": True,
+            },
+        )
+        self.assertEqual(sorted(res["files"]), sorted(files))
+        self.assertGroupedByDir(res["files"])
+
+    def test_order_by_dir(self):
+        root, files = self.makeRoot()
+        os.mkdir(os.path.join(root, "dir0", "sub"))
+        self.touchRelative(root, "dir0", "sub", "a.js")
+        files.append("dir0/sub/a.js")
+
+        query = {
+            "expression": ["suffix", "js"],
+            "fields": ["name"],
+            "order_by": "name",
+            "group_by_dir": True,
+            "limit": 15,
+        }
+        pages = []
+        while True:
+            res = self.watchmanCommand("query", root, query)
+            pages.append(res["files"])
+            if "next_page_token" not in res:
+                break
+            query["page_token"] = res["next_page_token"]
+
+        expected = sorted(files, key=lambda name: os.path.split(name))
+        self.assertEqual(sum(pages, []), expected)
+        # The files of dir0 precede those of its subdir
+        self.assertLess(
+            expected.index("dir0/file9.js"), expected.index("dir0/sub/a.js")
+        )
+
+    def test_invalid(self):
+        root, _ = self.makeRoot()
+        for spec in [
+            {"limit": 0},
+            {"offset": -1},
+            {"order_by": "size"},
+            {"page_token": "dir0/file0.js"},
+            {"group_by_dir": 1},
+            {"order_by": "ticks", "offset": 1},
+            {"order_by": "ticks", "group_by_dir": True},
+        ]:
+            with self.assertRaises(pywatchman.WatchmanError):
+                self.watchmanCommand("query", root, spec)
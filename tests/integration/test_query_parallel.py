@@ -0,0 +1,70 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestQueryParallel(WatchmanTestCase.WatchmanTestCase):
+    def makeRoot(self):
+        root = self.mkdtemp()
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(
+                json.dumps({"query_parallelism": 4, "query_parallel_min_files": 1})
+            )
+
+        files = [".watchmanconfig"]
+        for d in range(8):
+            dirname = "dir%d" % d
+            os.mkdir(os.path.join(root, dirname))
+            files.append(dirname)
+            for i in range(25):
+                name = "file%d.%s" % (i, "js" if i % 2 else "txt")
+                self.touchRelative(root, dirname, name)
+                files.append(os.path.join(dirname, name))
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, files)
+        return root, files
+
+    def test_allFiles(self):
+        root, files = self.makeRoot()
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {"expression": ["pcre", "[13579]\\.js$"], "fields": ["name"]},
+        )
+        odd = ("1.js", "3.js", "5.js", "7.js", "9.js")
+        self.assertFileListsEqual(
+            res["files"], [f for f in files if f.endswith(odd)]
+        )
+
+    def test_pathGenerator(self):
+        root, files = self.makeRoot()
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "path": ["dir1", "dir2"],
+                "expression": ["type", "f"],
+                "fields": ["name", "size"],
+            },
+        )
+        names = [f["name"] for f in res["files"]]
+        self.assertFileListsEqual(
+            names, [f for f in files if f.startswith(("dir1/", "dir2/"))]
+        )
+
+    def test_stableOrder(self):
+        root, files = self.makeRoot()
+        query = {"path": ["dir3"], "fields": ["name"]}
+        first = self.watchmanCommand("query", root, query)["files"]
+        self.assertEqual(len(first), 25)
+        for _ in range(5):
+            self.assertEqual(self.watchmanCommand("query", root, query)["files"], first)
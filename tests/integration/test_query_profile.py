@@ -0,0 +1,54 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestQueryProfile(WatchmanTestCase.WatchmanTestCase):
+    def test_profile(self):
+        root = self.mkdtemp()
+        files = ["foo.js", "foo.txt", "bar.js"]
+        for name in files:
+            self.touchRelative(root, name)
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, files)
+
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": ["allof", ["type", "f"], ["match", "foo*"]],
+                "fields": ["name"],
+                "profile": True,
+            },
+        )
+        self.assertEqual(sorted(res["files"]), ["foo.js", "foo.txt"])
+
+        profile = res["profile"]
+        terms = [(t["term"], t["depth"]) for t in profile["terms"]]
+        self.assertEqual(terms, [("allof", 0), ("type", 1), ("match", 1)])
+        allof, type_term, match = profile["terms"]
+        self.assertEqual(allof["evaluations"], 3)
+        self.assertEqual(allof["matches"], 2)
+        self.assertEqual(type_term["matches"], 3)
+        self.assertEqual(match["evaluations"], 3)
+        self.assertEqual(match["matches"], 2)
+        for term in profile["terms"]:
+            self.assertEqual(term["deferred"], 0)
+            self.assertGreaterEqual(term["time_us"], 0)
+
+        self.assertEqual([g["generator"] for g in profile["generators"]], ["all"])
+        self.assertEqual(profile["generators"][0]["num_walked"], 3)
+        for key in [
+            "view_lock_wait_us",
+            "eval_batch_fetch_us",
+            "render_batch_fetch_us",
+            "render_us",
+            "serialize_us",
+        ]:
+            self.assertIn(key, profile)
@@ -0,0 +1,40 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestQueryResultCache(WatchmanTestCase.WatchmanTestCase):
+    def test_repeatedQuery(self):
+        root = self.mkdtemp()
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"query_result_cache_max_bytes": 1024 * 1024}))
+        self.touchRelative(root, "a.txt")
+        self.touchRelative(root, "b.txt")
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, [".watchmanconfig", "a.txt", "b.txt"])
+
+        query = {"glob": ["*.txt"], "fields": ["name"], "sync_timeout": 0}
+        first = self.watchmanCommand("query", root, query)
+        self.assertFileListsEqual(first["files"], ["a.txt", "b.txt"])
+
+        second = self.watchmanCommand("query", root, query)
+        self.assertEqual(first, second)
+        stats = self.watchmanCommand("debug-query-result-cache", root)["cache"]
+        self.assertEqual(stats["hits"], 1)
+        self.assertEqual(stats["stores"], 1)
+
+        # A change to the view invalidates the cached response
+        self.touchRelative(root, "c.txt")
+        self.assertFileList(root, [".watchmanconfig", "a.txt", "b.txt", "c.txt"])
+        third = self.watchmanCommand("query", root, query)
+        self.assertFileListsEqual(third["files"], ["a.txt", "b.txt", "c.txt"])
+        self.assertNotEqual(first["clock"], third["clock"])
@@ -507,3 +507,114 @@ o  changeset:   0:b08db10380dd
             },
         )
         self.assertFileListsEqual(res["files"], ["b/c/f1"])
+
+    def test_scmGit(self):
+        self.skipIfNoGit()
+
+        root = self.mkdtemp()
+        """ Set up a repo with a history like this:
+* add m2 (feature2)
+* add m1 (TheMaster)
+| * remove car (feature3)
+|/
+| * add f1 (feature1)
+|/
+* add bar and car
+* initial
+        """
+
+        self.git(["init", "-q"], cwd=root)
+        self.git(["checkout", "-q", "-b", "TheMaster"], cwd=root)
+        self.touchRelative(root, "foo")
+        self.git(["add", "-A"], cwd=root)
+        self.git(["commit", "-q", "-m", "initial"], cwd=root)
+        self.git(["tag", "initial"], cwd=root)
+        self.touchRelative(root, "bar")
+        self.touchRelative(root, "car")
+        self.git(["add", "-A"], cwd=root)
+        self.git(["commit", "-q", "-m", "add bar and car"], cwd=root)
+        self.git(["checkout", "-q", "-b", "feature1"], cwd=root)
+        os.makedirs(os.path.join(root, "a", "b", "c"))
+        self.touchRelative(root, "a", "b", "c", "f1")
+        self.git(["add", "-A"], cwd=root)
+        self.git(["commit", "-q", "-m", "add f1"], cwd=root)
+        self.git(["checkout", "-q", "-b", "feature3", "TheMaster"], cwd=root)
+        self.git(["rm", "-q", "car"], cwd=root)
+        self.git(["commit", "-q", "-m", "remove car"], cwd=root)
+        self.git(["checkout", "-q", "TheMaster"], cwd=root)
+        self.touchRelative(root, "m1")
+        self.git(["add", "-A"], cwd=root)
+        self.git(["commit", "-q", "-m", "add m1"], cwd=root)
+        self.git(["checkout", "-q", "-b", "feature2"], cwd=root)
+        self.touchRelative(root, "m2")
+        self.git(["add", "-A"], cwd=root)
+        self.git(["commit", "-q", "-m", "add m2"], cwd=root)
+        # Commits are read from packs as well as from loose objects
+        self.git(["gc", "-q"], cwd=root)
+
+        self.watchmanCommand("watch", root)
+        expression = ["not", ["anyof", ["name", ".git"], ["dirname", ".git"]]]
+
+        def query(since, **kwargs):
+            params = {"expression": expression, "fields": ["name"], "since": since}
+            params.update(kwargs)
+            return self.watchmanCommand("query", root, params)
+
+        res = query({"scm": {"mergebase-with": "TheMaster"}})
+        master = self.git(["rev-parse", "TheMaster"], cwd=root)[0]
+        self.assertEqual(res["clock"]["scm"]["mergebase"], master.decode().strip())
+        self.assertEqual(res["clock"]["scm"]["mergebase-with"], "TheMaster")
+        # The only file changed between TheMaster and feature2 is m2
+        self.assertFileListsEqual(res["files"], ["m2"])
+        mergeBase = res["clock"]["scm"]["mergebase"]
+
+        # Untracked files that aren't ignored show up as normal changes
+        with open(os.path.join(root, ".gitignore"), "w") as f:
+            f.write("*.ignored\n")
+        self.touchRelative(root, "w00t")
+        self.touchRelative(root, "x.ignored")
+        res = query({"scm": {"mergebase": "", "mergebase-with": "TheMaster"}})
+        self.assertEqual(res["clock"]["scm"]["mergebase"], mergeBase)
+        self.assertFileListsEqual(res["files"], [".gitignore", "m2", "w00t"])
+        os.unlink(os.path.join(root, ".gitignore"))
+        os.unlink(os.path.join(root, "w00t"))
+        os.unlink(os.path.join(root, "x.ignored"))
+
+        # Moving to another branch changes the merge base
+        self.git(["checkout", "-q", "feature1"], cwd=root)
+        res = query(res["clock"])
+        self.assertNotEqual(res["clock"]["scm"]["mergebase"], mergeBase)
+        self.assertFileListsEqual(res["files"], ["a/b/c/f1"])
+
+        # Deleted files are part of the result
+        self.git(["checkout", "-q", "feature3"], cwd=root)
+        res = query({"scm": {"mergebase": "", "mergebase-with": "TheMaster"}})
+        self.assertFileListsEqual(res["files"], ["car"])
+
+        # Asking again reuses the files that the first query found
+        res = query({"scm": {"mergebase": "", "mergebase-with": "TheMaster"}})
+        self.assertFileListsEqual(res["files"], ["car"])
+        cache = self.watchmanCommand("debug-scm-changed-files-cache", root)
+        self.assertGreater(cache["cache"]["hits"], 0)
+
+        # Staged and unstaged changes are part of the result
+        self.git(["checkout", "-q", "feature2"], cwd=root)
+        self.touchRelative(root, "staged")
+        self.git(["add", "staged"], cwd=root)
+        with open(os.path.join(root, "foo"), "w") as f:
+            f.write("changed\n")
+        res = query({"scm": {"mergebase": "", "mergebase-with": "TheMaster"}})
+        self.assertFileListsEqual(res["files"], ["foo", "m2", "staged"])
+        self.git(["reset", "-q", "--hard"], cwd=root)
+
+        # Tags resolve too
+        res = query({"scm": {"mergebase": "", "mergebase-with": "initial"}})
+        self.assertFileListsEqual(res["files"], ["bar", "car", "m1", "m2"])
+
+        # relative_root limits the result to the files under it
+        self.git(["checkout", "-q", "feature1"], cwd=root)
+        res = query(
+            {"scm": {"mergebase": "", "mergebase-with": "TheMaster"}},
+            relative_root="a",
+        )
+        self.assertFileListsEqual(res["files"], ["b/c/f1"])
@@ -0,0 +1,47 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import os
+
+import pywatchman
+import WatchmanInstance
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestSharedWatch(WatchmanTestCase.WatchmanTestCase):
+    def checkOSApplicability(self):
+        if os.name == "nt":
+            self.skipTest("N/A on Windows")
+
+    def test_nonCanonicalPaths(self):
+        config = {"share_nested_watches": True}
+        with WatchmanInstance.Instance(config=config) as inst:
+            inst.start()
+            self.getClient(inst, replace_cached=True)
+
+            root = self.mkdtemp()
+            os.mkdir(os.path.join(root, "sub"))
+            self.touchRelative(root, "sub", "foo")
+            self.touchRelative(root, "bar")
+            link = os.path.join(self.mkdtemp(), "link")
+            os.symlink(os.path.join(root, "sub"), link)
+
+            self.watchmanCommand("watch", root)
+            sub = os.path.join(root, "sub") + "/"
+            res = self.watchmanCommand("watch", sub)
+            self.assertIn("shared_with", res)
+
+            # Both name the shared watch, so the queries are scoped to it
+            self.assertFileList(sub, ["foo"])
+            self.assertFileList(link, ["foo"])
+
+            res = self.watchmanCommand("watch-del", link)
+            self.assertTrue(res["watch-del"])
+            self.assertTrue(self.rootIsWatched(root))
+            with self.assertRaises(pywatchman.WatchmanError):
+                self.watchmanCommand("query", sub, {"fields": ["name"]})
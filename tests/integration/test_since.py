@@ -117,6 +117,37 @@ class TestSince(WatchmanTestCase.WatchmanTestCase):
         )
         self.assertFileListsEqual(res["files"], ["dir2", "dir2/bar"])
 
+    def test_sinceRelativeRootSkipsOtherChanges(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, "busy"))
+        os.mkdir(os.path.join(root, "quiet"))
+        busy = ["busy/%d" % i for i in range(20)]
+        for name in busy + ["quiet/a"]:
+            self.touchRelative(root, name)
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, files=["busy", "quiet", "quiet/a"] + busy)
+        clock = self.watchmanCommand("clock", root)["clock"]
+
+        for name in busy:
+            self.touchRelative(root, name)
+        self.touchRelative(root, "quiet", "b")
+        self.waitForSync(root)
+
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "since": clock,
+                "relative_root": "quiet",
+                "fields": ["name"],
+                "explain": True,
+            },
+        )
+        self.assertFileListsEqual(res["files"], ["b"])
+        # Only the files of the quiet dir are looked at, rather than every
+        # change in the root
+        self.assertLess(res["explain"]["num_walked"], len(busy))
+
     def assertFreshInstanceForSince(self, root, cursor, empty=False):
         res = self.watchmanCommand(
             "query",
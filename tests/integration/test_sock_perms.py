@@ -102,6 +102,24 @@ class TestSockPerms(unittest.TestCase):
             get_debug_output=lambda: instance.getCLILogContents(),
         )
 
+    def test_cli_checks_user_dir_of_running_server(self):
+        instance = self._new_instance({})
+        instance.start()
+        # A command for a running server isn't sent through a dir that
+        # others could have put their own socket in
+        os.chmod(instance.user_dir, 0o777)
+        try:
+            stdout, stderr = instance.commandViaCLI(["get-pid"])
+        finally:
+            os.chmod(instance.user_dir, 0o700)
+            instance.stop()
+
+        self.assertNotIn(b"pid", stdout)
+        wanted = "the permissions on %s allow others to write to it" % (
+            instance.user_dir
+        )
+        self.assertIn(wanted, stderr.decode("utf-8"))
+
     def test_invalid_sock_group(self):
         # create a random group name
         while True:
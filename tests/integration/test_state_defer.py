@@ -0,0 +1,131 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+import time
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestStateDefer(WatchmanTestCase.WatchmanTestCase):
+    def requiresPersistentSession(self):
+        return True
+
+    def watchWithSettle(self, settle):
+        root = self.mkdtemp()
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"settle": settle}))
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, files=[".watchmanconfig"])
+        clock = self.watchmanCommand("clock", root, {"sync_timeout": 2000})["clock"]
+        return root, clock
+
+    def changedSince(self, root, clock, sync=False):
+        query = {"since": clock, "fields": ["name"]}
+        if not sync:
+            # Look at the view as it is, without a cookie to make the IO
+            # thread catch up
+            query["sync_timeout"] = 0
+        res = self.watchmanCommand("query", root, query)
+        return sorted(res["files"]), res["clock"]
+
+    def assertedStates(self, root):
+        res = self.watchmanCommand("debug-get-asserted-states", root)
+        return [(s["name"], s["state"]) for s in res["states"]]
+
+    def waitForAsserted(self, root, name):
+        self.assertWaitFor(lambda: (name, "Asserted") in self.assertedStates(root))
+
+    def touchAndCheckHeldBack(self, root, clock):
+        self.touchRelative(root, "a")
+        self.touchRelative(root, "b")
+        # Without the state these show up as soon as they are noticed
+        time.sleep(1)
+        self.assertEqual([], self.changedSince(root, clock)[0])
+
+    def test_deferUntilLeave(self):
+        root, clock = self.watchWithSettle(10000)
+
+        self.watchmanCommand(
+            "state-enter", root, {"name": "defer", "defer_processing": True}
+        )
+        self.waitForAsserted(root, "defer")
+        self.touchAndCheckHeldBack(root, clock)
+
+        self.watchmanCommand("state-leave", root, "defer")
+        self.assertWaitFor(lambda: self.assertedStates(root) == [])
+
+        # Well within the settle period, so it was leaving that let them in
+        self.assertWaitFor(
+            lambda: self.changedSince(root, clock)[0] == ["a", "b"], timeout=5
+        )
+
+        # They were applied exactly once
+        files, after = self.changedSince(root, clock, sync=True)
+        self.assertEqual(["a", "b"], files)
+        self.assertEqual([], self.changedSince(root, after, sync=True)[0])
+
+    def test_syncedQueryDoesNotWait(self):
+        root, clock = self.watchWithSettle(10000)
+
+        self.watchmanCommand(
+            "state-enter", root, {"name": "defer", "defer_processing": True}
+        )
+        self.waitForAsserted(root, "defer")
+        self.touchAndCheckHeldBack(root, clock)
+
+        # The cookie of a query isn't held back, and nor is what came
+        # before it
+        files, after = self.changedSince(root, clock, sync=True)
+        self.assertEqual(["a", "b"], files)
+        self.assertIn(("defer", "Asserted"), self.assertedStates(root))
+
+        self.watchmanCommand("state-leave", root, "defer")
+        self.assertWaitFor(lambda: self.assertedStates(root) == [])
+        self.assertEqual([], self.changedSince(root, after, sync=True)[0])
+
+    def test_deferUntilSettled(self):
+        root, clock = self.watchWithSettle(3000)
+
+        self.watchmanCommand(
+            "state-enter", root, {"name": "defer", "defer_processing": True}
+        )
+        self.waitForAsserted(root, "defer")
+        self.touchAndCheckHeldBack(root, clock)
+
+        # Once nothing new arrives for the settle period, the changes are
+        # applied even though the state is still asserted
+        self.assertWaitFor(lambda: self.changedSince(root, clock)[0] == ["a", "b"])
+        self.assertIn(("defer", "Asserted"), self.assertedStates(root))
+
+        files, after = self.changedSince(root, clock, sync=True)
+        self.assertEqual(["a", "b"], files)
+        self.watchmanCommand("state-leave", root, "defer")
+        self.assertWaitFor(lambda: self.assertedStates(root) == [])
+        self.assertEqual([], self.changedSince(root, after, sync=True)[0])
+
+    def test_deferUntilAbandoned(self):
+        root, clock = self.watchWithSettle(10000)
+
+        client = self.getClient(no_cache=True)
+        client.query("state-enter", root, {"name": "defer", "defer_processing": True})
+        self.waitForAsserted(root, "defer")
+        self.touchAndCheckHeldBack(root, clock)
+
+        # The state is vacated when its client goes away, which lets in
+        # what it held back well within the settle period
+        client.close()
+        self.assertWaitFor(lambda: self.assertedStates(root) == [])
+        self.assertWaitFor(
+            lambda: self.changedSince(root, clock)[0] == ["a", "b"], timeout=5
+        )
+
+        files, after = self.changedSince(root, clock, sync=True)
+        self.assertEqual(["a", "b"], files)
+        self.assertEqual([], self.changedSince(root, after, sync=True)[0])
@@ -0,0 +1,80 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import os
+
+import pywatchman
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestStreamResults(WatchmanTestCase.WatchmanTestCase):
+    def makeRoot(self):
+        root = self.mkdtemp()
+        files = []
+        for i in range(25):
+            name = "file%d" % i
+            self.touchRelative(root, name)
+            files.append(name)
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, files)
+        return root, files
+
+    def streamQuery(self, root, query):
+        # Collect the responses up to and including the final one
+        client = self.getClient()
+        responses = [client.query("query", root, query)]
+        while responses[-1].get("partial"):
+            responses.append(client.receive())
+        return responses
+
+    def test_streamResults(self):
+        root, files = self.makeRoot()
+        responses = self.streamQuery(
+            root,
+            {"expression": ["type", "f"], "fields": ["name"], "stream_results": 10},
+        )
+        self.assertEqual(len(responses), 3)
+        self.assertEqual([len(r["files"]) for r in responses], [10, 10, 5])
+        self.assertNotIn("partial", responses[-1])
+        self.assertIn("clock", responses[-1])
+
+        names = []
+        for r in responses:
+            names.extend(r["files"])
+        self.assertFileListsEqual(names, files)
+
+        # The client is still usable afterwards
+        self.assertFileListsEqual(
+            self.watchmanCommand("query", root, {"fields": ["name"]})["files"], files
+        )
+
+    def test_streamFewerThanChunk(self):
+        root, files = self.makeRoot()
+        responses = self.streamQuery(
+            root, {"fields": ["name", "size"], "stream_results": True}
+        )
+        self.assertEqual(len(responses), 1)
+        self.assertFileListsEqual([f["name"] for f in responses[0]["files"]], files)
+
+    def test_streamLimitedQuery(self):
+        root, files = self.makeRoot()
+        responses = self.streamQuery(
+            root, {"fields": ["name"], "limit": 20, "stream_results": 10}
+        )
+        names = []
+        for r in responses:
+            names.extend(r["files"])
+        self.assertEqual(len(names), 20)
+        self.assertEqual(len(set(names)), 20)
+        self.assertTrue(set(names).issubset(set(files)))
+
+    def test_invalidChunkSize(self):
+        root, _ = self.makeRoot()
+        with self.assertRaises(pywatchman.WatchmanError) as ctx:
+            self.watchmanCommand("query", root, {"stream_results": 0})
+        self.assertIn("must be a boolean or a positive integer", str(ctx.exception))
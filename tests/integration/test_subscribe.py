@@ -8,6 +8,7 @@ from __future__ import absolute_import, division, print_function
 import json
 import os
 import os.path
+import shutil
 
 import pywatchman
 import WatchmanTestCase
@@ -666,6 +667,184 @@ class TestSubscribe(WatchmanTestCase.WatchmanTestCase):
 
         self.assertWaitForEqual([], checkSubscribers)
 
+    def test_subscribe_overflow_policy(self):
+        root = self.mkdtemp()
+        self.watchmanCommand("watch", root)
+
+        with self.assertRaises(pywatchman.WatchmanError) as ctx:
+            self.watchmanCommand(
+                "subscribe", root, "bad", {"fields": ["name"], "overflow": "wat"}
+            )
+        self.assertIn("overflow must be either", str(ctx.exception))
+
+        self.watchmanCommand(
+            "subscribe", root, "dropper", {"fields": ["name"], "overflow": "drop"}
+        )
+        self.watchmanCommand("subscribe", root, "coalescer", {"fields": ["name"]})
+
+        out = self.watchmanCommand("debug-get-subscriptions", root)
+        policies = {sub["name"]: sub["overflow"] for sub in out["subscriptions"]}
+        self.assertEqual("drop", policies["dropper"])
+        self.assertEqual("coalesce", policies["coalescer"])
+        for sub in out["subscriptions"]:
+            self.assertEqual(0, sub["dropped_results"])
+            self.assertIn("max_bytes", sub["client_queue"])
+
+    def test_subscribe_many(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, "a.js")
+        self.touchRelative(root, "b.json")
+        self.watchmanCommand("watch", root)
+
+        # An invalid query means that none of them are made
+        with self.assertRaises(pywatchman.WatchmanError) as ctx:
+            self.watchmanCommand(
+                "subscribe-many",
+                root,
+                {
+                    "good": {"fields": ["name"]},
+                    "bad": {"fields": ["name"], "overflow": "wat"},
+                },
+            )
+        self.assertIn("overflow must be either", str(ctx.exception))
+        out = self.watchmanCommand("debug-get-subscriptions", root)
+        self.assertEqual([], out["subscribers"])
+
+        out = self.watchmanCommand(
+            "subscribe-many",
+            root,
+            {
+                "js": {"expression": ["suffix", "js"], "fields": ["name"]},
+                "json": {"expression": ["suffix", "json"], "fields": ["name"]},
+            },
+        )
+        self.assertCountEqual(["js", "json"], out["subscribe-many"])
+        self.assertEqual(["a.js"], out["subscriptions"]["js"]["files"])
+        self.assertEqual(["b.json"], out["subscriptions"]["json"]["files"])
+        for sub in out["subscriptions"].values():
+            self.assertTrue(sub["is_fresh_instance"])
+            self.assertIn("clock", sub)
+
+        # They are dispatched like any other subscription
+        self.touchRelative(root, "c.js")
+        dat = self.waitForSub(
+            "js",
+            root=root,
+            accept=lambda subdata: self.findSubscriptionContainingFile(
+                subdata, "c.js"
+            ),
+        )
+        self.assertNotEqual(None, dat)
+
+    def test_subscribe_glob(self):
+        root = self.mkdtemp()
+        os.makedirs(os.path.join(root, "a", "b"))
+        self.touchRelative(root, "a", "x.c")
+        self.touchRelative(root, "a", "b", "y.h")
+        self.touchRelative(root, "z.txt")
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, files=["a", "a/b", "a/b/y.h", "a/x.c", "z.txt"])
+
+        self.watchmanCommand(
+            "subscribe",
+            root,
+            "glob",
+            {"glob": ["**/*.h", "a/*.c"], "fields": ["name", "exists"]},
+        )
+        dat = self.waitForSub("glob", root=root)[0]
+        names = [f["name"] for f in dat["files"]]
+        self.assertFileListsEqual(names, ["a/b/y.h", "a/x.c"])
+
+        def containing(name):
+            name = norm_relative_path(name)
+
+            def accept(subdata):
+                for sub in subdata:
+                    files = sub.get("files", [])
+                    if name in [norm_relative_path(f["name"]) for f in files]:
+                        return sub
+                return None
+
+            return accept
+
+        def existing(sub):
+            return [
+                norm_relative_path(f["name"]) for f in sub["files"] if f["exists"]
+            ]
+
+        # Later results are matched against the files that changed, and
+        # still include the matches that didn't change
+        self.touchRelative(root, "a", "b", "w.h")
+        self.touchRelative(root, "a", "w.txt")
+        dat = self.waitForSub("glob", root=root, accept=containing("a/b/w.h"))
+        self.assertNotEqual(None, dat)
+        names = existing(dat[-1])
+        for name in ["a/b/w.h", "a/b/y.h", "a/x.c"]:
+            self.assertIn(norm_relative_path(name), names)
+
+        # The matches of a deleted dir are no longer reported as existing
+        shutil.rmtree(os.path.join(root, "a", "b"))
+        dat = self.waitForSub("glob", root=root, accept=containing("a/b/y.h"))
+        self.assertNotEqual(None, dat)
+        names = existing(dat[-1])
+        self.assertIn(norm_relative_path("a/x.c"), names)
+        self.assertNotIn(norm_relative_path("a/b/y.h"), names)
+        self.assertNotIn(norm_relative_path("a/b/w.h"), names)
+
+    def test_subscribe_dispatch_options(self):
+        root = self.mkdtemp()
+        self.watchmanCommand("watch", root)
+
+        with self.assertRaises(pywatchman.WatchmanError) as ctx:
+            self.watchmanCommand(
+                "subscribe", root, "bad", {"fields": ["name"], "dispatch": "wat"}
+            )
+        self.assertIn("dispatch must be either", str(ctx.exception))
+
+        with self.assertRaises(pywatchman.WatchmanError) as ctx:
+            self.watchmanCommand(
+                "subscribe", root, "bad", {"fields": ["name"], "min_interval_ms": -1}
+            )
+        self.assertIn("min_interval_ms must be", str(ctx.exception))
+
+        self.watchmanCommand(
+            "subscribe",
+            root,
+            "batched",
+            {
+                "fields": ["name"],
+                "dispatch": "throughput",
+                "min_interval_ms": 500,
+                "max_batch_files": 1000,
+            },
+        )
+        self.waitForSub("batched", root=root)
+
+        # The settles are held back for the interval and then dispatched,
+        # without anything else waking the client
+        self.touchRelative(root, "a")
+        self.touchRelative(root, "b")
+        dat = self.waitForSub(
+            "batched",
+            root=root,
+            accept=lambda subdata: self.findSubscriptionContainingFile(subdata, "b"),
+        )
+        self.assertNotEqual(None, dat)
+
+        out = self.watchmanCommand("debug-get-subscriptions", root)
+        dispatch = out["subscriptions"][0]["dispatch"]
+        self.assertEqual("throughput", dispatch["mode"])
+        self.assertEqual(500, dispatch["min_interval_ms"])
+        self.assertEqual(1000, dispatch["max_batch_files"])
+        self.assertGreaterEqual(dispatch["dispatches"], 1)
+        self.assertGreaterEqual(dispatch["max_latency_us"], 500000)
+
+        metrics = out["subscriptions"][0]["metrics"]
+        self.assertGreaterEqual(metrics["evaluation_us"]["count"], 1)
+        self.assertGreaterEqual(metrics["encoded_bytes"]["count"], 1)
+        self.assertGreater(metrics["encoded_bytes"]["max"], 0)
+        self.assertEqual(0, metrics["dropped_dispatches"])
+
     # TODO: Assimilate this test into test_subscribe when Watchman gets
     # unicode support.
     # TODO: Correctly test subscribe with unicode on Windows.
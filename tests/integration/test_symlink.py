@@ -63,6 +63,46 @@ class TestSymlink(WatchmanTestCase.WatchmanTestCase):
         res = self.watchmanCommand("query", root, expr)
         self.assertEqual("333", os.path.basename(res["files"][0]["symlink_target"]))
 
+    # test that the targets are read into the cache when the links are
+    # observed, and that queries then find them there
+    def test_symlinkTargetWarming(self):
+        root = self.mkdtemp()
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"symlink_target_warming": True}))
+        os.mkdir(os.path.join(root, "dir"))
+        os.symlink("target1", os.path.join(root, "link1"))
+        os.symlink("target2", os.path.join(root, "dir", "link2"))
+
+        self.watchmanCommand("watch", root)
+        self.assertFileList(
+            root, [".watchmanconfig", "dir", "dir/link2", "link1"]
+        )
+
+        def stored():
+            return self.watchmanCommand("debug-symlink-target-cache", root)[
+                "cacheStore"
+            ]
+
+        self.assertWaitForEqual(2, stored)
+
+        expr = {"expression": ["type", "l"], "fields": ["name", "symlink_target"]}
+        res = self.watchmanCommand("query", root, expr)
+        self.assertEqual(
+            [
+                {"name": "dir/link2", "symlink_target": "target2"},
+                {"name": "link1", "symlink_target": "target1"},
+            ],
+            sorted(res["files"], key=lambda k: k["name"]),
+        )
+        stats = self.watchmanCommand("debug-symlink-target-cache", root)
+        self.assertEqual(stats["cacheHit"], 2)
+        self.assertEqual(stats["cacheStore"], 2)
+
+        # A changed link is read again when it is observed
+        os.unlink(os.path.join(root, "link1"))
+        os.symlink("target3", os.path.join(root, "link1"))
+        self.assertWaitForEqual(3, stored)
+
     # test to see that invalid symbolic link
     # updates are picked up by the symlink_target field
     def test_invalidSymlink(self):
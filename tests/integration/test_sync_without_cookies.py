@@ -0,0 +1,33 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestSyncWithoutCookies(WatchmanTestCase.WatchmanTestCase):
+    def test_queriesSeePriorChanges(self):
+        root = self.mkdtemp()
+        with open(os.path.join(root, ".watchmanconfig"), "w") as f:
+            f.write(json.dumps({"sync_without_cookies": True}))
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, [".watchmanconfig"])
+
+        files = [".watchmanconfig"]
+        for i in range(20):
+            name = "file%d" % i
+            self.touchRelative(root, name)
+            files.append(name)
+            # No settling or retrying: the query has to see the file
+            # that was created before it was issued
+            res = self.watchmanCommand(
+                "query", root, {"fields": ["name"], "expression": ["exists"]}
+            )
+            self.assertFileListsEqual(res["files"], files)
@@ -0,0 +1,67 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import pywatchman
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestTaggedRequests(WatchmanTestCase.WatchmanTestCase):
+    def test_queryBatch(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, "a.txt")
+        self.touchRelative(root, "b.txt")
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, ["a.txt", "b.txt"])
+
+        responses = self.getClient().query_batch(
+            ("query", root, {"glob": ["*.txt"], "fields": ["name"]}),
+            ("clock", root, {"sync_timeout": 1000}),
+            ("query", root, {"glob": ["a.*"], "fields": ["name"]}),
+            ("version",),
+        )
+        self.assertEqual(len(responses), 4)
+        self.assertFileListsEqual(responses[0]["files"], ["a.txt", "b.txt"])
+        self.assertTrue(responses[1]["clock"])
+        self.assertFileListsEqual(responses[2]["files"], ["a.txt"])
+        self.assertTrue(responses[3]["version"])
+
+    def test_queryBatchError(self):
+        root = self.mkdtemp()
+        self.watchmanCommand("watch", root)
+
+        with self.assertRaises(pywatchman.CommandError) as ctx:
+            self.getClient().query_batch(
+                ("clock", root), ("query", root, {"expression": ["bogus"]})
+            )
+        self.assertIn("unknown expression term 'bogus'", str(ctx.exception))
+
+        # The connection is still usable once all of the responses are read
+        self.assertTrue(self.watchmanCommand("clock", root)["clock"])
+
+    def test_waitingCommandsInBatch(self):
+        # The watch has to crawl the root, and the query to sync it, before
+        # they are dispatched
+        root = self.mkdtemp()
+        self.touchRelative(root, "a.txt")
+        self.touchRelative(root, "b.txt")
+
+        responses = self.getClient().query_batch(
+            ("watch-project", root),
+            ("version",),
+        )
+        self.assertEqual(len(responses), 2)
+        self.assertTrue(responses[0]["watch"])
+        self.assertTrue(responses[1]["version"])
+
+        self.touchRelative(root, "c.txt")
+        responses = self.getClient().query_batch(
+            ("query", root, {"glob": ["*.txt"], "fields": ["name"]}),
+            ("query", root, {"glob": ["c.*"], "fields": ["name"]}),
+        )
+        self.assertFileListsEqual(responses[0]["files"], ["a.txt", "b.txt", "c.txt"])
+        self.assertFileListsEqual(responses[1]["files"], ["c.txt"])
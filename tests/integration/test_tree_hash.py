@@ -0,0 +1,86 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2020-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import os
+
+import WatchmanTestCase
+
+
+@WatchmanTestCase.expand_matrix
+class TestTreeHash(WatchmanTestCase.WatchmanTestCase):
+    def treeHashes(self, root):
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {
+                "expression": ["name", ["a", "a/b", "y", "z"], "wholename"],
+                "fields": ["name", "tree_hash"],
+            },
+        )
+        return {f["name"]: f["tree_hash"] for f in res["files"]}
+
+    def test_treeHash(self):
+        root = self.mkdtemp()
+        os.makedirs(os.path.join(root, "a", "b"))
+        os.mkdir(os.path.join(root, "y"))
+        self.touchRelative(root, "a", "b", "c")
+        self.touchRelative(root, "y", "d")
+        self.touchRelative(root, "z")
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, ["a", "a/b", "a/b/c", "y", "y/d", "z"])
+
+        before = self.treeHashes(root)
+        for name in ["a", "a/b", "y"]:
+            self.assertEqual(len(before[name]), 16, before)
+        # Files don't have one
+        self.assertIsNone(before["z"])
+        # The hashes are cached until something changes
+        self.assertEqual(before, self.treeHashes(root))
+
+        with open(os.path.join(root, "a", "b", "c"), "w") as f:
+            f.write("changed")
+
+        def changed():
+            after = self.treeHashes(root)
+            return after["a/b"] != before["a/b"] and after["a"] != before["a"]
+
+        self.assertWaitFor(changed)
+        # The dirs beside the change keep their hashes
+        self.assertEqual(self.treeHashes(root)["y"], before["y"])
+
+    def test_treeStats(self):
+        root = self.mkdtemp()
+        os.makedirs(os.path.join(root, "a", "b"))
+        with open(os.path.join(root, "a", "b", "c"), "w") as f:
+            f.write("12345")
+        with open(os.path.join(root, "a", "d"), "w") as f:
+            f.write("123")
+        self.watchmanCommand("watch", root)
+        self.assertFileList(root, ["a", "a/b", "a/b/c", "a/d"])
+
+        res = self.watchmanCommand(
+            "query",
+            root,
+            {"expression": ["name", "a"], "fields": ["name", "tree_stats"]},
+        )
+        stats = res["files"][0]["tree_stats"]
+        self.assertEqual(stats["files"], 2, stats)
+        self.assertEqual(stats["dirs"], 1, stats)
+        self.assertEqual(stats["size"], 8, stats)
+
+        os.unlink(os.path.join(root, "a", "d"))
+
+        def updated():
+            res = self.watchmanCommand(
+                "query",
+                root,
+                {"expression": ["name", "a"], "fields": ["name", "tree_stats"]},
+            )
+            stats = res["files"][0]["tree_stats"]
+            return stats["files"] == 1 and stats["size"] == 5
+
+        self.assertWaitFor(updated)
@@ -70,6 +70,74 @@ class TestTrigger(WatchmanTestCase.WatchmanTestCase):
             message="both triggers fired on update",
         )
 
+    def test_triggerStdinPipeBser(self):
+        root = self.mkdtemp()
+        # Enough names that they don't fit in the pipe all at once
+        files = ["file%d.c" % i for i in range(5000)]
+        for f in files:
+            self.touchRelative(root, f)
+
+        self.watchmanCommand("watch", root)
+
+        log = os.path.join(self.mkdtemp(), "trigger.json")
+        res = self.watchmanCommand(
+            "trigger",
+            root,
+            {
+                "name": "piped",
+                "expression": ["suffix", "c"],
+                "command": [
+                    sys.executable,
+                    os.path.join(THIS_DIR, "trigbser.py"),
+                    log,
+                ],
+                "stdin": ["name"],
+                "stdin_encoding": "bser",
+                "stdin_delivery": "pipe",
+            },
+        )
+        self.assertEqual("created", res["disposition"])
+
+        def names():
+            if not os.path.exists(log):
+                return None
+            with open(log) as f:
+                return sorted(json.load(f))
+
+        self.assertWaitForEqual(sorted(files), names)
+
+    def test_triggerRunStats(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, "foo.js")
+        self.watchmanCommand("watch", root)
+
+        log = os.path.join(self.mkdtemp(), "touched")
+        res = self.watchmanCommand(
+            "trigger",
+            root,
+            {
+                "name": "queued",
+                "expression": ["suffix", "js"],
+                "command": [sys.executable, os.path.join(THIS_DIR, "touch.py"), log],
+                "on_busy": "queue",
+                "max_concurrency": 2,
+                "priority": 1,
+            },
+        )
+        self.assertEqual("created", res["disposition"])
+        self.assertWaitFor(lambda: os.path.exists(log), message="trigger ran")
+
+        def stats():
+            res = self.watchmanCommand("trigger-list", root)
+            self.assertIn("scheduler", res)
+            return res["stats"]["queued"]
+
+        self.assertWaitFor(
+            lambda: stats()["runs"] >= 1 and stats()["running"] == 0,
+            message="the run was reaped",
+        )
+        self.assertEqual(0, stats()["failures"])
+
     def validate_trigger_output(self, root, files, context):
         trigger_log = os.path.join(root, "trigger.log")
         trigger_json = os.path.join(root, "trigger.json")
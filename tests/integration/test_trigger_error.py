@@ -74,6 +74,46 @@ class TestTriggerError(WatchmanTestCase.WatchmanTestCase):
             {"name": "oink", "command": ["cat"], "max_files_stdin": -1},
         )
 
+        self.assertTriggerRegError(
+            "stdin_encoding requires stdin to be a list of fields",
+            "trigger",
+            root,
+            {"name": "oink", "command": ["cat"], "stdin_encoding": "bser"},
+        )
+
+        self.assertTriggerRegError(
+            "stdin_encoding must be either",
+            "trigger",
+            root,
+            {
+                "name": "oink",
+                "command": ["cat"],
+                "stdin": ["name"],
+                "stdin_encoding": "xml",
+            },
+        )
+
+        self.assertTriggerRegError(
+            "stdin_delivery must be either",
+            "trigger",
+            root,
+            {"name": "oink", "command": ["cat"], "stdin_delivery": "carrier"},
+        )
+
+        self.assertTriggerRegError(
+            "max_concurrency must be >= 1",
+            "trigger",
+            root,
+            {"name": "oink", "command": ["cat"], "max_concurrency": 0},
+        )
+
+        self.assertTriggerRegError(
+            "on_busy must be either",
+            "trigger",
+            root,
+            {"name": "oink", "command": ["cat"], "on_busy": "panic"},
+        )
+
         self.assertTriggerRegError(
             "stdout: must be prefixed with either > or >>, got out",
             "trigger",
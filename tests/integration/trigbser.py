@@ -0,0 +1,21 @@
+#!/usr/bin/env python
+# no unicode literals
+from __future__ import absolute_import, division, print_function
+
+import json
+import os
+import sys
+
+from pywatchman import bser
+
+
+log_file_name = sys.argv[1]
+
+# Decode the BSER PDU on stdin and write it to the log file as json.  The
+# log is renamed into place so that it is never seen half written.
+stdin = getattr(sys.stdin, "buffer", sys.stdin)
+data = bser.loads(stdin.read(), value_encoding="utf-8")
+tmp_name = log_file_name + ".tmp"
+with open(tmp_name, "w") as f:
+    json.dump(data, f)
+os.rename(tmp_name, log_file_name)
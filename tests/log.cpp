@@ -28,5 +28,16 @@ TEST(Log, logging) {
   EXPECT_TRUE(logged);
 }
 
+TEST(Log, isEnabledOnlyWithSubscribers) {
+  // stderr only gets errors unless the server is told otherwise
+  EXPECT_FALSE(isLogEnabled(DBG));
+  EXPECT_TRUE(isLogEnabled(ERR));
+
+  auto sub = watchman::getLog().subscribe(watchman::DBG, []() {});
+  EXPECT_TRUE(isLogEnabled(DBG));
+  sub.reset();
+  EXPECT_FALSE(isLogEnabled(DBG));
+}
+
 /* vim:ts=2:sw=2:et:
  */
@@ -0,0 +1,209 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0. */
+
+#include "watchman.h"
+#include <folly/logging/xlog.h>
+#include <folly/portability/GTest.h>
+#include <map>
+#include <thread>
+
+namespace {
+
+std::map<std::string, int> collect(PendingCollection::LockedPtr& coll) {
+  std::map<std::string, int> result;
+  auto item = coll->stealItems();
+  while (item) {
+    result[std::string(item->path.data(), item->path.size())] = item->flags;
+    item = std::move(item->next);
+  }
+  return result;
+}
+
+struct Item {
+  const char* path;
+  int flags;
+};
+
+// Exercises the cases that add() consolidates: duplicates, children that
+// are pruned by or obsoleted by a recursive dir, siblings that share a
+// prefix with that dir, crawl-only children and cookies
+const Item kItems[] = {
+    {"/root/a/1", W_PENDING_VIA_NOTIFY},
+    {"/root/c/d", W_PENDING_CRAWL_ONLY},
+    {"/root/a", W_PENDING_RECURSIVE},
+    {"/root/a/2", W_PENDING_VIA_NOTIFY},
+    {"/root/a-b", W_PENDING_VIA_NOTIFY},
+    {"/root/a/b/.watchman-cookie-host-1-2", W_PENDING_VIA_NOTIFY},
+    {"/root/c", W_PENDING_VIA_NOTIFY},
+    {"/root/c", W_PENDING_RECURSIVE},
+    {"/root/c/e", W_PENDING_VIA_NOTIFY},
+    {"/root/f", W_PENDING_VIA_NOTIFY},
+};
+
+} // namespace
+
+TEST(PendingQueue, appendBatchMatchesAdd) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  PendingCollection expected;
+  auto expectedLock = expected.lock();
+  for (auto& item : kItems) {
+    expectedLock->add(w_string(item.path, W_STRING_BYTE), now, item.flags);
+  }
+
+  // Queue each item as a chain of its own, as though each came from a
+  // different batch
+  PendingCollection queued;
+  for (auto& item : kItems) {
+    queued.enqueue(std::make_shared<watchman_pending_fs>(
+        w_string(item.path, W_STRING_BYTE), now, item.flags));
+  }
+  EXPECT_TRUE(queued.hasQueued());
+
+  PendingCollection actual;
+  auto actualLock = actual.lock();
+  actualLock->appendBatch(queued.takeQueued());
+  EXPECT_FALSE(queued.hasQueued());
+
+  auto result = collect(actualLock);
+  EXPECT_EQ(collect(expectedLock), result);
+  EXPECT_EQ(
+      (std::map<std::string, int>{
+          {"/root/a", W_PENDING_RECURSIVE},
+          {"/root/a-b", W_PENDING_VIA_NOTIFY},
+          {"/root/a/b/.watchman-cookie-host-1-2", W_PENDING_VIA_NOTIFY},
+          {"/root/c", W_PENDING_VIA_NOTIFY | W_PENDING_RECURSIVE},
+          {"/root/c/d", W_PENDING_CRAWL_ONLY},
+          {"/root/f", W_PENDING_VIA_NOTIFY},
+      }),
+      result);
+}
+
+TEST(PendingQueue, appendBatchConsolidatesWithExistingItems) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  PendingCollection coll;
+  auto lock = coll.lock();
+  lock->add(w_string("/root/a", W_STRING_BYTE), now, W_PENDING_RECURSIVE);
+  lock->add(w_string("/root/b/1", W_STRING_BYTE), now, W_PENDING_VIA_NOTIFY);
+  lock->add(w_string("/root/c", W_STRING_BYTE), now, W_PENDING_VIA_NOTIFY);
+
+  PendingCollection batch;
+  {
+    auto batchLock = batch.lock();
+    batchLock->add(
+        w_string("/root/a/1", W_STRING_BYTE), now, W_PENDING_VIA_NOTIFY);
+    batchLock->add(
+        w_string("/root/b", W_STRING_BYTE), now, W_PENDING_RECURSIVE);
+    batchLock->add(
+        w_string("/root/c", W_STRING_BYTE), now, W_PENDING_RECURSIVE);
+    lock->appendBatch({batchLock->stealItems()});
+  }
+
+  EXPECT_EQ(
+      (std::map<std::string, int>{
+          {"/root/a", W_PENDING_RECURSIVE},
+          {"/root/b", W_PENDING_RECURSIVE},
+          {"/root/c", W_PENDING_VIA_NOTIFY | W_PENDING_RECURSIVE},
+      }),
+      collect(lock));
+}
+
+TEST(PendingQueue, tracksPossibleCookies) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+
+  PendingCollection coll;
+  auto lock = coll.lock();
+  lock->add(w_string("/root/a", W_STRING_BYTE), now, W_PENDING_RECURSIVE);
+  EXPECT_FALSE(lock->hasPossibleCookie());
+  // Not obsoleted by the recursive dir that contains it
+  lock->add(
+      w_string("/root/a/.watchman-cookie-host-1-2", W_STRING_BYTE),
+      now,
+      W_PENDING_VIA_NOTIFY);
+  EXPECT_TRUE(lock->hasPossibleCookie());
+
+  PendingCollection other;
+  auto otherLock = other.lock();
+  otherLock->append(&*lock);
+  EXPECT_FALSE(lock->hasPossibleCookie());
+  EXPECT_TRUE(otherLock->hasPossibleCookie());
+
+  otherLock->stealItems();
+  EXPECT_FALSE(otherLock->hasPossibleCookie());
+}
+
+// Measures the rate at which events make it from several watcher threads
+// to the consumer, both via the queue and via the lock that the
+// collection used to require
+static void run_ingest(
+    bool useQueue,
+    size_t numProducers,
+    size_t eventsPerProducer,
+    size_t batchSize) {
+  PendingCollection shared;
+  PendingCollection consumed;
+  auto consumedLock = consumed.lock();
+  struct timeval start, end;
+
+  gettimeofday(&start, nullptr);
+  std::vector<std::thread> producers;
+  for (size_t t = 0; t < numProducers; ++t) {
+    producers.emplace_back([&, t] {
+      PendingCollection local;
+      auto localLock = local.lock();
+      struct timeval now;
+      gettimeofday(&now, nullptr);
+      for (size_t i = 0; i < eventsPerProducer; ++i) {
+        localLock->add(
+            w_string::build("/some/path/dir", t, "/file", i),
+            now,
+            W_PENDING_VIA_NOTIFY);
+        if (localLock->size() >= batchSize || i + 1 == eventsPerProducer) {
+          if (useQueue) {
+            shared.enqueue(localLock->stealItems());
+          } else {
+            auto lock = shared.lock();
+            lock->append(&*localLock);
+            lock->ping();
+          }
+        }
+      }
+    });
+  }
+
+  size_t expected = numProducers * eventsPerProducer;
+  while (consumedLock->size() < expected) {
+    bool pinged;
+    {
+      auto lock = shared.lockAndWait(std::chrono::milliseconds(10), pinged);
+      consumedLock->append(&*lock);
+    }
+    consumedLock->appendBatch(shared.takeQueued());
+  }
+  gettimeofday(&end, nullptr);
+
+  for (auto& thread : producers) {
+    thread.join();
+  }
+  EXPECT_EQ(expected, consumedLock->size());
+
+  auto elapsed = w_timeval_diff(start, end);
+  XLOG(ERR) << (useQueue ? "queue" : "lock") << ": " << numProducers
+            << " producers delivered " << expected << " events in "
+            << elapsed << "s, "
+            << (elapsed > 0 ? int64_t(expected / elapsed) : 0)
+            << " events/sec";
+}
+
+TEST(PendingQueue, bench) {
+  const size_t num_producers = 4;
+  const size_t events_per_producer = 50000;
+  const size_t batch_size = WATCHMAN_BATCH_LIMIT;
+
+  run_ingest(false, num_producers, events_per_producer, batch_size);
+  run_ingest(true, num_producers, events_per_producer, batch_size);
+}
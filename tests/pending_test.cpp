@@ -101,3 +101,30 @@ TEST(Pending, bench) {
               << drained << " items into pending coll";
   }
 }
+
+TEST(Pending, onlyTheLatestStatIsKept) {
+  PendingCollection coll;
+  auto lock = coll.lock();
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  w_string path("/some/path/file", W_STRING_BYTE);
+
+  watchman::FileInformation st;
+  st.size = 1;
+  lock->add(path, now, W_PENDING_VIA_NOTIFY, &st);
+  st.size = 2;
+  lock->add(path, now, W_PENDING_VIA_NOTIFY, &st);
+  auto item = lock->stealItems();
+  ASSERT_TRUE(item);
+  ASSERT_TRUE(item->stat);
+  EXPECT_EQ(2, item->stat->size);
+
+  // A later change that came without a stat means that it has to be
+  // stat'd after all
+  lock->add(path, now, W_PENDING_VIA_NOTIFY, &st);
+  lock->add(path, now, W_PENDING_VIA_NOTIFY);
+  item = lock->stealItems();
+  ASSERT_TRUE(item);
+  EXPECT_FALSE(item->stat);
+  EXPECT_FALSE(item->next);
+}
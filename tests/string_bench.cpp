@@ -0,0 +1,192 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+/* Compares the vector and scalar forms of the string scans in StringScan.h
+ * on a set of synthetic paths:
+ *
+ *   string_bench [min seconds per measurement] [path length]
+ *
+ * For each scan this reports the MB of paths per second that each form
+ * gets through, and the speedup of the vector form. */
+
+#include "watchman_system.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+#include "StringScan.h"
+
+using namespace watchman;
+
+namespace {
+// Returns the mean time in seconds of a call to func, running it for at
+// least minTime seconds
+template <typename Func>
+double measure(Func&& func, double minTime) {
+  func();
+  size_t iterations = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (true) {
+    func();
+    ++iterations;
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (elapsed.count() >= minTime && iterations >= 3) {
+      return elapsed.count() / iterations;
+    }
+  }
+}
+
+// Paths of about len bytes, made of dir names of a few bytes to a dozen
+// or so, with a file name and suffix at the end
+std::vector<std::string> makePaths(size_t len) {
+  std::vector<std::string> paths;
+  uint32_t seed = 1;
+  auto next = [&seed](uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+  };
+  for (int i = 0; i < 10000; ++i) {
+    std::string path;
+    while (path.size() < len) {
+      path.push_back('/');
+      auto nameLen = 3 + next(10);
+      for (uint32_t j = 0; j < nameLen; ++j) {
+        path.push_back(char((next(4) == 0 ? 'A' : 'a') + next(26)));
+      }
+    }
+    path += ".Java";
+    paths.push_back(std::move(path));
+  }
+  return paths;
+}
+
+volatile size_t sink;
+} // namespace
+
+int main(int argc, char** argv) {
+  double minTime = argc > 1 ? atof(argv[1]) : 0.5;
+  size_t len = argc > 2 ? size_t(atoi(argv[2])) : 60;
+
+  auto paths = makePaths(len);
+  auto lowered = paths;
+  size_t bytes = 0;
+  for (auto& path : paths) {
+    bytes += path.size();
+  }
+  std::string buf(len * 2 + 64, 0);
+
+  struct Scan {
+    const char* name;
+    std::function<void()> vector;
+    std::function<void()> scalar;
+  };
+  // Each scan runs over every path, and sums something from each result so
+  // that the work can't be skipped
+  std::vector<Scan> scans{
+      {"findLastSlash",
+       [&] {
+         size_t sum = 0;
+         for (auto& p : paths) {
+           sum += strscan::findLastSlash(p.data(), p.data() + p.size()) -
+               p.data();
+         }
+         sink = sum;
+       },
+       [&] {
+         size_t sum = 0;
+         for (auto& p : paths) {
+           sum += strscan::scalar::findLastSlash(
+                      p.data(), p.data() + p.size()) -
+               p.data();
+         }
+         sink = sum;
+       }},
+      {"findLastSlashOrDot",
+       [&] {
+         size_t sum = 0;
+         for (auto& p : paths) {
+           sum += strscan::findLastSlashOrDot(p.data(), p.data() + p.size()) -
+               p.data();
+         }
+         sink = sum;
+       },
+       [&] {
+         size_t sum = 0;
+         for (auto& p : paths) {
+           sum += strscan::scalar::findLastSlashOrDot(
+                      p.data(), p.data() + p.size()) -
+               p.data();
+         }
+         sink = sum;
+       }},
+      {"toLower",
+       [&] {
+         for (auto& p : paths) {
+           strscan::toLower(&buf[0], p.data(), p.size());
+         }
+         sink = buf[0];
+       },
+       [&] {
+         for (auto& p : paths) {
+           strscan::scalar::toLower(&buf[0], p.data(), p.size());
+         }
+         sink = buf[0];
+       }},
+      {"equalCaseless",
+       [&] {
+         size_t sum = 0;
+         for (size_t i = 0; i < paths.size(); ++i) {
+           auto& p = paths[i];
+           sum += strscan::equalCaseless(
+               p.data(), lowered[i].data(), p.size());
+         }
+         sink = sum;
+       },
+       [&] {
+         size_t sum = 0;
+         for (size_t i = 0; i < paths.size(); ++i) {
+           auto& p = paths[i];
+           sum += strscan::scalar::equalCaseless(
+               p.data(), lowered[i].data(), p.size());
+         }
+         sink = sum;
+       }},
+      {"replaceSlashes",
+       [&] {
+         for (auto& p : paths) {
+           strscan::replaceSlashes(&buf[0], p.data(), p.size(), '\\');
+         }
+         sink = buf[0];
+       },
+       [&] {
+         for (auto& p : paths) {
+           strscan::scalar::replaceSlashes(&buf[0], p.data(), p.size(), '\\');
+         }
+         sink = buf[0];
+       }},
+  };
+  for (auto& p : lowered) {
+    strscan::scalar::toLower(&p[0], p.data(), p.size());
+  }
+
+  printf(
+      "%-20s %14s %14s %8s\n",
+      "scan",
+      "vector MB/s",
+      "scalar MB/s",
+      "speedup");
+  for (auto& scan : scans) {
+    auto vectorTime = measure(scan.vector, minTime);
+    auto scalarTime = measure(scan.scalar, minTime);
+    printf(
+        "%-20s %14.1f %14.1f %7.2fx\n",
+        scan.name,
+        bytes / vectorTime / 1e6,
+        bytes / scalarTime / 1e6,
+        scalarTime / vectorTime);
+  }
+  return 0;
+}
@@ -6,6 +6,8 @@
 #include <folly/logging/xlog.h>
 #include <folly/portability/GTest.h>
 #include <string>
+#include <vector>
+#include "StringScan.h"
 
 TEST(String, fmt) {
   EXPECT_EQ(w_string::format("hello {}", "world"), w_string("hello world"));
@@ -385,3 +387,120 @@ TEST(String, path_equal) {
       << "strict case in the other positions c:/Foo/bar";
 #endif
 }
+
+namespace {
+// Makes strings of every length around the 16 byte blocks of the vector
+// scans, sprinkled with the bytes that they look for, including ones with
+// the top bit set, which mustn't be mistaken for them
+std::vector<std::string> makeScanInputs() {
+  static const char alphabet[] = "aZ/\\.Q_\x80\xc1\xda\xfa";
+  std::vector<std::string> inputs;
+  uint32_t seed = 1;
+  for (size_t len = 0; len <= 70; ++len) {
+    for (int variant = 0; variant < 8; ++variant) {
+      std::string s;
+      for (size_t i = 0; i < len; ++i) {
+        seed = seed * 1103515245 + 12345;
+        // Mostly plain letters, so that the interesting bytes turn up in
+        // some blocks and not in others
+        auto r = (seed >> 16) % 64;
+        s.push_back(
+            r < sizeof(alphabet) - 1 ? alphabet[r] : char('a' + r % 26));
+      }
+      inputs.push_back(std::move(s));
+    }
+  }
+  return inputs;
+}
+} // namespace
+
+TEST(String, vector_scans_match_scalar) {
+  using namespace watchman;
+  auto inputs = makeScanInputs();
+  for (auto& s : inputs) {
+    auto begin = s.data();
+    auto end = begin + s.size();
+    EXPECT_EQ(
+        strscan::scalar::findLastSlash(begin, end),
+        strscan::findLastSlash(begin, end))
+        << s;
+    EXPECT_EQ(
+        strscan::scalar::findLastSlashOrDot(begin, end),
+        strscan::findLastSlashOrDot(begin, end))
+        << s;
+
+    std::string lower(s.size(), 0);
+    std::string expected(s.size(), 0);
+    strscan::toLower(&lower[0], begin, s.size());
+    strscan::scalar::toLower(&expected[0], begin, s.size());
+    EXPECT_EQ(expected, lower);
+    for (size_t i = 0; i < s.size(); ++i) {
+      EXPECT_EQ(char(tolower(uint8_t(s[i]))), lower[i]) << s;
+    }
+    EXPECT_EQ(lower != s, strscan::hasUpper(begin, s.size())) << s;
+    EXPECT_EQ(
+        strscan::scalar::hasUpper(begin, s.size()),
+        strscan::hasUpper(begin, s.size()))
+        << s;
+
+    std::string replaced(s.size(), 0);
+    strscan::replaceSlashes(&replaced[0], begin, s.size(), '/');
+    strscan::scalar::replaceSlashes(&expected[0], begin, s.size(), '/');
+    EXPECT_EQ(expected, replaced);
+
+    // Compare with a copy that differs at each position in turn
+    for (size_t i = 0; i < s.size(); ++i) {
+      for (char c : {'a', 'A', '/', '\\', '\x80'}) {
+        auto other = s;
+        other[i] = c;
+        EXPECT_EQ(
+            strscan::scalar::equalCaseless(begin, other.data(), s.size()),
+            strscan::equalCaseless(begin, other.data(), s.size()))
+            << s << " vs " << other;
+        EXPECT_EQ(
+            strscan::scalar::equalAsPaths(begin, other.data(), s.size()),
+            strscan::equalAsPaths(begin, other.data(), s.size()))
+            << s << " vs " << other;
+      }
+    }
+  }
+}
+
+TEST(String, find) {
+  using namespace watchman;
+  auto inputs = makeScanInputs();
+  for (auto& hay : inputs) {
+    // Needles taken from the haystack itself, and some that aren't in it
+    std::vector<std::string> needles{"", "a", "/\\", "zzzzzzzz"};
+    for (size_t len : {1, 2, 5, 17}) {
+      if (hay.size() >= len) {
+        needles.push_back(hay.substr(hay.size() - len));
+        needles.push_back(hay.substr(hay.size() / 2, len / 2 + 1));
+      }
+    }
+    for (auto& needle : needles) {
+      auto pos = hay.find(needle);
+      EXPECT_EQ(
+          pos == std::string::npos ? nullptr : hay.data() + pos,
+          strscan::find(hay.data(), hay.size(), needle.data(), needle.size()))
+          << hay << " / " << needle;
+    }
+  }
+}
+
+TEST(String, long_paths) {
+  // Long enough that the separators are found in the vector loops
+  std::string dir = "/some/fairly/long/directory/name/that/spans/blocks";
+  std::string file = dir + "/and.a.file.Name.TXT";
+  w_string_piece path(file);
+  EXPECT_EQ(w_string_piece(dir), path.dirName());
+  EXPECT_EQ(w_string_piece("and.a.file.Name.TXT"), path.baseName());
+  EXPECT_EQ(w_string_piece("TXT"), path.suffix());
+  std::string lower = dir + "/and.a.file.name.txt";
+  EXPECT_EQ(w_string(lower.data(), lower.size()), path.asLowerCase());
+  EXPECT_TRUE(path.startsWithCaseInsensitive("/SOME/FAIRLY/LONG/DIRECTORY"));
+  EXPECT_FALSE(path.startsWithCaseInsensitive("/SOME/FAIRLY/LONG/DIRECTORX"));
+
+  std::string noSuffix = dir + ".d/and_a_file_name_without_a_suffix";
+  EXPECT_EQ(w_string_piece(nullptr), w_string_piece(noSuffix).suffix());
+}
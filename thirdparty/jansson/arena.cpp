@@ -0,0 +1,156 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include "jansson.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace {
+// The most chunks that each thread keeps for reuse
+constexpr size_t kMaxPooledChunks = 16;
+
+static_assert(
+    (JsonArena::kChunkSize & (JsonArena::kChunkSize - 1)) == 0,
+    "chunk size must be a power of two");
+
+void* allocateChunk() {
+#ifdef _WIN32
+  auto chunk = _aligned_malloc(JsonArena::kChunkSize, JsonArena::kChunkSize);
+  if (!chunk) {
+    throw std::bad_alloc();
+  }
+  return chunk;
+#else
+  void* chunk;
+  if (posix_memalign(&chunk, JsonArena::kChunkSize, JsonArena::kChunkSize)) {
+    throw std::bad_alloc();
+  }
+  return chunk;
+#endif
+}
+
+void freeChunk(void* chunk) {
+#ifdef _WIN32
+  _aligned_free(chunk);
+#else
+  free(chunk);
+#endif
+}
+
+// Arenas tend to be made and released at the same rate on a thread, so the
+// chunks of the last one are kept for the next
+struct ChunkPool {
+  std::vector<void*> chunks;
+
+  ~ChunkPool() {
+    for (auto chunk : chunks) {
+      freeChunk(chunk);
+    }
+  }
+
+  void* take() {
+    if (chunks.empty()) {
+      return allocateChunk();
+    }
+    auto chunk = chunks.back();
+    chunks.pop_back();
+    return chunk;
+  }
+
+  void give(void* chunk) {
+    if (chunks.size() >= kMaxPooledChunks) {
+      freeChunk(chunk);
+      return;
+    }
+    chunks.push_back(chunk);
+  }
+};
+
+ChunkPool& chunkPool() {
+  static thread_local ChunkPool pool;
+  return pool;
+}
+
+thread_local JsonArena* currentArena = nullptr;
+
+constexpr size_t alignUp(size_t size) {
+  return (size + alignof(std::max_align_t) - 1) &
+      ~(alignof(std::max_align_t) - 1);
+}
+} // namespace
+
+struct JsonArena::Chunk {
+  JsonArena* arena;
+  Chunk* next;
+};
+
+JsonArena::Ptr JsonArena::make() {
+  return Ptr(new JsonArena());
+}
+
+void JsonArena::Release::operator()(JsonArena* arena) const {
+  // Values that are still alive keep the arena until they are deallocated
+  if (currentArena == arena) {
+    currentArena = nullptr;
+  }
+  arena->unref();
+}
+
+JsonArena::~JsonArena() {
+  auto& pool = chunkPool();
+  while (chunks_) {
+    auto chunk = chunks_;
+    chunks_ = chunk->next;
+    pool.give(chunk);
+  }
+}
+
+void JsonArena::unref() {
+  if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete this;
+  }
+}
+
+JsonArena* JsonArena::current() {
+  return currentArena;
+}
+
+void* JsonArena::allocate(size_t size) {
+  constexpr size_t kChunkHeaderSize = alignUp(sizeof(Chunk));
+  size = alignUp(size);
+  assert(size <= kChunkSize - kChunkHeaderSize);
+  if (size_t(end_ - next_) < size) {
+    auto chunk = static_cast<Chunk*>(chunkPool().take());
+    chunk->arena = this;
+    chunk->next = chunks_;
+    chunks_ = chunk;
+    next_ = reinterpret_cast<char*>(chunk) + kChunkHeaderSize;
+    end_ = reinterpret_cast<char*>(chunk) + kChunkSize;
+  }
+  auto ptr = next_;
+  next_ += size;
+  refs_.fetch_add(1, std::memory_order_relaxed);
+  return ptr;
+}
+
+void JsonArena::deallocate(void* ptr) {
+  // The memory itself is only reclaimed along with the whole arena
+  auto chunk = reinterpret_cast<Chunk*>(
+      reinterpret_cast<uintptr_t>(ptr) & ~uintptr_t(kChunkSize - 1));
+  chunk->arena->unref();
+}
+
+JsonArenaScope::JsonArenaScope(JsonArena* arena) : prior_(currentArena) {
+  currentArena = arena;
+}
+
+JsonArenaScope::~JsonArenaScope() {
+  currentArena = prior_;
+}
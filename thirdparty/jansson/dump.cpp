@@ -70,46 +70,45 @@ static int dump_string(
     json_dump_callback_t dump,
     void* data,
     size_t flags) {
-  const char *pos, *end;
+  const char* end = str + strlen(str);
+  /* the start of the text that has yet to be dumped, and how far it has
+     been checked */
+  const char* run = str;
+  const char* pos = str;
   int32_t codepoint;
 
   if (dump("\"", 1, data))
     return -1;
 
-  end = pos = str;
   while (1) {
     const char* text;
     char seq[13];
     int length;
 
-    while (*end) {
-      end = utf8_iterate(pos, &codepoint);
-      if (!end) {
-        return -1;
-      }
-
-      /* mandatory escape or control char */
-      if (codepoint == '\\' || codepoint == '"' || codepoint < 0x20)
-        break;
-
-      /* slash */
-      if ((flags & JSON_ESCAPE_SLASH) && codepoint == '/')
-        break;
+    /* skip over plain ASCII in bulk, which leaves the characters that
+       may have to be escaped and the ones that have to be validated */
+    const char* next = jsonp_scan_plain(pos, end);
+    if (flags & JSON_ESCAPE_SLASH) {
+      auto slash = (const char*)memchr(pos, '/', next - pos);
+      if (slash)
+        next = slash;
+    }
+    if (next == end)
+      break;
 
-      /* non-ASCII */
-      if ((flags & JSON_ENSURE_ASCII) && codepoint > 0x7F)
-        break;
+    pos = utf8_iterate(next, &codepoint);
+    if (!pos)
+      return -1;
 
-      pos = end;
-    }
+    /* non-ASCII that can be dumped as it is */
+    if (codepoint > 0x7F && !(flags & JSON_ENSURE_ASCII))
+      continue;
 
-    if (pos != str) {
-      if (dump(str, pos - str, data))
+    if (next != run) {
+      if (dump(run, next - run, data))
         return -1;
     }
-
-    if (end == pos)
-      break;
+    run = pos;
 
     /* handle \, /, ", and control codes */
     length = 2;
@@ -164,8 +163,11 @@ static int dump_string(
 
     if (dump(text, length, data))
       return -1;
+  }
 
-    str = pos = end;
+  if (end != run) {
+    if (dump(run, end - run, data))
+      return -1;
   }
 
   return dump("\"", 1, data);
@@ -235,7 +237,9 @@ static int do_dump(
         return -1;
 
       for (i = 0; i < n; ++i) {
-        if (do_dump(json_array_get(json, i), flags, depth + 1, dump, data)) {
+        // Borrowed rather than referenced: see JsonArena
+        if (do_dump(
+                json_to_array(json)->table[i], flags, depth + 1, dump, data)) {
           return -1;
         }
 
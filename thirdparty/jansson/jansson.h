@@ -15,6 +15,7 @@
 #include <unordered_map>
 #include <string>
 #include <atomic>
+#include <memory>
 #include <vector>
 #include "jansson_config.h"
 #include "utf.h"
@@ -49,6 +50,9 @@ typedef enum {
 
 struct json_t {
   json_type type;
+  // Set for values that were allocated from a JsonArena, whose reference
+  // counts are only ever touched by one thread at a time
+  bool arena{false};
   std::atomic<size_t> refcount;
 
   explicit json_t(json_type type);
@@ -75,14 +79,30 @@ class json_ref {
   json_t* ref_;
 
   static inline json_t* incref(json_t* json) {
-    if (json && json->refcount != (size_t)-1) {
+    if (!json) {
+      return json;
+    }
+    if (json->arena) {
+      json->refcount.store(
+          json->refcount.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+    } else if (json->refcount != (size_t)-1) {
       ++json->refcount;
     }
     return json;
   }
 
   static inline void decref(json_t* json) {
-    if (json && json->refcount != (size_t)-1 && --json->refcount == 0) {
+    if (!json) {
+      return;
+    }
+    if (json->arena) {
+      auto refcount = json->refcount.load(std::memory_order_relaxed) - 1;
+      json->refcount.store(refcount, std::memory_order_relaxed);
+      if (refcount == 0) {
+        json_delete(json);
+      }
+    } else if (json->refcount != (size_t)-1 && --json->refcount == 0) {
       json_delete(json);
     }
   }
@@ -225,6 +245,71 @@ json_ref json_false(void);
 #define json_boolean(val) ((val) ? json_true() : json_false())
 json_ref json_null(void);
 
+/* arena allocation */
+
+// A region that json values are allocated from in bulk, for values that
+// are built and thrown away together, such as the rows of the results of
+// a query.  The values made on a thread while a JsonArenaScope is in
+// effect come from its arena rather than from the heap.
+//
+// The reference counts of arena values are not atomic, so such a value
+// must only be used by one thread at a time: it may be handed over to
+// another thread along with whatever holds it, but not referenced from
+// two threads at once.  Encoding a value doesn't touch the reference
+// counts of its members, so values held by a heap allocated container can
+// be encoded by several threads at once.  Values that are kept beyond the
+// work that they were built for should be copied with json_promote.
+//
+// The memory of an arena is released once the arena itself has been
+// released and none of its values remain.
+class JsonArena {
+ public:
+  // The granularity that memory is taken from the system in; it is a
+  // power of two and chunks are aligned to it
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  struct Release {
+    void operator()(JsonArena* arena) const;
+  };
+  using Ptr = std::unique_ptr<JsonArena, Release>;
+
+  static Ptr make();
+
+  // The arena that values made on this thread are allocated from, if any
+  static JsonArena* current();
+
+  // Returns size bytes, suitably aligned for any json value
+  void* allocate(size_t size);
+  // Releases memory that was returned by allocate(), of any arena
+  static void deallocate(void* ptr);
+
+ private:
+  struct Chunk;
+
+  JsonArena() = default;
+  ~JsonArena();
+  void unref();
+
+  Chunk* chunks_{nullptr};
+  char* next_{nullptr};
+  char* end_{nullptr};
+  // One for the Ptr and one for each value that hasn't been deallocated
+  std::atomic<size_t> refs_{1};
+};
+
+// Makes arena the one that json values made on this thread come from,
+// until the scope is left.  A null arena allocates them from the heap.
+class JsonArenaScope {
+ public:
+  explicit JsonArenaScope(JsonArena* arena);
+  ~JsonArenaScope();
+  JsonArenaScope(const JsonArenaScope&) = delete;
+  JsonArenaScope& operator=(const JsonArenaScope&) = delete;
+
+ private:
+  JsonArena* prior_;
+};
+
 /* error reporting */
 
 #define JSON_ERROR_TEXT_LENGTH 160
@@ -308,6 +393,9 @@ int json_equal(json_t* value1, json_t* value2);
 
 json_ref json_copy(const json_t* value);
 json_ref json_deep_copy(const json_t* value);
+/* Returns value if it doesn't hold anything that was allocated from a
+   JsonArena, otherwise a deep copy of it that was allocated on the heap */
+json_ref json_promote(const json_t* value);
 
 /* decoding */
 
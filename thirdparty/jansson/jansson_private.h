@@ -105,6 +105,11 @@ void jsonp_error_vset(
 int jsonp_strtod(std::string& strbuffer, double* out);
 int jsonp_dtostr(char* buffer, size_t size, double value);
 
+/* Returns the first byte in [p, end) that isn't a plain ASCII character
+   of a string: a quote, a backslash, a control character or part of a
+   multibyte UTF-8 sequence.  Returns end if there is none. */
+const char* jsonp_scan_plain(const char* p, const char* end);
+
 /* Windows compatibility */
 #ifdef _WIN32
 #define snprintf _snprintf
@@ -11,9 +11,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits>
 
 #include "jansson.h"
 #include "jansson_private.h"
@@ -833,6 +835,412 @@ json_ref json_loads(const char* string, size_t flags, json_error_t* error) {
   return result;
 }
 
+/*** parser for buffers ***/
+
+namespace {
+// Parses a document that is held in memory, as the PDUs of JSON clients
+// are.  It works on the buffer directly, rather than through the stream
+// that the lexer reads a byte at a time, and skips over the plain ASCII
+// parts of strings in bulk.  It only knows how to accept a document: when
+// it comes across anything that is not valid, it gives up and the lexer
+// based parser is run over the buffer to describe the error.
+class buffer_parser {
+ public:
+  buffer_parser(const char* buffer, size_t buflen, size_t flags)
+      : start_(buffer), p_(buffer), end_(buffer + buflen), flags_(flags) {}
+
+  // Returns nullptr if the document could not be parsed.  Otherwise
+  // position is set to how far into the buffer the document ends.
+  json_ref parse(size_t* position);
+
+ private:
+  json_ref parse_value();
+  json_ref parse_object();
+  json_ref parse_array();
+  json_ref parse_number();
+  json_ref parse_literal(const char* literal, size_t len, json_ref value);
+  bool parse_string(w_string& out);
+  bool decode_escape();
+  bool read_hex4(int32_t* value);
+
+  void skip_whitespace() {
+    while (p_ < end_ &&
+           (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) {
+      ++p_;
+    }
+  }
+
+  const char* const start_;
+  const char* p_;
+  const char* const end_;
+  const size_t flags_;
+  // Strings that have escapes are decoded into this, as are numbers that
+  // are converted by jsonp_strtod
+  std::string scratch_;
+};
+
+json_ref buffer_parser::parse(size_t* position) {
+  skip_whitespace();
+  if (p_ == end_) {
+    return nullptr;
+  }
+  if (!(flags_ & JSON_DECODE_ANY) && *p_ != '[' && *p_ != '{') {
+    return nullptr;
+  }
+
+  auto result = parse_value();
+  if (!result) {
+    return nullptr;
+  }
+
+  if (!(flags_ & JSON_DISABLE_EOF_CHECK)) {
+    skip_whitespace();
+    if (p_ != end_) {
+      return nullptr;
+    }
+  }
+
+  *position = p_ - start_;
+  return result;
+}
+
+json_ref buffer_parser::parse_value() {
+  if (p_ == end_) {
+    return nullptr;
+  }
+  switch (*p_) {
+    case '{':
+      return parse_object();
+    case '[':
+      return parse_array();
+    case '"': {
+      w_string str;
+      if (!parse_string(str)) {
+        return nullptr;
+      }
+      return w_string_to_json(str);
+    }
+    case 't':
+      return parse_literal("true", 4, json_true());
+    case 'f':
+      return parse_literal("false", 5, json_false());
+    case 'n':
+      return parse_literal("null", 4, json_null());
+    default:
+      if (*p_ == '-' || l_isdigit(*p_)) {
+        return parse_number();
+      }
+      return nullptr;
+  }
+}
+
+json_ref buffer_parser::parse_object() {
+  auto object = json_object();
+  auto& map = json_to_object(object)->map;
+
+  ++p_;
+  skip_whitespace();
+  if (p_ < end_ && *p_ == '}') {
+    ++p_;
+    return object;
+  }
+
+  while (true) {
+    // Empty keys are rejected, as they are by parse_object()
+    w_string key;
+    if (p_ == end_ || *p_ != '"' || !parse_string(key) || key.empty()) {
+      return nullptr;
+    }
+    if ((flags_ & JSON_REJECT_DUPLICATES) && map.find(key) != map.end()) {
+      return nullptr;
+    }
+
+    skip_whitespace();
+    if (p_ == end_ || *p_ != ':') {
+      return nullptr;
+    }
+    ++p_;
+    skip_whitespace();
+
+    auto value = parse_value();
+    if (!value) {
+      return nullptr;
+    }
+    map[key] = std::move(value);
+
+    skip_whitespace();
+    if (p_ == end_) {
+      return nullptr;
+    }
+    if (*p_ == '}') {
+      ++p_;
+      return object;
+    }
+    if (*p_ != ',') {
+      return nullptr;
+    }
+    ++p_;
+    skip_whitespace();
+  }
+}
+
+json_ref buffer_parser::parse_array() {
+  auto array = json_array();
+  auto& table = json_to_array(array)->table;
+
+  ++p_;
+  skip_whitespace();
+  if (p_ < end_ && *p_ == ']') {
+    ++p_;
+    return array;
+  }
+
+  while (true) {
+    auto elem = parse_value();
+    if (!elem) {
+      return nullptr;
+    }
+    table.emplace_back(std::move(elem));
+
+    skip_whitespace();
+    if (p_ == end_) {
+      return nullptr;
+    }
+    if (*p_ == ']') {
+      ++p_;
+      return array;
+    }
+    if (*p_ != ',') {
+      return nullptr;
+    }
+    ++p_;
+    skip_whitespace();
+  }
+}
+
+json_ref
+buffer_parser::parse_literal(const char* literal, size_t len, json_ref value) {
+  if (size_t(end_ - p_) < len || memcmp(p_, literal, len) != 0) {
+    return nullptr;
+  }
+  p_ += len;
+  // The lexer reads a whole identifier, so that "truex" isn't "true"
+  if (p_ < end_ && l_isalpha(*p_)) {
+    return nullptr;
+  }
+  return value;
+}
+
+json_ref buffer_parser::parse_number() {
+  auto number = p_;
+  bool negative = false;
+  bool real = false;
+
+  if (*p_ == '-') {
+    negative = true;
+    ++p_;
+  }
+  if (p_ == end_ || !l_isdigit(*p_)) {
+    return nullptr;
+  }
+  if (*p_ == '0') {
+    ++p_;
+    if (p_ < end_ && l_isdigit(*p_)) {
+      return nullptr;
+    }
+  } else {
+    while (p_ < end_ && l_isdigit(*p_)) {
+      ++p_;
+    }
+  }
+
+  if (p_ < end_ && *p_ == '.') {
+    ++p_;
+    if (p_ == end_ || !l_isdigit(*p_)) {
+      return nullptr;
+    }
+    while (p_ < end_ && l_isdigit(*p_)) {
+      ++p_;
+    }
+    real = true;
+  }
+
+  if (p_ < end_ && (*p_ == 'E' || *p_ == 'e')) {
+    ++p_;
+    if (p_ < end_ && (*p_ == '+' || *p_ == '-')) {
+      ++p_;
+    }
+    if (p_ == end_ || !l_isdigit(*p_)) {
+      return nullptr;
+    }
+    while (p_ < end_ && l_isdigit(*p_)) {
+      ++p_;
+    }
+    real = true;
+  }
+
+  if (real) {
+    scratch_.assign(number, p_ - number);
+    double value;
+    if (jsonp_strtod(scratch_, &value)) {
+      return nullptr;
+    }
+    return json_real(value);
+  }
+
+  // Integers that are out of range are left to the lexer to report
+  uint64_t magnitude = 0;
+  for (auto digit = number + negative; digit < p_; ++digit) {
+    auto d = uint64_t(*digit - '0');
+    if (magnitude > (UINT64_MAX - d) / 10) {
+      return nullptr;
+    }
+    magnitude = magnitude * 10 + d;
+  }
+  auto limit = uint64_t(std::numeric_limits<json_int_t>::max());
+  if (magnitude > limit + negative) {
+    return nullptr;
+  }
+  return json_integer(
+      negative && magnitude ? -json_int_t(magnitude - 1) - 1
+                            : json_int_t(magnitude));
+}
+
+bool buffer_parser::parse_string(w_string& out) {
+  auto run = ++p_;
+  bool escaped = false;
+
+  while (true) {
+    p_ = jsonp_scan_plain(p_, end_);
+    if (p_ == end_) {
+      return false;
+    }
+
+    auto c = (unsigned char)*p_;
+    if (c == '"') {
+      break;
+    }
+    if (c >= 0x80) {
+      int count = utf8_check_first(*p_);
+      if (!count || end_ - p_ < count ||
+          !utf8_check_full(p_, count, nullptr)) {
+        return false;
+      }
+      p_ += count;
+      continue;
+    }
+    if (c != '\\') {
+      // A control character
+      return false;
+    }
+
+    if (!escaped) {
+      scratch_.clear();
+      escaped = true;
+    }
+    scratch_.append(run, p_ - run);
+    if (!decode_escape()) {
+      return false;
+    }
+    run = p_;
+  }
+
+  if (escaped) {
+    scratch_.append(run, p_ - run);
+    out = w_string(scratch_.data(), scratch_.size(), W_STRING_BYTE);
+  } else {
+    out = w_string(run, p_ - run, W_STRING_BYTE);
+  }
+  ++p_;
+  return true;
+}
+
+bool buffer_parser::read_hex4(int32_t* value) {
+  if (end_ - p_ < 4) {
+    return false;
+  }
+  int32_t result = 0;
+  for (int i = 0; i < 4; ++i) {
+    char c = *p_++;
+    result <<= 4;
+    if (l_isdigit(c)) {
+      result += c - '0';
+    } else if ('a' <= c && c <= 'f') {
+      result += c - 'a' + 10;
+    } else if ('A' <= c && c <= 'F') {
+      result += c - 'A' + 10;
+    } else {
+      return false;
+    }
+  }
+  *value = result;
+  return true;
+}
+
+// Appends the character that the escape at p_ stands for to scratch_, with
+// the same checks as lex_scan_string()
+bool buffer_parser::decode_escape() {
+  if (end_ - p_ < 2) {
+    return false;
+  }
+  char c = p_[1];
+  p_ += 2;
+
+  switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      scratch_.push_back(c);
+      return true;
+    case 'b':
+      scratch_.push_back('\b');
+      return true;
+    case 'f':
+      scratch_.push_back('\f');
+      return true;
+    case 'n':
+      scratch_.push_back('\n');
+      return true;
+    case 'r':
+      scratch_.push_back('\r');
+      return true;
+    case 't':
+      scratch_.push_back('\t');
+      return true;
+    case 'u':
+      break;
+    default:
+      return false;
+  }
+
+  int32_t value;
+  if (!read_hex4(&value)) {
+    return false;
+  }
+  if (0xD800 <= value && value <= 0xDBFF) {
+    int32_t value2;
+    if (end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u') {
+      return false;
+    }
+    p_ += 2;
+    if (!read_hex4(&value2) || value2 < 0xDC00 || value2 > 0xDFFF) {
+      return false;
+    }
+    value = ((value - 0xD800) << 10) + (value2 - 0xDC00) + 0x10000;
+  } else if ((0xDC00 <= value && value <= 0xDFFF) || value == 0) {
+    return false;
+  }
+
+  char buffer[4];
+  int length;
+  if (utf8_encode(value, buffer, &length)) {
+    return false;
+  }
+  scratch_.append(buffer, length);
+  return true;
+}
+} // namespace
+
 typedef struct {
   const char* data;
   size_t len;
@@ -865,6 +1273,15 @@ json_ref json_loadb(
     return nullptr;
   }
 
+  size_t position;
+  auto result = buffer_parser(buffer, buflen, flags).parse(&position);
+  if (result) {
+    if (error) {
+      error->position = position;
+    }
+    return result;
+  }
+
   stream_data.data = buffer;
   stream_data.pos = 0;
   stream_data.len = buflen;
@@ -872,9 +1289,7 @@ json_ref json_loadb(
   if (lex_init(&lex, buffer_get, (void*)&stream_data))
     return nullptr;
 
-  auto result = parse_json(&lex, flags, error);
-
-  return result;
+  return parse_json(&lex, flags, error);
 }
 
 json_ref json_loadf(FILE* input, size_t flags, json_error_t* error) {
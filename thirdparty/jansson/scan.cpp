@@ -0,0 +1,69 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#include <folly/lang/Bits.h>
+#include <stdint.h>
+#include <string.h>
+#include "jansson_private.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define JSONP_HAVE_SSE2 1
+#endif
+
+namespace {
+inline bool is_plain(unsigned char c) {
+  return c >= 0x20 && c < 0x80 && c != '"' && c != '\\';
+}
+
+#ifndef JSONP_HAVE_SSE2
+constexpr uint64_t kOnes = ~uint64_t(0) / 255;
+constexpr uint64_t kHighBits = kOnes * 0x80;
+
+// Non-zero if any byte of word is zero
+inline uint64_t has_zero_byte(uint64_t word) {
+  return (word - kOnes) & ~word & kHighBits;
+}
+#endif
+} // namespace
+
+const char* jsonp_scan_plain(const char* p, const char* end) {
+#ifdef JSONP_HAVE_SSE2
+  const auto quote = _mm_set1_epi8('"');
+  const auto backslash = _mm_set1_epi8('\\');
+  const auto space = _mm_set1_epi8(0x20);
+  while (end - p >= 16) {
+    auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    // The comparison is signed, so the bytes from 0x80 up are less than a
+    // space too
+    auto special = _mm_or_si128(
+        _mm_cmplt_epi8(chunk, space),
+        _mm_or_si128(
+            _mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+    auto mask = unsigned(_mm_movemask_epi8(special));
+    if (mask) {
+      return p + folly::findFirstSet(mask) - 1;
+    }
+    p += 16;
+  }
+#else
+  // Test a word at a time, and find the byte within the word the slow
+  // way, which saves caring about the byte order
+  while (end - p >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    auto special = (word & kHighBits) |
+        ((word - kOnes * 0x20) & ~word & kHighBits) |
+        has_zero_byte(word ^ (kOnes * '"')) |
+        has_zero_byte(word ^ (kOnes * '\\'));
+    if (special) {
+      break;
+    }
+    p += 8;
+  }
+#endif
+  while (p < end && is_plain(*p)) {
+    ++p;
+  }
+  return p;
+}
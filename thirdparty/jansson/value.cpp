@@ -13,7 +13,9 @@
 
 #include <algorithm>
 #include <cmath>
+#include <new>
 #include <string>
+#include <utility>
 
 #include "watchman_string.h"
 #include "utf.h"
@@ -71,6 +73,39 @@ json_t::json_t(json_type type) : type(type), refcount(1) {}
 json_t::json_t(json_type type, json_t::SingletonHack&&)
     : type(type), refcount(-1) {}
 
+namespace {
+// Constructs a value of type T in the arena that is current on this
+// thread, if there is one, and on the heap otherwise
+template <typename T, typename... Args>
+json_ref make_value(Args&&... args) {
+  T* value;
+  if (auto arena = JsonArena::current()) {
+    auto ptr = arena->allocate(sizeof(T));
+    try {
+      value = new (ptr) T(std::forward<Args>(args)...);
+    } catch (...) {
+      JsonArena::deallocate(ptr);
+      throw;
+    }
+    value->json.arena = true;
+  } else {
+    value = new T(std::forward<Args>(args)...);
+  }
+  return json_ref(&value->json, false);
+}
+
+template <typename T>
+void delete_value(json_t* json) {
+  auto value = reinterpret_cast<T*>(json);
+  if (json->arena) {
+    value->~T();
+    JsonArena::deallocate(value);
+  } else {
+    delete value;
+  }
+}
+} // namespace
+
 bool json_ref::asBool() const {
   switch (type()) {
     case JSON_TRUE:
@@ -103,8 +138,7 @@ json_object_t::json_object_t(size_t sizeHint) : json(JSON_OBJECT) {
 }
 
 json_ref json_object_of_size(size_t size) {
-  auto object = new json_object_t(size);
-  return json_ref(&object->json, false);
+  return make_value<json_object_t>(size);
 }
 
 json_ref json_object(
@@ -358,8 +392,7 @@ std::vector<json_ref>& json_ref::array() {
 }
 
 json_ref json_array_of_size(size_t nelems) {
-  auto array = new json_array_t(nelems);
-  return json_ref(&array->json, false);
+  return make_value<json_array_t>(nelems);
 }
 
 json_ref json_array(void) {
@@ -367,8 +400,7 @@ json_ref json_array(void) {
 }
 
 json_ref json_array(std::initializer_list<json_ref> values) {
-  auto array = new json_array_t(std::move(values));
-  return json_ref(&array->json, false);
+  return make_value<json_array_t>(values);
 }
 
 int json_array_set_template(json_t* json, json_t* templ) {
@@ -558,8 +590,7 @@ json_ref w_string_to_json(const w_string& str) {
   if (!str)
     return nullptr;
 
-  auto string = new json_string_t(str);
-  return json_ref(&string->json, false);
+  return make_value<json_string_t>(str);
 }
 
 const char* json_string_value(const json_t* json) {
@@ -594,8 +625,7 @@ json_integer_t::json_integer_t(json_int_t value)
     : json(JSON_INTEGER), value(value) {}
 
 json_ref json_integer(json_int_t value) {
-  auto integer = new json_integer_t(value);
-  return json_ref(&integer->json, false);
+  return make_value<json_integer_t>(value);
 }
 
 json_int_t json_integer_value(const json_t* json) {
@@ -622,7 +652,7 @@ static int json_integer_equal(json_t* integer1, json_t* integer2) {
   return json_integer_value(integer1) == json_integer_value(integer2);
 }
 
-static json_t* json_integer_copy(const json_t* integer) {
+static json_ref json_integer_copy(const json_t* integer) {
   return json_integer(json_integer_value(integer));
 }
 
@@ -634,8 +664,7 @@ json_ref json_real(double value) {
   if (std::isnan(value) || std::isinf(value)) {
     return nullptr;
   }
-  auto real = new json_real_t(value);
-  return json_ref(&real->json, false);
+  return make_value<json_real_t>(value);
 }
 
 double json_real_value(const json_t* json) {
@@ -659,7 +688,7 @@ static int json_real_equal(json_t* real1, json_t* real2) {
   return json_real_value(real1) == json_real_value(real2);
 }
 
-static json_t* json_real_copy(const json_t* real) {
+static json_ref json_real_copy(const json_t* real) {
   return json_real(json_real_value(real));
 }
 
@@ -696,19 +725,19 @@ json_ref json_null(void) {
 void json_ref::json_delete(json_t* json) {
   switch (json->type) {
     case JSON_OBJECT:
-      delete (json_object_t*)json;
+      delete_value<json_object_t>(json);
       break;
     case JSON_ARRAY:
-      delete (json_array_t*)json;
+      delete_value<json_array_t>(json);
       break;
     case JSON_STRING:
-      delete (json_string_t*)json;
+      delete_value<json_string_t>(json);
       break;
     case JSON_INTEGER:
-      delete (json_integer_t*)json;
+      delete_value<json_integer_t>(json);
       break;
     case JSON_REAL:
-      delete (json_real_t*)json;
+      delete_value<json_real_t>(json);
       break;
     case JSON_TRUE:
     case JSON_FALSE:
@@ -804,3 +833,76 @@ json_ref json_deep_copy(const json_t* json) {
 
   return nullptr;
 }
+
+/*** promotion ***/
+
+static bool json_holds_arena_values(const json_t* json) {
+  if (json->arena) {
+    return true;
+  }
+  // Borrow the members rather than taking references to them; arena
+  // values may be referenced from other threads
+  if (json_is_object(json)) {
+    for (auto& it : json_to_object(json)->map) {
+      if (json_holds_arena_values(it.second)) {
+        return true;
+      }
+    }
+  } else if (json_is_array(json)) {
+    auto array = json_to_array(json);
+    for (auto& value : array->table) {
+      if (json_holds_arena_values(value)) {
+        return true;
+      }
+    }
+    if (array->templ && json_holds_arena_values(array->templ)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static json_ref json_promote_copy(const json_t* json) {
+  switch (json->type) {
+    case JSON_OBJECT: {
+      auto src = json_to_object(json);
+      auto result = json_object_of_size(src->map.size());
+      auto& map = json_to_object(result)->map;
+      for (auto& it : src->map) {
+        map.emplace(it.first, json_promote_copy(it.second));
+      }
+      return result;
+    }
+    case JSON_ARRAY: {
+      auto src = json_to_array(json);
+      auto result = json_array_of_size(src->table.size());
+      auto dest = json_to_array(result);
+      for (auto& value : src->table) {
+        dest->table.emplace_back(json_promote_copy(value));
+      }
+      if (src->templ) {
+        dest->templ = json_promote_copy(src->templ);
+      }
+      return result;
+    }
+    case JSON_STRING:
+      return json_string_copy(json);
+    case JSON_INTEGER:
+      return json_integer_copy(json);
+    case JSON_REAL:
+      return json_real_copy(json);
+    default:
+      return const_cast<json_t*>(json);
+  }
+}
+
+json_ref json_promote(const json_t* json) {
+  if (!json) {
+    return nullptr;
+  }
+  if (!json_holds_arena_values(json)) {
+    return const_cast<json_t*>(json);
+  }
+  JsonArenaScope heap(nullptr);
+  return json_promote_copy(json);
+}
@@ -1,7 +1,15 @@
 #include <memory>
 
-#ifdef __SSE__
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define ART_SSE2 1
 #include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define ART_NEON 1
+#include <arm_neon.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
 #endif
 #include <algorithm>
 #include <new>
@@ -22,7 +30,71 @@ template <typename T, typename Deleter, typename... Args>
 std::unique_ptr<T, Deleter> make_unique_with_deleter(Args&&... args) {
   return std::unique_ptr<T, Deleter>(new T(std::forward<Args>(args)...));
 }
+
+// Returns the index of the lowest set bit of a non-zero mask
+inline unsigned lowestBit(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward(&idx, mask);
+  return idx;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+#if ART_NEON
+// Packs the lanes of a comparison result, each of which is all ones or
+// all zeros, into a bitmask like _mm_movemask_epi8
+inline unsigned movemask(uint8x16_t cmp) {
+  static const uint8_t kBits[16] = {
+      1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  auto bits = vandq_u8(cmp, vld1q_u8(kBits));
+  return vaddv_u8(vget_low_u8(bits)) | (vaddv_u8(vget_high_u8(bits)) << 8);
 }
+#endif
+
+// The keys of a Node16 are searched by comparing c with all 16 of them
+// at once; the bits for the slots beyond the first n are masked off.
+
+// Returns a mask with bit i set if keys[i] == c
+inline unsigned node16Equal(const unsigned char* keys, unsigned n, uint8_t c) {
+#if ART_SSE2
+  auto cmp = _mm_cmpeq_epi8(
+      _mm_set1_epi8(char(c)), _mm_loadu_si128((const __m128i*)keys));
+  return unsigned(_mm_movemask_epi8(cmp)) & ((1u << n) - 1);
+#elif ART_NEON
+  return movemask(vceqq_u8(vdupq_n_u8(c), vld1q_u8(keys))) & ((1u << n) - 1);
+#else
+  unsigned bits = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    bits |= unsigned(keys[i] == c) << i;
+  }
+  return bits;
+#endif
+}
+
+// Returns a mask with bit i set if keys[i] > c
+inline unsigned
+node16Greater(const unsigned char* keys, unsigned n, uint8_t c) {
+#if ART_SSE2
+  // SSE2 only compares signed bytes; flipping the sign bit of both sides
+  // gives the unsigned order
+  auto bias = _mm_set1_epi8(char(0x80));
+  auto cmp = _mm_cmpgt_epi8(
+      _mm_xor_si128(_mm_loadu_si128((const __m128i*)keys), bias),
+      _mm_xor_si128(_mm_set1_epi8(char(c)), bias));
+  return unsigned(_mm_movemask_epi8(cmp)) & ((1u << n) - 1);
+#elif ART_NEON
+  return movemask(vcgtq_u8(vld1q_u8(keys), vdupq_n_u8(c))) & ((1u << n) - 1);
+#else
+  unsigned bits = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    bits |= unsigned(keys[i] > c) << i;
+  }
+  return bits;
+#endif
+}
+} // namespace detail
 
 // The ART implementation requires that no key be a full prefix of an existing
 // key during insertion.  In practice this means that each key must have a
@@ -251,20 +323,10 @@ void art_tree<ValueType, KeyType>::Node16::addChild(
     NodePtr&& child) {
   if (this->num_children < 16) {
     unsigned idx;
-#ifdef __SSE__
-    __m128i cmp;
-    unsigned mask, bitfield;
-
-    // Compare the key to all 16 stored keys
-    cmp = _mm_cmplt_epi8(_mm_set1_epi8(c), _mm_loadu_si128((__m128i*)keys));
-
-    // Use a mask to ignore children that don't exist
-    mask = (1 << this->num_children) - 1;
-    bitfield = _mm_movemask_epi8(cmp) & mask;
-
-    // Check if less than any
+    // The first key that is greater than c is where c goes
+    auto bitfield = detail::node16Greater(keys, this->num_children, c);
     if (bitfield) {
-      idx = __builtin_ctz(bitfield);
+      idx = detail::lowestBit(bitfield);
       memmove(keys + idx + 1, keys + idx, this->num_children - idx);
       std::move_backward(
           children.begin() + idx,
@@ -273,18 +335,6 @@ void art_tree<ValueType, KeyType>::Node16::addChild(
     } else {
       idx = this->num_children;
     }
-#else
-    for (idx = 0; idx < this->num_children; idx++) {
-      if (c < keys[idx]) {
-        memmove(keys + idx + 1, keys + idx, this->num_children - idx);
-        std::move_backward(
-            children.begin() + idx,
-            children.begin() + this->num_children,
-            children.begin() + this->num_children + 1);
-        break;
-      }
-    }
-#endif
 
     // Set the child
     keys[idx] = c;
@@ -300,16 +350,7 @@ void art_tree<ValueType, KeyType>::Node16::addChild(
 template <typename ValueType, typename KeyType>
 typename art_tree<ValueType, KeyType>::NodePtr*
 art_tree<ValueType, KeyType>::Node16::findChild(unsigned char c) {
-#ifdef __SSE__
-  __m128i cmp;
-  int mask, bitfield;
-
-  // Compare the key to all 16 stored keys
-  cmp = _mm_cmpeq_epi8(_mm_set1_epi8(c), _mm_loadu_si128((__m128i*)keys));
-
-  // Use a mask to ignore children that don't exist
-  mask = (1 << this->num_children) - 1;
-  bitfield = _mm_movemask_epi8(cmp) & mask;
+  auto bitfield = detail::node16Equal(keys, this->num_children, c);
 
   /*
    * If we have a match (any bit set) then we can
@@ -317,16 +358,8 @@ art_tree<ValueType, KeyType>::Node16::findChild(unsigned char c) {
    * the index.
    */
   if (bitfield) {
-    return &children[__builtin_ctz(bitfield)];
+    return &children[detail::lowestBit(bitfield)];
   }
-#else
-  int i;
-  for (i = 0; i < this->num_children; i++) {
-    if (keys[i] == c) {
-      return &children[i];
-    }
-  }
-#endif
   return nullptr;
 }
 
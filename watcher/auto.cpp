@@ -37,6 +37,14 @@ const WatcherRegistry* WatcherRegistry::getWatcherByName(
   return &it->second;
 }
 
+std::vector<std::string> WatcherRegistry::getWatcherNames() {
+  std::vector<std::string> names;
+  for (const auto& it : getRegistry()) {
+    names.push_back(it.first);
+  }
+  return names;
+}
+
 // Helper to DRY in the two success paths in the function below
 static inline std::shared_ptr<watchman::QueryableView> reportWatcher(
     const std::string& watcherName,
@@ -150,5 +158,45 @@ bool Watcher::start(const std::shared_ptr<w_root_t>&) {
 
 void Watcher::signalThreads() {}
 
+bool Watcher::isDrained() {
+  return false;
+}
+
+int Watcher::getNotifyFd() {
+  return -1;
+}
+
+w_string Watcher::getResumePosition() {
+  return nullptr;
+}
+
+void Watcher::setResumePosition(w_string_piece) {}
+
+bool Watcher::resumedFromPosition() {
+  return false;
+}
+
+size_t Watcher::getNumWatches() const {
+  return 0;
+}
+
+size_t Watcher::getWatchLimit() const {
+  return 0;
+}
+
+void Watcher::addMetrics(MetricsWriter&, const MetricsWriter::Labels&) const {}
+
+json_ref Watcher::getStatsJson() const {
+  return json_object(
+      {{"batches", json_integer(stats.batches.load())},
+       {"events", json_integer(stats.events.load())},
+       {"coalesced_events", json_integer(stats.coalescedEvents.load())},
+       {"bytes_read", json_integer(stats.bytesRead.load())},
+       {"overflows", json_integer(stats.overflows.load())},
+       {"consume_micros", json_integer(stats.consumeMicros.load())},
+       {"watches", json_integer(getNumWatches())},
+       {"watch_limit", json_integer(getWatchLimit())}});
+}
+
 /* vim:ts=2:sw=2:et:
  */
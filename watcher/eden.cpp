@@ -8,8 +8,10 @@
 #include <folly/io/async/AsyncSocket.h>
 #include <folly/io/async/EventBase.h>
 #include <folly/io/async/EventBaseManager.h>
+#include <folly/io/async/ScopedEventBaseThread.h>
 #include <thrift/lib/cpp2/async/HeaderClientChannel.h>
 #include <thrift/lib/cpp2/async/RocketClientChannel.h>
+#include <thrift/lib/cpp/transport/TTransportException.h>
 #include <algorithm>
 #include <chrono>
 #include <iterator>
@@ -238,6 +240,345 @@ std::unique_ptr<StreamingEdenServiceAsyncClient> getRocketEdenClient(
   });
 }
 
+// A few connections to the eden server for one mount, driven by an event
+// base thread of their own.  Queries use them to have several requests in
+// flight at once, rather than making one blocking call after another on
+// their own threads.
+class EdenClientPool {
+ public:
+  EdenClientPool(
+      w_string rootPath,
+      size_t numClients,
+      size_t maxConcurrent,
+      size_t batchSize)
+      : rootPath_(std::move(rootPath)),
+        mountPoint_(to<std::string>(rootPath_)),
+        evbThread_("edenclient"),
+        clients_(std::max(numClients, size_t(1))),
+        maxConcurrent_(std::max(maxConcurrent, size_t(1))),
+        batchSize_(std::max(batchSize, size_t(1))) {}
+
+  ~EdenClientPool() {
+    // The clients belong to the event base thread
+    evbThread_.getEventBase()->runInEventBaseThreadAndWait(
+        [this] { clients_.clear(); });
+  }
+
+  const std::string& mountPoint() const {
+    return mountPoint_;
+  }
+
+  // Makes the request that func issues with the client that it is given
+  template <typename Func>
+  auto call(Func func) {
+    return folly::via(evbThread_.getEventBase(), [this, func]() mutable {
+      return withClient(func);
+    });
+  }
+
+  // Splits names into batches, makes the request that func issues for
+  // each of them, with no more than maxConcurrent_ of them in flight at
+  // once, and concatenates the results in the order of names.  The caller
+  // must wait for the result before the pool is destroyed.
+  template <typename Result, typename Func>
+  folly::SemiFuture<std::vector<Result>> fanOut(
+      const std::vector<std::string>& names,
+      Func func) {
+    if (names.empty()) {
+      return folly::makeSemiFuture(std::vector<Result>());
+    }
+    std::vector<std::vector<std::string>> batches;
+    for (size_t i = 0; i < names.size(); i += batchSize_) {
+      auto end = std::min(names.size(), i + batchSize_);
+      batches.emplace_back(names.begin() + i, names.begin() + end);
+    }
+
+    auto futures = folly::window(
+        std::move(batches),
+        [this, func](std::vector<std::string> batch) {
+          return call([func, batch = std::move(batch)](
+                          StreamingEdenServiceAsyncClient& client) mutable {
+            return func(client, batch);
+          });
+        },
+        maxConcurrent_);
+    // Wait for all of the batches, even if one fails, so that none of
+    // them outlives the caller
+    return folly::collectAll(std::move(futures))
+        .deferValue([](std::vector<folly::Try<std::vector<Result>>> parts) {
+          std::vector<Result> result;
+          for (auto& part : parts) {
+            auto& values = part.value();
+            result.insert(
+                result.end(),
+                std::make_move_iterator(values.begin()),
+                std::make_move_iterator(values.end()));
+          }
+          return result;
+        });
+  }
+
+ private:
+  // Runs in the event base thread
+  template <typename Func>
+  auto withClient(Func& func) {
+    auto index = next_++ % clients_.size();
+    auto& slot = clients_[index];
+    if (!slot) {
+      slot = getEdenClient(rootPath_, evbThread_.getEventBase());
+    }
+    std::shared_ptr<StreamingEdenServiceAsyncClient> client = slot;
+    return func(*client)
+        .via(evbThread_.getEventBase())
+        .thenTry([this, index, client](auto&& result) {
+          if (result.hasException() &&
+              result.exception()
+                  .template is_compatible_with<
+                      apache::thrift::transport::TTransportException>() &&
+              clients_.size() > index && clients_[index] == client) {
+            // The connection is broken; make a new one for the next
+            // request that lands on this slot
+            clients_[index].reset();
+          }
+          return std::move(result).value();
+        });
+  }
+
+  const w_string rootPath_;
+  const std::string mountPoint_;
+  folly::ScopedEventBaseThread evbThread_;
+  // Only accessed in the event base thread
+  std::vector<std::shared_ptr<StreamingEdenServiceAsyncClient>> clients_;
+  size_t next_{0};
+  const size_t maxConcurrent_;
+  const size_t batchSize_;
+};
+
+// Holds the information of the files that recently changed in the mount.
+// The subscriber thread fetches it as it learns of the changes from the
+// journal, so that the queries that follow, such as those of
+// subscriptions, rarely need to wait for Eden to provide it.
+//
+// An entry is current as of the journal position at which it was fetched,
+// until the journal shows that its file changed again.  The cache is only
+// consulted for a query whose journal position the subscriber thread has
+// already seen, as otherwise a change that the query needs to see may not
+// have been applied to the cache yet.
+class EdenMetadataCache
+    : public std::enable_shared_from_this<EdenMetadataCache> {
+ public:
+  EdenMetadataCache(
+      size_t maxItems,
+      std::shared_ptr<EdenClientPool> clients,
+      const JournalPosition& position)
+      : maxItems_(maxItems),
+        clients_(std::move(clients)),
+        entries_(std::max(maxItems, size_t(1)), std::chrono::seconds(0)) {
+    auto state = state_.lock();
+    state->mountGeneration = *position.mountGeneration_ref();
+    state->seenThrough = *position.sequenceNumber_ref();
+  }
+
+  bool enabled() const {
+    return maxItems_ > 0;
+  }
+
+  // Called by the subscriber thread with each delta that it reads from
+  // the journal.  Forgets the files that changed and fetches them again.
+  void applyDelta(
+      const std::shared_ptr<w_root_t>& root,
+      const FileDelta& delta) {
+    if (!enabled()) {
+      return;
+    }
+    auto generation = *delta.toPosition_ref()->mountGeneration_ref();
+    auto seq = int64_t(*delta.toPosition_ref()->sequenceNumber_ref());
+    bool fetch;
+    {
+      auto state = state_.lock();
+      if (generation != state->mountGeneration ||
+          *delta.fromPosition_ref()->snapshotHash_ref() !=
+              *delta.toPosition_ref()->snapshotHash_ref()) {
+        // The files that a checkout changed are not in the delta, so we
+        // can't tell which of the entries are still current
+        entries_.clear();
+        state->pending.clear();
+        state->mountGeneration = generation;
+        state->clearedAt = seq;
+        state->seenThrough = seq;
+        return;
+      }
+
+      auto forget = [&](const std::vector<std::string>& names) {
+        for (auto& name : names) {
+          // Record when it changed, so that a fetch that started before
+          // this can't store what it found
+          Entry entry;
+          entry.changedAt = seq;
+          entries_.set(name, std::move(entry));
+
+          auto full = w_string::pathCat({root->root_path, name});
+          if (state->pending.size() < maxItems_ &&
+              !root->ignore.isIgnored(full.data(), full.size())) {
+            state->pending.insert(name);
+          }
+        }
+      };
+      forget(*delta.changedPaths_ref());
+      forget(*delta.createdPaths_ref());
+      forget(*delta.removedPaths_ref());
+      state->seenThrough = seq;
+
+      fetch = !state->pending.empty() && !state->fetching;
+      if (fetch) {
+        state->fetching = true;
+      }
+    }
+
+    if (fetch) {
+      try {
+        getThreadPool().add([self = shared_from_this()] {
+          self->fetchPending();
+        });
+      } catch (const std::exception&) {
+        // The pool is stopping
+        state_.lock()->fetching = false;
+      }
+    }
+  }
+
+  // Forgets everything, because the journal was truncated and we may have
+  // missed changes
+  void invalidateAll() {
+    auto state = state_.lock();
+    entries_.clear();
+    state->pending.clear();
+    state->clearedAt = state->seenThrough + 1;
+  }
+
+  // Returns the cached information for each of names that is current as
+  // of position, or none where there isn't any
+  std::vector<Optional<FileInformationOrError>> lookup(
+      const JournalPosition& position,
+      const std::vector<std::string>& names) {
+    std::vector<Optional<FileInformationOrError>> result(names.size());
+    auto state = state_.lock();
+    if (*position.mountGeneration_ref() != state->mountGeneration ||
+        int64_t(*position.sequenceNumber_ref()) > state->seenThrough) {
+      state->misses += names.size();
+      return result;
+    }
+    for (size_t i = 0; i < names.size(); ++i) {
+      auto node = entries_.get(names[i]);
+      if (node && node->value().info &&
+          node->value().fetchedAt >= node->value().changedAt) {
+        result[i] = node->value().info;
+        state->hits++;
+      } else {
+        state->misses++;
+      }
+    }
+    return result;
+  }
+
+ private:
+  struct Entry {
+    // Absent until the file has been fetched since it last changed
+    Optional<FileInformationOrError> info;
+    // The sequence number of the journal as of which info is current
+    int64_t fetchedAt{0};
+    // The sequence number at which the journal last showed it changing
+    int64_t changedAt{0};
+  };
+
+  struct State {
+    int64_t mountGeneration{0};
+    // The position through which the journal has been applied
+    int64_t seenThrough{0};
+    // Anything fetched as of a position before this is out of date
+    int64_t clearedAt{0};
+    // The files waiting to be fetched, and whether a thread is fetching
+    std::unordered_set<std::string> pending;
+    bool fetching{false};
+
+    size_t hits{0};
+    size_t misses{0};
+  };
+
+  // Runs in the thread pool until there is nothing left to fetch
+  void fetchPending() {
+    while (true) {
+      std::vector<std::string> names;
+      int64_t fetchedAt;
+      {
+        auto state = state_.lock();
+        if (state->pending.empty()) {
+          state->fetching = false;
+          return;
+        }
+        names.assign(state->pending.begin(), state->pending.end());
+        state->pending.clear();
+        // Eden applies the changes that we have seen before it answers
+        fetchedAt = state->seenThrough;
+      }
+
+      try {
+        auto info =
+            clients_
+                ->fanOut<FileInformationOrError>(
+                    names,
+                    [mountPoint = clients_->mountPoint()](
+                        StreamingEdenServiceAsyncClient& client,
+                        const std::vector<std::string>& batch) {
+                      return client.semifuture_getFileInformation(
+                          mountPoint, batch);
+                    })
+                .get();
+        store(names, info, fetchedAt);
+      } catch (const std::exception& exc) {
+        // The queries will ask for what they need themselves
+        log(ERR,
+            "failed to prefetch file information for ",
+            clients_->mountPoint(),
+            ": ",
+            exc.what(),
+            "\n");
+      }
+    }
+  }
+
+  void store(
+      const std::vector<std::string>& names,
+      const std::vector<FileInformationOrError>& info,
+      int64_t fetchedAt) {
+    if (info.size() != names.size()) {
+      return;
+    }
+    auto state = state_.lock();
+    if (fetchedAt < state->clearedAt) {
+      return;
+    }
+    for (size_t i = 0; i < names.size(); ++i) {
+      auto node = entries_.get(names[i]);
+      if (node && node->value().changedAt > fetchedAt) {
+        // It changed again while we were fetching it
+        continue;
+      }
+      Entry entry;
+      entry.info = info[i];
+      entry.fetchedAt = fetchedAt;
+      entry.changedAt = node ? node->value().changedAt : 0;
+      entries_.set(names[i], std::move(entry));
+    }
+  }
+
+  const size_t maxItems_;
+  std::shared_ptr<EdenClientPool> clients_;
+  LRUCache<std::string, Entry> entries_;
+  // Also serializes the updates of entries_ against each other
+  folly::Synchronized<State, std::mutex> state_;
+};
+
 class EdenFileResult : public FileResult {
  public:
   EdenFileResult(
@@ -245,8 +586,14 @@ class EdenFileResult : public FileResult {
       const w_string& fullName,
       JournalPosition* position = nullptr,
       bool isNew = false,
-      DType dtype = DType::Unknown)
-      : root_path_(rootPath), fullName_(fullName), dtype_(dtype) {
+      DType dtype = DType::Unknown,
+      std::shared_ptr<EdenClientPool> clients = nullptr,
+      std::shared_ptr<EdenMetadataCache> metadata = nullptr)
+      : root_path_(rootPath),
+        fullName_(fullName),
+        dtype_(dtype),
+        metadata_(std::move(metadata)),
+        clients_(std::move(clients)) {
     otime_.ticks = ctime_.ticks = 0;
     otime_.timestamp = ctime_.timestamp = 0;
     if (position) {
@@ -459,34 +806,86 @@ class EdenFileResult : public FileResult {
       edenFile.clearNeededProperties();
     }
 
-    auto client = getEdenClient(root_path_);
-    loadFileInformation(
-        client.get(),
-        root_path_,
-        getFileInformationNames,
-        getFileInformationFiles,
-        onlyEntryInfoNeeded);
-
-    // TODO: add eden bulk readlink call
-    loadSymlinkTargets(client.get(), getSymlinkFiles);
+    auto& clients = *clients_;
+    if (metadata_ && metadata_->enabled() &&
+        !getFileInformationNames.empty()) {
+      applyCachedInformation(
+          clients, getFileInformationNames, getFileInformationFiles);
+    }
 
-    if (!getShaFiles.empty()) {
-      std::vector<SHA1Result> sha1s;
-      client->sync_getSHA1(sha1s, to<std::string>(root_path_), getShaNames);
+    // Issue all of the requests before waiting for any of them
+    auto mountPoint = clients.mountPoint();
+    auto entryInfo = clients.fanOut<EntryInformationOrError>(
+        onlyEntryInfoNeeded ? getFileInformationNames
+                            : std::vector<std::string>(),
+        [mountPoint](
+            StreamingEdenServiceAsyncClient& client,
+            const std::vector<std::string>& batch) {
+          return client.semifuture_getEntryInformation(mountPoint, batch);
+        });
+    auto fileInfo = clients.fanOut<FileInformationOrError>(
+        onlyEntryInfoNeeded ? std::vector<std::string>()
+                            : getFileInformationNames,
+        getFileInformationFunc(mountPoint));
+    auto sha1s = clients.fanOut<SHA1Result>(
+        getShaNames,
+        [mountPoint](
+            StreamingEdenServiceAsyncClient& client,
+            const std::vector<std::string>& batch) {
+          return client.semifuture_getSHA1(mountPoint, batch);
+        });
+    // Wait for all of them, even if one fails, as the pool needs them to
+    // complete before we return
+    auto results = folly::collectAll(
+                       std::move(entryInfo),
+                       std::move(fileInfo),
+                       std::move(sha1s))
+                       .get();
 
-      if (sha1s.size() != getShaFiles.size()) {
-        watchman::log(
-            ERR,
-            "Requested SHA-1 of ",
-            getShaFiles.size(),
-            " but Eden returned ",
-            sha1s.size(),
-            " results -- ignoring");
+    if (onlyEntryInfoNeeded) {
+      auto& info = std::get<0>(results);
+      auto* appEx = info.hasException()
+          ? info.exception().get_exception<TApplicationException>()
+          : nullptr;
+      if (appEx && appEx->getType() == TApplicationException::UNKNOWN_METHOD) {
+        // getEntryInformation is not available in this version of
+        // Eden. Fall back to the older, more expensive
+        // getFileInformation.
+        applyResults(
+            getFileInformationNames,
+            getFileInformationFiles,
+            clients
+                .fanOut<FileInformationOrError>(
+                    getFileInformationNames,
+                    getFileInformationFunc(mountPoint))
+                .get());
       } else {
-        auto sha1Iter = sha1s.begin();
-        for (auto& edenFile : getShaFiles) {
-          edenFile->sha1_ = *sha1Iter++;
-        }
+        applyResults(
+            getFileInformationNames, getFileInformationFiles, info.value());
+      }
+    } else {
+      applyResults(
+          getFileInformationNames,
+          getFileInformationFiles,
+          std::get<1>(results).value());
+    }
+
+    // TODO: add eden bulk readlink call
+    loadSymlinkTargets(getSymlinkFiles);
+
+    auto& sha1Results = std::get<2>(results).value();
+    if (sha1Results.size() != getShaFiles.size()) {
+      watchman::log(
+          ERR,
+          "Requested SHA-1 of ",
+          getShaFiles.size(),
+          " but Eden returned ",
+          sha1Results.size(),
+          " results -- ignoring");
+    } else {
+      auto sha1Iter = sha1Results.begin();
+      for (auto& edenFile : getShaFiles) {
+        edenFile->sha1_ = *sha1Iter++;
       }
     }
   }
@@ -501,14 +900,50 @@ class EdenFileResult : public FileResult {
   Optional<SHA1Result> sha1_;
   Optional<w_string> symlinkTarget_;
   DType dtype_{DType::Unknown};
+  std::shared_ptr<EdenMetadataCache> metadata_;
+  std::shared_ptr<EdenClientPool> clients_;
+
+  static auto getFileInformationFunc(const std::string& mountPoint) {
+    return [mountPoint](
+               StreamingEdenServiceAsyncClient& client,
+               const std::vector<std::string>& batch) {
+      return client.semifuture_getFileInformation(mountPoint, batch);
+    };
+  }
+
+  // Applies the information that the subscriber thread prefetched to the
+  // files that it is current for, and removes them from names and files
+  void applyCachedInformation(
+      EdenClientPool& clients,
+      std::vector<std::string>& names,
+      std::vector<EdenFileResult*>& files) {
+    auto position = clients
+                        .call([&](StreamingEdenServiceAsyncClient& client) {
+                          return client.semifuture_getCurrentJournalPosition(
+                              clients.mountPoint());
+                        })
+                        .get();
+    auto cached = metadata_->lookup(position, names);
+
+    size_t numLeft = 0;
+    for (size_t i = 0; i < names.size(); ++i) {
+      if (cached[i]) {
+        files[i]->applyInformationOrError(*cached[i]);
+      } else {
+        names[numLeft] = std::move(names[i]);
+        files[numLeft] = files[i];
+        ++numLeft;
+      }
+    }
+    names.resize(numLeft);
+    files.resize(numLeft);
+  }
 
   // Read the symlink targets for each of the provided `files`.  The files
   // had SymlinkTarget set in neededProperties prior to clearing it in
   // the batchFetchProperties() method that calls us, so we know that
   // we unconditionally need to read these links.
-  static void loadSymlinkTargets(
-      StreamingEdenServiceAsyncClient*,
-      const std::vector<EdenFileResult*>& files) {
+  static void loadSymlinkTargets(const std::vector<EdenFileResult*>& files) {
     for (auto& edenFile : files) {
       if (!edenFile->stat_->isSymlink()) {
         // If this file is not a symlink then we immediately yield
@@ -522,60 +957,35 @@ class EdenFileResult : public FileResult {
     }
   }
 
-  static void loadFileInformation(
-      StreamingEdenServiceAsyncClient* client,
-      const w_string& rootPath,
+  template <typename Info>
+  static void applyResults(
       const std::vector<std::string>& names,
       const std::vector<EdenFileResult*>& outFiles,
-      bool onlyEntryInfoNeeded) {
+      const std::vector<Info>& edenInfo) {
     w_assert(
         names.size() == outFiles.size(), "names.size must == outFiles.size");
     if (names.empty()) {
       return;
     }
+    if (names.size() != edenInfo.size()) {
+      watchman::log(
+          ERR,
+          "Requested file information of ",
+          names.size(),
+          " files but Eden returned information for ",
+          edenInfo.size(),
+          " files. Treating missing entries as missing files.");
+    }
 
-    auto applyResults = [&](const auto& edenInfo) {
-      if (names.size() != edenInfo.size()) {
-        watchman::log(
-            ERR,
-            "Requested file information of ",
-            names.size(),
-            " files but Eden returned information for ",
-            edenInfo.size(),
-            " files. Treating missing entries as missing files.");
-      }
-
-      auto infoIter = edenInfo.begin();
-      for (auto& edenFileResult : outFiles) {
-        if (infoIter == edenInfo.end()) {
-          edenFileResult->setExists(false);
-        } else {
-          edenFileResult->applyInformationOrError(*infoIter);
-          ++infoIter;
-        }
-      }
-    };
-
-    if (onlyEntryInfoNeeded) {
-      std::vector<EntryInformationOrError> info;
-      try {
-        client->sync_getEntryInformation(
-            info, to<std::string>(rootPath), names);
-        applyResults(info);
-        return;
-      } catch (const TApplicationException& ex) {
-        if (TApplicationException::UNKNOWN_METHOD != ex.getType()) {
-          throw;
-        }
-        // getEntryInformation is not available in this version of
-        // Eden. Fall back to the older, more expensive
-        // getFileInformation below.
+    auto infoIter = edenInfo.begin();
+    for (auto& edenFileResult : outFiles) {
+      if (infoIter == edenInfo.end()) {
+        edenFileResult->setExists(false);
+      } else {
+        edenFileResult->applyInformationOrError(*infoIter);
+        ++infoIter;
       }
     }
-
-    std::vector<FileInformationOrError> info;
-    client->sync_getFileInformation(info, to<std::string>(rootPath), names);
-    applyResults(info);
   }
 
   void applyInformationOrError(const EntryInformationOrError& infoOrErr) {
@@ -770,6 +1180,53 @@ std::vector<NameAndDType> globNameAndDType(
   }
 }
 
+/** Returns the leading portion of pattern that has no glob special
+ * characters in it, up to the last slash, or all of pattern if it has none.
+ * Only files whose names start with this can match the pattern. */
+std::string globPrefix(const std::string& pattern) {
+  auto special = pattern.find_first_of("*?[\\");
+  if (special == std::string::npos) {
+    return pattern;
+  }
+  auto slash = pattern.rfind('/', special);
+  return slash == std::string::npos ? std::string()
+                                    : pattern.substr(0, slash + 1);
+}
+
+/** Returns true if the changes in delta could alter the results of a glob
+ * whose patterns have the given prefixes */
+bool globAffectedBy(
+    const std::vector<std::string>& prefixes,
+    const FileDelta& delta) {
+  if (*delta.fromPosition_ref()->snapshotHash_ref() !=
+      *delta.toPosition_ref()->snapshotHash_ref()) {
+    // The files that a checkout changed are not listed in the delta
+    return true;
+  }
+  auto affects = [&](const std::string& name) {
+    for (auto& prefix : prefixes) {
+      if (name.compare(0, prefix.size(), prefix) == 0) {
+        return true;
+      }
+      // A dir along the prefix was replaced
+      if (prefix.size() > name.size() && prefix[name.size()] == '/' &&
+          prefix.compare(0, name.size(), name) == 0) {
+        return true;
+      }
+    }
+    return false;
+  };
+  for (auto* names :
+       {&*delta.changedPaths_ref(),
+        &*delta.createdPaths_ref(),
+        &*delta.removedPaths_ref()}) {
+    if (std::any_of(names->begin(), names->end(), affects)) {
+      return true;
+    }
+  }
+  return false;
+}
+
 class EdenView : public QueryableView {
   w_string root_path_;
   // The source control system that we detected during initialization
@@ -781,6 +1238,23 @@ class EdenView : public QueryableView {
   std::string mountPoint_;
   std::promise<void> subscribeReadyPromise_;
   std::shared_future<void> subscribeReadyFuture_;
+  std::shared_ptr<EdenClientPool> clients_;
+  std::shared_ptr<EdenMetadataCache> metadata_;
+
+  // The results of recent globs, keyed by their patterns.  An entry is
+  // reused for as long as the journal shows no changes to the files that
+  // its patterns could match.
+  struct GlobCacheEntry {
+    // The position that files is current as of
+    JournalPosition position;
+    std::shared_ptr<const std::vector<NameAndDType>> files;
+    // See globPrefix()
+    std::vector<std::string> prefixes;
+  };
+  mutable LRUCache<std::string, GlobCacheEntry> globCache_;
+  bool enableGlobCache_;
+  // Larger results are not cached
+  size_t globCacheMaxFiles_;
 
  public:
   explicit EdenView(w_root_t* root)
@@ -789,11 +1263,38 @@ class EdenView : public QueryableView {
         // Allow for 32 pairs of revs, with errors cached for 10 seconds
         filesBetweenCommitCache_(32, std::chrono::seconds(10)),
         mountPoint_(to<std::string>(root->root_path)),
-        subscribeReadyFuture_(subscribeReadyPromise_.get_future()) {
+        subscribeReadyFuture_(subscribeReadyPromise_.get_future()),
+        globCache_(
+            size_t(std::max(
+                root->config.getInt("eden_glob_cache_max_entries", 16),
+                json_int_t(1))),
+            std::chrono::seconds(0)),
+        enableGlobCache_(
+            root->config.getInt("eden_glob_cache_max_entries", 16) > 0),
+        globCacheMaxFiles_(size_t(std::max(
+            root->config.getInt("eden_glob_cache_max_files", 100000),
+            json_int_t(0)))) {
     // Get the current journal position so that we can keep track of
     // cookie file changes
     auto client = getEdenClient(root_path_);
     client->sync_getCurrentJournalPosition(lastCookiePosition_, mountPoint_);
+
+    clients_ = std::make_shared<EdenClientPool>(
+        root_path_,
+        size_t(std::max(
+            root->config.getInt("eden_client_pool_size", 4), json_int_t(1))),
+        size_t(std::max(
+            root->config.getInt("eden_max_concurrent_requests", 8),
+            json_int_t(1))),
+        size_t(std::max(
+            root->config.getInt("eden_fetch_batch_size", 1024),
+            json_int_t(1))));
+    metadata_ = std::make_shared<EdenMetadataCache>(
+        size_t(std::max(
+            root->config.getInt("eden_metadata_prefetch_max_items", 0),
+            json_int_t(0))),
+        clients_,
+        lastCookiePosition_);
   }
 
   void timeGenerator(w_query* query, struct w_query_ctx* ctx) const override {
@@ -828,11 +1329,8 @@ class EdenView : public QueryableView {
         globPattern.append("/");
       }
       globPattern.append("**");
-      return globNameAndDType(
-          client.get(),
-          mountPoint_,
-          std::vector<std::string>{globPattern},
-          includeDotfiles);
+      return cachedGlob(
+          client.get(), std::vector<std::string>{globPattern}, includeDotfiles);
     };
 
     std::vector<NameAndDType> fileInfo;
@@ -983,7 +1481,9 @@ class EdenView : public QueryableView {
           w_string::pathCat({mountPoint_, item.name}),
           &resultPosition,
           isNew,
-          item.dtype);
+          item.dtype,
+          clients_,
+          metadata_);
 
       if (ctx->since.clock.is_fresh_instance) {
         // Fresh instance queries only return data about files
@@ -1020,6 +1520,65 @@ class EdenView : public QueryableView {
   void syncToNow(const std::shared_ptr<w_root_t>&, std::chrono::milliseconds)
       override {}
 
+  /** Returns the files that match the glob, reusing the results of an
+   * earlier glob with the same patterns if the journal shows that nothing
+   * that they could match has changed since */
+  std::vector<NameAndDType> cachedGlob(
+      StreamingEdenServiceAsyncClient* client,
+      const std::vector<std::string>& globPatterns,
+      bool includeDotfiles) const {
+    if (!enableGlobCache_) {
+      return globNameAndDType(
+          client, mountPoint_, globPatterns, includeDotfiles);
+    }
+
+    auto key = to<std::string>(
+        includeDotfiles ? '1' : '0',
+        folly::join(std::string(1, '\0'), globPatterns));
+
+    if (auto node = globCache_.get(key)) {
+      auto& entry = node->value();
+      try {
+        FileDelta delta;
+        client->sync_getFilesChangedSince(delta, mountPoint_, entry.position);
+        if (!globAffectedBy(entry.prefixes, delta)) {
+          // Bring it forward so that the next delta is smaller
+          GlobCacheEntry updated{
+              *delta.toPosition_ref(), entry.files, entry.prefixes};
+          globCache_.set(key, std::move(updated));
+          return *entry.files;
+        }
+      } catch (const EdenError& err) {
+        // ERANGE: mountGeneration differs
+        // EDOM: journal was truncated.
+        // Either way we have to glob again.
+        if (err.errorCode_ref().value_unchecked() != ERANGE &&
+            err.errorCode_ref().value_unchecked() != EDOM) {
+          throw;
+        }
+      }
+    }
+
+    // Take the position first, so that anything that changes while we
+    // glob invalidates the entry
+    JournalPosition position;
+    client->sync_getCurrentJournalPosition(position, mountPoint_);
+    auto files =
+        globNameAndDType(client, mountPoint_, globPatterns, includeDotfiles);
+    if (files.size() <= globCacheMaxFiles_) {
+      GlobCacheEntry entry;
+      entry.position = std::move(position);
+      entry.files = std::make_shared<const std::vector<NameAndDType>>(files);
+      for (auto& pattern : globPatterns) {
+        entry.prefixes.push_back(globPrefix(pattern));
+      }
+      globCache_.set(key, std::move(entry));
+    } else {
+      globCache_.erase(key);
+    }
+    return files;
+  }
+
   void executeGlobBasedQuery(
       const std::vector<std::string>& globStrings,
       w_query* query,
@@ -1027,8 +1586,7 @@ class EdenView : public QueryableView {
     auto client = getEdenClient(ctx->root->root_path);
 
     auto includeDotfiles = (query->glob_flags & WM_PERIOD) == 0;
-    auto fileInfo = globNameAndDType(
-        client.get(), mountPoint_, globStrings, includeDotfiles);
+    auto fileInfo = cachedGlob(client.get(), globStrings, includeDotfiles);
 
     // Filter out any ignored files
     filterOutPaths(fileInfo, ctx);
@@ -1039,7 +1597,9 @@ class EdenView : public QueryableView {
           w_string::pathCat({mountPoint_, item.name}),
           /* position=*/nullptr,
           /*isNew=*/false,
-          item.dtype);
+          item.dtype,
+          clients_,
+          metadata_);
 
       // The results of a glob are known to exist
       file->setExists(true);
@@ -1079,8 +1639,8 @@ class EdenView : public QueryableView {
       }
       // -1 depth is infinite which we can translate to a recursive
       // glob.  0 depth is direct descendant which we can translate
-      // to a simple * wildcard.
-      auto glob = path.depth == -1 ? "**/*" : "*";
+      // to a simple * wildcard.  An exact path is matched by itself.
+      auto glob = path.exact ? "" : path.depth == -1 ? "**/*" : "*";
 
       globStrings.emplace_back(to<std::string>(
           w_string::pathCat({rel, escapeGlobSpecialChars(path.name), glob})));
@@ -1161,6 +1721,12 @@ class EdenView : public QueryableView {
     return scm_.get();
   }
 
+  FetchBatching getFetchBatching() const override {
+    // Each batch is a thrift call, which is worth filling
+    return FetchBatching{
+        20480, 20480, 1024, 102400, std::chrono::milliseconds(500)};
+  }
+
   SCM::StatusResult getFilesChangedBetweenCommits(
       w_string_piece commitA,
       w_string_piece commitB) const {
@@ -1208,6 +1774,9 @@ class EdenView : public QueryableView {
         root->cookies.notifyCookie(full);
       }
 
+      // Get ahead of the queries that will want to know about these
+      metadata_->applyDelta(root, delta);
+
       // Remember this position for subsequent calls
       lastCookiePosition_ = *delta.toPosition_ref();
     } catch (const EdenError& err) {
@@ -1223,6 +1792,8 @@ class EdenView : public QueryableView {
       // cookie sync mechanism will retry if there is sufficient time remaining
       // in their individual retry schedule(s).
       root->cookies.abortAllCookies();
+      // Likewise, we may have missed changes to the prefetched files
+      metadata_->invalidateAll();
     }
   }
 
@@ -0,0 +1,428 @@
+/* Copyright 2020-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include <array>
+#include <unordered_set>
+#include "FileDescriptor.h"
+#include "FileSystem.h"
+#include "InMemoryView.h"
+#include "Pipe.h"
+
+#if defined(HAVE_SYS_FANOTIFY_H) && defined(HAVE_DECL_FAN_REPORT_DFID_NAME)
+#include <fcntl.h>
+#include <sys/fanotify.h>
+#include <sys/ioctl.h>
+
+using namespace watchman;
+
+namespace {
+
+// We don't ask for FAN_CLOSE_WRITE, as FAN_MODIFY already tells us
+// about the writes
+constexpr uint64_t kFanotifyMask = FAN_CREATE | FAN_DELETE | FAN_MODIFY |
+    FAN_ATTRIB | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE_SELF |
+    FAN_MOVE_SELF | FAN_ONDIR;
+
+// We remember this many of the dirs that we found to be outside of the
+// root before we forget them all and start over
+constexpr size_t kMaxForeignDirs = 64 * 1024;
+
+const struct flag_map fanflags[] = {
+    {FAN_MODIFY, "FAN_MODIFY"},
+    {FAN_ATTRIB, "FAN_ATTRIB"},
+    {FAN_MOVED_FROM, "FAN_MOVED_FROM"},
+    {FAN_MOVED_TO, "FAN_MOVED_TO"},
+    {FAN_CREATE, "FAN_CREATE"},
+    {FAN_DELETE, "FAN_DELETE"},
+    {FAN_DELETE_SELF, "FAN_DELETE_SELF"},
+    {FAN_MOVE_SELF, "FAN_MOVE_SELF"},
+    {FAN_Q_OVERFLOW, "FAN_Q_OVERFLOW"},
+    {FAN_ONDIR, "FAN_ONDIR"},
+    {0, nullptr},
+};
+
+// Returns the bytes that identify a file handle, for use as a map key
+std::string handleKey(const struct file_handle* handle) {
+  std::string key(
+      reinterpret_cast<const char*>(&handle->handle_type),
+      sizeof(handle->handle_type));
+  key.append(
+      reinterpret_cast<const char*>(handle->f_handle), handle->handle_bytes);
+  return key;
+}
+
+bool isWithin(const w_string& path, const w_string& dir) {
+  return path == dir ||
+      (path.size() > dir.size() && path.data()[dir.size()] == '/' &&
+       w_string_piece(path).startsWith(dir));
+}
+} // namespace
+
+/** The fanotify watcher marks the whole filesystem that contains the root
+ * with a single fanotify_mark() call, rather than adding a watch for each
+ * dir as the inotify watcher does.  This means that there is no limit on
+ * the number of dirs that can be watched, and that the crawler doesn't
+ * need to register anything with the kernel.
+ *
+ * Events are reported with FAN_REPORT_DFID_NAME, which identifies the dir
+ * that contains the changed entry by its file handle, along with the name
+ * of the entry.  We resolve the handles to paths on demand and remember
+ * the results, so that only the dirs that see activity cost us anything.
+ * The events for the rest of the filesystem are discarded, after the first
+ * one from a given dir has shown that it is outside of the root.  So are
+ * the events for the entries of ignored dirs, such as the dirs inside of
+ * a vcs dir, once the first one has shown that the dir is ignored.
+ *
+ * This requires Linux 5.9 or later, along with CAP_SYS_ADMIN to mark the
+ * filesystem and CAP_DAC_READ_SEARCH to resolve the handles.  Filesystems
+ * that are mounted beneath the root are not watched.
+ */
+struct FanotifyWatcher : public Watcher {
+  FileDescriptor fanfd_;
+  // An fd on the watched filesystem, which open_by_handle_at()
+  // requires to resolve the handles
+  FileDescriptor mountFd_;
+  Pipe terminatePipe_;
+  w_string rootPath_;
+
+  // These are accessed only by the notify thread.
+  // Handle of a dir in the root -> its path
+  std::unordered_map<std::string, w_string> dirs_;
+  // Handles of dirs that are outside of the root
+  std::unordered_set<std::string> foreignDirs_;
+  // Handles of dirs in the root whose entries are all ignored
+  std::unordered_set<std::string> ignoredDirs_;
+
+  alignas(struct fanotify_event_metadata) char buf_[64 * 1024];
+
+  explicit FanotifyWatcher(w_root_t* root);
+
+  std::unique_ptr<watchman_dir_handle> startWatchDir(
+      const std::shared_ptr<w_root_t>& root,
+      struct watchman_dir* dir,
+      const char* path) override;
+
+  bool consumeNotify(
+      const std::shared_ptr<w_root_t>& root,
+      PendingCollection::LockedPtr& coll) override;
+
+  bool waitNotify(int timeoutms) override;
+
+  bool isDrained() override;
+
+  void signalThreads() override;
+
+ private:
+  // Returns the path of the dir identified by handle, or a null
+  // w_string if it is outside of the root, everything in it is ignored or
+  // it no longer exists
+  w_string resolveDir(
+      const std::shared_ptr<w_root_t>& root,
+      const struct file_handle* handle);
+  // Forget the handles that we resolved for path and its descendants
+  void forgetDirsUnder(const w_string& path);
+  void processEvent(
+      const std::shared_ptr<w_root_t>& root,
+      PendingCollection::LockedPtr& coll,
+      const struct fanotify_event_metadata* meta,
+      struct timeval now);
+};
+
+FanotifyWatcher::FanotifyWatcher(w_root_t* root)
+    : Watcher("fanotify", WATCHER_HAS_PER_FILE_NOTIFICATIONS),
+      rootPath_(root->root_path) {
+  fanfd_ = FileDescriptor(
+      fanotify_init(
+          FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME,
+          O_RDONLY | O_LARGEFILE),
+      "fanotify_init",
+      FileDescriptor::FDType::Generic);
+
+  mountFd_ = openFileHandle(
+      rootPath_.c_str(), OpenFileHandleOptions::queryFileInfo());
+
+  // Make sure that we'll be able to make sense of the events before we
+  // commit to using this watcher
+  struct {
+    struct file_handle handle;
+    unsigned char storage[MAX_HANDLE_SZ];
+  } rootHandle;
+  rootHandle.handle.handle_bytes = MAX_HANDLE_SZ;
+  int mountId;
+  if (name_to_handle_at(
+          mountFd_.fd(), "", &rootHandle.handle, &mountId, AT_EMPTY_PATH) ==
+      -1) {
+    throw std::system_error(
+        errno, std::generic_category(), "name_to_handle_at");
+  }
+  FileDescriptor probe(
+      open_by_handle_at(mountFd_.fd(), &rootHandle.handle, O_PATH | O_CLOEXEC),
+      "open_by_handle_at",
+      FileDescriptor::FDType::Generic);
+  dirs_[handleKey(&rootHandle.handle)] = rootPath_;
+
+  if (fanotify_mark(
+          fanfd_.fd(),
+          FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+          kFanotifyMask,
+          AT_FDCWD,
+          rootPath_.c_str()) == -1) {
+    throw std::system_error(errno, std::generic_category(), "fanotify_mark");
+  }
+}
+
+std::unique_ptr<watchman_dir_handle> FanotifyWatcher::startWatchDir(
+    const std::shared_ptr<w_root_t>&,
+    struct watchman_dir*,
+    const char* path) {
+  // The filesystem mark already covers this dir
+  return w_dir_open(path);
+}
+
+w_string FanotifyWatcher::resolveDir(
+    const std::shared_ptr<w_root_t>& root,
+    const struct file_handle* handle) {
+  auto key = handleKey(handle);
+  auto it = dirs_.find(key);
+  if (it != dirs_.end()) {
+    return it->second;
+  }
+  if (foreignDirs_.find(key) != foreignDirs_.end() ||
+      ignoredDirs_.find(key) != ignoredDirs_.end()) {
+    return nullptr;
+  }
+
+  w_string path;
+  try {
+    // open_by_handle_at doesn't modify the handle, but isn't
+    // declared to take a const pointer
+    FileDescriptor dirFd(
+        open_by_handle_at(
+            mountFd_.fd(),
+            const_cast<struct file_handle*>(handle),
+            O_PATH | O_CLOEXEC),
+        "open_by_handle_at",
+        FileDescriptor::FDType::Generic);
+    path = dirFd.getOpenedPath();
+  } catch (const std::system_error& exc) {
+    // Most likely the dir was deleted before we got to it, in which case
+    // its removal from its parent will tell us what we need to know
+    log(DBG, "unable to resolve fanotify dir handle: ", exc.what(), "\n");
+    return nullptr;
+  }
+
+  if (folly::StringPiece(w_string_piece(path)).endsWith(" (deleted)")) {
+    return nullptr;
+  }
+
+  if (isWithin(path, rootPath_)) {
+    if (root->ignore.isIgnoredBelow(path)) {
+      if (ignoredDirs_.size() >= kMaxForeignDirs) {
+        ignoredDirs_.clear();
+      }
+      ignoredDirs_.insert(key);
+      return nullptr;
+    }
+    dirs_[key] = path;
+    return path;
+  }
+
+  if (foreignDirs_.size() >= kMaxForeignDirs) {
+    foreignDirs_.clear();
+  }
+  foreignDirs_.insert(key);
+  return nullptr;
+}
+
+void FanotifyWatcher::forgetDirsUnder(const w_string& path) {
+  auto it = dirs_.begin();
+  while (it != dirs_.end()) {
+    if (isWithin(it->second, path)) {
+      it = dirs_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void FanotifyWatcher::processEvent(
+    const std::shared_ptr<w_root_t>& root,
+    PendingCollection::LockedPtr& coll,
+    const struct fanotify_event_metadata* meta,
+    struct timeval now) {
+  char flags_label[128];
+
+  w_expand_flags(
+      fanflags, uint32_t(meta->mask), flags_label, sizeof(flags_label));
+
+  if (meta->mask & FAN_Q_OVERFLOW) {
+    logf(DBG, "notify: mask={:x} {}\n", meta->mask, flags_label);
+    /* we missed something, will need to re-crawl */
+    ++stats.overflows;
+    root->scheduleRecrawl("FAN_Q_OVERFLOW");
+    return;
+  }
+
+  // Locate the record that identifies the dir that the event happened in
+  const struct fanotify_event_info_fid* fid = nullptr;
+  auto info = reinterpret_cast<const char*>(meta) + meta->metadata_len;
+  auto end = reinterpret_cast<const char*>(meta) + meta->event_len;
+  while (info + sizeof(struct fanotify_event_info_header) <= end) {
+    auto hdr = reinterpret_cast<const struct fanotify_event_info_header*>(info);
+    if (hdr->len == 0) {
+      break;
+    }
+    if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+        hdr->info_type == FAN_EVENT_INFO_TYPE_DFID) {
+      fid = reinterpret_cast<const struct fanotify_event_info_fid*>(info);
+      break;
+    }
+    info += hdr->len;
+  }
+  if (!fid) {
+    logf(DBG, "notify: mask={:x} {} without a dir\n", meta->mask, flags_label);
+    return;
+  }
+
+  auto handle = reinterpret_cast<const struct file_handle*>(fid->handle);
+  // The name is "." for events that are about the dir itself
+  const char* name = ".";
+  if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+    name = reinterpret_cast<const char*>(handle->f_handle) +
+        handle->handle_bytes;
+  }
+
+  auto dir_name = resolveDir(root, handle);
+  logf(
+      DBG,
+      "notify: mask={:x} {} dir={} name={}\n",
+      meta->mask,
+      flags_label,
+      dir_name ? dir_name.c_str() : "<not in root or ignored>",
+      name);
+  if (!dir_name) {
+    return;
+  }
+
+  bool isSelf = strcmp(name, ".") == 0;
+  auto path = isSelf ? dir_name : w_string::pathCat({dir_name, name});
+  int pending_flags = W_PENDING_VIA_NOTIFY;
+
+  if (isSelf && (meta->mask & (FAN_DELETE_SELF | FAN_MOVE_SELF))) {
+    forgetDirsUnder(path);
+    ignoredDirs_.clear();
+    if (path == rootPath_) {
+      logf(
+          ERR,
+          "root dir {} has been (re)moved, canceling watch\n",
+          root->root_path);
+      root->cancel();
+      return;
+    }
+
+    // We need to examine the parent and potentially crawl down
+    path = path.dirName();
+  } else if (
+      (meta->mask & FAN_ONDIR) &&
+      (meta->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE))) {
+    // The handles that we've resolved for this dir and its children no
+    // longer correspond to their paths
+    forgetDirsUnder(path);
+    ignoredDirs_.clear();
+    if (meta->mask & FAN_MOVED_TO) {
+      // It may have been moved in from outside of the root
+      foreignDirs_.clear();
+    }
+  }
+
+  if (meta->mask & (FAN_CREATE | FAN_DELETE)) {
+    pending_flags |= W_PENDING_RECURSIVE;
+  }
+
+  logf(
+      DBG,
+      "add_pending for fanotify mask={:x} {}\n",
+      meta->mask,
+      path.c_str());
+  coll->add(path, now, pending_flags);
+}
+
+bool FanotifyWatcher::consumeNotify(
+    const std::shared_ptr<w_root_t>& root,
+    PendingCollection::LockedPtr& coll) {
+  struct timeval now;
+
+  auto n = read(fanfd_.fd(), buf_, sizeof(buf_));
+  if (n == -1) {
+    if (errno == EINTR) {
+      return false;
+    }
+    logf(
+        FATAL,
+        "read({}, {}): error {}\n",
+        fanfd_.fd(),
+        sizeof(buf_),
+        strerror(errno));
+  }
+
+  logf(DBG, "fanotify read: returned {}.\n", n);
+  gettimeofday(&now, nullptr);
+
+  size_t numEvents = 0;
+  for (auto meta = reinterpret_cast<struct fanotify_event_metadata*>(buf_);
+       FAN_EVENT_OK(meta, n);
+       meta = FAN_EVENT_NEXT(meta, n)) {
+    ++numEvents;
+    if (meta->vers != FANOTIFY_METADATA_VERSION) {
+      logf(
+          FATAL,
+          "fanotify metadata version {} doesn't match {}\n",
+          meta->vers,
+          FANOTIFY_METADATA_VERSION);
+    }
+    processEvent(root, coll, meta, now);
+  }
+  recordBatch(numEvents, n);
+
+  return true;
+}
+
+bool FanotifyWatcher::waitNotify(int timeoutms) {
+  std::array<struct pollfd, 2> pfd;
+
+  pfd[0].fd = fanfd_.fd();
+  pfd[0].events = POLLIN;
+  pfd[1].fd = terminatePipe_.read.fd();
+  pfd[1].events = POLLIN;
+
+  int n = poll(pfd.data(), pfd.size(), timeoutms);
+
+  if (n > 0) {
+    if (pfd[1].revents) {
+      // We were signalled via signalThreads
+      return false;
+    }
+    return pfd[0].revents != 0;
+  }
+  return false;
+}
+
+bool FanotifyWatcher::isDrained() {
+  int avail = 0;
+  return ioctl(fanfd_.fd(), FIONREAD, &avail) == 0 && avail == 0;
+}
+
+void FanotifyWatcher::signalThreads() {
+  ignore_result(write(terminatePipe_.write.fd(), "X", 1));
+}
+
+// Ranked below inotify, so that it is only used when it is requested via
+// the "watcher" configuration option; marking the whole filesystem is not
+// something that we want to do by default.
+static RegisterWatcher<FanotifyWatcher> reg("fanotify", -1);
+
+#endif // HAVE_SYS_FANOTIFY_H
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -2,11 +2,18 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <folly/Conv.h>
+#include <folly/String.h>
 #include <folly/Synchronized.h>
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
 #include <deque>
 #include <iterator>
+#include <list>
 #include <mutex>
+#include "DescriptorTable.h"
+#include "FileDescriptor.h"
 #include "InMemoryView.h"
 #include "LogConfig.h"
 #include "Pipe.h"
@@ -22,9 +29,17 @@ using namespace watchman;
 struct watchman_fsevent {
   w_string path;
   FSEventStreamEventFlags flags;
-
-  watchman_fsevent(w_string&& path, FSEventStreamEventFlags flags)
-      : path(std::move(path)), flags(flags) {}
+  FSEventStreamEventId id;
+  // True if the event was replayed from the journal rather than
+  // reported as it happened
+  bool replayed;
+
+  watchman_fsevent(
+      w_string&& path,
+      FSEventStreamEventFlags flags,
+      FSEventStreamEventId id,
+      bool replayed)
+      : path(std::move(path)), flags(flags), id(id), replayed(replayed) {}
 };
 
 struct fse_stream {
@@ -35,6 +50,7 @@ struct fse_stream {
   bool lost_sync{false};
   bool inject_drop{false};
   bool event_id_wrapped{false};
+  bool history_done{false};
   CFUUIDRef uuid;
 
   fse_stream(const std::shared_ptr<w_root_t>& root, FSEventStreamEventId since)
@@ -50,6 +66,42 @@ struct FSEventsWatcher : public Watcher {
 
   struct fse_stream* stream{nullptr};
   bool attempt_resync_on_drop{false};
+  // If true, an event that reports that a path was removed, and nothing
+  // else, is taken at its word rather than having the path stat'd
+  bool trust_removals{false};
+
+  // If fsevents_resume_from_snapshot is set, the position recorded in the
+  // view snapshot of a prior incarnation, which FSEventsThread replays
+  // the journal from
+  bool resume_from_snapshot{false};
+  FSEventStreamEventId resume_since{kFSEventStreamEventIdSinceNow};
+  CFUUIDBytes resume_uuid;
+  bool resumed{false};
+
+  // The UUID of the journal that the stream reads, which is set before
+  // start returns, and the id of the most recent event that consumeNotify
+  // has passed on
+  bool have_journal_uuid{false};
+  CFUUIDBytes journal_uuid;
+  std::atomic<FSEventStreamEventId> consumed_id{0};
+
+  // If fsevents_kqueue_dirs is set, the dirs in which fsevents most
+  // recently reported changes are also watched with kqueue, which reports
+  // changes to their entries without the latency and coalescing of
+  // fsevents.  The least recently active dir is dropped to make room for
+  // another.  Only accessed by the FSEvents thread.
+  size_t kqueue_budget{0};
+  FileDescriptor kq_fd;
+  struct KQueueDir {
+    w_string path;
+    FileDescriptor fd;
+  };
+  // Most recently active first
+  std::list<KQueueDir> kqueue_lru;
+  std::unordered_map<w_string, std::list<KQueueDir>::iterator> kqueue_dirs;
+  DescriptorTable<w_string> kqueue_fd_to_path;
+  // The size of kqueue_lru, for getNumWatches
+  std::atomic<size_t> kqueue_watches{0};
 
   explicit FSEventsWatcher(w_root_t* root);
 
@@ -66,7 +118,17 @@ struct FSEventsWatcher : public Watcher {
 
   bool waitNotify(int timeoutms) override;
   void signalThreads() override;
+  w_string getResumePosition() override;
+  void setResumePosition(w_string_piece position) override;
+  bool resumedFromPosition() override;
+  // The dirs watched with kqueue; the stream itself isn't counted
+  size_t getNumWatches() const override;
   void FSEventsThread(const std::shared_ptr<w_root_t>& root);
+
+  // These are called in the FSEvents thread
+  void noteActiveDir(const w_string& dir);
+  void unwatchKQueueDir(const w_string& dir);
+  void readKQueue(const std::shared_ptr<w_root_t>& root);
 };
 
 static const struct flag_map kflags[] = {
@@ -92,6 +154,67 @@ static const struct flag_map kflags[] = {
     {0, nullptr},
 };
 
+#ifdef HAVE_FSEVENTSTREAMSETEXCLUSIONPATHS
+// True if a and b are the same path, or if one of them is beneath the other
+static bool fse_paths_overlap(w_string_piece a, w_string_piece b) {
+  if (a.size() > b.size()) {
+    std::swap(a, b);
+  }
+  return b.startsWith(a) && (b.size() == a.size() || is_slash(b[a.size()]));
+}
+
+// Picks the paths that fsevents can stop reporting, so that we don't pay
+// to receive and discard the events for them.  The ignore_dirs come first,
+// then the dirs inside of each vcs dir: those hold the bulk of the vcs
+// churn, and nothing beneath them is ever reported, while the entries of
+// the vcs dir itself are, cookies included, so it can't be excluded.
+static std::vector<w_string> fse_exclusion_paths(
+    const std::shared_ptr<w_root_t>& root) {
+  std::vector<w_string> candidates = root->ignore.dirs_vec;
+
+  std::vector<w_string> vcs(
+      root->ignore.ignore_vcs.begin(), root->ignore.ignore_vcs.end());
+  std::sort(vcs.begin(), vcs.end());
+  auto cookieDir = root->cookies.cookieDir();
+  for (auto& dir : vcs) {
+    std::vector<w_string> subdirs;
+    try {
+      auto handle = w_dir_open(dir.c_str());
+      while (auto ent = handle->readDir()) {
+        if (ent->d_type != DType::Dir || !strcmp(ent->d_name, ".") ||
+            !strcmp(ent->d_name, "..")) {
+          continue;
+        }
+        auto path = w_string::pathCat({dir, ent->d_name});
+        if (!fse_paths_overlap(path, cookieDir)) {
+          subdirs.push_back(std::move(path));
+        }
+      }
+    } catch (const std::system_error&) {
+      // There is no such vcs dir in this root
+      continue;
+    }
+    std::sort(subdirs.begin(), subdirs.end());
+    std::move(subdirs.begin(), subdirs.end(), std::back_inserter(candidates));
+  }
+
+  std::vector<w_string> paths;
+  for (auto& path : candidates) {
+    if (paths.size() >= MAX_EXCLUSIONS) {
+      break;
+    }
+    bool covered = std::any_of(
+        paths.begin(), paths.end(), [&path](const w_string& other) {
+          return fse_paths_overlap(path, other);
+        });
+    if (!covered) {
+      paths.push_back(path);
+    }
+  }
+  return paths;
+}
+#endif
+
 static struct fse_stream* fse_stream_make(
     const std::shared_ptr<w_root_t>& root,
     FSEventStreamEventId since,
@@ -111,6 +234,9 @@ std::shared_ptr<FSEventsWatcher> watcherFromRoot(
 static void log_drop_event(
     const std::shared_ptr<w_root_t>& root,
     bool isKernel) {
+  if (auto watcher = watcherFromRoot(root)) {
+    ++watcher->stats.overflows;
+  }
   w_perf_t sample(isKernel ? "KernelDropped" : "UserDropped");
   sample.add_root_meta(root);
   sample.finish();
@@ -131,6 +257,7 @@ static void fse_callback(
   auto root = stream->root;
   std::deque<watchman_fsevent> items;
   auto watcher = watcherFromRoot(root);
+  watcher->recordBatch(numEvents);
 
   if (!stream->lost_sync) {
     // This is to facilitate testing via debug-fsevents-inject-drop.
@@ -240,6 +367,7 @@ propagate:
           "up on {} events)\n",
           eventIds[i],
           eventIds[i] - stream->since);
+      stream->history_done = true;
       continue;
     }
 
@@ -256,10 +384,24 @@ propagate:
       continue;
     }
 
-    items.emplace_back(w_string(path, len), eventFlags[i]);
+    items.emplace_back(
+        w_string(path, len),
+        eventFlags[i],
+        eventIds[i],
+        stream->since != kFSEventStreamEventIdSinceNow &&
+            !stream->history_done);
     if (!stream->lost_sync) {
       stream->last_good = eventIds[i];
     }
+
+    if (watcher->kqueue_budget > 0 &&
+        !(eventFlags[i] & kFSEventStreamEventFlagItemRemoved)) {
+      auto& item = items.back();
+      watcher->noteActiveDir(
+          (eventFlags[i] & kFSEventStreamEventFlagItemIsDir)
+              ? item.path
+              : item.path.dirName());
+    }
   }
 
   if (!items.empty()) {
@@ -274,6 +416,113 @@ static void fse_pipe_callback(CFFileDescriptorRef, CFOptionFlags, void*) {
   CFRunLoopStop(CFRunLoopGetCurrent());
 }
 
+static void
+fse_kqueue_callback(CFFileDescriptorRef fdref, CFOptionFlags, void* info) {
+  auto root = static_cast<w_root_t*>(info)->shared_from_this();
+  auto watcher = watcherFromRoot(root);
+  if (watcher) {
+    watcher->readKQueue(root);
+  }
+  // The callback is disabled each time that it fires
+  CFFileDescriptorEnableCallBacks(fdref, kCFFileDescriptorReadCallBack);
+}
+
+void FSEventsWatcher::noteActiveDir(const w_string& dir) {
+  auto it = kqueue_dirs.find(dir);
+  if (it != kqueue_dirs.end()) {
+    kqueue_lru.splice(kqueue_lru.begin(), kqueue_lru, it->second);
+    return;
+  }
+
+  FileDescriptor fd(
+      open(dir.c_str(), O_EVTONLY | O_NOFOLLOW | O_CLOEXEC),
+      FileDescriptor::FDType::Generic);
+  if (!fd) {
+    // It's gone already, or it isn't a dir that we can open
+    return;
+  }
+  struct kevent k;
+  memset(&k, 0, sizeof(k));
+  EV_SET(
+      &k,
+      fd.fd(),
+      EVFILT_VNODE,
+      EV_ADD | EV_CLEAR,
+      NOTE_WRITE | NOTE_DELETE | NOTE_EXTEND | NOTE_RENAME | NOTE_REVOKE,
+      0,
+      nullptr);
+  if (kevent(kq_fd.fd(), &k, 1, nullptr, 0, nullptr)) {
+    logf(DBG, "kevent EV_ADD dir {} failed: {}\n", dir, strerror(errno));
+    return;
+  }
+
+  kqueue_fd_to_path.set(fd.fd(), dir);
+  kqueue_lru.push_front(KQueueDir{dir, std::move(fd)});
+  kqueue_dirs.emplace(dir, kqueue_lru.begin());
+
+  while (kqueue_lru.size() > kqueue_budget) {
+    unwatchKQueueDir(kqueue_lru.back().path);
+  }
+  kqueue_watches = kqueue_lru.size();
+}
+
+void FSEventsWatcher::unwatchKQueueDir(const w_string& dir) {
+  auto it = kqueue_dirs.find(dir);
+  if (it == kqueue_dirs.end()) {
+    return;
+  }
+  auto entry = it->second;
+  kqueue_dirs.erase(it);
+  kqueue_fd_to_path.erase(entry->fd.fd());
+  // Closing the fd removes its kevent along with any of its events that
+  // are yet to be read
+  kqueue_lru.erase(entry);
+  kqueue_watches = kqueue_lru.size();
+}
+
+void FSEventsWatcher::readKQueue(const std::shared_ptr<w_root_t>& root) {
+  struct kevent events[WATCHMAN_BATCH_LIMIT / 16];
+  struct timespec ts = {0, 0};
+  std::deque<watchman_fsevent> items;
+
+  int n = kevent(
+      kq_fd.fd(),
+      nullptr,
+      0,
+      events,
+      sizeof(events) / sizeof(events[0]),
+      &ts);
+  for (int i = 0; i < n; ++i) {
+    auto found = kqueue_fd_to_path.find(int(events[i].ident));
+    if (!found) {
+      continue;
+    }
+    auto path = *found;
+    logf(DBG, "kqueue: {} fflags={:x}\n", path, events[i].fflags);
+
+    // The entries of the dir changed
+    FSEventStreamEventFlags flags =
+        kFSEventStreamEventFlagItemIsDir | kFSEventStreamEventFlagItemModified;
+    if (events[i].fflags & (NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE)) {
+      // The watch follows the dir rather than its name, so we're done with
+      // it, and the old name needs to be looked at recursively
+      unwatchKQueueDir(path);
+      flags =
+          kFSEventStreamEventFlagItemIsDir | kFSEventStreamEventFlagItemRenamed;
+    }
+    if (root->ignore.isIgnored(path.data(), path.size())) {
+      continue;
+    }
+    items.emplace_back(std::move(path), flags, 0, false);
+  }
+
+  if (!items.empty()) {
+    auto wlock = items_.lock();
+    std::move(items.begin(), items.end(), std::back_inserter(*wlock));
+    fse_cond.notify_one();
+  }
+}
+
 fse_stream::~fse_stream() {
   if (stream) {
     FSEventStreamStop(stream);
@@ -295,6 +544,7 @@ static fse_stream* fse_stream_make(
   double latency;
   struct stat st;
   auto watcher = watcherFromRoot(root);
+  std::vector<w_string> exclusions;
 
   struct fse_stream* fse_stream = new struct fse_stream(root, since);
 
@@ -324,16 +574,21 @@ static fse_stream* fse_stream_make(
           "fsevents journal is not available for dev_t=", st.st_dev, "\n");
       goto fail;
     }
-    // Compare the UUID with that of the current stream
-    if (!watcher->stream->uuid) {
-      failure_reason = w_string(
-          "fsevents journal was not available for prior stream",
-          W_STRING_UNICODE);
-      goto fail;
+    // Compare the UUID with that of the current stream, or with that of
+    // the stream of the prior incarnation that we're resuming from
+    if (watcher->stream) {
+      if (!watcher->stream->uuid) {
+        failure_reason = w_string(
+            "fsevents journal was not available for prior stream",
+            W_STRING_UNICODE);
+        goto fail;
+      }
+      b = CFUUIDGetUUIDBytes(watcher->stream->uuid);
+    } else {
+      b = watcher->resume_uuid;
     }
 
     a = CFUUIDGetUUIDBytes(fse_stream->uuid);
-    b = CFUUIDGetUUIDBytes(watcher->stream->uuid);
 
     if (memcmp(&a, &b, sizeof(a)) != 0) {
       failure_reason =
@@ -390,10 +645,11 @@ static fse_stream* fse_stream_make(
       fse_stream->stream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
 
 #ifdef HAVE_FSEVENTSTREAMSETEXCLUSIONPATHS
-  if (!root->ignore.dirs_vec.empty() &&
-      root->config.getBool("_use_fsevents_exclusions", true)) {
+  if (root->config.getBool("_use_fsevents_exclusions", true)) {
+    exclusions = fse_exclusion_paths(root);
+  }
+  if (!exclusions.empty()) {
     CFMutableArrayRef ignarray;
-    size_t i, nitems = std::min(root->ignore.dirs_vec.size(), MAX_EXCLUSIONS);
 
     ignarray = CFArrayCreateMutable(nullptr, 0, &kCFTypeArrayCallBacks);
     if (!ignarray) {
@@ -402,8 +658,7 @@ static fse_stream* fse_stream_make(
       goto fail;
     }
 
-    for (i = 0; i < nitems; ++i) {
-      const auto& path = root->ignore.dirs_vec[i];
+    for (const auto& path : exclusions) {
       CFStringRef ignpath;
 
       ignpath = CFStringCreateWithBytes(
@@ -453,6 +708,7 @@ fail:
 
 void FSEventsWatcher::FSEventsThread(const std::shared_ptr<w_root_t>& root) {
   CFFileDescriptorRef fdref;
+  CFFileDescriptorRef kqref = nullptr;
   auto fdctx = CFFileDescriptorContext();
 
   w_set_thread_name("fsevents ", root->root_path);
@@ -481,13 +737,65 @@ void FSEventsWatcher::FSEventsThread(const std::shared_ptr<w_root_t>& root) {
       CFRelease(fdsrc);
     }
 
-    stream = fse_stream_make(
-        root, kFSEventStreamEventIdSinceNow, root->failure_reason);
+    if (kqueue_budget > 0) {
+      kq_fd =
+          FileDescriptor(kqueue(), "kqueue", FileDescriptor::FDType::Generic);
+      kq_fd.setCloExec();
+      kqref = CFFileDescriptorCreate(
+          nullptr, kq_fd.fd(), false, fse_kqueue_callback, &fdctx);
+      CFFileDescriptorEnableCallBacks(kqref, kCFFileDescriptorReadCallBack);
+      auto kqsrc = CFFileDescriptorCreateRunLoopSource(nullptr, kqref, 0);
+      if (!kqsrc) {
+        root->failure_reason = w_string(
+            "CFFileDescriptorCreateRunLoopSource failed", W_STRING_UNICODE);
+        goto done;
+      }
+      CFRunLoopAddSource(CFRunLoopGetCurrent(), kqsrc, kCFRunLoopDefaultMode);
+      CFRelease(kqsrc);
+      kqueue_dirs.reserve(kqueue_budget);
+    }
+
+    if (resume_since != kFSEventStreamEventIdSinceNow) {
+      w_string failure_reason;
+      stream = fse_stream_make(root, resume_since, failure_reason);
+      if (stream && FSEventStreamStart(stream->stream)) {
+        logf(
+            ERR,
+            "Replaying fsevents from event id {} of the view snapshot\n",
+            resume_since);
+        resumed = true;
+      } else {
+        if (!failure_reason) {
+          failure_reason =
+              w_string("FSEventStreamStart failed", W_STRING_UNICODE);
+        }
+        logf(
+            ERR,
+            "Can't replay fsevents from the view snapshot ({}), "
+            "so the restored view will be crawled\n",
+            failure_reason);
+        delete stream;
+        stream = nullptr;
+      }
+    }
+
     if (!stream) {
-      goto done;
+      // Anything that happened before we start is picked up by the crawl
+      consumed_id = FSEventsGetCurrentEventId();
+      stream = fse_stream_make(
+          root, kFSEventStreamEventIdSinceNow, root->failure_reason);
+      if (!stream) {
+        goto done;
+      }
+    } else {
+      consumed_id = resume_since;
+    }
+    if (stream->uuid) {
+      journal_uuid = CFUUIDGetUUIDBytes(stream->uuid);
+      have_journal_uuid = true;
     }
 
-    if (!FSEventStreamStart(stream->stream)) {
+    if (!resumed && !FSEventStreamStart(stream->stream)) {
       root->failure_reason = w_string::build(
           "FSEventStreamStart failed, look at your log file ",
           log_name,
@@ -511,6 +819,14 @@ done:
   if (fdref) {
     CFRelease(fdref);
   }
+  if (kqref) {
+    CFFileDescriptorInvalidate(kqref);
+    CFRelease(kqref);
+  }
+  kqueue_dirs.clear();
+  kqueue_fd_to_path.clear();
+  kqueue_lru.clear();
+  kqueue_watches = 0;
 
   logf(DBG, "fse_thread done\n");
 }
@@ -557,6 +873,18 @@ bool FSEventsWatcher::consumeNotify(
       break;
     }
 
+    if (item.replayed &&
+        ((item.flags & kFSEventStreamEventFlagEventIdsWrapped) ||
+         ((item.flags & kFSEventStreamEventFlagMustScanSubDirs) &&
+          item.path == root->root_path))) {
+      // The journal can't tell us everything that we missed
+      root->scheduleRecrawl(
+          "fsevents journal replay was incomplete; "
+          "kFSEventStreamEventFlagEventIdsWrapped or "
+          "kFSEventStreamEventFlagMustScanSubDirs of the root");
+      break;
+    }
+
     if (item.flags & kFSEventStreamEventFlagRootChanged) {
       logf(
           ERR,
@@ -572,19 +900,84 @@ bool FSEventsWatcher::consumeNotify(
         ? true
         : false;
 
+    // The flags of the events for a path are coalesced, so this is only
+    // clear-cut if the path wasn't also created or renamed.  If it is
+    // created again after this event, that is reported by a later one.
+    bool removed = trust_removals &&
+        (item.flags &
+         (kFSEventStreamEventFlagItemRemoved |
+          kFSEventStreamEventFlagItemCreated |
+          kFSEventStreamEventFlagItemRenamed |
+          kFSEventStreamEventFlagMustScanSubDirs)) ==
+            kFSEventStreamEventFlagItemRemoved;
+
     coll->add(
         item.path,
         now,
-        W_PENDING_VIA_NOTIFY | (recurse ? W_PENDING_RECURSIVE : 0));
+        W_PENDING_VIA_NOTIFY | (recurse ? W_PENDING_RECURSIVE : 0) |
+            (removed ? W_PENDING_REMOVED : 0));
+    if (item.id > consumed_id) {
+      consumed_id = item.id;
+    }
   }
 
   return !items.empty();
 }
 
-FSEventsWatcher::FSEventsWatcher(w_root_t*)
+FSEventsWatcher::FSEventsWatcher(w_root_t* root)
     : Watcher(
           "fsevents",
-          WATCHER_HAS_PER_FILE_NOTIFICATIONS | WATCHER_COALESCED_RENAME) {}
+          WATCHER_HAS_PER_FILE_NOTIFICATIONS | WATCHER_COALESCED_RENAME),
+      trust_removals(root->config.getBool("fsevents_trust_removals", false)),
+      resume_from_snapshot(
+          root->config.getBool("fsevents_resume_from_snapshot", false)),
+      kqueue_budget(size_t(std::max(
+          json_int_t(0), root->config.getInt("fsevents_kqueue_dirs", 0)))) {}
+
+// The position is the UUID of the journal in hex, followed by a colon and
+// the event id
+w_string FSEventsWatcher::getResumePosition() {
+  if (!have_journal_uuid) {
+    return nullptr;
+  }
+  std::string uuid;
+  folly::hexlify(
+      folly::ByteRange(
+          reinterpret_cast<const uint8_t*>(&journal_uuid),
+          sizeof(journal_uuid)),
+      uuid);
+  return w_string::build(uuid, ":", consumed_id.load());
+}
+
+void FSEventsWatcher::setResumePosition(w_string_piece position) {
+  if (!resume_from_snapshot) {
+    return;
+  }
+  folly::StringPiece pos = position;
+  auto colon = pos.find(':');
+  if (colon == folly::StringPiece::npos) {
+    return;
+  }
+  std::string uuid;
+  if (!folly::unhexlify(pos.subpiece(0, colon), uuid) ||
+      uuid.size() != sizeof(resume_uuid)) {
+    return;
+  }
+  auto id = folly::tryTo<FSEventStreamEventId>(pos.subpiece(colon + 1));
+  if (!id.hasValue() || id.value() == 0) {
+    return;
+  }
+  memcpy(&resume_uuid, uuid.data(), sizeof(resume_uuid));
+  resume_since = id.value();
+}
+
+bool FSEventsWatcher::resumedFromPosition() {
+  return resumed;
+}
+
+size_t FSEventsWatcher::getNumWatches() const {
+  return kqueue_watches.load();
+}
 
 void FSEventsWatcher::signalThreads() {
   write(fse_pipe.write.fd(), "X", 1);
@@ -2,13 +2,16 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <folly/FileUtil.h>
 #include <folly/Synchronized.h>
+#include "DescriptorTable.h"
 #include "FileDescriptor.h"
 #include "InMemoryView.h"
 #include "Pipe.h"
 #include "watchman_error_category.h"
 
 #ifdef HAVE_INOTIFY_INIT
+#include <sys/ioctl.h>
 
 using namespace watchman;
 using watchman::FileDescriptor;
@@ -48,6 +51,19 @@ static const struct flag_map inflags[] = {
     {0, nullptr},
 };
 
+// How long ago a dir must have last reported an event for us to consider
+// it to be active when the kernel drops some notifications
+constexpr time_t kRecentActivitySeconds = 30;
+// The most active dirs that we keep track of
+constexpr size_t kMaxRecentDirs = 16 * 1024;
+// Big enough for 16k entries, which happens to be the default
+// fs.inotify.max_queued_events
+constexpr size_t kDefaultReadBufferSize =
+    WATCHMAN_BATCH_LIMIT * (sizeof(struct inotify_event) + (NAME_MAX + 1));
+// Big enough for the largest event
+constexpr size_t kMinReadBufferSize =
+    sizeof(struct inotify_event) + (NAME_MAX + 1);
+
 struct pending_move {
   time_t created;
   w_string name;
@@ -63,17 +79,36 @@ struct InotifyWatcher : public Watcher {
 
   struct maps {
     /* map of active watch descriptor to name of the corresponding dir */
-    std::unordered_map<int, w_string> wd_to_name;
+    DescriptorTable<w_string> wd_to_name;
     /* map of inotify cookie to corresponding name */
     std::unordered_map<uint32_t, pending_move> move_map;
   };
 
   folly::Synchronized<maps> maps;
 
-  // Make the buffer big enough for 16k entries, which
-  // happens to be the default fs.inotify.max_queued_events
-  char ibuf
-      [WATCHMAN_BATCH_LIMIT * (sizeof(struct inotify_event) + (NAME_MAX + 1))];
+  // map of dirs that recently reported events to when they last did.
+  // This is only accessed by the notify thread.
+  std::unordered_map<w_string, time_t> recentDirs_;
+  // When we last had to forget dirs that were still active
+  time_t forgotRecentDirs_{0};
+
+  // Each read fills as much of this as the kernel has events for; its
+  // size is set by inotify_read_buffer_size
+  std::vector<char> ibuf;
+
+  // The dirs of the watch descriptors in the batch that is being
+  // processed, which are looked up together under one acquisition of the
+  // maps lock.  Only accessed by the notify thread.
+  DescriptorTable<w_string> batchDirs_;
+  // The paths that the batch adds to the pending collection, with the
+  // flags of each, so that the events of the batch for the same path
+  // are added once.  Only accessed by the notify thread.
+  std::vector<std::pair<w_string, int>> batchPending_;
+  std::unordered_map<w_string, size_t> batchPendingIndex_;
+
+  // fs.inotify.max_user_watches when the watcher was created.  The limit
+  // is shared by all of the inotify instances of the user.
+  size_t maxUserWatches_{0};
 
   explicit InotifyWatcher(w_root_t* root);
 
@@ -87,14 +122,25 @@ struct InotifyWatcher : public Watcher {
       PendingCollection::LockedPtr& coll) override;
 
   bool waitNotify(int timeoutms) override;
+  int getNotifyFd() override;
+
+  bool isDrained() override;
 
-  void process_inotify_event(
+  // Returns false if the root was cancelled
+  bool process_inotify_event(
       const std::shared_ptr<w_root_t>& root,
-      PendingCollection::LockedPtr& coll,
       struct inotify_event* ine,
       struct timeval now);
 
   void signalThreads() override;
+
+  size_t getNumWatches() const override;
+  size_t getWatchLimit() const override;
+
+ private:
+  void addPending(const w_string& name, int flags);
+  void noteActivity(const w_string& dir_name, time_t now);
+  std::vector<w_string> getRecentlyActiveDirs(time_t now);
 };
 
 InotifyWatcher::InotifyWatcher(w_root_t* root)
@@ -110,6 +156,16 @@ InotifyWatcher::InotifyWatcher(w_root_t* root)
   }
   infd.setCloExec();
 
+  ibuf.resize(std::max(
+      kMinReadBufferSize,
+      size_t(root->config.getInt(
+          "inotify_read_buffer_size", kDefaultReadBufferSize))));
+
+  std::string maxWatches;
+  if (folly::readFile("/proc/sys/fs/inotify/max_user_watches", maxWatches)) {
+    maxUserWatches_ = strtoull(maxWatches.c_str(), nullptr, 10);
+  }
+
   {
     auto wlock = maps.wlock();
     wlock->wd_to_name.reserve(
@@ -140,16 +196,15 @@ std::unique_ptr<watchman_dir_handle> InotifyWatcher::startWatchDir(
   // record mapping
   {
     auto wlock = maps.wlock();
-    wlock->wd_to_name[newwd] = dir_name;
+    wlock->wd_to_name.set(newwd, dir_name);
   }
   logf(DBG, "adding {} -> {} mapping\n", newwd, path);
 
   return osdir;
 }
 
-void InotifyWatcher::process_inotify_event(
+bool InotifyWatcher::process_inotify_event(
     const std::shared_ptr<w_root_t>& root,
-    PendingCollection::LockedPtr& coll,
     struct inotify_event* ine,
     struct timeval now) {
   char flags_label[128];
@@ -164,20 +219,24 @@ void InotifyWatcher::process_inotify_event(
       ine->len > 0 ? ine->name : "");
 
   if (ine->wd == -1 && (ine->mask & IN_Q_OVERFLOW)) {
-    /* we missed something, will need to re-crawl */
-    root->scheduleRecrawl("IN_Q_OVERFLOW");
+    /* we missed something, will need to re-examine the places
+     * where it could have happened.  If we don't know them all,
+     * we have to re-crawl */
+    ++stats.overflows;
+    if (now.tv_sec - forgotRecentDirs_ <= kRecentActivitySeconds) {
+      root->scheduleRecrawl("IN_Q_OVERFLOW");
+    } else {
+      root->scheduleOverflowRecovery(
+          "IN_Q_OVERFLOW", getRecentlyActiveDirs(now.tv_sec));
+    }
   } else if (ine->wd != -1) {
     w_string name;
     char buf[WATCHMAN_NAME_MAX];
     int pending_flags = W_PENDING_VIA_NOTIFY;
     w_string dir_name;
 
-    {
-      auto rlock = maps.rlock();
-      auto it = rlock->wd_to_name.find(ine->wd);
-      if (it != rlock->wd_to_name.end()) {
-        dir_name = it->second;
-      }
+    if (auto batch_dir_name = batchDirs_.find(ine->wd)) {
+      dir_name = *batch_dir_name;
     }
 
     if (dir_name) {
@@ -235,7 +294,7 @@ void InotifyWatcher::process_inotify_event(
           }
         } else {
           logf(DBG, "moved {} -> {}\n", old.name.c_str(), name.c_str());
-          wlock->wd_to_name[wd] = name;
+          wlock->wd_to_name.set(wd, name);
         }
       } else {
         logf(
@@ -255,7 +314,7 @@ void InotifyWatcher::process_inotify_event(
               "root dir {} has been (re)moved, canceling watch\n",
               root->root_path);
           root->cancel();
-          return;
+          return false;
         }
 
         // We need to examine the parent and potentially crawl down
@@ -273,7 +332,8 @@ void InotifyWatcher::process_inotify_event(
           "add_pending for inotify mask={:x} {}\n",
           ine->mask,
           name.c_str());
-      coll->add(name, now, pending_flags);
+      addPending(name, pending_flags);
+      noteActivity(dir_name, now.tv_sec);
 
       // The kernel removed the wd -> name mapping, so let's update
       // our state here also
@@ -286,6 +346,7 @@ void InotifyWatcher::process_inotify_event(
             dir_name);
         auto wlock = maps.wlock();
         wlock->wd_to_name.erase(ine->wd);
+        batchDirs_.erase(ine->wd);
       }
 
     } else if ((ine->mask & (IN_MOVE_SELF | IN_IGNORED)) == 0) {
@@ -301,6 +362,48 @@ void InotifyWatcher::process_inotify_event(
       root->scheduleRecrawl("dir missing from internal state");
     }
   }
+  return true;
+}
+
+void InotifyWatcher::addPending(const w_string& name, int flags) {
+  auto it = batchPendingIndex_.find(name);
+  if (it != batchPendingIndex_.end()) {
+    batchPending_[it->second].second |= flags;
+    ++stats.coalescedEvents;
+    return;
+  }
+  batchPendingIndex_.emplace(name, batchPending_.size());
+  batchPending_.emplace_back(name, flags);
+}
+
+void InotifyWatcher::noteActivity(const w_string& dir_name, time_t now) {
+  if (recentDirs_.size() >= kMaxRecentDirs &&
+      recentDirs_.find(dir_name) == recentDirs_.end()) {
+    auto it = recentDirs_.begin();
+    while (it != recentDirs_.end()) {
+      if (now - it->second > kRecentActivitySeconds) {
+        it = recentDirs_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (recentDirs_.size() >= kMaxRecentDirs) {
+      // Too much is going on for a targeted recovery to be worthwhile
+      recentDirs_.clear();
+      forgotRecentDirs_ = now;
+    }
+  }
+  recentDirs_[dir_name] = now;
+}
+
+std::vector<w_string> InotifyWatcher::getRecentlyActiveDirs(time_t now) {
+  std::vector<w_string> dirs;
+  for (auto& it : recentDirs_) {
+    if (now - it.second <= kRecentActivitySeconds) {
+      dirs.push_back(it.first);
+    }
+  }
+  return dirs;
 }
 
 bool InotifyWatcher::consumeNotify(
@@ -311,7 +414,7 @@ bool InotifyWatcher::consumeNotify(
   int n;
   struct timeval now;
 
-  n = read(infd.fd(), &ibuf, sizeof(ibuf));
+  n = read(infd.fd(), ibuf.data(), ibuf.size());
   if (n == -1) {
     if (errno == EINTR) {
       return false;
@@ -320,17 +423,41 @@ bool InotifyWatcher::consumeNotify(
         FATAL,
         "read({}, {}): error {}\n",
         infd.fd(),
-        sizeof(ibuf),
+        ibuf.size(),
         strerror(errno));
   }
 
   logf(DBG, "inotify read: returned {}.\n", n);
   gettimeofday(&now, nullptr);
 
-  for (iptr = ibuf; iptr < ibuf + n; iptr = iptr + sizeof(*ine) + ine->len) {
-    ine = (struct inotify_event*)iptr;
+  char* end = ibuf.data() + n;
+  batchDirs_.clear();
+  {
+    auto rlock = maps.rlock();
+    for (iptr = ibuf.data(); iptr < end; iptr += sizeof(*ine) + ine->len) {
+      ine = (struct inotify_event*)iptr;
+      if (ine->wd == -1 || batchDirs_.find(ine->wd)) {
+        continue;
+      }
+      if (auto dir_name = rlock->wd_to_name.find(ine->wd)) {
+        batchDirs_.set(ine->wd, *dir_name);
+      }
+    }
+  }
 
-    process_inotify_event(root, coll, ine, now);
+  batchPending_.clear();
+  batchPendingIndex_.clear();
+  size_t numEvents = 0;
+  for (iptr = ibuf.data(); iptr < end; iptr += sizeof(*ine) + ine->len) {
+    ine = (struct inotify_event*)iptr;
+    ++numEvents;
+    if (!process_inotify_event(root, ine, now)) {
+      break;
+    }
+  }
+  recordBatch(numEvents, n);
+  for (auto& it : batchPending_) {
+    coll->add(it.first, now, it.second);
   }
 
   // It is possible that we can accumulate a set of pending_move
@@ -385,10 +512,27 @@ bool InotifyWatcher::waitNotify(int timeoutms) {
   return false;
 }
 
+int InotifyWatcher::getNotifyFd() {
+  return infd.fd();
+}
+
+bool InotifyWatcher::isDrained() {
+  int avail = 0;
+  return ioctl(infd.fd(), FIONREAD, &avail) == 0 && avail == 0;
+}
+
 void InotifyWatcher::signalThreads() {
   ignore_result(write(terminatePipe_.write.fd(), "X", 1));
 }
 
+size_t InotifyWatcher::getNumWatches() const {
+  return maps.rlock()->wd_to_name.size();
+}
+
+size_t InotifyWatcher::getWatchLimit() const {
+  return maxUserWatches_;
+}
+
 namespace {
 std::shared_ptr<watchman::QueryableView> detectInotify(w_root_t* root) {
   if (root->fs_type == "fuse") {
@@ -3,7 +3,9 @@
 
 #include "watchman.h"
 #include <folly/Synchronized.h>
+#include <sys/resource.h>
 #include <array>
+#include "DescriptorTable.h"
 #include "FileDescriptor.h"
 #include "InMemoryView.h"
 #include "Pipe.h"
@@ -24,7 +26,7 @@ struct KQueueWatcher : public Watcher {
   struct maps {
     std::unordered_map<w_string, FileDescriptor> name_to_fd;
     /* map of active watch descriptor to name of the corresponding item */
-    std::unordered_map<int, w_string> fd_to_name;
+    DescriptorTable<w_string> fd_to_name;
 
     explicit maps(json_int_t sizeHint) {
       name_to_fd.reserve(sizeHint);
@@ -49,7 +51,11 @@ struct KQueueWatcher : public Watcher {
       PendingCollection::LockedPtr& coll) override;
 
   bool waitNotify(int timeoutms) override;
+  int getNotifyFd() override;
   void signalThreads() override;
+
+  size_t getNumWatches() const override;
+  size_t getWatchLimit() const override;
 };
 
 static const struct flag_map kflags[] = {
@@ -70,6 +76,19 @@ KQueueWatcher::KQueueWatcher(w_root_t* root)
   kq_fd.setCloExec();
 }
 
+size_t KQueueWatcher::getNumWatches() const {
+  return maps_.rlock()->fd_to_name.size();
+}
+
+size_t KQueueWatcher::getWatchLimit() const {
+  // Each watch holds an open descriptor
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == RLIM_INFINITY) {
+    return 0;
+  }
+  return limit.rlim_cur;
+}
+
 bool KQueueWatcher::startWatchFile(struct watchman_file* file) {
   struct kevent k;
 
@@ -117,7 +136,7 @@ bool KQueueWatcher::startWatchFile(struct watchman_file* file) {
   {
     auto wlock = maps_.wlock();
     wlock->name_to_fd[full_name] = std::move(fdHolder);
-    wlock->fd_to_name[rawFd] = full_name;
+    wlock->fd_to_name.set(rawFd, full_name);
   }
 
   if (kevent(kq_fd.fd(), &k, 1, nullptr, 0, 0)) {
@@ -159,8 +178,8 @@ std::unique_ptr<watchman_dir_handle> KQueueWatcher::startWatchDir(
         errno, std::generic_category(), std::string("open O_EVTONLY: ") + path);
   }
   if (fstat(rawFd, &st) == -1 || fstat(osdir->getFd(), &osdirst) == -1) {
-    // whaaa?
-    root->scheduleRecrawl("fstat failed");
+    // whaaa?  handle_open_errno arranges for the dir to be crawled again
+    // if the error may be transient
     throw std::system_error(
         errno,
         std::generic_category(),
@@ -192,7 +211,7 @@ std::unique_ptr<watchman_dir_handle> KQueueWatcher::startWatchDir(
   {
     auto wlock = maps_.wlock();
     wlock->name_to_fd[dir_name] = std::move(fdHolder);
-    wlock->fd_to_name[rawFd] = dir_name;
+    wlock->fd_to_name.set(rawFd, dir_name);
   }
 
   if (kevent(kq_fd.fd(), &k, 1, nullptr, 0, 0)) {
@@ -233,6 +252,9 @@ bool KQueueWatcher::consumeNotify(
   if (root->inner.cancelled) {
     return 0;
   }
+  if (n > 0) {
+    recordBatch(n);
+  }
 
   gettimeofday(&now, nullptr);
   for (i = 0; n > 0 && i < n; i++) {
@@ -243,8 +265,8 @@ bool KQueueWatcher::consumeNotify(
 
     w_expand_flags(kflags, fflags, flags_label, sizeof(flags_label));
     auto wlock = maps_.wlock();
-    auto it = wlock->fd_to_name.find(fd);
-    w_string path = it == wlock->fd_to_name.end() ? nullptr : it->second;
+    auto name = wlock->fd_to_name.find(fd);
+    w_string path = name ? *name : nullptr;
     if (!path) {
       // Was likely a buffered notification for something that we decided
       // to stop watching
@@ -286,6 +308,10 @@ bool KQueueWatcher::consumeNotify(
   return n > 0;
 }
 
+int KQueueWatcher::getNotifyFd() {
+  return kq_fd.fd();
+}
+
 bool KQueueWatcher::waitNotify(int timeoutms) {
   int n;
   std::array<struct pollfd, 2> pfd;
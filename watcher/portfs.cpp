@@ -6,19 +6,38 @@
 
 #include "watchman.h"
 #include <folly/Synchronized.h>
+#include <algorithm>
 #include <memory>
+#include <vector>
 #include "InMemoryView.h"
 
 #ifdef HAVE_PORT_CREATE
 
 #define WATCHMAN_PORT_EVENTS FILE_MODIFIED | FILE_ATTRIB | FILE_NOFOLLOW
 
+namespace {
+// The number of events that we ask port_getn for at a time
+constexpr size_t kMinBatchSize = 64;
+} // namespace
+
 struct watchman_port_file {
   file_obj_t port_file;
   w_string name;
   bool is_dir;
 };
 
+/* A port reports a file object once and then dissociates it, so each
+ * event has to be followed by a port_associate once the IO thread has
+ * looked at the file again.  The times that we associate the file object
+ * with come from that look, and the port reports the object straight
+ * away if the file has changed since, so the association doesn't have to
+ * happen right then.  startWatchFile queues the files and the notify
+ * thread associates the whole queue under one lock on port_files,
+ * rather than the IO thread taking that lock for each file.  Dirs are
+ * still associated as they are crawled, since a failure there has to be
+ * reported to the crawler.
+ */
+
 using watchman::FileDescriptor;
 using watchman::Pipe;
 
@@ -26,16 +45,21 @@ struct PortFSWatcher : public Watcher {
   FileDescriptor port_fd;
   FileDescriptor port_delete_fd;
   Pipe terminatePipe_;
+  // Written to when the queue of files to associate becomes non-empty
+  Pipe associatePipe_;
 
-  /* map of file name to watchman_port_file */
-  folly::Synchronized<
-      std::unordered_map<w_string, std::unique_ptr<watchman_port_file>>>
-      port_files;
+  struct PortFiles {
+    /* map of file name to watchman_port_file */
+    std::unordered_map<w_string, std::unique_ptr<watchman_port_file>> files;
+    // Files that are in the map but waiting to be associated
+    std::vector<watchman_port_file*> toAssociate;
+  };
+  folly::Synchronized<PortFiles> port_files;
 
   std::unique_ptr<watchman_port_file> root_delete_w_port_file;
   bool root_deleted;
 
-  port_event_t portevents[WATCHMAN_BATCH_LIMIT];
+  std::vector<port_event_t> portevents;
 
   explicit PortFSWatcher(w_root_t* root);
 
@@ -58,6 +82,10 @@ struct PortFSWatcher : public Watcher {
       const w_string& name,
       const watchman::FileInformation& finfo,
       bool throw_on_error);
+  // Associates the files queued by startWatchFile
+  void associateQueued();
+
+  size_t getNumWatches() const override;
 };
 
 static const struct flag_map pflags[] = {
@@ -93,7 +121,10 @@ PortFSWatcher::PortFSWatcher(w_root_t* root)
       port_delete_fd(port_create(), "port_create()"),
       root_deleted(false) {
   auto wlock = port_files.wlock();
-  wlock->reserve(root->config.getInt(CFG_HINT_NUM_DIRS, HINT_NUM_DIRS));
+  wlock->files.reserve(root->config.getInt(CFG_HINT_NUM_DIRS, HINT_NUM_DIRS));
+  portevents.resize(std::max(
+      kMinBatchSize,
+      size_t(root->config.getInt("portfs_batch_size", WATCHMAN_BATCH_LIMIT))));
   port_fd.setCloExec();
   port_delete_fd.setCloExec();
 }
@@ -103,14 +134,14 @@ bool PortFSWatcher::do_watch(
     const watchman::FileInformation& finfo,
     bool throw_on_error) {
   auto wlock = port_files.wlock();
-  if (wlock->find(name) != wlock->end()) {
+  if (wlock->files.find(name) != wlock->files.end()) {
     // Already watching it
     return true;
   }
 
   auto f = make_port_file(name, finfo);
   auto rawFile = f.get();
-  wlock->emplace(name, std::move(f));
+  wlock->files.emplace(name, std::move(f));
 
   logf(DBG, "watching {}\n", name);
   errno = 0;
@@ -126,7 +157,7 @@ bool PortFSWatcher::do_watch(
         "port_associate {} {}\n",
         rawFile->port_file.fo_name,
         strerror(errno));
-    wlock->erase(name);
+    wlock->files.erase(name);
     if (throw_on_error) {
       throw std::system_error(err, std::generic_category(), "port_associate");
     }
@@ -136,6 +167,34 @@ bool PortFSWatcher::do_watch(
   return true;
 }
 
+size_t PortFSWatcher::getNumWatches() const {
+  auto rlock = port_files.rlock();
+  return rlock->files.size() - rlock->toAssociate.size();
+}
+
+void PortFSWatcher::associateQueued() {
+  auto wlock = port_files.wlock();
+  for (auto f : wlock->toAssociate) {
+    errno = 0;
+    if (port_associate(
+            port_fd.fd(),
+            PORT_SOURCE_FILE,
+            (uintptr_t)&f->port_file,
+            WATCHMAN_PORT_EVENTS,
+            (void*)f)) {
+      // Most likely it was deleted since it was looked at, in which case
+      // the IO thread will see that when it looks at the dir again
+      logf(
+          DBG,
+          "port_associate {} {}\n",
+          f->port_file.fo_name,
+          strerror(errno));
+      wlock->files.erase(f->name);
+    }
+  }
+  wlock->toAssociate.clear();
+}
+
 /*
  * We need to have an extra port the catches the delete event on the root.
  * The reason for this is that the creation or delete of one of the
@@ -176,7 +235,19 @@ bool PortFSWatcher::startWatchFile(struct watchman_file* file) {
     return false;
   }
 
-  return do_watch(name, file->stat, false);
+  auto wlock = port_files.wlock();
+  if (wlock->files.find(name) != wlock->files.end()) {
+    // Already watching it, or about to
+    return true;
+  }
+  auto f = make_port_file(name, file->getStat());
+  auto rawFile = f.get();
+  wlock->files.emplace(name, std::move(f));
+  if (wlock->toAssociate.empty()) {
+    ignore_result(write(associatePipe_.write.fd(), "X", 1));
+  }
+  wlock->toAssociate.push_back(rawFile);
+  return true;
 }
 
 std::unique_ptr<watchman_dir_handle> PortFSWatcher::startWatchDir(
@@ -188,14 +259,14 @@ std::unique_ptr<watchman_dir_handle> PortFSWatcher::startWatchDir(
   auto osdir = w_dir_open(path);
 
   if (fstat(osdir->getFd(), &st) == -1) {
+    auto err = errno;
     if (dir->getFullPath() == root->root_path) {
       root->cancel();
-    } else {
-      // whaaa?
-      root->scheduleRecrawl("fstat failed");
     }
+    // Otherwise handle_open_errno arranges for the dir to be crawled again
+    // if the error may be transient
     throw std::system_error(
-        errno,
+        err,
         std::generic_category(),
         std::string("fstat failed for dir ") + path);
   }
@@ -221,11 +292,7 @@ bool PortFSWatcher::consumeNotify(
 
   n = 1;
   if (port_getn(
-          port_fd.fd(),
-          portevents,
-          sizeof(portevents) / sizeof(portevents[0]),
-          &n,
-          nullptr)) {
+          port_fd.fd(), portevents.data(), portevents.size(), &n, nullptr)) {
     if (errno == EINTR) {
       return false;
     }
@@ -237,6 +304,7 @@ bool PortFSWatcher::consumeNotify(
   if (n == 0) {
     return false;
   }
+  recordBatch(n);
 
   auto wlock = port_files.wlock();
 
@@ -269,7 +337,7 @@ bool PortFSWatcher::consumeNotify(
 
     // It was port_dissociate'd implicitly.  We'll re-establish a
     // watch later when portfs_root_start_watch_(file|dir) are called again
-    wlock->erase(f->name);
+    wlock->files.erase(f->name);
   }
 
   return true;
@@ -277,7 +345,7 @@ bool PortFSWatcher::consumeNotify(
 
 bool PortFSWatcher::waitNotify(int timeoutms) {
   int n;
-  std::array<struct pollfd, 3> pfd;
+  std::array<struct pollfd, 4> pfd;
 
   pfd[0].fd = port_fd.fd();
   pfd[0].events = POLLIN;
@@ -285,6 +353,8 @@ bool PortFSWatcher::waitNotify(int timeoutms) {
   pfd[1].events = POLLIN;
   pfd[2].fd = terminatePipe_.read.fd();
   pfd[2].events = POLLIN;
+  pfd[3].fd = associatePipe_.read.fd();
+  pfd[3].events = POLLIN;
 
   n = poll(pfd.data(), pfd.size(), timeoutms);
 
@@ -293,6 +363,13 @@ bool PortFSWatcher::waitNotify(int timeoutms) {
       // We were signalled via signalThreads
       return false;
     }
+    if (pfd[3].revents) {
+      char buf[64];
+      while (read(associatePipe_.read.fd(), buf, sizeof(buf)) > 0) {
+        ;
+      }
+      associateQueued();
+    }
     if (pfd[1].revents) {
       // An exceptional event (delete) occured on the root so delete it
       root_deleted = true;
@@ -25,10 +25,96 @@ namespace {
 struct Item {
   w_string path;
   int flags;
+  // The state of the file as reported by an extended notification
+  std::unique_ptr<FileInformation> stat;
 
-  Item(w_string&& path, int flags) : path(std::move(path)), flags(flags) {}
+  Item(w_string&& path, int flags, std::unique_ptr<FileInformation> stat)
+      : path(std::move(path)), flags(flags), stat(std::move(stat)) {}
 };
 
+// ReadDirectoryChangesExW is only available on Windows 10 and later, so we
+// look it up at runtime
+using ReadDirectoryChangesExWFunc = BOOL(WINAPI*)(
+    HANDLE,
+    LPVOID,
+    DWORD,
+    BOOL,
+    DWORD,
+    LPDWORD,
+    LPOVERLAPPED,
+    LPOVERLAPPED_COMPLETION_ROUTINE,
+    READ_DIRECTORY_NOTIFY_INFORMATION_CLASS);
+
+std::unique_ptr<FileInformation> notifiedStat(const FILE_NOTIFY_INFORMATION&) {
+  return nullptr;
+}
+
+std::unique_ptr<FileInformation> notifiedStat(
+    const FILE_NOTIFY_EXTENDED_INFORMATION& info) {
+  if (info.Action == FILE_ACTION_REMOVED ||
+      info.Action == FILE_ACTION_RENAMED_OLD_NAME) {
+    // Whatever it was, it isn't there any more
+    return nullptr;
+  }
+  if (info.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+    // Leave symlinks and the like to getFileInformation
+    return nullptr;
+  }
+  // The same information as the crawler gets from the dir listing
+  auto st = std::make_unique<FileInformation>(info.FileAttributes);
+  FILETIME_LARGE_INTEGER_to_timespec(info.CreationTime, &st->ctime);
+  FILETIME_LARGE_INTEGER_to_timespec(info.LastAccessTime, &st->atime);
+  FILETIME_LARGE_INTEGER_to_timespec(info.LastModificationTime, &st->mtime);
+  st->size = info.FileSize.QuadPart;
+  return st;
+}
+
+// Appends the changes in the buffer filled by a successful read to items.
+// Info is FILE_NOTIFY_INFORMATION or FILE_NOTIFY_EXTENDED_INFORMATION,
+// depending on how the read was issued.
+template <typename Info>
+void parseNotifications(
+    const std::shared_ptr<w_root_t>& root,
+    const uint8_t* buf,
+    std::list<Item>& items) {
+  auto notify = (const Info*)buf;
+
+  while (true) {
+    DWORD n_chars;
+
+    // FileNameLength is in BYTES, but FileName is WCHAR
+    n_chars = notify->FileNameLength / sizeof(notify->FileName[0]);
+    w_string name(notify->FileName, n_chars);
+
+    auto full = w_string::pathCat({root->root_path, name});
+
+    if (!root->ignore.isIgnored(full.data(), full.size())) {
+      // If we have a delete or rename-away it may be part of
+      // a recursive tree remove or rename.  In that situation
+      // the notifications that we'll receive from the OS will
+      // be from the leaves and bubble up to the root of the
+      // delete/rename.  We want to flag those paths for recursive
+      // analysis so that we can prune children from the trie
+      // that is built when we pass this to the pending list
+      // later.  We don't do that here in this thread because
+      // we're trying to minimize latency in this context.
+      items.emplace_back(
+          std::move(full),
+          (notify->Action &
+           (FILE_ACTION_REMOVED | FILE_ACTION_RENAMED_OLD_NAME)) != 0
+              ? W_PENDING_RECURSIVE
+              : 0,
+          notifiedStat(*notify));
+    }
+
+    // Advance to next item
+    if (notify->NextEntryOffset == 0) {
+      break;
+    }
+    notify = (const Info*)(notify->NextEntryOffset + (const char*)notify);
+  }
+}
+
 } // namespace
 
 struct WinWatcher : public Watcher {
@@ -38,6 +124,10 @@ struct WinWatcher : public Watcher {
   std::condition_variable cond;
   folly::Synchronized<std::list<Item>, std::mutex> changedItems;
 
+  // Set if the system has ReadDirectoryChangesExW and
+  // win32_rdcw_extended_info is set
+  ReadDirectoryChangesExWFunc readChangesEx{nullptr};
+
   explicit WinWatcher(w_root_t* root);
   ~WinWatcher();
 
@@ -54,6 +144,7 @@ struct WinWatcher : public Watcher {
   bool start(const std::shared_ptr<w_root_t>& root) override;
   void signalThreads() override;
   void readChangesThread(const std::shared_ptr<w_root_t>& root);
+  BOOL issueRead(std::vector<uint8_t>& buf, DWORD filter, OVERLAPPED* olap);
 };
 
 WinWatcher::WinWatcher(w_root_t* root)
@@ -93,6 +184,11 @@ WinWatcher::WinWatcher(w_root_t* root)
         std::string("failed to create event: ") +
         win32_strerror(GetLastError()));
   }
+
+  if (root->config.getBool("win32_rdcw_extended_info", true)) {
+    readChangesEx = (ReadDirectoryChangesExWFunc)GetProcAddress(
+        GetModuleHandle("kernel32.dll"), "ReadDirectoryChangesExW");
+  }
 }
 
 WinWatcher::~WinWatcher() {
@@ -108,6 +204,35 @@ void WinWatcher::signalThreads() {
   SetEvent(ping);
 }
 
+BOOL WinWatcher::issueRead(
+    std::vector<uint8_t>& buf,
+    DWORD filter,
+    OVERLAPPED* olap) {
+  if (readChangesEx) {
+    // Asks for the attributes, size and times of each file along with
+    // its name, which saves stat'ing it
+    return readChangesEx(
+        (HANDLE)dir_handle.handle(),
+        buf.data(),
+        DWORD(buf.size()),
+        TRUE,
+        filter,
+        nullptr,
+        olap,
+        nullptr,
+        ReadDirectoryNotifyExtendedInformation);
+  }
+  return ReadDirectoryChangesW(
+      (HANDLE)dir_handle.handle(),
+      buf.data(),
+      DWORD(buf.size()),
+      TRUE,
+      filter,
+      nullptr,
+      olap,
+      nullptr);
+}
+
 void WinWatcher::readChangesThread(const std::shared_ptr<w_root_t>& root) {
   std::vector<uint8_t> buf;
   DWORD err, filter;
@@ -126,6 +251,48 @@ void WinWatcher::readChangesThread(const std::shared_ptr<w_root_t>& root) {
   auto extraLatency = root->config.getInt("win32_batch_latency_ms", 30);
 
   DWORD size = root->config.getInt("win32_rdcw_buf_size", 16384);
+  // The buffer is grown towards this size whenever a read fills most of
+  // it or overflows, which would otherwise make us recrawl
+  DWORD maxSize = std::max(
+      size, DWORD(root->config.getInt("win32_rdcw_max_buf_size", 1048576)));
+  auto& rootPath = root->root_path;
+  if (rootPath.size() > 2 && is_slash(rootPath.data()[0]) &&
+      is_slash(rootPath.data()[1])) {
+    // ReadDirectoryChangesW fails with ERROR_INVALID_PARAMETER if given
+    // more than 64k for a network share
+    size = std::min(size, DWORD(NETWORK_BUF_SIZE));
+    maxSize = NETWORK_BUF_SIZE;
+  }
+  auto growBuffer = [&]() {
+    if (size >= maxSize) {
+      return;
+    }
+    size = std::min(size * 2, maxSize);
+    buf.resize(size);
+    logf(
+        DBG,
+        "growing ReadDirectoryChangesW buffer for {} to {} bytes\n",
+        root->root_path,
+        size);
+  };
+
+  // A mapped drive may also be a network share, which we only find out
+  // about when a read fails; returns false if the buffer is already small
+  // enough that this can't be why
+  auto shrinkForNetwork = [&](DWORD readErr) {
+    if (readErr != ERROR_INVALID_PARAMETER || size <= NETWORK_BUF_SIZE) {
+      return false;
+    }
+    logf(
+        ERR,
+        "retrying watch for possible network location {} "
+        "with smaller buffer\n",
+        root->root_path);
+    size = NETWORK_BUF_SIZE;
+    maxSize = NETWORK_BUF_SIZE;
+    buf.resize(size);
+    return true;
+  };
 
   // Block until winmatch_root_st is waiting for our initialization
   {
@@ -139,15 +306,21 @@ void WinWatcher::readChangesThread(const std::shared_ptr<w_root_t>& root) {
 
     buf.resize(size);
 
-    if (!ReadDirectoryChangesW(
-            (HANDLE)dir_handle.handle(),
-            &buf[0],
-            size,
-            TRUE,
-            filter,
-            nullptr,
-            &olap,
-            nullptr)) {
+    BOOL issued = issueRead(buf, filter, &olap);
+    if (!issued && readChangesEx) {
+      // Not every filesystem supports the extended information
+      logf(
+          ERR,
+          "ReadDirectoryChangesExW: failed, falling back to "
+          "ReadDirectoryChangesW. {}\n",
+          win32_strerror(GetLastError()));
+      readChangesEx = nullptr;
+      issued = issueRead(buf, filter, &olap);
+    }
+    if (!issued && shrinkForNetwork(GetLastError())) {
+      issued = issueRead(buf, filter, &olap);
+    }
+    if (!issued) {
       err = GetLastError();
       logf(
           ERR,
@@ -170,16 +343,11 @@ void WinWatcher::readChangesThread(const std::shared_ptr<w_root_t>& root) {
   // The mutex must not be held when we enter the loop
   while (!root->inner.cancelled) {
     if (initiate_read) {
-      if (!ReadDirectoryChangesW(
-              (HANDLE)dir_handle.handle(),
-              &buf[0],
-              size,
-              TRUE,
-              filter,
-              nullptr,
-              &olap,
-              nullptr)) {
+      if (!issueRead(buf, filter, &olap)) {
         err = GetLastError();
+        if (shrinkForNetwork(err)) {
+          continue;
+        }
         logf(
             ERR,
             "ReadDirectoryChangesW: failed, cancel watch. {}\n",
@@ -217,63 +385,43 @@ void WinWatcher::readChangesThread(const std::shared_ptr<w_root_t>& root) {
             err,
             win32_strerror(err));
 
-        if (err == ERROR_INVALID_PARAMETER && size > NETWORK_BUF_SIZE) {
-          // May be a network buffer related size issue; the docs say that
-          // we can hit this when watching a UNC path. Let's downsize and
-          // retry the read just one time
-          logf(
-              ERR,
-              "retrying watch for possible network location {} "
-              "with smaller buffer\n",
-              root->root_path);
-          size = NETWORK_BUF_SIZE;
+        if (shrinkForNetwork(err)) {
+          // Retry the read just one time
           initiate_read = true;
           continue;
         }
 
         if (err == ERROR_NOTIFY_ENUM_DIR) {
+          ++stats.overflows;
           root->scheduleRecrawl("ERROR_NOTIFY_ENUM_DIR");
+          growBuffer();
+          ResetEvent(olapEvent);
+          initiate_read = true;
         } else {
           logf(ERR, "Cancelling watch for {}\n", root->root_path);
           root->cancel();
           break;
         }
       } else {
-        PFILE_NOTIFY_INFORMATION notify = (PFILE_NOTIFY_INFORMATION)buf.data();
-
-        while (true) {
-          DWORD n_chars;
-
-          // FileNameLength is in BYTES, but FileName is WCHAR
-          n_chars = notify->FileNameLength / sizeof(notify->FileName[0]);
-          w_string name(notify->FileName, n_chars);
-
-          auto full = w_string::pathCat({root->root_path, name});
-
-          if (!root->ignore.isIgnored(full.data(), full.size())) {
-            // If we have a delete or rename-away it may be part of
-            // a recursive tree remove or rename.  In that situation
-            // the notifications that we'll receive from the OS will
-            // be from the leaves and bubble up to the root of the
-            // delete/rename.  We want to flag those paths for recursive
-            // analysis so that we can prune children from the trie
-            // that is built when we pass this to the pending list
-            // later.  We don't do that here in this thread because
-            // we're trying to minimize latency in this context.
-            items.emplace_back(
-                std::move(full),
-                (notify->Action &
-                 (FILE_ACTION_REMOVED | FILE_ACTION_RENAMED_OLD_NAME)) != 0
-                    ? W_PENDING_RECURSIVE
-                    : 0);
+        if (bytes == 0) {
+          // The changes didn't fit in the buffer
+          ++stats.overflows;
+          root->scheduleRecrawl("ReadDirectoryChangesW buffer overflowed");
+          growBuffer();
+        } else {
+          auto numItems = items.size();
+          if (readChangesEx) {
+            parseNotifications<FILE_NOTIFY_EXTENDED_INFORMATION>(
+                root, buf.data(), items);
+          } else {
+            parseNotifications<FILE_NOTIFY_INFORMATION>(
+                root, buf.data(), items);
           }
-
-          // Advance to next item
-          if (notify->NextEntryOffset == 0) {
-            break;
+          recordBatch(items.size() - numItems, bytes);
+          if (bytes > size / 4 * 3) {
+            // Make room before we overflow
+            growBuffer();
           }
-          notify = (PFILE_NOTIFY_INFORMATION)(
-              notify->NextEntryOffset + (char*)notify);
         }
 
         ResetEvent(olapEvent);
@@ -383,7 +531,8 @@ bool WinWatcher::consumeNotify(
         " ",
         item.flags,
         "\n");
-    coll->add(item.path, now, W_PENDING_VIA_NOTIFY | item.flags);
+    coll->add(
+        item.path, now, W_PENDING_VIA_NOTIFY | item.flags, item.stat.get());
   }
 
   return !items.empty();
@@ -73,6 +73,13 @@ bool w_state_load(void);
 bool w_root_save_state(json_ref& state);
 bool w_root_load_state(const json_ref& state);
 json_ref w_root_watch_list_to_json(void);
+json_ref w_root_overflow_recovery_to_json(void);
+json_ref w_root_recrawl_to_json(void);
+namespace watchman {
+class MetricsWriter;
+}
+void w_root_add_metrics(watchman::MetricsWriter& metrics);
+json_ref w_root_memory_usage_to_json(void);
 
 #include "FileDescriptor.h"
 
@@ -83,6 +90,12 @@ void w_listener_prep_inetd();
 bool w_start_listener();
 namespace watchman {
 void startSanityCheckThread(void);
+// Answers an HTTP request on a connection to the metrics listener with
+// the metrics of the server, in the Prometheus text format
+void serveMetricsConnection(FileDescriptor&& fd);
+// Configures the perf alarms from the global config, to capture their
+// diagnostics from the clients and roots of the server
+void configurePerfAlarms();
 }
 
 #include "watchman_getopt.h"
@@ -1,12 +1,24 @@
 /* Copyright 2012-present Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
+#include <folly/Optional.h>
+#include <folly/SharedMutex.h>
 #include <folly/Synchronized.h>
+#include <folly/Try.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <functional>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include "Clock.h"
+#include "Histogram.h"
+#include "LockProfile.h"
 #include "Logging.h"
+#include "ResponseQueue.h"
+#include "SettleChanges.h"
 #include "watchman_pdu.h"
 #include "watchman_perf.h"
 
@@ -35,10 +47,15 @@ class ClientStateAssertion {
   // locking: You must hold root->assertedStates lock to access this member.
   json_ref enterPayload;
 
+  // The client asked for the IO thread to hold back the changes that it
+  // sees while this state is asserted; see ClientStateAssertions
+  const bool deferProcessing;
+
   ClientStateAssertion(
       const std::shared_ptr<w_root_t>& root,
-      const w_string& name)
-      : root(root), name(name) {}
+      const w_string& name,
+      bool deferProcessing = false)
+      : root(root), name(name), deferProcessing(deferProcessing) {}
 };
 } // namespace watchman
 
@@ -46,7 +63,7 @@ struct watchman_client : public std::enable_shared_from_this<watchman_client> {
   const uint64_t unique_id;
   std::unique_ptr<watchman_stream> stm;
   std::unique_ptr<watchman_event> ping;
-  w_jbuffer_t reader, writer;
+  w_jbuffer_t reader;
   bool client_mode{false};
   bool client_is_owner{false};
   enum w_pdu_type pdu_type;
@@ -55,9 +72,21 @@ struct watchman_client : public std::enable_shared_from_this<watchman_client> {
   // The command currently being processed by dispatch_command
   json_ref current_command;
   w_perf_t* perf_sample{nullptr};
+  // How many error responses have been sent to the client, which is how
+  // dispatch_command tells that a command failed
+  uint64_t errorResponses{0};
+  // The tag of the request that holds the current command, which is
+  // copied into the responses to it
+  json_ref request_tag;
+  // How the command_wait_func of the current command went, if it was
+  // waited for before the command was dispatched; see command_wait_synced()
+  folly::Optional<folly::Try<folly::Unit>> commandWait;
 
   // Queue of things to send to the client.
   std::deque<json_ref> responses;
+  // What has been encoded for the client from responses, and is waiting
+  // to be written to it
+  watchman::ResponseQueue outgoing;
 
   // Logging Subscriptions
   std::shared_ptr<watchman::Publisher::Subscriber> debugSub;
@@ -68,6 +97,34 @@ struct watchman_client : public std::enable_shared_from_this<watchman_client> {
   virtual ~watchman_client();
 
   void enqueueResponse(json_ref&& resp, bool ping = true);
+
+  // Encodes the responses that have been queued up and moves them to
+  // outgoing.  Returns false if one of them couldn't be encoded.
+  virtual bool queueResponses();
+
+  // Writes resp to the client, after any responses that are already
+  // queued, without waiting for the current command to complete.  What
+  // the client has no room for is written once the command has completed,
+  // unless the client is so far behind that outgoing is full, in which
+  // case this waits for it to catch up.  Must be called from the thread
+  // that is serving the client.  Returns false if the write failed.
+  virtual bool writeResponseNow(json_ref&& resp);
+  // As writeResponseNow, for a response that has already been encoded
+  // in the pdu_type and capabilities of this client
+  virtual bool writeEncodedResponseNow(const std::string& pdu);
+
+  // The process id of the client, or 0 if it isn't known
+  virtual pid_t getPeerProcessID() const;
+
+  // Returns a function that returns true once the client has hung up, for
+  // a long running command to check now and then.  It may be called from
+  // any thread while the command is running.
+  virtual std::function<bool()> hangupProbe();
+
+ protected:
+  watchman_client(
+      std::unique_ptr<watchman_stream>&& stm,
+      std::unique_ptr<watchman_event>&& ping);
 };
 
 struct watchman_user_client;
@@ -77,12 +134,40 @@ enum class OnStateTransition { QueryAnyway, DontAdvance };
 struct watchman_client_subscription
     : public std::enable_shared_from_this<watchman_client_subscription> {
   struct LoggedResponse {
-    // TODO: also track the time when the response was enqueued
-    std::chrono::system_clock::time_point written;
+    std::chrono::system_clock::time_point queued;
     json_ref response;
+    // The size of the response as it was encoded for the client, which
+    // stands in for the memory that it holds
+    size_t bytes;
+  };
+
+  // What to do with the results of the subscription when the client is so
+  // far behind in reading them that its outgoing queue is full
+  enum class OverflowPolicy {
+    // Replace the results that haven't been written yet with a single
+    // fresh instance notification that has no files, which tells the
+    // client that it has to query for the current state again
+    Coalesce,
+    // Drop the results
+    Drop,
+  };
+
+  // How the settles that arrive within minInterval of each other are
+  // dispatched
+  enum class DispatchMode {
+    // The first settle is dispatched right away, and those that follow
+    // it within minInterval are coalesced into one dispatch at the end
+    // of the interval
+    Latency,
+    // The first settle starts the interval, and it is dispatched along
+    // with those that follow it at the end of the interval
+    Throughput,
   };
 
   std::shared_ptr<w_root_t> root;
+  // The root as the client named it, which is below root->root_path if it
+  // is a shared watch; the notifications of the subscription report it
+  w_string rootPath;
   w_string name;
   /* whether this subscription is paused */
   bool debug_paused = false;
@@ -92,15 +177,70 @@ struct watchman_client_subscription
   uint32_t last_sub_tick{0};
   // map of statename => bool.  If true, policy is drop, else defer
   std::unordered_map<w_string, bool> drop_or_defer;
+  // The changes that the query could possibly match
+  watchman::SettleChanges::Filter changeFilter;
   std::weak_ptr<watchman_client> weakClient;
 
   std::deque<LoggedResponse> lastResponses;
 
+  OverflowPolicy overflowPolicy{OverflowPolicy::Coalesce};
+  // The results that were dropped, or folded into a fresh instance
+  // notification, because the client wasn't keeping up with them
+  std::atomic<uint64_t> droppedResults{0};
+  std::atomic<uint64_t> coalescedResults{0};
+
+  DispatchMode dispatchMode{DispatchMode::Latency};
+  // The least time between two dispatches of the subscription
+  std::chrono::milliseconds minInterval{0};
+  // If set, a dispatch that is held back by minInterval goes ahead once
+  // this many files have changed since the subscription was last run
+  size_t maxBatchFiles{0};
+  // The times that the subscription was dispatched, the settles that were
+  // coalesced into another dispatch, and how long after its first settle
+  // was seen that the last and slowest dispatch completed
+  std::atomic<uint64_t> dispatches{0};
+  std::atomic<uint64_t> coalescedSettles{0};
+  std::atomic<uint64_t> lastDispatchLatencyUs{0};
+  std::atomic<uint64_t> maxDispatchLatencyUs{0};
+  // The distributions of the time from the first settle of a dispatch to
+  // its evaluation starting, of the time that the evaluation takes, and
+  // of the time and the bytes taken to encode its results, in
+  // microseconds
+  watchman::Histogram settleToDispatchUs;
+  watchman::Histogram evaluationUs;
+  watchman::Histogram encodeUs;
+  watchman::Histogram encodedBytes;
+  // The dispatches that were held back by a state or a VCS operation, and
+  // those that were dropped because of a state
+  std::atomic<uint64_t> deferredDispatches{0};
+  std::atomic<uint64_t> droppedDispatches{0};
+
   explicit watchman_client_subscription(
       const std::shared_ptr<w_root_t>& root,
       std::weak_ptr<watchman_client> client);
   ~watchman_client_subscription();
   void processSubscription();
+  // The histograms and counters of the dispatches of the subscription
+  json_ref getMetrics() const;
+
+  // Notes that the root has settled, which the subscription is to be
+  // dispatched for
+  void noteSettle(std::chrono::steady_clock::time_point now);
+  // Dispatches the settles that have been noted, if they are due, to be
+  // evaluated in the subscription thread pool.  Returns when they will be
+  // due if they aren't yet, or none if there is nothing left to dispatch
+  // or the subscription is still being evaluated.
+  folly::Optional<std::chrono::steady_clock::time_point> dispatchIfDue(
+      std::chrono::steady_clock::time_point now);
+  // Once the subscription has been evaluated, queues its results for
+  // client, followed by the notifications that were held back while it
+  // was being evaluated.  If wait is set, waits for the evaluation to
+  // complete.
+  void collectResults(watchman_user_client* client, bool wait = false);
+  // Queues a notification, such as state-enter, for client, unless the
+  // subscription is being evaluated, in which case it is held back until
+  // the results of the evaluation have been queued
+  void sendNotification(watchman_user_client* client, json_ref&& response);
 
   std::shared_ptr<watchman_user_client> lockClient();
   json_ref buildSubscriptionResults(
@@ -109,11 +249,32 @@ struct watchman_client_subscription
       OnStateTransition onStateTransition);
 
  private:
-  ClockSpec runSubscriptionRules(
-      watchman_user_client* client,
-      const std::shared_ptr<w_root_t>& root);
-  void updateSubscriptionTicks(w_query_res* res);
+  ClockSpec runSubscriptionRules(const std::shared_ptr<w_root_t>& root);
+  void updateSubscriptionTicks(const w_query_res* res);
+  bool skipUnmatchedChanges(const ClockPosition& position);
   void processSubscriptionImpl();
+  void evaluate(
+      const std::weak_ptr<watchman_client>& client,
+      std::chrono::steady_clock::time_point settledAt);
+
+  // The rest are only used by the thread that serves the client, other
+  // than what is noted.
+
+  // When the first of the settles that have yet to be dispatched was noted
+  folly::Optional<std::chrono::steady_clock::time_point> settledAt_;
+  std::chrono::steady_clock::time_point lastDispatch_;
+  // Set from when the subscription is dispatched until its results have
+  // been collected.  In the meantime the rest of its state belongs to
+  // the thread that evaluates it.
+  bool evaluating_{false};
+  // The notifications that are held back until the results are collected
+  std::deque<json_ref> heldNotifications_;
+  // The results of the evaluation, and whether it has completed, which
+  // are shared with the thread that evaluates the subscription
+  std::mutex evaluationMutex_;
+  std::condition_variable evaluationDone_;
+  std::deque<json_ref> evaluatedResponses_;
+  bool evaluated_{false};
 };
 
 // Represents the server side session maintained for a client of
@@ -134,13 +295,70 @@ struct watchman_user_client : public watchman_client {
       std::shared_ptr<watchman::Publisher::Subscriber>>
       unilateralSub;
 
+  // What requests that were run on worker threads have sent, waiting
+  // for the thread that serves the client to write it out.  Each entry
+  // is either a response or an already encoded pdu.
+  struct ConcurrentResponse {
+    json_ref response;
+    std::string pdu;
+  };
+  folly::Synchronized<std::deque<ConcurrentResponse>> concurrentResponses;
+
+  // A request whose command is waiting for its command_wait_func before it
+  // is dispatched.  The next request of the client isn't read until then.
+  // Only used by the thread that serves the client.
+  struct SuspendedRequest {
+    json_ref command;
+    json_ref tag;
+  };
+  folly::Optional<SuspendedRequest> suspended;
+  // How the wait of the suspended request went, set before the client is
+  // pinged once it is over
+  folly::Synchronized<folly::Optional<folly::Try<folly::Unit>>> suspendedWait;
+
+  // When the settles that subscriptions are holding back are next due
+  // to be dispatched.  Only used by the thread that serves the client.
+  folly::Optional<std::chrono::steady_clock::time_point> nextDispatch;
+
   explicit watchman_user_client(std::unique_ptr<watchman_stream>&& stm);
   ~watchman_user_client() override;
 
+  // Applies the overflow policies of the subscriptions to their results,
+  // and keeps a log of what was sent for each subscription
+  bool queueResponses() override;
+
   bool unsubByName(const w_string& name);
 };
 
-extern folly::Synchronized<std::unordered_set<std::shared_ptr<watchman_client>>>
-    clients;
+// Runs the command of a tagged request from a user client on a worker thread,
+// concurrently with the other requests of that client.  It has no stream
+// of its own: what it sends is handed to the user client, whose own thread
+// writes it out.
+struct watchman_request_client : public watchman_client {
+  const std::shared_ptr<watchman_user_client> parent;
+
+  watchman_request_client(
+      std::shared_ptr<watchman_user_client> parent,
+      json_ref request_tag);
+
+  // Dispatches command, then hands its responses to the parent
+  void run(const json_ref& command);
+
+  bool writeResponseNow(json_ref&& resp) override;
+  bool writeEncodedResponseNow(const std::string& pdu) override;
+  pid_t getPeerProcessID() const override;
+  std::function<bool()> hangupProbe() override;
+
+ private:
+  void handOffResponses();
+};
+
+struct ClientsLock {
+  static constexpr const char* kName = "clients";
+};
+using SyncClients = folly::Synchronized<
+    std::unordered_set<std::shared_ptr<watchman_client>>,
+    watchman::ProfiledMutex<folly::SharedMutex, ClientsLock>>;
+extern SyncClients clients;
 
 void w_client_vacate_states(struct watchman_user_client* client);
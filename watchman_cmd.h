@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <folly/Optional.h>
 #include <stdexcept>
 #include "CommandRegistry.h"
 
@@ -10,6 +11,9 @@
 // realpath's that parameter on the client side and updates the
 // argument list
 void w_cmd_realpath_root(json_ref& args);
+// As w_cmd_realpath_root, for the server, which remembers the resolved path
+// in the RootPathCache
+void w_cmd_realpath_root_cached(json_ref& args);
 
 // Try to find a project root that contains the path `resolved`. If found,
 // modify `resolved` to hold the path to the root project and return true.
@@ -31,6 +35,19 @@ bool dispatch_command(
     struct watchman_client* client,
     const json_ref& args,
     int mode);
+// Returns true if args is a command that is registered with CMD_CONCURRENT
+bool is_concurrent_command(const json_ref& args, int mode);
+// If args is a command that has a command_wait_func, and client may run
+// it, starts its wait and returns the future for it.  Returns none if
+// there is nothing to wait for, or if the wait couldn't be started, in
+// which case dispatch_command reports what is wrong.
+folly::Optional<folly::Future<folly::Unit>>
+start_command_wait(watchman_client* client, const json_ref& args, int mode);
+// For a command with a command_wait_func that syncs its root: returns true
+// if that wait has synced it, so that the command doesn't have to, or
+// throws the error that the sync failed with.  Returns false if the
+// command was dispatched without the wait, and has to sync the root itself.
+bool command_wait_synced(watchman_client* client);
 bool try_client_mode_command(const json_ref& cmd, bool pretty);
 
 void send_error_response(
@@ -56,7 +73,27 @@ std::shared_ptr<w_root_t> resolveOrCreateRoot(
     struct watchman_client* client,
     const json_ref& args);
 
+// If the root that args name is a shared watch, which resolveRoot resolves
+// to the root that encloses it, scopes querySpec to the dir of the shared
+// watch by prefixing its relative_root with the path of that dir
+void scopeQueryToSharedWatch(const json_ref& args, const json_ref& querySpec);
+
+// Has query render its results straight into BSER rows, rather than
+// into json values that are encoded afterwards, if the client can be sent
+// them that way
+void prepareQueryRendering(watchman_client* client, w_query* query);
+// Sends response to client with the files of res, which were rendered as
+// prepareQueryRendering arranged
+void sendQueryResponse(
+    watchman_client* client,
+    w_query* query,
+    w_query_res& res,
+    json_ref&& response);
+
 json_ref make_response(void);
+// Tags response with the tag of the request that the client is processing,
+// if it has one and response isn't a unilateral one
+void annotate_with_request_tag(watchman_client* client, json_ref& response);
 void annotate_with_clock(const std::shared_ptr<w_root_t>& root, json_ref& resp);
 void add_root_warnings_to_response(
     json_ref& response,
@@ -1,31 +1,139 @@
 /* Copyright 2012-present Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
-#include <unordered_map>
+#include <folly/Optional.h>
+#include <atomic>
+#include "ChildTable.h"
+#include "TreeSummary.h"
+
+namespace watchman {
+class NodeArena;
+}
 
 struct watchman_dir {
   /* the name of this dir, relative to its parent */
   w_string name;
   /* the parent dir */
   watchman_dir* parent;
+  /* the arena that this dir and its child nodes are allocated from.
+   * This must be declared ahead of the files and dirs members so that
+   * it remains valid while they are being destroyed */
+  watchman::NodeArena* arena;
 
-  /* files contained in this dir (keyed by file->name) */
+  /* Returns nodes to the arena that they were allocated from */
   struct Deleter {
     void operator()(watchman_file*) const;
+    void operator()(watchman_dir*) const;
+  };
+
+  /* Extract the keys of the files and dirs tables from their nodes */
+  struct FileName {
+    inline w_string_piece operator()(
+        const std::unique_ptr<watchman_file, Deleter>& file) const;
   };
-  std::unordered_map<w_string_piece, std::unique_ptr<watchman_file, Deleter>>
+  struct DirName {
+    inline w_string_piece operator()(
+        const std::unique_ptr<watchman_dir, Deleter>& dir) const;
+  };
+
+  /* files contained in this dir (keyed by file->getName()) */
+  watchman::ChildTable<
+      w_string_piece,
+      std::unique_ptr<watchman_file, Deleter>,
+      FileName>
       files;
 
   /* child dirs contained in this dir (keyed by dir->name) */
-  std::unordered_map<w_string_piece, std::unique_ptr<watchman_dir>> dirs;
+  watchman::ChildTable<
+      w_string_piece,
+      std::unique_ptr<watchman_dir, Deleter>,
+      DirName>
+      dirs;
 
   // If we think this dir was deleted, we'll avoid recursing
   // to its children when processing deletes
   bool last_check_existed{true};
 
-  watchman_dir(w_string name, watchman_dir* parent);
+  // Set by the crawler of the parent dir when it skipped the stat of
+  // this dir because the listing showed that it was still the same dir.
+  // The crawler for this dir then refreshes its stat from the open
+  // dir handle instead.
+  bool stat_deferred{false};
+
+  // Set when the view dropped the files and dirs beneath this one to save
+  // memory.  The next crawl of this dir brings them back.
+  bool collapsed{false};
+
+  // The most recent otime tick of the files in this dir and beneath it,
+  // which lets a since query skip the subtrees that haven't changed
+  uint32_t subtree_tick{0};
+  // ... and the timestamp of that change
+  time_t subtree_time{0};
+
+  // Set on a dir that the view recreated from one that was renamed, to the
+  // full path that it was renamed from, and the tick at which it was
+  // recreated.  See root/rename.cpp.
+  w_string renamed_from;
+  uint32_t renamed_tick{0};
+
+  // The summary returned by getTreeSummary(), which is only valid while
+  // its hash isn't 0.  It is computed by queries that share the view lock,
+  // which all store the same values, so its members are atomic; it is only
+  // cleared with the view lock held exclusively.  Whenever the hash of a
+  // dir is 0, so is that of each parent.
+  struct CachedTreeSummary {
+    std::atomic<uint64_t> hash{0};
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> dirs{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<int64_t> newestMtimeSec{0};
+    std::atomic<long> newestMtimeNsec{0};
+  };
+  mutable CachedTreeSummary tree_summary;
+
+  watchman_dir(
+      w_string name,
+      watchman_dir* parent,
+      watchman::NodeArena* arena);
+  ~watchman_dir();
+
+  /** Allocates a dir node from arena */
+  static std::unique_ptr<watchman_dir, Deleter>
+  make(watchman::NodeArena& arena, w_string name, watchman_dir* parent);
+
+  /** Creates (or replaces) the child dir entry named name and returns it */
+  watchman_dir* makeChildDir(const w_string& name);
+
+  /** Adds file, whose name must not already be present, and returns it */
+  watchman_file* addChildFile(std::unique_ptr<watchman_file, Deleter> file);
+
+  /** Make room for n files or dirs without growing the tables.  These,
+   * makeChildDir and addChildFile account for the memory of the tables
+   * in the arena. */
+  void reserveFiles(size_t n);
+  void reserveDirs(size_t n);
+
+  /** Frees all of the files and dirs beneath this dir */
+  void clearChildren();
+
   watchman_dir* getChildDir(w_string_piece name) const;
 
+  /** Records that a file in this dir changed at otime, raising the
+   * subtree_tick and subtree_time of this dir and of its parents to match */
+  void markSubtreeChanged(const w_clock_t& otime);
+
+  /** Returns the fingerprint, counts, total size and newest modification
+   * time of the files that exist beneath this dir.  It is cached on each
+   * dir beneath this one until one of their files changes, so it only has
+   * to visit the dirs that changed since it was last computed.  Returns
+   * folly::none if a dir beneath this one is collapsed, since its files
+   * aren't known. */
+  folly::Optional<watchman::TreeSummary> getTreeSummary() const;
+
+  /** Forgets the tree summary of this dir and of its parents, because one
+   * of its files has changed */
+  void invalidateTreeSummary();
+
   /** Returns the direct child file named name, or nullptr
    * if there is no such entry */
   watchman_file* getChildFile(w_string_piece name) const;
@@ -38,3 +146,8 @@ struct watchman_dir {
    * with it, to produce the path to the child */
   w_string getFullPathToChild(w_string_piece child) const;
 };
+
+inline w_string_piece watchman_dir::DirName::operator()(
+    const std::unique_ptr<watchman_dir, Deleter>& dir) const {
+  return dir->name;
+}
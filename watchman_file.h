@@ -2,23 +2,25 @@
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
 
+#include "ChangeJournal.h"
 #include "Clock.h"
 #include "FileInformation.h"
+#include "SuffixList.h"
 
 struct watchman_file {
   /* the parent dir */
   watchman_dir* parent;
 
-  /* linkage to files ordered by changed time.
-   * prev points to the address of `next` in the
-   * previous file node, or the head of the list. */
-  struct watchman_file **prev, *next;
+  /* the entry for this file in the change journal of the view,
+   * which orders files by changed time */
+  watchman::ChangeJournal<watchman_file>::Entry* journal_entry;
 
-  /* linkage to files ordered by common suffix.
-   * suffix_prev points to the address of `suffix_next`
-   * in the previous file node, or the head of the
-   * suffix list. */
-  struct watchman_file **suffix_prev, *suffix_next;
+  /* the slot that holds this file in the list of files
+   * that share its suffix, if it has one */
+  struct watchman_file** suffix_slot;
+  /* likewise for the list of files that share its name,
+   * if the view maintains a basename index */
+  struct watchman_file** basename_slot;
 
   /* the time we last observed a change to this file */
   w_clock_t otime;
@@ -31,10 +33,18 @@ struct watchman_file {
   bool exists;
   /* whether we think this file might not exist */
   bool maybe_deleted;
+  /* whether the name has no upper case letters, so that the
+   * case insensitive matching of queries can compare it as-is */
+  bool name_folded;
 
   /* cache stat results so we can tell if an entry
-   * changed */
-  watchman::FileInformation stat;
+   * changed.  The device and owner are held by the arena
+   * that the node was allocated from; getStat() puts them
+   * back together. */
+  watchman::CompactFileInformation stat;
+
+  watchman::FileInformation getStat() const;
+  void setStat(const watchman::FileInformation& st);
 
   inline w_string_piece getName() const {
     auto lenPtr = (uint32_t*)(this + 1);
@@ -42,8 +52,6 @@ struct watchman_file {
     return w_string_piece(data, *lenPtr);
   }
 
-  void removeFromFileList();
-
   watchman_file() = delete;
   watchman_file(const watchman_file&) = delete;
   watchman_file& operator=(const watchman_file&) = delete;
@@ -52,9 +60,11 @@ struct watchman_file {
   static std::unique_ptr<watchman_file, watchman_dir::Deleter> make(
       const w_string& name,
       watchman_dir* parent);
-
- private:
-  void removeFromSuffixList();
 };
 
 void free_file_node(struct watchman_file* file);
+
+inline w_string_piece watchman_dir::FileName::operator()(
+    const std::unique_ptr<watchman_file, Deleter>& file) const {
+  return file->getName();
+}
@@ -5,6 +5,8 @@
 #define WATCHMAN_IGNORE_H
 
 #include <unordered_set>
+#include <vector>
+#include "WildMatcher.h"
 #include "thirdparty/libart/src/art.h"
 
 #ifdef __cplusplus
@@ -24,20 +26,70 @@ struct watchman_ignore {
    * system limits. */
   std::vector<w_string> dirs_vec;
 
+  /* The compiled ignore_globs patterns.  A dir below glob_root whose name
+   * or root relative path matches one of them is ignored along with
+   * everything below it.  Patterns that are a plain name, which is most
+   * of them, are looked up in glob_names instead of being matched one at
+   * a time; glob_strings holds the storage for those names. */
+  w_string glob_root;
+  std::vector<w_string> glob_strings;
+  std::unordered_set<w_string_piece> glob_names;
+  std::vector<watchman::WildMatcher> glob_name_patterns;
+  std::vector<watchman::WildMatcher> glob_path_patterns;
+
+  /* The watch_includes configuration.  When include_dirs isn't empty, only
+   * the dirs below include_root that are listed in it, the dirs below
+   * those, and their ancestors, which are listed in include_ancestors, are
+   * watched.  include_strings holds the storage for both sets. */
+  w_string include_root;
+  std::vector<w_string> include_strings;
+  std::unordered_set<w_string_piece> include_dirs;
+  std::unordered_set<w_string_piece> include_ancestors;
+
   // Adds a string to the ignore list.
   // The is_vcs_ignore parameter indicates whether it is a full ignore
   // or a vcs-style grandchild ignore.
   void add(const w_string& path, bool is_vcs_ignore);
 
+  // Adds a gitignore style pattern for the dirs below root_path.
+  // Patterns without a slash match a name at any depth, the others match
+  // the path relative to root_path.  Returns false if the pattern is of a
+  // form that can't be used to ignore dirs.
+  bool addGlob(const w_string& root_path, w_string_piece pattern);
+
+  // Adds path, which is below root_path, to the dirs that are watched,
+  // leaving the dirs that aren't included or beneath an included dir,
+  // and aren't leading to one, unwatched.
+  void addInclude(const w_string& root_path, const w_string& path);
+
   // Tests whether path is ignored.
   // Returns true if the path is ignored, false otherwise.
   bool isIgnored(const char* path, uint32_t pathlen) const;
 
+  // Tests whether everything below dir is ignored, so that a watcher can
+  // drop the events for the entries of dir without looking at their names.
+  // That holds for an ignored dir and the dirs below it, and for the dirs
+  // in a vcs dir, but not for the vcs dir itself.
+  bool isIgnoredBelow(const w_string& dir) const;
+
   // Test whether path is listed in ignore vcs config
   bool isIgnoreVCS(const w_string& path) const;
 
-  // Test whether path is listed in ignore dir config
+  // Test whether path is listed in ignore dir config, matches an
+  // ignore_globs pattern, or lies outside of the watch_includes
   bool isIgnoreDir(const w_string& path) const;
+
+  // Test whether path matches an ignore_globs pattern.  Only path itself
+  // is matched and not its parents, which are expected to have been
+  // tested on the way down to it, as the crawler does.  path must be NUL
+  // terminated.
+  bool isIgnoreGlob(w_string_piece path) const;
+
+  // Test whether path lies outside of the watch_includes.  A file directly
+  // in one of the ancestors of an included dir is watched along with it;
+  // since it is only known whether path is a dir once it has been stat'd,
+  // isDir says whether to treat it as one.
+  bool isOutsideIncludes(w_string_piece path, bool isDir) const;
 };
 
 #ifdef __cplusplus
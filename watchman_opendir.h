@@ -7,6 +7,11 @@ struct watchman_dir_ent {
   bool has_stat;
   char* d_name;
   watchman::FileInformation stat;
+  // The type and inode number reported by the directory listing, which
+  // are usually available even when has_stat is false.  d_type is
+  // DType::Unknown and d_ino is 0 if the system didn't tell us.
+  watchman::DType d_type{watchman::DType::Unknown};
+  uint64_t d_ino{0};
 };
 
 class watchman_dir_handle {
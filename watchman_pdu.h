@@ -1,15 +1,26 @@
 /* Copyright 2012-present Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
+#include <vector>
 
 enum w_pdu_type {
   need_data,
   is_json_compact,
   is_json_pretty,
   is_bser,
-  is_bser_v2
+  is_bser_v2,
+  is_bser_v3,
+  // Wraps a BSER v2 or v3 PDU whose body has been compressed
+  is_bser_compressed,
+  // A fixed size binary request that the server answers without decoding
+  // or dispatching it; see Probe.h
+  is_probe
 };
 
+namespace watchman {
+struct ProbeRequest;
+}
+
 struct watchman_json_buffer {
   char* buf;
   uint32_t allocd;
@@ -36,8 +47,32 @@ struct watchman_json_buffer {
       const json_ref& json,
       w_stm_t stm);
 
+  // Encodes json as a complete PDU, as pduEncodeToStream would write it,
+  // and appends it to out
+  static bool pduEncodeToString(
+      enum w_pdu_type pdu_type,
+      uint32_t capabilities,
+      const json_ref& json,
+      std::string& out);
+  // Like pduEncodeToString for the BSER pdu types, where the top level
+  // object json gets an additional member named key whose value has
+  // already been BSER encoded, with the same version and capabilities.
+  // Neither that value nor json use the string dictionary of BSER v3.
+  static bool bserPduEncodeToString(
+      enum w_pdu_type pdu_type,
+      uint32_t capabilities,
+      const json_ref& json,
+      const w_string& key,
+      w_string_piece encoded,
+      std::string& out);
+
   json_ref decodeNext(w_stm_t stm, json_error_t* jerr);
 
+  // If the next PDU is a probe, reads it into probe and returns true.
+  // Otherwise, or if not all of it has arrived yet, returns false, having
+  // consumed nothing, and decodeNext deals with it.
+  bool readProbe(w_stm_t stm, watchman::ProbeRequest& probe);
+
   bool passThru(
       enum w_pdu_type output_pdu,
       uint32_t output_capabilities,
@@ -51,7 +86,13 @@ struct watchman_json_buffer {
   inline enum w_pdu_type detectPdu();
   json_ref readJsonPrettyPdu(w_stm_t stm, json_error_t* jerr);
   json_ref readJsonPdu(w_stm_t stm, json_error_t* jerr);
+  bool readBserBody(
+      w_stm_t stm,
+      uint32_t bser_version,
+      json_int_t* len,
+      json_error_t* jerr);
   json_ref readBserPdu(w_stm_t stm, uint32_t bser_version, json_error_t* jerr);
+  json_ref readCompressedPdu(w_stm_t stm, json_error_t* jerr);
   json_ref decodePdu(w_stm_t stm, json_error_t* jerr);
   bool decodePduInfo(
       w_stm_t stm,
@@ -62,22 +103,42 @@ struct watchman_json_buffer {
   bool streamPdu(w_stm_t stm, json_error_t* jerr);
   bool streamUntilNewLine(w_stm_t stm);
   bool streamN(w_stm_t stm, json_int_t len, json_error_t* jerr);
+
+  // The string table of the BSER v3 PDU being decoded
+  std::vector<json_ref> bserStrings_;
 };
 
+// The strings of a BSER v3 PDU that later strings can refer back to
+struct bser_string_table;
+
 typedef struct bser_ctx {
   uint32_t bser_version;
   uint32_t bser_capabilities;
   json_dump_callback_t dump;
+  // If set, used in place of dump for string payloads that remain valid
+  // until the output has been written, so that they need not be copied
+  json_dump_callback_t dump_ref;
+  // If set, string values are added to this dictionary and encoded as
+  // references to it where possible, as BSER v3 allows
+  struct bser_string_table* strings;
 } bser_ctx_t;
 
 typedef struct watchman_json_buffer w_jbuffer_t;
 
 #define BSER_MAGIC "\x00\x01"
 #define BSER_V2_MAGIC "\x00\x02"
+#define BSER_V3_MAGIC "\x00\x03"
+#define BSER_COMPRESSED_MAGIC "\x00\x04"
+#define BSER_SHARED_MEMORY_MAGIC "\x00\x05"
 
 // BSERv2 capabilities. Must be powers of 2.
 #define BSER_CAP_DISABLE_UNICODE 0x1
 #define BSER_CAP_DISABLE_UNICODE_FOR_ERRORS 0x2
+// Set by clients that can decompress large responses with that codec
+#define BSER_CAP_COMPRESS_ZSTD 0x4
+#define BSER_CAP_COMPRESS_LZ4 0x8
+// Set by local clients that can map large responses from shared memory
+#define BSER_CAP_SHARED_MEMORY 0x10
 
 int w_bser_write_pdu(
     const uint32_t bser_version,
@@ -85,14 +146,70 @@ int w_bser_write_pdu(
     json_dump_callback_t dump,
     const json_ref& json,
     void* data);
-int w_bser_dump(const bser_ctx_t* ctx, const json_ref& json, void* data);
+int w_bser_dump(const bser_ctx_t* ctx, const json_t* json, void* data);
+
+// Like w_bser_write_pdu, for a top level object that gets an additional
+// member named key whose value has already been encoded to BSER
+int w_bser_write_pdu_with_encoded_member(
+    const uint32_t bser_version,
+    const uint32_t capabilities,
+    json_dump_callback_t dump,
+    const json_ref& json,
+    const w_string& key,
+    w_string_piece encoded,
+    void* data);
+
+namespace watchman {
+class PduBuffer;
+}
+
+// Like w_bser_write_pdu and w_bser_write_pdu_with_encoded_member, but
+// encode the PDU into buffer in a single pass.  The buffer references the
+// larger strings of json, and encoded, rather than copying them, so they
+// must outlive it.
+int w_bser_encode_pdu(
+    const uint32_t bser_version,
+    const uint32_t capabilities,
+    const json_ref& json,
+    watchman::PduBuffer& buffer);
+int w_bser_encode_pdu_with_encoded_member(
+    const uint32_t bser_version,
+    const uint32_t capabilities,
+    const json_ref& json,
+    const w_string& key,
+    w_string_piece encoded,
+    watchman::PduBuffer& buffer);
+
+// Encode individual values, for callers that produce BSER directly rather
+// than building json values to pass to w_bser_dump
+int w_bser_dump_int(const bser_ctx_t* ctx, json_int_t val, void* data);
+int w_bser_dump_real(const bser_ctx_t* ctx, double val, void* data);
+int w_bser_dump_bool(const bser_ctx_t* ctx, bool val, void* data);
+int w_bser_dump_string(const bser_ctx_t* ctx, const w_string& str, void* data);
+// Encodes a byte string that needn't outlive the call, such as one that
+// was assembled in a buffer that is about to be reused
+int w_bser_dump_bytestring(
+    const bser_ctx_t* ctx,
+    w_string_piece str,
+    void* data);
+// Begins an array of count values.  If templ is set, it is the array of
+// property names of a template array, and each of the values that follow
+// has to be the list of the values of those properties, in order.
+int w_bser_dump_array_header(
+    const bser_ctx_t* ctx,
+    size_t count,
+    const json_ref& templ,
+    void* data);
 bool bunser_int(
     const char* buf,
     json_int_t avail,
     json_int_t* needed,
     json_int_t* val);
+// Decodes the value at buf.  strings is the dictionary of the PDU, which
+// must be set, and start out empty, for the body of a BSER v3 PDU.
 json_ref bunser(
     const char* buf,
     const char* end,
     json_int_t* needed,
-    json_error_t* jerr);
+    json_error_t* jerr,
+    std::vector<json_ref>* strings = nullptr);
@@ -2,13 +2,24 @@
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
 #include <folly/Synchronized.h>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "FileInformation.h"
+#include "LockProfile.h"
 #include "thirdparty/libart/src/art.h"
 
 #define W_PENDING_RECURSIVE 1
 #define W_PENDING_VIA_NOTIFY 2
 #define W_PENDING_CRAWL_ONLY 4
+// The watcher reported that the path was removed, and nothing else, so
+// statPath can take that as read rather than stat'ing it.  This is only
+// kept when every add() of the path has it.
+#define W_PENDING_REMOVED 8
 
 struct watchman_pending_fs {
   // We own the next entry and will destroy that chain when we
@@ -18,6 +29,10 @@ struct watchman_pending_fs {
   w_string path;
   struct timeval now;
   int flags;
+  // The state of the path as the watcher reported it along with the
+  // change, which statPath can use rather than stat'ing it.  Only the
+  // most recent add() of the path counts; if that had none, this is null.
+  std::unique_ptr<watchman::FileInformation> stat;
 
   watchman_pending_fs(
       const w_string& path,
@@ -27,14 +42,19 @@ struct watchman_pending_fs {
 
 struct PendingCollectionBase {
   PendingCollectionBase(
-      std::condition_variable& cond,
-      std::atomic<bool>& pinged);
+      std::condition_variable_any& cond,
+      std::atomic<bool>& pinged,
+      const std::shared_ptr<std::function<void()>>& wakeHook);
   PendingCollectionBase(const PendingCollectionBase&) = delete;
   PendingCollectionBase(PendingCollectionBase&&) = default;
   ~PendingCollectionBase();
 
   void drain();
-  bool add(const w_string& path, struct timeval now, int flags);
+  bool add(
+      const w_string& path,
+      struct timeval now,
+      int flags,
+      const watchman::FileInformation* stat = nullptr);
   bool add(
       struct watchman_dir* dir,
       const char* name,
@@ -42,19 +62,37 @@ struct PendingCollectionBase {
       int flags);
   void append(PendingCollectionBase* src);
 
+  /* Merges chains of items, such as those taken from the queue of a
+   * PendingCollection, into this collection.  Rather than consolidating
+   * the items one at a time, the batch is sorted by path so that the
+   * items that are obsoleted by a recursive item in the same batch can be
+   * discarded in a single pass; only the survivors are then merged into
+   * the tree. */
+  void appendBatch(std::vector<std::shared_ptr<watchman_pending_fs>>&& chains);
+
   /* Moves the head of the chain of items to the caller.
    * The tree is cleared and the caller owns the whole chain */
   std::shared_ptr<watchman_pending_fs> stealItems();
 
   uint32_t size() const;
+
+  /* Returns true if one of the items that add() or append() has put in
+   * the collection since it was last drained or stolen from may be a
+   * cookie */
+  bool hasPossibleCookie() const {
+    return possibleCookie_;
+  }
+
   void ping();
   bool checkAndResetPinged();
 
  private:
-  std::condition_variable& cond_;
+  std::condition_variable_any& cond_;
   std::atomic<bool>& pinged_;
+  const std::shared_ptr<std::function<void()>>& wakeHook_;
   art_tree<std::shared_ptr<watchman_pending_fs>, w_string> tree_;
   std::shared_ptr<watchman_pending_fs> pending_;
+  bool possibleCookie_{false};
 
   struct iterContext {
     const w_string& root;
@@ -69,21 +107,62 @@ struct PendingCollectionBase {
   friend struct iterContext;
 
   void maybePruneObsoletedChildren(w_string path, int flags);
-  inline void consolidateItem(watchman_pending_fs* p, int flags);
+  inline void consolidateItem(
+      watchman_pending_fs* p,
+      int flags,
+      std::unique_ptr<watchman::FileInformation> stat);
   bool isObsoletedByContainingDir(const w_string& path);
   inline void linkHead(std::shared_ptr<watchman_pending_fs>&& p);
   inline void unlinkItem(std::shared_ptr<watchman_pending_fs>& p);
 };
 
+struct PendingLock {
+  static constexpr const char* kName = "pending";
+};
+using PendingMutex = watchman::ProfiledMutex<std::mutex, PendingLock>;
+
 class PendingCollection
-    : public folly::Synchronized<PendingCollectionBase, std::mutex> {
-  std::condition_variable cond_;
+    : public folly::Synchronized<PendingCollectionBase, PendingMutex> {
+  std::condition_variable_any cond_;
   std::atomic<bool> pinged_;
+  // Called whenever the collection is pinged, for a consumer that is
+  // scheduled rather than waiting in lockAndWait.  Accessed atomically.
+  std::shared_ptr<std::function<void()>> wakeHook_;
+
+  // A lock free, multi-producer single-consumer stack of the chains of
+  // items that have been enqueued but not yet taken
+  struct QueuedChain {
+    std::shared_ptr<watchman_pending_fs> items;
+    QueuedChain* next;
+  };
+  std::atomic<QueuedChain*> queue_{nullptr};
 
  public:
   PendingCollection();
+  PendingCollection(const PendingCollection&) = delete;
+  ~PendingCollection();
+
+  // Waits for the collection to be pinged or for items to be enqueued.
+  // The caller is responsible for calling takeQueued.
   LockedPtr lockAndWait(std::chrono::milliseconds timeoutms, bool& pinged);
 
   // Ping without requiring the lock to be held
   void ping();
+
+  // Arranges for hook to be called, on the pinging thread, whenever the
+  // collection is pinged
+  void setWakeHook(std::function<void()> hook);
+
+  /** Hands over a chain of items, typically obtained via stealItems()
+   * from a collection that is private to the calling thread, without
+   * contending for our lock.  Any number of threads may enqueue
+   * concurrently.  The consumer is pinged when the queue transitions
+   * from empty to non-empty, so a burst of chains costs one wakeup. */
+  void enqueue(std::shared_ptr<watchman_pending_fs> items);
+
+  /** Removes the enqueued chains, oldest first, for the consumer to
+   * merge via PendingCollectionBase::appendBatch */
+  std::vector<std::shared_ptr<watchman_pending_fs>> takeQueued();
+
+  bool hasQueued() const;
 };
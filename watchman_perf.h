@@ -4,6 +4,7 @@
 #ifndef WATCHMAN_PERF_H
 #define WATCHMAN_PERF_H
 #include "thirdparty/jansson/jansson.h"
+#include "watchman_string.h"
 struct watchman_root;
 typedef struct watchman_root w_root_t;
 
@@ -21,6 +22,10 @@ struct watchman_perf_sample {
   // This is a json object with various properties set inside it
   json_ref meta_data{json_object()};
 
+  // The root that the sample was taken for, if any; samples are
+  // aggregated by their description and root
+  w_string root_path;
+
   // Measure the wall time
   struct timeval time_begin, time_end, duration;
 
@@ -28,6 +33,9 @@ struct watchman_perf_sample {
   // mechanism
   bool will_log{false};
 
+  // Set by finish(); only finished samples are aggregated
+  bool finished{false};
+
   // If non-zero, force logging on if the wall time is greater
   // that this value
   double wall_time_elapsed_thresh{0};
@@ -46,6 +54,9 @@ struct watchman_perf_sample {
   watchman_perf_sample(const watchman_perf_sample&) = delete;
   watchman_perf_sample(watchman_perf_sample&&) = delete;
 
+  // Adds a finished sample to the aggregated perf stats
+  ~watchman_perf_sample();
+
   // Augment any configuration policy and cause this sample to be logged if the
   // walltime exceeds the specified number of seconds (fractions are supported)
   void set_wall_time_thresh(double thresh);
@@ -60,6 +71,10 @@ struct watchman_perf_sample {
   // Annotate the sample with some standard metadata taken from a root.
   void add_root_meta(const std::shared_ptr<w_root_t>& root);
 
+  // Associate the sample with a root, without annotating it.  This is
+  // cheap enough to do for samples that are not logged.
+  void set_root(const std::shared_ptr<w_root_t>& root);
+
   // Force the sample to go to the log
   void force_log();
 
@@ -74,6 +89,10 @@ void perf_shutdown();
 }
 #endif
 
+// Returns the counts of the samples that were passed to, dropped before
+// or failed to reach perf_logger_command
+json_ref perf_logger_stats();
+
 #endif
 
 /* vim:ts=2:sw=2:et:
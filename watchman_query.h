@@ -3,18 +3,31 @@
 
 #ifndef WATCHMAN_QUERY_H
 #define WATCHMAN_QUERY_H
+#include <folly/Function.h>
 #include <folly/Optional.h>
+#include <folly/Synchronized.h>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <unordered_set>
 #include <vector>
 #include "Clock.h"
+#include "FetchBatchSizer.h"
 #include "FileSystem.h"
+#include "GlobSuffixIndex.h"
+#include "QueryCancellation.h"
+#include "TreeSummary.h"
 
 namespace watchman {
 struct FileInformation;
+enum class ContentHashAlgorithm : uint8_t;
+class InMemoryFileResult;
 }
 struct watchman_file;
 
@@ -22,9 +35,19 @@ struct w_query;
 struct w_query_ctx;
 class FileResult;
 
+struct bser_ctx;
+
 struct w_query_field_renderer {
   w_string name;
   folly::Optional<json_ref> (*make)(FileResult* file, const w_query_ctx* ctx);
+  // If set, encodes the same value that make would produce as BSER and
+  // appends it to out, without building a json value.  Returns false,
+  // leaving out untouched, if the file needs data to be loaded first.
+  bool (*encodeBser)(
+      FileResult* file,
+      const w_query_ctx* ctx,
+      const struct bser_ctx* bser,
+      std::string* out);
 };
 
 using w_query_field_list = std::vector<const w_query_field_renderer*>;
@@ -69,6 +92,16 @@ class FileResult {
 
   // Returns the name of the file in its containing dir
   virtual w_string_piece baseName() = 0;
+  // Returns true if baseName() is known to have no upper case letters, so
+  // that it needn't be folded to compare it case insensitively.  The
+  // default doesn't know.
+  virtual bool baseNameIsFolded();
+  // Returns a key that is the same for every result of the same file and
+  // differs between files for as long as the view stays locked, so that
+  // the results of a generator can be deduplicated without assembling
+  // their names; or nullptr if the view has no such key, which is the
+  // default.
+  virtual const void* identity();
   // Returns the name of the containing dir relative to the
   // VFS root
   virtual w_string_piece dirName() = 0;
@@ -80,6 +113,15 @@ class FileResult {
   // Returns the symlink target
   virtual folly::Optional<w_string> readLink() = 0;
 
+  // Returns the full path that the file was renamed from, if the view
+  // knows it; otherwise a null string.  The default knows of no renames.
+  virtual folly::Optional<w_string> renamedFrom();
+
+  // Returns the summary of the files beneath a dir.  Unlike the other
+  // accessors, this returns folly::none if the file isn't a dir or the
+  // view doesn't summarize it, which the default doesn't.
+  virtual folly::Optional<watchman::TreeSummary> treeSummary();
+
   // Maybe return the change time.
   // Returns folly::none if ctime is not currently known
   virtual folly::Optional<w_clock_t> ctime() = 0;
@@ -92,6 +134,13 @@ class FileResult {
   using ContentHash = std::array<uint8_t, 20>;
   virtual folly::Optional<ContentHash> getContentSha1() = 0;
 
+  // Returns the hash of the file contents computed by algorithm.
+  // The digest occupies the first contentHashSize(algorithm) bytes.
+  // Views that cannot compute it throw, which is the default.
+  using ContentDigest = std::array<uint8_t, 32>;
+  virtual folly::Optional<ContentDigest> getContentHash(
+      watchman::ContentHashAlgorithm algorithm);
+
   // Maybe return the dtype.
   // Returns folly::none if the dtype is not currently known.
   // Returns DType::Unknown if we have dtype data but it doesn't
@@ -130,6 +179,8 @@ class FileResult {
     SymlinkTarget = 1 << 8,
     // Need full stat metadata
     FullFileInformation = 1 << 9,
+    // The getContentHash() method will be called
+    ContentFastHash = 1 << 10,
   };
 
   // Perform a batch fetch to fill in some missing data.
@@ -179,19 +230,37 @@ class FileResult {
 struct w_query_ctx {
   struct w_query* query;
   std::shared_ptr<w_root_t> root;
-  std::unique_ptr<FileResult> file;
-  w_string wholename;
+  // The file that is being evaluated, which is owned by the caller of
+  // w_query_process_file
+  FileResult* file{nullptr};
+  // The wholename of file, once w_query_ctx_get_wholename has assembled it.
+  // The buffer is reused from one file to the next, so that the terms that
+  // look at the wholename don't allocate a string for each file.
+  std::string wholenameBuf;
+  bool wholenameValid{false};
   struct w_query_since since;
   // root number, ticks at start of query execution
   ClockSpec clockAtStartOfQuery;
   uint32_t lastAgeOutTickValueAtStartOfQuery;
+  // Clocks from this incarnation of the root are also honored
+  folly::Optional<ClockLineage> priorClockLineage;
 
   // Rendered results
   json_ref resultsArray;
-
-  // When deduping the results, set<wholename> of
-  // the files held in results
+  // Rendered results when query->render_bser is set, as the concatenated
+  // BSER encodings of the rows of the results array
+  std::string bserRows;
+  size_t numBserRows{0};
+
+  // When deduping the results, the identity() of the files held in
+  // results, and the wholenames of those that have none or, when the
+  // query collects the names, of all of them
+  std::unordered_set<const void*> dedupIdentities;
   std::unordered_set<w_string> dedup;
+  // An identity() is only good while the view stays locked, and each
+  // generator locks it separately, so when several of them run the
+  // results are deduplicated by name instead
+  bool dedupByIdentity{true};
 
   // How many times we suppressed a result due to dedup checking
   uint32_t num_deduped{0};
@@ -199,6 +268,43 @@ struct w_query_ctx {
   // Disable fresh instance queries
   bool disableFreshInstance{false};
 
+  // Set if the query can be cancelled; shared with the worker contexts
+  std::shared_ptr<watchman::QueryCancellation> cancellation;
+
+  // Total time spent waiting to acquire the view lock
+  std::chrono::microseconds viewLockWaitTime{0};
+
+  // If true, rendered results are passed to query->result_sink once
+  // there are enough of them, rather than being held in resultsArray
+  bool streamResults{false};
+  // The number of results that were passed to query->result_sink
+  size_t numStreamed{0};
+
+  // The number of files that matched the expression, which query->limit
+  // and query->offset apply to
+  size_t numMatched{0};
+  // Set if the query is ordered by name and more files matched than were
+  // returned
+  w_string nextPageToken;
+  // Set if the query is ordered by ticks and more files matched than were
+  // returned, to the tick that the returned files are complete up to
+  folly::Optional<uint32_t> resumeTicks;
+  // Set by a generator that emits the files of each directory together,
+  // so that the files of a query with group_by_dir needn't be regrouped
+  bool generatedInDirOrder{false};
+
+  // Only recorded if query->profile is set
+  struct GeneratorProfile {
+    const char* name;
+    std::chrono::nanoseconds time;
+    int64_t numWalked;
+  };
+  std::vector<GeneratorProfile> generatorProfiles;
+  std::chrono::nanoseconds renderTime{0};
+  // Time spent in batchFetchProperties for the eval and render batches
+  std::chrono::nanoseconds evalBatchFetchTime{0};
+  std::chrono::nanoseconds renderBatchFetchTime{0};
+
   w_query_ctx(
       w_query* q,
       const std::shared_ptr<w_root_t>& root,
@@ -206,6 +312,12 @@ struct w_query_ctx {
   w_query_ctx(const w_query_ctx&) = delete;
   w_query_ctx& operator=(const w_query_ctx&) = delete;
 
+  // Returns a context that can process files for the same query, with
+  // the same clocks, on another thread.  Its results are added to ours
+  // by mergeWorkerContext() once it has finished.
+  std::unique_ptr<w_query_ctx> makeWorkerContext() const;
+  void mergeWorkerContext(w_query_ctx& worker);
+
   // Increment numWalked_ by the specified amount
   inline void bumpNumWalked(int64_t amount = 1) {
     numWalked_ += amount;
@@ -222,12 +334,52 @@ struct w_query_ctx {
   // their expression cause evaluated during w_query_process_file().
   void addToEvalBatch(std::unique_ptr<FileResult>&& file);
 
+  // The number of files that the eval and render batches are fetched at,
+  // as they have adapted to the fetches so far
+  size_t evalBatchSize() const {
+    return evalBatchSizer_.size();
+  }
+  size_t renderBatchSize() const {
+    return renderBatchSizer_.size();
+  }
+
   // Perform an immediate fetch of data for the items in the
   // evalBatch_ set, and then re-evaluate each of them by passing
   // them to w_query_process_file().
   void fetchEvalBatchNow();
 
+  // Called for each file that matched the expression, to apply the
+  // limit, offset and order of the query before rendering it
+  void addMatch(std::unique_ptr<FileResult>&& file);
+  // Records file as a result when deduping; returns false if it already
+  // is one
+  bool addToDedup();
+  // True once the query has matched as many files as it is limited to,
+  // so that the generators can stop walking
+  bool limitReached() const;
+  // True once the query has been cancelled, which also stops the
+  // generators.  The deadline and the client are only checked every so
+  // many calls, so this is cheap enough to call for each file.
+  bool cancelled();
+  // Throws if the query was cancelled
+  void throwIfCancelled() const;
+  // Renders the files held for a query that is ordered by name or
+  // grouped by directory
+  void renderSorted();
+
   void maybeRender(std::unique_ptr<FileResult>&& file);
+  // Renders file into the results, returning false if it needs data to be
+  // loaded first
+  bool tryRender(const std::unique_ptr<FileResult>& file);
+  // Appends a rendered result to resultsArray
+  void addResult(json_ref&& rendered);
+  // The arena that the rows of resultsArray are allocated from.  Each
+  // context has its own, as an arena is only allocated from by one thread
+  // at a time.
+  JsonArena* resultArena() const;
+  // Passes the accumulated results to query->result_sink if there are
+  // enough of them and streamResults is set
+  void maybeStreamResults();
   void addToRenderBatch(std::unique_ptr<FileResult>&& file);
 
   // Perform a batch load of the items in the render batch,
@@ -237,6 +389,14 @@ struct w_query_ctx {
   bool fetchRenderBatchNow();
 
   w_string computeWholeName(FileResult* file) const;
+  // Writes the wholename of file to buf, replacing what it held, and
+  // returns it.  Unlike the w_string form, this reuses the memory of buf
+  // and has no reference count to maintain.
+  w_string_piece computeWholeName(FileResult* file, std::string& buf) const;
+  // Returns the part of the name of file relative to the root that
+  // computeWholeName joins to its baseName with a `/`, or an empty piece
+  // if the file is at the top of the root
+  w_string_piece computeWholeNameDir(FileResult* file) const;
 
   // Returns true if the filename associated with `f` matches
   // the relative_root constraint set on the query.
@@ -258,22 +418,47 @@ struct w_query_ctx {
  private:
   // Number of files considered as part of running this query
   int64_t numWalked_{0};
+  // Calls to cancelled() since it last polled the cancellation
+  uint32_t callsSinceCancelPoll_{0};
 
   // Files for which we encountered NeedMoreData and that we
   // will re-evaluate once we have enough of them accumulated
   // to batch fetch the required data
   std::vector<std::unique_ptr<FileResult>> evalBatch_;
+  watchman::FetchBatchSizer evalBatchSizer_;
 
   // Similar to needBatchFetch_ above, except that the files
   // in this batch have been successfully matched by the
   // expression and are just pending data to be loaded
   // for rendering the result fields.
   std::vector<std::unique_ptr<FileResult>> renderBatch_;
+  watchman::FetchBatchSizer renderBatchSizer_;
+
+  // For a query that is ordered by name, a max-heap by name of the first
+  // offset + limit matching files.  For a query that is only grouped by
+  // directory, the matching files in the order that they were generated.
+  using NamedFile = std::pair<w_string, std::unique_ptr<FileResult>>;
+  std::vector<NamedFile> sorted_;
+
+  // For a query that is ordered by ticks, the matching files by the tick
+  // that they last changed at.  When it has a limit, the files of the
+  // latest ticks are dropped for as long as the others make up the limit,
+  // so that the files of a tick are either all returned or none are.
+  std::map<uint32_t, std::vector<std::unique_ptr<FileResult>>> byTick_;
+  size_t numByTick_{0};
+  // The earliest tick whose files were dropped
+  folly::Optional<uint32_t> droppedFromTick_;
+
+  // Made on first use by resultArena()
+  mutable JsonArena::Ptr resultArena_;
 };
 
 struct w_query_path {
   w_string name;
   int depth;
+  // Generate only the file or dir that name refers to, rather than the
+  // contents of the dir.  Only the query planner sets this.
+  bool exact{false};
 };
 
 // Describes how terms are being aggregated
@@ -284,11 +469,71 @@ enum AggregateOp {
 
 using EvaluateResult = folly::Optional<bool>;
 
+// A coarse estimate of the cost of evaluating a term against a single
+// file, from the cheapest to the most expensive.  The query planner
+// evaluates the cheaper terms of a compound expression first so that the
+// expensive ones only see the files that the cheap ones didn't decide.
+enum class QueryExprCost : uint8_t {
+  // Needs only the name or type of the file
+  Name,
+  // Matches a pattern against the name of the file
+  Pattern,
+  // Needs the metadata or the contents of the file, which may have to be
+  // fetched
+  Data,
+};
+
 class QueryExpr {
  public:
   virtual ~QueryExpr();
   virtual EvaluateResult evaluate(w_query_ctx* ctx, FileResult* file) = 0;
 
+  // Evaluates a file of the InMemoryView, which the view passes with its
+  // concrete type so that terms that derive from SpecializedQueryExpr can
+  // read its properties without virtual calls.  The default calls
+  // evaluate().
+  virtual EvaluateResult evaluateInMemory(
+      w_query_ctx* ctx,
+      watchman::InMemoryFileResult* file);
+
+  // Returns the estimated cost of this expression.  The default is the
+  // most expensive class.
+  virtual QueryExprCost cost() const;
+
+  // Rewrites the expression into a cheaper form that matches the same
+  // files.  The default does nothing.
+  virtual void plan();
+
+  // Returns a description of the expression, as planned, for the
+  // "explain" query option.  The default returns term.
+  virtual json_ref describe() const;
+
+  // If each file that matches this expression must have one of a set of
+  // suffixes, returns that set so that the planner can generate the
+  // candidate files from the suffix index.
+  virtual folly::Optional<std::vector<w_string>> impliedSuffixes() const;
+
+  // If each file that matches this expression must have one of a set of
+  // basenames, returns that set, lower-cased, so that the planner can
+  // generate the candidate files from the basename index of the view.
+  virtual folly::Optional<std::vector<w_string>> impliedBasenames() const;
+
+  // If each file that matches this expression must have one of a set of
+  // names relative to the root, returns that set so that the planner can
+  // look up those files rather than generate all of them.
+  virtual folly::Optional<std::vector<w_string>> impliedPaths() const;
+
+  // If each file that matches this expression must be within one of a set
+  // of dirs, no deeper than a given depth, returns those dirs as paths for
+  // the path generator so that the planner can walk just those subtrees.
+  virtual folly::Optional<std::vector<w_query_path>> impliedDirs() const;
+
+  // Replaces each of the terms that this expression is composed of with
+  // the result of passing it to wrap.  The default has no terms.
+  virtual void wrapTerms(
+      const std::function<std::unique_ptr<QueryExpr>(
+          std::unique_ptr<QueryExpr>)>& wrap);
+
   // If OTHER can be aggregated with THIS, returns a new expression instance
   // representing the combined state.  Op provides information on the containing
   // query and can be used to determine how aggregation is done.
@@ -296,10 +541,63 @@ class QueryExpr {
   virtual std::unique_ptr<QueryExpr> aggregate(
       const QueryExpr* other,
       const AggregateOp op) const;
+
+  // The term that this expression was parsed from
+  json_ref term;
+};
+
+// Evaluates expr with the most specific path for the type of file
+inline EvaluateResult
+evaluateQueryExpr(QueryExpr& expr, w_query_ctx* ctx, FileResult* file) {
+  return expr.evaluate(ctx, file);
+}
+inline EvaluateResult evaluateQueryExpr(
+    QueryExpr& expr,
+    w_query_ctx* ctx,
+    watchman::InMemoryFileResult* file) {
+  return expr.evaluateInMemory(ctx, file);
+}
+
+// A base for the cheap terms that are evaluated for nearly every file.
+// Derived implements
+//   template <typename File>
+//   EvaluateResult evaluateFile(w_query_ctx* ctx, File* file);
+// which is instantiated for both FileResult and InMemoryFileResult, so
+// that the accessors of the latter, which is final, can be inlined.  The
+// translation unit of Derived must include InMemoryView.h.
+template <typename Derived>
+class SpecializedQueryExpr : public QueryExpr {
+ public:
+  EvaluateResult evaluate(w_query_ctx* ctx, FileResult* file) override {
+    return static_cast<Derived*>(this)->evaluateFile(ctx, file);
+  }
+
+  EvaluateResult evaluateInMemory(
+      w_query_ctx* ctx,
+      watchman::InMemoryFileResult* file) override {
+    return static_cast<Derived*>(this)->evaluateFile(ctx, file);
+  }
 };
 
 struct watchman_glob_tree;
 
+// The counters that a query that is set to profile keeps for a term of
+// its expression.  They are updated by all of the threads that evaluate
+// the query.
+struct QueryTermProfile {
+  QueryTermProfile(json_ref name, uint32_t depth)
+      : name(std::move(name)), depth(depth) {}
+
+  json_ref name;
+  // The number of terms that this one is nested in
+  uint32_t depth;
+  std::atomic<uint64_t> evaluations{0};
+  std::atomic<uint64_t> matches{0};
+  // Evaluations that needed data to be loaded first
+  std::atomic<uint64_t> deferred{0};
+  std::atomic<uint64_t> nanos{0};
+};
+
 // represents an error parsing a query
 class QueryParseError : public std::runtime_error {
  public:
@@ -330,13 +628,79 @@ class RootResolveError : public std::runtime_error {
             std::forward<Args>(args)...)) {}
 };
 
+// The files that the glob generator of a query matched when it last ran
+struct w_query_glob_matches {
+  // Whether names holds every match in the view numbered rootNumber, apart
+  // from those among the files that changed after ticks
+  bool valid{false};
+  uint32_t rootNumber{0};
+  uint32_t ticks{0};
+  // Relative to the dir that the globs are matched against.  Some may have
+  // been deleted since.
+  std::unordered_set<w_string> names;
+};
+
 struct w_query {
   watchman::CaseSensitivity case_sensitive{
       watchman::CaseSensitivity::CaseInSensitive};
   bool fail_if_no_saved_state{false};
   bool empty_on_fresh_instance{false};
   bool dedup_results{false};
+  // Collect the names of the results in w_query_res::dedupedFileNames;
+  // requires dedup_results
+  bool collect_file_names{false};
+  // Return the plan that was chosen for the query in the response
+  bool explain{false};
+  // The suffix generator was chosen by the planner rather than the client
+  bool planned_suffixes{false};
+  // Likewise for the basename generator, which only the planner chooses
+  bool planned_basenames{false};
+  // Likewise for the path generator
+  bool planned_paths{false};
+  // If non-zero, the results are handed to result_sink in arrays of
+  // about this many files as they are rendered, rather than all being
+  // returned in w_query_res::resultsArray
+  uint32_t stream_chunk_size{0};
+  std::function<void(json_ref&& files)> result_sink;
   uint32_t bench_iterations{0};
+  // If non-zero, at most this many files are returned
+  uint32_t limit{0};
+  // The number of matching files to skip before returning any
+  uint32_t offset{0};
+  // If set, the files are returned in order of their names, starting
+  // after page_token if that is set, and limit and offset apply to that
+  // order rather than the order in which the files are generated
+  bool order_by_name{false};
+  w_string page_token;
+  // If set, the files are returned in the order that they last changed,
+  // and limit doesn't split the files that changed at the same tick; when
+  // more files matched than were returned, the clock of the response is
+  // that of the last of them, so that a since query from it resumes after
+  // them
+  bool order_by_ticks{false};
+  // If set, the files of each directory are returned together, so that
+  // consecutive names share their directory prefix.  When combined with
+  // order_by_name, the files are ordered by their directory, and then by
+  // their base name within it.
+  bool group_by_dir{false};
+  // Record counters and timings for the terms and stages of the query,
+  // returned in w_query_res::profile
+  bool profile{false};
+  // One per term of expr, in depth first order
+  std::deque<QueryTermProfile> term_profiles;
+  // If set, results are rendered straight to BSER with this version and
+  // capabilities and are returned in w_query_res::bserRows, rather than
+  // as json values in w_query_res::resultsArray
+  bool render_bser{false};
+  uint32_t render_bser_version{0};
+  uint32_t render_bser_capabilities{0};
+  // If set, the query must have only the name field, and the names are
+  // rendered into w_query_res::bserRows as length prefixed strings, to be
+  // returned as a single blob by w_query_res_encode_packed_names rather
+  // than as an array
+  bool packed_names{false};
+  // Front codes the packed names against the name before each of them
+  bool packed_names_front_coded{false};
 
   /* optional full path to relative root, without and with trailing slash */
   w_string relative_root;
@@ -347,11 +711,22 @@ struct w_query {
   std::unique_ptr<watchman_glob_tree> glob_tree;
   // Additional flags to pass to wildmatch in the glob_generator
   int glob_flags{0};
+  // Set for the queries of subscriptions and triggers, which are executed
+  // again each time that the root changes.  The glob generator then
+  // remembers the files that it matched in glob_matches, and the next time
+  // only matches the files that changed since, rather than walking the
+  // tree again.
+  bool incremental_glob{false};
+  folly::Synchronized<w_query_glob_matches, std::mutex> glob_matches;
 
   folly::Optional<std::vector<w_string>> suffixes;
+  // The lower-cased names for the basename generator; sorted and unique
+  folly::Optional<std::vector<w_string>> basenames;
 
   std::chrono::milliseconds sync_timeout{0};
   uint32_t lock_timeout{0};
+  // How long the query may take to execute, or 0 for as long as it takes
+  std::chrono::milliseconds timeout{0};
 
   // We can't (and mustn't!) evaluate the clockspec
   // fully until we execute query, because we have
@@ -394,6 +769,22 @@ void w_query_process_file(
     w_query* query,
     struct w_query_ctx* ctx,
     std::unique_ptr<FileResult> file);
+// As above, for a file that the generator owns, such as one on its stack.
+// promote is only called if the file matched or has to be evaluated again
+// once its properties have been fetched, and returns a copy of it that the
+// query can keep, so that the files that are rejected are never allocated.
+void w_query_process_file(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    FileResult& file,
+    folly::FunctionRef<std::unique_ptr<FileResult>()> promote);
+// As above, evaluating the expression through its specialized path for the
+// results of the InMemoryView
+void w_query_process_file(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    watchman::InMemoryFileResult& file,
+    folly::FunctionRef<std::unique_ptr<FileResult>()> promote);
 
 // Generator callback, used to plug in an alternate
 // generator when used in triggers or subscriptions
@@ -409,22 +800,64 @@ void time_generator(
 struct w_query_res {
   bool is_fresh_instance;
   json_ref resultsArray;
-  // Only populated if the query was set to dedup_results
+  // Only populated if the query was set to collect_file_names
   std::unordered_set<w_string> dedupedFileNames;
   ClockSpec clockAtStartOfQuery;
   uint32_t stateTransCountAtStartOfQuery;
   json_ref savedStateInfo;
+  // Only populated if the query was set to explain
+  json_ref explain;
+  // Only populated if the query was set to render_bser
+  std::string bserRows;
+  size_t numBserRows{0};
+  // Only populated if the query was set to profile
+  json_ref profile;
+  // The number of files that the generators produced
+  int64_t numWalked{0};
+  // Only populated if the query is ordered by name and has more results
+  // than its limit; passing it as page_token returns the next of them
+  w_string nextPageToken;
+  // Set if the query is ordered by ticks and has more results than its
+  // limit, in which case clockAtStartOfQuery is where the results stop
+  bool hasMore{false};
 };
 
+// Returns the BSER encoding of the results array of res, which must be
+// the result of a query that was set to render_bser
+std::string w_query_res_encode_bser_results(
+    const w_query* query,
+    const w_query_res& res);
+
+// Returns the BSER encoding of the packed names blob for the results of a
+// query that was set to render_bser and packed_names
+std::string w_query_res_encode_packed_names(
+    const w_query* query,
+    const w_query_res& res);
+
+// Wraps each term of the expression of query to record its profile
+void w_query_profile_terms(w_query* query);
+json_ref w_query_profile_to_json(const w_query_ctx* ctx);
+
+// clientGone, if set, returns true once the client that is waiting for
+// the results has hung up, which cancels the query
 w_query_res w_query_execute(
+    w_query* query,
+    const std::shared_ptr<w_root_t>& root,
+    w_query_generator generator,
+    std::function<bool()> clientGone = nullptr);
+
+// Like w_query_execute, for the queries of subscriptions and triggers,
+// which are executed when the root settles.  Queries with the same spec
+// and since position as one that has already been executed at the current
+// position of the view are given the result of that one.
+std::shared_ptr<const w_query_res> w_query_execute_shared(
     w_query* query,
     const std::shared_ptr<w_root_t>& root,
     w_query_generator generator);
 
-// Returns a shared reference to the wholename
-// of the file.  The caller must not delref
-// the reference.
-const w_string& w_query_ctx_get_wholename(struct w_query_ctx* ctx);
+// Returns the wholename of the file that ctx is evaluating.  The piece
+// refers to ctx->wholenameBuf, and is valid until the next file.
+w_string_piece w_query_ctx_get_wholename(struct w_query_ctx* ctx);
 
 // parse the old style since and find queries
 std::shared_ptr<w_query> w_query_parse_legacy(
@@ -434,12 +867,33 @@ std::shared_ptr<w_query> w_query_parse_legacy(
     uint32_t* next_arg,
     const char* clockspec,
     json_ref* expr_p);
+// Like w_query_parse_legacy, for the find and since commands, but takes
+// the query from the QueryPlanCache of the root if the same patterns were
+// parsed before.  Sets cacheKey to the key that the caller returns the
+// query to the cache under once it has executed it, or to null if the
+// query isn't to be cached.
+std::shared_ptr<w_query> w_query_parse_legacy_cached(
+    const std::shared_ptr<w_root_t>& root,
+    const json_ref& args,
+    int start,
+    const char* clockspec,
+    w_string& cacheKey);
 void w_query_legacy_field_list(w_query_field_list* flist);
 
 folly::Optional<json_ref> file_result_to_json(
     const w_query_field_list& fieldList,
     const std::unique_ptr<FileResult>& file,
     const w_query_ctx* ctx);
+// Appends the BSER encoding of the row for file to out, in the shape
+// of a row of the array that file_result_to_json would be rendered into.
+// Returns false, leaving out untouched, if the file needs data to be
+// loaded first.
+// The encoding is the one that ctx->query is set to render_bser with.
+bool file_result_to_bser(
+    const w_query_field_list& fieldList,
+    const std::unique_ptr<FileResult>& file,
+    const w_query_ctx* ctx,
+    std::string* out);
 
 void w_query_init_all(void);
 
@@ -475,6 +929,15 @@ struct watchman_glob_tree {
   unsigned had_specials : 1; // if false, can do simple string compare
   unsigned is_doublestar : 1; // pattern begins with **
 
+  // The children that cannot be looked up by name and have to be matched
+  // against each entry of a dir, along with a prefilter for them whose
+  // indices refer to this list.  The prefilter for the ** rules refers to
+  // doublestar_children.  These are populated once all globs are added.
+  std::vector<const watchman_glob_tree*> matched_children;
+  watchman::GlobSuffixIndex matched_index;
+  watchman::GlobSuffixIndex doublestar_index;
+  bool has_matched_leaf{false};
+
   watchman_glob_tree(const char* pattern, uint32_t pattern_len);
 };
 
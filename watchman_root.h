@@ -4,11 +4,17 @@
 #include <folly/Synchronized.h>
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <unordered_map>
+#include "ChangedFilesCache.h"
 #include "CookieSync.h"
 #include "FileSystem.h"
 #include "PubSub.h"
+#include "QueryPlanCache.h"
+#include "QueryResultCache.h"
 #include "QueryableView.h"
+#include "RecrawlBackoff.h"
+#include "SharedSubscriptionResults.h"
 #include "watchman_config.h"
 
 #define HINT_NUM_DIRS 128 * 1024
@@ -54,12 +60,21 @@ class ClientStateAssertions {
    * the integration tests. */
   json_ref debugStates() const;
 
+  /** Returns true if one of the queued assertions asked for the IO
+   * thread to defer processing its pending changes, so that they can be
+   * applied in one pass once things have quietened down. */
+  bool isDeferringProcessing() const {
+    return deferringProcessing_ > 0;
+  }
+
  private:
   /** states_ maps from a state name to a queue of assertions with
    * various dispositions */
   std::
       unordered_map<w_string, std::deque<std::shared_ptr<ClientStateAssertion>>>
           states_;
+  /** The number of queued assertions with deferProcessing set */
+  size_t deferringProcessing_{0};
 };
 } // namespace watchman
 
@@ -91,6 +106,21 @@ struct watchman_root : public std::enable_shared_from_this<watchman_root> {
   // Stream of broadcast unilateral items emitted by this root
   std::shared_ptr<watchman::Publisher> unilateralResponses;
 
+  // Encoded responses to recent queries; see cmds/query.cpp
+  watchman::QueryResultCache queryResultCache;
+
+  // Parsed queries of the legacy find and since commands; see
+  // w_query_parse_legacy_cached
+  watchman::QueryPlanCache queryPlanCache;
+
+  // Files changed since the merge base for SCM-aware queries; see
+  // query/eval.cpp
+  std::shared_ptr<watchman::ChangedFilesCache> scmChangedFiles;
+
+  // Results of the queries of the subscriptions and triggers that have the
+  // same query and since position; see w_query_execute_shared
+  watchman::SharedSubscriptionResults<w_query_res> sharedSubscriptionResults;
+
   struct RecrawlInfo {
     /* how many times we've had to recrawl */
     int recrawlCount{0};
@@ -99,6 +129,25 @@ struct watchman_root : public std::enable_shared_from_this<watchman_root> {
     bool shouldRecrawl{true};
     // Last ad-hoc warning message
     w_string warning;
+    /* if true, the watcher lost some notifications and the IO thread
+     * should reconcile the view with the filesystem; see
+     * scheduleOverflowRecovery */
+    bool shouldRecover{false};
+    w_string recoveryReason;
+    // Dirs that the watcher saw activity in shortly before the loss
+    std::vector<w_string> recoveryDirs;
+    /* how many times we've recovered without a full recrawl */
+    int recoveryCount{0};
+    // Describes the scope of the most recent recovery
+    json_ref lastRecovery;
+    // Why the pending recrawl was scheduled
+    w_string recrawlReason;
+    // When the pending recrawl, and the crawls of the dirs that failed to
+    // be read, may start; see scheduleRecrawl and scheduleSubtreeRecrawl
+    watchman::RecrawlBackoff backoff;
+    // The time spent recrawling, and the most recent recrawls, oldest first
+    double recrawlSeconds{0};
+    std::deque<json_ref> recrawlHistory;
   };
   folly::Synchronized<RecrawlInfo> recrawlInfo;
 
@@ -117,7 +166,7 @@ struct watchman_root : public std::enable_shared_from_this<watchman_root> {
     bool cancelled{0};
 
     /* map of cursor name => last observed tick value */
-    folly::Synchronized<std::unordered_map<w_string, uint32_t>> cursors;
+    CursorMap cursors;
 
     /* Collection of symlink targets that we try to watch.
      * Reads and writes on this collection are only safe if done from the IO
@@ -138,9 +187,47 @@ struct watchman_root : public std::enable_shared_from_this<watchman_root> {
   ~watchman_root();
 
   void considerAgeOut();
-  void performAgeOut(std::chrono::seconds min_age);
+  // Ages out the deleted files that are older than min_age.  Unless
+  // complete is set, a view that ages out in slices may do only a slice
+  // of the work, and considerAgeOut() continues it later.
+  void performAgeOut(std::chrono::seconds min_age, bool complete = true);
   void syncToNow(std::chrono::milliseconds timeout);
-  void scheduleRecrawl(const char* why);
+  // As syncToNow, as a future that is fulfilled once the root is in sync
+  // rather than holding up the caller; see QueryableView::syncToNowAsync
+  folly::Future<folly::Unit> syncToNowAsync(std::chrono::milliseconds timeout);
+  // Schedules a crawl of the whole tree.  A recrawl that follows soon
+  // after the last one is held back for longer each time, within the
+  // recrawl_backoff_ms and recrawl_backoff_max_ms options, unless backoff
+  // is false.
+  void scheduleRecrawl(const char* why, bool backoff = true);
+
+  // Called when a dir beneath the root couldn't be read for a reason that
+  // may be transient, such as an I/O error on a network filesystem.  The
+  // IO thread crawls just that dir again once the backoff for its
+  // failures has passed, rather than recrawling the whole tree.
+  void scheduleSubtreeRecrawl(const w_string& dir, const w_string& why);
+
+  // Describes the recrawls of this root, and the dirs that are waiting to
+  // be crawled again
+  json_ref getRecrawlInfo();
+
+  // Called by a watcher when the kernel tells it that notifications were
+  // dropped.  Rather than recrawling everything, the IO thread rescans
+  // the activeDirs and any dirs whose stat no longer matches the view,
+  // falling back to a full recrawl if that would exceed the configured
+  // overflow_recovery_budget.
+  void scheduleOverflowRecovery(
+      const char* why,
+      std::vector<w_string> activeDirs);
+
+  // Describes the overflow recoveries performed for this root
+  json_ref getOverflowRecoveryInfo();
+
+  // Adds the metrics of the root, and of its view, labelled with its path
+  void addMetrics(watchman::MetricsWriter& metrics);
+
+  // Returns an estimate of the memory held by the root and its view
+  json_ref getMemoryUsage();
 
   // Requests cancellation of the root.
   // Returns true if this request caused the root cancellation, false
@@ -160,6 +247,9 @@ struct watchman_root : public std::enable_shared_from_this<watchman_root> {
 
  private:
   void applyIgnoreConfiguration();
+  void applyIgnoreGlobConfiguration();
+  void applyIncludeConfiguration();
+  void ageOutSlice(std::chrono::seconds min_age);
 };
 
 std::shared_ptr<w_root_t> w_root_resolve(const char* path, bool auto_watch);
@@ -170,6 +260,37 @@ bool findEnclosingRoot(
     w_string_piece& prefix,
     w_string_piece& relativePath);
 
+/* Shared watches are dirs below a watched root that clients watched in
+ * their own right while share_nested_watches was set.  Rather than being
+ * watched separately, they are served by the view of the root that
+ * encloses them, with queries scoped to the dir by relative_root. */
+
+/* Returns the path that root_resolve looks filename up by, which is what
+ * shared watches are keyed by: its canonical path, or filename itself if
+ * that can't be resolved */
+w_string w_root_canonical_path(const char* filename);
+
+/* If path is a shared watch, sets enclosingPath to the root that serves
+ * it and relativePath to its path within that root, and returns true */
+bool w_root_find_shared(
+    const w_string& path,
+    w_string& enclosingPath,
+    w_string& relativePath);
+/* Makes path a shared watch of the watched root that encloses it, if
+ * there is one.  Returns true and sets enclosingPath and relativePath as
+ * w_root_find_shared does if it was made one */
+bool w_root_share_enclosing(
+    const w_string& path,
+    w_string& enclosingPath,
+    w_string& relativePath);
+/* Stops serving path as a shared watch.  Returns true if it was one */
+bool w_root_unshare(const w_string& path);
+
+/* If a watched root has the number rootNumber, sets position to its
+ * current clock and returns true.  This is for probes, which name roots
+ * by number rather than by path; see Probe.h */
+bool w_root_probe_clock(uint32_t rootNumber, ClockPosition& position);
+
 void w_root_free_watched_roots(void);
 json_ref w_root_stop_watch_all(void);
 void w_root_reap(void);
@@ -186,6 +307,10 @@ extern folly::Synchronized<
 std::shared_ptr<w_root_t>
 root_resolve(const char* filename, bool auto_watch, bool* created);
 
+// If path is a root from the state file that is waiting to be restored,
+// takes it out of the queue of roots to restore and returns true
+bool w_root_claim_pending_restore(const w_string& path);
+
 void set_poison_state(
     const w_string& dir,
     struct timeval now,
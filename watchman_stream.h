@@ -5,6 +5,8 @@
 
 #include "FileDescriptor.h"
 
+struct iovec;
+
 // Very limited stream abstraction to make it easier to
 // deal with portability between Windows and POSIX.
 
@@ -24,12 +26,28 @@ class watchman_stream {
   virtual ~watchman_stream() = default;
   virtual int read(void* buf, int size) = 0;
   virtual int write(const void* buf, int size) = 0;
+  // Writes from iovcnt buffers in order, like writev(2), and returns the
+  // number of bytes written or -1.  The default writes only from the first
+  // buffer that has any data; callers loop until everything is written,
+  // as they do with write.
+  virtual int writev(const struct iovec* iov, int iovcnt);
+  // Writes up to size bytes from buf, like write, passing a copy of the
+  // descriptor fd to the peer along with them.  The default fails with
+  // errno set to ENOTSUP; only unix domain sockets can pass descriptors.
+  virtual int writeWithDescriptor(
+      const void* buf,
+      int size,
+      watchman::FileDescriptor::system_handle_type fd);
   virtual w_evt_t getEvents() = 0;
   virtual void setNonBlock(bool nonBlock) = 0;
   virtual bool rewind() = 0;
   virtual bool shutdown() = 0;
   virtual bool peerIsOwner() = 0;
   virtual pid_t getPeerProcessID() const = 0;
+  // Returns true if the peer has closed its end, without consuming any of
+  // what it sent, so that a long running command can tell that nobody is
+  // waiting for it.  The default doesn't know, and returns false.
+  virtual bool peerHasClosed();
   virtual const watchman::FileDescriptor& getFileDescriptor() const = 0;
 };
 using w_stm_t = watchman_stream*;
@@ -52,6 +70,11 @@ int w_poll_events_named_pipe(
     int timeoutms);
 int w_poll_events_sockets(struct watchman_event_poll* p, int n, int timeoutms);
 int w_poll_events(struct watchman_event_poll* p, int n, int timeoutms);
+// The number of times that w_poll_events has slept until its timeout
+// without any of its events being signalled.  Loops that have nothing to
+// do should wait without a timeout, so this should only grow while there
+// is something to be retried.
+uint64_t w_poll_idle_wakeups();
 
 // Create a connected unix socket or a named pipe client stream
 std::unique_ptr<watchman_stream> w_stm_connect(int timeoutms);
@@ -66,6 +89,21 @@ std::unique_ptr<watchman_stream> w_stm_connect_named_pipe(
     const char* path,
     int timeoutms);
 watchman::FileDescriptor w_handle_open(const char* path, int flags);
+
+// Switches a named pipe stream, whose handle has already been associated
+// with an I/O completion port, over to having its writes completed by
+// whoever waits on that port rather than by an APC.  Must be called
+// before anything is read from or written to the stream.
+bool w_stm_use_completion_port(watchman_stream* stm);
+
+// Passes a completion packet that was dequeued for stm on to it.  Returns
+// true if it was that of a write, in which case there may be room to write
+// more; any other packet means that there may be input to read.
+bool w_stm_completed(
+    watchman_stream* stm,
+    OVERLAPPED* olap,
+    DWORD err,
+    DWORD bytes);
 #endif
 std::unique_ptr<watchman_stream> w_stm_fdopen(watchman::FileDescriptor&& fd);
 std::unique_ptr<watchman_stream> w_stm_fdopen_windows(
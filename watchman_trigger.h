@@ -1,12 +1,82 @@
 /* Copyright 2012-present Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <thread>
 #include "ChildProcess.h"
+#include "Clock.h"
 
-enum trigger_input_style { input_dev_null, input_json, input_name_list };
+enum trigger_input_style {
+  input_dev_null,
+  input_json,
+  input_name_list,
+  input_bser
+};
+
+// How the input is passed to the child: in a file that holds all of it,
+// or through a pipe that it is written to as the child reads it
+enum trigger_input_delivery { input_via_file, input_via_pipe };
+
+// Writes the stdin of a child through a pipe on a thread of its own, so
+// that the child can start to consume it right away
+class TriggerStdinWriter {
+ public:
+  // Writes data to pipe, the write end of the stdin of the child
+  TriggerStdinWriter(
+      const w_string& triggername,
+      watchman::FileDescriptor&& pipe,
+      std::string&& data);
+  // Abandons what has yet to be written, and waits for the thread
+  ~TriggerStdinWriter();
+  TriggerStdinWriter(const TriggerStdinWriter&) = delete;
+  TriggerStdinWriter& operator=(const TriggerStdinWriter&) = delete;
+
+ private:
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+// What to do with changes that arrive while a trigger is already running
+// as many children as it is allowed
+enum class TriggerOnBusy {
+  // Kill the oldest child, and run the command again with the changes
+  // that were given to it as well as the new ones
+  Restart,
+  // Run the command once for all of the changes once a child exits
+  Queue,
+};
 
 struct watchman_trigger_command {
+  // A child that is running the command
+  struct Run {
+    std::unique_ptr<watchman::ChildProcess> proc;
+    std::chrono::steady_clock::time_point started;
+    std::unique_ptr<TriggerStdinWriter> stdinWriter;
+    // Where the query that produced the input of the child started, so
+    // that a restart can pick up from there
+    std::unique_ptr<ClockSpec> since;
+  };
+
+  // Counters of the runs of the trigger, which trigger-list reports
+  struct Stats {
+    // The children that were started, killed to restart the command, and
+    // that exited with a failure status
+    std::atomic<uint64_t> runs{0};
+    std::atomic<uint64_t> restarts{0};
+    std::atomic<uint64_t> failures{0};
+    // The settles that were folded into a run that was already pending,
+    // and the times that the trigger waited for trigger_max_concurrent
+    std::atomic<uint64_t> coalesced{0};
+    std::atomic<uint64_t> waited{0};
+    // How long the children that have exited ran for
+    std::atomic<uint64_t> lastRunMs{0};
+    std::atomic<uint64_t> maxRunMs{0};
+    std::atomic<uint64_t> totalRunMs{0};
+    std::atomic<size_t> running{0};
+  };
+
   w_string triggername;
   std::shared_ptr<w_query> query;
   json_ref definition;
@@ -15,6 +85,7 @@ struct watchman_trigger_command {
 
   bool append_files;
   enum trigger_input_style stdin_style;
+  enum trigger_input_delivery stdin_delivery;
   uint32_t max_files_stdin;
 
   int stdout_flags;
@@ -22,9 +93,17 @@ struct watchman_trigger_command {
   std::string stdout_name;
   std::string stderr_name;
 
-  /* While we are running, this holds the pid
-   * of the running process */
-  std::unique_ptr<watchman::ChildProcess> current_proc;
+  // Triggers with a higher priority are run first when more of them are
+  // waiting than trigger_max_concurrent lets run
+  int priority{0};
+  size_t max_concurrency{1};
+  TriggerOnBusy on_busy{TriggerOnBusy::Restart};
+
+  /* While we are running, this holds the children that are running the
+   * command, oldest first.  Only used by the trigger thread. */
+  std::deque<Run> running;
+
+  Stats stats;
 
   watchman_trigger_command(
       const std::shared_ptr<w_root_t>& root,
@@ -35,15 +114,29 @@ struct watchman_trigger_command {
   void stop();
   void start(const std::shared_ptr<w_root_t>& root);
 
+  json_ref statsToJson() const;
+
  private:
   std::thread triggerThread_;
   std::shared_ptr<watchman::Publisher::Subscriber> subscriber_;
   std::unique_ptr<watchman_event> ping_;
   bool stopTrigger_{false};
+  // Whether the root has settled since the command was last run
+  bool runPending_{false};
+  // Whether the scheduler has queued the pending run
+  bool waiting_{false};
 
   void run(const std::shared_ptr<w_root_t>& root);
+  // Runs the command if it is pending and the scheduler lets it
+  void maybeRun(const std::shared_ptr<w_root_t>& root);
+  // Returns true if the query matched files and a child was started
   bool maybeSpawn(const std::shared_ptr<w_root_t>& root);
-  bool waitNoIntr();
+  // Reaps the children that have exited
+  void reapChildren();
+  // Kills the child at the front of running, and waits for it
+  void killOldest();
+  // Accounts for a child that has exited, and gives back its slot
+  void finishRun(Run& run, bool failed);
 };
 
 void w_assess_trigger(
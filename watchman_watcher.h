@@ -1,7 +1,11 @@
 /* Copyright 2012-present Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
+#include <atomic>
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include "Metrics.h"
 #include "watchman_opendir.h"
 
 namespace watchman {
@@ -13,6 +17,26 @@ class TerminalWatcherError : public std::runtime_error {
 };
 } // namespace watchman
 
+// Counters that every watcher keeps, so that the capacity of a watcher can
+// be compared across systems in debug-watcher-info and the metrics export.
+// The threads of the watcher update them, and anyone may read them.
+struct WatcherStats {
+  // Batches of events that the watcher retrieved from the system, and the
+  // number of events in them
+  std::atomic<uint64_t> batches{0};
+  std::atomic<uint64_t> events{0};
+  // Events that were folded into another event for the same path
+  std::atomic<uint64_t> coalescedEvents{0};
+  // Bytes of event records read from the system, for the watchers that
+  // read them as bytes
+  std::atomic<uint64_t> bytesRead{0};
+  // Times that the system reported that it dropped events, each of which
+  // costs a recrawl or a resync
+  std::atomic<uint64_t> overflows{0};
+  // Time spent in consumeNotify
+  std::atomic<uint64_t> consumeMicros{0};
+};
+
 struct Watcher : public std::enable_shared_from_this<Watcher> {
   // What's it called??
   const w_string name;
@@ -25,6 +49,8 @@ struct Watcher : public std::enable_shared_from_this<Watcher> {
 #define WATCHER_COALESCED_RENAME 2
   unsigned flags;
 
+  WatcherStats stats;
+
   Watcher(const char* name, unsigned flags);
 
   // Start up threads or similar.  Called in the context of the
@@ -55,6 +81,57 @@ struct Watcher : public std::enable_shared_from_this<Watcher> {
 
   // Wait for an inotify event to become available
   virtual bool waitNotify(int timeoutms) = 0;
+
+  // Returns true if there were no notifications left for consumeNotify
+  // to read at the time of the call, which means that every change made
+  // before the call has been read by a prior call to consumeNotify.
+  // Returns false if there may be some left, or if the watcher can't
+  // tell, in which case a sync needs a cookie file.
+  virtual bool isDrained();
+
+  // Returns an fd that is readable whenever waitNotify would return
+  // true, so that a RootThreadPool can wait for the notifications of many
+  // roots at once, or -1 if the watcher has no such fd
+  virtual int getNotifyFd();
+
+  // Returns an opaque position in the journal of changes that the watcher
+  // reads from, which follows every change that has been passed on by
+  // consumeNotify so far, or nullptr if the watcher can't replay changes
+  // from a position.  Called from the IO thread.
+  virtual w_string getResumePosition();
+
+  // Asks start to replay the changes that followed position, which was
+  // returned by getResumePosition in a prior incarnation of the server,
+  // rather than only reporting the changes made after the start.
+  // Called before start.
+  virtual void setResumePosition(w_string_piece position);
+
+  // True if start replays the changes that followed the position passed
+  // to setResumePosition, so that a view restored from the snapshot that
+  // recorded the position doesn't need to be crawled
+  virtual bool resumedFromPosition();
+
+  // The number of files and dirs that the watcher holds a watch on
+  virtual size_t getNumWatches() const;
+
+  // The most watches that the system will let the watcher hold, or 0 if
+  // it has no such limit or the watcher doesn't know it
+  virtual size_t getWatchLimit() const;
+
+  // Adds the metrics that are specific to the watcher, labelled with labels
+  virtual void addMetrics(
+      watchman::MetricsWriter& metrics,
+      const watchman::MetricsWriter::Labels& labels) const;
+
+  // Describes stats and the watch usage, for debug-watcher-info
+  json_ref getStatsJson() const;
+
+  // Counts a batch of events retrieved from the system
+  void recordBatch(size_t events, size_t bytes = 0) {
+    ++stats.batches;
+    stats.events += events;
+    stats.bytesRead += bytes;
+  }
 };
 
 /** Maintains the list of available watchers.
@@ -82,6 +159,9 @@ class WatcherRegistry {
     return name_;
   }
 
+  /** Returns the names of the watchers, in no particular order */
+  static std::vector<std::string> getWatcherNames();
+
  private:
   std::string name_;
   std::function<std::shared_ptr<watchman::QueryableView>(w_root_t*)> init_;
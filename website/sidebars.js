@@ -29,7 +29,9 @@ module.exports = {
       'list-capabilities',
       'log',
       'log-level',
+      'multi-query',
       'query',
+      'save-state',
       'shutdown-server',
       'since',
       'state-enter',